@@ -0,0 +1,26 @@
+#include "common_kokkos.h"
+#include "mpiHelper.h"
+#include <benchmark/benchmark.h>
+
+/** Driver of the benchmarks of the main kernels of Phoebe.
+ * The benchmarks read the input files of the tests, and must be run from the
+ * build directory, as the tests.
+ * Use e.g. --benchmark_format=json or --benchmark_out=bench.json to get a
+ * machine-readable output, and --benchmark_filter=<regex> to select some of
+ * the benchmarks.
+ */
+int main(int argc, char **argv) {
+  initMPI(argc, argv);
+  initKokkos(argc, argv);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  deleteKokkos();
+  mpi->finalize();
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef BENCH_UTILS_H
+#define BENCH_UTILS_H
+
+#include "common_kokkos.h"
+#include "eigen.h"
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <random>
+#include <string>
+
+// checks that the input files of a benchmark are present. If not, the
+// benchmark is skipped with a message (returns false)
+inline bool hasBenchFiles(benchmark::State &state,
+                          const std::vector<std::string> &fileNames) {
+  for (const auto &fileName : fileNames) {
+    std::ifstream f(fileName);
+    if (!f.good()) {
+      state.SkipWithError(("missing input file " + fileName).c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// returns numPoints random wavevectors in cartesian coordinates, with a
+// fixed seed so that all runs benchmark the same points
+inline Eigen::MatrixXd randomWavevectors(const int &numPoints,
+                                         const Eigen::Matrix3d &reciprocalCell) {
+  std::mt19937 generator(12345);
+  std::uniform_real_distribution<double> distribution(0., 1.);
+  Eigen::MatrixXd wavevectors(numPoints, 3);
+  for (int i = 0; i < numPoints; i++) {
+    Eigen::Vector3d crystal;
+    for (int j = 0; j < 3; j++) {
+      crystal(j) = distribution(generator);
+    }
+    wavevectors.row(i) = reciprocalCell * crystal;
+  }
+  return wavevectors;
+}
+
+// copies a list of wavevectors (numPoints,3) to the Kokkos device
+inline DoubleView2D wavevectorsToDevice(const Eigen::MatrixXd &wavevectors) {
+  int numPoints = int(wavevectors.rows());
+  DoubleView2D wavevectors_d("wavevectors", numPoints, 3);
+  auto wavevectors_h = Kokkos::create_mirror_view(wavevectors_d);
+  for (int i = 0; i < numPoints; i++) {
+    for (int j = 0; j < 3; j++) {
+      wavevectors_h(i, j) = wavevectors(i, j);
+    }
+  }
+  Kokkos::deep_copy(wavevectors_d, wavevectors_h);
+  return wavevectors_d;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include "benchUtils.h"
+#include "points.h"
+#include "qe_input_parser.h"
+
+/** Benchmarks of the batched diagonalization of the harmonic Hamiltonians,
+ * of kokkosZHEEV, and of the lookups of wavevectors in Points.
+ * The range argument is the number of wavevectors in the batch.
+ */
+
+namespace {
+// the Hamiltonians are parsed once, and shared by all the benchmarks
+struct SiliconPhonons {
+  Context context;
+  std::unique_ptr<Crystal> crystal;
+  std::unique_ptr<PhononH0> phononH0;
+  SiliconPhonons() {
+    context.setPhFC2FileName("../test/data/444_silicon.fc");
+    context.setSumRuleFC2("simple");
+    auto tup = QEParser::parsePhHarmonic(context);
+    crystal = std::make_unique<Crystal>(std::get<0>(tup));
+    phononH0 = std::make_unique<PhononH0>(std::get<1>(tup));
+  }
+};
+
+struct SiliconElectrons {
+  Context context;
+  std::unique_ptr<Crystal> crystal;
+  std::unique_ptr<ElectronH0Wannier> electronH0;
+  SiliconElectrons() {
+    context.setPhFC2FileName("../test/data/silicon.fc");
+    context.setElectronH0Name("../test/data/si_tb.dat");
+    auto tup = QEParser::parsePhHarmonic(context);
+    crystal = std::make_unique<Crystal>(std::get<0>(tup));
+    auto tup1 = QEParser::parseElHarmonicWannier(context, crystal.get());
+    electronH0 = std::make_unique<ElectronH0Wannier>(std::get<1>(tup1));
+  }
+};
+
+SiliconPhonons &getSiliconPhonons() {
+  static SiliconPhonons silicon;
+  return silicon;
+}
+
+SiliconElectrons &getSiliconElectrons() {
+  static SiliconElectrons silicon;
+  return silicon;
+}
+} // namespace
+
+static void BM_PhononH0BatchedDiagonalize(benchmark::State &state) {
+  if (!hasBenchFiles(state, {"../test/data/444_silicon.fc"})) return;
+  auto &silicon = getSiliconPhonons();
+  auto numPoints = int(state.range(0));
+  DoubleView2D wavevectors_d = wavevectorsToDevice(randomWavevectors(
+      numPoints, silicon.crystal->getReciprocalUnitCell()));
+  for (auto _ : state) {
+    auto t = silicon.phononH0->kokkosBatchedDiagonalizeFromCoordinates(
+        wavevectors_d);
+    Kokkos::fence();
+    benchmark::DoNotOptimize(std::get<0>(t).data());
+  }
+  state.SetItemsProcessed(state.iterations() * numPoints);
+}
+BENCHMARK(BM_PhononH0BatchedDiagonalize)->RangeMultiplier(4)->Range(64, 4096);
+
+static void BM_ElectronH0BatchedDiagonalize(benchmark::State &state) {
+  if (!hasBenchFiles(state, {"../test/data/silicon.fc",
+                             "../test/data/si_tb.dat"})) return;
+  auto &silicon = getSiliconElectrons();
+  auto numPoints = int(state.range(0));
+  DoubleView2D wavevectors_d = wavevectorsToDevice(randomWavevectors(
+      numPoints, silicon.crystal->getReciprocalUnitCell()));
+  for (auto _ : state) {
+    auto t = silicon.electronH0->kokkosBatchedDiagonalizeWithVelocities(
+        wavevectors_d);
+    Kokkos::fence();
+    benchmark::DoNotOptimize(std::get<0>(t).data());
+  }
+  state.SetItemsProcessed(state.iterations() * numPoints);
+}
+BENCHMARK(BM_ElectronH0BatchedDiagonalize)->RangeMultiplier(4)->Range(64, 4096);
+
+// batched diagonalization of random hermitian matrices, the arguments are
+// the number of matrices and their size
+static void BM_KokkosZHEEV(benchmark::State &state) {
+  auto numMatrices = int(state.range(0));
+  auto matrixSize = int(state.range(1));
+
+  std::mt19937 generator(12345);
+  std::uniform_real_distribution<double> distribution(-1., 1.);
+  ComplexView3D matrices("matrices", numMatrices, matrixSize, matrixSize);
+  auto matrices_h = Kokkos::create_mirror_view(matrices);
+  for (int i = 0; i < numMatrices; i++) {
+    for (int j = 0; j < matrixSize; j++) {
+      matrices_h(i, j, j) = distribution(generator);
+      for (int k = j + 1; k < matrixSize; k++) {
+        Kokkos::complex<double> x(distribution(generator),
+                                  distribution(generator));
+        matrices_h(i, j, k) = x;
+        matrices_h(i, k, j) = Kokkos::conj(x);
+      }
+    }
+  }
+  ComplexView3D work("work", numMatrices, matrixSize, matrixSize);
+  DoubleView2D eigenvalues("eigenvalues", numMatrices, matrixSize);
+
+  for (auto _ : state) {
+    // the matrices are overwritten by the eigenvectors
+    state.PauseTiming();
+    Kokkos::deep_copy(work, matrices_h);
+    state.ResumeTiming();
+    StridedComplexView3D workStrided = work;
+    kokkosZHEEV(workStrided, eigenvalues);
+    Kokkos::fence();
+  }
+  state.SetItemsProcessed(state.iterations() * numMatrices);
+}
+BENCHMARK(BM_KokkosZHEEV)
+    ->Args({1024, 6})
+    ->Args({1024, 18})
+    ->Args({256, 48})
+    ->Args({64, 96});
+
+// lookups of the index of a wavevector and of its irreducible point
+static void BM_PointsLookup(benchmark::State &state) {
+  if (!hasBenchFiles(state, {"../test/data/444_silicon.fc"})) return;
+  auto &silicon = getSiliconPhonons();
+  auto meshSize = int(state.range(0));
+  Eigen::Vector3i mesh;
+  mesh << meshSize, meshSize, meshSize;
+  Points points(*silicon.crystal, mesh);
+  points.setIrreduciblePoints();
+  int numPoints = points.getNumPoints();
+  for (auto _ : state) {
+    int sum = 0;
+    for (int ik = 0; ik < numPoints; ik++) {
+      Eigen::Vector3d k =
+          points.getPointCoordinates(ik, Points::crystalCoordinates);
+      sum += points.getIndex(k);
+      Eigen::Vector3d kC = points.crystalToCartesian(k);
+      sum += std::get<0>(points.getRotationToIrreducible(kC));
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * numPoints);
+}
+BENCHMARK(BM_PointsLookup)->Arg(8)->Arg(16)->Arg(32);
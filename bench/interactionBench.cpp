@@ -0,0 +1,111 @@
+#include "benchUtils.h"
+#include "ifc3_parser.h"
+#include "interaction_elph.h"
+#include "qe_input_parser.h"
+
+/** Benchmarks of the 3-phonon and electron-phonon coupling kernels.
+ * The range argument is the number of wavevectors processed with one fixed
+ * wavevector (q2 for the 3-phonon coupling, k1 for the el-ph coupling),
+ * as in the loops of the scattering matrix builders.
+ */
+
+static void BM_Interaction3PhCouplingsSquared(benchmark::State &state) {
+  if (!hasBenchFiles(state, {"../test/data/444_silicon.fc",
+                             "../test/data/FORCE_CONSTANTS_3RD"})) return;
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setPhFC3FileName("../test/data/FORCE_CONSTANTS_3RD");
+  context.setSumRuleFC2("simple");
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto phononH0 = std::get<1>(tup);
+  auto coupling3Ph = IFC3Parser::parse(context, crystal);
+
+  auto numPoints = int(state.range(0));
+  Eigen::MatrixXd qs =
+      randomWavevectors(numPoints + 1, crystal.getReciprocalUnitCell());
+
+  Eigen::Vector3d q2 = qs.row(numPoints);
+  auto tup2 = phononH0.diagonalizeFromCoordinates(q2);
+  Eigen::MatrixXcd ev2 = std::get<1>(tup2);
+  int nb2 = int(std::get<0>(tup2).size());
+
+  std::vector<Eigen::Vector3d> q1s(numPoints);
+  std::vector<Eigen::MatrixXcd> ev1s(numPoints), ev3Pluss(numPoints),
+      ev3Minss(numPoints);
+  std::vector<int> nb1s(numPoints), nb3Pluss(numPoints), nb3Minss(numPoints);
+  for (int i = 0; i < numPoints; i++) {
+    q1s[i] = qs.row(i);
+    auto tup1 = phononH0.diagonalizeFromCoordinates(q1s[i]);
+    ev1s[i] = std::get<1>(tup1);
+    nb1s[i] = int(std::get<0>(tup1).size());
+    Eigen::Vector3d q3Plus = q1s[i] + q2;
+    auto tup3 = phononH0.diagonalizeFromCoordinates(q3Plus);
+    ev3Pluss[i] = std::get<1>(tup3);
+    nb3Pluss[i] = int(std::get<0>(tup3).size());
+    Eigen::Vector3d q3Mins = q1s[i] - q2;
+    tup3 = phononH0.diagonalizeFromCoordinates(q3Mins);
+    ev3Minss[i] = std::get<1>(tup3);
+    nb3Minss[i] = int(std::get<0>(tup3).size());
+  }
+
+  for (auto _ : state) {
+    coupling3Ph.cacheD3(q2);
+    auto tup4 = coupling3Ph.getCouplingsSquared(q1s, q2, ev1s, ev2, ev3Pluss,
+                                                ev3Minss, nb1s, nb2, nb3Pluss,
+                                                nb3Minss);
+    benchmark::DoNotOptimize(std::get<0>(tup4).data());
+  }
+  state.SetItemsProcessed(state.iterations() * numPoints);
+}
+BENCHMARK(BM_Interaction3PhCouplingsSquared)
+    ->RangeMultiplier(4)
+    ->Range(16, 1024)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_InteractionElPhCouplingSquared(benchmark::State &state) {
+  if (!hasBenchFiles(state, {"../test/data/silicon.fc",
+                             "../test/data/si_tb.dat",
+                             "../test/data/silicon.phoebe.elph.hdf5"})) return;
+  Context context;
+  context.setPhFC2FileName("../test/data/silicon.fc");
+  context.setElectronH0Name("../test/data/si_tb.dat");
+  context.setElphFileName("../test/data/silicon.phoebe.elph.hdf5");
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto phononH0 = std::get<1>(tup);
+  auto tup1 = QEParser::parseElHarmonicWannier(context, &crystal);
+  auto electronH0 = std::get<1>(tup1);
+  auto couplingElPh = InteractionElPhWan::parse(context, crystal, &phononH0);
+
+  auto numPoints = int(state.range(0));
+  Eigen::MatrixXd ks =
+      randomWavevectors(numPoints + 1, crystal.getReciprocalUnitCell());
+
+  Eigen::Vector3d k1C = ks.row(numPoints);
+  Eigen::MatrixXcd eigvec1 =
+      std::get<1>(electronH0.diagonalizeFromCoordinates(k1C));
+
+  std::vector<Eigen::MatrixXcd> eigvecs2(numPoints), eigvecs3(numPoints);
+  std::vector<Eigen::Vector3d> q3Cs(numPoints);
+  for (int i = 0; i < numPoints; i++) {
+    Eigen::Vector3d k2C = ks.row(i);
+    eigvecs2[i] = std::get<1>(electronH0.diagonalizeFromCoordinates(k2C));
+    q3Cs[i] = k2C - k1C;
+    eigvecs3[i] = std::get<1>(phononH0.diagonalizeFromCoordinates(q3Cs[i]));
+  }
+  // an empty list of polar data lets the polar correction run on device
+  std::vector<Eigen::VectorXcd> polarData;
+
+  for (auto _ : state) {
+    couplingElPh.cacheElPh(eigvec1, k1C);
+    couplingElPh.calcCouplingSquared(eigvec1, eigvecs2, eigvecs3, q3Cs,
+                                     polarData);
+    benchmark::DoNotOptimize(couplingElPh.getCouplingSquared(0).data());
+  }
+  state.SetItemsProcessed(state.iterations() * numPoints);
+}
+BENCHMARK(BM_InteractionElPhCouplingSquared)
+    ->RangeMultiplier(4)
+    ->Range(16, 1024)
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,62 @@
+#include "active_bandstructure.h"
+#include "benchUtils.h"
+#include "constants.h"
+#include "delta_function.h"
+#include "ifc3_parser.h"
+#include "ph_scattering.h"
+#include "points.h"
+#include "qe_input_parser.h"
+
+/** Benchmark of the product of the phonon scattering matrix, stored in
+ * memory, with a vector of populations. The range argument is the size of
+ * the q-point mesh along each direction.
+ */
+
+static void BM_ScatteringMatrixDot(benchmark::State &state) {
+  if (!hasBenchFiles(state, {"../test/data/444_silicon.fc",
+                             "../test/data/FORCE_CONSTANTS_3RD"})) return;
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setPhFC3FileName("../test/data/FORCE_CONSTANTS_3RD");
+  context.setSumRuleFC2("simple");
+  context.setUseSymmetries(true);
+  context.setScatteringMatrixInMemory(true);
+  context.setSmearingMethod(DeltaFunction::adaptiveGaussian);
+
+  auto meshSize = int(state.range(0));
+  Eigen::Vector3i qMesh;
+  qMesh << meshSize, meshSize, meshSize;
+  context.setQMesh(qMesh);
+  Eigen::VectorXd temperatures(1);
+  temperatures << 300. / temperatureAuToSi;
+  context.setTemperatures(temperatures);
+
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto phononH0 = std::get<1>(tup);
+  auto coupling3Ph = IFC3Parser::parse(context, crystal);
+
+  Points points(crystal, qMesh);
+  auto tup1 = ActiveBandStructure::builder(context, phononH0, points);
+  auto bandStructure = std::get<0>(tup1);
+  auto statisticsSweep = std::get<1>(tup1);
+
+  PhScatteringMatrix scatteringMatrix(context, statisticsSweep, bandStructure,
+                                      bandStructure, &coupling3Ph, &phononH0);
+  scatteringMatrix.setup();
+
+  VectorBTE population(statisticsSweep, bandStructure, 3);
+  population.setConst(1.);
+
+  for (auto _ : state) {
+    VectorBTE outPopulation = scatteringMatrix.dot(population);
+    benchmark::DoNotOptimize(outPopulation.data.data());
+  }
+  state.SetItemsProcessed(state.iterations() *
+                          bandStructure.getNumStates());
+}
+BENCHMARK(BM_ScatteringMatrixDot)
+    ->Arg(4)
+    ->Arg(6)
+    ->Arg(8)
+    ->Unit(benchmark::kMillisecond);
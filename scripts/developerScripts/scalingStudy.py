@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Scaling study of the scattering matrix builder.
+
+Runs a phononTransport or electronWannierTransport input in dryRun mode for
+a grid of MPI processes, pool sizes, OpenMP threads and device memory limits
+(MAXMEM, which sets the size of the batches sent to the GPU), and collects
+the performance_report.json written by each run.
+In a dry run, each process computes a few wavevector pairs of the builder,
+so that the sampled workload per process is the same in every run, while
+the time to build the full matrix is extrapolated.
+
+For each run, the script reports:
+* the strong-scaling efficiency, from the extrapolated time of the builder;
+* the weak-scaling efficiency, from the time of the sampled workload;
+* the fraction of the time spent in MPI communications;
+* the peak device memory, as a fraction of the memory limit.
+The strong-scaling efficiency is relative to the run with the fewest cores
+(processes x threads), the weak-scaling one to the run with the fewest
+processes and the same threads and memory limit.
+
+Example (run in the directory of the input file):
+  python3 scalingStudy.py -in phononTransport.in -e ../../build/phoebe \\
+      --ranks 1 2 4 --poolSizes 1 2 --threads 1 4 --maxmem 4 16
+"""
+import argparse
+import itertools
+import json
+import os
+import shutil
+import subprocess
+import sys
+
+reportFileName = "performance_report.json"
+builderRegion = "computing scattering matrix"
+mpiRegion = "MPI communication"
+
+
+def getRegion(report, name):
+    for region in report["regions"]:
+        if region["name"] == name:
+            return region
+    return None
+
+
+def runPhoebe(args, inputFileName, numRanks, poolSize, numThreads, maxmem):
+    env = os.environ.copy()
+    env["OMP_NUM_THREADS"] = str(numThreads)
+    if maxmem is not None:
+        env["MAXMEM"] = str(maxmem)
+    command = []
+    if args.mpirun != "":
+        command += args.mpirun.split() + [str(numRanks)]
+    command += [args.executable, "-in", inputFileName]
+    if poolSize > 1:
+        command += ["-ps", str(poolSize)]
+
+    tag = "np{}_ps{}_nt{}".format(numRanks, poolSize, numThreads)
+    if maxmem is not None:
+        tag += "_mem{}".format(maxmem)
+    print("Running: " + " ".join(command), flush=True)
+    if os.path.exists(reportFileName):
+        os.remove(reportFileName)
+    with open("scaling_" + tag + ".out", "w") as out:
+        process = subprocess.run(command, env=env, stdout=out,
+                                 stderr=subprocess.STDOUT)
+    if process.returncode != 0 or not os.path.exists(reportFileName):
+        print("  failed, see scaling_" + tag + ".out")
+        return None
+    # keep the report of each run
+    shutil.move(reportFileName, "scaling_" + tag + ".json")
+    with open("scaling_" + tag + ".json") as f:
+        report = json.load(f)
+
+    result = {"numRanks": numRanks, "poolSize": poolSize,
+              "numThreads": numThreads, "maxmem": maxmem,
+              "wallTime": report["wallTime"]}
+    values = report.get("values", {})
+    if "dryRunBuilderTime" in values:
+        result["builderTime"] = values["dryRunBuilderTime"]
+    region = getRegion(report, builderRegion)
+    if region is not None:
+        result["sampleTime"] = region["maxTime"]
+    region = getRegion(report, mpiRegion)
+    if region is not None and report["wallTime"] > 0.:
+        result["communicationFraction"] = \
+            region["averageTime"] / report["wallTime"]
+    if "peakDeviceMemory" in report and report["deviceMemory"] > 0.:
+        result["deviceMemoryFraction"] = \
+            report["peakDeviceMemory"] / report["deviceMemory"]
+    return result
+
+
+def addEfficiencies(results):
+    # the reference is the run with the fewest cores
+    reference = min(results, key=lambda r: r["numRanks"] * r["numThreads"])
+    refCores = reference["numRanks"] * reference["numThreads"]
+    for r in results:
+        cores = r["numRanks"] * r["numThreads"]
+        if "builderTime" in reference and r.get("builderTime", 0.) > 0.:
+            r["strongEfficiency"] = reference["builderTime"] * refCores \
+                / (r["builderTime"] * cores)
+        # each process samples the same number of pairs, so that the sampled
+        # workload grows with the number of processes. We compare with the
+        # run with the fewest processes and otherwise the same settings
+        sameSettings = [s for s in results
+                        if s["numThreads"] == r["numThreads"]
+                        and s["maxmem"] == r["maxmem"] and "sampleTime" in s]
+        if len(sameSettings) > 0 and r.get("sampleTime", 0.) > 0.:
+            weakReference = min(sameSettings, key=lambda s: s["numRanks"])
+            r["weakEfficiency"] = weakReference["sampleTime"] / r["sampleTime"]
+
+
+def printTable(results):
+    columns = [("numRanks", "ranks", "{:d}"), ("poolSize", "pool", "{:d}"),
+               ("numThreads", "threads", "{:d}"), ("maxmem", "maxmem", "{}"),
+               ("builderTime", "builder[s]", "{:.4g}"),
+               ("strongEfficiency", "strongEff", "{:.3f}"),
+               ("weakEfficiency", "weakEff", "{:.3f}"),
+               ("communicationFraction", "comm", "{:.3f}"),
+               ("deviceMemoryFraction", "devMem", "{:.3f}")]
+    print("".join("{:>12}".format(c[1]) for c in columns))
+    for r in results:
+        line = ""
+        for key, _, fmt in columns:
+            value = r.get(key)
+            line += "{:>12}".format("-" if value is None else fmt.format(value))
+        print(line)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Scaling study of the scattering matrix builder, "
+                    "using the dryRun mode of the transport apps.")
+    parser.add_argument("-in", "--input", required=True,
+                        help="Phoebe input file of a transport app")
+    parser.add_argument("-e", "--executable", default="phoebe",
+                        help="path to the phoebe executable")
+    parser.add_argument("--mpirun", default="mpirun -np",
+                        help="command to launch MPI, followed by the number "
+                             "of processes (empty for a serial build)")
+    parser.add_argument("--ranks", type=int, nargs="+", default=[1],
+                        help="numbers of MPI processes")
+    parser.add_argument("--poolSizes", type=int, nargs="+", default=[1],
+                        help="pool sizes (-ps)")
+    parser.add_argument("--threads", type=int, nargs="+", default=[1],
+                        help="numbers of OpenMP threads")
+    parser.add_argument("--maxmem", type=float, nargs="+", default=[None],
+                        help="device memory limits in GB (MAXMEM)")
+    parser.add_argument("-o", "--output", default="scaling_study.json",
+                        help="JSON file with the results")
+    args = parser.parse_args()
+
+    # a copy of the input, with the dry run switched on
+    with open(args.input) as f:
+        inputText = f.read()
+    inputFileName = "scaling_" + os.path.basename(args.input)
+    with open(inputFileName, "w") as f:
+        f.write(inputText + "\ndryRun = true\n")
+
+    results = []
+    for numRanks, poolSize, numThreads, maxmem in itertools.product(
+            args.ranks, args.poolSizes, args.threads, args.maxmem):
+        if numRanks % poolSize != 0:
+            continue
+        result = runPhoebe(args, inputFileName, numRanks, poolSize,
+                           numThreads, maxmem)
+        if result is not None:
+            results.append(result)
+    os.remove(inputFileName)
+
+    if len(results) == 0:
+        print("No successful runs.")
+        sys.exit(1)
+    addEfficiencies(results)
+    printTable(results)
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+    print("\nResults written to " + args.output)
@@ -6,9 +6,17 @@
  */
 
 #include <complex>
+#ifdef MPI_AVAIL
+#include <mpi.h>
+#endif
 
 extern "C" {
 
+#ifdef MPI_AVAIL
+// BLACS system context of a MPI communicator (C interface of BLACS)
+int Csys2blacs_handle(MPI_Comm);
+#endif
+
 void blacs_get_(int *, int *, int *);
 void blacs_pinfo_(int *, int *);
 void blacs_gridinit_(int *, char *, int *, int *);
@@ -17,6 +25,8 @@ void descinit_(int *, int *, int *, int *, int *, int *, int *, int *, int *,
                int *);
 void blacs_gridexit_(const int *);
 int numroc_(int *, int *, int *, int *, int *);
+void dgsum2d_(int *, char *, char *, int *, int *, double *, int *, int *,
+              int *);
 
 //void pdelset_(double *, int *, int *, int *, double *);
 //void pdelget_(char *, char *, double *, double *, const int *, const int *,
@@ -63,6 +73,10 @@ void pdsyevd_(char *, char *, int *, double *, int *, int *, int *, double *,
              double *, int *, int *, int *, double *, int *, int *, int *, int *);
 // take the transpose of a real matrix
 void pdtran_(int * m, int * n, double * alpha, double * a, int * ia, int * ja, int * desc_a, double * beta, double * c, int * ic, int * jc, int * desc_c);
+// copy a real matrix between two process grids, both within the context ictxt
+void pdgemr2d_(int * m, int * n, double * a, int * ia, int * ja, int * desc_a, double * b, int * ib, int * jb, int * desc_b, int * ictxt);
+// add two real matrices, C = beta * C + alpha * op(A)
+void pdgeadd_(const char * trans, int * m, int * n, double * alpha, double * a, int * ia, int * ja, int * desc_a, double * beta, double * c, int * ic, int * jc, int * desc_c);
 
 }
 
@@ -0,0 +1,76 @@
+#include "MappedBuffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+#include "mpiHelper.h"
+
+MappedBuffer::MappedBuffer(const std::string &directory,
+                           const size_t &numBytes) {
+  static std::atomic<int> counter(0);
+  fileName = directory + "/phoebe_scratch." + std::to_string(mpi->getRank())
+      + "." + std::to_string(counter++) + ".bin";
+  // at least one page, since empty mappings are not allowed
+  mapSize = std::max(numBytes, size_t(sysconf(_SC_PAGESIZE)));
+
+  int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    Error("Couldn't create the scratch file " + fileName);
+  }
+  // the file is sparse: disk blocks are only allocated when written
+  if (ftruncate(fd, off_t(mapSize)) != 0) {
+    close(fd);
+    unlink(fileName.c_str());
+    Error("Couldn't allocate " + std::to_string(mapSize)
+          + " bytes for the scratch file " + fileName);
+  }
+  map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid after closing the file
+  if (map == MAP_FAILED) {
+    map = nullptr;
+    unlink(fileName.c_str());
+    Error("Couldn't memory-map the scratch file " + fileName);
+  }
+}
+
+MappedBuffer::~MappedBuffer() {
+  if (map != nullptr) {
+    munmap(map, mapSize);
+  }
+  unlink(fileName.c_str());
+}
+
+void *MappedBuffer::data() { return map; }
+
+void MappedBuffer::pageRange(const size_t &offset, const size_t &numBytes,
+                             char *&start, size_t &length) {
+  auto pageSize = size_t(sysconf(_SC_PAGESIZE));
+  size_t begin = std::min(offset, mapSize) / pageSize * pageSize;
+  size_t end = std::min(offset + numBytes, mapSize);
+  start = (char *)map + begin;
+  length = end > begin ? end - begin : 0;
+}
+
+void MappedBuffer::prefetch(const size_t &offset, const size_t &numBytes) {
+  char *start;
+  size_t length;
+  pageRange(offset, numBytes, start, length);
+  if (length > 0) {
+    madvise(start, length, MADV_WILLNEED);
+  }
+}
+
+void MappedBuffer::release(const size_t &offset, const size_t &numBytes) {
+  char *start;
+  size_t length;
+  pageRange(offset, numBytes, start, length);
+  if (length > 0) {
+    // for a shared file mapping, the pages are dropped from the address
+    // space but their content is kept, and written back to the file
+    madvise(start, length, MADV_DONTNEED);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef MAPPED_BUFFER_H
+#define MAPPED_BUFFER_H
+
+#include <cstddef>
+#include <string>
+
+/** A buffer stored in a scratch file, memory-mapped into the address space.
+ *
+ * Used to keep out of core the local block of very large matrices (such as
+ * the scattering matrix), when it doesn't fit in memory: the OS pages the
+ * file in and out, so that the buffer can be used as if it were in memory.
+ * Reading it in order, with prefetch() on the next tile and release() on
+ * the tiles already used, lets the disk reads overlap with computations.
+ * The scratch file is deleted when the buffer is destroyed.
+ */
+class MappedBuffer {
+public:
+  /** Creates a scratch file of numBytes bytes in directory, and maps it.
+   * The file name is unique to the MPI process and to the buffer.
+   */
+  MappedBuffer(const std::string &directory, const size_t &numBytes);
+
+  /** Unmaps and deletes the scratch file.
+   */
+  ~MappedBuffer();
+
+  MappedBuffer(const MappedBuffer &that) = delete;
+  MappedBuffer &operator=(const MappedBuffer &that) = delete;
+
+  /** Pointer to the mapped memory.
+   */
+  void *data();
+
+  /** Asks the OS to start reading asynchronously the bytes in
+   * [offset, offset+numBytes) from disk.
+   */
+  void prefetch(const size_t &offset, const size_t &numBytes);
+
+  /** Tells the OS that the bytes in [offset, offset+numBytes) won't be used
+   * soon, so that their pages can be written back and evicted first.
+   */
+  void release(const size_t &offset, const size_t &numBytes);
+
+private:
+  std::string fileName;
+  void *map = nullptr;
+  size_t mapSize = 0;
+
+  // the page-aligned range containing [offset, offset+numBytes)
+  void pageRange(const size_t &offset, const size_t &numBytes,
+                 char *&start, size_t &length);
+};
+
+#endif
@@ -74,6 +74,12 @@ class Matrix {
    */
   std::vector<std::tuple<int, int>> getAllLocalStates();
 
+  /** Loops over the tiles of the matrix stored by the current MPI process,
+   * see ParallelMatrix::forEachLocalTile().
+   */
+  template <typename F>
+  void forEachLocalTile(F f);
+
   /** Returns true if the global indices (row,col) identify a matrix element
    * stored by the MPI process.
    */
@@ -330,6 +336,13 @@ std::vector<std::tuple<int, int>> Matrix<T>::getAllLocalStates() {
   else{ return mat->getAllLocalStates(); }
 }
 
+template <typename T>
+template <typename F>
+void Matrix<T>::forEachLocalTile(F f) {
+  if(isDistributed) pmat->forEachLocalTile(f);
+  else{ mat->forEachLocalTile(f); }
+}
+
 /* ------------- basic linear algebra ops -------------- */
 // General unary negation
 template <typename T>
@@ -4,9 +4,25 @@
 
 #include "Blacs.h"
 #include "constants.h"
+#include "io.h"
 #include "mpiHelper.h"
 #include "utilities.h"
 
+#ifdef ELPA_AVAIL
+#include <elpa/elpa.h>
+#endif
+
+// Registers with the profiler a rough estimate of the work of a full
+// diagonalization of a symmetric matrix of size n, i.e. the reduction to
+// tridiagonal form (4/3 n^3), the tridiagonal eigensolver (~4/3 n^3) and
+// the back-transformation of the eigenvectors (2 n^3), shared evenly by the
+// processes. The memory traffic is that of the matrix and the eigenvectors.
+static void addDiagonalizationWork(const int &n) {
+  double n2 = double(n) * n;
+  Profiler::addWork(14. / 3. * n2 * n / mpi->getSize(),
+                    2. * 8. * n2 / mpi->getSize());
+}
+
 template <>
 ParallelMatrix<double> ParallelMatrix<double>::prod(
     const ParallelMatrix<double>& that, const char& trans1,
@@ -45,9 +61,196 @@ ParallelMatrix<double> ParallelMatrix<double>::prod(
   double alpha = 1.;
   double beta = 0.;
   int one = 1;
+  Kokkos::Profiling::pushRegion("pdgemm");
   pdgemm_(&trans1, &trans2, &m, &n, &k, &alpha, mat, &one, &one, &descMat_[0],
           that.mat, &one, &one, &that.descMat_[0], &beta, result.mat, &one,
           &one, &result.descMat_[0]);
+  // estimate of the work, shared evenly by the processes
+  Profiler::addWork(2. * m * n * k / mpi->getSize(),
+                    8. * (double(m) * k + double(k) * n + double(m) * n) /
+                        mpi->getSize());
+  Kokkos::Profiling::popRegion();
+  return result;
+}
+
+template <>
+Eigen::MatrixXd ParallelMatrix<double>::projectOnColumns(
+    const Eigen::MatrixXd& x, const Eigen::VectorXd& weights) const {
+
+  int numProjections = int(weights.size());
+  if (x.rows() != numRows_ || numProjections > numCols_) {
+    Error("Projection on matrix columns with inconsistent sizes.");
+  }
+  int numVectors = int(x.cols());
+  if (numProjections == 0 || numVectors == 0) {
+    return Eigen::MatrixXd::Zero(x.rows(), x.cols());
+  }
+  ParallelMatrix<double> xDist = distributeRows(x);
+
+  // projections of x on the columns, distributed like x
+  ParallelMatrix<double> projections(numProjections, numVectors, 0, 0,
+                                     numBlocksCols_, numBlasCols_,
+                                     blacsContext_);
+  int numRows = numRows_;
+  char transA = 'T';
+  char transB = 'N';
+  double alpha = 1.;
+  double beta = 0.;
+  int one = 1;
+  // only the first numProjections columns are used, as the others may
+  // not have been computed by a partial diagonalization
+  pdgemm_(&transA, &transB, &numProjections, &numVectors, &numRows, &alpha,
+          mat, &one, &one, &descMat_[0], xDist.mat, &one, &one,
+          &xDist.descMat_[0], &beta, projections.mat, &one, &one,
+          &projections.descMat_[0]);
+
+  for (int k = 0; k < projections.numLocalElements_; k++) {
+    int i = std::get<0>(projections.local2Global(k));
+    projections.mat[k] *= weights(i);
+  }
+
+  // back-rotate, the result is distributed like x
+  transA = 'N';
+  pdgemm_(&transA, &transB, &numRows, &numVectors, &numProjections, &alpha,
+          mat, &one, &one, &descMat_[0], projections.mat, &one, &one,
+          &projections.descMat_[0], &beta, xDist.mat, &one, &one,
+          &xDist.descMat_[0]);
+  return xDist.replicate();
+}
+
+template <>
+Eigen::MatrixXd ParallelMatrix<double>::projectColumns(
+    const Eigen::MatrixXd& x, const int& numProjections) const {
+
+  if (x.rows() != numRows_ || numProjections > numCols_) {
+    Error("Projection on matrix columns with inconsistent sizes.");
+  }
+  int numVectors = int(x.cols());
+  if (numProjections == 0 || numVectors == 0) {
+    return Eigen::MatrixXd::Zero(numProjections, numVectors);
+  }
+  ParallelMatrix<double> xDist = distributeRows(x);
+
+  ParallelMatrix<double> projections(numProjections, numVectors, 0, 0,
+                                     numBlocksCols_, numBlasCols_,
+                                     blacsContext_);
+  int numRows = numRows_;
+  int numProj = numProjections;
+  char transA = 'T';
+  char transB = 'N';
+  double alpha = 1.;
+  double beta = 0.;
+  int one = 1;
+  pdgemm_(&transA, &transB, &numProj, &numVectors, &numRows, &alpha,
+          mat, &one, &one, &descMat_[0], xDist.mat, &one, &one,
+          &xDist.descMat_[0], &beta, projections.mat, &one, &one,
+          &projections.descMat_[0]);
+  return projections.replicate();
+}
+
+template <>
+Eigen::MatrixXd ParallelMatrix<double>::combineColumns(
+    const Eigen::MatrixXd& c) const {
+
+  int numProjections = int(c.rows());
+  if (numProjections > numCols_) {
+    Error("Combination of matrix columns with inconsistent sizes.");
+  }
+  int numVectors = int(c.cols());
+  if (numProjections == 0 || numVectors == 0) {
+    return Eigen::MatrixXd::Zero(numRows_, numVectors);
+  }
+
+  // distribute c like the projections computed in projectColumns
+  ParallelMatrix<double> cDist(numProjections, numVectors, 0, 0,
+                               numBlocksCols_, numBlasCols_, blacsContext_);
+  for (int k = 0; k < cDist.numLocalElements_; k++) {
+    auto [i, j] = cDist.local2Global(k);
+    cDist.mat[k] = c(i, j);
+  }
+  ParallelMatrix<double> yDist = distributeRows(
+      Eigen::MatrixXd::Zero(numRows_, numVectors));
+
+  int numRows = numRows_;
+  char transA = 'N';
+  char transB = 'N';
+  double alpha = 1.;
+  double beta = 0.;
+  int one = 1;
+  pdgemm_(&transA, &transB, &numRows, &numVectors, &numProjections, &alpha,
+          mat, &one, &one, &descMat_[0], cDist.mat, &one, &one,
+          &cDist.descMat_[0], &beta, yDist.mat, &one, &one,
+          &yDist.descMat_[0]);
+  return yDist.replicate();
+}
+
+template <>
+Eigen::MatrixXd ParallelMatrix<double>::gatherLocalRows(
+    const Eigen::MatrixXd& y) const {
+
+  int numVectors = int(y.cols());
+  bool isInGrid = myBlasRow_ >= 0 && myBlasRow_ < numBlasRows_;
+  if (isInGrid && y.rows() != numLocalRows_) {
+    Error("Gathering local rows with inconsistent sizes.");
+  }
+
+  // sum the partial results over the processes of the same grid row,
+  // all of which receive the result
+  Eigen::MatrixXd ySum = y;
+  if (isInGrid && numLocalRows_ > 0 && numVectors > 0 && numBlasCols_ > 1) {
+    char scope = 'R';
+    char topology = ' ';
+    int numLocalRows = numLocalRows_;
+    int lda = numLocalRows_;
+    int allProcesses = -1;
+    int blacsContext = blacsContext_;
+    dgsum2d_(&blacsContext, &scope, &topology, &numLocalRows, &numVectors,
+             ySum.data(), &lda, &allProcesses, &allProcesses);
+  }
+
+  // then the first process of each grid row sends its rows to all others
+  bool isSender = isInGrid && myBlasCol_ == 0;
+  int sendCount = isSender ? numLocalRows_ * numVectors : 0;
+  int gridRow = isSender ? myBlasRow_ : -1;
+  int size = mpi->getSize();
+  std::vector<int> counts(size), gridRows(size);
+  MPI_Allgather(&sendCount, 1, MPI_INT, counts.data(), 1, MPI_INT,
+                mpi->getComm());
+  MPI_Allgather(&gridRow, 1, MPI_INT, gridRows.data(), 1, MPI_INT,
+                mpi->getComm());
+  std::vector<int> displacements(size, 0);
+  for (int i = 1; i < size; i++) {
+    displacements[i] = displacements[i - 1] + counts[i - 1];
+  }
+  std::vector<double> buffer(displacements[size - 1] + counts[size - 1]);
+  int errCode = MPI_Allgatherv(ySum.data(), sendCount, MPI_DOUBLE,
+                               buffer.data(), counts.data(),
+                               displacements.data(), MPI_DOUBLE,
+                               mpi->getComm());
+  if (errCode != MPI_SUCCESS) {
+    mpi->errorReport(errCode);
+  }
+
+  // each chunk is the column-major local block of one grid row
+  Eigen::MatrixXd result = Eigen::MatrixXd::Zero(numRows_, numVectors);
+  int iZero = 0;
+  int numRows = numRows_;
+  int blockSizeRows = blockSizeRows_;
+  int numBlasRows = numBlasRows_;
+  for (int i = 0; i < size; i++) {
+    if (counts[i] == 0) continue;
+    int p = gridRows[i];
+    int numRowsOfP = counts[i] / numVectors;
+    assert(numRowsOfP == numroc_(&numRows, &blockSizeRows, &p, &iZero,
+                                 &numBlasRows));
+    Eigen::Map<Eigen::MatrixXd> chunk(buffer.data() + displacements[i],
+                                      numRowsOfP, numVectors);
+    // note: indxl2g_ uses fortran indices, running from 1 to N
+    for (int k = 1; k <= numRowsOfP; k++) {
+      int iRow = indxl2g_(&k, &blockSizeRows, &p, &iZero, &numBlasRows) - 1;
+      result.row(iRow) = chunk.row(k - 1);
+    }
+  }
   return result;
 }
 
@@ -88,12 +291,88 @@ ParallelMatrix<std::complex<double>> ParallelMatrix<std::complex<double>>::prod(
   std::complex<double> alpha = complexOne;
   std::complex<double> beta = complexZero;
   int one = 1;
+  Kokkos::Profiling::pushRegion("pzgemm");
   pzgemm_(&trans1, &trans2, &m, &n, &k, &alpha, mat, &one, &one, &descMat_[0],
           that.mat, &one, &one, &that.descMat_[0], &beta, result.mat, &one,
           &one, &result.descMat_[0]);
+  // a complex multiply-add counts as 8 real operations
+  Profiler::addWork(8. * m * n * k / mpi->getSize(),
+                    16. * (double(m) * k + double(k) * n + double(m) * n) /
+                        mpi->getSize());
+  Kokkos::Profiling::popRegion();
   return result;
 }
 
+#ifdef ELPA_AVAIL
+template <>
+bool ParallelMatrix<double>::diagonalizeWithElpa(
+    double* eigenvalues, ParallelMatrix<double>& eigenvectors) {
+
+  // ELPA takes the same block-cyclic layout as scalapack, but only with
+  // square blocks, and every process of the communicator must sit on the grid
+  if (blockSizeRows_ != blockSizeCols_ ||
+      eigenvectors.blockSizeRows_ != blockSizeRows_ ||
+      numBlasRows_ * numBlasCols_ != mpi->getSize()) {
+    return false;
+  }
+
+  if (elpa_init(ELPA_API_VERSION) != ELPA_OK) {
+    Error("ELPA API version not supported.");
+  }
+  int error = 0;
+  elpa_t handle = elpa_allocate(&error);
+  if (error != ELPA_OK) {
+    Error("Failed to allocate the ELPA handle.", error);
+  }
+
+  // describe the scalapack distribution of the matrix to ELPA
+  elpa_set(handle, "na", numRows_, &error);
+  elpa_set(handle, "nev", numRows_, &error);
+  elpa_set(handle, "local_nrows", numLocalRows_, &error);
+  elpa_set(handle, "local_ncols", numLocalCols_, &error);
+  elpa_set(handle, "nblk", blockSizeRows_, &error);
+  elpa_set(handle, "mpi_comm_parent",
+           int(MPI_Comm_c2f(mpi->getComm())), &error);
+  elpa_set(handle, "process_row", myBlasRow_, &error);
+  elpa_set(handle, "process_col", myBlasCol_, &error);
+  if (elpa_setup(handle) != ELPA_OK) {
+    Error("Failed to set up the ELPA eigensolver.");
+  }
+
+  elpa_set(handle, "solver", ELPA_SOLVER_2STAGE, &error);
+#ifdef ELPA_GPU
+  elpa_set(handle, "gpu", 1, &error);
+#endif
+  if (error != ELPA_OK) {
+    Error("Failed to configure the ELPA eigensolver.", error);
+  }
+
+  if(mpi->mpiHead()) {
+     std::cout << "Starting matrix diagonalization with ELPA." << std::endl;
+     mpi->time();
+  }
+
+  Kokkos::Profiling::pushRegion("elpa_eigenvectors");
+  // like pdsyevd, this overwrites the matrix
+  elpa_eigenvectors(handle, mat, eigenvalues, eigenvectors.mat, &error);
+  addDiagonalizationWork(numRows_);
+  Kokkos::Profiling::popRegion();
+
+  if (error != ELPA_OK) {
+    Error("ELPA diagonalization failed.", error);
+  }
+
+  if(mpi->mpiHead()) {
+     std::cout << "Matrix diagonalization completed." << std::endl;
+     mpi->time();
+  }
+
+  elpa_deallocate(handle, &error);
+  elpa_uninit(&error);
+  return true;
+}
+#endif
+
 template <>
 std::tuple<std::vector<double>, ParallelMatrix<double>>
 ParallelMatrix<double>::diagonalize() {
@@ -101,79 +380,88 @@ ParallelMatrix<double>::diagonalize() {
   if (numRows_ != numCols_) {
     Error("Cannot diagonalize non-square matrix");
   }
-  if ( numBlasRows_ != numBlasCols_ ) {
-    Error("Cannot diagonalize via scalapack with a non-square process grid!");
+  // the scalapack eigensolvers work on any process grid, but need square blocks
+  if ( blockSizeRows_ != blockSizeCols_ ) {
+    Error("Cannot diagonalize via scalapack with non-square blocks!");
   }
 
   double *eigenvalues;
   allocate(eigenvalues, numRows_);
 
   // Make a new PMatrix to receive the output
-  // zeros here trigger a the default blacs process grid (a square one)
+  // zeros here trigger a the default blacs process grid (the most square one)
   ParallelMatrix<double> eigenvectors(numRows_,numCols_, 0, 0,
                               numBlocksRows_,numBlocksCols_, blacsContext_);
 
-  char jobz = 'V';  // also eigenvectors
-  char uplo = 'U';  // upper triangular
-  int ia = 1;       // row index from which we diagonalize
-  int ja = 1;       // row index from which we diagonalize
-
-  int info = 0;
-
-  // we will let pdseyv determine lwork for us. if we run it with
-  // lwork = -1 and work of length 1, it will fill work with
-  // an appropriate lwork number
-  double *work;
-  int lwork = -1;
-  allocate(work, 1);
-  // somehow autodetermination never works for liwork, so we compute this manually
-  // liwork ≥ 7n + 8npcol + 2
-  int liwork = 7*numRows_ + 8* numBlasCols_ + 2;
-  int *iwork;
-  allocate(iwork, liwork);
-  // calculate lwork
-  pdsyevd_(&jobz, &uplo, &numRows_, mat, &ia, &ja, &descMat_[0], eigenvalues,
-          eigenvectors.mat, &ia, &ja, &eigenvectors.descMat_[0],
-          work, &lwork, iwork, &liwork, &info);
-
-  //size_t tempWork = int(work[0]);
-  // automatic detection finds the minimum needed,
-  // we actually pretty much always need way more than this!
-  //if(tempWork > 2147483640) { lwork = 2147483640; } // check for overflow
-  //else { lwork = tempWork; }
-
-  lwork = int(work[0]);
-  delete[] work;
-  try{ allocate(work, lwork); }
-  catch (std::bad_alloc& ba) {
-    Error("PDSYEVD lwork array allocation failed.");
-  }
+  double *work = nullptr;
+  bool elpaDone = false;
+#ifdef ELPA_AVAIL
+  elpaDone = diagonalizeWithElpa(eigenvalues, eigenvectors);
+#endif
+
+  if (!elpaDone) {
+    char jobz = 'V';  // also eigenvectors
+    char uplo = 'U';  // upper triangular
+    int ia = 1;       // row index from which we diagonalize
+    int ja = 1;       // row index from which we diagonalize
+
+    int info = 0;
+
+    // we will let pdseyv determine lwork for us. if we run it with
+    // lwork = -1 and work of length 1, it will fill work with
+    // an appropriate lwork number
+    int lwork = -1;
+    allocate(work, 1);
+    // somehow autodetermination never works for liwork, so we compute this manually
+    // liwork ≥ 7n + 8npcol + 2
+    int liwork = 7*numRows_ + 8* numBlasCols_ + 2;
+    int *iwork;
+    allocate(iwork, liwork);
+    // calculate lwork
+    pdsyevd_(&jobz, &uplo, &numRows_, mat, &ia, &ja, &descMat_[0], eigenvalues,
+            eigenvectors.mat, &ia, &ja, &eigenvectors.descMat_[0],
+            work, &lwork, iwork, &liwork, &info);
+
+    //size_t tempWork = int(work[0]);
+    // automatic detection finds the minimum needed,
+    // we actually pretty much always need way more than this!
+    //if(tempWork > 2147483640) { lwork = 2147483640; } // check for overflow
+    //else { lwork = tempWork; }
+
+    lwork = int(work[0]);
+    delete[] work;
+    try{ allocate(work, lwork); }
+    catch (std::bad_alloc& ba) {
+      Error("PDSYEVD lwork array allocation failed.");
+    }
 
-  if(mpi->mpiHead()) {
-     std::cout << "Starting matrix diagonalization." << std::endl;
-     mpi->time();
-  }
+    if(mpi->mpiHead()) {
+       std::cout << "Starting matrix diagonalization." << std::endl;
+       mpi->time();
+    }
 
-  Kokkos::Profiling::pushRegion("pdsyevd");
+    Kokkos::Profiling::pushRegion("pdsyevd");
 
-  // call the function to now diagonalize
-  pdsyevd_(&jobz, &uplo, &numRows_, mat, &ia, &ja, &descMat_[0], eigenvalues,
-          eigenvectors.mat, &ia, &ja, &eigenvectors.descMat_[0],
-          work, &lwork, iwork, &liwork, &info);
+    // call the function to now diagonalize
+    pdsyevd_(&jobz, &uplo, &numRows_, mat, &ia, &ja, &descMat_[0], eigenvalues,
+            eigenvectors.mat, &ia, &ja, &eigenvectors.descMat_[0],
+            work, &lwork, iwork, &liwork, &info);
+    addDiagonalizationWork(numRows_);
 
-  Kokkos::Profiling::popRegion();
+    Kokkos::Profiling::popRegion();
 
-  if(mpi->mpiHead()) {
-     std::cout << "Matrix diagonalization completed." << std::endl;
-     mpi->time();
-  }
+    if(mpi->mpiHead()) {
+       std::cout << "Matrix diagonalization completed." << std::endl;
+       mpi->time();
+    }
 
-  if(info != 0) {
-    if (mpi->mpiHead()) {
-      std::cout << "Developer Error: "
-                "One of the input params to PDSYEVD is wrong!" << std::endl;
+    if(info != 0) {
+      if (mpi->mpiHead()) {
+        std::cout << "Developer Error: "
+                  "One of the input params to PDSYEVD is wrong!" << std::endl;
+      }
+      Error("PDSYEVD failed.", info);
     }
-    Error("PDSYEVD failed.", info);
   }
 
   if( eigenvalues[0] < 0 ) { // negative modes were found
@@ -211,13 +499,14 @@ ParallelMatrix<std::complex<double>>::diagonalize() {
   if (numRows_ != numCols_) {
     Error("Can not diagonalize non-square matrix");
   }
-  if ( numBlasRows_ != numBlasCols_ ) {
-    Error("Cannot diagonalize via scalapack with a non-square process grid!");
+  // the scalapack eigensolvers work on any process grid, but need square blocks
+  if ( blockSizeRows_ != blockSizeCols_ ) {
+    Error("Cannot diagonalize via scalapack with non-square blocks!");
   }
   double* eigenvalues = nullptr;
   eigenvalues = new double[numRows_];
 
-  // the two zeros here trigger the default square blacs process grid in initBlacs
+  // the two zeros here trigger the default blacs process grid in initBlacs
   ParallelMatrix<std::complex<double>> eigenvectors(
       numRows_, numCols_, 0, 0, numBlocksRows_, numBlocksCols_);
 
@@ -271,8 +560,9 @@ std::tuple<std::vector<double>, ParallelMatrix<double>>
   if (numRows_ != numCols_) {
     Error("Cannot diagonalize non-square matrix");
   }
-  if ( numBlasRows_ != numBlasCols_ ) {
-    Error("Cannot diagonalize via scalapack with a non-square process grid!");
+  // the scalapack eigensolvers work on any process grid, but need square blocks
+  if ( blockSizeRows_ != blockSizeCols_ ) {
+    Error("Cannot diagonalize via scalapack with non-square blocks!");
   }
   if ( numRows_ < numEigenvalues) {
     numEigenvalues = numRows_;
@@ -419,28 +709,102 @@ std::tuple<std::vector<double>, ParallelMatrix<double>>
   return std::make_tuple(eigenvalues_, eigenvectors);
 }
 
+// redistributes the matrix from the world grid to the grid of each split
+// group, one group at a time, with pdgemr2d over the world context
+template <>
+ParallelMatrix<double> ParallelMatrix<double>::copyToSplitGroup() const {
+  int numGroups = mpi->getNumSplitGroups();
+  if (numGroups == 1) {
+    return *this;
+  }
+  // the new matrix lives on the grid of the group, with tuned blocks
+  ParallelMatrix<double> result(numRows_, numCols_, 0, 0, autoBlocks,
+                                autoBlocks);
+
+  // pdgemr2d copies to the grid of one group at a time, and all the
+  // processes of this grid must take part in each copy. The processes
+  // outside the target grid flag it with a -1 context in the descriptor
+  int descOutside[9];
+  for (int i = 0; i < 9; i++) {
+    descOutside[i] = result.descMat_[i];
+  }
+  descOutside[1] = -1;
+  int descThis[9];
+  for (int i = 0; i < 9; i++) {
+    descThis[i] = descMat_[i];
+  }
+  int numRows = numRows_;
+  int numCols = numCols_;
+  int iOne = 1;
+  int blacsContext = blacsContext_;
+  for (int iGroup = 0; iGroup < numGroups; iGroup++) {
+    bool isTarget = iGroup == mpi->getSplitGroupId();
+    pdgemr2d_(&numRows, &numCols, mat, &iOne, &iOne, &descThis[0],
+              result.mat, &iOne, &iOne,
+              isTarget ? &result.descMat_[0] : &descOutside[0], &blacsContext);
+  }
+  return result;
+}
+
 // executes A + AT/2
 template <>
 void ParallelMatrix<double>::symmetrize() {
 
-  // it seems scalapack will make us copy the matrix into a new one
-  ParallelMatrix<double> AT = *(this);
-
   if (numRows_ != numCols_) {
     Error("Cannot currently symmetrize a non-square matrix.");
   }
 
-  int ia = 1;       // row index of start of A
-  int ja = 1;       // col index of start of A
-  int ic = 1;       // row index of start of C
-  int jc = 1;       // row index of start of C
-  double scale = 0.5; // 0.5 factors are for the 1/2 used in the sym (A + AT)/2.
-
-  // C here is the current matrix object stored by this class -- it will be overwritten,
-  // and the copy above will go out of scope.
-  //      C = beta*C + alpha*( A )^T
-  pdtran_(&numRows_, &numRows_, &scale, AT.mat, &ia, &ja, &descMat_[0], &scale, mat, &ic, &jc, &descMat_[0]);
+  // Rather than making a transposed copy of the whole matrix, we symmetrize
+  // one strip J = [j0, j0+w) of rows and columns at a time, using scratch
+  // matrices of about 2*w*numRows elements. For each strip:
+  //   C(J, j0:)    = 0.5 * A(J, j0:)    + 0.5 * A(j0:, J)^T
+  //   C(j0+w:, J)  = 0.5 * A(j0+w:, J)  + 0.5 * A(J, j0+w:)^T
+  // The elements with row or column before j0 were set by previous strips,
+  // and those after the strip are not modified yet.
+  const int numStrips = 16;
+  int stripWidth = std::max(blockSizeCols_, (numRows_ + numStrips - 1) / numStrips);
+
+  char transN_ = transN;
+  double one = 1.;
+  double zero = 0.;
+  double half = 0.5;  // the 1/2 used in the sym (A + AT)/2
+  int iOne = 1;
+
+  for (int j0 = 0; j0 < numRows_; j0 += stripWidth) {
+    int w = std::min(stripWidth, numRows_ - j0);
+    int m = numRows_ - j0;  // rows/cols from j0 to the end of the matrix
+    int mRest = m - w;      // rows/cols after the strip
+    int jStrip = j0 + 1;    // fortran indices
+    int jRest = j0 + w + 1;
+
+    // the original values of the column strip, A(j0:, J)^T, (w x m)
+    ParallelMatrix<double> colStripT(w, m, numBlasRows_, numBlasCols_, 0, 0,
+                                     blacsContext_);
+    //      C = beta*C + alpha*( A )^T
+    pdtran_(&w, &m, &one, mat, &jStrip, &jStrip, &descMat_[0], &zero,
+            colStripT.mat, &iOne, &iOne, &colStripT.descMat_[0]);
+
+    // the original values of the row strip after the diagonal block,
+    // A(J, j0+w:)^T, (mRest x w)
+    ParallelMatrix<double> rowStripT;
+    if (mRest > 0) {
+      rowStripT = ParallelMatrix<double>(mRest, w, numBlasRows_, numBlasCols_,
+                                         0, 0, blacsContext_);
+      pdtran_(&mRest, &w, &one, mat, &jStrip, &jRest, &descMat_[0], &zero,
+              rowStripT.mat, &iOne, &iOne, &rowStripT.descMat_[0]);
+    }
 
+    // C(J, j0:) = 0.5 * C(J, j0:) + 0.5 * A(j0:, J)^T
+    pdgeadd_(&transN_, &w, &m, &half, colStripT.mat, &iOne, &iOne,
+             &colStripT.descMat_[0], &half, mat, &jStrip, &jStrip,
+             &descMat_[0]);
+    // C(j0+w:, J) = 0.5 * C(j0+w:, J) + 0.5 * A(J, j0+w:)^T
+    if (mRest > 0) {
+      pdgeadd_(&transN_, &mRest, &w, &half, rowStripT.mat, &iOne, &iOne,
+               &rowStripT.descMat_[0], &half, mat, &jRest, &jStrip,
+               &descMat_[0]);
+    }
+  }
 }
 
 #endif  // MPI_AVAIL
@@ -1,12 +1,17 @@
 #ifndef P_MATRIX_H
 #define P_MATRIX_H
 
+#include <algorithm>
+#include <memory>
+#include <string>
 #include <tuple>
 #include <vector>
 #include "Blacs.h"
+#include "MappedBuffer.h"
 #include "exceptions.h"
 #include "constants.h"
 #include "mpiHelper.h"
+#include "utilities.h"
 
 #include "SMatrix.h"
 
@@ -21,7 +26,6 @@ using ParallelMatrix = SerialMatrix<T>;
 #include <set>
 
 // https://www.ibm.com/docs/en/pessl/5.5?topic=programs-application-program-outline
-// TODO we could remove the sq proc grid requirement as done here
 
 /** Class for managing a matrix MPI-distributed in memory.
  *
@@ -62,6 +66,16 @@ class ParallelMatrix {
   T const dummyConstZero = 0;
 
   T* mat = nullptr; // raw buffer
+  // if the matrix is out of core, the scratch file mapped in mat
+  std::unique_ptr<MappedBuffer> mappedBuffer_;
+
+  /** Copies the dimensions and the BLACS distribution of that matrix.
+   */
+  void copyLayout(const ParallelMatrix<T>& that);
+
+  /** Deallocates the raw buffer, in memory or out of core.
+   */
+  void freeBuffer();
 
   /** Converts a local one-dimensional storage index (MPI-dependent) into the
    * row/column index of the global matrix.
@@ -69,6 +83,23 @@ class ParallelMatrix {
   std::tuple<int, int> local2Global(const int& k) const;
   std::tuple<int, int> local2Global(const int& i, const int& j) const;
 
+  /** Chooses the number of blocks along a matrix dimension of size
+   * numElements, for the block-cyclic distribution over the process grid.
+   * The same block size is used for rows and columns, as required by the
+   * scalapack eigensolvers.
+   */
+  int tuneNumBlocks(const int& numElements) const;
+
+#ifdef ELPA_AVAIL
+  /** Diagonalizes the matrix with the ELPA eigensolver, reusing the BLACS
+   * block-cyclic distribution of this matrix and of eigenvectors.
+   * Returns false, without touching the inputs, if the distribution can't
+   * be handed to ELPA (non-square blocks, or processes outside the grid),
+   * in which case the caller should fall back to ScaLAPACK.
+   */
+  bool diagonalizeWithElpa(double* eigenvalues, ParallelMatrix<T>& eigenvectors);
+#endif
+
   /** Set the blacsContext for cases where two descriptors must share the same one */
   void setBlacsContext(int blacsContext);
 
@@ -84,17 +115,25 @@ class ParallelMatrix {
   static const char transT = 'T';  // transpose
   static const char transC = 'C';  // adjoint (for complex numbers)
 
+  // value of numBlocksRows/Cols requesting a tuned block-cyclic distribution
+  static constexpr int autoBlocks = -1;
+
   /** Default constructor of the matrix class.
    * Matrix elements are set to zero in the initialization.
    * @param numRows: global number of matrix rows
    * @param numCols: global number of matrix columns
    * @param numBLocksRows: row size of the block for Blacs distribution
    * @param numBLocksCols: column size of the block for Blacs distribution
+   * If numBlocksRows and numBlocksCols are set to autoBlocks, the block size
+   * is tuned to the matrix size and the process grid (see tuneNumBlocks).
+   * @param scratchDirectory: if not empty, the local elements are stored
+   * out of core, in a memory-mapped scratch file in this directory.
    */
   ParallelMatrix(const int& numRows, const int& numCols,
                  const int& numBlasRows = 0, const int& numBlasCols = 0,
                  const int& numBlocksRows = 0, const int& numBlocksCols = 0,
-                 const int& blacsContext = -1);
+                 const int& blacsContext = -1,
+                 const std::string& scratchDirectory = "");
 
   /** Empty constructor
    */
@@ -104,19 +143,43 @@ class ParallelMatrix {
    */
   ~ParallelMatrix();
 
-  /** Copy constructor
+  /** Copy constructor. The copy is always stored in memory.
    */
   ParallelMatrix(const ParallelMatrix<T>& that);
 
+  /** Move constructor, takes over the buffer of that.
+   */
+  ParallelMatrix(ParallelMatrix<T>&& that) noexcept;
+
   /** Copy assignment
    */
   ParallelMatrix& operator=(const ParallelMatrix<T>& that);
 
+  /** Move assignment, takes over the buffer of that.
+   */
+  ParallelMatrix& operator=(ParallelMatrix<T>&& that) noexcept;
+
+  /** Returns true if the local elements are stored in a scratch file.
+   */
+  bool isOutOfCore() const;
+
+  /** For an out-of-core matrix, starts reading asynchronously from disk the
+   * local columns [firstCol, firstCol+numCols) of the local block.
+   * Does nothing if the matrix is in memory.
+   */
+  void prefetchLocalCols(const int& firstCol, const int& numCols);
+
+  /** For an out-of-core matrix, marks the local columns
+   * [firstCol, firstCol+numCols) as not needed soon, so that their pages
+   * are evicted first. Does nothing if the matrix is in memory.
+   */
+  void releaseLocalCols(const int& firstCol, const int& numCols);
+
   /** A method to initialize blacs parameters, if needed.
   * @param numBlasRows -- number of rows requested for blacs grid
   * @param numBlasCols -- number of cosl requested for blacs grid
-  * If both are zero, this function falls back to create a square
-  * blacs process grid.
+  * If both are zero, this function falls back to create the most square
+  * blacs process grid that uses all MPI processes.
   */
   void initBlacs(const int& numBlasRows = 0, const int& numBlasCols = 0,
                                                 const int& initBlacsContext = -1);
@@ -126,6 +189,16 @@ class ParallelMatrix {
    */
   std::vector<std::tuple<int, int>> getAllLocalStates();
 
+  /** Loops over the tiles of the block-cyclic distribution stored by the
+   * current MPI process, without listing the local matrix elements.
+   * For each tile, calls f(row0, col0, numTileRows, numTileCols, data, ld),
+   * where (row0, col0) are the global indices of the first element of the
+   * tile, and the element (row0+i, col0+j) is stored at data[i + j * ld].
+   * @param f: a callable with the signature above.
+   */
+  template <typename F>
+  void forEachLocalTile(F f);
+
   /** Find the global indices of the rows that are stored locally
    * by the current MPI process.
    */
@@ -156,6 +229,15 @@ class ParallelMatrix {
   /** Find global number of matrix elements
    */
   int size() const;
+  /** Return the number of matrix elements stored by this MPI process
+   */
+  int localSize() const;
+
+  /** Returns a pointer to the raw buffer of the matrix elements stored by
+   * this MPI process, of size localSize(). The buffer follows the local
+   * storage order of global2Local(). Used e.g. to write the matrix to file.
+   */
+  T* data();
 
   /** Get and set operator.
    * Returns the stored value if the matrix element (row,col) is stored in
@@ -241,6 +323,65 @@ class ParallelMatrix {
   */
   void symmetrize();
 
+  /** Distributes a matrix x, replicated on all MPI processes and with the
+   * same number of rows as this one, on the process grid of this matrix.
+   * Each process only copies the elements it owns, so no communication
+   * is needed, and the result can be used in prod() with this matrix.
+   */
+  ParallelMatrix<T> distributeRows(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x) const;
+
+  /** Copies this matrix, distributed over the processes of the world
+   * before mpi->splitWorld(), on a new process grid made of the processes
+   * of the group of this process, so that each group owns a full copy.
+   * To be called after splitWorld(), by all the processes of all groups.
+   */
+  ParallelMatrix<T> copyToSplitGroup() const;
+
+  /** Collects the distributed matrix into an Eigen matrix replicated
+   * on all MPI processes.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> replicate() const;
+
+  /** Computes y = A * diag(weights) * A^T * x, where A are the first
+   * weights.size() columns of this matrix, and x (numRows x k) and y are
+   * replicated on all MPI processes.
+   * Used to project populations on the relaxon eigenvectors and back:
+   * both products are done with pdgemm, so the matrix is never gathered,
+   * the projections A^T * x stay distributed, and only y is reduced.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> projectOnColumns(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x,
+      const Eigen::VectorXd& weights) const;
+
+  /** Computes p = A^T * x, where A are the first numProjections columns of
+   * this matrix, and x (numRows x k) and p (numProjections x k) are
+   * replicated on all MPI processes.
+   * Several vectors can be stacked as columns of x, so that all their
+   * projections on the relaxon eigenvectors are done with a single pdgemm.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> projectColumns(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x,
+      const int& numProjections) const;
+
+  /** Computes y = A * c, where A are the first c.rows() columns of this
+   * matrix, and c and y (numRows x k) are replicated on all MPI processes.
+   * This is the back-rotation of coefficients computed from projectColumns.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> combineColumns(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& c) const;
+
+  /** Collects the partial results y computed on the local rows of this
+   * matrix (e.g. y = localBlock * x, of size localRows() x k) into a
+   * matrix numRows x k, summed and replicated on all MPI processes.
+   * The partial results are first summed over the processes of the same
+   * row of the process grid, and each row is then gathered once, which
+   * moves less data than scattering y in a full matrix and summing it
+   * over all processes.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> gatherLocalRows(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& y) const;
+
 };
 
 template <typename T>
@@ -249,13 +390,13 @@ ParallelMatrix<T>::ParallelMatrix(const int& numRows, const int& numCols,
                                   const int& numBlasCols,
                                   const int& numBlocksRows,
                                   const int& numBlocksCols,
-                                  const int& blacsContext) {
+                                  const int& blacsContext,
+                                  const std::string& scratchDirectory) {
 
   // call initBlacs to set all blacs related variables and contruct
   // the blacs context and process grid setup.
-  // If numBlocksRows or numBlocksCols is not zero, this will
-  // initialize blacs with a square process grid
-  // (and number of processors must be a square number if we're doing lin alg ops)
+  // If numBlasRows and numBlasCols are zero, this will
+  // initialize blacs with the most square process grid possible
   initBlacs(numBlasRows, numBlasCols, blacsContext);
 
   // initialize number of rows and columns of the global matrix
@@ -269,9 +410,13 @@ ParallelMatrix<T>::ParallelMatrix(const int& numRows, const int& numCols,
   //
   // If block size values are not supplied, the default is to make the
   // block sizes the same as the blacs grid divisions
-  if(numBlocksRows == 0) { numBlocksRows_ = numBlasRows_; }
+  //
+  // With autoBlocks, the distribution is block-cyclic with tuned block sizes
+  if(numBlocksRows == autoBlocks) { numBlocksRows_ = tuneNumBlocks(numRows_); }
+  else if(numBlocksRows == 0) { numBlocksRows_ = numBlasRows_; }
   else { numBlocksRows_ = numBlocksRows; }
-  if(numBlocksCols == 0) { numBlocksCols_ = numBlasCols_; }
+  if(numBlocksCols == autoBlocks) { numBlocksCols_ = tuneNumBlocks(numCols_); }
+  else if(numBlocksCols == 0) { numBlocksCols_ = numBlasCols_; }
   else { numBlocksCols_ = numBlocksCols; }
 
   // compute the block size (chunks of rows/cols over which matrix is distributed)
@@ -290,14 +435,21 @@ ParallelMatrix<T>::ParallelMatrix(const int& numRows, const int& numCols,
   numLocalCols_ = numroc_(&numCols_, &blockSizeCols_, &myBlasCol_, &iZero, &numBlasCols_);
   numLocalElements_ = numLocalRows_ * numLocalCols_;
 
-  // allocate the matrix
-  mat = new T[numLocalElements_];
+  if (scratchDirectory.empty()) {
+    // allocate the matrix
+    mat = new T[numLocalElements_];
 
-  // Memory could not be allocated, end program
-  assert(mat != nullptr);
+    // Memory could not be allocated, end program
+    assert(mat != nullptr);
 
-  // fill the matrix with zeroes
-  for (int i = 0; i < numLocalElements_; ++i) *(mat + i) = 0.;
+    // fill the matrix with zeroes, spreading its pages over NUMA domains
+    firstTouch(mat, size_t(numLocalElements_));
+  } else {
+    // the scratch file is created filled with zeroes
+    mappedBuffer_ = std::make_unique<MappedBuffer>(
+        scratchDirectory, size_t(numLocalElements_) * sizeof(T));
+    mat = (T*) mappedBuffer_->data();
+  }
 
   // Create descriptor for block cyclic distribution of matrix
   int info;  // error code
@@ -332,7 +484,7 @@ ParallelMatrix<T>::ParallelMatrix()  {
 }
 
 template <typename T>
-ParallelMatrix<T>::ParallelMatrix(const ParallelMatrix<T>& that) {
+void ParallelMatrix<T>::copyLayout(const ParallelMatrix<T>& that) {
   numRows_ = that.numRows_;
   numCols_ = that.numCols_;
   numLocalRows_ = that.numLocalRows_;
@@ -352,59 +504,87 @@ ParallelMatrix<T>::ParallelMatrix(const ParallelMatrix<T>& that) {
   for (int i = 0; i < 9; i++) {
     descMat_[i] = that.descMat_[i];
   }
-  if ( mat != nullptr ) {
+}
+
+template <typename T>
+void ParallelMatrix<T>::freeBuffer() {
+  if (mappedBuffer_ != nullptr) {
+    mappedBuffer_.reset();
+  } else if ( mat != nullptr ) {
     delete[] mat;
   }
+  mat = nullptr;
+}
+
+template <typename T>
+ParallelMatrix<T>::ParallelMatrix(const ParallelMatrix<T>& that) {
+  copyLayout(that);
   // matrix allocation
   mat = new T[numLocalElements_];
   // Memory could not be allocated, end program
   assert(mat != nullptr);
-  for (int i = 0; i < numLocalElements_; i++) {
-    mat[i] = that.mat[i];
-  }
+  firstTouch(mat, size_t(numLocalElements_), (const T*) that.mat);
+}
+
+template <typename T>
+ParallelMatrix<T>::ParallelMatrix(ParallelMatrix<T>&& that) noexcept {
+  *this = std::move(that);
 }
 
 template <typename T>
 ParallelMatrix<T>& ParallelMatrix<T>::operator=(const ParallelMatrix<T>& that) {
   if (this != &that) {
-    numRows_ = that.numRows_;
-    numCols_ = that.numCols_;
-    numLocalRows_ = that.numLocalRows_;
-    numLocalCols_ = that.numLocalCols_;
-    numLocalElements_ = that.numLocalElements_;
-    numBlocksRows_ = that.numBlocksRows_;
-    numBlocksCols_ = that.numBlocksCols_;
-    blockSizeRows_ = that.blockSizeRows_;
-    blockSizeCols_ = that.blockSizeCols_;
-    numBlasRows_ = that.numBlasRows_;
-    numBlasCols_ = that.numBlasCols_;
-    myBlasRow_ = that.myBlasRow_;
-    myBlasCol_ = that.myBlasCol_;
-    blasRank_ = that.blasRank_;
-    blacsContext_ = that.blacsContext_;
-
-    for (int i = 0; i < 9; i++) {
-      descMat_[i] = that.descMat_[i];
-    }
-    if ( mat != nullptr ) {
-      delete[] mat;
-    }
+    freeBuffer();
+    copyLayout(that);
     // matrix allocation
     mat = new T[numLocalElements_];
     // Memory could not be allocated, end program
     assert(mat != nullptr);
-    for (int i = 0; i < numLocalElements_; i++) {
-      mat[i] = that.mat[i];
-    }
+    firstTouch(mat, size_t(numLocalElements_), (const T*) that.mat);
   }
   return *this;
 }
 
 template <typename T>
-ParallelMatrix<T>::~ParallelMatrix() {
-  if ( mat != nullptr ) {
-    delete[] mat;
+ParallelMatrix<T>& ParallelMatrix<T>::operator=(ParallelMatrix<T>&& that) noexcept {
+  if (this != &that) {
+    freeBuffer();
+    copyLayout(that);
+    mat = that.mat;
+    mappedBuffer_ = std::move(that.mappedBuffer_);
+    // leave that as an empty matrix
+    that.mat = nullptr;
+    that.numLocalRows_ = 0;
+    that.numLocalCols_ = 0;
+    that.numLocalElements_ = 0;
   }
+  return *this;
+}
+
+template <typename T>
+ParallelMatrix<T>::~ParallelMatrix() {
+  freeBuffer();
+}
+
+template <typename T>
+bool ParallelMatrix<T>::isOutOfCore() const {
+  return mappedBuffer_ != nullptr;
+}
+
+template <typename T>
+void ParallelMatrix<T>::prefetchLocalCols(const int& firstCol,
+                                          const int& numCols) {
+  if (mappedBuffer_ == nullptr || firstCol >= numLocalCols_) return;
+  size_t bytesPerCol = size_t(numLocalRows_) * sizeof(T);
+  mappedBuffer_->prefetch(firstCol * bytesPerCol, numCols * bytesPerCol);
+}
+
+template <typename T>
+void ParallelMatrix<T>::releaseLocalCols(const int& firstCol,
+                                         const int& numCols) {
+  if (mappedBuffer_ == nullptr || firstCol >= numLocalCols_) return;
+  size_t bytesPerCol = size_t(numLocalRows_) * sizeof(T);
+  mappedBuffer_->release(firstCol * bytesPerCol, numCols * bytesPerCol);
 }
 
 template <typename T>
@@ -413,17 +593,20 @@ void ParallelMatrix<T>::initBlacs(const int& numBlasRows, const int& numBlasCols
 
   int size = mpi->getSize(); // temp variable for mpi world size, used in setup
 
-  // TODO if we only give this the nearest square number of processors,
-  // will it disregard the others for us? Could this fix the
-  // sq process thing?
-  //       NPROW = INT(SQRT(REAL(NNODES)))
-  //    NPCOL = NNODES/NPROW
-  //  IF (MYROW .LT. NPROW .AND. MYCOL .LT. NPCOL) THEN
-  //  https://www.ibm.com/docs/en/pessl/5.5?topic=programs-application-program-outline
   blacs_pinfo_(&blasRank_, &size);
   int iZero = 0;
   if( inputBlacsContext == -1) { // no context has been created/supplied
-    blacs_get_(&iZero, &iZero, &blacsContext_);  // -> get default system context
+    if (mpi->isSubWorld()) {
+      // the default system context spans all the groups of the job farm,
+      // or of splitWorld()
+      blacsContext_ = Csys2blacs_handle(mpi->getComm());
+    } else {
+      blacs_get_(&iZero, &iZero, &blacsContext_);  // -> get default system context
+    }
+  }
+  if (mpi->isSubWorld()) { // blacs_pinfo_ counts the processes of all groups
+    blasRank_ = mpi->getRank();
+    size = mpi->getSize();
   }
 
   // kill the code if we asked for more blas rows/cols than there are procs
@@ -432,7 +615,7 @@ void ParallelMatrix<T>::initBlacs(const int& numBlasRows, const int& numBlasCols
   }
 
   // Cases for a blacs grid where we specified rows, cols, both,
-  // or the default, neither, which results in a square proc grid
+  // or the default, neither, which results in the most square proc grid
   if(numBlasRows != 0 && numBlasCols == 0) {
     numBlasRows_ = numBlasRows;
     numBlasCols_ = mpi->getSize()/numBlasRows;
@@ -446,18 +629,11 @@ void ParallelMatrix<T>::initBlacs(const int& numBlasRows, const int& numBlasCols
     numBlasCols_ = numBlasCols;
   }
   else {
-    // set up a square procs grid, as the default
+    // set up the most square procs grid that uses all processes, as the
+    // default: tall and skinny grids are slow for pdgemm and the eigensolvers
     numBlasRows_ = (int)(sqrt(size)); // int does rounding down (intentional!)
-    numBlasCols_ = numBlasRows_;
-
-    // TODO will this just work ( not using all procs for matrix )
-    // if we remove this error???
-    //
-    // Throw an error if we tried to set up a square proc grid with
-    // a non-square number of processors
-    if (mpi->getSize() > numBlasRows_ * numBlasCols_) {
-      Error("Phoebe needs a square number of MPI processes");
-    }
+    while (size % numBlasRows_ != 0) numBlasRows_--;
+    numBlasCols_ = size / numBlasRows_;
   }
 
   // if no context is given, create one.
@@ -472,6 +648,50 @@ void ParallelMatrix<T>::initBlacs(const int& numBlasRows, const int& numBlasCols
   blacs_gridinfo_(&blacsContext_, &numBlasRows_, &numBlasCols_, &myBlasRow_,&myBlasCol_);
 }
 
+template <typename T>
+int ParallelMatrix<T>::tuneNumBlocks(const int& numElements) const {
+  // blocks of 64 elements benchmarked best for the scattering matrix
+  // (matSize~31k on 81 processes, compared to 16 and 176).
+  // Smaller matrices need smaller blocks, otherwise some processes of the
+  // grid are left without blocks, so we require at least two blocks per
+  // process along the longest side of the grid.
+  int numProcs = std::max(numBlasRows_, numBlasCols_);
+  int blockSize = 64;
+  while (blockSize > 1 && (numElements + blockSize - 1) / blockSize < 2 * numProcs) {
+    blockSize /= 2;
+  }
+  return std::max(1, (numElements + blockSize - 1) / blockSize);
+}
+
+template <typename T>
+ParallelMatrix<T> ParallelMatrix<T>::distributeRows(
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x) const {
+  if (x.rows() != numRows_) {
+    Error("Cannot distribute a matrix with a different number of rows.");
+  }
+  // same row blocks and process grid as this matrix
+  ParallelMatrix<T> result(int(x.rows()), int(x.cols()), 0, 0, numBlocksRows_,
+                           numBlasCols_, blacsContext_);
+  for (int k = 0; k < result.numLocalElements_; k++) {
+    auto [i, j] = result.local2Global(k);
+    result.mat[k] = x(i, j);
+  }
+  return result;
+}
+
+template <typename T>
+Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>
+ParallelMatrix<T>::replicate() const {
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> x =
+      Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>::Zero(numRows_, numCols_);
+  for (int k = 0; k < numLocalElements_; k++) {
+    auto [i, j] = local2Global(k);
+    x(i, j) = mat[k];
+  }
+  mpi->allReduceSum(&x);
+  return x;
+}
+
 template <typename T>
 int ParallelMatrix<T>::rows() const {
   return numRows_;
@@ -497,6 +717,16 @@ int ParallelMatrix<T>::size() const {
   return cols() * rows();
 }
 
+template <typename T>
+int ParallelMatrix<T>::localSize() const {
+  return numLocalElements_;
+}
+
+template <typename T>
+T* ParallelMatrix<T>::data() {
+  return mat;
+}
+
 // Get/set element
 
 template <typename T>
@@ -605,13 +835,33 @@ std::vector<std::tuple<int, int>> ParallelMatrix<T>::getAllLocalStates() {
   return x;
 }
 
+template <typename T>
+template <typename F>
+void ParallelMatrix<T>::forEachLocalTile(F f) {
+  int ld = descMat_[8];
+  // local blocks of rows (cols) are stored one after the other, and the
+  // b-th local block is the (b * numBlasRows_ + myBlasRow_)-th global block
+  for (int lc0 = 0; lc0 < numLocalCols_; lc0 += blockSizeCols_) {
+    int numTileCols = std::min(blockSizeCols_, numLocalCols_ - lc0);
+    int col0 = ((lc0 / blockSizeCols_) * numBlasCols_ + myBlasCol_)
+        * blockSizeCols_;
+    for (int lr0 = 0; lr0 < numLocalRows_; lr0 += blockSizeRows_) {
+      int numTileRows = std::min(blockSizeRows_, numLocalRows_ - lr0);
+      int row0 = ((lr0 / blockSizeRows_) * numBlasRows_ + myBlasRow_)
+          * blockSizeRows_;
+      f(row0, col0, numTileRows, numTileCols, mat + lr0 + size_t(lc0) * ld, ld);
+    }
+  }
+}
+
 template <typename T>
 std::vector<int> ParallelMatrix<T>::getAllLocalRows() {
   int iZero = 0;
   std::vector<int> x;
-  for (int k = 0; k < numLocalRows_; k++) {
+  // note: indxl2g_ uses fortran indices, running from 1 to N
+  for (int k = 1; k <= numLocalRows_; k++) {
     int gr = indxl2g_( &k, &blockSizeRows_, &myBlasRow_, &iZero, &numBlasRows_ );
-    x.push_back(gr);
+    x.push_back(gr - 1);
   }
   return x;
 }
@@ -620,9 +870,10 @@ template <typename T>
 std::vector<int> ParallelMatrix<T>::getAllLocalCols() {
   std::vector<int> x;
   int iZero = 0;
-  for (int k = 0; k < numLocalCols_; k++) {
+  // note: indxl2g_ uses fortran indices, running from 1 to N
+  for (int k = 1; k <= numLocalCols_; k++) {
     int gc = indxl2g_( &k, &blockSizeCols_, &myBlasCol_, &iZero, &numBlasCols_ );
-    x.push_back(gc);
+    x.push_back(gc - 1);
   }
   return x;
 }
@@ -1,10 +1,13 @@
 #ifndef S_MATRIX_H
 #define S_MATRIX_H
 
+#include <numeric>
+#include <string>
 #include <tuple>
 #include <vector>
 
 #include "Blas.h"
+#include "eigen.h"
 #include "exceptions.h"
 
 /** Class for managing a (serial) matrix stored in memory.
@@ -41,17 +44,23 @@ class SerialMatrix {
    */
   static const char transC = 'C';
 
+  // mirrors ParallelMatrix::autoBlocks, ignored
+  static constexpr int autoBlocks = -1;
+
   /** Default SMatrix constructor.
    * SerialMatrix elements are set to zero upon initialization.
    *
    * @param numRows: number of rows of the matrix
    * @param numCols: number of columns of the matrix.
-   * @param numBlocksRows, numBlocksCols: these parameters are ignored and are
-   * put here for mirroring the interface of ParallelMatrix.
+   * @param numBlocksRows, numBlocksCols, blacsContext, scratchDirectory:
+   * these parameters are ignored and are put here for mirroring the
+   * interface of ParallelMatrix. The matrix is always stored in memory.
    */
   SerialMatrix(const int& numRows, const int& numCols,
                  const int& numBlasRows = 0, const int& numBlasCols = 0,
-                 const int& numBlocksRows = 0, const int& numBlocksCols = 0);
+                 const int& numBlocksRows = 0, const int& numBlocksCols = 0,
+                 const int& blacsContext = -1,
+                 const std::string& scratchDirectory = "");
 
   /** Default constructor
    */
@@ -74,6 +83,23 @@ class SerialMatrix {
    */
   std::vector<std::tuple<int, int>> getAllLocalStates();
 
+  /** Same as ParallelMatrix::forEachLocalTile(): here, the whole matrix is
+   * a single tile, i.e. f(0, 0, numRows, numCols, data, numRows) is called.
+   * @param f: a callable f(row0, col0, numTileRows, numTileCols, data, ld).
+   */
+  template <typename F>
+  void forEachLocalTile(F f);
+
+  /** Find the global indices of the rows that are stored locally
+   * by the current MPI process (all of them).
+   */
+  std::vector<int> getAllLocalRows();
+
+  /** Find the global indices of the cols that are stored locally
+   * by the current MPI process (all of them).
+   */
+  std::vector<int> getAllLocalCols();
+
   /** Returns true if the global indices (row,col) identify a matrix element
    * stored by the MPI process.
    */
@@ -94,6 +120,12 @@ class SerialMatrix {
   /** Find global number of matrix elements
    */
   int size() const;
+  /** Return the number of matrix elements stored locally (all of them)
+   */
+  int localSize() const;
+  /** Returns a pointer to the raw buffer of matrix elements (column major)
+   */
+  T* data();
   /** Get and set operator
    */
   T& operator()(const int &row, const int &col);
@@ -189,18 +221,76 @@ class SerialMatrix {
   /** Symmetrize the matrix */
   void symmetrize();
 
+  /** Copies a matrix x, with the same number of rows as this one, into a
+   * SerialMatrix. Mirrors the interface of ParallelMatrix.
+   */
+  SerialMatrix<T> distributeRows(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x) const;
+
+  /** Returns a copy of the matrix as an Eigen matrix.
+   * Mirrors the interface of ParallelMatrix.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> replicate() const;
+
+  /** Computes y = A * diag(weights) * A^T * x, where A are the first
+   * weights.size() columns of this matrix.
+   * Mirrors the interface of ParallelMatrix.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> projectOnColumns(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x,
+      const Eigen::VectorXd& weights) const;
+
+  /** Computes p = A^T * x, where A are the first numProjections columns of
+   * this matrix. Mirrors the interface of ParallelMatrix.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> projectColumns(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x,
+      const int& numProjections) const;
+
+  /** Computes y = A * c, where A are the first c.rows() columns of this
+   * matrix. Mirrors the interface of ParallelMatrix.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> combineColumns(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& c) const;
+
+  /** Returns y, as all rows are local to the serial matrix.
+   * Mirrors the interface of ParallelMatrix.
+   */
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> gatherLocalRows(
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& y) const {
+    return y;
+  }
+
+  /** Mirror the out-of-core interface of ParallelMatrix.
+   * The serial matrix is always in memory.
+   */
+  bool isOutOfCore() const { return false; }
+  void prefetchLocalCols(const int& firstCol, const int& numCols) {
+    (void) firstCol;
+    (void) numCols;
+  }
+  void releaseLocalCols(const int& firstCol, const int& numCols) {
+    (void) firstCol;
+    (void) numCols;
+  }
 };
 
 // A default constructor to build a dense matrix of zeros to be filled
 template <typename T>
 SerialMatrix<T>::SerialMatrix(const int& numRows, const int& numCols,
                   const int& numBlasRows, const int& numBlasCols,
-                  const int& numBlocksRows, const int& numBlocksCols) {
+                  const int& numBlocksRows, const int& numBlocksCols,
+                  const int& blacsContext,
+                  const std::string& scratchDirectory) {
   // these are used only the in the pmatrix case
   (void) numBlocksRows;
   (void) numBlocksCols;
   (void) numBlasRows;
   (void) numBlasCols;
+  (void) blacsContext;
+  if (!scratchDirectory.empty()) {
+    Warning("Out-of-core matrices require MPI, the matrix is kept in memory.");
+  }
 
   numRows_ = numRows;
   numCols_ = numCols;
@@ -261,6 +351,67 @@ SerialMatrix<T>::~SerialMatrix() {
   if (mat != nullptr) delete[] mat;
 }
 
+template <typename T>
+SerialMatrix<T> SerialMatrix<T>::distributeRows(
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x) const {
+  if (x.rows() != numRows_) {
+    Error("Cannot distribute a matrix with a different number of rows.");
+  }
+  SerialMatrix<T> result(int(x.rows()), int(x.cols()));
+  Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>(
+      result.mat, x.rows(), x.cols()) = x;
+  return result;
+}
+
+template <typename T>
+Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>
+SerialMatrix<T>::replicate() const {
+  return Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>(
+      mat, numRows_, numCols_);
+}
+
+template <typename T>
+Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>
+SerialMatrix<T>::projectOnColumns(
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x,
+    const Eigen::VectorXd& weights) const {
+  if (x.rows() != numRows_ || weights.size() > numCols_) {
+    Error("Projection on matrix columns with inconsistent sizes.");
+  }
+  Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>> a(
+      mat, numRows_, numCols_);
+  auto aCols = a.leftCols(weights.size());
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> projection =
+      aCols.transpose() * x;
+  projection = weights.cast<T>().asDiagonal() * projection;
+  return aCols * projection;
+}
+
+template <typename T>
+Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>
+SerialMatrix<T>::projectColumns(
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& x,
+    const int& numProjections) const {
+  if (x.rows() != numRows_ || numProjections > numCols_) {
+    Error("Projection on matrix columns with inconsistent sizes.");
+  }
+  Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>> a(
+      mat, numRows_, numCols_);
+  return a.leftCols(numProjections).transpose() * x;
+}
+
+template <typename T>
+Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>
+SerialMatrix<T>::combineColumns(
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>& c) const {
+  if (c.rows() > numCols_) {
+    Error("Combination of matrix columns with inconsistent sizes.");
+  }
+  Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>> a(
+      mat, numRows_, numCols_);
+  return a.leftCols(c.rows()) * c;
+}
+
 /* ------------- Very basic operations -------------- */
 template <typename T>
 int SerialMatrix<T>::rows() const {
@@ -282,6 +433,14 @@ template <typename T>
 int SerialMatrix<T>::size() const {
   return numElements_;
 }
+template <typename T>
+int SerialMatrix<T>::localSize() const {
+  return numElements_;
+}
+template <typename T>
+T* SerialMatrix<T>::data() {
+  return mat;
+}
 
 // Get/set element
 template <typename T>
@@ -333,6 +492,28 @@ std::vector<std::tuple<int, int>> SerialMatrix<T>::getAllLocalStates() {
   return x;
 }
 
+template <typename T>
+template <typename F>
+void SerialMatrix<T>::forEachLocalTile(F f) {
+  if (numElements_ > 0) {
+    f(0, 0, numRows_, numCols_, mat, numRows_);
+  }
+}
+
+template <typename T>
+std::vector<int> SerialMatrix<T>::getAllLocalRows() {
+  std::vector<int> x(numRows_);
+  std::iota(x.begin(), x.end(), 0);
+  return x;
+}
+
+template <typename T>
+std::vector<int> SerialMatrix<T>::getAllLocalCols() {
+  std::vector<int> x(numCols_);
+  std::iota(x.begin(), x.end(), 0);
+  return x;
+}
+
 // General unary negation
 template <typename T>
 SerialMatrix<T> SerialMatrix<T>::operator-() const {
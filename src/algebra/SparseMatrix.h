@@ -0,0 +1,277 @@
+#ifndef SPARSE_MATRIX_H
+#define SPARSE_MATRIX_H
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <tuple>
+#include <vector>
+
+/** Class for the storage of a sparse matrix in the compressed sparse row
+ * (CSR) format.
+ *
+ * The matrix is meant to be built by accumulation (e.g. by the builder of the
+ * scattering matrix): elements added with add() are first appended to a
+ * buffer of (row, col, value) triplets, which is periodically merged into
+ * the CSR storage, summing duplicate elements.
+ *
+ * Note on MPI: each MPI process stores the contributions that it has
+ * computed, and a matrix element may be found on more than one process.
+ * The full matrix is the sum of the matrices stored by each process.
+ * Hence, a matrix-vector product is done on the local matrix, and then
+ * summed over all MPI processes.
+ */
+template <typename T>
+class SparseMatrix {
+ private:
+  int numRows_ = 0;
+  int numCols_ = 0;
+
+  // compressed storage: the elements of row i are found at positions
+  // rowPointers_[i] <= k < rowPointers_[i+1] of colIndices_ and values_
+  std::vector<size_t> rowPointers_;
+  std::vector<int> colIndices_;
+  std::vector<T> values_;
+
+  // elements that have been added, but not yet compressed
+  std::vector<int> rowBuffer_;
+  std::vector<int> colBuffer_;
+  std::vector<T> valueBuffer_;
+
+  // minimum size of the buffer before triggering a compression
+  size_t minBufferSize_ = 1 << 20;
+
+ public:
+  /** Default constructor of the matrix class.
+   * Creates an empty (all zeros) matrix.
+   * @param numRows: number of rows of the matrix.
+   * @param numCols: number of columns of the matrix.
+   */
+  SparseMatrix(const int &numRows, const int &numCols);
+
+  /** Empty constructor
+   */
+  SparseMatrix();
+
+  /** Find global number of rows
+   */
+  int rows() const;
+
+  /** Find global number of columns
+   */
+  int cols() const;
+
+  /** Number of elements stored in the compressed storage.
+   * Call compress() before this, to include all the added elements.
+   */
+  size_t nonZeros() const;
+
+  /** Adds a value to the matrix element (row,col).
+   * Elements are buffered, and summed to the stored ones by compress().
+   */
+  void add(const int &row, const int &col, const T &value);
+
+  /** Merges the buffered elements into the compressed storage.
+   * Needs to be called after the last call to add(), before reading the
+   * matrix elements.
+   */
+  void compress();
+
+  /** Removes the stored elements with absolute value smaller or equal than
+   * a threshold.
+   * @param threshold: the drop tolerance.
+   */
+  void drop(const double &threshold);
+
+  /** Symmetrize the matrix, as (A + A^T)/2.
+   * Since each MPI process stores a part of the full matrix (see class
+   * notes), this is done on the local elements, without communications.
+   */
+  void symmetrize();
+
+  /** Returns the index of the first element of a row in the compressed
+   * storage, i.e. the elements of the row are found at the positions
+   * rowBegin(row) <= k < rowBegin(row+1).
+   */
+  size_t rowBegin(const int &row) const;
+
+  /** Returns the column index of the k-th element of the compressed storage.
+   */
+  int colIndex(const size_t &k) const;
+
+  /** Get and set operator for the k-th element of the compressed storage.
+   */
+  T &value(const size_t &k);
+  const T &value(const size_t &k) const;
+};
+
+template <typename T>
+SparseMatrix<T>::SparseMatrix(const int &numRows, const int &numCols) {
+  numRows_ = numRows;
+  numCols_ = numCols;
+  rowPointers_.resize(numRows_ + 1, 0);
+}
+
+template <typename T>
+SparseMatrix<T>::SparseMatrix() = default;
+
+template <typename T>
+int SparseMatrix<T>::rows() const {
+  return numRows_;
+}
+
+template <typename T>
+int SparseMatrix<T>::cols() const {
+  return numCols_;
+}
+
+template <typename T>
+size_t SparseMatrix<T>::nonZeros() const {
+  return values_.size();
+}
+
+template <typename T>
+void SparseMatrix<T>::add(const int &row, const int &col, const T &value) {
+  rowBuffer_.push_back(row);
+  colBuffer_.push_back(col);
+  valueBuffer_.push_back(value);
+  // the buffer doesn't exceed the size of the compressed storage,
+  // so that duplicate elements don't use too much memory
+  if (valueBuffer_.size() >= std::max(minBufferSize_, values_.size())) {
+    compress();
+  }
+}
+
+template <typename T>
+void SparseMatrix<T>::compress() {
+  if (valueBuffer_.empty()) {
+    return;
+  }
+
+  // sort the buffer by row, and then by column
+  std::vector<size_t> order(valueBuffer_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](const size_t &a, const size_t &b) {
+    return std::tie(rowBuffer_[a], colBuffer_[a]) <
+           std::tie(rowBuffer_[b], colBuffer_[b]);
+  });
+
+  std::vector<size_t> newRowPointers(numRows_ + 1, 0);
+  std::vector<int> newColIndices;
+  std::vector<T> newValues;
+  newColIndices.reserve(values_.size() + valueBuffer_.size());
+  newValues.reserve(values_.size() + valueBuffer_.size());
+
+  // merge, row by row, the sorted buffer with the stored elements
+  size_t iBuffer = 0;
+  for (int row = 0; row < numRows_; row++) {
+    size_t k = rowPointers_[row];
+    size_t kEnd = rowPointers_[row + 1];
+    while (k < kEnd ||
+           (iBuffer < order.size() && rowBuffer_[order[iBuffer]] == row)) {
+      int col;
+      T x;
+      bool fromBuffer =
+          iBuffer < order.size() && rowBuffer_[order[iBuffer]] == row &&
+          (k == kEnd || colBuffer_[order[iBuffer]] < colIndices_[k]);
+      if (fromBuffer) {
+        col = colBuffer_[order[iBuffer]];
+        x = valueBuffer_[order[iBuffer]];
+        iBuffer++;
+      } else {
+        col = colIndices_[k];
+        x = values_[k];
+        k++;
+      }
+      if (!newColIndices.empty() && newRowPointers[row] < newValues.size() &&
+          newColIndices.back() == col) {
+        newValues.back() += x;
+      } else {
+        newColIndices.push_back(col);
+        newValues.push_back(x);
+      }
+    }
+    newRowPointers[row + 1] = newValues.size();
+  }
+
+  rowPointers_ = newRowPointers;
+  colIndices_ = newColIndices;
+  values_ = newValues;
+
+  // free the memory of the buffer
+  std::vector<int>().swap(rowBuffer_);
+  std::vector<int>().swap(colBuffer_);
+  std::vector<T>().swap(valueBuffer_);
+}
+
+template <typename T>
+void SparseMatrix<T>::drop(const double &threshold) {
+  compress();
+  size_t numKept = 0;
+  size_t kBegin = 0;
+  for (int row = 0; row < numRows_; row++) {
+    size_t kEnd = rowPointers_[row + 1];
+    for (size_t k = kBegin; k < kEnd; k++) {
+      if (std::abs(values_[k]) > threshold) {
+        colIndices_[numKept] = colIndices_[k];
+        values_[numKept] = values_[k];
+        numKept++;
+      }
+    }
+    kBegin = kEnd;
+    rowPointers_[row + 1] = numKept;
+  }
+  colIndices_.resize(numKept);
+  values_.resize(numKept);
+  colIndices_.shrink_to_fit();
+  values_.shrink_to_fit();
+}
+
+template <typename T>
+void SparseMatrix<T>::symmetrize() {
+  compress();
+  if (numRows_ != numCols_) {
+    return;
+  }
+  for (int row = 0; row < numRows_; row++) {
+    for (size_t k = rowPointers_[row]; k < rowPointers_[row + 1]; k++) {
+      values_[k] *= 0.5;
+      if (colIndices_[k] != row) {
+        rowBuffer_.push_back(colIndices_[k]);
+        colBuffer_.push_back(row);
+        valueBuffer_.push_back(values_[k]);
+      }
+    }
+  }
+  compress();
+  // restore the diagonal elements, which have been halved
+  for (int row = 0; row < numRows_; row++) {
+    for (size_t k = rowPointers_[row]; k < rowPointers_[row + 1]; k++) {
+      if (colIndices_[k] == row) {
+        values_[k] *= 2.;
+      }
+    }
+  }
+}
+
+template <typename T>
+size_t SparseMatrix<T>::rowBegin(const int &row) const {
+  return rowPointers_[row];
+}
+
+template <typename T>
+int SparseMatrix<T>::colIndex(const size_t &k) const {
+  return colIndices_[k];
+}
+
+template <typename T>
+T &SparseMatrix<T>::value(const size_t &k) {
+  return values_[k];
+}
+
+template <typename T>
+const T &SparseMatrix<T>::value(const size_t &k) const {
+  return values_[k];
+}
+
+#endif
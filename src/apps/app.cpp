@@ -6,11 +6,17 @@
 #include "elph_plot_app.h"
 #include "elph_qe_to_phoebe_app.h"
 #include "exceptions.h"
+#include "io.h"
 #include "lifetimes_app.h"
 #include "phonon_transport_app.h"
 #include "transport_epa_app.h"
 #include "ph_el_lifetimes.h"
+#include "common_kokkos.h"
+#include "mpiHelper.h"
+#include "utilities.h"
+#include <algorithm>
 #include <cmath>
+#include <iomanip>
 #include <string>
 
 // app factory
@@ -134,3 +140,91 @@ void App::throwWarningIfUnset(const std::string &x, const std::string &name) {
     Warning("Input variable " + name + " hasn't been found in input");
   }
 }
+
+void App::printDryRunReport(
+    Context &context, BaseBandStructure &bandStructure,
+    const int &numCalculations,
+    const std::vector<std::pair<std::string, double>> &deviceMemory,
+    const double &builderTime) {
+
+  // the estimates also go in the performance report, e.g. for scaling studies
+  Profiler::recordValue("dryRunBuilderTime", builderTime);
+  Profiler::recordValue("dryRunNumStates",
+                        double(bandStructure.irrStateIterator().size()));
+
+  // the memory used so far, e.g. by the band structure and the couplings
+  // (this is collective, and prints its own summary)
+  memoryUsage();
+
+  if (!mpi->mpiHead()) return;
+
+  const double gigabyte = pow(1024., 3);
+  int numProcesses = mpi->getSize();
+  auto numStates = double(bandStructure.irrStateIterator().size());
+  double matSize = context.getUseSymmetries() ? 3. * numStates : numStates;
+
+  std::cout << "\n" << std::string(80, '-') << "\n\n"
+            << "Dry run: estimate of the resources of the calculation, with "
+            << numProcesses << " MPI processes.\n" << std::endl;
+  std::cout << std::setprecision(4);
+  std::cout << "Number of states in the BTE: " << numStates << "\n";
+  std::cout << "Number of temperatures/chemical potentials: "
+            << numCalculations << "\n" << std::endl;
+
+  if (context.getScatteringMatrixInMemory()) {
+    double matrixMemory = matSize * matSize * sizeof(double) / gigabyte;
+    if (context.getSparseScatteringMatrix()) {
+      std::cout << "Sparse scattering matrix: the memory depends on the "
+                   "elements dropped, at most "
+                << matrixMemory * 1.5 / numProcesses
+                << " GB per process (values and column indices).\n";
+    } else {
+      std::cout << "Scattering matrix: " << matrixMemory << " GB, "
+                << matrixMemory / numProcesses << " GB per process.\n";
+      std::vector<std::string> solvers = context.getSolverBTE();
+      if (std::find(solvers.begin(), solvers.end(), "relaxons") !=
+          solvers.end()) {
+        std::cout << "The relaxons solver needs as much memory again for "
+                     "the eigenvectors.\n";
+      }
+      if (context.getScatteringMatrixOnDevice()) {
+        std::cout << "The local block of the matrix is also copied to the "
+                     "device, if it fits.\n";
+      }
+    }
+    if (numCalculations > 1) {
+      std::cout << "The matrix is built and stored for one temperature/"
+                   "chemical potential at a time.\n";
+    }
+  } else {
+    std::cout << "The scattering matrix is not stored in memory.\n";
+  }
+  // one vector of the BTE, i.e. a population or a drift term, with
+  // three cartesian components for each state and each calculation
+  double vectorMemory =
+      3. * numStates * numCalculations * sizeof(double) / gigabyte;
+  std::cout << "Each population vector: " << vectorMemory
+            << " GB per process (the solvers use a few of them).\n"
+            << std::endl;
+
+  for (const auto &it : deviceMemory) {
+    std::cout << "Device memory of the " << it.first << ": "
+              << it.second / gigabyte << " GB per process.\n";
+  }
+  std::cout << "Device memory available: "
+            << kokkosDeviceMemory->getTotalMemory() / gigabyte
+            << " GB per process.\n" << std::endl;
+
+  std::cout << "Estimated time to build the scattering "
+            << (context.getScatteringMatrixInMemory() ? "matrix" : "rates")
+            << ": " << builderTime << " s (" << builderTime / 3600.
+            << " h),\nextrapolated from " << numDryRunPairs
+            << " wavevector pairs per process.\n";
+  if (!context.getScatteringMatrixInMemory() &&
+      !context.getSolverBTE().empty()) {
+    std::cout << "Without the scattering matrix in memory, each iteration "
+                 "of the exact solvers\ntakes about as long.\n";
+  }
+  std::cout << "\nDry run completed, exiting.\n" << std::endl;
+  std::cout << std::resetiosflags(std::cout.flags());
+}
@@ -56,6 +56,25 @@ protected:
                          const std::string &name);
 
   static void throwWarningIfUnset(const std::string &x, const std::string &name);
+
+  /** Prints the resources estimated by the dry run of a transport app
+   * (see the dryRun input variable). Must be called by all MPI processes.
+   * @param context: object with the user input.
+   * @param bandStructure: the band structure used by the BTE.
+   * @param numCalculations: number of temperatures/chemical potentials.
+   * @param deviceMemory: pairs of (name, bytes) with the memory of the
+   * tensors stored on the Kokkos device by each MPI process.
+   * @param builderTime: estimate of the time in seconds needed to build the
+   * scattering matrix (or the linewidths) for all the calculations.
+   */
+  static void printDryRunReport(
+      Context &context, BaseBandStructure &bandStructure,
+      const int &numCalculations,
+      const std::vector<std::pair<std::string, double>> &deviceMemory,
+      const double &builderTime);
+
+  // number of wavevector pairs per MPI process timed by the dry run
+  static const int numDryRunPairs = 4;
 };
 
 #endif
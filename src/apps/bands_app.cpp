@@ -1,6 +1,7 @@
 #include "bands_app.h"
 #include "constants.h"
 #include "eigen.h"
+#include "hdf5_output.h"
 #include "mpiHelper.h"
 #include "points.h"
 #include "parser.h"
@@ -8,12 +9,18 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <nlohmann/json.hpp>
 
-// forward declare this helper function, so we can leave the important
+// forward declare these helper functions, so we can leave the important
 // run functions at the top
+bool distributeBands(Context &context);
+void outputBands(FullBandStructure &fullBandStructure, Context &context,
+                 Points &pathPoints, const std::string &outFileName);
 void outputBandsToJSON(FullBandStructure &fullBandStructure, Context &context,
                        Points &pathPoints, std::string outFileName);
+void outputBandsToHDF5(FullBandStructure &fullBandStructure, Context &context,
+                       Points &pathPoints, const std::string &outFileName);
 
 /* --------------------- PhononBandsApp ------------------------------ */
 void PhononBandsApp::run(Context &context) {
@@ -31,12 +38,11 @@ void PhononBandsApp::run(Context &context) {
   Points pathPoints(crystal, context.getPathExtrema(), context.getDeltaPath());
   bool withVelocities = false;
   bool withEigenvectors = context.getOutputEigendisplacements();
-  FullBandStructure fullBandStructure =
-      phononH0.populate(pathPoints, withVelocities, withEigenvectors);
+  FullBandStructure fullBandStructure = phononH0.populate(
+      pathPoints, withVelocities, withEigenvectors, distributeBands(context));
 
   // arguments: bandStructure, context, pathPoints, outputFileName
-  outputBandsToJSON(fullBandStructure, context, pathPoints,
-                    "phonon_bands.json");
+  outputBands(fullBandStructure, context, pathPoints, "phonon_bands.json");
 
   if (mpi->mpiHead()) {
     std::cout << "Finishing phonon bands calculation" << std::endl;
@@ -60,12 +66,11 @@ void ElectronWannierBandsApp::run(Context &context) {
 
   bool withVelocities = false;
   bool withEigenvectors = false;
-  FullBandStructure fullBandStructure =
-      electronH0.populate(pathPoints, withVelocities, withEigenvectors);
+  FullBandStructure fullBandStructure = electronH0.populate(
+      pathPoints, withVelocities, withEigenvectors, distributeBands(context));
 
   // arguments: bandStructure, context, pathPoints, outputFileName
-  outputBandsToJSON(fullBandStructure, context, pathPoints,
-                    "electron_bands.json");
+  outputBands(fullBandStructure, context, pathPoints, "electron_bands.json");
 
   if (mpi->mpiHead()) {
     std::cout << "Finishing electron (Wannier) bands calculation" << std::endl;
@@ -88,12 +93,11 @@ void ElectronFourierBandsApp::run(Context &context) {
 
   bool withVelocities = false;
   bool withEigenvectors = false;
-  FullBandStructure fullBandStructure =
-      electronH0.populate(pathPoints, withVelocities, withEigenvectors);
+  FullBandStructure fullBandStructure = electronH0.populate(
+      pathPoints, withVelocities, withEigenvectors, distributeBands(context));
 
   // arguments: bandStructure, context, pathPoints, outputFileName
-  outputBandsToJSON(fullBandStructure, context, pathPoints,
-                    "electron_bands.json");
+  outputBands(fullBandStructure, context, pathPoints, "electron_bands.json");
 
   if (mpi->mpiHead()) {
     std::cout << "Finishing electron (Fourier) bands calculation" << std::endl;
@@ -108,28 +112,11 @@ namespace std {
   }
 }
 
-/* helper function to output bands to a json file */
-void outputBandsToJSON(FullBandStructure &fullBandStructure, Context &context,
-                       Points &pathPoints, std::string outFileName) {
-
-  if (!mpi->mpiHead())
-    return;
-
-  std::vector<std::vector<double>> outEnergies;
-  std::vector<int> wavevectorIndices;
-  std::vector<double> tempEns;
-  std::vector<std::vector<std::vector<std::vector<std::complex<double>>>>> eigendisplacements;
-  std::vector<std::vector<double>> vecCrystal;
-  std::vector<std::vector<double>> vecAtomPos;
-  std::vector<std::vector<double>> pathCoordinates;
-  auto particle = fullBandStructure.getParticle();
-  // mev for phonons
-  double energyConversion = particle.isPhonon() ? 1000*energyRyToEv : energyRyToEv;
-  int numBands = fullBandStructure.getNumBands();
-
-  // determine path extrema to output to json
-  std::vector<std::vector<double>> extremaCoordinates;
-  std::vector<int> pathLabelIndices;
+/* helper function to find the coordinates of the path extrema, and the
+ * indices of the path points at the high symmetry points */
+void findHighSymPoints(Context &context, Points &pathPoints,
+                       std::vector<std::vector<double>> &extremaCoordinates,
+                       std::vector<int> &pathLabelIndices) {
   Eigen::Tensor<double, 3> pathExtrema = context.getPathExtrema();
   auto numExtrema = pathExtrema.dimensions();
   for (int pe = 0; pe < numExtrema[0]; pe++) {
@@ -140,19 +127,11 @@ void outputBandsToJSON(FullBandStructure &fullBandStructure, Context &context,
         {pathExtrema(pe, 1, 0), pathExtrema(pe, 1, 1), pathExtrema(pe, 1, 2)});
   }
 
-  // store the wavevector indices, wavevectors and high sym point indices
+  auto pathLabels = context.getPathLabels();
   unsigned int extremaCount =
       0; // keeps track of how many high sym points we've found
   for (int ik = 0; ik < pathPoints.getNumPoints(); ik++) {
-
-    // store wavevector indices
-    wavevectorIndices.push_back(ik);
-    auto ikIndex = WavevectorIndex(ik);
-
-    // store the path coordinates
     auto coord = pathPoints.getPointCoordinates(ik);
-    pathCoordinates.push_back({coord[0], coord[1], coord[2]});
-    auto pathLabels = context.getPathLabels();
     // check if this point is one of the high sym points,
     // and if it is, save the index
     if ( abs(coord[0] - extremaCoordinates[extremaCount][0]) < 1e-8 &&
@@ -178,6 +157,68 @@ void outputBandsToJSON(FullBandStructure &fullBandStructure, Context &context,
         }
       }
     }
+  }
+}
+
+/* with the HDF5 output, and parallel HDF5, the band structure is distributed
+ * over the MPI processes, each writing its own wavevectors. The json output
+ * needs all the band structure on the head process. */
+bool distributeBands(Context &context) {
+#if defined(HDF5_AVAIL) && defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+  return context.getBandsFormat() == "hdf5";
+#else
+  (void) context;
+  return false;
+#endif
+}
+
+/* helper function to output bands in the formats requested by the user */
+void outputBands(FullBandStructure &fullBandStructure, Context &context,
+                 Points &pathPoints, const std::string &outFileName) {
+  std::string format = context.getBandsFormat();
+  if (format == "json" || format == "both") {
+    outputBandsToJSON(fullBandStructure, context, pathPoints, outFileName);
+  }
+  if (format == "hdf5" || format == "both") {
+    outputBandsToHDF5(fullBandStructure, context, pathPoints,
+                      getHDF5OutputFileName(outFileName));
+  }
+}
+
+/* helper function to output bands to a json file */
+void outputBandsToJSON(FullBandStructure &fullBandStructure, Context &context,
+                       Points &pathPoints, std::string outFileName) {
+
+  if (!mpi->mpiHead())
+    return;
+
+  std::vector<std::vector<double>> outEnergies;
+  std::vector<int> wavevectorIndices;
+  std::vector<double> tempEns;
+  std::vector<std::vector<std::vector<std::vector<std::complex<double>>>>> eigendisplacements;
+  std::vector<std::vector<double>> vecCrystal;
+  std::vector<std::vector<double>> vecAtomPos;
+  std::vector<std::vector<double>> pathCoordinates;
+  auto particle = fullBandStructure.getParticle();
+  // mev for phonons
+  double energyConversion = particle.isPhonon() ? 1000*energyRyToEv : energyRyToEv;
+  int numBands = fullBandStructure.getNumBands();
+
+  // determine path extrema to output to json
+  std::vector<std::vector<double>> extremaCoordinates;
+  std::vector<int> pathLabelIndices;
+  findHighSymPoints(context, pathPoints, extremaCoordinates, pathLabelIndices);
+
+  // store the wavevector indices and wavevectors
+  for (int ik = 0; ik < pathPoints.getNumPoints(); ik++) {
+
+    // store wavevector indices
+    wavevectorIndices.push_back(ik);
+    auto ikIndex = WavevectorIndex(ik);
+
+    // store the path coordinates
+    auto coord = pathPoints.getPointCoordinates(ik);
+    pathCoordinates.push_back({coord[0], coord[1], coord[2]});
 
     // store the energies
     Eigen::VectorXd energies = fullBandStructure.getEnergies(ikIndex);
@@ -260,6 +301,162 @@ void outputBandsToJSON(FullBandStructure &fullBandStructure, Context &context,
   o.close();
 }
 
+/* helper function to output bands to a HDF5 file, with the same content
+ * of the json file. With parallel HDF5, each MPI process writes the
+ * wavevectors of the band structure it holds */
+void outputBandsToHDF5(FullBandStructure &fullBandStructure, Context &context,
+                       Points &pathPoints, const std::string &outFileName) {
+#ifndef HDF5_AVAIL
+  (void) fullBandStructure;
+  (void) context;
+  (void) pathPoints;
+  (void) outFileName;
+  Error("The HDF5 output of the bands requires Phoebe built with HDF5.");
+#else
+  Kokkos::Profiling::pushRegion("outputBandsToHDF5");
+
+  auto particle = fullBandStructure.getParticle();
+  // mev for phonons
+  double energyConversion = particle.isPhonon() ? 1000*energyRyToEv : energyRyToEv;
+  auto numBands = size_t(fullBandStructure.getNumBands());
+  auto numAtoms = numBands / 3;
+  auto numPoints = size_t(pathPoints.getNumPoints());
+  bool withEigendisplacements =
+      context.getOutputEigendisplacements() && particle.isPhonon();
+  bool head = mpi->mpiHead();
+
+  std::vector<std::vector<double>> extremaCoordinates;
+  std::vector<int> pathLabelIndices;
+  findHighSymPoints(context, pathPoints, extremaCoordinates, pathLabelIndices);
+
+  // the wavevectors of a distributed band structure are split in contiguous
+  // blocks, one for each process. If not distributed, the head writes all
+  std::vector<int> localPoints;
+  if (fullBandStructure.getIsDistributed() || head) {
+    localPoints = fullBandStructure.getWavevectorIndices();
+  }
+  size_t firstPoint = localPoints.empty() ? 0 : size_t(localPoints[0]);
+  auto numLocalPoints = size_t(localPoints.size());
+
+  std::vector<int> wavevectorIndices(numLocalPoints);
+  std::vector<double> pathCoordinates(3 * numLocalPoints);
+  std::vector<double> energies(numLocalPoints * numBands);
+  std::vector<std::complex<double>> eigendisplacements;
+  if (withEigendisplacements) {
+    eigendisplacements.resize(numLocalPoints * numBands * numAtoms * 3);
+  }
+#pragma omp parallel for default(none) shared(localPoints, numLocalPoints, pathPoints, fullBandStructure, wavevectorIndices, pathCoordinates, energies, eigendisplacements, numBands, numAtoms, energyConversion, withEigendisplacements)
+  for (size_t i = 0; i < numLocalPoints; i++) {
+    int ik = localPoints[i];
+    wavevectorIndices[i] = ik;
+    auto coord = pathPoints.getPointCoordinates(ik);
+    for (int iDim : {0, 1, 2}) {
+      pathCoordinates[3 * i + iDim] = coord[iDim];
+    }
+    auto ikIndex = WavevectorIndex(ik);
+    Eigen::VectorXd ens = fullBandStructure.getEnergies(ikIndex);
+    for (size_t ib = 0; ib < numBands; ib++) {
+      energies[i * numBands + ib] = ens(ib) * energyConversion;
+    }
+    if (withEigendisplacements) {
+      Eigen::Tensor<std::complex<double>, 3> eigendisps =
+          fullBandStructure.getPhEigenvectors(ikIndex);
+      for (size_t ib = 0; ib < numBands; ib++) {
+        for (size_t iat = 0; iat < numAtoms; iat++) {
+          for (size_t iDim = 0; iDim < 3; iDim++) {
+            size_t j = ((i * numBands + ib) * numAtoms + iat) * 3 + iDim;
+            eigendisplacements[j] =
+                eigendisps(iDim, iat, ib) * distanceBohrToAng;
+          }
+        }
+      }
+    }
+  }
+
+  // small datasets, written by the head process
+  std::vector<double> extremaBuffer, latticeVectors, atomPositions;
+  std::vector<int> labelIndicesBuffer;
+  if (head) {
+    for (const auto &x : extremaCoordinates) {
+      extremaBuffer.insert(extremaBuffer.end(), x.begin(), x.end());
+    }
+    labelIndicesBuffer = pathLabelIndices;
+    if (withEigendisplacements) {
+      Crystal crystal = fullBandStructure.getPoints().getCrystal();
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+          latticeVectors.push_back(crystal.getDirectUnitCell()(i, j) *
+                                   distanceBohrToAng);
+        }
+      }
+      for (size_t iat = 0; iat < numAtoms; iat++) {
+        for (int iDim = 0; iDim < 3; iDim++) {
+          atomPositions.push_back(crystal.getAtomicPositions()(iat, iDim) *
+                                  distanceBohrToAng);
+        }
+      }
+    }
+  }
+
+  try {
+    std::unique_ptr<HighFive::File> file;
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+    file = std::make_unique<HighFive::File>(
+        outFileName, HighFive::File::Overwrite,
+        HighFive::MPIOFileDriver(mpi->getComm(), MPI_INFO_NULL));
+#else
+    if (head) {
+      file = std::make_unique<HighFive::File>(outFileName,
+                                              HighFive::File::Overwrite);
+    }
+#endif
+    if (file != nullptr) {
+      writeHDF5Slice(*file, "/wavevectorIndices", {numPoints}, {firstPoint},
+                     {numLocalPoints}, wavevectorIndices);
+      writeHDF5Slice(*file, "/wavevectorCoordinates", {numPoints, 3},
+                     {firstPoint, 0}, {numLocalPoints, 3}, pathCoordinates);
+      writeHDF5String(*file, "/highSymLabels", context.getPathLabels(), head);
+      auto numLabels = size_t(pathLabelIndices.size());
+      writeHDF5Slice(*file, "/highSymIndices", {numLabels}, {0}, {numLabels},
+                     labelIndicesBuffer);
+      auto numExtrema = size_t(extremaCoordinates.size());
+      writeHDF5Slice(*file, "/highSymCoordinates", {numExtrema, 3}, {0, 0},
+                     {numExtrema, 3}, extremaBuffer);
+      std::vector<int> numBandsBuffer;
+      if (head) numBandsBuffer.push_back(int(numBands));
+      writeHDF5Slice(*file, "/numBands", {1}, {0}, {1}, numBandsBuffer);
+      writeHDF5Slice(*file, "/energies", {numPoints, numBands}, {firstPoint, 0},
+                     {numLocalPoints, numBands}, energies);
+      writeHDF5String(*file, "/particleType",
+                      particle.isPhonon() ? "phonon" : "electron", head);
+      writeHDF5String(*file, "/energyUnit",
+                      particle.isPhonon() ? "meV" : "eV", head);
+      writeHDF5String(*file, "/coordsType", "lattice", head);
+      if (withEigendisplacements) {
+        writeHDF5Slice(*file, "/phononEigendisplacements",
+                       {numPoints, numBands, numAtoms, 3},
+                       {firstPoint, 0, 0, 0},
+                       {numLocalPoints, numBands, numAtoms, 3},
+                       eigendisplacements);
+        writeHDF5String(*file, "/coordsTypePhononEigendisplacements",
+                        "cartesian", head);
+        writeHDF5Slice(*file, "/latticeVectors", {3, 3}, {0, 0}, {3, 3},
+                       latticeVectors);
+        writeHDF5String(*file, "/distanceUnit", "Angstrom", head);
+        writeHDF5Slice(*file, "/atomPositionsCartesian", {numAtoms, 3},
+                       {0, 0}, {numAtoms, 3}, atomPositions);
+        writeHDF5String(*file, "/atomSpecies",
+                        fullBandStructure.getPoints().getCrystal()
+                            .getAtomicNames(), head);
+      }
+    }
+  } catch (std::exception &error) {
+    Error("Issue writing the bands to " + outFileName);
+  }
+  Kokkos::Profiling::popRegion();
+#endif
+}
+
 void PhononBandsApp::checkRequirements(Context &context) {
   throwErrorIfUnset(context.getPhFC2FileName(), "PhFC2FileName");
   throwErrorIfUnset(context.getPathExtrema(), "points path extrema");
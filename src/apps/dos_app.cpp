@@ -131,6 +131,7 @@ std::tuple<std::vector<double>, std::vector<double>> calcDOS(
 
   // Form tetrahedra and fill them with eigenvalues
   TetrahedronDeltaFunction tetrahedra(fullBandStructure);
+  tetrahedra.precomputeTetrahedra();
 
   double minEnergy = context.getDosMinEnergy();
   double maxEnergy = context.getDosMaxEnergy();
@@ -151,11 +152,9 @@ std::tuple<std::vector<double>, std::vector<double>> calcDOS(
   }
 
   // Calculate phonon density of states (DOS) [1/Ry]
-  std::vector<double> dos(workFraction, 0.);  // DOS initialized to zero
-#pragma omp parallel for default(none) shared(workFraction,tetrahedra,dos,energies)
-  for (int i = 0; i < workFraction; i++) {
-    dos[i] += tetrahedra.getDOS(energies[i]);
-  }
+  // with a single sweep over the tetrahedra, for the energies of this process
+  std::vector<double> dos = tetrahedra.getDOS(
+      double(start) * deltaEnergy + minEnergy, deltaEnergy, workFraction);
 
   std::vector<double> dosTotal;
   std::vector<double> eneTotal;
@@ -5,13 +5,31 @@
 #include "el_scattering.h"
 #include "electron_viscosity.h"
 #include "exceptions.h"
+#include "io.h"
 #include "observable.h"
+#include "observables_pass.h"
 #include "onsager.h"
 #include "parser.h"
+#include "solver_checkpoint.h"
+#include "solver_helpers.h"
 #include "wigner_electron.h"
+#include <deque>
+#include <memory>
 
 void ElectronWannierTransportApp::run(Context &context) {
 
+  // with only the RTA solver, the off-diagonal part of the scattering
+  // matrix is never used: we only compute and store the linewidths.
+  // The flag is restored when the app returns
+  bool onlyRTA =
+      context.getSolverBTE().empty() && context.getScatteringMatrixInMemory();
+  ScatteringMatrixInMemoryScope inMemoryScope(
+      context, context.getScatteringMatrixInMemory() && !onlyRTA);
+  if (onlyRTA && mpi->mpiHead()) {
+    std::cout << "Only the RTA solver is requested: the scattering matrix "
+                 "will not be stored in memory.\n" << std::endl;
+  }
+
   Kokkos::Profiling::pushRegion("ETapp.parseHamiltonians");
   auto t2 = Parser::parsePhHarmonic(context);
   auto crystal = std::get<0>(t2);
@@ -31,16 +49,36 @@ void ElectronWannierTransportApp::run(Context &context) {
     couplingElPh = InteractionElPhWan::parse(context, crystal, &phononH0);
   }
   Kokkos::Profiling::popRegion();
+  Profiler::recordHostMemory("parsing");
 
   // compute the band structure on the fine grid
   if (mpi->mpiHead()) {
     std::cout << "\nComputing electronic band structure." << std::endl;
   }
+  if (context.getUseKramersPairs() && !context.getHasSpinOrbit()) {
+    Error("useKramersPairs requires a calculation with spin-orbit coupling");
+  }
   Kokkos::Profiling::pushRegion("ETapp.setupElBandstructure");
   Points fullPoints(crystal, context.getKMesh());
   auto t3 = ActiveBandStructure::builder(context, electronH0, fullPoints);
-  auto bandStructure = std::get<0>(t3);
   auto statisticsSweep = std::get<1>(t3);
+  // with Kramers pairs, std::get<0>(t3) keeps the single bands, from which
+  // the pairs take their eigenvectors
+  ActiveBandStructure bandStructure = context.getUseKramersPairs()
+                                          ? std::get<0>(t3).buildKramersPairs()
+                                          : std::get<0>(t3);
+  std::unique_ptr<HasSpinOrbitScope> spinOrbitScope;
+  if (context.getUseKramersPairs()) {
+    // the chemical potentials are already set: from now on, each pair counts
+    // as a spin-degenerate state in the transport coefficients. The Context
+    // is restored when the app returns
+    spinOrbitScope = std::make_unique<HasSpinOrbitScope>(context, false);
+    if (mpi->mpiHead()) {
+      std::cout << "Kramers pairs reduced electronic band structure from "
+                << std::get<0>(t3).getNumStates() << " to "
+                << bandStructure.getNumStates() << " states." << std::endl;
+    }
+  }
   Kokkos::Profiling::popRegion();
 
   // print some info about how window and symmetries have reduced things
@@ -57,6 +95,20 @@ void ElectronWannierTransportApp::run(Context &context) {
     }
     std::cout << "Done computing electronic band structure.\n" << std::endl;
   }
+  Profiler::recordHostMemory("band structure");
+
+  // in a dry run, we only estimate memory and time of the el-ph scattering
+  if (context.getDryRun()) {
+    std::vector<std::pair<std::string, double>> deviceMemory = {
+        {"electron-phonon coupling", couplingElPh.getDeviceMemoryUsage()}};
+    ElScatteringMatrix sampleMatrix(context, statisticsSweep, bandStructure,
+                                    bandStructure, phononH0, &couplingElPh);
+    double builderTime = sampleMatrix.estimateBuilderTime(numDryRunPairs);
+    printDryRunReport(context, bandStructure,
+                      statisticsSweep.getNumCalculations(), deviceMemory,
+                      builderTime);
+    return;
+  }
 
   // Old code for using all the band structure
   //  bool withVelocities = true;
@@ -71,7 +123,10 @@ void ElectronWannierTransportApp::run(Context &context) {
   ElScatteringMatrix scatteringMatrix(context, statisticsSweep, bandStructure,
                                       bandStructure, phononH0, &couplingElPh);
   scatteringMatrix.setup();
-  scatteringMatrix.outputToJSON("rta_el_relaxation_times.json");
+  scatteringMatrix.outputRelaxationTimes("rta_el_relaxation_times.json");
+  if (context.getCoupledPhElLinewidths()) {
+    scatteringMatrix.outputPhElToJSON("coupled_rta_phel_relaxation_times.json");
+  }
   Kokkos::Profiling::popRegion();
 
   // solve the BTE at the relaxation time approximation level
@@ -94,17 +149,34 @@ void ElectronWannierTransportApp::run(Context &context) {
   VectorBTE nERTA = -driftE * relaxationTimes;
   VectorBTE nTRTA = -driftT * relaxationTimes;
 
-  // compute the electrical conductivity
+  // compute the Onsager coefficients and the specific heat
+  // with a single pass over the band structure
   OnsagerCoefficients transportCoefficients(statisticsSweep, crystal, bandStructure, context);
-  transportCoefficients.calcFromPopulation(nERTA, nTRTA);
+  SpecificHeat specificHeat(context, statisticsSweep, crystal, bandStructure);
+  ObservablesPass observablesPass(statisticsSweep, bandStructure);
+  observablesPass.add(transportCoefficients, nERTA, nTRTA);
+  observablesPass.add(specificHeat);
+
+  // the Wigner transport coefficients reuse the same accumulation
+  std::unique_ptr<WignerElCoefficients> wignerCoefficients;
+  if (context.getWignerCorrection()) {
+    wignerCoefficients = std::make_unique<WignerElCoefficients>(
+        statisticsSweep, crystal, bandStructure, context, relaxationTimes);
+    observablesPass.add(*wignerCoefficients, nERTA, nTRTA);
+  }
+  observablesPass.calc();
+
   transportCoefficients.print();
   transportCoefficients.outputToJSON("rta_onsager_coefficients.json");
+  if (context.getSpectralTransportBins() > 0) {
+    transportCoefficients.outputSpectralToJSON(
+        "rta_onsager_coefficients_spectral.json");
+  }
 
-  // compute the Wigner transport coefficients
-  WignerElCoefficients wignerCoefficients(statisticsSweep, crystal, bandStructure, context, relaxationTimes);
-  wignerCoefficients.calcFromPopulation(nERTA, nTRTA);
-  wignerCoefficients.print();
-  wignerCoefficients.outputToJSON("rta_wigner_coefficients.json");
+  if (wignerCoefficients != nullptr) {
+    wignerCoefficients->print();
+    wignerCoefficients->outputToJSON("rta_wigner_coefficients.json");
+  }
 
   // compute the electron viscosity
   ElectronViscosity elViscosity(context, statisticsSweep, crystal, bandStructure);
@@ -112,11 +184,9 @@ void ElectronWannierTransportApp::run(Context &context) {
   elViscosity.print();
   elViscosity.outputToJSON("rta_electron_viscosity.json");
 
-  // compute the specific heat
-  SpecificHeat specificHeat(context, statisticsSweep, crystal, bandStructure);
-  specificHeat.calc();
   specificHeat.print();
   specificHeat.outputToJSON("el_specific_heat.json");
+  Profiler::recordHostMemory("RTA output");
 
   if (mpi->mpiHead()) {
     std::cout << "\n" << std::string(80, '-') << "\n" << std::endl;
@@ -136,11 +206,14 @@ void ElectronWannierTransportApp::run(Context &context) {
   std::vector<std::string> solverBTE = context.getSolverBTE();
 
   bool doIterative = false;
+  bool doAnderson = false;
   bool doVariational = false;
   bool doRelaxons = false;
   for (const std::string &s : solverBTE) {
     if (s.compare("iterative") == 0)
       doIterative = true;
+    if (s.compare("anderson") == 0)
+      doAnderson = true;
     if (s.compare("variational") == 0)
       doVariational = true;
     if (s.compare("relaxons") == 0)
@@ -163,16 +236,9 @@ void ElectronWannierTransportApp::run(Context &context) {
     // or may require some modifications to make it work
     // that we didn't have yet thought of
   }
-  if (doVariational && context.getUseSymmetries()) {
-    Error("Variational solver only works without symmetries");
-    // Note: this is a problem of the theory I suppose
-    // because the scattering matrix may not be anymore symmetric
-    // or may require some modifications to make it work
-    // that we didn't yet think of
-  }
 
   if (context.getScatteringMatrixInMemory() && !context.getUseSymmetries()) {
-    if (doVariational || doRelaxons || doIterative) {
+    if (doVariational || doRelaxons || doIterative || doAnderson) {
       if ( context.getSymmetrizeMatrix() ) {
         // reinforce the condition that the scattering matrix is symmetric
         // A -> ( A^T + A ) / 2
@@ -181,15 +247,54 @@ void ElectronWannierTransportApp::run(Context &context) {
       }
     }
   }
+  if (context.getScatteringMatrixInMemory() &&
+      context.getScatteringMatrixPrecision() == "single") {
+    // the solvers only need products with the matrix, which can be done
+    // with the matrix stored in single precision
+    if (doRelaxons) {
+      Warning("The relaxons solver requires the scattering matrix in double"
+              " precision,\nscatteringMatrixPrecision is ignored.");
+    } else {
+      scatteringMatrix.reducePrecision();
+    }
+  }
+  if (context.getScatteringMatrixInMemory() &&
+      context.getScatteringMatrixOnDevice()) {
+    if (doRelaxons) {
+      Warning("The relaxons solver diagonalizes the scattering matrix on the"
+              " host,\nscatteringMatrixOnDevice is ignored.");
+    } else {
+      scatteringMatrix.copyToDevice();
+    }
+  }
+
+  // the symmetrized drift vectors are the same for the iterative and
+  // variational solvers, so we build them only once
+  std::unique_ptr<BulkEDrift> driftESym;
+  std::unique_ptr<BulkTDrift> driftTSym;
+  if (doIterative || doAnderson || doVariational) {
+    driftESym = std::make_unique<BulkEDrift>(statisticsSweep, bandStructure,
+                                             3, true);
+    driftTSym = std::make_unique<BulkTDrift>(statisticsSweep, bandStructure,
+                                             3, true);
+  }
 
   if (doIterative) {
     runIterativeMethod(context, crystal, statisticsSweep, bandStructure,
-                       scatteringMatrix);
+                       scatteringMatrix, *driftESym, *driftTSym);
+  }
+
+  if (doAnderson) {
+    // a handful of previous iterates is enough for the mixing
+    int andersonHistory = 5;
+    runIterativeMethod(context, crystal, statisticsSweep, bandStructure,
+                       scatteringMatrix, *driftESym, *driftTSym,
+                       andersonHistory);
   }
 
   if (doVariational) {
     runVariationalMethod(context, crystal, statisticsSweep, bandStructure,
-                         scatteringMatrix);
+                         scatteringMatrix, *driftESym, *driftTSym);
   }
 
   if (doRelaxons) {
@@ -222,7 +327,18 @@ void ElectronWannierTransportApp::run(Context &context) {
                                            scatteringMatrix);
     transportCoefficients.print();
     transportCoefficients.outputToJSON("relaxons_onsager_coefficients.json");
-    scatteringMatrix.relaxonsToJSON("exact_relaxation_times.json", eigenvalues);
+    scatteringMatrix.outputRelaxonsTimes("exact_relaxation_times.json", eigenvalues);
+
+    if (!context.getACFrequencies().empty()) {
+      if (context.getUseSymmetries()) {
+        Warning("The AC transport coefficients are not computed with "
+                "symmetries.");
+      } else {
+        transportCoefficients.calcACFromRelaxons(eigenvalues, eigenvectors);
+        transportCoefficients.outputACToJSON(
+            "relaxons_onsager_coefficients_ac.json");
+      }
+    }
 
     if (!context.getUseSymmetries()) {
       elViscosity.calcFromRelaxons(eigenvalues, eigenvectors);
@@ -266,11 +382,16 @@ void ElectronWannierTransportApp::checkRequirements(Context &context) {
      (std::isnan(minChemicalPotential) || std::isnan(maxChemicalPotential) || std::isnan(deltaChemicalPotential)))  {
     Error("Either chemical potentials or dopings must be set");
   }
+
+  if (context.getUseKramersPairs() && context.getWignerCorrection()) {
+    Error("useKramersPairs isn't compatible with the Wigner correction");
+  }
 }
 
 void ElectronWannierTransportApp::runVariationalMethod(
     Context &context, Crystal &crystal, StatisticsSweep &statisticsSweep,
-    ActiveBandStructure &bandStructure, ElScatteringMatrix &scatteringMatrix) {
+    ActiveBandStructure &bandStructure, ElScatteringMatrix &scatteringMatrix,
+    BulkEDrift &driftE, BulkTDrift &driftT) {
 
   // here we implement a conjugate gradient solution to Az = b
 
@@ -302,10 +423,10 @@ void ElectronWannierTransportApp::runVariationalMethod(
   preconditioning.setConst(1.);
 
   // symmetrized b vectors
-  BulkEDrift bE(statisticsSweep, bandStructure, 3, true);
-  BulkTDrift bT(statisticsSweep, bandStructure, 3, true);
-  bE.data *= -1.; // because the scattering matrix should have a -1 sign
-  bT.data *= -1.; // and we are solving b = -Af
+  // (with a -1 sign, because the scattering matrix should have a -1 sign
+  // and we are solving b = -Af)
+  VectorBTE bE = -driftE;
+  VectorBTE bT = -driftT;
 
   // populations, initial guess
   VectorBTE zNewE = bE;
@@ -324,13 +445,37 @@ void ElectronWannierTransportApp::runVariationalMethod(
   VectorBTE rE = bE - w0E;
   VectorBTE rT = bT - w0T;
 
+  // A*z, updated at each iteration by linearity, so that each CG step
+  // needs a single product with the scattering matrix
+  VectorBTE azE = w0E;
+  VectorBTE azT = w0T;
+
   // search direction
   VectorBTE dE = rE;
   VectorBTE dT = rT;
 
   double threshold = context.getConvergenceThresholdBTE();
 
-  for (int iter = 0; iter < context.getMaxIterationsBTE(); iter++) {
+  // with symmetries, a single CG coefficient is used for the three
+  // cartesian components, which are mixed by the rotations of the star
+  bool useSymmetries = context.getUseSymmetries();
+
+  // the solver may resume from a checkpoint of a previous run
+  SolverCheckpoint checkpoint(context, "el_variational");
+  checkpoint.add("zE", zE.data);
+  checkpoint.add("zT", zT.data);
+  checkpoint.add("azE", azE.data);
+  checkpoint.add("azT", azT.data);
+  checkpoint.add("residualE", rE.data);
+  checkpoint.add("residualT", rT.data);
+  checkpoint.add("searchDirectionE", dE.data);
+  checkpoint.add("searchDirectionT", dT.data);
+  checkpoint.add("oldElectricalConductivity", elCondOld);
+  checkpoint.add("oldThermalConductivity", thCondOld);
+  int firstIter = checkpoint.load();
+
+  for (int iter = firstIter; iter < context.getMaxIterationsBTE(); iter++) {
+    checkpoint.save(iter);
     // execute CG step, as in
     // https://www.cs.cmu.edu/~quake-papers/painless-conjugate-gradient.pdf
 
@@ -345,61 +490,34 @@ void ElectronWannierTransportApp::runVariationalMethod(
     // amount of descent along the search direction
 //    Eigen::MatrixXd alphaE = (rE.dot(rE)).array() / (dE.dot(wE)).array();
 //    Eigen::MatrixXd alphaT = (rT.dot(rT)).array() / (dT.dot(wT)).array();
-    int numCalculations = statisticsSweep.getNumCalculations();
-    Eigen::MatrixXd alphaE = Eigen::MatrixXd::Zero(numCalculations,3);
-    Eigen::MatrixXd alphaT = Eigen::MatrixXd::Zero(numCalculations,3);
-    {
-      Eigen::MatrixXd numE = rE.dot(rE);
-      Eigen::MatrixXd numT = rT.dot(rT);
-      Eigen::MatrixXd denE = dE.dot(wE);
-      Eigen::MatrixXd denT = dT.dot(wT);
-      for (int iCalc=0; iCalc<numCalculations; iCalc++) {
-        for (int i : {0,1,2}) {
-          if (denE(iCalc,i) != 0.) {
-            alphaE(iCalc, i) = numE(iCalc, i) / denE(iCalc, i);
-          }
-          if (denT(iCalc,i) != 0.) {
-            alphaT(iCalc, i) = numT(iCalc, i) / denT(iCalc, i);
-          }
-        }
-      }
-    }
+    Eigen::MatrixXd alphaE = cgRatio(rE.dot(rE), dE.dot(wE), useSymmetries);
+    Eigen::MatrixXd alphaT = cgRatio(rT.dot(rT), dT.dot(wT), useSymmetries);
 
     // new guess of population
-    zNewE = dE * alphaE + zE;
-    zNewT = dT * alphaT + zT;
+    zNewE = zE;
+    zNewE.axpy(alphaE, dE);
+    zNewT = zT;
+    zNewT.axpy(alphaT, dT);
 
     // new estimate of residual
-    VectorBTE tmpE = wE * alphaE;
-    VectorBTE tmpT = wT * alphaT;
-    VectorBTE rNewE = rE - tmpE;
-    VectorBTE rNewT = rT - tmpT;
+    VectorBTE rNewE = rE;
+    rNewE.axpy(-alphaE, wE);
+    VectorBTE rNewT = rT;
+    rNewT.axpy(-alphaT, wT);
 
     // amount of correction for the search direction
 //    Eigen::MatrixXd betaE = (rNewE.dot(rNewE)).array() / (rE.dot(rE)).array();
 //    Eigen::MatrixXd betaT = (rNewT.dot(rNewT)).array() / (rT.dot(rT)).array();
-    Eigen::MatrixXd betaE = Eigen::MatrixXd::Zero(numCalculations,3);
-    Eigen::MatrixXd betaT = Eigen::MatrixXd::Zero(numCalculations,3);
-    {
-      Eigen::MatrixXd numE = rNewE.dot(rNewE);
-      Eigen::MatrixXd numT = rNewT.dot(rNewT);
-      Eigen::MatrixXd denE = rE.dot(rE);
-      Eigen::MatrixXd denT = rT.dot(rT);
-      for (int iCalc=0; iCalc<numCalculations; iCalc++) {
-        for (int i : {0,1,2}) {
-          if (denE(iCalc,i) != 0.) {
-            betaE(iCalc, i) = numE(iCalc, i) / denE(iCalc, i);
-          }
-          if (denT(iCalc,i) != 0.) {
-            betaT(iCalc, i) = numT(iCalc, i) / denT(iCalc, i);
-          }
-        }
-      }
-    }
+    Eigen::MatrixXd betaE =
+        cgRatio(rNewE.dot(rNewE), rE.dot(rE), useSymmetries);
+    Eigen::MatrixXd betaT =
+        cgRatio(rNewT.dot(rNewT), rT.dot(rT), useSymmetries);
 
     // new search direction
-    VectorBTE dNewE = dE * betaE + rNewE;
-    VectorBTE dNewT = dT * betaT + rNewT;
+    VectorBTE dNewE = rNewE;
+    dNewE.axpy(betaE, dE);
+    VectorBTE dNewT = rNewT;
+    dNewT.axpy(betaT, dT);
 
     // now we update the guess of transport coefficients
     // first though, we add the factors n(1-n) that we removed from the CG
@@ -425,12 +543,11 @@ void ElectronWannierTransportApp::runVariationalMethod(
 //        }
 //      }
 //    }
-    std::vector<VectorBTE> inF;
-    inF.push_back(zNewE);
-    inF.push_back(zNewT);
-    auto outF = scatteringMatrix.dot(inF);
-    VectorBTE az2E = outF[0];
-    VectorBTE az2T = outF[1];
+    // A*zNew = A*z + alpha*A*d, without applying again the matrix
+    VectorBTE az2E = azE;
+    az2E.axpy(alphaE, wE);
+    VectorBTE az2T = azT;
+    az2T.axpy(alphaT, wT);
     transportCoefficients.calcVariational(az2E, az2T, zNewE, zNewT, bE, bT, preconditioning);
     transportCoefficients.print(iter);
     elCond = transportCoefficients.getElectricalConductivity();
@@ -448,6 +565,8 @@ void ElectronWannierTransportApp::runVariationalMethod(
       thCondOld = thCond;
       zE = zNewE;
       zT = zNewT;
+      azE = az2E;
+      azT = az2T;
       rE = rNewE;
       rT = rNewT;
       dE = dNewE;
@@ -459,6 +578,7 @@ void ElectronWannierTransportApp::runVariationalMethod(
     }
   }
 
+  checkpoint.remove();
   // nice formatting of the transport properties at the last step
   transportCoefficients.print();
   transportCoefficients.outputToJSON("variational_onsager_coefficients.json");
@@ -472,12 +592,19 @@ void ElectronWannierTransportApp::runVariationalMethod(
 
 void ElectronWannierTransportApp::runIterativeMethod(
     Context &context, Crystal &crystal, StatisticsSweep &statisticsSweep,
-    ActiveBandStructure &bandStructure, ElScatteringMatrix &scatteringMatrix) {
+    ActiveBandStructure &bandStructure, ElScatteringMatrix &scatteringMatrix,
+    BulkEDrift &driftE, BulkTDrift &driftT, const int &andersonHistory) {
 
   // here we implement a conjugate gradient solution to Az = b
 
+  bool doAnderson = andersonHistory > 0;
   if (mpi->mpiHead()) {
-    std::cout << "Starting Omini Sparavigna BTE solver\n" << std::endl;
+    if (doAnderson) {
+      std::cout << "Starting Anderson-accelerated Omini Sparavigna BTE solver"
+                   "\n" << std::endl;
+    } else {
+      std::cout << "Starting Omini Sparavigna BTE solver\n" << std::endl;
+    }
   }
 
   OnsagerCoefficients transportCoefficients(statisticsSweep, crystal,
@@ -497,9 +624,7 @@ void ElectronWannierTransportApp::runIterativeMethod(
 
   VectorBTE lineWidths = scatteringMatrix.getLinewidths();
 
-  // we get the symmetrized drift vectors
-  BulkEDrift driftE(statisticsSweep, bandStructure, 3, true);
-  BulkTDrift driftT(statisticsSweep, bandStructure, 3, true);
+  // the symmetrized drift vectors are passed by the caller
   VectorBTE relaxationTimes = scatteringMatrix.getSingleModeTimes();
   VectorBTE nERTA = -driftE * relaxationTimes;
   VectorBTE nTRTA = -driftT * relaxationTimes;
@@ -509,28 +634,65 @@ void ElectronWannierTransportApp::runIterativeMethod(
 
   auto threshold = context.getConvergenceThresholdBTE();
 
-  for (int iter = 0; iter < context.getMaxIterationsBTE(); iter++) {
+  // different temperatures might converge differently: the calculations
+  // that have converged are frozen, and skipped by the matrix-free product
+  int numCalculations = statisticsSweep.getNumCalculations();
+  std::vector<bool> isActive(numCalculations, true);
+
+  // the previous iterates of the Anderson mixing, which are not written to
+  // the checkpoint: after a restart, the history is built again
+  std::deque<Eigen::MatrixXd> nEHistory, rEHistory, nTHistory, rTHistory;
+
+  // the solver may resume from a checkpoint of a previous run
+  SolverCheckpoint checkpoint(context, doAnderson ? "el_anderson" : "el_omini");
+  checkpoint.add("nEOld", nEOld.data);
+  checkpoint.add("nTOld", nTOld.data);
+  checkpoint.add("oldElectricalConductivity", elCondOld);
+  checkpoint.add("oldThermalConductivity", thCondOld);
+  checkpoint.add("isActive", isActive);
+  int firstIter = checkpoint.load();
+
+  for (int iter = firstIter; iter < context.getMaxIterationsBTE(); iter++) {
+    checkpoint.save(iter);
 
     std::vector<VectorBTE> nIn;
     nIn.push_back(nEOld);
     nIn.push_back(nTOld);
+    scatteringMatrix.setActiveCalculations(isActive);
     auto nOut = scatteringMatrix.offDiagonalDot(nIn);
     nENext = nOut[0] / lineWidths;
     nTNext = nOut[1] / lineWidths;
     nENext = nERTA - nENext;
     nTNext = nTRTA - nTNext;
+    if (doAnderson) {
+      andersonMixing(nENext.data, nEOld.data, 3, nEHistory, rEHistory,
+                     andersonHistory);
+      andersonMixing(nTNext.data, nTOld.data, 3, nTHistory, rTHistory,
+                     andersonHistory);
+    }
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      if (!isActive[iCalc]) { // rows of data are (iCalc, iDim)
+        nENext.data.middleRows(3 * iCalc, 3) =
+            nEOld.data.middleRows(3 * iCalc, 3);
+        nTNext.data.middleRows(3 * iCalc, 3) =
+            nTOld.data.middleRows(3 * iCalc, 3);
+      }
+    }
 
     transportCoefficients.calcFromSymmetricPopulation(nENext, nTNext);
     transportCoefficients.print(iter);
     elCond = transportCoefficients.getElectricalConductivity();
     thCond = transportCoefficients.getThermalConductivity();
 
-    // this exit condition must be improved
-    // different temperatures might converge differently
-
-    double dE = findMaxRelativeDifference(elCond, elCondOld);
-    double dT = findMaxRelativeDifference(thCond, thCondOld);
-    if ((dE < threshold) && (dT < threshold)) {
+    Eigen::VectorXd dE = findMaxRelativeDifferencePerCalc(elCond, elCondOld);
+    Eigen::VectorXd dT = findMaxRelativeDifferencePerCalc(thCond, thCondOld);
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      if ((dE(iCalc) < threshold) && (dT(iCalc) < threshold)) {
+        isActive[iCalc] = false;
+      }
+    }
+    if (std::none_of(isActive.begin(), isActive.end(),
+                     [](bool x) { return x; })) {
       break;
     } else {
       elCondOld = elCond;
@@ -543,8 +705,12 @@ void ElectronWannierTransportApp::runIterativeMethod(
       Error("Reached max BTE iterations without convergence");
     }
   }
+  scatteringMatrix.setActiveCalculations({});
+  checkpoint.remove();
   transportCoefficients.print();
-  transportCoefficients.outputToJSON("omini_onsager_coefficients.json");
+  transportCoefficients.outputToJSON(doAnderson
+                                         ? "anderson_onsager_coefficients.json"
+                                         : "omini_onsager_coefficients.json");
 
   if (mpi->mpiHead()) {
     std::cout << "Finished Omini-Sparavigna BTE solver\n\n";
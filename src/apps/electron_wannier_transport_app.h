@@ -3,6 +3,7 @@
 
 #include <string>
 #include "app.h"
+#include "drift.h"
 #include "el_scattering.h"
 
 /** Main driver for the transport calculation
@@ -13,17 +14,29 @@ public:
   void checkRequirements(Context &context) override;
 private:
   /** Method for running the variational solver of the electron BTE
+   * @param driftE, driftT: the symmetrized drift vectors, shared with the
+   * other solvers.
    */
   static void runVariationalMethod(Context &context,
                             Crystal &crystal,
                             StatisticsSweep &statisticsSweep,
                             ActiveBandStructure &bandStructure,
-                            ElScatteringMatrix &scatteringMatrix);
+                            ElScatteringMatrix &scatteringMatrix,
+                            BulkEDrift &driftE, BulkTDrift &driftT);
+  /** Method for running the iterative (Omini-Sparavigna) solver of the
+   * electron BTE, i.e. the fixed-point iteration n = nRTA - tau * A_off n.
+   * @param driftE, driftT: the symmetrized drift vectors, shared with the
+   * other solvers.
+   * @param andersonHistory: if > 0, the iterates are accelerated with
+   * Anderson mixing over this number of previous iterations.
+   */
   static void runIterativeMethod(Context &context,
                                  Crystal &crystal,
                                  StatisticsSweep &statisticsSweep,
                                  ActiveBandStructure &bandStructure,
-                                 ElScatteringMatrix &scatteringMatrix);
+                                 ElScatteringMatrix &scatteringMatrix,
+                                 BulkEDrift &driftE, BulkTDrift &driftT,
+                                 const int &andersonHistory = 0);
 };
 
 #endif
@@ -140,88 +140,110 @@ void ElPhCouplingPlotApp::run(Context &context) {
   }   
 
   // Compute the coupling --------------------------------------------------
-  std::vector<double> allGs;
 
-  // distribute over k,q pairs
+  // product of nbands1 * nbands2 * nmodes -- + 1 is because range is inclusive
+  size_t bandProd = (g2PlotEl1Bands.second - g2PlotEl1Bands.first + 1) *
+            (g2PlotEl2Bands.second - g2PlotEl2Bands.first + 1) *
+            (g2PlotPhBands.second - g2PlotPhBands.first + 1);
+
+  // distribute over k,q pairs. Each process gets a contiguous block of pairs
   int numPairs = pointsPairs.size();
   std::vector<size_t> pairParallelIter = mpi->divideWorkIter(numPairs);
+  size_t numLocalPairs = pairParallelIter.size();
+
+  // the pairs are listed with k1 in the outer loop, so that consecutive
+  // pairs of a process often share k1. Each group of pairs with the same k1
+  // needs a single Fourier transform of the coupling (cacheElPh), and the
+  // couplings of its (k2,q3) points are computed in batches.
+  std::vector<std::vector<size_t>> k1Groups;
+  for (size_t iPair : pairParallelIter) {
+    if (k1Groups.empty() ||
+        pointsPairs[k1Groups.back().back()].first != pointsPairs[iPair].first) {
+      k1Groups.emplace_back();
+    }
+    k1Groups.back().push_back(iPair);
+  }
 
-  // If mpi pools are used and each process does not have the same 
-  // amount of work, the code can hang waiting for couplingElph to return.
-  // In the worse case, some processes will have one less item. 
-  // We check if this process's work value is less than the max value across 
-  // processes, and if so, append a -1 index. 
-  size_t max = pairParallelIter.size(); 
-  mpi->allReduceMax(&max); 
-  if(pairParallelIter.size() < max) {
-    Eigen::Vector3d kCartesian = Eigen::Vector3d::Zero();
-    int numWannier = couplingElPh.getCouplingDimensions()(4);
-    Eigen::MatrixXcd eigenVectorK = Eigen::MatrixXcd::Zero(numWannier, 1);
-    couplingElPh.cacheElPh(eigenVectorK, kCartesian);
-  } 
-
-  // we calculate the coupling for each pair, flatten it, and append  --------------
-  // it to allGs. Then at the end, we write this chunk to HDF5.
+  // If mpi pools are used, cacheElPh must be called the same number of times
+  // by all processes of a pool, or the code hangs waiting for couplingElph to
+  // return. Processes with fewer groups of k1 make some dummy calls.
+  size_t numGroups = k1Groups.size();
+  size_t maxGroups = numGroups;
+  mpi->allReduceMax(&maxGroups);
 
   if(mpi->mpiHead())
     std::cout << "\nCoupling requested for " << numPairs << " k,q pairs." << std::endl;
 
-  LoopPrint loopPrint("calculating coupling", "k,q pairs on this process", pairParallelIter.size());
-  for (auto iPair : pairParallelIter) {
+  // we calculate the coupling for each pair, flatten it, and store it in
+  // allGs at the position of the pair. Then at the end, we write it to HDF5.
+  std::vector<double> allGs(numLocalPairs * bandProd);
+  size_t firstPair = numLocalPairs > 0 ? pairParallelIter[0] : 0;
 
+  LoopPrint loopPrint("calculating coupling", "k points on this process", maxGroups);
+  for (size_t iGroup = 0; iGroup < maxGroups; iGroup++) {
     loopPrint.update();
 
-    std::pair<Eigen::Vector3d, Eigen::Vector3d> thisPair = pointsPairs[iPair];
-
-    Eigen::Vector3d k1C = thisPair.first;
-    Eigen::Vector3d q3C = thisPair.second;
-    Eigen::Vector3d k2C = k1C + q3C;
+    if (iGroup >= numGroups) {
+      Eigen::Vector3d kCartesian = Eigen::Vector3d::Zero();
+      int numWannier = couplingElPh.getCouplingDimensions()(4);
+      Eigen::MatrixXcd eigenVectorK = Eigen::MatrixXcd::Zero(numWannier, 1);
+      couplingElPh.cacheElPh(eigenVectorK, kCartesian);
+      continue;
+    }
+    const std::vector<size_t> &groupPairs = k1Groups[iGroup];
 
-    // need to get the eigenvectors at these three wavevectors
+    Eigen::Vector3d k1C = pointsPairs[groupPairs[0]].first;
     auto t3 = electronH0.diagonalizeFromCoordinates(k1C);
     auto eigenVector1 = std::get<1>(t3);
+    couplingElPh.cacheElPh(eigenVector1, k1C);
 
-    // second electron eigenvector
-    auto t4 = electronH0.diagonalizeFromCoordinates(k2C);
-    auto eigenVector2 = std::get<1>(t4);
-
-    std::vector<Eigen::MatrixXcd> eigenVectors2;
-    eigenVectors2.push_back(eigenVector2);
-    std::vector<Eigen::Vector3d> k2Cs;
-    k2Cs.push_back(k2C);
-
-    // phonon eigenvectors
-    auto t5 = phononH0.diagonalizeFromCoordinates(q3C);
-    auto eigenVector3 = std::get<1>(t5);
-
-    std::vector<Eigen::MatrixXcd> eigenVectors3;
-    eigenVectors3.push_back(eigenVector3);
-    std::vector<Eigen::Vector3d> q3Cs;
-    q3Cs.push_back(q3C);
-
-    // calculate polar correction
-    std::vector<Eigen::VectorXcd> polarData;
-    Eigen::VectorXcd polar = couplingElPh.polarCorrectionPart1(q3C, eigenVector3);
-    polarData.push_back(polar);
+    auto nk2 = int(groupPairs.size());
+    int numBatches =
+        couplingElPh.estimateNumBatches(nk2, int(eigenVector1.cols()));
+
+    for (int iBatch = 0; iBatch < numBatches; iBatch++) {
+      int start = nk2 * iBatch / numBatches;
+      int end = nk2 * (iBatch + 1) / numBatches;
+      int batchSize = end - start;
+
+      // electron eigenvectors at k2 = k1 + q3, and phonon eigenvectors at q3
+      std::vector<Eigen::MatrixXcd> eigenVectors2(batchSize);
+      std::vector<Eigen::MatrixXcd> eigenVectors3(batchSize);
+      std::vector<Eigen::Vector3d> q3Cs(batchSize);
+#pragma omp parallel for
+      for (int iBatchPair = 0; iBatchPair < batchSize; iBatchPair++) {
+        Eigen::Vector3d q3C = pointsPairs[groupPairs[start + iBatchPair]].second;
+        Eigen::Vector3d k2C = k1C + q3C;
+        auto t4 = electronH0.diagonalizeFromCoordinates(k2C);
+        eigenVectors2[iBatchPair] = std::get<1>(t4);
+        auto t5 = phononH0.diagonalizeFromCoordinates(q3C);
+        eigenVectors3[iBatchPair] = std::get<1>(t5);
+        q3Cs[iBatchPair] = q3C;
+      }
 
-    // calculate the elph coupling squared
-    couplingElPh.cacheElPh(eigenVector1, k1C);
-    couplingElPh.calcCouplingSquared(eigenVector1, eigenVectors2, eigenVectors3, q3Cs, polarData);
-    auto coupling = couplingElPh.getCouplingSquared(0);
-
-    // the coupling object is coupling at a given set of k,q, for a range of bands
-    // band ranges are inclusive of start and finish ones
-    for (int ib1 = g2PlotEl1Bands.first; ib1 <= g2PlotEl1Bands.second; ib1++) {
-      for (int ib2 = g2PlotEl2Bands.first; ib2 <= g2PlotEl2Bands.second; ib2++) {
-        for (int ib3 = g2PlotPhBands.first; ib3 <= g2PlotPhBands.second; ib3++) {
-          allGs.push_back(coupling(ib1, ib2, ib3));
-          //if(ib1 == 1  && ib2 == 2 && ib3 == 1) {
-            //if(mpi->mpiHead()) std::cout << "coupling " << std::setprecision(8) << coupling(ib1, ib2, ib3) << " " << k1C.transpose() << std::endl;
-         // }
+      // with no polar data in input, the polar correction is computed on
+      // the device together with the short-range coupling
+      std::vector<Eigen::VectorXcd> polarData;
+      couplingElPh.calcCouplingSquared(eigenVector1, eigenVectors2,
+                                       eigenVectors3, q3Cs, polarData);
+
+      // the coupling object is coupling at a given set of k,q, for a range of bands
+      // band ranges are inclusive of start and finish ones
+#pragma omp parallel for
+      for (int iBatchPair = 0; iBatchPair < batchSize; iBatchPair++) {
+        auto &coupling = couplingElPh.getCouplingSquared(iBatchPair);
+        size_t iG = (groupPairs[start + iBatchPair] - firstPair) * bandProd;
+        for (int ib1 = g2PlotEl1Bands.first; ib1 <= g2PlotEl1Bands.second; ib1++) {
+          for (int ib2 = g2PlotEl2Bands.first; ib2 <= g2PlotEl2Bands.second; ib2++) {
+            for (int ib3 = g2PlotPhBands.first; ib3 <= g2PlotPhBands.second; ib3++) {
+              allGs[iG] = coupling(ib1, ib2, ib3);
+              iG++;
+            }
+          }
         }
       }
     }
-  } // close pairs loop
+  } // close k1 groups loop
   mpi->barrier();
   loopPrint.close();
 
@@ -233,11 +255,6 @@ void ElPhCouplingPlotApp::run(Context &context) {
   std::string outFileName = "coupling.elph.phoebe.hdf5";
   std::remove(&outFileName[0]);
 
-  // product of nbands1 * nbands2 * nmodes -- + 1 is because range is inclusive
-  size_t bandProd = (g2PlotEl1Bands.second - g2PlotEl1Bands.first + 1) *
-            (g2PlotEl2Bands.second - g2PlotEl2Bands.first + 1) *
-            (g2PlotPhBands.second - g2PlotPhBands.first + 1);
-
   #if defined(HDF5_AVAIL)
   try {
   #if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
@@ -247,9 +264,9 @@ void ElPhCouplingPlotApp::run(Context &context) {
     // open the hdf5 file
     HighFive::File file(
           outFileName, HighFive::File::Overwrite,
-          HighFive::MPIOFileDriver(MPI_COMM_WORLD, MPI_INFO_NULL));
+          HighFive::MPIOFileDriver(mpi->getComm(), MPI_INFO_NULL));
 
-    unsigned int globalSize = numPairs * bandProd;
+    size_t globalSize = numPairs * bandProd;
 
     // Create the data-space to write g to
     std::vector<size_t> dims(2);
@@ -260,8 +277,7 @@ void ElPhCouplingPlotApp::run(Context &context) {
 
     // start point and the number of the total number of elements
     // to be written by this process
-    size_t start = mpi->divideWorkIter(numPairs)[0] * bandProd;
-    size_t offset = start;
+    size_t offset = firstPair * bandProd;
 
     // Note: HDF5 < v1.10.2 cannot write datasets larger than 2 Gbs
     // ( due to max(int 32 bit))/1024^3 = 2Gb overflowing in MPI)
@@ -277,7 +293,7 @@ void ElPhCouplingPlotApp::run(Context &context) {
 
     // determine the size of each bunch of electronic bravais vectors
     // the BunchSizes vector tells us how many are in each set
-    int numPairsBunch = mpi->divideWorkIter(numPairs).back() + 1 - mpi->divideWorkIter(numPairs)[0];
+    int numPairsBunch = int(numLocalPairs);
 
     int bunchSize = 0;
     for (int i = 0; i < numPairsBunch; i++) {
@@ -295,7 +311,7 @@ void ElPhCouplingPlotApp::run(Context &context) {
     int numDatasets = bunchSizes.size();
 
     // we now loop over these data sets and write each chunk in parallel
-    int netOffset = 0;  // offset from first bunch in this set to current bunch
+    size_t netOffset = 0;  // offset from first bunch in this set to current bunch
 
     for (int iBunch = 0; iBunch < numDatasets; iBunch++) {
 
@@ -309,7 +325,9 @@ void ElPhCouplingPlotApp::run(Context &context) {
       // The format is ((startRow,startCol),(numRows,numCols)).write(data)
       // Because it's a vector (1 row) all processes write to row=0, col=startPoint
       // with nRows = 1, nCols = number of items this process will write.
-      dgmat.select({0, bunchOffset}, {1, bunchElements}).write_raw(&allGs[0]);
+      if (bunchElements == 0) continue;
+      dgmat.select({0, bunchOffset}, {1, bunchElements})
+          .write_raw(&allGs[bunchOffset - offset]);
 
     }
     } // end parallel write section
@@ -317,7 +335,7 @@ void ElPhCouplingPlotApp::run(Context &context) {
     {
 
     // throw an error if there are too many elements to write
-    unsigned int globalSize = numPairs * bandProd;
+    size_t globalSize = numPairs * bandProd;
     auto maxSize = int(pow(1000, 3)) / sizeof(double);
     if(globalSize > maxSize) {
       Error("Your requested el-ph matrix element file size is greater than the allowed size\n"
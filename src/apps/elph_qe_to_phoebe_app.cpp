@@ -3,9 +3,15 @@
 #include "eigen.h"
 #include "io.h"
 #include "qe_input_parser.h"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void ElPhQeToPhoebeApp::run(Context &context) {
   (void)context;
@@ -92,7 +98,17 @@ ElPhQeToPhoebeApp::readChunkGFromQE(const int& iqIrr, Context &context,
   std::string numString = ss.str();
   std::string fileName = phoebePrefixQE + ".phoebe." + numString + ".dat";
 
+  // use the binary file if QE wrote one
+  std::string binaryFileName = phoebePrefixQE + ".phoebe." + numString + ".bin";
+  if (std::ifstream(binaryFileName).good()) {
+    return readChunkGFromQEBinary(binaryFileName, numKPoints, numModes,
+                                  numQEBands, ikMap);
+  }
+
   std::ifstream infileQ(fileName);
+  if (not infileQ.is_open()) {
+    Error(fileName + " file not found.");
+  }
   infileQ >> nqStar;
 
   // allocate read quantities
@@ -170,6 +186,98 @@ ElPhQeToPhoebeApp::readChunkGFromQE(const int& iqIrr, Context &context,
   return std::make_tuple(gStar, phononEigenvectorsStar, phononEnergiesStar, qStar);
 }
 
+std::tuple<Eigen::Tensor<std::complex<double>, 5>,
+           Eigen::Tensor<std::complex<double>, 3>, Eigen::MatrixXd,
+           Eigen::MatrixXd>
+ElPhQeToPhoebeApp::readChunkGFromQEBinary(const std::string &fileName,
+                                          const int &numKPoints,
+                                          const int &numModes,
+                                          const int &numQEBands,
+                                          const Eigen::VectorXi &ikMap) {
+
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    Error(fileName + " file couldn't be opened.");
+  }
+  struct stat fileStat {};
+  if (fstat(fd, &fileStat) != 0) {
+    close(fd);
+    Error(fileName + " file couldn't be read.");
+  }
+  auto fileSize = size_t(fileStat.st_size);
+
+  int32_t nqStarIn = 0;
+  if (fileSize < sizeof(nqStarIn)) {
+    close(fd);
+    Error(fileName + " is too small.");
+  }
+  void *map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping stays valid after closing the file
+  if (map == MAP_FAILED) {
+    Error(fileName + " file couldn't be memory-mapped.");
+  }
+  madvise(map, fileSize, MADV_SEQUENTIAL);
+  const char *buffer = (const char *)map;
+
+  std::memcpy(&nqStarIn, buffer, sizeof(nqStarIn));
+  int nqStar = int(nqStarIn);
+
+  // offsets of the different records
+  size_t blockSize = size_t(numQEBands) * numQEBands;
+  size_t offsetQ = sizeof(int32_t);
+  size_t offsetEnergies = offsetQ + 6 * nqStar * sizeof(double);
+  size_t offsetEigenvectors = offsetEnergies + numModes * sizeof(double);
+  size_t offsetG = offsetEigenvectors + size_t(numModes) * numModes * nqStar *
+                                            sizeof(std::complex<double>);
+  size_t expectedSize = offsetG + blockSize * numKPoints * numModes * nqStar *
+                                      sizeof(std::complex<double>);
+  if (nqStar <= 0 || fileSize != expectedSize) {
+    munmap(map, fileSize);
+    Error(fileName + " doesn't have the expected size, check that it was "
+                     "written with the same number of bands, modes and "
+                     "k-points.");
+  }
+
+  Eigen::Tensor<std::complex<double>, 5> gStar(numQEBands, numQEBands, numModes,
+                                               numKPoints, nqStar);
+  Eigen::Tensor<std::complex<double>, 3> phononEigenvectorsStar(numModes, numModes,
+                                                                nqStar);
+  Eigen::MatrixXd phononEnergiesStar(numModes, nqStar);
+  Eigen::MatrixXd qStar(3, nqStar);
+
+  // the cartesian coordinates of the star are skipped, as in the text file
+  std::memcpy(qStar.data(), buffer + offsetQ, 3 * nqStar * sizeof(double));
+
+  Eigen::VectorXd phononEnergies(numModes);
+  std::memcpy(phononEnergies.data(), buffer + offsetEnergies,
+              numModes * sizeof(double));
+  for (int iqStar = 0; iqStar < nqStar; iqStar++) {
+    phononEnergiesStar.col(iqStar) = phononEnergies;
+  }
+
+  std::memcpy(phononEigenvectorsStar.data(), buffer + offsetEigenvectors,
+              phononEigenvectorsStar.size() * sizeof(std::complex<double>));
+
+  // each (ib1,ib2) block is contiguous both in the file and in gStar,
+  // so it's copied at once, reordering only the k-points with ikMap
+#pragma omp parallel for collapse(3)
+  for (int iq = 0; iq < nqStar; iq++) {
+    for (int nu = 0; nu < numModes; nu++) {
+      for (int ik = 0; ik < numKPoints; ik++) {
+        size_t iBlock = (size_t(iq) * numModes + nu) * numKPoints + ik;
+        std::memcpy(&gStar(0, 0, nu, ikMap(ik), iq),
+                    buffer + offsetG +
+                        iBlock * blockSize * sizeof(std::complex<double>),
+                    blockSize * sizeof(std::complex<double>));
+      }
+    }
+  }
+
+  munmap(map, fileSize);
+
+  return std::make_tuple(gStar, phononEigenvectorsStar, phononEnergiesStar, qStar);
+}
+
 // read g, which is written to file on all k, q points
 std::tuple<Eigen::Tensor<std::complex<double>, 5>,
            Eigen::Tensor<std::complex<double>, 3>, Eigen::MatrixXd>
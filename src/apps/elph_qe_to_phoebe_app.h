@@ -165,6 +165,16 @@ protected:
                   const Eigen::MatrixXd &kGridFull, const int &numIrrQPoints,
                   const int &numQEBands, const Eigen::MatrixXd &energies);
 
+  /** Reads the el-ph coupling on the star of the iqIrr-th irreducible
+   * q-point, from the file {prefix}.phoebe.{iqIrr+1}.dat written by QE.
+   * If the binary file {prefix}.phoebe.{iqIrr+1}.bin is found instead, it's
+   * read with readChunkGFromQEBinary().
+   *
+   * @return tuple: with elements gStar(numQEBands,numQEBands,numModes,
+   * numKPoints,numQStar), the phonon eigenvectors (numModes,numModes,
+   * numQStar), the phonon energies (numModes,numQStar) and the q-points of
+   * the star in crystal coordinates (3,numQStar).
+   */
   std::tuple<Eigen::Tensor<std::complex<double>, 5>,
              Eigen::Tensor<std::complex<double>, 3>, Eigen::MatrixXd,
              Eigen::MatrixXd>
@@ -172,6 +182,24 @@ protected:
                    const int &numModes, const int &numQEBands,
                    const Eigen::VectorXi &ikMap);
 
+  /** Binary variant of readChunkGFromQE(). The file is memory-mapped, and
+   * the blocks of the coupling are copied directly into gStar, without any
+   * text parsing. The file contains, in native byte order and without
+   * Fortran record markers (i.e. as written with access='stream'):
+   * int32 numQStar; float64 qStar in crystal coordinates (3,numQStar);
+   * float64 qStar in cartesian coordinates (3,numQStar);
+   * float64 phonon energies (numModes); complex128 phonon eigenvectors
+   * (numModes,numModes,numQStar); complex128 coupling
+   * (numQEBands,numQEBands,numKPoints,numModes,numQStar).
+   * Arrays are in Fortran (column-major) order, as in the text file.
+   */
+  static std::tuple<Eigen::Tensor<std::complex<double>, 5>,
+                    Eigen::Tensor<std::complex<double>, 3>, Eigen::MatrixXd,
+                    Eigen::MatrixXd>
+  readChunkGFromQEBinary(const std::string &fileName, const int &numKPoints,
+                         const int &numModes, const int &numQEBands,
+                         const Eigen::VectorXi &ikMap);
+
   /** This method compares the energies computed by qe2wannier90
    * and the energies of quantum espresso pw.x, to compute the offset between
    * the two sets (wannier90 may skip some core states).
@@ -2,12 +2,51 @@
 #include "bands_app.h"
 #include "bandstructure.h"
 #include "context.h"
+#include "delta_function.h"
 #include "el_scattering.h"
 #include "exceptions.h"
 #include "ifc3_parser.h"
+#include "ifc4_parser.h"
 #include "points.h"
 #include "ph_scattering.h"
 #include "parser.h"
+#include <string>
+
+/** Splits the points of a path in chunks of at most chunkSize points, which
+ * the lifetimes apps compute one after the other.
+ * If chunkSize is 0, or larger than the path, there's a single chunk.
+ */
+std::vector<Points> splitPath(Crystal &crystal, Points &pathPoints,
+                              const int &chunkSize) {
+  int numPoints = pathPoints.getNumPoints();
+  if (chunkSize == 0 || chunkSize >= numPoints) {
+    return {pathPoints};
+  }
+  std::vector<Points> chunks;
+  for (int start = 0; start < numPoints; start += chunkSize) {
+    int numChunkPoints = std::min(chunkSize, numPoints - start);
+    Eigen::MatrixXd pointsList(3, numChunkPoints);
+    for (int i = 0; i < numChunkPoints; i++) {
+      pointsList.col(i) = pathPoints.getPointCoordinates(
+          start + i, Points::crystalCoordinates);
+    }
+    chunks.emplace_back(crystal, pointsList);
+  }
+  if (mpi->mpiHead()) {
+    std::cout << "Computing the " << numPoints << " path points in "
+              << chunks.size() << " chunks." << std::endl;
+  }
+  return chunks;
+}
+
+/** Suffix of the output files of a chunk of the path (see splitPath()).
+ */
+std::string chunkSuffix(const int &iChunk, const int &numChunks) {
+  if (numChunks == 1) {
+    return "";
+  }
+  return "_" + std::to_string(iChunk);
+}
 
 void ElectronLifetimesApp::run(Context &context) {
   context.setScatteringMatrixInMemory(false);
@@ -35,24 +74,37 @@ void ElectronLifetimesApp::run(Context &context) {
 
   bool withVelocities = true;
   bool withEigenvectors = true;
+  // the velocities of the mesh states are only read by the adaptive smearing
+  bool withMeshVelocities =
+      context.getSmearingMethod() == DeltaFunction::adaptiveGaussian;
   FullBandStructure fullBandStructure =
-      electronH0.populate(fullKPoints, withVelocities, withEigenvectors);
-  FullBandStructure pathBandStructure =
-      electronH0.populate(pathKPoints, withVelocities, withEigenvectors);
+      electronH0.populate(fullKPoints, withMeshVelocities, withEigenvectors);
 
   StatisticsSweep statisticsSweep(context, &fullBandStructure);
 
   //----------------------------------------------------------------------------
 
-  // build/initialize the scattering matrix and the smearing
-  ElScatteringMatrix scatteringMatrix(context, statisticsSweep,
-                                      fullBandStructure, pathBandStructure,
-                                      phononH0, &couplingElPh);
-  scatteringMatrix.setup();
-
-  scatteringMatrix.outputToJSON("path_el_relaxation_times.json");
-  outputBandsToJSON(pathBandStructure, context, pathKPoints,
-                    "path_el_bandstructure.json");
+  // the path is done in chunks, so that the memory needed by the path
+  // states is freed after writing the results of each chunk
+  std::vector<Points> pathChunks =
+      splitPath(crystal, pathKPoints, context.getLifetimesChunkSize());
+  auto numChunks = int(pathChunks.size());
+  for (int iChunk = 0; iChunk < numChunks; iChunk++) {
+    std::string suffix = chunkSuffix(iChunk, numChunks);
+    FullBandStructure pathBandStructure = electronH0.populate(
+        pathChunks[iChunk], withVelocities, withEigenvectors);
+
+    // build/initialize the scattering matrix and the smearing
+    ElScatteringMatrix scatteringMatrix(context, statisticsSweep,
+                                        fullBandStructure, pathBandStructure,
+                                        phononH0, &couplingElPh);
+    scatteringMatrix.setup();
+
+    scatteringMatrix.outputRelaxationTimes("path_el_relaxation_times" +
+                                           suffix + ".json");
+    outputBandsToJSON(pathBandStructure, context, pathChunks[iChunk],
+                      "path_el_bandstructure" + suffix + ".json");
+  }
 
   mpi->barrier();
 }
@@ -67,6 +119,12 @@ void PhononLifetimesApp::run(Context &context) {
   // load the 3phonon coupling
   auto coupling3Ph = IFC3Parser::parse(context, crystal);
 
+  // if requested in input, load the 4phonon coupling
+  std::unique_ptr<Interaction4Ph> coupling4Ph;
+  if (!context.getPhFC4FileName().empty()) {
+    coupling4Ph = IFC4Parser::parse(context, crystal);
+  }
+
   // set k and q point meshes and paths
   Points pathPoints(crystal, context.getPathExtrema(),
                     context.getDeltaPath());
@@ -76,24 +134,38 @@ void PhononLifetimesApp::run(Context &context) {
 
   bool withVelocities = true;
   bool withEigenvectors = true;
+  // the velocities of the mesh states are only read by the adaptive smearing
+  bool withMeshVelocities =
+      context.getSmearingMethod() == DeltaFunction::adaptiveGaussian;
   FullBandStructure fullBandStructure =
-      phononH0.populate(fullPoints, withVelocities, withEigenvectors);
-  FullBandStructure pathBandStructure =
-      phononH0.populate(pathPoints, withVelocities, withEigenvectors);
+      phononH0.populate(fullPoints, withMeshVelocities, withEigenvectors);
 
   StatisticsSweep statisticsSweep(context);
 
   //----------------------------------------------------------------------------
 
-  // build/initialize the scattering matrix and the smearing
-  PhScatteringMatrix scatteringMatrix(context, statisticsSweep,
-                                      fullBandStructure, pathBandStructure,
-                                      &coupling3Ph, &phononH0);
-  scatteringMatrix.setup();
-
-  scatteringMatrix.outputToJSON("path_ph_relaxation_times.json");
-  outputBandsToJSON(pathBandStructure, context, pathPoints,
-                    "path_ph_bandstructure.json");
+  // the path is done in chunks, so that the memory needed by the path
+  // states is freed after writing the results of each chunk
+  std::vector<Points> pathChunks =
+      splitPath(crystal, pathPoints, context.getLifetimesChunkSize());
+  auto numChunks = int(pathChunks.size());
+  for (int iChunk = 0; iChunk < numChunks; iChunk++) {
+    std::string suffix = chunkSuffix(iChunk, numChunks);
+    FullBandStructure pathBandStructure = phononH0.populate(
+        pathChunks[iChunk], withVelocities, withEigenvectors);
+
+    // build/initialize the scattering matrix and the smearing
+    PhScatteringMatrix scatteringMatrix(context, statisticsSweep,
+                                        fullBandStructure, pathBandStructure,
+                                        &coupling3Ph, &phononH0, nullptr,
+                                        coupling4Ph.get());
+    scatteringMatrix.setup();
+
+    scatteringMatrix.outputRelaxationTimes("path_ph_relaxation_times" +
+                                           suffix + ".json");
+    outputBandsToJSON(pathBandStructure, context, pathChunks[iChunk],
+                      "path_ph_bandstructure" + suffix + ".json");
+  }
   mpi->barrier();
 }
 
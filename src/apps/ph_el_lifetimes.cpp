@@ -90,7 +90,13 @@ void PhElLifetimesApp::run(Context &context) {
                                         elBandStructure, phBandStructure,
                                         couplingElPh, electronH0);
   scatteringMatrix.setup();
-  scatteringMatrix.outputToJSON("rta_phel_relaxation_times.json");
+  scatteringMatrix.outputRelaxationTimes("rta_phel_relaxation_times.json");
+#ifdef HDF5_AVAIL
+  // the linewidths can be added to a phononTransport run with
+  // phElLinewidthsFileName
+  VectorBTE linewidths = scatteringMatrix.getLinewidths();
+  linewidths.outputToHDF5("phel_linewidths.hdf5");
+#endif
 
   // solve the BTE at the relaxation time approximation level
   // we always do this, as it's the cheapest solver and is required to know
@@ -1,37 +1,150 @@
 #include "phonon_transport_app.h"
 #include "bandstructure.h"
+#include "constants.h"
 #include "context.h"
 #include "drift.h"
 #include "exceptions.h"
+#include "hdf5_output.h"
 #include "ifc3_parser.h"
+#include "ifc4_parser.h"
+#include "io.h"
 #include "observable.h"
+#include "observables_pass.h"
 #include "parser.h"
 #include "phel_scattering.h"
 #include "ph_scattering.h"
 #include "phonon_thermal_cond.h"
 #include "phonon_viscosity.h"
 #include "points.h"
+#include "solver_checkpoint.h"
+#include "solver_helpers.h"
 #include "specific_heat.h"
 #include "wigner_phonon_thermal_cond.h"
+#include <algorithm>
+#include <fstream>
+#include <functional>
 #include <iomanip>
+#include <memory>
+#include <nlohmann/json.hpp>
 
 void PhononTransportApp::run(Context &context) {
 
   // TODO make these two each optional, and that we can run if only one or the other is defed
   // collect information about the run from context
   bool usePhPhInteraction = !context.getPhFC3FileName().empty();
-  bool usePhElInteraction = !context.getElphFileName().empty();
+  bool usePhElInteraction = !context.getElphFileName().empty() ||
+                            !context.getPhElLinewidthsFileName().empty();
   bool useCRTA = std::isnan(context.getConstantRelaxationTime());
 
   if(!usePhPhInteraction && !usePhElInteraction && !useCRTA) {
     Error("To run the ph transport app beyond CRTA, supply a ph-ph or el-ph file!");
   }
 
+  // with only the RTA solver, the off-diagonal part of the scattering
+  // matrix is never used: we only compute and store the linewidths.
+  // The flag is restored when the app returns
+  bool onlyRTA =
+      context.getSolverBTE().empty() && context.getScatteringMatrixInMemory();
+  ScatteringMatrixInMemoryScope inMemoryScope(
+      context, context.getScatteringMatrixInMemory() && !onlyRTA);
+  if (onlyRTA && mpi->mpiHead()) {
+    std::cout << "Only the RTA solver is requested: the scattering matrix "
+                 "will not be stored in memory.\n" << std::endl;
+  }
+
   // Read the necessary input files
   auto tup = Parser::parsePhHarmonic(context);
   auto crystal = std::get<0>(tup);
   auto phononH0 = std::get<1>(tup);
 
+  // load the 3phonon coupling
+  if (mpi->mpiHead()) {
+    std::cout << "Starting anharmonic scattering calculation." << std::endl;
+  }
+  // this also checks that the crystal is the same one read in for 3ph
+  auto coupling3Ph = IFC3Parser::parse(context, crystal);
+
+  // if requested in input, load the 4phonon coupling
+  std::unique_ptr<Interaction4Ph> coupling4Ph;
+  if (!context.getPhFC4FileName().empty()) {
+    coupling4Ph = IFC4Parser::parse(context, crystal);
+  }
+  Profiler::recordHostMemory("parsing");
+
+  // with convergenceMeshDivisors, the BTE is solved on a sequence of nested
+  // meshes, from the coarsest one to qMesh. The force constants are read
+  // only once, and the solution on each mesh is the initial guess of the
+  // solvers on the next one
+  Eigen::Vector3i qMesh = context.getQMesh();
+  std::vector<Eigen::Vector3i> meshes;
+  std::vector<int> divisors = context.getConvergenceMeshDivisors();
+  std::sort(divisors.begin(), divisors.end(), std::greater<int>());
+  if (context.getDryRun()) {
+    divisors.clear();
+  }
+  for (int divisor : divisors) {
+    // non-periodic directions (a single point) are not refined
+    Eigen::Vector3i mesh = qMesh;
+    for (int i : {0, 1, 2}) {
+      if (qMesh(i) > 1) {
+        mesh(i) = qMesh(i) / divisor;
+      }
+    }
+    meshes.push_back(mesh);
+  }
+  meshes.push_back(qMesh);
+  divisors.push_back(1);
+
+  // with linewidthsQMesh, the linewidths are computed once on the coarse
+  // mesh, and interpolated on the states of the mesh(es) of the transport
+  MeshVectorBTE meshLinewidths;
+  if (context.getLinewidthsQMesh().prod() > 0 && !context.getDryRun()) {
+    meshLinewidths = computeMeshLinewidths(context, crystal, phononH0,
+                                           coupling3Ph, coupling4Ph.get());
+  }
+
+  std::vector<Eigen::Tensor<double, 3>> conductivities;
+  MeshVectorBTE previousSolution;
+  for (size_t iMesh = 0; iMesh < meshes.size(); iMesh++) {
+    // the outputs of the coarser meshes have a suffix, e.g. "_mesh10x10x10"
+    std::string meshSuffix;
+    bool isLastMesh = iMesh + 1 == meshes.size();
+    if (!isLastMesh) {
+      meshSuffix = "_mesh" + std::to_string(meshes[iMesh](0)) + "x" +
+                   std::to_string(meshes[iMesh](1)) + "x" +
+                   std::to_string(meshes[iMesh](2));
+    }
+    if (meshes.size() > 1 && mpi->mpiHead()) {
+      std::cout << "\n" << std::string(80, '#') << "\n\n"
+                << "Convergence study: solving the BTE on the mesh "
+                << meshes[iMesh].transpose() << " (" << iMesh + 1 << " of "
+                << meshes.size() << ")." << std::endl;
+    }
+    // the observables are normalized with the mesh in context
+    context.setQMesh(meshes[iMesh]);
+
+    MeshVectorBTE solution;
+    conductivities.push_back(solveOnMesh(
+        context, crystal, phononH0, coupling3Ph, coupling4Ph.get(), meshSuffix,
+        previousSolution.empty() ? nullptr : &previousSolution,
+        isLastMesh ? nullptr : &solution,
+        meshLinewidths.empty() ? nullptr : &meshLinewidths));
+    previousSolution = solution;
+  }
+  context.setQMesh(qMesh);
+
+  if (meshes.size() > 1) {
+    outputConvergenceStudy(context, meshes, divisors, conductivities);
+  }
+  mpi->barrier();
+}
+
+Eigen::Tensor<double, 3> PhononTransportApp::solveOnMesh(
+    Context &context, Crystal &crystal, PhononH0 &phononH0,
+    Interaction3Ph &coupling3Ph, Interaction4Ph *coupling4Ph,
+    const std::string &meshSuffix, const MeshVectorBTE *meshGuess,
+    MeshVectorBTE *meshSolution, const MeshVectorBTE *meshLinewidths) {
+
   // first we make compute the band structure on the fine grid
   Points fullPoints(crystal, context.getQMesh());
 
@@ -56,23 +169,33 @@ void PhononTransportApp::run(Context &context) {
     }
     std::cout << "Done computing phonon band structure.\n" << std::endl;
   }
-
-  // load the 3phonon coupling
-  if (mpi->mpiHead()) {
-    std::cout << "Starting anharmonic scattering calculation." << std::endl;
+  Profiler::recordHostMemory("band structure");
+
+  // in a dry run, we only estimate memory and time of the ph-ph scattering
+  if (context.getDryRun()) {
+    std::vector<std::pair<std::string, double>> deviceMemory = {
+        {"3-phonon force constants", coupling3Ph.getDeviceMemoryUsage()}};
+    PhScatteringMatrix sampleMatrix(context, statisticsSweep, bandStructure,
+                                    bandStructure, &coupling3Ph, &phononH0);
+    double builderTime = sampleMatrix.estimateBuilderTime(numDryRunPairs);
+    // with the matrix in memory, it's rebuilt for each temperature
+    int numCalculations = statisticsSweep.getNumCalculations();
+    if (context.getScatteringMatrixInMemory()) {
+      builderTime *= numCalculations;
+    }
+    printDryRunReport(context, bandStructure, numCalculations, deviceMemory,
+                      builderTime);
+    return {};
   }
-  // this also checks that the crystal is the same one read in for 3ph
-  auto coupling3Ph = IFC3Parser::parse(context, crystal);
-
-  // build/initialize the scattering matrix and the smearing
-  PhScatteringMatrix scatteringMatrix(context, statisticsSweep, bandStructure,
-                                      bandStructure, &coupling3Ph, &phononH0);
-  scatteringMatrix.setup();
 
   // if requested in input, load the phononElectron information
   // we save only a vector BTE to add to the phonon scattering matrix,
   // as the phonon electron lifetime only contributes to the digaonal
-  if(usePhElInteraction) {
+  std::unique_ptr<VectorBTE> phElLinewidths;
+  if (!context.getPhElLinewidthsFileName().empty()) {
+    phElLinewidths = std::make_unique<VectorBTE>(readPhononElectronLinewidth(
+        context, statisticsSweep, bandStructure));
+  } else if (!context.getElphFileName().empty()) {
 
     // could be possible to do this?
     // don't proceed if we use more than one doping concentration:
@@ -85,18 +208,293 @@ void PhononTransportApp::run(Context &context) {
     if (mpi->mpiHead()) {
       std::cout << "\nStarting phonon-electron scattering calculation." << std::endl;
     }
-    VectorBTE phElLinewidths = getPhononElectronLinewidth(context, crystal,
-                                                        bandStructure, phononH0);
+    phElLinewidths = std::make_unique<VectorBTE>(getPhononElectronLinewidth(
+        context, crystal, bandStructure, phononH0));
+  }
+
+  // if the scattering matrix is kept in memory, we can only store it for
+  // one temperature at the time. Hence, we solve the BTE separately for
+  // each temperature, rebuilding the matrix every time.
+  // the ph-ph transition weights don't depend on temperature: if requested,
+  // they are cached and reused by the scattering matrices of each temperature
+  std::shared_ptr<PhPhCouplingCache> couplingCache;
+  if (context.getCachePhPhCouplings()) {
+    couplingCache = std::make_shared<PhPhCouplingCache>();
+  }
+
+  int numCalculations = statisticsSweep.getNumCalculations();
+
+  // in the RTA, the arrays growing with the number of calculations may not
+  // fit in memory: then, we process the temperatures in chunks
+  int chunkSize = numCalculations;
+  if (context.getSolverBTE().empty() &&
+      context.getCalculationsChunkMemory() > 0.) {
+    // about 16 doubles per state and calculation: the linewidths and their
+    // copies, the Bose factors, the drift and the RTA populations
+    double memoryPerCalc = 16. * sizeof(double) *
+                           double(bandStructure.getNumStates()) /
+                           pow(1024., 3);
+    chunkSize = std::max(1, int(context.getCalculationsChunkMemory() /
+                                memoryPerCalc));
+  }
+
+  if (context.getScatteringMatrixInMemory() && numCalculations > 1) {
+    int dimensionality = context.getDimensionality();
+    Eigen::Tensor<double, 3> conductivity(numCalculations, dimensionality,
+                                          dimensionality);
+    // with warmStartBTE, the deviation from the RTA of the solution at one
+    // temperature is the initial guess of the solvers at the next one, and
+    // so are the relaxons for the partial eigensolver
+    Eigen::MatrixXd warmStart;
+    Eigen::MatrixXd relaxonsGuess;
+    double previousTemperature = 0.;
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      StatisticsSweep calcStatisticsSweep(statisticsSweep, iCalc);
+      std::string fileSuffix = meshSuffix + "_calc" + std::to_string(iCalc);
+
+      if (mpi->mpiHead()) {
+        auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+        std::cout << "\n" << std::string(80, '=') << "\n\n"
+                  << "Solving BTE at temperature "
+                  << calcStat.temperature * temperatureAuToSi << " K ("
+                  << iCalc + 1 << " of " << numCalculations << ").\n"
+                  << "Output files will have the suffix \"" << fileSuffix
+                  << "\"." << std::endl;
+      }
+
+      std::unique_ptr<VectorBTE> calcPhElLinewidths;
+      if (phElLinewidths != nullptr) {
+        calcPhElLinewidths = std::make_unique<VectorBTE>(calcStatisticsSweep,
+                                                         bandStructure, 1);
+        calcPhElLinewidths->data.row(0) = phElLinewidths->data.row(iCalc);
+      }
+
+      // the canonical population has a leading 1/T^2 dependence
+      double temperature = statisticsSweep.getCalcStatistics(iCalc).temperature;
+      if (warmStart.size() > 0) {
+        warmStart *= std::pow(previousTemperature / temperature, 2);
+      }
+      previousTemperature = temperature;
+
+      MeshVectorBTE calcSolution;
+      Eigen::Tensor<double, 3> calcConductivity = solveBTE(
+          context, calcStatisticsSweep, crystal, bandStructure, coupling3Ph,
+          phononH0, couplingCache, calcPhElLinewidths.get(), fileSuffix,
+          coupling4Ph, context.getWarmStartBTE() ? &warmStart : nullptr,
+          meshGuess, meshSolution == nullptr ? nullptr : &calcSolution,
+          context.getWarmStartBTE() ? &relaxonsGuess : nullptr,
+          meshLinewidths);
+      conductivity.chip(iCalc, 0) = calcConductivity.chip(0, 0);
+      if (meshSolution != nullptr) {
+        meshSolution->append(calcSolution);
+      }
+    }
+    return conductivity;
+  } else if (chunkSize < numCalculations) {
+    if (couplingCache == nullptr) {
+      Warning("The ph-ph couplings are recomputed for each chunk of "
+              "temperatures,\nset cachePhPhCouplings = true to reuse them.");
+    }
+    int dimensionality = context.getDimensionality();
+    Eigen::Tensor<double, 3> conductivity(numCalculations, dimensionality,
+                                          dimensionality);
+    for (int firstCalc = 0; firstCalc < numCalculations;
+         firstCalc += chunkSize) {
+      int numChunkCalcs = std::min(chunkSize, numCalculations - firstCalc);
+      StatisticsSweep chunkStatisticsSweep(statisticsSweep, firstCalc,
+                                           numChunkCalcs);
+      std::string fileSuffix = meshSuffix + "_calcs" +
+                               std::to_string(firstCalc) + "-" +
+                               std::to_string(firstCalc + numChunkCalcs - 1);
+
+      if (mpi->mpiHead()) {
+        std::cout << "\n" << std::string(80, '=') << "\n\n"
+                  << "Solving BTE at temperatures " << firstCalc + 1 << " to "
+                  << firstCalc + numChunkCalcs << " of " << numCalculations
+                  << ".\nOutput files will have the suffix \"" << fileSuffix
+                  << "\"." << std::endl;
+      }
+
+      std::unique_ptr<VectorBTE> chunkPhElLinewidths;
+      if (phElLinewidths != nullptr) {
+        chunkPhElLinewidths = std::make_unique<VectorBTE>(chunkStatisticsSweep,
+                                                          bandStructure, 1);
+        chunkPhElLinewidths->data =
+            phElLinewidths->data.middleRows(firstCalc, numChunkCalcs);
+      }
+
+      Eigen::Tensor<double, 3> chunkConductivity = solveBTE(
+          context, chunkStatisticsSweep, crystal, bandStructure, coupling3Ph,
+          phononH0, couplingCache, chunkPhElLinewidths.get(), fileSuffix,
+          coupling4Ph, nullptr, nullptr, nullptr, nullptr, meshLinewidths);
+      Eigen::array<Eigen::Index, 3> offsets = {firstCalc, 0, 0};
+      Eigen::array<Eigen::Index, 3> extents = {numChunkCalcs, dimensionality,
+                                               dimensionality};
+      conductivity.slice(offsets, extents) = chunkConductivity;
+    }
+    return conductivity;
+  } else {
+    if (context.getWarmStartBTE()) {
+      Warning("warmStartBTE is only used when the BTE is solved separately "
+              "for each temperature,\ni.e. with the scattering matrix in "
+              "memory and more than one temperature.");
+    }
+    return solveBTE(context, statisticsSweep, crystal, bandStructure,
+                    coupling3Ph, phononH0, couplingCache, phElLinewidths.get(),
+                    meshSuffix, coupling4Ph, nullptr, meshGuess, meshSolution,
+                    nullptr, meshLinewidths);
+  }
+}
+
+void PhononTransportApp::outputConvergenceStudy(
+    Context &context, const std::vector<Eigen::Vector3i> &meshes,
+    const std::vector<int> &divisors,
+    const std::vector<Eigen::Tensor<double, 3>> &conductivities) {
+
+  // Richardson extrapolation of the last two meshes: with an error
+  // decreasing as (mesh spacing)^p, i.e. as divisor^p,
+  // kappa_inf = kappa_2 + (kappa_2 - kappa_1) / (r^p - 1), r = d_1 / d_2.
+  // With three meshes in geometric progression, the order p is estimated
+  // from the trace of the conductivity, otherwise we assume p = 2.
+  int numMeshes = int(meshes.size());
+  const Eigen::Tensor<double, 3> &kappa1 = conductivities[numMeshes - 2];
+  const Eigen::Tensor<double, 3> &kappa2 = conductivities[numMeshes - 1];
+  int numCalculations = int(kappa2.dimension(0));
+  int dimensionality = int(kappa2.dimension(1));
+  double r = double(divisors[numMeshes - 2]) / divisors[numMeshes - 1];
+
+  auto trace = [dimensionality](const Eigen::Tensor<double, 3> &kappa,
+                                const int &iCalc) {
+    double x = 0.;
+    for (int i = 0; i < dimensionality; i++) {
+      x += kappa(iCalc, i, i);
+    }
+    return x;
+  };
+
+  Eigen::VectorXd orders = Eigen::VectorXd::Constant(numCalculations, 2.);
+  if (numMeshes >= 3 &&
+      divisors[numMeshes - 3] == divisors[numMeshes - 2] * r) {
+    const Eigen::Tensor<double, 3> &kappa0 = conductivities[numMeshes - 3];
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      double ratio = (trace(kappa1, iCalc) - trace(kappa0, iCalc)) /
+                     (trace(kappa2, iCalc) - trace(kappa1, iCalc));
+      double p = std::log(ratio) / std::log(r);
+      if (std::isfinite(p) && p > 0.) {
+        orders(iCalc) = p;
+      }
+    }
+  }
+
+  Eigen::Tensor<double, 3> extrapolated = kappa2;
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    double factor = 1. / (std::pow(r, orders(iCalc)) - 1.);
+    for (int i = 0; i < dimensionality; i++) {
+      for (int j = 0; j < dimensionality; j++) {
+        extrapolated(iCalc, i, j) +=
+            (kappa2(iCalc, i, j) - kappa1(iCalc, i, j)) * factor;
+      }
+    }
+  }
+
+  if (!mpi->mpiHead()) {
+    return;
+  }
+
+  StatisticsSweep statisticsSweep(context);
+  auto toVector = [dimensionality](const Eigen::Tensor<double, 3> &kappa,
+                                   const int &iCalc) {
+    std::vector<std::vector<double>> rows;
+    for (int i = 0; i < dimensionality; i++) {
+      std::vector<double> cols;
+      for (int j = 0; j < dimensionality; j++) {
+        cols.push_back(kappa(iCalc, i, j));
+      }
+      rows.push_back(cols);
+    }
+    return rows;
+  };
+
+  std::cout << "\n" << std::string(80, '#') << "\n\n"
+            << "Convergence study of the thermal conductivity (W /(m K))."
+            << std::endl;
+  std::vector<double> temps;
+  std::vector<std::vector<std::vector<std::vector<double>>>> meshKappas(
+      numMeshes);
+  std::vector<std::vector<std::vector<double>>> extrapolatedKappas;
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
+    temps.push_back(temp * temperatureAuToSi);
+    std::cout << "\nTemperature: " << temp * temperatureAuToSi << " K\n";
+    for (int iMesh = 0; iMesh < numMeshes; iMesh++) {
+      meshKappas[iMesh].push_back(toVector(conductivities[iMesh], iCalc));
+      std::cout << "mesh " << meshes[iMesh].transpose() << ": trace/d = "
+                << std::setprecision(5) << std::fixed
+                << trace(conductivities[iMesh], iCalc) / dimensionality
+                << "\n";
+    }
+    extrapolatedKappas.push_back(toVector(extrapolated, iCalc));
+    std::cout << "extrapolated (order " << std::setprecision(2)
+              << orders(iCalc) << "): trace/d = " << std::setprecision(5)
+              << trace(extrapolated, iCalc) / dimensionality << std::endl;
+  }
+  std::cout.unsetf(std::ios_base::floatfield);
+
+  std::vector<std::vector<int>> meshList;
+  for (const auto &mesh : meshes) {
+    meshList.push_back({mesh(0), mesh(1), mesh(2)});
+  }
+  std::vector<double> orderList(orders.data(), orders.data() + orders.size());
+
+  nlohmann::json output;
+  output["meshes"] = meshList;
+  output["temperatures"] = temps;
+  output["temperatureUnit"] = "K";
+  output["thermalConductivity"] = meshKappas;
+  output["extrapolatedThermalConductivity"] = extrapolatedKappas;
+  output["convergenceOrder"] = orderList;
+  output["thermalConductivityUnit"] = "W /(m K)";
+  output["particleType"] = "phonon";
+  std::ofstream o("convergence_phonon_thermal_cond.json");
+  o << std::setw(3) << output << std::endl;
+  o.close();
+}
+
+Eigen::Tensor<double, 3> PhononTransportApp::solveBTE(
+    Context &context, StatisticsSweep &statisticsSweep, Crystal &crystal,
+    ActiveBandStructure &bandStructure, Interaction3Ph &coupling3Ph,
+    PhononH0 &phononH0, std::shared_ptr<PhPhCouplingCache> couplingCache,
+    VectorBTE *phElLinewidths, const std::string &fileSuffix,
+    Interaction4Ph *coupling4Ph, Eigen::MatrixXd *warmStart,
+    const MeshVectorBTE *meshGuess, MeshVectorBTE *meshSolution,
+    Eigen::MatrixXd *relaxonsGuess, const MeshVectorBTE *meshLinewidths) {
+
+  // names of the output files, e.g. "rta_phonon_thermal_cond.json"
+  auto fileName = [&fileSuffix](const std::string &name) {
+    return name + fileSuffix + ".json";
+  };
+
+  // build/initialize the scattering matrix and the smearing
+  PhScatteringMatrix scatteringMatrix(context, statisticsSweep, bandStructure,
+                                      bandStructure, &coupling3Ph, &phononH0,
+                                      couplingCache, coupling4Ph);
+  if (meshLinewidths != nullptr) {
+    scatteringMatrix.setLinewidthsFromMesh(*meshLinewidths);
+  } else {
+    scatteringMatrix.setup();
+  }
+
+  // if requested, add in the phel linewidths
+  if (phElLinewidths != nullptr) {
 
     // if we're using both phel and phph times, we should output
     // each independent linewidth set. PhEl is output above.
-    scatteringMatrix.outputToJSON("rta_phph_relaxation_times.json");
+    scatteringMatrix.outputRelaxationTimes(fileName("rta_phph_relaxation_times"));
 
     // add in the phel linewidths -- use getLinewidths to remove pop factors
     VectorBTE totalRates = scatteringMatrix.getLinewidths();
-    totalRates = totalRates + phElLinewidths;
+    totalRates = totalRates + *phElLinewidths;
     scatteringMatrix.setLinewidths(totalRates);
-
   }
 
   // solve the BTE at the relaxation time approximation level
@@ -117,31 +515,44 @@ void PhononTransportApp::run(Context &context) {
   VectorBTE popRTA = drift * phononRelTimes;
 
   // output relaxation times
-  scatteringMatrix.outputToJSON("rta_ph_relaxation_times.json");
+  scatteringMatrix.outputRelaxationTimes(fileName("rta_ph_relaxation_times"));
 
-  // compute the thermal conductivity
+  // compute the thermal conductivity, viscosity and specific heat
+  // with a single pass over the band structure
   PhononThermalConductivity phTCond(context, statisticsSweep, crystal, bandStructure);
-  phTCond.calcFromPopulation(popRTA);
+  PhononViscosity phViscosity(context, statisticsSweep, crystal, bandStructure);
+  SpecificHeat specificHeat(context, statisticsSweep, crystal, bandStructure);
+  ObservablesPass observablesPass(statisticsSweep, bandStructure);
+  observablesPass.add(phTCond, popRTA, &phononRelTimes);
+  observablesPass.add(phViscosity, phononRelTimes);
+  observablesPass.add(specificHeat);
+
+  // the Wigner thermal conductivity reuses the same accumulation
+  std::unique_ptr<WignerPhononThermalConductivity> phTCondWigner;
+  if (context.getWignerCorrection()) {
+    phTCondWigner = std::make_unique<WignerPhononThermalConductivity>(
+        context, statisticsSweep, crystal, bandStructure, phononRelTimes);
+    observablesPass.add(*phTCondWigner, popRTA);
+  }
+  observablesPass.calc();
+
   phTCond.print();
-  phTCond.outputToJSON("rta_phonon_thermal_cond.json");
+  phTCond.outputToJSON(fileName("rta_phonon_thermal_cond"));
+  if (context.getSpectralTransportBins() > 0) {
+    phTCond.outputSpectralToJSON(fileName("rta_phonon_thermal_cond_spectral"));
+  }
 
-  // compute the Wigner thermal conductivity
-  WignerPhononThermalConductivity phTCondWigner(context, statisticsSweep, crystal, bandStructure, phononRelTimes);
-  phTCondWigner.calcFromPopulation(popRTA);
-  phTCondWigner.print();
-  phTCondWigner.outputToJSON("wigner_phonon_thermal_cond.json");
+  if (phTCondWigner != nullptr) {
+    phTCondWigner->print();
+    phTCondWigner->outputToJSON(fileName("wigner_phonon_thermal_cond"));
+  }
 
-  // compute the thermal conductivity
-  PhononViscosity phViscosity(context, statisticsSweep, crystal, bandStructure);
-  phViscosity.calcRTA(phononRelTimes);
   phViscosity.print();
-  phViscosity.outputToJSON("rta_phonon_viscosity.json");
+  phViscosity.outputToJSON(fileName("rta_phonon_viscosity"));
 
-  // compute the specific heat
-  SpecificHeat specificHeat(context, statisticsSweep, crystal, bandStructure);
-  specificHeat.calc();
   specificHeat.print();
-  specificHeat.outputToJSON("specific_heat.json");
+  specificHeat.outputToJSON(fileName("specific_heat"));
+  Profiler::recordHostMemory("RTA output");
 
   if (mpi->mpiHead()) {
     std::cout << "\n" << std::string(80, '-') << "\n" << std::endl;
@@ -153,16 +564,21 @@ void PhononTransportApp::run(Context &context) {
   bool doIterative = false;
   bool doVariational = false;
   bool doRelaxons = false;
+  bool doBiCGStab = false;
   for (const auto &s : solverBTE) {
     if (s.compare("iterative") == 0) {   doIterative = true; }
     if (s.compare("variational") == 0) {  doVariational = true; }
     if (s.compare("relaxons") == 0) {    doRelaxons = true; }
+    if (s.compare("bicgstab") == 0) {    doBiCGStab = true; }
   }
 
   // here we do validation of the input, to check for consistency
   if (doRelaxons && !context.getScatteringMatrixInMemory()) {
     Error("Relaxons require matrix kept in memory");
   }
+  if (!doRelaxons && !context.getTransientTimes().empty()) {
+    Warning("transientTimes is only used by the relaxons solver.");
+  }
   if (doRelaxons && context.getUseSymmetries()) {
     Error("Relaxon solver only works without symmetries");
     // Note: this is a problem of the theory I suppose
@@ -170,21 +586,8 @@ void PhononTransportApp::run(Context &context) {
     // or may require some modifications to make it work
     // that we didn't have yet thought of
   }
-  if (doVariational && context.getUseSymmetries()) {
-    Error("Variational solver only works without symmetries");
-    // Note: this is a problem of the theory I suppose
-    // because the scattering matrix may not be anymore symmetric
-    // or may require some modifications to make it work
-    // that we didn't yet think of
-  }
-  if (context.getScatteringMatrixInMemory() &&
-      statisticsSweep.getNumCalculations() != 1) {
-    Error("If scattering matrix is kept in memory, only one "
-          "temperature/chemical potential is allowed in a run");
-  }
-
   if (context.getScatteringMatrixInMemory() && !context.getUseSymmetries()) {
-    if (doVariational || doRelaxons || doIterative) {
+    if (doVariational || doRelaxons || doIterative || doBiCGStab) {
       if ( context.getSymmetrizeMatrix() ) {
         // reinforce the condition that the scattering matrix is symmetric
         // A -> ( A^T + A ) / 2
@@ -194,6 +597,102 @@ void PhononTransportApp::run(Context &context) {
     }
   }
 
+  // the exact solvers may run concurrently on groups of MPI processes, each
+  // with its own copy of the scattering matrix. The solvers are assigned to
+  // the groups in turn, in the order in which they appear below
+  std::vector<std::string> exactSolvers;
+  if (doIterative) { exactSolvers.emplace_back("iterative"); }
+  if (doVariational) { exactSolvers.emplace_back("variational"); }
+  if (doBiCGStab) { exactSolvers.emplace_back("bicgstab"); }
+  if (doRelaxons) { exactSolvers.emplace_back("relaxons"); }
+  int numSolverGroups = std::min({context.getNumSolverGroups(),
+                                  int(exactSolvers.size()), mpi->getSize()});
+  auto solverGroup = [&](const std::string &name) {
+    auto it = std::find(exactSolvers.begin(), exactSolvers.end(), name);
+    return int(it - exactSolvers.begin()) % numSolverGroups;
+  };
+  if (numSolverGroups > 1) {
+    if (!context.getScatteringMatrixInMemory() ||
+        context.getSparseScatteringMatrix()) {
+      Error("numSolverGroups requires the dense scattering matrix in memory");
+    }
+    if (mpi->mpiHead()) {
+      std::cout << "Running the BTE solvers on " << numSolverGroups
+                << " groups of MPI processes.\n" << std::endl;
+    }
+    int groupId = mpi->splitWorld(numSolverGroups);
+    scatteringMatrix.copyToSplitGroup();
+    // from here on, each group only runs its own solvers
+    doIterative = doIterative && solverGroup("iterative") == groupId;
+    doVariational = doVariational && solverGroup("variational") == groupId;
+    doBiCGStab = doBiCGStab && solverGroup("bicgstab") == groupId;
+    doRelaxons = doRelaxons && solverGroup("relaxons") == groupId;
+  }
+
+  if (context.getScatteringMatrixInMemory() &&
+      context.getScatteringMatrixPrecision() == "single") {
+    // the solvers only need products with the matrix, which can be done
+    // with the matrix stored in single precision
+    if (doRelaxons) {
+      Warning("The relaxons solver requires the scattering matrix in double"
+              " precision,\nscatteringMatrixPrecision is ignored.");
+    } else {
+      scatteringMatrix.reducePrecision();
+    }
+  }
+  if (context.getScatteringMatrixInMemory() &&
+      context.getScatteringMatrixOnDevice()) {
+    if (doRelaxons) {
+      Warning("The relaxons solver diagonalizes the scattering matrix on the"
+              " host,\nscatteringMatrixOnDevice is ignored.");
+    } else {
+      scatteringMatrix.copyToDevice();
+    }
+  }
+
+  // initial guess of the iterative solvers, in canonical form: the RTA
+  // solution, plus the deviation from the RTA of a previous solution, if
+  // any, i.e. from a coarser mesh, the previous temperature or a file
+  VectorBTE fRTA = popRTA;
+  fRTA.population2Canonical();
+  VectorBTE fGuess = fRTA;
+  if (doIterative || doVariational || doBiCGStab) {
+    if (meshGuess == nullptr && warmStart != nullptr &&
+        warmStart->size() > 0) {
+      fGuess.data += *warmStart;
+    } else if (meshGuess != nullptr ||
+               !context.getInitialPopulationFileName().empty()) {
+      VectorBTE correction = fRTA;
+      Eigen::VectorXd guessTemperatures;
+      if (meshGuess != nullptr) {
+        guessTemperatures = correction.interpolateFromMesh(*meshGuess);
+      } else {
+        guessTemperatures = correction.interpolateFromHDF5(
+            context.getInitialPopulationFileName());
+      }
+      for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations();
+           iCalc++) {
+        double temperature =
+            statisticsSweep.getCalcStatistics(iCalc).temperature;
+        correction.data.middleRows(3 * iCalc, 3) *=
+            std::pow(guessTemperatures(iCalc) / temperature, 2);
+      }
+      fGuess += correction;
+    }
+  }
+
+  // the deviation from the RTA of the solution of a solver is kept for the
+  // next temperature or mesh and, if requested, written to file
+  Eigen::MatrixXd solutionCorrection;
+  auto storeSolution = [&](VectorBTE &f, const std::string &solverName) {
+    VectorBTE correction = f - fRTA;
+    solutionCorrection = correction.data;
+    if (context.getOutputPopulationBTE()) {
+      correction.outputToHDF5(getHDF5OutputFileName(
+          fileName(solverName + "_phonon_population")));
+    }
+  };
+
   if (doIterative) {
 
     if (mpi->mpiHead()) {
@@ -201,35 +700,58 @@ void PhononTransportApp::run(Context &context) {
     }
 
     // initialize the (old) thermal conductivity
-    PhononThermalConductivity phTCondOld = phTCond;
+    Eigen::Tensor<double, 3> oldCond = phTCond.getThermalConductivity();
 
     VectorBTE fNext(statisticsSweep, bandStructure, 3);
     VectorBTE sMatrixDiagonal = scatteringMatrix.diagonal();
 
-    // from n, we get f, such that n = bose(bose+1)f
-    VectorBTE fRTA = popRTA;
-    fRTA.population2Canonical();
-    VectorBTE fOld = fRTA;
+    VectorBTE fOld = fGuess;
 
     auto threshold = context.getConvergenceThresholdBTE();
 
-    for (int iter = 0; iter < context.getMaxIterationsBTE(); iter++) {
-
-      fNext = scatteringMatrix.offDiagonalDot(fOld) / sMatrixDiagonal;
-      fNext = fRTA - fNext;
+    // different temperatures might converge differently: the calculations
+    // that have converged are frozen, and skipped by the matrix-free product
+    int numCalculations = statisticsSweep.getNumCalculations();
+    std::vector<bool> isActive(numCalculations, true);
+
+    // the solver may resume from a checkpoint of a previous run
+    SolverCheckpoint checkpoint(context, "omini" + fileSuffix);
+    checkpoint.add("fOld", fOld.data);
+    checkpoint.add("oldConductivity", oldCond);
+    checkpoint.add("isActive", isActive);
+    int firstIter = checkpoint.load();
+
+    for (int iter = firstIter; iter < context.getMaxIterationsBTE(); iter++) {
+      checkpoint.save(iter);
+
+      scatteringMatrix.setActiveCalculations(isActive);
+      // fNext = fRTA - offDiagonal(fOld) / diagonal, without temporaries
+      fNext = scatteringMatrix.offDiagonalDot(fOld);
+      fNext /= sMatrixDiagonal;
+      fNext *= -1.;
+      fNext += fRTA;
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        if (!isActive[iCalc]) { // rows of data are (iCalc, iDim)
+          fNext.data.middleRows(3 * iCalc, 3) =
+              fOld.data.middleRows(3 * iCalc, 3);
+        }
+      }
 
       phTCond.calcFromCanonicalPopulation(fNext);
       phTCond.print(iter);
 
-      // this exit condition must be improved
-      // different temperatures might converge differently
       Eigen::Tensor<double,3> newCond = phTCond.getThermalConductivity();
-      Eigen::Tensor<double,3> oldCond = phTCondOld.getThermalConductivity();
-      double diff = findMaxRelativeDifference(newCond, oldCond);
-      if (diff < threshold) {
+      Eigen::VectorXd diffs = findMaxRelativeDifferencePerCalc(newCond, oldCond);
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        if (diffs(iCalc) < threshold) {
+          isActive[iCalc] = false;
+        }
+      }
+      if (std::none_of(isActive.begin(), isActive.end(),
+                       [](bool x) { return x; })) {
         break;
       } else {
-        phTCondOld = phTCond;
+        oldCond = newCond;
         fOld = fNext;
       }
 
@@ -237,8 +759,11 @@ void PhononTransportApp::run(Context &context) {
         Error("Reached max BTE iterations without convergence");
       }
     }
+    scatteringMatrix.setActiveCalculations({});
+    checkpoint.remove();
     phTCond.print();
-    phTCond.outputToJSON("omini_phonon_thermal_cond.json");
+    phTCond.outputToJSON(fileName("omini_phonon_thermal_cond"));
+    storeSolution(fNext, "omini");
 
     if (mpi->mpiHead()) {
       std::cout << "Finished Omini Sparavigna BTE solver\n\n";
@@ -254,11 +779,11 @@ void PhononTransportApp::run(Context &context) {
     // NOTE this is currently un-preconditioned! We should update the algorithm as here
     // See numerical recipies: the minimal residual algorithm, 2.7 Sparse Linear Systems, pg 89
 
-    // note: each iteration should take approximately twice as long as
-    // the iterative method above (in the way it's written here.
+    // note: each iteration takes approximately as long as the iterative
+    // method above, as the matrix is applied once per iteration.
 
     // initialize the (old) thermal conductivity
-    PhononThermalConductivity phTCondOld = phTCond;
+    Eigen::Tensor<double, 3> oldCond = phTCond.getThermalConductivity();
 
     // load the conjugate gradient rescaling factor
     // VectorBTE preconditioning2 = scatteringMatrix.diagonal();
@@ -267,9 +792,8 @@ void PhononTransportApp::run(Context &context) {
     // initialize b
     VectorBTE b = drift; // / preconditioning;
 
-    // initialize first population guess (the RTA solution)
-    VectorBTE f = popRTA;
-    f.population2Canonical();
+    // initialize first population guess
+    VectorBTE f = fGuess;
 
     //  f = f * preconditioning;
     //  b = b / preconditioning;
@@ -279,12 +803,30 @@ void PhononTransportApp::run(Context &context) {
     //  VectorBTE w0 = scatteringMatrix.offDiagonalDot(f) + f;
     VectorBTE r = b - w0;
 
+    // A*f, updated at each iteration by linearity, so that each CG step
+    // needs a single product with the scattering matrix
+    VectorBTE aF = w0;
+
     // search direction
     VectorBTE d = b - w0;
 
     double threshold = context.getConvergenceThresholdBTE();
 
-    for (int iter = 0; iter < context.getMaxIterationsBTE(); iter++) {
+    // with symmetries, a single CG coefficient is used for the three
+    // cartesian components, which are mixed by the rotations of the star
+    bool useSymmetries = context.getUseSymmetries();
+
+    // the solver may resume from a checkpoint of a previous run
+    SolverCheckpoint checkpoint(context, "variational" + fileSuffix);
+    checkpoint.add("f", f.data);
+    checkpoint.add("aF", aF.data);
+    checkpoint.add("residual", r.data);
+    checkpoint.add("searchDirection", d.data);
+    checkpoint.add("oldConductivity", oldCond);
+    int firstIter = checkpoint.load();
+
+    for (int iter = firstIter; iter < context.getMaxIterationsBTE(); iter++) {
+      checkpoint.save(iter);
       // execute CG step, as in
       // https://www.cs.cmu.edu/~quake-papers/painless-conjugate-gradient.pdf
 
@@ -302,41 +844,19 @@ void PhononTransportApp::run(Context &context) {
 //      }
 
       // amount of descent along the search direction
-      int numCalculations = statisticsSweep.getNumCalculations();
-      Eigen::MatrixXd alpha = Eigen::MatrixXd::Zero(numCalculations,3);
-      {
-        Eigen::MatrixXd num = r.dot(r);
-        Eigen::MatrixXd den = d.dot(w);
-        for (int iCalc=0; iCalc<numCalculations; iCalc++) {
-          for (int i : {0,1,2}) {
-            if (den(iCalc,i) != 0.) {
-              alpha(iCalc, i) = num(iCalc, i) / den(iCalc, i);
-            }
-          }
-        }
-      }
+      Eigen::MatrixXd alpha = cgRatio(r.dot(r), d.dot(w), useSymmetries);
 
       // new guess of population
-      VectorBTE fNew = d * alpha + f;
+      VectorBTE fNew = f;
+      fNew.axpy(alpha, d);
 
       // new estimate of residual
-      VectorBTE tmp = w * alpha;
-      VectorBTE rNew = r - tmp;
+      VectorBTE rNew = r;
+      rNew.axpy(-alpha, w);
 
       // amount of correction for the search direction
       // Eigen::MatrixXd beta = (rNew.dot(rNew)).array() / (r.dot(r)).array();
-      Eigen::MatrixXd beta = Eigen::MatrixXd::Zero(numCalculations,3);
-      {
-        Eigen::MatrixXd num = rNew.dot(rNew);
-        Eigen::MatrixXd den = r.dot(r);
-        for (int iCalc=0; iCalc<numCalculations; iCalc++) {
-          for (int i : {0,1,2}) {
-            if (den(iCalc,i) != 0.) {
-              beta(iCalc, i) = num(iCalc, i) / den(iCalc, i);
-            }
-          }
-        }
-      }
+      Eigen::MatrixXd beta = cgRatio(rNew.dot(rNew), r.dot(r), useSymmetries);
 
 //      // note: this is to avoid a 0/0 division for low dimensional problems
 //      for (int i=dimensionality; i<3; i++) {
@@ -346,24 +866,27 @@ void PhononTransportApp::run(Context &context) {
 //      }
 
       // new search direction
-      VectorBTE dNew = d * beta + rNew;
+      VectorBTE dNew = rNew;
+      dNew.axpy(beta, d);
 
       // compute thermal conductivity
-      auto aF = scatteringMatrix.dot(fNew);
-      //  auto aF = scatteringMatrix.offDiagonalDot(fNew) + fNew;
-      phTCond.calcVariational(aF, f, b);
+      // A*fNew = A*f + alpha*A*d, without applying again the matrix
+      VectorBTE aFNew = aF;
+      aFNew.axpy(alpha, w);
+      phTCond.calcVariational(aFNew, f, b);
 
       phTCond.print(iter);
 
       // decide whether to exit or run the next iteration
       Eigen::Tensor<double,3> newCond = phTCond.getThermalConductivity();
-      Eigen::Tensor<double,3> oldCond = phTCondOld.getThermalConductivity();
       double diff = findMaxRelativeDifference(newCond, oldCond);
       if (diff < threshold) {
+        f = fNew;
         break;
       } else {
-        phTCondOld = phTCond;
+        oldCond = newCond;
         f = fNew;
+        aF = aFNew;
         r = rNew;
         d = dNew;
       }
@@ -373,9 +896,11 @@ void PhononTransportApp::run(Context &context) {
       }
     }
 
+    checkpoint.remove();
     // nice formatting of the thermal conductivity at the last step
     phTCond.print();
-    phTCond.outputToJSON("variational_phonon_thermal_cond.json");
+    phTCond.outputToJSON(fileName("variational_phonon_thermal_cond"));
+    storeSolution(f, "variational");
 
     if (mpi->mpiHead()) {
       std::cout << "Finished variational BTE solver\n\n";
@@ -383,23 +908,166 @@ void PhononTransportApp::run(Context &context) {
     }
   }
 
+  if (doBiCGStab) {
+    if (mpi->mpiHead()) {
+      std::cout << "Starting BiCGStab BTE solver\n" << std::endl;
+    }
+
+    // We solve A f = D fRTA, where A = D + O is the scattering matrix, D its
+    // diagonal and O the off-diagonal part, i.e. the same linear system
+    // whose fixed point is found by the Omini Sparavigna method.
+    // We use the stabilized bi-conjugate gradient method, which doesn't
+    // require A to be symmetric (hence, it works with symmetries), with the
+    // right-preconditioner M = D. Note that each iteration applies A twice.
+    // See H. A. van der Vorst, SIAM J. Sci. Stat. Comput. 13, 631 (1992).
+
+    // initialize the (old) thermal conductivity
+    Eigen::Tensor<double, 3> oldCond = phTCond.getThermalConductivity();
+
+    VectorBTE sMatrixDiagonal = scatteringMatrix.diagonal();
+
+    // as for the other solvers, the scalar coefficients of the method are
+    // matrices of size (numCalculations,3), shared by the three cartesian
+    // components when these are coupled by the symmetries
+    int numCalculations = statisticsSweep.getNumCalculations();
+    bool useSymmetries = context.getUseSymmetries();
+
+    VectorBTE b = fRTA * sMatrixDiagonal;
+    VectorBTE f = fGuess;
+
+    // residual and shadow residual
+    VectorBTE af = scatteringMatrix.dot(f);
+    VectorBTE r = b - af;
+    VectorBTE rHat = r;
+
+    VectorBTE p = r;
+    p.data.setZero();
+    VectorBTE v = p;
+    Eigen::MatrixXd rho = Eigen::MatrixXd::Ones(numCalculations, 3);
+    Eigen::MatrixXd alpha = Eigen::MatrixXd::Ones(numCalculations, 3);
+    Eigen::MatrixXd omega = Eigen::MatrixXd::Ones(numCalculations, 3);
+
+    double threshold = context.getConvergenceThresholdBTE();
+
+    // the solver may resume from a checkpoint of a previous run
+    SolverCheckpoint checkpoint(context, "bicgstab" + fileSuffix);
+    checkpoint.add("f", f.data);
+    checkpoint.add("residual", r.data);
+    checkpoint.add("shadowResidual", rHat.data);
+    checkpoint.add("searchDirection", p.data);
+    checkpoint.add("v", v.data);
+    checkpoint.add("rho", rho);
+    checkpoint.add("alpha", alpha);
+    checkpoint.add("omega", omega);
+    checkpoint.add("oldConductivity", oldCond);
+    int firstIter = checkpoint.load();
+
+    for (int iter = firstIter; iter < context.getMaxIterationsBTE(); iter++) {
+      checkpoint.save(iter);
+
+      Eigen::MatrixXd rhoNew = rHat.dot(r);
+      Eigen::MatrixXd beta =
+          cgRatio(rhoNew, rho, useSymmetries)
+              .cwiseProduct(cgRatio(alpha, omega, useSymmetries));
+      rho = rhoNew;
+
+      // new search direction p = r + beta (p - omega v)
+      p.axpy(-omega, v);
+      p *= beta;
+      p += r;
+
+      // preconditioned search direction
+      VectorBTE y = p / sMatrixDiagonal;
+      v = scatteringMatrix.dot(y);
+      alpha = cgRatio(rho, rHat.dot(v), useSymmetries);
+
+      // s = r - alpha v
+      VectorBTE s = r;
+      s.axpy(-alpha, v);
+
+      // stabilizing step
+      VectorBTE z = s / sMatrixDiagonal;
+      VectorBTE t = scatteringMatrix.dot(z);
+      omega = cgRatio(t.dot(s), t.dot(t), useSymmetries);
+
+      // new guess of the population, f = f + alpha y + omega z
+      f.axpy(alpha, y);
+      f.axpy(omega, z);
+
+      // new residual r = s - omega t
+      r = s;
+      r.axpy(-omega, t);
+
+      phTCond.calcFromCanonicalPopulation(f);
+      phTCond.print(iter);
+
+      // decide whether to exit or run the next iteration
+      Eigen::Tensor<double,3> newCond = phTCond.getThermalConductivity();
+      double diff = findMaxRelativeDifference(newCond, oldCond);
+      if (diff < threshold) {
+        break;
+      } else {
+        oldCond = newCond;
+      }
+
+      if (iter == context.getMaxIterationsBTE() - 1) {
+        Error("Reached max BTE iterations without convergence");
+      }
+    }
+    checkpoint.remove();
+    phTCond.print();
+    phTCond.outputToJSON(fileName("bicgstab_phonon_thermal_cond"));
+    storeSolution(f, "bicgstab");
+
+    if (mpi->mpiHead()) {
+      std::cout << "Finished BiCGStab BTE solver\n\n";
+      std::cout << std::string(80, '-') << "\n" << std::endl;
+    }
+  }
+
   if (doRelaxons) {
     if (mpi->mpiHead()) {
       std::cout << "Starting relaxons BTE solver" << std::endl;
     }
-    scatteringMatrix.a2Omega();
+    // the lobpcg eigensolver only needs products with Omega, so the matrix
+    // A is left unchanged and can still be used afterwards
+    bool useOmegaView = context.getRelaxonsEigenSolver() == "lobpcg";
+    if (useOmegaView) {
+      scatteringMatrix.setOmegaView(true);
+    } else {
+      scatteringMatrix.a2Omega();
+    }
 
     // Calculate Du(i,j) before we diagonalize the matrix and ruin it
     // to calculate D we need the phi vectors, so we here calculate ahead of time
     // here -- they are saved internally to the class
     phViscosity.calcSpecialEigenvectors();
     // create the real space solver transport coefficients
-    phViscosity.outputRealSpaceToJSON(scatteringMatrix);
+    phViscosity.outputRealSpaceToJSON(
+        scatteringMatrix, fileName("ph_relaxons_real_space_coeffs"));
 
-    // NOTE: scattering matrix is destroyed in this process, do not use it afterwards!
-    auto tup2 = scatteringMatrix.diagonalize(context.getNumRelaxonsEigenvalues());
+    // NOTE: scattering matrix is destroyed in this process (unless the lobpcg
+    // eigensolver is used), do not use it afterwards!
+    auto tup2 = scatteringMatrix.diagonalize(
+        context.getNumRelaxonsEigenvalues(), relaxonsGuess);
     auto eigenvalues = std::get<0>(tup2);
     auto eigenvectors = std::get<1>(tup2);
+    if (useOmegaView) {
+      scatteringMatrix.setOmegaView(false);
+    }
+    // keep the relaxons found by the partial eigensolver, replicated on all
+    // processes, as initial guess at the next temperature
+    if (relaxonsGuess != nullptr && context.getNumRelaxonsEigenvalues() > 0) {
+      auto numRelaxons = int(eigenvalues.size());
+      *relaxonsGuess = Eigen::MatrixXd::Zero(eigenvectors.rows(), numRelaxons);
+      for (int alpha : eigenvectors.getAllLocalCols()) {
+        if (alpha >= numRelaxons) continue;
+        for (int iBte : eigenvectors.getAllLocalRows()) {
+          (*relaxonsGuess)(iBte, alpha) = eigenvectors(iBte, alpha);
+        }
+      }
+      mpi->allReduceSum(relaxonsGuess);
+    }
     // EV such that Omega = V D V^-1
     // eigenvectors(phonon index, eigenvalue index)
 
@@ -407,15 +1075,25 @@ void PhononTransportApp::run(Context &context) {
     phTCond.calcFromRelaxons(context, statisticsSweep, eigenvectors,
                              scatteringMatrix, eigenvalues);
     phTCond.print();
-    phTCond.outputToJSON("relaxons_phonon_thermal_cond.json");
+    phTCond.outputToJSON(fileName("relaxons_phonon_thermal_cond"));
+    if (!context.getACFrequencies().empty()) {
+      phTCond.calcACFromRelaxons(eigenvectors, eigenvalues);
+      phTCond.outputACToJSON(fileName("relaxons_phonon_thermal_cond_ac"));
+    }
 
     // output relaxation times
-    scatteringMatrix.relaxonsToJSON("relaxons_relaxation_times.json", eigenvalues);
+    scatteringMatrix.outputRelaxonsTimes(fileName("relaxons_relaxation_times"), eigenvalues);
 
     if (!context.getUseSymmetries()) {
       phViscosity.calcFromRelaxons(eigenvalues, eigenvectors);
       phViscosity.print();
-      phViscosity.outputToJSON("relaxons_phonon_viscosity.json");
+      phViscosity.outputToJSON(fileName("relaxons_phonon_viscosity"));
+    }
+
+    if (!context.getTransientTimes().empty()) {
+      outputTransientRelaxons(context, statisticsSweep, bandStructure,
+                              eigenvectors, eigenvalues,
+                              fileName("relaxons_transient"));
     }
 
     if (mpi->mpiHead()) {
@@ -423,7 +1101,200 @@ void PhononTransportApp::run(Context &context) {
       std::cout << std::string(80, '-') << "\n" << std::endl;
     }
   }
-  mpi->barrier();
+
+  // the thermal conductivity of the last solver, in the output units
+  double conversion = std::get<0>(phTCond.getOutputUnits());
+  Eigen::Tensor<double, 3> conductivity =
+      phTCond.getThermalConductivity() * conversion;
+
+  // all processes get the results of the solvers that ran on other groups
+  if (numSolverGroups > 1) {
+    mpi->mergeWorld();
+    auto bcastFromGroup = [&](Eigen::MatrixXd &x, const int &iGroup) {
+      int root = mpi->getSplitGroupHead(iGroup, numSolverGroups);
+      int numRows = int(x.rows());
+      int numCols = int(x.cols());
+      mpi->bcast(&numRows, mpi->worldComm, root);
+      mpi->bcast(&numCols, mpi->worldComm, root);
+      x.resize(numRows, numCols);
+      mpi->bcast(&x, mpi->worldComm, root);
+    };
+    std::string lastPopulationSolver;
+    for (const auto &s : exactSolvers) {
+      if (s != "relaxons") { lastPopulationSolver = s; }
+    }
+    if (!lastPopulationSolver.empty()) {
+      bcastFromGroup(solutionCorrection, solverGroup(lastPopulationSolver));
+    }
+    if (exactSolvers.back() == "relaxons" && relaxonsGuess != nullptr) {
+      bcastFromGroup(*relaxonsGuess, solverGroup("relaxons"));
+    }
+    mpi->bcast(&conductivity, mpi->worldComm,
+               mpi->getSplitGroupHead(solverGroup(exactSolvers.back()),
+                                      numSolverGroups));
+  }
+
+  if (solutionCorrection.size() > 0) {
+    if (warmStart != nullptr) {
+      *warmStart = solutionCorrection;
+    }
+    if (meshSolution != nullptr) {
+      VectorBTE correction = fRTA;
+      correction.data = solutionCorrection;
+      *meshSolution = correction.unfoldOnMesh();
+    }
+  }
+  return conductivity;
+}
+
+void PhononTransportApp::outputTransientRelaxons(
+    Context &context, StatisticsSweep &statisticsSweep,
+    ActiveBandStructure &bandStructure, ParallelMatrix<double> &eigenvectors,
+    const Eigen::VectorXd &eigenvalues, const std::string &outFileName) {
+
+  if (mpi->mpiHead()) {
+    std::cout << "Computing the transient phonon populations" << std::endl;
+  }
+
+  std::vector<double> times = context.getTransientTimes();
+  std::vector<double> pumpEnergies = context.getTransientPumpEnergies();
+  double pumpWidth = context.getTransientPumpWidth();
+  auto numTimes = int(times.size());
+  auto numPumps = int(pumpEnergies.size());
+  auto numRelaxons = int(eigenvalues.size());
+  int numStates = bandStructure.getNumStates();
+  auto particle = bandStructure.getParticle();
+
+  int iCalc = 0; // relaxons only allows one calc in memory
+  double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
+  double chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
+
+  // the relaxons diagonalize the symmetrized matrix, acting on the
+  // populations divided by sqrt(n(n+1)).
+  // The pumps excite the phonons within pumpWidth of the pump energy, with
+  // populations normalized to a unit deposited energy
+  Eigen::VectorXd energies = Eigen::VectorXd::Zero(numStates);
+  Eigen::VectorXd popTerms = Eigen::VectorXd::Zero(numStates);
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates, numPumps);
+  for (int is = 0; is < numStates; is++) {
+    StateIndex isIdx(is);
+    double en = bandStructure.getEnergy(isIdx);
+    if (en <= 0.) {
+      continue;
+    }
+    energies(is) = en;
+    popTerms(is) = sqrt(particle.getPopPopPm1(en, temp, chemPot));
+    for (int iPump = 0; iPump < numPumps; iPump++) {
+      double arg = (en - pumpEnergies[iPump]) / pumpWidth;
+      x(is, iPump) = exp(-0.5 * arg * arg);
+    }
+  }
+  for (int iPump = 0; iPump < numPumps; iPump++) {
+    double depositedEnergy = energies.dot(x.col(iPump));
+    if (depositedEnergy == 0.) {
+      Error("No phonon state is excited by the transient pump at " +
+            std::to_string(pumpEnergies[iPump] * energyRyToEv * 1000.) +
+            " meV");
+    }
+    x.col(iPump) /= depositedEnergy;
+    x.col(iPump).array() /= popTerms.array().max(1.e-300);
+  }
+
+  // projections of the initial populations on the relaxons, done once
+  Eigen::MatrixXd projections = eigenvectors.projectColumns(x, numRelaxons);
+
+  // in the units of the code, the relaxon alpha decays with the rate
+  // eigenvalue/(2 pi), as in the output relaxation times.
+  // Non-positive eigenvalues (e.g. the energy conserving relaxon) are kept
+  // constant in time
+  auto damping = [&](const int &alpha, const double &time) {
+    double rate = eigenvalues(alpha) / twoPi;
+    return rate > 0. ? exp(-rate * time) : 1.;
+  };
+
+  // the thermal population, dn/dT, in the symmetrized basis, used to find
+  // the energy that has reached a thermal distribution
+  Eigen::VectorXd thermalVector = popTerms.cwiseProduct(energies);
+
+  // bins of the energy-resolved excess energy, as wide as the pump
+  int numBins = std::max(1, int(ceil(energies.maxCoeff() / pumpWidth)));
+  std::vector<std::vector<std::vector<double>>> spectra(
+      numPumps, std::vector<std::vector<double>>(
+                    numTimes, std::vector<double>(numBins, 0.)));
+  std::vector<std::vector<double>> excessEnergies(
+      numPumps, std::vector<double>(numTimes, 0.));
+  std::vector<std::vector<double>> thermalEnergies(
+      numPumps, std::vector<double>(numTimes, 0.));
+
+  // several times are rotated back with a single product, in chunks which
+  // bound the memory of the populations replicated on each process
+  int timesPerChunk = std::max(1, 64 / numPumps);
+  for (int t0 = 0; t0 < numTimes; t0 += timesPerChunk) {
+    int chunkSize = std::min(timesPerChunk, numTimes - t0);
+    Eigen::MatrixXd c(numRelaxons, chunkSize * numPumps);
+    for (int iTime = 0; iTime < chunkSize; iTime++) {
+      for (int alpha = 0; alpha < numRelaxons; alpha++) {
+        double d = damping(alpha, times[t0 + iTime]);
+        for (int iPump = 0; iPump < numPumps; iPump++) {
+          c(alpha, iTime * numPumps + iPump) = d * projections(alpha, iPump);
+        }
+      }
+    }
+    Eigen::MatrixXd y = eigenvectors.combineColumns(c);
+
+    if (!mpi->mpiHead()) {
+      continue;
+    }
+    for (int iTime = 0; iTime < chunkSize; iTime++) {
+      for (int iPump = 0; iPump < numPumps; iPump++) {
+        int iCol = iTime * numPumps + iPump;
+        std::vector<double> &spectrum = spectra[iPump][t0 + iTime];
+        double excessEnergy = 0.;
+        for (int is = 0; is < numStates; is++) {
+          // energy of the population deviation, back to the phonon basis
+          double e = energies(is) * popTerms(is) * y(is, iCol);
+          excessEnergy += e;
+          int iBin = std::min(int(energies(is) / pumpWidth), numBins - 1);
+          spectrum[iBin] += e;
+        }
+        excessEnergies[iPump][t0 + iTime] = excessEnergy;
+        // the projection of y on the thermal vector u is a temperature
+        // change, whose energy is proportional to u.u: the energy of the
+        // thermal component is simply u.y
+        thermalEnergies[iPump][t0 + iTime] = thermalVector.dot(y.col(iCol));
+      }
+    }
+  }
+
+  if (!mpi->mpiHead()) {
+    return;
+  }
+  std::vector<double> outTimes, outPumpEnergies, binEnergies;
+  for (double t : times) {
+    outTimes.push_back(t * timeAuToFs * 1.0e-3);
+  }
+  for (double e : pumpEnergies) {
+    outPumpEnergies.push_back(e * energyRyToEv * 1000.);
+  }
+  for (int iBin = 0; iBin < numBins; iBin++) {
+    binEnergies.push_back((iBin + 0.5) * pumpWidth * energyRyToEv * 1000.);
+  }
+  nlohmann::json output;
+  output["temperature"] = temp * temperatureAuToSi;
+  output["temperatureUnit"] = "K";
+  output["times"] = outTimes;
+  output["timeUnit"] = "ps";
+  output["pumpEnergies"] = outPumpEnergies;
+  output["pumpWidth"] = pumpWidth * energyRyToEv * 1000.;
+  output["energyBins"] = binEnergies;
+  output["energyUnit"] = "meV";
+  output["numRelaxons"] = numRelaxons;
+  output["excessEnergy"] = excessEnergies;
+  output["thermalizedEnergy"] = thermalEnergies;
+  output["excessEnergySpectrum"] = spectra;
+  std::ofstream o(outFileName);
+  o << std::setw(3) << output << std::endl;
+  o.close();
 }
 
 // helper function to generate phEl rates
@@ -510,17 +1381,83 @@ VectorBTE PhononTransportApp::getPhononElectronLinewidth(Context& context, Cryst
         "perhaps use more OMP threads instead.");
     }
     phelScatteringMatrix.setup();
-    phelScatteringMatrix.outputToJSON("rta_phel_relaxation_times.json");
+    phelScatteringMatrix.outputRelaxationTimes("rta_phel_relaxation_times.json");
 
     // important to use getLinewidths here instead of diagonal() -- they
     // do not return the same thing (diagonal has population factors)
     VectorBTE phononElectronRates = phelScatteringMatrix.getLinewidths();
+#ifdef HDF5_AVAIL
+    // to be reused by other runs with phElLinewidthsFileName
+    phononElectronRates.outputToHDF5("phel_linewidths.hdf5");
+#endif
     return phononElectronRates;
 }
 
+MeshVectorBTE PhononTransportApp::computeMeshLinewidths(
+    Context &context, Crystal &crystal, PhononH0 &phononH0,
+    Interaction3Ph &coupling3Ph, Interaction4Ph *coupling4Ph) {
+  Eigen::Vector3i qMesh = context.getQMesh();
+  // the scattering rates are normalized with the mesh in context
+  context.setQMesh(context.getLinewidthsQMesh());
+  if (mpi->mpiHead()) {
+    std::cout << "\nComputing the phonon linewidths on the coarse mesh "
+              << context.getQMesh().transpose() << "." << std::endl;
+  }
+  Points coarsePoints(crystal, context.getQMesh());
+  auto tup = ActiveBandStructure::builder(context, phononH0, coarsePoints);
+  auto coarseBandStructure = std::get<0>(tup);
+  auto coarseStatisticsSweep = std::get<1>(tup);
+
+  PhScatteringMatrix coarseMatrix(context, coarseStatisticsSweep,
+                                  coarseBandStructure, coarseBandStructure,
+                                  &coupling3Ph, &phononH0, nullptr,
+                                  coupling4Ph);
+  coarseMatrix.setup();
+  coarseMatrix.outputRelaxationTimes(
+      "rta_ph_relaxation_times_linewidths_mesh.json");
+  MeshVectorBTE meshLinewidths = coarseMatrix.getMeshLinewidths();
+  context.setQMesh(qMesh);
+
+  if (mpi->mpiHead()) {
+    std::cout << "Done computing the phonon linewidths, which are "
+                 "interpolated on qMesh.\n" << std::endl;
+  }
+  return meshLinewidths;
+}
+
+VectorBTE PhononTransportApp::readPhononElectronLinewidth(
+    Context &context, StatisticsSweep &statisticsSweep,
+    ActiveBandStructure &bandStructure) {
+  std::string fileName = context.getPhElLinewidthsFileName();
+  if (mpi->mpiHead()) {
+    std::cout << "\nReading phonon-electron linewidths from " << fileName
+              << "." << std::endl;
+  }
+  VectorBTE linewidths(statisticsSweep, bandStructure, 1);
+  Eigen::VectorXd fileTemperatures = linewidths.interpolateFromHDF5(fileName);
+
+  // the file is interpolated on the mesh, but not in temperature
+  for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
+    double temperature = statisticsSweep.getCalcStatistics(iCalc).temperature;
+    if (std::abs(fileTemperatures(iCalc) - temperature) > 1e-6 * temperature) {
+      Error("The phonon-electron linewidths of " + fileName +
+            " were not computed at " +
+            std::to_string(temperature * temperatureAuToSi) + " K.");
+    }
+  }
+  return linewidths;
+}
+
 void PhononTransportApp::checkRequirements(Context &context) {
   throwErrorIfUnset(context.getPhFC2FileName(), "PhFC2FileName");
   throwErrorIfUnset(context.getQMesh(), "qMesh");
+  for (int divisor : context.getConvergenceMeshDivisors()) {
+    for (int i : {0, 1, 2}) {
+      if (context.getQMesh()(i) > 1 && context.getQMesh()(i) % divisor != 0) {
+        Error("convergenceMeshDivisors must divide the components of qMesh");
+      }
+    }
+  }
   throwWarningIfUnset(context.getSumRuleFC2(), "sumRuleFC2");
   throwErrorIfUnset(context.getPhFC3FileName(), "PhFC3FileName");
   throwErrorIfUnset(context.getTemperatures(), "temperatures");
@@ -528,7 +1465,24 @@ void PhononTransportApp::checkRequirements(Context &context) {
   if (context.getSmearingMethod() == DeltaFunction::gaussian) {
     throwErrorIfUnset(context.getSmearingWidth(), "smearingWidth");
   }
-  if (!context.getElphFileName().empty()) {
+  if (!context.getTransientTimes().empty()) {
+    if (context.getTransientPumpEnergies().empty()) {
+      Error("transientTimes requires transientPumpEnergies");
+    }
+    throwErrorIfUnset(context.getTransientPumpWidth(), "transientPumpWidth");
+  }
+  if (context.getLinewidthsQMesh().prod() > 0) {
+    // the exact solvers need the off-diagonal part of the matrix on qMesh
+    if (!context.getSolverBTE().empty()) {
+      Error("linewidthsQMesh can only be used with the RTA solver");
+    }
+    if (context.getOutputUNTimes()) {
+      Error("outputUNTimes can't be used with linewidthsQMesh");
+    }
+  }
+  // the ph-el scattering is only computed if not read from file
+  if (!context.getElphFileName().empty() &&
+      context.getPhElLinewidthsFileName().empty()) {
     throwErrorIfUnset(context.getElectronH0Name(), "electronH0Name");
     throwErrorIfUnset(context.getKMesh(), "kMesh");
     if (context.getDopings().size() == 0 &&
@@ -2,6 +2,9 @@
 #define PHONON_TRANSPORT_APP_H
 
 #include "app.h"
+#include "interaction_3ph.h"
+#include "ph_scattering.h"
+#include "statistics_sweep.h"
 #include "vector_bte.h"
 #include "phonon_h0.h"
 #include <string>
@@ -13,9 +16,118 @@ public:
   void run(Context &context) override;
   void checkRequirements(Context &context) override;
  private:
+  /** Builds the phonon band structure on the mesh qMesh of context, and
+   * solves the BTE for all temperatures.
+   * @param meshSuffix: string appended to the names of the output files.
+   * @param meshGuess: if not null, the solution on another (coarser) mesh,
+   * interpolated as initial guess of the iterative solvers.
+   * @param meshSolution: if not null, set to the solution on this mesh.
+   * @param meshLinewidths: if not null, the linewidths on a coarser mesh,
+   * which are interpolated instead of building the scattering matrix.
+   * @return conductivity: the thermal conductivity of the last solver, with
+   * indices (iCalc, i, j), in the units of the output files.
+   */
+  Eigen::Tensor<double, 3> solveOnMesh(Context &context, Crystal &crystal,
+                                       PhononH0 &phononH0,
+                                       Interaction3Ph &coupling3Ph,
+                                       Interaction4Ph *coupling4Ph,
+                                       const std::string &meshSuffix,
+                                       const MeshVectorBTE *meshGuess,
+                                       MeshVectorBTE *meshSolution,
+                                       const MeshVectorBTE *meshLinewidths);
+  /** Writes the thermal conductivity of a convergence study on nested
+   * meshes, with its Richardson extrapolation to an infinitely dense mesh,
+   * to convergence_phonon_thermal_cond.json.
+   * @param meshes: the meshes, from the coarsest to the densest.
+   * @param divisors: the divisors of qMesh defining each mesh.
+   * @param conductivities: the conductivity on each mesh.
+   */
+  void outputConvergenceStudy(
+      Context &context, const std::vector<Eigen::Vector3i> &meshes,
+      const std::vector<int> &divisors,
+      const std::vector<Eigen::Tensor<double, 3>> &conductivities);
+  /** Builds the phonon scattering matrix and solves the BTE, with all the
+   * solvers requested in input, for the calculations of statisticsSweep.
+   * @param couplingCache: cache of the ph-ph transition weights, shared by
+   * the calls for different temperatures (may be null).
+   * @param phElLinewidths: if not null, the phonon-electron linewidths that
+   * are added to the diagonal of the scattering matrix.
+   * @param fileSuffix: string appended to the names of the output files.
+   * @param coupling4Ph: if not null, the 4-phonon coupling, whose linewidths
+   * are added to the diagonal of the scattering matrix.
+   * @param warmStart: if not null, the deviation from the RTA of the
+   * canonical population used as initial guess of the iterative solvers
+   * (if not empty), replaced on output by the deviation of the solution.
+   * @param meshGuess: if not null, the deviation from the RTA of a solution
+   * on another mesh, interpolated as initial guess (it has precedence over
+   * warmStart).
+   * @param meshSolution: if not null, set to the deviation from the RTA of
+   * the solution, unfolded on the mesh.
+   * @param relaxonsGuess: if not null, the relaxon eigenvectors used as
+   * initial guess of the partial eigensolver (if not empty), replaced on
+   * output by the relaxons found here.
+   * @param meshLinewidths: if not null, the phonon linewidths on another
+   * mesh (see computeMeshLinewidths()), interpolated on the states of
+   * bandStructure instead of building the scattering matrix.
+   * @return conductivity: the thermal conductivity of the last solver, with
+   * indices (iCalc, i, j), in the units of the output files.
+   */
+  Eigen::Tensor<double, 3>
+  solveBTE(Context &context, StatisticsSweep &statisticsSweep,
+           Crystal &crystal, ActiveBandStructure &bandStructure,
+           Interaction3Ph &coupling3Ph, PhononH0 &phononH0,
+           std::shared_ptr<PhPhCouplingCache> couplingCache,
+           VectorBTE *phElLinewidths, const std::string &fileSuffix,
+           Interaction4Ph *coupling4Ph = nullptr,
+           Eigen::MatrixXd *warmStart = nullptr,
+           const MeshVectorBTE *meshGuess = nullptr,
+           MeshVectorBTE *meshSolution = nullptr,
+           Eigen::MatrixXd *relaxonsGuess = nullptr,
+           const MeshVectorBTE *meshLinewidths = nullptr);
+  /** Computes the phonon linewidths (ph-ph, and 4-phonon if requested) on
+   * the coarse mesh linewidthsQMesh, unfolded on the full mesh, so that they
+   * can be interpolated on the states of the denser qMesh, where the
+   * transport integrals are evaluated. The cost of the scattering rates
+   * scales with the square (ph-ph) or the cube (4-phonon) of the number of
+   * points of the coarse mesh.
+   * The relaxation times on the coarse mesh are written to
+   * rta_ph_relaxation_times_linewidths_mesh.json.
+   */
+  MeshVectorBTE computeMeshLinewidths(Context &context, Crystal &crystal,
+                                      PhononH0 &phononH0,
+                                      Interaction3Ph &coupling3Ph,
+                                      Interaction4Ph *coupling4Ph);
+  /** Propagates in time the phonon populations excited by a pump, using
+   * the eigenvalues and eigenvectors of the relaxons solver. In the relaxon
+   * basis, the BTE without drift is diagonal, so that each initial
+   * population is projected once on the relaxons, and the populations at
+   * all times are obtained by damping the projections and rotating them
+   * back, for all pumps and times with a single matrix product.
+   * The energy-resolved excess energy at each time is written to file.
+   * @param eigenvectors: relaxon eigenvectors, in the symmetrized basis.
+   * @param eigenvalues: relaxon eigenvalues.
+   * @param outFileName: name of the json output file.
+   */
+  void outputTransientRelaxons(Context &context,
+                               StatisticsSweep &statisticsSweep,
+                               ActiveBandStructure &bandStructure,
+                               ParallelMatrix<double> &eigenvectors,
+                               const Eigen::VectorXd &eigenvalues,
+                               const std::string &outFileName);
+  /** Computes the phonon-electron linewidths of the states of
+   * phBandStructure, which are also written to phel_linewidths.hdf5.
+   */
   VectorBTE getPhononElectronLinewidth(Context& context, Crystal& crystalPh,
                                        ActiveBandStructure& phBandStructure,
                                        PhononH0& phononH0);
+
+  /** Reads the phonon-electron linewidths from the file
+   * phElLinewidthsFileName, interpolating them on the states of
+   * bandStructure if the file comes from a different mesh.
+   */
+  VectorBTE readPhononElectronLinewidth(Context &context,
+                                        StatisticsSweep &statisticsSweep,
+                                        ActiveBandStructure &bandStructure);
 };
 
 #endif
@@ -483,7 +483,7 @@ void writeElPhCouplingHDF5v1(
     {
       // open the hdf5 file
       HighFive::FileAccessProps fapl;// = HighFive::FileAccessProps{};
-      fapl.add(HighFive::MPIOFileAccess<MPI_Comm, MPI_Info>(MPI_COMM_WORLD, MPI_INFO_NULL));
+      fapl.add(HighFive::MPIOFileAccess<MPI_Comm, MPI_Info>(mpi->getComm(), MPI_INFO_NULL));
       HighFive::File file(outFileName, HighFive::File::Overwrite, fapl);
 
       // flatten the tensor (tensor is not supported) and create the data set
@@ -663,30 +663,21 @@ void writeElPhCouplingHDF5v2(
     // small quantities as in the next block.
 
     {
-      // open the hdf5 file and remove existing files
-      if (mpi->mpiHead()) {
-        HighFive::File file(outFileName, HighFive::File::Overwrite);
-      }
-      mpi->barrier(); // wait for file to be overwritten
-
-      // now open the file in serial mode
-      // because we do the parallelization by hand
-      HighFive::File file(outFileName, HighFive::File::Overwrite);
-
       // create buffer to save a slice of the tensor, at fixed irE
       Eigen::Tensor<std::complex<double>, 4> slice;
       slice.resize(numWannier, numWannier, numModes, numPhBravaisVectors);
+      Eigen::VectorXcd flatSlice(slice.size());
 
       auto irEIterator = mpi->divideWorkIter(elDegeneracies.size());
-      for (int irE : irEIterator) {
+
+      // copies the irE-th slice of gWannier in flatSlice
+      auto fillSlice = [&](const int &irE) {
         int irELocal;
         if (matrixDistributed) {
           irELocal = irE - irEIterator[0];
         } else {
           irELocal = irE;
         }
-
-        // select a slice
         for (int irP = 0; irP < numPhBravaisVectors; irP++) {
           for (int nu = 0; nu < numModes; nu++) {
             for (int i = 0; i < numWannier; i++) {
@@ -696,20 +687,53 @@ void writeElPhCouplingHDF5v2(
             }
           }
         }
-
-        // flatten the tensor in a vector
-        Eigen::VectorXcd flatSlice = Eigen::Map<Eigen::VectorXcd, Eigen::Unaligned>(
+        flatSlice = Eigen::Map<Eigen::VectorXcd, Eigen::Unaligned>(
             slice.data(), slice.size());
+      };
+
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+      // open the file collectively. Each process writes the slices it owns,
+      // so that the tensor is never gathered on a single process.
+      HighFive::FileAccessProps fapl;
+      fapl.add(HighFive::MPIOFileAccess<MPI_Comm, MPI_Info>(mpi->getComm(),
+                                                            MPI_INFO_NULL));
+      HighFive::File file(outFileName, HighFive::File::Overwrite, fapl);
 
+      // dataset creation is a collective operation in parallel HDF5:
+      // all processes must create all the datasets, in the same order
+      std::vector<HighFive::DataSet> datasets;
+      for (int irE = 0; irE < numElBravaisVectors; irE++) {
         std::string datasetName = "/gWannier_" + std::to_string(irE);
+        datasets.push_back(file.createDataSet<std::complex<double>>(
+            datasetName, HighFive::DataSpace::From(flatSlice)));
+      }
 
-        // create dataset
-        HighFive::DataSet dslice = file.createDataSet<std::complex<double>>(
-            datasetName, HighFive::DataSpace::From(flatSlice));
+      for (int irE : irEIterator) {
+        fillSlice(irE);
+        datasets[irE].write(flatSlice);
+      }
+#else
+      // open the hdf5 file and remove existing files
+      if (mpi->mpiHead()) {
+        HighFive::File file(outFileName, HighFive::File::Overwrite);
+      }
+      mpi->barrier(); // wait for file to be overwritten
 
-        // write to hdf5
-        dslice.write(flatSlice);
+      // HDF5 was built serially: processes take turns to append their slices
+      for (int iRank = 0; iRank < mpi->getSize(); iRank++) {
+        if (iRank == mpi->getRank()) {
+          HighFive::File file(outFileName, HighFive::File::ReadWrite);
+          for (int irE : irEIterator) {
+            fillSlice(irE);
+            std::string datasetName = "/gWannier_" + std::to_string(irE);
+            HighFive::DataSet dslice = file.createDataSet<std::complex<double>>(
+                datasetName, HighFive::DataSpace::From(flatSlice));
+            dslice.write(flatSlice);
+          }
+        }
+        mpi->barrier();
       }
+#endif
     }
   } catch (std::exception &error) {
     Error("Issue writing elph Wannier representation to hdf5.");
@@ -864,7 +888,7 @@ void ElPhQeToPhoebeApp::writeWannierCoupling(
   writeElPhCouplingNoHDF5(context, gWannier, numFilledWannier, numSpin,
                           numModes, numWannier, phDegeneracies,
                           elDegeneracies, phBravaisVectors,
-                          elBravaisVectors, qMesh, constkMesh);
+                          elBravaisVectors, qMesh, kMesh);
 #endif
 
   if (mpi->mpiHead()) {
@@ -1,4 +1,5 @@
 #include "bandstructure.h"
+#include "common_kokkos.h"
 #include "eigen.h"
 #include "elph_qe_to_phoebe_app.h"
 #include "interaction_elph.h"
@@ -10,6 +11,244 @@
 #include <sstream>
 #include <string>
 #include <Kokkos_Core.hpp>
+#include <KokkosBlas3_gemm.hpp>
+
+/** Copies the rotation matrices U(ib,iw,ik) to the device.
+ * Since Eigen has left layout while kokkos has right layout, the view has
+ * shape (numKPoints, numWannier, numBands).
+ */
+ComplexView3D uMatricesToDevice(
+    const Eigen::Tensor<std::complex<double>, 3> &uMatrices) {
+  int numBands = int(uMatrices.dimension(0));
+  int numWannier = int(uMatrices.dimension(1));
+  int numKPoints = int(uMatrices.dimension(2));
+  HostComplexView3D u_h((Kokkos::complex<double> *)uMatrices.data(),
+                        numKPoints, numWannier, numBands);
+  ComplexView3D u_k("u_k", numKPoints, numWannier, numBands);
+  Kokkos::deep_copy(u_k, u_h);
+  return u_k;
+}
+
+/** Returns on the device the phases exp(-ik.R)/numKPoints of the Fourier
+ * transform over electronic wavevectors, with shape
+ * (numKPoints, numElBravaisVectors).
+ */
+ComplexView2D elPhasesToDevice(Points &kPoints,
+                               const Eigen::MatrixXd &elBravaisVectors) {
+  int numKPoints = kPoints.getNumPoints();
+  int numElBravaisVectors = int(elBravaisVectors.cols());
+  ComplexView2D phases_k("elPhases_k", numKPoints, numElBravaisVectors);
+  auto phases_h = Kokkos::create_mirror_view(phases_k);
+#pragma omp parallel for
+  for (int ik = 0; ik < numKPoints; ik++) {
+    Eigen::Vector3d k =
+        kPoints.getPointCoordinates(ik, Points::cartesianCoordinates);
+    for (int iR = 0; iR < numElBravaisVectors; iR++) {
+      double arg = k.dot(elBravaisVectors.col(iR));
+      phases_h(ik, iR) = exp(-complexI * arg) / double(numKPoints);
+    }
+  }
+  Kokkos::deep_copy(phases_k, phases_h);
+  return phases_k;
+}
+
+/** Transforms the el-ph coupling at a single q-point from the Bloch
+ * representation to the Wannier gauge (on the electronic indices), to the
+ * electronic Bravais lattice vectors, and to the phonon cartesian/atomic
+ * basis, i.e. computes
+ * gOut(i,j,nu,iR) = sum_{k,l,m,nu2} uKq(l,i) g(l,m,nu2,k) uK^*(m,j)
+ *                   phases(k,iR) uQM1(nu2,nu).
+ * The rotations are done by device kernels, batched over k-points, and the
+ * Fourier transform as a matrix product by the (device) BLAS library.
+ *
+ * @param gQ: pointer to the coupling at q, of size
+ * (numBands,numBands,numModes,numKPoints).
+ * @param u_k: rotation matrices, as returned by uMatricesToDevice().
+ * @param ikqs: index of the k+q point, for each k-point.
+ * @param elPhases_k: phases, as returned by elPhasesToDevice().
+ * @param uQM1: inverse of the matrix of phonon eigenvectors at q.
+ * @param gOut: pointer to the output, of size
+ * (numWannier,numWannier,numModes,numElBravaisVectors).
+ */
+void blochToWannierAtQ(std::complex<double> *gQ, const ComplexView3D &u_k,
+                       const std::vector<int> &ikqs,
+                       const ComplexView2D &elPhases_k,
+                       const Eigen::MatrixXcd &uQM1,
+                       std::complex<double> *gOut) {
+  Kokkos::Profiling::pushRegion("blochToWannierAtQ");
+  int numKPoints = int(u_k.extent(0));
+  int numWannier = int(u_k.extent(1));
+  int numBands = int(u_k.extent(2));
+  int numElBravaisVectors = int(elPhases_k.extent(1));
+  int numModes = int(uQM1.rows());
+  int numElements = numModes * numWannier * numWannier;
+
+  // note that Eigen has left layout while kokkos has right layout
+  HostComplexView4D g_h((Kokkos::complex<double> *)gQ, numKPoints, numModes,
+                        numBands, numBands);
+  ComplexView4D g_k("g_k", numKPoints, numModes, numBands, numBands);
+  Kokkos::deep_copy(g_k, g_h);
+
+  IntView1D ikqs_k("ikqs_k", numKPoints);
+  auto ikqs_h = Kokkos::create_mirror_view(ikqs_k);
+  for (int ik = 0; ik < numKPoints; ik++) {
+    ikqs_h(ik) = ikqs[ik];
+  }
+  Kokkos::deep_copy(ikqs_k, ikqs_h);
+
+  ComplexView2D uQM1_k("uQM1_k", numModes, numModes);
+  auto uQM1_h = Kokkos::create_mirror_view(uQM1_k);
+  for (int nu2 = 0; nu2 < numModes; nu2++) {
+    for (int nu = 0; nu < numModes; nu++) {
+      uQM1_h(nu2, nu) = uQM1(nu2, nu);
+    }
+  }
+  Kokkos::deep_copy(uQM1_k, uQM1_h);
+
+  // rotation on the k+q band: tmp(k,nu,m,i) = sum_l uKq(l,i) g(l,m,nu,k)
+  ComplexView4D tmp_k("tmp_k", numKPoints, numModes, numBands, numWannier);
+  Kokkos::parallel_for(
+      "uKqRotation",
+      Range4D({0, 0, 0, 0}, {numKPoints, numModes, numBands, numWannier}),
+      KOKKOS_LAMBDA(int ik, int nu, int m, int i) {
+        int ikq = ikqs_k(ik);
+        Kokkos::complex<double> tmp = 0.;
+        for (int l = 0; l < numBands; l++) {
+          tmp += u_k(ikq, i, l) * g_k(ik, nu, m, l);
+        }
+        tmp_k(ik, nu, m, i) = tmp;
+      });
+  Kokkos::realloc(g_k, 0, 0, 0, 0);
+
+  // rotation on the k band: rot(k,(nu,j,i)) = sum_m tmp(k,nu,m,i) uK^*(m,j)
+  ComplexView2D rot_k("rot_k", numKPoints, numElements);
+  Kokkos::parallel_for(
+      "uKRotation",
+      Range4D({0, 0, 0, 0}, {numKPoints, numModes, numWannier, numWannier}),
+      KOKKOS_LAMBDA(int ik, int nu, int j, int i) {
+        Kokkos::complex<double> tmp = 0.;
+        for (int m = 0; m < numBands; m++) {
+          tmp += tmp_k(ik, nu, m, i) * Kokkos::conj(u_k(ik, j, m));
+        }
+        rot_k(ik, (nu * numWannier + j) * numWannier + i) = tmp;
+      });
+  Kokkos::realloc(tmp_k, 0, 0, 0, 0);
+
+  // Fourier transform over k, as the matrix product
+  // mixed(iR,(nu,j,i)) = sum_k phases(k,iR) rot(k,(nu,j,i))
+  ComplexView2D mixed_k("mixed_k", numElBravaisVectors, numElements);
+  KokkosBlas::gemm("T", "N", Kokkos::complex<double>(1.0), elPhases_k, rot_k,
+                   Kokkos::complex<double>(0.0), mixed_k);
+  Kokkos::realloc(rot_k, 0, 0);
+
+  // rotation on the phonon index:
+  // out(iR,nu,j,i) = sum_nu2 mixed(iR,(nu2,j,i)) uQM1(nu2,nu)
+  // note: uQM1 isn't the adjoint of the eigenvectors, due to the masses
+  ComplexView4D out_k("out_k", numElBravaisVectors, numModes, numWannier,
+                      numWannier);
+  Kokkos::parallel_for(
+      "uQRotation",
+      Range4D({0, 0, 0, 0},
+              {numElBravaisVectors, numModes, numWannier, numWannier}),
+      KOKKOS_LAMBDA(int iR, int nu, int j, int i) {
+        Kokkos::complex<double> tmp = 0.;
+        for (int nu2 = 0; nu2 < numModes; nu2++) {
+          tmp += mixed_k(iR, (nu2 * numWannier + j) * numWannier + i) *
+                 uQM1_k(nu2, nu);
+        }
+        out_k(iR, nu, j, i) = tmp;
+      });
+  Kokkos::realloc(mixed_k, 0, 0);
+
+  HostComplexView4D out_h((Kokkos::complex<double> *)gOut,
+                          numElBravaisVectors, numModes, numWannier,
+                          numWannier);
+  Kokkos::deep_copy(out_h, out_k);
+  Kokkos::Profiling::popRegion();
+}
+
+/** Fourier transform of the coupling from phonon wavevectors to phonon
+ * Bravais lattice vectors, done as a matrix product by the (device) BLAS
+ * library, i.e. adds to gOut
+ * gOut(i,j,nu,irP,irE-irEStart) = sum_q phPhases(irP,q) gIn(i,j,nu,irE,q)
+ * for irEStart <= irE < irEStart + numIrE.
+ * The electronic Bravais vectors are split in chunks fitting in the device
+ * memory.
+ *
+ * @param gIn: coupling of size
+ * (numWannier,numWannier,numModes,numElBravaisVectors,numQ).
+ * @param phPhases: phases of size (numPhBravaisVectors,numQ).
+ * @param irEStart: first electronic Bravais vector to transform.
+ * @param numIrE: number of electronic Bravais vectors to transform.
+ * @param gOut: coupling of size
+ * (numWannier,numWannier,numModes,numPhBravaisVectors,numIrE).
+ */
+void phononFourierTransformWannier(
+    const Eigen::Tensor<std::complex<double>, 5> &gIn,
+    const Eigen::MatrixXcd &phPhases, const int &irEStart, const int &numIrE,
+    Eigen::Tensor<std::complex<double>, 5> &gOut) {
+  Kokkos::Profiling::pushRegion("phononFourierTransformWannier");
+  int numElements = int(gIn.dimension(0) * gIn.dimension(1) * gIn.dimension(2));
+  int numElBravaisVectors = int(gIn.dimension(3));
+  int numQ = int(gIn.dimension(4));
+  int numPhBravaisVectors = int(phPhases.rows());
+
+  ComplexView2D phases_k("phPhases_k", numPhBravaisVectors, numQ);
+  auto phases_h = Kokkos::create_mirror_view(phases_k);
+  for (int irP = 0; irP < numPhBravaisVectors; irP++) {
+    for (int iq = 0; iq < numQ; iq++) {
+      phases_h(irP, iq) = phPhases(irP, iq);
+    }
+  }
+  Kokkos::deep_copy(phases_k, phases_h);
+
+  double memoryPerIrE =
+      sizeof(Kokkos::complex<double>) * double(numElements) *
+      (numQ + numPhBravaisVectors);
+  int chunkSize = int(std::min(
+      double(numIrE), std::max(1., 0.5 * kokkosDeviceMemory->getAvailableMemory() /
+                                       memoryPerIrE)));
+
+  for (int chunkStart = 0; chunkStart < numIrE; chunkStart += chunkSize) {
+    int numChunk = std::min(chunkSize, numIrE - chunkStart);
+
+    // x(q,(irE,i,j,nu)) = gIn(i,j,nu,irE,q)
+    ComplexView2D x_k("x_k", numQ, numChunk * numElements);
+    auto x_h = Kokkos::create_mirror_view(x_k);
+#pragma omp parallel for collapse(2)
+    for (int iq = 0; iq < numQ; iq++) {
+      for (int iE = 0; iE < numChunk; iE++) {
+        const std::complex<double> *in =
+            gIn.data() + (size_t(iq) * numElBravaisVectors + irEStart +
+                          chunkStart + iE) * numElements;
+        for (int m = 0; m < numElements; m++) {
+          x_h(iq, iE * numElements + m) = in[m];
+        }
+      }
+    }
+    Kokkos::deep_copy(x_k, x_h);
+
+    ComplexView2D y_k("y_k", numPhBravaisVectors, numChunk * numElements);
+    KokkosBlas::gemm("N", "N", Kokkos::complex<double>(1.0), phases_k, x_k,
+                     Kokkos::complex<double>(0.0), y_k);
+    auto y_h = Kokkos::create_mirror_view(y_k);
+    Kokkos::deep_copy(y_h, y_k);
+
+#pragma omp parallel for collapse(2)
+    for (int iE = 0; iE < numChunk; iE++) {
+      for (int irP = 0; irP < numPhBravaisVectors; irP++) {
+        std::complex<double> *out =
+            gOut.data() +
+            (size_t(chunkStart + iE) * numPhBravaisVectors + irP) * numElements;
+        for (int m = 0; m < numElements; m++) {
+          Kokkos::complex<double> y = y_h(irP, iE * numElements + m);
+          out[m] += std::complex<double>(y.real(), y.imag());
+        }
+      }
+    }
+  }
+  Kokkos::Profiling::popRegion();
+}
 
 Eigen::Tensor<std::complex<double>, 5>
 ElPhQeToPhoebeApp::BlochToWannierEfficient(
@@ -84,6 +323,10 @@ ElPhQeToPhoebeApp::BlochToWannierEfficient(
   Eigen::MatrixXcd phPhases;
   Eigen::Tensor<std::complex<double>, 5> gWannierTmp;
 
+  // these are kept on the device for all the irreducible q-points
+  ComplexView3D u_k = uMatricesToDevice(uMatrices);
+  ComplexView2D elPhases_k = elPhasesToDevice(kPoints, elBravaisVectors);
+
   LoopPrint loopPrint("Wannier transform of coupling", "irreducible q-points",
                       loopSize);
   // for (int iqIrr : mpi->divideWorkIter(numIrrQPoints)) {
@@ -191,176 +434,36 @@ ElPhQeToPhoebeApp::BlochToWannierEfficient(
         }
       }
 
-      Eigen::Tensor<std::complex<double>, 5> gFullTmp(
-          numWannier, numWannier, numModes, numKPoints, numQStar);
-      gFullTmp.setZero();
-
+      gWannierTmp.resize(numWannier, numWannier, numModes, numElBravaisVectors,
+                         numQStar);
+      gWannierTmp.setZero();
       for (int iq = 0; iq < numQStar; iq++) {
         Eigen::Vector3d qCrystal = qStar.col(iq);
         Eigen::Vector3d q = qPoints.crystalToCartesian(qCrystal);
+
+        // index of the k+q points
+        std::vector<int> ikqs(numKPoints);
         for (int ik = 0; ik < numKPoints; ik++) {
           Eigen::Vector3d k =
               kPoints.getPointCoordinates(ik, Points::cartesianCoordinates);
-
-          // Coordinates and index of k+q point
           Eigen::Vector3d kq = k + q;
           Eigen::Vector3d kqCrystal = kPoints.cartesianToCrystal(kq);
-          int ikq = kPoints.getIndex(kqCrystal);
-
-          // First we transform from the Bloch to Wannier Gauge
-
-          // u has size (numBands, numWannier, numKPoints)
-          Eigen::MatrixXcd uK(numBands, numWannier);
-          Eigen::MatrixXcd uKq(numBands, numWannier);
-          for (int j = 0; j < numWannier; j++) {
-            for (int i = 0; i < numBands; i++) {
-              uK(i, j) = uMatrices(i, j, ik);
-              uKq(i, j) = uMatrices(i, j, ikq);
-            }
-          }
-          Eigen::MatrixXcd uKDagger(numWannier, numBands);
-          uKDagger = uK.adjoint();
-
-#pragma omp parallel default(none) shared(numModes, numWannier, numBands, uKq, \
-                                          gStar, gFullTmp, ik, iq, uKDagger)
-          {
-            Eigen::Tensor<std::complex<double>, 3> tmp(numWannier, numBands,
-                                                       numModes);
-            tmp.setZero();
-#pragma omp for nowait collapse(4)
-            for (int nu = 0; nu < numModes; nu++) {
-              for (int i = 0; i < numWannier; i++) {
-                for (int j = 0; j < numBands; j++) {
-                  for (int l = 0; l < numBands; l++) {
-                    // ukq has size(numWannier, numBands)
-                    // gFull has size numBands, numBands, ...
-                    tmp(i, j, nu) += uKq(l, i) * gStar(l, j, nu, ik, iq);
-                  }
-                }
-              }
-            }
-            Eigen::Tensor<std::complex<double>, 3> tmp2(numWannier, numWannier,
-                                                        numModes);
-            tmp2.setZero();
-#pragma omp for nowait collapse(4)
-            for (int nu = 0; nu < numModes; nu++) {
-              for (int i = 0; i < numWannier; i++) {
-                for (int j = 0; j < numWannier; j++) {
-                  for (int l = 0; l < numBands; l++) {
-                    tmp2(i, j, nu) += tmp(i, l, nu) * uKDagger(j, l);
-                  }
-                }
-              }
-            }
-
-#pragma omp critical
-            for (int nu = 0; nu < numModes; nu++) {
-              for (int i = 0; i < numWannier; i++) {
-                for (int j = 0; j < numWannier; j++) {
-                  gFullTmp(i, j, nu, ik, iq) += tmp2(i, j, nu);
-                }
-              }
-            }
-          }
-        } // ik
-      }   // iq
-      gStar.reshape(zeros);
-
-      // Fourier transform on the electronic coordinates
-      Eigen::Tensor<std::complex<double>, 5> gMixed(
-          numWannier, numWannier, numModes, numElBravaisVectors, numQStar);
-      gMixed.setZero();
-
-      {
-        Eigen::MatrixXcd phases(numKPoints, numElBravaisVectors);
-        phases.setZero();
-#pragma omp parallel for
-        for (int ik = 0; ik < numKPoints; ik++) {
-          Eigen::Vector3d k =
-              kPoints.getPointCoordinates(ik, Points::cartesianCoordinates);
-          for (int iR = 0; iR < numElBravaisVectors; iR++) {
-            double arg = k.dot(elBravaisVectors.col(iR));
-            phases(ik, iR) = exp(-complexI * arg) / double(numKPoints);
-          }
+          ikqs[ik] = kPoints.getIndex(kqCrystal);
         }
 
-        for (int iq = 0; iq < numQStar; iq++) {
-#pragma omp parallel default(none)                                             \
-    shared(iq, gFullTmp, phases, numElBravaisVectors, numKPoints, numModes,    \
-           numWannier, gMixed)
-          {
-            Eigen::Tensor<std::complex<double>, 4> tmp(
-                numWannier, numWannier, numModes, numElBravaisVectors);
-            tmp.setZero();
-#pragma omp for nowait
-            for (int iR = 0; iR < numElBravaisVectors; iR++) {
-              for (int ik = 0; ik < numKPoints; ik++) {
-                for (int nu = 0; nu < numModes; nu++) {
-                  for (int j = 0; j < numWannier; j++) {
-                    for (int i = 0; i < numWannier; i++) {
-                      tmp(i, j, nu, iR) +=
-                          gFullTmp(i, j, nu, ik, iq) * phases(ik, iR);
-                    }
-                  }
-                }
-              }
-            }
-#pragma omp critical
-            for (int iR = 0; iR < numElBravaisVectors; iR++) {
-              for (int nu = 0; nu < numModes; nu++) {
-                for (int j = 0; j < numWannier; j++) {
-                  for (int i = 0; i < numWannier; i++) {
-                    gMixed(i, j, nu, iR, iq) += tmp(i, j, nu, iR);
-                  }
-                }
-              }
-            }
-          }
-        } // iq
-      }
-      gFullTmp.reshape(zeros);
-
-      gWannierTmp.resize(numWannier, numWannier, numModes, numElBravaisVectors,
-                         numQStar);
-      gWannierTmp.setZero();
-      {
-        Eigen::Tensor<std::complex<double>, 3> uQM1s(numModes, numModes,
-                                                     numQStar);
-        uQM1s.setZero();
-        for (int iq = 0; iq < numQStar; iq++) {
-          Eigen::MatrixXcd uQ(numModes, numModes);
-          for (int nu2 = 0; nu2 < numModes; nu2++) {
-            for (int nu = 0; nu < numModes; nu++) {
-              uQ(nu, nu2) = phononEigenvectorsStar(nu, nu2, iq);
-            }
-          }
-          auto uQM1 = uQ.inverse();
-          for (int nu2 = 0; nu2 < numModes; nu2++) {
-            for (int nu = 0; nu < numModes; nu++) {
-              uQM1s(nu, nu2, iq) = uQM1(nu, nu2);
-            }
-          }
-          // this isn't equal to the adjoint, due to mass renormalization
-          // should be parallelized with OMP already
-        }
-        for (int iq = 0; iq < numQStar; iq++) {
+        Eigen::MatrixXcd uQ(numModes, numModes);
+        for (int nu2 = 0; nu2 < numModes; nu2++) {
           for (int nu = 0; nu < numModes; nu++) {
-            for (int nu2 = 0; nu2 < numModes; nu2++) {
-#pragma omp parallel for collapse(3) default(none) shared(                     \
-    numElBravaisVectors, numWannier, gMixed, uQM1s, iq, nu, nu2, gWannierTmp)
-              for (int irE = 0; irE < numElBravaisVectors; irE++) {
-                for (int i = 0; i < numWannier; i++) {
-                  for (int j = 0; j < numWannier; j++) {
-                    gWannierTmp(i, j, nu, irE, iq) +=
-                        gMixed(i, j, nu2, irE, iq) * uQM1s(nu2, nu, iq);
-                  }
-                }
-              }
-            }
+            uQ(nu, nu2) = phononEigenvectorsStar(nu, nu2, iq);
           }
         }
+        // this isn't equal to the adjoint, due to mass renormalization
+        Eigen::MatrixXcd uQM1 = uQ.inverse();
+
+        blochToWannierAtQ(&gStar(0, 0, 0, 0, iq), u_k, ikqs, elPhases_k, uQM1,
+                          &gWannierTmp(0, 0, 0, 0, iq));
       }
-      gMixed.reshape(zeros);
+      gStar.reshape(zeros);
 
       phPhases.resize(numPhBravaisVectors, numQStar);
       phPhases.setZero();
@@ -376,45 +479,35 @@ ElPhQeToPhoebeApp::BlochToWannierEfficient(
 
     } // if iqIrr != -1
 
-    // Create a vector with the indices from 0, 1, ..., numElBravaisVectors-1
-    std::vector<int> v(numElBravaisVectors);
-    std::iota(std::begin(v), std::end(v), 0);
-    // split it into chunks
-    int chunkSize = numElBravaisVectors / mpi->getSize();
-    auto chunks = splitVector(v, chunkSize);
+    // The electronic Bravais vectors are split in chunks, one for each MPI
+    // process, matching the distribution of gWannierPara. Each chunk is
+    // reduced only on the process that owns it, so that no process ever
+    // holds more than a slice of the full tensor.
+    for (int iRank = 0; iRank < mpi->getSize(); iRank++) {
+      int chunkStart = int((size_t(numElBravaisVectors) * iRank) / mpi->getSize());
+      int chunkStop =
+          int((size_t(numElBravaisVectors) * (iRank + 1)) / mpi->getSize());
+      if (chunkStop == chunkStart) {
+        continue;
+      }
+      std::vector<int> chunk(chunkStop - chunkStart);
+      std::iota(std::begin(chunk), std::end(chunk), chunkStart);
 
-    for (std::vector<int> chunk : chunks) {
       Eigen::Tensor<std::complex<double>, 5> tmp(numWannier, numWannier,
                                                  numModes, numPhBravaisVectors,
                                                  int(chunk.size()));
       tmp.setZero();
 
       if (iqIrr >= 0) { // if the MPI process actually is computing something
-        for (int irE : chunk) {
-#pragma omp parallel for collapse(4) default(none)                             \
-    shared(numPhBravaisVectors, phPhases, numModes, numWannier, gWannierTmp,   \
-           tmp, irE, chunk)
-          for (int irP = 0; irP < numPhBravaisVectors; irP++) {
-            for (int nu = 0; nu < numModes; nu++) {
-              for (int j = 0; j < numWannier; j++) {
-                for (int i = 0; i < numWannier; i++) {
-                  for (int iq = 0; iq < phPhases.cols(); iq++) {
-                    tmp(i, j, nu, irP, irE - chunk[0]) +=
-                        phPhases(irP, iq) * gWannierTmp(i, j, nu, irE, iq);
-                  }
-                }
-              }
-            }
-          }
-        }
+        phononFourierTransformWannier(gWannierTmp, phPhases, chunkStart,
+                                      int(chunk.size()), tmp);
       }
 
-      // now, all MPI receives `tmp`
-      mpi->allReduceSum(&tmp);
+      // now, only the owner of the chunk receives `tmp`
+      mpi->reduceSum(&tmp, iRank);
 
-      for (int irE : chunk) {
-        if (std::find(localElIndices.begin(), localElIndices.end(), irE) !=
-            localElIndices.end()) {
+      if (iRank == mpi->getRank()) {
+        for (int irE : chunk) {
           int irELocal = irE - localElIndicesOffset;
           for (int irP = 0; irP < numPhBravaisVectors; irP++) {
             for (int nu = 0; nu < numModes; nu++) {
@@ -431,6 +524,8 @@ ElPhQeToPhoebeApp::BlochToWannierEfficient(
     }
   } // loop on files
   loopPrint.close();
+  Kokkos::realloc(u_k, 0, 0, 0);
+  Kokkos::realloc(elPhases_k, 0, 0);
 
   if (mpi->mpiHead()) {
     std::cout << "Done Wannier-transform of g\n" << std::endl;
@@ -532,195 +627,46 @@ Eigen::Tensor<std::complex<double>, 5> ElPhQeToPhoebeApp::blochToWannier(
   }
 
   if (mpi->mpiHead()) {
-    std::cout << "Wannier rotation" << std::endl;
+    std::cout << "Wannier rotation and electronic Fourier transform"
+              << std::endl;
   }
 
-  Eigen::Tensor<std::complex<double>, 5> gFullTmp(
-      numWannier, numWannier, numModes, numKPoints, numQPoints);
-  gFullTmp.setZero();
-
-  for (size_t iq : mpi->divideWorkIter(numQPoints)) {
-    Eigen::Vector3d q =
-        qPoints.getPointCoordinates(iq, Points::cartesianCoordinates);
-    for (int ik = 0; ik < numKPoints; ik++) {
-      Eigen::Vector3d k =
-          kPoints.getPointCoordinates(ik, Points::cartesianCoordinates);
-
-      // Coordinates and index of k+q point
-      Eigen::Vector3d kq = k + q;
-      Eigen::Vector3d kqCrystal = kPoints.cartesianToCrystal(kq);
-      int ikq = kPoints.getIndex(kqCrystal);
-
-      // First we transform from the Bloch to Wannier Gauge
-
-      // u has size (numBands, numWannier, numKPoints)
-      Eigen::MatrixXcd uK(numBands, numWannier);
-      Eigen::MatrixXcd uKq(numBands, numWannier);
-      for (int i = 0; i < numBands; i++) {
-        for (int j = 0; j < numWannier; j++) {
-          uK(i, j) = uMatrices(i, j, ik);
-          uKq(i, j) = uMatrices(i, j, ikq);
-        }
-      }
-      Eigen::MatrixXcd uKDagger(numWannier, numBands);
-      uKDagger = uK.adjoint();
-
-#pragma omp parallel default(none) shared(numModes, numWannier, numBands, uKq, \
-                                          gFull, gFullTmp, ik, iq, uKDagger)
-      {
-        Eigen::Tensor<std::complex<double>, 3> tmp(numWannier, numBands,
-                                                   numModes);
-        tmp.setZero();
-#pragma omp for nowait collapse(4)
-        for (int nu = 0; nu < numModes; nu++) {
-          for (int i = 0; i < numWannier; i++) {
-            for (int j = 0; j < numBands; j++) {
-              for (int l = 0; l < numBands; l++) {
-                // ukq has size(numWannier, numBands)
-                // gFull has size numBands, numBands, ...
-                tmp(i, j, nu) += uKq(l, i) * gFull(l, j, nu, ik, int(iq));
-              }
-            }
-          }
-        }
-        Eigen::Tensor<std::complex<double>, 3> tmp2(numWannier, numWannier,
-                                                    numModes);
-        tmp2.setZero();
-#pragma omp for nowait collapse(4)
-        for (int nu = 0; nu < numModes; nu++) {
-          for (int i = 0; i < numWannier; i++) {
-            for (int j = 0; j < numWannier; j++) {
-              for (int l = 0; l < numBands; l++) {
-                tmp2(i, j, nu) += tmp(i, l, nu) * uKDagger(j, l);
-              }
-            }
-          }
-        }
-
-#pragma omp critical
-        for (int nu = 0; nu < numModes; nu++) {
-          for (int i = 0; i < numWannier; i++) {
-            for (int j = 0; j < numWannier; j++) {
-              gFullTmp(i, j, nu, ik, int(iq)) += tmp2(i, j, nu);
-            }
-          }
-        }
-      }
-    } // ik
-  }   // iq
-  mpi->allReduceSum(&gFullTmp);
-  gFull.reshape(zeros);
-
-  if (mpi->mpiHead()) {
-    std::cout << "Electronic Fourier Transform" << std::endl;
-  }
-
-  // Fourier transform on the electronic coordinates
-  Eigen::Tensor<std::complex<double>, 5> gMixed(
+  Eigen::Tensor<std::complex<double>, 5> gWannierTmp(
       numWannier, numWannier, numModes, numElBravaisVectors, numQPoints);
-  gMixed.setZero();
-
+  gWannierTmp.setZero();
   {
-    Eigen::MatrixXcd phases(numKPoints, numElBravaisVectors);
-    phases.setZero();
-    std::vector<size_t> iks = mpi->divideWorkIter(numKPoints);
-    size_t niks = iks.size();
-#pragma omp parallel for
-    for (size_t iik = 0; iik < niks; iik++) {
-      size_t ik = iks[iik];
-      Eigen::Vector3d k =
-          kPoints.getPointCoordinates(ik, Points::cartesianCoordinates);
-      for (int iR = 0; iR < numElBravaisVectors; iR++) {
-        double arg = k.dot(elBravaisVectors.col(iR));
-        phases(ik, iR) = exp(-complexI * arg) / double(numKPoints);
-      }
-    }
-    mpi->allReduceSum(&phases);
+    ComplexView3D u_k = uMatricesToDevice(uMatrices);
+    ComplexView2D elPhases_k = elPhasesToDevice(kPoints, elBravaisVectors);
 
     for (auto iq : mpi->divideWorkIter(numQPoints)) {
-#pragma omp parallel default(none)                                             \
-    shared(iq, gFullTmp, phases, numElBravaisVectors, numKPoints, numModes,    \
-           numWannier, gMixed)
-      {
-        Eigen::Tensor<std::complex<double>, 4> tmp(
-            numWannier, numWannier, numModes, numElBravaisVectors);
-        tmp.setZero();
-#pragma omp for nowait
-        for (int iR = 0; iR < numElBravaisVectors; iR++) {
-          for (int ik = 0; ik < numKPoints; ik++) {
-            for (int nu = 0; nu < numModes; nu++) {
-              for (int j = 0; j < numWannier; j++) {
-                for (int i = 0; i < numWannier; i++) {
-                  tmp(i, j, nu, iR) +=
-                      gFullTmp(i, j, nu, ik, int(iq)) * phases(ik, iR);
-                }
-              }
-            }
-          }
-        }
-#pragma omp critical
-        for (int iR = 0; iR < numElBravaisVectors; iR++) {
-          for (int nu = 0; nu < numModes; nu++) {
-            for (int j = 0; j < numWannier; j++) {
-              for (int i = 0; i < numWannier; i++) {
-                gMixed(i, j, nu, iR, int(iq)) += tmp(i, j, nu, iR);
-              }
-            }
-          }
-        }
-      }
-    } // iq
-    mpi->allReduceSum(&gMixed);
-  }
-  gFullTmp.reshape(zeros);
+      Eigen::Vector3d q =
+          qPoints.getPointCoordinates(iq, Points::cartesianCoordinates);
 
-  if (mpi->mpiHead()) {
-    std::cout << "Phonon rotation" << std::endl;
-  }
+      // index of the k+q points
+      std::vector<int> ikqs(numKPoints);
+      for (int ik = 0; ik < numKPoints; ik++) {
+        Eigen::Vector3d k =
+            kPoints.getPointCoordinates(ik, Points::cartesianCoordinates);
+        Eigen::Vector3d kq = k + q;
+        Eigen::Vector3d kqCrystal = kPoints.cartesianToCrystal(kq);
+        ikqs[ik] = kPoints.getIndex(kqCrystal);
+      }
 
-  Eigen::Tensor<std::complex<double>, 5> gWannierTmp(
-      numWannier, numWannier, numModes, numElBravaisVectors, numQPoints);
-  gWannierTmp.setZero();
-  {
-    Eigen::Tensor<std::complex<double>, 3> uQM1s(numModes, numModes,
-                                                 numQPoints);
-    uQM1s.setZero();
-    for (auto iq : mpi->divideWorkIter(numQPoints)) {
       Eigen::MatrixXcd uQ(numModes, numModes);
       for (int nu2 = 0; nu2 < numModes; nu2++) {
         for (int nu = 0; nu < numModes; nu++) {
           uQ(nu, nu2) = phEigenvectors(nu, nu2, int(iq));
         }
       }
-      auto uQM1 = uQ.inverse();
-      for (int nu2 = 0; nu2 < numModes; nu2++) {
-        for (int nu = 0; nu < numModes; nu++) {
-          uQM1s(nu, nu2, int(iq)) = uQM1(nu, nu2);
-        }
-      }
       // this isn't equal to the adjoint, due to mass renormalization
-      // should be parallelized with OMP already
-    }
-    mpi->allReduceSum(&uQM1s);
-    for (auto iq : mpi->divideWorkIter(numQPoints)) {
-      for (int nu = 0; nu < numModes; nu++) {
-        for (int nu2 = 0; nu2 < numModes; nu2++) {
-#pragma omp parallel for collapse(3) default(none) shared(                     \
-    numElBravaisVectors, numWannier, gMixed, uQM1s, iq, nu, nu2, gWannierTmp)
-          for (int irE = 0; irE < numElBravaisVectors; irE++) {
-            for (int i = 0; i < numWannier; i++) {
-              for (int j = 0; j < numWannier; j++) {
-                gWannierTmp(i, j, nu, irE, int(iq)) +=
-                    gMixed(i, j, nu2, irE, int(iq)) * uQM1s(nu2, nu, int(iq));
-              }
-            }
-          }
-        }
-      }
+      Eigen::MatrixXcd uQM1 = uQ.inverse();
+
+      blochToWannierAtQ(&gFull(0, 0, 0, 0, int(iq)), u_k, ikqs, elPhases_k,
+                        uQM1, &gWannierTmp(0, 0, 0, 0, int(iq)));
     }
     mpi->allReduceSum(&gWannierTmp);
   }
-  gMixed.reshape(zeros);
+  gFull.reshape(zeros);
 
   if (mpi->mpiHead()) {
     std::cout << "Phonon Fourier Transform" << std::endl;
@@ -732,12 +678,8 @@ Eigen::Tensor<std::complex<double>, 5> ElPhQeToPhoebeApp::blochToWannier(
   gWannier.setZero();
   {
     Eigen::MatrixXcd phases(numPhBravaisVectors, numQPoints);
-    phases.setZero();
-    std::vector<size_t> iqs = mpi->divideWorkIter(numQPoints);
-    size_t niqs = iqs.size();
 #pragma omp parallel for
-    for (size_t iiq = 0; iiq < niqs; iiq++) {
-      size_t iq = iqs[iiq];
+    for (int iq = 0; iq < numQPoints; iq++) {
       Eigen::Vector3d q =
           qPoints.getPointCoordinates(iq, Points::cartesianCoordinates);
       for (int irP = 0; irP < numPhBravaisVectors; irP++) {
@@ -745,40 +687,18 @@ Eigen::Tensor<std::complex<double>, 5> ElPhQeToPhoebeApp::blochToWannier(
         phases(irP, iq) = exp(-complexI * arg) / double(numQPoints);
       }
     }
-    mpi->allReduceSum(&phases);
-
-    for (auto irE : mpi->divideWorkIter(numElBravaisVectors)) {
-#pragma omp parallel default(none)                                             \
-    shared(numQPoints, numPhBravaisVectors, numModes, numWannier, phases,      \
-           gWannier, irE, gWannierTmp)
-      {
-        Eigen::Tensor<std::complex<double>, 4> tmp(
-            numWannier, numWannier, numModes, numPhBravaisVectors);
-        tmp.setZero();
-#pragma omp for nowait
-        for (int iq = 0; iq < numQPoints; iq++) {
-          for (int irP = 0; irP < numPhBravaisVectors; irP++) {
-            for (int nu = 0; nu < numModes; nu++) {
-              for (int j = 0; j < numWannier; j++) {
-                for (int i = 0; i < numWannier; i++) {
-                  tmp(i, j, nu, irP) +=
-                      phases(irP, iq) * gWannierTmp(i, j, nu, int(irE), iq);
-                }
-              }
-            }
-          }
-        }
-#pragma omp critical
-        for (int irP = 0; irP < numPhBravaisVectors; irP++) {
-          for (int nu = 0; nu < numModes; nu++) {
-            for (int i = 0; i < numWannier; i++) {
-              for (int j = 0; j < numWannier; j++) {
-                gWannier(i, j, nu, irP, int(irE)) += tmp(i, j, nu, irP);
-              }
-            }
-          }
-        }
-      }
+
+    auto irEIterator = mpi->divideWorkIter(numElBravaisVectors);
+    int numLocalIrE = int(irEIterator.size());
+    if (numLocalIrE > 0) {
+      Eigen::Tensor<std::complex<double>, 5> gWannierLocal(
+          numWannier, numWannier, numModes, numPhBravaisVectors, numLocalIrE);
+      gWannierLocal.setZero();
+      phononFourierTransformWannier(gWannierTmp, phases, int(irEIterator[0]),
+                                    numLocalIrE, gWannierLocal);
+      std::copy(gWannierLocal.data(),
+                gWannierLocal.data() + gWannierLocal.size(),
+                &gWannier(0, 0, 0, 0, int(irEIterator[0])));
     }
     mpi->allReduceSum(&gWannier);
   }
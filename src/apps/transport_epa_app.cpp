@@ -123,6 +123,7 @@ TransportEpaApp::calcEnergyProjVelocity(Context &context,
   //--------------------------------
   // set up tetrahedron method
   TetrahedronDeltaFunction tetrahedrons(bandStructure);
+  tetrahedrons.precomputeTetrahedra();
 
   int numEnergies = int(energies.size());
   int numPoints = std::get<0>(bandStructure.getPoints().getMesh()).prod();
@@ -141,39 +142,69 @@ TransportEpaApp::calcEnergyProjVelocity(Context &context,
   Eigen::VectorXd dos(numEnergies);
   dos.setZero();
 
-  LoopPrint loopPrint("calculating energy projected velocity", "states",
-      numEnergies);
-  std::vector<size_t> iEnergies = mpi->divideWorkIter(numEnergies);
-  size_t niEnergies = iEnergies.size();
-#pragma omp parallel for
-  for (size_t iiEnergy = 0; iiEnergy < niEnergies; iiEnergy++) {
-    int iEnergy = iEnergies[iiEnergy];
-#pragma omp critical
-    { loopPrint.update(); }
-    for (int iState : bandStructure.irrStateIterator()) {
-      StateIndex isIdx(iState);
+  // Each state only contributes to the energy bins within the range of its
+  // tetrahedra. So, we loop over the states, and for each state we visit
+  // only those bins, instead of evaluating the tetrahedra of all states at
+  // every energy.
+  double energyStep = context.getEpaEnergyStep();
+  double minEnergy = energies(0);
+  std::vector<int> states = bandStructure.parallelIrrStateIterator();
+  auto numStates = int(states.size());
+#pragma omp parallel default(none) shared(states, numStates, bandStructure, tetrahedrons, energies, numEnergies, energyStep, minEnergy, norm, normDos, energyProjVelocity, dos)
+  {
+    Eigen::Tensor<double, 3> privateProjVelocity(3, 3, numEnergies);
+    privateProjVelocity.setZero();
+    Eigen::VectorXd privateDos = Eigen::VectorXd::Zero(numEnergies);
+
+#pragma omp for nowait
+    for (int iis = 0; iis < numStates; iis++) {
+      StateIndex isIdx(states[iis]);
+      auto range = tetrahedrons.getEnergyRange(isIdx);
+      int iFirst = std::max(
+          0, int(std::ceil((std::get<0>(range) - minEnergy) / energyStep)));
+      int iLast = std::min(
+          numEnergies - 1,
+          int(std::floor((std::get<1>(range) - minEnergy) / energyStep)));
+      if (iFirst > iLast) {
+        continue;
+      }
+
+      // v x v summed over the star of the irreducible state, computed once
+      // for all the energy bins
       auto rotations = bandStructure.getRotationsStar(isIdx);
       Eigen::Vector3d velIrr = bandStructure.getGroupVelocity(isIdx);
-      double deltaFunction = tetrahedrons.getSmearing(energies(iEnergy), isIdx);
-
-      // integrate DOS
-      auto degeneracy = double(rotations.size());
-      dos(iEnergy) += deltaFunction * degeneracy * normDos;
-
+      Eigen::Matrix3d velocitySquared = Eigen::Matrix3d::Zero();
       for (const Eigen::Matrix3d &r : rotations) {
         Eigen::Vector3d velocity = r * velIrr;
-        for (int j  = 0; j < 3; j++) {
+        velocitySquared += velocity * velocity.transpose();
+      }
+      auto degeneracy = double(rotations.size());
+
+      for (int iEnergy = iFirst; iEnergy <= iLast; iEnergy++) {
+        double deltaFunction =
+            tetrahedrons.getSmearing(energies(iEnergy), isIdx);
+        if (deltaFunction == 0.) {
+          continue;
+        }
+        // integrate DOS
+        privateDos(iEnergy) += deltaFunction * degeneracy * normDos;
+        for (int j = 0; j < 3; j++) {
           for (int i = 0; i < 3; i++) {
-            energyProjVelocity(i, j, iEnergy) +=
-              velocity(i) * velocity(j) * deltaFunction * norm;
+            privateProjVelocity(i, j, iEnergy) +=
+                velocitySquared(i, j) * deltaFunction * norm;
           }
         }
       }
     }
+
+#pragma omp critical
+    {
+      energyProjVelocity += privateProjVelocity;
+      dos += privateDos;
+    }
   }
   mpi->allReduceSum(&energyProjVelocity);
   mpi->allReduceSum(&dos);
-  loopPrint.close();
   return std::make_tuple(energyProjVelocity, dos);
 }
 
@@ -222,45 +253,36 @@ VectorEPA TransportEpaApp::getScatteringRates(
     }
   }
 
-  LoopPrint loopPrint("calculation of EPA scattering rates", "energy bins per MPI process",
-                      int(mpi->divideWorkIter(numEnergies).size()));
-
   VectorEPA epaRate(statisticsSweep, numEnergies, 1);
 
   double norm = twoPi / spinFactor *
                 crystal.getVolumeUnitCell(crystal.getDimensionality());
 
-  std::vector<size_t> iEnergies = mpi->divideWorkIter(numEnergies);
-  size_t niEnergies = iEnergies.size();
-
-#pragma omp parallel for
-  for (size_t iiEnergy = 0; iiEnergy < niEnergies; iiEnergy++) {
-    int iEnergy = iEnergies[iiEnergy];
-
-#pragma omp critical
-    { loopPrint.update(); }
-
-    // loop over phonon frequencies
+  // The final-state DOS and the couplings |g|^2 only depend on the energy
+  // bin and the phonon mode, so they are tabulated once and reused for all
+  // temperatures and chemical potentials.
+  // note: phEnergies(iPhFreq)/energyStep =
+  // # of bin-jumps the electron does after scattering
+  Eigen::MatrixXd dosAbsorption = Eigen::MatrixXd::Zero(numModes, numEnergies);
+  Eigen::MatrixXd dosEmission = Eigen::MatrixXd::Zero(numModes, numEnergies);
+  Eigen::MatrixXd gAbsorption(numModes, numEnergies);
+  Eigen::MatrixXd gEmission(numModes, numEnergies);
+#pragma omp parallel for collapse(2)
+  for (int iEnergy = 0; iEnergy < numEnergies; iEnergy++) {
     for (int iPhFreq = 0; iPhFreq < numModes; iPhFreq++) {
-
-      // note: phEnergies(iPhFreq)/energyStep =
-      // # of bin-jumps the electron does after scattering
-
       // compute the dos for electron in the final state for the two
       // scatterings mechanisms, and do a linear interpolation
       int iJump = int(phEnergies(iPhFreq) / energyStep);
       double iInterp = phEnergies(iPhFreq) / energyStep - double(iJump);
       auto largeIndex = int(iEnergy + iJump + 1);
       auto smallIndex = int(iEnergy - iJump - 1);
-      double dosEmission = 0.;
-      double dosAbsorption = 0.;
       // Avoid some index out of bound errors
       if (smallIndex >= 0) {
-        dosEmission =
+        dosEmission(iPhFreq, iEnergy) =
             dos(smallIndex) * iInterp + dos(iEnergy - iJump) * (1. - iInterp);
       }
       if (largeIndex < dos.size()) {
-        dosAbsorption =
+        dosAbsorption(iPhFreq, iEnergy) =
             dos(iEnergy + iJump) * (1. - iInterp) + dos(largeIndex) * iInterp;
       }
 
@@ -269,35 +291,47 @@ VectorEPA TransportEpaApp::getScatteringRates(
       double en = energies(iEnergy);
       double enP = energies(iEnergy) + phEnergies(iPhFreq);
       double enM = energies(iEnergy) - phEnergies(iPhFreq);
-      double gAbsorption = couplingEpa.getCoupling(iPhFreq, en, enP);
-      double gEmission = couplingEpa.getCoupling(iPhFreq, en, enM);
-
-      // population of phonons, electron after emission/absorption
-      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-        auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-        double temp = calcStat.temperature;
-        double chemPot = calcStat.chemicalPotential;
-
-        double nFermiAbsorption = particle.getPopulation(
-            energies[iEnergy] + phEnergies(iPhFreq), temp, chemPot);
-        double nFermiEmission = particle.getPopulation(
-            energies[iEnergy] - phEnergies(iPhFreq), temp, chemPot);
-
-        //-----------------------------
-        // now the scattering rate
-        // Note that g (the coupling) is already squared
-
-        double rate = gAbsorption * (bose(iPhFreq, iCalc) + nFermiAbsorption) *
-                          dosAbsorption +
-                      gEmission * (bose(iPhFreq, iCalc) + 1 - nFermiEmission) *
-                          dosEmission;
-
-        epaRate.data(iCalc, iEnergy) += norm * rate;
-      }
+      gAbsorption(iPhFreq, iEnergy) = couplingEpa.getCoupling(iPhFreq, en, enP);
+      gEmission(iPhFreq, iEnergy) = couplingEpa.getCoupling(iPhFreq, en, enM);
+    }
+  }
+
+  // the (temperature, chemical potential, energy) triplets are independent,
+  // so we distribute all of them over MPI processes and threads, which keeps
+  // all processes busy also with coarse energy grids and large doping sweeps
+  std::vector<size_t> iPairs =
+      mpi->divideWorkIter(size_t(numCalculations) * numEnergies);
+  size_t niPairs = iPairs.size();
+
+#pragma omp parallel for
+  for (size_t iiPair = 0; iiPair < niPairs; iiPair++) {
+    int iCalc = int(iPairs[iiPair] / numEnergies);
+    int iEnergy = int(iPairs[iiPair] % numEnergies);
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    double temp = calcStat.temperature;
+    double chemPot = calcStat.chemicalPotential;
+
+    // population of phonons, electron after emission/absorption
+    double rate = 0.;
+    for (int iPhFreq = 0; iPhFreq < numModes; iPhFreq++) {
+      double nFermiAbsorption = particle.getPopulation(
+          energies(iEnergy) + phEnergies(iPhFreq), temp, chemPot);
+      double nFermiEmission = particle.getPopulation(
+          energies(iEnergy) - phEnergies(iPhFreq), temp, chemPot);
+
+      //-----------------------------
+      // now the scattering rate
+      // Note that g (the coupling) is already squared
+      rate += gAbsorption(iPhFreq, iEnergy) *
+                  (bose(iPhFreq, iCalc) + nFermiAbsorption) *
+                  dosAbsorption(iPhFreq, iEnergy) +
+              gEmission(iPhFreq, iEnergy) *
+                  (bose(iPhFreq, iCalc) + 1 - nFermiEmission) *
+                  dosEmission(iPhFreq, iEnergy);
     }
+    epaRate.data(iCalc, iEnergy) = norm * rate;
   }
   mpi->allReduceSum(&epaRate.data);
-  loopPrint.close();
 
   return epaRate;
 }
@@ -1,10 +1,15 @@
 #include "active_bandstructure.h"
 #include "bandstructure.h"
 #include "exceptions.h"
+#include "io.h"
 #include "mpiHelper.h"
 #include "window.h"
 #include "common_kokkos.h"
 
+// view on the eigenvectors of a wavevector, when stored in single precision
+using EigenvectorsFloatView = Eigen::Map<const Eigen::Matrix<
+    std::complex<float>, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>;
+
 ActiveBandStructure::ActiveBandStructure(Particle &particle_, Points &points_)
     : particle(particle_), points(points_) {}
 
@@ -12,15 +17,23 @@ ActiveBandStructure::ActiveBandStructure(Particle &particle_, Points &points_)
 ActiveBandStructure::ActiveBandStructure(const ActiveBandStructure &that)
     : particle(that.particle), points(that.points), energies(that.energies),
       velocities(that.velocities), eigenvectors(that.eigenvectors),
-      hasEigenvectors(that.hasEigenvectors), numStates(that.numStates),
+      eigenvectorsFloat(that.eigenvectorsFloat),
+      groupVelocities(that.groupVelocities),
+      hasEigenvectors(that.hasEigenvectors),
+      onlyGroupVelocities(that.onlyGroupVelocities),
+      singlePrecisionEigenvectors(that.singlePrecisionEigenvectors),
+      numStates(that.numStates),
       numIrrStates(that.numIrrStates), numIrrPoints(that.numIrrPoints),
       numPoints(that.numPoints), numBands(that.numBands),
-      numFullBands(that.numFullBands), windowMethod(that.windowMethod),
+      bandsOffset(that.bandsOffset), numFullBands(that.numFullBands), windowMethod(that.windowMethod),
+      kramersParent(that.kramersParent),
       auxBloch2Comb(that.auxBloch2Comb),
       cumulativeKbOffset(that.cumulativeKbOffset),
       bteAuxBloch2Comb(that.bteAuxBloch2Comb),
       bteCumulativeKbOffset(that.bteCumulativeKbOffset),
-      cumulativeKbbOffset(that.cumulativeKbbOffset) {}
+      cumulativeKbbOffset(that.cumulativeKbbOffset),
+      degenerateGroups(that.degenerateGroups),
+      deviceMirror(that.deviceMirror) {}
 
 ActiveBandStructure &ActiveBandStructure::operator=(
     const ActiveBandStructure &that) { // assignment operator
@@ -30,19 +43,27 @@ ActiveBandStructure &ActiveBandStructure::operator=(
     energies = that.energies;
     velocities = that.velocities;
     eigenvectors = that.eigenvectors;
+    eigenvectorsFloat = that.eigenvectorsFloat;
+    groupVelocities = that.groupVelocities;
     hasEigenvectors = that.hasEigenvectors;
+    onlyGroupVelocities = that.onlyGroupVelocities;
+    singlePrecisionEigenvectors = that.singlePrecisionEigenvectors;
     numStates = that.numStates;
     numIrrStates = that.numIrrStates;
     numIrrPoints = that.numIrrPoints;
     numPoints = that.numPoints;
     numBands = that.numBands;
+    bandsOffset = that.bandsOffset;
     numFullBands = that.numFullBands;
     windowMethod = that.windowMethod;
+    kramersParent = that.kramersParent;
     auxBloch2Comb = that.auxBloch2Comb;
     cumulativeKbOffset = that.cumulativeKbOffset;
     bteAuxBloch2Comb = that.bteAuxBloch2Comb;
     bteCumulativeKbOffset = that.bteCumulativeKbOffset;
     cumulativeKbbOffset = that.cumulativeKbbOffset;
+    degenerateGroups = that.degenerateGroups;
+    deviceMirror = that.deviceMirror;
   }
   return *this;
 }
@@ -61,12 +82,15 @@ ActiveBandStructure::ActiveBandStructure(const Points &points_,
   for (int ik = 0; ik < numPoints; ik++) {
     numBands(ik) = numFullBands;
   }
+  bandsOffset = Eigen::VectorXi::Zero(numPoints);
   numStates = numFullBands * numPoints;
   hasEigenvectors = withEigenvectors;
+  onlyGroupVelocities = h0->getOnlyGroupVelocities();
+  singlePrecisionEigenvectors = h0->getSinglePrecisionEigenvectors();
 
   energies.resize(numPoints * numFullBands, 0.);
-  if(withVelocities) velocities.resize(numPoints * numFullBands * numFullBands * 3, complexZero);
-  if(withEigenvectors) eigenvectors.resize(numPoints * numFullBands * numFullBands, complexZero);
+  if(withVelocities) allocateVelocities(numPoints * numFullBands * numFullBands * 3);
+  if(withEigenvectors) allocateEigenvectors(numPoints * numFullBands * numFullBands);
 
   windowMethod = Window::nothing;
   buildIndices();
@@ -99,17 +123,25 @@ ActiveBandStructure::ActiveBandStructure(const Points &points_,
     int stop_iik = std::min(niks, start_iik + approx_batch_size);
 
     Kokkos::Profiling::pushRegion("call diagonalization");
-    auto tup = h0->kokkosBatchedDiagonalizeFromCoordinates(Kokkos::subview(qs, Kokkos::make_pair(start_iik, stop_iik), Kokkos::ALL));
+    auto batchQs = Kokkos::subview(qs, Kokkos::make_pair(start_iik, stop_iik), Kokkos::ALL);
+    DoubleView2D energies_d;
+    StridedComplexView3D eigenvectors_d;
+    if (withEigenvectors) {
+      auto tup = h0->kokkosBatchedDiagonalizeFromCoordinates(batchQs);
+      energies_d = std::get<0>(tup);
+      eigenvectors_d = std::get<1>(tup);
+    } else {
+      energies_d = h0->kokkosBatchedEnergies(batchQs);
+    }
     Kokkos::Profiling::popRegion();
 
-    DoubleView2D energies_d = std::get<0>(tup);
-    StridedComplexView3D eigenvectors_d = std::get<1>(tup);
-
     // copy the results to CPU
     auto energies_h = Kokkos::create_mirror_view(energies_d);
     auto eigenvectors_h = Kokkos::create_mirror_view(eigenvectors_d);
     Kokkos::deep_copy(energies_h, energies_d);
-    Kokkos::deep_copy(eigenvectors_h, eigenvectors_d);
+    if (withEigenvectors) {
+      Kokkos::deep_copy(eigenvectors_h, eigenvectors_d);
+    }
 
     // store the results in the old datastructures
     Kokkos::Profiling::pushRegion("store results");
@@ -184,8 +216,9 @@ ActiveBandStructure::ActiveBandStructure(const Points &points_,
     Kokkos::Profiling::popRegion();
   }
   mpi->allReduceSum(&energies);
-  mpi->allReduceSum(&velocities);
-  mpi->allReduceSum(&eigenvectors);
+  buildDegenerateGroups();
+  reduceVelocities();
+  reduceEigenvectors();
   Kokkos::Profiling::popRegion();
 }
 
@@ -227,6 +260,14 @@ int ActiveBandStructure::getIndex(const WavevectorIndex &ik,
   return bloch2Comb(ik.get(), ib.get());
 }
 
+int ActiveBandStructure::getFullBandIndex(const WavevectorIndex &ik,
+                                          const BandIndex &ib) {
+  if (bandsOffset.size() == 0) {
+    return ib.get();
+  }
+  return bandsOffset(ik.get()) + ib.get();
+}
+
 std::tuple<WavevectorIndex, BandIndex>
 ActiveBandStructure::getIndex(const int &is) {
   auto tup = comb2Bloch(is);
@@ -264,6 +305,23 @@ Eigen::VectorXd ActiveBandStructure::getEnergies(WavevectorIndex &ik) {
   return x;
 }
 
+std::vector<std::tuple<int, int>>
+ActiveBandStructure::getDegenerateGroups(WavevectorIndex &ik) {
+  if (ik.get() < int(degenerateGroups.size())) {
+    return degenerateGroups[ik.get()];
+  }
+  return BaseBandStructure::getDegenerateGroups(ik);
+}
+
+void ActiveBandStructure::buildDegenerateGroups() {
+  degenerateGroups.resize(numPoints);
+#pragma omp parallel for
+  for (int ik = 0; ik < numPoints; ik++) {
+    WavevectorIndex ikIdx(ik);
+    degenerateGroups[ik] = findDegenerateGroups(getEnergies(ikIdx));
+  }
+}
+
 double ActiveBandStructure::getMaxEnergy() {
   if(getIsDistributed())
     Error("Developer error: getMaxEnergy not implemented when activeBS is distributed.");
@@ -272,13 +330,19 @@ double ActiveBandStructure::getMaxEnergy() {
 
 Eigen::Vector3d ActiveBandStructure::getGroupVelocity(StateIndex &is) {
   int stateIndex = is.get();
-  if (velocities.empty()) {
+  if (velocitiesEmpty()) {
     Error("ActiveBandStructure velocities haven't been populated");
   }
   auto tup = comb2Bloch(stateIndex);
   auto ik = std::get<0>(tup);
   auto ib = std::get<1>(tup);
   Eigen::Vector3d vel;
+  if (onlyGroupVelocities) {
+    for (int i : {0, 1, 2}) {
+      vel(i) = groupVelocities[groupVelBloch2Comb(ik, ib, i)];
+    }
+    return vel;
+  }
   vel(0) = velocities[velBloch2Comb(ik, ib, ib, 0)].real();
   vel(1) = velocities[velBloch2Comb(ik, ib, ib, 1)].real();
   vel(2) = velocities[velBloch2Comb(ik, ib, ib, 2)].real();
@@ -291,7 +355,11 @@ Eigen::MatrixXd ActiveBandStructure::getGroupVelocities(WavevectorIndex &ik) {
   Eigen::MatrixXd vel(nb, 3);
   for (int ib = 0; ib < nb; ib++) {
     for (int i : {0, 1, 2}) {
-      vel(ib, i) = velocities[velBloch2Comb(ikk, ib, ib, i)].real();
+      if (onlyGroupVelocities) {
+        vel(ib, i) = groupVelocities[groupVelBloch2Comb(ikk, ib, i)];
+      } else {
+        vel(ib, i) = velocities[velBloch2Comb(ikk, ib, ib, i)].real();
+      }
     }
   }
   return vel;
@@ -299,6 +367,10 @@ Eigen::MatrixXd ActiveBandStructure::getGroupVelocities(WavevectorIndex &ik) {
 
 Eigen::Tensor<std::complex<double>, 3>
 ActiveBandStructure::getVelocities(WavevectorIndex &ik) {
+  if (onlyGroupVelocities) {
+    Error("ActiveBandStructure only stores the group velocities, "
+          "the velocity operator is not available");
+  }
   int ikk = ik.get();
   int nb = numBands(ikk);
   Eigen::Tensor<std::complex<double>, 3> vel(nb, nb, 3);
@@ -313,8 +385,17 @@ ActiveBandStructure::getVelocities(WavevectorIndex &ik) {
 }
 
 Eigen::MatrixXcd ActiveBandStructure::getEigenvectors(WavevectorIndex &ik) {
+  if (kramersParent != nullptr) {
+    return kramersParent->getEigenvectors(ik);
+  }
   int ikk = ik.get();
   int nb = numBands(ikk);
+  if (singlePrecisionEigenvectors) {
+    return EigenvectorsFloatView(
+               eigenvectorsFloat.data() + eigBloch2Comb(ikk, 0, 0),
+               numFullBands, nb)
+        .cast<std::complex<double>>();
+  }
   Eigen::MatrixXcd eigenVectors_(numFullBands, nb);
   eigenVectors_.setZero();
   for (int ib1 = 0; ib1 < numFullBands; ib1++) {
@@ -326,6 +407,60 @@ Eigen::MatrixXcd ActiveBandStructure::getEigenvectors(WavevectorIndex &ik) {
   return eigenVectors_;
 }
 
+EnergiesView ActiveBandStructure::getEnergiesView(WavevectorIndex &ik) {
+  int ikk = ik.get();
+  return EnergiesView(energies.data() + bloch2Comb(ikk, 0), numBands(ikk));
+}
+
+GroupVelocitiesView
+ActiveBandStructure::getGroupVelocitiesView(WavevectorIndex &ik) {
+  int ikk = ik.get();
+  int nb = numBands(ikk);
+  if (velocitiesEmpty()) {
+    Error("ActiveBandStructure velocities haven't been populated");
+  }
+  if (onlyGroupVelocities) {
+    return GroupVelocitiesView(
+        groupVelocities.data() + groupVelBloch2Comb(ikk, 0, 0), nb, 3,
+        Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(3, 1));
+  }
+  // real part of the elements (ib,ib,i) of the velocity operator
+  auto data = reinterpret_cast<const double *>(velocities.data() +
+                                               velBloch2Comb(ikk, 0, 0, 0));
+  return GroupVelocitiesView(
+      data, nb, 3, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(6 * (nb + 1), 2));
+}
+
+EigenvectorsView ActiveBandStructure::getEigenvectorsView(WavevectorIndex &ik) {
+  if (kramersParent != nullptr) {
+    return kramersParent->getEigenvectorsView(ik);
+  }
+  if (singlePrecisionEigenvectors) {
+    Error("Developer error: the eigenvectors are stored in single precision, "
+          "use copyEigenvectors()");
+  }
+  int ikk = ik.get();
+  return EigenvectorsView(eigenvectors.data() + eigBloch2Comb(ikk, 0, 0),
+                          numFullBands, numBands(ikk));
+}
+
+void ActiveBandStructure::copyEigenvectors(WavevectorIndex &ik,
+                                           Eigen::MatrixXcd &eigenvectors_) {
+  if (kramersParent != nullptr) {
+    kramersParent->copyEigenvectors(ik, eigenvectors_);
+    return;
+  }
+  if (!singlePrecisionEigenvectors) {
+    eigenvectors_ = getEigenvectorsView(ik);
+    return;
+  }
+  int ikk = ik.get();
+  eigenvectors_ = EigenvectorsFloatView(
+                      eigenvectorsFloat.data() + eigBloch2Comb(ikk, 0, 0),
+                      numFullBands, numBands(ikk))
+                      .cast<std::complex<double>>();
+}
+
 Eigen::Tensor<std::complex<double>, 3>
 ActiveBandStructure::getPhEigenvectors(WavevectorIndex &ik) {
   Eigen::MatrixXcd eigenMatrix = getEigenvectors(ik);
@@ -377,7 +512,11 @@ void ActiveBandStructure::setEigenvectors(Point &point,
   for (int i = 0; i < eigenvectors_.rows(); i++) {
     for (int j = 0; j < eigenvectors_.cols(); j++) {
       int index = eigBloch2Comb(ik, i, j);
-      eigenvectors[index] = eigenvectors_(i, j);
+      if (singlePrecisionEigenvectors) {
+        eigenvectorsFloat[index] = std::complex<float>(eigenvectors_(i, j));
+      } else {
+        eigenvectors[index] = eigenvectors_(i, j);
+      }
     }
   }
 }
@@ -385,6 +524,15 @@ void ActiveBandStructure::setEigenvectors(Point &point,
 void ActiveBandStructure::setVelocities(
     Point &point, Eigen::Tensor<std::complex<double>, 3> &velocities_) {
   int ik = point.getIndex();
+  if (onlyGroupVelocities) {
+    for (int ib = 0; ib < velocities_.dimension(0); ib++) {
+      for (int j : {0, 1, 2}) {
+        groupVelocities[groupVelBloch2Comb(ik, ib, j)] =
+            velocities_(ib, ib, j).real();
+      }
+    }
+    return;
+  }
   for (int ib1 = 0; ib1 < velocities_.dimension(0); ib1++) {
     for (int ib2 = 0; ib2 < velocities_.dimension(1); ib2++) {
       for (int j : {0, 1, 2}) {
@@ -400,6 +548,47 @@ int ActiveBandStructure::velBloch2Comb(const int &ik, const int &ib1,
   return cumulativeKbbOffset(ik) + ib1 * numBands(ik) * 3 + ib2 * 3 + i;
 }
 
+int ActiveBandStructure::groupVelBloch2Comb(const int &ik, const int &ib,
+                                            const int &i) {
+  return (cumulativeKbOffset(ik) + ib) * 3 + i;
+}
+
+void ActiveBandStructure::allocateVelocities(const int &numVelStates) {
+  if (onlyGroupVelocities) {
+    groupVelocities.resize(size_t(numStates) * 3, 0.);
+  } else {
+    velocities.resize(numVelStates, complexZero);
+  }
+}
+
+void ActiveBandStructure::reduceVelocities() {
+  if (onlyGroupVelocities) {
+    groupVelocities.reduce();
+  } else {
+    velocities.reduce();
+  }
+}
+
+bool ActiveBandStructure::velocitiesEmpty() {
+  return onlyGroupVelocities ? groupVelocities.empty() : velocities.empty();
+}
+
+void ActiveBandStructure::allocateEigenvectors(const int &numEigStates) {
+  if (singlePrecisionEigenvectors) {
+    eigenvectorsFloat.resize(numEigStates, std::complex<float>(0., 0.));
+  } else {
+    eigenvectors.resize(numEigStates, complexZero);
+  }
+}
+
+void ActiveBandStructure::reduceEigenvectors() {
+  if (singlePrecisionEigenvectors) {
+    eigenvectorsFloat.reduce();
+  } else {
+    eigenvectors.reduce();
+  }
+}
+
 int ActiveBandStructure::eigBloch2Comb(const int &ik, const int &ib1,
                                        const int &ib2) {
   return cumulativeKbOffset(ik) * numFullBands + ib1 * numBands(ik) + ib2;
@@ -494,6 +683,29 @@ ActiveBandStructure::builder(Context &context, HarmonicHamiltonian &h0,
 
   ActiveBandStructure activeBandStructure(particle, points_);
 
+  // the off-diagonal elements of the velocity operator are only kept if
+  // needed, e.g. for the Wigner transport coefficients
+  activeBandStructure.onlyGroupVelocities = h0.getOnlyGroupVelocities();
+  // the eigenvectors may be stored in single precision, to save memory
+  activeBandStructure.singlePrecisionEigenvectors =
+      h0.getSinglePrecisionEigenvectors();
+
+  // the largest arrays of the band structure, for the memory report
+  auto recordMemory = [&activeBandStructure, &particle]() {
+    double bytes =
+        activeBandStructure.energies.size() * sizeof(double) +
+        activeBandStructure.velocities.size() * sizeof(std::complex<double>) +
+        activeBandStructure.eigenvectors.size() *
+            sizeof(std::complex<double>) +
+        activeBandStructure.eigenvectorsFloat.size() *
+            sizeof(std::complex<float>) +
+        activeBandStructure.groupVelocities.size() * sizeof(double);
+    Profiler::recordObjectMemory(particle.isPhonon()
+                                     ? "phonon band structure"
+                                     : "electron band structure",
+                                 bytes);
+  };
+
   // select a build method based on particle type
   // if it's an electron, we can't build on the fly for any reason.
   // must buildAPP (as post-processing), because we need to calculate chemical potential.
@@ -502,6 +714,7 @@ ActiveBandStructure::builder(Context &context, HarmonicHamiltonian &h0,
 
     StatisticsSweep s = activeBandStructure.buildAsPostprocessing(
         context, points_, h0, withEigenvectors, withVelocities);
+    recordMemory();
 
     return std::make_tuple(activeBandStructure, s);
 
@@ -517,6 +730,7 @@ ActiveBandStructure::builder(Context &context, HarmonicHamiltonian &h0,
 
     activeBandStructure.buildOnTheFly(window, points_, h0, withEigenvectors,
                                       withVelocities);
+    recordMemory();
 
     StatisticsSweep statisticsSweep(context);
     return std::make_tuple(activeBandStructure, statisticsSweep);
@@ -534,35 +748,36 @@ void ActiveBandStructure::buildOnTheFly(Window &window, Points points_,
 
   // we have to build this in a way that works in parallel
   // ALGORITHM:
-  // - loop over points. Diagonalize, and find if we want this k-point
-  //   (while we are at it, we could save energies and the eigenvalues)
+  // - loop over points in batches, split between the device and the host.
+  //   Diagonalize, find if we want this k-point, and if so keep the filtered
+  //   energies, eigenvectors and velocities aside
   // - find how many points each MPI rank has found
   // - communicate the indices
-  // - loop again over wavevectors to compute energies and velocities
+  // - copy the filtered quantities in the raw buffers
+  // In this way, each point is diagonalized only once.
 
   Kokkos::Profiling::pushRegion("activeBandStructure::buildOnTheFly");
-  numFullBands = 0; // save the unfiltered number of bands
-  std::vector<int> myFilteredPoints;
-  std::vector<std::vector<int>> myFilteredBands;
-
-  Kokkos::Profiling::pushRegion("diagonalization loop");
-  // iterate over mpi-parallelized wavevectors
-  #pragma omp parallel
-  {
-  std::vector<int> filteredThreadPoints;
-  std::vector<std::vector<int>> filteredThreadBands;
+  // save the unfiltered number of bands
+  numFullBands = h0.getNumBands();
 
   std::vector<size_t> pointsIter = mpi->divideWorkIter(points_.getNumPoints());
-  #pragma omp for nowait schedule(static)
-  for (size_t iik = 0; iik < pointsIter.size(); iik++) {
-
-    int ik = pointsIter[iik];
-
-    Point point = points_.getPoint(ik);
-    // diagonalize harmonic hamiltonian
-    auto tup = h0.diagonalize(point);
-    auto theseEnergies = std::get<0>(tup);
-    auto theseEigenvectors = std::get<1>(tup);
+  int numLocalPoints = int(pointsIter.size());
+
+  // filtered quantities of the points owned by this MPI process. Each point
+  // writes in its own slot, which stays empty if the point is discarded
+  std::vector<std::vector<int>> localBandsExtrema(numLocalPoints);
+  std::vector<Eigen::VectorXd> localEnergies(numLocalPoints);
+  std::vector<Eigen::MatrixXcd> localEigenvectors(numLocalPoints);
+  std::vector<Eigen::Tensor<std::complex<double>, 3>> localVelocities(
+      numLocalPoints);
+
+  // applies the window to the point #iik, and keeps what survives.
+  // The accessors return the full band structure quantities of that point.
+  auto filterPoint = [&](const int &iik, Eigen::VectorXd &theseEnergies,
+                         const std::function<std::complex<double>(int, int)>
+                             &getEigenvector,
+                         const std::function<std::complex<double>(int, int, int)>
+                             &getVelocity) {
     // ens is empty if no "relevant" energy is found.
     // bandsExtrema contains the lower and upper band index of "relevant"
     // bands at this point
@@ -570,38 +785,133 @@ void ActiveBandStructure::buildOnTheFly(Window &window, Points points_,
     auto ens = std::get<0>(tup1);
     auto bandsExtrema = std::get<1>(tup1);
     if (ens.empty()) { // nothing to do
-      continue;
-    } else { // save point index and "relevant" band indices
-      filteredThreadPoints.push_back(ik);
-      filteredThreadBands.push_back(bandsExtrema);
+      return;
     }
-  }
-  // merge the vector collected by each thread
-  int threadNum = 1;
-  #ifdef OMP_AVAIL
-  threadNum = omp_get_num_threads();
-  #endif
-  #pragma omp for schedule(static) ordered
-  for(int i=0; i<threadNum; i++) {
-    #pragma omp ordered
+    int ib0 = bandsExtrema[0];
+    int numB = bandsExtrema[1] - ib0 + 1;
+    localBandsExtrema[iik] = bandsExtrema;
+    localEnergies[iik] = theseEnergies.segment(ib0, numB);
+    if (withEigenvectors) {
+      // we are reducing the basis size!
+      // the first index has the size of the Hamiltonian
+      // the second index has the size of the filtered bands
+      localEigenvectors[iik].resize(numFullBands, numB);
+      for (int ib = 0; ib < numB; ib++) {
+        for (int i = 0; i < numFullBands; i++) {
+          localEigenvectors[iik](i, ib) = getEigenvector(i, ib0 + ib);
+        }
+      }
+    }
+    if (withVelocities) {
+      localVelocities[iik].resize(numB, numB, 3);
+      for (int ib1 = 0; ib1 < numB; ib1++) {
+        for (int ib2 = 0; ib2 < numB; ib2++) {
+          if (onlyGroupVelocities && ib1 != ib2) continue;
+          for (int i : {0, 1, 2}) {
+            localVelocities[iik](ib1, ib2, i) =
+                getVelocity(ib0 + ib1, ib0 + ib2, i);
+          }
+        }
+      }
+    }
+  };
+
+  Kokkos::Profiling::pushRegion("diagonalization loop");
+
+  auto deviceWork = [&](const int &start, const int &end) {
+    int numK = end - start;
+    DoubleView2D cartesianWavevectors_d("cartWav_d", numK, 3);
     {
-    myFilteredPoints.insert(myFilteredPoints.end(),
-        std::make_move_iterator(filteredThreadPoints.begin()),
-        std::make_move_iterator(filteredThreadPoints.end()));
+      auto cartesianWavevectors_h =
+          Kokkos::create_mirror_view(cartesianWavevectors_d);
+#pragma omp parallel for
+      for (int iik = 0; iik < numK; ++iik) {
+        Eigen::Vector3d k = points_.getPointCoordinates(
+            int(pointsIter[start + iik]), Points::cartesianCoordinates);
+        for (int i = 0; i < 3; ++i) {
+          cartesianWavevectors_h(iik, i) = k(i);
+        }
+      }
+      Kokkos::deep_copy(cartesianWavevectors_d, cartesianWavevectors_h);
+    }
 
-    myFilteredBands.insert(myFilteredBands.end(),
-        std::make_move_iterator(filteredThreadBands.begin()),
-        std::make_move_iterator(filteredThreadBands.end()));
+    DoubleView2D allEnergies_d;
+    StridedComplexView3D allEigenvectors_d;
+    ComplexView4D allVelocities_d;
+    if (withVelocities) {
+      auto t = h0.kokkosBatchedDiagonalizeWithVelocities(cartesianWavevectors_d);
+      allEnergies_d = std::get<0>(t);
+      allEigenvectors_d = std::get<1>(t);
+      allVelocities_d = std::get<2>(t);
+    } else if (withEigenvectors) {
+      auto t = h0.kokkosBatchedDiagonalizeFromCoordinates(cartesianWavevectors_d);
+      allEnergies_d = std::get<0>(t);
+      allEigenvectors_d = std::get<1>(t);
+    } else {
+      // the window only needs the energies
+      allEnergies_d = h0.kokkosBatchedEnergies(cartesianWavevectors_d);
     }
-  }
-  } // close OMP parallel region
+    Kokkos::realloc(cartesianWavevectors_d, 0, 0);
+
+    auto allEnergies_h = Kokkos::create_mirror_view(allEnergies_d);
+    Kokkos::deep_copy(allEnergies_h, allEnergies_d);
+    auto allEigenvectors_h = Kokkos::create_mirror_view(allEigenvectors_d);
+    if (withEigenvectors) {
+      Kokkos::deep_copy(allEigenvectors_h, allEigenvectors_d);
+    }
+    auto allVelocities_h = Kokkos::create_mirror_view(allVelocities_d);
+    if (withVelocities) {
+      Kokkos::deep_copy(allVelocities_h, allVelocities_d);
+    }
+
+#pragma omp parallel for
+    for (int iik = 0; iik < numK; iik++) {
+      Eigen::VectorXd theseEnergies(numFullBands);
+      for (int ib = 0; ib < numFullBands; ib++) {
+        theseEnergies(ib) = allEnergies_h(iik, ib);
+      }
+      filterPoint(
+          start + iik, theseEnergies,
+          [&](int i, int ib) { return allEigenvectors_h(iik, i, ib); },
+          [&](int ib1, int ib2, int i) {
+            return allVelocities_h(iik, ib1, ib2, i);
+          });
+    }
+  };
+
+  auto hostWork = [&](const int &start, const int &end) {
+#pragma omp parallel for
+    for (int iik = start; iik < end; iik++) {
+      Point point = points_.getPoint(int(pointsIter[iik]));
+      // diagonalize harmonic hamiltonian
+      auto tup = h0.diagonalize(point);
+      auto theseEnergies = std::get<0>(tup);
+      auto theseEigenvectors = std::get<1>(tup);
+      Eigen::Tensor<std::complex<double>, 3> thisVelocity;
+      if (withVelocities) {
+        // thisVelocity is a tensor of dimensions (ib, ib, 3)
+        thisVelocity = h0.diagonalizeVelocity(point);
+      }
+      filterPoint(
+          iik, theseEnergies,
+          [&](int i, int ib) { return theseEigenvectors(i, ib); },
+          [&](int ib1, int ib2, int i) { return thisVelocity(ib1, ib2, i); });
+    }
+  };
+
+  heterogeneousBatches(numLocalPoints, h0.estimateBatchSize(withVelocities),
+                       deviceWork, hostWork);
   Kokkos::Profiling::popRegion();
 
-  // this numBands is the full bands num, doesn't matter which point
-  Point point = points_.getPoint(0);
-  auto tup = h0.diagonalize(point);
-  auto theseEnergies = std::get<0>(tup);
-  numFullBands = int(theseEnergies.size());
+  // list the points kept by this process, in increasing order
+  std::vector<int> myFilteredPoints;
+  std::vector<int> myFilteredSlots;
+  for (int iik = 0; iik < numLocalPoints; iik++) {
+    if (!localBandsExtrema[iik].empty()) {
+      myFilteredPoints.push_back(int(pointsIter[iik]));
+      myFilteredSlots.push_back(iik);
+    }
+  }
 
   // now, we let each MPI process now how many points each process has found
   int myNumPts = int(myFilteredPoints.size());
@@ -641,8 +951,8 @@ void ActiveBandStructure::buildOnTheFly(Window &window, Points points_,
   filteredBands.setZero();
   for (int i = 0; i < myNumPts; i++) {
     int index = i + displacements[mpi->getRank()];
-    filteredBands(index, 0) = myFilteredBands[i][0];
-    filteredBands(index, 1) = myFilteredBands[i][1];
+    filteredBands(index, 0) = localBandsExtrema[myFilteredSlots[i]][0];
+    filteredBands(index, 1) = localBandsExtrema[myFilteredSlots[i]][1];
   }
   mpi->allReduceSum(&filteredBands);
 
@@ -652,6 +962,7 @@ void ActiveBandStructure::buildOnTheFly(Window &window, Points points_,
   // this isn't a constant number.
   // Also, we look for the size of the arrays containing band structure.
   numBands = Eigen::VectorXi::Zero(numPoints);
+  bandsOffset = filteredBands.col(0);
   int numEnStates = 0;
   int numVelStates = 0;
   int numEigStates = 0;
@@ -672,87 +983,38 @@ void ActiveBandStructure::buildOnTheFly(Window &window, Points points_,
 
   energies.resize(numEnStates, 0.);
   if (withVelocities) {
-    velocities.resize(numVelStates, complexZero);
+    allocateVelocities(numVelStates);
   }
   if (withEigenvectors) {
     hasEigenvectors = true;
-    eigenvectors.resize(numEigStates, complexZero);
+    allocateEigenvectors(numEigStates);
   }
 
   windowMethod = window.getMethodUsed();
 
 /////////////////
 
-  std::vector<size_t> iks = mpi->divideWorkIter(numPoints);
-  size_t niks = iks.size();
-  Kokkos::Profiling::pushRegion("trimmed diagonalization loop");
-
-// now we can loop over the trimmed list of points
-#pragma omp parallel for default(none)                                         \
-    shared(mpi, h0, window, filteredBands, withEigenvectors, withVelocities, iks, niks, Eigen::Dynamic)
-  for (size_t iik = 0; iik < niks; iik++) {
-    size_t ik = iks[iik];
+  // copy the quantities kept in the diagonalization loop. The points found
+  // by this process are stored contiguously, starting at displacements[rank]
+  Kokkos::Profiling::pushRegion("copy filtered band structure");
+#pragma omp parallel for
+  for (int i = 0; i < myNumPts; i++) {
+    int ik = i + displacements[mpi->getRank()];
+    int iik = myFilteredSlots[i];
     Point point = points.getPoint(ik);
-    auto tup = h0.diagonalize(point);
-    auto theseEnergies = std::get<0>(tup);
-    auto theseEigenvectors = std::get<1>(tup);
-    // eigenvectors(3,numAtoms,numBands)
-    auto tup1 = window.apply(theseEnergies);
-    auto ens = std::get<0>(tup1);
-    auto bandsExtrema = std::get<1>(tup1);
-
-    Eigen::VectorXd eigEns(numBands(ik));
-    {
-      int ibAct = 0;
-      for (int ibFull = filteredBands(ik, 0); ibFull <= filteredBands(ik, 1);
-           ibFull++) {
-        eigEns(ibAct) = theseEnergies(ibFull);
-        ibAct++;
-      }
-    }
-    setEnergies(point, eigEns);
-
+    setEnergies(point, localEnergies[iik]);
     if (withEigenvectors) {
-      // we are reducing the basis size!
-      // the first index has the size of the Hamiltonian
-      // the second index has the size of the filtered bands
-      Eigen::MatrixXcd theseEigenVectors_(numFullBands, numBands(ik));
-      int ibAct = 0;
-      for (int ibFull = filteredBands(ik, 0); ibFull <= filteredBands(ik, 1);
-           ibFull++) {
-        theseEigenVectors_.col(ibAct) = theseEigenvectors.col(ibFull);
-        ibAct++;
-      }
-      setEigenvectors(point, theseEigenVectors_);
+      setEigenvectors(point, localEigenvectors[iik]);
     }
-
     if (withVelocities) {
-      // thisVelocity is a tensor of dimensions (ib, ib, 3)
-      auto thisVelocity = h0.diagonalizeVelocity(point);
-
-      // now we filter it
-      Eigen::Tensor<std::complex<double>, 3> thisVelocities(numBands(ik),
-                                                            numBands(ik), 3);
-      int ib1New = 0;
-      for (int ib1Old = filteredBands(ik, 0); ib1Old < filteredBands(ik, 1) + 1;
-           ib1Old++) {
-        int ib2New = 0;
-        for (int ib2Old = filteredBands(ik, 0);
-             ib2Old < filteredBands(ik, 1) + 1; ib2Old++) {
-          for (int i = 0; i < 3; i++) {
-            thisVelocities(ib1New, ib2New, i) = thisVelocity(ib1Old, ib2Old, i);
-          }
-          ib2New++;
-        }
-        ib1New++;
-      }
-      setVelocities(point, thisVelocities);
+      setVelocities(point, localVelocities[iik]);
     }
   }
   Kokkos::Profiling::popRegion();
   mpi->allReduceSum(&energies);
-  mpi->allReduceSum(&velocities);
-  mpi->allReduceSum(&eigenvectors);
+  buildDegenerateGroups();
+  reduceVelocities();
+  reduceEigenvectors();
 
   buildSymmetries();
   Kokkos::Profiling::popRegion();
@@ -845,8 +1107,7 @@ StatisticsSweep ActiveBandStructure::buildAsPostprocessing(
     // also, since the band structure is distributed, we have to recompute
     // the quasiparticle energies, as they may not be available locally
 
-    Eigen::Vector3d k = fullBandStructure.getWavevector(ikIdx);
-    auto t = points_.getRotationToIrreducible(k, Points::cartesianCoordinates);
+    auto t = points_.getRotationIndexToIrreducible(ik);
     int ikIrr = std::get<0>(t);
     Eigen::Vector3d kIrr =
         points_.getPointCoordinates(ikIrr, Points::cartesianCoordinates);
@@ -945,6 +1206,7 @@ StatisticsSweep ActiveBandStructure::buildAsPostprocessing(
   // this isn't a constant number.
   // Also, we look for the size of the arrays containing band structure.
   numBands = Eigen::VectorXi::Zero(numPoints);
+  bandsOffset = filteredBands.col(0);
   int numEnStates = 0;
   int numVelStates = 0;
   int numEigStates = 0;
@@ -964,11 +1226,11 @@ StatisticsSweep ActiveBandStructure::buildAsPostprocessing(
 
   energies.resize(numEnStates, 0.);
   if (withVelocities) {
-    velocities.resize(numVelStates, complexZero);
+    allocateVelocities(numVelStates);
   }
   if (withEigenvectors) {
     hasEigenvectors = true;
-    eigenvectors.resize(numEigStates, complexZero);
+    allocateEigenvectors(numEigStates);
   }
   windowMethod = window.getMethodUsed();
   Kokkos::Profiling::pushRegion("collect energies and eigenvectors");
@@ -1024,8 +1286,9 @@ StatisticsSweep ActiveBandStructure::buildAsPostprocessing(
   }
   // reduce over internal data buffers
   mpi->allReduceSum(&energies);
+  buildDegenerateGroups();
   if (withEigenvectors)
-    mpi->allReduceSum(&eigenvectors);
+    reduceEigenvectors();
   Kokkos::Profiling::popRegion();
 
   // compute velocities, store, reduce
@@ -1066,7 +1329,7 @@ StatisticsSweep ActiveBandStructure::buildAsPostprocessing(
       }
       setVelocities(point, thisVelocities);
     }
-    mpi->allReduceSum(&velocities);
+    reduceVelocities();
     Kokkos::Profiling::popRegion();
   }
   buildSymmetries();
@@ -1147,6 +1410,20 @@ ActiveBandStructure::getRotationToIrreducible(const Eigen::Vector3d &x,
   return points.getRotationToIrreducible(x, basis);
 }
 
+const std::vector<int> &ActiveBandStructure::getRotationIndicesStar(StateIndex &isIndex) {
+  auto t = getIndex(isIndex);
+  return points.getRotationIndicesStar(std::get<0>(t).get());
+}
+
+const Eigen::Matrix3d &ActiveBandStructure::getRotationMatrix(const int &iRotation) {
+  return points.getRotationMatrix(iRotation, Points::cartesianCoordinates);
+}
+
+std::tuple<int, int>
+ActiveBandStructure::getRotationIndexToIrreducible(WavevectorIndex &ikIndex) {
+  return points.getRotationIndexToIrreducible(ikIndex.get());
+}
+
 int ActiveBandStructure::getPointIndex(
     const Eigen::Vector3d &crystalCoordinates, const bool &suppressError) {
   if (points.isPointStored(crystalCoordinates) == -1) {
@@ -1164,3 +1441,153 @@ std::vector<int>
 ActiveBandStructure::getReducibleStarFromIrreducible(const int &ik) {
   return points.getReducibleStarFromIrreducible(ik);
 }
+
+BandStructureDeviceMirror::~BandStructureDeviceMirror() {
+  kokkosDeviceMemory->removeDeviceMemoryUsage(getDeviceMemoryUsage());
+}
+
+double BandStructureDeviceMirror::getDeviceMemoryUsage() const {
+  return numBands.size() * sizeof(int) +
+         (wavevectors.size() + energies.size() + groupVelocities.size()) *
+             sizeof(double) +
+         eigenvectors.size() * sizeof(Kokkos::complex<double>);
+}
+
+const BandStructureDeviceMirror &ActiveBandStructure::getDeviceMirror() {
+  if (deviceMirror != nullptr) {
+    return *deviceMirror;
+  }
+  DeviceMemoryScope memoryScope("BandStructure");
+  deviceMirror = std::make_shared<BandStructureDeviceMirror>();
+  auto &m = *deviceMirror;
+
+  int maxNumBands = numBands.size() > 0 ? numBands.maxCoeff() : 0;
+  int numEigenRows = hasEigenvectors ? numFullBands : 0;
+  bool withVelocities = !velocitiesEmpty();
+  m.maxNumBands = maxNumBands;
+  m.numBands = IntView1D("bsNumBands", numPoints);
+  m.wavevectors = DoubleView2D("bsWavevectors", numPoints, 3);
+  m.energies = DoubleView2D("bsEnergies", numPoints, maxNumBands);
+  m.groupVelocities = DoubleView3D("bsGroupVelocities", numPoints,
+                                   withVelocities ? maxNumBands : 0, 3);
+  m.eigenvectors = ComplexView3D("bsEigenvectors", numPoints, maxNumBands,
+                                 numEigenRows);
+
+  // the views are zero-initialized, the host copies as well, so that the
+  // padding of the smaller wavevectors is zero
+  auto numBands_h = Kokkos::create_mirror_view(m.numBands);
+  auto wavevectors_h = Kokkos::create_mirror_view(m.wavevectors);
+  auto energies_h = Kokkos::create_mirror_view(m.energies);
+  auto groupVelocities_h = Kokkos::create_mirror_view(m.groupVelocities);
+  auto eigenvectors_h = Kokkos::create_mirror_view(m.eigenvectors);
+#pragma omp parallel for
+  for (int ik = 0; ik < numPoints; ik++) {
+    WavevectorIndex ikIdx(ik);
+    int nb = numBands(ik);
+    numBands_h(ik) = nb;
+    Eigen::Vector3d k = getWavevector(ikIdx);
+    EnergiesView en = getEnergiesView(ikIdx);
+    for (int i : {0, 1, 2}) {
+      wavevectors_h(ik, i) = k(i);
+    }
+    for (int ib = 0; ib < nb; ib++) {
+      energies_h(ik, ib) = en(ib);
+    }
+    if (withVelocities) {
+      GroupVelocitiesView v = getGroupVelocitiesView(ikIdx);
+      for (int ib = 0; ib < nb; ib++) {
+        for (int i : {0, 1, 2}) {
+          groupVelocities_h(ik, ib, i) = v(ib, i);
+        }
+      }
+    }
+    if (numEigenRows > 0) {
+      // converted to double precision, if stored in single precision
+      Eigen::MatrixXcd ev;
+      copyEigenvectors(ikIdx, ev);
+      for (int ib = 0; ib < nb; ib++) {
+        for (int i = 0; i < numEigenRows; i++) {
+          eigenvectors_h(ik, ib, i) = ev(i, ib);
+        }
+      }
+    }
+  }
+  Kokkos::deep_copy(m.numBands, numBands_h);
+  Kokkos::deep_copy(m.wavevectors, wavevectors_h);
+  Kokkos::deep_copy(m.energies, energies_h);
+  Kokkos::deep_copy(m.groupVelocities, groupVelocities_h);
+  Kokkos::deep_copy(m.eigenvectors, eigenvectors_h);
+  kokkosDeviceMemory->addDeviceMemoryUsage(m.getDeviceMemoryUsage());
+  return m;
+}
+
+ActiveBandStructure ActiveBandStructure::buildKramersPairs() {
+  if (velocitiesEmpty()) {
+    Error("Developer error: the Kramers pairs need the group velocities");
+  }
+  // tolerance on the splitting of the two bands of a pair (Ry)
+  const double pairThreshold = 1.0e-5;
+
+  ActiveBandStructure pairs(particle, points);
+  pairs.kramersParent = this;
+  pairs.onlyGroupVelocities = true;
+  pairs.hasEigenvectors = false;
+  pairs.windowMethod = windowMethod;
+  pairs.numPoints = numPoints;
+  pairs.numFullBands = numFullBands / 2;
+  pairs.numBands = Eigen::VectorXi::Zero(numPoints);
+  pairs.bandsOffset = Eigen::VectorXi::Zero(numPoints);
+
+  // the window must keep both bands of every pair
+  int numUnpairedPoints = 0;
+  for (int ik = 0; ik < numPoints; ik++) {
+    int offset = bandsOffset.size() == 0 ? 0 : bandsOffset(ik);
+    bool isPaired = numBands(ik) % 2 == 0 && offset % 2 == 0;
+    int is0 = bloch2Comb(ik, 0);
+    for (int ib = 0; isPaired && ib < numBands(ik); ib += 2) {
+      isPaired = std::abs(energies[is0 + ib] - energies[is0 + ib + 1]) <
+                 pairThreshold;
+    }
+    if (!isPaired) {
+      numUnpairedPoints++;
+    }
+    pairs.numBands(ik) = numBands(ik) / 2;
+    pairs.bandsOffset(ik) = offset / 2;
+  }
+  if (numUnpairedPoints > 0) {
+    Error("useKramersPairs requires doubly degenerate bands at all "
+          "wavevectors, i.e. spin-orbit coupling in a crystal with inversion "
+          "symmetry, and a window that doesn't split the pairs. Found " +
+          std::to_string(numUnpairedPoints) + " wavevectors without pairs.");
+  }
+  pairs.numStates = pairs.numBands.sum();
+  pairs.buildIndices();
+
+  pairs.energies.resize(pairs.numStates, 0.);
+  pairs.allocateVelocities(0);
+  // the average velocity of the two bands doesn't depend on the gauge
+  // chosen inside the degenerate subspace
+  for (size_t ik : mpi->divideWorkIter(numPoints)) {
+    int is0 = bloch2Comb(int(ik), 0);
+    int isPair0 = pairs.bloch2Comb(int(ik), 0);
+    WavevectorIndex ikIdx{int(ik)};
+    GroupVelocitiesView v = getGroupVelocitiesView(ikIdx);
+    for (int ib = 0; ib < pairs.numBands(ik); ib++) {
+      pairs.energies[isPair0 + ib] =
+          0.5 * (energies[is0 + 2 * ib] + energies[is0 + 2 * ib + 1]);
+      for (int i : {0, 1, 2}) {
+        pairs.groupVelocities[pairs.groupVelBloch2Comb(int(ik), ib, i)] =
+            0.5 * (v(2 * ib, i) + v(2 * ib + 1, i));
+      }
+    }
+  }
+  mpi->allReduceSum(&pairs.energies);
+  pairs.reduceVelocities();
+  pairs.buildDegenerateGroups();
+  pairs.buildSymmetries();
+  return pairs;
+}
+
+bool ActiveBandStructure::hasKramersPairs() const {
+  return kramersParent != nullptr;
+}
@@ -8,6 +8,116 @@
 #include "points.h"
 #include "statistics_sweep.h"
 #include "window.h"
+#include "mpiHelper.h"
+#include <memory>
+
+/** Array storing the velocities or eigenvectors of ActiveBandStructure.
+ * When the code runs with shared memory (the -sm flag), the array is
+ * allocated once per node, in memory shared by the MPI processes of the node,
+ * rather than once per process. Each process writes the Bloch states it has
+ * computed, and reduce() collects the contributions of all processes.
+ * Copies refer to the same shared memory, which is released (collectively
+ * over the processes of the node) when the last copy is destroyed.
+ */
+template <typename T>
+class BandStructureBuffer {
+ public:
+  BandStructureBuffer() = default;
+
+  BandStructureBuffer(const BandStructureBuffer &that)
+      : localData(that.localData), sharedData(that.sharedData),
+        numElements(that.numElements), isShared(that.isShared) {
+    // shared arrays are not copied: the copies refer to the same memory
+    ptr = isShared ? that.ptr : localData.data();
+  }
+
+  BandStructureBuffer &operator=(const BandStructureBuffer &that) {
+    if (this != &that) {
+      localData = that.localData;
+      sharedData = that.sharedData;
+      numElements = that.numElements;
+      isShared = that.isShared;
+      ptr = isShared ? that.ptr : localData.data();
+    }
+    return *this;
+  }
+
+  /** Allocates the array and sets all elements to value. When using shared
+   * memory, this is a collective call over all MPI processes.
+   */
+  void resize(const size_t &size, const T &value) {
+    numElements = size;
+    isShared = mpi->useSharedMemory() && size > 0;
+    sharedData.reset();
+    if (isShared) {
+      localData.clear();
+      localData.shrink_to_fit();
+      sharedData = std::shared_ptr<T>(
+          (T *)mpi->allocateSharedMemory(size * sizeof(T)),
+          [](T *data) { mpi->freeSharedMemory(data); });
+      ptr = sharedData.get();
+      if (mpi->isSharedMemoryHead()) {
+        std::fill(ptr, ptr + size, value);
+      }
+      mpi->sharedMemoryBarrier();
+    } else {
+      localData.assign(size, value);
+      ptr = localData.data();
+    }
+  }
+
+  /** Sums the contributions of all MPI processes, which must have written
+   * different elements of the array. Collective over all MPI processes.
+   */
+  void reduce() {
+    if (!isShared) {
+      mpi->allReduceSum(&localData);
+      return;
+    }
+    mpi->sharedMemoryBarrier();
+    mpi->allReduceSumSharedMemory(ptr, numElements);
+    mpi->sharedMemoryBarrier();
+  }
+
+  bool empty() const { return numElements == 0; }
+  size_t size() const { return numElements; }
+  T *data() { return ptr; }
+  const T *data() const { return ptr; }
+  T &operator[](const size_t &i) { return ptr[i]; }
+  const T &operator[](const size_t &i) const { return ptr[i]; }
+
+ private:
+  std::vector<T> localData;
+  std::shared_ptr<T> sharedData;
+  T *ptr = nullptr;
+  size_t numElements = 0;
+  bool isShared = false;
+};
+
+/** Copy on the device of the band structure data used by the scattering
+ * kernels: the cartesian wavevectors, and the energies, group velocities and
+ * eigenvectors of the active bands. Since the number of active bands changes
+ * from one wavevector to another, the arrays are padded to the largest
+ * number of bands, and the padding is set to zero.
+ * The mirror is uploaded once, and the kernels index it by wavevector and
+ * band, so that the batches of the builders only transfer indices.
+ */
+struct BandStructureDeviceMirror {
+  IntView1D numBands;            // (numPoints)
+  DoubleView2D wavevectors;      // (numPoints, 3)
+  DoubleView2D energies;         // (numPoints, maxNumBands)
+  DoubleView3D groupVelocities;  // (numPoints, maxNumBands, 3)
+  ComplexView3D eigenvectors;    // (numPoints, maxNumBands, numFullBands)
+  int maxNumBands = 0;
+
+  BandStructureDeviceMirror() = default;
+  BandStructureDeviceMirror(const BandStructureDeviceMirror &) = delete;
+  BandStructureDeviceMirror &operator=(const BandStructureDeviceMirror &) =
+      delete;
+  ~BandStructureDeviceMirror();
+
+  double getDeviceMemoryUsage() const;
+};
 
 /** Class container of the quasiparticle band structure, i.e. energies,
  * velocities, eigenvectors and wavevectors.
@@ -110,6 +220,15 @@ public:
    */
   int getIndex(const WavevectorIndex &ik, const BandIndex &ib) override;
 
+  /** Converts the band index of a state at a wavevector into the band index
+   * before the window was applied, i.e. in the range [0,numFullBands[.
+   * @param ik: strong-typed index on wavevector index
+   * @param ib: strong-typed index on the active bands at ik
+   * @return ibFull: band index counting all the bands of the Hamiltonian
+   */
+  int getFullBandIndex(const WavevectorIndex &ik,
+                       const BandIndex &ib) override;
+
   /** Given a Bloch state index, finds the corresponding wavevector and band
    * index.
    * @param stateIndex: integer from 0 to numStates-1
@@ -158,6 +277,22 @@ public:
    */
   Eigen::VectorXd getEnergies(WavevectorIndex &ik) override;
 
+  /** Returns the groups of degenerate bands at a wavevector, see
+   * BaseBandStructure::getDegenerateGroups(). These are tabulated for all
+   * wavevectors when the band structure is built, so that the scattering
+   * matrix builders don't compare energies at every wavevector pair.
+   */
+  std::vector<std::tuple<int, int>>
+  getDegenerateGroups(WavevectorIndex &ik) override;
+
+  /** Returns the copy of the band structure on the device, which is
+   * uploaded at the first call and shared by the copies of this object.
+   * Eigenvectors and velocities are included only if the band structure
+   * has them.
+   * The band structure must not be modified afterwards.
+   */
+  const BandStructureDeviceMirror &getDeviceMirror();
+
   /** Returns the maximum energy value. This can be useful when
    * setting energy scales based on which phonons are discarded
    * (as in the phel scattering, where the window is set relative
@@ -194,6 +329,8 @@ public:
    * velocity operator matrix elements, in cartesian basis and in atomic rydberg
    * units, where numActiveBands is the number of active bands present at the
    * specified wavevector.
+   * Not available if the band structure was built storing only the group
+   * velocities, i.e. when the Wigner corrections are not computed.
    */
   Eigen::Tensor<std::complex<double>, 3> getVelocities(WavevectorIndex &ik) override;
 
@@ -206,9 +343,23 @@ public:
    * filtered bands at the desired wavevector.
    * Eigenvectors are ordered along columns.
    * Note that all band structure interpolations may give eigenvectors.
+   * If the states are Kramers pairs, returns the eigenvectors of both bands
+   * of each pair, i.e. columns (2*ib, 2*ib+1) are those of pair ib.
    */
   Eigen::MatrixXcd getEigenvectors(WavevectorIndex &ik) override;
 
+  /** Non-owning views on the energies, group velocities and eigenvectors
+   * at a wavevector, see getEnergies(), getGroupVelocities() and
+   * getEigenvectors(). Views have the size of the active bands.
+   * The eigenvectors view isn't available if the eigenvectors are stored in
+   * single precision: use copyEigenvectors() instead.
+   */
+  EnergiesView getEnergiesView(WavevectorIndex &ik) override;
+  GroupVelocitiesView getGroupVelocitiesView(WavevectorIndex &ik) override;
+  EigenvectorsView getEigenvectorsView(WavevectorIndex &ik) override;
+  void copyEigenvectors(WavevectorIndex &ik,
+                        Eigen::MatrixXcd &eigenvectors_) override;
+
   /** Obtain the eigenvectors of the quasiparticles at a specified wavevector.
    * It's only meaningful for the phonon band structure, where eigenvectors
    * are more naturally represented in this shape!
@@ -320,6 +471,31 @@ public:
   std::tuple<int, Eigen::Matrix3d> getRotationToIrreducible(
       const Eigen::Vector3d &x, const int &basis = Points::crystalCoordinates) override;
 
+  /** Integer version of getRotationsStar: the indices of the rotations
+   * reconstructing the star of the point of an irreducible Bloch state,
+   * to be used with getRotationMatrix(). No matrices are copied.
+   *
+   * @param isIndex: Index of the irreducible Bloch State.
+   * @return rotationIndices: the indices of the rotations R such that
+   * k^red = R k^irr, in the order of getReducibleStarFromIrreducible().
+   */
+  const std::vector<int> &getRotationIndicesStar(StateIndex &isIndex) override;
+
+  /** Returns the cartesian rotation matrix of the symmetry operation
+   * iRotation (see getRotationIndicesStar()).
+   */
+  const Eigen::Matrix3d &getRotationMatrix(const int &iRotation) override;
+
+  /** Integer version of getRotationToIrreducible, for a point of the band
+   * structure, without searching its coordinates.
+   *
+   * @param ikIndex: index of the (reducible) wavevector.
+   * @return <ikIrr,iRotation>: the index of the irreducible point and the
+   * index of the rotation R such that k^red = R k^irr.
+   */
+  std::tuple<int, int>
+  getRotationIndexToIrreducible(WavevectorIndex &ikIndex) override;
+
   /** Utility method to convert an index over Bloch states in the band structure
    * into a Bloch state index usable by VectorBTE.
    * If a state is not mapped to the VectorBTE, throws an error.
@@ -389,6 +565,24 @@ public:
    * equivalent to point #ik.
    */
   std::vector<int> getReducibleStarFromIrreducible(const int &ik) override;
+
+  /** Builds the band structure of the Kramers pairs of this band structure.
+   * With spin-orbit coupling in a crystal with inversion symmetry, all bands
+   * are doubly degenerate: state ib of the new band structure is the pair of
+   * active bands (2*ib, 2*ib+1) at the same wavevector, with their average
+   * energy and group velocity. The eigenvectors of a pair are taken from this
+   * band structure, which must therefore outlive the returned object: see
+   * getEigenvectors().
+   * The velocity operator isn't available on the pairs, i.e. this isn't
+   * compatible with the Wigner corrections.
+   * @return the band structure of the pairs, with half the states.
+   */
+  ActiveBandStructure buildKramersPairs();
+
+  /** Returns true if the states of this band structure are Kramers pairs,
+   * i.e. if it was built by buildKramersPairs().
+   */
+  bool hasKramersPairs() const;
  protected:
   // stores the quasiparticle kind
   Particle particle;
@@ -398,18 +592,31 @@ public:
   // note: we don't store a matrix: we are storing an object (Nk,Nb),
   // with a variable number of bands Nb per point
   std::vector<double> energies;
-  std::vector<std::complex<double>> velocities;
-  std::vector<std::complex<double>> eigenvectors;
+  // the largest arrays, which may be stored in shared memory
+  BandStructureBuffer<std::complex<double>> velocities;
+  BandStructureBuffer<std::complex<double>> eigenvectors;
+  // eigenvectors stored in single precision, used in place of eigenvectors
+  // if singlePrecisionEigenvectors, and converted to double when read
+  BandStructureBuffer<std::complex<float>> eigenvectorsFloat;
+  // real group velocities (numStates,3), used in place of the full velocity
+  // operator when its off-diagonal elements are not needed
+  BandStructureBuffer<double> groupVelocities;
 
   bool hasEigenvectors = false;
+  bool onlyGroupVelocities = false;
+  bool singlePrecisionEigenvectors = false;
   int numStates = 0;
   int numIrrStates;
   int numIrrPoints;
   int numPoints;
 
   Eigen::VectorXi numBands;
+  // index of the first active band at each point (before the window)
+  Eigen::VectorXi bandsOffset;
   int numFullBands = 0;
   int windowMethod = 0;
+  // band structure of the single bands, if the states are Kramers pairs
+  ActiveBandStructure *kramersParent = nullptr;
 
   // index management
   // these are two auxiliary vectors to store indices
@@ -418,14 +625,29 @@ public:
   Eigen::MatrixXi bteAuxBloch2Comb;
   Eigen::VectorXi bteCumulativeKbOffset;
   Eigen::VectorXi cumulativeKbbOffset;
+  // groups of degenerate bands (first band, number of bands) at each point
+  std::vector<std::vector<std::tuple<int, int>>> degenerateGroups;
+  // device copy of the band structure, built on demand
+  std::shared_ptr<BandStructureDeviceMirror> deviceMirror;
   // this is the functionality to build the indices
   void buildIndices(); // to be called after building the band structure
   // and these are the tools to convert indices
   void buildSymmetries();
+  // to be called once the energies are set and reduced
+  void buildDegenerateGroups();
 
   // utilities to convert Bloch indices into internal indices
   int velBloch2Comb(const int &ik, const int &ib1, const int &ib2,
                      const int &i);
+  int groupVelBloch2Comb(const int &ik, const int &ib, const int &i);
+
+  // allocate and reduce the velocity buffer used by the current storage mode
+  void allocateVelocities(const int &numVelStates);
+  void reduceVelocities();
+  bool velocitiesEmpty();
+  // the same for the eigenvectors buffer
+  void allocateEigenvectors(const int &numEigStates);
+  void reduceEigenvectors();
   int eigBloch2Comb(const int &ik, const int &ibFull, const int &ibRed);
   int bloch2Comb(const int &k, const int &b);
   std::tuple<int, int> comb2Bloch(const int &is);
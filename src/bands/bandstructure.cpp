@@ -6,18 +6,83 @@
 #include "points.h"
 #include "utilities.h"
 #include "Matrix.h"
+#include <cstdio>
+#include <fstream>
 #include <set>
 
+#ifdef HDF5_AVAIL
+#include <highfive/H5Easy.hpp>
+#endif
+
 std::vector<size_t> BaseBandStructure::parallelStateIterator() {
     size_t numStates = getNumStates();
     return mpi->divideWorkIter(numStates);
 }
+
+std::vector<std::tuple<int, int>>
+BaseBandStructure::getDegenerateGroups(WavevectorIndex &ik) {
+  return findDegenerateGroups(getEnergies(ik));
+}
+
+std::vector<std::tuple<int, int>>
+BaseBandStructure::findDegenerateGroups(const Eigen::VectorXd &energies) {
+  auto nb = int(energies.size());
+  std::vector<std::tuple<int, int>> groups;
+  for (int ib = 0; ib < nb;) {
+    int degDegree = 1;
+    while (ib + degDegree < nb &&
+           std::abs(energies(ib) - energies(ib + degDegree)) < 1.0e-6) {
+      degDegree++;
+    }
+    if (degDegree > 1) {
+      groups.emplace_back(ib, degDegree);
+    }
+    ib += degDegree;
+  }
+  return groups;
+}
+//-----------------------------------------------------------------------------
+
+BandStructureArrays::BandStructureArrays(BaseBandStructure &bandStructure,
+                                         const bool &withVelocities) {
+  if (bandStructure.getIsDistributed()) {
+    Error("Developer error: BandStructureArrays needs a band structure "
+          "which is not distributed.");
+  }
+  numPoints = bandStructure.getNumPoints();
+  stateOffsets = Eigen::VectorXi::Zero(numPoints + 1);
+  for (int ik = 0; ik < numPoints; ik++) {
+    WavevectorIndex ikIdx(ik);
+    stateOffsets(ik + 1) = stateOffsets(ik) + bandStructure.getNumBands(ikIdx);
+  }
+  int numStates = stateOffsets(numPoints);
+  energies = Eigen::VectorXd::Zero(numStates);
+  // if not requested, the group velocities are read as zero
+  velocities.setZero(numStates, 3);
+  wavevectors.resize(3, numPoints);
+
+#pragma omp parallel for
+  for (int ik = 0; ik < numPoints; ik++) {
+    WavevectorIndex ikIdx(ik);
+    int nb = getNumBands(ik);
+    energies.segment(stateOffsets(ik), nb) =
+        bandStructure.getEnergiesView(ikIdx);
+    if (withVelocities) {
+      velocities.middleRows(stateOffsets(ik), nb) =
+          bandStructure.getGroupVelocitiesView(ikIdx);
+    }
+    wavevectors.col(ik) = bandStructure.getWavevector(ikIdx);
+  }
+}
+
 //-----------------------------------------------------------------------------
 
 FullBandStructure::FullBandStructure(int numBands_, Particle &particle_,
                                      bool withVelocities, bool withEigenvectors,
-                                     Points &points_, bool isDistributed_)
-    : particle(particle_), points(points_), isDistributed(isDistributed_) {
+                                     Points &points_, bool isDistributed_,
+                                     bool onlyGroupVelocities_)
+    : particle(particle_), points(points_), isDistributed(isDistributed_),
+      onlyGroupVelocities(onlyGroupVelocities_) {
 
   numBands = numBands_;
   numAtoms = numBands_ / 3;
@@ -45,8 +110,13 @@ FullBandStructure::FullBandStructure(int numBands_, Particle &particle_,
   numLocalPoints = energies.localCols();
   if (hasVelocities) {
     try {
-      velocities = Matrix<std::complex<double>>(
-        numBands * numBands * 3, numPoints, 1, numBlockCols, isDistributed);
+      if (onlyGroupVelocities) {
+        groupVelocities = Matrix<double>(numBands * 3, numPoints, 1,
+                                         numBlockCols, isDistributed);
+      } else {
+        velocities = Matrix<std::complex<double>>(
+            numBands * numBands * 3, numPoints, 1, numBlockCols, isDistributed);
+      }
     } catch(std::bad_alloc &) {
       Error("Failed to allocate band structure velocities.\n"
         "You are likely out of memory.");
@@ -74,8 +144,10 @@ FullBandStructure::FullBandStructure(const FullBandStructure &that)
   isDistributed = that.isDistributed;
   hasEigenvectors = that.hasEigenvectors;
   hasVelocities = that.hasVelocities;
+  onlyGroupVelocities = that.onlyGroupVelocities;
   energies = that.energies;
   velocities = that.velocities;
+  groupVelocities = that.groupVelocities;
   eigenvectors = that.eigenvectors;
   numBands = that.numBands;
   numAtoms = that.numAtoms;
@@ -91,8 +163,10 @@ FullBandStructure &FullBandStructure::operator=(  // copy assignment
     isDistributed = that.isDistributed;
     hasEigenvectors = that.hasEigenvectors;
     hasVelocities = that.hasVelocities;
+    onlyGroupVelocities = that.onlyGroupVelocities;
     energies = that.energies;
     velocities = that.velocities;
+    groupVelocities = that.groupVelocities;
     eigenvectors = that.eigenvectors;
     numBands = that.numBands;
     numAtoms = that.numAtoms;
@@ -135,6 +209,12 @@ int FullBandStructure::getIndex(const WavevectorIndex &ik,
   return ik.get() * numBands + ib.get();
 }
 
+int FullBandStructure::getFullBandIndex(const WavevectorIndex &ik,
+                                        const BandIndex &ib) {
+  (void)ik;
+  return ib.get();
+}
+
 std::tuple<WavevectorIndex, BandIndex> FullBandStructure::getIndex(
     const int &is) {
   int ik = is / numBands;
@@ -152,25 +232,38 @@ std::tuple<WavevectorIndex, BandIndex> FullBandStructure::getIndex(
 int FullBandStructure::getNumStates() { return numBands * getNumPoints(); }
 
 std::vector<int> FullBandStructure::getWavevectorIndices() {
+  // the columns of the local tiles of energies are the local wavevectors
   std::set<int> kPointsSet;
-  for ( auto tup : energies.getAllLocalStates()) {
-    // returns global indices for local index
-    auto ik = std::get<1>(tup);
-    kPointsSet.insert(ik);
-  }
+  energies.forEachLocalTile([&](const int &row0, const int &col0,
+                                const int &numTileRows,
+                                const int &numTileCols, double *data,
+                                const int &ld) {
+    (void) row0;
+    (void) numTileRows;
+    (void) data;
+    (void) ld;
+    for (int j = 0; j < numTileCols; j++) {
+      kPointsSet.insert(col0 + j);
+    }
+  });
   std::vector<int> kPointsList(kPointsSet.begin(), kPointsSet.end());
   return kPointsList;
 }
 
 std::vector<std::tuple<WavevectorIndex,BandIndex>> FullBandStructure::getStateIndices() {
-  auto allLocalStates = energies.getAllLocalStates();
   std::vector<std::tuple<WavevectorIndex, BandIndex>> indices;
-  for ( auto t : allLocalStates ) {
-    auto ib = BandIndex(std::get<0>(t));
-    auto ik = WavevectorIndex(std::get<1>(t));
-    auto p = std::make_tuple(ik, ib);
-    indices.push_back(p);
-  }
+  energies.forEachLocalTile([&](const int &row0, const int &col0,
+                                const int &numTileRows,
+                                const int &numTileCols, double *data,
+                                const int &ld) {
+    (void) data;
+    (void) ld;
+    for (int j = 0; j < numTileCols; j++) {
+      for (int i = 0; i < numTileRows; i++) {
+        indices.emplace_back(WavevectorIndex(col0 + j), BandIndex(row0 + i));
+      }
+    }
+  });
   return indices;
 }
 
@@ -218,10 +311,19 @@ Eigen::Vector3d FullBandStructure::getGroupVelocity(StateIndex &is) {
   auto tup = decompress2Indices(stateIndex, numPoints, numBands);
   auto ik = std::get<0>(tup);
   auto ib = std::get<1>(tup);
+  Eigen::Vector3d vel;
+  if (onlyGroupVelocities) {
+    if (!groupVelocities.indicesAreLocal(0, ik)) {
+      Error("Cannot access a non-local velocity.");
+    }
+    for (int i : {0, 1, 2}) {
+      vel(i) = groupVelocities(ib * 3 + i, ik);
+    }
+    return vel;
+  }
   if (!velocities.indicesAreLocal(ib,ik)) { // note ib is smaller than nRows
     Error("Cannot access a non-local velocity.");
   }
-  Eigen::Vector3d vel;
   for (int i : {0, 1, 2}) {
     int ind = compress3Indices(ib, ib, i, numBands, numBands, 3);
     vel(i) = velocities(ind, ik).real();
@@ -230,6 +332,9 @@ Eigen::Vector3d FullBandStructure::getGroupVelocity(StateIndex &is) {
 }
 
 Eigen::MatrixXd FullBandStructure::getGroupVelocities(WavevectorIndex &ik) {
+  if (onlyGroupVelocities) {
+    return getGroupVelocitiesView(ik);
+  }
   int ikk = ik.get();
   if (!velocities.indicesAreLocal(0,ikk)) {
     Error("Cannot access a non-local velocity.");
@@ -246,6 +351,10 @@ Eigen::MatrixXd FullBandStructure::getGroupVelocities(WavevectorIndex &ik) {
 
 Eigen::Tensor<std::complex<double>, 3> FullBandStructure::getVelocities(
     WavevectorIndex &ik) {
+  if (onlyGroupVelocities) {
+    Error("FullBandStructure only stores the group velocities, "
+          "the velocity operator is not available");
+  }
   int ikk = ik.get();
   if (!velocities.indicesAreLocal(0,ikk)) {
     Error("Cannot access a non-local velocity.");
@@ -279,6 +388,47 @@ Eigen::MatrixXcd FullBandStructure::getEigenvectors(WavevectorIndex &ik) {
   return eigenVectors_;
 }
 
+// note: the points are distributed over columns, hence the values at one
+// wavevector are contiguous in the local storage
+EnergiesView FullBandStructure::getEnergiesView(WavevectorIndex &ik) {
+  if (!energies.indicesAreLocal(0, ik.get())) {
+    Error("Cannot access a non-local energy.");
+  }
+  return EnergiesView(&energies(0, ik.get()), numBands);
+}
+
+GroupVelocitiesView
+FullBandStructure::getGroupVelocitiesView(WavevectorIndex &ik) {
+  if (onlyGroupVelocities) {
+    if (!groupVelocities.indicesAreLocal(0, ik.get())) {
+      Error("Cannot access a non-local velocity.");
+    }
+    return GroupVelocitiesView(
+        &groupVelocities(0, ik.get()), numBands, 3,
+        Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(3, 1));
+  }
+  if (!velocities.indicesAreLocal(0, ik.get())) {
+    Error("Cannot access a non-local velocity.");
+  }
+  // real part of the elements (ib,ib,i) of the velocity operator
+  auto data = reinterpret_cast<const double *>(&velocities(0, ik.get()));
+  return GroupVelocitiesView(
+      data, numBands, 3,
+      Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(6 * (numBands + 1), 2));
+}
+
+EigenvectorsView FullBandStructure::getEigenvectorsView(WavevectorIndex &ik) {
+  if (!eigenvectors.indicesAreLocal(0, ik.get())) {
+    Error("Cannot access a non-local eigenvector.");
+  }
+  return EigenvectorsView(&eigenvectors(0, ik.get()), numBands, numBands);
+}
+
+void FullBandStructure::copyEigenvectors(WavevectorIndex &ik,
+                                         Eigen::MatrixXcd &eigenvectors_) {
+  eigenvectors_ = getEigenvectorsView(ik);
+}
+
 Eigen::Tensor<std::complex<double>, 3> FullBandStructure::getPhEigenvectors(
     WavevectorIndex &ik) {
   int ikk = ik.get();
@@ -338,7 +488,19 @@ void FullBandStructure::setVelocities(
   if (!hasVelocities) {
     Error("FullBandStructure was initialized without velocities, cannot set velocities.");
   }
-  
+  int ik = point.getIndex();
+  if (onlyGroupVelocities) {
+    if (!groupVelocities.indicesAreLocal(0, ik)) {
+      Error("DeveloperError: Cannot set a non-local velocity in distributed velocity vector.");
+    }
+    for (int ib = 0; ib < numBands; ib++) {
+      for (int i : {0, 1, 2}) {
+        groupVelocities(ib * 3 + i, ik) = velocities_(ib, ib, i).real();
+      }
+    }
+    return;
+  }
+
   // we convert from a tensor to a vector (how it's stored in memory)
   Eigen::VectorXcd tmpVelocities_(numBands * numBands * 3);
   for (int i = 0; i < numBands; i++) {
@@ -350,7 +512,6 @@ void FullBandStructure::setVelocities(
       }
     }
   }
-  int ik = point.getIndex();
   if(ik >= numPoints || ik < 0) std::cout << "found a bad ik value " << ik << std::endl;
   if (!velocities.indicesAreLocal(0,ik)) {
     // col distributed, only need to check ik
@@ -416,6 +577,20 @@ std::tuple<int, Eigen::Matrix3d> FullBandStructure::getRotationToIrreducible(
   return points.getRotationToIrreducible(x, basis);
 }
 
+const std::vector<int> &FullBandStructure::getRotationIndicesStar(StateIndex &isIndex) {
+  auto t = getIndex(isIndex);
+  return points.getRotationIndicesStar(std::get<0>(t).get());
+}
+
+const Eigen::Matrix3d &FullBandStructure::getRotationMatrix(const int &iRotation) {
+  return points.getRotationMatrix(iRotation, Points::cartesianCoordinates);
+}
+
+std::tuple<int, int>
+FullBandStructure::getRotationIndexToIrreducible(WavevectorIndex &ikIndex) {
+  return points.getRotationIndexToIrreducible(ikIndex.get());
+}
+
 BteIndex FullBandStructure::stateToBte(StateIndex &isIndex) {
   auto t = getIndex(isIndex);
   // ik is in [0,N_k]
@@ -492,3 +667,250 @@ int FullBandStructure::getPointIndex(const Eigen::Vector3d &crystalCoordinates,
 std::vector<int> FullBandStructure::getReducibleStarFromIrreducible(const int &ik) {
   return points.getReducibleStarFromIrreducible(ik);
 }
+
+void FullBandStructure::fixEigenvectorGauge() {
+  if (!hasEigenvectors) {
+    return;
+  }
+  std::vector<int> iks = getWavevectorIndices();
+  int numIks = int(iks.size());
+#pragma omp parallel for
+  for (int iik = 0; iik < numIks; iik++) {
+    int ik = iks[iik];
+
+    // for each eigenvector, the phase that makes its largest component real
+    // and positive. Components of (almost) equal size are resolved by taking
+    // the first one, so that numerical noise doesn't change the choice.
+    Eigen::VectorXcd phases(numBands);
+    for (int ib = 0; ib < numBands; ib++) {
+      double maxNorm = 0.;
+      for (int i = 0; i < numBands; i++) {
+        int idx = compress2Indices(i, ib, numBands, numBands);
+        maxNorm = std::max(maxNorm, std::abs(eigenvectors(idx, ik)));
+      }
+      phases(ib) = 1.;
+      for (int i = 0; i < numBands; i++) {
+        int idx = compress2Indices(i, ib, numBands, numBands);
+        std::complex<double> c = eigenvectors(idx, ik);
+        if (std::abs(c) > (1. - 1.0e-6) * maxNorm && std::abs(c) > 0.) {
+          phases(ib) = std::conj(c) / std::abs(c);
+          break;
+        }
+      }
+    }
+
+    for (int ib = 0; ib < numBands; ib++) {
+      for (int i = 0; i < numBands; i++) {
+        int idx = compress2Indices(i, ib, numBands, numBands);
+        eigenvectors(idx, ik) *= phases(ib);
+      }
+    }
+    // v -> D^dagger v D, with D the diagonal matrix of phases
+    // (the group velocities are left unchanged)
+    if (hasVelocities && !onlyGroupVelocities) {
+      for (int ib1 = 0; ib1 < numBands; ib1++) {
+        for (int ib2 = 0; ib2 < numBands; ib2++) {
+          for (int i : {0, 1, 2}) {
+            int idx = compress3Indices(ib1, ib2, i, numBands, numBands, 3);
+            velocities(idx, ik) *= std::conj(phases(ib1)) * phases(ib2);
+          }
+        }
+      }
+    }
+  }
+}
+
+int FullBandStructure::getStorageFlags() const {
+  return int(hasVelocities) + 2 * int(hasEigenvectors)
+      + 4 * int(onlyGroupVelocities);
+}
+
+void FullBandStructure::saveToFile(const std::string &fileName,
+                                   const uint64_t &hash) {
+#ifndef HDF5_AVAIL
+  (void) fileName;
+  (void) hash;
+#else
+  // collect the full band structure on the head process
+  std::vector<int> iks = getWavevectorIndices();
+  Eigen::MatrixXd energiesAll = Eigen::MatrixXd::Zero(numBands, numPoints);
+  Eigen::MatrixXd groupVelocitiesAll;
+  Eigen::MatrixXcd velocitiesAll, eigenvectorsAll;
+  for (int ik : iks) {
+    for (int ib = 0; ib < numBands; ib++) {
+      energiesAll(ib, ik) = energies(ib, ik);
+    }
+  }
+  if (hasVelocities && onlyGroupVelocities) {
+    groupVelocitiesAll = Eigen::MatrixXd::Zero(numBands * 3, numPoints);
+    for (int ik : iks) {
+      for (int i = 0; i < numBands * 3; i++) {
+        groupVelocitiesAll(i, ik) = groupVelocities(i, ik);
+      }
+    }
+  } else if (hasVelocities) {
+    velocitiesAll = Eigen::MatrixXcd::Zero(velocities.rows(), numPoints);
+    for (int ik : iks) {
+      for (int i = 0; i < velocities.rows(); i++) {
+        velocitiesAll(i, ik) = velocities(i, ik);
+      }
+    }
+  }
+  if (hasEigenvectors) {
+    eigenvectorsAll = Eigen::MatrixXcd::Zero(eigenvectors.rows(), numPoints);
+    for (int ik : iks) {
+      for (int i = 0; i < eigenvectors.rows(); i++) {
+        eigenvectorsAll(i, ik) = eigenvectors(i, ik);
+      }
+    }
+  }
+  if (isDistributed) {
+    mpi->reduceSum(&energiesAll);
+    if (hasVelocities && onlyGroupVelocities) {
+      mpi->reduceSum(&groupVelocitiesAll);
+    } else if (hasVelocities) {
+      mpi->reduceSum(&velocitiesAll);
+    }
+    if (hasEigenvectors) {
+      mpi->reduceSum(&eigenvectorsAll);
+    }
+  }
+
+  if (!mpi->mpiHead()) {
+    return;
+  }
+  std::cout << "Saving the band structure to " << fileName << std::endl;
+  try {
+    // remove stale files, which HDF5 may fail to overwrite
+    std::remove(fileName.c_str());
+    HighFive::File file(fileName, HighFive::File::Overwrite);
+
+    HighFive::DataSet dHash = file.createDataSet<uint64_t>(
+        "/hash", HighFive::DataSpace::From(hash));
+    dHash.write(hash);
+    Eigen::Vector3i sizes;
+    sizes << numBands, numPoints, getStorageFlags();
+    HighFive::DataSet dSizes = file.createDataSet<int>(
+        "/sizes", HighFive::DataSpace::From(sizes));
+    dSizes.write(sizes);
+
+    HighFive::DataSet dEnergies = file.createDataSet<double>(
+        "/energies", HighFive::DataSpace::From(energiesAll));
+    dEnergies.write(energiesAll);
+    if (hasVelocities && onlyGroupVelocities) {
+      HighFive::DataSet dVelocities = file.createDataSet<double>(
+          "/groupVelocities", HighFive::DataSpace::From(groupVelocitiesAll));
+      dVelocities.write(groupVelocitiesAll);
+    } else if (hasVelocities) {
+      HighFive::DataSet dVelocities = file.createDataSet<std::complex<double>>(
+          "/velocities", HighFive::DataSpace::From(velocitiesAll));
+      dVelocities.write(velocitiesAll);
+    }
+    if (hasEigenvectors) {
+      HighFive::DataSet dEigenvectors =
+          file.createDataSet<std::complex<double>>(
+              "/eigenvectors", HighFive::DataSpace::From(eigenvectorsAll));
+      dEigenvectors.write(eigenvectorsAll);
+    }
+  } catch (std::exception &error) {
+    Warning("Failed to write the band structure to " + fileName);
+  }
+#endif
+}
+
+bool FullBandStructure::loadFromFile(const std::string &fileName,
+                                     const uint64_t &hash) {
+#ifndef HDF5_AVAIL
+  (void) fileName;
+  (void) hash;
+  Error("Saving the band structure to disk requires Phoebe built with HDF5.");
+  return false;
+#else
+  // 0: no file, 1: valid file, -1: file written for different inputs
+  int status = 0;
+  Eigen::MatrixXd energiesAll(numBands, numPoints);
+  Eigen::MatrixXd groupVelocitiesAll;
+  Eigen::MatrixXcd velocitiesAll, eigenvectorsAll;
+  if (hasVelocities && onlyGroupVelocities) {
+    groupVelocitiesAll.resize(numBands * 3, numPoints);
+  } else if (hasVelocities) {
+    velocitiesAll.resize(velocities.rows(), numPoints);
+  }
+  if (hasEigenvectors) {
+    eigenvectorsAll.resize(eigenvectors.rows(), numPoints);
+  }
+
+  if (mpi->mpiHead()) {
+    std::ifstream tmpFile(fileName);
+    if (tmpFile.good()) {
+      status = 1;
+    }
+  }
+  if (mpi->mpiHead() && status == 1) {
+    try {
+      HighFive::File file(fileName, HighFive::File::ReadOnly);
+      uint64_t hash_;
+      Eigen::Vector3i sizes;
+      file.getDataSet("/hash").read(hash_);
+      file.getDataSet("/sizes").read(sizes);
+      if (hash_ != hash || sizes(0) != numBands || sizes(1) != numPoints
+          || sizes(2) != getStorageFlags()) {
+        status = -1;
+      } else {
+        file.getDataSet("/energies").read(energiesAll);
+        if (hasVelocities && onlyGroupVelocities) {
+          file.getDataSet("/groupVelocities").read(groupVelocitiesAll);
+        } else if (hasVelocities) {
+          file.getDataSet("/velocities").read(velocitiesAll);
+        }
+        if (hasEigenvectors) {
+          file.getDataSet("/eigenvectors").read(eigenvectorsAll);
+        }
+      }
+    } catch (std::exception &error) {
+      status = -1;
+    }
+  }
+  mpi->bcast(&status);
+  if (status == -1) {
+    Warning("The band structure in " + fileName + " cannot be reused "
+            "and will be recomputed.");
+  }
+  if (status != 1) {
+    return false;
+  }
+
+  mpi->bcast(&energiesAll);
+  if (hasVelocities && onlyGroupVelocities) {
+    mpi->bcast(&groupVelocitiesAll);
+  } else if (hasVelocities) {
+    mpi->bcast(&velocitiesAll);
+  }
+  if (hasEigenvectors) {
+    mpi->bcast(&eigenvectorsAll);
+  }
+  for (int ik : getWavevectorIndices()) {
+    for (int ib = 0; ib < numBands; ib++) {
+      energies(ib, ik) = energiesAll(ib, ik);
+    }
+    if (hasVelocities && onlyGroupVelocities) {
+      for (int i = 0; i < numBands * 3; i++) {
+        groupVelocities(i, ik) = groupVelocitiesAll(i, ik);
+      }
+    } else if (hasVelocities) {
+      for (int i = 0; i < velocities.rows(); i++) {
+        velocities(i, ik) = velocitiesAll(i, ik);
+      }
+    }
+    if (hasEigenvectors) {
+      for (int i = 0; i < eigenvectors.rows(); i++) {
+        eigenvectors(i, ik) = eigenvectorsAll(i, ik);
+      }
+    }
+  }
+  if (mpi->mpiHead()) {
+    std::cout << "Loaded the band structure from " << fileName << std::endl;
+  }
+  return true;
+#endif
+}
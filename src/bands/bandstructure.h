@@ -8,6 +8,19 @@
 #include "Matrix.h"
 #include <utility>
 
+/** Non-owning views over the band structure storage, returned by the
+ * get*View() accessors to avoid copies in the scattering matrix builders.
+ * Eigenvectors are stored row-major (one eigenvector per column), and the
+ * group velocities are the real parts of the diagonal of the velocity
+ * operator, hence the strides.
+ */
+using EnergiesView = Eigen::Map<const Eigen::VectorXd>;
+using EigenvectorsView = Eigen::Map<const Eigen::Matrix<
+    std::complex<double>, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>;
+using GroupVelocitiesView =
+    Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>,
+               0, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>>;
+
 /** Base class for describing objects containing the band structure, i.e.
  * the harmonic properties of a quasiparticle, as a function of wavevectors
  * (Points).
@@ -88,6 +101,16 @@ class BaseBandStructure {
   virtual std::tuple<WavevectorIndex, BandIndex> getIndex(const int &is) = 0;
   virtual std::tuple<WavevectorIndex, BandIndex> getIndex(StateIndex &is) = 0;
 
+  /** Converts the band index of a state at a wavevector into the band index
+   * of the band structure computed without a window, so that states of the
+   * same band can be matched across different wavevectors.
+   * @param ik: strong-typed index on wavevector
+   * @param ib: strong-typed index on the bands of this band structure
+   * @return ibFull: band index counting all the bands of the Hamiltonian
+   */
+  virtual int getFullBandIndex(const WavevectorIndex &ik,
+                               const BandIndex &ib) = 0;
+
   /** Returns the total number of Bloch states.
    * @return numStates: the integer number of Bloch states.
    */
@@ -111,6 +134,22 @@ class BaseBandStructure {
   virtual const double &getEnergy(StateIndex &is) = 0;
   virtual Eigen::VectorXd getEnergies(WavevectorIndex &ik) = 0;
 
+  /** Returns the groups of degenerate bands at a wavevector, i.e. the runs
+   * of consecutive bands with energy within 1e-6 Ry of the first band of
+   * the run. Only groups of two or more bands are listed, so that
+   * non-degenerate bands can be skipped when averaging over degeneracies.
+   * @param ik: a WavevectorIndex(ik) object where ik is the integer index
+   * @return groups: a vector of tuples (first band, number of bands).
+   */
+  virtual std::vector<std::tuple<int, int>>
+  getDegenerateGroups(WavevectorIndex &ik);
+
+  /** Same as getDegenerateGroups(), for a list of band energies sorted in
+   * ascending order.
+   */
+  static std::vector<std::tuple<int, int>>
+  findDegenerateGroups(const Eigen::VectorXd &energies);
+
   /** Returns the energy of a quasiparticle from its Bloch index
    * Used for accessing the band structure in the BTE.
    * @param stateIndex: an integer index in range [0,numStates[
@@ -126,6 +165,21 @@ class BaseBandStructure {
   virtual Eigen::Tensor<std::complex<double>, 3> getPhEigenvectors(
       WavevectorIndex &ik) = 0;
 
+  /** Same as getEnergies(), getGroupVelocities() and getEigenvectors(), but
+   * return a non-owning view on the stored values, without allocations.
+   * The views are valid as long as the band structure object.
+   */
+  virtual EnergiesView getEnergiesView(WavevectorIndex &ik) = 0;
+  virtual GroupVelocitiesView getGroupVelocitiesView(WavevectorIndex &ik) = 0;
+  virtual EigenvectorsView getEigenvectorsView(WavevectorIndex &ik) = 0;
+
+  /** Copies the eigenvectors at a wavevector in a matrix, whose memory is
+   * reused if it already has the right size. Unlike getEigenvectorsView(),
+   * this also works when the eigenvectors are stored in single precision.
+   */
+  virtual void copyEigenvectors(WavevectorIndex &ik,
+                                Eigen::MatrixXcd &eigenvectors_) = 0;
+
   /** Returns the energy of a quasiparticle from its Bloch index
    * Used for accessing the band structure in the BTE.
    * @param stateIndex: an integer index in range [0,numStates[
@@ -199,6 +253,31 @@ class BaseBandStructure {
       const Eigen::Vector3d &x,
       const int &basis = Points::crystalCoordinates) = 0;
 
+  /** Integer version of getRotationsStar: the indices of the rotations
+   * reconstructing the star of the point of an irreducible Bloch state,
+   * to be used with getRotationMatrix(). No matrices are copied.
+   *
+   * @param isIndex: Index of the irreducible Bloch State.
+   * @return rotationIndices: the indices of the rotations R such that
+   * k^red = R k^irr, in the order of getReducibleStarFromIrreducible().
+   */
+  virtual const std::vector<int> &getRotationIndicesStar(StateIndex &isIndex) = 0;
+
+  /** Returns the cartesian rotation matrix of the symmetry operation
+   * iRotation (see getRotationIndicesStar()).
+   */
+  virtual const Eigen::Matrix3d &getRotationMatrix(const int &iRotation) = 0;
+
+  /** Integer version of getRotationToIrreducible, for a point of the band
+   * structure, without searching its coordinates.
+   *
+   * @param ikIndex: index of the (reducible) wavevector.
+   * @return <ikIrr,iRotation>: the index of the irreducible point and the
+   * index of the rotation R such that k^red = R k^irr.
+   */
+  virtual std::tuple<int, int>
+  getRotationIndexToIrreducible(WavevectorIndex &ikIndex) = 0;
+
   /** Utility method to convert an index over Bloch states in the band structure
    * into a Bloch state index usable by VectorBTE.
    * If a state is not mapped to the VectorBTE, throws an error.
@@ -270,6 +349,64 @@ class BaseBandStructure {
   virtual std::vector<int> getReducibleStarFromIrreducible(const int &ik) = 0;
 };
 
+/** Flat copy of the energies, group velocities and wavevectors of a band
+ * structure, stored as structure of arrays. It is meant for the innermost
+ * loops of the scattering matrix builders, where the virtual calls of
+ * BaseBandStructure and the temporary index objects have a visible cost.
+ * States are ordered by wavevector, then band, as in the band structures,
+ * so that integer state indices can be used directly.
+ */
+class BandStructureArrays {
+ public:
+  /** Copies the data of a (non-distributed) band structure.
+   * @param bandStructure: the band structure to be copied.
+   * @param withVelocities: if false, the group velocities are not copied,
+   * and are read as zero. The band structure may then have no velocities.
+   */
+  explicit BandStructureArrays(BaseBandStructure &bandStructure,
+                               const bool &withVelocities = true);
+
+  int getNumPoints() const { return numPoints; }
+
+  int getNumBands(const int &ik) const {
+    return stateOffsets(ik + 1) - stateOffsets(ik);
+  }
+
+  int getStateIndex(const int &ik, const int &ib) const {
+    return stateOffsets(ik) + ib;
+  }
+
+  double getEnergy(const int &is) const { return energies(is); }
+
+  EnergiesView getEnergies(const int &ik) const {
+    return EnergiesView(energies.data() + stateOffsets(ik), getNumBands(ik));
+  }
+
+  Eigen::Vector3d getGroupVelocity(const int &is) const {
+    return velocities.row(is);
+  }
+
+  GroupVelocitiesView getGroupVelocities(const int &ik) const {
+    return GroupVelocitiesView(
+        velocities.data() + 3 * stateOffsets(ik), getNumBands(ik), 3,
+        Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>(3, 1));
+  }
+
+  /** Cartesian coordinates of the wavevector ik.
+   */
+  Eigen::Vector3d getWavevector(const int &ik) const {
+    return wavevectors.col(ik);
+  }
+
+ private:
+  int numPoints = 0;
+  // the states of wavevector ik are in [stateOffsets(ik),stateOffsets(ik+1)[
+  Eigen::VectorXi stateOffsets;
+  Eigen::VectorXd energies;
+  Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> velocities;
+  Eigen::Matrix<double, 3, Eigen::Dynamic> wavevectors;
+};
+
 class ActiveBandStructure;
 // forward declaration of friend class
 // we could remove this by making ActiveBS a subclass of FullBS
@@ -302,10 +439,13 @@ class FullBandStructure : public BaseBandStructure {
    * @param isDistributed: if true, we distribute in memory the
    * storage of quantities, parallelizing over wavevectors (points). By default
    * we don't distribute data in parallel.
+   * @param onlyGroupVelocities: if true, only the group velocities are stored
+   * instead of the full velocity operator, and getVelocities() can't be used.
    */
   FullBandStructure(int numBands_, Particle &particle_, bool withVelocities,
                     bool withEigenvectors, Points &points_,
-                    bool isDistributed_ = false);
+                    bool isDistributed_ = false,
+                    bool onlyGroupVelocities_ = false);
 
   FullBandStructure();
 
@@ -365,6 +505,11 @@ class FullBandStructure : public BaseBandStructure {
    */
   int getIndex(const WavevectorIndex &ik, const BandIndex &ib) override;
 
+  /** Returns the band index ib, as all bands are stored.
+   */
+  int getFullBandIndex(const WavevectorIndex &ik,
+                       const BandIndex &ib) override;
+
   /** Given a Bloch state index, finds the corresponding wavevector and band
    * index.
    * @param stateIndex: integer from 0 to numStates-1=numBands*numPoints-1
@@ -486,6 +631,16 @@ class FullBandStructure : public BaseBandStructure {
    */
   Eigen::MatrixXcd getEigenvectors(WavevectorIndex &ik) override;
 
+  /** Non-owning views on the energies, group velocities and eigenvectors
+   * at a wavevector, see getEnergies(), getGroupVelocities() and
+   * getEigenvectors(). The wavevector must be stored on this MPI process.
+   */
+  EnergiesView getEnergiesView(WavevectorIndex &ik) override;
+  GroupVelocitiesView getGroupVelocitiesView(WavevectorIndex &ik) override;
+  EigenvectorsView getEigenvectorsView(WavevectorIndex &ik) override;
+  void copyEigenvectors(WavevectorIndex &ik,
+                        Eigen::MatrixXcd &eigenvectors_) override;
+
   /** Obtain the eigenvectors of the quasiparticles at a specified wavevector.
    * It's only meaningful for the phonon band structure, where eigenvectors
    * are more naturally represented in this shape!
@@ -549,6 +704,30 @@ class FullBandStructure : public BaseBandStructure {
    */
   void setEnergies(Eigen::Vector3d &point, Eigen::VectorXd &energies_);
 
+  /** Fixes the arbitrary phase of each eigenvector, making its largest
+   * component real and positive, and rotates the velocity operator
+   * accordingly. This makes the eigenvectors reproducible across runs, so
+   * that they can be stored on disk and reused.
+   * Note: the gauge freedom within degenerate subspaces is not fixed.
+   */
+  void fixEigenvectorGauge();
+
+  /** Writes energies, and velocities and eigenvectors if present, to an HDF5
+   * file. Only the head MPI process writes the file.
+   * @param fileName: name of the HDF5 file.
+   * @param hash: a hash identifying the inputs used to compute the band
+   * structure, which is stored in the file and checked when reloading it.
+   */
+  void saveToFile(const std::string &fileName, const uint64_t &hash);
+
+  /** Reads the band structure written by saveToFile().
+   * @param fileName: name of the HDF5 file.
+   * @param hash: the identifier of the current inputs.
+   * @return bool: false if the file doesn't exist, or was written for
+   * different inputs. In this case, the band structure is left untouched.
+   */
+  bool loadFromFile(const std::string &fileName, const uint64_t &hash);
+
   /** Returns all electronic energies for all wavevectors at fixed band index
    * Used by the Fourier interpolation of the band structure.
    * @param bandIndex: index in [0,numBands[ for the quasiparticle band
@@ -592,6 +771,31 @@ class FullBandStructure : public BaseBandStructure {
       const Eigen::Vector3d &x,
       const int &basis = Points::crystalCoordinates) override;
 
+  /** Integer version of getRotationsStar: the indices of the rotations
+   * reconstructing the star of the point of an irreducible Bloch state,
+   * to be used with getRotationMatrix(). No matrices are copied.
+   *
+   * @param isIndex: Index of the irreducible Bloch State.
+   * @return rotationIndices: the indices of the rotations R such that
+   * k^red = R k^irr, in the order of getReducibleStarFromIrreducible().
+   */
+  const std::vector<int> &getRotationIndicesStar(StateIndex &isIndex) override;
+
+  /** Returns the cartesian rotation matrix of the symmetry operation
+   * iRotation (see getRotationIndicesStar()).
+   */
+  const Eigen::Matrix3d &getRotationMatrix(const int &iRotation) override;
+
+  /** Integer version of getRotationToIrreducible, for a point of the band
+   * structure, without searching its coordinates.
+   *
+   * @param ikIndex: index of the (reducible) wavevector.
+   * @return <ikIrr,iRotation>: the index of the irreducible point and the
+   * index of the rotation R such that k^red = R k^irr.
+   */
+  std::tuple<int, int>
+  getRotationIndexToIrreducible(WavevectorIndex &ikIndex) override;
+
   /** Utility method to convert an index over Bloch states in the band structure
    * into a Bloch state index usable by VectorBTE.
    * If a state is not mapped to the VectorBTE, throws an error.
@@ -673,10 +877,12 @@ protected:
 
   bool hasEigenvectors = false;
   bool hasVelocities = false;
+  bool onlyGroupVelocities = false;
 
   // matrices storing the raw data
   Matrix<double> energies;       // size(bands,points)
   Matrix<std::complex<double>> velocities;    // size(3*bands^2,points)
+  Matrix<double> groupVelocities;    // size(3*bands,points), if onlyGroupVelocities
   Matrix<std::complex<double>> eigenvectors;  // size(bands^2,points)
 
   // auxiliary variables
@@ -688,6 +894,9 @@ protected:
   // method to find the index of the point, from its crystal coordinates
   int getIndex(Eigen::Vector3d &pointCoordinates);
 
+  // encodes which quantities are stored, to validate files on disk
+  int getStorageFlags() const;
+
   // ActiveBandStructure, which restricts the FullBandStructure to a subset
   // of wavevectors, needs low-level access to the raw data (for now)
   friend class ActiveBandStructure;
@@ -9,7 +9,7 @@
 Window::Window(Context &context, Particle &particle_,
                const double &temperatureMin_, const double &temperatureMax_,
                const double &chemicalPotentialMin_,
-               const double &chemicalPotentialMax_) :
+               const double &chemicalPotentialMax_, const bool &verbose) :
     particle(particle_), temperatureMin(temperatureMin_),
     temperatureMax(temperatureMax_),
     chemicalPotentialMin(chemicalPotentialMin_),
@@ -37,7 +37,7 @@ Window::Window(Context &context, Particle &particle_,
       // tested this value to be a safe one.
     }
     std::string occ = (particle.isElectron()) ? "df/dT" : "dn/dT";
-    if(mpi->mpiHead()) {
+    if(mpi->mpiHead() && verbose) {
         std::cout << std::scientific << "Applying a population window discarding states with "
                 << occ << " < " << populationThreshold << "." << std::fixed << std::endl;
     }
@@ -47,7 +47,7 @@ Window::Window(Context &context, Particle &particle_,
     minEnergy = context.getWindowEnergyLimit().minCoeff();
     maxEnergy = context.getWindowEnergyLimit().maxCoeff();
 
-    if(mpi->mpiHead()) {
+    if(mpi->mpiHead() && verbose) {
       std::cout << "Applying an energy window discarding states outside of ["
                 <<  std::fixed << minEnergy*energyRyToEv << ", " << maxEnergy*energyRyToEv
                 << "] eV range." << std::endl;
@@ -60,10 +60,12 @@ Window::Window(Context &context, Particle &particle_,
     }
   } else if (method == muEnergy) {
 
-    minEnergy = chemicalPotentialMin - abs(context.getWindowEnergyLimit().minCoeff());
-    maxEnergy = chemicalPotentialMax + abs(context.getWindowEnergyLimit().maxCoeff());
+    muWindowBelow = abs(context.getWindowEnergyLimit().minCoeff());
+    muWindowAbove = abs(context.getWindowEnergyLimit().maxCoeff());
+    minEnergy = chemicalPotentialMin - muWindowBelow;
+    maxEnergy = chemicalPotentialMax + muWindowAbove;
 
-    if(mpi->mpiHead()) {
+    if(mpi->mpiHead() && verbose) {
       std::cout << "Applying an energy window discarding states outside of ["
           << std::fixed << minEnergy*energyRyToEv << ", " << maxEnergy*energyRyToEv <<
           "] eV range." << std::endl;
@@ -159,3 +161,18 @@ std::tuple<std::vector<double>, std::vector<int>> Window::internalEnWindow(
 int Window::getMethodUsed() const {
   return method;
 }
+
+bool Window::isInWindow(const double &stateEnergy, const double &temperature,
+                        const double &chemicalPotential) const {
+  if (method == population) {
+    return abs(particle.getPopPopPm1(stateEnergy, temperature, chemicalPotential))
+        > populationThreshold;
+  } else if (method == energy) {
+    return stateEnergy < maxEnergy && stateEnergy > minEnergy;
+  } else if (method == muEnergy) {
+    return stateEnergy < chemicalPotential + muWindowAbove
+        && stateEnergy > chemicalPotential - muWindowBelow;
+  } else { // no filter
+    return true;
+  }
+}
@@ -27,13 +27,16 @@ class Window {
    * @param chemicalPotentialMax: largest value of chemical potential used
    * in the calculation.
    *
+   * @param verbose: if true, the window limits are printed to screen.
+   *
    * Note: temperatures and chemical potentials are used only if we are
    * using a filter on populations.
    */
   Window(Context &context, Particle &particle_, const double &temperatureMin =
   0., const double &temperatureMax = 0.,
          const double &chemicalPotentialMin = 0.,
-         const double &chemicalPotentialMax = 0.);
+         const double &chemicalPotentialMax = 0.,
+         const bool &verbose = true);
 
   /** public interface to use the window, used by activeBandStructure.
    * @param: energies: a list of energies, in absolute units. They should be
@@ -73,6 +76,18 @@ class Window {
    * Window::population, or Window::energy.
    */
   int getMethodUsed() const;
+
+  /** Checks whether a state passes the window of a single calculation, i.e.
+   * at a single temperature and chemical potential. The window applied by
+   * apply() is the union of these windows over the range of temperatures
+   * and chemical potentials.
+   * @param stateEnergy: energy of the state.
+   * @param temperature: temperature of the calculation.
+   * @param chemicalPotential: chemical potential of the calculation.
+   * @return true if the state is kept by the window of this calculation.
+   */
+  bool isInWindow(const double &stateEnergy, const double &temperature,
+                  const double &chemicalPotential) const;
  private:
   /** particle stores whether we are working with electrons or phonons
    */
@@ -83,6 +98,8 @@ class Window {
   double chemicalPotentialMin, chemicalPotentialMax;
   double populationThreshold = 0.;
   double minEnergy = 0., maxEnergy = 0.;
+  // half widths of the muCenteredEnergy window
+  double muWindowBelow = 0., muWindowAbove = 0.;
 
   /** variable for selecting the window type
    */
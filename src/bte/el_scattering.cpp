@@ -1,10 +1,17 @@
 #include "el_scattering.h"
 
+#include "active_bandstructure.h"
 #include "constants.h"
+#include "elph_coupling_file_cache.h"
 #include "helper_el_scattering.h"
 #include "io.h"
 #include "mpiHelper.h"
 #include "periodic_table.h"
+#include <fstream>
+#include <iomanip>
+#include <nlohmann/json.hpp>
+#include <numeric>
+#include <unordered_map>
 
 ElScatteringMatrix::ElScatteringMatrix(Context &context_,
                                        StatisticsSweep &statisticsSweep_,
@@ -26,6 +33,209 @@ ElScatteringMatrix::ElScatteringMatrix(Context &context_,
 
   isMatrixOmega = true;
   highMemory = context.getScatteringMatrixInMemory();
+  doPhElLinewidths = context.getCoupledPhElLinewidths();
+  useElPhLittleGroup = context.getUseElPhLittleGroup();
+}
+
+std::vector<std::vector<int>>
+ElScatteringMatrix::getK2Orbits(const Eigen::Vector3d &k1C,
+                                const std::vector<int> &ik2Indexes,
+                                Points &innerPoints) {
+  auto nk2 = int(ik2Indexes.size());
+  std::vector<std::vector<int>> orbits;
+  if (!useElPhLittleGroup) {
+    orbits.resize(nk2);
+    for (int ik2Pos = 0; ik2Pos < nk2; ik2Pos++) {
+      orbits[ik2Pos].push_back(ik2Pos);
+    }
+    return orbits;
+  }
+
+  // find the little group of k1, i.e. the rotations such that R k1 = k1 + G
+  Eigen::Vector3d k1Crystal = innerPoints.cartesianToCrystal(k1C);
+  std::vector<Eigen::Matrix3d> littleGroup;
+  for (const SymmetryOperation &symmetry :
+       innerPoints.getCrystal().getSymmetryOperations()) {
+    Eigen::Vector3d diff = symmetry.rotation * k1Crystal - k1Crystal;
+    double x = 0.;
+    for (int i : {0, 1, 2}) {
+      x += std::abs(diff(i) - std::round(diff(i)));
+    }
+    if (x < 1.0e-5) {
+      littleGroup.push_back(symmetry.rotation);
+    }
+  }
+
+  // position of each wavevector in the list ik2Indexes
+  std::unordered_map<int, int> positions;
+  for (int ik2Pos = 0; ik2Pos < nk2; ik2Pos++) {
+    positions[ik2Indexes[ik2Pos]] = ik2Pos;
+  }
+
+  // the orbit of k2 groups the points R k2 of the list, with R in the little
+  // group. Since the coupling is symmetrized over degenerate states, it's
+  // the same for all points of the orbit.
+  std::vector<bool> isAssigned(nk2, false);
+  for (int ik2Pos = 0; ik2Pos < nk2; ik2Pos++) {
+    if (isAssigned[ik2Pos]) continue;
+    std::vector<int> orbit = {ik2Pos};
+    isAssigned[ik2Pos] = true;
+    WavevectorIndex ik2Idx(ik2Indexes[ik2Pos]);
+    int nb2 = innerBandStructure.getNumBands(ik2Idx);
+    Eigen::Vector3d k2Crystal =
+        innerPoints.cartesianToCrystal(innerBandStructure.getWavevector(ik2Idx));
+    for (const Eigen::Matrix3d &rotation : littleGroup) {
+      int ik2Rot = innerPoints.isPointStored(rotation * k2Crystal);
+      if (ik2Rot < 0) continue;
+      auto search = positions.find(ik2Rot);
+      if (search == positions.end() || isAssigned[search->second]) continue;
+      WavevectorIndex ik2RotIdx(ik2Rot);
+      if (innerBandStructure.getNumBands(ik2RotIdx) != nb2) continue;
+      orbit.push_back(search->second);
+      isAssigned[search->second] = true;
+    }
+    orbits.push_back(orbit);
+  }
+  return orbits;
+}
+
+/** Prescreens the bands at k2 with the energy conservation, before computing
+ * the el-ph couplings of a pair (k1,k2).
+ * The smearings of the builder are evaluated at en1-en2+en3 and en1-en2-en3,
+ * with phonon energies en3 between 0 and maxPhononEnergy, so that a pair of
+ * bands (ib1,ib2) can only scatter if the smearing is nonzero at the
+ * smallest of these mismatches. Bands degenerate with an active band are
+ * also kept, so that symmetrizeCoupling() averages over full degenerate
+ * groups. Only implemented for the gaussian smearing schemes.
+ * @return the list of active bands at k2, in increasing order.
+ */
+std::vector<int> prescreenBands2(DeltaFunction *smearing,
+                                 const Eigen::VectorXd &energies1,
+                                 const Eigen::MatrixXd &v1s,
+                                 const Eigen::VectorXd &energies2,
+                                 const Eigen::MatrixXd &v2s,
+                                 const double &maxPhononEnergy) {
+  auto nb1 = int(energies1.size());
+  auto nb2 = int(energies2.size());
+  bool isGaussian = smearing->getType() == DeltaFunction::gaussian;
+
+  std::vector<bool> hasPairs(nb2, false);
+  for (int ib2 = 0; ib2 < nb2; ib2++) {
+    for (int ib1 = 0; ib1 < nb1; ib1++) {
+      double mismatch = std::max(
+          0., std::abs(energies1(ib1) - energies2(ib2)) - maxPhononEnergy);
+      double delta;
+      if (isGaussian) {
+        delta = smearing->getSmearing(mismatch);
+      } else {
+        Eigen::Vector3d v = v1s.row(ib1) - v2s.row(ib2);
+        delta = smearing->getSmearing(mismatch, v);
+      }
+      if (delta > 0.) {
+        hasPairs[ib2] = true;
+        break;
+      }
+    }
+  }
+
+  // extend to the degenerate groups, defined as in symmetrizeCoupling()
+  std::vector<int> activeBands2;
+  for (int ib2 = 0; ib2 < nb2; ib2++) {
+    int degDegree = 0;
+    bool isActive = false;
+    for (int i = ib2; i < nb2; i++) {
+      if (std::abs(energies2(ib2) - energies2(i)) < 1.0e-6) {
+        degDegree++;
+        isActive = isActive || hasPairs[i];
+      } else {
+        break;
+      }
+    }
+    if (isActive) {
+      for (int i = 0; i < degDegree; i++) {
+        activeBands2.push_back(ib2 + i);
+      }
+    }
+    ib2 += degDegree - 1;
+  }
+  return activeBands2;
+}
+
+/** Reduces the el-ph coupling of the single bands to the Kramers pairs (see
+ * ActiveBandStructure::buildKramersPairs()): |g|^2 is summed over the two
+ * bands of the final state at k2 and averaged over those of the initial state
+ * at k1, i.e. a coupling (2*nb1, 2*nb2, nb3) becomes (nb1, nb2, nb3).
+ */
+void reduceKramersPairs(Eigen::Tensor<double, 3> &coupling) {
+  auto nb1 = int(coupling.dimension(0) / 2);
+  auto nb2 = int(coupling.dimension(1) / 2);
+  auto nb3 = int(coupling.dimension(2));
+  Eigen::Tensor<double, 3> pairCoupling(nb1, nb2, nb3);
+  for (int ib3 = 0; ib3 < nb3; ib3++) {
+    for (int ib2 = 0; ib2 < nb2; ib2++) {
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        pairCoupling(ib1, ib2, ib3) =
+            0.5 * (coupling(2 * ib1, 2 * ib2, ib3) +
+                   coupling(2 * ib1, 2 * ib2 + 1, ib3) +
+                   coupling(2 * ib1 + 1, 2 * ib2, ib3) +
+                   coupling(2 * ib1 + 1, 2 * ib2 + 1, ib3));
+      }
+    }
+  }
+  coupling = pairCoupling;
+}
+
+uint64_t ElScatteringMatrix::getCouplingCacheHash() {
+  // FNV-1a hash, as in getScatteringMatrixFileName()
+  uint64_t hash = 14695981039346656037ULL;
+  auto addToHash = [&hash](const void *x, const size_t &numBytes) {
+    auto bytes = static_cast<const unsigned char *>(x);
+    for (size_t i = 0; i < numBytes; i++) {
+      hash ^= uint64_t(bytes[i]);
+      hash *= 1099511628211ULL;
+    }
+  };
+  auto addString = [&addToHash](const std::string &x) {
+    addToHash(x.data(), x.size());
+  };
+  auto addInt = [&addToHash](const int &x) { addToHash(&x, sizeof(int)); };
+  auto addDouble = [&addToHash](const double &x) {
+    addToHash(&x, sizeof(double));
+  };
+
+  // the interpolation of the coupling
+  addString(context.getElphFileName());
+  addString(context.getPhFC2FileName());
+  addDouble(context.getElPhTruncationThreshold());
+  addInt(int(context.getElPhSinglePrecision()));
+  addInt(int(context.getEigenvectorsSinglePrecision()));
+
+  // the smearing selects the pairs of states (see prescreenBands2()), and
+  // the symmetries the pairs of wavevectors
+  addInt(context.getSmearingMethod());
+  addDouble(context.getSmearingWidth());
+  addInt(int(context.getUseSymmetries()));
+  addInt(int(context.getUseKramersPairs()));
+  addInt(int(useElPhLittleGroup));
+
+  // the Bloch states in the window
+  auto addStates = [&](BaseBandStructure &bandStructure) {
+    addInt(bandStructure.getNumPoints(true));
+    addInt(bandStructure.getNumStates());
+    for (int is = 0; is < bandStructure.getNumStates(); is++) {
+      StateIndex isIdx(is);
+      addDouble(bandStructure.getEnergy(isIdx));
+      Eigen::Vector3d k = bandStructure.getWavevector(isIdx);
+      for (int i : {0, 1, 2}) {
+        addDouble(k(i));
+      }
+    }
+  };
+  addStates(outerBandStructure);
+  if (&innerBandStructure != &outerBandStructure) {
+    addStates(innerBandStructure);
+  }
+  return hash;
 }
 
 // 3 cases:
@@ -41,11 +251,11 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
   Kokkos::Profiling::pushRegion("ElScatteringMatrix::builder");
 
   int switchCase = 0;
-  if (theMatrix.rows() != 0 && linewidth != nullptr && inPopulations.empty() && outPopulations.empty()) {
+  if (getNumStoredRows() != 0 && linewidth != nullptr && inPopulations.empty() && outPopulations.empty()) {
     switchCase = 0;
-  } else if (theMatrix.rows() == 0 && linewidth == nullptr && !inPopulations.empty() && !outPopulations.empty()) {
+  } else if (getNumStoredRows() == 0 && linewidth == nullptr && !inPopulations.empty() && !outPopulations.empty()) {
     switchCase = 1;
-  } else if (theMatrix.rows() == 0 && linewidth != nullptr && inPopulations.empty() && outPopulations.empty()) {
+  } else if (getNumStoredRows() == 0 && linewidth != nullptr && inPopulations.empty() && outPopulations.empty()) {
     switchCase = 2;
   } else {
     Error("builder3Ph found a non-supported case");
@@ -59,77 +269,210 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
 
   int numCalculations = statisticsSweep.getNumCalculations();
 
+  // calculations that the solver doesn't need in the matrix-vector product
+  std::vector<bool> isSkippedCalc = getSkippedCalculations(switchCase);
+
+  // the band structure window covers all (T,mu) calculations at once.
+  // Two states both outside the window of a calculation have negligible
+  // populations there, and their off-diagonal coupling is skipped for it.
+  // Linewidths are always computed.
+  std::vector<std::vector<bool>> outerWindowMask =
+      getCalcWindowMask(outerBandStructure);
+  std::vector<std::vector<bool>> innerWindowMask =
+      (&innerBandStructure == &outerBandStructure)
+          ? outerWindowMask : getCalcWindowMask(innerBandStructure);
+
   // note: innerNumFullPoints is the number of points in the full grid
   // may be larger than innerNumPoints, when we use ActiveBandStructure
   double norm = 1. / context.getKMesh().prod();
 
-  // precompute Fermi-Dirac populations
-  auto numOuterIrrStates = int(outerBandStructure.irrStateIterator().size());
-  Eigen::MatrixXd outerFermi(numCalculations, numOuterIrrStates);
-  outerFermi.setZero();
-  std::vector<size_t> iBtes = mpi->divideWorkIter(numOuterIrrStates);
-  int niBtes = iBtes.size();
-#pragma omp parallel for default(none)                                \
-    shared(mpi, outerBandStructure, numCalculations, statisticsSweep, \
-           particle, outerFermi, numOuterIrrStates, niBtes, iBtes)
-  for (int iiBte = 0; iiBte < niBtes; iiBte++) {
-    int iBte = iBtes[iiBte];
-    BteIndex iBteIdx = BteIndex(iBte);
-    StateIndex isIdx = outerBandStructure.bteToState(iBteIdx);
-    double energy = outerBandStructure.getEnergy(isIdx);
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-      double temp = calcStat.temperature;
-      double chemPot = calcStat.chemicalPotential;
-      outerFermi(iCalc, iBte) = particle.getPopulation(energy, temp, chemPot);
-    }
-  }
-  mpi->allReduceSum(&outerFermi);
-
-  auto numInnerIrrStates = int(innerBandStructure.irrStateIterator().size());
-  Eigen::MatrixXd innerFermi(numCalculations, numInnerIrrStates);
-  innerFermi.setZero();
-  iBtes = mpi->divideWorkIter(numInnerIrrStates);
-  niBtes = iBtes.size();
-#pragma omp parallel for default(none)                                  \
-    shared(numInnerIrrStates, mpi, innerBandStructure, statisticsSweep, \
-           particle, innerFermi, numCalculations, niBtes, iBtes)
-  for (int iiBte = 0; iiBte < niBtes; iiBte++) {
-    int iBte = iBtes[iiBte];
-    BteIndex iBteIdx = BteIndex(iBte);
-    StateIndex isIdx = innerBandStructure.bteToState(iBteIdx);
-    double energy = innerBandStructure.getEnergy(isIdx);
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-      double temp = calcStat.temperature;
-      double chemPot = calcStat.chemicalPotential;
-      innerFermi(iCalc, iBte) = particle.getPopulation(energy, temp, chemPot);
-    }
-  }
-  mpi->allReduceSum(&innerFermi);
+  // flat copies of the band structures, read in the loops below
+  BandStructureArrays outerArrays(outerBandStructure);
+  // the inner velocities are only needed by the adaptive smearing
+  BandStructureArrays innerArrays(
+      innerBandStructure,
+      smearing->getType() == DeltaFunction::adaptiveGaussian);
 
-  if (smearing->getType() == DeltaFunction::tetrahedron) {
-    Error("Tetrahedron method not supported by electron scattering. It will not work properly with a\n"
-          "filtering window, and we will almost always need to use this for electrons.");
-    // that's because it doesn't work with the window the way it's implemented,
-    // and we will almost always have a window for electrons
-  }
+  // precompute Fermi-Dirac populations
+  Eigen::MatrixXd outerFermi = statisticsSweep.getIrrPopulations(outerBandStructure);
+  Eigen::MatrixXd innerFermi = statisticsSweep.getIrrPopulations(innerBandStructure);
 
   bool rowMajor = true;
   std::vector<std::tuple<std::vector<int>, int>> kPairIterator =
       getIteratorWavevectorPairs(switchCase, rowMajor);
+  // with useTimeReversal, the pairs (-k1,-k2) are done with the pairs (k1,k2)
+  pairTimeReversal(kPairIterator, rowMajor, switchCase);
 
   HelperElScattering pointHelper(innerBandStructure, outerBandStructure,
-                                 statisticsSweep, smearing->getType(), h0, couplingElPhWan);
+                                 statisticsSweep, smearing->getType(), h0);
+
+  // adds the rates of the states (iBte1,iBte2) to the matrix-vector product,
+  // rotating the populations of the irreducible state iBte2
+  auto addToProduct = [&](const int &iCalc, const int &iBte1, const int &iBte2,
+                          const Eigen::Matrix3d &rotationInv,
+                          const bool &isOffDiagonal, const double &rate,
+                          const double &rateOffDiagonal) {
+    for (unsigned int iVec = 0; iVec < inPopulations.size(); iVec++) {
+      Eigen::Vector3d inPopRot;
+      inPopRot.setZero();
+      for (int i : {0, 1, 2}) {
+        for (int j : {0, 1, 2}) {
+          inPopRot(i) +=
+              rotationInv(i, j) * inPopulations[iVec](iCalc, j, iBte2);
+        }
+      }
+      for (int i : {0, 1, 2}) {
+        if (isOffDiagonal) {
+          outPopulations[iVec](iCalc, i, iBte1) +=
+              rateOffDiagonal * inPopRot(i);
+        }
+        outPopulations[iVec](iCalc, i, iBte1) +=
+            rate * inPopulations[iVec](iCalc, i, iBte1);
+      }
+    }
+  };
 
   bool withSymmetries = context.getUseSymmetries();
 
   double phononCutoff = 5. / ryToCmm1;// used to discard small phonon energies
 
+  auto numPairs = int(kPairIterator.size());
+
+  // if we are restarting, skip the k-points already done
+  int numPairsDone = loadBuilderCheckpoint(switchCase, numPairs, linewidth);
+
+  // the ph-el linewidths are accumulated when each pair of wavevectors is
+  // visited only once, i.e. when the pairs are divided by k1 points
+  bool doPhEl = doPhElLinewidths && (switchCase == 2 || (switchCase == 0 && isSparse));
+  if (doPhElLinewidths && switchCase == 0 && !isSparse) {
+    Warning("coupledPhElLinewidths is not available with the dense scattering"
+            " matrix in memory,\nthe ph-el linewidths are not computed.");
+  }
+  if (doPhEl && numPairsDone > 0) {
+    Warning("The ph-el linewidths can't be restarted from a checkpoint,\n"
+            "and are not computed.");
+    doPhEl = false;
+  }
+  int numPhBands = h0.getNumBands();
+  Points qPoints(innerBandStructure.getPoints().getCrystal(),
+                 context.getKMesh());
+  if (doPhEl) {
+    phElLinewidths =
+        Eigen::MatrixXd::Zero(numCalculations, qPoints.getNumPoints() * numPhBands);
+  }
+
+  Points innerPoints = innerBandStructure.getPoints();
+
+  // the irreducible point and rotation of each k2 don't depend on k1,
+  // so we tabulate them once instead of searching them at every pair
+  int numInnerPoints = innerBandStructure.getNumPoints();
+  std::vector<int> ik2IrrTable(numInnerPoints);
+  std::vector<Eigen::Matrix3d> rotationInvTable(numInnerPoints);
+#pragma omp parallel for
+  for (int ik2 = 0; ik2 < numInnerPoints; ik2++) {
+    auto t3 = innerPoints.getRotationIndexToIrreducible(ik2);
+    ik2IrrTable[ik2] = std::get<0>(t3);
+    rotationInvTable[ik2] = innerPoints.getRotationMatrix(
+        std::get<1>(t3), Points::cartesianCoordinates);
+  }
+
+  // with the gaussian smearing schemes, the k2 points, and the bands at k2,
+  // are prescreened with the energy conservation before computing the
+  // couplings (see prescreenBands2()). Not done with the tetrahedron method,
+  // whose smearing depends on the state at k2 and on k1
+  bool prescreenPairs =
+      smearing->getType() == DeltaFunction::gaussian ||
+      smearing->getType() == DeltaFunction::adaptiveGaussian;
+
+  // with Kramers pairs, each state is a pair of degenerate bands, whose
+  // eigenvectors are the columns (2*ib, 2*ib+1) of getEigenvectors(). The
+  // couplings are computed on the bands, and then reduced to the pairs
+  auto activeOuter = dynamic_cast<ActiveBandStructure *>(&outerBandStructure);
+  bool isKramers = activeOuter != nullptr && activeOuter->hasKramersPairs();
+  int pairSize = isKramers ? 2 : 1;
+
+  // with partnerSamplingFraction < 1, the k2 points are sampled at random,
+  // with the likelihood that |en1 - en2| is within the phonon energies,
+  // up to the smearing (see samplePartners())
+  bool isSampling = isPartnerSampling(switchCase);
+
+  // the largest phonon energy, on the mesh of the ph-el linewidths
+  double maxPhononEnergy = 0.;
+  if (prescreenPairs || isSampling) {
+    for (int iq : mpi->divideWorkIter(qPoints.getNumPoints())) {
+      Eigen::Vector3d q3C =
+          qPoints.getPointCoordinates(iq, Points::cartesianCoordinates);
+      auto t = h0.diagonalizeFromCoordinates(q3C);
+      maxPhononEnergy = std::max(maxPhononEnergy, std::get<0>(t).maxCoeff());
+    }
+    mpi->allReduceMax(&maxPhononEnergy);
+  }
+  // q3 = k2 - k1 may not be on that mesh (e.g. for k1 on a path), and the
+  // phonon energies may be slightly larger there
+  double prescreenPhononEnergy = 1.1 * maxPhononEnergy;
+
+  std::vector<std::vector<double>> pairWeights;
+  if (isSampling) {
+    bool isAdaptive = smearing->getType() == DeltaFunction::adaptiveGaussian;
+    pairWeights = samplePartners(
+        kPairIterator, [&](const int &ik1, const int &ik2) {
+          Eigen::VectorXd energies1 = outerArrays.getEnergies(ik1);
+          Eigen::VectorXd energies2 = innerArrays.getEnergies(ik2);
+          Eigen::MatrixXd v1s = outerArrays.getGroupVelocities(ik1);
+          Eigen::MatrixXd v2s = innerArrays.getGroupVelocities(ik2);
+          auto nb1 = int(energies1.size());
+          auto nb2 = int(energies2.size());
+          Eigen::VectorXd mismatches(nb1 * nb2);
+          Eigen::MatrixXd velocities(isAdaptive ? nb1 * nb2 : 0, 3);
+          for (int ib1 = 0; ib1 < nb1; ib1++) {
+            for (int ib2 = 0; ib2 < nb2; ib2++) {
+              int i = ib1 * nb2 + ib2;
+              mismatches(i) = std::max(
+                  0., std::abs(energies1(ib1) - energies2(ib2)) -
+                          maxPhononEnergy);
+              if (isAdaptive) {
+                velocities.row(i) = v1s.row(ib1) - v2s.row(ib2);
+              }
+            }
+          }
+          return getPairLikelihood(mismatches, velocities);
+        });
+    linewidthVariance =
+        std::make_shared<VectorBTE>(statisticsSweep, outerBandStructure, 1);
+    linewidthVariance->setConst(0.);
+  }
+
+  // in a dry run, only the first few pairs are done, to time the loop
+  int lastPair = getLastBuilderPair(numPairsDone, numPairs);
+
+  // the couplings may be read from the files of a previous build, or
+  // written for the next ones, which must then do all the pairs.
+  // The sampled partners change at every build
+  std::unique_ptr<ElPhCouplingFileCache> couplingFileCache;
+  if (!context.getElPhCouplingCachePrefix().empty()) {
+    if (isSampling) {
+      Warning("The el-ph couplings of sampled partners are not cached.");
+    } else {
+      couplingFileCache = std::make_unique<ElPhCouplingFileCache>(
+          context, getCouplingCacheHash(), kPairIterator,
+          numPairsDone == 0 && lastPair == numPairs);
+    }
+  }
+  bool readCouplings =
+      couplingFileCache != nullptr && couplingFileCache->isReading();
+  bool writeCouplings =
+      couplingFileCache != nullptr && couplingFileCache->isWriting();
+  auto loopStartTime = std::chrono::steady_clock::now();
   LoopPrint loopPrint("computing scattering matrix", "k-points",
-                      int(kPairIterator.size()));
+                      lastPair - numPairsDone,
+                      context.getProgressHeartbeatInterval());
 
-  for (auto t1 : kPairIterator) {
+  for (int iPair = numPairsDone; iPair < lastPair; iPair++) {
+    // periodically save the partial results
+    if (iPair != numPairsDone) {
+      saveBuilderCheckpoint(switchCase, iPair, numPairs, linewidth);
+    }
+    auto t1 = kPairIterator[iPair];
     loopPrint.update();
     auto ik2Indexes = std::get<0>(t1);
     int ik1 = std::get<1>(t1);
@@ -142,6 +485,9 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
     // process has 7 k-points, the 2nd MPI process has 6. This block makes
     // the 2nd process call calcCouplingSquared 7 times as well.
     if (ik1 == -1) {
+      if (readCouplings) {
+        continue;
+      }
       Eigen::Vector3d k1C = Eigen::Vector3d::Zero();
       int numWannier = couplingElPhWan->getCouplingDimensions()(4);
       Eigen::MatrixXcd eigenVector1 = Eigen::MatrixXcd::Zero(numWannier, 1);
@@ -152,28 +498,132 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
       continue;
     }
 
-    Eigen::Vector3d k1C = outerBandStructure.getWavevector(ik1Idx);
-    Eigen::VectorXd state1Energies = outerBandStructure.getEnergies(ik1Idx);
+    Eigen::Vector3d k1C = outerArrays.getWavevector(ik1);
+    Eigen::VectorXd state1Energies = outerArrays.getEnergies(ik1);
     auto nb1 = int(state1Energies.size());
-    Eigen::MatrixXd v1s = outerBandStructure.getGroupVelocities(ik1Idx);
+    Eigen::MatrixXd v1s = outerArrays.getGroupVelocities(ik1);
     Eigen::MatrixXcd eigenVector1 = outerBandStructure.getEigenvectors(ik1Idx);
+    auto degGroups1 = outerBandStructure.getDegenerateGroups(ik1Idx);
 
-    couplingElPhWan->cacheElPh(eigenVector1, k1C);
+    // with the couplings read from disk, none of the processes of a pool
+    // computes them
+    if (!readCouplings) {
+      couplingElPhWan->cacheElPh(eigenVector1, k1C);
+    }
+
+    // the bands at k2 that can scatter with k1, and the k2 points with no
+    // such band, which are dropped (after cacheElPh, which must be called for
+    // every k1 on all the processes of a pool)
+    std::vector<std::vector<int>> activeBands2(ik2Indexes.size());
+#pragma omp parallel for
+    for (int ik2Pos = 0; ik2Pos < int(ik2Indexes.size()); ik2Pos++) {
+      int ik2 = ik2Indexes[ik2Pos];
+      if (prescreenPairs) {
+        activeBands2[ik2Pos] = prescreenBands2(
+            smearing, state1Energies, v1s, innerArrays.getEnergies(ik2),
+            innerArrays.getGroupVelocities(ik2), prescreenPhononEnergy);
+      } else {
+        WavevectorIndex ik2Idx(ik2);
+        activeBands2[ik2Pos].resize(innerBandStructure.getNumBands(ik2Idx));
+        std::iota(activeBands2[ik2Pos].begin(), activeBands2[ik2Pos].end(),
+                  0);
+      }
+    }
+    if (prescreenPairs) {
+      int numKept = 0;
+      for (int ik2Pos = 0; ik2Pos < int(ik2Indexes.size()); ik2Pos++) {
+        if (activeBands2[ik2Pos].empty()) continue;
+        ik2Indexes[numKept] = ik2Indexes[ik2Pos];
+        activeBands2[numKept] = std::move(activeBands2[ik2Pos]);
+        if (isSampling) {
+          pairWeights[iPair][numKept] = pairWeights[iPair][ik2Pos];
+        }
+        numKept++;
+      }
+      ik2Indexes.resize(numKept);
+      activeBands2.resize(numKept);
+      if (isSampling) {
+        pairWeights[iPair].resize(numKept);
+      }
+    }
+
+    // all the k2 partners may have been discarded by the sampling, or by
+    // the energy conservation
+    if (ik2Indexes.empty()) {
+      continue;
+    }
+    if (readCouplings) {
+      couplingFileCache->readPair(iPair);
+    }
 
     pointHelper.prepare(k1C, ik2Indexes);
 
+    // the states of -k1, which receive the rates of the time-reversed pairs
+    int ik1Reversed =
+        timeReversedOuterPoints.empty() ? -1 : timeReversedOuterPoints[ik1];
+    std::vector<int> is1sReversed, iBte1sReversed;
+    if (ik1Reversed >= 0) {
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        int is1 = outerBandStructure.getIndex(WavevectorIndex(ik1Reversed),
+                                              BandIndex(ib1));
+        StateIndex is1Idx(is1);
+        is1sReversed.push_back(is1);
+        iBte1sReversed.push_back(outerBandStructure.stateToBte(is1Idx).get());
+      }
+    }
+
+    // the states of k1 (and -k1), whose linewidths are weighted by the
+    // sampled pairs
+    std::vector<int> iBte1s;
+    if (isSampling) {
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        StateIndex is1Idx(outerBandStructure.getIndex(ik1Idx, BandIndex(ib1)));
+        iBte1s.push_back(outerBandStructure.stateToBte(is1Idx).get());
+      }
+      if (ik1Reversed >= 0 && ik1Reversed != ik1) {
+        iBte1s.insert(iBte1s.end(), iBte1sReversed.begin(),
+                      iBte1sReversed.end());
+      }
+    }
+
+    // with symmetries, k1 is an irreducible point, and its contribution to
+    // the ph-el linewidths is weighted by the size of its star
+    double k1Weight = 1.;
+    if (withSymmetries) {
+      k1Weight = outerBandStructure.getPoints()
+                     .getReducibleStarFromIrreducible(ik1).size();
+    }
+
+    // the couplings are computed only at the first point of each orbit of
+    // k2 points, and reused for the others (see getK2Orbits)
+    std::vector<std::vector<int>> k2Orbits =
+        getK2Orbits(k1C, ik2Indexes, innerPoints);
+
     // prepare batches based on memory usage
-    auto nk2 = int(ik2Indexes.size());
-    int numBatches = couplingElPhWan->estimateNumBatches(nk2, nb1);
+    auto nk2 = int(k2Orbits.size());
+    int numBatches = couplingElPhWan->estimateNumBatches(nk2, pairSize * nb1);
 
     // loop over batches of q1s
     // later we will loop over the q1s inside each batch
     // this is done to optimize the usage and data transfer of a GPU
     for (int iBatch = 0; iBatch < numBatches; iBatch++) {
-      // start and end point for current batch
+      // start and end orbit for current batch
       int start = nk2 * iBatch / numBatches;
       int end = nk2 * (iBatch + 1) / numBatches;
-      int batch_size = end - start;
+      int numOrbits = end - start;
+
+      // list the k2 points of the orbits in the batch, with the index of
+      // their orbit, and the position of the first point of each orbit
+      std::vector<int> batchIk2s, batchOrbits, orbitStarts, batchPositions;
+      for (int iOrbit = start; iOrbit < end; iOrbit++) {
+        orbitStarts.push_back(int(batchIk2s.size()));
+        for (int ik2Pos : k2Orbits[iOrbit]) {
+          batchIk2s.push_back(ik2Indexes[ik2Pos]);
+          batchOrbits.push_back(iOrbit - start);
+          batchPositions.push_back(ik2Pos);
+        }
+      }
+      auto batch_size = int(batchIk2s.size());
 
       std::vector<Eigen::Vector3d> allQ3C(batch_size);
       std::vector<Eigen::VectorXd> allStates3Energies(batch_size);
@@ -181,9 +631,7 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
       std::vector<Eigen::MatrixXcd> allEigenVectors3(batch_size);
       std::vector<Eigen::MatrixXd> allV3s(batch_size);
       std::vector<Eigen::MatrixXd> allBose3Data(batch_size);
-      std::vector<Eigen::VectorXcd> allPolarData(batch_size);
 
-      std::vector<Eigen::Vector3d> allK2C(batch_size);
       std::vector<Eigen::MatrixXcd> allEigenVectors2(batch_size);
       std::vector<Eigen::VectorXd> allState2Energies(batch_size);
       std::vector<Eigen::MatrixXd> allV2s(batch_size);
@@ -191,13 +639,12 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
       Kokkos::Profiling::pushRegion("preprocessing loop");
       // do prep work for all values of q1 in current batch,
       // store stuff needed for couplings later
-#pragma omp parallel for default(none) shared(allNb3, allEigenVectors3, allV3s, allBose3Data, ik2Indexes, pointHelper, allQ3C, allStates3Energies, batch_size, start, allK2C, allState2Energies, allV2s, allEigenVectors2, k1C, allPolarData)
+#pragma omp parallel for default(none) shared(allNb3, allEigenVectors3, allV3s, allBose3Data, batchIk2s, pointHelper, allQ3C, allStates3Energies, batch_size, allState2Energies, allV2s, allEigenVectors2, k1C, innerArrays)
       for (int ik2Batch = 0; ik2Batch < batch_size; ik2Batch++) {
-        int ik2 = ik2Indexes[start + ik2Batch];
+        int ik2 = batchIk2s[ik2Batch];
         WavevectorIndex ik2Idx(ik2);
-        allK2C[ik2Batch] = innerBandStructure.getWavevector(ik2Idx);
-        allState2Energies[ik2Batch] = innerBandStructure.getEnergies(ik2Idx);
-        allV2s[ik2Batch] = innerBandStructure.getGroupVelocities(ik2Idx);
+        allState2Energies[ik2Batch] = innerArrays.getEnergies(ik2);
+        allV2s[ik2Batch] = innerArrays.getGroupVelocities(ik2);
         allEigenVectors2[ik2Batch] = innerBandStructure.getEigenvectors(ik2Idx);
         auto t2 = pointHelper.get(k1C, ik2);
         allQ3C[ik2Batch] = std::get<0>(t2);
@@ -206,36 +653,94 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
         allEigenVectors3[ik2Batch] = std::get<3>(t2);
         allV3s[ik2Batch] = std::get<4>(t2);
         allBose3Data[ik2Batch] = std::get<5>(t2);
-        allPolarData[ik2Batch] = std::get<6>(t2);
       }
       Kokkos::Profiling::popRegion();
 
-      couplingElPhWan->calcCouplingSquared(eigenVector1, allEigenVectors2,
-                                           allEigenVectors3, allQ3C, allPolarData);
+      // the eigenvectors are only needed at the first point of each orbit,
+      // and for the active bands at k2, which are the same for all the
+      // points of the orbit
+      std::vector<Eigen::MatrixXcd> orbitEigenVectors2(numOrbits);
+      std::vector<Eigen::MatrixXcd> orbitEigenVectors3(numOrbits);
+      std::vector<Eigen::Vector3d> orbitQ3C(numOrbits);
+      std::vector<std::vector<int>> orbitBands2(numOrbits);
+      for (int iOrbit = 0; iOrbit < numOrbits; iOrbit++) {
+        int ik2Batch = orbitStarts[iOrbit];
+        orbitBands2[iOrbit] = activeBands2[batchPositions[ik2Batch]];
+        auto numActive2 = int(orbitBands2[iOrbit].size());
+        if (pairSize * numActive2 < allEigenVectors2[ik2Batch].cols()) {
+          Eigen::MatrixXcd eigenVectors2(allEigenVectors2[ik2Batch].rows(),
+                                         pairSize * numActive2);
+          for (int i = 0; i < numActive2; i++) {
+            for (int a = 0; a < pairSize; a++) {
+              eigenVectors2.col(pairSize * i + a) =
+                  allEigenVectors2[ik2Batch].col(
+                      pairSize * orbitBands2[iOrbit][i] + a);
+            }
+          }
+          orbitEigenVectors2[iOrbit] = eigenVectors2;
+        } else {
+          orbitEigenVectors2[iOrbit] = std::move(allEigenVectors2[ik2Batch]);
+        }
+        orbitEigenVectors3[iOrbit] = std::move(allEigenVectors3[ik2Batch]);
+        orbitQ3C[iOrbit] = allQ3C[ik2Batch];
+      }
+
+      // the symmetrized couplings of the orbits, if read from disk
+      std::vector<Eigen::Tensor<double, 3>> cachedCouplings;
+      if (readCouplings) {
+        for (int iOrbit = 0; iOrbit < numOrbits; iOrbit++) {
+          cachedCouplings.push_back(couplingFileCache->getNextCoupling());
+        }
+      } else {
+        // with no polar data in input, the polar correction is computed on
+        // the device together with the short-range coupling
+        std::vector<Eigen::VectorXcd> polarData;
+        couplingElPhWan->calcCouplingSquared(eigenVector1, orbitEigenVectors2,
+                                             orbitEigenVectors3, orbitQ3C,
+                                             polarData);
 
-      Kokkos::Profiling::pushRegion("symmetrize coupling");
+        Kokkos::Profiling::pushRegion("symmetrize coupling");
 #pragma omp parallel for
-      for (int ik2Batch = 0; ik2Batch < batch_size; ik2Batch++) {
-        symmetrizeCoupling(
-            couplingElPhWan->getCouplingSquared(ik2Batch),
-            state1Energies, allState2Energies[ik2Batch], allStates3Energies[ik2Batch]
-        );
+        for (int iOrbit = 0; iOrbit < numOrbits; iOrbit++) {
+          int ik2Batch = orbitStarts[iOrbit];
+          auto numActive2 = int(orbitBands2[iOrbit].size());
+          Eigen::VectorXd energies2(numActive2);
+          for (int i = 0; i < numActive2; i++) {
+            energies2(i) = allState2Energies[ik2Batch](orbitBands2[iOrbit][i]);
+          }
+          if (isKramers) {
+            reduceKramersPairs(couplingElPhWan->getCouplingSquared(iOrbit));
+          }
+          symmetrizeCoupling(
+              couplingElPhWan->getCouplingSquared(iOrbit), degGroups1,
+              BaseBandStructure::findDegenerateGroups(energies2),
+              BaseBandStructure::findDegenerateGroups(
+                  allStates3Energies[ik2Batch]));
+        }
+        Kokkos::Profiling::popRegion();
+
+        if (writeCouplings) {
+          for (int iOrbit = 0; iOrbit < numOrbits; iOrbit++) {
+            couplingFileCache->addCoupling(
+                couplingElPhWan->getCouplingSquared(iOrbit));
+          }
+        }
       }
-      Kokkos::Profiling::popRegion();
 
       Kokkos::Profiling::pushRegion("postprocessing loop");
       // do postprocessing loop with batch of couplings
       for (int ik2Batch = 0; ik2Batch < batch_size; ik2Batch++) {
-        int ik2 = ik2Indexes[start + ik2Batch];
+        int ik2 = batchIk2s[ik2Batch];
 
         Eigen::Tensor<double, 3>& coupling =
-            couplingElPhWan->getCouplingSquared(ik2Batch);
+            readCouplings
+                ? cachedCouplings[batchOrbits[ik2Batch]]
+                : couplingElPhWan->getCouplingSquared(batchOrbits[ik2Batch]);
+        // the coupling is only computed for the active bands at k2
+        const std::vector<int> &bands2 = orbitBands2[batchOrbits[ik2Batch]];
 
-        Eigen::Vector3d k2C = allK2C[ik2Batch];
-        auto t3 = innerBandStructure.getRotationToIrreducible(
-            k2C, Points::cartesianCoordinates);
-        int ik2Irr = std::get<0>(t3);
-        Eigen::Matrix3d rotation = std::get<1>(t3);
+        int ik2Irr = ik2IrrTable[ik2];
+        const Eigen::Matrix3d &rotationInv = rotationInvTable[ik2];
 
         WavevectorIndex ik2Idx(ik2);
         WavevectorIndex ik2IrrIdx(ik2Irr);
@@ -247,9 +752,35 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
         Eigen::MatrixXd v3s = allV3s[ik2Batch];
         Eigen::VectorXd state3Energies = allStates3Energies[ik2Batch];
 
-        auto nb2 = int(state2Energies.size());
         auto nb3 = int(state3Energies.size());
 
+        int iq3 = -1;
+        if (doPhEl) {
+          iq3 = qPoints.getIndex(qPoints.cartesianToCrystal(allQ3C[ik2Batch]));
+        }
+
+        // the time-reversed pair (-k1,-k2) has the same rates
+        auto tReversed = getTimeReversedPair(ik1, ik2);
+        bool hasReversed = std::get<0>(tReversed) >= 0;
+        int ik2IrrReversed = -1;
+        Eigen::Matrix3d rotationInvReversed = Eigen::Matrix3d::Identity();
+        int iq3Reversed = -1;
+        if (hasReversed) {
+          ik2IrrReversed = ik2IrrTable[std::get<1>(tReversed)];
+          rotationInvReversed = rotationInvTable[std::get<1>(tReversed)];
+          if (doPhEl) {
+            iq3Reversed = qPoints.getIndex(
+                -qPoints.cartesianToCrystal(allQ3C[ik2Batch]));
+          }
+        }
+
+        double pairWeight = 1.;
+        Eigen::MatrixXd previousLinewidths;
+        if (isSampling) {
+          pairWeight = pairWeights[iPair][batchPositions[ik2Batch]];
+          previousLinewidths = getSampledStates(linewidth, iBte1s);
+        }
+
         Eigen::MatrixXd sinh3Data(nb3, numCalculations);
 #pragma omp parallel for collapse(2)
         for (int ib3 = 0; ib3 < nb3; ib3++) {
@@ -260,7 +791,8 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
           }
         }
 
-        for (int ib2 = 0; ib2 < nb2; ib2++) {
+        for (int jb2 = 0; jb2 < int(bands2.size()); jb2++) {
+          int ib2 = bands2[jb2];
           double en2 = state2Energies(ib2);
           int is2 = innerBandStructure.getIndex(ik2Idx, BandIndex(ib2));
           int is2Irr = innerBandStructure.getIndex(ik2IrrIdx, BandIndex(ib2));
@@ -269,6 +801,16 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
           BteIndex ind2Idx = innerBandStructure.stateToBte(is2IrrIdx);
           int iBte2 = ind2Idx.get();
 
+          int is2IrrReversed = -1;
+          int iBte2Reversed = -1;
+          if (hasReversed) {
+            is2IrrReversed = innerBandStructure.getIndex(
+                WavevectorIndex(ik2IrrReversed), BandIndex(ib2));
+            StateIndex is2IrrReversedIdx(is2IrrReversed);
+            iBte2Reversed =
+                innerBandStructure.stateToBte(is2IrrReversedIdx).get();
+          }
+
           for (int ib1 = 0; ib1 < nb1; ib1++) {
             double en1 = state1Energies(ib1);
             int is1 = outerBandStructure.getIndex(ik1Idx, BandIndex(ib1));
@@ -294,16 +836,41 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
                 delta1 = smearing->getSmearing(en1 - en2 + en3, smear);
                 delta2 = smearing->getSmearing(en1 - en2 - en3, smear);
               } else {
-                delta1 = smearing->getSmearing(en3 + en1, is2Idx);
-                delta2 = smearing->getSmearing(en3 - en1, is2Idx);
+                // the tetrahedra integrate over k2, i.e. they approximate
+                // delta(en2 - en1 - en3) and delta(en2 - en1 + en3).
+                // States outside the window don't contribute.
+                delta1 = smearing->getSmearing(en1 + en3, is2Idx);
+                delta2 = smearing->getSmearing(en1 - en3, is2Idx);
               }
 
               if (delta1 <= 0. && delta2 <= 0.) {
                 continue;
               }
 
+              // phonon absorption k1 + q3 -> k2 contributes to the ph-el
+              // linewidth of q3 (see PhElScatteringMatrix::builder).
+              // The phonon scatters with both bands of a Kramers pair
+              if (doPhEl && delta1 > 0. && ib3 < numPhBands) {
+                for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                  double fermi1 = outerFermi(iCalc, iBte1);
+                  double temp =
+                      statisticsSweep.getCalcStatistics(iCalc).temperature;
+                  double rate = coupling(ib1, jb2, ib3) * fermi1 *
+                                (1. - fermi1) * delta1 * norm / temp * pi *
+                                k1Weight * pairWeight * pairSize;
+                  phElLinewidths(iCalc, iq3 * numPhBands + ib3) += rate;
+                  if (hasReversed) {
+                    phElLinewidths(iCalc, iq3Reversed * numPhBands + ib3) +=
+                        rate;
+                  }
+                }
+              }
+
               // loop on temperature
               for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                if (isSkippedCalc[iCalc]) continue;
+                bool isCoupled = outerWindowMask[iCalc][iBte1] ||
+                                 innerWindowMask[iCalc][iBte2];
 
                 //double fermi1 = outerFermi(iCalc, iBte1);
                 double fermi2 = innerFermi(iCalc, iBte2);
@@ -313,13 +880,13 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
                 // Calculate transition probability W+
 
                 double rate =
-                    coupling(ib1, ib2, ib3)
+                    coupling(ib1, jb2, ib3)
                     * ((fermi2 + bose3) * delta1
                        + (1. - fermi2 + bose3) * delta2)
                     * norm / en3 * pi;
 
                 double rateOffDiagonal = -
-                      coupling(ib1, ib2, ib3) * bose3Symm * (delta1 + delta2)
+                      coupling(ib1, jb2, ib3) * bose3Symm * (delta1 + delta2)
                       * norm / en3 * pi;
 
                 // double rateOffDiagonal = -
@@ -336,56 +903,69 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
                       for (int j : {0, 1, 2}) {
                         CartIndex jIndex(j);
                         int iMat2 = getSMatrixIndex(ind2Idx, jIndex);
-                        if (theMatrix.indicesAreLocal(iMat1, iMat2)) {
+                        if (matrixElementIsLocal(iMat1, iMat2)) {
                           if (i == 0 && j == 0) {
                             linewidth->operator()(iCalc, 0, iBte1) += rate;
                           }
-                          if (is1 != is2Irr) {
-                            theMatrix(iMat1, iMat2) +=
-                                rotation.inverse()(i, j) * rateOffDiagonal;
+                          if (is1 != is2Irr && isCoupled) {
+                            addToMatrix(iMat1, iMat2,
+                                        rotationInv(i, j) * rateOffDiagonal);
                           }
                         }
                       }
                     }
                   } else {
-                    if (theMatrix.indicesAreLocal(iBte1, iBte2)) {
+                    if (matrixElementIsLocal(iBte1, iBte2)) {
                       linewidth->operator()(iCalc, 0, iBte1) += rate;
                     }
-                    theMatrix(iBte1, iBte2) += rateOffDiagonal;
+                    if (isCoupled) {
+                      addToMatrix(iBte1, iBte2, rateOffDiagonal);
+                    }
                   }
                 } else if (switchCase == 1) {
                   // case of matrix-vector multiplication
                   // we build the scattering matrix A = S*n(n+1)
-
-                  for (unsigned int iVec = 0; iVec < inPopulations.size();
-                       iVec++) {
-                    Eigen::Vector3d inPopRot;
-                    inPopRot.setZero();
-                    for (int i : {0, 1, 2}) {
-                      for (int j : {0, 1, 2}) {
-                        inPopRot(i) += rotation.inverse()(i, j) * inPopulations[iVec](iCalc, j, iBte2);
-                      }
-                    }
-                    for (int i : {0, 1, 2}) {
-                      if (is1 != is2Irr) {
-                        outPopulations[iVec](iCalc, i, iBte1) +=
-                            rateOffDiagonal * inPopRot(i);
-                      }
-                      outPopulations[iVec](iCalc, i, iBte1) +=
-                          rate * inPopulations[iVec](iCalc, i, iBte1);
-                    }
-                  }
+                  addToProduct(iCalc, iBte1, iBte2, rotationInv,
+                               is1 != is2Irr && isCoupled, rate,
+                               rateOffDiagonal);
                 } else {
                   // case of linewidth construction
                   linewidth->operator()(iCalc, 0, iBte1) += rate;
                 }
+
+                if (hasReversed) {
+                  int iBte1Reversed = iBte1sReversed[ib1];
+                  if (switchCase == 1) {
+                    bool isCoupledReversed =
+                        outerWindowMask[iCalc][iBte1Reversed] ||
+                        innerWindowMask[iCalc][iBte2Reversed];
+                    addToProduct(iCalc, iBte1Reversed, iBte2Reversed,
+                                 rotationInvReversed,
+                                 is1sReversed[ib1] != is2IrrReversed &&
+                                     isCoupledReversed,
+                                 rate, rateOffDiagonal);
+                  } else {
+                    linewidth->operator()(iCalc, 0, iBte1Reversed) += rate;
+                  }
+                }
               }
             }
           }
         }
+        if (isSampling) {
+          addSampledPair(linewidth, iBte1s, previousLinewidths, pairWeight);
+        }
       }
       Kokkos::Profiling::popRegion();
     }
+    if (writeCouplings) {
+      couplingFileCache->writePair(iPair);
+    }
+  }
+
+  loopPrint.endLocalWork();
+  if (couplingFileCache != nullptr) {
+    couplingFileCache->close();
   }
 
   if (switchCase == 1) {
@@ -395,13 +975,26 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
   } else {
     mpi->allReduceSum(&linewidth->data);
   }
+  if (isSampling) {
+    mpi->allReduceSum(&linewidthVariance->data);
+  }
+  if (doPhEl) {
+    mpi->allReduceSum(&phElLinewidths);
+  }
   // I prefer to close loopPrint after the MPI barrier: all MPI are synced here
   loopPrint.close();
+  recordBuilderSample(loopStartTime, numPairsDone, lastPair, numPairs);
+  if (switchCase != 1) {
+    removeBuilderCheckpoint();
+  }
 
   // Average over degenerate eigenstates.
   // we turn it off for now and leave the code if needed in the future
   if (switchCase == 2) {
     degeneracyAveragingLinewidths(linewidth);
+    if (isSampling) {
+      degeneracyAveragingLinewidths(linewidthVariance.get());
+    }
   }
 
   // Add boundary scattering
@@ -412,11 +1005,12 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
     int nis1s = is1s.size();
 #pragma omp parallel for default(none) shared(                            \
     outerBandStructure, numCalculations, statisticsSweep, boundaryLength, \
-    particle, outPopulations, inPopulations, linewidth, switchCase, nis1s, is1s)
+    particle, outPopulations, inPopulations, linewidth, switchCase, nis1s, is1s, \
+    outerArrays)
     for (int iis1 = 0; iis1 < nis1s; iis1++) {
       int is1 = is1s[iis1];
       StateIndex is1Idx(is1);
-      auto vel = outerBandStructure.getGroupVelocity(is1Idx);
+      Eigen::Vector3d vel = outerArrays.getGroupVelocity(is1);
       int iBte1 = outerBandStructure.stateToBte(is1Idx).get();
       double rate = sqrt(vel.squaredNorm()) / boundaryLength;
 
@@ -444,7 +1038,8 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
 
   // we place the linewidths back in the diagonal of the scattering matrix
   // this because we may need an MPI_allReduce on the linewidths
-  if (switchCase == 0) {// case of matrix construction
+  // (the sparse matrix doesn't store the diagonal, which is the linewidth)
+  if (switchCase == 0 && !isSparse) {// case of matrix construction
     int iCalc = 0;
     if (context.getUseSymmetries()) {
       // numStates is defined in scattering.cpp as # of irrStates
@@ -471,3 +1066,89 @@ void ElScatteringMatrix::builder(VectorBTE *linewidth,
   }
   Kokkos::Profiling::popRegion();
 }
+
+void ElScatteringMatrix::outputPhElToJSON(const std::string &outFileName) {
+  if (!mpi->mpiHead() || phElLinewidths.size() == 0) {
+    return;
+  }
+
+  // the linewidths are computed on all points of the mesh, but with
+  // symmetries the sum over k1 only runs on irreducible points: we average
+  // over the star of each irreducible q-point
+  Points qPoints(innerBandStructure.getPoints().getCrystal(),
+                 context.getKMesh());
+  if (context.getUseSymmetries()) {
+    qPoints.setIrreduciblePoints();
+  }
+  int numPhBands = h0.getNumBands();
+  double energyConversion = energyRyToEv * 1000;
+  double energyToTime = energyRyToFs / twoPi * 1e-3;
+
+  std::vector<std::vector<std::vector<double>>> outTimes;
+  std::vector<std::vector<std::vector<double>>> outLinewidths;
+  std::vector<std::vector<std::vector<double>>> energies;
+  std::vector<std::vector<double>> meshCoordinates;
+  std::vector<double> temps;
+  std::vector<double> chemPots;
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+    temps.push_back(calcStatistics.temperature * temperatureAuToSi);
+    chemPots.push_back(calcStatistics.chemicalPotential * energyRyToEv);
+    outTimes.emplace_back();
+    outLinewidths.emplace_back();
+    energies.emplace_back();
+  }
+
+  for (int iq : qPoints.irrPointsIterator()) {
+    Point point = qPoints.getPoint(iq);
+    auto t = h0.diagonalize(point);
+    Eigen::VectorXd phEnergies = std::get<0>(t);
+    auto coord = point.getCoordinates(Points::crystalCoordinates);
+    meshCoordinates.push_back({coord[0], coord[1], coord[2]});
+
+    std::vector<int> star = {iq};
+    if (context.getUseSymmetries()) {
+      star = qPoints.getReducibleStarFromIrreducible(iq);
+    }
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      std::vector<double> bandsT;
+      std::vector<double> bandsL;
+      std::vector<double> bandsE;
+      for (int ib = 0; ib < numPhBands; ib++) {
+        double linewidth = 0.;
+        for (int iqStar : star) {
+          linewidth += phElLinewidths(iCalc, iqStar * numPhBands + ib);
+        }
+        linewidth /= double(star.size());
+        bandsL.push_back(linewidth * energyConversion);
+        if (linewidth > 0.) {
+          bandsT.push_back(1. / linewidth * energyToTime);
+        } else {
+          bandsT.push_back(0.);
+        }
+        bandsE.push_back(phEnergies(ib) * energyConversion);
+      }
+      outTimes[iCalc].push_back(bandsT);
+      outLinewidths[iCalc].push_back(bandsL);
+      energies[iCalc].push_back(bandsE);
+    }
+  }
+
+  nlohmann::json output;
+  output["temperatures"] = temps;
+  output["temperatureUnit"] = "K";
+  output["chemicalPotentials"] = chemPots;
+  output["chemicalPotentialUnit"] = "eV";
+  output["linewidths"] = outLinewidths;
+  output["linewidthsUnit"] = "meV";
+  output["relaxationTimes"] = outTimes;
+  output["relaxationTimeUnit"] = "ps";
+  output["energies"] = energies;
+  output["energyUnit"] = "meV";
+  output["wavevectorCoordinates"] = meshCoordinates;
+  output["coordsType"] = "lattice";
+  output["particleType"] = "phonon";
+  std::ofstream o(outFileName);
+  o << std::setw(3) << output << std::endl;
+  o.close();
+}
@@ -45,6 +45,13 @@ public:
    */
 //  ElScatteringMatrix &operator=(const ElScatteringMatrix &that);
 
+  /** Writes to file the phonon-electron linewidths computed by the builder
+   * if coupledPhElLinewidths is true, on the irreducible points of the
+   * wavevector mesh of the electrons, in the same format of outputToJSON().
+   * @param outFileName: name of the json file.
+   */
+  void outputPhElToJSON(const std::string &outFileName);
+
 protected:
   InteractionElPhWan *couplingElPhWan;
   PhononH0 &h0;
@@ -52,6 +59,42 @@ protected:
   double boundaryLength;
   bool doBoundary;
 
+  // If true, the builder also computes the ph-el linewidths of the phonons
+  // at q3 = k2 - k1, reusing the el-ph couplings |g(k1,k2,q3)|^2 computed
+  // for the electron scattering rates, so that they are interpolated only
+  // once. The q3 wavevectors fall on the (full) kMesh, and the linewidths
+  // are stored as phElLinewidths(iCalc, iq3 * numPhBands + ib3).
+  bool doPhElLinewidths = false;
+  Eigen::MatrixXd phElLinewidths;
+
+  // If true, the couplings at fixed k1 are computed only for the k2 points
+  // that are irreducible under the little group of k1.
+  bool useElPhLittleGroup = false;
+
+  /** Groups the k2 wavevectors of the builder in orbits under the little
+   * group of k1, i.e. the symmetry rotations R such that R k1 = k1 + G.
+   * The el-ph coupling, symmetrized over degenerate states, is the same at
+   * all points R k2 of an orbit, and is computed only at its first point.
+   * If useElPhLittleGroup is false, each orbit contains a single point.
+   *
+   * @param k1C: cartesian coordinates of k1.
+   * @param ik2Indexes: indices of the k2 wavevectors.
+   * @param innerPoints: the points of the inner band structure.
+   * @return orbits: a list of orbits, each listing the positions of its
+   * points in ik2Indexes.
+   */
+  std::vector<std::vector<int>> getK2Orbits(const Eigen::Vector3d &k1C,
+                                            const std::vector<int> &ik2Indexes,
+                                            Points &innerPoints);
+
+  /** Hash of the inputs that determine the el-ph couplings computed by the
+   * builder, i.e. the input files, the Bloch states, and the parameters that
+   * select the pairs of states. It identifies the files of the coupling
+   * cache (see ElPhCouplingFileCache), together with the pairs of
+   * wavevectors of each MPI process.
+   */
+  uint64_t getCouplingCacheHash();
+
   /** Function with the detailed calculation of the scattering matrix.
    *
    * Note: this function is computing the symmetrized scattering matrix
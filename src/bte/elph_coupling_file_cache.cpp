@@ -0,0 +1,190 @@
+#include "elph_coupling_file_cache.h"
+#include "exceptions.h"
+#include "mpiHelper.h"
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+ElPhCouplingFileCache::ElPhCouplingFileCache(
+    Context &context, const uint64_t &inputsHash,
+    const std::vector<std::tuple<std::vector<int>, int>> &kPairIterator,
+    const bool &canWrite) {
+  std::string prefix = context.getElPhCouplingCachePrefix();
+  if (prefix.empty()) {
+    return;
+  }
+#ifndef HDF5_AVAIL
+  (void)inputsHash;
+  (void)kPairIterator;
+  (void)canWrite;
+  Error("Caching the el-ph couplings on disk requires Phoebe built with HDF5.");
+#else
+  // the pairs of this process, and how they are distributed, are added to
+  // the hash of the inputs (FNV-1a, stable across compilers and runs)
+  uint64_t hash = inputsHash;
+  auto addInt = [&hash](const int &x) {
+    auto bytes = reinterpret_cast<const unsigned char *>(&x);
+    for (size_t i = 0; i < sizeof(int); i++) {
+      hash ^= uint64_t(bytes[i]);
+      hash *= 1099511628211ULL;
+    }
+  };
+  addInt(mpi->getSize());
+  addInt(mpi->getSize(mpi->intraPoolComm));
+  addInt(int(kPairIterator.size()));
+  for (const auto &[ik2s, ik1] : kPairIterator) {
+    addInt(ik1);
+    addInt(int(ik2s.size()));
+    for (int ik2 : ik2s) {
+      addInt(ik2);
+    }
+  }
+  std::stringstream hashString;
+  hashString << std::hex << std::setw(16) << std::setfill('0') << hash;
+  fileName = prefix + ".elPhCoupling." + hashString.str() + ".rank" +
+             std::to_string(mpi->getRank()) + ".hdf5";
+
+  // the couplings are read only if all the processes find their file: the
+  // processes of a pool compute the couplings together
+  int found = 0;
+  {
+    std::ifstream tmpFile(fileName);
+    if (tmpFile.good()) {
+      found = 1;
+    }
+  }
+  mpi->allReduceMin(&found);
+  if (found == 1) {
+    try {
+      file = std::make_unique<HighFive::File>(fileName,
+                                              HighFive::File::ReadOnly);
+    } catch (std::exception &error) {
+      Error("Failed to open the el-ph coupling cache " + fileName +
+            ".\nRemove it to compute the couplings again.");
+    }
+    reading = true;
+    if (mpi->mpiHead()) {
+      std::cout << "Reading the el-ph couplings from the files with prefix "
+                << prefix << ".\n" << std::endl;
+    }
+    return;
+  }
+  if (!canWrite) {
+    return;
+  }
+  // the file is written with a temporary name, and renamed by close(), so
+  // that an incomplete file is never read
+  try {
+    file = std::make_unique<HighFive::File>(fileName + ".tmp",
+                                            HighFive::File::Overwrite);
+    writing = true;
+  } catch (std::exception &error) {
+    std::cout << "Warning: MPI process " << mpi->getRank()
+              << " failed to create the el-ph coupling cache " << fileName
+              << std::endl;
+  }
+#endif
+}
+
+ElPhCouplingFileCache::~ElPhCouplingFileCache() {
+#ifdef HDF5_AVAIL
+  file.reset();
+#endif
+  if (writing) {
+    std::remove((fileName + ".tmp").c_str());
+  }
+}
+
+bool ElPhCouplingFileCache::isReading() const { return reading; }
+
+bool ElPhCouplingFileCache::isWriting() const { return writing; }
+
+void ElPhCouplingFileCache::readPair(const int &iPair) {
+#ifdef HDF5_AVAIL
+  std::string name = std::to_string(iPair);
+  try {
+    file->getDataSet("/couplings" + name).read(values);
+    file->getDataSet("/dimensions" + name).read(dimensions);
+  } catch (std::exception &error) {
+    Error("The el-ph coupling cache " + fileName + " is not compatible with "
+          "the current run.\nRemove it to compute the couplings again.");
+  }
+  valuesOffset = 0;
+  dimensionsOffset = 0;
+#else
+  (void)iPair;
+#endif
+}
+
+Eigen::Tensor<double, 3> ElPhCouplingFileCache::getNextCoupling() {
+  if (dimensionsOffset + 3 > dimensions.size()) {
+    Error("The el-ph coupling cache " + fileName + " is not compatible with "
+          "the current run.\nRemove it to compute the couplings again.");
+  }
+  int nb1 = dimensions[dimensionsOffset];
+  int nb2 = dimensions[dimensionsOffset + 1];
+  int nb3 = dimensions[dimensionsOffset + 2];
+  dimensionsOffset += 3;
+  Eigen::Tensor<double, 3> coupling(nb1, nb2, nb3);
+  if (valuesOffset + coupling.size() > values.size()) {
+    Error("The el-ph coupling cache " + fileName + " is corrupted.\n"
+          "Remove it to compute the couplings again.");
+  }
+  std::copy(values.begin() + valuesOffset,
+            values.begin() + valuesOffset + coupling.size(), coupling.data());
+  valuesOffset += coupling.size();
+  return coupling;
+}
+
+void ElPhCouplingFileCache::addCoupling(
+    const Eigen::Tensor<double, 3> &coupling) {
+  if (!writing) {
+    return;
+  }
+  for (int i = 0; i < 3; i++) {
+    dimensions.push_back(int(coupling.dimension(i)));
+  }
+  values.insert(values.end(), coupling.data(),
+                coupling.data() + coupling.size());
+}
+
+void ElPhCouplingFileCache::writePair(const int &iPair) {
+  if (!writing) {
+    return;
+  }
+#ifdef HDF5_AVAIL
+  std::string name = std::to_string(iPair);
+  try {
+    HighFive::DataSet dValues = file->createDataSet<double>(
+        "/couplings" + name, HighFive::DataSpace::From(values));
+    dValues.write(values);
+    HighFive::DataSet dDimensions = file->createDataSet<int>(
+        "/dimensions" + name, HighFive::DataSpace::From(dimensions));
+    dDimensions.write(dimensions);
+  } catch (std::exception &error) {
+    // the run goes on, but the incomplete file is discarded
+    std::cout << "Warning: MPI process " << mpi->getRank()
+              << " failed to write the el-ph coupling cache " << fileName
+              << std::endl;
+    file.reset();
+    std::remove((fileName + ".tmp").c_str());
+    writing = false;
+  }
+#else
+  (void)iPair;
+#endif
+  values.clear();
+  dimensions.clear();
+}
+
+void ElPhCouplingFileCache::close() {
+#ifdef HDF5_AVAIL
+  file.reset();
+#endif
+  if (writing) {
+    std::rename((fileName + ".tmp").c_str(), fileName.c_str());
+    writing = false;
+  }
+  reading = false;
+}
@@ -0,0 +1,104 @@
+#ifndef ELPH_COUPLING_FILE_CACHE_H
+#define ELPH_COUPLING_FILE_CACHE_H
+
+#include "context.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <vector>
+
+#ifdef HDF5_AVAIL
+#include <highfive/H5Easy.hpp>
+#endif
+
+/** On-disk cache of the squared el-ph couplings |g(k1,k2,q3)|^2 in Bloch
+ * representation, as used by the electron scattering matrix builder (i.e.
+ * after the symmetrization over degenerate states).
+ *
+ * Each MPI process stores the couplings of its own pairs of wavevectors (the
+ * kPairIterator of the builder) in its own HDF5 file, with one dataset per
+ * k1 point, holding the couplings of the k2 points in the order in which the
+ * builder computes them. The name of the file contains a hash of the inputs
+ * that determine the couplings and of the pairs of the process, so that a
+ * run with different inputs, or a different distribution of the pairs over
+ * the processes, computes the couplings again.
+ *
+ * Usage: if isReading(), call readPair() at each k1 point of the iterator
+ * and getNextCoupling() for each k2 orbit. If isWriting(), call
+ * addCoupling() for each k2 orbit and writePair() at the end of each k1
+ * point, then close() at the end of the loop.
+ */
+class ElPhCouplingFileCache {
+ public:
+  /** Constructor, to be called by all MPI processes.
+   * @param context: sets the prefix of the files (elPhCouplingCachePrefix).
+   * If empty, the cache does nothing.
+   * @param inputsHash: hash of the inputs that determine the couplings.
+   * @param kPairIterator: the pairs of wavevectors of this MPI process.
+   * @param canWrite: if false, a missing cache isn't written, e.g. when the
+   * builder only does part of the pairs.
+   */
+  ElPhCouplingFileCache(
+      Context &context, const uint64_t &inputsHash,
+      const std::vector<std::tuple<std::vector<int>, int>> &kPairIterator,
+      const bool &canWrite);
+
+  /** Closes the file, discarding it if it's written and close() wasn't
+   * called.
+   */
+  ~ElPhCouplingFileCache();
+
+  /** True if the files of all processes were found, i.e. the couplings
+   * are read rather than computed.
+   */
+  bool isReading() const;
+
+  /** True if the couplings are computed and written to the cache.
+   */
+  bool isWriting() const;
+
+  /** Reads the couplings of a k1 point.
+   * @param iPair: index of the k1 point in the kPairIterator.
+   */
+  void readPair(const int &iPair);
+
+  /** Returns the next coupling (nb1, nb2, nb3) of the k1 point loaded by
+   * readPair().
+   */
+  Eigen::Tensor<double, 3> getNextCoupling();
+
+  /** Appends a coupling to the ones of the current k1 point. Does nothing
+   * if the cache isn't written, e.g. after an error in writing the file.
+   */
+  void addCoupling(const Eigen::Tensor<double, 3> &coupling);
+
+  /** Writes the couplings added since the last call.
+   * @param iPair: index of the k1 point in the kPairIterator.
+   */
+  void writePair(const int &iPair);
+
+  /** Closes the file. When writing, the file becomes available to later
+   * builds, so this must be called only after all the pairs were written.
+   */
+  void close();
+
+ private:
+  std::string fileName;
+  bool reading = false;
+  bool writing = false;
+
+  // couplings of the current k1 point, flattened, with the dimensions of
+  // each coupling
+  std::vector<double> values;
+  std::vector<int> dimensions;
+  size_t valuesOffset = 0;
+  size_t dimensionsOffset = 0;
+
+#ifdef HDF5_AVAIL
+  std::unique_ptr<HighFive::File> file;
+#endif
+};
+
+#endif
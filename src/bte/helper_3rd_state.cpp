@@ -2,6 +2,8 @@
 #include "constants.h"
 #include "delta_function.h"
 #include "mpiHelper.h"
+#include <algorithm>
+#include <cmath>
 #include <set>
 
 Helper3rdState::Helper3rdState(BaseBandStructure &innerBandStructure_,
@@ -26,6 +28,7 @@ Helper3rdState::Helper3rdState(BaseBandStructure &innerBandStructure_,
       innerBandStructure.hasWindow() == 0) {
     storedAllQ3 = true;
     storedAllQ3Case = storedAllQ3Case1;
+    points3 = std::make_unique<Points>(innerBandStructure.getPoints());
 
   } else if ((&innerBandStructure == &outerBandStructure) &&
              (offset.norm() == 0.) && innerBandStructure.hasWindow() != 0) {
@@ -115,53 +118,45 @@ Helper3rdState::Helper3rdState(BaseBandStructure &innerBandStructure_,
     bool withVelocities = true;
     bandStructure3 = std::make_unique<ActiveBandStructure>(
         activePoints3, h0, withEigenvectors, withVelocities);
+    points3 = std::make_unique<Points>(bandStructure3->getPoints());
   }
 }
 
-// auto [energies3Minus, nb3Minus, eigenVectors3Minus, v3Minus, bose3]
-/** This function receives in input the cartesian coordinates of a vector,
- * and returns the harmonic info for that vector.
+/** This function receives in input the q1 and q2 points, and returns the
+ * harmonic info for the vector q3 = q1 +- q2.
  * This is to be used for the third wavevector of the 3-phonon scattering.
  */
-std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
-           Eigen::MatrixXd, Eigen::MatrixXd>
-Helper3rdState::get(Point &point1, Point &point2, const int &thisCase) {
-  Eigen::Vector3d q3;
-  if (thisCase == casePlus) {
-    q3 = point1.getCoordinates(Points::cartesianCoordinates) +
-         point2.getCoordinates(Points::cartesianCoordinates);
-  } else {
-    q3 = point1.getCoordinates(Points::cartesianCoordinates) -
-         point2.getCoordinates(Points::cartesianCoordinates);
-  }
-
+void Helper3rdState::get(Point &point1, Point &point2, const int &thisCase,
+                         Eigen::VectorXd &energies3,
+                         Eigen::MatrixXcd &eigenVectors3, Eigen::MatrixXd &v3s,
+                         Eigen::MatrixXd &bose3Data) {
   if (storedAllQ3) {
     // if the meshes are the same (and gamma centered)
     // q3 will fall into the same grid, and it's easy to get
+    Eigen::Vector3d q3;
+    if (thisCase == casePlus) {
+      q3 = point1.getCoordinates(Points::cartesianCoordinates) +
+           point2.getCoordinates(Points::cartesianCoordinates);
+    } else {
+      q3 = point1.getCoordinates(Points::cartesianCoordinates) -
+           point2.getCoordinates(Points::cartesianCoordinates);
+    }
 
     // note: 3rdBandStructure might still be different from inner/outer bs.
     // so, we must use the points from 3rdBandStructure to get the values
-
-    int iq3;
-    int nb3;
-    Eigen::VectorXd energies3;
-    Eigen::MatrixXcd eigenVectors3;
-    Eigen::MatrixXd v3s;
-    Eigen::MatrixXd bose3Data;
+    Eigen::Vector3d crystalPoints = points3->cartesianToCrystal(q3);
+    int iq3 = points3->getIndex(crystalPoints);
+    auto iq3Index = WavevectorIndex(iq3);
 
     if (storedAllQ3Case == storedAllQ3Case1) { // we use innerBandStructure
-      auto points = innerBandStructure.getPoints();
-      Eigen::Vector3d crystalPoints = points.cartesianToCrystal(q3);
-      iq3 = points.getIndex(crystalPoints);
-      auto iq3Index = WavevectorIndex(iq3);
-      energies3 = innerBandStructure.getEnergies(iq3Index);
-      eigenVectors3 = innerBandStructure.getEigenvectors(iq3Index);
+      energies3 = innerBandStructure.getEnergiesView(iq3Index);
+      innerBandStructure.copyEigenvectors(iq3Index, eigenVectors3);
 
       if (smearingType == DeltaFunction::adaptiveGaussian) {
-        v3s = innerBandStructure.getGroupVelocities(iq3Index);
+        v3s = innerBandStructure.getGroupVelocitiesView(iq3Index);
       }
-      nb3 = int(energies3.size());
-      bose3Data = Eigen::MatrixXd(numCalculations, nb3);
+      int nb3 = int(energies3.size());
+      bose3Data.resize(numCalculations, nb3);
       for (int ib3 = 0; ib3 < nb3; ib3++) {
         int is3 =
             outerBandStructure.getIndex(WavevectorIndex(iq3), BandIndex(ib3));
@@ -171,17 +166,13 @@ Helper3rdState::get(Point &point1, Point &point2, const int &thisCase) {
         bose3Data.col(ib3) = outerBose.col(iBte3);
       }
     } else {
-      auto points = bandStructure3->getPoints();
-      Eigen::Vector3d crystalPoints = points.cartesianToCrystal(q3);
-      iq3 = points.getIndex(crystalPoints);
-      auto iq3Index = WavevectorIndex(iq3);
-      energies3 = bandStructure3->getEnergies(iq3Index);
-      eigenVectors3 = bandStructure3->getEigenvectors(iq3Index);
+      energies3 = bandStructure3->getEnergiesView(iq3Index);
+      bandStructure3->copyEigenvectors(iq3Index, eigenVectors3);
       if (smearingType == DeltaFunction::adaptiveGaussian) {
-        v3s = bandStructure3->getGroupVelocities(iq3Index);
+        v3s = bandStructure3->getGroupVelocitiesView(iq3Index);
       }
-      nb3 = int(energies3.size());
-      bose3Data = Eigen::MatrixXd(numCalculations, nb3);
+      int nb3 = int(energies3.size());
+      bose3Data.resize(numCalculations, nb3);
       for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
         auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
         double temp = calcStatistics.temperature;
@@ -193,126 +184,271 @@ Helper3rdState::get(Point &point1, Point &point2, const int &thisCase) {
       }
     }
 
-    return std::make_tuple(q3, energies3, nb3, eigenVectors3, v3s, bose3Data);
-
   } else {
     // otherwise, q3 doesn't fall into the same grid
     // and we must therefore compute it from the hamiltonian
 
-    int iq1 = point1.getIndex();
-
-    Eigen::VectorXd energies3;
-    Eigen::MatrixXcd eigenVectors3;
-    Eigen::MatrixXd v3s;
-    Eigen::MatrixXd bose3Data;
-
-    int iq1Counter = iq1 - cacheOffset;
+    int iq1Counter = point1.getIndex() - cache.offset;
 
     if (thisCase == casePlus) {
-      energies3 = cachePlusEnergies[iq1Counter];
-      eigenVectors3 = cachePlusEigenVectors[iq1Counter];
-      v3s = cachePlusVelocity[iq1Counter];
-      bose3Data = cachePlusBose[iq1Counter];
+      energies3 = cache.plusEnergies[iq1Counter];
+      eigenVectors3 = cache.plusEigenVectors[iq1Counter];
+      v3s = cache.plusVelocity[iq1Counter];
+      bose3Data = cache.plusBose[iq1Counter];
     } else {
-      energies3 = cacheMinusEnergies[iq1Counter];
-      eigenVectors3 = cacheMinusEigenVectors[iq1Counter];
-      v3s = cacheMinusVelocity[iq1Counter];
-      bose3Data = cacheMinusBose[iq1Counter];
+      energies3 = cache.minusEnergies[iq1Counter];
+      eigenVectors3 = cache.minusEigenVectors[iq1Counter];
+      v3s = cache.minusVelocity[iq1Counter];
+      bose3Data = cache.minusBose[iq1Counter];
     }
-
-    int nb3 = int(energies3.size());
-    return std::make_tuple(q3, energies3, nb3, eigenVectors3, v3s, bose3Data);
   }
 }
 
 void Helper3rdState::prepare(const std::vector<int> &q1Indexes,
                              const int &iq2) {
   if (!storedAllQ3) {
-    auto numPoints = int(q1Indexes.size());
-    cacheOffset = q1Indexes[0];
+    if (nextCache.valid() && nextIq2 == iq2 && nextQ1Indexes == q1Indexes) {
+      cache = nextCache.get();
+    } else {
+      if (nextCache.valid()) { // a prefetch for a different q2, discard it
+        nextCache.get();
+      }
+      cache = computeCache(q1Indexes, iq2, *h0, true);
+    }
+  }
+}
+
+void Helper3rdState::prefetch(const std::vector<int> &q1Indexes,
+                              const int &iq2) {
+  if (!storedAllQ3) {
+    if (nextCache.valid()) {
+      nextCache.get();
+    }
+    nextQ1Indexes = q1Indexes;
+    nextIq2 = iq2;
+    // the main thread keeps using h0 while the prefetch runs
+    if (prefetchH0 == nullptr) {
+      prefetchH0 = std::make_unique<PhononH0>(*h0);
+    }
+    nextCache = std::async(std::launch::async, [this, q1Indexes, iq2]() {
+      return computeCache(q1Indexes, iq2, *prefetchH0, false);
+    });
+  }
+}
+
+Helper3rdState::Q3Cache
+Helper3rdState::computeCache(const std::vector<int> &q1Indexes,
+                             const int &iq2, PhononH0 &harmonic,
+                             const bool &batched) {
+  Q3Cache thisCache;
+  auto numPoints = int(q1Indexes.size());
+  if (numPoints == 0) {
+    return thisCache;
+  }
+  thisCache.offset = q1Indexes[0];
 
-    cachePlusEnergies.resize(numPoints);
-    cachePlusEigenVectors.resize(numPoints);
-    cachePlusBose.resize(numPoints);
-    cachePlusVelocity.resize(numPoints);
+  thisCache.plusEnergies.resize(numPoints);
+  thisCache.plusEigenVectors.resize(numPoints);
+  thisCache.plusBose.resize(numPoints);
+  thisCache.plusVelocity.resize(numPoints);
 
-    cacheMinusEnergies.resize(numPoints);
-    cacheMinusEigenVectors.resize(numPoints);
-    cacheMinusBose.resize(numPoints);
-    cacheMinusVelocity.resize(numPoints);
+  thisCache.minusEnergies.resize(numPoints);
+  thisCache.minusEigenVectors.resize(numPoints);
+  thisCache.minusBose.resize(numPoints);
+  thisCache.minusVelocity.resize(numPoints);
 
-    Particle particle = h0->getParticle();
+  // keep in the cache at least the q3 points of two values of q2
+  q3CacheCapacity = std::max(q3CacheCapacity, size_t(4 * numPoints));
 
-    int iq1Counter = -1;
+  Eigen::Vector3d q2 = innerBandStructure.getPoint(iq2).getCoordinates(
+      Points::cartesianCoordinates);
+
+  if (batched) {
+    std::vector<Eigen::Vector3d> q3s;
+    q3s.reserve(2 * numPoints);
     for (int iq1 : q1Indexes) {
-      iq1Counter++;
       Eigen::Vector3d q1 = outerBandStructure.getPoint(iq1).getCoordinates(
           Points::cartesianCoordinates);
-      Eigen::Vector3d q2 = innerBandStructure.getPoint(iq2).getCoordinates(
-          Points::cartesianCoordinates);
+      q3s.emplace_back(q1 + q2);
+      q3s.emplace_back(q1 - q2);
+    }
+    batchedDiagonalizeQ3(q3s);
+  }
 
-      Eigen::Vector3d q3Plus = q1 + q2;
-      Eigen::Vector3d q3Minus = q1 - q2;
+  int iq1Counter = -1;
+  for (int iq1 : q1Indexes) {
+    iq1Counter++;
+    Eigen::Vector3d q1 = outerBandStructure.getPoint(iq1).getCoordinates(
+        Points::cartesianCoordinates);
+
+    Eigen::Vector3d q3Plus = q1 + q2;
+    Eigen::Vector3d q3Minus = q1 - q2;
+
+    const Q3Harmonic &plus = getQ3Harmonic(q3Plus, harmonic);
+    thisCache.plusEnergies[iq1Counter] = plus.energies;
+    thisCache.plusEigenVectors[iq1Counter] = plus.eigenVectors;
+    thisCache.plusBose[iq1Counter] = plus.bose;
+    thisCache.plusVelocity[iq1Counter] = plus.velocity;
+
+    // note: the reference to plus may be invalidated here
+    const Q3Harmonic &minus = getQ3Harmonic(q3Minus, harmonic);
+    thisCache.minusEnergies[iq1Counter] = minus.energies;
+    thisCache.minusEigenVectors[iq1Counter] = minus.eigenVectors;
+    thisCache.minusBose[iq1Counter] = minus.bose;
+    thisCache.minusVelocity[iq1Counter] = minus.velocity;
+  }
+  return thisCache;
+}
 
-      auto tup = h0->diagonalizeFromCoordinates(q3Plus);
-      auto energies3Plus = std::get<0>(tup);
-      auto eigenVectors3Plus = std::get<1>(tup);
-      auto tup1 = h0->diagonalizeFromCoordinates(q3Minus);
-      auto energies3Minus = std::get<0>(tup1);
-      auto eigenVectors3Minus = std::get<1>(tup1);
+Helper3rdState::Q3Key Helper3rdState::getQ3Key(const Eigen::Vector3d &q3) {
+  Q3Key key;
+  for (int i : {0, 1, 2}) {
+    key[i] = std::llround(q3(i) * 1.0e8);
+  }
+  return key;
+}
 
-      int nb3Plus = int(energies3Plus.size());
-      int nb3Minus = int(energies3Minus.size());
+const Helper3rdState::Q3Harmonic &
+Helper3rdState::addQ3Harmonic(const Q3Key &key, Q3Harmonic &q3Info,
+                              PhononH0 &harmonic) {
+  int nb3 = int(q3Info.energies.size());
+  Particle particle = harmonic.getParticle();
+  q3Info.bose.resize(numCalculations, nb3);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
+    double chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
+    for (int ib3 = 0; ib3 < nb3; ib3++) {
+      q3Info.bose(iCalc, ib3) =
+          particle.getPopulation(q3Info.energies(ib3), temp, chemPot);
+    }
+  }
 
-      Eigen::MatrixXd bose3DataPlus(numCalculations, nb3Plus);
-      Eigen::MatrixXd bose3DataMinus(numCalculations, nb3Minus);
-      bose3DataPlus.setZero();
-      bose3DataMinus.setZero();
+  // remove the least recently used point if the cache is full
+  if (q3List.size() >= q3CacheCapacity && !q3List.empty()) {
+    q3Map.erase(q3List.back().first);
+    q3List.pop_back();
+  }
+  q3List.emplace_front(key, std::move(q3Info));
+  q3Map[key] = q3List.begin();
+  return q3List.front().second;
+}
 
-      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-        double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
-        double chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
-        for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
-          bose3DataPlus(iCalc, ib3) =
-              particle.getPopulation(energies3Plus(ib3), temp, chemPot);
-        }
-        for (int ib3 = 0; ib3 < nb3Minus; ib3++) {
-          bose3DataMinus(iCalc, ib3) =
-              particle.getPopulation(energies3Minus(ib3), temp, chemPot);
-        }
+const Helper3rdState::Q3Harmonic &
+Helper3rdState::getQ3Harmonic(const Eigen::Vector3d &q3,
+                              PhononH0 &harmonic) {
+  Q3Key key = getQ3Key(q3);
+  auto search = q3Map.find(key);
+  if (search != q3Map.end()) {
+    // move the point to the front of the list, as the most recently used
+    q3List.splice(q3List.begin(), q3List, search->second);
+    return search->second->second;
+  }
+
+  Q3Harmonic q3Info;
+  Eigen::Vector3d q3Coordinates = q3;
+  auto tup = harmonic.diagonalizeFromCoordinates(q3Coordinates);
+  q3Info.energies = std::get<0>(tup);
+  q3Info.eigenVectors = std::get<1>(tup);
+  int nb3 = int(q3Info.energies.size());
+
+  q3Info.velocity = Eigen::MatrixXd::Zero(nb3, 3);
+  if (smearingType == DeltaFunction::adaptiveGaussian) {
+    Eigen::Tensor<std::complex<double>, 3> v3sTmp =
+        harmonic.diagonalizeVelocityFromCoordinates(q3Coordinates);
+    // we only need the diagonal elements of the velocity operator
+    // i.e. the group velocity
+    for (int i : {0, 1, 2}) {
+      for (int ib3 = 0; ib3 < nb3; ib3++) {
+        q3Info.velocity(ib3, i) = v3sTmp(ib3, ib3, i).real();
       }
+    }
+  }
+  return addQ3Harmonic(key, q3Info, harmonic);
+}
 
-      Eigen::MatrixXd v3sPlus(nb3Plus, 3);
-      Eigen::MatrixXd v3sMinus(nb3Minus, 3);
-      v3sPlus.setZero();
-      v3sMinus.setZero();
-      if (smearingType == DeltaFunction::adaptiveGaussian) {
-        Eigen::Tensor<std::complex<double>, 3> v3sTmpPlus =
-            h0->diagonalizeVelocityFromCoordinates(q3Plus);
-        Eigen::Tensor<std::complex<double>, 3> v3sTmpMinus =
-            h0->diagonalizeVelocityFromCoordinates(q3Minus);
+void Helper3rdState::batchedDiagonalizeQ3(
+    const std::vector<Eigen::Vector3d> &q3s) {
+  // the points not yet in the cache, each listed once
+  std::vector<Eigen::Vector3d> newQ3s;
+  std::vector<Q3Key> newKeys;
+  std::set<Q3Key> newKeysSet;
+  for (const auto &q3 : q3s) {
+    Q3Key key = getQ3Key(q3);
+    auto search = q3Map.find(key);
+    if (search != q3Map.end()) {
+      // keep it in front, so it's not removed when adding the new points
+      q3List.splice(q3List.begin(), q3List, search->second);
+    } else if (newKeysSet.insert(key).second) {
+      newQ3s.push_back(q3);
+      newKeys.push_back(key);
+    }
+  }
+  auto numQ3 = int(newQ3s.size());
+  if (numQ3 == 0) {
+    return;
+  }
+
+  bool withVelocities = smearingType == DeltaFunction::adaptiveGaussian;
+  int numBands = h0->getNumBands();
+  int batchSize = std::max(1, h0->estimateBatchSize(withVelocities));
 
-        // we only need the diagonal elements of the velocity operator
-        // i.e. the group velocity
+  for (int start = 0; start < numQ3; start += batchSize) {
+    int numK = std::min(batchSize, numQ3 - start);
+
+    DoubleView2D cartesianWavevectors_d("q3CartWav_d", numK, 3);
+    {
+      auto cartesianWavevectors_h =
+          Kokkos::create_mirror_view(cartesianWavevectors_d);
+      for (int iik = 0; iik < numK; iik++) {
         for (int i : {0, 1, 2}) {
-          for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
-            v3sPlus(ib3, i) = v3sTmpPlus(ib3, ib3, i).real();
-          }
-          for (int ib3 = 0; ib3 < nb3Minus; ib3++) {
-            v3sMinus(ib3, i) = v3sTmpMinus(ib3, ib3, i).real();
-          }
+          cartesianWavevectors_h(iik, i) = newQ3s[start + iik](i);
         }
       }
+      Kokkos::deep_copy(cartesianWavevectors_d, cartesianWavevectors_h);
+    }
 
-      cachePlusEnergies[iq1Counter] = energies3Plus;
-      cachePlusEigenVectors[iq1Counter] = eigenVectors3Plus;
-      cachePlusBose[iq1Counter] = bose3DataPlus;
-      cachePlusVelocity[iq1Counter] = v3sPlus;
+    // note: the eigenvectors must be computed with the mass scaling, as in
+    // diagonalizeFromCoordinates(), so we don't take them from the
+    // velocity function
+    auto t = h0->kokkosBatchedDiagonalizeFromCoordinates(cartesianWavevectors_d);
+    auto allEnergies_h = Kokkos::create_mirror_view(std::get<0>(t));
+    auto allEigenvectors_h = Kokkos::create_mirror_view(std::get<1>(t));
+    Kokkos::deep_copy(allEnergies_h, std::get<0>(t));
+    Kokkos::deep_copy(allEigenvectors_h, std::get<1>(t));
+
+    std::vector<Q3Harmonic> q3Infos(numK);
+#pragma omp parallel for
+    for (int iik = 0; iik < numK; iik++) {
+      Q3Harmonic &q3Info = q3Infos[iik];
+      q3Info.energies.resize(numBands);
+      q3Info.eigenVectors.resize(numBands, numBands);
+      for (int ib1 = 0; ib1 < numBands; ib1++) {
+        q3Info.energies(ib1) = allEnergies_h(iik, ib1);
+        for (int ib2 = 0; ib2 < numBands; ib2++) {
+          q3Info.eigenVectors(ib1, ib2) = allEigenvectors_h(iik, ib1, ib2);
+        }
+      }
+      q3Info.velocity = Eigen::MatrixXd::Zero(numBands, 3);
+    }
+
+    if (withVelocities) {
+      auto tv = h0->kokkosBatchedDiagonalizeWithVelocities(
+          cartesianWavevectors_d);
+      auto allVelocities_h = Kokkos::create_mirror_view(std::get<2>(tv));
+      Kokkos::deep_copy(allVelocities_h, std::get<2>(tv));
+      // we only need the group velocity, i.e. the diagonal elements
+      for (int iik = 0; iik < numK; iik++) {
+        for (int ib3 = 0; ib3 < numBands; ib3++) {
+          for (int i : {0, 1, 2}) {
+            q3Infos[iik].velocity(ib3, i) =
+                allVelocities_h(iik, ib3, ib3, i).real();
+          }
+        }
+      }
+    }
 
-      cacheMinusEnergies[iq1Counter] = energies3Minus;
-      cacheMinusEigenVectors[iq1Counter] = eigenVectors3Minus;
-      cacheMinusBose[iq1Counter] = bose3DataMinus;
-      cacheMinusVelocity[iq1Counter] = v3sMinus;
+    for (int iik = 0; iik < numK; iik++) {
+      addQ3Harmonic(newKeys[start + iik], q3Infos[iik], *h0);
     }
   }
 }
@@ -3,6 +3,10 @@
 
 #include "phonon_h0.h"
 #include "vector_bte.h"
+#include <array>
+#include <future>
+#include <list>
+#include <map>
 
 /** This is a highly specialized auxiliary class, whose sole purpose is to
  * optimize the construction of the phonon scattering matrix.
@@ -27,6 +31,13 @@
  * matrix has an outer loop over q2, we compute at once all the band structure
  * for the values of all q3 such that q3 = q1 +- q2 for a fixed q2. Then, we
  * can quickly retrieve the info at each value of q3.
+ * The diagonalized q3 points are also kept in a least-recently-used cache,
+ * shared across the iterations over q2, so that q3 points appearing for
+ * several values of q2 are only computed once.
+ * When computing lifetimes on a path, the outer band structure contains all
+ * the path points, and the q3 points of a q2 that are missing from the cache
+ * are diagonalized in batches with the Kokkos functions of PhononH0, so that
+ * each sweep of the inner mesh keeps the device busy with full batches.
  */
 class Helper3rdState {
  public:
@@ -59,12 +70,31 @@ class Helper3rdState {
    */
   void prepare(const std::vector<int>& q1Indexes, const int &iq2);
 
+  /** Starts computing, on a separate host thread, the harmonic info of the
+   * q3 points that will be needed by the next call to prepare(), so that it
+   * overlaps with the calculation of the couplings for the current q2.
+   * Does nothing if the q3 band structure is already stored (cases 1, 2).
+   * The thread diagonalizes with its own copy of h0, made at the first call.
+   * Note: this holds in memory the q3 info for two values of q2.
+   */
+  void prefetch(const std::vector<int>& q1Indexes, const int &iq2);
+
   /** to be called inside the loops on q1 and q2 to get the harmonic info on q3.
+   * The results are written in the output arguments, so that the caller can
+   * store them without further copies.
+   * @param point1: the q1 point.
+   * @param point2: the q2 point.
+   * @param thisCase: casePlus or caseMinus.
+   * @param energies3: output, the phonon energies at q3.
+   * @param eigenVectors3: output, the phonon eigenvectors at q3.
+   * @param v3s: output, the group velocities at q3 (nb3,3), only set with
+   * adaptive smearing.
+   * @param bose3Data: output, the Bose--Einstein occupations at q3
+   * (numCalculations,nb3).
    */
-  std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
-             Eigen::MatrixXd, Eigen::MatrixXd> get(Point &point1,
-                                                   Point &point2,
-                                                   const int &thisCase);
+  void get(Point &point1, Point &point2, const int &thisCase,
+           Eigen::VectorXd &energies3, Eigen::MatrixXcd &eigenVectors3,
+           Eigen::MatrixXd &v3s, Eigen::MatrixXd &bose3Data);
 
   /** To be used with get(), this identifies q3 as q3 = q1 + q2
    */
@@ -81,23 +111,86 @@ class Helper3rdState {
   StatisticsSweep &statisticsSweep;
   int smearingType;
   PhononH0 *h0 = nullptr;
+  // copy of h0 used by the prefetch() thread, so that the two threads never
+  // diagonalize with the same PhononH0 object
+  std::unique_ptr<PhononH0> prefetchH0;
 
   std::unique_ptr<BaseBandStructure> bandStructure3;
   std::unique_ptr<Points> fullPoints3;
+  // points of the q3 band structure (cases 1 and 2), stored once to avoid
+  // a copy of the Points object at every call to get()
+  std::unique_ptr<Points> points3;
 
   bool storedAllQ3; // if true, q3 falls on a grid and we store the full bands
 
   const int storedAllQ3Case1=1;
   const int storedAllQ3Case2=2;
   int storedAllQ3Case;
-  int cacheOffset = 0;
   int numCalculations;
 
-  std::vector<Eigen::VectorXd> cachePlusEnergies, cacheMinusEnergies;
-  std::vector<Eigen::MatrixXcd> cachePlusEigenVectors, cacheMinusEigenVectors;
-  std::vector<Eigen::MatrixXd> cachePlusBose, cacheMinusBose;
-  std::vector<Eigen::MatrixXd> cachePlusVelocity, cacheMinusVelocity;
+  // harmonic info at q3 = q1 +- q2, for all q1 at fixed q2 (case 3)
+  struct Q3Cache {
+    int offset = 0;
+    std::vector<Eigen::VectorXd> plusEnergies, minusEnergies;
+    std::vector<Eigen::MatrixXcd> plusEigenVectors, minusEigenVectors;
+    std::vector<Eigen::MatrixXd> plusBose, minusBose;
+    std::vector<Eigen::MatrixXd> plusVelocity, minusVelocity;
+  };
+  Q3Cache cache;
+
+  // harmonic info at a single q3 point
+  struct Q3Harmonic {
+    Eigen::VectorXd energies;
+    Eigen::MatrixXcd eigenVectors;
+    Eigen::MatrixXd bose;
+    Eigen::MatrixXd velocity;
+  };
+  // least-recently-used cache of diagonalized q3 points (case 3), indexed
+  // by the rounded cartesian coordinates of q3. Most recent points in front.
+  using Q3Key = std::array<long long, 3>;
+  std::list<std::pair<Q3Key, Q3Harmonic>> q3List;
+  std::map<Q3Key, std::list<std::pair<Q3Key, Q3Harmonic>>::iterator> q3Map;
+  size_t q3CacheCapacity = 0;
+
+  // cache for the next q2, being computed by prefetch()
+  std::future<Q3Cache> nextCache;
+  std::vector<int> nextQ1Indexes;
+  int nextIq2 = -1;
 
+  /** Computes the harmonic info at q3 for all the q1 and a fixed q2.
+   * @param harmonic: the phonon Hamiltonian, h0 on the main thread and
+   * prefetchH0 on the prefetch() thread.
+   * @param batched: if true, the q3 points are first diagonalized with the
+   * Kokkos batched functions. Must be false on the prefetch() thread, as
+   * Kokkos kernels can't be launched concurrently with the main thread.
+   */
+  Q3Cache computeCache(const std::vector<int>& q1Indexes, const int &iq2,
+                       PhononH0 &harmonic, const bool &batched);
+
+  /** Diagonalizes with the Kokkos batched functions the q3 points of the list
+   * not found in the least-recently-used cache, and adds them to the cache.
+   * The points already in the cache are marked as the most recently used.
+   */
+  void batchedDiagonalizeQ3(const std::vector<Eigen::Vector3d> &q3s);
+
+  /** Key of a q3 point in the least-recently-used cache: the same point is
+   * identified up to a small tolerance.
+   */
+  static Q3Key getQ3Key(const Eigen::Vector3d &q3);
+
+  /** Computes the Bose--Einstein occupations of a new q3 point, and adds it
+   * to the least-recently-used cache, removing the oldest point if full.
+   */
+  const Q3Harmonic &addQ3Harmonic(const Q3Key &key, Q3Harmonic &q3Info,
+                                  PhononH0 &harmonic);
+
+  /** Returns the harmonic info at q3, diagonalizing the dynamical matrix
+   * with harmonic only if q3 is not found in the least-recently-used cache.
+   * Not thread safe: only called by computeCache(), which runs on one
+   * thread at a time.
+   */
+  const Q3Harmonic &getQ3Harmonic(const Eigen::Vector3d &q3,
+                                  PhononH0 &harmonic);
 };
 
 #endif
@@ -3,17 +3,18 @@
 #include "constants.h"
 #include "mpiHelper.h"
 #include "delta_function.h"
+#include "utilities.h"
 #include <iomanip>
 
 HelperElScattering::HelperElScattering(BaseBandStructure &innerBandStructure_,
                                BaseBandStructure &outerBandStructure_,
                                StatisticsSweep &statisticsSweep_,
-                               const int &smearingType_, PhononH0 &h0_, InteractionElPhWan *coupling)
+                               const int &smearingType_, PhononH0 &h0_)
     : innerBandStructure(innerBandStructure_),
       outerBandStructure(outerBandStructure_),
       statisticsSweep(statisticsSweep_),
       smearingType(smearingType_),
-      h0(h0_), couplingElPhWan(coupling) {
+      h0(h0_) {
   // three conditions must be met to avoid recomputing q3
   // 1 - q1 and q2 mesh must be the same
   // 2 - the mesh is gamma-centered
@@ -55,6 +56,8 @@ HelperElScattering::HelperElScattering(BaseBandStructure &innerBandStructure_,
                                                withEigenvectors);
     bandStructure3 = std::make_unique<FullBandStructure>(bs);
 
+    buildGridTables(Eigen::VectorXi());
+
   } else if ((&innerBandStructure == &outerBandStructure) &&
              (offset.norm() == 0.) && innerBandStructure.hasWindow() != 0) {
 
@@ -75,8 +78,13 @@ HelperElScattering::HelperElScattering(BaseBandStructure &innerBandStructure_,
 
     // now, we loop over the pairs of wavevectors
     std::set<int> listOfIndexes;
+    // the cost of a k2 point scales with the size of its star
     int numPoints = innerBandStructure.getNumPoints();
-    std::vector<size_t> ik2s = mpi->divideWorkIter(numPoints);
+    std::vector<double> k2Costs(numPoints);
+    for (int ik2 = 0; ik2 < numPoints; ik2++) {
+      k2Costs[ik2] = double(innerPoints.getRotationsStar(ik2).size());
+    }
+    std::vector<size_t> ik2s = mpi->divideWorkIterWeighted(k2Costs);
     int nik2s = ik2s.size();
 #pragma omp parallel
     {
@@ -159,65 +167,42 @@ HelperElScattering::HelperElScattering(BaseBandStructure &innerBandStructure_,
     // note: bandStructure3 stores a copy of ap3: can't pass unique_ptr
     bandStructure3 = std::make_unique<ActiveBandStructure>(
         ap3, &h0, withEigenvectors, withVelocities);
+
+    buildGridTables(filter);
   }
 
-  // precompute the first part of the polar correction, save work
-  if(storedAllQ3){
-    // get the list of local iq3s indices
-    std::vector<int> iq3s = bandStructure3->parallelIrrPointsIterator();
-    int localNumQ3 = iq3s.size();
-
-    // sum up total number of q3 indices
-    int numQ3 = localNumQ3;
-    mpi->allReduceSum(&numQ3);
-
-    // compute the local columns of the matrix
-    int numBands = bandStructure3->getNumBands();
-    Eigen::MatrixXcd polarData(numBands, localNumQ3);
-    #pragma omp parallel for
-    for(int iiq3 = 0; iiq3 < localNumQ3; iiq3++){
-      int iq3 = iq3s[iiq3];
-      WavevectorIndex iq3Index(iq3);
-      Eigen::Vector3d q3 = bandStructure3->getWavevector(iq3Index);
-      auto ev3 = bandStructure3->getEigenvectors(iq3Index);
-      polarData.col(iiq3) = couplingElPhWan->polarCorrectionPart1(q3, ev3);
-    }
+  Kokkos::Profiling::popRegion();
+}
 
-    // gather results from across the MPI processes
-    std::vector<int> alliq3s(numQ3);
-    mpi->allGatherv(&iq3s, &alliq3s);
-    Eigen::MatrixXcd allPolarData(numBands, numQ3);
-#ifdef MPI_AVAIL
-    // now gather the polar data, which has been divided column-wise
-    {
-      int nprocs = mpi->getSize();
-      std::vector<int> myniq3s(1, localNumQ3), allniq3s(nprocs), polarsizes(nprocs), polarstarts(nprocs, 0);
-      // get # localNumQ3 on each MPI rank
-      mpi->allGather(&myniq3s, &allniq3s);
-      // multiply by column size, cumulative sum to get displacements
-      for(int rank = 0; rank < nprocs; rank++){
-        polarsizes[rank] = numBands * allniq3s[rank];
-        polarstarts[rank] = rank==0 ? 0 : polarstarts[rank-1]+polarsizes[rank-1];
-      }
-      // gather all polar data
-      MPI_Allgatherv(polarData.data(), polarData.size(), MPI_DOUBLE_COMPLEX,
-          allPolarData.data(), polarsizes.data(), polarstarts.data(),
-          MPI_DOUBLE_COMPLEX, MPI_COMM_WORLD);
-    }
-    //mpi->allGatherv(&polarData, &allPolarData);
-#else
-    allPolarData = polarData;
-#endif
-
-    // store mapping from iq3 to the polar data
-    // this is required since the helper.get(iq3) functions are called with
-    // iq3 being an integer running over M values between 0 and N-1, M<N
-    // while internally, we are saving the polar terms in a vector of size M
-    for(int iiq3 = 0; iiq3 < numQ3; iiq3++){
-      mappedPolarData.insert({alliq3s[iiq3], allPolarData.col(iiq3)});
+Eigen::Vector3i
+HelperElScattering::getGridCoordinates(const Eigen::Vector3d &crystalK) {
+  Eigen::Vector3i p;
+  for (int i : {0, 1, 2}) {
+    p(i) = mod(int(round(crystalK(i) * gridMesh(i))), gridMesh(i));
+  }
+  return p;
+}
+
+void HelperElScattering::buildGridTables(const Eigen::VectorXi &filter) {
+  // the meshes are gamma-centered, so the point coordinates are integers
+  gridMesh = std::get<0>(fullPoints3->getMesh());
+
+  Points innerPoints = innerBandStructure.getPoints();
+  int numPoints = innerBandStructure.getNumPoints();
+  innerGridCoordinates.resize(3, numPoints);
+#pragma omp parallel for
+  for (int ik = 0; ik < numPoints; ik++) {
+    Eigen::Vector3d k =
+        innerPoints.getPointCoordinates(ik, Points::crystalCoordinates);
+    innerGridCoordinates.col(ik) = getGridCoordinates(k);
+  }
+
+  if (storedAllQ3Case == storedAllQ3Case2) {
+    fullToActive3 = Eigen::VectorXi::Constant(fullPoints3->getNumPoints(), -1);
+    for (int iq = 0; iq < int(filter.size()); iq++) {
+      fullToActive3(filter(iq)) = iq;
     }
   }
-  Kokkos::Profiling::popRegion();
 }
 
 // auto [eigenValues3Minus, nb3Minus, eigenVectors3Minus, v3Minus, bose3]
@@ -226,7 +211,7 @@ HelperElScattering::HelperElScattering(BaseBandStructure &innerBandStructure_,
  * This is to be used for the third wavevector of the 3-phonon scattering.
  */
 std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
-           Eigen::MatrixXd, Eigen::MatrixXd, Eigen::VectorXcd>
+           Eigen::MatrixXd, Eigen::MatrixXd>
     HelperElScattering::get(Eigen::Vector3d &k1, const int &ik2) {
 
   auto ik2Idx = WavevectorIndex(ik2);
@@ -240,15 +225,20 @@ std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
     // note: 3rdBandStructure might still be different from inner/outer bs.
     // so, we must use the points from 3rdBandStructure to get the values
 
-    int iq3;
-    if (storedAllQ3Case == storedAllQ3Case1) {  // we use innerBandStructure
-      Eigen::Vector3d crystalPoints = fullPoints3->cartesianToCrystal(q3);
-      iq3 = fullPoints3->getIndex(crystalPoints);
-    } else {
-      Eigen::Vector3d crystalPoints = activePoints3->cartesianToCrystal(q3);
-      iq3 = activePoints3->getIndex(crystalPoints);
+    // q3 = k2 - k1 folded in the first Brillouin zone, with the same index
+    // ordering as Points::getPointCoordinates
+    Eigen::Vector3i p = innerGridCoordinates.col(ik2) - k1GridCoordinates;
+    int iq3 = 0;
+    for (int i : {2, 1, 0}) {
+      iq3 = iq3 * gridMesh(i) + mod(p(i), gridMesh(i));
     }
-    auto iq3Index = WavevectorIndex(iq3); // TODO: MAP FROM THIS?
+    if (storedAllQ3Case == storedAllQ3Case2) {
+      iq3 = fullToActive3(iq3);
+      if (iq3 < 0) {
+        Error("HelperElScattering found a q3 point not in the list");
+      }
+    }
+    auto iq3Index = WavevectorIndex(iq3);
 
     Eigen::VectorXd energies3 = bandStructure3->getEnergies(iq3Index);
     Eigen::MatrixXcd eigenVectors3 = bandStructure3->getEigenvectors(iq3Index);
@@ -265,9 +255,7 @@ std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
          bose3Data(iCalc, ib3) = particle.getPopulation(energies3(ib3), temp);
       }
     }
-    Eigen::VectorXcd polarData = mappedPolarData.at(iq3);
-
-    return std::make_tuple(q3, energies3, nb3, eigenVectors3, v3s, bose3Data, polarData);
+    return std::make_tuple(q3, energies3, nb3, eigenVectors3, v3s, bose3Data);
 
   } else {
     // otherwise, q3 doesn't fall into the same grid
@@ -280,73 +268,117 @@ std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
     Eigen::MatrixXcd eigenVectors3 = cacheEigenVectors[ik2Counter];
     Eigen::MatrixXd v3s = cacheVelocity[ik2Counter];
     Eigen::MatrixXd bose3Data = cacheBose[ik2Counter];
-    Eigen::VectorXcd polarData = cachePolarData[ik2Counter];
     int nb3 = int(energies3.size());
 
-    return std::make_tuple(q3, energies3, nb3, eigenVectors3, v3s, bose3Data, polarData);
+    return std::make_tuple(q3, energies3, nb3, eigenVectors3, v3s, bose3Data);
   }
 }
 
 void HelperElScattering::prepare(const Eigen::Vector3d &k1,
                                  const std::vector<int>& k2Indexes) {
-  if (!storedAllQ3) {
+  if (storedAllQ3) {
+    k1GridCoordinates = getGridCoordinates(fullPoints3->cartesianToCrystal(k1));
+  } else {
     int numPoints = int(k2Indexes.size());
     cacheEnergies.resize(numPoints);
     cacheEigenVectors.resize(numPoints);
     cacheBose.resize(numPoints);
-    cachePolarData.resize(numPoints);
     cacheVelocity.resize(numPoints);
     cacheOffset = k2Indexes[0];
 
     Particle particle = h0.getParticle();
 
-    int ik2Counter = -1;
-    for (int ik2 : k2Indexes) {
-      ik2Counter++;
-      auto ik2Idx = WavevectorIndex(ik2);
-      Eigen::Vector3d k2 = innerBandStructure.getWavevector(ik2Idx);
-
-      Eigen::Vector3d q3 = k2 - k1;
-
-      auto t1 = h0.diagonalizeFromCoordinates(q3);
-      auto energies3 = std::get<0>(t1);
-      auto eigenVectors3 = std::get<1>(t1);
+    bool withVelocities = smearingType == DeltaFunction::adaptiveGaussian;
+    int numCalculations = statisticsSweep.getNumCalculations();
 
-      int nb3 = int(energies3.size());
+    // all the q3 = k2 - k1 are diagonalized in batches on the device,
+    // rather than one point at a time
+    std::vector<int> ik2Counters(numPoints);
+    for (int i = 0; i < numPoints; i++) {
+      ik2Counters[i] = i;
+    }
+    int batchSize = h0.estimateBatchSize(withVelocities);
+    std::vector<std::vector<int>> batches =
+        kokkosDeviceMemory->splitToBatches(ik2Counters, batchSize);
+
+    for (const std::vector<int> &batch : batches) {
+      int numQ = int(batch.size());
+
+      DoubleView2D q3s_d("q3s_d", numQ, 3);
+      auto q3s_h = Kokkos::create_mirror_view(q3s_d);
+      for (int iq = 0; iq < numQ; iq++) {
+        auto ik2Idx = WavevectorIndex(k2Indexes[batch[iq]]);
+        Eigen::Vector3d q3 = innerBandStructure.getWavevector(ik2Idx) - k1;
+        for (int i : {0, 1, 2}) {
+          q3s_h(iq, i) = q3(i);
+        }
+      }
+      Kokkos::deep_copy(q3s_d, q3s_h);
+
+      DoubleView2D energies_d;
+      StridedComplexView3D eigenVectors_d;
+      ComplexView4D velocities_d;
+      if (withVelocities) {
+        auto t = h0.kokkosBatchedDiagonalizeWithVelocities(q3s_d);
+        energies_d = std::get<0>(t);
+        eigenVectors_d = std::get<1>(t);
+        velocities_d = std::get<2>(t);
+      } else {
+        auto t = h0.kokkosBatchedDiagonalizeFromCoordinates(q3s_d);
+        energies_d = std::get<0>(t);
+        eigenVectors_d = std::get<1>(t);
+      }
+      int nb3 = int(energies_d.extent(1));
+
+      auto energies_h = Kokkos::create_mirror_view(energies_d);
+      auto eigenVectors_h = Kokkos::create_mirror_view(eigenVectors_d);
+      Kokkos::deep_copy(energies_h, energies_d);
+      Kokkos::deep_copy(eigenVectors_h, eigenVectors_d);
+      // only the group velocities (the diagonal of the velocity operator)
+      // are needed by the adaptive smearing
+      DoubleView3D groupVelocities_d("v3s_d", numQ, nb3, 3);
+      if (withVelocities) {
+        Kokkos::parallel_for(
+            "phGroupVelocities", Range3D({0, 0, 0}, {numQ, nb3, 3}),
+            KOKKOS_LAMBDA(int iq, int ib, int i) {
+              groupVelocities_d(iq, ib, i) = velocities_d(iq, ib, ib, i).real();
+            });
+      }
+      auto groupVelocities_h = Kokkos::create_mirror_view(groupVelocities_d);
+      Kokkos::deep_copy(groupVelocities_h, groupVelocities_d);
 
-      Eigen::MatrixXd bose3Data(statisticsSweep.getNumCalculations(), nb3);
-      bose3Data.setZero();
+#pragma omp parallel for
+      for (int iq = 0; iq < numQ; iq++) {
+        int ik2Counter = batch[iq];
 
-      for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
-        double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
+        Eigen::VectorXd energies3(nb3);
+        Eigen::MatrixXcd eigenVectors3(nb3, nb3);
+        Eigen::MatrixXd v3s = Eigen::MatrixXd::Zero(nb3, 3);
         for (int ib3 = 0; ib3 < nb3; ib3++) {
-          bose3Data(iCalc, ib3) = particle.getPopulation(energies3(ib3), temp);
+          energies3(ib3) = energies_h(iq, ib3);
+          for (int jb3 = 0; jb3 < nb3; jb3++) {
+            eigenVectors3(ib3, jb3) = eigenVectors_h(iq, ib3, jb3);
+          }
+          if (withVelocities) {
+            for (int i : {0, 1, 2}) {
+              v3s(ib3, i) = groupVelocities_h(iq, ib3, i);
+            }
+          }
         }
-      }
 
-      Eigen::MatrixXd v3s(nb3, 3);
-      v3s.setZero();
-      if (smearingType == DeltaFunction::adaptiveGaussian) {
-        Eigen::Tensor<std::complex<double>, 3> v3sTmp =
-            h0.diagonalizeVelocityFromCoordinates(q3);
-
-        // we only need the diagonal elements of the velocity operator
-        // i.e. the group velocity
-        for (int i : {0, 1, 2}) {
+        Eigen::MatrixXd bose3Data(numCalculations, nb3);
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
           for (int ib3 = 0; ib3 < nb3; ib3++) {
-            v3s(ib3, i) = v3sTmp(ib3, ib3, i).real();
+            bose3Data(iCalc, ib3) = particle.getPopulation(energies3(ib3), temp);
           }
         }
-      }
-
-      Eigen::VectorXcd polarData = couplingElPhWan->polarCorrectionPart1(q3, eigenVectors3);
-
-      cacheEnergies[ik2Counter] = energies3;
-      cacheEigenVectors[ik2Counter] = eigenVectors3;
-      cacheBose[ik2Counter] = bose3Data;
-      cachePolarData[ik2Counter] = polarData;
-      cacheVelocity[ik2Counter] = v3s;
 
+        cacheEnergies[ik2Counter] = energies3;
+        cacheEigenVectors[ik2Counter] = eigenVectors3;
+        cacheBose[ik2Counter] = bose3Data;
+        cacheVelocity[ik2Counter] = v3s;
+      }
     }
   }
 }
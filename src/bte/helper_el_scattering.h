@@ -3,8 +3,6 @@
 
 #include "phonon_h0.h"
 #include "vector_bte.h"
-#include "interaction_elph.h"
-#include <unordered_map>
 
 /** This class manages the calculation of phonon properties during the
  * integration of the scattering matrix.
@@ -33,8 +31,7 @@ class HelperElScattering {
                  BaseBandStructure &outerBandStructure_,
                  StatisticsSweep &statisticsSweep_,
                  const int &smearingType_,
-                 PhononH0 &h0_,
-                 InteractionElPhWan *coupling);
+                 PhononH0 &h0_);
 
   /** This function creates a "cache" of phonon properties.
    * To be called in the loop over k2, before the loop on k2.
@@ -56,7 +53,7 @@ class HelperElScattering {
    * qPointVelocities, boseEinsteinPopulation] of phonons for this q-point.
    */
   std::tuple<Eigen::Vector3d, Eigen::VectorXd, int, Eigen::MatrixXcd,
-             Eigen::MatrixXd, Eigen::MatrixXd, Eigen::VectorXcd> get(Eigen::Vector3d &k1,
+             Eigen::MatrixXd, Eigen::MatrixXd> get(Eigen::Vector3d &k1,
                                                    const int &ik2);
 
  private:
@@ -65,7 +62,6 @@ class HelperElScattering {
   StatisticsSweep &statisticsSweep;
   int smearingType;
   PhononH0 &h0;
-  InteractionElPhWan *couplingElPhWan;
 
   std::unique_ptr<BaseBandStructure> bandStructure3;
   std::unique_ptr<Points> fullPoints3;
@@ -77,13 +73,30 @@ class HelperElScattering {
   int storedAllQ3Case;
   int cacheOffset=0;
 
+  // when storedAllQ3, the index of q3 = k2 - k1 is found with integer
+  // arithmetic on the grid, rather than searching the point in the list.
+  // innerGridCoordinates(:,ik2) are the integer coordinates of k2 on the mesh
+  // gridMesh, k1GridCoordinates those of the k1 point set by prepare().
+  // In case 2, fullToActive3(iq) maps a point of fullPoints3 to its index in
+  // activePoints3 (or -1 if absent).
+  Eigen::Vector3i gridMesh;
+  Eigen::MatrixXi innerGridCoordinates;
+  Eigen::Vector3i k1GridCoordinates;
+  Eigen::VectorXi fullToActive3;
+
+  /** Returns the integer coordinates of a wavevector on the mesh gridMesh,
+   * folded in the range [0,gridMesh[.
+   */
+  Eigen::Vector3i getGridCoordinates(const Eigen::Vector3d &crystalK);
+
+  /** Builds the table innerGridCoordinates (and fullToActive3 in case 2).
+   */
+  void buildGridTables(const Eigen::VectorXi &filter);
+
   std::vector<Eigen::VectorXd> cacheEnergies;
   std::vector<Eigen::MatrixXcd> cacheEigenVectors;
   std::vector<Eigen::MatrixXd> cacheBose;
   std::vector<Eigen::MatrixXd> cacheVelocity;
-  std::vector<Eigen::VectorXcd> cachePolarData;
-
-  std::unordered_map<int, Eigen::VectorXcd> mappedPolarData;
 };
 
 #endif
@@ -1,22 +1,34 @@
 #include "ph_scattering.h"
+#include "active_bandstructure.h"
 #include "constants.h"
 #include "helper_3rd_state.h"
 #include "io.h"
 #include "mpiHelper.h"
+#include <algorithm>
 #include <cmath>
+#include <numeric>
 
 PhScatteringMatrix::PhScatteringMatrix(Context &context_,
                                        StatisticsSweep &statisticsSweep_,
                                        BaseBandStructure &innerBandStructure_,
                                        BaseBandStructure &outerBandStructure_,
                                        Interaction3Ph *coupling3Ph_,
-                                       PhononH0 *h0_)
+                                       PhononH0 *h0_,
+                                       std::shared_ptr<PhPhCouplingCache> couplingCache_,
+                                       Interaction4Ph *coupling4Ph_)
     : ScatteringMatrix(context_, statisticsSweep_, innerBandStructure_,
                        outerBandStructure_),
-      coupling3Ph(coupling3Ph_), h0(h0_) {
+      coupling3Ph(coupling3Ph_), h0(h0_), couplingCache(couplingCache_),
+      coupling4Ph(coupling4Ph_) {
   if (&innerBandStructure != &outerBandStructure && h0 == nullptr) {
     Error("PhScatteringMatrix needs h0 for incommensurate grids");
   }
+  if (coupling4Ph != nullptr && h0 == nullptr) {
+    Error("PhScatteringMatrix needs h0 for 4-phonon scattering");
+  }
+  if (couplingCache == nullptr && context.getCachePhPhCouplings()) {
+    couplingCache = std::make_shared<PhPhCouplingCache>();
+  }
 
   // setup here the isotopic scattering
   if (context.getWithIsotopeScattering()) {
@@ -57,6 +69,526 @@ PhScatteringMatrix::PhScatteringMatrix(Context &context_,
 // inPopulation+outPopulation is passed: we compute the action of the
 //       scattering matrix on the in vector, returning outVec = sMatrix*vector
 // only linewidth is passed: we compute only the linewidths
+std::vector<Eigen::MatrixXd> phPhLinewidthsOnDevice(
+    DoubleView4D couplingPlus, DoubleView4D couplingMins,
+    const DeviceDeltaFunction &deltaFunction,
+    const std::vector<Eigen::VectorXd> &energies1_v,
+    const std::vector<Eigen::MatrixXd> &bose1_v,
+    const Eigen::VectorXd &energies2, const Eigen::MatrixXd &v2s,
+    const Eigen::MatrixXd &bose2, const std::vector<bool> &isActive2,
+    const std::vector<Eigen::VectorXd> &energies3Plus_v,
+    const std::vector<Eigen::MatrixXd> &v3sPlus_v,
+    const std::vector<Eigen::MatrixXd> &bose3Plus_v,
+    const std::vector<Eigen::VectorXd> &energies3Mins_v,
+    const std::vector<Eigen::MatrixXd> &v3sMins_v,
+    const std::vector<Eigen::MatrixXd> &bose3Mins_v, const double &norm,
+    const double &energyCutoff, const bool &outerEqualInnerMesh) {
+  Kokkos::Profiling::pushRegion("phPhLinewidthsOnDevice");
+
+  auto nq1 = int(energies1_v.size());
+  auto nb2 = int(energies2.size());
+  auto numCalculations = int(bose2.rows());
+  int maxnb1 = 0, maxnb3Plus = 0, maxnb3Mins = 0;
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    maxnb1 = std::max(maxnb1, int(energies1_v[iq1].size()));
+    maxnb3Plus = std::max(maxnb3Plus, int(energies3Plus_v[iq1].size()));
+    maxnb3Mins = std::max(maxnb3Mins, int(energies3Mins_v[iq1].size()));
+  }
+
+  IntView1D nb1s("nb1s", nq1), nb3Pluss("nb3ps", nq1), nb3Minss("nb3ms", nq1);
+  // the couplings are averaged over the degenerate bands at q1, q2 and q3 (as
+  // done by symmetrizeCoupling()), i.e. over degSize bands starting from
+  // degStart
+  IntView2D degStart1("degStart1", nq1, maxnb1);
+  IntView2D degSize1("degSize1", nq1, maxnb1);
+  IntView1D degStart2("degStart2", nb2), degSize2("degSize2", nb2);
+  IntView2D degStart3Plus("degStart3p", nq1, maxnb3Plus);
+  IntView2D degSize3Plus("degSize3p", nq1, maxnb3Plus);
+  IntView2D degStart3Mins("degStart3m", nq1, maxnb3Mins);
+  IntView2D degSize3Mins("degSize3m", nq1, maxnb3Mins);
+  DoubleView2D energies1("en1", nq1, maxnb1);
+  DoubleView3D bose1("bose1", numCalculations, nq1, maxnb1);
+  DoubleView1D energies2_k("en2", nb2);
+  DoubleView2D v2s_k("v2s", nb2, 3);
+  DoubleView2D bose2_k("bose2", numCalculations, nb2);
+  IntView1D isActive2_k("isActive2", nb2);
+  DoubleView2D energies3Plus("en3p", nq1, maxnb3Plus);
+  DoubleView3D v3sPlus("v3sp", nq1, maxnb3Plus, 3);
+  DoubleView3D bose3Plus("bose3p", numCalculations, nq1, maxnb3Plus);
+  DoubleView2D energies3Mins("en3m", nq1, maxnb3Mins);
+  DoubleView3D v3sMins("v3sm", nq1, maxnb3Mins, 3);
+  DoubleView3D bose3Mins("bose3m", numCalculations, nq1, maxnb3Mins);
+
+  // copy everything to kokkos views
+  {
+    auto nb1s_h = Kokkos::create_mirror_view(nb1s);
+    auto nb3Pluss_h = Kokkos::create_mirror_view(nb3Pluss);
+    auto nb3Minss_h = Kokkos::create_mirror_view(nb3Minss);
+    auto degStart1_h = Kokkos::create_mirror_view(degStart1);
+    auto degSize1_h = Kokkos::create_mirror_view(degSize1);
+    auto degStart2_h = Kokkos::create_mirror_view(degStart2);
+    auto degSize2_h = Kokkos::create_mirror_view(degSize2);
+    auto degStart3Plus_h = Kokkos::create_mirror_view(degStart3Plus);
+    auto degSize3Plus_h = Kokkos::create_mirror_view(degSize3Plus);
+    auto degStart3Mins_h = Kokkos::create_mirror_view(degStart3Mins);
+    auto degSize3Mins_h = Kokkos::create_mirror_view(degSize3Mins);
+    auto energies1_h = Kokkos::create_mirror_view(energies1);
+    auto bose1_h = Kokkos::create_mirror_view(bose1);
+    auto energies2_h = Kokkos::create_mirror_view(energies2_k);
+    auto v2s_h = Kokkos::create_mirror_view(v2s_k);
+    auto bose2_h = Kokkos::create_mirror_view(bose2_k);
+    auto isActive2_h = Kokkos::create_mirror_view(isActive2_k);
+    auto energies3Plus_h = Kokkos::create_mirror_view(energies3Plus);
+    auto v3sPlus_h = Kokkos::create_mirror_view(v3sPlus);
+    auto bose3Plus_h = Kokkos::create_mirror_view(bose3Plus);
+    auto energies3Mins_h = Kokkos::create_mirror_view(energies3Mins);
+    auto v3sMins_h = Kokkos::create_mirror_view(v3sMins);
+    auto bose3Mins_h = Kokkos::create_mirror_view(bose3Mins);
+
+    // (first band, number of bands) of the degenerate group of each band,
+    // with the groups of findDegenerateGroups()
+    auto getBandGroups = [](const Eigen::VectorXd &energies) {
+      auto nb = int(energies.size());
+      std::vector<std::tuple<int, int>> bandGroups(nb);
+      for (int ib = 0; ib < nb; ib++) {
+        bandGroups[ib] = {ib, 1};
+      }
+      for (auto [start, degDegree] :
+           BaseBandStructure::findDegenerateGroups(energies)) {
+        for (int i = 0; i < degDegree; i++) {
+          bandGroups[start + i] = {start, degDegree};
+        }
+      }
+      return bandGroups;
+    };
+
+    for (int iq1 = 0; iq1 < nq1; iq1++) {
+      auto nb1 = int(energies1_v[iq1].size());
+      auto nb3Plus = int(energies3Plus_v[iq1].size());
+      auto nb3Mins = int(energies3Mins_v[iq1].size());
+      nb1s_h(iq1) = nb1;
+      nb3Pluss_h(iq1) = nb3Plus;
+      nb3Minss_h(iq1) = nb3Mins;
+      auto bandGroups1 = getBandGroups(energies1_v[iq1]);
+      auto bandGroups3Plus = getBandGroups(energies3Plus_v[iq1]);
+      auto bandGroups3Mins = getBandGroups(energies3Mins_v[iq1]);
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        degStart1_h(iq1, ib1) = std::get<0>(bandGroups1[ib1]);
+        degSize1_h(iq1, ib1) = std::get<1>(bandGroups1[ib1]);
+        energies1_h(iq1, ib1) = energies1_v[iq1](ib1);
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          bose1_h(iCalc, iq1, ib1) = bose1_v[iq1](iCalc, ib1);
+        }
+      }
+      for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
+        degStart3Plus_h(iq1, ib3) = std::get<0>(bandGroups3Plus[ib3]);
+        degSize3Plus_h(iq1, ib3) = std::get<1>(bandGroups3Plus[ib3]);
+        energies3Plus_h(iq1, ib3) = energies3Plus_v[iq1](ib3);
+        for (int i : {0, 1, 2}) {
+          v3sPlus_h(iq1, ib3, i) = v3sPlus_v[iq1](ib3, i);
+        }
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          bose3Plus_h(iCalc, iq1, ib3) = bose3Plus_v[iq1](iCalc, ib3);
+        }
+      }
+      for (int ib3 = 0; ib3 < nb3Mins; ib3++) {
+        degStart3Mins_h(iq1, ib3) = std::get<0>(bandGroups3Mins[ib3]);
+        degSize3Mins_h(iq1, ib3) = std::get<1>(bandGroups3Mins[ib3]);
+        energies3Mins_h(iq1, ib3) = energies3Mins_v[iq1](ib3);
+        for (int i : {0, 1, 2}) {
+          v3sMins_h(iq1, ib3, i) = v3sMins_v[iq1](ib3, i);
+        }
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          bose3Mins_h(iCalc, iq1, ib3) = bose3Mins_v[iq1](iCalc, ib3);
+        }
+      }
+    }
+    auto bandGroups2 = getBandGroups(energies2);
+    for (int ib2 = 0; ib2 < nb2; ib2++) {
+      degStart2_h(ib2) = std::get<0>(bandGroups2[ib2]);
+      degSize2_h(ib2) = std::get<1>(bandGroups2[ib2]);
+      energies2_h(ib2) = energies2(ib2);
+      isActive2_h(ib2) = isActive2[ib2] ? 1 : 0;
+      for (int i : {0, 1, 2}) {
+        v2s_h(ib2, i) = v2s(ib2, i);
+      }
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        bose2_h(iCalc, ib2) = bose2(iCalc, ib2);
+      }
+    }
+    Kokkos::deep_copy(nb1s, nb1s_h);
+    Kokkos::deep_copy(nb3Pluss, nb3Pluss_h);
+    Kokkos::deep_copy(nb3Minss, nb3Minss_h);
+    Kokkos::deep_copy(degStart1, degStart1_h);
+    Kokkos::deep_copy(degSize1, degSize1_h);
+    Kokkos::deep_copy(degStart2, degStart2_h);
+    Kokkos::deep_copy(degSize2, degSize2_h);
+    Kokkos::deep_copy(degStart3Plus, degStart3Plus_h);
+    Kokkos::deep_copy(degSize3Plus, degSize3Plus_h);
+    Kokkos::deep_copy(degStart3Mins, degStart3Mins_h);
+    Kokkos::deep_copy(degSize3Mins, degSize3Mins_h);
+    Kokkos::deep_copy(energies1, energies1_h);
+    Kokkos::deep_copy(bose1, bose1_h);
+    Kokkos::deep_copy(energies2_k, energies2_h);
+    Kokkos::deep_copy(v2s_k, v2s_h);
+    Kokkos::deep_copy(bose2_k, bose2_h);
+    Kokkos::deep_copy(isActive2_k, isActive2_h);
+    Kokkos::deep_copy(energies3Plus, energies3Plus_h);
+    Kokkos::deep_copy(v3sPlus, v3sPlus_h);
+    Kokkos::deep_copy(bose3Plus, bose3Plus_h);
+    Kokkos::deep_copy(energies3Mins, energies3Mins_h);
+    Kokkos::deep_copy(v3sMins, v3sMins_h);
+    Kokkos::deep_copy(bose3Mins, bose3Mins_h);
+  }
+
+  // each thread computes the linewidths of one state at q1, so that no
+  // atomic operations are needed
+  DoubleView3D linewidths("linewidths", numCalculations, nq1, maxnb1);
+  double prefactor = pi * 0.25 * 0.5 * norm;
+  Kokkos::parallel_for(
+      "phPhLinewidths", Range2D({0, 0}, {nq1, maxnb1}),
+      KOKKOS_LAMBDA(int iq1, int ib1) {
+        if (ib1 >= nb1s(iq1)) return;
+        double en1 = energies1(iq1, ib1);
+        int deg1 = degStart1(iq1, ib1);
+        int degN1 = degSize1(iq1, ib1);
+
+        for (int ib2 = 0; ib2 < nb2; ib2++) {
+          if (isActive2_k(ib2) == 0) continue;
+          double en2 = energies2_k(ib2);
+          int deg2 = degStart2(ib2);
+          int degN2 = degSize2(ib2);
+
+          for (int ib3 = 0; ib3 < nb3Pluss(iq1); ib3++) {
+            double en3 = energies3Plus(iq1, ib3);
+            double enProd = en1 * en2 * en3;
+            if (outerEqualInnerMesh) {
+              if (en1 < energyCutoff || en2 < energyCutoff ||
+                  en3 < energyCutoff) continue;
+            } else if (enProd < energyCutoff) {
+              continue;
+            }
+            double deltaPlus = deltaFunction(
+                en1 + en2 - en3, v2s_k(ib2, 0) - v3sPlus(iq1, ib3, 0),
+                v2s_k(ib2, 1) - v3sPlus(iq1, ib3, 1),
+                v2s_k(ib2, 2) - v3sPlus(iq1, ib3, 2));
+            if (deltaPlus <= 0.) continue;
+            // the averages over the three indices commute, so that the
+            // coupling is averaged over the block of degenerate states
+            int deg3 = degStart3Plus(iq1, ib3);
+            int degN3 = degSize3Plus(iq1, ib3);
+            double coupling = 0.;
+            for (int i1 = 0; i1 < degN1; i1++) {
+              for (int i2 = 0; i2 < degN2; i2++) {
+                for (int i3 = 0; i3 < degN3; i3++) {
+                  coupling +=
+                      couplingPlus(iq1, deg1 + i1, deg2 + i2, deg3 + i3);
+                }
+              }
+            }
+            coupling /= double(degN1 * degN2 * degN3);
+            double weight = prefactor * coupling * deltaPlus / enProd;
+            for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              linewidths(iCalc, iq1, ib1) +=
+                  bose1(iCalc, iq1, ib1) * bose2_k(iCalc, ib2) *
+                  (bose3Plus(iCalc, iq1, ib3) + 1.) * weight;
+            }
+          }
+
+          for (int ib3 = 0; ib3 < nb3Minss(iq1); ib3++) {
+            double en3 = energies3Mins(iq1, ib3);
+            double enProd = en1 * en2 * en3;
+            if (outerEqualInnerMesh) {
+              if (en1 < energyCutoff || en2 < energyCutoff ||
+                  en3 < energyCutoff) continue;
+            } else if (enProd < energyCutoff) {
+              continue;
+            }
+            double vx = v2s_k(ib2, 0) - v3sMins(iq1, ib3, 0);
+            double vy = v2s_k(ib2, 1) - v3sMins(iq1, ib3, 1);
+            double vz = v2s_k(ib2, 2) - v3sMins(iq1, ib3, 2);
+            double deltaMinus1 = deltaFunction(en1 + en3 - en2, vx, vy, vz);
+            double deltaMinus2 = deltaFunction(en2 + en3 - en1, vx, vy, vz);
+            if (deltaMinus1 <= 0. && deltaMinus2 <= 0.) continue;
+            if (deltaMinus1 < 0.) deltaMinus1 = 0.;
+            if (deltaMinus2 < 0.) deltaMinus2 = 0.;
+            int deg3 = degStart3Mins(iq1, ib3);
+            int degN3 = degSize3Mins(iq1, ib3);
+            double coupling = 0.;
+            for (int i1 = 0; i1 < degN1; i1++) {
+              for (int i2 = 0; i2 < degN2; i2++) {
+                for (int i3 = 0; i3 < degN3; i3++) {
+                  coupling +=
+                      couplingMins(iq1, deg1 + i1, deg2 + i2, deg3 + i3);
+                }
+              }
+            }
+            coupling /= double(degN1 * degN2 * degN3);
+            double weight = prefactor * coupling / enProd;
+            for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              double b1 = bose1(iCalc, iq1, ib1);
+              double b2 = bose2_k(iCalc, ib2);
+              double b3 = bose3Mins(iCalc, iq1, ib3);
+              linewidths(iCalc, iq1, ib1) +=
+                  (b3 * b1 * (b2 + 1.) * deltaMinus1 +
+                   b2 * b3 * (b1 + 1.) * deltaMinus2) * weight;
+            }
+          }
+        }
+      });
+
+  // copy back the reduced rows
+  auto linewidths_h = Kokkos::create_mirror_view(linewidths);
+  Kokkos::deep_copy(linewidths_h, linewidths);
+  std::vector<Eigen::MatrixXd> linewidths_v(nq1);
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    auto nb1 = int(energies1_v[iq1].size());
+    linewidths_v[iq1].resize(numCalculations, nb1);
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        linewidths_v[iq1](iCalc, ib1) = linewidths_h(iCalc, iq1, ib1);
+      }
+    }
+  }
+  Kokkos::Profiling::popRegion();
+  return linewidths_v;
+}
+
+/** Computes, with a Kokkos kernel, the temperature-independent part of the
+ * isotope scattering rates between the states of a list of q1 points and
+ * the states at a q2 point. This is the product of the eigenvector overlaps
+ * weighted by the mass variance, the smearing and the prefactors, i.e. the
+ * termIso of the host loop in the builder.
+ * The q1 points are split in batches that fit in the device memory.
+ * Only implemented for the gaussian smearing schemes.
+ * @return weights: for each q1, a (nb1, nb2) matrix.
+ */
+std::vector<Eigen::MatrixXd> isotopeWeightsOnDevice(
+    const DeviceDeltaFunction &deltaFunction,
+    const Eigen::VectorXd &massVariance,
+    const std::vector<Eigen::VectorXd> &energies1_v,
+    const std::vector<Eigen::MatrixXd> &v1s_v,
+    const std::vector<Eigen::MatrixXcd> &ev1s_v,
+    const Eigen::VectorXd &energies2, const Eigen::MatrixXcd &ev2,
+    const double &norm) {
+  Kokkos::Profiling::pushRegion("isotopeWeightsOnDevice");
+
+  auto nq1 = int(energies1_v.size());
+  auto nb2 = int(energies2.size());
+  auto numBands = int(ev2.rows());
+  auto numAtoms = int(massVariance.size());
+  int maxnb1 = 0;
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    maxnb1 = std::max(maxnb1, int(energies1_v[iq1].size()));
+  }
+  std::vector<Eigen::MatrixXd> weights_v(nq1);
+  if (nq1 == 0) {
+    Kokkos::Profiling::popRegion();
+    return weights_v;
+  }
+
+  DoubleView1D massVariance_k("massVariance", numAtoms);
+  DoubleView1D energies2_k("en2", nb2);
+  ComplexView2D ev2_k("ev2", nb2, numBands);
+  {
+    auto massVariance_h = Kokkos::create_mirror_view(massVariance_k);
+    auto energies2_h = Kokkos::create_mirror_view(energies2_k);
+    auto ev2_h = Kokkos::create_mirror_view(ev2_k);
+    for (int iat = 0; iat < numAtoms; iat++) {
+      massVariance_h(iat) = massVariance(iat);
+    }
+    for (int ib2 = 0; ib2 < nb2; ib2++) {
+      energies2_h(ib2) = energies2(ib2);
+      for (int i = 0; i < numBands; i++) {
+        ev2_h(ib2, i) = ev2(i, ib2);
+      }
+    }
+    Kokkos::deep_copy(massVariance_k, massVariance_h);
+    Kokkos::deep_copy(energies2_k, energies2_h);
+    Kokkos::deep_copy(ev2_k, ev2_h);
+  }
+
+  // the q1 points are split in batches, so that the eigenvectors fit in
+  // the available memory
+  double memoryPerQ1 = 16. * maxnb1 * numBands + 8. * maxnb1 * (4 + nb2);
+  double availableMemory = kokkosDeviceMemory->getAvailableMemory();
+  int numBatches =
+      std::max(1, int(std::ceil(nq1 * memoryPerQ1 / availableMemory)));
+  if (numBatches > nq1) {
+    Error("Insufficient memory!");
+  }
+
+  double prefactor = pi * 0.5 * norm;
+  bool isAdaptive = deltaFunction.type == DeltaFunction::adaptiveGaussian;
+  for (int iBatch = 0; iBatch < numBatches; iBatch++) {
+    int start = nq1 * iBatch / numBatches;
+    int batchSize = nq1 * (iBatch + 1) / numBatches - start;
+
+    IntView1D nb1s("nb1s", batchSize);
+    DoubleView2D energies1("en1", batchSize, maxnb1);
+    DoubleView3D v1s("v1s", batchSize, maxnb1, 3);
+    ComplexView3D ev1s("ev1s", batchSize, maxnb1, numBands);
+    {
+      auto nb1s_h = Kokkos::create_mirror_view(nb1s);
+      auto energies1_h = Kokkos::create_mirror_view(energies1);
+      auto v1s_h = Kokkos::create_mirror_view(v1s);
+      auto ev1s_h = Kokkos::create_mirror_view(ev1s);
+      for (int iq1 = 0; iq1 < batchSize; iq1++) {
+        auto nb1 = int(energies1_v[start + iq1].size());
+        nb1s_h(iq1) = nb1;
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          energies1_h(iq1, ib1) = energies1_v[start + iq1](ib1);
+          for (int i : {0, 1, 2}) {
+            v1s_h(iq1, ib1, i) = v1s_v[start + iq1](ib1, i);
+          }
+          for (int i = 0; i < numBands; i++) {
+            ev1s_h(iq1, ib1, i) = ev1s_v[start + iq1](i, ib1);
+          }
+        }
+      }
+      Kokkos::deep_copy(nb1s, nb1s_h);
+      Kokkos::deep_copy(energies1, energies1_h);
+      Kokkos::deep_copy(v1s, v1s_h);
+      Kokkos::deep_copy(ev1s, ev1s_h);
+    }
+
+    DoubleView3D weights("isoWeights", batchSize, maxnb1, nb2);
+    Kokkos::parallel_for(
+        "isotopeWeights", Range3D({0, 0, 0}, {batchSize, maxnb1, nb2}),
+        KOKKOS_LAMBDA(int iq1, int ib1, int ib2) {
+          if (ib1 >= nb1s(iq1)) return;
+          double en1 = energies1(iq1, ib1);
+          double en2 = energies2_k(ib2);
+          // same smearing used by the host loop of the builder
+          double delta = deltaFunction(en1 - en2, v1s(iq1, ib1, 0),
+                                       v1s(iq1, ib1, 1), v1s(iq1, ib1, 2));
+          if (isAdaptive) {
+            delta *= 0.5;
+          }
+          double term = 0.;
+          for (int iat = 0; iat < numAtoms; iat++) {
+            Kokkos::complex<double> zz = 0.;
+            for (int k = 0; k < 3; k++) {
+              zz += Kokkos::conj(ev1s(iq1, ib1, iat * 3 + k)) *
+                    ev2_k(ib2, iat * 3 + k);
+            }
+            term += (zz.real() * zz.real() + zz.imag() * zz.imag()) *
+                    massVariance_k(iat);
+          }
+          weights(iq1, ib1, ib2) = term * prefactor * en1 * en2 * delta;
+        });
+
+    auto weights_h = Kokkos::create_mirror_view(weights);
+    Kokkos::deep_copy(weights_h, weights);
+    for (int iq1 = 0; iq1 < batchSize; iq1++) {
+      auto nb1 = int(energies1_v[start + iq1].size());
+      weights_v[start + iq1].resize(nb1, nb2);
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        for (int ib2 = 0; ib2 < nb2; ib2++) {
+          weights_v[start + iq1](ib1, ib2) = weights_h(iq1, ib1, ib2);
+        }
+      }
+    }
+  }
+  Kokkos::Profiling::popRegion();
+  return weights_v;
+}
+
+/** Prescreens the 3-phonon triplets of a q1 point (at fixed q2) with the
+ * energy conservation, before computing their couplings.
+ * Finds the bands ib1 that have at least one triplet (ib1,ib2,ib3) with a
+ * nonzero smearing for the plus or minus processes, applying the same
+ * energy cutoffs used by the builder. Bands degenerate with an active band
+ * are also kept, so that symmetrizeCoupling() averages over full degenerate
+ * groups. isActive1(ib1) and isActive2(ib2) are false for excluded states.
+ * Only implemented for the gaussian smearing schemes.
+ * @return the list of active bands at q1, in increasing order.
+ */
+std::vector<int> prescreenBands1(
+    DeltaFunction *smearing, const Eigen::VectorXd &energies1,
+    const std::vector<bool> &isActive1, const Eigen::VectorXd &energies2,
+    const Eigen::MatrixXd &v2s, const std::vector<bool> &isActive2,
+    const Eigen::VectorXd &energies3Plus, const Eigen::MatrixXd &v3sPlus,
+    const Eigen::VectorXd &energies3Mins, const Eigen::MatrixXd &v3sMins,
+    const double &energyCutoff, const bool &outerEqualInnerMesh) {
+  auto nb1 = int(energies1.size());
+  auto nb2 = int(energies2.size());
+  bool isGaussian = smearing->getType() == DeltaFunction::gaussian;
+
+  auto isAllowed = [&](const double &en1, const double &en2,
+                       const double &en3) {
+    if (outerEqualInnerMesh) {
+      return en1 >= energyCutoff && en2 >= energyCutoff && en3 >= energyCutoff;
+    }
+    return en1 * en2 * en3 >= energyCutoff;
+  };
+
+  std::vector<bool> hasTriplets(nb1, false);
+  for (int ib1 = 0; ib1 < nb1; ib1++) {
+    if (!isActive1[ib1]) continue;
+    double en1 = energies1(ib1);
+    for (int ib2 = 0; ib2 < nb2 && !hasTriplets[ib1]; ib2++) {
+      if (!isActive2[ib2]) continue;
+      double en2 = energies2(ib2);
+      for (int ib3 = 0; ib3 < energies3Plus.size(); ib3++) {
+        double en3 = energies3Plus(ib3);
+        if (!isAllowed(en1, en2, en3)) continue;
+        double delta;
+        if (isGaussian) {
+          delta = smearing->getSmearing(en1 + en2 - en3);
+        } else {
+          Eigen::Vector3d v = v2s.row(ib2) - v3sPlus.row(ib3);
+          delta = smearing->getSmearing(en1 + en2 - en3, v);
+        }
+        if (delta > 0.) {
+          hasTriplets[ib1] = true;
+          break;
+        }
+      }
+      if (hasTriplets[ib1]) break;
+      for (int ib3 = 0; ib3 < energies3Mins.size(); ib3++) {
+        double en3 = energies3Mins(ib3);
+        if (!isAllowed(en1, en2, en3)) continue;
+        double delta1, delta2;
+        if (isGaussian) {
+          delta1 = smearing->getSmearing(en1 + en3 - en2);
+          delta2 = smearing->getSmearing(en2 + en3 - en1);
+        } else {
+          Eigen::Vector3d v = v2s.row(ib2) - v3sMins.row(ib3);
+          delta1 = smearing->getSmearing(en1 + en3 - en2, v);
+          delta2 = smearing->getSmearing(en2 + en3 - en1, v);
+        }
+        if (delta1 > 0. || delta2 > 0.) {
+          hasTriplets[ib1] = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // extend to the degenerate groups, defined as in symmetrizeCoupling()
+  std::vector<int> activeBands1;
+  for (int ib1 = 0; ib1 < nb1; ib1++) {
+    int degDegree = 0;
+    bool isActive = false;
+    for (int i = ib1; i < nb1; i++) {
+      if (std::abs(energies1(ib1) - energies1(i)) < 1.0e-6) {
+        degDegree++;
+        isActive = isActive || hasTriplets[i];
+      } else {
+        break;
+      }
+    }
+    if (isActive) {
+      for (int i = 0; i < degDegree; i++) {
+        activeBands1.push_back(ib1 + i);
+      }
+    }
+    ib1 += degDegree - 1;
+  }
+  return activeBands1;
+}
+
 void PhScatteringMatrix::builder(VectorBTE *linewidth,
                                  std::vector<VectorBTE> &inPopulations,
                                  std::vector<VectorBTE> &outPopulations) {
@@ -74,13 +606,13 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
   }
 
   int switchCase = 0;
-  if (theMatrix.rows() != 0 && linewidth != nullptr && inPopulations.empty() &&
+  if (getNumStoredRows() != 0 && linewidth != nullptr && inPopulations.empty() &&
       outPopulations.empty()) {
     switchCase = 0;
-  } else if (theMatrix.rows() == 0 && linewidth == nullptr &&
+  } else if (getNumStoredRows() == 0 && linewidth == nullptr &&
              !inPopulations.empty() && !outPopulations.empty()) {
     switchCase = 1;
-  } else if (theMatrix.rows() == 0 && linewidth != nullptr &&
+  } else if (getNumStoredRows() == 0 && linewidth != nullptr &&
              inPopulations.empty() && outPopulations.empty()) {
     switchCase = 2;
   } else {
@@ -95,60 +627,436 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
   int numAtoms = innerBandStructure.getPoints().getCrystal().getNumAtoms();
   int numCalculations = statisticsSweep.getNumCalculations();
 
-  // note: innerNumFullPoints is the number of points in the full grid
-  // may be larger than innerNumPoints, when we use ActiveBandStructure
-  double norm = 1. / context.getQMesh().prod();
+  // the integration over q2 is weighted by the volume sampled by each point,
+  // 1/numQMeshPoints on uniform meshes (also with ActiveBandStructure)
+  Points innerPoints = innerBandStructure.getPoints();
+  if (!innerPoints.hasUniformWeights() && switchCase != 2) {
+    Error("Refined meshes are only supported with the relaxation time "
+          "approximation");
+  }
+
+  // flat copies of the band structures, read in the loops below
+  BandStructureArrays outerArrays(outerBandStructure);
+  // the inner velocities are only needed by the adaptive smearing
+  BandStructureArrays innerArrays(
+      innerBandStructure,
+      smearing->getType() == DeltaFunction::adaptiveGaussian);
 
   // precompute Bose populations
-  auto numOuterIrrStates = int(outerBandStructure.irrStateIterator().size());
-  Eigen::MatrixXd outerBose(numCalculations, numOuterIrrStates);
-  outerBose.setZero();
-  std::vector<size_t> iBtes = mpi->divideWorkIter(numOuterIrrStates);
-  int niBtes = iBtes.size();
-#pragma omp parallel for default(none)                                         \
-    shared(mpi, particle, outerBose, numOuterIrrStates, numCalculations, niBtes, iBtes)
-  for(int iiBte = 0; iiBte < niBtes; iiBte++){
-    int iBte = iBtes[iiBte];
-    BteIndex iBteIdx(iBte);
-    StateIndex isIdx = outerBandStructure.bteToState(iBteIdx);
-    double energy = outerBandStructure.getEnergy(isIdx);
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-      double temp = calcStat.temperature;
-      double chemPot = calcStat.chemicalPotential;
-      outerBose(iCalc, iBte) = particle.getPopulation(energy, temp, chemPot);
+  Eigen::MatrixXd outerBose = statisticsSweep.getIrrPopulations(outerBandStructure);
+  Eigen::MatrixXd innerBose = statisticsSweep.getIrrPopulations(innerBandStructure);
+
+  // calculations that the solver doesn't need in the matrix-vector product
+  std::vector<bool> isSkippedCalc = getSkippedCalculations(switchCase);
+
+  std::vector<std::tuple<std::vector<int>, int>> qPairIterator =
+      getIteratorWavevectorPairs(switchCase);
+  // drop the pairs whose time-reversed pair (-q1,-q2) is computed instead
+  pairTimeReversal(qPairIterator, false, switchCase);
+
+  // with partnerSamplingFraction < 1, the q1 points are sampled at random,
+  // with the likelihood of conserving energy with the q3 points of the mesh
+  // (see samplePartners()). On a path, q3 isn't on the mesh, and the
+  // points are sampled uniformly.
+  bool isSampling = isPartnerSampling(switchCase);
+  std::vector<std::vector<double>> pairWeights;
+  if (isSampling) {
+    if (outputUNTimes) {
+      Error("The sampling of the scattering partners can't be used with "
+            "outputUNTimes");
     }
+    bool isAdaptive = smearing->getType() == DeltaFunction::adaptiveGaussian;
+    Points outerPoints = outerBandStructure.getPoints();
+    pairWeights = samplePartners(
+        qPairIterator, [&](const int &iq2, const int &iq1) {
+          if (!outerEqualInnerMesh) {
+            return 1.;
+          }
+          Eigen::Vector3d q1 = outerPoints.getPointCoordinates(iq1);
+          Eigen::Vector3d q2 = innerPoints.getPointCoordinates(iq2);
+          int iq3Plus = innerPoints.isPointStored(q1 + q2);
+          int iq3Minus = innerPoints.isPointStored(q1 - q2);
+          if (iq3Plus < 0 || iq3Minus < 0) {
+            return 1.;
+          }
+          Eigen::VectorXd energies1 = outerArrays.getEnergies(iq1);
+          Eigen::VectorXd energies2 = innerArrays.getEnergies(iq2);
+          Eigen::VectorXd energies3Plus = innerArrays.getEnergies(iq3Plus);
+          Eigen::VectorXd energies3Minus = innerArrays.getEnergies(iq3Minus);
+          Eigen::MatrixXd v2s = innerArrays.getGroupVelocities(iq2);
+          Eigen::MatrixXd v3sPlus = innerArrays.getGroupVelocities(iq3Plus);
+          Eigen::MatrixXd v3sMinus = innerArrays.getGroupVelocities(iq3Minus);
+          // the mismatches of the (+) process, and of the two (-) processes,
+          // for the states above the energy cutoff of the builder
+          std::vector<double> mismatches;
+          std::vector<Eigen::Vector3d> velocities;
+          for (int ib1 = 0; ib1 < int(energies1.size()); ib1++) {
+            double en1 = energies1(ib1);
+            for (int ib2 = 0; ib2 < int(energies2.size()); ib2++) {
+              double en2 = energies2(ib2);
+              if (en1 < energyCutoff || en2 < energyCutoff) {
+                continue;
+              }
+              for (int ib3 = 0; ib3 < int(energies3Plus.size()); ib3++) {
+                if (energies3Plus(ib3) < energyCutoff) {
+                  continue;
+                }
+                mismatches.push_back(en1 + en2 - energies3Plus(ib3));
+                if (isAdaptive) {
+                  velocities.emplace_back(v2s.row(ib2) - v3sPlus.row(ib3));
+                }
+              }
+              for (int ib3 = 0; ib3 < int(energies3Minus.size()); ib3++) {
+                if (energies3Minus(ib3) < energyCutoff) {
+                  continue;
+                }
+                mismatches.push_back(en1 + energies3Minus(ib3) - en2);
+                mismatches.push_back(en2 + energies3Minus(ib3) - en1);
+                if (isAdaptive) {
+                  Eigen::Vector3d v = v2s.row(ib2) - v3sMinus.row(ib3);
+                  velocities.push_back(v);
+                  velocities.push_back(v);
+                }
+              }
+            }
+          }
+          auto numEntries = int(mismatches.size());
+          Eigen::MatrixXd velocitiesMatrix(isAdaptive ? numEntries : 0, 3);
+          for (int i = 0; i < int(velocities.size()); i++) {
+            velocitiesMatrix.row(i) = velocities[i];
+          }
+          return getPairLikelihood(
+              Eigen::Map<Eigen::VectorXd>(mismatches.data(), numEntries),
+              velocitiesMatrix);
+        });
+    linewidthVariance =
+        std::make_shared<VectorBTE>(statisticsSweep, outerBandStructure, 1);
+    linewidthVariance->setConst(0.);
   }
-  mpi->allReduceSum(&outerBose);
 
-  auto numInnerIrrStates = int(innerBandStructure.irrStateIterator().size());
-  Eigen::MatrixXd innerBose(numCalculations, numInnerIrrStates);
-  innerBose.setZero();
-  iBtes = mpi->divideWorkIter(numInnerIrrStates);
-  niBtes = iBtes.size();
-#pragma omp parallel for default(none)                                         \
-    shared(mpi, particle, innerBose, numInnerIrrStates, numCalculations, niBtes, iBtes)
-  for(int iiBte = 0; iiBte < niBtes; iiBte++){
-    int iBte = iBtes[iiBte];
-    BteIndex iBteIdx(iBte);
-    StateIndex isIdx = innerBandStructure.bteToState(iBteIdx);
-    double energy = innerBandStructure.getEnergy(isIdx);
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-      double temp = calcStat.temperature;
-      double chemPot = calcStat.chemicalPotential;
-      innerBose(iCalc, iBte) = particle.getPopulation(energy, temp, chemPot);
+  // with pools of MPI processes, D3 is distributed over the pool, and each
+  // process of the pool must call cacheD3 the same number of times.
+  // Hence, we pad qPairIterator with dummy pairs (iq2 = -1)
+  bool isPooled = mpi->getSize(mpi->intraPoolComm) > 1;
+  if (isPooled) {
+    int numQ2 = int(qPairIterator.size());
+    mpi->allReduceMax(&numQ2, mpi->intraPoolComm);
+    while (int(qPairIterator.size()) < numQ2) {
+      qPairIterator.emplace_back(std::vector<int>(), -1);
+    }
+  }
+  auto numPairs = int(qPairIterator.size());
+
+  // if we are restarting, skip the q-point pairs already done
+  int numPairsDone = loadBuilderCheckpoint(switchCase, numPairs, linewidth);
+  if (isPooled) {
+    int minPairsDone = numPairsDone;
+    int maxPairsDone = numPairsDone;
+    mpi->allReduceMin(&minPairsDone, mpi->intraPoolComm);
+    mpi->allReduceMax(&maxPairsDone, mpi->intraPoolComm);
+    if (minPairsDone != maxPairsDone) {
+      Error("The checkpoints of the processes of a pool are inconsistent, "
+            "remove them to restart the calculation");
     }
   }
-  mpi->allReduceSum(&innerBose);
 
-  std::vector<std::tuple<std::vector<int>, int>> qPairIterator =
-      getIteratorWavevectorPairs(switchCase);
+  // the ph-ph transition weights are either read from the cache, or computed
+  // and (if a cache is used, and we are not restarting) stored in the cache
+  // (not with sampled partners, whose rates are weighted)
+  bool replayCache = couplingCache != nullptr && couplingCache->isComplete &&
+                     !isSampling &&
+                     couplingCache->qPairIterator == qPairIterator;
+  bool recordCache = couplingCache != nullptr && !replayCache &&
+                     !isSampling && numPairsDone == 0 && numSampledPairs == 0;
+  if (recordCache) {
+    couplingCache->qPairIterator = qPairIterator;
+    couplingCache->processes.clear();
+    couplingCache->processes.resize(numPairs);
+    couplingCache->isComplete = false;
+  }
+  Eigen::VectorXd temperatures(numCalculations);
+  Eigen::VectorXd chemicalPotentials(numCalculations);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temperatures(iCalc) = calcStat.temperature;
+    chemicalPotentials(iCalc) = calcStat.chemicalPotential;
+  }
+
+  // adds the rate of a (+) process, i.e. (1+2)->3, to the scattering matrix,
+  // the matrix-vector product, or the linewidths, depending on switchCase
+  auto addRatePlus = [&](const PhPhCouplingCache::Process &process,
+                         const int &iq2, const Eigen::Matrix3d &rotationInv,
+                         const int &iCalc, const double &ratePlus) {
+    int iq1 = process.iq1;
+    int iBte1 = process.iBte1;
+    int iBte2 = process.iBte2;
+    BteIndex iBte1Idx(iBte1);
+    BteIndex iBte2Idx(iBte2);
+    if (switchCase == 0) { // case of matrix construction
+      if (context.getUseSymmetries()) {
+        for (int i : {0, 1, 2}) {
+          for (int j : {0, 1, 2}) {
+            CartIndex iIndex(i);
+            CartIndex jIndex(j);
+            int iMat1 = getSMatrixIndex(iBte1Idx, iIndex);
+            int iMat2 = getSMatrixIndex(iBte2Idx, jIndex);
+            if (matrixElementIsLocal(iMat1, iMat2)) {
+              if (i == 0 && j == 0) {
+                linewidth->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
+              }
+              if (process.isOffDiagonal) {
+                addToMatrix(iMat1, iMat2,
+                            rotationInv(i, j) * ratePlus);
+              }
+            }
+          }
+        }
+      } else {
+        if (matrixElementIsLocal(iBte1, iBte2)) {
+          linewidth->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
+        }
+        addToMatrix(iBte1, iBte2, ratePlus);
+      }
+
+    } else if (switchCase == 1) { // case of matrix-vector multiplication
+      // we build the scattering matrix A = S*n(n+1)
+      // here we rotate the populations from the irreducible point
+      for (unsigned int iInput = 0; iInput < inPopulations.size();
+           iInput++) {
+        Eigen::Vector3d inPopRot;
+        inPopRot.setZero();
+        for (int i : {0, 1, 2}) {
+          for (int j : {0, 1, 2}) {
+            inPopRot(i) += rotationInv(i, j) *
+                           inPopulations[iInput](iCalc, j, iBte2);
+          }
+        }
+        for (int i : {0, 1, 2}) {
+          if (process.isOffDiagonal) {
+            outPopulations[iInput](iCalc, i, iBte1) +=
+                ratePlus * inPopRot(i);
+          }
+          outPopulations[iInput](iCalc, i, iBte1) +=
+              0.5 * ratePlus *
+              inPopulations[iInput](iCalc, i, iBte1);
+        }
+      }
+
+    } else { // case of linewidth construction
+      linewidth->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
+      if(outputUNTimes) {
+        Point q1 = outerBandStructure.getPoint(iq1);
+        Point q2 = innerBandStructure.getPoint(iq2);
+        // check if this process is umklapp // TODO put this in hasUmklapp function
+        Eigen::Vector3d q1Cart = q1.getCoordinates(Points::cartesianCoordinates);
+        Eigen::Vector3d q2Cart = q2.getCoordinates(Points::cartesianCoordinates);
+        Eigen::Vector3d q1WS = outerBandStructure.getPoints().bzToWs(q1Cart, Points::cartesianCoordinates);
+        Eigen::Vector3d q2WS = outerBandStructure.getPoints().bzToWs(q2Cart, Points::cartesianCoordinates);
+        Eigen::Vector3d q3Cart = q1WS + q2WS;
+        Eigen::Vector3d q3fold = outerBandStructure.getPoints().bzToWs(q3Cart, Points::cartesianCoordinates);
+        bool isUmklapp = false;
+        if(abs((q3Cart-q3fold).norm()) > 1e-6) {
+          isUmklapp = true;
+        }
+        if(isUmklapp) {
+          internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
+        } else {
+          internalDiagonalNormal->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
+        }
+      }
+    }
+  };
+
+  // adds the rates of a (-) process, i.e. (1+3)->2 and (3+2)->1, to the
+  // scattering matrix, the matrix-vector product, or the linewidths
+  auto addRateMinus = [&](const PhPhCouplingCache::Process &process,
+                          const int &iq2, const Eigen::Matrix3d &rotationInv,
+                          const int &iCalc, const double &rateMinus1,
+                          const double &rateMinus2) {
+    int iq1 = process.iq1;
+    int iBte1 = process.iBte1;
+    int iBte2 = process.iBte2;
+    BteIndex iBte1Idx(iBte1);
+    BteIndex iBte2Idx(iBte2);
+    if (switchCase == 0) { // case of matrix construction
+      if (context.getUseSymmetries()) {
+        for (int i : {0, 1, 2}) {
+          for (int j : {0, 1, 2}) {
+            CartIndex iIndex(i);
+            CartIndex jIndex(j);
+            int iMat1 = getSMatrixIndex(iBte1Idx, iIndex);
+            int iMat2 = getSMatrixIndex(iBte2Idx, jIndex);
+            if (matrixElementIsLocal(iMat1, iMat2)) {
+              if (i == 0 && j == 0) {
+                linewidth->operator()(iCalc, 0, iBte1) +=
+                    0.5 * (rateMinus1 + rateMinus2);
+              }
+              if (process.isOffDiagonal) {
+                addToMatrix(iMat1, iMat2,
+                            -rotationInv(i, j) *
+                                (rateMinus1 + rateMinus2));
+              }
+            }
+          }
+        }
+      } else {
+        if (matrixElementIsLocal(iBte1, iBte2)) {
+          linewidth->operator()(iCalc, 0, iBte1) +=
+              0.5 * (rateMinus1 + rateMinus2);
+        }
+        addToMatrix(iBte1, iBte2, -(rateMinus1 + rateMinus2));
+      }
+
+    } else if (switchCase == 1) { // matrix-vector multiplication
+      for (unsigned int iInput = 0; iInput < inPopulations.size();
+           iInput++) {
+        Eigen::Vector3d inPopRot;
+        inPopRot.setZero();
+        for (int i : {0, 1, 2}) {
+          for (int j : {0, 1, 2}) {
+            inPopRot(i) += rotationInv(i, j) *
+                           inPopulations[iInput](iCalc, j, iBte2);
+          }
+        }
+
+        for (int i : {0, 1, 2}) {
+          // off-diagonal term
+          if (process.isOffDiagonal) { // avoid double counting terms
+            outPopulations[iInput](iCalc, i, iBte1) -=
+                (rateMinus1 + rateMinus2) * inPopRot(i);
+          }
+          // diagonal term
+          outPopulations[iInput](iCalc, i, iBte1) +=
+              0.5 * (rateMinus1 + rateMinus2) *
+              inPopulations[iInput](iCalc, i, iBte1);
+        }
+      }
+    } else {
+      linewidth->operator()(iCalc, 0, iBte1) += 0.5 * (rateMinus1 + rateMinus2);
+      if(outputUNTimes) {
+        Point q1 = outerBandStructure.getPoint(iq1);
+        Point q2 = innerBandStructure.getPoint(iq2);
+        Eigen::Vector3d q1Cart = q1.getCoordinates(Points::cartesianCoordinates);
+        Eigen::Vector3d q2Cart = q2.getCoordinates(Points::cartesianCoordinates);
+        Eigen::Vector3d q1WS = outerBandStructure.getPoints().bzToWs(q1Cart, Points::cartesianCoordinates);
+        Eigen::Vector3d q2WS = outerBandStructure.getPoints().bzToWs(q2Cart, Points::cartesianCoordinates);
+        Eigen::Vector3d q3Cart = q1WS - q2WS;
+        Eigen::Vector3d q3fold = outerBandStructure.getPoints().bzToWs(q3Cart, Points::cartesianCoordinates);
+        bool isUmklapp = false;
+        if(abs((q3Cart-q3fold).norm()) > 1e-6) {
+          isUmklapp = true;
+        }
+        if(isUmklapp) {
+          internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus1);
+        } else {
+          internalDiagonalNormal->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus1);
+        }
+
+        // check the second point
+        Eigen::Vector3d q3Cart2 = q2WS - q1WS;
+        Eigen::Vector3d q3fold2 = outerBandStructure.getPoints().bzToWs(q3Cart2, Points::cartesianCoordinates);
+        isUmklapp = false;
+        if(abs((q3Cart2-q3fold2).norm()) > 1e-6) {
+          isUmklapp = true;
+        }
+        if(isUmklapp) {
+          internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus2);
+        } else {
+          internalDiagonalNormal->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus2);
+        }
+      }
+    }
+  };
+
+  // the linewidths are computed on the device by phPhLinewidthsOnDevice(),
+  // unless the transitions are needed on the host (for the couplings cache,
+  // or to separate Umklapp processes), or the smearing is not gaussian
+  bool linewidthsOnDevice =
+      switchCase == 2 && couplingCache == nullptr && !outputUNTimes &&
+      (smearing->getType() == DeltaFunction::gaussian ||
+       smearing->getType() == DeltaFunction::adaptiveGaussian);
+  DeviceDeltaFunction deviceDelta;
+  if (linewidthsOnDevice) {
+    deviceDelta = smearing->getDeviceDeltaFunction();
+  }
+  // the triplets are prescreened with the energy conservation, so that the
+  // couplings are computed only for the bands at q1 having some transition
+  // (see prescreenBands1()). Not done with the tetrahedron method, since it
+  // would double the cost of evaluating the smearing.
+  bool prescreenTriplets =
+      smearing->getType() == DeltaFunction::gaussian ||
+      smearing->getType() == DeltaFunction::adaptiveGaussian;
 
   Helper3rdState pointHelper(innerBandStructure, outerBandStructure, outerBose,
                              statisticsSweep, smearing->getType(), h0);
+
+  // the BTE indices of the states of q1 (and -q1, which may receive the
+  // rates of the time-reversed pair), whose linewidths are weighted by the
+  // sampled pairs
+  auto getIBte1s = [&](const int &iq1) {
+    std::vector<int> iq1s = {iq1};
+    if (!timeReversedOuterPoints.empty() &&
+        timeReversedOuterPoints[iq1] >= 0 &&
+        timeReversedOuterPoints[iq1] != iq1) {
+      iq1s.push_back(timeReversedOuterPoints[iq1]);
+    }
+    std::vector<int> iBte1s;
+    for (int iq : iq1s) {
+      WavevectorIndex iqIndex(iq);
+      for (int ib1 = 0; ib1 < outerBandStructure.getNumBands(iqIndex);
+           ib1++) {
+        StateIndex is1Idx(outerBandStructure.getIndex(iqIndex, BandIndex(ib1)));
+        iBte1s.push_back(outerBandStructure.stateToBte(is1Idx).get());
+      }
+    }
+    return iBte1s;
+  };
+
+  // the irreducible states, and their BTE indices, of the bands at iq, with
+  // the inverse rotation of iq to its irreducible point. Used to apply the
+  // rates of a pair to its time-reversed pair (-q1,-q2), which is only done
+  // if the inner and outer band structures coincide (see pairTimeReversal())
+  auto getReversedStates = [&](const int &iq, std::vector<int> &isIrrs,
+                               std::vector<int> &iBtes,
+                               Eigen::Matrix3d &rotationInvIrr) {
+    WavevectorIndex iqIndex(iq);
+    auto t = innerBandStructure.getRotationIndexToIrreducible(iqIndex);
+    WavevectorIndex iqIrrIndex(std::get<0>(t));
+    // the rotation R such that q = R q^irr
+    rotationInvIrr = innerBandStructure.getRotationMatrix(std::get<1>(t));
+    int nb = innerBandStructure.getNumBands(iqIrrIndex);
+    isIrrs.resize(nb);
+    iBtes.resize(nb);
+    for (int ib = 0; ib < nb; ib++) {
+      isIrrs[ib] = innerBandStructure.getIndex(iqIrrIndex, BandIndex(ib));
+      StateIndex isIrrIdx(isIrrs[ib]);
+      iBtes[ib] = innerBandStructure.stateToBte(isIrrIdx).get();
+    }
+  };
+  // the process of the time-reversed pair, with the same transition weights
+  auto getReversedProcess = [](const PhPhCouplingCache::Process &process,
+                               const int &iq1Reversed, const int &is1Reversed,
+                               const int &iBte1Reversed,
+                               const int &is2IrrReversed,
+                               const int &iBte2Reversed) {
+    PhPhCouplingCache::Process processReversed = process;
+    processReversed.iq1 = iq1Reversed;
+    processReversed.iBte1 = iBte1Reversed;
+    processReversed.iBte2 = iBte2Reversed;
+    processReversed.isOffDiagonal = is1Reversed != is2IrrReversed;
+    processReversed.isReversed = true;
+    return processReversed;
+  };
+  auto isExcluded = [&](const int &iBte) {
+    return std::find(excludeIndices.begin(), excludeIndices.end(), iBte) !=
+           excludeIndices.end();
+  };
+  // in a dry run, only the first few pairs are done, to time the loop
+  int lastPair = getLastBuilderPair(numPairsDone, numPairs);
+  auto loopStartTime = std::chrono::steady_clock::now();
   LoopPrint loopPrint("computing scattering matrix", "q-point pairs",
-                      int(qPairIterator.size()));
+                      lastPair - numPairsDone,
+                      context.getProgressHeartbeatInterval());
 
   /** Very important: the code must be executed with a loop over q2 outside
    * and a loop over q1 inside. This is because the 3-ph coupling must compute
@@ -157,37 +1065,125 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
    * Thus, we have some speed when executing in this order.
    * PointHelper too assumes that order of loop execution.
    */
+  // the couplings of each batch are written in the same buffers
+  Interaction3Ph::CouplingBuffer couplingPlus_b, couplingMinus_b;
+  // optionally, the q1 states are read from a copy of the band structure on
+  // the device, and the batches only transfer their indices
+  Interaction3Ph::DeviceQ1s deviceQ1s;
+  auto activeOuterBandStructure =
+      dynamic_cast<ActiveBandStructure *>(&outerBandStructure);
+  if (kokkosDeviceMemory->useDeviceBandStructure() &&
+      activeOuterBandStructure != nullptr) {
+    deviceQ1s.bandStructure = &activeOuterBandStructure->getDeviceMirror();
+  }
+  bool useDeviceQ1s = deviceQ1s.bandStructure != nullptr;
   // outer loop over q2
-  for (auto tup : qPairIterator) {
+  for (int iPair = numPairsDone; iPair < lastPair; iPair++) {
+    // periodically save the partial results
+    if (iPair != numPairsDone) {
+      saveBuilderCheckpoint(switchCase, iPair, numPairs, linewidth);
+    }
+    auto tup = qPairIterator[iPair];
     std::vector<int> iq1Indexes = std::get<0>(tup);
     int iq2 = std::get<1>(tup);
+
+    // dummy pair: only help the other processes of the pool with cacheD3
+    if (iq2 < 0) {
+      loopPrint.update();
+      if (!replayCache) {
+        coupling3Ph->cacheD3(Eigen::Vector3d::Zero());
+      }
+      continue;
+    }
     WavevectorIndex iq2Index(iq2);
+    double norm = innerPoints.getWeight(iq2);
 
     Point q2Point = innerBandStructure.getPoint(iq2);
-    Eigen::VectorXd energies2 = innerBandStructure.getEnergies(iq2Index);
+    Eigen::VectorXd energies2 = innerArrays.getEnergies(iq2);
     auto nb2 = int(energies2.size());
-    Eigen::MatrixXd v2s = innerBandStructure.getGroupVelocities(iq2Index);
-    Eigen::Vector3d q2 = innerBandStructure.getWavevector(iq2Index);
+    Eigen::MatrixXd v2s = innerArrays.getGroupVelocities(iq2);
+    Eigen::Vector3d q2 = innerArrays.getWavevector(iq2);
     Eigen::MatrixXcd ev2 = innerBandStructure.getEigenvectors(iq2Index);
+    auto degGroups2 = innerBandStructure.getDegenerateGroups(iq2Index);
 
     auto nq1 = int(iq1Indexes.size());
 
-    auto t = innerBandStructure.getRotationToIrreducible(
-        q2Point.getCoordinates(Points::cartesianCoordinates),
-        Points::cartesianCoordinates);
+    auto t = innerBandStructure.getRotationIndexToIrreducible(iq2Index);
     int iq2Irr = std::get<0>(t);
     WavevectorIndex iq2IrrIndex(iq2Irr);
-    Eigen::Matrix3d rotation = std::get<1>(t);
-    // rotation such that qIrr = R * qRed
+    // rotation such that qRed = rotationInv * qIrr (no coordinate search)
+    const Eigen::Matrix3d &rotationInv =
+        innerBandStructure.getRotationMatrix(std::get<1>(t));
+
+    std::vector<bool> isActive2(nb2);
+    for (int ib2 = 0; ib2 < nb2; ib2++) {
+      int is2Irr = innerBandStructure.getIndex(iq2IrrIndex, BandIndex(ib2));
+      StateIndex is2IrrIdx(is2Irr);
+      int iBte2 = innerBandStructure.stateToBte(is2IrrIdx).get();
+      isActive2[ib2] = std::find(excludeIndices.begin(), excludeIndices.end(),
+                                 iBte2) == excludeIndices.end();
+    }
+
+    // the states of -q2, for the time-reversed pairs (-q1,-q2)
+    int iq2Reversed =
+        timeReversedInnerPoints.empty() ? -1 : timeReversedInnerPoints[iq2];
+    std::vector<int> is2IrrsReversed, iBte2sReversed;
+    Eigen::Matrix3d rotationInvReversed = Eigen::Matrix3d::Identity();
+    if (iq2Reversed >= 0) {
+      getReversedStates(iq2Reversed, is2IrrsReversed, iBte2sReversed,
+                        rotationInvReversed);
+    }
 
     loopPrint.update();
+
+    // the transition weights are known: we only need the Bose factors
+    if (replayCache) {
+      for (const auto &process : couplingCache->processes[iPair]) {
+        int iq2Process = process.isReversed ? iq2Reversed : iq2;
+        const Eigen::Matrix3d &rotationInvProcess =
+            process.isReversed ? rotationInvReversed : rotationInv;
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          if (isSkippedCalc[iCalc]) continue;
+          double bose1 = outerBose(iCalc, process.iBte1);
+          double bose2 = innerBose(iCalc, process.iBte2);
+          double bose3 = particle.getPopulation(
+              process.energy3, temperatures(iCalc), chemicalPotentials(iCalc));
+          if (process.isPlus) {
+            double ratePlus =
+                pi * 0.25 * bose1 * bose2 * (bose3 + 1.) * process.weight1;
+            addRatePlus(process, iq2Process, rotationInvProcess, iCalc,
+                        ratePlus);
+          } else {
+            double rateMinus1 =
+                pi * 0.25 * bose3 * bose1 * (bose2 + 1.) * process.weight1;
+            double rateMinus2 =
+                pi * 0.25 * bose2 * bose3 * (bose1 + 1.) * process.weight2;
+            addRateMinus(process, iq2Process, rotationInvProcess, iCalc,
+                         rateMinus1, rateMinus2);
+          }
+        }
+      }
+      continue;
+    }
+
     pointHelper.prepare(iq1Indexes, iq2);
+    // start the harmonic calculations at q3 for the next q2, which overlap
+    // with the couplings of the current q2
+    if (context.getPipelinePhPhBuilder() && iPair + 1 < lastPair &&
+        std::get<1>(qPairIterator[iPair + 1]) >= 0) {
+      pointHelper.prefetch(std::get<0>(qPairIterator[iPair + 1]),
+                           std::get<1>(qPairIterator[iPair + 1]));
+    }
 
     // prepare batches based on memory usage
     int numBatches = coupling3Ph->estimateNumBatches(nq1, nb2);
 
     // precalculate D3cached for current value of q2
     coupling3Ph->cacheD3(q2);
+    // all the q1 partners may have been discarded by the sampling
+    if (nq1 == 0) {
+      continue;
+    }
 
     // loop over batches of q1s
     // later we will loop over the q1s inside each batch
@@ -217,7 +1213,7 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
 
       // do prep work for all values of q1 in current batch,
       // store stuff needed for couplings later
-#pragma omp parallel for default(none) shared(v3sMinus_v, v3sPlus_v, bose3MinusData_v, bose3PlusData_v, energies3Minus_v, energies3Plus_v, ev1_v, ev3Minus_v, ev3Plus_v, q1_v, nb1_v, nb3Minus_v, nb3Plus_v, batch_size, iq1Indexes, start, pointHelper, q2Point, v1s_v, energies1_v)
+#pragma omp parallel for default(none) shared(v3sMinus_v, v3sPlus_v, bose3MinusData_v, bose3PlusData_v, energies3Minus_v, energies3Plus_v, ev1_v, ev3Minus_v, ev3Plus_v, q1_v, nb1_v, nb3Minus_v, nb3Plus_v, batch_size, iq1Indexes, start, pointHelper, q2Point, v1s_v, energies1_v, outerArrays, useDeviceQ1s)
       for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
         int iq1 = iq1Indexes[start + iq1Batch];
         WavevectorIndex iq1Index(iq1);
@@ -227,65 +1223,218 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
         // fall into known meshes and therefore needs to be computed
 
         Point q1Point = outerBandStructure.getPoint(iq1);
-        Eigen::VectorXd energies1 = outerBandStructure.getEnergies(iq1Index);
+        EnergiesView energies1 = outerArrays.getEnergies(iq1);
         auto nb1 = int(energies1.size());
-        Eigen::MatrixXd v1s = outerBandStructure.getGroupVelocities(iq1Index);
-
-        auto tup1 = pointHelper.get(q1Point, q2Point, Helper3rdState::casePlus);
-        auto tup2 =
-            pointHelper.get(q1Point, q2Point, Helper3rdState::caseMinus);
-
-        auto energies3Plus = std::get<1>(tup1);
-        auto ev3Plus = std::get<3>(tup1);
-        auto v3sPlus = std::get<4>(tup1);
-        auto bose3PlusData = std::get<5>(tup1);
+        GroupVelocitiesView v1s = outerArrays.getGroupVelocities(iq1);
 
-        auto energies3Minus = std::get<1>(tup2);
-        auto ev3Minus = std::get<3>(tup2);
-        auto v3sMinus = std::get<4>(tup2);
-        auto bose3MinusData = std::get<5>(tup2);
+        // the q3 info is written directly in the batch vectors
+        pointHelper.get(q1Point, q2Point, Helper3rdState::casePlus,
+                        energies3Plus_v[iq1Batch], ev3Plus_v[iq1Batch],
+                        v3sPlus_v[iq1Batch], bose3PlusData_v[iq1Batch]);
+        pointHelper.get(q1Point, q2Point, Helper3rdState::caseMinus,
+                        energies3Minus_v[iq1Batch], ev3Minus_v[iq1Batch],
+                        v3sMinus_v[iq1Batch], bose3MinusData_v[iq1Batch]);
 
-        q1_v[iq1Batch] = outerBandStructure.getWavevector(iq1Index);
+        q1_v[iq1Batch] = outerArrays.getWavevector(iq1);
         nb1_v[iq1Batch] = nb1;
         energies1_v[iq1Batch] = energies1;
         v1s_v[iq1Batch] = v1s;
-        nb3Plus_v[iq1Batch] = int(energies3Plus.size());
-        nb3Minus_v[iq1Batch] = int(energies3Minus.size());
-        ev1_v[iq1Batch] = outerBandStructure.getEigenvectors(iq1Index);
-        ev3Plus_v[iq1Batch] = ev3Plus;
-        ev3Minus_v[iq1Batch] = ev3Minus;
-
-        energies3Plus_v[iq1Batch] = energies3Plus;
-        v3sPlus_v[iq1Batch] = v3sPlus;
-        bose3PlusData_v[iq1Batch] = bose3PlusData;
-        energies3Minus_v[iq1Batch] = energies3Minus;
-        v3sMinus_v[iq1Batch] = v3sMinus;
-        bose3MinusData_v[iq1Batch] = bose3MinusData;
-      }
-
-      // calculate batch of couplings
-      auto tuple1 = coupling3Ph->getCouplingsSquared(
-          q1_v, q2, ev1_v, ev2, ev3Plus_v, ev3Minus_v, nb1_v, nb2, nb3Plus_v,
-          nb3Minus_v);
-      auto couplingPlus_v = std::get<0>(tuple1);
-      auto couplingMinus_v = std::get<1>(tuple1);
+        nb3Plus_v[iq1Batch] = int(energies3Plus_v[iq1Batch].size());
+        nb3Minus_v[iq1Batch] = int(energies3Minus_v[iq1Batch].size());
+        if (!useDeviceQ1s) {
+          outerBandStructure.copyEigenvectors(iq1Index, ev1_v[iq1Batch]);
+        }
+      }
+
+      // index of the q1 points of the batch, and their bands passed to the
+      // couplings (with prescreening, the vectors above are compacted to the
+      // q1 points and bands at q1 with some allowed transition)
+      std::vector<int> iq1_v(batch_size);
+      std::vector<double> weight1_v(batch_size, 1.);
+      std::vector<std::vector<int>> bands1_v(batch_size);
+      for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
+        iq1_v[iq1Batch] = iq1Indexes[start + iq1Batch];
+        if (isSampling) {
+          weight1_v[iq1Batch] = pairWeights[iPair][start + iq1Batch];
+        }
+        bands1_v[iq1Batch].resize(nb1_v[iq1Batch]);
+        std::iota(bands1_v[iq1Batch].begin(), bands1_v[iq1Batch].end(), 0);
+      }
+      if (prescreenTriplets) {
+#pragma omp parallel for
+        for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
+          WavevectorIndex iq1Index(iq1_v[iq1Batch]);
+          std::vector<bool> isActive1(nb1_v[iq1Batch]);
+          for (int ib1 = 0; ib1 < nb1_v[iq1Batch]; ib1++) {
+            int is1 = outerBandStructure.getIndex(iq1Index, BandIndex(ib1));
+            StateIndex is1Idx(is1);
+            int iBte1 = outerBandStructure.stateToBte(is1Idx).get();
+            isActive1[ib1] = std::find(excludeIndices.begin(),
+                                       excludeIndices.end(),
+                                       iBte1) == excludeIndices.end();
+          }
+          bands1_v[iq1Batch] = prescreenBands1(
+              smearing, energies1_v[iq1Batch], isActive1, energies2, v2s,
+              isActive2, energies3Plus_v[iq1Batch], v3sPlus_v[iq1Batch],
+              energies3Minus_v[iq1Batch], v3sMinus_v[iq1Batch], energyCutoff,
+              outerEqualInnerMesh);
+        }
+
+        int numKept = 0;
+        for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
+          std::vector<int> bands1 = bands1_v[iq1Batch];
+          auto nb1 = int(bands1.size());
+          if (nb1 == 0) continue;
+          if (nb1 < nb1_v[iq1Batch]) {
+            Eigen::MatrixXcd ev1(ev1_v[iq1Batch].rows(), nb1);
+            Eigen::VectorXd energies1(nb1);
+            Eigen::MatrixXd v1s(nb1, 3);
+            for (int i = 0; i < nb1; i++) {
+              if (!useDeviceQ1s) {
+                ev1.col(i) = ev1_v[iq1Batch].col(bands1[i]);
+              }
+              energies1(i) = energies1_v[iq1Batch](bands1[i]);
+              v1s.row(i) = v1s_v[iq1Batch].row(bands1[i]);
+            }
+            ev1_v[iq1Batch] = ev1;
+            energies1_v[iq1Batch] = energies1;
+            v1s_v[iq1Batch] = v1s;
+            nb1_v[iq1Batch] = nb1;
+          }
+          auto keep = [&](auto &v) { v[numKept] = std::move(v[iq1Batch]); };
+          keep(iq1_v), keep(weight1_v), keep(bands1_v), keep(q1_v), keep(ev1_v);
+          keep(energies1_v), keep(v1s_v), keep(nb1_v);
+          keep(ev3Plus_v), keep(nb3Plus_v), keep(energies3Plus_v);
+          keep(v3sPlus_v), keep(bose3PlusData_v);
+          keep(ev3Minus_v), keep(nb3Minus_v), keep(energies3Minus_v);
+          keep(v3sMinus_v), keep(bose3MinusData_v);
+          numKept++;
+        }
+        if (numKept == 0) continue;
+        auto shrink = [&](auto &v) { v.resize(numKept); };
+        shrink(iq1_v), shrink(weight1_v), shrink(bands1_v), shrink(q1_v);
+        shrink(ev1_v);
+        shrink(energies1_v), shrink(v1s_v), shrink(nb1_v);
+        shrink(ev3Plus_v), shrink(nb3Plus_v), shrink(energies3Plus_v);
+        shrink(v3sPlus_v), shrink(bose3PlusData_v);
+        shrink(ev3Minus_v), shrink(nb3Minus_v), shrink(energies3Minus_v);
+        shrink(v3sMinus_v), shrink(bose3MinusData_v);
+        batch_size = numKept;
+      }
+
+      if (useDeviceQ1s) {
+        deviceQ1s.iq1s = iq1_v;
+        deviceQ1s.bands1s = bands1_v;
+      }
+
+      if (linewidthsOnDevice) {
+        auto tupleViews =
+            useDeviceQ1s
+                ? coupling3Ph->getCouplingsSquaredViews(
+                      deviceQ1s, ev2, ev3Plus_v, ev3Minus_v, nb2, nb3Plus_v,
+                      nb3Minus_v)
+                : coupling3Ph->getCouplingsSquaredViews(
+                      q1_v, q2, ev1_v, ev2, ev3Plus_v, ev3Minus_v, nb1_v, nb2,
+                      nb3Plus_v, nb3Minus_v);
+
+        std::vector<Eigen::MatrixXd> bose1_v(batch_size);
+        std::vector<std::vector<int>> iBte1s_v(batch_size);
+        for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
+          WavevectorIndex iq1Index(iq1_v[iq1Batch]);
+          int nb1 = nb1_v[iq1Batch];
+          bose1_v[iq1Batch].resize(numCalculations, nb1);
+          for (int ib1 = 0; ib1 < nb1; ib1++) {
+            BandIndex ib1Idx(bands1_v[iq1Batch][ib1]);
+            int is1 = outerBandStructure.getIndex(iq1Index, ib1Idx);
+            StateIndex is1Idx(is1);
+            int iBte1 = outerBandStructure.stateToBte(is1Idx).get();
+            iBte1s_v[iq1Batch].push_back(iBte1);
+            bose1_v[iq1Batch].col(ib1) = outerBose.col(iBte1);
+          }
+        }
+        Eigen::MatrixXd bose2(numCalculations, nb2);
+        for (int ib2 = 0; ib2 < nb2; ib2++) {
+          int is2Irr = innerBandStructure.getIndex(iq2IrrIndex, BandIndex(ib2));
+          StateIndex is2IrrIdx(is2Irr);
+          int iBte2 = innerBandStructure.stateToBte(is2IrrIdx).get();
+          bose2.col(ib2) = innerBose.col(iBte2);
+        }
+
+        auto linewidths_v = phPhLinewidthsOnDevice(
+            std::get<0>(tupleViews), std::get<1>(tupleViews), deviceDelta,
+            energies1_v, bose1_v, energies2, v2s, bose2, isActive2,
+            energies3Plus_v, v3sPlus_v, bose3PlusData_v, energies3Minus_v,
+            v3sMinus_v, bose3MinusData_v, norm, energyCutoff,
+            outerEqualInnerMesh);
+
+        for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
+          std::vector<int> iBte1s;
+          Eigen::MatrixXd previousLinewidths;
+          if (isSampling) {
+            iBte1s = getIBte1s(iq1_v[iq1Batch]);
+            previousLinewidths = getSampledStates(linewidth, iBte1s);
+          }
+          // the states of -q1 get the linewidths of the time-reversed pair
+          int iq1Reversed =
+              std::get<0>(getTimeReversedPair(iq1_v[iq1Batch], iq2));
+          for (int ib1 = 0; ib1 < nb1_v[iq1Batch]; ib1++) {
+            int iBte1 = iBte1s_v[iq1Batch][ib1];
+            if (isExcluded(iBte1)) continue;
+            for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              linewidth->operator()(iCalc, 0, iBte1) +=
+                  linewidths_v[iq1Batch](iCalc, ib1);
+            }
+            if (iq1Reversed >= 0) {
+              StateIndex is1ReversedIdx(outerBandStructure.getIndex(
+                  WavevectorIndex(iq1Reversed),
+                  BandIndex(bands1_v[iq1Batch][ib1])));
+              int iBte1Reversed =
+                  outerBandStructure.stateToBte(is1ReversedIdx).get();
+              if (isExcluded(iBte1Reversed)) continue;
+              for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                linewidth->operator()(iCalc, 0, iBte1Reversed) +=
+                    linewidths_v[iq1Batch](iCalc, ib1);
+              }
+            }
+          }
+          if (isSampling) {
+            addSampledPair(linewidth, iBte1s, previousLinewidths,
+                           weight1_v[iq1Batch]);
+          }
+        }
+        continue;
+      }
+
+      // calculate batch of couplings, in the buffers reused by all batches
+      if (useDeviceQ1s) {
+        coupling3Ph->getCouplingsSquared(deviceQ1s, ev2, ev3Plus_v,
+                                         ev3Minus_v, nb2, nb3Plus_v,
+                                         nb3Minus_v, couplingPlus_b,
+                                         couplingMinus_b);
+      } else {
+        coupling3Ph->getCouplingsSquared(
+            q1_v, q2, ev1_v, ev2, ev3Plus_v, ev3Minus_v, nb1_v, nb2,
+            nb3Plus_v, nb3Minus_v, couplingPlus_b, couplingMinus_b);
+      }
 
 #pragma omp parallel for
       for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
+        WavevectorIndex iq1Index(iq1Indexes[start + iq1Batch]);
+        auto degGroups1 = outerBandStructure.getDegenerateGroups(iq1Index);
         symmetrizeCoupling(
-            couplingPlus_v[iq1Batch], energies1_v[iq1Batch], energies2, energies3Plus_v[iq1Batch]
-        );
+            couplingPlus_b.get(iq1Batch), degGroups1, degGroups2,
+            BaseBandStructure::findDegenerateGroups(energies3Plus_v[iq1Batch]));
         symmetrizeCoupling(
-            couplingMinus_v[iq1Batch], energies1_v[iq1Batch], energies2, energies3Minus_v[iq1Batch]
-        );
+            couplingMinus_b.get(iq1Batch), degGroups1, degGroups2,
+            BaseBandStructure::findDegenerateGroups(energies3Minus_v[iq1Batch]));
       }
 
       // do postprocessing loop with batch of couplings
       for (int iq1Batch = 0; iq1Batch < batch_size; iq1Batch++) {
-        int iq1 = iq1Indexes[start + iq1Batch];
+        int iq1 = iq1_v[iq1Batch];
         WavevectorIndex iq1Index(iq1);
-        auto couplingPlus = couplingPlus_v[iq1Batch];
-        auto couplingMinus = couplingMinus_v[iq1Batch];
+        auto couplingPlus = couplingPlus_b.get(iq1Batch);
+        auto couplingMinus = couplingMinus_b.get(iq1Batch);
         Eigen::VectorXd energies1 = energies1_v[iq1Batch];
         auto nb1 = int(energies1.size());
         Eigen::MatrixXd v1s = v1s_v[iq1Batch];
@@ -300,9 +1449,60 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
         auto v3sMinus = v3sMinus_v[iq1Batch];
         auto bose3MinusData = bose3MinusData_v[iq1Batch];
 
+        std::vector<int> iBte1s;
+        Eigen::MatrixXd previousLinewidths;
+        if (isSampling) {
+          iBte1s = getIBte1s(iq1);
+          previousLinewidths = getSampledStates(linewidth, iBte1s);
+        }
+
+        // the time-reversed pair (-q1,-q2) has the same rates
+        int iq1Reversed = std::get<0>(getTimeReversedPair(iq1, iq2));
+
+        // evaluate the gaussian smearings of the whole (nb1,nb2,nb3) blocks
+        // at once, the tetrahedron method is evaluated state by state below
+        bool isBatchedSmearing =
+            smearing->getType() != DeltaFunction::tetrahedron;
+        Eigen::VectorXd deltasPlus, deltasMinus1, deltasMinus2;
+        if (isBatchedSmearing) {
+          bool isAdaptive =
+              smearing->getType() == DeltaFunction::adaptiveGaussian;
+          auto numPlus = int(nb1 * nb2 * nb3Plus);
+          auto numMinus = int(nb1 * nb2 * nb3Minus);
+          Eigen::VectorXd enPlus(numPlus), enMinus1(numMinus),
+              enMinus2(numMinus);
+          Eigen::MatrixXd vPlus(isAdaptive ? numPlus : 0, 3);
+          Eigen::MatrixXd vMinus(isAdaptive ? numMinus : 0, 3);
+          for (int ib1 = 0; ib1 < nb1; ib1++) {
+            for (int ib2 = 0; ib2 < nb2; ib2++) {
+              for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
+                int i = int((ib1 * nb2 + ib2) * nb3Plus + ib3);
+                enPlus(i) = energies1(ib1) + energies2(ib2) - energies3Plus(ib3);
+                if (isAdaptive) {
+                  vPlus.row(i) = v2s.row(ib2) - v3sPlus.row(ib3);
+                }
+              }
+              for (int ib3 = 0; ib3 < nb3Minus; ib3++) {
+                int i = int((ib1 * nb2 + ib2) * nb3Minus + ib3);
+                enMinus1(i) =
+                    energies1(ib1) + energies3Minus(ib3) - energies2(ib2);
+                enMinus2(i) =
+                    energies2(ib2) + energies3Minus(ib3) - energies1(ib1);
+                if (isAdaptive) {
+                  vMinus.row(i) = v2s.row(ib2) - v3sMinus.row(ib3);
+                }
+              }
+            }
+          }
+          deltasPlus = smearing->getSmearings(enPlus, vPlus);
+          deltasMinus1 = smearing->getSmearings(enMinus1, vMinus);
+          deltasMinus2 = smearing->getSmearings(enMinus2, vMinus);
+        }
+
         for (int ib1 = 0; ib1 < nb1; ib1++) {
           double en1 = energies1(ib1);
-          int is1 = outerBandStructure.getIndex(iq1Index, BandIndex(ib1));
+          BandIndex ib1Idx(bands1_v[iq1Batch][ib1]);
+          int is1 = outerBandStructure.getIndex(iq1Index, ib1Idx);
           StateIndex is1Idx(is1);
           BteIndex iBte1Idx = outerBandStructure.stateToBte(is1Idx);
           int iBte1 = iBte1Idx.get();
@@ -311,6 +1511,15 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
               excludeIndices.end())
             continue;
 
+          int is1Reversed = -1;
+          int iBte1Reversed = -1;
+          if (iq1Reversed >= 0) {
+            is1Reversed =
+                outerBandStructure.getIndex(WavevectorIndex(iq1Reversed), ib1Idx);
+            StateIndex is1ReversedIdx(is1Reversed);
+            iBte1Reversed = outerBandStructure.stateToBte(is1ReversedIdx).get();
+          }
+
           for (int ib2 = 0; ib2 < nb2; ib2++) {
             double en2 = energies2(ib2);
             int is2 = innerBandStructure.getIndex(iq2Index, BandIndex(ib2));
@@ -325,6 +1534,9 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
                           iBte2) != excludeIndices.end())
               continue;
 
+            bool hasReversed = iq1Reversed >= 0 && !isExcluded(iBte1Reversed) &&
+                               !isExcluded(iBte2sReversed[ib2]);
+
             for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
 
               double en3Plus = energies3Plus(ib3);
@@ -354,12 +1566,8 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
               }
 
               double deltaPlus;
-              if (smearing->getType() == DeltaFunction::gaussian) {
-                deltaPlus = smearing->getSmearing(en1 + en2 - en3Plus);
-              } else if (smearing->getType() ==
-                         DeltaFunction::adaptiveGaussian) {
-                Eigen::Vector3d v = v2s.row(ib2) - v3sPlus.row(ib3);
-                deltaPlus = smearing->getSmearing(en1 + en2 - en3Plus, v);
+              if (isBatchedSmearing) {
+                deltaPlus = deltasPlus((ib1 * nb2 + ib2) * nb3Plus + ib3);
               } else {
                 deltaPlus = smearing->getSmearing(en3Plus - en1, is2Idx);
               }
@@ -368,89 +1576,37 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
                 continue;
               }
 
+              PhPhCouplingCache::Process process{
+                  iq1, iBte1, iBte2, true, is1 != is2Irr, en3Plus,
+                  couplingPlus(ib1, ib2, ib3) * deltaPlus * norm / enProd, 0.};
+              PhPhCouplingCache::Process processReversed;
+              if (hasReversed) {
+                processReversed = getReversedProcess(
+                    process, iq1Reversed, is1Reversed, iBte1Reversed,
+                    is2IrrsReversed[ib2], iBte2sReversed[ib2]);
+              }
+              if (recordCache) {
+                couplingCache->processes[iPair].push_back(process);
+                if (hasReversed) {
+                  couplingCache->processes[iPair].push_back(processReversed);
+                }
+              }
+
               // loop on temperature
               for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                if (isSkippedCalc[iCalc]) continue;
                 double bose1 = outerBose(iCalc, iBte1);
                 double bose2 = innerBose(iCalc, iBte2);
                 double bose3Plus = bose3PlusData(iCalc, ib3);
 
                 // Calculate transition probability W+
                 double ratePlus = pi * 0.25 * bose1 * bose2 * (bose3Plus + 1.) *
-                    couplingPlus(ib1, ib2, ib3) * deltaPlus *
-                    norm / enProd;
-
-                if (switchCase == 0) { // case of matrix construction
-                  if (context.getUseSymmetries()) {
-                    for (int i : {0, 1, 2}) {
-                      for (int j : {0, 1, 2}) {
-                        CartIndex iIndex(i);
-                        CartIndex jIndex(j);
-                        int iMat1 = getSMatrixIndex(iBte1Idx, iIndex);
-                        int iMat2 = getSMatrixIndex(iBte2Idx, jIndex);
-                        if (theMatrix.indicesAreLocal(iMat1, iMat2)) {
-                          if (i == 0 && j == 0) {
-                            linewidth->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
-                          }
-                          if (is1 != is2Irr) {
-                            theMatrix(iMat1, iMat2) +=
-                                rotation.inverse()(i, j) * ratePlus;
-                          }
-                        }
-                      }
-                    }
-                  } else {
-                    if (theMatrix.indicesAreLocal(iBte1, iBte2)) {
-                      linewidth->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
-                    }
-                    theMatrix(iBte1, iBte2) += ratePlus;
-                  }
+                    process.weight1;
 
-                } else if (switchCase == 1) { // case of matrix-vector multiplication
-                  // we build the scattering matrix A = S*n(n+1)
-                  // here we rotate the populations from the irreducible point
-                  for (unsigned int iInput = 0; iInput < inPopulations.size();
-                       iInput++) {
-                    Eigen::Vector3d inPopRot;
-                    inPopRot.setZero();
-                    for (int i : {0, 1, 2}) {
-                      for (int j : {0, 1, 2}) {
-                        inPopRot(i) += rotation.inverse()(i, j) *
-                                       inPopulations[iInput](iCalc, j, iBte2);
-                      }
-                    }
-                    for (int i : {0, 1, 2}) {
-                      if (is1 != is2Irr) {
-                        outPopulations[iInput](iCalc, i, iBte1) +=
-                            ratePlus * inPopRot(i);
-                      }
-                      outPopulations[iInput](iCalc, i, iBte1) +=
-                          0.5 * ratePlus *
-                          inPopulations[iInput](iCalc, i, iBte1);
-                    }
-                  }
-
-                } else { // case of linewidth construction
-                  linewidth->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
-                  if(outputUNTimes) {
-                    Point q1 = outerBandStructure.getPoint(iq1);
-                    Point q2 = innerBandStructure.getPoint(iq2);
-                    // check if this process is umklapp // TODO put this in hasUmklapp function
-                    Eigen::Vector3d q1Cart = q1.getCoordinates(Points::cartesianCoordinates);
-                    Eigen::Vector3d q2Cart = q2.getCoordinates(Points::cartesianCoordinates);
-                    Eigen::Vector3d q1WS = outerBandStructure.getPoints().bzToWs(q1Cart, Points::cartesianCoordinates);
-                    Eigen::Vector3d q2WS = outerBandStructure.getPoints().bzToWs(q2Cart, Points::cartesianCoordinates);
-                    Eigen::Vector3d q3Cart = q1WS + q2WS;
-                    Eigen::Vector3d q3fold = outerBandStructure.getPoints().bzToWs(q3Cart, Points::cartesianCoordinates);
-                    bool isUmklapp = false;
-                    if(abs((q3Cart-q3fold).norm()) > 1e-6) {
-                      isUmklapp = true;
-                    }
-                    if(isUmklapp) {
-                      internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
-                    } else {
-                      internalDiagonalNormal->operator()(iCalc, 0, iBte1) += 0.5 * ratePlus;
-                    }
-                  }
+                addRatePlus(process, iq2, rotationInv, iCalc, ratePlus);
+                if (hasReversed) {
+                  addRatePlus(processReversed, iq2Reversed,
+                              rotationInvReversed, iCalc, ratePlus);
                 }
               }
             }
@@ -483,14 +1639,10 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
               }
 
               double deltaMinus1, deltaMinus2;
-              if (smearing->getType() == DeltaFunction::gaussian) {
-                deltaMinus1 = smearing->getSmearing(en1 + en3Minus - en2);
-                deltaMinus2 = smearing->getSmearing(en2 + en3Minus - en1);
-              } else if (smearing->getType() ==
-                         DeltaFunction::adaptiveGaussian) {
-                Eigen::Vector3d v = v2s.row(ib2) - v3sMinus.row(ib3);
-                deltaMinus1 = smearing->getSmearing(en1 + en3Minus - en2, v);
-                deltaMinus2 = smearing->getSmearing(en2 + en3Minus - en1, v);
+              if (isBatchedSmearing) {
+                int i = int((ib1 * nb2 + ib2) * nb3Minus + ib3);
+                deltaMinus1 = deltasMinus1(i);
+                deltaMinus2 = deltasMinus2(i);
               } else {
                 // Note: here I require inner == outer band structure
                 deltaMinus1 = smearing->getSmearing(en1 + en3Minus, is2Idx);
@@ -504,7 +1656,25 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
               if (deltaMinus2 < 0.)
                 deltaMinus2 = 0.;
 
+              PhPhCouplingCache::Process process{
+                  iq1, iBte1, iBte2, false, is1 != is2Irr, en3Minus,
+                  couplingMinus(ib1, ib2, ib3) * deltaMinus1 * norm / enProd,
+                  couplingMinus(ib1, ib2, ib3) * deltaMinus2 * norm / enProd};
+              PhPhCouplingCache::Process processReversed;
+              if (hasReversed) {
+                processReversed = getReversedProcess(
+                    process, iq1Reversed, is1Reversed, iBte1Reversed,
+                    is2IrrsReversed[ib2], iBte2sReversed[ib2]);
+              }
+              if (recordCache) {
+                couplingCache->processes[iPair].push_back(process);
+                if (hasReversed) {
+                  couplingCache->processes[iPair].push_back(processReversed);
+                }
+              }
+
               for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                if (isSkippedCalc[iCalc]) continue;
                 double bose1 = outerBose(iCalc, iBte1);
                 double bose2 = innerBose(iCalc, iBte2);
                 double bose3Minus = bose3MinusData(iCalc, ib3);
@@ -512,142 +1682,210 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
                 // Calculate transition probability W-
                 double rateMinus1 =
                     pi * 0.25 * bose3Minus * bose1 * (bose2 + 1.) *
-                    couplingMinus(ib1, ib2, ib3) * deltaMinus1 * norm / enProd;
+                    process.weight1;
                 double rateMinus2 =
                     pi * 0.25 * bose2 * bose3Minus * (bose1 + 1.) *
-                    couplingMinus(ib1, ib2, ib3) * deltaMinus2 * norm / enProd;
-
-                if (switchCase == 0) { // case of matrix construction
-                  if (context.getUseSymmetries()) {
-                    for (int i : {0, 1, 2}) {
-                      for (int j : {0, 1, 2}) {
-                        CartIndex iIndex(i);
-                        CartIndex jIndex(j);
-                        int iMat1 = getSMatrixIndex(iBte1Idx, iIndex);
-                        int iMat2 = getSMatrixIndex(iBte2Idx, jIndex);
-                        if (theMatrix.indicesAreLocal(iMat1, iMat2)) {
-                          if (i == 0 && j == 0) {
-                            linewidth->operator()(iCalc, 0, iBte1) +=
-                                0.5 * (rateMinus1 + rateMinus2);
-                          }
-                          if (is1 != is2Irr) {
-                            theMatrix(iMat1, iMat2) -=
-                                rotation.inverse()(i, j) *
-                                (rateMinus1 + rateMinus2);
-                          }
-                        }
-                      }
-                    }
-                  } else {
-                    if (theMatrix.indicesAreLocal(iBte1, iBte2)) {
-                      linewidth->operator()(iCalc, 0, iBte1) +=
-                          0.5 * (rateMinus1 + rateMinus2);
-                    }
-                    theMatrix(iBte1, iBte2) -= rateMinus1 + rateMinus2;
-                  }
-
-                } else if (switchCase == 1) { // matrix-vector multiplication
-                  for (unsigned int iInput = 0; iInput < inPopulations.size();
-                       iInput++) {
-                    Eigen::Vector3d inPopRot;
-                    inPopRot.setZero();
-                    for (int i : {0, 1, 2}) {
-                      for (int j : {0, 1, 2}) {
-                        inPopRot(i) += rotation.inverse()(i, j) *
-                                       inPopulations[iInput](iCalc, j, iBte2);
-                      }
-                    }
-
-                    for (int i : {0, 1, 2}) {
-                      // off-diagonal term
-                      if (is1 != is2Irr) { // avoid double counting terms
-                        outPopulations[iInput](iCalc, i, iBte1) -=
-                            (rateMinus1 + rateMinus2) * inPopRot(i);
-                      }
-                      // diagonal term
-                      outPopulations[iInput](iCalc, i, iBte1) +=
-                          0.5 * (rateMinus1 + rateMinus2) *
-                          inPopulations[iInput](iCalc, i, iBte1);
-                    }
-                  }
-                } else {
-                  linewidth->operator()(iCalc, 0, iBte1) += 0.5 * (rateMinus1 + rateMinus2);
-                  if(outputUNTimes) {
-                    Point q1 = outerBandStructure.getPoint(iq1);
-                    Point q2 = innerBandStructure.getPoint(iq2);
-                    Eigen::Vector3d q1Cart = q1.getCoordinates(Points::cartesianCoordinates);
-                    Eigen::Vector3d q2Cart = q2.getCoordinates(Points::cartesianCoordinates);
-                    Eigen::Vector3d q1WS = outerBandStructure.getPoints().bzToWs(q1Cart, Points::cartesianCoordinates);
-                    Eigen::Vector3d q2WS = outerBandStructure.getPoints().bzToWs(q2Cart, Points::cartesianCoordinates);
-                    Eigen::Vector3d q3Cart = q1WS - q2WS;
-                    Eigen::Vector3d q3fold = outerBandStructure.getPoints().bzToWs(q3Cart, Points::cartesianCoordinates);
-                    bool isUmklapp = false;
-                    if(abs((q3Cart-q3fold).norm()) > 1e-6) {
-                      isUmklapp = true;
-                    }
-                    if(isUmklapp) {
-                      internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus1);
-                    } else {
-                      internalDiagonalNormal->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus1);
-                    }
-
-                    // check the second point
-                    Eigen::Vector3d q3Cart2 = q2WS - q1WS;
-                    Eigen::Vector3d q3fold2 = outerBandStructure.getPoints().bzToWs(q3Cart2, Points::cartesianCoordinates);
-                    isUmklapp = false;
-                    if(abs((q3Cart2-q3fold2).norm()) > 1e-6) {
-                      isUmklapp = true;
-                    }
-                    if(isUmklapp) {
-                      internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus2);
-                    } else {
-                      internalDiagonalNormal->operator()(iCalc, 0, iBte1) += 0.5*(rateMinus2);
-                    }
-                  }
+                    process.weight2;
+
+                addRateMinus(process, iq2, rotationInv, iCalc, rateMinus1,
+                             rateMinus2);
+                if (hasReversed) {
+                  addRateMinus(processReversed, iq2Reversed,
+                               rotationInvReversed, iCalc, rateMinus1,
+                               rateMinus2);
                 }
               }
             }
           }
         }
+        if (isSampling) {
+          addSampledPair(linewidth, iBte1s, previousLinewidths,
+                         weight1_v[iq1Batch]);
+        }
       }
     }
   }
 
+  if (recordCache) {
+    couplingCache->isComplete = true;
+    size_t numProcesses = 0;
+    for (const auto &pairProcesses : couplingCache->processes) {
+      numProcesses += pairProcesses.size();
+    }
+    mpi->allReduceSum(&numProcesses);
+    if (mpi->mpiHead()) {
+      double memory = double(numProcesses) *
+                      sizeof(PhPhCouplingCache::Process) / pow(1024., 3);
+      std::cout << "Cached " << numProcesses << " ph-ph processes ("
+                << std::setprecision(4) << memory << " GB)." << std::endl;
+    }
+  }
+
   // Isotope scattering
+  // with the gaussian smearing schemes, the overlaps of the eigenvectors and
+  // the smearing are computed on the device, for all the q1 of a pair
+  bool doIsotopesOnDevice =
+      smearing->getType() == DeltaFunction::gaussian ||
+      smearing->getType() == DeltaFunction::adaptiveGaussian;
   if (doIsotopes) {
-    for (auto tup : qPairIterator) {
+    DeviceDeltaFunction isotopeDelta;
+    if (doIsotopesOnDevice) {
+      isotopeDelta = smearing->getDeviceDeltaFunction();
+    }
+    // adds the rate of an isotope process to the scattering matrix, the
+    // matrix-vector product, or the linewidths, depending on switchCase
+    auto addRateIso = [&](const int &iCalc, const int &iq1, const int &iq2,
+                          const int &iBte1, const int &iBte2,
+                          const bool &isOffDiagonal,
+                          const Eigen::Matrix3d &rotationInv,
+                          const double &rateIso) {
+      if (switchCase == 0) { // case of matrix construction
+        if (context.getUseSymmetries()) {
+          BteIndex iBte1Idx(iBte1);
+          BteIndex iBte2Idx(iBte2);
+          for (int i : {0, 1, 2}) {
+            CartIndex iIndex(i);
+            int iMat1 = getSMatrixIndex(iBte1Idx, iIndex);
+            for (int j : {0, 1, 2}) {
+              CartIndex jIndex(j);
+              int iMat2 = getSMatrixIndex(iBte2Idx, jIndex);
+              if (matrixElementIsLocal(iMat1, iMat2)) {
+                if (i == 0 && j == 0) {
+                  linewidth->operator()(iCalc, 0, iBte1) += rateIso;
+                }
+                if (isOffDiagonal) {
+                  addToMatrix(iMat1, iMat2,
+                              -rotationInv(i, j) * rateIso);
+                }
+              }
+            }
+          }
+        } else {
+          if (matrixElementIsLocal(iBte1, iBte2)) {
+            linewidth->operator()(iCalc, 0, iBte1) += rateIso;
+            addToMatrix(iBte1, iBte2, -rateIso);
+          }
+        }
+
+      } else if (switchCase == 1) { // case of matrix-vector multiplication
+        for (unsigned int iInput = 0; iInput < inPopulations.size(); iInput++) {
+
+          // here we rotate the populations from the irreducible point
+          Eigen::Vector3d inPopRot;
+          inPopRot.setZero();
+          for (int i : {0, 1, 2}) {
+            for (int j : {0, 1, 2}) {
+              inPopRot(i) += rotationInv(i, j) *
+                             inPopulations[iInput](iCalc, j, iBte2);
+            }
+          }
+          for (int i : {0, 1, 2}) {
+            if (isOffDiagonal) {
+              // off diagonals
+              outPopulations[iInput](iCalc, i, iBte1) -=
+                  rateIso * inPopRot(i);
+            } // diagonals
+            outPopulations[iInput](iCalc, i, iBte1) +=
+                rateIso * inPopulations[iInput](iCalc, i, iBte1);
+          }
+        }
+
+      } else { // case of linewidth construction
+        linewidth->operator()(iCalc, 0, iBte1) += rateIso;
+        if(outputUNTimes) {
+          Point q1 = outerBandStructure.getPoint(iq1);
+          Point q2 = innerBandStructure.getPoint(iq2);
+          // check if this process is umklapp // TODO put this in hasUmklapp function
+          Eigen::Vector3d q1Cart = q1.getCoordinates(Points::cartesianCoordinates);
+          Eigen::Vector3d q2Cart = q2.getCoordinates(Points::cartesianCoordinates);
+          Eigen::Vector3d q1WS = outerBandStructure.getPoints().bzToWs(q1Cart, Points::cartesianCoordinates);
+          Eigen::Vector3d q2WS = outerBandStructure.getPoints().bzToWs(q2Cart, Points::cartesianCoordinates);
+          Eigen::Vector3d q3Cart = q1WS + q2WS;
+          Eigen::Vector3d q3fold = outerBandStructure.getPoints().bzToWs(q3Cart, Points::cartesianCoordinates);
+          bool isUmklapp = false;
+          if(abs((q3Cart-q3fold).norm()) > 1e-6) {
+            isUmklapp = true;
+          }
+          if(isUmklapp) {
+            internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += rateIso;
+          } else {
+            internalDiagonalNormal->operator()(iCalc, 0, iBte1) += rateIso;
+          }
+        }
+      }
+    };
+
+    for (int iPair = 0; iPair < numPairs; iPair++) {
+      auto tup = qPairIterator[iPair];
       auto iq1Indexes = std::get<0>(tup);
       int iq2 = std::get<1>(tup);
+      if (iq2 < 0) continue;
 
       WavevectorIndex iq2Index(iq2);
-      Eigen::VectorXd state2Energies = innerBandStructure.getEnergies(iq2Index);
+      double norm = innerPoints.getWeight(iq2);
+      EnergiesView state2Energies = innerArrays.getEnergies(iq2);
       auto nb2 = int(state2Energies.size());
-      Eigen::Tensor<std::complex<double>, 3> ev2 =
-          innerBandStructure.getPhEigenvectors(iq2Index);
-      Eigen::MatrixXd v2s = innerBandStructure.getGroupVelocities(iq2Index);
-
-      auto q2 = innerBandStructure.getPoint(iq2).getCoordinates(
-          Points::cartesianCoordinates);
+      Eigen::Tensor<std::complex<double>, 3> ev2;
+
+      std::vector<Eigen::MatrixXd> isotopeWeights;
+      if (doIsotopesOnDevice) {
+        std::vector<Eigen::VectorXd> energies1_v;
+        std::vector<Eigen::MatrixXd> v1s_v;
+        std::vector<Eigen::MatrixXcd> ev1s_v;
+        for (auto iq1 : iq1Indexes) {
+          WavevectorIndex iq1Index(iq1);
+          energies1_v.emplace_back(outerArrays.getEnergies(iq1));
+          v1s_v.emplace_back(outerArrays.getGroupVelocities(iq1));
+          ev1s_v.emplace_back();
+          outerBandStructure.copyEigenvectors(iq1Index, ev1s_v.back());
+        }
+        isotopeWeights = isotopeWeightsOnDevice(
+            isotopeDelta, massVariance, energies1_v, v1s_v, ev1s_v,
+            state2Energies, innerBandStructure.getEigenvectors(iq2Index),
+            norm);
+      } else {
+        ev2 = innerBandStructure.getPhEigenvectors(iq2Index);
+      }
 
-      auto t = innerBandStructure.getRotationToIrreducible(
-          q2, Points::cartesianCoordinates);
-      // rotation such that
+      auto t = innerBandStructure.getRotationIndexToIrreducible(iq2Index);
+      // rotation such that q2 = rotationInv * q2Irr
       int iq2Irr = std::get<0>(t);
-      Eigen::Matrix3d rotation = std::get<1>(t);
+      const Eigen::Matrix3d &rotationInv =
+          innerBandStructure.getRotationMatrix(std::get<1>(t));
+
+      // the states of -q2, for the time-reversed pairs (-q1,-q2)
+      int iq2Reversed =
+          timeReversedInnerPoints.empty() ? -1 : timeReversedInnerPoints[iq2];
+      std::vector<int> is2IrrsReversed, iBte2sReversed;
+      Eigen::Matrix3d rotationInvReversed = Eigen::Matrix3d::Identity();
+      if (iq2Reversed >= 0) {
+        getReversedStates(iq2Reversed, is2IrrsReversed, iBte2sReversed,
+                          rotationInvReversed);
+      }
 
-      for (auto iq1 : iq1Indexes) {
+      for (int iiq1 = 0; iiq1 < int(iq1Indexes.size()); iiq1++) {
+        int iq1 = iq1Indexes[iiq1];
         WavevectorIndex iq1Index(iq1);
 
         // note: for computing linewidths on a path, we must distinguish
         // that q1 and q2 are on different meshes, and that q3+/- may not
         // fall into known meshes and therefore needs to be computed
 
-        Eigen::VectorXd state1Energies =
-            outerBandStructure.getEnergies(iq1Index);
+        EnergiesView state1Energies = outerArrays.getEnergies(iq1);
         auto nb1 = int(state1Energies.size());
-        Eigen::Tensor<std::complex<double>, 3> ev1 =
-            outerBandStructure.getPhEigenvectors(iq1Index);
-        Eigen::MatrixXd v1s = outerBandStructure.getGroupVelocities(iq1Index);
+
+        // with sampled partners, the isotope rates are weighted as well
+        std::vector<int> iBte1s;
+        Eigen::MatrixXd previousLinewidths;
+        if (isSampling) {
+          iBte1s = getIBte1s(iq1);
+          previousLinewidths = getSampledStates(linewidth, iBte1s);
+        }
+        Eigen::Tensor<std::complex<double>, 3> ev1;
+        if (!doIsotopesOnDevice) {
+          ev1 = outerBandStructure.getPhEigenvectors(iq1Index);
+        }
+        int iq1Reversed = std::get<0>(getTimeReversedPair(iq1, iq2));
 
         for (int ib1 = 0; ib1 < nb1; ib1++) {
           double en1 = state1Energies(ib1);
@@ -664,6 +1902,15 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
             continue;
           }
 
+          int is1Reversed = -1;
+          int iBte1Reversed = -1;
+          if (iq1Reversed >= 0) {
+            is1Reversed = outerBandStructure.getIndex(
+                WavevectorIndex(iq1Reversed), BandIndex(ib1));
+            StateIndex is1ReversedIdx(is1Reversed);
+            iBte1Reversed = outerBandStructure.stateToBte(is1ReversedIdx).get();
+          }
+
           for (int ib2 = 0; ib2 < nb2; ib2++) {
             double en2 = state2Energies(ib2);
             int is2Irr = innerBandStructure.getIndex(WavevectorIndex(iq2Irr),
@@ -681,117 +1928,54 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
             if (en2 < energyCutoff) {
               continue;
             }
-
-            double deltaIso;
-            if (smearing->getType() == DeltaFunction::gaussian) {
-              deltaIso = smearing->getSmearing(en1 - en2);
-            } else if (smearing->getType() == DeltaFunction::adaptiveGaussian) {
-              deltaIso = smearing->getSmearing(en1 - en2, v2s.row(ib2));
-              deltaIso = smearing->getSmearing(en1 - en2, v1s.row(ib1));
-              deltaIso *= 0.5;
-            } else {
-              deltaIso = smearing->getSmearing(en1, is2Idx);
-            }
+            bool hasReversed = iq1Reversed >= 0 && !isExcluded(iBte1Reversed) &&
+                               !isExcluded(iBte2sReversed[ib2]);
 
             double termIso = 0.;
-            for (int iat = 0; iat < numAtoms; iat++) {
-              std::complex<double> zzIso = complexZero;
-              for (int kDim : {0, 1, 2}) { // cartesian indices
-                zzIso += std::conj(ev1(kDim, iat, ib1)) * ev2(kDim, iat, ib2);
+            if (doIsotopesOnDevice) {
+              termIso = isotopeWeights[iiq1](ib1, ib2);
+            } else {
+              double deltaIso = smearing->getSmearing(en1, is2Idx);
+              for (int iat = 0; iat < numAtoms; iat++) {
+                std::complex<double> zzIso = complexZero;
+                for (int kDim : {0, 1, 2}) { // cartesian indices
+                  zzIso += std::conj(ev1(kDim, iat, ib1)) * ev2(kDim, iat, ib2);
+                }
+                termIso += std::norm(zzIso) * massVariance(iat);
               }
-              termIso += std::norm(zzIso) * massVariance(iat);
+              termIso *= pi * 0.5 * norm * en1 * en2 * deltaIso;
             }
-            termIso *= pi * 0.5 * norm * en1 * en2 * deltaIso;
 
 
             for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              if (isSkippedCalc[iCalc]) continue;
               double bose1 = outerBose(iCalc, iBte1);
               double bose2 = innerBose(iCalc, iBte2);
 
               double rateIso =
                   termIso * (bose1 * bose2 + 0.5 * (bose1 + bose2));
 
-              if (switchCase == 0) { // case of matrix construction
-                if (context.getUseSymmetries()) {
-                  BteIndex iBte1Idx(iBte1);
-                  BteIndex iBte2Idx(iBte2);
-                  for (int i : {0, 1, 2}) {
-                    CartIndex iIndex(i);
-                    int iMat1 = getSMatrixIndex(iBte1Idx, iIndex);
-                    for (int j : {0, 1, 2}) {
-                      CartIndex jIndex(j);
-                      int iMat2 = getSMatrixIndex(iBte2Idx, jIndex);
-                      if (theMatrix.indicesAreLocal(iMat1, iMat2)) {
-                        if (i == 0 && j == 0) {
-                          linewidth->operator()(iCalc, 0, iBte1) += rateIso;
-                        }
-                        if (is1 != is2Irr) {
-                          theMatrix(iMat1, iMat2) -=
-                              rotation.inverse()(i, j) * rateIso;
-                        }
-                      }
-                    }
-                  }
-                } else {
-                  if (theMatrix.indicesAreLocal(iBte1, iBte2)) {
-                    linewidth->operator()(iCalc, 0, iBte1) += rateIso;
-                    theMatrix(iBte1, iBte2) -= rateIso;
-                  }
-                }
-
-              } else if (switchCase == 1) { // case of matrix-vector multiplication
-                for (unsigned int iInput = 0; iInput < inPopulations.size(); iInput++) {
-
-                  // here we rotate the populations from the irreducible point
-                  Eigen::Vector3d inPopRot;
-                  inPopRot.setZero();
-                  for (int i : {0, 1, 2}) {
-                    for (int j : {0, 1, 2}) {
-                      inPopRot(i) += rotation.inverse()(i, j) *
-                                     inPopulations[iInput](iCalc, j, iBte2);
-                    }
-                  }
-                  for (int i : {0, 1, 2}) {
-                    if (is1 != is2Irr) {
-	              // off diagonals
-                      outPopulations[iInput](iCalc, i, iBte1) -=
-                          rateIso * inPopRot(i);
-                    } // diagonals
-                    outPopulations[iInput](iCalc, i, iBte1) +=
-                        rateIso * inPopulations[iInput](iCalc, i, iBte1);
-                  }
-                }
-
-              } else { // case of linewidth construction
-                linewidth->operator()(iCalc, 0, iBte1) += rateIso;
-                if(outputUNTimes) {
-                  Point q1 = outerBandStructure.getPoint(iq1);
-                  Point q2 = innerBandStructure.getPoint(iq2);
-                  // check if this process is umklapp // TODO put this in hasUmklapp function
-                  Eigen::Vector3d q1Cart = q1.getCoordinates(Points::cartesianCoordinates);
-                  Eigen::Vector3d q2Cart = q2.getCoordinates(Points::cartesianCoordinates);
-                  Eigen::Vector3d q1WS = outerBandStructure.getPoints().bzToWs(q1Cart, Points::cartesianCoordinates);
-                  Eigen::Vector3d q2WS = outerBandStructure.getPoints().bzToWs(q2Cart, Points::cartesianCoordinates);
-                  Eigen::Vector3d q3Cart = q1WS + q2WS;
-                  Eigen::Vector3d q3fold = outerBandStructure.getPoints().bzToWs(q3Cart, Points::cartesianCoordinates);
-                  bool isUmklapp = false;
-                  if(abs((q3Cart-q3fold).norm()) > 1e-6) {
-                    isUmklapp = true;
-                  }
-                  if(isUmklapp) {
-                    internalDiagonalUmklapp->operator()(iCalc, 0, iBte1) += rateIso;
-                  } else {
-                    internalDiagonalNormal->operator()(iCalc, 0, iBte1) += rateIso;
-                  }
-                }
+              addRateIso(iCalc, iq1, iq2, iBte1, iBte2, is1 != is2Irr,
+                         rotationInv, rateIso);
+              if (hasReversed) {
+                addRateIso(iCalc, iq1Reversed, iq2Reversed, iBte1Reversed,
+                           iBte2sReversed[ib2],
+                           is1Reversed != is2IrrsReversed[ib2],
+                           rotationInvReversed, rateIso);
               }
             }
           }
         }
+        if (isSampling) {
+          addSampledPair(linewidth, iBte1s, previousLinewidths,
+                         pairWeights[iPair][iiq1]);
+        }
       }
     }
   }
 
+  loopPrint.endLocalWork();
+
   if (switchCase == 1) {
     for (auto & outPopulation : outPopulations) {
       mpi->allReduceSum(&outPopulation.data);
@@ -802,32 +1986,67 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
       mpi->allReduceSum(&internalDiagonalUmklapp->data);
       mpi->allReduceSum(&internalDiagonalNormal->data);
     }
+    if (isSampling) {
+      mpi->allReduceSum(&linewidthVariance->data);
+    }
   }
   // I prefer to close loopPrint after the MPI barrier: all MPI are synced here
   loopPrint.close();
+  recordBuilderSample(loopStartTime, numPairsDone, lastPair, numPairs);
+  if (switchCase != 1) {
+    removeBuilderCheckpoint();
+  }
 
   // Average over degenerate eigenstates.
   // we turn it off for now and leave the code if needed in the future
   if (switchCase == 2) {
     degeneracyAveragingLinewidths(linewidth);
+    if (isSampling) {
+      degeneracyAveragingLinewidths(linewidthVariance.get());
+    }
     if(outputUNTimes) {
       degeneracyAveragingLinewidths(internalDiagonalUmklapp.get());
       degeneracyAveragingLinewidths(internalDiagonalNormal.get());
     }
   }
 
+  // Add 4-phonon scattering, to the diagonal of the scattering matrix.
+  // The linewidths don't change with the populations, so they are computed
+  // once and reused by the later calls to the builder
+  if (coupling4Ph != nullptr) {
+    if (phPh4Linewidths == nullptr) {
+      phPh4Linewidths =
+          std::make_unique<VectorBTE>(computePhPh4Linewidths(energyCutoff));
+    }
+    for (int iBte1 = 0; iBte1 < numStates; iBte1++) {
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        double rate = phPh4Linewidths->operator()(iCalc, 0, iBte1);
+        if (switchCase == 1) { // case of matrix-vector multiplication
+          for (unsigned int iVec = 0; iVec < inPopulations.size(); iVec++) {
+            for (int i = 0; i < 3; i++) {
+              outPopulations[iVec](iCalc, i, iBte1) +=
+                  rate * inPopulations[iVec](iCalc, i, iBte1);
+            }
+          }
+        } else { // case of matrix or linewidth construction
+          linewidth->operator()(iCalc, 0, iBte1) += rate;
+        }
+      }
+    }
+  }
+
   // Add boundary scattering
   if (doBoundary) {
     std::vector<int> is1s = outerBandStructure.irrStateIterator();
     int nis1s = is1s.size();
 #pragma omp parallel for default(none)                                         \
     shared(inPopulations, outPopulations, innerBose, particle, linewidth,      \
-           switchCase, numCalculations, nis1s, is1s)
+           switchCase, numCalculations, nis1s, is1s, outerArrays)
     for(int iis1 = 0; iis1 < nis1s; iis1++){
       int is1 = is1s[iis1];
       StateIndex is1Idx(is1);
-      double energy = outerBandStructure.getEnergy(is1Idx);
-      auto vel = outerBandStructure.getGroupVelocity(is1Idx);
+      double energy = outerArrays.getEnergy(is1);
+      Eigen::Vector3d vel = outerArrays.getGroupVelocity(is1);
       int iBte1 = outerBandStructure.stateToBte(is1Idx).get();
 
       if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte1) !=
@@ -867,6 +2086,9 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
     if (context.getUseSymmetries()) {
       for (auto iBte1 : excludeIndices) {
         linewidth->data.col(iBte1).setZero();
+        if (isSparse) {
+          continue; // excluded states are skipped by sparseDot()
+        }
         for (auto iBte2 : excludeIndices) {
           for (int i : {0, 1, 2}) {
             for (int j : {0, 1, 2}) {
@@ -884,6 +2106,9 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
     } else {
       for (auto iBte1 : excludeIndices) {
         linewidth->data.col(iBte1).setZero();
+        if (isSparse) {
+          continue; // excluded states are skipped by sparseDot()
+        }
         for (auto iBte2 : excludeIndices) {
           theMatrix(iBte1, iBte2) = 0.;
         }
@@ -901,13 +2126,17 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
     // case of linewidth construction
     for (auto iBte1 : excludeIndices) {
       linewidth->data.col(iBte1).setZero();
+      if (isSampling) {
+        linewidthVariance->data.col(iBte1).setZero();
+      }
       // TODO may need to toss U and N indices here?
     }
   }
 
   // we place the linewidths back in the diagonal of the scattering matrix
   // this because we may need an MPI_allReduce on the linewidths
-  if (switchCase == 0) { // case of matrix construction
+  // (the sparse matrix doesn't store the diagonal, which is the linewidth)
+  if (switchCase == 0 && !isSparse) { // case of matrix construction
     int iCalc = 0;
     if (context.getUseSymmetries()) {
       // numStates is defined in scattering.cpp as # of irrStates
@@ -933,3 +2162,263 @@ void PhScatteringMatrix::builder(VectorBTE *linewidth,
     }
   }
 }
+
+VectorBTE PhScatteringMatrix::computePhPh4Linewidths(
+    const double &energyCutoff) {
+  Kokkos::Profiling::pushRegion("computePhPh4Linewidths");
+
+  if (smearing->getType() != DeltaFunction::gaussian &&
+      smearing->getType() != DeltaFunction::adaptiveGaussian) {
+    Error("4-phonon scattering is only implemented with gaussian or "
+          "adaptive gaussian smearing");
+  }
+  bool isAdaptive = smearing->getType() == DeltaFunction::adaptiveGaussian;
+
+  VectorBTE linewidth4(statisticsSweep, outerBandStructure, 1);
+  auto particle = outerBandStructure.getParticle();
+  int numCalculations = statisticsSweep.getNumCalculations();
+  double norm = 1. / context.getQMesh().prod();
+  bool outerEqualInnerMesh = &innerBandStructure == &outerBandStructure;
+
+  // harmonic properties of the phonons at one wavevector
+  struct PhononInfo {
+    Eigen::Vector3d crystalCoordinates;
+    Eigen::Vector3d cartesianCoordinates;
+    Eigen::VectorXd energies;
+    Eigen::MatrixXcd eigenvectors;
+    Eigen::MatrixXd velocities;
+    Eigen::MatrixXd bose;
+  };
+  auto setBose = [&](PhononInfo &info) {
+    info.bose.resize(numCalculations, info.energies.size());
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+      for (int ib = 0; ib < int(info.energies.size()); ib++) {
+        info.bose(iCalc, ib) = particle.getPopulation(
+            info.energies(ib), calcStat.temperature, calcStat.chemicalPotential);
+      }
+    }
+  };
+  auto getInfo = [&](BaseBandStructure &bandStructure, const int &iq) {
+    PhononInfo info;
+    WavevectorIndex iqIndex(iq);
+    info.crystalCoordinates = bandStructure.getPoint(iq).getCoordinates(
+        Points::crystalCoordinates);
+    info.cartesianCoordinates = bandStructure.getPoint(iq).getCoordinates(
+        Points::cartesianCoordinates);
+    info.energies = bandStructure.getEnergies(iqIndex);
+    info.eigenvectors = bandStructure.getEigenvectors(iqIndex);
+    // velocities are only needed by the adaptive smearing
+    if (isAdaptive) {
+      info.velocities = bandStructure.getGroupVelocities(iqIndex);
+    } else {
+      info.velocities = Eigen::MatrixXd::Zero(info.energies.size(), 3);
+    }
+    setBose(info);
+    return info;
+  };
+  // q4 is looked up on the inner grid if possible, otherwise computed by h0
+  Points innerPoints = innerBandStructure.getPoints();
+  auto getQ4Info = [&](const Eigen::Vector3d &q4Crystal) {
+    if (outerEqualInnerMesh) {
+      int iq4 = innerBandStructure.getPointIndex(q4Crystal, true);
+      if (iq4 >= 0) {
+        return getInfo(innerBandStructure, iq4);
+      }
+    }
+    PhononInfo info;
+    info.crystalCoordinates = q4Crystal;
+    info.cartesianCoordinates = innerPoints.crystalToCartesian(q4Crystal);
+    Eigen::Vector3d q4 = info.cartesianCoordinates;
+    auto tup = h0->diagonalizeFromCoordinates(q4);
+    info.energies = std::get<0>(tup);
+    info.eigenvectors = std::get<1>(tup);
+    int nb4 = int(info.energies.size());
+    info.velocities = Eigen::MatrixXd::Zero(nb4, 3);
+    if (isAdaptive) {
+      Eigen::Tensor<std::complex<double>, 3> v4s =
+          h0->diagonalizeVelocityFromCoordinates(q4);
+      for (int i : {0, 1, 2}) {
+        for (int ib4 = 0; ib4 < nb4; ib4++) {
+          info.velocities(ib4, i) = v4s(ib4, ib4, i).real();
+        }
+      }
+    }
+    setBose(info);
+    return info;
+  };
+
+  // the states at q1 are the irreducible states of the outer band structure
+  std::vector<int> q1Indexes = outerBandStructure.irrPointsIterator();
+  std::vector<PhononInfo> q1Infos;
+  std::vector<std::vector<int>> q1Btes;
+  for (int iq1 : q1Indexes) {
+    q1Infos.push_back(getInfo(outerBandStructure, iq1));
+    std::vector<int> iBtes;
+    for (int ib1 = 0; ib1 < int(q1Infos.back().energies.size()); ib1++) {
+      int is1 = outerBandStructure.getIndex(WavevectorIndex(iq1),
+                                            BandIndex(ib1));
+      StateIndex is1Idx(is1);
+      int iBte1 = outerBandStructure.stateToBte(is1Idx).get();
+      // the excluded states are marked with -1
+      if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte1) !=
+              excludeIndices.end() ||
+          q1Infos.back().energies(ib1) < energyCutoff) {
+        iBte1 = -1;
+      }
+      iBtes.push_back(iBte1);
+    }
+    q1Btes.push_back(iBtes);
+  }
+
+  // the delta function of a quartet of states, with x = E1 + s2 E2 + s3 E3 - E4.
+  // Note: the gaussian is evaluated at |x|, as getSmearing() only cuts the
+  // tail at positive energies
+  auto getDelta = [&](const double &x, const Eigen::Vector3d &v3,
+                      const Eigen::Vector3d &v4) {
+    if (isAdaptive) {
+      return smearing->getSmearing(std::abs(x), v3 - v4);
+    }
+    return smearing->getSmearing(std::abs(x));
+  };
+
+  // the cost of a q2 point scales with its number of bands, which varies
+  // when the band structure is filtered by an energy window
+  int numInnerPoints = innerBandStructure.getNumPoints();
+  std::vector<double> q2Costs(numInnerPoints);
+  for (int iq2 = 0; iq2 < numInnerPoints; iq2++) {
+    WavevectorIndex iq2Idx(iq2);
+    q2Costs[iq2] = innerBandStructure.getNumBands(iq2Idx);
+  }
+  std::vector<size_t> iq2s = mpi->divideWorkIterWeighted(q2Costs);
+  LoopPrint loopPrint4("computing 4-phonon scattering", "q-points",
+                       int(iq2s.size()));
+  for (size_t iq2 : iq2s) {
+    loopPrint4.update();
+    PhononInfo info2 = getInfo(innerBandStructure, int(iq2));
+    auto nb2 = int(info2.energies.size());
+    coupling4Ph->cacheD4(info2.cartesianCoordinates);
+
+    for (int iq3 = 0; iq3 < numInnerPoints; iq3++) {
+      PhononInfo info3 = getInfo(innerBandStructure, iq3);
+      auto nb3 = int(info3.energies.size());
+      coupling4Ph->cacheD4Q3(info3.cartesianCoordinates);
+
+      for (int processType : {Interaction4Ph::plusPlus,
+                              Interaction4Ph::plusMinus,
+                              Interaction4Ph::minusMinus}) {
+        auto signs = Interaction4Ph::getProcessSigns(processType);
+        int s2 = std::get<0>(signs);
+        int s3 = std::get<1>(signs);
+        // the combinatorial factors of the three kinds of processes
+        double factor = processType == Interaction4Ph::minusMinus ? 1. / 6.
+                                                                   : 0.5;
+
+        // prescreening: keep the q1 points with at least one quartet of
+        // states that satisfies the energy conservation
+        std::vector<int> iq1sKept;
+        std::vector<PhononInfo> q4Infos;
+        for (int iq1 = 0; iq1 < int(q1Indexes.size()); iq1++) {
+          const PhononInfo &info1 = q1Infos[iq1];
+          Eigen::Vector3d q4Crystal = info1.crystalCoordinates +
+                                      s2 * info2.crystalCoordinates +
+                                      s3 * info3.crystalCoordinates;
+          PhononInfo info4 = getQ4Info(q4Crystal);
+          auto nb4 = int(info4.energies.size());
+          bool isKept = false;
+          for (int ib1 = 0; ib1 < int(info1.energies.size()) && !isKept;
+               ib1++) {
+            if (q1Btes[iq1][ib1] < 0) continue;
+            for (int ib2 = 0; ib2 < nb2 && !isKept; ib2++) {
+              if (info2.energies(ib2) < energyCutoff) continue;
+              for (int ib3 = 0; ib3 < nb3 && !isKept; ib3++) {
+                if (info3.energies(ib3) < energyCutoff) continue;
+                for (int ib4 = 0; ib4 < nb4 && !isKept; ib4++) {
+                  if (info4.energies(ib4) < energyCutoff) continue;
+                  double x = info1.energies(ib1) + s2 * info2.energies(ib2) +
+                             s3 * info3.energies(ib3) - info4.energies(ib4);
+                  isKept = getDelta(x, info3.velocities.row(ib3),
+                                    info4.velocities.row(ib4)) > 0.;
+                }
+              }
+            }
+          }
+          if (isKept) {
+            iq1sKept.push_back(iq1);
+            q4Infos.push_back(info4);
+          }
+        }
+        auto nq1 = int(iq1sKept.size());
+        if (nq1 == 0) continue;
+
+        int numBatches = coupling4Ph->estimateNumBatches(nq1, nb2, nb3);
+        for (int iBatch = 0; iBatch < numBatches; iBatch++) {
+          int start = nq1 * iBatch / numBatches;
+          int end = nq1 * (iBatch + 1) / numBatches;
+          int batchSize = end - start;
+
+          std::vector<Eigen::Vector3d> q1s(batchSize);
+          std::vector<Eigen::MatrixXcd> ev1s(batchSize), ev4s(batchSize);
+          for (int i = 0; i < batchSize; i++) {
+            q1s[i] = q1Infos[iq1sKept[start + i]].cartesianCoordinates;
+            ev1s[i] = q1Infos[iq1sKept[start + i]].eigenvectors;
+            ev4s[i] = q4Infos[start + i].eigenvectors;
+          }
+          auto couplings = coupling4Ph->getCouplingsSquared(
+              processType, q1s, ev1s, info2.eigenvectors, info3.eigenvectors,
+              ev4s);
+
+          for (int i = 0; i < batchSize; i++) {
+            int iq1 = iq1sKept[start + i];
+            const PhononInfo &info1 = q1Infos[iq1];
+            const PhononInfo &info4 = q4Infos[start + i];
+            const Eigen::Tensor<double, 4> &coupling = couplings[i];
+            auto nb4 = int(info4.energies.size());
+            for (int ib1 = 0; ib1 < int(info1.energies.size()); ib1++) {
+              int iBte1 = q1Btes[iq1][ib1];
+              if (iBte1 < 0) continue;
+              double en1 = info1.energies(ib1);
+              for (int ib2 = 0; ib2 < nb2; ib2++) {
+                double en2 = info2.energies(ib2);
+                if (en2 < energyCutoff) continue;
+                for (int ib3 = 0; ib3 < nb3; ib3++) {
+                  double en3 = info3.energies(ib3);
+                  if (en3 < energyCutoff) continue;
+                  for (int ib4 = 0; ib4 < nb4; ib4++) {
+                    double en4 = info4.energies(ib4);
+                    if (en4 < energyCutoff) continue;
+                    double delta = getDelta(en1 + s2 * en2 + s3 * en3 - en4,
+                                            info3.velocities.row(ib3),
+                                            info4.velocities.row(ib4));
+                    if (delta <= 0.) continue;
+
+                    // the temperature-independent part of the rate
+                    double weight = 0.5 * factor * pi * 0.125 *
+                                    coupling(ib1, ib2, ib3, ib4) * delta *
+                                    norm * norm / (en1 * en2 * en3 * en4);
+                    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                      double n1 = info1.bose(iCalc, ib1);
+                      double n2 = info2.bose(iCalc, ib2);
+                      double n3 = info3.bose(iCalc, ib3);
+                      double n4 = info4.bose(iCalc, ib4);
+                      double f2 = s2 > 0 ? n2 : n2 + 1.;
+                      double f3 = s3 > 0 ? n3 : n3 + 1.;
+                      linewidth4(iCalc, 0, iBte1) +=
+                          weight * n1 * f2 * f3 * (n4 + 1.);
+                    }
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  loopPrint4.close();
+
+  mpi->allReduceSum(&linewidth4.data);
+  degeneracyAveragingLinewidths(&linewidth4);
+  Kokkos::Profiling::popRegion();
+  return linewidth4;
+}
@@ -2,9 +2,71 @@
 #define PH_SCATTERING_H
 
 #include "interaction_3ph.h"
+#include "interaction_4ph.h"
 #include "phonon_h0.h"
 #include "scattering.h"
 #include "vector_bte.h"
+#include <memory>
+
+/** Storage of the temperature-independent part of the 3-phonon transition
+ * rates, which can be reused by later builds of the phonon scattering matrix.
+ * The rate of a process is W = pi/4 * (Bose factors) * weight, where
+ * weight = |V3|^2 delta(E) / (N_q E1 E2 E3) only depends on the phonon
+ * wavevectors and modes, so that only the Bose factors must be recomputed for
+ * a new temperature. Only processes passing the energy cutoffs and with a
+ * non-zero delta function are stored.
+ *
+ * The cache is valid for the same band structures and smearing, and for the
+ * same distribution of wavevector pairs over MPI processes, which is checked
+ * comparing the iterator over wavevector pairs.
+ */
+struct PhPhCouplingCache {
+  struct Process {
+    int iq1;
+    int iBte1;
+    int iBte2;
+    bool isPlus;        // (1+2)->3 if true, (1+3)->2 and (3+2)->1 otherwise
+    bool isOffDiagonal; // false if state 1 and (irreducible) state 2 coincide
+    double energy3;
+    double weight1;     // weight of the plus, or of the first minus process
+    double weight2;     // weight of the second minus process
+    bool isReversed = false; // process of the time-reversed pair (-q1,-q2)
+  };
+
+  // iterator over pairs of wavevectors used when filling the cache
+  std::vector<std::tuple<std::vector<int>, int>> qPairIterator;
+  // processes, grouped by index of the wavevector pair
+  std::vector<std::vector<Process>> processes;
+  // true when all the wavevector pairs have been stored
+  bool isComplete = false;
+};
+
+/** Computes, with Kokkos kernels, the contribution of a batch of q1 points
+ * (at fixed q2) to the ph-ph linewidths of the states at q1.
+ * It's the same calculation done by the loops of the builder for the
+ * linewidths, but it uses the couplings left on the device by
+ * Interaction3Ph::getCouplingsSquaredViews(), and only the linewidths
+ * reduced over the bands at q2 and q3 are copied back to the host.
+ * Energies, velocities and populations are passed for each q1 of the
+ * batch, as in the builder. isActive2(ib2) is false for the excluded states
+ * at q2. The couplings are averaged over the degenerate states at q1, q2
+ * and q3, as done by ScatteringMatrix::symmetrizeCoupling() on the host.
+ * @return linewidths: for each q1, a (numCalculations, nb1) matrix.
+ */
+std::vector<Eigen::MatrixXd> phPhLinewidthsOnDevice(
+    DoubleView4D couplingPlus, DoubleView4D couplingMins,
+    const DeviceDeltaFunction &deltaFunction,
+    const std::vector<Eigen::VectorXd> &energies1_v,
+    const std::vector<Eigen::MatrixXd> &bose1_v,
+    const Eigen::VectorXd &energies2, const Eigen::MatrixXd &v2s,
+    const Eigen::MatrixXd &bose2, const std::vector<bool> &isActive2,
+    const std::vector<Eigen::VectorXd> &energies3Plus_v,
+    const std::vector<Eigen::MatrixXd> &v3sPlus_v,
+    const std::vector<Eigen::MatrixXd> &bose3Plus_v,
+    const std::vector<Eigen::VectorXd> &energies3Mins_v,
+    const std::vector<Eigen::MatrixXd> &v3sMins_v,
+    const std::vector<Eigen::MatrixXd> &bose3Mins_v, const double &norm,
+    const double &energyCutoff, const bool &outerEqualInnerMesh);
 
 /** class representing the phonon scattering matrix.
  * This class contains the logic to compute the phonon scattering matrix.
@@ -24,6 +86,13 @@ class PhScatteringMatrix : public ScatteringMatrix {
    * @param coupling3Ph: a pointer to the class handling the 3-phonon
    * interaction calculation.
    * @param h0: the object used for constructing phonon energies.
+   * @param couplingCache: a cache of the ph-ph transition weights, which may
+   * be shared between scattering matrices on the same band structure (e.g.
+   * at different temperatures). If null, a new cache is allocated if
+   * requested by the user input (cachePhPhCouplings).
+   * @param coupling4Ph: a pointer to the class handling the 4-phonon
+   * interaction. If not null, the 4-phonon scattering rates are added to the
+   * diagonal of the scattering matrix.
    *
    * Note: inner and outer band structures may be different, for example, if we
    * want to compute the phonon linewidths on a path, the outer band structure
@@ -38,7 +107,9 @@ class PhScatteringMatrix : public ScatteringMatrix {
                      BaseBandStructure &innerBandStructure_,
                      BaseBandStructure &outerBandStructure_,
                      Interaction3Ph *coupling3Ph_ = nullptr,
-                     PhononH0 *h0 = nullptr);
+                     PhononH0 *h0 = nullptr,
+                     std::shared_ptr<PhPhCouplingCache> couplingCache_ = nullptr,
+                     Interaction4Ph *coupling4Ph_ = nullptr);
 
   /** Copy constructor
    */
@@ -52,6 +123,12 @@ class PhScatteringMatrix : public ScatteringMatrix {
   Interaction3Ph *coupling3Ph;
   PhononH0 *h0;
 
+  std::shared_ptr<PhPhCouplingCache> couplingCache;
+
+  Interaction4Ph *coupling4Ph;
+  // the 4-phonon linewidths, computed at the first call to the builder
+  std::unique_ptr<VectorBTE> phPh4Linewidths;
+
   Eigen::VectorXd massVariance;
   bool doIsotopes;
 
@@ -62,6 +139,15 @@ class PhScatteringMatrix : public ScatteringMatrix {
   void builder(VectorBTE *linewidth,
                std::vector<VectorBTE> &inPopulations,
                std::vector<VectorBTE> &outPopulations) override;
+
+  /** Computes the 4-phonon contribution to the linewidths of the states of
+   * the outer band structure.
+   * The sums over q2 and q3 run on the inner band structure, and the states
+   * at q4 = q1 +- q2 +- q3 are looked up on the inner band structure or, if
+   * not found, computed with h0.
+   * @param energyCutoff: states with lower energies are discarded.
+   */
+  VectorBTE computePhPh4Linewidths(const double &energyCutoff);
 };
 
 #endif
@@ -24,6 +24,206 @@ std::vector<std::tuple<int, std::vector<int>>> PhElScatteringMatrix::getIrrWavev
   return pairIterator;
 }
 
+/** Computes, with Kokkos kernels, the contribution of a batch of q3 points
+ * (at fixed k1, with k2 = k1 + q3) to the ph-el linewidths of the phonon
+ * states at q3. It's the same calculation done by the loops of the builder,
+ * but it uses the couplings left on the device by
+ * InteractionElPhWan::calcCouplingSquaredView(). These are first averaged
+ * over degenerate states (as done by symmetrizeCoupling()), then each thread
+ * sums over the bands at k1 and k2 the rates of one phonon state, so that
+ * only the linewidths are copied back to the host.
+ * @param fermiTerm1: (numCalculations, nb1) values of f(1-f) at k1.
+ * @param v2s_v: for each q3, the (nb2, 3) group velocities at k2.
+ * @param prefactor: factor common to all the rates.
+ * @return linewidths: for each q3, a (numCalculations, nb3) matrix.
+ */
+std::vector<Eigen::MatrixXd> phElLinewidthsOnDevice(
+    DoubleView4D coupling, const DeviceDeltaFunction &deltaFunction,
+    const Eigen::VectorXd &energies1, const Eigen::MatrixXd &v1s,
+    const Eigen::MatrixXd &fermiTerm1,
+    const std::vector<Eigen::VectorXd> &energies2_v,
+    const std::vector<Eigen::MatrixXd> &v2s_v,
+    const std::vector<Eigen::VectorXd> &energies3_v,
+    const Eigen::VectorXd &temperatures, const double &prefactor,
+    const double &phononCutoff) {
+  Kokkos::Profiling::pushRegion("phElLinewidthsOnDevice");
+
+  auto nq3 = int(energies3_v.size());
+  auto nb1 = int(energies1.size());
+  auto numCalculations = int(temperatures.size());
+  int maxnb2 = 0, maxnb3 = 0;
+  for (int iq3 = 0; iq3 < nq3; iq3++) {
+    maxnb2 = std::max(maxnb2, int(energies2_v[iq3].size()));
+    maxnb3 = std::max(maxnb3, int(energies3_v[iq3].size()));
+  }
+
+  IntView1D nb2s("nb2s", nq3), nb3s("nb3s", nq3);
+  IntView1D degStart1("degStart1", nb1), degSize1("degSize1", nb1);
+  IntView2D degStart2("degStart2", nq3, maxnb2), degSize2("degSize2", nq3, maxnb2);
+  IntView2D degStart3("degStart3", nq3, maxnb3), degSize3("degSize3", nq3, maxnb3);
+  DoubleView1D energies1_k("en1", nb1);
+  DoubleView2D v1s_k("v1s", nb1, 3);
+  DoubleView2D fermiTerm1_k("fermi1", numCalculations, nb1);
+  DoubleView1D temperatures_k("temperatures", numCalculations);
+  DoubleView2D energies2("en2", nq3, maxnb2);
+  DoubleView3D v2s("v2s", nq3, maxnb2, 3);
+  DoubleView2D energies3("en3", nq3, maxnb3);
+
+  // for each band, the first band and the number of bands of its group of
+  // degenerate states (BaseBandStructure only lists the groups of two or
+  // more bands)
+  auto groupOfEachBand = [](const Eigen::VectorXd &energies) {
+    auto nb = int(energies.size());
+    std::vector<int> degStart(nb), degSize(nb, 1);
+    for (int ib = 0; ib < nb; ib++) {
+      degStart[ib] = ib;
+    }
+    for (auto [start, size] :
+         BaseBandStructure::findDegenerateGroups(energies)) {
+      for (int ib = start; ib < start + size; ib++) {
+        degStart[ib] = start;
+        degSize[ib] = size;
+      }
+    }
+    return std::make_tuple(degStart, degSize);
+  };
+
+  // copy everything to kokkos views
+  {
+    auto nb2s_h = Kokkos::create_mirror_view(nb2s);
+    auto nb3s_h = Kokkos::create_mirror_view(nb3s);
+    auto degStart1_h = Kokkos::create_mirror_view(degStart1);
+    auto degSize1_h = Kokkos::create_mirror_view(degSize1);
+    auto degStart2_h = Kokkos::create_mirror_view(degStart2);
+    auto degSize2_h = Kokkos::create_mirror_view(degSize2);
+    auto degStart3_h = Kokkos::create_mirror_view(degStart3);
+    auto degSize3_h = Kokkos::create_mirror_view(degSize3);
+    auto energies1_h = Kokkos::create_mirror_view(energies1_k);
+    auto v1s_h = Kokkos::create_mirror_view(v1s_k);
+    auto fermiTerm1_h = Kokkos::create_mirror_view(fermiTerm1_k);
+    auto temperatures_h = Kokkos::create_mirror_view(temperatures_k);
+    auto energies2_h = Kokkos::create_mirror_view(energies2);
+    auto v2s_h = Kokkos::create_mirror_view(v2s);
+    auto energies3_h = Kokkos::create_mirror_view(energies3);
+
+    auto [degStart1_v, degSize1_v] = groupOfEachBand(energies1);
+    for (int ib1 = 0; ib1 < nb1; ib1++) {
+      degStart1_h(ib1) = degStart1_v[ib1];
+      degSize1_h(ib1) = degSize1_v[ib1];
+      energies1_h(ib1) = energies1(ib1);
+      for (int i : {0, 1, 2}) {
+        v1s_h(ib1, i) = v1s(ib1, i);
+      }
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        fermiTerm1_h(iCalc, ib1) = fermiTerm1(iCalc, ib1);
+      }
+    }
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      temperatures_h(iCalc) = temperatures(iCalc);
+    }
+    for (int iq3 = 0; iq3 < nq3; iq3++) {
+      auto nb2 = int(energies2_v[iq3].size());
+      auto nb3 = int(energies3_v[iq3].size());
+      nb2s_h(iq3) = nb2;
+      nb3s_h(iq3) = nb3;
+      auto [degStart2_v, degSize2_v] = groupOfEachBand(energies2_v[iq3]);
+      for (int ib2 = 0; ib2 < nb2; ib2++) {
+        degStart2_h(iq3, ib2) = degStart2_v[ib2];
+        degSize2_h(iq3, ib2) = degSize2_v[ib2];
+        energies2_h(iq3, ib2) = energies2_v[iq3](ib2);
+        for (int i : {0, 1, 2}) {
+          v2s_h(iq3, ib2, i) = v2s_v[iq3](ib2, i);
+        }
+      }
+      auto [degStart3_v, degSize3_v] = groupOfEachBand(energies3_v[iq3]);
+      for (int ib3 = 0; ib3 < nb3; ib3++) {
+        degStart3_h(iq3, ib3) = degStart3_v[ib3];
+        degSize3_h(iq3, ib3) = degSize3_v[ib3];
+        energies3_h(iq3, ib3) = energies3_v[iq3](ib3);
+      }
+    }
+    Kokkos::deep_copy(nb2s, nb2s_h);
+    Kokkos::deep_copy(nb3s, nb3s_h);
+    Kokkos::deep_copy(degStart1, degStart1_h);
+    Kokkos::deep_copy(degSize1, degSize1_h);
+    Kokkos::deep_copy(degStart2, degStart2_h);
+    Kokkos::deep_copy(degSize2, degSize2_h);
+    Kokkos::deep_copy(degStart3, degStart3_h);
+    Kokkos::deep_copy(degSize3, degSize3_h);
+    Kokkos::deep_copy(energies1_k, energies1_h);
+    Kokkos::deep_copy(v1s_k, v1s_h);
+    Kokkos::deep_copy(fermiTerm1_k, fermiTerm1_h);
+    Kokkos::deep_copy(temperatures_k, temperatures_h);
+    Kokkos::deep_copy(energies2, energies2_h);
+    Kokkos::deep_copy(v2s, v2s_h);
+    Kokkos::deep_copy(energies3, energies3_h);
+  }
+
+  // average the coupling over the degenerate states at k1, k2 and q3
+  DoubleView4D couplingAvg(Kokkos::ViewAllocateWithoutInitializing("couplingAvg"),
+                           nq3, maxnb3, maxnb2, nb1);
+  Kokkos::parallel_for(
+      "phElCouplingAveraging", Range4D({0, 0, 0, 0}, {nq3, maxnb3, maxnb2, nb1}),
+      KOKKOS_LAMBDA(int iq3, int ib3, int ib2, int ib1) {
+        if (ib3 >= nb3s(iq3) || ib2 >= nb2s(iq3)) return;
+        int s1 = degStart1(ib1), d1 = degSize1(ib1);
+        int s2 = degStart2(iq3, ib2), d2 = degSize2(iq3, ib2);
+        int s3 = degStart3(iq3, ib3), d3 = degSize3(iq3, ib3);
+        double tmp = 0.;
+        for (int i3 = s3; i3 < s3 + d3; i3++) {
+          for (int i2 = s2; i2 < s2 + d2; i2++) {
+            for (int i1 = s1; i1 < s1 + d1; i1++) {
+              tmp += coupling(iq3, i3, i2, i1);
+            }
+          }
+        }
+        couplingAvg(iq3, ib3, ib2, ib1) = tmp / (d1 * d2 * d3);
+      });
+
+  // each thread computes the linewidths of one phonon state, so that no
+  // atomic operations are needed
+  DoubleView3D linewidths("linewidths", numCalculations, nq3, maxnb3);
+  Kokkos::parallel_for(
+      "phElLinewidths", Range2D({0, 0}, {nq3, maxnb3}),
+      KOKKOS_LAMBDA(int iq3, int ib3) {
+        if (ib3 >= nb3s(iq3)) return;
+        double en3 = energies3(iq3, ib3);
+        // remove small divergent phonon energies
+        if (en3 < phononCutoff) return;
+        for (int ib2 = 0; ib2 < nb2s(iq3); ib2++) {
+          double en2 = energies2(iq3, ib2);
+          for (int ib1 = 0; ib1 < nb1; ib1++) {
+            double delta = deltaFunction(energies1_k(ib1) - en2 + en3,
+                                         v1s_k(ib1, 0) - v2s(iq3, ib2, 0),
+                                         v1s_k(ib1, 1) - v2s(iq3, ib2, 1),
+                                         v1s_k(ib1, 2) - v2s(iq3, ib2, 2));
+            if (delta <= 0.) continue;
+            double weight = couplingAvg(iq3, ib3, ib2, ib1) * delta * prefactor;
+            for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              linewidths(iCalc, iq3, ib3) +=
+                  weight * fermiTerm1_k(iCalc, ib1) / temperatures_k(iCalc);
+            }
+          }
+        }
+      });
+  Kokkos::realloc(couplingAvg, 0, 0, 0, 0);
+
+  auto linewidths_h = Kokkos::create_mirror_view(linewidths);
+  Kokkos::deep_copy(linewidths_h, linewidths);
+  std::vector<Eigen::MatrixXd> linewidths_v(nq3);
+  for (int iq3 = 0; iq3 < nq3; iq3++) {
+    auto nb3 = int(energies3_v[iq3].size());
+    linewidths_v[iq3].resize(numCalculations, nb3);
+    for (int ib3 = 0; ib3 < nb3; ib3++) {
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        linewidths_v[iq3](iCalc, ib3) = linewidths_h(iCalc, iq3, ib3);
+      }
+    }
+  }
+  Kokkos::Profiling::popRegion();
+  return linewidths_v;
+}
+
 PhElScatteringMatrix::PhElScatteringMatrix(Context &context_,
                                            StatisticsSweep &statisticsSweep_,
                                            BaseBandStructure &elBandStructure_,
@@ -138,6 +338,8 @@ void PhElScatteringMatrix::builder(VectorBTE *linewidth,
     // that's because it doesn't work with the window the way it's implemented,
     // and we will almost always have a window for electrons
   }
+  // the delta functions are evaluated on the device
+  DeviceDeltaFunction deviceDelta = smearing->getDeviceDeltaFunction();
 
   // k1, k2 are the electronic states, q3 is the phonon
   // this helper returns pairs of the form vector<idxK1, std::vector(allQ3idxs)>
@@ -187,6 +389,12 @@ void PhElScatteringMatrix::builder(VectorBTE *linewidth,
     // that map to this irr kpoint
     double k1Weight = getElBandStructure().getPoints().
                                 getReducibleStarFromIrreducible(ik1).size();
+    Eigen::MatrixXd fermiTerm1(numCalculations, nb1);
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      for (int ib1 = 0; ib1 < nb1; ib1++) {
+        fermiTerm1(iCalc, ib1) = fermiTerm(iCalc, ik1, ib1);
+      }
+    }
 
     // precompute first fourier transform + rotation by k1
     couplingElPhWan.cacheElPh(eigenVector1, k1C);
@@ -250,104 +458,61 @@ void PhElScatteringMatrix::builder(VectorBTE *linewidth,
       std::vector<Eigen::MatrixXcd> allEigenVectors2 = std::get<1>(tHelp);
       std::vector<Eigen::Tensor<std::complex<double>,3>> allStates2Velocities = std::get<2>(tHelp);
 
-      // Generate couplings for fixed k1, all k2s and all Q3Cs
-      couplingElPhWan.calcCouplingSquared(eigenVector1, allEigenVectors2,
-                                          allEigenVectors3, allQ3C, allPolarData);
+      // Generate couplings for fixed k1, all k2s and all Q3Cs, which are
+      // left on the device to compute the linewidths
+      DoubleView4D couplingView = couplingElPhWan.calcCouplingSquaredView(
+          eigenVector1, allEigenVectors2, allEigenVectors3, allQ3C, allPolarData);
 
-      // do postprocessing loop with batch of couplings to calculate the scattering rates
+      std::vector<Eigen::MatrixXd> allStates2Vs(batch_size);
+      std::vector<Eigen::VectorXd> allStates3Energies(batch_size);
       for (int iq3Batch = 0; iq3Batch < batch_size; iq3Batch++) {
-
         int iq3 = iq3Indexes[start + iq3Batch];
         WavevectorIndex iq3Idx(iq3);
-
-        Eigen::VectorXd state2Energies = allStates2Energies[iq3Batch];
-        auto nb2 = int(state2Energies.size());
-        // for gpu would replace with compute OTF
-        Eigen::VectorXd state3Energies = getPhBandStructure().getEnergies(iq3Idx); // iq3Idx
-
-        // NOTE: these loops are already set up to be applicable to gpus
-        // the precomputaton of the smearing values and the open mp loops could
-        // be converted to GPU relevant version
-        int nb3 = state3Energies.size();
-        Eigen::Tensor<double,3> smearingValues(nb1, nb2, nb3);
-
-        #pragma omp parallel for collapse(3)
-        for (int ib2 = 0; ib2 < nb2; ib2++) {
-          for (int ib1 = 0; ib1 < nb1; ib1++) {
-            for (int ib3 = 0; ib3 < nb3; ib3++) {
-
-              double en2 = state2Energies(ib2);
-              double en1 = state1Energies(ib1);
-              double en3 = state3Energies(ib3);
-
-              // remove small divergent phonon energies
-              if (en3 < phononCutoff) {
-                smearingValues(ib1, ib2, ib3) = 0.;
-                continue;
-              }
-              double delta;
-
-              // NOTE: for gpus, if statements need to be moved outside, as
-              // this creates load balancing issues for gpu threads and cpu must
-              // dispatch this decision info
-              if (smearing->getType() == DeltaFunction::gaussian) {
-                delta = smearing->getSmearing(en1 - en2 + en3);
-              } else {
-                Eigen::Vector3d smear = v1s.row(ib1);
-                for (int i : {0,1,2}) {
-                  smear(i) -= allStates2Velocities[iq3Batch](ib2, ib2, i).real();
-                }
-                delta = smearing->getSmearing(en1 - en2 + en3, smear);
-              }
-              smearingValues(ib1, ib2, ib3) = std::max(delta, 0.);
+        allStates3Energies[iq3Batch] = getPhBandStructure().getEnergies(iq3Idx);
+        auto nb2 = int(allStates2Energies[iq3Batch].size());
+        allStates2Vs[iq3Batch] = Eigen::MatrixXd::Zero(nb2, 3);
+        if (withVelocities) {
+          for (int ib2 = 0; ib2 < nb2; ib2++) {
+            for (int i : {0, 1, 2}) {
+              allStates2Vs[iq3Batch](ib2, i) =
+                  allStates2Velocities[iq3Batch](ib2, ib2, i).real();
             }
           }
         }
+      }
 
-        Eigen::Tensor<double, 3> coupling = couplingElPhWan.getCouplingSquared(iq3Batch);
-        // symmetrize the elph coupling tensor
-        symmetrizeCoupling(coupling, state1Energies, state2Energies, state3Energies);
+      // https://arxiv.org/pdf/1409.1268.pdf
+      // rate = coupling(ib1, ib2, ib3)
+      //    * (fermi(iCalc, ik1, ib1) - fermi(iCalc, ik2, ib2))
+      //    * smearing_values(ib1, ib2, ib3) * norm / en3 * pi;
+      // NOTE: although the expression above is formally correct,
+      // fk-fk2 could be negative due to numerical noise.
+      // so instead, we do:
+      // fk-fk2 ~= dfk/dek dwq
+      // However, we don't include the dwq here, as this is gSE^2, which
+      // includes a factor of (1/wq)
+      auto linewidths_v = phElLinewidthsOnDevice(
+          couplingView, deviceDelta, state1Energies, v1s, fermiTerm1,
+          allStates2Energies, allStates2Vs, allStates3Energies, temperatures,
+          norm * pi * k1Weight, phononCutoff);
 
-        #pragma omp parallel for collapse(2)
+      for (int iq3Batch = 0; iq3Batch < batch_size; iq3Batch++) {
+        int iq3 = iq3Indexes[start + iq3Batch];
+        WavevectorIndex iq3Idx(iq3);
+        auto nb3 = int(allStates3Energies[iq3Batch].size());
         for (int ib3 = 0; ib3 < nb3; ib3++) {
+          // the BTE index is an irr point which indexes VectorBTE objects
+          // like the linewidths + scattering matrix -- as these are
+          // only allocated for irr points when sym is on
+          int is3 = getPhBandStructure().getIndex(iq3Idx, BandIndex(ib3));
+          StateIndex isIdx3(is3);
+          int ibte3 = getPhBandStructure().stateToBte(isIdx3).get();
           for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-
-            int is3 = getPhBandStructure().getIndex(iq3Idx, BandIndex(ib3));
-            // the BTE index is an irr point which indexes VectorBTE objects
-            // like the linewidths + scattering matrix -- as these are
-            // only allocated for irr points when sym is on
-            StateIndex isIdx3(is3);
-            BteIndex ibteIdx3= getPhBandStructure().stateToBte(isIdx3);
-            int ibte3 = ibteIdx3.get();
-
-            for (int ib1 = 0; ib1 < nb1; ib1++) {
-              for (int ib2 = 0; ib2 < nb2; ib2++) {
-              // loop on temperature
-                // https://arxiv.org/pdf/1409.1268.pdf
-                // double rate =
-                //    coupling(ib1, ib2, ib3)
-                //    * (fermi(iCalc, ik1, ib1) - fermi(iCalc, ik2, ib2))
-                //    * smearing_values(ib1, ib2, ib3) * norm / en3 * pi;
-
-                // NOTE: although the expression above is formally correct,
-                // fk-fk2 could be negative due to numerical noise.
-                // so instead, we do:
-                // fk-fk2 ~= dfk/dek dwq
-                // However, we don't include the dwq here, as this is gSE^2, which
-                // includes a factor of (1/wq)
-                double rate =
-                    coupling(ib1, ib2, ib3) * fermiTerm(iCalc, ik1, ib1)
-                    * smearingValues(ib1, ib2, ib3)
-                    * norm / temperatures(iCalc) * pi * k1Weight;
-
-                // case of linewidth construction (the only case, for ph-el)
-                linewidth->operator()(iCalc, 0, ibte3) += rate;
-
-                //NOTE: for eliashberg function, we could here add another vectorBTE object
-                // as done with the linewidths here, slightly modified
-
-              }
-            }
+            // case of linewidth construction (the only case, for ph-el)
+            linewidth->operator()(iCalc, 0, ibte3) +=
+                linewidths_v[iq3Batch](iCalc, ib3);
+            //NOTE: for eliashberg function, we could here add another
+            // vectorBTE object as done with the linewidths here
           }
         }
       }
@@ -1,13 +1,21 @@
 #include "scattering.h"
 #include "constants.h"
+#include "hdf5_output.h"
+#include "io.h"
 #include "mpiHelper.h"
+#include "window.h"
+#include <KokkosBlas3_gemm.hpp>
 #include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <numeric> // std::iota
+#include <random>
 #include <set>
+#include <sstream>
+#include <type_traits>
 #include <utility>
 
 ScatteringMatrix::ScatteringMatrix(Context &context_,
@@ -26,6 +34,7 @@ ScatteringMatrix::ScatteringMatrix(Context &context_,
   dimensionality_ = int(context.getDimensionality());
 
   highMemory = context.getScatteringMatrixInMemory();
+  isSparse = highMemory && context.getSparseScatteringMatrix();
 
   // we want to know the state index of acoustic modes at gamma,
   // so that we can set their populations to zero
@@ -72,16 +81,23 @@ ScatteringMatrix::ScatteringMatrix(Context &context_,
   }
 
   smearing = DeltaFunction::smearingFactory(context, innerBandStructure);
-  // block for electron scattering matrix
-  if ( (innerBandStructure.getParticle().isElectron() 
-        || outerBandStructure.getParticle().isElectron() )
-        && smearing->getType() == DeltaFunction::tetrahedron) {
-    Error("Tetrahedron smearing can cause issues for smearing with a state filtering window,"
-        "\nwhich one essentially will always want to use for electrons.");
+  if (smearing->getType() == DeltaFunction::tetrahedron) {
+    static_cast<TetrahedronDeltaFunction *>(smearing)->precomputeTetrahedra();
   }
+  if (context.getPartnerSamplingFraction() < 1. &&
+      smearing->getType() == DeltaFunction::tetrahedron) {
+    Error("The sampling of the scattering partners requires the gaussian or "
+          "adaptive gaussian smearing");
+  }
+  // Note: the tetrahedron method treats states outside the window as
+  // missing, so it can be used by the electron scattering matrix
 }
 
 ScatteringMatrix::~ScatteringMatrix() {
+  if (isOnDevice) {
+    kokkosDeviceMemory->removeDeviceMemoryUsage(
+        double(deviceMatrix.span()) * sizeof(double));
+  }
   if (context.getConstantRelaxationTime() > 0.) {
     return; // smearing is not assigned in CRT case
   } else {
@@ -99,9 +115,6 @@ void ScatteringMatrix::setup() {
 
   std::vector<VectorBTE> emptyVector;
 
-  // user info about memory
-  memoryUsage();
-
   if (highMemory) {
     if (numCalculations > 1) {
       // note: one could write code around this
@@ -116,6 +129,34 @@ void ScatteringMatrix::setup() {
       matSize = int(numStates);
     }
 
+    if (isSparse) {
+      // the matrix is allocated while it's built
+      theSparseMatrix = SparseMatrix<double>(matSize, matSize);
+      builder(&internalDiagonal, emptyVector, emptyVector);
+
+      // discard the small matrix elements
+      double threshold = context.getSparseMatrixDropTolerance()
+                         * internalDiagonal.data.cwiseAbs().maxCoeff();
+      theSparseMatrix.drop(threshold);
+
+      // user info about memory
+      double numNonZeros = double(theSparseMatrix.nonZeros());
+      mpi->allReduceSum(&numNonZeros);
+      if (mpi->mpiHead()) {
+        // 12 bytes for each element, value and column index
+        double x = numNonZeros * (sizeof(double) + sizeof(int)) / pow(1024., 3);
+        std::cout << "The sparse scattering matrix has " << numNonZeros
+                  << " stored elements (" << x << " GB), "
+                  << numNonZeros / pow(matSize, 2) * 100. << "% of the"
+                  << " dense matrix.\n" << std::endl;
+      }
+      Profiler::recordObjectMemory(
+          "scattering matrix", double(theSparseMatrix.nonZeros()) *
+                                   (sizeof(double) + sizeof(int)));
+      Profiler::recordHostMemory("scattering matrix");
+      return;
+    }
+
     // user info about memory
     if (mpi->mpiHead()) {
       double x = pow(matSize, 2) / pow(1024., 3) * sizeof(double);
@@ -128,37 +169,68 @@ void ScatteringMatrix::setup() {
       // The block size of this matrix can really change the performance
       // of the diagonalization method, and also the parallelization
       // of the scattering rate calculation in the full matrix case!
-      // Choosing numBlocks = matSize --> perfectly cyclic matrix
-      // Choosing numBlocks = numMPIProcs (the default) --> perfectly block
-      //
-      // Jenny's note: I've benchmarked several values of block size, and
-      // blocksize ~between 10-100 is the best. Hopefully this is universally true,
-      // benchmarks were done in the phonon case with a matrix with matSize=~31k, 81 MPI procs
-      // 64 ended up giving me slightly better performance than 16 or 176.
-      // There may be logic to how to choose these sizes,
-      // but for now I cannot find advice on this online.
-
-      int nBlocks = int(matSize/64.);
-      // TODO Should we move this to PMatrix constructor instead?
-      // seems tiny number of blocks is a problem, but it should
-      // only come up for very tiny cases where speed is not an issue,
-      // therefore, we default to 4 blocks if this happens.
-      // Seems like this is maybe a bug in scalapack?
-      if(nBlocks <= int(sqrt(mpi->getSize()))) nBlocks = int(sqrt(mpi->getSize())) * 2;
-
-      theMatrix = ParallelMatrix<double>(matSize, matSize, 0, 0, nBlocks, nBlocks);
+      // We let ParallelMatrix tune the process grid and block size.
+      // If requested, the local block is stored out of core.
+      theMatrix = ParallelMatrix<double>(
+          matSize, matSize, 0, 0, ParallelMatrix<double>::autoBlocks,
+          ParallelMatrix<double>::autoBlocks, -1,
+          context.getScatteringMatrixScratchDirectory());
 
     } catch(std::bad_alloc&) {
       Error("Failed to allocate memory for the scattering matrix.\n"
         "You are likely running out of memory.");
     }
+    // the local block, unless it's stored out of core
+    if (context.getScatteringMatrixScratchDirectory().empty()) {
+      Profiler::recordObjectMemory(
+          "scattering matrix",
+          double(theMatrix.localRows()) * theMatrix.localCols() *
+              sizeof(double));
+    }
 
-    // calc matrix and linewidth.
-    builder(&internalDiagonal, emptyVector, emptyVector);
+    // calc matrix and linewidth, unless it was saved by a previous run
+    if (!loadScatteringMatrix()) {
+      builder(&internalDiagonal, emptyVector, emptyVector);
+      saveScatteringMatrix();
+    }
   } else {
     // calc linewidths only
     builder(&internalDiagonal, emptyVector, emptyVector);
   }
+  Profiler::recordHostMemory("scattering matrix");
+}
+
+double ScatteringMatrix::estimateBuilderTime(const int &numSampledPairs_) {
+  if (constantRTA) return 0.;
+  // the linewidths are enough for timing the builder, and the results are
+  // discarded: we don't touch internalDiagonal
+  VectorBTE linewidth(statisticsSweep, outerBandStructure, 1);
+  std::vector<VectorBTE> emptyVector;
+  numSampledPairs = numSampledPairs_;
+  builderTimeEstimate = 0.;
+  builder(&linewidth, emptyVector, emptyVector);
+  numSampledPairs = 0;
+  double timeEstimate = builderTimeEstimate;
+  mpi->allReduceMax(&timeEstimate);
+  return timeEstimate;
+}
+
+int ScatteringMatrix::getLastBuilderPair(const int &numPairsDone,
+                                         const int &numPairs) const {
+  if (numSampledPairs > 0) {
+    return std::min(numPairs, numPairsDone + numSampledPairs);
+  }
+  return numPairs;
+}
+
+void ScatteringMatrix::recordBuilderSample(
+    const std::chrono::steady_clock::time_point &start,
+    const int &numPairsDone, const int &lastPair, const int &numPairs) {
+  if (numSampledPairs <= 0 || lastPair <= numPairsDone) return;
+  double time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count() / 1e9;
+  builderTimeEstimate =
+      time * double(numPairs - numPairsDone) / double(lastPair - numPairsDone);
 }
 
 // Get/set elements
@@ -173,75 +245,41 @@ VectorBTE ScatteringMatrix::diagonal() {
     VectorBTE diagonal(statisticsSweep, outerBandStructure, 1);
     diagonal.setConst(twoPi / context.getConstantRelaxationTime());
     return diagonal;
+  } else if (isOmegaView) {
+    VectorBTE diagonal = internalDiagonal;
+    scaleToOmegaView(diagonal);
+    scaleToOmegaView(diagonal);
+    return diagonal;
   } else {
     return internalDiagonal;
   }
 }
 
 VectorBTE ScatteringMatrix::offDiagonalDot(VectorBTE &inPopulation) {
-  if (highMemory) {
-    VectorBTE outPopulation(statisticsSweep, outerBandStructure, 3);
-    // note: we are assuming that ScatteringMatrix has numCalculations = 1
-
-    auto allLocalStates = theMatrix.getAllLocalStates();
-    size_t numAllLocalStates = allLocalStates.size();
-
-#pragma omp parallel
-    {
-      Eigen::MatrixXd dataPrivate = Eigen::MatrixXd::Zero(3, numStates);
-
-      if (context.getUseSymmetries()) {
-#pragma omp for
-        for (size_t iTup = 0; iTup < numAllLocalStates; iTup++) {
-          auto tup = allLocalStates[iTup];
-          int iMat1 = std::get<0>(tup);
-          int iMat2 = std::get<1>(tup);
-          auto t1 = getSMatrixIndex(iMat1);
-          auto t2 = getSMatrixIndex(iMat2);
-          int iBte1 = std::get<0>(t1).get();
-          int iBte2 = std::get<0>(t2).get();
-          if (iBte1 == iBte2)
-            continue;
-          int i = std::get<1>(t1).get();
-          int j = std::get<1>(t2).get();
-          dataPrivate(i, iBte1) +=
-              theMatrix(iMat1, iMat2) * inPopulation(0, j, iBte2);
-        }
-      } else {
-#pragma omp for
-        for (size_t iTup = 0; iTup < numAllLocalStates; iTup++) {
-          auto tup = allLocalStates[iTup];
-          auto iBte1 = std::get<0>(tup);
-          auto iBte2 = std::get<1>(tup);
-          if (iBte1 == iBte2)
-            continue;
-          for (int i : {0, 1, 2}) {
-            dataPrivate(i, iBte1) +=
-                theMatrix(iBte1, iBte2) * inPopulation(0, i, iBte2);
-          }
-        }
-      }
-
-#pragma omp critical
-      for (int iBte1=0; iBte1<numStates; ++iBte1) {
-        for (int i : {0, 1, 2}) {
-          outPopulation(0, i, iBte1) += dataPrivate(i, iBte1);
-        }
-      }
-
-    } // end pragma omp parallel
-
-    mpi->allReduceSum(&outPopulation.data);
-    return outPopulation;
+  if (isOmegaView) { // Omega x = s A (s x), and the same for the diagonal
+    VectorBTE x = inPopulation;
+    scaleToOmegaView(x);
+    isOmegaView = false;
+    VectorBTE y = offDiagonalDot(x);
+    isOmegaView = true;
+    scaleToOmegaView(y);
+    return y;
+  }
+  if (highMemory && !isSparse) {
+    std::vector<VectorBTE> inPopulations;
+    inPopulations.push_back(inPopulation);
+    return denseDot(inPopulations, true)[0];
   } else {
     VectorBTE outPopulation = dot(inPopulation);
-#pragma omp parallel for collapse(3) default(none)                             \
+    // states in the outer loop, to read contiguous columns of data
+#pragma omp parallel for default(none)                                         \
     shared(outPopulation, internalDiagonal, inPopulation, numCalculations, numStates)
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      for (int iDim = 0; iDim < 3; iDim++) {
-        for (int iBte = 0; iBte < numStates; iBte++) {
-          outPopulation(iCalc, iDim, iBte) -= internalDiagonal(iCalc, 0, iBte) *
-                                              inPopulation(iCalc, iDim, iBte);
+    for (int iBte = 0; iBte < numStates; iBte++) {
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        double diag = internalDiagonal(iCalc, 0, iBte);
+        for (int iDim = 0; iDim < 3; iDim++) {
+          outPopulation(iCalc, iDim, iBte) -=
+              diag * inPopulation(iCalc, iDim, iBte);
         }
       }
     }
@@ -251,16 +289,25 @@ VectorBTE ScatteringMatrix::offDiagonalDot(VectorBTE &inPopulation) {
 
 std::vector<VectorBTE>
 ScatteringMatrix::offDiagonalDot(std::vector<VectorBTE> &inPopulations) {
+  if (isOmegaView) {
+    std::vector<VectorBTE> x = inPopulations;
+    for (auto &xx : x) scaleToOmegaView(xx);
+    isOmegaView = false;
+    std::vector<VectorBTE> y = offDiagonalDot(x);
+    isOmegaView = true;
+    for (auto &yy : y) scaleToOmegaView(yy);
+    return y;
+  }
   // outPopulation = outPopulation - internalDiagonal * inPopulation;
   std::vector<VectorBTE> outPopulations = dot(inPopulations);
   for (unsigned int iVec = 0; iVec < inPopulations.size(); iVec++) {
-#pragma omp parallel for collapse(3)
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      for (int iDim = 0; iDim < 3; iDim++) {
-        for (int iBte = 0; iBte < numStates; iBte++) {
+#pragma omp parallel for
+    for (int iBte = 0; iBte < numStates; iBte++) {
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        double diag = internalDiagonal(iCalc, 0, iBte);
+        for (int iDim = 0; iDim < 3; iDim++) {
           outPopulations[iVec](iCalc, iDim, iBte) -=
-              internalDiagonal(iCalc, 0, iBte) *
-              inPopulations[iVec](iCalc, iDim, iBte);
+              diag * inPopulations[iVec](iCalc, iDim, iBte);
         }
       }
     }
@@ -269,66 +316,21 @@ ScatteringMatrix::offDiagonalDot(std::vector<VectorBTE> &inPopulations) {
 }
 
 VectorBTE ScatteringMatrix::dot(VectorBTE &inPopulation) {
-  if (highMemory) {
-    VectorBTE outPopulation(statisticsSweep, outerBandStructure, 3);
-    // note: we are assuming that ScatteringMatrix has numCalculations = 1
-
-    auto allLocalStates = theMatrix.getAllLocalStates();
-    size_t numAllLocalStates = allLocalStates.size();
-
-#pragma omp parallel
-    {
-      Eigen::MatrixXd dataPrivate = Eigen::MatrixXd::Zero(3, numStates);
-
-      if (context.getUseSymmetries()) {
-#pragma omp for
-        for (size_t iTup = 0; iTup < numAllLocalStates; iTup++) {
-          auto tup = allLocalStates[iTup];
-          int iMat1 = std::get<0>(tup);
-          int iMat2 = std::get<1>(tup);
-          auto t1 = getSMatrixIndex(iMat1);
-          auto t2 = getSMatrixIndex(iMat2);
-          int iBte1 = std::get<0>(t1).get();
-          int iBte2 = std::get<0>(t2).get();
-
-          if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte1) != excludeIndices.end())
-            continue;
-          if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte2) != excludeIndices.end())
-            continue;
-
-          int i = std::get<1>(t1).get();
-          int j = std::get<1>(t2).get();
-          dataPrivate(i, iBte1) +=
-              theMatrix(iMat1, iMat2) * inPopulation(0, j, iBte2);
-        }
-      } else {
-#pragma omp for
-        for (size_t iTup = 0; iTup < numAllLocalStates; iTup++) {
-          auto tup = allLocalStates[iTup];
-          auto iBte1 = std::get<0>(tup);
-          auto iBte2 = std::get<1>(tup);
-
-          if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte1) != excludeIndices.end())
-            continue;
-          if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte2) != excludeIndices.end())
-            continue;
-
-          for (int i : {0, 1, 2}) {
-            dataPrivate(i, iBte1) +=
-                theMatrix(iBte1, iBte2) * inPopulation(0, i, iBte2);
-          }
-        }
-      }
-#pragma omp critical
-      for (int iBte1=0; iBte1<numStates; ++iBte1) {
-        for (int i : {0, 1, 2}) {
-          outPopulation(0, i, iBte1) += dataPrivate(i, iBte1);
-        }
-      }
-    }
-
-    mpi->allReduceSum(&outPopulation.data);
-    return outPopulation;
+  if (isOmegaView) {
+    VectorBTE x = inPopulation;
+    scaleToOmegaView(x);
+    isOmegaView = false;
+    VectorBTE y = dot(x);
+    isOmegaView = true;
+    scaleToOmegaView(y);
+    return y;
+  }
+  if (isSparse) {
+    return sparseDot(inPopulation);
+  } else if (highMemory) {
+    std::vector<VectorBTE> inPopulations;
+    inPopulations.push_back(inPopulation);
+    return denseDot(inPopulations, false)[0];
   } else {
     VectorBTE outPopulation(statisticsSweep, outerBandStructure, 3);
     outPopulation.data.setZero();
@@ -343,7 +345,18 @@ VectorBTE ScatteringMatrix::dot(VectorBTE &inPopulation) {
 
 std::vector<VectorBTE>
 ScatteringMatrix::dot(std::vector<VectorBTE> &inPopulations) {
-  if (highMemory) {
+  if (isOmegaView) {
+    std::vector<VectorBTE> x = inPopulations;
+    for (auto &xx : x) scaleToOmegaView(xx);
+    isOmegaView = false;
+    std::vector<VectorBTE> y = dot(x);
+    isOmegaView = true;
+    for (auto &yy : y) scaleToOmegaView(yy);
+    return y;
+  }
+  if (highMemory && !isSparse) {
+    return denseDot(inPopulations, false);
+  } else if (highMemory) {
     std::vector<VectorBTE> outPopulations;
     for (auto inPopulation : inPopulations) {
       VectorBTE outPopulation(statisticsSweep, outerBandStructure, 3);
@@ -367,11 +380,17 @@ void ScatteringMatrix::a2Omega() {
   if (!highMemory) {
     Error("a2Omega only works if the matrix is stored in memory");
   }
+  if (isSinglePrecision) {
+    Error("a2Omega requires the matrix in double precision");
+  }
 
-  if (theMatrix.rows() == 0) {
+  if (getNumStoredRows() == 0) {
     Error("The scattering matrix hasn't been built yet");
   }
 
+  // the stored matrix becomes Omega, the view isn't needed anymore
+  isOmegaView = false;
+
   if (isMatrixOmega) { // it's already with the scaling of omega
     return;
   }
@@ -383,54 +402,117 @@ void ScatteringMatrix::a2Omega() {
   double temp = calcStatistics.temperature;
   double chemPot = calcStatistics.chemicalPotential;
 
-  auto allLocalStates = theMatrix.getAllLocalStates();
-  size_t numAllLocalStates = allLocalStates.size();
+  // n(n+1) for bosons, n(1-n) for fermions
+  Eigen::VectorXd popTerms(numStates);
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    BteIndex iBteIdx(iBte);
+    StateIndex isIdx = outerBandStructure.bteToState(iBteIdx);
+    double en = outerBandStructure.getEnergy(isIdx);
+    popTerms(iBte) = particle.getPopPopPm1(en, temp, chemPot);
+  }
+  std::vector<bool> isExcluded(numStates, false);
+  for (int iBte : excludeIndices) {
+    isExcluded[iBte] = true;
+  }
+
+  if (isSparse) {
+    int numRows = theSparseMatrix.rows();
 #pragma omp parallel for
-  for (size_t iTup=0; iTup<numAllLocalStates; iTup++) {
-    auto tup = allLocalStates[iTup];
+    for (int iMat1 = 0; iMat1 < numRows; iMat1++) {
+      int iBte1 = std::get<0>(getSMatrixIndex(iMat1)).get();
+      if (isExcluded[iBte1]) continue;
+      for (size_t k = theSparseMatrix.rowBegin(iMat1);
+           k < theSparseMatrix.rowBegin(iMat1 + 1); k++) {
+        int iBte2 = std::get<0>(getSMatrixIndex(theSparseMatrix.colIndex(k))).get();
+        if (isExcluded[iBte2]) continue;
+        theSparseMatrix.value(k) /= sqrt(popTerms(iBte1) * popTerms(iBte2));
+      }
+    }
+    // the diagonal is not stored in the sparse matrix
+    for (int iBte = 0; iBte < numStates; iBte++) {
+      if (isExcluded[iBte]) continue;
+      internalDiagonal(0, 0, iBte) /= popTerms(iBte);
+    }
+    isMatrixOmega = true;
+    return;
+  }
 
-    int iBte1, iBte2, iMat1, iMat2;
-    StateIndex is1Idx(-1), is2Idx(-1);
+  // the BTE index of each row/column of the matrix
+  std::vector<int> matToBte(theMatrix.rows());
+  for (int iMat = 0; iMat < theMatrix.rows(); iMat++) {
     if (context.getUseSymmetries()) {
-      iMat1 = std::get<0>(tup);
-      iMat2 = std::get<1>(tup);
-      auto tup1 = getSMatrixIndex(iMat1);
-      auto tup2 = getSMatrixIndex(iMat2);
-      BteIndex iBte1Idx = std::get<0>(tup1);
-      BteIndex iBte2Idx = std::get<0>(tup2);
-      iBte1 = iBte1Idx.get();
-      iBte2 = iBte2Idx.get();
-      is1Idx = outerBandStructure.bteToState(iBte1Idx);
-      is2Idx = outerBandStructure.bteToState(iBte2Idx);
+      matToBte[iMat] = std::get<0>(getSMatrixIndex(iMat)).get();
     } else {
-      iBte1 = std::get<0>(tup);
-      iBte2 = std::get<1>(tup);
-      iMat1 = iBte1;
-      iMat2 = iBte2;
-      is1Idx = StateIndex(iBte1);
-      is2Idx = StateIndex(iBte2);
-    }
-    if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte1) !=
-        excludeIndices.end())
-      continue;
-    if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte2) !=
-        excludeIndices.end())
-      continue;
-
-    double en1 = outerBandStructure.getEnergy(is1Idx);
-    double en2 = outerBandStructure.getEnergy(is2Idx);
+      matToBte[iMat] = iMat;
+    }
+  }
 
-    // n(n+1) for bosons, n(1-n) for fermions
-    double term1 = particle.getPopPopPm1(en1, temp, chemPot);
-    double term2 = particle.getPopPopPm1(en2, temp, chemPot);
+  // rescale the local tiles of the matrix in place
+  theMatrix.forEachLocalTile([&](const int &row0, const int &col0,
+                                 const int &numTileRows,
+                                 const int &numTileCols, double *data,
+                                 const int &ld) {
+#pragma omp parallel for
+    for (int j = 0; j < numTileCols; j++) {
+      int iBte2 = matToBte[col0 + j];
+      if (isExcluded[iBte2]) continue;
+      for (int i = 0; i < numTileRows; i++) {
+        int iBte1 = matToBte[row0 + i];
+        if (isExcluded[iBte1]) continue;
+        if (iBte1 == iBte2) {
+          internalDiagonal(0, 0, iBte1) /= popTerms(iBte1);
+        }
+        data[i + size_t(j) * ld] /= sqrt(popTerms(iBte1) * popTerms(iBte2));
+      }
+    }
+  });
+  isMatrixOmega = true;
+}
 
-    if (iBte1 == iBte2) {
-      internalDiagonal(0, 0, iBte1) /= term1;
+void ScatteringMatrix::setOmegaView(const bool &x) {
+  if (!x || isMatrixOmega) {
+    isOmegaView = false;
+    return;
+  }
+  std::vector<bool> isExcluded(numStates, false);
+  for (int iBte : excludeIndices) {
+    isExcluded[iBte] = true;
+  }
+  auto particle = outerBandStructure.getParticle();
+  omegaViewScaling = Eigen::MatrixXd::Ones(numCalculations, numStates);
+#pragma omp parallel for
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    if (isExcluded[iBte]) continue;
+    BteIndex iBteIdx(iBte);
+    StateIndex isIdx = outerBandStructure.bteToState(iBteIdx);
+    double en = outerBandStructure.getEnergy(isIdx);
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+      // n(n+1) for bosons, n(1-n) for fermions
+      double popTerm = particle.getPopPopPm1(
+          en, calcStatistics.temperature, calcStatistics.chemicalPotential);
+      omegaViewScaling(iCalc, iBte) = 1. / sqrt(popTerm);
     }
+  }
+  isOmegaView = true;
+}
 
-    theMatrix(iMat1, iMat2) /= sqrt(term1 * term2);
+double ScatteringMatrix::getOmegaViewScaling(const int &iBte) {
+  if (!isOmegaView) {
+    return 1.;
+  }
+  return omegaViewScaling(0, iBte);
+}
+
+void ScatteringMatrix::scaleToOmegaView(VectorBTE &population) {
+#pragma omp parallel for
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      for (int iDim = 0; iDim < population.dimensionality; iDim++) {
+        population(iCalc, iDim, iBte) *= omegaViewScaling(iCalc, iBte);
+      }
+    }
   }
-  isMatrixOmega = true;
 }
 
 // add a flag to remember if we have A or Omega
@@ -567,6 +649,34 @@ VectorBTE ScatteringMatrix::getLinewidths() {
   }
 }
 
+VectorBTE ScatteringMatrix::getLinewidthErrors() {
+  VectorBTE errors(statisticsSweep, outerBandStructure, 1);
+  errors.setConst(0.);
+  errors.excludeIndices = excludeIndices;
+  if (linewidthVariance == nullptr) {
+    return errors;
+  }
+  errors.data = linewidthVariance->data.cwiseMax(0.).cwiseSqrt();
+  if (isMatrixOmega) {
+    return errors;
+  }
+  // as in getLinewidths(), A_nu,nu = Gamma / N(1+N) for phonons
+  auto particle = outerBandStructure.getParticle();
+  #pragma omp parallel for
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    auto iBteIdx = BteIndex(iBte);
+    StateIndex isIdx = outerBandStructure.bteToState(iBteIdx);
+    double en = outerBandStructure.getEnergy(isIdx);
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+      double popTerm = particle.getPopPopPm1(en, calcStatistics.temperature,
+                                             calcStatistics.chemicalPotential);
+      errors(iCalc, 0, iBte) /= popTerm;
+    }
+  }
+  return errors;
+}
+
 void ScatteringMatrix::setLinewidths(VectorBTE &linewidths) {
 
   // note: this function assumes that we have not
@@ -609,8 +719,37 @@ void ScatteringMatrix::setLinewidths(VectorBTE &linewidths) {
   // we also need to add these to the full scattering matrix
   // we do this after setting up internal diagonal so that population
   // factors are already in place as needed
+  copyDiagonalToMatrix();
+}
+
+MeshVectorBTE ScatteringMatrix::getMeshLinewidths() {
+  VectorBTE linewidths = getLinewidths();
+  // the boundary scattering depends on the velocity of each state, and is
+  // recomputed on the other mesh rather than interpolated
+  linewidths.data -= getBoundaryRates(false).data;
+  return linewidths.unfoldOnMesh();
+}
+
+void ScatteringMatrix::setLinewidthsFromMesh(
+    const MeshVectorBTE &meshLinewidths) {
+  VectorBTE linewidths(statisticsSweep, outerBandStructure, 1);
+  linewidths.excludeIndices = excludeIndices;
+  Eigen::VectorXd meshTemperatures =
+      linewidths.interpolateFromMesh(meshLinewidths);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    double temperature = statisticsSweep.getCalcStatistics(iCalc).temperature;
+    if (std::abs(meshTemperatures(iCalc) - temperature) > 1e-6 * temperature) {
+      Error("The interpolated linewidths were not computed at the "
+            "temperatures of the current calculation.");
+    }
+  }
+  linewidths.data += getBoundaryRates(false).data;
+  setLinewidths(linewidths);
+}
 
-  if (highMemory) { // matrix in memory
+void ScatteringMatrix::copyDiagonalToMatrix() {
+  // (the diagonal of the sparse matrix is internalDiagonal itself)
+  if (highMemory && !isSparse) { // matrix in memory
     int iCalc = 0;
     if (context.getUseSymmetries()) {
       // numStates is defined in scattering.cpp as # of irrStates
@@ -636,6 +775,50 @@ void ScatteringMatrix::setLinewidths(VectorBTE &linewidths) {
   }
 }
 
+void ScatteringMatrix::getOutputUnits(std::string &particleType,
+                                      std::string &energyUnit,
+                                      std::string &relaxationTimeUnit,
+                                      double &energyConversion,
+                                      double &energyToTime) {
+  auto particle = outerBandStructure.getParticle();
+  energyConversion = energyRyToEv;
+  energyUnit = "eV";
+  relaxationTimeUnit = "fs";
+  // we need an extra factor of two pi, likely because of unit conversion
+  // (perhaps h vs hbar)
+  energyToTime = energyRyToFs/twoPi;
+  if (particle.isPhonon()) {
+    particleType = "phonon";
+    energyUnit = "meV";
+    energyConversion *= 1000;
+    relaxationTimeUnit = "ps"; // phonon times more commonly in ps
+    energyToTime *= 1e-3;
+  } else {
+    particleType = "electron";
+  }
+}
+
+void ScatteringMatrix::outputRelaxationTimes(const std::string &outFileName) {
+  std::string format = context.getRelaxationTimesFormat();
+  if (format == "json" || format == "both") {
+    outputToJSON(outFileName);
+  }
+  if (format == "hdf5" || format == "both") {
+    outputToHDF5(getHDF5OutputFileName(outFileName));
+  }
+}
+
+void ScatteringMatrix::outputRelaxonsTimes(const std::string &outFileName,
+                                           const Eigen::VectorXd &eigenvalues) {
+  std::string format = context.getRelaxationTimesFormat();
+  if (format == "json" || format == "both") {
+    relaxonsToJSON(outFileName, eigenvalues);
+  }
+  if (format == "hdf5" || format == "both") {
+    relaxonsToHDF5(getHDF5OutputFileName(outFileName), eigenvalues);
+  }
+}
+
 void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
 
   if (!mpi->mpiHead())
@@ -643,6 +826,8 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
 
   VectorBTE times = getSingleModeTimes();
   VectorBTE tmpLinewidths = getLinewidths();
+  bool outputErrors = linewidthVariance != nullptr;
+  VectorBTE linewidthErrors = getLinewidthErrors();
   std::shared_ptr<VectorBTE> timesN;
   std::shared_ptr<VectorBTE> timesU;
   if(outputUNTimes) {
@@ -650,26 +835,11 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
     timesU = std::make_shared<VectorBTE>(getSingleModeTimes(2));
   }
 
-  std::string particleType;
+  std::string particleType, energyUnit, relaxationTimeUnit;
+  double energyConversion, energyToTime;
+  getOutputUnits(particleType, energyUnit, relaxationTimeUnit,
+                 energyConversion, energyToTime);
   auto particle = outerBandStructure.getParticle();
-  double energyConversion = energyRyToEv;
-  std::string energyUnit = "eV";
-  std::string relaxationTimeUnit = "fs";
-  // we need an extra factor of two pi, likely because of unit conversion
-  // (perhaps h vs hbar)
-  double energyToTime = energyRyToFs/twoPi;
-  if (particle.isPhonon()) {
-    particleType = "phonon";
-    energyUnit = "meV";
-    energyConversion *= 1000;
-    relaxationTimeUnit = "ps"; // phonon times more commonly in ps
-    energyToTime *= 1e-3;
-    // this is a bit of a hack to deal with phel scattering, where stat sweep
-    // has nonzero mu values in spite of it being a phonon case
-
-  } else {
-    particleType = "electron";
-  }
 
   // need to store as a vector format with dimensions
   // iCalc, ik. ib, iDim (where iState is unfolded into
@@ -678,6 +848,7 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
   std::vector<std::vector<std::vector<double>>> outTimesU;
   std::vector<std::vector<std::vector<double>>> outTimesN;
   std::vector<std::vector<std::vector<double>>> outLinewidths;
+  std::vector<std::vector<std::vector<double>>> outLinewidthErrors;
   std::vector<std::vector<std::vector<std::vector<double>>>> velocities;
   std::vector<std::vector<std::vector<double>>> energies;
   std::vector<double> temps;
@@ -701,6 +872,7 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
 
     std::vector<std::vector<double>> wavevectorsT;
     std::vector<std::vector<double>> wavevectorsL;
+    std::vector<std::vector<double>> wavevectorsLE;
     std::vector<std::vector<std::vector<double>>> wavevectorsV;
     std::vector<std::vector<double>> wavevectorsE;
     // loop over wavevectors
@@ -709,6 +881,7 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
 
       std::vector<double> bandsT;
       std::vector<double> bandsL;
+      std::vector<double> bandsLE;
       std::vector<std::vector<double>> bandsV;
       std::vector<double> bandsE;
       // loop over bands here
@@ -725,6 +898,7 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
         bandsT.push_back(tau * energyToTime);
         double linewidth = tmpLinewidths(iCalc, 0, iBte);
         bandsL.push_back(linewidth * energyConversion);
+        bandsLE.push_back(linewidthErrors(iCalc, 0, iBte) * energyConversion);
 
         std::vector<double> iDimsV;
         // loop over dimensions
@@ -735,11 +909,13 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
       }
       wavevectorsT.push_back(bandsT);
       wavevectorsL.push_back(bandsL);
+      wavevectorsLE.push_back(bandsLE);
       wavevectorsV.push_back(bandsV);
       wavevectorsE.push_back(bandsE);
     }
     outTimes.push_back(wavevectorsT);
     outLinewidths.push_back(wavevectorsL);
+    outLinewidthErrors.push_back(wavevectorsLE);
     velocities.push_back(wavevectorsV);
     energies.push_back(wavevectorsE);
   }
@@ -794,6 +970,9 @@ void ScatteringMatrix::outputToJSON(const std::string &outFileName) {
   }
   output["linewidths"] = outLinewidths;
   output["linewidthsUnit"] = energyUnit;
+  if (outputErrors) {
+    output["linewidthErrors"] = outLinewidthErrors;
+  }
   output["relaxationTimes"] = outTimes;
   if(outputUNTimes) {
     output["normalRelaxationTimes"] = outTimesN;
@@ -868,12 +1047,330 @@ void ScatteringMatrix::relaxonsToJSON(const std::string &outFileName,
   o.close();
 }
 
+void ScatteringMatrix::outputToHDF5(const std::string &outFileName) {
+#ifndef HDF5_AVAIL
+  (void) outFileName;
+  Error("The HDF5 output of the relaxation times requires Phoebe built "
+        "with HDF5.");
+#else
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::outputToHDF5");
+
+  VectorBTE times = getSingleModeTimes();
+  VectorBTE tmpLinewidths = getLinewidths();
+  bool outputErrors = linewidthVariance != nullptr;
+  VectorBTE linewidthErrors = getLinewidthErrors();
+  std::shared_ptr<VectorBTE> timesN;
+  std::shared_ptr<VectorBTE> timesU;
+  if (outputUNTimes) {
+    timesN = std::make_shared<VectorBTE>(getSingleModeTimes(1));
+    timesU = std::make_shared<VectorBTE>(getSingleModeTimes(2));
+  }
+
+  std::string particleType, energyUnit, relaxationTimeUnit;
+  double energyConversion, energyToTime;
+  getOutputUnits(particleType, energyUnit, relaxationTimeUnit,
+                 energyConversion, energyToTime);
+  auto particle = outerBandStructure.getParticle();
+
+  // the states of the irreducible wavevectors are flattened, and
+  // pointOffsets[i] is the index of the first state of the i-th wavevector
+  std::vector<int> irrPoints = outerBandStructure.irrPointsIterator();
+  auto numIrrPoints = int(irrPoints.size());
+  std::vector<size_t> pointOffsets(numIrrPoints + 1, 0);
+  for (int i = 0; i < numIrrPoints; i++) {
+    auto ikIndex = WavevectorIndex(irrPoints[i]);
+    pointOffsets[i + 1] =
+        pointOffsets[i] + outerBandStructure.getNumBands(ikIndex);
+  }
+  size_t numIrrStates = pointOffsets.back();
+
+  // with parallel HDF5, each process writes the states of a slice of the
+  // wavevectors. Otherwise, the head process writes everything
+  std::vector<int> localPoints;
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+  localPoints = mpi->divideWorkIter(numIrrPoints);
+#else
+  if (mpi->mpiHead()) {
+    localPoints.resize(numIrrPoints);
+    std::iota(localPoints.begin(), localPoints.end(), 0);
+  }
+#endif
+  int firstPoint = localPoints.empty() ? 0 : localPoints[0];
+  auto numLocalPoints = size_t(localPoints.size());
+  size_t firstState = pointOffsets[firstPoint];
+  size_t numLocalStates = pointOffsets[firstPoint + numLocalPoints] - firstState;
+
+  // local slices, with the layout (iCalc, iState) for the times and
+  // linewidths, (iState, iDim) for the velocities
+  size_t numCalcs = numCalculations;
+  std::vector<double> outTimes(numCalcs * numLocalStates);
+  std::vector<double> outLinewidths(numCalcs * numLocalStates);
+  std::vector<double> outLinewidthErrors;
+  if (outputErrors) {
+    outLinewidthErrors.resize(numCalcs * numLocalStates);
+  }
+  std::vector<double> outTimesN, outTimesU;
+  if (outputUNTimes) {
+    outTimesN.resize(numCalcs * numLocalStates);
+    outTimesU.resize(numCalcs * numLocalStates);
+  }
+  std::vector<double> energies(numLocalStates);
+  std::vector<double> velocities(3 * numLocalStates);
+  std::vector<int> wavevectorIndices(numLocalStates);
+  std::vector<int> bandIndices(numLocalStates);
+  std::vector<double> meshCoordinates(3 * numLocalPoints);
+
+  auto points = outerBandStructure.getPoints();
+  for (size_t i = 0; i < numLocalPoints; i++) {
+    int iPoint = localPoints[i];
+    auto ikIndex = WavevectorIndex(irrPoints[iPoint]);
+    auto coord =
+        points.cartesianToCrystal(outerBandStructure.getWavevector(ikIndex));
+    for (int iDim : {0, 1, 2}) {
+      meshCoordinates[3 * i + iDim] = coord[iDim];
+    }
+    for (int ib = 0; ib < outerBandStructure.getNumBands(ikIndex); ib++) {
+      size_t iLocal = pointOffsets[iPoint] + ib - firstState;
+      auto ibIndex = BandIndex(ib);
+      StateIndex isIdx(outerBandStructure.getIndex(ikIndex, ibIndex));
+      int iBte = int(outerBandStructure.stateToBte(isIdx).get());
+      energies[iLocal] = outerBandStructure.getEnergy(isIdx) * energyConversion;
+      auto vel = outerBandStructure.getGroupVelocity(isIdx);
+      for (int iDim : {0, 1, 2}) {
+        velocities[3 * iLocal + iDim] = vel[iDim] * velocityRyToSi;
+      }
+      wavevectorIndices[iLocal] = iPoint;
+      bandIndices[iLocal] = ib;
+      for (size_t iCalc = 0; iCalc < numCalcs; iCalc++) {
+        size_t j = iCalc * numLocalStates + iLocal;
+        outTimes[j] = times(iCalc, 0, iBte) * energyToTime;
+        outLinewidths[j] = tmpLinewidths(iCalc, 0, iBte) * energyConversion;
+        if (outputErrors) {
+          outLinewidthErrors[j] =
+              linewidthErrors(iCalc, 0, iBte) * energyConversion;
+        }
+        if (outputUNTimes) {
+          outTimesN[j] = timesN->operator()(iCalc, 0, iBte) * energyToTime;
+          outTimesU[j] = timesU->operator()(iCalc, 0, iBte) * energyToTime;
+        }
+      }
+    }
+  }
+
+  std::vector<double> temps, chemPots, dopings;
+  if (mpi->mpiHead()) {
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+      temps.push_back(calcStatistics.temperature * temperatureAuToSi);
+      // as in the json file, phel scattering has nonzero mu values in spite
+      // of it being a phonon case
+      if (particle.isElectron()) {
+        chemPots.push_back(calcStatistics.chemicalPotential * energyConversion);
+      } else {
+        chemPots.push_back(0.);
+      }
+      dopings.push_back(calcStatistics.doping);
+    }
+  }
+
+  try {
+    std::unique_ptr<HighFive::File> file;
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+    file = std::make_unique<HighFive::File>(
+        outFileName, HighFive::File::Overwrite,
+        HighFive::MPIOFileDriver(mpi->getComm(), MPI_INFO_NULL));
+#else
+    if (mpi->mpiHead()) {
+      file = std::make_unique<HighFive::File>(outFileName,
+                                              HighFive::File::Overwrite);
+    }
+#endif
+    if (file != nullptr) {
+      bool head = mpi->mpiHead();
+      writeHDF5Slice(*file, "/temperatures", {numCalcs}, {0}, {numCalcs},
+                     temps);
+      writeHDF5String(*file, "/temperatureUnit", "K", head);
+      writeHDF5Slice(*file, "/chemicalPotentials", {numCalcs}, {0},
+                     {numCalcs}, chemPots);
+      writeHDF5String(*file, "/chemicalPotentialUnit", "eV", head);
+      if (particle.isElectron()) {
+        writeHDF5Slice(*file, "/dopingConcentrations", {numCalcs}, {0},
+                       {numCalcs}, dopings);
+        writeHDF5String(*file, "/dopingConcentrationUnit",
+                        "cm$^{-" + std::to_string(context.getDimensionality())
+                            + "}$", head);
+      }
+      std::vector<size_t> dimsT = {numCalcs, numIrrStates};
+      std::vector<size_t> offsetT = {0, firstState};
+      std::vector<size_t> countT = {numCalcs, numLocalStates};
+      writeHDF5Slice(*file, "/linewidths", dimsT, offsetT, countT,
+                     outLinewidths);
+      writeHDF5String(*file, "/linewidthsUnit", energyUnit, head);
+      if (outputErrors) {
+        writeHDF5Slice(*file, "/linewidthErrors", dimsT, offsetT, countT,
+                       outLinewidthErrors);
+      }
+      writeHDF5Slice(*file, "/relaxationTimes", dimsT, offsetT, countT,
+                     outTimes);
+      if (outputUNTimes) {
+        writeHDF5Slice(*file, "/normalRelaxationTimes", dimsT, offsetT,
+                       countT, outTimesN);
+        writeHDF5Slice(*file, "/umklappRelaxationTimes", dimsT, offsetT,
+                       countT, outTimesU);
+      }
+      writeHDF5String(*file, "/relaxationTimeUnit", relaxationTimeUnit, head);
+      writeHDF5Slice(*file, "/velocities", {numIrrStates, 3}, {firstState, 0},
+                     {numLocalStates, 3}, velocities);
+      writeHDF5String(*file, "/velocityUnit", "m/s", head);
+      writeHDF5Slice(*file, "/energies", {numIrrStates}, {firstState},
+                     {numLocalStates}, energies);
+      writeHDF5String(*file, "/energyUnit", energyUnit, head);
+      // (wavevector, band) indices of the flattened states
+      writeHDF5Slice(*file, "/wavevectorIndices", {numIrrStates},
+                     {firstState}, {numLocalStates}, wavevectorIndices);
+      writeHDF5Slice(*file, "/bandIndices", {numIrrStates}, {firstState},
+                     {numLocalStates}, bandIndices);
+      writeHDF5Slice(*file, "/wavevectorCoordinates",
+                     {size_t(numIrrPoints), 3}, {size_t(firstPoint), 0},
+                     {numLocalPoints, 3}, meshCoordinates);
+      writeHDF5String(*file, "/coordsType", "lattice", head);
+      writeHDF5String(*file, "/particleType", particleType, head);
+    }
+  } catch (std::exception &error) {
+    Error("Issue writing the relaxation times to " + outFileName);
+  }
+  Kokkos::Profiling::popRegion();
+#endif
+}
+
+void ScatteringMatrix::relaxonsToHDF5(const std::string &outFileName,
+                                      const Eigen::VectorXd &eigenvalues) {
+#ifndef HDF5_AVAIL
+  (void) outFileName;
+  (void) eigenvalues;
+  Error("The HDF5 output of the relaxation times requires Phoebe built "
+        "with HDF5.");
+#else
+  std::string particleType;
+  if (outerBandStructure.getParticle().isPhonon()) {
+    particleType = "phonon";
+  } else {
+    particleType = "electron";
+  }
+  // same units of relaxonsToJSON()
+  double energyToTime = energyRyToFs;
+  double energyConversion = energyRyToEv;
+
+  auto numRelaxons = size_t(eigenvalues.size());
+  size_t numCalcs = numCalculations;
+  std::vector<int> localRelaxons;
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+  localRelaxons = mpi->divideWorkIter(int(numRelaxons));
+#else
+  if (mpi->mpiHead()) {
+    localRelaxons.resize(numRelaxons);
+    std::iota(localRelaxons.begin(), localRelaxons.end(), 0);
+  }
+#endif
+  size_t first = localRelaxons.empty() ? 0 : localRelaxons[0];
+  size_t numLocal = localRelaxons.size();
+
+  std::vector<double> outTimes(numCalcs * numLocal);
+  for (size_t iCalc = 0; iCalc < numCalcs; iCalc++) {
+    for (size_t i = 0; i < numLocal; i++) {
+      outTimes[iCalc * numLocal + i] =
+          energyToTime / eigenvalues(localRelaxons[i]);
+    }
+  }
+  std::vector<double> temps, chemPots;
+  if (mpi->mpiHead()) {
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+      temps.push_back(calcStatistics.temperature * temperatureAuToSi);
+      chemPots.push_back(calcStatistics.chemicalPotential * energyConversion);
+    }
+  }
+
+  try {
+    std::unique_ptr<HighFive::File> file;
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+    file = std::make_unique<HighFive::File>(
+        outFileName, HighFive::File::Overwrite,
+        HighFive::MPIOFileDriver(mpi->getComm(), MPI_INFO_NULL));
+#else
+    if (mpi->mpiHead()) {
+      file = std::make_unique<HighFive::File>(outFileName,
+                                              HighFive::File::Overwrite);
+    }
+#endif
+    if (file != nullptr) {
+      bool head = mpi->mpiHead();
+      writeHDF5Slice(*file, "/temperatures", {numCalcs}, {0}, {numCalcs},
+                     temps);
+      writeHDF5String(*file, "/temperatureUnit", "K", head);
+      writeHDF5Slice(*file, "/chemicalPotentials", {numCalcs}, {0},
+                     {numCalcs}, chemPots);
+      writeHDF5Slice(*file, "/relaxationTimes", {numCalcs, numRelaxons},
+                     {0, first}, {numCalcs, numLocal}, outTimes);
+      writeHDF5String(*file, "/relaxationTimeUnit", "fs", head);
+      writeHDF5String(*file, "/particleType", particleType, head);
+    }
+  } catch (std::exception &error) {
+    Error("Issue writing the relaxation times to " + outFileName);
+  }
+#endif
+}
+
 std::tuple<Eigen::VectorXd, ParallelMatrix<double>>
-ScatteringMatrix::diagonalize(int numEigenvalues) {
+ScatteringMatrix::diagonalize(int numEigenvalues,
+                              const Eigen::MatrixXd *initialGuess) {
+
+  if (isSinglePrecision) {
+    Error("The relaxons solver requires the scattering matrix in double\n"
+          "precision, set scatteringMatrixPrecision = \"double\".");
+  }
+
+  if(numEigenvalues > numStates) { // not possible
+    Error("You have requested to calculate more relaxons eigenvalues"
+        " than your number of particle states.");
+  }
+
+  // the iterative solver only needs matrix-vector products, and works
+  // also with the sparse matrix
+  if (context.getRelaxonsEigenSolver() == "lobpcg") {
+    if (numEigenvalues <= 0) {
+      Error("The lobpcg relaxons eigensolver requires numRelaxonsEigenvalues");
+    }
+    return iterativeDiagonalize(numEigenvalues, initialGuess);
+  }
+
+  if (isSparse) {
+    Error("The diagonalization of the scattering matrix (relaxons solver)\n"
+          "requires the dense matrix, set sparseScatteringMatrix = false\n"
+          "or relaxonsEigenSolver = \"lobpcg\".");
+  }
+
+  // the eigenvectors change smoothly with temperature: those of the
+  // previous temperature are refined with a few LOBPCG iterations, which
+  // leave the matrix untouched for the direct solver, if still needed
+  if (initialGuess != nullptr && initialGuess->rows() == numStates &&
+      initialGuess->cols() > 0 && numEigenvalues > 0 &&
+      numEigenvalues < numStates && !context.getUseSymmetries()) {
+    bool isConverged = false;
+    auto tup = iterativeDiagonalize(numEigenvalues, initialGuess,
+                                    &isConverged);
+    if (isConverged) {
+      return tup;
+    }
+    if (mpi->mpiHead()) {
+      std::cout << "The relaxons of the previous temperature didn't "
+                   "converge, falling back to the direct eigensolver.\n"
+                << std::endl;
+    }
+  }
 
   // user info about memory
   {
-    memoryUsage();
     double xx;
     double x = 2 * pow(theMatrix.rows(), 2) / pow(1024., 3) * sizeof(xx);
     // 2 because one is for eigenvectors, another is the copy of the matrix
@@ -886,10 +1383,6 @@ ScatteringMatrix::diagonalize(int numEigenvalues) {
   }
   // diagonalize
   std::tuple<std::vector<double>, ParallelMatrix<double>> tup;
-  if(numEigenvalues > numStates) { // not possible
-    Error("You have requested to calculate more relaxons eigenvalues"
-        " than your number of particle states.");
-  }
   if(numEigenvalues > 0 && numEigenvalues != numStates) { // zero is default, calculates all of them
     // calculate some of the eigenvalues
     tup = theMatrix.diagonalize(numEigenvalues, context.getCheckNegativeRelaxons());
@@ -898,6 +1391,10 @@ ScatteringMatrix::diagonalize(int numEigenvalues) {
   }
   auto eigenvalues = std::get<0>(tup);
   auto eigenvectors = std::get<1>(tup);
+  Profiler::recordObjectMemory("relaxons eigenvectors",
+                               double(eigenvectors.localRows()) *
+                                   eigenvectors.localCols() * sizeof(double));
+  Profiler::recordHostMemory("scattering matrix diagonalization");
 
   // place eigenvalues in an VectorBTE object
   Eigen::VectorXd eigenValues(eigenvalues.size());
@@ -908,22 +1405,402 @@ ScatteringMatrix::diagonalize(int numEigenvalues) {
   return std::make_tuple(eigenValues, eigenvectors);
 }
 
-std::vector<std::tuple<std::vector<int>, int>>
-ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
-                                             const bool &rowMajor) {
-  if (rowMajor) { // case for el-ph scattering
-    std::vector<std::tuple<std::vector<int>, int>> pairIterator;
+std::tuple<Eigen::VectorXd, ParallelMatrix<double>>
+ScatteringMatrix::iterativeDiagonalize(const int &numEigenvalues,
+                                       const Eigen::MatrixXd *initialGuess,
+                                       bool *isConverged) {
+  // LOBPCG method (Knyazev, SIAM J. Sci. Comput. 23, 517 (2001)) for the
+  // smallest eigenvalues of the matrix. The blocks of trial vectors are
+  // split by rows across the MPI processes, and the matrix is only used
+  // through the products computed by blockDot().
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::iterativeDiagonalize");
 
-    if (switchCase == 1 || switchCase == 2) { // case for linewidth construction
+  if (context.getUseSymmetries()) {
+    Error("The lobpcg relaxons eigensolver doesn't support symmetries");
+  }
+
+  // the residual of an eigenpair is converged when it's smaller than
+  // threshold times the largest diagonal element of the matrix
+  const double threshold = 1.0e-8;
+  // with a fallback, we give up early: a good initial guess converges in a
+  // few tens of iterations
+  const int maxIterations = isConverged == nullptr ? 1000 : 100;
+  // linearly dependent directions of the search space are dropped
+  const double dependenceThreshold = 1.0e-12;
+
+  // the excluded states are kept out of the search space, so that they
+  // don't appear as spurious zero eigenvalues
+  std::vector<bool> isExcluded(numStates, false);
+  for (int iBte : excludeIndices) {
+    isExcluded[iBte] = true;
+  }
+  int numActiveStates = int(std::count(isExcluded.begin(), isExcluded.end(),
+                                       false));
+
+  // a few extra vectors speed up the convergence of the last eigenvalues
+  int blockSize = std::min(numEigenvalues + std::max(numEigenvalues / 10, 4),
+                           numActiveStates / 3);
+  if (blockSize < numEigenvalues) {
+    Error("Too many relaxons eigenvalues requested for the lobpcg solver,\n"
+          "use relaxonsEigenSolver = \"direct\" instead.");
+  }
+
+  // Jacobi preconditioner
+  Eigen::VectorXd diagonal = Eigen::VectorXd::Zero(numStates);
+  if (isSparse) {
+    for (int iBte = 0; iBte < numStates; iBte++) {
+      diagonal(iBte) = internalDiagonal(0, 0, iBte);
+    }
+  } else {
+    std::vector<int> localRows = theMatrix.getAllLocalRows();
+    std::vector<int> localCols = theMatrix.getAllLocalCols();
+    std::vector<int> localColIndex(numStates, -1);
+    for (int iCol = 0; iCol < int(localCols.size()); iCol++) {
+      localColIndex[localCols[iCol]] = iCol;
+    }
+    if (!localRows.empty() && !localCols.empty()) {
+      Eigen::Map<Eigen::MatrixXd> localMatrix(
+          theMatrix.data(), int(localRows.size()), int(localCols.size()));
+      for (int iRow = 0; iRow < int(localRows.size()); iRow++) {
+        int iCol = localColIndex[localRows[iRow]];
+        if (iCol >= 0) {
+          diagonal(localRows[iRow]) = localMatrix(iRow, iCol);
+        }
+      }
+    }
+    mpi->allReduceSum(&diagonal);
+  }
+  if (isOmegaView) {
+    diagonal = diagonal.cwiseProduct(
+        omegaViewScaling.row(0).transpose().cwiseAbs2());
+  }
+  double scale = diagonal.cwiseAbs().maxCoeff();
+  if (scale == 0.) {
+    scale = 1.;
+  }
+  Eigen::VectorXd preconditioner = Eigen::VectorXd::Zero(numStates);
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    if (isExcluded[iBte]) continue;
+    double d = std::abs(diagonal(iBte));
+    preconditioner(iBte) = d > 1.0e-12 * scale ? 1. / d : 1. / scale;
+  }
+
+  // the trial vectors and search directions are split across the MPI
+  // processes in contiguous ranges of rows, and the products between blocks
+  // are summed over the processes. Only the matrix products use (and
+  // discard) the full blocks.
+  std::vector<size_t> rowDivision = mpi->divideWork(numStates);
+  int rowStart = int(rowDivision[0]);
+  int numLocalStates = int(rowDivision[1] - rowDivision[0]);
+
+  // full block from the local rows
+  auto gatherRows = [&](const Eigen::MatrixXd &local) {
+    Eigen::MatrixXd full = Eigen::MatrixXd::Zero(numStates, local.cols());
+    full.middleRows(rowStart, numLocalStates) = local;
+    mpi->allReduceSum(&full);
+    return full;
+  };
+  // local rows of the product with the matrix
+  auto localBlockDot = [&](const Eigen::MatrixXd &local) {
+    Eigen::MatrixXd full = blockDot(gatherRows(local));
+    return Eigen::MatrixXd(full.middleRows(rowStart, numLocalStates));
+  };
+  // a^T b, for blocks split by rows
+  auto innerProduct = [&](const Eigen::MatrixXd &a, const Eigen::MatrixXd &b) {
+    Eigen::MatrixXd ab = a.transpose() * b;
+    mpi->allReduceSum(&ab);
+    return ab;
+  };
+  auto columnNorms = [&](const Eigen::MatrixXd &v) {
+    Eigen::VectorXd norms = v.colwise().squaredNorm().transpose();
+    mpi->allReduceSum(&norms);
+    return Eigen::VectorXd(norms.cwiseSqrt());
+  };
+  Eigen::VectorXd localPreconditioner =
+      preconditioner.segment(rowStart, numLocalStates);
+
+  // Rayleigh-Ritz procedure on the space spanned by the columns of v,
+  // with av = A v. Returns the lowest numVectors Ritz values, and the
+  // coefficients of the Ritz vectors on the columns of v.
+  auto rayleighRitz = [&](const Eigen::MatrixXd &v, const Eigen::MatrixXd &av,
+                          const int &numVectors) {
+    Eigen::MatrixXd gram = innerProduct(v, v);
+    Eigen::MatrixXd h = innerProduct(v, av);
+    h = (0.5 * (h + h.transpose())).eval();
+    // orthonormal basis of the space, from the eigenvectors of the
+    // (ascending) Gram matrix with non-negligible eigenvalues
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> gramSolver(gram);
+    Eigen::VectorXd s = gramSolver.eigenvalues();
+    int numDropped = 0;
+    while (numDropped < s.size() &&
+           s(numDropped) <= dependenceThreshold * s.maxCoeff()) {
+      numDropped++;
+    }
+    int numKept = int(s.size()) - numDropped;
+    if (numKept < numVectors) {
+      Error("The lobpcg relaxons eigensolver lost the orthogonality"
+            " of the trial vectors");
+    }
+    Eigen::MatrixXd t = gramSolver.eigenvectors().rightCols(numKept) *
+                        s.tail(numKept).cwiseSqrt().cwiseInverse().asDiagonal();
+    Eigen::MatrixXd hReduced = t.transpose() * h * t;
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(hReduced);
+    Eigen::VectorXd e = solver.eigenvalues().head(numVectors);
+    Eigen::MatrixXd c = t * solver.eigenvectors().leftCols(numVectors);
+    return std::make_tuple(e, c);
+  };
+
+  auto normalizeColumns = [&](Eigen::MatrixXd &v, Eigen::MatrixXd &av) {
+    Eigen::VectorXd norms = columnNorms(v);
+    for (int j = 0; j < v.cols(); j++) {
+      if (norms(j) > 0.) {
+        v.col(j) /= norms(j);
+        av.col(j) /= norms(j);
+      }
+    }
+  };
+
+  // initial guess: the vectors in input, if any, completed with random
+  // vectors, with the same seed on all MPI processes
+  int numGuesses = 0;
+  if (initialGuess != nullptr && initialGuess->rows() == numStates) {
+    numGuesses = std::min(int(initialGuess->cols()), blockSize);
+  }
+  std::mt19937 generator(13);
+  std::uniform_real_distribution<double> distribution(-1., 1.);
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numLocalStates, blockSize);
+  for (int j = 0; j < blockSize; j++) {
+    for (int iBte = 0; iBte < numStates; iBte++) {
+      if (!isExcluded[iBte]) {
+        // the random numbers are drawn for all rows, to be independent of
+        // the number of processes
+        double value = j < numGuesses ? (*initialGuess)(iBte, j)
+                                      : distribution(generator);
+        if (iBte >= rowStart && iBte < rowStart + numLocalStates) {
+          x(iBte - rowStart, j) = value;
+        }
+      }
+    }
+  }
+  Eigen::MatrixXd ax = localBlockDot(x);
+  Eigen::VectorXd lambda;
+  {
+    auto tup = rayleighRitz(x, ax, blockSize);
+    lambda = std::get<0>(tup);
+    x = x * std::get<1>(tup);
+    ax = ax * std::get<1>(tup);
+  }
+
+  // search directions of the previous iteration (none at the first one)
+  Eigen::MatrixXd p, ap;
+
+  if (mpi->mpiHead()) {
+    std::cout << "Computing the first " << numEigenvalues
+              << " eigenvalues of the scattering matrix with LOBPCG";
+    if (numGuesses > 0) {
+      std::cout << ", starting from the previous relaxons";
+    }
+    std::cout << "." << std::endl;
+  }
+
+  int numConverged = 0;
+  int iter;
+  for (iter = 0; iter < maxIterations; iter++) {
+    Eigen::MatrixXd r = ax - x * lambda.asDiagonal();
+    Eigen::VectorXd residualNorms = columnNorms(r);
+    numConverged = 0;
+    for (int j = 0; j < numEigenvalues; j++) {
+      if (residualNorms(j) <= threshold * scale) {
+        numConverged++;
+      }
+    }
+    if (numConverged == numEigenvalues) {
+      break;
+    }
+
+    // new directions: preconditioned residuals, orthogonal to x
+    Eigen::MatrixXd w = localPreconditioner.asDiagonal() * r;
+    w -= x * innerProduct(x, w);
+    Eigen::MatrixXd aw = localBlockDot(w);
+    normalizeColumns(w, aw);
+
+    auto numP = int(p.cols());
+    Eigen::MatrixXd v(numLocalStates, 2 * blockSize + numP);
+    Eigen::MatrixXd av(numLocalStates, 2 * blockSize + numP);
+    v.leftCols(blockSize) = x;
+    av.leftCols(blockSize) = ax;
+    v.middleCols(blockSize, blockSize) = w;
+    av.middleCols(blockSize, blockSize) = aw;
+    if (numP > 0) {
+      v.rightCols(numP) = p;
+      av.rightCols(numP) = ap;
+    }
+
+    auto tup = rayleighRitz(v, av, blockSize);
+    lambda = std::get<0>(tup);
+    Eigen::MatrixXd c = std::get<1>(tup);
+
+    // the next search directions are the components of the new Ritz
+    // vectors outside of the old ones
+    int numNew = blockSize + numP;
+    p = v.rightCols(numNew) * c.bottomRows(numNew);
+    ap = av.rightCols(numNew) * c.bottomRows(numNew);
+    normalizeColumns(p, ap);
+    x = v * c;
+    ax = av * c;
+  }
+
+  if (mpi->mpiHead()) {
+    std::cout << "LOBPCG stopped after " << iter << " iterations, with "
+              << numConverged << " converged eigenvalues.\n" << std::endl;
+  }
+  if (isConverged != nullptr) {
+    *isConverged = numConverged == numEigenvalues;
+    if (!*isConverged) {
+      Kokkos::Profiling::popRegion();
+      return std::make_tuple(Eigen::VectorXd(), ParallelMatrix<double>());
+    }
+  } else if (numConverged < numEigenvalues) {
+    Warning("The lobpcg relaxons eigensolver didn't converge all "
+            "the eigenvalues.");
+  }
+
+  if (context.getCheckNegativeRelaxons()) {
+    int numNegative = 0;
+    for (int j = 0; j < numEigenvalues; j++) {
+      if (lambda(j) <= 0.) {
+        numNegative++;
+      }
+    }
+    if (numNegative > 3 && mpi->mpiHead()) {
+      // more than just the zero eigenmode was found
+      Warning("Relaxons diagonalization found " + std::to_string(numNegative) +
+              " eigenvalues <= 0. This can happen when there's a bit of"
+              "\n\tnumerical noise on the scattering matrix, and may"
+              " indicate the calculation is unconverged.");
+    }
+  }
+
+  // copy to the containers used by the direct diagonalization, where only
+  // the first numEigenvalues columns of the eigenvectors are set
+  ParallelMatrix<double> eigenvectors(numStates, numStates, 0, 0,
+                                      ParallelMatrix<double>::autoBlocks,
+                                      ParallelMatrix<double>::autoBlocks);
+  Eigen::MatrixXd xFull = gatherRows(x.leftCols(numEigenvalues));
+  for (int alpha : eigenvectors.getAllLocalCols()) {
+    if (alpha >= numEigenvalues) continue;
+    for (int iBte : eigenvectors.getAllLocalRows()) {
+      eigenvectors(iBte, alpha) = xFull(iBte, alpha);
+    }
+  }
+  Eigen::VectorXd eigenValues = lambda.head(numEigenvalues);
+
+  Kokkos::Profiling::popRegion();
+  return std::make_tuple(eigenValues, eigenvectors);
+}
+
+Eigen::MatrixXd ScatteringMatrix::blockDot(const Eigen::MatrixXd &x) {
+  // note: we are assuming that ScatteringMatrix has numCalculations = 1,
+  // and no symmetries, so that the matrix index is the Bte index
+  std::vector<bool> isExcluded(numStates, false);
+  for (int iBte : excludeIndices) {
+    isExcluded[iBte] = true;
+  }
+
+  if (isOmegaView) {
+    Eigen::VectorXd s = omegaViewScaling.row(0).transpose();
+    isOmegaView = false;
+    Eigen::MatrixXd y = blockDot(s.asDiagonal() * x);
+    isOmegaView = true;
+    return s.asDiagonal() * y;
+  }
+
+  auto numVectors = int(x.cols());
+  Eigen::MatrixXd y = Eigen::MatrixXd::Zero(numStates, numVectors);
+
+  if (isSparse) {
+    int numRows = theSparseMatrix.rows();
+#pragma omp parallel for
+    for (int iBte1 = 0; iBte1 < numRows; iBte1++) {
+      if (isExcluded[iBte1]) continue;
+      for (size_t k = theSparseMatrix.rowBegin(iBte1);
+           k < theSparseMatrix.rowBegin(iBte1 + 1); k++) {
+        int iBte2 = theSparseMatrix.colIndex(k);
+        if (isExcluded[iBte2]) continue;
+        y.row(iBte1) += theSparseMatrix.value(k) * x.row(iBte2);
+      }
+    }
+    // the diagonal is not stored in the sparse matrix: compute its
+    // contribution while the off-diagonal part is being reduced
+    MPIRequest request = mpi->iAllReduceSum(&y);
+    Eigen::MatrixXd yDiagonal = Eigen::MatrixXd::Zero(numStates, numVectors);
+    for (int iBte = 0; iBte < numStates; iBte++) {
+      if (isExcluded[iBte]) continue;
+      yDiagonal.row(iBte) = internalDiagonal(0, 0, iBte) * x.row(iBte);
+    }
+    request.wait();
+    y += yDiagonal;
+    return y;
+  }
+
+  std::vector<int> localRows = theMatrix.getAllLocalRows();
+  std::vector<int> localCols = theMatrix.getAllLocalCols();
+  auto numLocalRows = int(localRows.size());
+  auto numLocalCols = int(localCols.size());
+  if (numLocalRows > 0 && numLocalCols > 0) {
+    Eigen::MatrixXd xLocal = Eigen::MatrixXd::Zero(numLocalCols, numVectors);
+    for (int iCol = 0; iCol < numLocalCols; iCol++) {
+      if (!isExcluded[localCols[iCol]]) {
+        xLocal.row(iCol) = x.row(localCols[iCol]);
+      }
+    }
+    Eigen::Map<Eigen::MatrixXd> localMatrix(theMatrix.data(), numLocalRows,
+                                            numLocalCols);
+    Eigen::MatrixXd yLocal = localMatrix * xLocal;
+    for (int iRow = 0; iRow < numLocalRows; iRow++) {
+      if (!isExcluded[localRows[iRow]]) {
+        y.row(localRows[iRow]) += yLocal.row(iRow);
+      }
+    }
+  }
+  mpi->allReduceSum(&y);
+  return y;
+}
+
+std::set<int>
+ScatteringMatrix::getLocalIrrWavevectors(const std::vector<int> &matIndices) {
+  std::set<int> wavevectors;
+  for (int iMat : matIndices) {
+    BteIndex iBte = std::get<0>(getSMatrixIndex(iMat));
+    // map the index on the irreducible points of BTE to band structure index
+    StateIndex is = outerBandStructure.bteToState(iBte);
+    wavevectors.insert(std::get<0>(outerBandStructure.getIndex(is)).get());
+  }
+  return wavevectors;
+}
+
+std::vector<std::tuple<std::vector<int>, int>>
+ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
+                                             const bool &rowMajor) {
+  if (rowMajor) { // case for el-ph scattering
+    std::vector<std::tuple<std::vector<int>, int>> pairIterator;
+
+    // note: the sparse matrix is built like the linewidths,
+    // parallelizing over wavevectors rather than matrix elements
+    if (switchCase == 1 || switchCase == 2 || isSparse) { // case for linewidth construction
       // here I parallelize over ik1
-      // which is the outer loop on q-points
-      std::vector<int> k1Iterator =
-          outerBandStructure.parallelIrrPointsIterator();
+      // which is the outer loop on q-points.
+      // The cost of a pair is ~nb1*nb2*nb3, and since all k2 points are
+      // looped over for each k1, the cost of a k1 point scales with nb1,
+      // which can vary a lot at different points due to the energy window
+      std::vector<int> k1Iterator = divideWavevectors(
+          outerBandStructure.irrPointsIterator(), outerBandStructure);
 
       // I don't parallelize the inner band structure, the inner loop
       std::vector<int> k2Iterator(innerBandStructure.getNumPoints());
       // populate vector with integers from 0 to numPoints-1
       std::iota(std::begin(k2Iterator), std::end(k2Iterator), 0);
+      sortWavevectors(k2Iterator, innerBandStructure);
 
       for (int ik1 : k1Iterator) {
         auto t = std::make_tuple(k2Iterator, ik1);
@@ -933,42 +1810,19 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
 
       // here we operate assuming innerBandStructure=outerBandStructure
       // list in form [[0,0],[1,0],[2,0],...]
+      // The local elements of the matrix are all the pairs of a local row
+      // and a local column, so we only need the wavevectors of the local
+      // rows and columns, rather than unpacking each local element.
+      auto localK1s = getLocalIrrWavevectors(theMatrix.getAllLocalRows());
+      auto localK2s = getLocalIrrWavevectors(theMatrix.getAllLocalCols());
       std::set<std::pair<int, int>> localPairs;
-      std::vector<std::tuple<int, int>> localStates = theMatrix.getAllLocalStates();
-      int nlocalStates = localStates.size();
-#pragma omp parallel default(none) shared(localPairs, theMatrix, localStates, nlocalStates)
-      {
-        std::vector<std::pair<int, int>> localPairsPrivate;
-        // first unpack Bloch Index and get all wavevector pairs
-#pragma omp for nowait
-        for(int ilocalState = 0; ilocalState < nlocalStates; ilocalState++){
-          std::tuple<int,int> tup0 = localStates[ilocalState];
-          auto iMat1 = std::get<0>(tup0);
-          auto iMat2 = std::get<1>(tup0);
-          auto tup1 = getSMatrixIndex(iMat1);
-          auto tup2 = getSMatrixIndex(iMat2);
-          BteIndex iBte1 = std::get<0>(tup1);
-          BteIndex iBte2 = std::get<0>(tup2);
-          // map the index on the irreducible points of BTE to band structure
-          // index
-          StateIndex is1 = outerBandStructure.bteToState(iBte1);
-          StateIndex is2 = outerBandStructure.bteToState(iBte2);
-          auto tuple1 = outerBandStructure.getIndex(is1);
-          auto tuple2 = outerBandStructure.getIndex(is2);
-          WavevectorIndex ik1Index = std::get<0>(tuple1);
-          WavevectorIndex ik2Index = std::get<0>(tuple2);
-          int ik1Irr = ik1Index.get();
-          int ik2Irr = ik2Index.get();
-          for (int ik2 :
-               outerBandStructure.getReducibleStarFromIrreducible(ik2Irr)) {
-            std::pair<int, int> xx = std::make_pair(ik1Irr, ik2);
-            localPairsPrivate.push_back(xx);
+      for (int ik2Irr : localK2s) {
+        for (int ik2 :
+             outerBandStructure.getReducibleStarFromIrreducible(ik2Irr)) {
+          for (int ik1Irr : localK1s) {
+            localPairs.insert(std::make_pair(ik1Irr, ik2));
           }
         }
-#pragma omp critical
-        for (auto y : localPairsPrivate) {
-          localPairs.insert(y);
-        }
       }
 
       // find set of q1
@@ -985,6 +1839,7 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
       for (int x : q1IndexesSet) {
         q1Indexes.push_back(x);
       }
+      sortWavevectors(q1Indexes, outerBandStructure);
 
       for (int iq1 : q1Indexes) {
         std::vector<int> x;
@@ -1005,6 +1860,9 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
           Error("iq1 not found, not supposed to happen");
         }
       }
+      for (auto &t : pairIterator) {
+        sortWavevectors(std::get<0>(t), innerBandStructure);
+      }
     }
 
     // Patch to make pooled interpolation of coupling work
@@ -1031,12 +1889,16 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
 
   } else { // case for ph_scattering
 
-    if (switchCase == 1 || switchCase == 2) { // case for dot
+    if (switchCase == 1 || switchCase == 2 || isSparse) { // case for dot
       // must parallelize over the inner band structure (iq2 in phonons)
-      // which is the outer loop on q-points
-      size_t a = innerBandStructure.getNumPoints();
-      auto q2Iterator = mpi->divideWorkIter(a);
+      // which is the outer loop on q-points.
+      // All q1 points are looped over for each q2, so that the cost of a q2
+      // point (~nb1*nb2*nb3 per pair) scales with its number of bands
+      std::vector<int> q2s(innerBandStructure.getNumPoints());
+      std::iota(q2s.begin(), q2s.end(), 0);
+      auto q2Iterator = divideWavevectors(q2s, innerBandStructure);
       std::vector<int> q1Iterator = outerBandStructure.irrPointsIterator();
+      sortWavevectors(q1Iterator, outerBandStructure);
 
       std::vector<std::tuple<std::vector<int>, int>> pairIterator;
       for (int iq2 : q2Iterator) {
@@ -1048,42 +1910,17 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
 
     } else { // case for constructing A matrix
 
+      // as above, the local elements pair each local row with each local col
+      auto localQ1s = getLocalIrrWavevectors(theMatrix.getAllLocalRows());
+      auto localQ2s = getLocalIrrWavevectors(theMatrix.getAllLocalCols());
       std::set<std::pair<int, int>> localPairs;
-      std::vector<std::tuple<int, int>> localStates = theMatrix.getAllLocalStates();
-      int nlocalStates = localStates.size();
-#pragma omp parallel default(none) shared(theMatrix, localPairs, localStates, nlocalStates)
-      {
-        std::vector<std::pair<int, int>> localPairsPrivate;
-        // first unpack Bloch Index and get all wavevector pairs
-#pragma omp for nowait
-        for(int ilocalState = 0; ilocalState < nlocalStates; ilocalState++){
-          std::tuple<int,int> tup0 = localStates[ilocalState];
-          auto iMat1 = std::get<0>(tup0);
-          auto iMat2 = std::get<1>(tup0);
-          auto tup1 = getSMatrixIndex(iMat1);
-          auto tup2 = getSMatrixIndex(iMat2);
-          BteIndex iBte1 = std::get<0>(tup1);
-          BteIndex iBte2 = std::get<0>(tup2);
-          // map the index on the irreducible points of BTE to band structure
-          // index
-          StateIndex is1 = outerBandStructure.bteToState(iBte1);
-          StateIndex is2 = outerBandStructure.bteToState(iBte2);
-          auto tuple1 = outerBandStructure.getIndex(is1);
-          auto tuple2 = outerBandStructure.getIndex(is2);
-          WavevectorIndex iq1Index = std::get<0>(tuple1);
-          WavevectorIndex iq2Index = std::get<0>(tuple2);
-          int iq1Irr = iq1Index.get();
-          int iq2Irr = iq2Index.get();
-          for (int iq2 :
-               outerBandStructure.getReducibleStarFromIrreducible(iq2Irr)) {
-            std::pair<int, int> xx = std::make_pair(iq1Irr, iq2);
-            localPairsPrivate.push_back(xx);
+      for (int iq2Irr : localQ2s) {
+        for (int iq2 :
+             outerBandStructure.getReducibleStarFromIrreducible(iq2Irr)) {
+          for (int iq1Irr : localQ1s) {
+            localPairs.insert(std::make_pair(iq1Irr, iq2));
           }
         }
-#pragma omp critical
-        for (auto y : localPairsPrivate) {
-          localPairs.insert(y);
-        }
       }
 
       // find set of q2
@@ -1099,6 +1936,7 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
       for (int x : q2IndexesSet) {
         q2Indexes.push_back(x);
       }
+      sortWavevectors(q2Indexes, innerBandStructure);
 
       std::vector<std::tuple<std::vector<int>, int>> pairIterator;
       for (int iq2 : q2Indexes) {
@@ -1120,11 +1958,264 @@ ScatteringMatrix::getIteratorWavevectorPairs(const int &switchCase,
           Error("iq2 not found, not supposed to happen");
         }
       }
+      for (auto &t : pairIterator) {
+        sortWavevectors(std::get<0>(t), outerBandStructure);
+      }
       return pairIterator;
     }
   }
 }
 
+void ScatteringMatrix::sortWavevectors(std::vector<int> &iks,
+                                       BaseBandStructure &bandStructure) {
+  std::string ordering = context.getWavevectorOrdering();
+  if (ordering == "index" || iks.size() < 2) {
+    return;
+  }
+  Points points = bandStructure.getPoints();
+  std::vector<std::pair<uint64_t, int>> keys(iks.size());
+  for (size_t i = 0; i < iks.size(); i++) {
+    keys[i] = std::make_pair(points.getCurveIndex(iks[i], ordering), iks[i]);
+  }
+  std::sort(keys.begin(), keys.end());
+  for (size_t i = 0; i < iks.size(); i++) {
+    iks[i] = keys[i].second;
+  }
+}
+
+std::vector<int>
+ScatteringMatrix::divideWavevectors(std::vector<int> iks,
+                                    BaseBandStructure &bandStructure) {
+  sortWavevectors(iks, bandStructure);
+  std::vector<double> costs(iks.size());
+  for (size_t i = 0; i < iks.size(); i++) {
+    WavevectorIndex ikIdx(iks[i]);
+    costs[i] = bandStructure.getNumBands(ikIdx);
+  }
+  std::vector<int> myIks;
+  if (context.getWavevectorOrdering() == "index") {
+    for (size_t i : mpi->divideWorkIterWeighted(costs)) {
+      myIks.push_back(iks[i]);
+    }
+  } else {
+    auto range = mpi->divideWorkWeighted(costs);
+    for (size_t i = range[0]; i < range[1]; i++) {
+      myIks.push_back(iks[i]);
+    }
+  }
+  return myIks;
+}
+
+bool ScatteringMatrix::pairTimeReversal(
+    std::vector<std::tuple<std::vector<int>, int>> &pairIterator,
+    const bool &rowMajor, const int &switchCase) {
+  timeReversedOuterPoints.clear();
+  timeReversedInnerPoints.clear();
+  if (!context.getUseTimeReversal() || (switchCase != 1 && switchCase != 2)
+      || &innerBandStructure != &outerBandStructure) {
+    return false;
+  }
+
+  // -k must have the same bands as k, which may not be the case for an
+  // active band structure, if the energies are at the edge of the window
+  Points points = outerBandStructure.getPoints();
+  int numPoints_ = outerBandStructure.getNumPoints();
+  std::vector<bool> isIrreducible(numPoints_, false);
+  for (int ik : outerBandStructure.irrPointsIterator()) {
+    isIrreducible[ik] = true;
+  }
+  timeReversedOuterPoints.assign(numPoints_, -1);
+  timeReversedInnerPoints.assign(numPoints_, -1);
+#pragma omp parallel for
+  for (int ik = 0; ik < numPoints_; ik++) {
+    Eigen::Vector3d k = points.getPointCoordinates(ik);
+    int ikReversed = points.isPointStored(-k);
+    if (ikReversed < 0) {
+      continue;
+    }
+    WavevectorIndex ikIdx(ik);
+    WavevectorIndex ikReversedIdx(ikReversed);
+    if (outerBandStructure.getNumBands(ikIdx) !=
+        outerBandStructure.getNumBands(ikReversedIdx)) {
+      continue;
+    }
+    timeReversedInnerPoints[ik] = ikReversed;
+    if (isIrreducible[ik] && isIrreducible[ikReversed]) {
+      timeReversedOuterPoints[ik] = ikReversed;
+    }
+  }
+
+  // the same pairs are removed on every MPI process, which only depends on
+  // the indices of the pair and of its time-reversed pair
+  double numPairsTotal = 0.;
+  double numPairsKept = 0.;
+  for (auto &t : pairIterator) {
+    int ik = std::get<1>(t);
+    if (ik < 0) { // dummy pairs of the MPI pools
+      continue;
+    }
+    std::vector<int> keptPartners;
+    for (int iPartner : std::get<0>(t)) {
+      int ik1 = rowMajor ? ik : iPartner;
+      int ik2 = rowMajor ? iPartner : ik;
+      int ik1Reversed = timeReversedOuterPoints[ik1];
+      int ik2Reversed = timeReversedInnerPoints[ik2];
+      if (ik1Reversed < 0 || ik2Reversed < 0 || ik1 < ik1Reversed ||
+          (ik1 == ik1Reversed && ik2 <= ik2Reversed)) {
+        keptPartners.push_back(iPartner);
+      }
+    }
+    numPairsTotal += double(std::get<0>(t).size());
+    numPairsKept += double(keptPartners.size());
+    std::get<0>(t) = keptPartners;
+  }
+  mpi->allReduceSum(&numPairsTotal);
+  mpi->allReduceSum(&numPairsKept);
+  if (mpi->mpiHead() && numPairsTotal > 0.) {
+    std::cout << "Time-reversal symmetry reduces the wavevector pairs to "
+              << std::setprecision(4) << numPairsKept / numPairsTotal * 100.
+              << "%." << std::endl;
+  }
+  return true;
+}
+
+std::tuple<int, int> ScatteringMatrix::getTimeReversedPair(const int &ik1,
+                                                          const int &ik2) {
+  if (timeReversedOuterPoints.empty()) {
+    return {-1, -1};
+  }
+  int ik1Reversed = timeReversedOuterPoints[ik1];
+  int ik2Reversed = timeReversedInnerPoints[ik2];
+  if (ik1Reversed < 0 || ik2Reversed < 0 ||
+      (ik1Reversed == ik1 && ik2Reversed == ik2)) {
+    return {-1, -1};
+  }
+  return {ik1Reversed, ik2Reversed};
+}
+
+bool ScatteringMatrix::isPartnerSampling(const int &switchCase) {
+  return switchCase == 2 && context.getPartnerSamplingFraction() < 1.;
+}
+
+std::vector<std::vector<double>> ScatteringMatrix::samplePartners(
+    std::vector<std::tuple<std::vector<int>, int>> &pairIterator,
+    const std::function<double(const int &, const int &)> &likelihood) {
+  double fraction = context.getPartnerSamplingFraction();
+  int seed = context.getPartnerSamplingSeed();
+  auto numTuples = int(pairIterator.size());
+  std::vector<std::vector<double>> pairWeights(numTuples);
+
+  double numPartnersTotal = 0.;
+  double numPartnersKept = 0.;
+#pragma omp parallel for schedule(dynamic) reduction(+ : numPartnersTotal, numPartnersKept)
+  for (int iTuple = 0; iTuple < numTuples; iTuple++) {
+    std::vector<int> &partners = std::get<0>(pairIterator[iTuple]);
+    int ik = std::get<1>(pairIterator[iTuple]);
+    if (ik < 0) { // dummy pairs of the MPI pools
+      continue;
+    }
+    auto numPartners = int(partners.size());
+    std::vector<double> likelihoods(numPartners);
+    for (int i = 0; i < numPartners; i++) {
+      likelihoods[i] = likelihood(ik, partners[i]);
+    }
+
+    // we look for c such that sum_i min(1, c L_i) = fraction * numPartners.
+    // With the likelihoods in decreasing order, the first m partners are
+    // always kept, and c = (target - m) / (sum of the other likelihoods).
+    // c < 0 means that all the partners with L > 0 are kept.
+    std::vector<double> sorted = likelihoods;
+    std::sort(sorted.begin(), sorted.end(), std::greater<>());
+    double target = fraction * numPartners;
+    double tail = std::accumulate(sorted.begin(), sorted.end(), 0.);
+    double c = -1.;
+    for (int m = 0; m < numPartners && sorted[m] > 0.; m++) {
+      double cm = (target - m) / tail;
+      if (cm * sorted[m] <= 1.) {
+        c = cm;
+        break;
+      }
+      tail -= sorted[m];
+    }
+
+    // the random numbers are drawn for all the partners, in a fixed order,
+    // so that they don't depend on the likelihoods of the other partners
+    std::seed_seq seedSequence{seed, ik};
+    std::mt19937 generator(seedSequence);
+    std::uniform_real_distribution<double> distribution(0., 1.);
+    std::vector<int> keptPartners;
+    std::vector<double> weights;
+    for (int i = 0; i < numPartners; i++) {
+      double r = distribution(generator);
+      if (likelihoods[i] <= 0.) {
+        continue;
+      }
+      double p = c < 0. ? 1. : std::min(1., c * likelihoods[i]);
+      if (r < p) {
+        keptPartners.push_back(partners[i]);
+        weights.push_back(1. / p);
+      }
+    }
+    numPartnersTotal += numPartners;
+    numPartnersKept += double(keptPartners.size());
+    partners = keptPartners;
+    pairWeights[iTuple] = weights;
+  }
+
+  mpi->allReduceSum(&numPartnersTotal);
+  mpi->allReduceSum(&numPartnersKept);
+  if (mpi->mpiHead() && numPartnersTotal > 0.) {
+    std::cout << "Sampled " << std::setprecision(4)
+              << numPartnersKept / numPartnersTotal * 100.
+              << "% of the scattering partners." << std::endl;
+  }
+  return pairWeights;
+}
+
+double ScatteringMatrix::getPairLikelihood(const Eigen::VectorXd &mismatches,
+                                           const Eigen::MatrixXd &velocities) {
+  auto numEntries = int(mismatches.size());
+  if (numEntries == 0) {
+    return 0.;
+  }
+  Eigen::VectorXd deltas = smearing->getSmearings(mismatches, velocities);
+  Eigen::VectorXd peaks =
+      smearing->getSmearings(Eigen::VectorXd::Zero(numEntries), velocities);
+  double likelihood = 0.;
+  for (int i = 0; i < numEntries; i++) {
+    if (peaks(i) > 0.) {
+      likelihood = std::max(likelihood, deltas(i) / peaks(i));
+    }
+  }
+  return std::min(1., likelihood);
+}
+
+Eigen::MatrixXd
+ScatteringMatrix::getSampledStates(VectorBTE *linewidth,
+                                   const std::vector<int> &iBtes) {
+  Eigen::MatrixXd values(numCalculations, iBtes.size());
+  for (size_t i = 0; i < iBtes.size(); i++) {
+    values.col(i) = linewidth->data.col(iBtes[i]);
+  }
+  return values;
+}
+
+void ScatteringMatrix::addSampledPair(VectorBTE *linewidth,
+                                      const std::vector<int> &iBtes,
+                                      const Eigen::MatrixXd &previous,
+                                      const double &weight) {
+  for (size_t i = 0; i < iBtes.size(); i++) {
+    int iBte = iBtes[i];
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      double contribution =
+          linewidth->operator()(iCalc, 0, iBte) - previous(iCalc, i);
+      linewidth->operator()(iCalc, 0, iBte) += (weight - 1.) * contribution;
+      linewidthVariance->operator()(iCalc, 0, iBte) +=
+          (weight - 1.) * weight * contribution * contribution;
+    }
+  }
+}
+
 int ScatteringMatrix::getSMatrixIndex(BteIndex &bteIndex,
                                       CartIndex &cartIndex) {
   if (context.getUseSymmetries()) {
@@ -1157,7 +2248,13 @@ void ScatteringMatrix::symmetrize() {
     // not only, probably it doesn't make sense. To be checked
   }
 
-  if (highMemory) {
+  if (isSinglePrecision) {
+    Error("Developer error: symmetrize the matrix before reducePrecision");
+  }
+
+  if (isSparse) {
+    theSparseMatrix.symmetrize();
+  } else if (highMemory) {
     theMatrix.symmetrize();
   } else {
     Warning("The symmetrization of the scattering matrix is not\n"
@@ -1165,43 +2262,124 @@ void ScatteringMatrix::symmetrize() {
   }
 }
 
-void ScatteringMatrix::degeneracyAveragingLinewidths(VectorBTE *linewidth) {
-  for (int ik : outerBandStructure.irrPointsIterator()) {
-    WavevectorIndex ikIdx(ik);
-    Eigen::VectorXd en = outerBandStructure.getEnergies(ikIdx);
-    auto numBands = int(en.size());
+void ScatteringMatrix::copyToSplitGroup() {
+  if (!highMemory || isSparse || isSinglePrecision || isOnDevice) {
+    Error("Developer error: only the dense double precision matrix in "
+          "memory can be copied to the groups of processes");
+  }
+#ifdef MPI_AVAIL
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::copyToSplitGroup");
+  theMatrix = theMatrix.copyToSplitGroup();
+  Kokkos::Profiling::popRegion();
+#endif
+}
 
-    Eigen::VectorXd linewidthTmp(numBands);
-    linewidthTmp.setZero();
+void ScatteringMatrix::reducePrecision() {
+  // the single precision copy would be kept in memory
+  if (!highMemory || isSparse || isSinglePrecision || theMatrix.isOutOfCore()) {
+    return;
+  }
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::reducePrecision");
 
-    for (int ib1 = 0; ib1 < numBands; ib1++) {
-      double ekk = en(ib1);
-      int n = 0;
-      double tmp2 = 0.;
-      for (int ib2 = 0; ib2 < numBands; ib2++) {
-        double ekk2 = en(ib2);
+  singleLocalRows = theMatrix.getAllLocalRows();
+  singleLocalCols = theMatrix.getAllLocalCols();
+  auto numLocalRows = int(singleLocalRows.size());
+  auto numLocalCols = int(singleLocalCols.size());
 
-        BandIndex ibIdx(ib2);
-        int is = outerBandStructure.getIndex(ikIdx, ibIdx);
-        StateIndex isIdx(is);
-        BteIndex ind1Idx = outerBandStructure.stateToBte(isIdx);
-        int iBte1 = ind1Idx.get();
+  std::vector<int> rowsBte(numLocalRows);
+  for (int iRow = 0; iRow < numLocalRows; iRow++) {
+    rowsBte[iRow] = std::get<0>(getSMatrixIndex(singleLocalRows[iRow])).get();
+  }
 
-        if (abs(ekk2 - ekk) < 1.0e-6) {
-          n++;
-          tmp2 = tmp2 + linewidth->data(0, iBte1);
-        }
+  theSingleMatrix.resize(size_t(numLocalRows) * numLocalCols);
+  double *localData = theMatrix.data();
+#pragma omp parallel for
+  for (int iCol = 0; iCol < numLocalCols; iCol++) {
+    int iBte2 = std::get<0>(getSMatrixIndex(singleLocalCols[iCol])).get();
+    for (int iRow = 0; iRow < numLocalRows; iRow++) {
+      size_t k = size_t(iCol) * numLocalRows + iRow;
+      if (rowsBte[iRow] == iBte2) {
+        theSingleMatrix[k] = 0.;
+      } else {
+        theSingleMatrix[k] = float(localData[k]);
+      }
+    }
+  }
+  for (int iCol = 0; iCol < numLocalCols; iCol++) {
+    int iBte2 = std::get<0>(getSMatrixIndex(singleLocalCols[iCol])).get();
+    for (int iRow = 0; iRow < numLocalRows; iRow++) {
+      if (rowsBte[iRow] == iBte2) {
+        size_t k = size_t(iCol) * numLocalRows + iRow;
+        diagonalBlockElements.emplace_back(iRow, iCol, localData[k]);
       }
-      linewidthTmp(ib1) = tmp2 / float(n);
     }
+  }
+
+  // release the memory of the double precision matrix
+  theMatrix = ParallelMatrix<double>();
+  isSinglePrecision = true;
+
+  if (mpi->mpiHead()) {
+    std::cout << "Scattering matrix converted to single precision.\n"
+              << std::endl;
+  }
+  Kokkos::Profiling::popRegion();
+}
+
+void ScatteringMatrix::copyToDevice() {
+  DeviceMemoryScope memoryScope("ScatteringMatrix");
+  if (!highMemory || isSparse || isSinglePrecision || isOnDevice) {
+    return;
+  }
+  int numLocalRows = theMatrix.localRows();
+  int numLocalCols = theMatrix.localCols();
+  double memory = double(numLocalRows) * numLocalCols * sizeof(double);
+  // the populations need little memory compared to the matrix
+  int fits = memory < 0.9 * kokkosDeviceMemory->getAvailableMemory();
+  mpi->allReduceMin(&fits);
+  if (fits == 0) {
+    Warning("The scattering matrix doesn't fit in the device memory,\n"
+            "the matrix-vector products are done on the host.");
+    return;
+  }
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::copyToDevice");
+
+  Kokkos::View<double **, Kokkos::LayoutLeft, Kokkos::HostSpace,
+               Kokkos::MemoryTraits<Kokkos::Unmanaged>>
+      hostMatrix(theMatrix.data(), numLocalRows, numLocalCols);
+  deviceMatrix = Kokkos::View<double **, Kokkos::LayoutLeft>(
+      Kokkos::ViewAllocateWithoutInitializing("scatteringMatrix"),
+      numLocalRows, numLocalCols);
+  Kokkos::deep_copy(deviceMatrix, hostMatrix);
+  kokkosDeviceMemory->addDeviceMemoryUsage(memory);
+  isOnDevice = true;
+
+  if (mpi->mpiHead()) {
+    std::cout << "Scattering matrix copied to the device.\n" << std::endl;
+  }
+  Kokkos::Profiling::popRegion();
+}
 
-    for (int ib1 = 0; ib1 < numBands; ib1++) {
-      BandIndex ibIdx(ib1);
-      int is = outerBandStructure.getIndex(ikIdx, ibIdx);
-      StateIndex isIdx(is);
-      BteIndex ind1Idx = outerBandStructure.stateToBte(isIdx);
-      int iBte1 = ind1Idx.get();
-      linewidth->data(0, iBte1) = linewidthTmp(ib1);
+void ScatteringMatrix::degeneracyAveragingLinewidths(VectorBTE *linewidth) {
+  std::vector<int> irrPoints = outerBandStructure.irrPointsIterator();
+#pragma omp parallel for
+  for (int i = 0; i < int(irrPoints.size()); i++) {
+    WavevectorIndex ikIdx(irrPoints[i]);
+    // non-degenerate bands are left untouched
+    for (auto [start, degDegree] :
+         outerBandStructure.getDegenerateGroups(ikIdx)) {
+      std::vector<int> iBtes(degDegree);
+      double tmp = 0.;
+      for (int ib = 0; ib < degDegree; ib++) {
+        int is = outerBandStructure.getIndex(ikIdx, BandIndex(start + ib));
+        StateIndex isIdx(is);
+        iBtes[ib] = outerBandStructure.stateToBte(isIdx).get();
+        tmp += linewidth->data(0, iBtes[ib]);
+      }
+      tmp /= degDegree;
+      for (int iBte : iBtes) {
+        linewidth->data(0, iBte) = tmp;
+      }
     }
   }
 }
@@ -1210,115 +2388,915 @@ void ScatteringMatrix::symmetrizeCoupling(Eigen::Tensor<double,3>& coupling,
                                           const Eigen::VectorXd& energies1,
                                           const Eigen::VectorXd& energies2,
                                           const Eigen::VectorXd& energies3){
-  int nb1 = energies1.size();
-  int nb2 = energies2.size();
-  int nb3 = energies3.size();
-
-  for (int ib1 = 0; ib1 < nb1; ib1++) {
-    double e1 = energies1(ib1);
-    // determine degeneracy degree
-    int degDegree = 0;
-    for (int i = ib1; i < nb1; i++) {
-      double e2 = energies1(i);
-      if (abs(e1 - e2) < 1.0e-6) { // at first iteration, ib1=ib2, degDegree=1
-        degDegree++;
-      } else {
-        break;
+  symmetrizeCoupling(coupling,
+                     BaseBandStructure::findDegenerateGroups(energies1),
+                     BaseBandStructure::findDegenerateGroups(energies2),
+                     BaseBandStructure::findDegenerateGroups(energies3));
+}
+
+void ScatteringMatrix::symmetrizeCoupling(
+    Eigen::Tensor<double,3>& coupling,
+    const std::vector<std::tuple<int,int>>& groups1,
+    const std::vector<std::tuple<int,int>>& groups2,
+    const std::vector<std::tuple<int,int>>& groups3) {
+  symmetrizeCoupling(Eigen::TensorMap<Eigen::Tensor<double, 3>>(
+                         coupling.data(), coupling.dimensions()),
+                     groups1, groups2, groups3);
+}
+
+void ScatteringMatrix::symmetrizeCoupling(
+    Eigen::TensorMap<Eigen::Tensor<double,3>> coupling,
+    const std::vector<std::tuple<int,int>>& groups1,
+    const std::vector<std::tuple<int,int>>& groups2,
+    const std::vector<std::tuple<int,int>>& groups3) {
+  auto nb1 = int(coupling.dimension(0));
+  auto nb2 = int(coupling.dimension(1));
+  auto nb3 = int(coupling.dimension(2));
+
+  // average over ib1, for each (ib2,ib3)
+  for (auto [start, degDegree] : groups1) {
+    for (int ib3 = 0; ib3 < nb3; ib3++) {
+      for (int ib2 = 0; ib2 < nb2; ib2++) {
+        double tmp = 0.;
+        for (int i = 0; i < degDegree; i++) {
+          tmp += coupling(start + i, ib2, ib3);
+        }
+        tmp /= degDegree;
+        for (int i = 0; i < degDegree; i++) {
+          coupling(start + i, ib2, ib3) = tmp;
+        }
       }
     }
-    Eigen::MatrixXd tmpCoupling(nb2,nb3);
-    tmpCoupling.setZero();
-    // now do averaging
-    for (int i=0; i<degDegree; ++i) {
+  }
+
+  // average over ib2, for each (ib1,ib3). ib1 is the innermost index,
+  // contiguous in memory
+  Eigen::VectorXd tmpCoupling(nb1);
+  for (auto [start, degDegree] : groups2) {
+    for (int ib3 = 0; ib3 < nb3; ib3++) {
+      tmpCoupling.setZero();
+      for (int i = 0; i < degDegree; i++) {
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          tmpCoupling(ib1) += coupling(ib1, start + i, ib3);
+        }
+      }
+      tmpCoupling /= double(degDegree);
+      for (int i = 0; i < degDegree; i++) {
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          coupling(ib1, start + i, ib3) = tmpCoupling(ib1);
+        }
+      }
+    }
+  }
+
+  // average over ib3, for each (ib1,ib2)
+  Eigen::MatrixXd tmpCoupling2(nb1, nb2);
+  for (auto [start, degDegree] : groups3) {
+    tmpCoupling2.setZero();
+    for (int i = 0; i < degDegree; i++) {
       for (int ib2 = 0; ib2 < nb2; ib2++) {
-        for (int ib3 = 0; ib3 < nb3; ib3++) {
-          tmpCoupling(ib2, ib3) += coupling(ib1 + i, ib2, ib3) / float(degDegree);
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          tmpCoupling2(ib1, ib2) += coupling(ib1, ib2, start + i);
         }
       }
     }
-    // substitute back
-    for (int i=0; i<degDegree; ++i) {
+    tmpCoupling2 /= double(degDegree);
+    for (int i = 0; i < degDegree; i++) {
       for (int ib2 = 0; ib2 < nb2; ib2++) {
-        for (int ib3 = 0; ib3 < nb3; ib3++) {
-          coupling(ib1 + i, ib2, ib3) = tmpCoupling(ib2, ib3);
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          coupling(ib1, ib2, start + i) = tmpCoupling2(ib1, ib2);
         }
       }
     }
-    // now skip to next iteration
-    ib1 += degDegree - 1; // -1 because there's another addition in the loop
+  }
+}
+
+std::vector<std::tuple<int, int>> ScatteringMatrix::getAllLocalStates() {
+
+  return theMatrix.getAllLocalStates();
+
+}
+
+// name of the file where the current MPI process checkpoints the builder
+std::string getBuilderCheckpointFileName(Context &context) {
+  return context.getCheckpointPrefix() + ".scattering.rank"
+         + std::to_string(mpi->getRank()) + ".hdf5";
+}
+
+int ScatteringMatrix::loadBuilderCheckpoint(const int &switchCase,
+                                            const int &numPairs,
+                                            VectorBTE *linewidth) {
+  // checkpoints are only used to save the expensive builder calls in setup()
+  // with sampled partners, the linewidth variances aren't checkpointed
+  if (context.getScatteringCheckpointInterval() <= 0 || switchCase == 1
+      || numSampledPairs > 0 || isPartnerSampling(switchCase)) {
+    return 0;
+  }
+  if (isSparse && switchCase == 0) {
+    Warning("Checkpoints are not implemented for the sparse scattering matrix.");
+    return 0;
   }
 
-  for (int ib2 = 0; ib2 < nb2; ib2++) {
-    double e1 = energies2(ib2);
-    // determine degeneracy degree
-    int degDegree = 0;
-    for (int i = ib2; i < nb2; i++) {
-      double e2 = energies2(i);
-      if (abs(e1 - e2) < 1.0e-6) { // at first iteration, ib1=ib2, degDegree=1
-        degDegree++;
+#ifndef HDF5_AVAIL
+  (void) numPairs;
+  (void) linewidth;
+  Error("Checkpointing the scattering matrix requires Phoebe built with HDF5.");
+  return 0;
+#else
+
+  std::string fileName = getBuilderCheckpointFileName(context);
+
+  int numPairsDone = 0;
+  // 0: no checkpoint found, 1: checkpoint loaded, -1: invalid checkpoint
+  int status = 0;
+  {
+    std::ifstream tmpFile(fileName);
+    if (tmpFile.good()) {
+      status = 1;
+    }
+  }
+
+  if (status == 1) {
+    try {
+      HighFive::File file(fileName, HighFive::File::ReadOnly);
+
+      int numRanks_, switchCase_, numPairs_, numStates_, numCalculations_;
+      int localSize_, numPairsDone_;
+      file.getDataSet("/numRanks").read(numRanks_);
+      file.getDataSet("/switchCase").read(switchCase_);
+      file.getDataSet("/numPairs").read(numPairs_);
+      file.getDataSet("/numStates").read(numStates_);
+      file.getDataSet("/numCalculations").read(numCalculations_);
+      file.getDataSet("/localMatrixSize").read(localSize_);
+      file.getDataSet("/numPairsDone").read(numPairsDone_);
+
+      // the checkpoint can only be used if the parallel distribution of work
+      // is the same as the run that wrote it
+      if (numRanks_ != mpi->getSize() || switchCase_ != switchCase ||
+          numPairs_ != numPairs || numStates_ != numStates ||
+          numCalculations_ != numCalculations ||
+          localSize_ != theMatrix.localSize()) {
+        status = -1;
       } else {
-        break;
+        numPairsDone = numPairsDone_;
+
+        Eigen::MatrixXd linewidthData;
+        file.getDataSet("/linewidths").read(linewidthData);
+        linewidth->data = linewidthData;
+
+        if (switchCase == 0) {
+          Eigen::VectorXd matrixData;
+          file.getDataSet("/localMatrix").read(matrixData);
+          double *buffer = theMatrix.data();
+          for (int i = 0; i < theMatrix.localSize(); i++) {
+            buffer[i] = matrixData(i);
+          }
+        }
+        if (switchCase == 2 && outputUNTimes) {
+          Eigen::MatrixXd umklappData, normalData;
+          file.getDataSet("/umklappLinewidths").read(umklappData);
+          file.getDataSet("/normalLinewidths").read(normalData);
+          internalDiagonalUmklapp->data = umklappData;
+          internalDiagonalNormal->data = normalData;
+        }
       }
+    } catch (std::exception &error) {
+      status = -1;
     }
-    Eigen::MatrixXd tmpCoupling(nb1,nb3);
-    tmpCoupling.setZero();
-    // now do averaging
-    for (int i=0; i<degDegree; ++i) {
-      for (int ib1 = 0; ib1 < nb1; ib1++) {
-        for (int ib3 = 0; ib3 < nb3; ib3++) {
-          tmpCoupling(ib1, ib3) += coupling(ib1, ib2+i, ib3) / float(degDegree);
+  }
+
+  // all processes must agree that the checkpoints are valid
+  int minStatus = status;
+  mpi->allReduceMin(&minStatus);
+  if (minStatus == -1) {
+    Error("The scattering matrix checkpoint files with prefix "
+          + context.getCheckpointPrefix() + " are not compatible with the\n"
+          "current run (e.g. a different number of MPI processes was used).\n"
+          "Remove them to restart the calculation from scratch.");
+  }
+
+  // when the el-ph coupling is distributed over a pool, the processes of the
+  // pool must loop over the same number of wavevectors
+  int minDone = numPairsDone;
+  int maxDone = numPairsDone;
+  mpi->allReduceMin(&minDone, mpi->intraPoolComm);
+  mpi->allReduceMax(&maxDone, mpi->intraPoolComm);
+  int poolMismatch = int(minDone != maxDone);
+  mpi->allReduceMax(&poolMismatch);
+  if (poolMismatch != 0) {
+    Error("Scattering matrix checkpoint files are inconsistent within a pool.\n"
+          "Remove them to restart the calculation from scratch.");
+  }
+
+  int numRestarted = int(status == 1);
+  mpi->allReduceSum(&numRestarted);
+  if (mpi->mpiHead() && numRestarted > 0) {
+    std::cout << "Restarting the scattering matrix construction from "
+              << "checkpoint files with prefix " << context.getCheckpointPrefix()
+              << "." << std::endl;
+  }
+  return numPairsDone;
+#endif
+}
+
+void ScatteringMatrix::saveBuilderCheckpoint(const int &switchCase,
+                                             const int &numPairsDone,
+                                             const int &numPairs,
+                                             VectorBTE *linewidth) {
+  int interval = context.getScatteringCheckpointInterval();
+  if (interval <= 0 || switchCase == 1 || (isSparse && switchCase == 0)
+      || numSampledPairs > 0 || isPartnerSampling(switchCase)
+      || numPairsDone == 0
+      || numPairsDone % interval != 0 || numPairsDone == numPairs) {
+    return;
+  }
+
+#ifdef HDF5_AVAIL
+  std::string fileName = getBuilderCheckpointFileName(context);
+  // write to a temporary file first, so that if the job is killed while
+  // writing, the previous checkpoint is still usable
+  std::string tmpFileName = fileName + ".tmp";
+
+  try {
+    {
+      HighFive::File file(tmpFileName, HighFive::File::Overwrite);
+
+      int numRanks_ = mpi->getSize();
+      int localSize_ = theMatrix.localSize();
+      std::vector<std::pair<std::string, int>> header = {
+          {"/numRanks", numRanks_},
+          {"/switchCase", switchCase},
+          {"/numPairs", numPairs},
+          {"/numStates", numStates},
+          {"/numCalculations", numCalculations},
+          {"/localMatrixSize", localSize_},
+          {"/numPairsDone", numPairsDone}};
+      for (auto &p : header) {
+        HighFive::DataSet dHeader = file.createDataSet<int>(
+            p.first, HighFive::DataSpace::From(p.second));
+        dHeader.write(p.second);
+      }
+
+      HighFive::DataSet dLinewidths = file.createDataSet<double>(
+          "/linewidths", HighFive::DataSpace::From(linewidth->data));
+      dLinewidths.write(linewidth->data);
+
+      if (switchCase == 0) {
+        Eigen::VectorXd matrixData =
+            Eigen::Map<Eigen::VectorXd>(theMatrix.data(), localSize_);
+        HighFive::DataSet dMatrix = file.createDataSet<double>(
+            "/localMatrix", HighFive::DataSpace::From(matrixData));
+        dMatrix.write(matrixData);
+      }
+      if (switchCase == 2 && outputUNTimes) {
+        HighFive::DataSet dU = file.createDataSet<double>(
+            "/umklappLinewidths",
+            HighFive::DataSpace::From(internalDiagonalUmklapp->data));
+        dU.write(internalDiagonalUmklapp->data);
+        HighFive::DataSet dN = file.createDataSet<double>(
+            "/normalLinewidths",
+            HighFive::DataSpace::From(internalDiagonalNormal->data));
+        dN.write(internalDiagonalNormal->data);
+      }
+    } // the file is closed when going out of scope
+    std::rename(tmpFileName.c_str(), fileName.c_str());
+  } catch (std::exception &error) {
+    // we don't stop the run (other MPI processes aren't in sync here),
+    // we only lose the possibility of restarting from this point.
+    std::cout << "Warning: MPI process " << mpi->getRank()
+              << " failed to write the checkpoint file " << fileName
+              << std::endl;
+  }
+#else
+  (void) linewidth;
+#endif
+}
+
+void ScatteringMatrix::removeBuilderCheckpoint() {
+  if (context.getScatteringCheckpointInterval() <= 0 || numSampledPairs > 0) {
+    return;
+  }
+  std::string fileName = getBuilderCheckpointFileName(context);
+  std::remove(fileName.c_str());
+}
+
+std::string ScatteringMatrix::getScatteringMatrixFileName() {
+  if (!scatteringMatrixFileName.empty()) {
+    return scatteringMatrixFileName;
+  }
+  // we use the FNV-1a hash, which, unlike std::hash, is stable across
+  // compilers and runs
+  auto fnv = [](uint64_t &h, const void *x, const size_t &numBytes) {
+    auto bytes = static_cast<const unsigned char *>(x);
+    for (size_t i = 0; i < numBytes; i++) {
+      h ^= uint64_t(bytes[i]);
+      h *= 1099511628211ULL;
+    }
+  };
+  uint64_t hash = 14695981039346656037ULL;
+  auto addToHash = [&hash, &fnv](const void *x, const size_t &numBytes) {
+    fnv(hash, x, numBytes);
+  };
+  auto addInt = [&addToHash](const int &x) { addToHash(&x, sizeof(int)); };
+  auto addDouble = [&addToHash](const double &x) {
+    addToHash(&x, sizeof(double));
+  };
+
+  // the contents of the input files (rather than their names), so that an
+  // input file modified in place isn't paired with a stale matrix. The files
+  // are read by the head process only.
+  auto addFile = [&](const std::string &fileName) {
+    size_t fileHash = 0;
+    if (mpi->mpiHead()) {
+      uint64_t h = 14695981039346656037ULL;
+      std::ifstream file(fileName, std::ios::binary);
+      std::vector<char> buffer(size_t(1) << 20);
+      while (file.good()) {
+        file.read(buffer.data(), std::streamsize(buffer.size()));
+        fnv(h, buffer.data(), size_t(file.gcount()));
+      }
+      fileHash = size_t(h);
+    }
+    mpi->bcast(&fileHash);
+    addToHash(&fileHash, sizeof(size_t));
+  };
+
+  // information on the particle and on the input files
+  addInt(int(outerBandStructure.getParticle().isPhonon()));
+  addFile(context.getPhFC2FileName());
+  addFile(context.getPhFC3FileName());
+  addFile(context.getPhFC4FileName());
+  addFile(context.getElphFileName());
+
+  // parameters of the scattering rates calculation
+  addInt(context.getSmearingMethod());
+  addDouble(context.getSmearingWidth());
+  addInt(int(context.getUseSymmetries()));
+  addInt(int(context.getWithIsotopeScattering()));
+  // the boundary scattering is recomputed when the matrix is loaded, and the
+  // ph-el linewidths are added after the construction: they don't enter here
+  addInt(dimensionality_);
+  for (int i = 0; i < context.getMasses().size(); i++) {
+    addDouble(context.getMasses()(i));
+  }
+
+  // temperatures and chemical potentials
+  addInt(numCalculations);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    addDouble(calcStat.temperature);
+    addDouble(calcStat.chemicalPotential);
+  }
+
+  // wavevector meshes and Bloch states entering the BTE
+  addInt(innerBandStructure.getNumPoints(true));
+  addInt(innerBandStructure.getNumStates());
+  addInt(outerBandStructure.getNumPoints(true));
+  addInt(numStates);
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    auto iBteIdx = BteIndex(iBte);
+    StateIndex isIdx = outerBandStructure.bteToState(iBteIdx);
+    addDouble(outerBandStructure.getEnergy(isIdx));
+    Eigen::Vector3d q = outerBandStructure.getWavevector(isIdx);
+    for (int i : {0, 1, 2}) {
+      addDouble(q(i));
+    }
+  }
+
+  std::stringstream hashString;
+  hashString << std::hex << std::setw(16) << std::setfill('0') << hash;
+  scatteringMatrixFileName = context.getScatteringMatrixFilePrefix() +
+                             ".scatteringMatrix." + hashString.str() + ".hdf5";
+  return scatteringMatrixFileName;
+}
+
+bool ScatteringMatrix::loadScatteringMatrix() {
+  if (context.getScatteringMatrixFilePrefix().empty() || constantRTA) {
+    return false;
+  }
+  if (isSparse) {
+    Warning("Saving the sparse scattering matrix to disk is not implemented.");
+    return false;
+  }
+#ifndef HDF5_AVAIL
+  Error("Saving the scattering matrix to disk requires Phoebe built with HDF5.");
+  return false;
+#else
+
+  std::string fileName = getScatteringMatrixFileName();
+
+  // the time to load the file is negligible compared to the builder
+  int fileExists = 0;
+  if (mpi->mpiHead()) {
+    std::ifstream tmpFile(fileName);
+    fileExists = int(tmpFile.good());
+  }
+  mpi->bcast(&fileExists);
+  if (fileExists == 0) {
+    return false;
+  }
+
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::loadScatteringMatrix");
+
+  if (mpi->mpiHead()) {
+    std::cout << "Loading the scattering matrix from " << fileName << "\n"
+              << std::endl;
+  }
+
+  int numRows = theMatrix.rows();
+  int numCols = theMatrix.cols();
+  std::vector<int> localRows = theMatrix.getAllLocalRows();
+  std::vector<int> localCols = theMatrix.getAllLocalCols();
+  int numLocalRows = int(localRows.size());
+  double *localData = theMatrix.data();
+
+  // the matrix is read by the head process in bunches of rows,
+  // which are then distributed to the other processes
+  int bunchRows = std::max(1, std::min(numRows, int(pow(2, 24) / numCols)));
+
+  int status = 1;
+  try {
+    std::unique_ptr<HighFive::File> file;
+    if (mpi->mpiHead()) {
+      file = std::make_unique<HighFive::File>(fileName, HighFive::File::ReadOnly);
+      int numRows_, numCols_;
+      file->getDataSet("/numRows").read(numRows_);
+      file->getDataSet("/numCols").read(numCols_);
+      if (numRows_ != numRows || numCols_ != numCols) {
+        status = 0;
+      } else {
+        file->getDataSet("/intrinsicLinewidths").read(internalDiagonal.data);
+      }
+    }
+    mpi->bcast(&status);
+    if (status == 0) {
+      Error("The scattering matrix in " + fileName + " has the wrong size.");
+    }
+    mpi->bcast(&internalDiagonal.data);
+    // the linewidths in the file don't have the boundary scattering
+    internalDiagonal += getBoundaryRates();
+
+    for (int row0 = 0; row0 < numRows; row0 += bunchRows) {
+      int row1 = std::min(row0 + bunchRows, numRows);
+      std::vector<double> buffer(size_t(row1 - row0) * numCols, 0.);
+      if (mpi->mpiHead()) {
+        HighFive::DataSet dMatrix = file->getDataSet("/scatteringMatrix");
+        dMatrix.select({size_t(row0) * numCols},
+                       {buffer.size()}).read(buffer);
+      }
+      mpi->bcast(&buffer);
+
+      // local storage is column major
+      auto first = std::lower_bound(localRows.begin(), localRows.end(), row0);
+      auto last = std::lower_bound(localRows.begin(), localRows.end(), row1);
+      int il0 = int(first - localRows.begin());
+      int il1 = int(last - localRows.begin());
+      for (int jl = 0; jl < int(localCols.size()); jl++) {
+        for (int il = il0; il < il1; il++) {
+          localData[il + size_t(jl) * numLocalRows] =
+              buffer[size_t(localRows[il] - row0) * numCols + localCols[jl]];
         }
       }
     }
-    // substitute back
-    for (int i=0; i<degDegree; ++i) {
-      for (int ib1 = 0; ib1 < nb1; ib1++) {
-        for (int ib3 = 0; ib3 < nb3; ib3++) {
-          coupling(ib1, ib2 + i, ib3) = tmpCoupling(ib1, ib3);
+  } catch (std::exception &error) {
+    Error("Issue reading the scattering matrix from " + fileName);
+  }
+  copyDiagonalToMatrix();
+
+  Kokkos::Profiling::popRegion();
+  return true;
+#endif
+}
+
+void ScatteringMatrix::saveScatteringMatrix() {
+  if (context.getScatteringMatrixFilePrefix().empty() || constantRTA
+      || isSparse) {
+    return;
+  }
+#ifdef HDF5_AVAIL
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::saveScatteringMatrix");
+
+  std::string fileName = getScatteringMatrixFileName();
+  if (mpi->mpiHead()) {
+    std::cout << "Saving the scattering matrix to " << fileName << "\n"
+              << std::endl;
+  }
+
+  int numRows = theMatrix.rows();
+  int numCols = theMatrix.cols();
+  std::vector<int> localRows = theMatrix.getAllLocalRows();
+  std::vector<int> localCols = theMatrix.getAllLocalCols();
+  int numLocalRows = int(localRows.size());
+  double *localData = theMatrix.data();
+
+  // the matrix is gathered on the head process in bunches of rows,
+  // and written in row major order, independently of the MPI distribution
+  int bunchRows = std::max(1, std::min(numRows, int(pow(2, 24) / numCols)));
+
+  try {
+    std::unique_ptr<HighFive::File> file;
+    std::unique_ptr<HighFive::DataSet> dMatrix;
+    if (mpi->mpiHead()) {
+      file = std::make_unique<HighFive::File>(fileName, HighFive::File::Overwrite);
+      HighFive::DataSet dRows = file->createDataSet<int>(
+          "/numRows", HighFive::DataSpace::From(numRows));
+      dRows.write(numRows);
+      HighFive::DataSet dCols = file->createDataSet<int>(
+          "/numCols", HighFive::DataSpace::From(numCols));
+      dCols.write(numCols);
+      Eigen::MatrixXd intrinsicLinewidths =
+          internalDiagonal.data - getBoundaryRates().data;
+      HighFive::DataSet dLinewidths = file->createDataSet<double>(
+          "/intrinsicLinewidths",
+          HighFive::DataSpace::From(intrinsicLinewidths));
+      dLinewidths.write(intrinsicLinewidths);
+      std::vector<size_t> dims = {size_t(numRows) * numCols};
+      dMatrix = std::make_unique<HighFive::DataSet>(
+          file->createDataSet<double>("/scatteringMatrix",
+                                      HighFive::DataSpace(dims)));
+    }
+
+    for (int row0 = 0; row0 < numRows; row0 += bunchRows) {
+      int row1 = std::min(row0 + bunchRows, numRows);
+      std::vector<double> buffer(size_t(row1 - row0) * numCols, 0.);
+
+      auto first = std::lower_bound(localRows.begin(), localRows.end(), row0);
+      auto last = std::lower_bound(localRows.begin(), localRows.end(), row1);
+      int il0 = int(first - localRows.begin());
+      int il1 = int(last - localRows.begin());
+      for (int jl = 0; jl < int(localCols.size()); jl++) {
+        for (int il = il0; il < il1; il++) {
+          buffer[size_t(localRows[il] - row0) * numCols + localCols[jl]] =
+              localData[il + size_t(jl) * numLocalRows];
         }
       }
+      mpi->reduceSum(&buffer);
+
+      if (mpi->mpiHead()) {
+        dMatrix->select({size_t(row0) * numCols}, {buffer.size()})
+            .write(buffer);
+      }
     }
-    // now skip to next iteration
-    ib2 += degDegree - 1; // -1 because there's another addition in the loop
+  } catch (std::exception &error) {
+    Error("Issue writing the scattering matrix to " + fileName);
   }
 
-  for (int ib3 = 0; ib3 < nb3; ib3++) {
-    double e1 = energies3(ib3);
-    // determine degeneracy degree
-    int degDegree = 0;
-    for (int i = ib3; i < nb3; i++) {
-      double e2 = energies3(i);
-      if (abs(e1 - e2) < 1.0e-6) { // at first iteration, ib1=ib2, degDegree=1
-        degDegree++;
-      } else {
-        break;
+  Kokkos::Profiling::popRegion();
+#endif
+}
+
+VectorBTE ScatteringMatrix::getBoundaryRates(
+    const bool &withPopulationFactors) {
+  VectorBTE rates(statisticsSweep, outerBandStructure, 1);
+  rates.setConst(0.);
+  double boundaryLength = context.getBoundaryLength();
+  if (std::isnan(boundaryLength) || boundaryLength <= 0.) {
+    return rates;
+  }
+  auto particle = outerBandStructure.getParticle();
+  std::vector<bool> isExcluded(numStates, false);
+  for (int iBte : excludeIndices) {
+    isExcluded[iBte] = true;
+  }
+  std::vector<int> is1s = outerBandStructure.irrStateIterator();
+#pragma omp parallel for
+  for (int iis1 = 0; iis1 < int(is1s.size()); iis1++) {
+    StateIndex is1Idx(is1s[iis1]);
+    int iBte1 = outerBandStructure.stateToBte(is1Idx).get();
+    if (isExcluded[iBte1]) continue;
+    double energy = outerBandStructure.getEnergy(is1Idx);
+    Eigen::Vector3d vel = outerBandStructure.getGroupVelocity(is1Idx);
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      double rate = vel.norm() / boundaryLength;
+      // the phonon matrix A has the population factors n(n+1)
+      if (!isMatrixOmega && withPopulationFactors) {
+        double temperature =
+            statisticsSweep.getCalcStatistics(iCalc).temperature;
+        rate *= particle.getPopPopPm1(energy, temperature);
       }
+      rates(iCalc, 0, iBte1) = rate;
+    }
+  }
+  return rates;
+}
+
+int ScatteringMatrix::getNumStoredRows() {
+  if (isSparse) {
+    return theSparseMatrix.rows();
+  } else {
+    return theMatrix.rows();
+  }
+}
+
+bool ScatteringMatrix::matrixElementIsLocal(const int &iMat1,
+                                            const int &iMat2) {
+  if (isSparse) {
+    return true;
+  } else {
+    return theMatrix.indicesAreLocal(iMat1, iMat2);
+  }
+}
+
+void ScatteringMatrix::setActiveCalculations(
+    const std::vector<bool> &isActive) {
+  if (!isActive.empty() && int(isActive.size()) != numCalculations) {
+    Error("setActiveCalculations: wrong number of calculations");
+  }
+  activeCalculations = isActive;
+}
+
+std::vector<bool>
+ScatteringMatrix::getSkippedCalculations(const int &switchCase) {
+  std::vector<bool> isSkipped(numCalculations, false);
+  if (switchCase == 1 && !activeCalculations.empty()) {
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      isSkipped[iCalc] = !activeCalculations[iCalc];
+    }
+  }
+  return isSkipped;
+}
+
+std::vector<std::vector<bool>>
+ScatteringMatrix::getCalcWindowMask(BaseBandStructure &bandStructure) {
+  auto numBteStates = int(bandStructure.irrStateIterator().size());
+  std::vector<std::vector<bool>> mask(numCalculations,
+                                      std::vector<bool>(numBteStates, true));
+  if (bandStructure.hasWindow() == Window::nothing) {
+    return mask;
+  }
+  Particle particle = bandStructure.getParticle();
+  Window window(context, particle, 0., 0., 0., 0., false);
+  // the window in input may have been changed after building the band
+  // structure, in which case we keep all states
+  if (window.getMethodUsed() != bandStructure.hasWindow()) {
+    return mask;
+  }
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    double temp = calcStat.temperature;
+    double chemPot = calcStat.chemicalPotential;
+    for (int iBte = 0; iBte < numBteStates; iBte++) {
+      BteIndex iBteIdx(iBte);
+      StateIndex isIdx = bandStructure.bteToState(iBteIdx);
+      double energy = bandStructure.getEnergy(isIdx);
+      mask[iCalc][iBte] = window.isInWindow(energy, temp, chemPot);
     }
-    Eigen::MatrixXd tmpCoupling(nb1,nb2);
-    tmpCoupling.setZero();
-    // now do averaging
-    for (int i=0; i<degDegree; ++i) {
-      for (int ib1 = 0; ib1 < nb1; ib1++) {
-        for (int ib2 = 0; ib2 < nb2; ib2++) {
-          tmpCoupling(ib1, ib2) += coupling(ib1, ib2, ib3+i) / float(degDegree);
+  }
+  return mask;
+}
+
+void ScatteringMatrix::addToMatrix(const int &iMat1, const int &iMat2,
+                                   const double &x) {
+  if (isSparse) {
+    // the diagonal blocks are not stored, they are set to the linewidths
+    int iBte1 = std::get<0>(getSMatrixIndex(iMat1)).get();
+    int iBte2 = std::get<0>(getSMatrixIndex(iMat2)).get();
+    if (iBte1 != iBte2) {
+      theSparseMatrix.add(iMat1, iMat2, x);
+    }
+  } else if (theMatrix.indicesAreLocal(iMat1, iMat2)) {
+    theMatrix(iMat1, iMat2) += x;
+  }
+}
+
+VectorBTE ScatteringMatrix::sparseDot(VectorBTE &inPopulation) {
+  VectorBTE outPopulation(statisticsSweep, outerBandStructure, 3);
+  // note: we are assuming that ScatteringMatrix has numCalculations = 1
+
+  std::vector<bool> isExcluded(numStates, false);
+  for (int iBte : excludeIndices) {
+    isExcluded[iBte] = true;
+  }
+  bool useSymmetries = context.getUseSymmetries();
+
+  // each row of the matrix contributes to a different element of
+  // outPopulation, so that threads don't need a reduction
+  int numRows = theSparseMatrix.rows();
+#pragma omp parallel for
+  for (int iMat1 = 0; iMat1 < numRows; iMat1++) {
+    auto t1 = getSMatrixIndex(iMat1);
+    int iBte1 = std::get<0>(t1).get();
+    if (isExcluded[iBte1]) continue;
+    int i = std::get<1>(t1).get();
+    for (size_t k = theSparseMatrix.rowBegin(iMat1);
+         k < theSparseMatrix.rowBegin(iMat1 + 1); k++) {
+      auto t2 = getSMatrixIndex(theSparseMatrix.colIndex(k));
+      int iBte2 = std::get<0>(t2).get();
+      if (isExcluded[iBte2]) continue;
+      double x = theSparseMatrix.value(k);
+      if (useSymmetries) {
+        int j = std::get<1>(t2).get();
+        outPopulation(0, i, iBte1) += x * inPopulation(0, j, iBte2);
+      } else {
+        for (int iDim : {0, 1, 2}) {
+          outPopulation(0, iDim, iBte1) += x * inPopulation(0, iDim, iBte2);
         }
       }
     }
-    // substitute back
-    for (int i=0; i<degDegree; ++i) {
-      for (int ib1 = 0; ib1 < nb1; ib1++) {
-        for (int ib2 = 0; ib2 < nb2; ib2++) {
-          coupling(ib1, ib2, ib3 + i) = tmpCoupling(ib1, ib2);
+  }
+  mpi->allReduceSum(&outPopulation.data);
+
+  // add the diagonal, which is known by all MPI processes
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    if (isExcluded[iBte]) continue;
+    for (int iDim : {0, 1, 2}) {
+      outPopulation(0, iDim, iBte) +=
+          internalDiagonal(0, 0, iBte) * inPopulation(0, iDim, iBte);
+    }
+  }
+  return outPopulation;
+}
+
+// y += A * x, where A is a local block of the scattering matrix, stored in
+// column-major order with leading dimension numRows, with elements of type T.
+// The products are accumulated in double precision. With a single precision
+// matrix, the elements are read directly (the product with a few vectors is
+// bandwidth bound), and the rows are split in blocks among threads so that
+// the block of y stays in cache while looping over the columns.
+template <typename T>
+void localBlockDot(const T *data, const int &numRows, const int &numCols,
+                   const Eigen::MatrixXd &x, Eigen::MatrixXd &y) {
+  if constexpr (std::is_same_v<T, double>) {
+    Eigen::Map<const Eigen::MatrixXd> localMatrix(data, numRows, numCols);
+    y.noalias() += localMatrix * x;
+  } else {
+    const int blockRows = 1024;
+    int numBlocks = (numRows + blockRows - 1) / blockRows;
+    auto numRHS = int(x.cols());
+#pragma omp parallel for
+    for (int iBlock = 0; iBlock < numBlocks; iBlock++) {
+      int rowBegin = iBlock * blockRows;
+      int rowEnd = std::min(numRows, rowBegin + blockRows);
+      for (int iCol = 0; iCol < numCols; iCol++) {
+        const T *column = data + size_t(iCol) * numRows;
+        for (int iRHS = 0; iRHS < numRHS; iRHS++) {
+          double xx = x(iCol, iRHS);
+          if (xx == 0.) continue;
+          double *yColumn = y.col(iRHS).data();
+          for (int iRow = rowBegin; iRow < rowEnd; iRow++) {
+            yColumn[iRow] += double(column[iRow]) * xx;
+          }
         }
       }
     }
-    // now skip to next iteration
-    ib3 += degDegree - 1; // -1 because there's another addition in the loop
   }
 }
 
-std::vector<std::tuple<int, int>> ScatteringMatrix::getAllLocalStates() {
+std::vector<VectorBTE>
+ScatteringMatrix::denseDot(std::vector<VectorBTE> &inPopulations,
+                           const bool &offDiagonal) {
+  // note: we are assuming that ScatteringMatrix has numCalculations = 1
+  Kokkos::Profiling::pushRegion("ScatteringMatrix::denseDot");
+
+  bool useSymmetries = context.getUseSymmetries();
+  auto numVectors = int(inPopulations.size());
+  // without symmetries, the matrix is the same for the 3 cartesian
+  // directions, which are treated as different right-hand sides
+  int numDims = useSymmetries ? 1 : 3;
+  int numRHS = numVectors * numDims;
+
+  std::vector<int> localRows =
+      isSinglePrecision ? singleLocalRows : theMatrix.getAllLocalRows();
+  std::vector<int> localCols =
+      isSinglePrecision ? singleLocalCols : theMatrix.getAllLocalCols();
+  auto numLocalRows = int(localRows.size());
+  auto numLocalCols = int(localCols.size());
+
+  std::vector<bool> isExcluded(numStates, false);
+  if (!offDiagonal) {
+    for (int iBte : excludeIndices) {
+      isExcluded[iBte] = true;
+    }
+  }
 
-  return theMatrix.getAllLocalStates();
+  // gather the input vectors on the local columns of the matrix
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numLocalCols, numRHS);
+#pragma omp parallel for
+  for (int iCol = 0; iCol < numLocalCols; iCol++) {
+    auto t2 = getSMatrixIndex(localCols[iCol]);
+    int iBte2 = std::get<0>(t2).get();
+    if (isExcluded[iBte2]) continue;
+    int j = std::get<1>(t2).get();
+    for (int iVec = 0; iVec < numVectors; iVec++) {
+      if (useSymmetries) {
+        x(iCol, iVec) = inPopulations[iVec](0, j, iBte2);
+      } else {
+        for (int i : {0, 1, 2}) {
+          x(iCol, iVec * 3 + i) = inPopulations[iVec](0, i, iBte2);
+        }
+      }
+    }
+  }
+
+  // the local block is stored in column-major order, with leading
+  // dimension equal to the number of local rows
+  Eigen::MatrixXd y = Eigen::MatrixXd::Zero(numLocalRows, numRHS);
+  if (numLocalRows > 0 && numLocalCols > 0 && isSinglePrecision) {
+    // the diagonal blocks are not in the single precision matrix
+    localBlockDot(theSingleMatrix.data(), numLocalRows, numLocalCols, x, y);
+    if (!offDiagonal) {
+      for (auto [iRow, iCol, value] : diagonalBlockElements) {
+        y.row(iRow) += value * x.row(iCol);
+      }
+    }
+  } else if (numLocalRows > 0 && numLocalCols > 0) {
+    if (isOnDevice) {
+      // only the populations are moved to and from the device
+      Kokkos::View<const double **, Kokkos::LayoutLeft, Kokkos::HostSpace,
+                   Kokkos::MemoryTraits<Kokkos::Unmanaged>>
+          xHost(x.data(), numLocalCols, numRHS);
+      Kokkos::View<double **, Kokkos::LayoutLeft, Kokkos::HostSpace,
+                   Kokkos::MemoryTraits<Kokkos::Unmanaged>>
+          yHost(y.data(), numLocalRows, numRHS);
+      Kokkos::View<double **, Kokkos::LayoutLeft> xDevice("x", numLocalCols,
+                                                          numRHS);
+      Kokkos::View<double **, Kokkos::LayoutLeft> yDevice("y", numLocalRows,
+                                                          numRHS);
+      Kokkos::deep_copy(xDevice, xHost);
+      KokkosBlas::gemm("N", "N", 1.0, deviceMatrix, xDevice, 0.0, yDevice);
+      Kokkos::deep_copy(yHost, yDevice);
+    } else if (theMatrix.isOutOfCore()) {
+      // stream the local block from disk in tiles of columns, prefetching
+      // the next tile while multiplying the current one
+      const size_t tileBytes = size_t(256) << 20;
+      int tileCols = std::max(
+          1, int(tileBytes / (sizeof(double) * size_t(numLocalRows))));
+      theMatrix.prefetchLocalCols(0, tileCols);
+      for (int firstCol = 0; firstCol < numLocalCols; firstCol += tileCols) {
+        int numCols = std::min(tileCols, numLocalCols - firstCol);
+        theMatrix.prefetchLocalCols(firstCol + numCols, tileCols);
+        localBlockDot(theMatrix.data() + size_t(firstCol) * numLocalRows,
+                      numLocalRows, numCols, x.middleRows(firstCol, numCols),
+                      y);
+        theMatrix.releaseLocalCols(firstCol, numCols);
+      }
+    } else {
+      localBlockDot(theMatrix.data(), numLocalRows, numLocalCols, x, y);
+    }
+    Eigen::Map<Eigen::MatrixXd> localMatrix(theMatrix.data(), numLocalRows,
+                                            numLocalCols);
+
+    // subtract the contribution of the diagonal blocks, which, with
+    // symmetries, are 3x3 blocks on the cartesian indices
+    if (offDiagonal) {
+      int blockSize = useSymmetries ? 3 : 1;
+      std::vector<int> localColIndex(theMatrix.cols(), -1);
+      for (int iCol = 0; iCol < numLocalCols; iCol++) {
+        localColIndex[localCols[iCol]] = iCol;
+      }
+#pragma omp parallel for
+      for (int iRow = 0; iRow < numLocalRows; iRow++) {
+        BteIndex iBte1Idx = std::get<0>(getSMatrixIndex(localRows[iRow]));
+        for (int j = 0; j < blockSize; j++) {
+          CartIndex jIdx(j);
+          int iCol = localColIndex[getSMatrixIndex(iBte1Idx, jIdx)];
+          if (iCol >= 0) {
+            y.row(iRow) -= localMatrix(iRow, iCol) * x.row(iCol);
+          }
+        }
+      }
+    }
+  }
+
+  // sum the partial products over the process grid, with a single
+  // communication for all the vectors
+  Eigen::MatrixXd yAll;
+  if (isSinglePrecision) {
+    // the double precision matrix, and with it the grid layout, is released
+    int matSize = int(useSymmetries ? 3 * numStates : numStates);
+    yAll = Eigen::MatrixXd::Zero(matSize, numRHS);
+    for (int iRow = 0; iRow < numLocalRows; iRow++) {
+      yAll.row(localRows[iRow]) = y.row(iRow);
+    }
+    mpi->allReduceSum(&yAll);
+  } else {
+    yAll = theMatrix.gatherLocalRows(y);
+  }
 
+  // each row contributes to a different element of the output
+  std::vector<VectorBTE> outPopulations;
+  for (int iVec = 0; iVec < numVectors; iVec++) {
+    VectorBTE outPopulation(statisticsSweep, outerBandStructure, 3);
+    outPopulation.data.setZero();
+    outPopulations.push_back(outPopulation);
+  }
+  int numRows = int(yAll.rows());
+#pragma omp parallel for
+  for (int iRow = 0; iRow < numRows; iRow++) {
+    auto t1 = getSMatrixIndex(iRow);
+    int iBte1 = std::get<0>(t1).get();
+    if (isExcluded[iBte1]) continue;
+    int i = std::get<1>(t1).get();
+    for (int iVec = 0; iVec < numVectors; iVec++) {
+      if (useSymmetries) {
+        outPopulations[iVec](0, i, iBte1) = yAll(iRow, iVec);
+      } else {
+        for (int iDim : {0, 1, 2}) {
+          outPopulations[iVec](0, iDim, iBte1) = yAll(iRow, iVec * 3 + iDim);
+        }
+      }
+    }
+  }
+  Kokkos::Profiling::popRegion();
+  return outPopulations;
 }
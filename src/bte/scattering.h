@@ -2,9 +2,14 @@
 #define SCATTERING_H
 
 #include "Matrix.h"
+#include "SparseMatrix.h"
+#include "common_kokkos.h"
 #include "context.h"
 #include "delta_function.h"
 #include "vector_bte.h"
+#include <chrono>
+#include <functional>
+#include <set>
 
 /** Base class of the scattering matrix.
  * Note: this is an abstract class, which can only work if builder() is defined
@@ -40,6 +45,17 @@ public:
    */
   void setup();
 
+  /** Estimates the time needed to build the scattering matrix (or the
+   * linewidths) in setup(), used by the dry run of the transport apps.
+   * The builder is run on the first numSampledPairs wavevector pairs of each
+   * MPI process, without storing the results or writing checkpoints, and its
+   * time is extrapolated to all the pairs of the process.
+   * Can be called instead of setup(), and must be called by all processes.
+   * @param numSampledPairs: number of wavevector pairs to be computed.
+   * @return time: estimate in seconds, the largest over the MPI processes.
+   */
+  double estimateBuilderTime(const int &numSampledPairs);
+
   /** Returns the diagonal matrix elements.
    *  For the case of electrons, this is the linewidths -- A_out = Linewidths
    *  For the case of phonons, this is A_out = linewidths * n(n+1)
@@ -68,6 +84,23 @@ public:
   VectorBTE dot(VectorBTE &inPopulation);
   std::vector<VectorBTE> dot(std::vector<VectorBTE> &inPopulations);
 
+  /** Computes the product A*X for a block of vectors X(iBte,iVec), which
+   * are replicated on all MPI processes, as is the result.
+   * Assumes that symmetries are not used.
+   */
+  Eigen::MatrixXd blockDot(const Eigen::MatrixXd &x);
+
+  /** Sets the calculations (i.e. temperatures and chemical potentials) for
+   * which the matrix-free products dot() and offDiagonalDot() are computed,
+   * when the matrix isn't stored in memory. The results for the inactive
+   * calculations are not computed, and must be discarded by the caller.
+   * This is used by iterative solvers to skip the calculations that have
+   * already converged.
+   * @param isActive: vector of size numCalculations. If empty, all the
+   * calculations are computed.
+   */
+  void setActiveCalculations(const std::vector<bool> &isActive);
+
 //  /** Computes the product A*B, where A is the scattering matrix, and
 //   * B is an Eigen::MatrixXd. This can be used to compute products of the
 //   * scattering matrix with other vectors.
@@ -101,6 +134,13 @@ public:
    */
   VectorBTE getLinewidths();
 
+  /** Returns the standard deviation of the linewidths computed with the
+   * stochastic sampling of the scattering partners (partnerSamplingFraction
+   * < 1), in the same units of getLinewidths(). Zero if the linewidths were
+   * computed with all the partners.
+   */
+  VectorBTE getLinewidthErrors();
+
   /** Call to set the single-particle linewidths.
    *
    *  See getLinewidths function for notes about linewidths.
@@ -108,6 +148,19 @@ public:
    */
   void setLinewidths(VectorBTE &linewidths);
 
+  /** Returns the linewidths (as in getLinewidths()) without the boundary
+   * scattering, unfolded on the full mesh of wavevectors, so that they can
+   * be interpolated on the states of another mesh by setLinewidthsFromMesh().
+   */
+  MeshVectorBTE getMeshLinewidths();
+
+  /** Sets the linewidths by trilinear interpolation of the linewidths of a
+   * scattering matrix on a different mesh (see getMeshLinewidths()), and
+   * adds the boundary scattering of the states of this matrix.
+   * To be called instead of setup(), so that the builder is skipped.
+   */
+  void setLinewidthsFromMesh(const MeshVectorBTE &meshLinewidths);
+
   /** Converts the scattering matrix from the form A to the symmetrised Omega.
    * A acts on the canonical phonon population f, while Omega acts on the
    * symmetrised phonon population \tilde{n}.
@@ -118,6 +171,22 @@ public:
    */
   void a2Omega();
 
+  /** Sets a view of the matrix A in the symmetrised Omega form, without
+   * modifying the stored matrix. With the view, the products computed by
+   * dot(), offDiagonalDot() and the iterative diagonalization, as well as
+   * diagonal(), are those of Omega, obtained by scaling the vectors with the
+   * population factors of a2Omega(). Hence, the same matrix can be used by
+   * solvers working with A or with Omega. No effect if the matrix is Omega.
+   * @param x: true to set the view, false to go back to A.
+   */
+  void setOmegaView(const bool &x);
+
+  /** Factor relating the elements of A and Omega for the state iBte, i.e.
+   * Omega_ij = A_ij * factor_i * factor_j, if the Omega view is set.
+   * Returns 1 otherwise, or for excluded states. Used for iCalc = 0.
+   */
+  double getOmegaViewScaling(const int &iBte);
+
 //  /** The inverse of a2Omega, converts the matrix Omega to A
 //   */
 //  void omega2A();
@@ -125,18 +194,39 @@ public:
   /** Diagonalize the scattering matrix
    * @param numEigenvalues: if a number is supplied, calculate
    *                only the first few of these points
+   * @param initialGuess: if not null, approximate eigenvectors
+   * (numStates, numEigenvalues), e.g. the relaxons of a nearby temperature.
+   * With the partial eigensolver, they are refined with LOBPCG, and the
+   * matrix is diagonalized directly only if LOBPCG doesn't converge.
    * @return eigenvalues: a Eigen::VectorXd with the eigenvalues
    * @return eigenvectors: a Eigen::MatrixXd with the eigenvectors
    * Eigenvectors are aligned on rows: eigenvectors(qpState,eigenIndex)
    */
   std::tuple<Eigen::VectorXd, ParallelMatrix<double>>
-                                diagonalize(int numEigenvalues = 0);
+  diagonalize(int numEigenvalues = 0,
+              const Eigen::MatrixXd *initialGuess = nullptr);
 
   /** Outputs the quantity to a json file.
    * @param outFileName: string representing the name of the json file
    */
   void outputToJSON(const std::string &outFileName);
 
+  /** Outputs the relaxation times, linewidths, energies and velocities of
+   * the states at the irreducible wavevectors to a HDF5 file, with the same
+   * dataset names of outputToJSON(). The states are flattened, in the order
+   * of the json file, and each process writes the states of a slice of the
+   * wavevectors (with parallel HDF5). Must be called by all processes.
+   * @param outFileName: name of the HDF5 file
+   */
+  void outputToHDF5(const std::string &outFileName);
+
+  /** Outputs the relaxation times to json and/or HDF5, depending on the
+   * relaxationTimesFormat input variable. Must be called by all processes.
+   * @param outFileName: name of the json file. The HDF5 file has the same
+   * name, with the .json extension replaced by .hdf5.
+   */
+  void outputRelaxationTimes(const std::string &outFileName);
+
   /** Function to combine a BTE index and a cartesian index into one index of
    * the scattering matrix. If no symmetries are used, the output is equal to
    * the BteIndex.
@@ -172,8 +262,50 @@ public:
    */
   void symmetrize();
 
+  /** Converts the dense scattering matrix stored in memory to single
+   * precision, and releases the double precision matrix. This halves the
+   * memory and the bandwidth needed by dot() and offDiagonalDot(), which
+   * still accumulate in double precision. The diagonal blocks of the matrix
+   * (iBte1 == iBte2), which dominate the products, are kept in double
+   * precision. Does nothing for the sparse matrix, or if the matrix is not
+   * in memory. After this call, the matrix can't be diagonalized.
+   */
+  void reducePrecision();
+
+  /** Replaces the dense matrix, distributed over the processes of the
+   * world before mpi->splitWorld(), with a copy distributed over the group
+   * of this process, so that each group can run a different solver.
+   * The matrix must be stored densely in double precision in memory.
+   * To be called after splitWorld(), by the processes of all groups.
+   */
+  void copyToSplitGroup();
+
+  /** Copies the local block of the dense scattering matrix stored in
+   * memory to the Kokkos device, where the products of dot() and
+   * offDiagonalDot() are then done with KokkosBlas::gemm, so that only the
+   * populations are transferred at each iteration of the solvers.
+   * The host copy is kept (e.g. for the diagonal blocks), and must not be
+   * modified after this call. Does nothing if the matrix isn't stored
+   * densely in double precision in memory, or if it doesn't fit in the
+   * device memory.
+   */
+  void copyToDevice();
+
   void relaxonsToJSON(const std::string& fileName, const Eigen::VectorXd& eigenvalues);
 
+  /** Outputs the relaxation times of the relaxons to a HDF5 file, with the
+   * same dataset names of relaxonsToJSON(). Each process writes a slice of
+   * the relaxons. Must be called by all processes.
+   * @param fileName: name of the HDF5 file
+   * @param eigenvalues: the eigenvalues of the scattering matrix
+   */
+  void relaxonsToHDF5(const std::string& fileName, const Eigen::VectorXd& eigenvalues);
+
+  /** Outputs the relaxation times of the relaxons to json and/or HDF5, as
+   * outputRelaxationTimes(). Must be called by all processes.
+   */
+  void outputRelaxonsTimes(const std::string& fileName, const Eigen::VectorXd& eigenvalues);
+
   /** Average the coupling for degenerate states.
    * When there are degenerate energies, the freedom of choice of eigenvectors
    * within the corresponding eigenspace should not affect the final coupling.
@@ -188,6 +320,24 @@ public:
                         const Eigen::VectorXd& energies2,
                         const Eigen::VectorXd& energies3);
 
+  /** Same as above, with the groups of degenerate bands already known, e.g.
+   * from BaseBandStructure::getDegenerateGroups(), so that the energies
+   * are not compared again for every coupling. Only the degenerate groups
+   * are visited, and non-degenerate bands are left untouched.
+   * @param coupling: Calculated coupling to be averaged.
+   * @param groups1: groups (first band, number of bands) of degenerate ib1.
+   * @param groups2: groups (first band, number of bands) of degenerate ib2.
+   * @param groups3: groups (first band, number of bands) of degenerate ib3.
+   */
+  static void symmetrizeCoupling(Eigen::Tensor<double,3>& coupling,
+                        const std::vector<std::tuple<int,int>>& groups1,
+                        const std::vector<std::tuple<int,int>>& groups2,
+                        const std::vector<std::tuple<int,int>>& groups3);
+  static void symmetrizeCoupling(Eigen::TensorMap<Eigen::Tensor<double,3>> coupling,
+                        const std::vector<std::tuple<int,int>>& groups1,
+                        const std::vector<std::tuple<int,int>>& groups2,
+                        const std::vector<std::tuple<int,int>>& groups3);
+
   /** Call the underlying PMatrix function to return the iterator of all elements of the
    * matrix which are local
    * @return: an iterator of local state index pairs
@@ -210,8 +360,25 @@ public:
   // and there are simplified evaluations taking place
   bool constantRTA = false;
   bool highMemory = true;     // whether the matrix is kept in memory
+
+  // if > 0, the builder stops after this many wavevector pairs, and stores
+  // in builderTimeEstimate the time of the loop over all the pairs of this
+  // process, extrapolated from the pairs done (see estimateBuilderTime())
+  int numSampledPairs = 0;
+  double builderTimeEstimate = 0.;
+  // returns the index of the last wavevector pair to be done by the builder
+  int getLastBuilderPair(const int &numPairsDone, const int &numPairs) const;
+  // extrapolates the time of the pairs done to all the pairs of the builder
+  void recordBuilderSample(const std::chrono::steady_clock::time_point &start,
+                           const int &numPairsDone, const int &lastPair,
+                           const int &numPairs);
   bool outputUNTimes = false;    // whether to output U and N processes in RTA
 
+  // units and conversion factors of the output of the relaxation times
+  void getOutputUnits(std::string &particleType, std::string &energyUnit,
+                      std::string &relaxationTimeUnit,
+                      double &energyConversion, double &energyToTime);
+
   // NOTE: about the definition of A
   // A acts on the canonical population, omega on the population
   // A acts on f, Omega on n, with n = bose(bose+1)f e.g. for phonons
@@ -221,6 +388,12 @@ public:
   // In the case of electrons, A_out = linewidht
   bool isMatrixOmega = false; // whether the matrix is Omega or A
 
+  // lazy Omega form of A (see setOmegaView()): the vectors multiplying the
+  // matrix are scaled by omegaViewScaling(iCalc, iBte) = 1/sqrt(n(n+1))
+  bool isOmegaView = false;
+  Eigen::MatrixXd omegaViewScaling;
+  void scaleToOmegaView(VectorBTE &population);
+
 
   // we save the diagonal matrix element in a dedicated vector
   VectorBTE internalDiagonal;
@@ -228,6 +401,25 @@ public:
   std::shared_ptr<VectorBTE> internalDiagonalNormal;
   // the scattering matrix, initialized if highMemory==true
   ParallelMatrix<double> theMatrix;
+  // the scattering matrix in sparse format, used instead of theMatrix if
+  // highMemory==true and the user asked for sparse storage.
+  // Only the elements outside the diagonal blocks (iBte1 != iBte2) are
+  // stored, the diagonal being internalDiagonal.
+  bool isSparse = false;
+  SparseMatrix<double> theSparseMatrix;
+  // the scattering matrix in single precision, used instead of theMatrix
+  // after a call to reducePrecision(). It's the local block of theMatrix,
+  // with the same layout, but the elements of the diagonal blocks are set
+  // to zero and saved in double precision, as (localRow, localCol, value).
+  bool isSinglePrecision = false;
+  std::vector<float> theSingleMatrix;
+  std::vector<int> singleLocalRows;
+  std::vector<int> singleLocalCols;
+  std::vector<std::tuple<int, int, double>> diagonalBlockElements;
+  // copy of the local block of theMatrix on the Kokkos device, used by
+  // denseDot() after a call to copyToDevice()
+  bool isOnDevice = false;
+  Kokkos::View<double **, Kokkos::LayoutLeft> deviceMatrix;
 
   int numStates; // number of Bloch states (i.e. the size of theMatrix)
   int numPoints; // number of wavevectors
@@ -256,6 +448,82 @@ public:
                        std::vector<VectorBTE> &inPopulations,
                        std::vector<VectorBTE> &outPopulations) = 0;
 
+  /** Returns the number of rows of the scattering matrix stored in memory,
+   * either in the dense or sparse format. Returns 0 if the matrix is not
+   * stored in memory.
+   */
+  int getNumStoredRows();
+
+  /** Returns true if the matrix element (iMat1,iMat2) must be computed by
+   * this MPI process while building the matrix in memory.
+   * For the dense matrix, these are the elements stored by the process.
+   * For the sparse matrix, these are all the elements of the wavevector
+   * pairs assigned to the process by getIteratorWavevectorPairs().
+   */
+  bool matrixElementIsLocal(const int &iMat1, const int &iMat2);
+
+  /** Adds a value to the element (iMat1,iMat2) of the scattering matrix in
+   * memory, in either the dense or the sparse format.
+   * For the dense matrix, nothing is done if the element is not local.
+   */
+  void addToMatrix(const int &iMat1, const int &iMat2, const double &x);
+
+  // calculations computed by the matrix-free product (empty if all of them)
+  std::vector<bool> activeCalculations;
+
+  /** Returns, for each calculation, true if the builder can skip it, i.e.
+   * for the matrix-vector product (switchCase = 1) of the calculations set
+   * as inactive by setActiveCalculations().
+   */
+  std::vector<bool> getSkippedCalculations(const int &switchCase);
+
+  /** The band structure window is the union of the windows of all the
+   * (temperature, chemical potential) calculations. This returns, for each
+   * calculation, which BTE states pass the window of that calculation alone.
+   * @param bandStructure: the band structure whose states are flagged.
+   * @return mask: mask[iCalc][iBte] is true if state iBte is in the window
+   * of calculation iCalc. All true if the band structure has no window.
+   */
+  std::vector<std::vector<bool>>
+  getCalcWindowMask(BaseBandStructure &bandStructure);
+
+  /** Computes the product A*f for the matrix stored in sparse format.
+   */
+  VectorBTE sparseDot(VectorBTE &inPopulation);
+
+  /** Computes the product A*f for the dense matrix stored in memory, for a
+   * set of vectors at once. Each MPI process multiplies its local block of
+   * the matrix with the vectors (with a matrix-matrix product), and each
+   * thread computes different rows of the result, so that only a reduction
+   * over MPI processes is needed.
+   * @param inPopulations: the vectors f.
+   * @param offDiagonal: if true, the diagonal blocks of the matrix
+   * (iBte1 == iBte2) are skipped. If false, the rows and columns of the
+   * excluded states are skipped instead.
+   */
+  std::vector<VectorBTE> denseDot(std::vector<VectorBTE> &inPopulations,
+                                  const bool &offDiagonal);
+
+  /** Computes the smallest eigenvalues of the matrix, and their
+   * eigenvectors, with the iterative LOBPCG method, which only needs the
+   * product of the matrix with a few vectors and works also with the sparse
+   * matrix. Used by diagonalize() when relaxonsEigenSolver = "lobpcg".
+   * The trial vectors are split by rows across the MPI processes, and only
+   * the products with the matrix use the full blocks.
+   * @param numEigenvalues: number of eigenvalues to compute.
+   * @param initialGuess: if not null, the first trial vectors, otherwise
+   * the trial vectors are random.
+   * @param isConverged: if not null, the caller has a fallback for the case
+   * where LOBPCG doesn't converge: fewer iterations are done, and the
+   * convergence is returned here instead of issuing a warning.
+   * @return eigenvalues, eigenvectors: same as diagonalize().
+   */
+  std::tuple<Eigen::VectorXd, ParallelMatrix<double>>
+  iterativeDiagonalize(const int &numEigenvalues,
+                       const Eigen::MatrixXd *initialGuess = nullptr,
+                       bool *isConverged = nullptr);
+
+
   /** Returns a vector of pairs of wavevector indices to iterate over during
    * the construction of the scattering matrix.
    * @param switchCase: if 0, returns the pairs of wavevectors to loop for
@@ -281,6 +549,113 @@ public:
   getIteratorWavevectorPairs(const int &switchCase,
                              const bool &rowMajor = false);
 
+  /** Sorts a list of wavevector indices of a band structure along the
+   * space-filling curve chosen with the wavevectorOrdering input variable.
+   * Nothing is done with the default ordering by index.
+   */
+  void sortWavevectors(std::vector<int> &iks,
+                       BaseBandStructure &bandStructure);
+
+  /** Divides a list of wavevectors over the MPI processes, balancing the
+   * cost of each wavevector, which scales with its number of bands.
+   * With a space-filling curve ordering, each process receives a contiguous
+   * piece of the curve, i.e. a compact region of the mesh.
+   * @return the wavevectors of this process, in the order of the loops.
+   */
+  std::vector<int> divideWavevectors(std::vector<int> iks,
+                                     BaseBandStructure &bandStructure);
+
+  /** Time-reversal pairing of the wavevector pairs (useTimeReversal).
+   * The pairs (k1,k2) and (-k1,-k2) have the same transition rates, and
+   * this removes from the iterator one pair of each time-reversed couple,
+   * the one with the larger (k1,k2) indices. The builders then add the rates
+   * of the pairs left to their time-reversed pairs (see
+   * getTimeReversedPair()). Only done for the linewidths and the
+   * matrix-vector products, since the elements of the time-reversed pair of
+   * a matrix in memory may be stored by other MPI processes.
+   * @param pairIterator: the pairs of getIteratorWavevectorPairs().
+   * @param rowMajor: same as in getIteratorWavevectorPairs().
+   * @param switchCase: the case of the builder.
+   * @return true if the pairs have been paired.
+   */
+  bool pairTimeReversal(
+      std::vector<std::tuple<std::vector<int>, int>> &pairIterator,
+      const bool &rowMajor, const int &switchCase);
+
+  /** Returns the time-reversed pair (-k1,-k2) of a pair left in the iterator
+   * by pairTimeReversal(), as the indices of -k1 in the outer band structure
+   * and of -k2 in the inner one. Returns (-1,-1) if the pair has no distinct
+   * time-reversed pair.
+   */
+  std::tuple<int, int> getTimeReversedPair(const int &ik1, const int &ik2);
+
+  // index of -k for each wavevector of the outer (inner) band structure,
+  // or -1 if -k is not in the band structure (outer: not irreducible)
+  std::vector<int> timeReversedOuterPoints;
+  std::vector<int> timeReversedInnerPoints;
+
+  /** Returns true if the builder samples the scattering partners at random,
+   * i.e. if only the linewidths are computed and partnerSamplingFraction < 1.
+   */
+  bool isPartnerSampling(const int &switchCase);
+
+  /** Monte Carlo sampling of the scattering partners of the wavevector pair
+   * iterator. In each tuple (partners, ik), the partner i is kept with
+   * probability p_i = min(1, c * L_i), where L_i = likelihood(ik, i) is the
+   * likelihood of the pair in [0,1], and c is such that on average a
+   * fraction partnerSamplingFraction of the partners is kept. Pairs with
+   * L_i = 0 are never kept. The draws depend only on ik and the seed, not
+   * on the distribution of the pairs over the MPI processes.
+   * @param pairIterator: the pairs of getIteratorWavevectorPairs(). On
+   * output, each tuple only contains the sampled partners.
+   * @param likelihood: function (ik, iPartner) returning L.
+   * @return pairWeights: for each tuple, the weights 1/p_i of the sampled
+   * partners, with which the sum over the sampled partners is an unbiased
+   * estimate of the sum over all the partners.
+   */
+  std::vector<std::vector<double>> samplePartners(
+      std::vector<std::tuple<std::vector<int>, int>> &pairIterator,
+      const std::function<double(const int &, const int &)> &likelihood);
+
+  /** Likelihood that a pair of wavevectors has energy-conserving
+   * transitions: the largest ratio, over the band combinations of the pair,
+   * between the smearing at the energy mismatch of the transition and the
+   * smearing at zero energy.
+   * @param mismatches: the smallest energy mismatch of each band combination.
+   * @param velocities: (numEntries x 3) velocity differences, only used by
+   * the adaptive smearing.
+   */
+  double getPairLikelihood(const Eigen::VectorXd &mismatches,
+                           const Eigen::MatrixXd &velocities);
+
+  /** Weights the contribution of a sampled pair of wavevectors to the
+   * linewidths. With c the contribution of the pair and w = 1/p its weight,
+   * (w-1)*c is added to the linewidths, and the estimate of its variance,
+   * (w^2-w)*c^2, is added to linewidthVariance.
+   * @param linewidth: the linewidths, which include the contribution c.
+   * @param iBtes: BTE indices of the states receiving the contribution.
+   * @param previous: (numCalculations, iBtes.size()) linewidths of those
+   * states before the contribution of the pair was added.
+   * @param weight: the weight w of the pair (see samplePartners()).
+   */
+  void addSampledPair(VectorBTE *linewidth, const std::vector<int> &iBtes,
+                      const Eigen::MatrixXd &previous, const double &weight);
+
+  /** Returns the (numCalculations, iBtes.size()) linewidths of the states
+   * iBtes, to be passed to addSampledPair().
+   */
+  Eigen::MatrixXd getSampledStates(VectorBTE *linewidth,
+                                   const std::vector<int> &iBtes);
+
+  // variance of the linewidths computed with sampled scattering partners
+  std::shared_ptr<VectorBTE> linewidthVariance;
+
+  /** Returns the irreducible wavevectors of the states of a list of rows
+   * (or columns) of the matrix.
+   * @param matIndices: global row or column indices of the matrix.
+   */
+  std::set<int> getLocalIrrWavevectors(const std::vector<int> &matIndices);
+
   /** Performs an average of the linewidths over degenerate states.
    * This is necessary since the coupling |V_3| is not averaged over different
    * states, and hence introduces differences between degenerate states.
@@ -294,6 +669,84 @@ public:
    */
   void degeneracyAveragingLinewidths(VectorBTE *linewidth);
 
+  /** Restart the construction of the scattering matrix from a checkpoint.
+   * If the user has set scatteringCheckpointInterval and a checkpoint file
+   * written by this MPI process is found, the partial results saved in the
+   * file (the locally stored block of theMatrix, the linewidths, and the
+   * U/N linewidths if requested) are loaded.
+   * @param switchCase: the builder mode (0 = matrix in memory, 2 =
+   * linewidths only). Checkpoints are not used for matrix-vector products.
+   * @param numPairs: the size of the wavevector pair iterator of the builder.
+   * @param linewidth: the VectorBTE, passed to builder(), to be restored.
+   * @return numPairsDone: the number of elements of the pair iterator that
+   * were completed when the checkpoint was written (0 if no restart).
+   */
+  int loadBuilderCheckpoint(const int &switchCase, const int &numPairs,
+                            VectorBTE *linewidth);
+
+  /** Saves a checkpoint of the scattering matrix construction, if the user
+   * requested it and iPair is a multiple of the checkpoint interval.
+   * The current MPI process writes its own (partial) results to a file,
+   * hence this function does not need to be called in sync across processes.
+   * @param switchCase: the builder mode (0 = matrix in memory, 2 =
+   * linewidths only).
+   * @param numPairsDone: the number of wavevector pairs done so far.
+   * @param numPairs: the size of the wavevector pair iterator of the builder.
+   * @param linewidth: the VectorBTE, passed to builder(), to be saved.
+   */
+  void saveBuilderCheckpoint(const int &switchCase, const int &numPairsDone,
+                             const int &numPairs, VectorBTE *linewidth);
+
+  /** Deletes the checkpoint file of this MPI process, to be called when
+   * the builder loop has been completed.
+   */
+  void removeBuilderCheckpoint();
+
+  /** Returns the name of the file where the scattering matrix is saved.
+   * The name contains a hash of the input parameters that determine
+   * the scattering matrix (wavevector meshes, energies, smearing,
+   * temperatures, chemical potentials, symmetries...) and of the contents
+   * of the input files, so that a matrix is only reused by a calculation
+   * with the same parameters. Must be called by all MPI processes.
+   */
+  std::string getScatteringMatrixFileName();
+  // computed at the first call, since the input files are read again
+  std::string scatteringMatrixFileName;
+
+  /** If the user set scatteringMatrixFilePrefix, and a scattering matrix
+   * computed with the same parameters was saved by a previous run, loads
+   * it (together with the linewidths) into theMatrix.
+   * The boundary scattering isn't saved, and is recomputed for the current
+   * boundaryLength (see getBoundaryRates()).
+   * The file layout doesn't depend on the MPI parallelization, hence the
+   * matrix can be loaded with a different number of MPI processes.
+   * @return loaded: true if the matrix was loaded, and the builder can be
+   * skipped.
+   */
+  bool loadScatteringMatrix();
+
+  /** Saves theMatrix and the linewidths to the file returned by
+   * getScatteringMatrixFileName(), if the user set scatteringMatrixFilePrefix.
+   * The linewidths are saved without the boundary scattering.
+   * Must be called by all MPI processes.
+   */
+  void saveScatteringMatrix();
+
+  /** Computes the boundary scattering rates |v|/boundaryLength, in the units
+   * of the diagonal of the matrix (i.e. times n(n+1) for phonons), as they
+   * are added to the linewidths by the builders (zero if boundaryLength is
+   * not set). Since they only enter the diagonal, they are kept out of the
+   * saved scattering matrix, which can then be reused with a different
+   * boundaryLength.
+   * @param withPopulationFactors: if false, the rates are in the units of
+   * getLinewidths(), i.e. without the factors n(n+1).
+   */
+  VectorBTE getBoundaryRates(const bool &withPopulationFactors = true);
+
+  /** Copies internalDiagonal onto the diagonal of the matrix in memory.
+   */
+  void copyDiagonalToMatrix();
+
   /** Internal helper to formats single mode times stored in vectorBTE
    * object based on if the matrix isOmega or not.
    * @param VectorBTE& diagonal: the list of times we want to reformat
@@ -0,0 +1,157 @@
+#include "solver_checkpoint.h"
+#include "exceptions.h"
+#include "hdf5_output.h"
+#include "mpiHelper.h"
+#include <cstdio>
+#include <fstream>
+
+SolverCheckpoint::SolverCheckpoint(Context &context,
+                                   const std::string &solverName) {
+  interval = context.getSolverCheckpointInterval();
+  fileName = context.getCheckpointPrefix() + "." + solverName + ".hdf5";
+#ifndef HDF5_AVAIL
+  if (interval > 0) {
+    Error("Checkpointing the BTE solvers requires Phoebe built with HDF5.");
+  }
+#endif
+}
+
+void SolverCheckpoint::add(const std::string &name, Eigen::MatrixXd &x) {
+  names.push_back(name);
+  getters.emplace_back([&x]() { return x; });
+  setters.emplace_back([&x](const Eigen::MatrixXd &y) { x = y; });
+}
+
+void SolverCheckpoint::add(const std::string &name,
+                           Eigen::Tensor<double, 3> &x) {
+  names.push_back(name);
+  getters.emplace_back([&x]() {
+    return Eigen::MatrixXd(
+        Eigen::Map<const Eigen::MatrixXd>(x.data(), x.size(), 1));
+  });
+  setters.emplace_back([&x](const Eigen::MatrixXd &y) {
+    Eigen::Map<Eigen::MatrixXd>(x.data(), x.size(), 1) = y;
+  });
+}
+
+void SolverCheckpoint::add(const std::string &name, std::vector<bool> &x) {
+  names.push_back(name);
+  getters.emplace_back([&x]() {
+    Eigen::MatrixXd y(x.size(), 1);
+    for (size_t i = 0; i < x.size(); i++) {
+      y(i, 0) = double(x[i]);
+    }
+    return y;
+  });
+  setters.emplace_back([&x](const Eigen::MatrixXd &y) {
+    for (size_t i = 0; i < x.size(); i++) {
+      x[i] = y(i, 0) != 0.;
+    }
+  });
+}
+
+int SolverCheckpoint::load() {
+  numIterationsLoaded = 0;
+  if (interval <= 0) {
+    return 0;
+  }
+#ifdef HDF5_AVAIL
+  auto numArrays = int(names.size());
+  std::vector<Eigen::MatrixXd> arrays(numArrays);
+  for (int i = 0; i < numArrays; i++) {
+    arrays[i] = getters[i]();
+  }
+
+  // 0: no checkpoint found, 1: checkpoint loaded, -1: invalid checkpoint
+  int status = 0;
+  int numIterationsDone = 0;
+  if (mpi->mpiHead()) {
+    std::ifstream tmpFile(fileName);
+    if (tmpFile.good()) {
+      status = 1;
+    }
+    if (status == 1) {
+      try {
+        HighFive::File file(fileName, HighFive::File::ReadOnly);
+        file.getDataSet("/numIterationsDone").read(numIterationsDone);
+        for (int i = 0; i < numArrays; i++) {
+          Eigen::MatrixXd x;
+          file.getDataSet("/" + names[i]).read(x);
+          // the checkpoint must describe the same calculation
+          if (x.rows() != arrays[i].rows() || x.cols() != arrays[i].cols()) {
+            status = -1;
+            break;
+          }
+          arrays[i] = x;
+        }
+      } catch (std::exception &error) {
+        status = -1;
+      }
+    }
+  }
+  mpi->bcast(&status);
+  if (status == -1) {
+    Error("The BTE solver checkpoint " + fileName + " is not compatible with "
+          "the current run.\nRemove it to restart the solver from scratch.");
+  }
+  if (status == 0) {
+    return 0;
+  }
+  mpi->bcast(&numIterationsDone);
+  for (int i = 0; i < numArrays; i++) {
+    mpi->bcast(&arrays[i]);
+    setters[i](arrays[i]);
+  }
+  if (mpi->mpiHead()) {
+    std::cout << "Restarting the BTE solver from the checkpoint " << fileName
+              << ", after " << numIterationsDone << " iterations.\n"
+              << std::endl;
+  }
+  numIterationsLoaded = numIterationsDone;
+  return numIterationsDone;
+#else
+  return 0;
+#endif
+}
+
+void SolverCheckpoint::save(const int &numIterationsDone) {
+  if (interval <= 0 || numIterationsDone == 0 ||
+      numIterationsDone % interval != 0 ||
+      numIterationsDone == numIterationsLoaded) {
+    return;
+  }
+#ifdef HDF5_AVAIL
+  if (!mpi->mpiHead()) {
+    return;
+  }
+  // write to a temporary file first, so that if the job is killed while
+  // writing, the previous checkpoint is still usable
+  std::string tmpFileName = fileName + ".tmp";
+  try {
+    {
+      HighFive::File file(tmpFileName, HighFive::File::Overwrite);
+      HighFive::DataSet dIterations = file.createDataSet<int>(
+          "/numIterationsDone", HighFive::DataSpace::From(numIterationsDone));
+      dIterations.write(numIterationsDone);
+      for (size_t i = 0; i < names.size(); i++) {
+        Eigen::MatrixXd x = getters[i]();
+        HighFive::DataSet dArray = file.createDataSet<double>(
+            "/" + names[i], HighFive::DataSpace::From(x));
+        dArray.write(x);
+      }
+    } // the file is closed when going out of scope
+    std::rename(tmpFileName.c_str(), fileName.c_str());
+  } catch (std::exception &error) {
+    // the solver goes on, we only lose the possibility of restarting here
+    std::cout << "Warning: failed to write the BTE solver checkpoint "
+              << fileName << std::endl;
+  }
+#endif
+}
+
+void SolverCheckpoint::remove() {
+  if (interval <= 0 || !mpi->mpiHead()) {
+    return;
+  }
+  std::remove(fileName.c_str());
+}
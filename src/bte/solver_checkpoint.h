@@ -0,0 +1,73 @@
+#ifndef SOLVER_CHECKPOINT_H
+#define SOLVER_CHECKPOINT_H
+
+#include "context.h"
+#include <Eigen/Core>
+#include <functional>
+#include <string>
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <vector>
+
+/** Checkpoint of the state of an iterative BTE solver, i.e. of the vectors
+ * that the solver carries from one iteration to the next (populations,
+ * residuals and search directions of the conjugate gradient...), of the
+ * quantities of the convergence test, and of the number of iterations done.
+ * Since the matrix-free products are the expensive part of the solvers, a
+ * run interrupted in the middle of a solver can resume from the last
+ * checkpoint instead of starting again from the initial guess.
+ *
+ * The state of the solvers is the same on all MPI processes: the head writes
+ * the checkpoint, and broadcasts it to the other processes when loading it.
+ *
+ * Usage: register the state of the solver with add(), call load() before
+ * the loop over iterations, and save() at the beginning of each iteration.
+ */
+class SolverCheckpoint {
+ public:
+  /** Constructor.
+   * @param context: sets the interval between checkpoints
+   * (solverCheckpointInterval) and the prefix of the file name.
+   * @param solverName: identifies the solver (and the temperature or mesh of
+   * the calculation) in the name of the checkpoint file.
+   */
+  SolverCheckpoint(Context &context, const std::string &solverName);
+
+  /** Registers a part of the solver state, which is written by save() and
+   * overwritten by load(). The object must outlive the checkpoint, and keep
+   * its size.
+   */
+  void add(const std::string &name, Eigen::MatrixXd &x);
+  void add(const std::string &name, Eigen::Tensor<double, 3> &x);
+  void add(const std::string &name, std::vector<bool> &x);
+
+  /** If checkpoints are requested and a checkpoint of this solver exists,
+   * loads the registered state. To be called by all MPI processes.
+   * @return the number of iterations done when the checkpoint was written
+   * (0 if the solver starts from scratch).
+   */
+  int load();
+
+  /** Writes the registered state, if checkpoints are requested and
+   * numIterationsDone is a positive multiple of the checkpoint interval.
+   * To be called by all MPI processes.
+   */
+  void save(const int &numIterationsDone);
+
+  /** Deletes the checkpoint, to be called when the solver has converged.
+   */
+  void remove();
+
+ private:
+  int interval;
+  std::string fileName;
+  // the iteration of the last call to load(), which needs not be saved again
+  int numIterationsLoaded = 0;
+
+  // the state is stored as matrices, with a function that copies it back
+  // to the registered object
+  std::vector<std::string> names;
+  std::vector<std::function<Eigen::MatrixXd()>> getters;
+  std::vector<std::function<void(const Eigen::MatrixXd &)>> setters;
+};
+
+#endif
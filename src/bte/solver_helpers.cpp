@@ -0,0 +1,71 @@
+#include "solver_helpers.h"
+#include <Eigen/QR>
+
+void andersonMixing(Eigen::MatrixXd &nNext, const Eigen::MatrixXd &nOld,
+                    const int &dimensionality,
+                    std::deque<Eigen::MatrixXd> &nHistory,
+                    std::deque<Eigen::MatrixXd> &rHistory,
+                    const int &historySize) {
+  nHistory.push_back(nOld);
+  rHistory.push_back(nNext - nOld);
+  if (int(nHistory.size()) > historySize + 1) {
+    nHistory.pop_front();
+    rHistory.pop_front();
+  }
+  auto m = int(nHistory.size()) - 1;
+  if (m == 0) {
+    return; // plain fixed-point step
+  }
+  const Eigen::MatrixXd &r = rHistory.back();
+  auto numStates = int(r.cols());
+  auto numCalculations = int(r.rows()) / dimensionality;
+  int size = dimensionality * numStates;
+
+  // the rows of a calculation, stacked in a single vector
+  auto stack = [&](const Eigen::MatrixXd &x, const int &iCalc) {
+    Eigen::VectorXd v(size);
+    for (int iDim = 0; iDim < dimensionality; iDim++) {
+      v.segment(iDim * numStates, numStates) =
+          x.row(iCalc * dimensionality + iDim).transpose();
+    }
+    return v;
+  };
+
+#pragma omp parallel for
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    Eigen::MatrixXd dN(size, m), dR(size, m);
+    for (int j = 0; j < m; j++) {
+      dN.col(j) = stack(nHistory[j + 1], iCalc) - stack(nHistory[j], iCalc);
+      dR.col(j) = stack(rHistory[j + 1], iCalc) - stack(rHistory[j], iCalc);
+    }
+    Eigen::VectorXd rCalc = stack(r, iCalc);
+    Eigen::VectorXd gamma = dR.completeOrthogonalDecomposition().solve(rCalc);
+    Eigen::VectorXd mixed =
+        stack(nOld, iCalc) + rCalc - (dN + dR) * gamma;
+    for (int iDim = 0; iDim < dimensionality; iDim++) {
+      nNext.row(iCalc * dimensionality + iDim) =
+          mixed.segment(iDim * numStates, numStates).transpose();
+    }
+  }
+}
+
+Eigen::MatrixXd cgRatio(const Eigen::MatrixXd &num, const Eigen::MatrixXd &den,
+                        const bool &useSymmetries) {
+  auto numCalculations = int(num.rows());
+  Eigen::MatrixXd ratio = Eigen::MatrixXd::Zero(numCalculations, num.cols());
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    if (useSymmetries) {
+      if (den.row(iCalc).sum() != 0.) {
+        ratio.row(iCalc).setConstant(num.row(iCalc).sum() /
+                                     den.row(iCalc).sum());
+      }
+    } else {
+      for (int i = 0; i < int(num.cols()); i++) {
+        if (den(iCalc, i) != 0.) {
+          ratio(iCalc, i) = num(iCalc, i) / den(iCalc, i);
+        }
+      }
+    }
+  }
+  return ratio;
+}
@@ -0,0 +1,43 @@
+#ifndef SOLVER_HELPERS_H
+#define SOLVER_HELPERS_H
+
+#include <Eigen/Core>
+#include <deque>
+
+/** Anderson mixing for the fixed-point iteration n = G(n) of a BTE solver.
+ * The next iterate is the combination of the last iterates whose residual
+ * G(n)-n has the smallest norm. The populations are stored as VectorBTE
+ * data, with rows (iCalc, iDim): each calculation is mixed on its own, but
+ * its cartesian components are mixed together as a single vector, since
+ * with symmetries the rotations of the scattering operator couple them.
+ * @param nNext: on input G(nOld), on output the mixed next iterate.
+ * @param nOld: the current iterate.
+ * @param dimensionality: the number of cartesian components of each
+ * calculation.
+ * @param nHistory, rHistory: the previous iterates and their residuals,
+ * updated here.
+ * @param historySize: the number of previous iterations used.
+ */
+void andersonMixing(Eigen::MatrixXd &nNext, const Eigen::MatrixXd &nOld,
+                    const int &dimensionality,
+                    std::deque<Eigen::MatrixXd> &nHistory,
+                    std::deque<Eigen::MatrixXd> &rHistory,
+                    const int &historySize);
+
+/** Ratio of two (numCalculations,3) scalar products of VectorBTE, i.e. the
+ * scalar coefficients of the conjugate-gradient-like solvers.
+ * Without symmetries, each cartesian component is an independent linear
+ * system with its own coefficient. With symmetries, the matrix only stores
+ * the irreducible states and the components are mixed by the rotations of
+ * the star, so a single coefficient, from the products summed over the three
+ * components, is used for all of them.
+ * Entries with a vanishing denominator (e.g. in low dimensional problems)
+ * are set to zero.
+ * @param num: the numerator, of size (numCalculations,3).
+ * @param den: the denominator, of size (numCalculations,3).
+ * @param useSymmetries: whether the BTE is solved in the irreducible wedge.
+ */
+Eigen::MatrixXd cgRatio(const Eigen::MatrixXd &num, const Eigen::MatrixXd &den,
+                        const bool &useSymmetries);
+
+#endif
@@ -1,5 +1,9 @@
 #include "vector_bte.h"
 #include "constants.h"
+#include "hdf5_output.h"
+#include "io.h"
+#include "utilities.h"
+#include <cmath>
 
 // default constructor
 VectorBTE::VectorBTE(StatisticsSweep &statisticsSweep_,
@@ -20,7 +24,9 @@ VectorBTE::VectorBTE(StatisticsSweep &statisticsSweep_,
   numChemPots = statisticsSweep.getNumChemicalPotentials();
   numTemps = statisticsSweep.getNumTemperatures();
   data.resize(numCalculations, numStates);
-  data.setZero();
+  firstTouch(data.data(), size_t(data.size()));
+  Profiler::recordObjectMemory("each VectorBTE",
+                               double(data.size()) * sizeof(double));
 
   if (bandStructure.getParticle().isPhonon()) {
     for (int is : bandStructure.irrStateIterator()) {
@@ -89,9 +95,11 @@ Eigen::MatrixXd VectorBTE::dot(const VectorBTE &that) {
     auto isIndex = StateIndex(is);
     BteIndex iBteIdx = bandStructure.stateToBte(isIndex);
     int iBte = iBteIdx.get();
-    auto rotationsStar = bandStructure.getRotationsStar(isIndex);
+    const std::vector<int> &rotationsStar =
+        bandStructure.getRotationIndicesStar(isIndex);
     for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
-      for (const Eigen::Matrix3d &rot : rotationsStar) {
+      for (int iRot : rotationsStar) {
+        const Eigen::Matrix3d &rot = bandStructure.getRotationMatrix(iRot);
         Eigen::Vector3d x = Eigen::Vector3d::Zero();
         Eigen::Vector3d y = Eigen::Vector3d::Zero();
         for (int i : {0,1,2}) {
@@ -111,8 +119,13 @@ Eigen::MatrixXd VectorBTE::dot(const VectorBTE &that) {
 }
 
 VectorBTE VectorBTE::baseOperator(VectorBTE &that, const int &operatorType) {
+  VectorBTE newPopulation(*this);
+  newPopulation.baseInPlaceOperator(that, operatorType);
+  return newPopulation;
+}
 
-  VectorBTE newPopulation(statisticsSweep, bandStructure, dimensionality);
+void VectorBTE::baseInPlaceOperator(const VectorBTE &that,
+                                    const int &operatorType) {
 
   // check that they have the same number of states
   if(this->numStates != that.numStates) {
@@ -128,13 +141,13 @@ VectorBTE VectorBTE::baseOperator(VectorBTE &that, const int &operatorType) {
   if (dimensionality == that.dimensionality) {
 
     if (operatorType == operatorSums) {
-      newPopulation.data << this->data.array() + that.data.array();
+      data.array() += that.data.array();
     } else if (operatorType == operatorDivs) {
-      newPopulation.data << this->data.array() / that.data.array();
+      data.array() /= that.data.array();
     } else if (operatorType == operatorProd) {
-      newPopulation.data << this->data.array() * that.data.array();
+      data.array() *= that.data.array();
     } else if (operatorType == operatorDiff) {
-      newPopulation.data << this->data.array() - that.data.array();
+      data.array() -= that.data.array();
     } else {
       Error("Developer error: Operator type for VectorBTE not recognized");
     }
@@ -149,17 +162,13 @@ VectorBTE VectorBTE::baseOperator(VectorBTE &that, const int &operatorType) {
       auto i2 = that.glob2Loc(imu, it, CartIndex(0)); //cartesian index
 
       if (operatorType == operatorSums) {
-        newPopulation.data.row(iCalc) =
-            this->data.row(iCalc).array() + that.data.row(i2).array();
+        data.row(iCalc).array() += that.data.row(i2).array();
       } else if (operatorType == operatorDivs) {
-        newPopulation.data.row(iCalc) =
-            this->data.row(iCalc).array() / that.data.row(i2).array();
+        data.row(iCalc).array() /= that.data.row(i2).array();
       } else if (operatorType == operatorProd) {
-        newPopulation.data.row(iCalc) =
-            this->data.row(iCalc).array() * that.data.row(i2).array();
+        data.row(iCalc).array() *= that.data.row(i2).array();
       } else if (operatorType == operatorDiff) {
-        newPopulation.data.row(iCalc) =
-            this->data.row(iCalc).array() - that.data.row(i2).array();
+        data.row(iCalc).array() -= that.data.row(i2).array();
       } else {
         Error("Operator type for VectorBTE not recognized");
       }
@@ -169,9 +178,70 @@ VectorBTE VectorBTE::baseOperator(VectorBTE &that, const int &operatorType) {
                 "cannot be operated on when dim > 1.");
   }
   for (const int &iBte : excludeIndices) {
-    newPopulation.data.col(iBte).setZero();
+    data.col(iBte).setZero();
+  }
+}
+
+VectorBTE &VectorBTE::operator+=(const VectorBTE &that) {
+  baseInPlaceOperator(that, operatorSums);
+  return *this;
+}
+
+VectorBTE &VectorBTE::operator-=(const VectorBTE &that) {
+  baseInPlaceOperator(that, operatorDiff);
+  return *this;
+}
+
+VectorBTE &VectorBTE::operator*=(const VectorBTE &that) {
+  baseInPlaceOperator(that, operatorProd);
+  return *this;
+}
+
+VectorBTE &VectorBTE::operator/=(const VectorBTE &that) {
+  baseInPlaceOperator(that, operatorDivs);
+  return *this;
+}
+
+VectorBTE &VectorBTE::operator*=(const double &scalar) {
+  data *= scalar;
+  return *this;
+}
+
+VectorBTE &VectorBTE::operator*=(const Eigen::MatrixXd &vector) {
+  if (vector.rows() != statisticsSweep.getNumCalculations() ||
+      vector.cols() != dimensionality) {
+    Error("VectorBTE *= unexpected alignment with MatrixXd");
+  }
+  for (int iCalc = 0; iCalc < vector.rows(); iCalc++) {
+    for (int iDim = 0; iDim < dimensionality; iDim++) {
+      data.row(iCalc * dimensionality + iDim) *= vector(iCalc, iDim);
+    }
+  }
+  return *this;
+}
+
+void VectorBTE::axpy(const Eigen::MatrixXd &alpha, const VectorBTE &that) {
+  if (that.dimensionality != dimensionality || that.numStates != numStates) {
+    Error("VectorBTE axpy requires vectors of the same shape");
+  }
+  if (alpha.rows() != statisticsSweep.getNumCalculations() ||
+      alpha.cols() != dimensionality) {
+    Error("VectorBTE axpy: unexpected alignment with MatrixXd");
+  }
+  // alpha, flattened in the same order of the rows of data
+  Eigen::VectorXd alphaRows(numCalculations);
+  for (int iCalc = 0; iCalc < alpha.rows(); iCalc++) {
+    for (int iDim = 0; iDim < dimensionality; iDim++) {
+      alphaRows(iCalc * dimensionality + iDim) = alpha(iCalc, iDim);
+    }
+  }
+#pragma omp parallel for
+  for (int iBte = 0; iBte < numStates; iBte++) {
+    data.col(iBte) += alphaRows.cwiseProduct(that.data.col(iBte));
+  }
+  for (const int &iBte : excludeIndices) {
+    data.col(iBte).setZero();
   }
-  return newPopulation;
 }
 
 // product operator overload
@@ -216,31 +286,13 @@ VectorBTE VectorBTE::operator*(ParallelMatrix<double> &matrix) {
     Error("VectorBTE and Matrix not aligned");
   }
   VectorBTE newPopulation(statisticsSweep, bandStructure, dimensionality);
-  newPopulation.data.setZero();
-
-  auto allLocalStates = matrix.getAllLocalStates();
-  size_t numAllLocalStates = allLocalStates.size();
-
-  #pragma omp parallel
-  {
-    Eigen::MatrixXd dataPrivate = newPopulation.data;
-#pragma omp for
-    for (size_t iTup=0; iTup<numAllLocalStates; iTup++) {
-      auto tup = allLocalStates[iTup];
-      auto i = std::get<0>(tup);
-      auto j = std::get<1>(tup);
-      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-	dataPrivate(iCalc, j) += data(iCalc, i) * matrix(i, j);
-      }
-    }
-#pragma omp critical
-    for (int j=0; j<data.cols(); ++j) {
-      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-	newPopulation.data(iCalc, j) += dataPrivate(iCalc, j);
-      }
-    }
-  }
-  mpi->allReduceSum(&newPopulation.data);
+
+  // newPopulation = (matrix^T * data^T)^T, done with pdgemm on the process
+  // grid of the matrix, which is never gathered
+  char transT = 'T';
+  char transN = 'N';
+  ParallelMatrix<double> x = matrix.distributeRows(data.transpose());
+  newPopulation.data = matrix.prod(x, transT, transN).replicate().transpose();
   return newPopulation;
 }
 
@@ -291,16 +343,21 @@ VectorBTE VectorBTE::reciprocal() {
 
 void VectorBTE::canonical2Population() {
   auto particle = bandStructure.getParticle();
+  int numCalcs = statisticsSweep.getNumCalculations();
+  Eigen::VectorXd temps(numCalcs), chemPots(numCalcs);
+  for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temps(iCalc) = calcStat.temperature;
+    chemPots(iCalc) = calcStat.chemicalPotential;
+  }
 #pragma omp parallel for
   for (int iBte = 0; iBte < numStates; iBte++) {
     BteIndex iBteIdx = BteIndex(iBte);
     StateIndex isIdx = bandStructure.bteToState(iBteIdx);
     double en = bandStructure.getEnergy(isIdx);
-    for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
-      auto temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
-      auto chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
-      double pop = particle.getPopPopPm1(en, temp, chemPot);
-      for (int iDim : {0,1,2}) {
+    for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+      double pop = particle.getPopPopPm1(en, temps(iCalc), chemPots(iCalc));
+      for (int iDim = 0; iDim < dimensionality; iDim++) {
         VectorBTE::operator()(iCalc, iDim, iBte) *= pop;
       }
     }
@@ -312,16 +369,21 @@ void VectorBTE::population2Canonical() {
   if (particle.isFermi()) {
     Error("Possible divergence in population2Canonical");
   }
+  int numCalcs = statisticsSweep.getNumCalculations();
+  Eigen::VectorXd temps(numCalcs), chemPots(numCalcs);
+  for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temps(iCalc) = calcStat.temperature;
+    chemPots(iCalc) = calcStat.chemicalPotential;
+  }
 #pragma omp parallel for
   for (int iBte = 0; iBte < numStates; iBte++) {
     BteIndex iBteIdx = BteIndex(iBte);
     StateIndex isIdx = bandStructure.bteToState(iBteIdx);
     double en = bandStructure.getEnergy(isIdx);
-    for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
-      auto temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
-      auto chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
-      double pop = particle.getPopPopPm1(en, temp, chemPot);
-      for (int iDim : {0,1,2}) {
+    for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+      double pop = particle.getPopPopPm1(en, temps(iCalc), chemPots(iCalc));
+      for (int iDim = 0; iDim < dimensionality; iDim++) {
         VectorBTE::operator()(iCalc, iDim, iBte) /= pop;
       }
     }
@@ -361,3 +423,284 @@ VectorBTE::loc2Glob(
 void VectorBTE::setConst(const double &constant) {
   data.setConstant(constant);
 }
+
+// index of a wavevector (in crystal coordinates) on a periodic mesh, with
+// the mesh points ordered as (i0 * mesh(1) + i1) * mesh(2) + i2
+static int foldOnMesh(const Eigen::Vector3d &crystalCoordinates,
+                      const Eigen::Vector3i &mesh,
+                      const Eigen::Vector3d &offset) {
+  int index = 0;
+  for (int i : {0, 1, 2}) {
+    int j = int(std::round((crystalCoordinates(i) - offset(i)) * mesh(i)));
+    j = ((j % mesh(i)) + mesh(i)) % mesh(i);
+    index = index * mesh(i) + j;
+  }
+  return index;
+}
+
+void MeshVectorBTE::append(const MeshVectorBTE &that) {
+  if (empty()) {
+    *this = that;
+    return;
+  }
+  if (that.mesh != mesh || that.dimensionality != dimensionality ||
+      that.numFullBands != numFullBands) {
+    Error("Appending populations on a different mesh");
+  }
+  temperatures.insert(temperatures.end(), that.temperatures.begin(),
+                      that.temperatures.end());
+  chemicalPotentials.insert(chemicalPotentials.end(),
+                            that.chemicalPotentials.begin(),
+                            that.chemicalPotentials.end());
+  values.insert(values.end(), that.values.begin(), that.values.end());
+}
+
+MeshVectorBTE VectorBTE::unfoldOnMesh() {
+  if (bandStructure.getIsDistributed()) {
+    Error("Unfolding the BTE populations doesn't work with a distributed "
+          "band structure.");
+  }
+  MeshVectorBTE meshVector;
+  Points points = bandStructure.getPoints();
+  auto tup = points.getMesh();
+  meshVector.mesh = std::get<0>(tup);
+  meshVector.offset = std::get<1>(tup);
+  meshVector.dimensionality = dimensionality;
+  size_t numMeshPoints = meshVector.mesh.prod();
+  int numCalcs = statisticsSweep.getNumCalculations();
+  for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+    auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+    meshVector.temperatures.push_back(calcStatistics.temperature);
+    meshVector.chemicalPotentials.push_back(calcStatistics.chemicalPotential);
+  }
+
+  // bands are stored with their index in the full band structure
+  std::vector<int> iss = bandStructure.irrStateIterator();
+  for (int is : iss) {
+    StateIndex isIdx(is);
+    auto t = bandStructure.getIndex(isIdx);
+    meshVector.numFullBands = std::max(meshVector.numFullBands,
+        bandStructure.getFullBandIndex(std::get<0>(t), std::get<1>(t)) + 1);
+  }
+  size_t numFullBands = meshVector.numFullBands;
+
+  meshVector.values.resize(numCalcs * dimensionality * numMeshPoints
+                           * numFullBands, 0.);
+  for (int is : iss) {
+    StateIndex isIdx(is);
+    int iBte = bandStructure.stateToBte(isIdx).get();
+    if (std::find(excludeIndices.begin(), excludeIndices.end(), iBte) !=
+        excludeIndices.end()) {
+      continue;
+    }
+    auto t = bandStructure.getIndex(isIdx);
+    WavevectorIndex ikIdx = std::get<0>(t);
+    size_t ibFull = bandStructure.getFullBandIndex(ikIdx, std::get<1>(t));
+
+    // unfold the irreducible point on its star, q^red = R q^irr
+    const std::vector<int> &rotations =
+        bandStructure.getRotationIndicesStar(isIdx);
+    std::vector<int> star = {ikIdx.get()};
+    if (rotations.size() > 1) {
+      star = bandStructure.getReducibleStarFromIrreducible(ikIdx.get());
+    }
+    for (size_t iStar = 0; iStar < star.size(); iStar++) {
+      WavevectorIndex ikStar(star[iStar]);
+      Eigen::Vector3d q =
+          points.cartesianToCrystal(bandStructure.getWavevector(ikStar));
+      size_t iMesh = foldOnMesh(q, meshVector.mesh, meshVector.offset);
+      for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+        Eigen::VectorXd x(dimensionality);
+        for (int iDim = 0; iDim < dimensionality; iDim++) {
+          x(iDim) = operator()(iCalc, iDim, iBte);
+        }
+        if (dimensionality == 3) {
+          x = bandStructure.getRotationMatrix(rotations[iStar]) * x;
+        }
+        for (int iDim = 0; iDim < dimensionality; iDim++) {
+          size_t i = ((iCalc * dimensionality + iDim) * numMeshPoints + iMesh)
+                         * numFullBands + ibFull;
+          meshVector.values[i] = x(iDim);
+        }
+      }
+    }
+  }
+  return meshVector;
+}
+
+Eigen::VectorXd VectorBTE::interpolateFromMesh(
+    const MeshVectorBTE &meshVector) {
+  if (meshVector.dimensionality != dimensionality) {
+    Error("Interpolating BTE populations of a different dimensionality");
+  }
+  int numCalcs = statisticsSweep.getNumCalculations();
+  const Eigen::Vector3i &mesh = meshVector.mesh;
+  const Eigen::Vector3d &offset = meshVector.offset;
+  size_t numMeshPoints = mesh.prod();
+  size_t numFullBands = meshVector.numFullBands;
+
+  // each calculation reads the one at the closest temperature
+  std::vector<size_t> meshCalcs(numCalcs);
+  Eigen::VectorXd meshTemperatures(numCalcs);
+  for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+    auto calcStatistics = statisticsSweep.getCalcStatistics(iCalc);
+    auto distance = [&](const size_t &i) {
+      return std::make_pair(
+          std::abs(meshVector.temperatures[i] - calcStatistics.temperature),
+          std::abs(meshVector.chemicalPotentials[i]
+                   - calcStatistics.chemicalPotential));
+    };
+    size_t best = 0;
+    for (size_t i = 1; i < meshVector.temperatures.size(); i++) {
+      if (distance(i) < distance(best)) {
+        best = i;
+      }
+    }
+    meshCalcs[iCalc] = best;
+    meshTemperatures(iCalc) = meshVector.temperatures[best];
+  }
+
+  data.setZero();
+  Points points = bandStructure.getPoints();
+  std::vector<int> iss = bandStructure.irrStateIterator();
+  int niss = int(iss.size());
+#pragma omp parallel for default(none)                                        \
+    shared(iss, niss, points, mesh, offset, numMeshPoints, numFullBands,       \
+           meshVector, meshCalcs, numCalcs)
+  for (int iis = 0; iis < niss; iis++) {
+    StateIndex isIdx(iss[iis]);
+    int iBte = bandStructure.stateToBte(isIdx).get();
+    auto t = bandStructure.getIndex(isIdx);
+    WavevectorIndex ikIdx = std::get<0>(t);
+    size_t ibFull = bandStructure.getFullBandIndex(ikIdx, std::get<1>(t));
+    if (ibFull >= numFullBands) {
+      continue;
+    }
+    Eigen::Vector3d q =
+        points.cartesianToCrystal(bandStructure.getWavevector(ikIdx));
+
+    // the 8 corners of the cell of the mesh that contains q
+    Eigen::Vector3i corner;
+    Eigen::Vector3d w;
+    for (int i : {0, 1, 2}) {
+      double x = (q(i) - offset(i)) * mesh(i);
+      corner(i) = int(std::floor(x));
+      w(i) = x - corner(i);
+    }
+    for (int c = 0; c < 8; c++) {
+      double weight = 1.;
+      size_t iMesh = 0;
+      for (int i : {0, 1, 2}) {
+        int shift = (c >> i) & 1;
+        weight *= shift == 1 ? w(i) : 1. - w(i);
+        int j = ((corner(i) + shift) % mesh(i) + mesh(i)) % mesh(i);
+        iMesh = iMesh * mesh(i) + j;
+      }
+      if (weight == 0.) {
+        continue;
+      }
+      for (int iCalc = 0; iCalc < numCalcs; iCalc++) {
+        for (int iDim = 0; iDim < dimensionality; iDim++) {
+          size_t i = ((meshCalcs[iCalc] * dimensionality + iDim)
+                          * numMeshPoints + iMesh) * numFullBands + ibFull;
+          operator()(iCalc, iDim, iBte) += weight * meshVector.values[i];
+        }
+      }
+    }
+  }
+  for (int iBte : excludeIndices) {
+    data.col(iBte).setZero();
+  }
+  return meshTemperatures;
+}
+
+void VectorBTE::outputToHDF5(const std::string &fileName) {
+#ifndef HDF5_AVAIL
+  (void) fileName;
+  Error("The HDF5 output of the BTE populations requires Phoebe built "
+        "with HDF5.");
+#else
+  MeshVectorBTE meshVector = unfoldOnMesh();
+
+  // only the head writes: a failure is broadcast before raising the
+  // (collective) error
+  int writeError = 0;
+  if (mpi->mpiHead()) {
+    std::vector<double> temps, chemPots;
+    for (size_t i = 0; i < meshVector.temperatures.size(); i++) {
+      temps.push_back(meshVector.temperatures[i] * temperatureAuToSi);
+      chemPots.push_back(meshVector.chemicalPotentials[i] * energyRyToEv);
+    }
+    std::vector<int> mesh = {meshVector.mesh(0), meshVector.mesh(1),
+                             meshVector.mesh(2)};
+    std::vector<double> offset = {meshVector.offset(0), meshVector.offset(1),
+                                  meshVector.offset(2)};
+    std::vector<size_t> dims = {temps.size(), size_t(dimensionality),
+                                size_t(meshVector.mesh.prod()),
+                                size_t(meshVector.numFullBands)};
+    std::string particleType = "phonon";
+    if (bandStructure.getParticle().isElectron()) {
+      particleType = "electron";
+    }
+    try {
+      HighFive::File file(fileName, HighFive::File::Overwrite);
+      writeHDF5Slice(file, "/values", dims, {0, 0, 0, 0}, dims,
+                     meshVector.values);
+      file.createDataSet("/mesh", mesh);
+      file.createDataSet("/meshOffset", offset);
+      writeHDF5String(file, "/coordsType", "lattice", true);
+      file.createDataSet("/temperatures", temps);
+      writeHDF5String(file, "/temperatureUnit", "K", true);
+      file.createDataSet("/chemicalPotentials", chemPots);
+      writeHDF5String(file, "/chemicalPotentialUnit", "eV", true);
+      writeHDF5String(file, "/particleType", particleType, true);
+    } catch (std::exception &error) {
+      writeError = 1;
+    }
+  }
+  mpi->bcast(&writeError);
+  if (writeError != 0) {
+    Error("Issue writing the BTE populations to " + fileName);
+  }
+#endif
+}
+
+Eigen::VectorXd VectorBTE::interpolateFromHDF5(const std::string &fileName) {
+#ifndef HDF5_AVAIL
+  (void) fileName;
+  Error("Reading the BTE populations requires Phoebe built with HDF5.");
+  return Eigen::VectorXd::Zero(statisticsSweep.getNumCalculations());
+#else
+  MeshVectorBTE meshVector;
+  std::vector<double> offset, temps, chemPots;
+  std::vector<int> mesh;
+  std::vector<size_t> dims;
+  try {
+    HighFive::File file(fileName, HighFive::File::ReadOnly);
+    HighFive::DataSet dValues = file.getDataSet("/values");
+    dims = dValues.getDimensions();
+    if (dims.size() != 4) {
+      throw std::runtime_error("Unexpected shape of /values");
+    }
+    meshVector.values.resize(dims[0] * dims[1] * dims[2] * dims[3]);
+    dValues.read_raw(meshVector.values.data());
+    file.getDataSet("/mesh").read(mesh);
+    file.getDataSet("/meshOffset").read(offset);
+    file.getDataSet("/temperatures").read(temps);
+    file.getDataSet("/chemicalPotentials").read(chemPots);
+  } catch (std::exception &error) {
+    Error("Issue reading the BTE populations from " + fileName);
+  }
+  for (int i : {0, 1, 2}) {
+    meshVector.mesh(i) = mesh[i];
+    meshVector.offset(i) = offset[i];
+  }
+  meshVector.dimensionality = int(dims[1]);
+  meshVector.numFullBands = int(dims[3]);
+  for (size_t i = 0; i < temps.size(); i++) {
+    meshVector.temperatures.push_back(temps[i] / temperatureAuToSi);
+    meshVector.chemicalPotentials.push_back(chemPots[i] / energyRyToEv);
+  }
+  return interpolateFromMesh(meshVector);
+#endif
+}
@@ -7,6 +7,29 @@
 #include "context.h"
 #include "eigen.h"
 
+/** Values of a VectorBTE unfolded on the full (uniform) mesh of
+ * wavevectors, which don't depend on the band structure that produced them,
+ * and can be interpolated on a different mesh.
+ */
+struct MeshVectorBTE {
+  Eigen::Vector3i mesh = Eigen::Vector3i::Zero();
+  // offset of the mesh, in crystal coordinates
+  Eigen::Vector3d offset = Eigen::Vector3d::Zero();
+  int dimensionality = 0;
+  int numFullBands = 0;
+  // temperature and chemical potential (atomic units) of each calculation
+  std::vector<double> temperatures;
+  std::vector<double> chemicalPotentials;
+  // row-major (numCalculations, dimensionality, numMeshPoints, numFullBands)
+  std::vector<double> values;
+
+  bool empty() const { return temperatures.empty(); }
+
+  /** Appends the calculations of another MeshVectorBTE on the same mesh.
+   */
+  void append(const MeshVectorBTE &that);
+};
+
 /** Class used to store the "vector" of out-of-equilibrium populations.
  * The vector indices are over the Bloch state. Additionally, there is one of
  * these vector for each pair of (temperatures,chemicalPotentials).
@@ -109,6 +132,33 @@ public:
    */
   VectorBTE operator-();
 
+  /** In-place versions of the element-wise operators +, -, * and /.
+   * They follow the same rules for the dimensionality of that, but don't
+   * allocate a new vector, which matters for the solvers' loops.
+   * @param that: the second VectorBTE object y, such that *this = *this op y
+   */
+  VectorBTE &operator+=(const VectorBTE &that);
+  VectorBTE &operator-=(const VectorBTE &that);
+  VectorBTE &operator*=(const VectorBTE &that);
+  VectorBTE &operator/=(const VectorBTE &that);
+
+  /** In-place product with a scalar, x -> x * scalar.
+   */
+  VectorBTE &operator*=(const double &scalar);
+
+  /** In-place product with a (numCalculations, dimensionality) matrix, as
+   * in operator*(const Eigen::MatrixXd &).
+   */
+  VectorBTE &operator*=(const Eigen::MatrixXd &vector);
+
+  /** Fused update x -> x + alpha * y, where alpha is a
+   * (numCalculations, dimensionality) matrix of coefficients, as used by the
+   * conjugate gradient solvers.
+   * @param alpha: the coefficients for each calculation and direction.
+   * @param that: the VectorBTE y, with the same shape of this.
+   */
+  void axpy(const Eigen::MatrixXd &alpha, const VectorBTE &that);
+
   /** element wise division between two VectorBTE objects x and y.
    * If the dimensionality of the two objects is the same, we compute
    * element-wise result = x/y.
@@ -137,10 +187,53 @@ public:
    */
   void population2Canonical();
 
+  /** Unfolds the vector on the full mesh of wavevectors, so that it can be
+   * interpolated on the states of a different mesh (e.g. as the initial
+   * guess of the BTE solvers). The values of the irreducible states are
+   * copied on their star, rotating the cartesian components of vector
+   * quantities. Mesh points and bands without a Bloch state (e.g. outside
+   * the window) are set to zero.
+   */
+  MeshVectorBTE unfoldOnMesh();
+
+  /** Sets the vector by trilinear interpolation of values on a (periodic)
+   * mesh, which can differ from the mesh of the current band structure.
+   * Bands are matched by their index in the full band structure. Each
+   * calculation reads the calculation of meshVector with the closest
+   * temperature (and then chemical potential).
+   * @param meshVector: the values on the mesh, e.g. from unfoldOnMesh().
+   * @return temperatures: for each calculation, the temperature of the
+   * calculation read from meshVector, so that the caller can rescale the
+   * values.
+   */
+  Eigen::VectorXd interpolateFromMesh(const MeshVectorBTE &meshVector);
+
+  /** Writes the vector, unfolded on the full mesh, to a HDF5 file, e.g. to
+   * be used as the initial guess of the BTE solvers in a later run.
+   * The dataset /values has shape
+   * (numCalculations, dimensionality, numMeshPoints, numFullBands), and is
+   * stored with the mesh, the temperatures and the chemical potentials.
+   * The file is written by the head process.
+   * @param fileName: name of the HDF5 file.
+   */
+  void outputToHDF5(const std::string &fileName);
+
+  /** Sets the vector from a HDF5 file written by outputToHDF5(), whose
+   * mesh of wavevectors can differ from the current one, as in
+   * interpolateFromMesh().
+   * @param fileName: name of the HDF5 file.
+   * @return temperatures: for each calculation, the temperature of the
+   * calculation read from the file.
+   */
+  Eigen::VectorXd interpolateFromHDF5(const std::string &fileName);
+
   /** raw buffer containing the values of the vector
  *  The matrix has size (numCalculations, numStates), where numCalculations is the number
  *  of pairs of temperature and chemical potentials, and numStates is the
  *  number of Bloch states used in the Boltzmann equation.
+ *  Since Eigen is column-major, the numCalculations*dimensionality values
+ *  of a state are contiguous: loops should run over states in the outer
+ *  loop, and over iCalc and iDim in the inner loops.
  */
   Eigen::MatrixXd data;
 
@@ -189,6 +282,7 @@ public:
    * class, and also because operations are rather similar.
    */
   VectorBTE baseOperator(VectorBTE &that, const int &operatorType);
+  void baseInPlaceOperator(const VectorBTE &that, const int &operatorType);
   const int operatorSums = 0;
   const int operatorDivs = 1;
   const int operatorProd = 2;
@@ -157,11 +157,17 @@ VectorEPA VectorEPA::operator*(ParallelMatrix<double> &matrix) {
   VectorEPA newPopulation = *this;
   newPopulation.data.setZero();
   for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-    for (auto tup : matrix.getAllLocalStates()) {
-      auto i = std::get<0>(tup);
-      auto j = std::get<1>(tup);
-      newPopulation.data(iCalc, i) = matrix(i, j) * data(iCalc, j);
-    }
+    matrix.forEachLocalTile([&](const int &row0, const int &col0,
+                                const int &numTileRows,
+                                const int &numTileCols, double *tile,
+                                const int &ld) {
+      for (int j = 0; j < numTileCols; j++) {
+        for (int i = 0; i < numTileRows; i++) {
+          newPopulation.data(iCalc, row0 + i) +=
+              tile[i + size_t(j) * ld] * data(iCalc, col0 + j);
+        }
+      }
+    });
   }
   mpi->allReduceSum(&newPopulation.data);
   return newPopulation;
@@ -1,24 +1,32 @@
 #include "common_kokkos.h"
 #include "eigen.h"
 #include "mpiHelper.h"
+#include "Blas.h"
+#include "exceptions.h"
+#include "io.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
 #include <stdexcept>
+#include "omp.h"
 
 #ifdef KOKKOS_ENABLE_CUDA
+#include <cuda_runtime_api.h>
 #include <cusolver_common.h>
 #include <cusolverDn.h>
 #endif
+#ifdef KOKKOS_ENABLE_HIP
+#include <hip/hip_runtime_api.h>
+#include <rocsolver/rocsolver.h>
+#endif
 
-void kokkosZHEEV(StridedComplexView3D &A, DoubleView2D &W) {
-  // kokkos people didn't implement the diagonalization of matrices.
-  // So, we have to do a couple of dirty tricks
-
+/** Diagonalizes the batch on the host with Eigen, one matrix per thread.
+ */
+void hostZHEEVEigen(StridedComplexView3D &A, DoubleView2D &W,
+                    const bool &withEigenvectors) {
   int M = A.extent(0);// number of matrices
   int N = A.extent(1);// matrix size is NxN
 
-#ifndef KOKKOS_ENABLE_CUDA
-  // general case, copy to CPU (if necessary) and
-  // use Eigen to solve the diagonalization problems
-
   auto A_h = Kokkos::create_mirror_view(A);
   auto W_h = Kokkos::create_mirror_view(W);
   Kokkos::deep_copy(A_h, A);
@@ -38,28 +46,95 @@ void kokkosZHEEV(StridedComplexView3D &A, DoubleView2D &W) {
     // Each matrix is column-major due to the strided layout
     Eigen::Map<Eigen::Matrix<std::complex<double>, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>> thisH(storage, N, N);
 
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(thisH);
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(
+        thisH, withEigenvectors ? Eigen::ComputeEigenvectors
+                                : Eigen::EigenvaluesOnly);
     Eigen::VectorXd energies = eigenSolver.eigenvalues();
-    Eigen::MatrixXcd eigenvectors = eigenSolver.eigenvectors();
     for (int m = 0; m < N; ++m) {
       W_h(i, m) = energies(m);
-      for (int n = 0; n < N; ++n) {
-        //A_h(i, m, n) *= 3; // TODO: undo
-        A_h(i, m, n) = eigenvectors(m, n);
+    }
+    if (withEigenvectors) {
+      Eigen::MatrixXcd eigenvectors = eigenSolver.eigenvectors();
+      for (int m = 0; m < N; ++m) {
+        for (int n = 0; n < N; ++n) {
+          A_h(i, m, n) = eigenvectors(m, n);
+        }
       }
     }
   }
-  Kokkos::deep_copy(A, A_h);
+  if (withEigenvectors) {
+    Kokkos::deep_copy(A, A_h);
+  }
   Kokkos::deep_copy(W, W_h);
-#else
-  // CUDA special case, call the cuSOLVER library directly
+}
+
+/** Diagonalizes the batch on the host with LAPACK's zheev, one matrix per
+ * thread. The column-major matrices are diagonalized in place.
+ */
+void hostZHEEVLapack(StridedComplexView3D &A, DoubleView2D &W,
+                     const bool &withEigenvectors) {
+  int M = A.extent(0);// number of matrices
+  int N = A.extent(1);// matrix size is NxN
+
+  auto A_h = Kokkos::create_mirror_view(A);
+  auto W_h = Kokkos::create_mirror_view(W);
+  Kokkos::deep_copy(A_h, A);
+
+  int numErrors = 0;
+#pragma omp parallel reduction(+ : numErrors)
+  {
+    char jobz = withEigenvectors ? 'V' : 'N';
+    char uplo = 'L';
+    int n = N;
+    int info;
+    // workspace query, once per thread
+    int lwork = -1;
+    std::complex<double> workSize;
+    std::vector<double> rwork(std::max(1, 3 * N - 2));
+    std::vector<double> w(N);
+    std::vector<std::complex<double>> dummy(1);
+    zheev_(&jobz, &uplo, &n, dummy.data(), &n, w.data(), &workSize, &lwork,
+           rwork.data(), &info);
+    lwork = std::max(1, int(workSize.real()));
+    std::vector<std::complex<double>> work(lwork);
+
+#pragma omp for
+    for (int i = 0; i < M; ++i) {
+      auto *storage = reinterpret_cast<std::complex<double> *>(A_h.data()) + i*N*N;
+      zheev_(&jobz, &uplo, &n, storage, &n, w.data(), work.data(), &lwork,
+             rwork.data(), &info);
+      if (info != 0) {
+        ++numErrors;
+      }
+      for (int m = 0; m < N; ++m) {
+        W_h(i, m) = w[m];
+      }
+    }
+  }
+  if (numErrors > 0) {
+    Error("zheev failed on " + std::to_string(numErrors) + " matrices");
+  }
+  if (withEigenvectors) {
+    Kokkos::deep_copy(A, A_h);
+  }
+  Kokkos::deep_copy(W, W_h);
+}
+
+#ifdef KOKKOS_ENABLE_CUDA
+/** Diagonalizes the batch on the GPU with the Jacobi solver of cuSOLVER.
+ */
+void deviceZHEEVSyevj(StridedComplexView3D &A, DoubleView2D &W,
+                      const bool &withEigenvectors) {
+  int M = A.extent(0);// number of matrices
+  int N = A.extent(1);// matrix size is NxN
 
   // cuSOLVER setup
   cusolverDnHandle_t handle;
   cusolverDnCreate(&handle);
   syevjInfo_t params;
   cusolverDnCreateSyevjInfo(&params);
-  const cusolverEigMode_t jobz = CUSOLVER_EIG_MODE_VECTOR;
+  const cusolverEigMode_t jobz = withEigenvectors ? CUSOLVER_EIG_MODE_VECTOR
+                                                  : CUSOLVER_EIG_MODE_NOVECTOR;
   const cublasFillMode_t uplo = CUBLAS_FILL_MODE_LOWER;
 
   int lda = N;
@@ -70,7 +145,6 @@ void kokkosZHEEV(StridedComplexView3D &A, DoubleView2D &W) {
 
   // determine work array size
   cusolverDnZheevjBatched_bufferSize(handle, jobz, uplo, N, Aptr, lda, Wptr, &lwork, params, M);
-  //printf("lwork = %d\n", lwork);
 
   ComplexView1D work("work", lwork);
   cuDoubleComplex* workptr = (cuDoubleComplex*) work.data();
@@ -79,6 +153,9 @@ void kokkosZHEEV(StridedComplexView3D &A, DoubleView2D &W) {
   // call diagonalization
   cusolverDnZheevjBatched(handle, jobz, uplo, N, Aptr, lda, Wptr, workptr, lwork, info.data(), params, M);
 
+  cusolverDnDestroySyevjInfo(params);
+  cusolverDnDestroy(handle);
+
   // check if any diagonalizations went wrong
   int sum_infos = 0;
   Kokkos::parallel_reduce(M, KOKKOS_LAMBDA(int i, int &sum){
@@ -96,22 +173,277 @@ void kokkosZHEEV(StridedComplexView3D &A, DoubleView2D &W) {
 
     throw std::runtime_error("Error in cusolverDnZheevjBatched!");
   }
+}
+
+/** Diagonalizes the batch on the GPU with the divide and conquer solver of
+ * cuSOLVER, one matrix after the other. Faster than Jacobi for larger N.
+ */
+void deviceZHEEVSyevd(StridedComplexView3D &A, DoubleView2D &W,
+                      const bool &withEigenvectors) {
+  int M = A.extent(0);// number of matrices
+  int N = A.extent(1);// matrix size is NxN
+
+  cusolverDnHandle_t handle;
+  cusolverDnCreate(&handle);
+  const cusolverEigMode_t jobz = withEigenvectors ? CUSOLVER_EIG_MODE_VECTOR
+                                                  : CUSOLVER_EIG_MODE_NOVECTOR;
+  const cublasFillMode_t uplo = CUBLAS_FILL_MODE_LOWER;
+
+  int lda = N;
+  int lwork;
+  cuDoubleComplex* Aptr = (cuDoubleComplex*) A.data();
+  double *Wptr = W.data();
+  cusolverDnZheevd_bufferSize(handle, jobz, uplo, N, Aptr, lda, Wptr, &lwork);
+
+  ComplexView1D work("work", lwork);
+  cuDoubleComplex* workptr = (cuDoubleComplex*) work.data();
+  IntView1D info("info", M);
+
+  // the matrices are contiguous and column-major, and W has a right layout
+  for (int i = 0; i < M; ++i) {
+    cusolverDnZheevd(handle, jobz, uplo, N, Aptr + i * N * N, lda,
+                     Wptr + i * N, workptr, lwork, info.data() + i);
+  }
+  cusolverDnDestroy(handle);
+
+  int sum_infos = 0;
+  Kokkos::parallel_reduce(M, KOKKOS_LAMBDA(int i, int &sum){
+      sum += info(i)!=0;
+  }, sum_infos);
+  if(sum_infos > 0){
+    throw std::runtime_error("Error in cusolverDnZheevd!");
+  }
+}
 #endif
+
+#ifdef KOKKOS_ENABLE_HIP
+/** Diagonalizes the batch on AMD GPUs with the divide and conquer solver of
+ * rocSOLVER, with a single call for the whole batch.
+ */
+void deviceZHEEVRocsolver(StridedComplexView3D &A, DoubleView2D &W,
+                          const bool &withEigenvectors) {
+  int M = A.extent(0);// number of matrices
+  int N = A.extent(1);// matrix size is NxN
+
+  rocblas_handle handle;
+  rocblas_create_handle(&handle);
+  const rocblas_evect evect =
+      withEigenvectors ? rocblas_evect_original : rocblas_evect_none;
+  const rocblas_fill uplo = rocblas_fill_lower;
+
+  auto *Aptr = (rocblas_double_complex *) A.data();
+  double *Wptr = W.data();
+  // off-diagonal elements of the intermediate tridiagonal matrices
+  DoubleView1D E("E", size_t(M) * N);
+  IntView1D info("info", M);
+
+  // the matrices are contiguous and column-major, and W has a right layout
+  rocblas_status status = rocsolver_zheevd_strided_batched(
+      handle, evect, uplo, N, Aptr, N, rocblas_stride(N) * N, Wptr, N,
+      E.data(), N, info.data(), M);
+  // rocSOLVER runs asynchronously on the default stream of the handle
+  hipDeviceSynchronize();
+  rocblas_destroy_handle(handle);
+  if (status != rocblas_status_success) {
+    throw std::runtime_error("Error in rocsolver_zheevd_strided_batched!");
+  }
+
+  int sum_infos = 0;
+  Kokkos::parallel_reduce(M, KOKKOS_LAMBDA(int i, int &sum){
+      sum += info(i)!=0;
+  }, sum_infos);
+  if(sum_infos > 0){
+    throw std::runtime_error("Error in rocsolver_zheevd_strided_batched!");
+  }
+}
+#endif
+
+void kokkosZHEEV(StridedComplexView3D &A, DoubleView2D &W,
+                 const bool &withEigenvectors) {
+  // kokkos people didn't implement the diagonalization of matrices.
+  // So, we have to do a couple of dirty tricks, and call the libraries
+
+  int M = A.extent(0);// number of matrices
+  int N = A.extent(1);// matrix size is NxN
+
+  int backend =
+      kokkosDeviceMemory->chooseEigensolver(N, M, withEigenvectors);
+
+  Kokkos::fence();
+  auto startTime = std::chrono::steady_clock::now();
+
+  switch (backend) {
+  case eigensolverLapack:
+    hostZHEEVLapack(A, W, withEigenvectors);
+    break;
+#ifdef KOKKOS_ENABLE_CUDA
+  case eigensolverSyevj:
+    deviceZHEEVSyevj(A, W, withEigenvectors);
+    break;
+  case eigensolverSyevd:
+    deviceZHEEVSyevd(A, W, withEigenvectors);
+    break;
+#endif
+#ifdef KOKKOS_ENABLE_HIP
+  case eigensolverRocsolver:
+    deviceZHEEVRocsolver(A, W, withEigenvectors);
+    break;
+#endif
+  default:
+    hostZHEEVEigen(A, W, withEigenvectors);
+  }
+
+  Kokkos::fence();
+  std::chrono::duration<double> time =
+      std::chrono::steady_clock::now() - startTime;
+  kokkosDeviceMemory->recordEigensolverTiming(N, M, withEigenvectors, backend,
+                                              time.count());
 }
 
 DeviceManager *kokkosDeviceMemory = nullptr;
 
+/** Queries the device runtime for the free and total memory of the GPU.
+ * @return false if the query is not available (e.g. on CPUs).
+ */
+bool queryDeviceMemory(double &freeMemory, double &totalMemory) {
+  freeMemory = 0.;
+  totalMemory = 0.;
+#if defined(KOKKOS_ENABLE_CUDA)
+  size_t freeBytes, totalBytes;
+  if (cudaMemGetInfo(&freeBytes, &totalBytes) != cudaSuccess) {
+    return false;
+  }
+  freeMemory = double(freeBytes);
+  totalMemory = double(totalBytes);
+  return true;
+#elif defined(KOKKOS_ENABLE_HIP)
+  size_t freeBytes, totalBytes;
+  if (hipMemGetInfo(&freeBytes, &totalBytes) != hipSuccess) {
+    return false;
+  }
+  freeMemory = double(freeBytes);
+  totalMemory = double(totalBytes);
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Kokkos profiling hooks, measuring the memory allocated on the device
+static bool isDeviceMemorySpace(const Kokkos::Tools::SpaceHandle &handle) {
+  return std::string(handle.name) ==
+         Kokkos::DefaultExecutionSpace::memory_space::name();
+}
+
+static void allocateDataHook(const Kokkos::Tools::SpaceHandle handle,
+                             const char * /*label*/, const void *ptr,
+                             const uint64_t size) {
+  if (kokkosDeviceMemory != nullptr && isDeviceMemorySpace(handle)) {
+    kokkosDeviceMemory->recordAllocation(ptr, double(size));
+  }
+}
+
+static void deallocateDataHook(const Kokkos::Tools::SpaceHandle handle,
+                               const char * /*label*/, const void *ptr,
+                               const uint64_t /*size*/) {
+  if (kokkosDeviceMemory != nullptr && isDeviceMemorySpace(handle)) {
+    kokkosDeviceMemory->recordDeallocation(ptr);
+  }
+}
+
 DeviceManager::DeviceManager() {
 
+  // measure the allocations, unless an external Kokkos tool is loaded,
+  // since setting the hooks would replace the ones of the tool
+  if (!Kokkos::Tools::profileLibraryLoaded()) {
+    Kokkos::Tools::Experimental::set_allocate_data_callback(allocateDataHook);
+    Kokkos::Tools::Experimental::set_deallocate_data_callback(
+        deallocateDataHook);
+    memoryMeasured = true;
+  }
+
   memoryUsed = 0.;
+  double freeMemory, deviceMemory;
+  bool isDeviceQueried = queryDeviceMemory(freeMemory, deviceMemory);
   char *memStr = std::getenv("MAXMEM");
   if (memStr != nullptr) {
     memoryTotal = std::atof(memStr) * 1.0e9;
+  } else if (isDeviceQueried) {
+    memoryTotal = deviceMemory;
   } else {
     memoryTotal = 16.0e9; // 16 Gb is our educated guess for available memory
   }
+
+#if defined(KOKKOS_ENABLE_CUDA)
+  availableEigensolvers = {eigensolverSyevj, eigensolverSyevd,
+                           eigensolverLapack};
+#elif defined(KOKKOS_ENABLE_HIP)
+  availableEigensolvers = {eigensolverRocsolver, eigensolverLapack};
+#else
+  availableEigensolvers = {eigensolverEigen, eigensolverLapack};
+#endif
+  char *solverStr = std::getenv("EIGENSOLVER");
+  if (solverStr != nullptr) {
+    std::string solver(solverStr);
+    std::transform(solver.begin(), solver.end(), solver.begin(), ::tolower);
+    std::map<std::string, int> solverNames = {
+        {"auto", eigensolverAuto}, {"eigen", eigensolverEigen},
+        {"lapack", eigensolverLapack}, {"syevj", eigensolverSyevj},
+        {"syevd", eigensolverSyevd}, {"rocsolver", eigensolverRocsolver}};
+    if (solverNames.count(solver) == 0) {
+      Error("EIGENSOLVER must be one of auto, eigen, lapack, syevj, syevd, "
+            "rocsolver");
+    }
+    eigensolverBackend = solverNames[solver];
+#ifndef KOKKOS_ENABLE_CUDA
+    if (eigensolverBackend == eigensolverSyevj ||
+        eigensolverBackend == eigensolverSyevd) {
+      Error("The syevj and syevd eigensolvers require a CUDA build");
+    }
+#endif
+#ifndef KOKKOS_ENABLE_HIP
+    if (eigensolverBackend == eigensolverRocsolver) {
+      Error("The rocsolver eigensolver requires a HIP build");
+    }
+#endif
+  }
+
+  char *graphsStr = std::getenv("DEVICEGRAPHS");
+  if (graphsStr != nullptr) {
+    std::string graphs(graphsStr);
+    std::transform(graphs.begin(), graphs.end(), graphs.begin(), ::tolower);
+    kernelGraphs = graphs == "1" || graphs == "true" || graphs == "on";
+  }
+
+  char *bandStructureStr = std::getenv("DEVICEBANDSTRUCTURE");
+  if (bandStructureStr != nullptr) {
+    std::string value(bandStructureStr);
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    deviceBandStructure = value == "1" || value == "true" || value == "on";
+  }
+
+  char *layoutStr = std::getenv("D3LAYOUT");
+  if (layoutStr != nullptr) {
+    std::string layout(layoutStr);
+    std::transform(layout.begin(), layout.end(), layout.begin(), ::tolower);
+    std::map<std::string, int> layoutNames = {
+        {"auto", d3LayoutAuto}, {"right", d3LayoutRight},
+        {"left", d3LayoutLeft}};
+    if (layoutNames.count(layout) == 0) {
+      Error("D3LAYOUT must be one of auto, right, left");
+    }
+    d3Layout = layoutNames[layout];
+  }
 }
 
+bool DeviceManager::useKernelGraphs() const { return kernelGraphs; }
+
+bool DeviceManager::useDeviceBandStructure() const {
+  return deviceBandStructure;
+}
+
+int DeviceManager::getD3Layout() const { return d3Layout; }
+
 void DeviceManager::addDeviceMemoryUsage(const double& memoryBytes) {
   this->memoryUsed += memoryBytes;
   //printf("rank %d added %g MB, using %g MB\n", mpi->getRank(), memoryBytes/1e6, this->memoryUsed/1e6);
@@ -126,13 +458,95 @@ void DeviceManager::removeDeviceMemoryUsage(const double& memoryBytes) {
 }
 
 double DeviceManager::getAvailableMemory() {
-  return this->memoryTotal - this->memoryUsed;
+  double used = memoryMeasured ? memoryAllocated : memoryUsed;
+  double availableMemory = this->memoryTotal - used;
+  double freeMemory, deviceMemory;
+  if (queryDeviceMemory(freeMemory, deviceMemory)) {
+    availableMemory =
+        std::min(availableMemory, freeMemoryFraction * freeMemory);
+  }
+  return availableMemory;
 }
 
 double DeviceManager::getTotalMemory() {
   return this->memoryTotal;
 }
 
+bool DeviceManager::isMemoryMeasured() const { return memoryMeasured; }
+
+double DeviceManager::getMeasuredMemoryUsage() const {
+  return memoryAllocated;
+}
+
+double DeviceManager::getPeakMemoryUsage() const {
+  return peakMemoryAllocated;
+}
+
+void DeviceManager::recordAllocation(const void *ptr,
+                                     const double &memoryBytes) {
+#pragma omp critical(deviceManagerAllocations)
+  {
+    allocations[ptr] = std::make_pair(memoryComponent, memoryBytes);
+    memoryAllocated += memoryBytes;
+    peakMemoryAllocated = std::max(peakMemoryAllocated, memoryAllocated);
+    double &m = componentMemory[memoryComponent];
+    m += memoryBytes;
+    double &peak = componentPeakMemory[memoryComponent];
+    peak = std::max(peak, m);
+  }
+}
+
+void DeviceManager::recordDeallocation(const void *ptr) {
+#pragma omp critical(deviceManagerAllocations)
+  {
+    // allocations done before the hooks were set are not tracked
+    auto it = allocations.find(ptr);
+    if (it != allocations.end()) {
+      memoryAllocated -= it->second.second;
+      componentMemory[it->second.first] -= it->second.second;
+      allocations.erase(it);
+    }
+  }
+}
+
+std::string DeviceManager::setMemoryComponent(const std::string &component) {
+  std::string previous = memoryComponent;
+  memoryComponent = component;
+  return previous;
+}
+
+void DeviceManager::printMemoryReport() {
+  if (!memoryMeasured) {
+    return;
+  }
+  double maxPeak = peakMemoryAllocated;
+  mpi->allReduceMax(&maxPeak);
+  if (!mpi->mpiHead()) {
+    return;
+  }
+  printf("Peak device memory allocated by Kokkos: %.3g GB "
+         "(largest over MPI processes).\n", maxPeak / 1.0e9);
+  if (!componentPeakMemory.empty()) {
+    printf("Peak device memory per component (MPI head process):\n");
+    for (auto const &c : componentPeakMemory) {
+      printf("  %-20s %.3g GB\n", c.first.c_str(), c.second / 1.0e9);
+    }
+  }
+  printf("\n");
+}
+
+DeviceMemoryScope::DeviceMemoryScope(const std::string &component) {
+  if (kokkosDeviceMemory != nullptr) {
+    previousComponent = kokkosDeviceMemory->setMemoryComponent(component);
+  }
+}
+
+DeviceMemoryScope::~DeviceMemoryScope() {
+  if (kokkosDeviceMemory != nullptr) {
+    kokkosDeviceMemory->setMemoryComponent(previousComponent);
+  }
+}
+
 std::vector<std::vector<int>> DeviceManager::splitToBatches(
     const std::vector<int>& iterator, int& batchSize) {
 
@@ -179,13 +593,216 @@ std::vector<std::vector<int>> DeviceManager::splitToBatches(
   return result;
 }
 
+int DeviceManager::chooseEigensolver(const int& matrixSize,
+                                     const int& numMatrices,
+                                     const bool& withEigenvectors) {
+  if (eigensolverBackend != eigensolverAuto) {
+    return eigensolverBackend;
+  }
+  std::map<int, double> &timings =
+      eigensolverTimings[std::make_pair(matrixSize, withEigenvectors)];
+  // small batches use the timings collected so far, or the default backend
+  if (numMatrices >= minMatricesForTiming) {
+    for (int backend : availableEigensolvers) {
+      if (timings.count(backend) == 0) {
+        return backend;
+      }
+    }
+  }
+  int bestBackend = availableEigensolvers[0];
+  double bestTime = -1.;
+  for (auto const &t : timings) {
+    if (bestTime < 0. || t.second < bestTime) {
+      bestBackend = t.first;
+      bestTime = t.second;
+    }
+  }
+  return bestBackend;
+}
+
+void DeviceManager::recordEigensolverTiming(const int& matrixSize,
+                                           const int& numMatrices,
+                                           const bool& withEigenvectors,
+                                           const int& backend,
+                                           const double& time) {
+  if (eigensolverBackend != eigensolverAuto ||
+      numMatrices < minMatricesForTiming) {
+    return;
+  }
+  std::map<int, double> &timings =
+      eigensolverTimings[std::make_pair(matrixSize, withEigenvectors)];
+  if (timings.count(backend) == 0) {
+    timings[backend] = time / numMatrices;
+  }
+}
+
+BatchMemoryTuner::BatchMemoryTuner(const int &numWarmupCalls_)
+    : numWarmupCalls(numWarmupCalls_) {}
+
+double BatchMemoryTuner::getMemoryPerPoint(const double &maxMemory) const {
+  if (numCalls < numWarmupCalls || maxObservedFraction <= 0.) {
+    return maxMemory;
+  }
+  return std::min(maxMemory, safetyFactor * maxObservedFraction * maxMemory);
+}
+
+void BatchMemoryTuner::recordMemoryPerPoint(const double &memory,
+                                            const double &maxMemory) {
+  if (maxMemory <= 0.) {
+    return;
+  }
+  double fraction = memory / maxMemory;
+  if (numCalls >= numWarmupCalls && fraction > maxObservedFraction) {
+    // the estimate was too optimistic, use the upper bound for a while
+    numCalls = 0;
+  }
+  maxObservedFraction = std::max(maxObservedFraction, fraction);
+  numCalls++;
+}
+
+ScratchArena::~ScratchArena() { release(); }
+
+void ScratchArena::resizeBuffer(const int &slot, const size_t &numBytes) {
+  if (slot >= int(buffers.size())) {
+    buffers.resize(slot + 1);
+  }
+  auto newBytes = size_t(growthFactor * double(numBytes));
+  double oldBytes = double(buffers[slot].extent(0));
+  // free the old buffer first, so that the two don't coexist on the device
+  buffers[slot] = Kokkos::View<char *>();
+  buffers[slot] = Kokkos::View<char *>(
+      Kokkos::ViewAllocateWithoutInitializing("scratchArena"), newBytes);
+  memory += double(newBytes) - oldBytes;
+  if (kokkosDeviceMemory != nullptr) {
+    kokkosDeviceMemory->removeDeviceMemoryUsage(oldBytes);
+    kokkosDeviceMemory->addDeviceMemoryUsage(double(newBytes));
+  }
+}
+
+void ScratchArena::release() {
+  buffers.clear();
+  if (kokkosDeviceMemory != nullptr) {
+    kokkosDeviceMemory->removeDeviceMemoryUsage(memory);
+  }
+  memory = 0.;
+}
+
+void HostStagingArena::resizeBuffer(const int &slot, const size_t &numBytes) {
+  if (slot >= int(buffers.size())) {
+    buffers.resize(slot + 1);
+  }
+  auto newBytes = size_t(growthFactor * double(numBytes));
+  buffers[slot] = Kokkos::View<char *, PinnedHostSpace>();
+  buffers[slot] = Kokkos::View<char *, PinnedHostSpace>(
+      Kokkos::ViewAllocateWithoutInitializing("hostStagingArena"), newBytes);
+}
+
+void heterogeneousBatches(
+    const int &numPoints, const int &deviceBatchSize,
+    const std::function<void(const int &, const int &)> &deviceWork,
+    const std::function<void(const int &, const int &)> &hostWork) {
+
+  int batchSize = std::max(1, deviceBatchSize);
+  int numThreads = omp_get_max_threads();
+
+  bool useHost = false;
+#if defined(KOKKOS_ENABLE_CUDA) || defined(KOKKOS_ENABLE_HIP)
+  // if everything fits in one device batch, there's nothing to share
+  useHost = numThreads > 1 && numPoints > batchSize;
+#endif
+
+  if (!useHost) {
+    for (int start = 0; start < numPoints; start += batchSize) {
+      deviceWork(start, std::min(start + batchSize, numPoints));
+    }
+    return;
+  }
+
+  int nextPoint = 0;
+  // throughputs, in points per second, of the last batch on each side
+  double deviceRate = 0.;
+  double hostRate = 0.;
+
+  // the host thread opens a nested parallel region for its batches
+  int maxActiveLevels = omp_get_max_active_levels();
+  omp_set_max_active_levels(std::max(2, maxActiveLevels));
+
+#pragma omp parallel num_threads(2)
+  {
+    // the master thread drives the device, where Kokkos was initialized,
+    // and leaves the other cores to the host batches
+    bool onDevice = omp_get_thread_num() == 0;
+    if (onDevice) {
+      omp_set_num_threads(1);
+    } else {
+      omp_set_num_threads(std::max(1, numThreads - 1));
+    }
+
+    while (true) {
+      int start, end;
+#pragma omp critical(heterogeneousBatches)
+      {
+        start = nextPoint;
+        int size = batchSize;
+        if (!onDevice) {
+          if (hostRate <= 0. || deviceRate <= 0.) {
+            // one point per thread, until we have measured the throughput
+            size = numThreads - 1;
+          } else {
+            // as many points as the host computes during a device batch,
+            // but no more than its share of the remaining points
+            size = int(batchSize * hostRate / deviceRate);
+            size = std::min(size, int((numPoints - start) * hostRate /
+                                      (hostRate + deviceRate)));
+            size = std::min(size, batchSize);
+          }
+        }
+        end = std::min(numPoints, start + std::max(0, size));
+        nextPoint = end;
+      }
+      if (end <= start) {
+        break;
+      }
+
+      auto startTime = std::chrono::steady_clock::now();
+      if (onDevice) {
+        deviceWork(start, end);
+      } else {
+        hostWork(start, end);
+      }
+      std::chrono::duration<double> time =
+          std::chrono::steady_clock::now() - startTime;
+
+#pragma omp critical(heterogeneousBatches)
+      {
+        double rate = (end - start) / std::max(time.count(), 1.0e-9);
+        if (onDevice) {
+          deviceRate = rate;
+        } else {
+          hostRate = rate;
+        }
+      }
+    }
+  }
+
+  omp_set_max_active_levels(maxActiveLevels);
+}
+
 void initKokkos(int argc, char *argv[]) {
   Kokkos::initialize(argc, argv);
   kokkosDeviceMemory = new DeviceManager();
+  Profiler::start();
 }
 
 void deleteKokkos() {
+  Profiler::stop();
+  kokkosDeviceMemory->printMemoryReport();
+  if (kokkosDeviceMemory->isMemoryMeasured()) {
+    Kokkos::Tools::Experimental::set_allocate_data_callback(nullptr);
+    Kokkos::Tools::Experimental::set_deallocate_data_callback(nullptr);
+  }
   delete kokkosDeviceMemory;
+  kokkosDeviceMemory = nullptr;
   Kokkos::finalize();
 }
 
@@ -195,5 +812,9 @@ void kokkosInfo() {
            "GB,\nset the MAXMEM environment variable to the preferred memory "
            "usage in GB.\n",
            kokkosDeviceMemory->getAvailableMemory() / 1.0e9);
+    if (kokkosDeviceMemory->isMemoryMeasured()) {
+      printf("The device memory used is measured by tracking the Kokkos "
+             "allocations.\n");
+    }
   }
 }
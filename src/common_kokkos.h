@@ -2,6 +2,14 @@
 #define COMMON_KOKKOS_H
 
 #include <Kokkos_Core.hpp>
+#include <Kokkos_Graph.hpp>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <utility>
+#include <optional>
+#include <string>
+#include <vector>
 
 /** Define some useful classes for Kokkos-related calculations.
  */
@@ -19,6 +27,7 @@ using DoubleView2D = Kokkos::View<double **, Kokkos::LayoutRight>;
 using DoubleView3D = Kokkos::View<double ***, Kokkos::LayoutRight>;
 using DoubleView4D = Kokkos::View<double ****, Kokkos::LayoutRight>;
 using DoubleView5D = Kokkos::View<double *****, Kokkos::LayoutRight>;
+using ComplexFloatView4D = Kokkos::View<Kokkos::complex<float> ****, Kokkos::LayoutRight>;
 using StridedComplexView3D = Kokkos::View<Kokkos::complex<double> ***, Kokkos::LayoutStride>;
 
 using HostComplexView1D = Kokkos::View<Kokkos::complex<double> *, Kokkos::LayoutRight, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>>;
@@ -39,14 +48,39 @@ using Range4D = Kokkos::MDRangePolicy<Kokkos::Rank<4, Kokkos::Iterate::Right, Ko
 using Range5D = Kokkos::MDRangePolicy<Kokkos::Rank<5, Kokkos::Iterate::Right, Kokkos::Iterate::Right>>;
 using Range6D = Kokkos::MDRangePolicy<Kokkos::Rank<6, Kokkos::Iterate::Right, Kokkos::Iterate::Right>>;
 
+// Libraries used by kokkosZHEEV for the batched diagonalizations.
+// eigensolverAuto times the backends available in the build on the first
+// calls for each matrix size, and then uses the fastest one.
+// eigensolverEigen and eigensolverLapack run on the host, with OpenMP threads
+// over the batch. eigensolverSyevj (cusolverDnZheevjBatched) and
+// eigensolverSyevd (cusolverDnZheevd, one matrix at a time) need CUDA.
+// eigensolverRocsolver (rocsolver_zheevd_strided_batched) needs HIP.
+const int eigensolverAuto = 0;
+const int eigensolverEigen = 1;
+const int eigensolverLapack = 2;
+const int eigensolverSyevj = 3;
+const int eigensolverSyevd = 4;
+const int eigensolverRocsolver = 5;
+
+// Memory layouts of the 3-phonon force constants on the device (see
+// Interaction3Ph). d3LayoutAuto times the two layouts on the first Fourier
+// transform of D3, and then uses the fastest one.
+const int d3LayoutAuto = 0;
+const int d3LayoutRight = 1;
+const int d3LayoutLeft = 2;
+
 /** This function does a batched diagonalization of M matrices A.
- * Each kernel works on a single matrix A
+ * Each kernel works on a single matrix A. The library used for the
+ * diagonalization is chosen by DeviceManager::chooseEigensolver().
  *
  * @param A. On entry, a MxNxN tensor, identifying M hermitian matrices of size
  * NxN. matrix. On exit, A contains the eigenvectors of all the M matrices.
  * @param W: a MxN tensor, containing the N eigenvalues of each M-th matrix A.
+ * @param withEigenvectors: if false, only the eigenvalues are computed
+ * (jobz='N'), which is several times faster, and A is destroyed on exit.
  */
-void kokkosZHEEV(StridedComplexView3D& A, DoubleView2D& W);
+void kokkosZHEEV(StridedComplexView3D& A, DoubleView2D& W,
+                 const bool& withEigenvectors = true);
 
 class DeviceManager {
  public:
@@ -64,13 +98,66 @@ class DeviceManager {
   void removeDeviceMemoryUsage(const double& memoryBytes);
 
   /** Get how much memory is left on the kokkos device.
+   * This is the memory limit (MAXMEM) minus the memory used on the device.
+   * The memory used is measured by tracking the allocations of Kokkos
+   * Views, if possible (see isMemoryMeasured()), or else is the memory
+   * registered with addDeviceMemoryUsage(). On GPUs, it's also capped by a
+   * fraction of the free memory reported by the device, which accounts for
+   * the memory held by other processes (e.g. other MPI ranks sharing the
+   * GPU) and by libraries.
    *
    * @return memory left in bytes.
    */
   double getAvailableMemory();
 
+  /** Returns true if the device memory used is measured, i.e. the Kokkos
+   * allocations are tracked with the Kokkos profiling hooks. This is not the
+   * case if an external Kokkos tool (KOKKOS_TOOLS_LIBS) has been loaded, in
+   * which case the memory estimates of addDeviceMemoryUsage() are used.
+   */
+  bool isMemoryMeasured() const;
+
+  /** Returns the memory currently allocated by Kokkos Views on the device,
+   * in bytes, as measured by the profiling hooks.
+   */
+  double getMeasuredMemoryUsage() const;
+
+  /** Returns the peak memory allocated by Kokkos Views on the device, in
+   * bytes, as measured by the profiling hooks.
+   */
+  double getPeakMemoryUsage() const;
+
+  /** Records an allocation of memory on the device.
+   * Called by the Kokkos profiling hooks, not meant to be used elsewhere.
+   *
+   * @param ptr: the address of the allocation.
+   * @param memoryBytes: the size of the allocation in bytes.
+   */
+  void recordAllocation(const void *ptr, const double &memoryBytes);
+
+  /** Records that an allocation of memory on the device has been freed.
+   * Called by the Kokkos profiling hooks, not meant to be used elsewhere.
+   *
+   * @param ptr: the address of the allocation.
+   */
+  void recordDeallocation(const void *ptr);
+
+  /** Sets the name of the component to which the following allocations are
+   * attributed in the memory report. Use DeviceMemoryScope to set it.
+   *
+   * @param component: name of the component, e.g. the class name.
+   * @return the name of the component that was previously set.
+   */
+  std::string setMemoryComponent(const std::string &component);
+
+  /** Prints the peak memory measured on the device, in total and for each
+   * component. Must be called by all MPI processes.
+   */
+  void printMemoryReport();
+
   /** Returns the total memory present on the kokkos device.
    * This value is set by the user with the MAXMEM environment variable.
+   * If not set, on GPUs it's the memory of the device, and 16 GB otherwise.
    *
    * @return device memory in bytes.
    */
@@ -91,11 +178,429 @@ class DeviceManager {
   std::vector<std::vector<int>> splitToBatches(
       const std::vector<int>& ikIterator, int& batchSize);
 
+  /** Returns the backend to be used by kokkosZHEEV for a batch of matrices.
+   * The backend is set by the user with the EIGENSOLVER environment variable
+   * (auto, eigen, lapack, syevj or syevd). With auto (the default), the
+   * first calls for each matrix size try, in turn, all the backends
+   * available in this build, and the following calls use the fastest one.
+   *
+   * @param matrixSize: the size N of the NxN matrices.
+   * @param numMatrices: the number of matrices in the batch.
+   * @param withEigenvectors: whether the eigenvectors are computed, which
+   * are timed separately from the eigenvalues-only diagonalizations.
+   * @return backend: one of eigensolverEigen, eigensolverLapack,
+   * eigensolverSyevj, eigensolverSyevd or eigensolverRocsolver.
+   */
+  int chooseEigensolver(const int& matrixSize, const int& numMatrices,
+                        const bool& withEigenvectors);
+
+  /** Records the time taken by a backend of kokkosZHEEV, used by
+   * chooseEigensolver() to pick the fastest one.
+   *
+   * @param matrixSize: the size N of the NxN matrices.
+   * @param numMatrices: the number of matrices in the batch.
+   * @param withEigenvectors: whether the eigenvectors were computed.
+   * @param backend: the backend that has been used.
+   * @param time: the time in seconds taken by the diagonalization.
+   */
+  void recordEigensolverTiming(const int& matrixSize, const int& numMatrices,
+                               const bool& withEigenvectors,
+                               const int& backend, const double& time);
+
+  /** Returns true if the repeated sequences of kernels of the batched
+   * coupling calculations are recorded as graphs and replayed (see
+   * KernelGraphCache). Set by the user with the DEVICEGRAPHS environment
+   * variable (off by default).
+   */
+  bool useKernelGraphs() const;
+
+  /** Returns true if the band structures used by the scattering matrix
+   * builders are copied once on the device, so that the batches only
+   * transfer the indices of the states (see BandStructureDeviceMirror).
+   * Set by the user with the DEVICEBANDSTRUCTURE environment variable (off
+   * by default).
+   */
+  bool useDeviceBandStructure() const;
+
+  /** Returns the memory layout of the 3-phonon force constants requested
+   * with the D3LAYOUT environment variable: one of d3LayoutAuto (default),
+   * d3LayoutRight or d3LayoutLeft.
+   */
+  int getD3Layout() const;
+
  private:
+  bool kernelGraphs = false;
+  bool deviceBandStructure = false;
+  int d3Layout = d3LayoutAuto;
+  // backend requested with the EIGENSOLVER environment variable
+  int eigensolverBackend = eigensolverAuto;
+  // backends that can be timed by the autotuning, in order of preference
+  std::vector<int> availableEigensolvers;
+  // for each matrix size, and with or without eigenvectors, the time per
+  // matrix of each tested backend
+  std::map<std::pair<int, bool>, std::map<int, double>> eigensolverTimings;
+  // batches smaller than this aren't used for the autotuning, since their
+  // timings are dominated by the overheads
+  const int minMatricesForTiming = 32;
   double memoryUsed = 0.;
   double memoryTotal = 0.;
+  // fraction of the free device memory that we allow to be used, leaving
+  // some room for fragmentation and for the workspace of libraries
+  double freeMemoryFraction = 0.9;
+
+  // allocations measured with the Kokkos profiling hooks
+  bool memoryMeasured = false;
+  double memoryAllocated = 0.;
+  double peakMemoryAllocated = 0.;
+  std::string memoryComponent = "other";
+  // address of each live allocation -> (component, size in bytes)
+  std::map<const void *, std::pair<std::string, double>> allocations;
+  // memory currently allocated, and its peak, for each component
+  std::map<std::string, double> componentMemory;
+  std::map<std::string, double> componentPeakMemory;
+};
+
+/** Attributes the device memory allocated during the lifetime of this object
+ * to a component (e.g. a class), for the report of
+ * DeviceManager::printMemoryReport(). The previous component is restored
+ * on destruction, so that scopes can be nested.
+ */
+class DeviceMemoryScope {
+ public:
+  explicit DeviceMemoryScope(const std::string &component);
+  ~DeviceMemoryScope();
+  DeviceMemoryScope(const DeviceMemoryScope &) = delete;
+  DeviceMemoryScope &operator=(const DeviceMemoryScope &) = delete;
+
+ private:
+  std::string previousComponent;
+};
+
+/** Helper for choosing the batch sizes of the coupling calculations.
+ *
+ * The memory needed by a batch of wavevectors is estimated with an upper
+ * bound, using the largest possible number of bands at each wavevector.
+ * This class records the memory actually needed in the first few calls, and
+ * afterwards scales down the upper bound (with a safety margin), so that
+ * batches are larger and the device is saturated.
+ * Since the number of bands at the fixed wavevectors changes from call to
+ * call (e.g. after the band prescreening), each observation is recorded as
+ * a fraction of the upper bound of its own call, and the largest fraction is
+ * applied to the upper bound of the current call.
+ * If a later call needs a larger fraction than observed, the tuning restarts.
+ */
+class BatchMemoryTuner {
+ public:
+  /** Constructor.
+   * @param numWarmupCalls: number of calls using the upper bound, before the
+   * estimate is tuned.
+   */
+  explicit BatchMemoryTuner(const int &numWarmupCalls = 5);
+
+  /** Returns the memory per wavevector to be used for choosing the batches.
+   * @param maxMemory: upper bound of the memory needed per wavevector.
+   */
+  double getMemoryPerPoint(const double &maxMemory) const;
+
+  /** Records the memory per wavevector needed by a batch.
+   * @param memory: memory in bytes.
+   * @param maxMemory: upper bound of the memory per wavevector, for the
+   * band counts of the same batch.
+   */
+  void recordMemoryPerPoint(const double &memory, const double &maxMemory);
+
+ private:
+  int numWarmupCalls;
+  int numCalls = 0;
+  // largest observed ratio between the memory needed and its upper bound
+  double maxObservedFraction = 0.;
+  double safetyFactor = 1.25;
 };
 
+/** Reusable device memory for the temporary views of the batched kernels.
+ *
+ * On GPU backends, allocating and freeing device memory synchronizes the
+ * device, so kernels called once per batch borrow their temporary views from
+ * persistent buffers instead of allocating fresh views. Each buffer is
+ * identified by a slot number, and grows to the largest view requested so
+ * far. Views borrowed from the same slot alias each other, so a kernel must
+ * use different slots for views that are alive at the same time. The memory
+ * of the buffers is registered with the DeviceManager.
+ */
+class ScratchArena {
+ public:
+  ScratchArena() = default;
+  ScratchArena(const ScratchArena &) = delete;
+  ScratchArena &operator=(const ScratchArena &) = delete;
+  ~ScratchArena();
+
+  /** Returns an (unmanaged) view of the given dimensions, on the buffer of
+   * a slot. The content of the view is not initialized.
+   * @param slot: the index of the buffer.
+   * @param sizes: the extents of the view.
+   */
+  template <typename ViewType, typename... Sizes>
+  ViewType borrow(const int &slot, const Sizes &...sizes);
+
+  /** Returns the device memory held by the buffers, in bytes.
+   */
+  double getMemory() const { return memory; }
+
+  /** Frees all the buffers.
+   */
+  void release();
+
+ private:
+  std::vector<Kokkos::View<char *>> buffers;
+  double memory = 0.;
+  // buffers are allocated a bit larger than requested, so that slightly
+  // larger batches don't trigger a new allocation
+  const double growthFactor = 1.25;
+
+  void resizeBuffer(const int &slot, const size_t &numBytes);
+};
+
+template <typename ViewType, typename... Sizes>
+ViewType ScratchArena::borrow(const int &slot, const Sizes &...sizes) {
+  size_t numBytes = ViewType::required_allocation_size(size_t(sizes)...);
+  if (slot >= int(buffers.size()) || buffers[slot].extent(0) < numBytes) {
+    resizeBuffer(slot, numBytes);
+  }
+  using Pointer = typename ViewType::pointer_type;
+  return ViewType(reinterpret_cast<Pointer>(buffers[slot].data()), sizes...);
+}
+
+// Host memory that the device can access directly. Copies between the device
+// and pinned memory are faster than with pageable memory, and don't need to
+// be staged by the driver, so that they can be asynchronous.
+#ifdef KOKKOS_HAS_SHARED_HOST_PINNED_SPACE
+using PinnedHostSpace = Kokkos::SharedHostPinnedSpace;
+#elif defined(KOKKOS_ENABLE_CUDA)
+using PinnedHostSpace = Kokkos::CudaHostPinnedSpace;
+#else
+using PinnedHostSpace = Kokkos::HostSpace;
+#endif
+
+/** Type of the host views returned by HostStagingArena::mirror(), with the
+ * same data type and layout as the device view ViewType.
+ */
+template <typename ViewType>
+using StagingView = Kokkos::View<typename ViewType::non_const_data_type,
+                                 typename ViewType::array_layout,
+                                 PinnedHostSpace,
+                                 Kokkos::MemoryTraits<Kokkos::Unmanaged>>;
+
+/** Reusable pinned host memory for the transfers of the batched kernels.
+ *
+ * The host mirrors of the views copied to and from the device at each batch
+ * are borrowed from persistent buffers of pinned memory, rather than being
+ * allocated (in pageable memory) by Kokkos::create_mirror_view at every
+ * batch. As in ScratchArena, each buffer is identified by a slot number and
+ * grows to the largest view requested so far, and mirrors alive at the same
+ * time must use different slots. In builds without a GPU backend, the
+ * device view is accessible from the host, and is returned as its own mirror.
+ * A copy of the arena starts without buffers.
+ */
+class HostStagingArena {
+ public:
+  HostStagingArena() = default;
+  HostStagingArena(const HostStagingArena &) {}
+  HostStagingArena &operator=(const HostStagingArena &) { return *this; }
+
+  /** Returns a host view with the same shape as the device view, on the
+   * buffer of a slot. The content of the view is not initialized.
+   * @param slot: the index of the buffer.
+   * @param view: the device view to be mirrored.
+   */
+  template <typename ViewType>
+  StagingView<ViewType> mirror(const int &slot, const ViewType &view);
+
+ private:
+  std::vector<Kokkos::View<char *, PinnedHostSpace>> buffers;
+  const double growthFactor = 1.25;
+
+  void resizeBuffer(const int &slot, const size_t &numBytes);
+};
+
+template <typename ViewType>
+StagingView<ViewType> HostStagingArena::mirror(const int &slot,
+                                               const ViewType &view) {
+  using Pointer = typename StagingView<ViewType>::pointer_type;
+  if (Kokkos::SpaceAccessibility<
+          Kokkos::HostSpace, typename ViewType::memory_space>::accessible) {
+    return StagingView<ViewType>(const_cast<Pointer>(view.data()),
+                                 view.layout());
+  }
+  size_t numBytes = view.span() * sizeof(typename ViewType::value_type);
+  if (slot >= int(buffers.size()) || buffers[slot].extent(0) < numBytes) {
+    resizeBuffer(slot, numBytes);
+  }
+  return StagingView<ViewType>(reinterpret_cast<Pointer>(buffers[slot].data()),
+                               view.layout());
+}
+
+/** Records a sequence of kernels as a Kokkos graph, and replays it.
+ *
+ * Each batch of the coupling calculations launches the same sequence of
+ * small kernels. On GPUs, the launch latency of each kernel is significant
+ * for small unit cells, while a graph is launched at once. A graph keeps the
+ * views captured when it was recorded: the key must identify the shapes and
+ * the memory (data pointers) of all the views used by the kernels. The graph
+ * is replayed when the key is the same as in the previous call, and is
+ * recorded again otherwise. The views are stable across the batches when
+ * they are borrowed from a ScratchArena, whose buffers only change when they
+ * have to grow.
+ */
+class KernelGraphCache {
+ public:
+  /** Runs the sequence of kernels.
+   * @param key: identifies the shapes and the memory of the views.
+   * @param record: a callable taking the root node of a Kokkos graph, and
+   * adding the kernels to it (with then_parallel_for). Only called when the
+   * graph is recorded.
+   */
+  template <typename Closure>
+  void run(const std::vector<std::uintptr_t> &key, Closure &&record);
+
+  /** Helper for the keys: returns the data pointer and the extents of a
+   * view.
+   */
+  template <typename ViewType>
+  static std::vector<std::uintptr_t> viewKey(const ViewType &view);
+
+ private:
+  std::vector<std::uintptr_t> recordedKey;
+  std::optional<Kokkos::Experimental::Graph<Kokkos::DefaultExecutionSpace>>
+      graph;
+};
+
+template <typename Closure>
+void KernelGraphCache::run(const std::vector<std::uintptr_t> &key,
+                           Closure &&record) {
+  if (!graph.has_value() || key != recordedKey) {
+    graph.reset();
+    graph.emplace(Kokkos::Experimental::create_graph(
+        Kokkos::DefaultExecutionSpace(), std::forward<Closure>(record)));
+    recordedKey = key;
+  }
+  graph->submit();
+}
+
+template <typename ViewType>
+std::vector<std::uintptr_t> KernelGraphCache::viewKey(const ViewType &view) {
+  std::vector<std::uintptr_t> key;
+  key.push_back(reinterpret_cast<std::uintptr_t>(view.data()));
+  for (size_t i = 0; i < ViewType::rank; i++) {
+    key.push_back(view.extent(i));
+  }
+  return key;
+}
+
+/** Runs a loop over numPoints wavevectors in batches, splitting the work
+ * between the device and the host threads.
+ * In builds with a GPU backend, one OpenMP thread drives the device, taking
+ * batches of deviceBatchSize points, while the other threads work at the same
+ * time on host batches. The size of the host batches is adapted to the
+ * measured throughput of the two sides, so that a host batch takes about as
+ * long as a device batch, and the host stops taking points when the device
+ * would finish them first. In host-only builds (or with a single thread),
+ * only deviceWork is used, as a plain loop over batches.
+ *
+ * @param numPoints: number of points in the loop.
+ * @param deviceBatchSize: number of points in each call to deviceWork,
+ * usually from estimateBatchSize().
+ * @param deviceWork: function computing the points in [start,end[ with
+ * Kokkos.
+ * @param hostWork: function computing the points in [start,end[ on the host,
+ * without using Kokkos. It may use OpenMP threads.
+ */
+void heterogeneousBatches(
+    const int &numPoints, const int &deviceBatchSize,
+    const std::function<void(const int &, const int &)> &deviceWork,
+    const std::function<void(const int &, const int &)> &hostWork);
+
+/** Fourier transform of a batch of NxN matrices, with N fixed at compile
+ * time: out(iK,m,n) = sum_R phases(iK,R) * matR(m,n,R).
+ * Each thread computes a row of one matrix, keeping the N elements in
+ * registers during the sum over R. Since the loops over n have a constant
+ * trip count, the compiler can unroll them.
+ *
+ * @param phases: a (numK,numR) view with the phases (and weights) of each
+ * lattice vector R at each wavevector.
+ * @param matR: a (N,N,numR) view with the real-space matrices.
+ * @param out: a (numK,N,N) view, on exit contains the transformed matrices.
+ */
+template<int N, class MatRVT, class OutVT>
+void kokkosFixedSizeFourierTransform(const ComplexView2D &phases,
+                                     const MatRVT &matR, const OutVT &out) {
+  int numK = phases.extent(0);
+  int numR = phases.extent(1);
+  Kokkos::parallel_for(
+      "fourier_fixed_size", Range2D({0, 0}, {numK, N}),
+      KOKKOS_LAMBDA(int iK, int m) {
+        Kokkos::complex<double> tmp[N];
+        for (int n = 0; n < N; n++) {
+          tmp[n] = Kokkos::complex<double>(0., 0.);
+        }
+        for (int iR = 0; iR < numR; iR++) {
+          Kokkos::complex<double> phase = phases(iK, iR);
+          for (int n = 0; n < N; n++) {
+            tmp[n] += phase * matR(m, n, iR);
+          }
+        }
+        for (int n = 0; n < N; n++) {
+          out(iK, m, n) = tmp[n];
+        }
+      });
+}
+
+/** Fourier transform of a batch of matrices,
+ * out(iK,m,n) = sum_R phases(iK,R) * matR(m,n,R).
+ * Matrix sizes common in production runs (3, 6, 8, 12 and 18 bands) use the
+ * kernels of kokkosFixedSizeFourierTransform, the others a generic kernel.
+ *
+ * @param phases: a (numK,numR) view with the phases (and weights) of each
+ * lattice vector R at each wavevector.
+ * @param matR: a (numBands,numBands,numR) view with the real-space matrices.
+ * @param out: a (numK,numBands,numBands) view, on exit contains the
+ * transformed matrices.
+ */
+template<class MatRVT, class OutVT>
+void kokkosBatchedFourierTransform(const ComplexView2D &phases,
+                                   const MatRVT &matR, const OutVT &out) {
+  int numBands = matR.extent(0);
+  switch (numBands) {
+    case 3:
+      kokkosFixedSizeFourierTransform<3>(phases, matR, out);
+      return;
+    case 6:
+      kokkosFixedSizeFourierTransform<6>(phases, matR, out);
+      return;
+    case 8:
+      kokkosFixedSizeFourierTransform<8>(phases, matR, out);
+      return;
+    case 12:
+      kokkosFixedSizeFourierTransform<12>(phases, matR, out);
+      return;
+    case 18:
+      kokkosFixedSizeFourierTransform<18>(phases, matR, out);
+      return;
+    default:
+      break;
+  }
+  int numK = phases.extent(0);
+  int numR = phases.extent(1);
+  Kokkos::parallel_for(
+      "fourier", Range3D({0, 0, 0}, {numK, numBands, numBands}),
+      KOKKOS_LAMBDA(int iK, int m, int n) {
+        Kokkos::complex<double> tmp(0.0);
+        for (int iR = 0; iR < numR; iR++) {
+          tmp += phases(iK, iR) * matR(m, n, iR);
+        }
+        out(iK, m, n) = tmp;
+      });
+}
+
 // define a global object used for managing the memory on the GPU
 extern DeviceManager* kokkosDeviceMemory;
 
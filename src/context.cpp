@@ -4,6 +4,7 @@
 #include <fstream>
 #include <iomanip>
 #include <iterator>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -420,13 +421,31 @@ parseParameterNameValue(const std::string &line) {
 }
 
 void Context::setupFromInput(const std::string &fileName) {
-  std::vector<std::string> lines;
+  // only the head process reads the input file, and broadcasts its content,
+  // so that the file system isn't hit by every process of the run
+  std::string content;
+  int fileFound = 1;
+  if (mpi->mpiHead()) {
+    std::ifstream infile(fileName);
+    if (infile) {
+      std::stringstream buffer;
+      buffer << infile.rdbuf();
+      content = buffer.str();
+    } else {
+      fileFound = 0;
+    }
+  }
+  mpi->bcast(&fileFound);
+  if (fileFound == 0) {
+    Error("Input file " + fileName + " not found");
+  }
+  mpi->bcast(&content);
 
-  // open input file and read content
+  std::vector<std::string> lines;
   {
-    std::ifstream infile(fileName);
+    std::istringstream input(content);
     std::string line;
-    while (std::getline(infile, line)) {
+    while (std::getline(input, line)) {
       std::vector<std::string> tokens = split(line, ';');
       for (const std::string &t : tokens) {
         lines.push_back(t);
@@ -456,6 +475,9 @@ void Context::setupFromInput(const std::string &fileName) {
       if (parameterName == "phFC3FileName") {
         phFC3FileName = parseString(val);
       }
+      if (parameterName == "phFC4FileName") {
+        phFC4FileName = parseString(val);
+      }
       if (parameterName == "phonopyDispFileName") {
         phonopyDispFileName = parseString(val);
       }
@@ -467,6 +489,12 @@ void Context::setupFromInput(const std::string &fileName) {
       if (parameterName == "sumRuleFC2") {
         sumRuleFC2 = parseString(val);
       }
+      if (parameterName == "sumRuleFC2FilePrefix") {
+        sumRuleFC2FilePrefix = parseString(val);
+      }
+      if (parameterName == "bandStructureCachePrefix") {
+        bandStructureCachePrefix = parseString(val);
+      }
       if (parameterName == "electronH0Name") {
         electronH0Name = parseString(val);
       }
@@ -539,7 +567,16 @@ void Context::setupFromInput(const std::string &fileName) {
       }
 
       if (parameterName == "appName") {
-        appName = parseString(val);
+        if (val.find('[') != std::string::npos) {
+          appNames = parseStringList(val);
+          if (appNames.empty()) {
+            Error("appName list is empty");
+          }
+          appName = appNames[0];
+        } else {
+          appName = parseString(val);
+          appNames = {appName};
+        }
       }
       if (parameterName == "solverBTE") {
         solverBTE = parseStringList(val);
@@ -574,6 +611,19 @@ void Context::setupFromInput(const std::string &fileName) {
       if (parameterName == "outputUNTimes") {
         outputUNTimes = parseBool(val);
       }
+      if (parameterName == "bandsFormat") {
+        bandsFormat = parseString(val);
+        if (bandsFormat != "json" && bandsFormat != "hdf5" &&
+            bandsFormat != "both") {
+          Error("bandsFormat must be \"json\", \"hdf5\" or \"both\"");
+        }
+#ifndef HDF5_AVAIL
+        if (bandsFormat != "json") {
+          Error("bandsFormat = \"" + bandsFormat
+                + "\" requires Phoebe built with HDF5");
+        }
+#endif
+      }
       if (parameterName == "fermiLevel") {
         fermiLevel = parseDoubleWithUnits(val);
       }
@@ -625,9 +675,125 @@ void Context::setupFromInput(const std::string &fileName) {
       if (parameterName == "checkNegativeRelaxons") {
         checkNegativeRelaxons = parseBool(val);
       }
+      if (parameterName == "relaxonsEigenSolver") {
+        relaxonsEigenSolver = parseString(val);
+        if (relaxonsEigenSolver != "direct" &&
+            relaxonsEigenSolver != "lobpcg") {
+          Error("relaxonsEigenSolver must be \"direct\" or \"lobpcg\"");
+        }
+      }
+      if (parameterName == "relaxationTimesFormat") {
+        relaxationTimesFormat = parseString(val);
+        if (relaxationTimesFormat != "json" &&
+            relaxationTimesFormat != "hdf5" &&
+            relaxationTimesFormat != "both") {
+          Error("relaxationTimesFormat must be \"json\", \"hdf5\" or "
+                "\"both\"");
+        }
+#ifndef HDF5_AVAIL
+        if (relaxationTimesFormat != "json") {
+          Error("relaxationTimesFormat = \"" + relaxationTimesFormat
+                + "\" requires Phoebe built with HDF5");
+        }
+#endif
+      }
+      if (parameterName == "spectralTransportBins") {
+        spectralTransportBins = parseInt(val);
+        if (spectralTransportBins < 0) {
+          Error("spectralTransportBins must be non-negative");
+        }
+      }
+      if (parameterName == "acFrequencies") {
+        std::vector<double> x = parseDoubleList(val);
+        acFrequencies.clear();
+        for (double f : x) {
+          if (f < 0.) {
+            Error("acFrequencies must be non-negative");
+          }
+          // from THz to inverse atomic units of time
+          acFrequencies.push_back(f * timeAuToFs * 1.0e-3);
+        }
+      }
+      if (parameterName == "warmStartBTE") {
+        warmStartBTE = parseBool(val);
+      }
+      if (parameterName == "initialPopulationFileName") {
+        initialPopulationFileName = parseString(val);
+      }
+      if (parameterName == "phElLinewidthsFileName") {
+        phElLinewidthsFileName = parseString(val);
+      }
+      if (parameterName == "outputPopulationBTE") {
+        outputPopulationBTE = parseBool(val);
+      }
+      if (parameterName == "convergenceMeshDivisors") {
+        convergenceMeshDivisors = parseIntList(val);
+        for (int d : convergenceMeshDivisors) {
+          if (d < 2) {
+            Error("convergenceMeshDivisors must be larger than 1");
+          }
+        }
+      }
+      if (parameterName == "linewidthsQMesh") {
+        std::vector<int> vecMesh = parseIntList(val);
+        if (vecMesh.size() != 3) {
+          Error("linewidthsQMesh must have 3 components");
+        }
+        linewidthsQMesh << vecMesh[0], vecMesh[1], vecMesh[2];
+      }
+      if (parameterName == "transientTimes") {
+        std::vector<double> x = parseDoubleList(val);
+        transientTimes.clear();
+        for (double t : x) {
+          if (t < 0.) {
+            Error("transientTimes must be non-negative");
+          }
+          transientTimes.push_back(t / (timeAuToFs * 1.0e-3));
+        }
+      }
+      if (parameterName == "transientPumpEnergies") {
+        std::vector<double> x = parseDoubleList(val);
+        transientPumpEnergies.clear();
+        for (double e : x) {
+          transientPumpEnergies.push_back(e / (energyRyToEv * 1000.));
+        }
+      }
+      if (parameterName == "transientPumpWidth") {
+        transientPumpWidth = parseDoubleWithUnits(val);
+        if (transientPumpWidth <= 0.) {
+          Error("transientPumpWidth must be positive");
+        }
+      }
+      if (parameterName == "scatteringMatrixOnDevice") {
+        scatteringMatrixOnDevice = parseBool(val);
+      }
+      if (parameterName == "dryRun") {
+        dryRun = parseBool(val);
+      }
+      if (parameterName == "scatteringMatrixPrecision") {
+        scatteringMatrixPrecision = parseString(val);
+        if (scatteringMatrixPrecision != "double" &&
+            scatteringMatrixPrecision != "single") {
+          Error("scatteringMatrixPrecision must be \"double\" or \"single\"");
+        }
+      }
       if (parameterName == "useSymmetries") {
         useSymmetries = parseBool(val);
       }
+      if (parameterName == "useTimeReversal") {
+        useTimeReversal = parseBool(val);
+      }
+      if (parameterName == "wavevectorOrdering") {
+        wavevectorOrdering = parseString(val);
+        if (wavevectorOrdering != "index" && wavevectorOrdering != "morton" &&
+            wavevectorOrdering != "hilbert") {
+          Error("wavevectorOrdering must be \"index\", \"morton\" or "
+                "\"hilbert\"");
+        }
+      }
+      if (parameterName == "wignerCorrection") {
+        wignerCorrection = parseBool(val);
+      }
       if (parameterName == "withIsotopeScattering") {
         withIsotopeScattering = parseBool(val);
       }
@@ -733,6 +899,110 @@ void Context::setupFromInput(const std::string &fileName) {
         std::string x = parseString(val);
         setWsVecFileName(x);
       }
+      if (parameterName == "scatteringCheckpointInterval") {
+        int x = parseInt(val);
+        setScatteringCheckpointInterval(x);
+      }
+      if (parameterName == "checkpointPrefix") {
+        std::string x = parseString(val);
+        setCheckpointPrefix(x);
+      }
+      if (parameterName == "solverCheckpointInterval") {
+        int x = parseInt(val);
+        setSolverCheckpointInterval(x);
+      }
+      if (parameterName == "numSolverGroups") {
+        int x = parseInt(val);
+        setNumSolverGroups(x);
+      }
+      if (parameterName == "progressHeartbeatInterval") {
+        double x = parseDouble(val);
+        setProgressHeartbeatInterval(x);
+      }
+      if (parameterName == "scatteringMatrixFilePrefix") {
+        std::string x = parseString(val);
+        setScatteringMatrixFilePrefix(x);
+      }
+      if (parameterName == "scatteringMatrixScratchDirectory") {
+        std::string x = parseString(val);
+        setScatteringMatrixScratchDirectory(x);
+      }
+      if (parameterName == "elPhCouplingCachePrefix") {
+        std::string x = parseString(val);
+        setElPhCouplingCachePrefix(x);
+      }
+      if (parameterName == "sparseScatteringMatrix") {
+        bool x = parseBool(val);
+        setSparseScatteringMatrix(x);
+      }
+      if (parameterName == "sparseMatrixDropTolerance") {
+        double x = parseDouble(val);
+        setSparseMatrixDropTolerance(x);
+      }
+      if (parameterName == "cachePhPhCouplings") {
+        bool x = parseBool(val);
+        setCachePhPhCouplings(x);
+      }
+      if (parameterName == "calculationsChunkMemory") {
+        double x = parseDouble(val);
+        setCalculationsChunkMemory(x);
+      }
+      if (parameterName == "eigenvectorsSinglePrecision") {
+        bool x = parseBool(val);
+        setEigenvectorsSinglePrecision(x);
+      }
+      if (parameterName == "partnerSamplingFraction") {
+        double x = parseDouble(val);
+        setPartnerSamplingFraction(x);
+      }
+      if (parameterName == "partnerSamplingSeed") {
+        int x = parseInt(val);
+        setPartnerSamplingSeed(x);
+      }
+      if (parameterName == "pipelinePhPhBuilder") {
+        bool x = parseBool(val);
+        setPipelinePhPhBuilder(x);
+      }
+      if (parameterName == "elPhK1CacheMemory") {
+        double x = parseDouble(val);
+        setElPhK1CacheMemory(x);
+      }
+      if (parameterName == "useElPhLittleGroup") {
+        bool x = parseBool(val);
+        setUseElPhLittleGroup(x);
+      }
+      if (parameterName == "useKramersPairs") {
+        bool x = parseBool(val);
+        setUseKramersPairs(x);
+      }
+      if (parameterName == "elPhTruncationThreshold") {
+        double x = parseDouble(val);
+        setElPhTruncationThreshold(x);
+      }
+      if (parameterName == "elPhSinglePrecision") {
+        bool x = parseBool(val);
+        setElPhSinglePrecision(x);
+      }
+      if (parameterName == "elPhMemoryMap") {
+        bool x = parseBool(val);
+        setElPhMemoryMap(x);
+      }
+      if (parameterName == "coupledPhElLinewidths") {
+        bool x = parseBool(val);
+        setCoupledPhElLinewidths(x);
+      }
+      if (parameterName == "lifetimesChunkSize") {
+        int x = parseInt(val);
+        setLifetimesChunkSize(x);
+      }
+      if (parameterName == "fc3PruningThreshold") {
+        double x = parseDouble(val);
+        setFc3PruningThreshold(x);
+      }
+      if (parameterName == "fc3DistanceCutoff") {
+        double x = parseDoubleWithUnits(val);
+        setFc3DistanceCutoff(x);
+      }
 
       // Polarization
       if (parameterName == "numCoreElectrons") {
@@ -772,10 +1042,11 @@ void Context::setupFromInput(const std::string &fileName) {
 void Context::inputSanityCheck() {
 
   // disallow symmetries when relaxons are used
+  // (the variational solver works in the irreducible representation)
   for (const std::string &s : solverBTE) {
-    if (s.compare("variational") == 0 || s.compare("relaxons") == 0) {
+    if (s.compare("relaxons") == 0) {
       if(useSymmetries) { 
-        Error("Variational and relaxons solvers cannot be used with symmetries!");
+        Error("The relaxons solver cannot be used with symmetries!");
       }
     }
     
@@ -831,16 +1102,42 @@ void Context::printInputSummary(const std::string &fileName) {
 
   // crystal structure parameters -------------------
   std::cout << "useSymmetries = " << useSymmetries << std::endl;
+  if (useTimeReversal) {
+    std::cout << "useTimeReversal = " << useTimeReversal << std::endl;
+  }
+  if (wavevectorOrdering != "index") {
+    std::cout << "wavevectorOrdering = " << wavevectorOrdering << std::endl;
+  }
   std::cout << "dimensionality = " << dimensionality << std::endl;
   if(dimensionality != 3) std::cout << "thickness = " << thickness * distanceBohrToAng << " ang" << std::endl;
+  if (!bandStructureCachePrefix.empty()) {
+    std::cout << "bandStructureCachePrefix = " << bandStructureCachePrefix
+              << std::endl;
+  }
   std::cout << std::endl;
 
   // phonon parameters -------------------------------
   if (appName.find("honon") != std::string::npos) {
     std::cout << "phFC2FileName = " << phFC2FileName << std::endl;
     std::cout << "sumRuleFC2 = " << sumRuleFC2 << std::endl;
+    if (!sumRuleFC2FilePrefix.empty()) {
+      std::cout << "sumRuleFC2FilePrefix = " << sumRuleFC2FilePrefix
+                << std::endl;
+    }
     if (appName == "phononLifetimes" || appName == "phononTransport") {
       std::cout << "phFC3FileName = " << phFC3FileName << std::endl;
+      if (fc3PruningThreshold > 0.) {
+        std::cout << "fc3PruningThreshold = " << fc3PruningThreshold
+                  << std::endl;
+      }
+      if (fc3DistanceCutoff > 0.) {
+        std::cout << "fc3DistanceCutoff = "
+                  << fc3DistanceCutoff * distanceBohrToAng << " ang"
+                  << std::endl;
+      }
+      if (!phFC4FileName.empty()) {
+        std::cout << "phFC4FileName = " << phFC4FileName << std::endl;
+      }
     }
     if (!phonopyDispFileName.empty()) {
       std::cout << "phonopyDispFileName = " << phonopyDispFileName << std::endl;
@@ -985,12 +1282,176 @@ void Context::printInputSummary(const std::string &fileName) {
       std::cout << std::endl;
       std::cout << "convergenceThresholdBTE = " << convergenceThresholdBTE << std::endl;
       std::cout << "maxIterationsBTE = " << maxIterationsBTE << std::endl;
+      if (appName == "phononTransport" ||
+          appName == "electronWannierTransport") {
+        std::cout << "wignerCorrection = " << wignerCorrection << std::endl;
+      }
     } else {
       std::cout << "solverBTE = RTA";
     }
 
       std::cout << "scatteringMatrixInMemory = " << scatteringMatrixInMemory
               << std::endl;
+      if (scatteringCheckpointInterval > 0) {
+        std::cout << "scatteringCheckpointInterval = "
+                  << scatteringCheckpointInterval << std::endl;
+      }
+      if (solverCheckpointInterval > 0) {
+        std::cout << "solverCheckpointInterval = " << solverCheckpointInterval
+                  << std::endl;
+      }
+      if (scatteringCheckpointInterval > 0 || solverCheckpointInterval > 0) {
+        std::cout << "checkpointPrefix = " << checkpointPrefix << std::endl;
+      }
+      if (numSolverGroups > 1) {
+        std::cout << "numSolverGroups = " << numSolverGroups << std::endl;
+      }
+      if (progressHeartbeatInterval > 0.) {
+        std::cout << "progressHeartbeatInterval = " << progressHeartbeatInterval
+                  << std::endl;
+      }
+      if (!scatteringMatrixFilePrefix.empty()) {
+        std::cout << "scatteringMatrixFilePrefix = "
+                  << scatteringMatrixFilePrefix << std::endl;
+      }
+      if (!scatteringMatrixScratchDirectory.empty()) {
+        std::cout << "scatteringMatrixScratchDirectory = "
+                  << scatteringMatrixScratchDirectory << std::endl;
+      }
+      if (!elPhCouplingCachePrefix.empty()) {
+        std::cout << "elPhCouplingCachePrefix = " << elPhCouplingCachePrefix
+                  << std::endl;
+      }
+      if (scatteringMatrixInMemory && sparseScatteringMatrix) {
+        std::cout << "sparseScatteringMatrix = " << sparseScatteringMatrix
+                  << std::endl;
+        std::cout << "sparseMatrixDropTolerance = "
+                  << sparseMatrixDropTolerance << std::endl;
+      }
+      if (cachePhPhCouplings) {
+        std::cout << "cachePhPhCouplings = " << cachePhPhCouplings
+                  << std::endl;
+      }
+      if (calculationsChunkMemory > 0.) {
+        std::cout << "calculationsChunkMemory = " << calculationsChunkMemory
+                  << std::endl;
+      }
+      if (eigenvectorsSinglePrecision) {
+        std::cout << "eigenvectorsSinglePrecision = "
+                  << eigenvectorsSinglePrecision << std::endl;
+      }
+      if (partnerSamplingFraction < 1.) {
+        std::cout << "partnerSamplingFraction = " << partnerSamplingFraction
+                  << std::endl;
+        std::cout << "partnerSamplingSeed = " << partnerSamplingSeed
+                  << std::endl;
+      }
+      if (pipelinePhPhBuilder) {
+        std::cout << "pipelinePhPhBuilder = " << pipelinePhPhBuilder
+                  << std::endl;
+      }
+      if (elPhK1CacheMemory > 0.) {
+        std::cout << "elPhK1CacheMemory = " << elPhK1CacheMemory << " GB"
+                  << std::endl;
+      }
+      if (useElPhLittleGroup) {
+        std::cout << "useElPhLittleGroup = " << useElPhLittleGroup
+                  << std::endl;
+      }
+      if (useKramersPairs) {
+        std::cout << "useKramersPairs = " << useKramersPairs << std::endl;
+      }
+      if (elPhTruncationThreshold > 0.) {
+        std::cout << "elPhTruncationThreshold = " << elPhTruncationThreshold
+                  << std::endl;
+      }
+      if (elPhSinglePrecision) {
+        std::cout << "elPhSinglePrecision = " << elPhSinglePrecision
+                  << std::endl;
+      }
+      if (elPhMemoryMap) {
+        std::cout << "elPhMemoryMap = " << elPhMemoryMap << std::endl;
+      }
+      if (coupledPhElLinewidths) {
+        std::cout << "coupledPhElLinewidths = " << coupledPhElLinewidths
+                  << std::endl;
+      }
+      if (relaxonsEigenSolver != "direct") {
+        std::cout << "relaxonsEigenSolver = " << relaxonsEigenSolver
+                  << std::endl;
+      }
+      if (relaxationTimesFormat != "json") {
+        std::cout << "relaxationTimesFormat = " << relaxationTimesFormat
+                  << std::endl;
+      }
+      if (spectralTransportBins > 0) {
+        std::cout << "spectralTransportBins = " << spectralTransportBins
+                  << std::endl;
+      }
+      if (!acFrequencies.empty()) {
+        std::cout << "acFrequencies = [";
+        for (size_t i = 0; i < acFrequencies.size(); i++) {
+          std::cout << acFrequencies[i] / (timeAuToFs * 1.0e-3);
+          if (i + 1 < acFrequencies.size()) std::cout << ", ";
+        }
+        std::cout << "] THz" << std::endl;
+      }
+      if (warmStartBTE) {
+        std::cout << "warmStartBTE = " << warmStartBTE << std::endl;
+      }
+      if (!initialPopulationFileName.empty()) {
+        std::cout << "initialPopulationFileName = "
+                  << initialPopulationFileName << std::endl;
+      }
+      if (!phElLinewidthsFileName.empty()) {
+        std::cout << "phElLinewidthsFileName = " << phElLinewidthsFileName
+                  << std::endl;
+      }
+      if (outputPopulationBTE) {
+        std::cout << "outputPopulationBTE = " << outputPopulationBTE
+                  << std::endl;
+      }
+      if (!convergenceMeshDivisors.empty()) {
+        std::cout << "convergenceMeshDivisors = [";
+        for (size_t i = 0; i < convergenceMeshDivisors.size(); i++) {
+          std::cout << convergenceMeshDivisors[i];
+          if (i + 1 < convergenceMeshDivisors.size()) std::cout << ", ";
+        }
+        std::cout << "]" << std::endl;
+      }
+      if (linewidthsQMesh.prod() > 0) {
+        std::cout << "linewidthsQMesh = " << linewidthsQMesh(0) << " "
+                  << linewidthsQMesh(1) << " " << linewidthsQMesh(2)
+                  << std::endl;
+      }
+      if (!transientTimes.empty()) {
+        std::cout << "transientTimes = [";
+        for (size_t i = 0; i < transientTimes.size(); i++) {
+          std::cout << transientTimes[i] * timeAuToFs * 1.0e-3;
+          if (i + 1 < transientTimes.size()) std::cout << ", ";
+        }
+        std::cout << "] ps" << std::endl;
+        std::cout << "transientPumpEnergies = [";
+        for (size_t i = 0; i < transientPumpEnergies.size(); i++) {
+          std::cout << transientPumpEnergies[i] * energyRyToEv * 1000.;
+          if (i + 1 < transientPumpEnergies.size()) std::cout << ", ";
+        }
+        std::cout << "] meV" << std::endl;
+        std::cout << "transientPumpWidth = "
+                  << transientPumpWidth * energyRyToEv * 1000. << " meV"
+                  << std::endl;
+      }
+      if (scatteringMatrixPrecision != "double") {
+        std::cout << "scatteringMatrixPrecision = "
+                  << scatteringMatrixPrecision << std::endl;
+      }
+      if (scatteringMatrixOnDevice) {
+        std::cout << "scatteringMatrixOnDevice = " << scatteringMatrixOnDevice
+                  << std::endl;
+      }
+      if (dryRun) {
+        std::cout << "dryRun = " << dryRun << std::endl;
+      }
       std::cout << "windowType = " << windowType << std::endl;
 
     if (windowEnergyLimit(0) != 0 || windowEnergyLimit(1) != 0) {
@@ -1002,6 +1463,10 @@ void Context::printInputSummary(const std::string &fileName) {
       std::cout << "windowPopulationLimit = " << windowPopulationLimit
                 << std::endl;
     }
+    if (appName.find("Lifetimes") != std::string::npos &&
+        lifetimesChunkSize > 0) {
+      std::cout << "lifetimesChunkSize = " << lifetimesChunkSize << std::endl;
+    }
 
     printVectorXd("temperatures", temperatures * temperatureAuToSi, "K");
     if (!std::isnan(minTemperature))
@@ -1080,6 +1545,9 @@ void Context::printInputSummary(const std::string &fileName) {
       std::cout << "outputEigendisplacements = " << outputEigendisplacements <<
         std::endl;
     }
+    if (bandsFormat != "json") {
+      std::cout << "bandsFormat = " << bandsFormat << std::endl;
+    }
 
     std::cout << "\nBand Path:" << std::endl;
     std::cout << std::setprecision(4) << std::fixed;
@@ -1166,6 +1634,9 @@ void Context::setPhFC2FileName(const std::string &x) { phFC2FileName = x; }
 std::string Context::getPhFC3FileName() { return phFC3FileName; }
 void Context::setPhFC3FileName(const std::string &x) { phFC3FileName = x; }
 
+std::string Context::getPhFC4FileName() { return phFC4FileName; }
+void Context::setPhFC4FileName(const std::string &x) { phFC4FileName = x; }
+
 std::string Context::getPhonopyDispFileName() { return phonopyDispFileName; }
 /* just used as a test function */
 void Context::setPhonopyDispFileName(const std::string &x) {
@@ -1175,6 +1646,16 @@ std::string Context::getPhonopyBORNFileName() { return phonopyBORNFileName; }
 
 std::string Context::getSumRuleFC2() { return sumRuleFC2; }
 void Context::setSumRuleFC2(const std::string &x) { sumRuleFC2 = x; }
+std::string Context::getSumRuleFC2FilePrefix() { return sumRuleFC2FilePrefix; }
+void Context::setSumRuleFC2FilePrefix(const std::string &x) {
+  sumRuleFC2FilePrefix = x;
+}
+std::string Context::getBandStructureCachePrefix() {
+  return bandStructureCachePrefix;
+}
+void Context::setBandStructureCachePrefix(const std::string &x) {
+  bandStructureCachePrefix = x;
+}
 
 std::string Context::getElphFileName() { return elphFileName; }
 void Context::setElphFileName(const std::string &x) { elphFileName = x; }
@@ -1208,7 +1689,12 @@ double Context::getElectronFourierCutoff() const {
 
 std::string Context::getAppName() { return appName; }
 
+void Context::setAppName(const std::string &x) { appName = x; }
+
+std::vector<std::string> Context::getAppNames() { return appNames; }
+
 Eigen::Vector3i Context::getQMesh() { return qMesh; }
+void Context::setQMesh(const Eigen::Vector3i &x) { qMesh = x; }
 
 Eigen::Vector3i Context::getKMesh() { return kMesh; }
 
@@ -1284,6 +1770,9 @@ double Context::getDeltaPath() const { return deltaPath; }
 bool Context::getOutputEigendisplacements() const { return outputEigendisplacements; }
 bool Context::getOutputUNTimes() const { return outputUNTimes; }
 
+std::string Context::getBandsFormat() const { return bandsFormat; }
+void Context::setBandsFormat(const std::string &x) { bandsFormat = x; }
+
 double Context::getFermiLevel() const { return fermiLevel; }
 
 void Context::setFermiLevel(const double &x) { fermiLevel = x; }
@@ -1297,6 +1786,7 @@ bool Context::getHasSpinOrbit() const { return hasSpinOrbit; }
 void Context::setHasSpinOrbit(const bool &x) { hasSpinOrbit = x; }
 
 int Context::getSmearingMethod() const { return smearingMethod; }
+void Context::setSmearingMethod(const int &x) { smearingMethod = x; }
 
 double Context::getSmearingWidth() const { return smearingWidth; }
 void Context::setSmearingWidth(const double &x) { smearingWidth = x; }
@@ -1312,6 +1802,27 @@ void Context::setScatteringMatrixInMemory(const bool &x) {
   scatteringMatrixInMemory = x;
 }
 
+ScatteringMatrixInMemoryScope::ScatteringMatrixInMemoryScope(
+    Context &context_, const bool &inMemory)
+    : context(context_),
+      previousInMemory(context_.getScatteringMatrixInMemory()) {
+  context.setScatteringMatrixInMemory(inMemory);
+}
+
+ScatteringMatrixInMemoryScope::~ScatteringMatrixInMemoryScope() {
+  context.setScatteringMatrixInMemory(previousInMemory);
+}
+
+HasSpinOrbitScope::HasSpinOrbitScope(Context &context_,
+                                     const bool &hasSpinOrbit)
+    : context(context_), previousHasSpinOrbit(context_.getHasSpinOrbit()) {
+  context.setHasSpinOrbit(hasSpinOrbit);
+}
+
+HasSpinOrbitScope::~HasSpinOrbitScope() {
+  context.setHasSpinOrbit(previousHasSpinOrbit);
+}
+
 bool Context::getSymmetrizeMatrix() const {
   return symmetrizeMatrix;
 }
@@ -1328,9 +1839,120 @@ void Context::setNumRelaxonsEigenvalues(const int &x) {
 
 bool Context::getCheckNegativeRelaxons() const { return checkNegativeRelaxons; }
 
+std::string Context::getRelaxonsEigenSolver() const {
+  return relaxonsEigenSolver;
+}
+void Context::setRelaxonsEigenSolver(const std::string &x) {
+  relaxonsEigenSolver = x;
+}
+
+std::string Context::getRelaxationTimesFormat() const {
+  return relaxationTimesFormat;
+}
+void Context::setRelaxationTimesFormat(const std::string &x) {
+  relaxationTimesFormat = x;
+}
+
+int Context::getSpectralTransportBins() const {
+  return spectralTransportBins;
+}
+void Context::setSpectralTransportBins(const int &x) {
+  spectralTransportBins = x;
+}
+
+std::vector<double> Context::getTransientTimes() const {
+  return transientTimes;
+}
+void Context::setTransientTimes(const std::vector<double> &x) {
+  transientTimes = x;
+}
+
+std::vector<double> Context::getTransientPumpEnergies() const {
+  return transientPumpEnergies;
+}
+void Context::setTransientPumpEnergies(const std::vector<double> &x) {
+  transientPumpEnergies = x;
+}
+
+double Context::getTransientPumpWidth() const { return transientPumpWidth; }
+void Context::setTransientPumpWidth(const double &x) {
+  transientPumpWidth = x;
+}
+
+std::vector<double> Context::getACFrequencies() const {
+  return acFrequencies;
+}
+void Context::setACFrequencies(const std::vector<double> &x) {
+  acFrequencies = x;
+}
+
+bool Context::getWarmStartBTE() const { return warmStartBTE; }
+void Context::setWarmStartBTE(const bool &x) { warmStartBTE = x; }
+
+std::string Context::getInitialPopulationFileName() const {
+  return initialPopulationFileName;
+}
+void Context::setInitialPopulationFileName(const std::string &x) {
+  initialPopulationFileName = x;
+}
+
+std::string Context::getPhElLinewidthsFileName() const {
+  return phElLinewidthsFileName;
+}
+void Context::setPhElLinewidthsFileName(const std::string &x) {
+  phElLinewidthsFileName = x;
+}
+
+bool Context::getOutputPopulationBTE() const { return outputPopulationBTE; }
+void Context::setOutputPopulationBTE(const bool &x) {
+  outputPopulationBTE = x;
+}
+
+std::vector<int> Context::getConvergenceMeshDivisors() const {
+  return convergenceMeshDivisors;
+}
+void Context::setConvergenceMeshDivisors(const std::vector<int> &x) {
+  convergenceMeshDivisors = x;
+}
+
+Eigen::Vector3i Context::getLinewidthsQMesh() const { return linewidthsQMesh; }
+void Context::setLinewidthsQMesh(const Eigen::Vector3i &x) {
+  linewidthsQMesh = x;
+}
+
+std::string Context::getScatteringMatrixPrecision() const {
+  return scatteringMatrixPrecision;
+}
+void Context::setScatteringMatrixPrecision(const std::string &x) {
+  scatteringMatrixPrecision = x;
+}
+
+bool Context::getScatteringMatrixOnDevice() const {
+  return scatteringMatrixOnDevice;
+}
+void Context::setScatteringMatrixOnDevice(const bool &x) {
+  scatteringMatrixOnDevice = x;
+}
+
+bool Context::getDryRun() const { return dryRun; }
+void Context::setDryRun(const bool &x) { dryRun = x; }
+
 bool Context::getUseSymmetries() const { return useSymmetries; }
 void Context::setUseSymmetries(const bool &x) { useSymmetries = x; }
 
+bool Context::getUseTimeReversal() const { return useTimeReversal; }
+void Context::setUseTimeReversal(const bool &x) { useTimeReversal = x; }
+
+std::string Context::getWavevectorOrdering() const {
+  return wavevectorOrdering;
+}
+void Context::setWavevectorOrdering(const std::string &x) {
+  wavevectorOrdering = x;
+}
+
+bool Context::getWignerCorrection() const { return wignerCorrection; }
+void Context::setWignerCorrection(const bool &x) { wignerCorrection = x; }
+
 Eigen::VectorXd Context::getMasses() { return customMasses; }
 Eigen::VectorXd Context::getIsotopeCouplings() { return customIsotopeCouplings; }
 
@@ -1416,3 +2038,207 @@ std::string Context::getWsVecFileName() const {
 void Context::setWsVecFileName(const std::string& x) {
   wsVecFileName = x;
 }
+
+int Context::getScatteringCheckpointInterval() const {
+  return scatteringCheckpointInterval;
+}
+
+void Context::setScatteringCheckpointInterval(const int &x) {
+  if (x < 0) {
+    Error("scatteringCheckpointInterval must be a non-negative integer");
+  }
+  scatteringCheckpointInterval = x;
+}
+
+int Context::getSolverCheckpointInterval() const {
+  return solverCheckpointInterval;
+}
+
+void Context::setSolverCheckpointInterval(const int &x) {
+  if (x < 0) {
+    Error("solverCheckpointInterval must be a non-negative integer");
+  }
+  solverCheckpointInterval = x;
+}
+
+int Context::getNumSolverGroups() const { return numSolverGroups; }
+
+void Context::setNumSolverGroups(const int &x) {
+  if (x < 1) {
+    Error("numSolverGroups must be a positive integer");
+  }
+  numSolverGroups = x;
+}
+
+double Context::getProgressHeartbeatInterval() const {
+  return progressHeartbeatInterval;
+}
+
+void Context::setProgressHeartbeatInterval(const double &x) {
+  if (x < 0.) {
+    Error("progressHeartbeatInterval must be non-negative");
+  }
+  progressHeartbeatInterval = x;
+}
+
+std::string Context::getCheckpointPrefix() const {
+  return checkpointPrefix;
+}
+
+void Context::setCheckpointPrefix(const std::string &x) {
+  checkpointPrefix = x;
+}
+
+std::string Context::getScatteringMatrixFilePrefix() const {
+  return scatteringMatrixFilePrefix;
+}
+
+void Context::setScatteringMatrixFilePrefix(const std::string &x) {
+  scatteringMatrixFilePrefix = x;
+}
+
+std::string Context::getScatteringMatrixScratchDirectory() const {
+  return scatteringMatrixScratchDirectory;
+}
+
+void Context::setScatteringMatrixScratchDirectory(const std::string &x) {
+  scatteringMatrixScratchDirectory = x;
+}
+
+std::string Context::getElPhCouplingCachePrefix() const {
+  return elPhCouplingCachePrefix;
+}
+
+void Context::setElPhCouplingCachePrefix(const std::string &x) {
+  elPhCouplingCachePrefix = x;
+}
+
+bool Context::getSparseScatteringMatrix() const {
+  return sparseScatteringMatrix;
+}
+
+void Context::setSparseScatteringMatrix(const bool &x) {
+  sparseScatteringMatrix = x;
+}
+
+double Context::getSparseMatrixDropTolerance() const {
+  return sparseMatrixDropTolerance;
+}
+
+void Context::setSparseMatrixDropTolerance(const double &x) {
+  if (x < 0.) {
+    Error("sparseMatrixDropTolerance must be non-negative");
+  }
+  sparseMatrixDropTolerance = x;
+}
+
+bool Context::getCachePhPhCouplings() const { return cachePhPhCouplings; }
+
+void Context::setCachePhPhCouplings(const bool &x) { cachePhPhCouplings = x; }
+
+double Context::getCalculationsChunkMemory() const {
+  return calculationsChunkMemory;
+}
+
+void Context::setCalculationsChunkMemory(const double &x) {
+  if (x < 0.) {
+    Error("calculationsChunkMemory must be non-negative");
+  }
+  calculationsChunkMemory = x;
+}
+
+bool Context::getEigenvectorsSinglePrecision() const {
+  return eigenvectorsSinglePrecision;
+}
+
+void Context::setEigenvectorsSinglePrecision(const bool &x) {
+  eigenvectorsSinglePrecision = x;
+}
+
+double Context::getPartnerSamplingFraction() const {
+  return partnerSamplingFraction;
+}
+
+void Context::setPartnerSamplingFraction(const double &x) {
+  if (x <= 0. || x > 1.) {
+    Error("partnerSamplingFraction must be in the interval (0,1]");
+  }
+  partnerSamplingFraction = x;
+}
+
+int Context::getPartnerSamplingSeed() const { return partnerSamplingSeed; }
+
+void Context::setPartnerSamplingSeed(const int &x) { partnerSamplingSeed = x; }
+
+double Context::getElPhK1CacheMemory() const { return elPhK1CacheMemory; }
+
+void Context::setElPhK1CacheMemory(const double &x) {
+  if (x < 0.) {
+    Error("elPhK1CacheMemory must be non-negative");
+  }
+  elPhK1CacheMemory = x;
+}
+
+bool Context::getUseElPhLittleGroup() const { return useElPhLittleGroup; }
+
+void Context::setUseElPhLittleGroup(const bool &x) { useElPhLittleGroup = x; }
+
+bool Context::getUseKramersPairs() const { return useKramersPairs; }
+
+void Context::setUseKramersPairs(const bool &x) { useKramersPairs = x; }
+
+double Context::getElPhTruncationThreshold() const {
+  return elPhTruncationThreshold;
+}
+
+void Context::setElPhTruncationThreshold(const double &x) {
+  if (x < 0.) {
+    Error("elPhTruncationThreshold must be non-negative");
+  }
+  elPhTruncationThreshold = x;
+}
+
+bool Context::getElPhSinglePrecision() const { return elPhSinglePrecision; }
+
+void Context::setElPhSinglePrecision(const bool &x) { elPhSinglePrecision = x; }
+
+bool Context::getElPhMemoryMap() const { return elPhMemoryMap; }
+
+void Context::setElPhMemoryMap(const bool &x) { elPhMemoryMap = x; }
+
+bool Context::getPipelinePhPhBuilder() const { return pipelinePhPhBuilder; }
+
+void Context::setPipelinePhPhBuilder(const bool &x) { pipelinePhPhBuilder = x; }
+
+bool Context::getCoupledPhElLinewidths() const { return coupledPhElLinewidths; }
+
+void Context::setCoupledPhElLinewidths(const bool &x) {
+  coupledPhElLinewidths = x;
+}
+
+int Context::getLifetimesChunkSize() const { return lifetimesChunkSize; }
+
+void Context::setLifetimesChunkSize(const int &x) {
+  if (x < 0) {
+    Error("lifetimesChunkSize must be a non-negative integer");
+  }
+  lifetimesChunkSize = x;
+}
+
+double Context::getFc3PruningThreshold() const { return fc3PruningThreshold; }
+
+void Context::setFc3PruningThreshold(const double &x) {
+  if (x < 0. || x >= 1.) {
+    Error("fc3PruningThreshold must be in the interval [0,1)");
+  }
+  fc3PruningThreshold = x;
+}
+
+double Context::getFc3DistanceCutoff() const { return fc3DistanceCutoff; }
+
+void Context::setFc3DistanceCutoff(const double &x) {
+  if (x < 0.) {
+    Error("fc3DistanceCutoff must be non-negative");
+  }
+  fc3DistanceCutoff = x;
+}
@@ -16,6 +16,7 @@ class Context {
  private:
   std::string phFC2FileName;
   std::string phFC3FileName;
+  std::string phFC4FileName;
   std::string phonopyDispFileName;
   std::string phonopyBORNFileName;
 
@@ -25,7 +26,13 @@ class Context {
   std::string elPhInterpolation;
 
   std::string appName;
+  // list of apps to run one after the other in the same job
+  std::vector<std::string> appNames;
   std::string sumRuleFC2;
+  // if not empty, the "crystal" sum rule is cached in files with this prefix
+  std::string sumRuleFC2FilePrefix;
+  // if not empty, populated band structures are cached in files with this prefix
+  std::string bandStructureCachePrefix;
   int smearingMethod = -1;
   double smearingWidth = std::numeric_limits<double>::quiet_NaN();
   Eigen::VectorXd temperatures;
@@ -35,6 +42,9 @@ class Context {
 
   bool scatteringMatrixInMemory = true;
   bool useSymmetries = false;
+  bool useTimeReversal = false;
+  std::string wavevectorOrdering = "index";
+  bool wignerCorrection = true;
 
   std::string windowType = "nothing";
   Eigen::Vector2d windowEnergyLimit = Eigen::Vector2d::Zero();
@@ -68,6 +78,8 @@ class Context {
 
   bool outputEigendisplacements = false; // used by bands app if phonon eigdisps are dumped
   bool outputUNTimes = false; // triggers scattering matrix to output times for U and N processes
+  // format of the band structure output: "json", "hdf5" or "both"
+  std::string bandsFormat = "json";
 
   double constantRelaxationTime = std::numeric_limits<double>::quiet_NaN();
   bool withIsotopeScattering = true;  // add isotopes in phonon scattering matrix
@@ -124,9 +136,120 @@ class Context {
   int numRelaxonsEigenvalues = 0;
   // toggle the check for negative relaxons eigenvalues in few eigenvalues case
   bool checkNegativeRelaxons = true;
+  // algorithm for the relaxons eigenvalues: "direct" or "lobpcg"
+  std::string relaxonsEigenSolver = "direct";
+  // precision of the scattering matrix stored in memory: "double" or "single"
+  std::string scatteringMatrixPrecision = "double";
+  // format of the relaxation times output: "json", "hdf5" or "both"
+  std::string relaxationTimesFormat = "json";
+  // number of bins of the frequency/energy and mean free path decomposition
+  // of the RTA transport coefficients (0 to disable)
+  int spectralTransportBins = 0;
+  // times (in atomic units) at which the pumped phonon populations are
+  // propagated in the relaxon basis, with the pump energies and width
+  std::vector<double> transientTimes;
+  std::vector<double> transientPumpEnergies;
+  double transientPumpWidth = std::numeric_limits<double>::quiet_NaN();
+  // frequencies (in inverse atomic units of time) of the AC transport
+  // coefficients computed by the relaxons solver
+  std::vector<double> acFrequencies;
+  // initial guess of the iterative BTE solvers, from the solution at the
+  // previous temperature or from the populations written by an earlier run
+  bool warmStartBTE = false;
+  std::string initialPopulationFileName;
+  // ph-el linewidths written by an earlier run, added to the phonon BTE
+  std::string phElLinewidthsFileName;
+  // write the populations found by the iterative BTE solvers to HDF5
+  bool outputPopulationBTE = false;
+  // divisors of qMesh defining the coarser meshes of a convergence study
+  std::vector<int> convergenceMeshDivisors;
+  // coarse mesh of the RTA linewidths, interpolated on qMesh (double grid)
+  Eigen::Vector3i linewidthsQMesh = Eigen::Vector3i::Zero();
+  // keep the dense scattering matrix in the memory of the Kokkos device
+  bool scatteringMatrixOnDevice = false;
+  // only estimate the memory and time of the transport apps
+  bool dryRun = false;
 
   int hdf5ElphFileFormat = 1;
   std::string wsVecFileName;
+
+  // checkpointing of the scattering matrix construction
+  // number of wavevector iterations between dumps (0 = no checkpoints)
+  int scatteringCheckpointInterval = 0;
+  std::string checkpointPrefix = "phoebe_checkpoint";
+  // number of iterations of the BTE solvers between dumps (0 = no checkpoints)
+  int solverCheckpointInterval = 0;
+  // number of groups of MPI processes running the exact BTE solvers
+  // concurrently, each on its own copy of the scattering matrix
+  int numSolverGroups = 1;
+
+  // seconds between the progress reports of the MPI processes during the
+  // scattering matrix construction (0 = no reports)
+  double progressHeartbeatInterval = 0.;
+
+  // if not empty, the scattering matrix is saved to (or loaded from) disk
+  std::string scatteringMatrixFilePrefix;
+
+  // if not empty, the dense scattering matrix is stored out of core here
+  std::string scatteringMatrixScratchDirectory;
+
+  // if not empty, the squared el-ph couplings in Bloch representation are
+  // saved to (or loaded from) disk
+  std::string elPhCouplingCachePrefix;
+
+  // sparse storage of the scattering matrix in memory
+  bool sparseScatteringMatrix = false;
+  double sparseMatrixDropTolerance = 0.;
+
+  // keep the temperature-independent ph-ph transition weights in memory
+  bool cachePhPhCouplings = false;
+  // memory budget (GB) of the arrays growing with the number of
+  // calculations in the RTA, which are then processed in chunks
+  double calculationsChunkMemory = 0.;
+
+  // store the eigenvectors of the band structures in single precision
+  bool eigenvectorsSinglePrecision = false;
+
+  // stochastic sampling of the scattering partners of the linewidths
+  double partnerSamplingFraction = 1.;
+  int partnerSamplingSeed = 0;
+
+  // overlap the harmonic calculations at q3 with the ph-ph couplings
+  bool pipelinePhPhBuilder = false;
+
+  // memory budget (GB) of the cache of el-ph transforms at k1
+  double elPhK1CacheMemory = 0.;
+
+  // compute the el-ph couplings only at the k2 irreducible under the little
+  // group of k1
+  bool useElPhLittleGroup = false;
+
+  // with spin-orbit coupling and inversion symmetry, treat the pairs of
+  // degenerate bands as single states in the electron BTE
+  bool useKramersPairs = false;
+
+  // relative threshold on the norm of the (R_el,R_ph) blocks of the el-ph
+  // coupling in Wannier representation, below which blocks are dropped
+  double elPhTruncationThreshold = 0.;
+
+  // interpolate the el-ph coupling in single precision
+  bool elPhSinglePrecision = false;
+
+  // read the el-ph coupling from a memory map of the HDF5 file
+  bool elPhMemoryMap = false;
+
+  // compute the ph-el linewidths with the el-ph couplings of the electron
+  // scattering rates
+  bool coupledPhElLinewidths = false;
+
+  // number of path points processed at once by the lifetimes apps
+  // (0 = the whole path)
+  int lifetimesChunkSize = 0;
+
+  // pruning of the anharmonic force constants: relative threshold on the
+  // (R2,R3) blocks, and cutoff on the interatomic distances (0 = no cutoff)
+  double fc3PruningThreshold = 0.;
+  double fc3DistanceCutoff = 0.;
 public:
   // Methods for the apps of plotting the electron-phonon coupling
   std::string getG2PlotStyle();
@@ -159,6 +282,14 @@ public:
   std::string getPhFC3FileName();
   void setPhFC3FileName(const std::string &x);
 
+  /** gets the name of the file containing the 4th order force constants,
+   * in the ShengBTE (FourPhonon) format. If set, the 4-phonon scattering
+   * is added to the phonon linewidths.
+   * @return x: the file path, or an empty string.
+   */
+  std::string getPhFC4FileName();
+  void setPhFC4FileName(const std::string &x);
+
   std::string getPhonopyDispFileName();
   void setPhonopyDispFileName(const std::string &x);
 
@@ -198,16 +329,44 @@ public:
    */
   std::string getAppName();
 
+  /** Sets the app currently being run. Used when the input lists several
+   * apps, to run them one after the other in the same job.
+   * @param x: the name of the app.
+   */
+  void setAppName(const std::string &x);
+
+  /** gets the list of apps to be run in this job.
+   * The user can either set appName to a single app name, or to a list, e.g.
+   * appName = ["phononBands", "phononDos"], in which case the apps are run
+   * in sequence, sharing the parsed harmonic Hamiltonians.
+   * @return x: vector with the names of the apps.
+   */
+  std::vector<std::string> getAppNames();
+
   /** gets the sum rule to be imposed on the lattice force constants.
    * @return x: the name of the sum rule, i.e. "simple" or "crystal".
    */
   std::string getSumRuleFC2();
   void setSumRuleFC2(const std::string &x);
 
+  /** Prefix of the HDF5 files caching the force constants corrected by the
+   * "crystal" acoustic sum rule. If empty, the sum rule isn't cached.
+   */
+  std::string getSumRuleFC2FilePrefix();
+  void setSumRuleFC2FilePrefix(const std::string &x);
+
+  /** Prefix of the HDF5 files caching the band structures (energies,
+   * velocities and gauge-fixed eigenvectors) interpolated by the harmonic
+   * Hamiltonians. If empty, band structures aren't cached.
+   */
+  std::string getBandStructureCachePrefix();
+  void setBandStructureCachePrefix(const std::string &x);
+
   /** gets the mesh of points for harmonic phonon properties.
    * @return path: an array with 3 integers representing the q-point mesh.
    */
   Eigen::Vector3i getQMesh();
+  void setQMesh(const Eigen::Vector3i &x);
 
   /** gets the mesh of points for harmonic electronic properties.
    * @return path: an array with 3 integers representing the k-point mesh.
@@ -296,6 +455,12 @@ public:
   bool getOutputEigendisplacements() const;
   bool getOutputUNTimes() const;
 
+  /** Format of the output of the bands apps: "json" (written by the head
+   * MPI process), "hdf5" (written in parallel), or "both".
+   */
+  std::string getBandsFormat() const;
+  void setBandsFormat(const std::string &x);
+
   double getFermiLevel() const;
   void setFermiLevel(const double &x);
 
@@ -306,6 +471,7 @@ public:
   void setHasSpinOrbit(const bool &x);
 
   int getSmearingMethod() const;
+  void setSmearingMethod(const int &x);
 
   double getSmearingWidth() const;
   void setSmearingWidth(const double &x);
@@ -318,6 +484,24 @@ public:
   bool getUseSymmetries() const;
   void setUseSymmetries(const bool &x);
 
+  /** If true, the transition rates of a pair of wavevectors (k1,k2) are
+   * computed once and reused for the time-reversed pair (-k1,-k2), when
+   * building the linewidths or the matrix-vector products.
+   */
+  bool getUseTimeReversal() const;
+  void setUseTimeReversal(const bool &x);
+
+  /** Order of the wavevectors in the loops of the scattering matrix
+   * builders, and in their division over MPI processes: "index" (the order
+   * of the band structure), or along a "morton" or "hilbert" space-filling
+   * curve through the mesh.
+   */
+  std::string getWavevectorOrdering() const;
+  void setWavevectorOrdering(const std::string &x);
+
+  bool getWignerCorrection() const;
+  void setWignerCorrection(const bool &x);
+
   bool getWithIsotopeScattering() const;
 
   Eigen::VectorXd getMasses();
@@ -366,11 +550,327 @@ public:
 
   bool getCheckNegativeRelaxons() const;
 
+  std::string getRelaxonsEigenSolver() const;
+  void setRelaxonsEigenSolver(const std::string &x);
+
+  std::string getScatteringMatrixPrecision() const;
+  void setScatteringMatrixPrecision(const std::string &x);
+
+  /** Format of the files with the relaxation times, linewidths, energies and
+   * velocities of each state: "json" (written by the head process),
+   * "hdf5" (written in parallel), or "both".
+   */
+  std::string getRelaxationTimesFormat() const;
+  void setRelaxationTimesFormat(const std::string &x);
+
+  /** Number of bins used to decompose the RTA transport coefficients as a
+   * function of frequency (or energy for electrons) and phonon mean free
+   * path. The histograms are accumulated while computing the coefficients,
+   * and only these are written to file. If 0, no decomposition is done.
+   */
+  int getSpectralTransportBins() const;
+  void setSpectralTransportBins(const int &x);
+
+  /** Times at which the relaxons solver propagates the phonon populations
+   * excited by a pump, in the relaxon basis. If empty, no transient is
+   * computed. In atomic units of time.
+   */
+  std::vector<double> getTransientTimes() const;
+  void setTransientTimes(const std::vector<double> &x);
+
+  /** Central energies (in Rydberg) of the pumps that excite the phonon
+   * populations propagated with getTransientTimes(), one initial condition
+   * for each pump energy.
+   */
+  std::vector<double> getTransientPumpEnergies() const;
+  void setTransientPumpEnergies(const std::vector<double> &x);
+
+  /** Gaussian width (in Rydberg) of the pumps, also used as the bin width
+   * of the energy-resolved transient output.
+   */
+  double getTransientPumpWidth() const;
+  void setTransientPumpWidth(const double &x);
+
+  /** Frequencies at which the relaxons solvers compute the frequency
+   * dependent (AC) transport coefficients. If empty, only the static
+   * coefficients are computed. In inverse atomic units of time (cycles,
+   * not angular frequencies).
+   */
+  std::vector<double> getACFrequencies() const;
+  void setACFrequencies(const std::vector<double> &x);
+
+  /** If true, when the BTE is solved separately for each temperature, the
+   * iterative, variational and bicgstab solvers start from the solution at
+   * the previous temperature, rather than from the RTA populations.
+   */
+  bool getWarmStartBTE() const;
+  void setWarmStartBTE(const bool &x);
+
+  /** Name of a HDF5 file, written by an earlier run with
+   * getOutputPopulationBTE(), with the populations used as initial guess of
+   * the iterative, variational and bicgstab solvers (empty if not used).
+   */
+  std::string getInitialPopulationFileName() const;
+  void setInitialPopulationFileName(const std::string &x);
+
+  /** Name of a HDF5 file with the phonon-electron linewidths, written by
+   * phononElectronLifetimes or by an earlier phononTransport run, which are
+   * added to the phonon linewidths instead of computing the ph-el
+   * scattering (empty if not used).
+   */
+  std::string getPhElLinewidthsFileName() const;
+  void setPhElLinewidthsFileName(const std::string &x);
+
+  /** If true, the populations found by the iterative, variational and
+   * bicgstab solvers are written to HDF5 files.
+   */
+  bool getOutputPopulationBTE() const;
+  void setOutputPopulationBTE(const bool &x);
+
+  /** Divisors of qMesh, each defining a coarser mesh qMesh/divisor of a
+   * convergence study, in which the BTE is solved on the nested meshes
+   * before qMesh (empty if not used).
+   */
+  std::vector<int> getConvergenceMeshDivisors() const;
+  void setConvergenceMeshDivisors(const std::vector<int> &x);
+
+  /** Coarse mesh on which the phonon linewidths are computed, and then
+   * interpolated on the states of qMesh, where the RTA observables are
+   * integrated (zero if not used, i.e. the linewidths are computed on qMesh).
+   */
+  Eigen::Vector3i getLinewidthsQMesh() const;
+  void setLinewidthsQMesh(const Eigen::Vector3i &x);
+
+  /** If true, the dense scattering matrix stored in memory is copied to the
+   * Kokkos device (e.g. GPU), where the solvers' products are done.
+   */
+  bool getScatteringMatrixOnDevice() const;
+  void setScatteringMatrixOnDevice(const bool &x);
+
+  /** If true, the transport apps build the band structure, print estimates
+   * of the memory and time needed by the calculation, and exit.
+   */
+  bool getDryRun() const;
+  void setDryRun(const bool &x);
+
   int getHdf5ElPhFileFormat() const;
   void setHdf5ElPhFileFormat(const int &x);
 
   std::string getWsVecFileName() const;
   void setWsVecFileName(const std::string& x);
+
+  /** Number of iterations over wavevector pairs in the scattering matrix
+   * builder between two checkpoints. If 0, checkpoints are not written.
+   */
+  int getScatteringCheckpointInterval() const;
+  void setScatteringCheckpointInterval(const int &x);
+
+  /** Number of iterations of the iterative and variational BTE solvers
+   * between two checkpoints. If 0, checkpoints are not written.
+   */
+  int getSolverCheckpointInterval() const;
+  void setSolverCheckpointInterval(const int &x);
+
+  /** Number of groups of MPI processes in which the exact BTE solvers of
+   * solverBTE are distributed, so that they run concurrently.
+   */
+  int getNumSolverGroups() const;
+  void setNumSolverGroups(const int &x);
+
+  /** Time in seconds between two reports of the progress of all MPI
+   * processes in the scattering matrix construction. If 0, only the progress
+   * of the head process is reported.
+   */
+  double getProgressHeartbeatInterval() const;
+  void setProgressHeartbeatInterval(const double &x);
+
+  /** Prefix of the files used to checkpoint and restart a calculation.
+   */
+  std::string getCheckpointPrefix() const;
+  void setCheckpointPrefix(const std::string &x);
+
+  /** Prefix of the HDF5 files where the scattering matrix, once built in
+   * memory, is stored, so that it can be reused by later runs.
+   * If empty, the scattering matrix is not saved to disk.
+   */
+  std::string getScatteringMatrixFilePrefix() const;
+  void setScatteringMatrixFilePrefix(const std::string &x);
+
+  /** Directory (e.g. on node-local NVMe) of the scratch files where the
+   * dense scattering matrix is stored out of core, memory-mapped, when it
+   * doesn't fit in memory. If empty, the matrix is kept in memory.
+   */
+  std::string getScatteringMatrixScratchDirectory() const;
+  void setScatteringMatrixScratchDirectory(const std::string &x);
+
+  /** Prefix of the HDF5 files where the electron scattering matrix builder
+   * stores the squared el-ph couplings |g(k1,k2,q3)|^2 in Bloch
+   * representation, so that later runs on the same states can read them
+   * instead of interpolating them. If empty, the couplings aren't cached.
+   */
+  std::string getElPhCouplingCachePrefix() const;
+  void setElPhCouplingCachePrefix(const std::string &x);
+
+  /** If true, and the scattering matrix is kept in memory, it's stored in a
+   * sparse format, rather than as a dense matrix.
+   */
+  bool getSparseScatteringMatrix() const;
+  void setSparseScatteringMatrix(const bool &x);
+
+  /** Elements of the sparse scattering matrix smaller than this tolerance,
+   * relative to the largest diagonal element, are discarded.
+   */
+  double getSparseMatrixDropTolerance() const;
+  void setSparseMatrixDropTolerance(const double &x);
+
+  /** If true, the ph-ph transition weights, i.e. the 3-phonon couplings
+   * times the delta functions, are stored in memory after the first build of
+   * the scattering matrix, and reused by later builds (e.g. at other
+   * temperatures), which only recompute the Bose factors.
+   */
+  bool getCachePhPhCouplings() const;
+  void setCachePhPhCouplings(const bool &x);
+
+  /** Memory budget, in GB, of the arrays of the phonon RTA that grow with
+   * the number of calculations (temperatures). If the calculations don't
+   * fit, they are processed in chunks. Zero (the default) disables chunks.
+   */
+  double getCalculationsChunkMemory() const;
+  void setCalculationsChunkMemory(const double &x);
+
+  /** If true, the band structures of the transport apps store the
+   * eigenvectors in single precision. They are converted back to double
+   * precision when read, e.g. by the couplings.
+   */
+  bool getEigenvectorsSinglePrecision() const;
+  void setEigenvectorsSinglePrecision(const bool &x);
+
+  /** Average fraction of the wavevectors of the inner mesh that are sampled
+   * as scattering partners of each wavevector when computing the
+   * linewidths. If smaller than one, the partners are drawn at random, with
+   * a probability proportional to the likelihood of conserving energy, and
+   * the linewidths are unbiased estimates, with a statistical error.
+   */
+  double getPartnerSamplingFraction() const;
+  void setPartnerSamplingFraction(const double &x);
+
+  /** Seed of the random sampling of the scattering partners.
+   */
+  int getPartnerSamplingSeed() const;
+  void setPartnerSamplingSeed(const int &x);
+
+  /** Memory budget, in GB, of the cache that keeps the el-ph coupling
+   * Fourier transformed at the most recently used k1 points, so that later
+   * builds of the el-ph scattering rates (e.g. the iterations of the
+   * electronic BTE solvers) only compute the transforms at k2.
+   * Zero (the default) disables the cache.
+   */
+  double getElPhK1CacheMemory() const;
+  void setElPhK1CacheMemory(const double &x);
+
+  /** If true, the electron scattering matrix computes the el-ph couplings
+   * at fixed k1 only for the k2 points irreducible under the little group of
+   * k1, and reuses them for the symmetry-equivalent k2 points.
+   */
+  bool getUseElPhLittleGroup() const;
+  void setUseElPhLittleGroup(const bool &x);
+
+  /** If true, electronWannierTransport groups the Kramers-degenerate bands
+   * of a spin-orbit calculation with inversion symmetry into pairs, and
+   * solves the BTE on the pairs, with the el-ph couplings summed over the
+   * two bands of each pair.
+   */
+  bool getUseKramersPairs() const;
+  void setUseKramersPairs(const bool &x);
+
+  /** Relative threshold for the truncation of the el-ph coupling in the
+   * Wannier representation: the blocks at a pair of lattice vectors
+   * (R_el,R_ph) whose norm is smaller than this value times the largest
+   * block norm are dropped after parsing. Zero (the default) keeps them all.
+   */
+  double getElPhTruncationThreshold() const;
+  void setElPhTruncationThreshold(const double &x);
+
+  /** If true, the el-ph coupling in Wannier representation is stored in
+   * single precision, and its Fourier transforms over the lattice vectors
+   * are accumulated in single precision.
+   */
+  bool getElPhSinglePrecision() const;
+  void setElPhSinglePrecision(const bool &x);
+
+  /** If true, every MPI process reads its part of the el-ph coupling
+   * directly from a memory map of the HDF5 file, instead of reading it on a
+   * few processes and broadcasting it.
+   */
+  bool getElPhMemoryMap() const;
+  void setElPhMemoryMap(const bool &x);
+
+  /** If true, in the construction of the ph-ph scattering matrix, the
+   * harmonic properties at the q3 points of the next q2 wavevector are
+   * computed on a separate thread, overlapping with the couplings of the
+   * current q2. Only used when q3 doesn't fall on the q-point mesh.
+   */
+  bool getPipelinePhPhBuilder() const;
+  void setPipelinePhPhBuilder(const bool &x);
+
+  bool getCoupledPhElLinewidths() const;
+  void setCoupledPhElLinewidths(const bool &x);
+
+  /** Number of points of the path that the lifetimes apps process at once.
+   * The linewidths of each chunk of points are written to file before
+   * moving to the next one, so that the memory doesn't grow with the length
+   * of the path. If 0, the whole path is done at once.
+   */
+  int getLifetimesChunkSize() const;
+  void setLifetimesChunkSize(const int &x);
+
+  /** Relative threshold for pruning the anharmonic force constants.
+   * The blocks of force constants of a pair of lattice vectors (R2,R3) whose
+   * largest element is smaller than this threshold times the largest force
+   * constant are discarded. If 0, only the blocks of zeros are discarded.
+   */
+  double getFc3PruningThreshold() const;
+  void setFc3PruningThreshold(const double &x);
+
+  /** Cutoff on the interatomic distances of the anharmonic force constants
+   * (in Bohr). The force constants of atom triplets with some interatomic
+   * distance larger than the cutoff are set to zero. If 0, there's no cutoff.
+   */
+  double getFc3DistanceCutoff() const;
+  void setFc3DistanceCutoff(const double &x);
+};
+
+/** Sets scatteringMatrixInMemory during the lifetime of this object. The
+ * previous value is restored on destruction, so that an app doesn't change
+ * the Context seen by the apps run after it.
+ */
+class ScatteringMatrixInMemoryScope {
+ public:
+  ScatteringMatrixInMemoryScope(Context &context_, const bool &inMemory);
+  ~ScatteringMatrixInMemoryScope();
+  ScatteringMatrixInMemoryScope(const ScatteringMatrixInMemoryScope &) =
+      delete;
+  ScatteringMatrixInMemoryScope &
+  operator=(const ScatteringMatrixInMemoryScope &) = delete;
+
+ private:
+  Context &context;
+  bool previousInMemory;
+};
+
+/** Sets hasSpinOrbit during the lifetime of this object, restoring the
+ * previous value on destruction, as ScatteringMatrixInMemoryScope.
+ */
+class HasSpinOrbitScope {
+ public:
+  HasSpinOrbitScope(Context &context_, const bool &hasSpinOrbit);
+  ~HasSpinOrbitScope();
+  HasSpinOrbitScope(const HasSpinOrbitScope &) = delete;
+  HasSpinOrbitScope &operator=(const HasSpinOrbitScope &) = delete;
+
+ private:
+  Context &context;
+  bool previousHasSpinOrbit;
 };
 
 #endif
@@ -6,6 +6,7 @@
 #include "eigen.h"
 #include "mpi/mpiHelper.h"
 #include "periodic_table.h"
+#include <algorithm>
 #include <iomanip>
 
 double calcVolume(const Eigen::Matrix3d &directUnitCell) {
@@ -237,6 +238,8 @@ Crystal::Crystal(const Crystal &obj) {
   speciesMasses = obj.speciesMasses;
   symmetryOperations = obj.symmetryOperations;
   numSymmetries = obj.numSymmetries;
+  wsVectorsCache = obj.wsVectorsCache;
+  wsShiftVectorsCache = obj.wsShiftVectorsCache;
 }
 
 // assignment operator
@@ -258,6 +261,8 @@ Crystal &Crystal::operator=(const Crystal &obj) {
     speciesMasses = obj.speciesMasses;
     symmetryOperations = obj.symmetryOperations;
     numSymmetries = obj.numSymmetries;
+    wsVectorsCache = obj.wsVectorsCache;
+    wsShiftVectorsCache = obj.wsShiftVectorsCache;
   }
   return *this;
 }
@@ -350,22 +355,113 @@ int Crystal::getDimensionality() const { return dimensionality; }
 
 int Crystal::getNumSpecies() const { return numSpecies; }
 
+std::vector<double> Crystal::wsCacheKey(const Eigen::Vector3i &grid,
+                                        const int &superCellFactor,
+                                        const Eigen::MatrixXd &shift) {
+  std::vector<double> key = {double(grid(0)), double(grid(1)),
+                             double(grid(2)), double(superCellFactor)};
+  key.insert(key.end(), directUnitCell.data(), directUnitCell.data() + 9);
+  key.insert(key.end(), shift.data(), shift.data() + shift.size());
+  return key;
+}
+
+/** Checks whether the lattice vector r=(i0,i1,i2) (crystal coordinates)
+ * lives in the Wigner Seitz zone of the super cell of size grid.
+ * We compute the distance between r (plus a cartesian shift) and all the
+ * super cell vectors R in a super cell B of size ((nx+1)*2+1)^3, and r is in
+ * the WS zone if R=0 gives the minimum distance.
+ * @return the degeneracy of r, i.e. the number of vectors R at the minimum
+ * distance, or 0 if r is not in the Wigner Seitz zone.
+ */
+double wsDegeneracy(const Eigen::Matrix3d &directUnitCell,
+                    const Eigen::Vector3i &grid, const int &nx,
+                    const int &i0, const int &i1, const int &i2,
+                    const Eigen::Vector3d &shift) {
+  // We calculate |r-R|
+  std::vector<double> distances;
+  distances.reserve((2 * nx + 3) * (2 * nx + 3) * (2 * nx + 3));
+  for (int j0 = -nx - 1; j0 <= nx + 1; j0++) {
+    for (int j1 = -nx - 1; j1 <= nx + 1; j1++) {
+      for (int j2 = -nx - 1; j2 <= nx + 1; j2++) {
+        Eigen::Vector3d dist;
+        dist(0) = i0 - j0 * grid(0);
+        dist(1) = i1 - j1 * grid(1);
+        dist(2) = i2 - j2 * grid(2);
+        // distances in cartesian space
+        dist = directUnitCell * dist;
+        dist += shift;
+        distances.push_back(dist.norm());
+      }
+    }
+  }
+
+  // find the minimum distance out of all distances
+  double distMin = *min_element(distances.begin(), distances.end());
+
+  // the point at midIndex is the reference "n" vector
+  // i.e. the one generated by j0=j1=j2=0
+  unsigned int midIndex = distances.size() / 2;
+  if (abs(distances[midIndex] - distMin) >= 1.0e-6) {
+    return 0.;
+  }
+  // count its degeneracy
+  double degeneracy = 0.;
+  for (double dist : distances) {
+    if (abs(dist - distMin) < 1.0e-6) {
+      degeneracy += 1.;
+    }
+  }
+  return degeneracy;
+}
+
+/** Computes wsDegeneracy for all the vectors of super cell A, i.e. the
+ * vectors (i0,i1,i2) with |i_j| <= nx*grid(j). Vectors are ordered with i2
+ * running fastest. The work is parallelized with OpenMP.
+ */
+std::vector<double> wsDegeneracies(const Eigen::Matrix3d &directUnitCell,
+                                   const Eigen::Vector3i &grid, const int &nx,
+                                   const Eigen::Vector3d &shift) {
+  int n0 = 2 * nx * grid(0) + 1;
+  int n1 = 2 * nx * grid(1) + 1;
+  int n2 = 2 * nx * grid(2) + 1;
+  int numCandidates = n0 * n1 * n2;
+  std::vector<double> degeneracies(numCandidates, 0.);
+#pragma omp parallel for
+  for (int iC = 0; iC < numCandidates; iC++) {
+    int i0 = iC / (n1 * n2) - nx * grid(0);
+    int i1 = (iC / n2) % n1 - nx * grid(1);
+    int i2 = iC % n2 - nx * grid(2);
+    degeneracies[iC] =
+        wsDegeneracy(directUnitCell, grid, nx, i0, i1, i2, shift);
+  }
+  return degeneracies;
+}
+
+/** Inverse of the ordering used by wsDegeneracies: crystal coordinates of
+ * the vector of super cell A at index iC.
+ */
+Eigen::Vector3d wsCandidateVector(const Eigen::Vector3i &grid, const int &nx,
+                                  const int &iC) {
+  int n1 = 2 * nx * grid(1) + 1;
+  int n2 = 2 * nx * grid(2) + 1;
+  Eigen::Vector3d x;
+  x << iC / (n1 * n2) - nx * grid(0), (iC / n2) % n1 - nx * grid(1),
+      iC % n2 - nx * grid(2);
+  return x;
+}
+
 std::tuple<Eigen::MatrixXd, Eigen::VectorXd>
 Crystal::buildWignerSeitzVectors(const Eigen::Vector3i &grid,
                                  const int &superCellFactor) {
 
-  int nx = superCellFactor;
-
-  std::vector<Eigen::Vector3d> tmpVectors;
-  std::vector<int> tmpDegeneracies;
+  std::vector<double> key =
+      wsCacheKey(grid, superCellFactor, Eigen::MatrixXd::Zero(3, 0));
+  auto cached = wsVectorsCache.find(key);
+  if (cached != wsVectorsCache.end()) {
+    return cached->second;
+  }
 
-  // the point at midIndex is the reference "n" vector
-  // i.e. the one generated by i0=i1=i2=0
-  // if it's the minimum vector, than it's in the
-  // Wigner Seitz zone of super cell A.
-  // Therefore we save this vector.
-  int midIndex = pow(2*(nx + 1)+1,3);
-  midIndex /= 2;
+  int nx = superCellFactor;
 
   // what are we doing:
   // the "n" specifies a grid of lattice vectors, that are (2*(cutoff+1)+1)^3
@@ -373,54 +469,23 @@ Crystal::buildWignerSeitzVectors(const Eigen::Vector3i &grid,
   // equal to the grid of wavevectors would be the bare minimum for the
   // interpolation to work, and wouldn't be enough for anything good.
 
-  // now, we loop over the vectors of super cell A, build a vector r.
-  for (int i0 = -nx * grid(0); i0 <= nx * grid(0); i0++) {
-    for (int i1 = -nx * grid(1); i1 <= nx * grid(1); i1++) {
-      for (int i2 = -nx * grid(2); i2 <= nx * grid(2); i2++) {
-        // loop over a super cell B of size ((searchSize+1)*2+1)^3
-        // bigger than super cell A. We compute the distance between any
-        // vector in super cell B w.r.t. the vector "n"
-
-        // We calculate |r-R|^2
-        std::vector<double> distances;
-        for (int j0 = -nx - 1; j0 <= nx + 1; j0++) {
-          for (int j1 = -nx - 1; j1 <= nx + 1; j1++) {
-            for (int j2 = -nx - 1; j2 <= nx + 1; j2++) {
-              Eigen::Vector3d dist;
-              dist(0) = i0 - j0 * grid(0);
-              dist(1) = i1 - j1 * grid(1);
-              dist(2) = i2 - j2 * grid(2);
-              // distances in cartesian space
-              dist = directUnitCell * dist;
-              double dist2 = dist.norm();
-              distances.push_back(dist2);
-            }
-          }
-        }
-
-        // find the minimum distance out of all distances
-        double distMin = *min_element(distances.begin(), distances.end());
-
-        if (abs(distances[midIndex] - distMin) < 1.0e-6) {
-          // count its degeneracy
-          int degeneracy = 0;
-          for (double dist : distances) {
-            if (abs(dist - distMin) < 1.0e-6) { ++degeneracy; }
-          }
-          tmpDegeneracies.push_back(degeneracy);
+  // now, we loop over the vectors of super cell A, and keep those in the WS
+  std::vector<double> candidateDegeneracies =
+      wsDegeneracies(directUnitCell, grid, nx, Eigen::Vector3d::Zero());
 
-          // store vector
-          Eigen::Vector3d thisVec = {double(i0), double(i1), double(i2)};
-          tmpVectors.push_back(thisVec);
-        }
-      }
+  std::vector<Eigen::Vector3d> tmpVectors;
+  std::vector<double> tmpDegeneracies;
+  for (int iC = 0; iC < int(candidateDegeneracies.size()); iC++) {
+    if (candidateDegeneracies[iC] > 0.) {
+      tmpDegeneracies.push_back(candidateDegeneracies[iC]);
+      tmpVectors.push_back(wsCandidateVector(grid, nx, iC));
     }
   }
 
   // check that we found all vectors
   double tot = 0.;
-  for (int x : tmpDegeneracies) {
-    tot += 1. / double(x);
+  for (double x : tmpDegeneracies) {
+    tot += 1. / x;
   }
   if (abs(tot - grid(0) * grid(1) * grid(2)) > 1.0e-6) {
     std::cout << grid(0) * grid(1) * grid(2) << " " << tot << "\n";
@@ -455,7 +520,9 @@ Crystal::buildWignerSeitzVectors(const Eigen::Vector3i &grid,
   positionVectors.col(0) = tmpV1;
   positionVectors.col(originIndex) = tmpV2;
 
-  return std::make_tuple(positionVectors, positionDegeneracies);
+  auto result = std::make_tuple(positionVectors, positionDegeneracies);
+  wsVectorsCache[key] = result;
+  return result;
 }
 
 std::tuple<Eigen::MatrixXd, Eigen::Tensor<double, 3>>
@@ -470,14 +537,13 @@ Crystal::buildWignerSeitzVectorsWithShift(const Eigen::Vector3i &grid,
   }
   auto shiftDims = int(shift.cols());
 
-  int nx = superCellFactor;
+  std::vector<double> key = wsCacheKey(grid, superCellFactor, shift);
+  auto cached = wsShiftVectorsCache.find(key);
+  if (cached != wsShiftVectorsCache.end()) {
+    return cached->second;
+  }
 
-  int maxVectors = 2 * nx * grid(0) + 1;
-  maxVectors *= 2 * nx * grid(1) + 1;
-  maxVectors *= 2 * nx * grid(2) + 1;
-  Eigen::MatrixXd tmpNumPoints(shiftDims, shiftDims);
-  Eigen::Tensor<double, 3> tmpDegeneraciesAll(shiftDims, shiftDims, maxVectors);
-  Eigen::Tensor<double, 4> tmpVectorsAll(shiftDims, shiftDims, maxVectors, 3);
+  int nx = superCellFactor;
 
   // what are we doing:
   // the "n" specifies a grid of lattice vectors, that are (2*(cutoff+1)+1)^3
@@ -485,106 +551,27 @@ Crystal::buildWignerSeitzVectorsWithShift(const Eigen::Vector3i &grid,
   // equal to the grid of wavevectors would be the bare minimum for the
   // interpolation to work, and wouldn't be enough for anything good.
 
+  // algorithm as before, except the shift, for each pair of shifts
+  std::vector<std::vector<double>> candidateDegeneracies(shiftDims *
+                                                         shiftDims);
   for (int iDim = 0; iDim < shiftDims; iDim++) {
     for (int jDim = 0; jDim < shiftDims; jDim++) {
-      // algorithm as before, except the shift
-
-      std::vector<Eigen::Vector3d> tmpVectors;
-      std::vector<double> tmpDegeneracies;
-
-      // now, we loop over the vectors of super cell A, build a vector r.
-      for (int i0 = -nx * grid(0); i0 <= nx * grid(0); i0++) {
-        for (int i1 = -nx * grid(1); i1 <= nx * grid(1); i1++) {
-          for (int i2 = -nx * grid(2); i2 <= nx * grid(2); i2++) {
-            // loop over a super cell B of size ((searchSize+1)*2+1)^3
-            // bigger than super cell A. We compute the distance between any
-            // vector in super cell B w.r.t. the vector "n"
-
-            // We calculate |r-R|^2
-            std::vector<double> distances;
-            for (int j0 = -nx - 1; j0 <= nx + 1; j0++) {
-              for (int j1 = -nx - 1; j1 <= nx + 1; j1++) {
-                for (int j2 = -nx - 1; j2 <= nx + 1; j2++) {
-                  Eigen::Vector3d dist;
-                  dist(0) = i0 - j0 * grid(0);
-                  dist(1) = i1 - j1 * grid(1);
-                  dist(2) = i2 - j2 * grid(2);
-                  // distances in cartesian space
-                  dist = directUnitCell * dist;
-
-                  dist += shift.col(jDim) - shift.col(iDim);
-
-                  double dist2 = dist.norm();
-                  distances.push_back(dist2);
-                }
-              }
-            }
-
-            // find the minimum distance out of all distances
-            double distMin = distances[0]; // [0] is just the first guess
-            for (double dist : distances) {
-              if (dist < distMin) {
-                distMin = dist;
-              }
-            }
-
-            // the point at midIndex is the reference "n" vector
-            // i.e. the one generated by i0=i1=i2=0
-            // if it's the minimum vector, than it's in the
-            // Wigner Seitz zone of super cell A.
-            // Therefore we save this vector.
-            unsigned int midIndex = distances.size() / 2;
-            if (abs(distances[midIndex] - distMin) < 1.0e-6) {
-              // count its degeneracy
-              double degeneracy = 0.;
-              for (double dist : distances) {
-                if (abs(dist - distMin) < 1.0e-6) {
-                  degeneracy += 1.;
-                }
-              }
-
-              tmpDegeneracies.push_back(degeneracy);
-
-              // store vector
-              Eigen::Vector3d thisVec;
-              thisVec << i0, i1, i2;
-              tmpVectors.push_back(thisVec);
-            }
-          }
-        }
-      }
-
-      tmpNumPoints(iDim, jDim) = int(tmpVectors.size());
-      for (unsigned int iR = 0; iR < tmpVectors.size(); iR++) {
-        tmpDegeneraciesAll(iDim, jDim, iR) = tmpDegeneracies[iR];
-        for (int i : {0, 1, 2}) {
-          tmpVectorsAll(iDim, jDim, iR, i) = tmpVectors[iR](i);
-        }
-      }
+      Eigen::Vector3d thisShift = shift.col(jDim) - shift.col(iDim);
+      candidateDegeneracies[iDim * shiftDims + jDim] =
+          wsDegeneracies(directUnitCell, grid, nx, thisShift);
     }
   }
 
-  // find the unique set of vectors, so it's a smaller list
+  // find the unique set of vectors, so it's a smaller list.
+  // Vectors are identified by their index in super cell A
+  auto numCandidates = int(candidateDegeneracies[0].size());
+  std::vector<int> candidateToUnique(numCandidates, -1);
   std::vector<Eigen::Vector3d> tmpVectors;
-  for (int iDim = 0; iDim < shiftDims; iDim++) {
-    for (int jDim = 0; jDim < shiftDims; jDim++) {
-      for (int iR = 0; iR < tmpNumPoints(iDim, jDim); iR++) {
-        Eigen::Vector3d x;
-        for (int i : {0, 1, 2}) {
-          x(i) = tmpVectorsAll(iDim, jDim, iR, i);
-        }
-        bool found = false;
-        if (tmpVectors.empty())
-          found = true; // if empty, add vector
-        for (const Eigen::Vector3d &y : tmpVectors) {
-          if ((x - y).squaredNorm() < 1.0e-6) {
-            found = true;
-            break;
-          }
-        }
-        if (found) {
-          tmpVectors.push_back(x);
-        }
+  for (const auto &thisDegeneracies : candidateDegeneracies) {
+    for (int iC = 0; iC < numCandidates; iC++) {
+      if (thisDegeneracies[iC] > 0. && candidateToUnique[iC] == -1) {
+        candidateToUnique[iC] = int(tmpVectors.size());
+        tmpVectors.push_back(wsCandidateVector(grid, nx, iC));
       }
     }
   }
@@ -595,19 +582,12 @@ Crystal::buildWignerSeitzVectorsWithShift(const Eigen::Vector3i &grid,
   degeneracies.setZero(); // important!
   for (int iDim = 0; iDim < shiftDims; iDim++) {
     for (int jDim = 0; jDim < shiftDims; jDim++) {
-      for (int iR = 0; iR < tmpNumPoints(iDim, jDim); iR++) {
-        Eigen::Vector3d x;
-        for (int i : {0, 1, 2}) {
-          x(i) = tmpVectorsAll(iDim, jDim, iR, i);
-        }
-        double deg = tmpDegeneraciesAll(iDim, jDim, iR);
-        int iRNew = 0;
-        for (const Eigen::Vector3d &y : tmpVectors) {
-          if ((x - y).squaredNorm() < 1.0e-6) {
-            degeneracies(iDim, jDim, iRNew) = deg;
-            break;
-          }
-          ++iRNew;
+      const auto &thisDegeneracies =
+          candidateDegeneracies[iDim * shiftDims + jDim];
+      for (int iC = 0; iC < numCandidates; iC++) {
+        if (thisDegeneracies[iC] > 0.) {
+          degeneracies(iDim, jDim, candidateToUnique[iC]) =
+              thisDegeneracies[iC];
         }
       }
     }
@@ -635,7 +615,9 @@ Crystal::buildWignerSeitzVectorsWithShift(const Eigen::Vector3i &grid,
       }
     }
   }
-  return std::make_tuple(bravaisVectors, degeneracies);
+  auto result = std::make_tuple(bravaisVectors, degeneracies);
+  wsShiftVectorsCache[key] = result;
+  return result;
 }
 
 // change of basis methods
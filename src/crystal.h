@@ -2,7 +2,9 @@
 #define CRYSTAL_H
 
 #include "eigen.h"
+#include <map>
 #include <string>
+#include <tuple>
 #include <vector>
 #include "context.h"
 
@@ -56,6 +58,18 @@ protected:
   std::vector<SymmetryOperation> symmetryOperations;
   int numSymmetries;
 
+  // Wigner Seitz vectors already built, reused by the several harmonic and
+  // interaction objects. The key contains the grid, the super cell factor,
+  // the unit cell and the shift
+  std::map<std::vector<double>, std::tuple<Eigen::MatrixXd, Eigen::VectorXd>>
+      wsVectorsCache;
+  std::map<std::vector<double>,
+           std::tuple<Eigen::MatrixXd, Eigen::Tensor<double, 3>>>
+      wsShiftVectorsCache;
+  std::vector<double> wsCacheKey(const Eigen::Vector3i &grid,
+                                 const int &superCellFactor,
+                                 const Eigen::MatrixXd &shift);
+
 public:
   /** Class containing the information on the crystal structure
    * Note: a number of important quantities used throughout the code are
@@ -194,6 +208,8 @@ public:
    * @return: a tuple with bravaisLatticeVectors(3,numVectors) in cartesian
    * coordinates and their degeneracies(numVectors).
    * Note: the weights to be used for integrations are 1/degeneracies.
+   * Note: results are cached, so that later calls with the same grid are
+   * free.
    */
   std::tuple<Eigen::MatrixXd, Eigen::VectorXd>
   buildWignerSeitzVectors(const Eigen::Vector3i &grid,
@@ -221,6 +237,7 @@ public:
    * two indices must be used in conjunction with the meaning of shift. Some
    * weights might be set to zero if they don't fall in the WS zone.
    * Note: the weights to be used for integrations are 1/degeneracies.
+   * Note: results are cached, as in buildWignerSeitzVectors.
    */
   std::tuple<Eigen::MatrixXd, Eigen::Tensor<double, 3>>
   buildWignerSeitzVectorsWithShift(const Eigen::Vector3i &grid,
@@ -3,6 +3,8 @@
 #include "context.h"
 #include "exceptions.h"
 #include "utilities.h"
+#include <algorithm>
+#include <limits>
 
 DeltaFunction::~DeltaFunction() {}
 
@@ -14,6 +16,48 @@ int AdaptiveGaussianDeltaFunction::getType() { return id; }
 
 int TetrahedronDeltaFunction::getType() { return id; }
 
+Eigen::VectorXd DeltaFunction::getSmearings(const Eigen::VectorXd &energies,
+                                            const Eigen::MatrixXd &velocities) {
+  auto numEntries = int(energies.size());
+  Eigen::VectorXd smearings(numEntries);
+  for (int i = 0; i < numEntries; i++) {
+    if (velocities.rows() == 0) {
+      smearings(i) = getSmearing(energies(i));
+    } else {
+      Eigen::Vector3d v = velocities.row(i);
+      smearings(i) = getSmearing(energies(i), v);
+    }
+  }
+  return smearings;
+}
+
+DeviceDeltaFunction DeltaFunction::getDeviceDeltaFunction() {
+  Error("This smearing can't be evaluated on the device");
+  return {};
+}
+
+DeviceDeltaFunction GaussianDeltaFunction::getDeviceDeltaFunction() {
+  DeviceDeltaFunction deviceDelta;
+  deviceDelta.type = gaussian;
+  deviceDelta.inverseWidth = inverseWidth;
+  deviceDelta.prefactor = prefactor;
+  return deviceDelta;
+}
+
+DeviceDeltaFunction AdaptiveGaussianDeltaFunction::getDeviceDeltaFunction() {
+  DeviceDeltaFunction deviceDelta;
+  deviceDelta.type = adaptiveGaussian;
+  deviceDelta.prefactor = prefactor;
+  deviceDelta.broadeningCutoff = broadeningCutoff;
+  deviceDelta.erf2 = erf2;
+  for (int i : {0, 1, 2}) {
+    for (int j : {0, 1, 2}) {
+      deviceDelta.qTensor[i][j] = qTensor(i, j);
+    }
+  }
+  return deviceDelta;
+}
+
 // app factory
 DeltaFunction *
 DeltaFunction::smearingFactory(Context &context,
@@ -44,6 +88,16 @@ double GaussianDeltaFunction::getSmearing(const double &energy,
   return prefactor * exp(-x * x);
 }
 
+Eigen::VectorXd
+GaussianDeltaFunction::getSmearings(const Eigen::VectorXd &energies,
+                                    const Eigen::MatrixXd &velocities) {
+  (void)velocities;
+  Eigen::ArrayXd x = energies.array() * inverseWidth;
+  // same cutoff as getSmearing()
+  Eigen::ArrayXd smearings = (x > 6.).select(0., prefactor * (-x * x).exp());
+  return smearings.matrix();
+}
+
 double GaussianDeltaFunction::getSmearing(const double &energy,
                                           StateIndex &is) {
   (void)energy;
@@ -95,6 +149,31 @@ AdaptiveGaussianDeltaFunction::getSmearing(const double &energy,
   return exp(-x * x) / sqrtPi / sigma / erf2;
 }
 
+Eigen::VectorXd AdaptiveGaussianDeltaFunction::getSmearings(
+    const Eigen::VectorXd &energies, const Eigen::MatrixXd &velocities) {
+  if (velocities.rows() != energies.size() || velocities.cols() != 3) {
+    Error("Adaptive smearing needs one velocity per energy");
+  }
+  // sigma of all entries at once, same as in getSmearing()
+  Eigen::ArrayXd sigma =
+      prefactor * ((velocities * qTensor.transpose()).rowwise().squaredNorm()
+                       .array() / 6.).sqrt();
+  Eigen::ArrayXd sigmaCut = sigma.max(broadeningCutoff);
+  Eigen::ArrayXd x = energies.array() / sigmaCut;
+  Eigen::ArrayXd smearings = (-x * x).exp() / sqrtPi / sigmaCut / erf2;
+
+  // apply the masks of the special cases
+  Eigen::ArrayXd vNorms = velocities.rowwise().squaredNorm().array();
+  for (int i = 0; i < int(energies.size()); i++) {
+    if (vNorms(i) == 0. && energies(i) == 0.) {
+      smearings(i) = 1.;
+    } else if (sigma(i) == 0. || abs(energies(i)) > 2. * sigmaCut(i)) {
+      smearings(i) = 0.;
+    }
+  }
+  return smearings.matrix();
+}
+
 double AdaptiveGaussianDeltaFunction::getSmearing(const double &energy,
                                                   StateIndex &is) {
   (void)energy;
@@ -155,23 +234,188 @@ TetrahedronDeltaFunction::TetrahedronDeltaFunction(
   vertices.row(5) << 1, 2, 3, 5;
 }
 
+/** Contribution of one tetrahedron to the weight of a state, given the
+ * sorted energies ee1 <= ee2 <= ee3 <= ee4 of its vertices.
+ * We follow Eq. B6 of Lambin and Vigneron PRB 29 3430 (1984)
+ */
+double tetrahedronWeight(const double &energy, const double &ee1,
+                         const double &ee2, const double &ee3,
+                         const double &ee4) {
+  double cnE = 0.;
+  if (ee1 <= energy && energy <= ee2) {
+    if ( ee2==ee1 || ee3==ee1 || ee4==ee1 ) {
+      cnE = 0.;
+    } else {
+      cnE = 3. * (energy-ee1)*(energy-ee1) / (ee2-ee1) / (ee3-ee1) / (ee4-ee1);
+    }
+  } else if (ee2 <= energy && energy <= ee3) {
+
+    cnE = 0.;
+    if ( ee4==ee2 || ee3==ee2 || ee3==ee1 ) {
+      cnE += 0.;
+    } else {
+      cnE += (ee3-energy)*(energy-ee2) / (ee4-ee2) / (ee3-ee2) / (ee3-ee1);
+    }
+    if ( ee4==ee1 || ee4==ee2 || ee3==ee1 ) {
+      cnE += 0.;
+    } else {
+      cnE += (ee4-energy)*(energy-ee1) / (ee4-ee1) / (ee4-ee2) / (ee3-ee1);
+    }
+    cnE *= 3.;
+
+  } else if (ee3 <= energy && energy <= ee4) {
+    if ( ee4==ee1 || ee4==ee2 || ee4==ee3 ) {
+      cnE = 0.;
+    } else {
+      cnE = 3. * (ee4-energy)*(ee4-energy) / (ee4-ee1) / (ee4-ee2) / (ee4-ee3);
+    }
+  }
+
+  // exception
+  if ((ee1 == ee2) && (ee1 == ee3) && (ee1 == ee4) && (energy == ee1)) {
+    cnE = 0.25;
+  }
+  return cnE;
+}
+
+void TetrahedronDeltaFunction::precomputeTetrahedra() {
+  if (!tetraEnergies[0].empty()) {
+    return;
+  }
+  int numStates = fullBandStructure.getNumStates();
+  for (auto &x : tetraEnergies) {
+    x.resize(numStates * 6);
+  }
+#pragma omp parallel for
+  for (int is = 0; is < numStates; is++) {
+    StateIndex isIdx(is);
+    Eigen::MatrixXd energies = getTetrahedraEnergies(isIdx);
+    for (int iTetra = 0; iTetra < 6; iTetra++) {
+      for (int i = 0; i < 4; i++) {
+        tetraEnergies[i][is * 6 + iTetra] = energies(iTetra, i);
+      }
+    }
+  }
+
+  // index of the tetrahedra of the irreducible states, used by getDOS()
+  std::vector<int> irrStates = fullBandStructure.irrStateIterator();
+  std::vector<double> degeneracies(irrStates.size());
+  for (size_t i = 0; i < irrStates.size(); i++) {
+    StateIndex isIdx(irrStates[i]);
+    degeneracies[i] =
+        double(fullBandStructure.getRotationsStar(isIdx).size());
+  }
+  std::vector<std::pair<int, double>> entries;
+  for (size_t i = 0; i < irrStates.size(); i++) {
+    for (int iTetra = 0; iTetra < 6; iTetra++) {
+      int iEntry = irrStates[i] * 6 + iTetra;
+      if (tetraEnergies[0][iEntry] < std::numeric_limits<double>::max()) {
+        entries.emplace_back(iEntry, degeneracies[i]);
+      }
+    }
+  }
+  std::sort(entries.begin(), entries.end(),
+            [&](const std::pair<int, double> &a,
+                const std::pair<int, double> &b) {
+              return tetraEnergies[0][a.first] < tetraEnergies[0][b.first];
+            });
+  dosTetrahedra.resize(entries.size());
+  dosDegeneracies.resize(entries.size());
+  dosMinEnergies.resize(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    dosTetrahedra[i] = entries[i].first;
+    dosDegeneracies[i] = entries[i].second;
+    dosMinEnergies[i] = tetraEnergies[0][entries[i].first];
+  }
+}
+
 double TetrahedronDeltaFunction::getDOS(const double &energy) {
   // initialize tetrahedron weight
   double weight = 0.;
-  for (int is : fullBandStructure.irrStateIterator()) {
-    auto isIndex = StateIndex(is);
-    double degeneracy = double(fullBandStructure.getRotationsStar(isIndex).size());
-    weight += getSmearing(energy, isIndex) * degeneracy;
+  if (!tetraEnergies[0].empty()) {
+    // only the tetrahedra with the lowest vertex below energy contribute
+    auto numCandidates = int(
+        std::upper_bound(dosMinEnergies.begin(), dosMinEnergies.end(), energy) -
+        dosMinEnergies.begin());
+    for (int i = 0; i < numCandidates; i++) {
+      int iEntry = dosTetrahedra[i];
+      if (tetraEnergies[3][iEntry] < energy) continue;
+      weight += tetrahedronWeight(energy, tetraEnergies[0][iEntry],
+                                  tetraEnergies[1][iEntry],
+                                  tetraEnergies[2][iEntry],
+                                  tetraEnergies[3][iEntry]) *
+                dosDegeneracies[i];
+    }
+    weight /= 6.;
+  } else {
+    for (int is : fullBandStructure.irrStateIterator()) {
+      auto isIndex = StateIndex(is);
+      double degeneracy =
+          double(fullBandStructure.getRotationsStar(isIndex).size());
+      weight += getSmearing(energy, isIndex) * degeneracy;
+    }
   }
   weight /= double(fullBandStructure.getNumPoints(true));
   return weight;
 }
 
-double TetrahedronDeltaFunction::getSmearing(const double &energy,
-                                             StateIndex &is) {
+std::vector<double> TetrahedronDeltaFunction::getDOS(const double &minEnergy,
+                                                    const double &deltaEnergy,
+                                                    const int &numEnergies) {
+  if (tetraEnergies[0].empty()) {
+    Error("Developer error: call precomputeTetrahedra() before getDOS()");
+  }
+  std::vector<double> dos(numEnergies, 0.);
+  if (numEnergies <= 0) {
+    return dos;
+  }
+  double maxEnergy = minEnergy + (numEnergies - 1) * deltaEnergy;
+  // tetrahedra whose lowest vertex is above the grid don't contribute
+  auto numCandidates = int(
+      std::upper_bound(dosMinEnergies.begin(), dosMinEnergies.end(),
+                       maxEnergy) - dosMinEnergies.begin());
+
+#pragma omp parallel
+  {
+    std::vector<double> dosPrivate(numEnergies, 0.);
+#pragma omp for
+    for (int i = 0; i < numCandidates; i++) {
+      int iEntry = dosTetrahedra[i];
+      double ee1 = tetraEnergies[0][iEntry];
+      double ee4 = tetraEnergies[3][iEntry];
+      if (ee4 < minEnergy) continue;
+      // grid points in [ee1,ee4]
+      int iFirst = std::max(0, int(std::ceil((ee1 - minEnergy) / deltaEnergy)));
+      int iLast = std::min(numEnergies - 1,
+                           int(std::floor((ee4 - minEnergy) / deltaEnergy)));
+      for (int iEnergy = iFirst; iEnergy <= iLast; iEnergy++) {
+        double energy = minEnergy + iEnergy * deltaEnergy;
+        dosPrivate[iEnergy] +=
+            tetrahedronWeight(energy, ee1, tetraEnergies[1][iEntry],
+                              tetraEnergies[2][iEntry], ee4) *
+            dosDegeneracies[i];
+      }
+    }
+#pragma omp critical
+    for (int iEnergy = 0; iEnergy < numEnergies; iEnergy++) {
+      dos[iEnergy] += dosPrivate[iEnergy];
+    }
+  }
+
+  double norm = 6. * double(fullBandStructure.getNumPoints(true));
+  for (double &x : dos) {
+    x /= norm;
+  }
+  return dos;
+}
+
+Eigen::MatrixXd
+TetrahedronDeltaFunction::getTetrahedraEnergies(StateIndex &is) {
   auto t = fullBandStructure.getIndex(is);
   int ik = std::get<0>(t).get();
-  auto ibIndex = std::get<1>(t);
+  // the band is matched at the corners using its index without the window
+  int ibFull = fullBandStructure.getFullBandIndex(std::get<0>(t),
+                                                  std::get<1>(t));
 
   // if the mesh is uniform, each k-point belongs to 6 tetrahedra
 
@@ -189,75 +433,75 @@ double TetrahedronDeltaFunction::getSmearing(const double &energy,
     kVectorsSubCell.row(i) = kCoordinates + x;
   }
 
-  Eigen::VectorXi ikSubCellIndices(8);
-  ikSubCellIndices(0) = ik;
-  for ( int i=1; i<8; i++) {
-    ikSubCellIndices(i) = fullPoints.getIndex(kVectorsSubCell.row(i));
-  }
-
+  // With a window, a corner state may not be stored, either because the
+  // wavevector or because the band was discarded. Such corners are treated
+  // as out of the window, i.e. their tetrahedra don't contribute.
   Eigen::VectorXd energies(8);
+  std::vector<bool> isCornerStored(8, true);
   for ( int i=0; i<8; i++) {
-    int is1 = fullBandStructure.getIndex(WavevectorIndex(ikSubCellIndices(i)),ibIndex);
+    int ikCorner = ik;
+    if (i > 0) {
+      ikCorner = fullPoints.isPointStored(kVectorsSubCell.row(i));
+    }
+    if (ikCorner < 0) {
+      isCornerStored[i] = false;
+      continue;
+    }
+    WavevectorIndex ikCornerIdx(ikCorner);
+    int ibCorner = ibFull - fullBandStructure.getFullBandIndex(ikCornerIdx,
+                                                               BandIndex(0));
+    if (ibCorner < 0 || ibCorner >= fullBandStructure.getNumBands(ikCornerIdx)) {
+      isCornerStored[i] = false;
+      continue;
+    }
+    int is1 = fullBandStructure.getIndex(ikCornerIdx, BandIndex(ibCorner));
     StateIndex is1Idx(is1);
     energies(i) = fullBandStructure.getEnergy(is1Idx);
   }
 
-  // initialize tetrahedron weight
-  double numTetra = 0.;
-  double weight = 0.;
+  // sorted energies of the vertices of each tetrahedron.
+  // Missing tetrahedra are marked by the largest double
+  Eigen::MatrixXd tetraEnergies_(6, 4);
   for (int iTetra=0; iTetra<6; iTetra++) {
+    if (!isCornerStored[vertices(iTetra, 0)] ||
+        !isCornerStored[vertices(iTetra, 1)] ||
+        !isCornerStored[vertices(iTetra, 2)] ||
+        !isCornerStored[vertices(iTetra, 3)]) {
+      tetraEnergies_.row(iTetra).setConstant(std::numeric_limits<double>::max());
+      continue;
+    }
     std::vector<double> tmp(4);
-    tmp[0] = energies(vertices(iTetra,0));
-    tmp[1] = energies(vertices(iTetra,1));
-    tmp[2] = energies(vertices(iTetra,2));
-    tmp[3] = energies(vertices(iTetra,3));
+    for (int i = 0; i < 4; i++) {
+      tmp[i] = energies(vertices(iTetra, i));
+    }
     std::sort(tmp.begin(), tmp.end());
-    double ee1 = tmp[0];
-    double ee2 = tmp[1];
-    double ee3 = tmp[2];
-    double ee4 = tmp[3];
-
-    // We follow Eq. B6 of Lambin and Vigneron PRB 29 3430 (1984)
-
-    double cnE = 0.;
-    if (ee1 <= energy && energy <= ee2) {
-      if ( ee2==ee1 || ee3==ee1 || ee4==ee1 ) {
-        cnE = 0.;
-      } else {
-        cnE = 3. * (energy-ee1)*(energy-ee1) / (ee2-ee1) / (ee3-ee1) / (ee4-ee1);
-      }
-    } else if (ee2 <= energy && energy <= ee3) {
-
-      cnE = 0.;
-      if ( ee4==ee2 || ee3==ee2 || ee3==ee1 ) {
-        cnE += 0.;
-      } else {
-        cnE += (ee3-energy)*(energy-ee2) / (ee4-ee2) / (ee3-ee2) / (ee3-ee1);
-      }
-      if ( ee4==ee1 || ee4==ee2 || ee3==ee1 ) {
-        cnE += 0.;
-      } else {
-        cnE += (ee4-energy)*(energy-ee1) / (ee4-ee1) / (ee4-ee2) / (ee3-ee1);
-      }
-      cnE *= 3.;
-
-    } else if (ee3 <= energy && energy <= ee4) {
-      if ( ee4==ee1 || ee4==ee2 || ee4==ee3 ) {
-        cnE = 0.;
-      } else {
-        cnE = 3. * (ee4-energy)*(ee4-energy) / (ee4-ee1) / (ee4-ee2) / (ee4-ee3);
-      }
+    for (int i = 0; i < 4; i++) {
+      tetraEnergies_(iTetra, i) = tmp[i];
     }
+  }
+  return tetraEnergies_;
+}
 
-    // exception
-    if ((ee1 == ee2) && (ee1 == ee3) && (ee1 == ee4) & (energy == ee1)) {
-      cnE = 0.25;
+double TetrahedronDeltaFunction::getSmearing(const double &energy,
+                                             StateIndex &is) {
+  // initialize tetrahedron weight
+  double numTetra = 6.;
+  double weight = 0.;
+  if (!tetraEnergies[0].empty()) {
+    int iStart = is.get() * 6;
+    for (int iTetra = iStart; iTetra < iStart + 6; iTetra++) {
+      weight += tetrahedronWeight(
+          energy, tetraEnergies[0][iTetra], tetraEnergies[1][iTetra],
+          tetraEnergies[2][iTetra], tetraEnergies[3][iTetra]);
     }
-
-    numTetra += 1.;
-
-    weight += cnE;
-  } // loop over all tetrahedra
+  } else {
+    Eigen::MatrixXd energies = getTetrahedraEnergies(is);
+    for (int iTetra = 0; iTetra < 6; iTetra++) {
+      weight += tetrahedronWeight(energy, energies(iTetra, 0),
+                                  energies(iTetra, 1), energies(iTetra, 2),
+                                  energies(iTetra, 3));
+    }
+  }
 
   // Zero out extremely small weights
   if (weight < 1.0e-12) {
@@ -269,6 +513,25 @@ double TetrahedronDeltaFunction::getSmearing(const double &energy,
   return weight;
 }
 
+std::tuple<double, double>
+TetrahedronDeltaFunction::getEnergyRange(StateIndex &is) {
+  if (tetraEnergies[0].empty()) {
+    Error("Developer error: call precomputeTetrahedra() before getEnergyRange()");
+  }
+  double minEnergy = std::numeric_limits<double>::max();
+  double maxEnergy = std::numeric_limits<double>::lowest();
+  int iStart = is.get() * 6;
+  for (int iTetra = iStart; iTetra < iStart + 6; iTetra++) {
+    // skip the tetrahedra with missing corners
+    if (tetraEnergies[0][iTetra] == std::numeric_limits<double>::max()) {
+      continue;
+    }
+    minEnergy = std::min(minEnergy, tetraEnergies[0][iTetra]);
+    maxEnergy = std::max(maxEnergy, tetraEnergies[3][iTetra]);
+  }
+  return std::make_tuple(minEnergy, maxEnergy);
+}
+
 double TetrahedronDeltaFunction::getSmearing(const double &energy,
                                              const Eigen::Vector3d &velocity) {
   (void)energy;
@@ -5,6 +5,9 @@
 #include "context.h"
 #include "eigen.h"
 #include "points.h"
+#include <Kokkos_Core.hpp>
+
+struct DeviceDeltaFunction;
 
 /** Base class for the approximations to the Delta Function.
  * Currently used for density of states calculation or for transport
@@ -50,15 +53,79 @@ public:
    */
   virtual double getSmearing(const double &energy, StateIndex &is) = 0;
 
+  /** Method for obtaining the smearing values of a block of states at once,
+   * e.g. all the band triplets of a pair of wavevectors.
+   * The default implementation calls getSmearing() for each entry.
+   * @param energies: the energy differences of the dirac deltas.
+   * @param velocities: (numEntries x 3) velocity differences, used by the
+   * adaptive smearing. Can be left empty for the gaussian smearing.
+   * @return smearings: the values of getSmearing() for each entry.
+   */
+  virtual Eigen::VectorXd getSmearings(const Eigen::VectorXd &energies,
+                                       const Eigen::MatrixXd &velocities);
+
   /** Method to identify which kind of smearing is being used.
    * Returns a int value between gaussian, adaptiveGaussian, tetrahedron.
    */
   virtual int getType();
 
+  /** Returns a copy of the smearing that can be evaluated inside Kokkos
+   * kernels. Only implemented for the gaussian schemes.
+   */
+  virtual DeviceDeltaFunction getDeviceDeltaFunction();
+
 private:
   int id = -1;
 };
 
+/** Gaussian or adaptive gaussian smearing, in a form that can be copied to
+ * and evaluated on the device by Kokkos kernels.
+ * Reproduces the getSmearing() methods of the corresponding classes below.
+ */
+struct DeviceDeltaFunction {
+  int type = DeltaFunction::gaussian;
+  // gaussian smearing
+  double inverseWidth = 0.;
+  double prefactor = 1.;
+  // adaptive gaussian smearing
+  double broadeningCutoff = 0.;
+  double qTensor[3][3] = {{0., 0., 0.}, {0., 0., 0.}, {0., 0., 0.}};
+  double erf2 = 0.9953222650189527;
+
+  /** Value of the smearing.
+   * @param energy: the energy difference.
+   * @param vx, vy, vz: the velocity difference (used by adaptive smearing).
+   */
+  KOKKOS_INLINE_FUNCTION
+  double operator()(const double &energy, const double &vx, const double &vy,
+                    const double &vz) const {
+    if (type == DeltaFunction::gaussian) {
+      double x = energy * inverseWidth;
+      if (x > 6.) return 0.;
+      return prefactor * Kokkos::exp(-x * x);
+    }
+    if (vx == 0. && vy == 0. && vz == 0. && energy == 0.) {
+      return 1.;
+    }
+    double sigma = 0.;
+    for (int i = 0; i < 3; i++) {
+      double x = qTensor[i][0] * vx + qTensor[i][1] * vy + qTensor[i][2] * vz;
+      sigma += x * x;
+    }
+    sigma = prefactor * Kokkos::sqrt(sigma / 6.);
+    if (sigma == 0.) {
+      return 0.;
+    }
+    if (sigma < broadeningCutoff) {
+      sigma = broadeningCutoff;
+    }
+    if (Kokkos::fabs(energy) > 2. * sigma) return 0.;
+    double x = energy / sigma;
+    // note: 0.56418... = 1/sqrt(pi)
+    return Kokkos::exp(-x * x) * 0.5641895835477563 / sigma / erf2;
+  }
+};
+
 /** Gaussian smearing scheme. Simply replace the dirac delta with a gaussian.
  * The width of such gaussian is specified by the user.
  */
@@ -82,11 +149,22 @@ public:
    */
   double getSmearing(const double &energy, StateIndex &is) override;
 
+  /** Vectorized evaluation of the gaussian on a block of energies.
+   * @param energies: the energy differences.
+   * @param velocities: ignored parameter.
+   */
+  Eigen::VectorXd getSmearings(const Eigen::VectorXd &energies,
+                               const Eigen::MatrixXd &velocities) override;
+
   /** returns an integer identifying this class as AdaptiveGaussian
    * @return int: id.
    */
   int getType() override;
 
+  /** Returns a copy of the smearing for Kokkos kernels.
+   */
+  DeviceDeltaFunction getDeviceDeltaFunction() override;
+
 protected:
   int id = DeltaFunction::gaussian;
   double inverseWidth;
@@ -119,11 +197,22 @@ public:
    */
   double getSmearing(const double &energy, StateIndex &is)  override;
 
+  /** Vectorized evaluation of the smearing on a block of states.
+   * @param energies: the energy differences.
+   * @param velocities: (numEntries x 3) velocity differences.
+   */
+  Eigen::VectorXd getSmearings(const Eigen::VectorXd &energies,
+                               const Eigen::MatrixXd &velocities) override;
+
   /** returns an integer identifying this class as AdaptiveGaussian
    * @return int: id.
    */
   int getType() override;
 
+  /** Returns a copy of the smearing for Kokkos kernels.
+   */
+  DeviceDeltaFunction getDeviceDeltaFunction() override;
+
 protected:
   int id = DeltaFunction::adaptiveGaussian;
 
@@ -166,6 +255,28 @@ public:
    */
   double getDOS(const double &energy);
 
+  /** Precomputes and stores the sorted vertex energies of all tetrahedra,
+   * for all states, so that getSmearing() and getDOS() don't have to
+   * rebuild them at every call. The tetrahedra of irreducible states are
+   * also sorted by their lowest energy, so that getDOS() only visits the
+   * tetrahedra that may contain the requested energy.
+   * Memory scales as 24*numStates doubles.
+   */
+  void precomputeTetrahedra();
+
+  /** Computes the DOS on a uniform grid of energies, looping once over the
+   * tetrahedra: each tetrahedron only adds to the energies within the
+   * range of its vertices. Parallelized over tetrahedra.
+   * Requires precomputeTetrahedra() to have been called.
+   * @param minEnergy: first energy of the grid.
+   * @param deltaEnergy: spacing of the grid.
+   * @param numEnergies: number of energies in the grid.
+   * @return dos: the density of states at the energies of the grid.
+   */
+  std::vector<double> getDOS(const double &minEnergy,
+                             const double &deltaEnergy,
+                             const int &numEnergies);
+
   /** Calculate tetrahedron weight.
    *
    * Method for calculating the tetrahedron weight for given wave vector and
@@ -184,12 +295,37 @@ public:
   getSmearing(const double &energy,
               const Eigen::Vector3d &velocity = Eigen::Vector3d::Zero()) override;
 
+  /** Returns the range of energies where getSmearing(energy, is) can be
+   * different from zero, i.e. from the lowest to the highest vertex of the
+   * tetrahedra of the state. Lets the callers skip the energies of a grid
+   * outside this range. Requires precomputeTetrahedra() to have been called.
+   * @param is: the state index.
+   * @return (minEnergy, maxEnergy): if no tetrahedron of the state is
+   * complete (with a window), minEnergy > maxEnergy.
+   */
+  std::tuple<double, double> getEnergyRange(StateIndex &is);
+
 protected:
   BaseBandStructure &fullBandStructure;
   Points fullPoints;
   int id = DeltaFunction::tetrahedron;
   Eigen::MatrixXd subCellShift;
   Eigen::MatrixXi vertices;
+
+  // sorted energies of the 4 vertices of the 6 tetrahedra of each state,
+  // stored as one array per vertex at index is*6+iTetra.
+  // Empty until precomputeTetrahedra() is called.
+  std::vector<double> tetraEnergies[4];
+  // tetrahedra of irreducible states sorted by their lowest energy
+  std::vector<int> dosTetrahedra;
+  std::vector<double> dosDegeneracies;
+  std::vector<double> dosMinEnergies;
+
+  /** Returns a (6,4) matrix with the sorted vertex energies of the
+   * tetrahedra containing the state is. Tetrahedra with a vertex outside
+   * the window are filled with the largest double, and don't contribute.
+   */
+  Eigen::MatrixXd getTetrahedraEnergies(StateIndex &is);
 };
 
 #endif
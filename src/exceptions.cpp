@@ -9,6 +9,16 @@ Error::Error(const std::string &errMessage, const int &errCode) {
       std::cout << "\nError!" << std::endl;
       std::cout << errMessage << "\n" << std::endl;
     }
+#ifdef MPI_AVAIL
+    if (mpi->getNumSplitGroups() > 1) {
+      // the other groups of splitWorld() can't join the finalization
+      MPI_Abort(MPI_COMM_WORLD, errCode);
+    }
+#endif
+    if (mpi->isFarming()) {
+      // the other groups go on with their tasks, see runFarm()
+      throw FarmTaskError(errMessage);
+    }
     mpi->barrier();
     mpi->finalize();
     exit(errCode);
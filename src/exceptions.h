@@ -3,13 +3,24 @@
 
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
+/** Thrown by Error in a job farm, where an error only stops the task of the
+ * group of processes, and not the other groups.
+ */
+class FarmTaskError : public std::runtime_error {
+public:
+  explicit FarmTaskError(const std::string &errMessage)
+      : std::runtime_error(errMessage) {}
+};
+
 /** Object used to print an error message, and stop the code.
  */
 class Error {
 public:
   /** object constructor.
+   * In a job farm, it throws a FarmTaskError instead of stopping the code.
    * @param errorMessage: message to be print to the user.
    * @param errCode: return integer error code, should be different from 0!
    */
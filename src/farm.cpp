@@ -0,0 +1,144 @@
+#include "farm.h"
+#include "app.h"
+#include "context.h"
+#include "exceptions.h"
+#include "io.h"
+#include "mpiHelper.h"
+#include "parser.h"
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+std::vector<std::string> readTaskList(const std::string &fileName) {
+  std::ifstream file(fileName);
+  if (!file.good()) {
+    Error("Task list " + fileName + " of the job farm not found");
+  }
+  std::vector<std::string> tasks;
+  std::string line;
+  while (std::getline(file, line)) {
+    // strip the blanks around the path
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') {
+      continue;
+    }
+    size_t last = line.find_last_not_of(" \t\r");
+    tasks.push_back(line.substr(first, last - first + 1));
+  }
+  return tasks;
+}
+
+/** Runs the apps of one input file, as the phoebe executable does.
+ * @return true if the task completed without errors.
+ */
+bool runTask(const std::string &inputPath) {
+  // the task runs in the directory of its input file, so that the relative
+  // paths in the input and the output files refer to that directory
+  size_t slash = inputPath.find_last_of('/');
+  std::string directory =
+      slash == std::string::npos ? "" : inputPath.substr(0, slash);
+  std::string inputFileName =
+      slash == std::string::npos ? inputPath : inputPath.substr(slash + 1);
+  std::vector<char> startDirectory(4096);
+  if (getcwd(startDirectory.data(), startDirectory.size()) == nullptr) {
+    return false;
+  }
+  if (!directory.empty() && chdir(directory.c_str()) != 0) {
+    return false;
+  }
+
+  // only the head of the group prints, so it's the only one to redirect
+  std::ofstream outputFile;
+  std::streambuf *coutBuffer = std::cout.rdbuf();
+  if (mpi->mpiHead()) {
+    std::string outputFileName =
+        inputFileName.substr(0, inputFileName.find_last_of('.')) + ".out";
+    outputFile.open(outputFileName);
+    std::cout.rdbuf(outputFile.rdbuf());
+  }
+
+  bool success = true;
+  try {
+    IO::welcome();
+    Context context;
+    context.setupFromInput(inputFileName);
+    std::vector<std::string> appNames = context.getAppNames();
+    if (appNames.empty()) { // let loadApp complain about the missing app
+      appNames.push_back(context.getAppName());
+    }
+    for (const std::string &appName : appNames) {
+      context.setAppName(appName);
+      context.printInputSummary(inputFileName);
+      std::unique_ptr<App> app = App::loadApp(appName);
+      if (mpi->mpiHead()) {
+        std::cout << "Launching App \"" + appName + "\".\n" << std::endl;
+      }
+      app->checkRequirements(context);
+      app->run(context);
+      if (mpi->mpiHead()) {
+        std::cout << "Closing App \"" + appName + "\".\n" << std::endl;
+      }
+    }
+  } catch (FarmTaskError &error) {
+    // the message was printed to the output of the task by Error
+    success = false;
+  }
+  // the cached Hamiltonians belong to this task
+  Parser::clearHarmonicCache();
+
+  std::cout.rdbuf(coutBuffer);
+  if (chdir(startDirectory.data()) != 0) {
+    success = false;
+  }
+  return success;
+}
+
+} // namespace
+
+void runFarm(int argc, char *argv[]) {
+  std::string taskListFileName;
+  for (int i = 0; i < argc - 1; i++) {
+    if (std::string(argv[i]) == "-farm") {
+      taskListFileName = argv[i + 1];
+    }
+  }
+
+  std::vector<std::string> tasks;
+  try {
+    if (taskListFileName.empty()) {
+      Error("A job farm (-ng flag) requires a task list (-farm flag)");
+    }
+    tasks = readTaskList(taskListFileName);
+  } catch (FarmTaskError &error) {
+    return;
+  }
+  auto numTasks = int(tasks.size());
+
+  if (mpi->mpiHead() && mpi->getFarmGroupId() == 0) {
+    std::cout << "Job farm: " << numTasks << " tasks on "
+              << mpi->getNumFarmGroups() << " groups of MPI processes.\n"
+              << std::endl;
+  }
+
+  for (int task = mpi->nextFarmTask(); task < numTasks;
+       task = mpi->nextFarmTask()) {
+    auto startTime = std::chrono::steady_clock::now();
+    bool success = runTask(tasks[task]);
+    double elapsedTime =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - startTime).count() / 1e9;
+    if (mpi->mpiHead()) {
+      std::cout << "Group " << mpi->getFarmGroupId() << ": task " << task
+                << " (" << tasks[task] << ") "
+                << (success ? "completed" : "failed") << " in "
+                << std::setprecision(3) << elapsedTime << " s." << std::endl;
+    }
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef FARM_H
+#define FARM_H
+
+/** Runs a job farm, i.e. many independent calculations in a single MPI
+ * allocation. The MPI processes are split in groups with the -ng flag
+ * (see MPIcontroller), and the -farm flag gives a task list: a text file
+ * with the path of one input file per line (empty lines and lines starting
+ * with # are skipped).
+ * Each group takes the next task of the list as soon as it's done with the
+ * previous one, and runs it in the directory of the input file, writing the
+ * output to a file with the name of the input file and the .out extension.
+ * An error in a task only stops that task, and the group moves on to the
+ * next one.
+ * Must be called by all MPI processes.
+ */
+void runFarm(int argc, char *argv[]);
+
+#endif
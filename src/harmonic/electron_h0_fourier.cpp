@@ -127,18 +127,110 @@ FullBandStructure ElectronH0Fourier::populate(Points &fullPoints,
 
   FullBandStructure fullBandStructure(numBands, particle, withVelocities,
                                       withEigenvectors, fullPoints,
-                                      isDistributed);
+                                      isDistributed, onlyGroupVelocities);
 
-  LoopPrint loopPrint("populating electronic band structure", "states", 
+  // this is mpi parallel in wavevector indices
+  std::vector<int> kIndices = fullBandStructure.getWavevectorIndices();
+  int numK = int(kIndices.size());
+
+  // check whether all wavevectors lie on the mesh of fullPoints,
+  // and find their index on the mesh
+  auto tup = fullPoints.getMesh();
+  Eigen::Vector3i mesh = std::get<0>(tup);
+  Eigen::Vector3d offset = std::get<1>(tup);
+  bool onMesh = mesh.minCoeff() > 0;
+  std::vector<int> meshIndices(numK);
+  for (int i = 0; i < numK && onMesh; i++) {
+    Eigen::Vector3d kCrystal = fullPoints.getPointCoordinates(
+        kIndices[i], Points::crystalCoordinates);
+    Eigen::Vector3i j;
+    for (int dir : {0, 1, 2}) {
+      double x = (kCrystal(dir) - offset(dir)) * mesh(dir);
+      if (abs(x - round(x)) > 1.0e-6) {
+        onMesh = false;
+      }
+      j(dir) = mod(int(round(x)), mesh(dir));
+    }
+    meshIndices[i] = (j(0) * mesh(1) + j(1)) * mesh(2) + j(2);
+  }
+  // the transform on the mesh only pays off if we need a good fraction of
+  // the mesh points (e.g. not for a small set of active points)
+  if (onMesh) {
+    double meshCost = double(mesh.prod()) * mesh.sum();
+    double pointCost = double(numK) * numPositionVectors;
+    onMesh = meshCost < pointCost;
+  }
+
+  if (onMesh) {
+    // if the band structure is not distributed, every process needs all the
+    // wavevectors, so we split the bands across MPI processes instead
+    std::vector<int> bandIndices;
+    if (isDistributed) {
+      for (int ib = 0; ib < numBands; ib++) {
+        bandIndices.push_back(ib);
+      }
+    } else {
+      for (int ib : mpi->divideWorkIter(numBands)) {
+        bandIndices.push_back(ib);
+      }
+    }
+
+    Eigen::MatrixXd energies = Eigen::MatrixXd::Zero(numBands, numK);
+    Eigen::MatrixXd velocities;
+    if (withVelocities) {
+      velocities = Eigen::MatrixXd::Zero(numBands * 3, numK);
+    }
+
+    LoopPrint loopPrint("populating electronic band structure on the mesh",
+                        "bands", int(bandIndices.size()));
+    for (int ib : bandIndices) {
+      loopPrint.update();
+      Eigen::MatrixXd bandsOnMesh =
+          getBandsOnMesh(mesh, offset, ib, withVelocities);
+#pragma omp parallel for
+      for (int i = 0; i < numK; i++) {
+        energies(ib, i) = bandsOnMesh(meshIndices[i], 0);
+        if (withVelocities) {
+          for (int dir : {0, 1, 2}) {
+            velocities(ib * 3 + dir, i) = bandsOnMesh(meshIndices[i], dir + 1);
+          }
+        }
+      }
+    }
+    loopPrint.close();
+
+    if (!isDistributed) {
+      mpi->allReduceSum(&energies);
+      if (withVelocities) {
+        mpi->allReduceSum(&velocities);
+      }
+    }
+
+    for (int i = 0; i < numK; i++) {
+      Point point = fullBandStructure.getPoint(kIndices[i]);
+      Eigen::VectorXd ens = energies.col(i);
+      fullBandStructure.setEnergies(point, ens);
+      if (withVelocities) {
+        Eigen::Tensor<std::complex<double>, 3> v(numBands, numBands, 3);
+        v.setZero();
+        for (int ib = 0; ib < numBands; ib++) {
+          for (int dir : {0, 1, 2}) {
+            v(ib, ib, dir) = velocities(ib * 3 + dir, i);
+          }
+        }
+        fullBandStructure.setVelocities(point, v);
+      }
+    }
+    return fullBandStructure;
+  }
+
+  LoopPrint loopPrint("populating electronic band structure", "states",
                               fullBandStructure.getNumStates());
 
-  // this is mpi parallel in wavevector indices
-  std::vector<int> kIndices = fullBandStructure.getWavevectorIndices(); 
-  for (size_t i = 0; i<kIndices.size(); i++) {
+  for (int ik : kIndices) {
 
-    loopPrint.update(); 
+    loopPrint.update();
 
-    int ik = kIndices[i];
     Point point = fullBandStructure.getPoint(ik);
     auto tup = diagonalize(point);
     auto ens = std::get<0>(tup);
@@ -200,11 +292,22 @@ void ElectronH0Fourier::setPositionVectors() {
     Error("Fourier cutoff is too small: set it >=1");
   }
 
-  // distDim is the size of the
-  int distDim = 1;
-  distDim *= ((searchSize0 + 1) * 2 + 1);
-  distDim *= ((searchSize1 + 1) * 2 + 1);
-  distDim *= ((searchSize2 + 1) * 2 + 1);
+  // the vectors of super cell B of size ((searchSize+1)*2+1)^3, made of
+  // multiples of the coarse grid, in cartesian coordinates.
+  // The zero vector is excluded.
+  std::vector<Eigen::Vector3d> superCellVectors;
+  for (int i0 = -searchSize0 - 1; i0 <= searchSize0 + 1; i0++) {
+    for (int i1 = -searchSize1 - 1; i1 <= searchSize1 + 1; i1++) {
+      for (int i2 = -searchSize2 - 1; i2 <= searchSize2 + 1; i2++) {
+        if (i0 == 0 && i1 == 0 && i2 == 0) {
+          continue;
+        }
+        Eigen::Vector3d vec;
+        vec << i0 * grid(0), i1 * grid(1), i2 * grid(2);
+        superCellVectors.push_back(directUnitCell * vec);
+      }
+    }
+  }
 
   std::vector<Eigen::Vector3d> tmpVectors;
   std::vector<double> tmpDegeneracies;
@@ -224,53 +327,31 @@ void ElectronH0Fourier::setPositionVectors() {
     loopPrint.update();
     for (int n1 = -searchSize1 * grid(1); n1 <= searchSize1 * grid(1); n1++) {
       for (int n2 = -searchSize2 * grid(2); n2 <= searchSize2 * grid(2); n2++) {
-        // loop over a super cell B of size ((searchSize+1)*2+1)^3
-        // bigger than super cell A. We compute the distance between any
-        // vector in super cell B w.r.t. the vector "n"
-
-        std::vector<double> distances;
-        for (int i0 = -searchSize0 - 1; i0 <= searchSize0 + 1; i0++) {
-          for (int i1 = -searchSize1 - 1; i1 <= searchSize1 + 1; i1++) {
-            for (int i2 = -searchSize2 - 1; i2 <= searchSize2 + 1; i2++) {
-              Eigen::Vector3d dist;
-              dist(0) = n0 - i0 * grid(0);
-              dist(1) = n1 - i1 * grid(1);
-              dist(2) = n2 - i2 * grid(2);
-              // distances in cartesian space
-              dist = directUnitCell * dist;
-              double dist2 = dist.norm();
-              distances.push_back(dist2);
-            }
+        Eigen::Vector3d thisVec;
+        thisVec << n0, n1, n2;
+        Eigen::Vector3d thisVecCartesian = directUnitCell * thisVec;
+        double thisDistance = thisVecCartesian.norm();
+
+        // the vector "n" is in the Wigner Seitz zone of super cell A if no
+        // vector n-B, with B in super cell B, is shorter than n.
+        // If so, its degeneracy is the number of vectors n-B as long as n.
+        // We stop as soon as we find a shorter vector.
+        bool isInWignerSeitz = true;
+        double degeneracy = 1.;
+        for (const auto &superCellVector : superCellVectors) {
+          double distance = (thisVecCartesian - superCellVector).norm();
+          if (distance < thisDistance - 1.0e-6) {
+            isInWignerSeitz = false;
+            break;
           }
-        }
-
-        // find the minimum distance out of all distances
-        double distMin = distances[0];
-        for (auto dist : distances) {
-          if (dist < distMin) {
-            distMin = dist;
+          if (abs(distance - thisDistance) < 1.0e-6) {
+            degeneracy += 1.;
           }
         }
 
-        // the point at distDim/2 is the reference "n" vector
-        // i.e. the one generated by i0=i1=i2=0
-        // if it's the minimum vector, than it's in the
-        // Wigner Seitz zone of super cell A.
-        // Therefore we save this vector.
-        if (abs(distances[distDim / 2] - distMin) < 1.0e-6) {
+        if (isInWignerSeitz) {
           tmpNumPoints += 1;
-
-          // count its degeneracy
-          double degeneracy = 0.;
-          for (int i = 0; i < distDim; i++) {
-            if (abs(distances[i] - distMin) < 1.0e-6) {
-              degeneracy += 1.;
-            }
-          }
           tmpDegeneracies.push_back(degeneracy);
-
-          Eigen::Vector3d thisVec;
-          thisVec << n0, n1, n2;
           tmpVectors.push_back(thisVec);
         }
       }
@@ -421,6 +502,69 @@ ElectronH0Fourier::getGroupVelocityFromCoordinates(Eigen::Vector3d &wavevector,
   return velocity;
 }
 
+Eigen::MatrixXd ElectronH0Fourier::getBandsOnMesh(const Eigen::Vector3i &mesh,
+                                                  const Eigen::Vector3d &offset,
+                                                  const int &bandIndex,
+                                                  const bool &withVelocities) {
+  int numMeshPoints = mesh.prod();
+  int numComponents = withVelocities ? 4 : 1;
+
+  // fold the star function expansion on the mesh.
+  // Component 0 is for the energy, components 1-3 for the velocity,
+  // whose coefficients are multiplied by iR
+  Eigen::MatrixXcd values = Eigen::MatrixXcd::Zero(numMeshPoints, numComponents);
+  Eigen::Matrix3d toCrystal = crystal.getDirectUnitCell().inverse();
+  for (int iR = 0; iR < numPositionVectors; iR++) {
+    Eigen::Vector3d nCrystal = toCrystal * positionVectors.col(iR);
+    Eigen::Vector3i m;
+    double arg = 0.;
+    for (int dir : {0, 1, 2}) {
+      int n = int(round(nCrystal(dir)));
+      m(dir) = mod(n, mesh(dir));
+      arg += twoPi * offset(dir) * n;
+    }
+    std::complex<double> c = expansionCoefficients(bandIndex, iR)
+        * exp(complexI * arg) / positionDegeneracies(iR);
+    int im = (m(0) * mesh(1) + m(1)) * mesh(2) + m(2);
+    values(im, 0) += c;
+    for (int i = 1; i < numComponents; i++) {
+      values(im, i) += complexI * positionVectors(i - 1, iR) * c;
+    }
+  }
+
+  // separable discrete Fourier transform, one direction at a time:
+  // f(j) = sum_m f(m) e^{2 pi i j m / mesh}
+  Eigen::Vector3i strides;
+  strides << mesh(1) * mesh(2), mesh(2), 1;
+  for (int dir : {0, 1, 2}) {
+    int n = mesh(dir);
+    int stride = strides(dir);
+    int numLines = numMeshPoints / n;
+    std::vector<std::complex<double>> twiddles(n);
+    for (int j = 0; j < n; j++) {
+      twiddles[j] = exp(complexI * twoPi * double(j) / double(n));
+    }
+#pragma omp parallel for collapse(2)
+    for (int iComp = 0; iComp < numComponents; iComp++) {
+      for (int iLine = 0; iLine < numLines; iLine++) {
+        int start = (iLine / stride) * stride * n + iLine % stride;
+        std::vector<std::complex<double>> line(n);
+        for (int j = 0; j < n; j++) {
+          std::complex<double> tmp = 0.;
+          for (int m = 0; m < n; m++) {
+            tmp += values(start + m * stride, iComp) * twiddles[(j * m) % n];
+          }
+          line[j] = tmp;
+        }
+        for (int j = 0; j < n; j++) {
+          values(start + j * stride, iComp) = line[j];
+        }
+      }
+    }
+  }
+  return values.real();
+}
+
 StridedComplexView3D ElectronH0Fourier::kokkosBatchedBuildBlochHamiltonian(
     [[maybe_unused]] const DoubleView2D &cartesianCoordinates) {
   Error("Kokkos not implemented in ElectronH0Fourier");
@@ -67,6 +67,9 @@ class ElectronH0Fourier : public HarmonicHamiltonian {
       Eigen::Vector3d &coordinates) override;
 
   /** This method constructs an electron band structure.
+   * If all the wavevectors lie on the Monkhorst-Pack mesh of fullPoints, the
+   * bands are computed on the whole mesh at once with a discrete Fourier
+   * transform (see getBandsOnMesh), otherwise point by point.
    * @param points: the object with the list/mesh of wavevectors
    * @param withVelocities: if true, compute the electron velocity operator.
    * @param withEigenvectors: can only be false, as there are no eigenvectors
@@ -114,6 +117,27 @@ class ElectronH0Fourier : public HarmonicHamiltonian {
   const double coefficient1 = 0.75;  // 3/4
   const double coefficient2 = 0.75;
   double getEnergyFromCoordinates(Eigen::Vector3d &wavevector, int &bandIndex);
+
+  /** Computes one band at all wavevectors of a regular mesh.
+   * Since the lattice vectors have integer crystal coordinates n, the phase
+   * e^{ikR} on the mesh point j is e^{2 pi i j.n/mesh} times a constant
+   * factor from the offset. Therefore, the expansion coefficients are first
+   * folded on the mesh (n modulo mesh), and then transformed with a
+   * separable 3D discrete Fourier transform. The cost is
+   * O(numMeshPoints*(mesh(0)+mesh(1)+mesh(2))), instead of
+   * O(numMeshPoints*numPositionVectors) for the point by point evaluation.
+   * @param mesh: the size of the mesh of wavevectors.
+   * @param offset: the offset of the mesh, in crystal coordinates.
+   * @param bandIndex: the band to be computed.
+   * @param withVelocities: if true, also computes the group velocities.
+   * @return bands: a matrix of size (numMeshPoints,1) with the energies, or
+   * (numMeshPoints,4) with energies and velocities. The mesh point (j0,j1,j2)
+   * has index (j0*mesh(1)+j1)*mesh(2)+j2.
+   */
+  Eigen::MatrixXd getBandsOnMesh(const Eigen::Vector3i &mesh,
+                                 const Eigen::Vector3d &offset,
+                                 const int &bandIndex,
+                                 const bool &withVelocities);
   Eigen::Vector3d getGroupVelocityFromCoordinates(Eigen::Vector3d &wavevector,
                                              int &bandIndex);
 };
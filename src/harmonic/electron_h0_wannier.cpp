@@ -10,6 +10,7 @@ ElectronH0Wannier::ElectronH0Wannier(
     const Eigen::Tensor<std::complex<double>, 3> &h0R_,
     const Eigen::Tensor<std::complex<double>, 4> &rMatrix_)
     : particle(Particle::electron) {
+  DeviceMemoryScope memoryScope("ElectronH0Wannier");
 
   h0R = h0R_;
   rMatrix = rMatrix_;
@@ -71,7 +72,7 @@ ElectronH0Wannier::ElectronH0Wannier(
 
 // copy constructor
 ElectronH0Wannier::ElectronH0Wannier(const ElectronH0Wannier &that)
-    : particle(Particle::electron) {
+    : HarmonicHamiltonian(that), particle(Particle::electron) {
   h0R = that.h0R;
   rMatrix = that.rMatrix;
   directUnitCell = that.directUnitCell;
@@ -82,11 +83,16 @@ ElectronH0Wannier::ElectronH0Wannier(const ElectronH0Wannier &that)
   hasShiftedVectors = that.hasShiftedVectors;
   vectorsShifts = that.vectorsShifts;
   degeneracyShifts = that.degeneracyShifts;
+  shiftStart = that.shiftStart;
+  shiftVectors = that.shiftVectors;
+  shiftCoefficients = that.shiftCoefficients;
   h0R_d = that.h0R_d;
-  degeneracyShifts_d = that.degeneracyShifts_d;
-  vectorsShifts_d = that.vectorsShifts_d;
+  shiftStart_d = that.shiftStart_d;
+  shiftVectors_d = that.shiftVectors_d;
+  shiftCoefficients_d = that.shiftCoefficients_d;
   vectorsDegeneracies_d = that.vectorsDegeneracies_d;
   bravaisVectors_d = that.bravaisVectors_d;
+  rMatrix_d = that.rMatrix_d;
   double memory = getDeviceMemoryUsage();
   kokkosDeviceMemory->addDeviceMemoryUsage(memory);
 }
@@ -94,6 +100,7 @@ ElectronH0Wannier::ElectronH0Wannier(const ElectronH0Wannier &that)
 // copy assignment
 ElectronH0Wannier &ElectronH0Wannier::operator=(const ElectronH0Wannier &that) {
   if (this != &that) {
+    HarmonicHamiltonian::operator=(that);
     particle = that.particle;
     numVectors = that.numVectors;
     numWannier = that.numWannier;
@@ -105,11 +112,16 @@ ElectronH0Wannier &ElectronH0Wannier::operator=(const ElectronH0Wannier &that) {
     hasShiftedVectors = that.hasShiftedVectors;
     vectorsShifts = that.vectorsShifts;
     degeneracyShifts = that.degeneracyShifts;
+    shiftStart = that.shiftStart;
+    shiftVectors = that.shiftVectors;
+    shiftCoefficients = that.shiftCoefficients;
     h0R_d = that.h0R_d;
-    degeneracyShifts_d = that.degeneracyShifts_d;
-    vectorsShifts_d = that.vectorsShifts_d;
+    shiftStart_d = that.shiftStart_d;
+    shiftVectors_d = that.shiftVectors_d;
+    shiftCoefficients_d = that.shiftCoefficients_d;
     vectorsDegeneracies_d = that.vectorsDegeneracies_d;
     bravaisVectors_d = that.bravaisVectors_d;
+    rMatrix_d = that.rMatrix_d;
     double memory = getDeviceMemoryUsage();
     kokkosDeviceMemory->addDeviceMemoryUsage(memory);
   }
@@ -122,10 +134,12 @@ ElectronH0Wannier::~ElectronH0Wannier() {
   // Deallocate stuff from GPU
   // Eigen class attributes should be deallocated automatically
   Kokkos::resize(h0R_d, 0, 0, 0);
-  Kokkos::resize(degeneracyShifts_d, 0, 0, 0);
-  Kokkos::resize(vectorsShifts_d, 0, 0, 0, 0, 0);
+  Kokkos::resize(shiftStart_d, 0);
+  Kokkos::resize(shiftVectors_d, 0, 0);
+  Kokkos::resize(shiftCoefficients_d, 0);
   Kokkos::resize(vectorsDegeneracies_d, 0);
   Kokkos::resize(bravaisVectors_d, 0, 0);
+  Kokkos::resize(rMatrix_d, 0, 0, 0, 0);
 }
 
 Particle ElectronH0Wannier::getParticle() { return particle; }
@@ -190,33 +204,93 @@ std::vector<Eigen::MatrixXcd> ElectronH0Wannier::batchedBuildHamiltonians(
     }
 
   } else {
-    // with shift
+    // with shift, only over the non-vanishing terms of each Wannier pair
+#pragma omp parallel for collapse(3)
+    for (int iK = 0; iK < numK; ++iK) {
+      for (int iw2 = 0; iw2 < numWannier; iw2++) {
+        for (int iw1 = 0; iw1 < numWannier; iw1++) {
+          int iPair = iw1 * numWannier + iw2;
+          for (int iShift = shiftStart[iPair]; iShift < shiftStart[iPair + 1];
+               ++iShift) {
+            double phaseArg =
+                cartesianWavevectors[iK].dot(shiftVectors.col(iShift));
+            std::complex<double> phase = {cos(phaseArg), sin(phaseArg)};
+            Hs[iK](iw1, iw2) += phase * shiftCoefficients(iShift);
+          }
+        }
+      }
+    }
+  }
+  return Hs;
+}
+
+std::tuple<std::vector<Eigen::MatrixXcd>, std::vector<Eigen::MatrixXcd>>
+ElectronH0Wannier::batchedBuildHamiltoniansAndDerivatives(
+    std::vector<Eigen::Vector3d>& cartesianWavevectors) {
+
+  int numK = cartesianWavevectors.size();
+  std::vector<Eigen::MatrixXcd> Hs(numK, Eigen::MatrixXcd::Zero(numWannier, numWannier));
+  std::vector<Eigen::MatrixXcd> dHs(numK * 3, Eigen::MatrixXcd::Zero(numWannier, numWannier));
+  std::complex<double> complexI(0., 1.);
+
+  // H(k) = sum_R e^{ikR} H(R), so that dH/dk = sum_R iR e^{ikR} H(R)
+  if (!hasShiftedVectors) {
+    Eigen::MatrixXcd phases(numVectors, numK);
 
+    // precompute all phases
+#pragma omp parallel for collapse(2)
     for (int iK = 0; iK < numK; ++iK) {
       for (int iR = 0; iR < numVectors; iR++) {
-        double phaseArg;
-        std::complex<double> phase;
-        for (int iw2 = 0; iw2 < numWannier; iw2++) {
-          for (int iw1 = 0; iw1 < numWannier; iw1++) {
-            for (int iDeg = 0; iDeg < degeneracyShifts(iw1, iw2, iR); ++iDeg) {
-              phaseArg = 0.;
-              for (int i : {0, 1, 2}) {
-                phaseArg += cartesianWavevectors[iK](i) * vectorsShifts(i, iDeg, iw1, iw2, iR);
-              }
-              phase = {cos(phaseArg), sin(phaseArg)};
-              phase /= vectorsDegeneracies(iR) * degeneracyShifts(iw1, iw2, iR);
-              Hs[iK](iw1, iw2) += phase * h0R(iR, iw1, iw2);
+        double phase = cartesianWavevectors[iK].dot(bravaisVectors.col(iR));
+        std::complex<double> phaseFactor = {cos(phase), sin(phase)};
+        phases(iR, iK) = phaseFactor / vectorsDegeneracies(iR);
+      }
+    }
+
+    // perform fourier transform
+#pragma omp parallel for collapse(3)
+    for (int iK = 0; iK < numK; ++iK) {
+      for (int n = 0; n < numWannier; n++) {
+        for (int m = 0; m < numWannier; m++) {
+          for (int iR = 0; iR < numVectors; iR++) {
+            std::complex<double> x = phases(iR, iK) * h0R(iR, m, n);
+            Hs[iK](m, n) += x;
+            for (int i : {0, 1, 2}) {
+              dHs[iK * 3 + i](m, n) += complexI * bravaisVectors(i, iR) * x;
+            }
+          }
+        }
+      }
+    }
+
+  } else {
+    // with shift, only over the non-vanishing terms of each Wannier pair
+#pragma omp parallel for collapse(3)
+    for (int iK = 0; iK < numK; ++iK) {
+      for (int iw2 = 0; iw2 < numWannier; iw2++) {
+        for (int iw1 = 0; iw1 < numWannier; iw1++) {
+          int iPair = iw1 * numWannier + iw2;
+          for (int iShift = shiftStart[iPair]; iShift < shiftStart[iPair + 1];
+               ++iShift) {
+            double phaseArg =
+                cartesianWavevectors[iK].dot(shiftVectors.col(iShift));
+            std::complex<double> phase = {cos(phaseArg), sin(phaseArg)};
+            std::complex<double> x = phase * shiftCoefficients(iShift);
+            Hs[iK](iw1, iw2) += x;
+            for (int i : {0, 1, 2}) {
+              dHs[iK * 3 + i](iw1, iw2) += complexI * shiftVectors(i, iShift) * x;
             }
           }
         }
       }
     }
   }
-  return Hs;
+  return std::make_tuple(Hs, dHs);
 }
 
 std::tuple<std::vector<Eigen::VectorXd>, std::vector<Eigen::MatrixXcd>>
-ElectronH0Wannier::batchedDiagonalizeFromCoordinates(std::vector<Eigen::Vector3d>& cartesianWavevectors) {
+ElectronH0Wannier::batchedDiagonalizeFromCoordinates(std::vector<Eigen::Vector3d>& cartesianWavevectors,
+                                                     const bool &withEigenvectors) {
 
   auto Hs = batchedBuildHamiltonians(cartesianWavevectors);
 
@@ -226,9 +300,13 @@ ElectronH0Wannier::batchedDiagonalizeFromCoordinates(std::vector<Eigen::Vector3d
   std::vector<Eigen::MatrixXcd> allEigenvectors(numK);
 #pragma omp parallel for
   for (int iK = 0; iK < numK; ++iK) {
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(Hs[iK]);
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(
+        Hs[iK], withEigenvectors ? Eigen::ComputeEigenvectors
+                                 : Eigen::EigenvaluesOnly);
     allEnergies[iK] = eigenSolver.eigenvalues();
-    allEigenvectors[iK] = eigenSolver.eigenvectors();
+    if (withEigenvectors) {
+      allEigenvectors[iK] = eigenSolver.eigenvectors();
+    }
   }
   return std::make_tuple(allEnergies, allEigenvectors);
 
@@ -256,40 +334,40 @@ ElectronH0Wannier::kokkosPopulate(const std::vector<Eigen::Vector3d>& cartesianC
                                                     const bool &withVelocities,
                                                     const bool &withEigenvectors, const std::vector<int> &iks) {
 
-  // TODO enforce hasEigenvectors here?
-  (void) withEigenvectors;
-  // could allow more kpoints to be on the GPU at the same time.
-  // For now it's implemented like this because it's only ever called in cases that need
-  // eigenvectors (phel_scattering.cpp)
+  // the eigenvectors are needed for the velocities, but if neither are
+  // requested, the diagonalization only computes the energies
 
   // cartesianCoordinates is the list of points which are local to this process
   size_t numPoints = cartesianCoordinates.size();
 
   std::vector<Eigen::VectorXd> allEnergies(numPoints, Eigen::VectorXd(numWannier));
-  std::vector<Eigen::MatrixXcd> allEigenvectors(numPoints, Eigen::MatrixXcd(numWannier, numWannier));
-  std::vector<Eigen::Tensor<std::complex<double>,3>> allVelocities(numPoints,
-                                        Eigen::Tensor<std::complex<double>,3>(numWannier, numWannier, 3));
-
-  // set up information about how kpoint batches will be moved onto host
-  int batchSize = estimateBatchSize(withVelocities);
-  std::vector<std::vector<int>> ikBatches = kokkosDeviceMemory->splitToBatches(iks, batchSize);
+  std::vector<Eigen::MatrixXcd> allEigenvectors(numPoints);
+  if (withEigenvectors) {
+    for (auto &x : allEigenvectors) {
+      x.resize(numWannier, numWannier);
+    }
+  }
+  std::vector<Eigen::Tensor<std::complex<double>,3>> allVelocities(numPoints);
+  if (withVelocities) {
+    for (auto &x : allVelocities) {
+      x.resize(numWannier, numWannier, 3);
+    }
+  }
 
-  // Note on indexing in this function:
+  // iks only sets the number of points: the device and the host work on the
+  // wavevectors of cartesianCoordinates in the range [start,end[.
+  // Note on indexing in the device batches:
   //   iik is local within the batch.
-  //   ikBatch[iik] are the global kpoint indices
-  // we need a value which indexes within the kpoints passed as the cartCoords argument
-  // To do this, we keep a batch counter, that would be ik = iik + numFinishedPoints
-  int numFinishedPoints = 0;
-
-  // diagonalize batches of kpoints
-  for (auto ikBatch : ikBatches) {
-
-    int numBatchK= ikBatch.size();
+  //   ik = iik + numFinishedPoints indexes the points of cartesianCoordinates
+  auto deviceWork = [&](const int &start, const int &end) {
+    int numBatchK = end - start;
+    int numFinishedPoints = start;
 
     // set up kokkos view for the wavevectors
     DoubleView2D cartesianWavevectors_d("el_cartWav_d", numBatchK, 3);
     {
-      auto cartesianWavevectors_h = Kokkos::create_mirror_view(cartesianWavevectors_d);
+      auto cartesianWavevectors_h =
+          stagingArena.mirror(0, cartesianWavevectors_d);
       for (int iik = 0; iik < numBatchK; ++iik) {
 
         // ik = index in cartCoords list, index of in iks, ikk is index in the batch
@@ -298,7 +376,9 @@ ElectronH0Wannier::kokkosPopulate(const std::vector<Eigen::Vector3d>& cartesianC
           cartesianWavevectors_h(iik, i) = cartesianCoordinates[ik](i);
         }
       }
-      Kokkos::deep_copy(cartesianWavevectors_d, cartesianWavevectors_h);
+      // asynchronous, the kernels of the batch are queued after the copy
+      Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(),
+                        cartesianWavevectors_d, cartesianWavevectors_h);
 
       // now calculate the energies, eigenvectors, and velocities for the kpoints in this batch
       DoubleView2D batchEnergies_d;
@@ -309,24 +389,38 @@ ElectronH0Wannier::kokkosPopulate(const std::vector<Eigen::Vector3d>& cartesianC
         batchEnergies_d = std::get<0>(t);
         batchEigenvectors_d = std::get<1>(t);
         batchVelocities_d = std::get<2>(t);
-      } else {
+      } else if (withEigenvectors) {
         auto t = kokkosBatchedDiagonalizeFromCoordinates(cartesianWavevectors_d);
         batchEnergies_d = std::get<0>(t);
         batchEigenvectors_d = std::get<1>(t);
+      } else {
+        batchEnergies_d = kokkosBatchedEnergies(cartesianWavevectors_d);
       }
       // no need to keep the wavevectors in memory after this
       Kokkos::realloc(cartesianWavevectors_d, 0, 0);
 
-      auto batchEnergies_h = Kokkos::create_mirror_view(batchEnergies_d);
-      auto batchEigenvectors_h = Kokkos::create_mirror_view(batchEigenvectors_d);
-
-      Kokkos::deep_copy(batchEnergies_h, batchEnergies_d);
-      Kokkos::deep_copy(batchEigenvectors_h, batchEigenvectors_d);
+      auto batchEnergies_h = stagingArena.mirror(1, batchEnergies_d);
+      Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), batchEnergies_h,
+                        batchEnergies_d);
+      StagingView<StridedComplexView3D> batchEigenvectors_h;
+      if (withEigenvectors) {
+        batchEigenvectors_h = stagingArena.mirror(2, batchEigenvectors_d);
+        Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), batchEigenvectors_h,
+                          batchEigenvectors_d);
+      }
+      StagingView<ComplexView4D> batchVelocities_h;
+      if (withVelocities) {
+        batchVelocities_h = stagingArena.mirror(3, batchVelocities_d);
+        Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), batchVelocities_h,
+                          batchVelocities_d);
+      }
+      Kokkos::fence();
       for (int iik=0; iik<numBatchK; ++iik) {
         // ik = index in cartCoords list, index of in iks, ikk is index in the batch
         int ik = iik + numFinishedPoints;
         for (int ib1 = 0; ib1 < numWannier; ++ib1) {
           allEnergies[ik](ib1) = batchEnergies_h(iik, ib1);
+          if (!withEigenvectors) continue;
           for (int ib2 = 0; ib2 < numWannier; ++ib2) {
             allEigenvectors[ik](ib1, ib2) = batchEigenvectors_h(iik, ib1, ib2);
           }
@@ -334,8 +428,6 @@ ElectronH0Wannier::kokkosPopulate(const std::vector<Eigen::Vector3d>& cartesianC
       }
 
       if (withVelocities) {
-        auto batchVelocities_h = Kokkos::create_mirror_view(batchVelocities_d);
-        Kokkos::deep_copy(batchVelocities_h, batchVelocities_d);
         for (int iik=0; iik<numBatchK; ++iik) {
           // ik = index in cartCoords list, index of in iks, ikk is index in the batch
           int ik = iik + numFinishedPoints;
@@ -353,8 +445,32 @@ ElectronH0Wannier::kokkosPopulate(const std::vector<Eigen::Vector3d>& cartesianC
       batchEigenvectors_d = decltype(batchEigenvectors_d)();
       Kokkos::realloc(batchVelocities_d, 0, 0, 0, 0);
     }
-    numFinishedPoints += numBatchK;
-  }
+  };
+
+  auto hostWork = [&](const int &start, const int &end) {
+    std::vector<Eigen::Vector3d> batchCoordinates(
+        cartesianCoordinates.begin() + start, cartesianCoordinates.begin() + end);
+    if (withVelocities) {
+      auto t = batchedDiagonalizeWithVelocities(batchCoordinates);
+      for (int ik = start; ik < end; ++ik) {
+        allEnergies[ik] = std::get<0>(t)[ik - start];
+        allEigenvectors[ik] = std::get<1>(t)[ik - start];
+        allVelocities[ik] = std::get<2>(t)[ik - start];
+      }
+    } else {
+      auto t = batchedDiagonalizeFromCoordinates(batchCoordinates,
+                                                 withEigenvectors);
+      for (int ik = start; ik < end; ++ik) {
+        allEnergies[ik] = std::get<0>(t)[ik - start];
+        allEigenvectors[ik] = std::get<1>(t)[ik - start];
+      }
+    }
+  };
+
+  // diagonalize batches of kpoints, on the device and on the host
+  int batchSize = estimateBatchSize(withVelocities);
+  heterogeneousBatches(int(iks.size()), batchSize, deviceWork, hostWork);
+
   return std::make_tuple(allEnergies, allEigenvectors, allVelocities);
 }
 
@@ -362,10 +478,37 @@ FullBandStructure ElectronH0Wannier::populate(Points &fullPoints,
                                               const bool &withVelocities,
                                               const bool &withEigenvectors,
                                               const bool isDistributed) {
+  return cachedPopulate(fullPoints, withVelocities, withEigenvectors,
+                        isDistributed, [&]() {
+    return interpolateBandStructure(fullPoints, withVelocities,
+                                    withEigenvectors, isDistributed);
+  });
+}
+
+uint64_t ElectronH0Wannier::getHamiltonianHash() {
+  uint64_t hash = 14695981039346656037ULL;
+  addToHash(hash, &numWannier, sizeof(int));
+  addToHash(hash, directUnitCell.data(), 9 * sizeof(double));
+  addToHash(hash, bravaisVectors.data(), bravaisVectors.size() * sizeof(double));
+  addToHash(hash, vectorsDegeneracies.data(),
+            vectorsDegeneracies.size() * sizeof(double));
+  addToHash(hash, h0R.data(), h0R.size() * sizeof(std::complex<double>));
+  if (hasShiftedVectors) {
+    addToHash(hash, degeneracyShifts.data(),
+              degeneracyShifts.size() * sizeof(double));
+    addToHash(hash, vectorsShifts.data(), vectorsShifts.size() * sizeof(double));
+  }
+  return hash;
+}
+
+FullBandStructure ElectronH0Wannier::interpolateBandStructure(
+    Points &fullPoints, const bool &withVelocities,
+    const bool &withEigenvectors, const bool &isDistributed) {
 
   // generate a band structure to be filled and returned
   FullBandStructure fullBandStructure(numWannier, particle, withVelocities,
-                                      withEigenvectors, fullPoints, isDistributed);
+                                      withEigenvectors, fullPoints, isDistributed,
+                                      onlyGroupVelocities);
 
   // set up cartesian coords list from fullPoints
   // ask each process to diagonalize the local wavevectors for this bandstruct
@@ -466,7 +609,7 @@ FullBandStructure ElectronH0Wannier::cpuPopulate(Points &fullPoints,
 
   FullBandStructure fullBandStructure(numWannier, particle, withVelocities,
                                       withEigenvectors, fullPoints,
-                                      isDistributed);
+                                      isDistributed, onlyGroupVelocities);
 
   // first prepare the list of wavevectors
   std::vector<int> iks = fullBandStructure.getWavevectorIndices();
@@ -491,7 +634,8 @@ FullBandStructure ElectronH0Wannier::cpuPopulate(Points &fullPoints,
     allEigenvectors = std::get<1>(t);
     allVelocities = std::get<2>(t);
   } else {
-    auto t = batchedDiagonalizeFromCoordinates(cartesianWavevectors);
+    auto t = batchedDiagonalizeFromCoordinates(cartesianWavevectors,
+                                               withEigenvectors);
     allEnergies = std::get<0>(t);
     allEigenvectors = std::get<1>(t);
   }
@@ -559,6 +703,7 @@ ElectronH0Wannier::getBerryConnection(Point &point) {
 
 void ElectronH0Wannier::addShiftedVectors(Eigen::Tensor<double,3> degeneracyShifts_,
                        Eigen::Tensor<double,5> vectorsShifts_) {
+  DeviceMemoryScope memoryScope("ElectronH0Wannier");
   // some validation
   if (degeneracyShifts_.dimension(0) != numWannier ||
       degeneracyShifts_.dimension(1) != numWannier ||
@@ -592,30 +737,59 @@ void ElectronH0Wannier::addShiftedVectors(Eigen::Tensor<double,3> degeneracyShif
   }
 
 
+  // compress the shifted vectors, keeping only the non-vanishing terms
+  shiftStart.assign(numWannier * numWannier + 1, 0);
+  int numShifts = 0;
+  for (int iw1 = 0; iw1 < numWannier; iw1++) {
+    for (int iw2 = 0; iw2 < numWannier; iw2++) {
+      for (int iR = 0; iR < numVectors; iR++) {
+        numShifts += int(degeneracyShifts(iw1, iw2, iR));
+      }
+      shiftStart[iw1 * numWannier + iw2 + 1] = numShifts;
+    }
+  }
+  shiftVectors.resize(3, numShifts);
+  shiftCoefficients.resize(numShifts);
+  for (int iw1 = 0; iw1 < numWannier; iw1++) {
+    for (int iw2 = 0; iw2 < numWannier; iw2++) {
+      int iShift = shiftStart[iw1 * numWannier + iw2];
+      for (int iR = 0; iR < numVectors; iR++) {
+        for (int iDeg = 0; iDeg < degeneracyShifts(iw1, iw2, iR); ++iDeg) {
+          for (int i : {0, 1, 2}) {
+            shiftVectors(i, iShift) = vectorsShifts(i, iDeg, iw1, iw2, iR);
+          }
+          shiftCoefficients(iShift) = h0R(iR, iw1, iw2)
+              / (vectorsDegeneracies(iR) * degeneracyShifts(iw1, iw2, iR));
+          ++iShift;
+        }
+      }
+    }
+  }
+
   { // copy to GPU
     // Note: getDeviceMemory usage checks on the size of the *_d Views
     // so, we remove here the previously added vectors and add back later below
     double oldMemory = getDeviceMemoryUsage();
     kokkosDeviceMemory->removeDeviceMemoryUsage(oldMemory);
 
-    Kokkos::resize(degeneracyShifts_d, numWannier, numWannier, numVectors);
-    Kokkos::resize(vectorsShifts_d, 3, 8, numWannier, numWannier, numVectors);
-    auto degeneracyShifts_h = create_mirror_view(degeneracyShifts_d);
-    auto vectorsShifts_h = create_mirror_view(vectorsShifts_d);
-    for (int iR = 0; iR < numVectors; iR++) {
-      for (int i = 0; i < numWannier; i++) {
-        for (int j = 0; j < numWannier; j++) {
-          degeneracyShifts_h(i, j, iR) = degeneracyShifts(i, j, iR);
-          for (int a = 0; a < 3; ++a) {
-            for (int b = 0; b < 8; ++b) {
-              vectorsShifts_h(a, b, i, j, iR) = vectorsShifts(a, b, i, j, iR);
-            }
-          }
-        }
+    Kokkos::resize(shiftStart_d, numWannier * numWannier + 1);
+    Kokkos::resize(shiftVectors_d, numShifts, 3);
+    Kokkos::resize(shiftCoefficients_d, numShifts);
+    auto shiftStart_h = create_mirror_view(shiftStart_d);
+    auto shiftVectors_h = create_mirror_view(shiftVectors_d);
+    auto shiftCoefficients_h = create_mirror_view(shiftCoefficients_d);
+    for (int iPair = 0; iPair <= numWannier * numWannier; iPair++) {
+      shiftStart_h(iPair) = shiftStart[iPair];
+    }
+    for (int iShift = 0; iShift < numShifts; iShift++) {
+      for (int i = 0; i < 3; ++i) {
+        shiftVectors_h(iShift, i) = shiftVectors(i, iShift);
       }
+      shiftCoefficients_h(iShift) = shiftCoefficients(iShift);
     }
-    Kokkos::deep_copy(degeneracyShifts_d, degeneracyShifts_h);
-    Kokkos::deep_copy(vectorsShifts_d, vectorsShifts_h);
+    Kokkos::deep_copy(shiftStart_d, shiftStart_h);
+    Kokkos::deep_copy(shiftVectors_d, shiftVectors_h);
+    Kokkos::deep_copy(shiftCoefficients_d, shiftCoefficients_h);
 
     double newMemory = getDeviceMemoryUsage();
     kokkosDeviceMemory->addDeviceMemoryUsage(newMemory);
@@ -637,26 +811,13 @@ ElectronH0Wannier::batchedDiagonalizeWithVelocities(
 
   int numK = cartesianCoordinates.size();
 
-  double delta = 1.0e-8;
   double threshold = 0.000001 / energyRyToEv; // = 1 micro-eV
 
-  std::vector<Eigen::Vector3d> allVectors(numK * 7);
-#pragma omp parallel for
-  for (int iK = 0; iK < numK; ++iK) {
-    Eigen::Vector3d coordinates = cartesianCoordinates[iK];
-    allVectors[iK * 7] = coordinates;
-    for (int i : {0, 1, 2}) {
-      // define q+ and q- from finite differences.
-      Eigen::Vector3d qPlus = coordinates;
-      Eigen::Vector3d qMins = coordinates;
-      qPlus(i) += delta;
-      qMins(i) -= delta;
-      allVectors[iK * 7 + i * 2 + 1] = qPlus; // 1, 3, 5, 8
-      allVectors[iK * 7 + i * 2 + 2] = qMins;// 2, 4, 6, 9
-    }
-  }
-
-  auto Hs = batchedBuildHamiltonians(allVectors);
+  // the derivative dH/dk comes analytically from the same Fourier transform
+  // as the Hamiltonian, so no extra wavevectors are needed
+  auto tH = batchedBuildHamiltoniansAndDerivatives(cartesianCoordinates);
+  auto Hs = std::get<0>(tH);
+  auto dHs = std::get<1>(tH);
 
   std::vector<Eigen::VectorXd> resultsEnergies(numK);
   std::vector<Eigen::MatrixXcd> resultsEigenvectors(numK);
@@ -666,7 +827,7 @@ ElectronH0Wannier::batchedDiagonalizeWithVelocities(
 
 #pragma omp parallel for
   for (int iK=0; iK<numK; ++iK) {
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(Hs[iK*7]);
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(Hs[iK]);
     resultsEnergies[iK] = eigenSolver.eigenvalues();
     resultsEigenvectors[iK] = eigenSolver.eigenvectors();
   }
@@ -685,23 +846,12 @@ ElectronH0Wannier::batchedDiagonalizeWithVelocities(
       continue;
     }
 
-    // now we compute the velocity operator, diagonalizing the expectation
-    // value of the derivative of the dynamical matrix.
-    // This works better than doing finite differences on the frequencies.
+    // now we compute the velocity operator, as the expectation value of the
+    // derivative of the Hamiltonian (Hellmann-Feynman theorem).
     for (int i : {0, 1, 2}) {
-      // build the dynamical matrix at the two wavevectors
-      // since we diagonalized it before, A = M.U.M*
-      Eigen::MatrixXcd sqrtDPlus = Hs[iK * 7 + i * 2 + 1];
-      Eigen::MatrixXcd sqrtDMins = Hs[iK * 7 + i * 2 + 2];
-
-      // now we can build the velocity operator
-      Eigen::MatrixXcd der = (sqrtDPlus - sqrtDMins) / (2. * delta);
-
-      // and to be safe, we reimpose hermiticity
-      der = 0.5 * (der + der.adjoint());
-
-      // now we rotate in the basis of the eigenvectors at q.
-      der = resultsEigenvectors[iK].adjoint() * der * resultsEigenvectors[iK];
+      // rotate dH/dk in the basis of the eigenvectors at k.
+      Eigen::MatrixXcd der = resultsEigenvectors[iK].adjoint() * dHs[iK * 3 + i]
+          * resultsEigenvectors[iK];
 
       for (int ib1 = 0; ib1 < numWannier; ib1++) {
         for (int ib2 = 0; ib2 < numWannier; ib2++) {
@@ -810,43 +960,168 @@ StridedComplexView3D ElectronH0Wannier::kokkosBatchedBuildBlochHamiltonian(
           elPhases_d(iK, iR) = exp(complexI * arg) / vectorsDegeneracies_d(iR);
         });
 
+    kokkosBatchedFourierTransform(elPhases_d, h0R_d, hamiltonians);
+    Kokkos::realloc(elPhases_d, 0, 0);
+
+  } else {
+    // with shifts, only over the non-vanishing terms of each Wannier pair
+    auto shiftStart_d = this->shiftStart_d;
+    auto shiftVectors_d = this->shiftVectors_d;
+    auto shiftCoefficients_d = this->shiftCoefficients_d;
+
     Kokkos::parallel_for(
-        "el_hamilton", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
+        "elHamiltonianShifted_d",
+        Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
+        KOKKOS_LAMBDA(int iK, int iw1, int iw2) {
+          Kokkos::complex<double> tmp(0.0);
+          int iPair = iw1 * numWannier + iw2;
+          for (int iShift = shiftStart_d(iPair);
+               iShift < shiftStart_d(iPair + 1); ++iShift) {
+            double arg = 0.;
+            for (int i = 0; i < 3; ++i) {
+              arg += cartesianCoordinates(iK, i) * shiftVectors_d(iShift, i);
+            }
+            tmp += shiftCoefficients_d(iShift) * exp(complexI * arg);
+          }
+          hamiltonians(iK, iw1, iw2) = tmp;
+        });
+  }
+
+  return hamiltonians;
+}
+
+/**
+ * Build Hamiltonians and their derivatives dH/dk for a batch of k-points
+ */
+std::tuple<StridedComplexView3D, ComplexView4D, ComplexView4D>
+ElectronH0Wannier::kokkosBatchedBuildBlochHamiltonianAndDerivatives(
+    const DoubleView2D &cartesianCoordinates, const bool &withPositions) {
+
+  // Kokkos quirkyness
+  int numWannier = this->numWannier;
+  int numVectors = this->numVectors;
+
+  int numK = cartesianCoordinates.extent(0);
+
+  // Col-major matrices stored contiguously
+  Kokkos::LayoutStride Hlayout(
+      numK, numWannier*numWannier,
+      numWannier, 1,
+      numWannier, numWannier
+  );
+
+  StridedComplexView3D hamiltonians("hamiltonians", Hlayout);
+  ComplexView4D derivatives("dHdk", numK, numWannier, numWannier, 3);
+  ComplexView4D positions;
+  if (withPositions) {
+    Kokkos::resize(positions, numK, numWannier, numWannier, 3);
+  }
+  Kokkos::complex<double> complexI(0.0, 1.0);
+
+  auto bravaisVectors_d = this->bravaisVectors_d;
+  auto vectorsDegeneracies_d = this->vectorsDegeneracies_d;
+  auto h0R_d = this->h0R_d;
+  auto rMatrix_d = this->rMatrix_d;
+
+  // H(k) = sum_R e^{ikR} H(R), so that dH/dk = sum_R iR e^{ikR} H(R)
+  // and the derivative costs only a few more operations per term of the sum
+  if (!hasShiftedVectors) {
+    ComplexView2D elPhases_d("elPhases_d", numK, numVectors);
+    Kokkos::parallel_for(
+        "el_phases", Range2D({0, 0}, {numK, numVectors}),
+        KOKKOS_LAMBDA(int iK, int iR) {
+          double arg = 0.0;
+          for (int i = 0; i < 3; i++) {
+            arg += cartesianCoordinates(iK, i) * bravaisVectors_d(iR, i);
+          }
+          elPhases_d(iK, iR) = exp(complexI * arg) / vectorsDegeneracies_d(iR);
+        });
+
+    Kokkos::parallel_for(
+        "el_hamilton_der", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
         KOKKOS_LAMBDA(int iK, int m, int n) {
           Kokkos::complex<double> tmp(0.0);
+          Kokkos::complex<double> tmpD[3] = {0.0, 0.0, 0.0};
+          Kokkos::complex<double> tmpR[3] = {0.0, 0.0, 0.0};
           for (int iR = 0; iR < numVectors; iR++) {
-            tmp += elPhases_d(iK, iR) * h0R_d(m, n, iR);
+            Kokkos::complex<double> x = elPhases_d(iK, iR) * h0R_d(m, n, iR);
+            tmp += x;
+            for (int i = 0; i < 3; i++) {
+              tmpD[i] += complexI * bravaisVectors_d(iR, i) * x;
+            }
+            if (withPositions) {
+              for (int i = 0; i < 3; i++) {
+                tmpR[i] += elPhases_d(iK, iR) * rMatrix_d(m, n, iR, i);
+              }
+            }
           }
           hamiltonians(iK, m, n) = tmp;
+          for (int i = 0; i < 3; i++) {
+            derivatives(iK, m, n, i) = tmpD[i];
+          }
+          if (withPositions) {
+            for (int i = 0; i < 3; i++) {
+              positions(iK, m, n, i) = tmpR[i];
+            }
+          }
         });
     Kokkos::realloc(elPhases_d, 0, 0);
 
   } else {
-    // with shifts
-    auto vectorsShifts_d = this->vectorsShifts_d;
-    auto degeneracyShifts_d = this->degeneracyShifts_d;
+    // with shifts, only over the non-vanishing terms of each Wannier pair
+    auto shiftStart_d = this->shiftStart_d;
+    auto shiftVectors_d = this->shiftVectors_d;
+    auto shiftCoefficients_d = this->shiftCoefficients_d;
 
     Kokkos::parallel_for(
-        "elHamiltonianShifted_d",
+        "elHamiltonianShiftedDer_d",
         Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
         KOKKOS_LAMBDA(int iK, int iw1, int iw2) {
           Kokkos::complex<double> tmp(0.0);
-          for (int iR = 0; iR < numVectors; iR++) {
-            for (int iDeg = 0; iDeg < degeneracyShifts_d(iw1, iw2, iR); ++iDeg) {
+          Kokkos::complex<double> tmpD[3] = {0.0, 0.0, 0.0};
+          Kokkos::complex<double> tmpR[3] = {0.0, 0.0, 0.0};
+          // as in getBerryConnection, the position operator is transformed
+          // with the phases of the lattice vectors, without the shifts
+          if (withPositions) {
+            for (int iR = 0; iR < numVectors; iR++) {
               double arg = 0.;
               for (int i = 0; i < 3; ++i) {
-                arg += cartesianCoordinates(iK, i) * vectorsShifts_d(i, iDeg, iw1, iw2, iR);
+                arg += cartesianCoordinates(iK, i) * bravaisVectors_d(iR, i);
+              }
+              Kokkos::complex<double> phase =
+                  exp(complexI * arg) / vectorsDegeneracies_d(iR);
+              for (int i = 0; i < 3; ++i) {
+                tmpR[i] += phase * rMatrix_d(iw1, iw2, iR, i);
               }
-              Kokkos::complex<double> phase = exp(complexI * arg)
-                  / vectorsDegeneracies_d(iR) * degeneracyShifts_d(iw1, iw2, iR);
-              tmp += h0R_d(iR, iw1, iw2) * phase;
+            }
+          }
+          int iPair = iw1 * numWannier + iw2;
+          for (int iShift = shiftStart_d(iPair);
+               iShift < shiftStart_d(iPair + 1); ++iShift) {
+            double arg = 0.;
+            for (int i = 0; i < 3; ++i) {
+              arg += cartesianCoordinates(iK, i) * shiftVectors_d(iShift, i);
+            }
+            Kokkos::complex<double> x =
+                shiftCoefficients_d(iShift) * exp(complexI * arg);
+            tmp += x;
+            for (int i = 0; i < 3; ++i) {
+              tmpD[i] += complexI * shiftVectors_d(iShift, i) * x;
             }
           }
           hamiltonians(iK, iw1, iw2) = tmp;
+          for (int i = 0; i < 3; ++i) {
+            derivatives(iK, iw1, iw2, i) = tmpD[i];
+          }
+          if (withPositions) {
+            for (int i = 0; i < 3; ++i) {
+              positions(iK, iw1, iw2, i) = tmpR[i];
+            }
+          }
         });
   }
 
-  return hamiltonians;
+  return std::make_tuple(hamiltonians, derivatives, positions);
 }
 
 /**
@@ -854,6 +1129,7 @@ StridedComplexView3D ElectronH0Wannier::kokkosBatchedBuildBlochHamiltonian(
  */
 std::tuple<DoubleView2D, StridedComplexView3D> ElectronH0Wannier::kokkosBatchedDiagonalizeFromCoordinates(
     const DoubleView2D &cartesianCoordinates, const bool withMassScaling) {
+  DeviceMemoryScope memoryScope("ElectronH0Wannier");
 
   // currently not used, this supresses a warning
   (void) withMassScaling;
@@ -876,6 +1152,17 @@ std::tuple<DoubleView2D, StridedComplexView3D> ElectronH0Wannier::kokkosBatchedD
   return std::make_tuple(allEnergies, blochHamiltonians);
 }
 
+DoubleView2D ElectronH0Wannier::kokkosBatchedEnergies(
+    const DoubleView2D &cartesianCoordinates) {
+  DeviceMemoryScope memoryScope("ElectronH0Wannier");
+  StridedComplexView3D blochHamiltonians =
+      kokkosBatchedBuildBlochHamiltonian(cartesianCoordinates);
+  int numK = blochHamiltonians.extent(0);
+  DoubleView2D allEnergies("energies_d", numK, numWannier);
+  kokkosZHEEV(blochHamiltonians, allEnergies, false);
+  return allEnergies;
+}
+
 /**
  * Build and diagonalize Hamiltonians, with velocities
  * Returns the energies (nk, nb), eigenvectors (nk, nb, nb)
@@ -887,82 +1174,80 @@ std::tuple<DoubleView2D, StridedComplexView3D> ElectronH0Wannier::kokkosBatchedD
 std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D>
 ElectronH0Wannier::kokkosBatchedDiagonalizeWithVelocities(
     const DoubleView2D &cartesianCoordinates) {
+  auto t = kokkosBatchedDiagonalizeWithVelocities(cartesianCoordinates, false);
+  return std::make_tuple(std::get<0>(t), std::get<1>(t), std::get<2>(t));
+}
+
+std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D, ComplexView4D>
+ElectronH0Wannier::kokkosBatchedDiagonalizeWithBerryConnection(
+    const DoubleView2D &cartesianCoordinates) {
+  copyPositionsToDevice();
+  return kokkosBatchedDiagonalizeWithVelocities(cartesianCoordinates, true);
+}
+
+void ElectronH0Wannier::copyPositionsToDevice() {
+  if (rMatrix_d.extent(0) > 0) {
+    return;
+  }
+  DeviceMemoryScope memoryScope("ElectronH0Wannier");
+  Kokkos::resize(rMatrix_d, numWannier, numWannier, numVectors, 3);
+  auto rMatrix_h = create_mirror_view(rMatrix_d);
+  for (int iR = 0; iR < numVectors; iR++) {
+    for (int i = 0; i < numWannier; i++) {
+      for (int j = 0; j < numWannier; j++) {
+        for (int iCart : {0, 1, 2}) {
+          rMatrix_h(i, j, iR, iCart) = rMatrix(iCart, iR, i, j);
+        }
+      }
+    }
+  }
+  Kokkos::deep_copy(rMatrix_d, rMatrix_h);
+  kokkosDeviceMemory->addDeviceMemoryUsage(16. * rMatrix_d.size());
+}
+
+std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D, ComplexView4D>
+ElectronH0Wannier::kokkosBatchedDiagonalizeWithVelocities(
+    const DoubleView2D &cartesianCoordinates,
+    const bool &withBerryConnection) {
+  DeviceMemoryScope memoryScope("ElectronH0Wannier");
 
   int numWannier = this->numWannier; // Kokkos quirkyness
 
   int numK = cartesianCoordinates.extent(0);
 
-  double delta = 1.0e-8;
   double threshold = 0.000001 / energyRyToEv;// = 1 micro-eV
 
-  // prepare all the wavevectors at which we need the hamiltonian
-  DoubleView2D allVectors("wavevectors_k", numK * 7, 3);
-  Kokkos::parallel_for(
-      "elHamiltonianShifted_d", numK, KOKKOS_LAMBDA(int iK) {
-        for (int i = 0; i < 3; ++i) {
-          allVectors(iK * 7, i) = cartesianCoordinates(iK, i);
-        }
-        for (int iDir = 0; iDir < 3; ++iDir) {
-          for (int i = 0; i < 3; ++i) {
-            allVectors(iK * 7 + iDir * 2 + 1, i) = cartesianCoordinates(iK, i);
-            allVectors(iK * 7 + iDir * 2 + 2, i) = cartesianCoordinates(iK, i);
-            if (iDir == i) {
-              allVectors(iK * 7 + iDir * 2 + 1, i) += delta;
-              allVectors(iK * 7 + iDir * 2 + 2, i) -= delta;
-            }
-          }
-        }
-      });
-
-  // Col-major matrices stored contiguously
-  Kokkos::LayoutStride Hlayout(
-      numK, numWannier*numWannier,
-      numWannier, 1,
-      numWannier, numWannier
-  );
-
-  // compute the electronic properties at all wavevectors
-  StridedComplexView3D allHamiltonians = kokkosBatchedBuildBlochHamiltonian(allVectors);
+  // compute the Hamiltonian and its analytic derivative dH/dk.
+  // The Hamiltonian matrices are overwritten with the eigenvectors
+  StridedComplexView3D resultEigenvectors;
+  ComplexView4D der;
+  ComplexView4D positions;
+  {
+    auto t = kokkosBatchedBuildBlochHamiltonianAndDerivatives(
+        cartesianCoordinates, withBerryConnection);
+    resultEigenvectors = std::get<0>(t);
+    der = std::get<1>(t);
+    positions = std::get<2>(t);
+  }
 
-  // save energies and eigenvectors to results
   DoubleView2D resultEnergies("energies", numK, numWannier);
-  StridedComplexView3D resultEigenvectors("eigenvectors", Hlayout);
   ComplexView4D resultVelocities("velocities", numK, numWannier, numWannier, 3);
 
-  // put the Hamiltonian matrix in resultEigenvectors
-  Kokkos::parallel_for(
-      "eigenvectors", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
-      KOKKOS_LAMBDA(int iK, int m, int n) {
-        resultEigenvectors(iK, m, n) = allHamiltonians(iK*7, m, n);
-      });
   // now, diagonalize the H matrix in place
   kokkosZHEEV(resultEigenvectors, resultEnergies);
 
-  // these are temporary "scratch" memory spaces
-  ComplexView3D der("der", numK, numWannier, numWannier);
+  // this is a temporary "scratch" memory space
   ComplexView3D tmpV("tmpV", numK, numWannier, numWannier);
 
   for (int i = 0; i < 3; ++i) {
 
-    // To build the velocity operator, we first compute the matrix
-    // der = dH/dk = ( H(k+dk)-H(k-dk) ) / 2dk
-    // we also reinforce the Hermiticity (better numerical properties)
-    Kokkos::parallel_for(
-        "der", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
-        KOKKOS_LAMBDA(int iK, int m, int n) {
-          auto HPlus = Kokkos::subview(allHamiltonians, iK * 7 + i * 2 + 1, Kokkos::ALL, Kokkos::ALL);
-          auto HMins = Kokkos::subview(allHamiltonians, iK * 7 + i * 2 + 2, Kokkos::ALL, Kokkos::ALL);
-          der(iK, m, n) = 0.25 / delta * ((HPlus(m, n) - HMins(m, n))
-                 + Kokkos::conj(HPlus(n, m) - HMins(n, m)));
-        });
-
-    // Now we complete the Hellman-Feynman theorem
-    // and compute the velocity as v = U(k)^* der * U(k)
+    // We use the Hellman-Feynman theorem
+    // and compute the velocity as v = U(k)^* dH/dk * U(k)
     Kokkos::parallel_for(
         "tmpV", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
         KOKKOS_LAMBDA(int iK, int m, int n) {
           auto L = Kokkos::subview(resultEigenvectors, iK, Kokkos::ALL, Kokkos::ALL);
-          auto R = Kokkos::subview(der, iK, Kokkos::ALL, Kokkos::ALL);
+          auto R = Kokkos::subview(der, iK, Kokkos::ALL, Kokkos::ALL, i);
           auto A = Kokkos::subview(tmpV, iK, Kokkos::ALL, Kokkos::ALL);
           Kokkos::complex<double> tmp(0.,0.);
           for (int l = 0; l < numWannier; ++l) {
@@ -988,25 +1273,64 @@ ElectronH0Wannier::kokkosBatchedDiagonalizeWithVelocities(
         });
   }
 
+  Kokkos::resize(der, 0, 0, 0, 0);
+
+  // the Berry connection is U(k)^* r(k) U(k), with r(k) the Fourier
+  // transform of the position operator
+  ComplexView4D resultBerryConnection;
+  if (withBerryConnection) {
+    Kokkos::resize(resultBerryConnection, numK, numWannier, numWannier, 3);
+    for (int i = 0; i < 3; ++i) {
+      Kokkos::parallel_for(
+          "tmpA", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
+          KOKKOS_LAMBDA(int iK, int m, int n) {
+            Kokkos::complex<double> tmp(0.,0.);
+            for (int l = 0; l < numWannier; ++l) {
+              tmp += Kokkos::conj(resultEigenvectors(iK, l, m))
+                  * positions(iK, l, n, i);
+            }
+            tmpV(iK, m, n) = tmp;
+          });
+
+      Kokkos::parallel_for(
+          "berry", Range3D({0, 0, 0}, {numK, numWannier, numWannier}),
+          KOKKOS_LAMBDA(int iK, int m, int n) {
+            Kokkos::complex<double> tmp(0.,0.);
+            for (int l = 0; l < numWannier; ++l) {
+              tmp += tmpV(iK, m, l) * resultEigenvectors(iK, l, n);
+            }
+            resultBerryConnection(iK, m, n, i) = tmp;
+          });
+    }
+    Kokkos::resize(positions, 0, 0, 0, 0);
+  }
+
   // deallocate the scratch
-  Kokkos::resize(der, 0, 0, 0);
   Kokkos::resize(tmpV, 0, 0, 0);
 
   kokkosBatchedTreatDegenerateVelocities(cartesianCoordinates, resultEnergies,
                                          resultVelocities, threshold);
 
-  return std::make_tuple(resultEnergies, resultEigenvectors, resultVelocities);
+  return std::make_tuple(resultEnergies, resultEigenvectors, resultVelocities,
+                         resultBerryConnection);
 }
 
 double ElectronH0Wannier::getDeviceMemoryUsage() {
-  double memory = 16 * h0R_d.size() +
-      8 * double(degeneracyShifts_d.size() + vectorsShifts_d.size() +
-                 vectorsDegeneracies_d.size() + bravaisVectors_d.size());
+  double memory = 16 * double(h0R_d.size() + rMatrix_d.size() +
+                             shiftCoefficients_d.size()) +
+      8 * double(shiftVectors_d.size() + vectorsDegeneracies_d.size() +
+                 bravaisVectors_d.size()) +
+      4 * double(shiftStart_d.size());
   return memory;
 }
 
 // helper to figure out how many kpoints to put in a kpoint batch on host
 int ElectronH0Wannier::estimateBatchSize(const bool& withVelocity) {
+  return estimateBatchSize(withVelocity, false);
+}
+
+int ElectronH0Wannier::estimateBatchSize(const bool& withVelocity,
+                                         const bool& withBerryConnection) {
 
   double memoryAvailable = kokkosDeviceMemory->getAvailableMemory();
   std::complex<double> tmpC;
@@ -1021,12 +1345,17 @@ int ElectronH0Wannier::estimateBatchSize(const bool& withVelocity) {
   int diagonalizationSize = 2*matrixSize + numWannier; // diagonalization of H
   double memoryPerPoint = 0.;
   if (withVelocity) {
+    // dH/dk (3 matrices) is kept until the end, together with the
+    // velocities (3 matrices) and one scratch matrix
     memoryPerPoint += sizeof(tmpC)
-        * std::max(diagonalizationSize*7,
-                   transformSize*7 + 2*matrixSize + matrixSize*3);
+        * (std::max(diagonalizationSize, transformSize) + matrixSize*7);
   } else {
     memoryPerPoint += sizeof(tmpC) * std::max(diagonalizationSize, transformSize);
   }
+  if (withBerryConnection) {
+    // the position operator and the Berry connection (3 matrices each)
+    memoryPerPoint += sizeof(tmpC) * matrixSize * 6;
+  }
 
   // we try to use 95% of the available memory (leave some buffer)
   int numBatches = int(memoryAvailable / memoryPerPoint * 0.95);
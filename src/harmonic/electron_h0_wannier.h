@@ -64,10 +64,13 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
    *
    * @param cartesianWavevectors: a std::vector containing the cartesian
    * coordinates of nk wavevectors.
+   * @param withEigenvectors: if false, only the energies are computed, and
+   * the eigenvector matrices are empty.
    * @return tuple with vectors of energies(nk,nb) and eigenvectors(nk,nb,nb).
    */
   std::tuple<std::vector<Eigen::VectorXd>, std::vector<Eigen::MatrixXcd>>
-  batchedDiagonalizeFromCoordinates(std::vector<Eigen::Vector3d>& cartesianWavevectors);
+  batchedDiagonalizeFromCoordinates(std::vector<Eigen::Vector3d>& cartesianWavevectors,
+                                    const bool &withEigenvectors = true);
 
   /** Computes the Fourier transform of the Wannier Hamiltonian at a batch of
    * wavevectors.
@@ -79,6 +82,20 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
   std::vector<Eigen::MatrixXcd> batchedBuildHamiltonians(
     std::vector<Eigen::Vector3d>& cartesianWavevectors);
 
+  /** Computes the Fourier transform of the Wannier Hamiltonian at a batch of
+   * wavevectors, together with its analytic derivative dH/dk, obtained
+   * within the same sum over Bravais lattice vectors.
+   *
+   * @param cartesianWavevectors: a std::vector containing the cartesian
+   * coordinates of nk wavevectors.
+   * @return tuple with the nk hamiltonian matrices in the Bloch
+   * representation, and the 3*nk matrices dH/dk_i, where the derivative along
+   * the cartesian direction i at the wavevector iK is stored at iK*3+i.
+   */
+  std::tuple<std::vector<Eigen::MatrixXcd>, std::vector<Eigen::MatrixXcd>>
+  batchedBuildHamiltoniansAndDerivatives(
+    std::vector<Eigen::Vector3d>& cartesianWavevectors);
+
   /** Computes the Fourier transform of the Wannier Hamiltonian at a batch of
    * wavevectors.
    *
@@ -91,6 +108,24 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
   StridedComplexView3D kokkosBatchedBuildBlochHamiltonian(
     const DoubleView2D &cartesianCoordinates) override;
 
+  /** Same as kokkosBatchedBuildBlochHamiltonian, but also computes the
+   * analytic derivative of the Hamiltonian dH/dk, reusing the phases of the
+   * Fourier transform.
+   *
+   * @param cartesianCoordinates: a DoubleView2D object of size (nk,3)
+   * (must already be on the GPU), with the cartesian coordinates of the
+   * wavevectors.
+   * @param withPositions: if true, also computes the Fourier transform of
+   * the position operator <0m|r|nR>, in the same sum over lattice vectors.
+   * @return a tuple with the Hamiltonians (nk,nb,nb), stored as column-major
+   * matrices, their derivatives (nk,nb,nb,3) and, if requested, the position
+   * operator in the Wannier gauge (nk,nb,nb,3), otherwise an empty view.
+   */
+  std::tuple<StridedComplexView3D, ComplexView4D, ComplexView4D>
+  kokkosBatchedBuildBlochHamiltonianAndDerivatives(
+    const DoubleView2D &cartesianCoordinates,
+    const bool &withPositions=false);
+
   /** Computes energies and eigenvectors of electrons for a batch of nk
    * wavevectors.
    *
@@ -102,6 +137,8 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
    */
   std::tuple<DoubleView2D, StridedComplexView3D> kokkosBatchedDiagonalizeFromCoordinates(
       const DoubleView2D &cartesianCoordinates, const bool withMassScaling=true) override;
+  DoubleView2D kokkosBatchedEnergies(
+      const DoubleView2D &cartesianCoordinates) override;
   /** Using kokkos, computes the electronic properties of a batch of wavevectors
    *
    * @param cartesianCoordinates: a ComplexView2D object of size (nk,3)
@@ -114,6 +151,23 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
   kokkosBatchedDiagonalizeWithVelocities(
       const DoubleView2D &cartesianCoordinates) override;
 
+  /** Same as kokkosBatchedDiagonalizeWithVelocities, but also computes the
+   * Berry connection <u_mk| nabla_k |u_nk>, i.e. the batched version of
+   * getBerryConnection(). The position operator is summed over the lattice
+   * vectors together with the Hamiltonian and its derivative, and rotated
+   * to the Bloch gauge with the same eigenvectors of the velocities.
+   *
+   * @param cartesianCoordinates: a DoubleView2D object of size (nk,3)
+   * (must already be on the GPU), with the cartesian coordinates of the
+   * wavevectors.
+   * @return a tuple with energies(nk,nb), eigenvectors(nk,nb,nb),
+   * velocities(nk,nb,nb,3) and Berry connection(nk,nb,nb,3) at each
+   * wavevector.
+   */
+  std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D, ComplexView4D>
+  kokkosBatchedDiagonalizeWithBerryConnection(
+      const DoubleView2D &cartesianCoordinates);
+
   /** get the electron velocities (in atomic units) at a single k-point.
    * @param k: a Point object with the wavevector coordinates.
    * @return velocity(numBands,numBands,3): values of the velocity operator
@@ -204,6 +258,12 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
    */
   int estimateBatchSize(const bool& withVelocity) override;
 
+  /** Same as estimateBatchSize(withVelocity), for the batches of
+   * kokkosBatchedDiagonalizeWithBerryConnection if withBerryConnection.
+   */
+  int estimateBatchSize(const bool& withVelocity,
+                        const bool& withBerryConnection);
+
  protected:
   Particle particle;
 
@@ -224,12 +284,27 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
   Eigen::Tensor<double,3> degeneracyShifts;
   Eigen::Tensor<double,5> vectorsShifts;
   bool hasShiftedVectors = false;
+  // the terms of the Fourier transform with shifted vectors, stored in a
+  // compressed format without the vanishing ones: the terms of the Wannier
+  // pair (iw1,iw2) are shiftStart[iw1*numWannier+iw2] <= iShift <
+  // shiftStart[iw1*numWannier+iw2+1], each with its shifted lattice vector
+  // and the coefficient h0R(R,iw1,iw2) / (vectorsDegeneracies(R) *
+  // degeneracyShifts(iw1,iw2,R)).
+  std::vector<int> shiftStart;
+  Eigen::Matrix<double, 3, Eigen::Dynamic> shiftVectors;
+  Eigen::VectorXcd shiftCoefficients;
 
   ComplexView3D h0R_d;
-  DoubleView3D degeneracyShifts_d;
-  DoubleView5D vectorsShifts_d;
+  IntView1D shiftStart_d;
+  DoubleView2D shiftVectors_d;
+  ComplexView1D shiftCoefficients_d;
   DoubleView1D vectorsDegeneracies_d;
   DoubleView2D bravaisVectors_d;
+  // position matrix elements (m,n,R,3), copied to the device on the first
+  // call of kokkosBatchedDiagonalizeWithBerryConnection
+  ComplexView4D rMatrix_d;
+  // pinned host buffers for the transfers of the batches of kokkosPopulate
+  HostStagingArena stagingArena;
 
   /** Checks the size of Device-allocated views
    *
@@ -237,6 +312,31 @@ class ElectronH0Wannier : public HarmonicHamiltonian {
    */
   double getDeviceMemoryUsage();
 
+  /** Copies the position matrix elements to the device, if not done yet.
+   */
+  void copyPositionsToDevice();
+
+  /** Implementation of kokkosBatchedDiagonalizeWithVelocities, which also
+   * computes the Berry connection if withBerryConnection (otherwise the
+   * last view of the tuple is empty).
+   */
+  std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D, ComplexView4D>
+  kokkosBatchedDiagonalizeWithVelocities(
+      const DoubleView2D &cartesianCoordinates,
+      const bool &withBerryConnection);
+
+  /** Hash of the Wannier Hamiltonian, identifying the band structures cached
+   * on disk by populate().
+   */
+  uint64_t getHamiltonianHash() override;
+
+  /** Same as populate(), without looking for a band structure on disk.
+   */
+  FullBandStructure interpolateBandStructure(Points &fullPoints,
+                                             const bool &withVelocities,
+                                             const bool &withEigenvectors,
+                                             const bool &isDistributed);
+
 };
 
 #endif
@@ -1,5 +1,8 @@
 #include "harmonic.h"
 
+#include <iomanip>
+#include <sstream>
+
 void HarmonicHamiltonian::kokkosBatchedTreatDegenerateVelocities(
     const DoubleView2D& cartesianCoordinates,
     const DoubleView2D& resultEnergies, ComplexView4D& resultVelocities,
@@ -202,3 +205,82 @@ void HarmonicHamiltonian::kokkosBatchedTreatDegenerateVelocities(
 //  return {resultEnergies, resultEigenvectors, resultVelocities};
 }
 
+
+DoubleView2D HarmonicHamiltonian::kokkosBatchedEnergies(
+    const DoubleView2D &cartesianCoordinates) {
+  // the subclasses whose Hamiltonian is diagonalized with kokkosZHEEV
+  // override this with an eigenvalues-only diagonalization
+  return std::get<0>(kokkosBatchedDiagonalizeFromCoordinates(
+      cartesianCoordinates, false));
+}
+
+void HarmonicHamiltonian::setBandStructureCachePrefix(const std::string &x) {
+  bandStructureCachePrefix = x;
+}
+
+void HarmonicHamiltonian::setOnlyGroupVelocities(const bool &x) {
+  onlyGroupVelocities = x;
+}
+
+bool HarmonicHamiltonian::getOnlyGroupVelocities() const {
+  return onlyGroupVelocities;
+}
+
+void HarmonicHamiltonian::setSinglePrecisionEigenvectors(const bool &x) {
+  singlePrecisionEigenvectors = x;
+}
+
+bool HarmonicHamiltonian::getSinglePrecisionEigenvectors() const {
+  return singlePrecisionEigenvectors;
+}
+
+void HarmonicHamiltonian::addToHash(uint64_t &hash, const void *x,
+                                    const size_t &numBytes) {
+  auto bytes = static_cast<const unsigned char *>(x);
+  for (size_t i = 0; i < numBytes; i++) {
+    hash ^= uint64_t(bytes[i]);
+    hash *= 1099511628211ULL;
+  }
+}
+
+FullBandStructure HarmonicHamiltonian::cachedPopulate(
+    Points &points, const bool &withVelocities, const bool &withEigenvectors,
+    const bool &isDistributed,
+    const std::function<FullBandStructure()> &populator) {
+  if (bandStructureCachePrefix.empty()) {
+    return populator();
+  }
+
+  uint64_t hash = getHamiltonianHash();
+  int numBands = getNumBands();
+  int numPoints = points.getNumPoints();
+  int flags = int(withVelocities) + 2 * int(withEigenvectors)
+      + 4 * int(getParticle().isPhonon()) + 8 * int(onlyGroupVelocities);
+  addToHash(hash, &numBands, sizeof(int));
+  addToHash(hash, &numPoints, sizeof(int));
+  addToHash(hash, &flags, sizeof(int));
+  for (int ik = 0; ik < numPoints; ik++) {
+    Eigen::Vector3d k =
+        points.getPointCoordinates(ik, Points::crystalCoordinates);
+    addToHash(hash, k.data(), 3 * sizeof(double));
+  }
+  std::stringstream hashString;
+  hashString << std::hex << std::setw(16) << std::setfill('0') << hash;
+  std::string fileName = bandStructureCachePrefix + ".bandStructure."
+      + hashString.str() + ".hdf5";
+
+  {
+    Particle particle = getParticle();
+    FullBandStructure bandStructure(numBands, particle, withVelocities,
+                                    withEigenvectors, points, isDistributed,
+                                    onlyGroupVelocities);
+    if (bandStructure.loadFromFile(fileName, hash)) {
+      return bandStructure;
+    }
+  }
+
+  FullBandStructure bandStructure = populator();
+  bandStructure.fixEigenvectorGauge();
+  bandStructure.saveToFile(fileName, hash);
+  return bandStructure;
+}
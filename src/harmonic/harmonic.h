@@ -5,6 +5,7 @@
 #include "particle.h"
 #include "points.h"
 #include "common_kokkos.h"
+#include <functional>
 
 /** Virtual base class for Harmonic Hamiltonian.
  * The subclasses of this base class are the objects responsible for storing
@@ -90,6 +91,19 @@ class HarmonicHamiltonian {
   kokkosBatchedDiagonalizeFromCoordinates(
       const DoubleView2D &cartesianCoordinates, const bool withMassScaling=true) = 0;
 
+  /** Computes only the energies of a batch of wavevectors, for the callers
+   * that don't need the eigenvectors (e.g. the DOS, or the filtering of the
+   * states in an energy window). The diagonalization skips the eigenvectors,
+   * which is several times faster and doesn't return the NxN matrices.
+   *
+   * @param cartesianCoordinates: a DoubleView2D object of size (nk,3)
+   * (must already be on the GPU), with the cartesian coordinates of the
+   * wavevectors.
+   * @return a view with the energies (nk,nb) at each wavevector.
+   */
+  virtual DoubleView2D kokkosBatchedEnergies(
+      const DoubleView2D &cartesianCoordinates);
+
   /** Estimate how many k-points we can compute on the GPU in one batch.
    *
    * @param withVelocity: set to true if computing also the velocity operator,
@@ -101,6 +115,54 @@ class HarmonicHamiltonian {
     (void) withVelocity;
     return 1;
   };
+
+  /** Sets the prefix of the HDF5 files used to cache the band structures
+   * computed by populate(). If empty (the default), nothing is cached.
+   * @param x: the file prefix.
+   */
+  void setBandStructureCachePrefix(const std::string &x);
+
+  /** Sets whether the band structures computed from this Hamiltonian store
+   * only the group velocities, rather than the full velocity operator.
+   * Its off-diagonal elements are only needed for the Wigner corrections.
+   * @param x: if true, only the group velocities are stored.
+   */
+  void setOnlyGroupVelocities(const bool &x);
+  bool getOnlyGroupVelocities() const;
+
+  /** Sets whether the active band structures computed from this Hamiltonian
+   * store the eigenvectors in single precision.
+   * @param x: if true, eigenvectors are stored as std::complex<float>.
+   */
+  void setSinglePrecisionEigenvectors(const bool &x);
+  bool getSinglePrecisionEigenvectors() const;
+
+ protected:
+  std::string bandStructureCachePrefix;
+  bool onlyGroupVelocities = false;
+  bool singlePrecisionEigenvectors = false;
+
+  /** Adds the raw bytes of an object to a FNV-1a hash, which, unlike
+   * std::hash, is stable across compilers and runs.
+   */
+  static void addToHash(uint64_t &hash, const void *x, const size_t &numBytes);
+
+  /** Hash of the data defining the harmonic Hamiltonian, used to recognize
+   * band structures cached on disk. Must be implemented by the subclasses
+   * that call cachedPopulate().
+   */
+  virtual uint64_t getHamiltonianHash() { return 0; }
+
+  /** Wraps the construction of a band structure with a cache on disk.
+   * If bandStructureCachePrefix is set and a band structure computed with
+   * the same Hamiltonian, points and options is found on disk, it is loaded.
+   * Otherwise, it's computed with the populator, its eigenvectors are
+   * gauge-fixed, and it's saved for later runs.
+   */
+  FullBandStructure cachedPopulate(
+      Points &points, const bool &withVelocities,
+      const bool &withEigenvectors, const bool &isDistributed,
+      const std::function<FullBandStructure()> &populator);
 };
 
 #endif
@@ -18,8 +18,10 @@
 PhononH0::PhononH0(Crystal &crystal, const Eigen::Matrix3d &dielectricMatrix_,
                    const Eigen::Tensor<double, 3> &bornCharges_,
                    Eigen::Tensor<double, 7> &forceConstants_,
-                   const std::string &sumRule)
+                   const std::string &sumRule,
+                   const std::string &sumRuleFilePrefix)
     : particle(Particle::phonon), crystal(crystal) {
+  DeviceMemoryScope memoryScope("PhononH0");
   // in this section, we save as class properties a few variables
   // that are needed for the diagonalization of phonon frequencies
 
@@ -49,7 +51,7 @@ PhononH0::PhononH0(Crystal &crystal, const Eigen::Matrix3d &dielectricMatrix_,
   // now, I initialize an auxiliary set of vectors that are needed
   // for the diagonalization, which are precomputed once and for all.
 
-  setAcousticSumRule(sumRule, forceConstants_);
+  setAcousticSumRule(sumRule, forceConstants_, sumRuleFilePrefix);
 
   reorderDynamicalMatrix(directUnitCell, forceConstants_);
 
@@ -166,12 +168,10 @@ PhononH0::PhononH0(Crystal &crystal, const Eigen::Matrix3d &dielectricMatrix_,
     int numG = gVectors.cols();
     Kokkos::resize(atomicMasses_d, numBands);
     Kokkos::resize(bravaisVectors_d, numBravaisVectors, 3);
-    Kokkos::resize(weights_d, numBravaisVectors);
     Kokkos::resize(mat2R_d, numBands, numBands, numBravaisVectors);
 
     auto atomicMasses_h = create_mirror_view(atomicMasses_d);
     auto bravaisVectors_h = create_mirror_view(bravaisVectors_d);
-    auto weights_h = create_mirror_view(weights_d);
     auto mat2R_h = create_mirror_view(mat2R_d);
 
     for (int iR = 0; iR < numBravaisVectors; iR++) {
@@ -192,14 +192,12 @@ PhononH0::PhononH0(Crystal &crystal, const Eigen::Matrix3d &dielectricMatrix_,
       }
     }
     for (int iR=0; iR<numBravaisVectors; ++iR) {
-      weights_h(iR) = weights(iR);
       for (int i = 0; i < 3; i++) {
         bravaisVectors_h(iR, i) = bravaisVectors(i, iR);
       }
     }
     Kokkos::deep_copy(atomicMasses_d, atomicMasses_h);
     Kokkos::deep_copy(bravaisVectors_d, bravaisVectors_h);
-    Kokkos::deep_copy(weights_d, weights_h);
     Kokkos::deep_copy(mat2R_d, mat2R_h);
     if (hasDielectric) {
       Kokkos::resize(longRangeCorrection1_d, 3, 3, numAtoms);
@@ -249,14 +247,14 @@ PhononH0::PhononH0(Crystal &crystal, const Eigen::Matrix3d &dielectricMatrix_,
 
 // copy constructor
 PhononH0::PhononH0(const PhononH0 &that)
-    : particle(that.particle), hasDielectric(that.hasDielectric),
+    : HarmonicHamiltonian(that), particle(that.particle), hasDielectric(that.hasDielectric),
       numAtoms(that.numAtoms), numBands(that.numBands), crystal(that.crystal),
       volumeUnitCell(that.volumeUnitCell), atomicSpecies(that.atomicSpecies),
       speciesMasses(that.speciesMasses), atomicPositions(that.atomicPositions),
       dielectricMatrix(that.dielectricMatrix), bornCharges(that.bornCharges),
       qCoarseGrid(that.qCoarseGrid),
       numBravaisVectors(that.numBravaisVectors),
-      bravaisVectors(that.bravaisVectors), weights(that.weights),
+      bravaisVectors(that.bravaisVectors),
       mat2R(that.mat2R), gVectors(that.gVectors),
       longRangeCorrection1(that.longRangeCorrection1),
       atomicMasses_d(that.atomicMasses_d),
@@ -266,7 +264,6 @@ PhononH0::PhononH0(const PhononH0 &that)
       bornCharges_d(that.bornCharges_d),
       atomicPositions_d(that.atomicPositions_d),
       bravaisVectors_d(that.bravaisVectors_d),
-      weights_d(that.weights_d),
       mat2R_d(that.mat2R_d) {
   double memory = getDeviceMemoryUsage();
   kokkosDeviceMemory->addDeviceMemoryUsage(memory);
@@ -275,6 +272,7 @@ PhononH0::PhononH0(const PhononH0 &that)
 // copy assignment
 PhononH0 &PhononH0::operator=(const PhononH0 &that) {
   if (this != &that) {
+    HarmonicHamiltonian::operator=(that);
     particle = that.particle;
     hasDielectric = that.hasDielectric;
     numAtoms = that.numAtoms;
@@ -289,7 +287,6 @@ PhononH0 &PhononH0::operator=(const PhononH0 &that) {
     qCoarseGrid = that.qCoarseGrid;
     numBravaisVectors = that.numBravaisVectors;
     bravaisVectors = that.bravaisVectors;
-    weights = that.weights;
     mat2R = that.mat2R;
     gVectors = that.gVectors;
     longRangeCorrection1 = that.longRangeCorrection1;
@@ -300,7 +297,6 @@ PhononH0 &PhononH0::operator=(const PhononH0 &that) {
     bornCharges_d = that.bornCharges_d;
     atomicPositions_d = that.atomicPositions_d;
     bravaisVectors_d = that.bravaisVectors_d;
-    weights_d = that.weights_d;
     mat2R_d = that.mat2R_d;
     double memory = getDeviceMemoryUsage();
     kokkosDeviceMemory->addDeviceMemoryUsage(memory);
@@ -318,7 +314,6 @@ PhononH0::~PhononH0() {
   Kokkos::realloc(bornCharges_d, 0, 0, 0);
   Kokkos::realloc(atomicPositions_d, 0, 0);
   Kokkos::realloc(bravaisVectors_d, 0, 0);
-  Kokkos::realloc(weights_d, 0);
   Kokkos::realloc(mat2R_d, 0, 0, 0);
 }
 
@@ -345,7 +340,8 @@ PhononH0::diagonalizeFromCoordinates(Eigen::Vector3d &q) {
 
 std::tuple<Eigen::VectorXd, Eigen::MatrixXcd>
 PhononH0::diagonalizeFromCoordinates(Eigen::Vector3d &q,
-                                     const bool &withMassScaling) {
+                                     const bool &withMassScaling,
+                                     const bool &withEigenvectors) {
   // to be executed at every q-point to get phonon frequencies and wavevectors
 
   Eigen::Tensor<std::complex<double>, 4> dyn(3, 3, numAtoms, numAtoms);
@@ -362,11 +358,11 @@ PhononH0::diagonalizeFromCoordinates(Eigen::Vector3d &q,
 
   // once everything is ready, here we scale by masses and diagonalize
 
-  auto tup = dynDiagonalize(dyn);
+  auto tup = dynDiagonalize(dyn, withEigenvectors);
   auto energies = std::get<0>(tup);
   auto eigenvectors = std::get<1>(tup);
 
-  if (withMassScaling) {
+  if (withMassScaling && withEigenvectors) {
     // we normalize with the mass.
     // In this way, the Eigenvector matrix U, doesn't satisfy (U^+) * U = I
     // but instead (U^+) * M * U = I, where M is the mass matrix
@@ -390,14 +386,34 @@ FullBandStructure PhononH0::populate(Points &points,
                                      const bool &withVelocities,
                                      const bool &withEigenvectors,
                                      const bool isDistributed) {
-  return kokkosPopulate(points, withVelocities, withEigenvectors, isDistributed);
+  return cachedPopulate(points, withVelocities, withEigenvectors,
+                        isDistributed, [&]() {
+    return kokkosPopulate(points, withVelocities, withEigenvectors,
+                          isDistributed);
+  });
+}
+
+uint64_t PhononH0::getHamiltonianHash() {
+  uint64_t hash = 14695981039346656037ULL;
+  addToHash(hash, &numAtoms, sizeof(int));
+  addToHash(hash, &hasDielectric, sizeof(bool));
+  addToHash(hash, directUnitCell.data(), 9 * sizeof(double));
+  addToHash(hash, atomicPositions.data(), atomicPositions.size() * sizeof(double));
+  addToHash(hash, atomicSpecies.data(), atomicSpecies.size() * sizeof(int));
+  addToHash(hash, speciesMasses.data(), speciesMasses.size() * sizeof(double));
+  addToHash(hash, dielectricMatrix.data(), 9 * sizeof(double));
+  addToHash(hash, bornCharges.data(), bornCharges.size() * sizeof(double));
+  addToHash(hash, bravaisVectors.data(), bravaisVectors.size() * sizeof(double));
+  addToHash(hash, mat2R.data(), mat2R.size() * sizeof(double));
+  return hash;
 }
 
 FullBandStructure PhononH0::cpuPopulate(Points &points, bool &withVelocities,
                                         bool &withEigenvectors,
                                         bool isDistributed) {
   FullBandStructure fullBandStructure(numBands, particle, withVelocities,
-                                      withEigenvectors, points, isDistributed);
+                                      withEigenvectors, points, isDistributed,
+                                      onlyGroupVelocities);
 
   std::vector<int> ikIndices = fullBandStructure.getWavevectorIndices();
   int numIkIndices = ikIndices.size();
@@ -689,8 +705,13 @@ void PhononH0::reorderDynamicalMatrix(const Eigen::Matrix3d& directUnitCell,
   // start by generating the weights for the Fourier transform
   auto wsCache = wsInit(directUnitCellSup, directUnitCell, nr1Big, nr2Big, nr3Big);
 
-  // we compute the total number of bravais lattice vectors
-
+  // The Wigner-Seitz weights are non-zero only for a few (R, na, nb) triplets,
+  // and many atom pairs share the same lattice vector R. We therefore keep
+  // only the distinct vectors R with at least one non-zero weight, and fold
+  // the weights in mat2R, so that the Fourier transform doesn't loop over
+  // zeros and computes a single phase per lattice vector.
+  int numCells = (2 * nr1Big + 1) * (2 * nr2Big + 1) * (2 * nr3Big + 1);
+  std::vector<int> cellToR(numCells, -1);
   numBravaisVectors = 0;
   for (int n3 = -nr3Big; n3 <= nr3Big; n3++) {
     int n3ForCache = n3 + nr3Big;
@@ -698,9 +719,13 @@ void PhononH0::reorderDynamicalMatrix(const Eigen::Matrix3d& directUnitCell,
       int n2ForCache = n2 + nr2Big;
       for (int n1 = -nr1Big; n1 <= nr1Big; n1++) {
         int n1ForCache = n1 + nr1Big;
+        int iCell = (n3ForCache * (2 * nr2Big + 1) + n2ForCache)
+            * (2 * nr1Big + 1) + n1ForCache;
         for (int nb = 0; nb < numAtoms; nb++) {
           for (int na = 0; na < numAtoms; na++) {
-            if (wsCache(n3ForCache, n2ForCache, n1ForCache, nb, na) > 0.) {
+            if (wsCache(n3ForCache, n2ForCache, n1ForCache, nb, na) > 0.
+                && cellToR[iCell] < 0) {
+              cellToR[iCell] = numBravaisVectors;
               numBravaisVectors += 1;
             }
           }
@@ -711,53 +736,53 @@ void PhononH0::reorderDynamicalMatrix(const Eigen::Matrix3d& directUnitCell,
 
   // next, we reorder the dynamical matrix along the bravais lattice vectors
   bravaisVectors = Eigen::MatrixXd::Zero(3, numBravaisVectors);
-  weights = Eigen::VectorXd::Zero(numBravaisVectors);
   mat2R.resize(3, 3, numAtoms, numAtoms, numBravaisVectors);
   mat2R.setZero();
 
-  int iR = 0;
   for (int n3 = -nr3Big; n3 <= nr3Big; n3++) {
     int n3ForCache = n3 + nr3Big;
     for (int n2 = -nr2Big; n2 <= nr2Big; n2++) {
       int n2ForCache = n2 + nr2Big;
       for (int n1 = -nr1Big; n1 <= nr1Big; n1++) {
         int n1ForCache = n1 + nr1Big;
+        int iCell = (n3ForCache * (2 * nr2Big + 1) + n2ForCache)
+            * (2 * nr1Big + 1) + n1ForCache;
+        int iR = cellToR[iCell];
+        if (iR < 0) {
+          continue;
+        }
+
+        for (int i : {0, 1, 2}) {
+          bravaisVectors(i, iR) = n1 * directUnitCell(i, 0)
+              + n2 * directUnitCell(i, 1) + n3 * directUnitCell(i, 2);
+        }
+
+        int m1 = mod((n1 + 1), qCoarseGrid(0));
+        if (m1 <= 0) {
+          m1 += qCoarseGrid(0);
+        }
+        int m2 = mod((n2 + 1), qCoarseGrid(1));
+        if (m2 <= 0) {
+          m2 += qCoarseGrid(1);
+        }
+        int m3 = mod((n3 + 1), qCoarseGrid(2));
+        if (m3 <= 0) {
+          m3 += qCoarseGrid(2);
+        }
+        m1 += -1;
+        m2 += -1;
+        m3 += -1;
+
         for (int nb = 0; nb < numAtoms; nb++) {
           for (int na = 0; na < numAtoms; na++) {
             double weight = wsCache(n3ForCache, n2ForCache, n1ForCache, nb, na);
             if (weight > 0.) {
-              weights(iR) = weight;
-
-              Eigen::Vector3d r;
-              for (int i : {0, 1, 2}) {
-                r(i) = n1 * directUnitCell(i, 0) + n2 * directUnitCell(i, 1) +
-                       n3 * directUnitCell(i, 2);
-              }
-              bravaisVectors.col(iR) = r;
-
-              int m1 = mod((n1 + 1), qCoarseGrid(0));
-              if (m1 <= 0) {
-                m1 += qCoarseGrid(0);
-              }
-              int m2 = mod((n2 + 1), qCoarseGrid(1));
-              if (m2 <= 0) {
-                m2 += qCoarseGrid(1);
-              }
-              int m3 = mod((n3 + 1), qCoarseGrid(2));
-              if (m3 <= 0) {
-                m3 += qCoarseGrid(2);
-              }
-              m1 += -1;
-              m2 += -1;
-              m3 += -1;
-
               for (int j : {0, 1, 2}) {
                 for (int i : {0, 1, 2}) {
                   mat2R(i, j, na, nb, iR) +=
-                      forceConstants(i, j, m1, m2, m3, na, nb);
+                      weight * forceConstants(i, j, m1, m2, m3, na, nb);
                 }
               }
-              iR += 1;
             }
           }
         }
@@ -794,7 +819,7 @@ void PhononH0::shortRangeTerm(Eigen::Tensor<std::complex<double>, 4> &dyn,
         for (int j : {0, 1, 2}) {
           for (int i : {0, 1, 2}) {
             dyn(i, j, na, nb) +=
-                mat2R(i, j, na, nb, iR) * phases[iR] * weights(iR);
+                mat2R(i, j, na, nb, iR) * phases[iR];
           }
         }
       }
@@ -813,7 +838,8 @@ void PhononH0::shortRangeTerm(Eigen::Tensor<std::complex<double>, 4> &dyn,
 }
 
 std::tuple<Eigen::VectorXd, Eigen::MatrixXcd>
-PhononH0::dynDiagonalize(Eigen::Tensor<std::complex<double>, 4> &dyn) {
+PhononH0::dynDiagonalize(Eigen::Tensor<std::complex<double>, 4> &dyn,
+                         const bool &withEigenvectors) {
   // diagonalise the dynamical matrix
   // On input:  speciesMasses = masses, in amu
   // On output: w2 = energies, z = displacements
@@ -860,7 +886,9 @@ PhononH0::dynDiagonalize(Eigen::Tensor<std::complex<double>, 4> &dyn) {
   //  }
   //}
 
-  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(dyn2);
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> eigenSolver(
+      dyn2, withEigenvectors ? Eigen::ComputeEigenvectors
+                             : Eigen::EigenvaluesOnly);
   Eigen::VectorXd w2 = eigenSolver.eigenvalues();
 
   Eigen::VectorXd energies(numBands);
@@ -872,7 +900,10 @@ PhononH0::dynDiagonalize(Eigen::Tensor<std::complex<double>, 4> &dyn) {
     }
     //printf("old = %.16e\n", energies(i));
   }
-  Eigen::MatrixXcd eigenvectors = eigenSolver.eigenvectors();
+  Eigen::MatrixXcd eigenvectors;
+  if (withEigenvectors) {
+    eigenvectors = eigenSolver.eigenvectors();
+  }
   //eigenvectors = 3*dyn2; // TODO: undo
 
   //for(int i = 0; i < 3*numAtoms; i++){
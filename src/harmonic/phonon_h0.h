@@ -27,11 +27,15 @@ class PhononH0 : public HarmonicHamiltonian {
    * effective charges
    * @param forceConstants: a tensor of doubles with the force constants
    * size is (meshX, meshY, meshZ, 3, 3, numAtoms, numAtoms)
+   * @param sumRule: name of the acoustic sum rule ("simple" or "crystal")
+   * @param sumRuleFilePrefix: if not empty, the force constants corrected by
+   * the "crystal" sum rule are cached in a file with this prefix
    */
   PhononH0(Crystal &crystal, const Eigen::Matrix3d &dielectricMatrix_,
            const Eigen::Tensor<double, 3> &bornCharges_,
            Eigen::Tensor<double, 7> &forceConstants_,
-           const std::string &sumRule);
+           const std::string &sumRule,
+           const std::string &sumRuleFilePrefix = "");
 
   /** Copy constructor
    */
@@ -69,12 +73,15 @@ class PhononH0 : public HarmonicHamiltonian {
    * phonon wavevector.
    * @param withMassScaling: if true, rescales the eigenvectors by the
    * mass z -> z/sqrt(m)
+   * @param withEigenvectors: if false, only the energies are computed and
+   * the eigenvector matrix is empty.
    * @return eigenvalues: all values of phonon energies for this point.
    * @return eigenvectors: the phonon eigenvectors, in matrix form, for this
    * point.
    */
   std::tuple<Eigen::VectorXd, Eigen::MatrixXcd> diagonalizeFromCoordinates(
-      Eigen::Vector3d &q, const bool &withMassScaling);
+      Eigen::Vector3d &q, const bool &withMassScaling,
+      const bool &withEigenvectors = true);
   std::tuple<Eigen::VectorXd, Eigen::MatrixXcd> diagonalizeFromCoordinates(
       Eigen::Vector3d &q) override;
 
@@ -105,10 +112,19 @@ class PhononH0 : public HarmonicHamiltonian {
       const DoubleView2D &cartesianCoordinates) override;
   std::tuple<DoubleView2D, StridedComplexView3D> kokkosBatchedDiagonalizeFromCoordinates(
       const DoubleView2D &cartesianCoordinates, const bool withMassScaling = true) override;
+  DoubleView2D kokkosBatchedEnergies(
+      const DoubleView2D &cartesianCoordinates) override;
   std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D>
   kokkosBatchedDiagonalizeWithVelocities(
       const DoubleView2D &cartesianCoordinates) override;
   void kokkosBatchedScaleEigenvectors(StridedComplexView3D& eigenvectors);
+  /** Analytic derivatives of the dynamical matrices dD/dq, for the phonon
+   * velocities of kokkosBatchedDiagonalizeWithVelocities().
+   * @return derivatives: a view (numK*3, numBands, numBands) with first
+   * index iK*3+i, for the cartesian direction i.
+   */
+  ComplexView3D kokkosBatchedBuildHamiltonianDerivatives(
+      const DoubleView2D &cartesianCoordinates);
 
   /** Returns the size of the q-point coarse grid on which the force constants
    * have been computed.
@@ -160,9 +176,37 @@ protected:
    * Currently supported values are akin to those from Quantum ESPRESSO
    * i.e. "simple" (for a rescaling of the diagonal elements) or "crystal"
    * (to find the closest matrix which satisfies the sum rule)
+   * @param sumRuleFilePrefix: if not empty, the results of the "crystal"
+   * sum rule are loaded from (or saved to) an HDF5 file with this prefix
    */
   void setAcousticSumRule(const std::string &sumRule,
-                          Eigen::Tensor<double, 7>& forceConstants);
+                          Eigen::Tensor<double, 7>& forceConstants,
+                          const std::string &sumRuleFilePrefix = "");
+
+  /** Name of the file caching the "crystal" sum rule. It contains a hash
+   * of the force constants and Born charges before the correction, so that
+   * a different input never reuses the file.
+   */
+  std::string getSumRuleFileName(const std::string &sumRuleFilePrefix,
+                                 Eigen::Tensor<double, 7>& forceConstants);
+
+  /** Loads force constants and Born charges corrected by the "crystal"
+   * sum rule from a file written by saveAcousticSumRule.
+   * @return true if the file exists and has been read.
+   */
+  bool loadAcousticSumRule(const std::string &fileName,
+                           Eigen::Tensor<double, 7>& forceConstants);
+
+  /** Saves the force constants and Born charges corrected by the "crystal"
+   * sum rule to an HDF5 file.
+   */
+  void saveAcousticSumRule(const std::string &fileName,
+                           Eigen::Tensor<double, 7>& forceConstants);
+
+  /** Hash of the force constants and crystal data, identifying the band
+   * structures cached on disk by populate().
+   */
+  uint64_t getHamiltonianHash() override;
 
   void reorderDynamicalMatrix(const Eigen::Matrix3d& directUnitCell,
                               const Eigen::Tensor<double, 7>& forceConstants);
@@ -186,9 +230,10 @@ protected:
   // uncomment this to activate it
   bool longRange2d = false;
 
+  // distinct lattice vectors of the Fourier interpolation, and the force
+  // constants on them, with the Wigner-Seitz weights already folded in
   int numBravaisVectors = 0;
   Eigen::MatrixXd bravaisVectors;
-  Eigen::VectorXd weights;
   Eigen::Tensor<double,5> mat2R;
 
   Eigen::MatrixXd gVectors;
@@ -203,8 +248,9 @@ protected:
   DoubleView3D bornCharges_d;
   DoubleView2D atomicPositions_d;
   DoubleView2D bravaisVectors_d;
-  DoubleView1D weights_d;
   DoubleView3D mat2R_d;
+  // pinned host buffers for the transfers of the batches of kokkosPopulate
+  HostStagingArena stagingArena;
 
   // private methods, used to diagonalize the Dyn matrix
 
@@ -241,9 +287,17 @@ protected:
   /** dynDiagonalize diagonalizes the dynamical matrix and returns eigenvalues and
    * eigenvectors.
    * @param dyn: the dynamical matrix in the shape 3,3,natoms,natoms
+   * @param withEigenvectors: if false, only the frequencies are computed,
+   * and the returned eigenvector matrix is empty.
    */
   std::tuple<Eigen::VectorXd, Eigen::MatrixXcd> dynDiagonalize(
-      Eigen::Tensor<std::complex<double>, 4> &dyn);
+      Eigen::Tensor<std::complex<double>, 4> &dyn,
+      const bool &withEigenvectors = true);
+
+  /** Replaces the eigenvalues of the dynamical matrices with the phonon
+   * frequencies, sign(eigenvalue)*sqrt(abs(eigenvalue)).
+   */
+  static void kokkosEigenvaluesToFrequencies(DoubleView2D &frequencies);
 
   /** Auxiliary methods for sum rule on Born charges
    */
@@ -12,7 +12,6 @@ StridedComplexView3D PhononH0::kokkosBatchedBuildBlochHamiltonian(
   Kokkos::complex<double> complexI(0.0, 1.0);
 
   auto bravaisVectors_d = this->bravaisVectors_d;
-  auto weights_d = this->weights_d;
   auto mat2R_d = this->mat2R_d;
   auto numAtoms = this->numAtoms;
 
@@ -27,7 +26,7 @@ StridedComplexView3D PhononH0::kokkosBatchedBuildBlochHamiltonian(
         for (int i = 0; i < 3; i++) {
           arg += cartesianCoordinates(iK, i) * bravaisVectors_d(iR, i);
         }
-        phases_d(iK, iR) = exp(-complexI * arg) * weights_d(iR);
+        phases_d(iK, iR) = exp(-complexI * arg);
       });
   Kokkos::fence();
   //print2DComplex("new = ", phases_d);
@@ -35,15 +34,7 @@ StridedComplexView3D PhononH0::kokkosBatchedBuildBlochHamiltonian(
   //print3D("new = ", mat2R_d);
 
   // multiply matrix by phase
-  Kokkos::parallel_for(
-      "el_hamilton", Range3D({0, 0, 0}, {numK, numBands, numBands}),
-      KOKKOS_LAMBDA(int iK, int m, int n) {
-        Kokkos::complex<double> tmp(0.0);
-        for (int iR = 0; iR < numBravaisVectors; iR++) {
-          tmp += phases_d(iK, iR) * mat2R_d(m, n, iR);
-        }
-        dynamicalMatrices(iK, m, n) = tmp;
-      });
+  kokkosBatchedFourierTransform(phases_d, mat2R_d, dynamicalMatrices);
   Kokkos::realloc(phases_d, 0, 0);
   //print3DComplex("new = ", dynamicalMatrices);
 
@@ -72,70 +63,70 @@ StridedComplexView3D PhononH0::kokkosBatchedBuildBlochHamiltonian(
     auto atomicPositions_d = this->atomicPositions_d;
     auto gMax = this->gMax;
 
-    // per-thread scratch memory size
-    int byte_size = Kokkos::View<double*, Kokkos::LayoutRight, Kokkos::DefaultExecutionSpace::scratch_memory_space>::shmem_size(numBands);
-
-    // compute full long range term
-    Kokkos::parallel_for("long-range-ph-H0",
-        Kokkos::TeamPolicy<Kokkos::DefaultExecutionSpace>(numG, Kokkos::AUTO()).set_scratch_size(
-          0, Kokkos::PerThread(byte_size)),
-        KOKKOS_LAMBDA (const Kokkos::TeamPolicy<>::member_type &team) {
-
-          int iG = team.league_rank();
-          auto G = Kokkos::subview(gVectors_d, iG, Kokkos::ALL);
-
-          // allocate per-thread scratch memory
-          Kokkos::View<double*, Kokkos::LayoutRight, Kokkos::DefaultExecutionSpace::scratch_memory_space> GQZ(team.thread_scratch(0), 3*numAtoms);
-
-          Kokkos::parallel_for(Kokkos::TeamThreadRange(team, numK), [&] (const int iK){
-
-            auto Q = Kokkos::subview(cartesianCoordinates, iK, Kokkos::ALL);
-            auto D = Kokkos::subview(dynamicalMatrices, iK, Kokkos::ALL, Kokkos::ALL);
+    // compute full long range term.
+    // Each thread takes care of one pair of atoms (na,nb) at one wavevector,
+    // and sums the 3x3 block of the Ewald term over the whole list of G
+    // vectors, shared by all the wavevectors of the batch. Since every
+    // element of the dynamical matrix is owned by a single thread, the sum
+    // over G doesn't need atomic operations.
+    Kokkos::parallel_for(
+        "long-range-ph-H0", Range3D({0, 0, 0}, {numK, numAtoms, numAtoms}),
+        KOKKOS_LAMBDA(int iK, int na, int nb) {
+          double xi[3];
+          for (int i = 0; i < 3; i++) {
+            xi[i] = atomicPositions_d(na, i) - atomicPositions_d(nb, i);
+          }
+          Kokkos::complex<double> block[3][3];
+          for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+              block[i][j] = Kokkos::complex<double>(0., 0.);
+            }
+          }
 
+          for (int iG = 0; iG < numG; iG++) {
             double GQ[3];
-            for (int i=0; i<3; ++i) {
-              GQ[i] = G(i) + Q(i);
+            for (int i = 0; i < 3; i++) {
+              GQ[i] = gVectors_d(iG, i) + cartesianCoordinates(iK, i);
             }
 
             double geg = 0.;
-            Kokkos::parallel_reduce(Kokkos::ThreadVectorRange(team, 9), [&] (const int ij, double &geg){
-                int i = ij / 3;
-                int j = ij % 3;
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
                 geg += GQ[i] * dielectricMatrix_d(i, j) * GQ[j];
-            }, geg);
-
-            if (geg > 0. && geg < 4. * gMax) {
-              double normG = norm * exp(-geg * 0.25) / geg;
-
-              Kokkos::parallel_for(Kokkos::ThreadVectorRange(team, 3*numAtoms), [&] (const int inb){
-                  int nb = inb / 3;
-                  int i = inb % 3;
-                  double tmp = 0.0;
-                  for (int j : {0, 1, 2}) {
-                     tmp += GQ[j] * bornCharges_d(i, j, nb);
-                  }
-                  GQZ[inb] = tmp;
-              });
-
-              Kokkos::parallel_for(Kokkos::ThreadVectorRange(team, numAtoms*numAtoms), [&] (const int nanb){
-                  int na = nanb / numAtoms;
-                  int nb = nanb % numAtoms;
-                  double arg = 0.;
-                  for (int i = 0; i < 3; i++) {
-                    double xi = atomicPositions_d(na,i) - atomicPositions_d(nb,i);
-                    arg += xi * GQ[i];
-                  }
-                  Kokkos::complex<double> phase = normG * exp(complexI * arg);
-                  for (int j : {0, 1, 2}) {
-                    for (int i : {0, 1, 2}) {
-                      Kokkos::complex<double> x = phase * GQZ[na*3+i] * GQZ[nb*3+j];
-                      Kokkos::atomic_add(&D(na*3+i, nb*3+j), x);
-                      // there's a reduce on iG!
-                    }
-                  }
-              });
+              }
+            }
+            if (geg <= 0. || geg >= 4. * gMax) {
+              continue;
+            }
+            double normG = norm * exp(-geg * 0.25) / geg;
+
+            double GQZa[3], GQZb[3];
+            for (int i = 0; i < 3; i++) {
+              GQZa[i] = 0.;
+              GQZb[i] = 0.;
+              for (int j = 0; j < 3; j++) {
+                GQZa[i] += GQ[j] * bornCharges_d(i, j, na);
+                GQZb[i] += GQ[j] * bornCharges_d(i, j, nb);
+              }
+            }
+
+            double arg = 0.;
+            for (int i = 0; i < 3; i++) {
+              arg += xi[i] * GQ[i];
             }
-          });
+            Kokkos::complex<double> phase = normG * exp(complexI * arg);
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
+                block[i][j] += phase * GQZa[i] * GQZb[j];
+              }
+            }
+          }
+
+          for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+              dynamicalMatrices(iK, na * 3 + i, nb * 3 + j) += block[i][j];
+            }
+          }
         });
   //print3DComplex("new = ", dynamicalMatrices);
   }
@@ -176,6 +167,7 @@ StridedComplexView3D PhononH0::kokkosBatchedBuildBlochHamiltonian(
  */
 std::tuple<DoubleView2D, StridedComplexView3D> PhononH0::kokkosBatchedDiagonalizeFromCoordinates(
     const DoubleView2D &cartesianCoordinates, const bool withMassScaling) {
+  DeviceMemoryScope memoryScope("PhononH0");
 
   // create the Hamiltonians
   StridedComplexView3D dynamicalMatrices =
@@ -188,7 +180,34 @@ std::tuple<DoubleView2D, StridedComplexView3D> PhononH0::kokkosBatchedDiagonaliz
 
   // perform diagonalization of all matrices
   kokkosZHEEV(dynamicalMatrices, frequencies);
+  kokkosEigenvaluesToFrequencies(frequencies);
+  //print2D("new = ", frequencies);
+  //print3DComplex("new = ", dynamicalMatrices);
+
+  if(withMassScaling) kokkosBatchedScaleEigenvectors(dynamicalMatrices);
+  return std::make_tuple(frequencies, dynamicalMatrices);
+}
+
+DoubleView2D PhononH0::kokkosBatchedEnergies(
+    const DoubleView2D &cartesianCoordinates) {
+  DeviceMemoryScope memoryScope("PhononH0");
+
+  StridedComplexView3D dynamicalMatrices =
+      kokkosBatchedBuildBlochHamiltonian(cartesianCoordinates);
+
+  int numK = dynamicalMatrices.extent(0);
+  DoubleView2D frequencies("energies", numK, numBands);
 
+  // the eigenvalues don't depend on the mass scaling of the eigenvectors,
+  // and the dynamical matrices are destroyed by the diagonalization
+  kokkosZHEEV(dynamicalMatrices, frequencies, false);
+  kokkosEigenvaluesToFrequencies(frequencies);
+  return frequencies;
+}
+
+void PhononH0::kokkosEigenvaluesToFrequencies(DoubleView2D &frequencies) {
+  int numK = frequencies.extent(0);
+  int numBands = frequencies.extent(1);
   // frequencies are sign(eigenvalues)*sqrt(abs(eigenvalues))
   Kokkos::parallel_for(
       "el_hamilton", Range2D({0, 0}, {numK, numBands}),
@@ -199,11 +218,6 @@ std::tuple<DoubleView2D, StridedComplexView3D> PhononH0::kokkosBatchedDiagonaliz
           frequencies(iK, m) = -sqrt(-frequencies(iK, m));
         }
       });
-  //print2D("new = ", frequencies);
-  //print3DComplex("new = ", dynamicalMatrices);
-
-  if(withMassScaling) kokkosBatchedScaleEigenvectors(dynamicalMatrices);
-  return std::make_tuple(frequencies, dynamicalMatrices);
 }
 
 void PhononH0::kokkosBatchedScaleEigenvectors(StridedComplexView3D& eigenvectors) {
@@ -223,7 +237,7 @@ double PhononH0::getDeviceMemoryUsage() {
       + 8 * (atomicMasses_d.size() + gVectors_d.size()
            + dielectricMatrix_d.size() + bornCharges_d.size()
            + atomicPositions_d.size() + bravaisVectors_d.size()
-           + weights_d.size() + mat2R_d.size() );
+           + mat2R_d.size() );
   return memory;
 }
 
@@ -236,7 +250,10 @@ int PhononH0::estimateBatchSize(const bool& withVelocity) {
 
   double memoryPerPoint = 0.;
   if (withVelocity) {
-    memoryPerPoint += 16. * (transformSize*7 + 2*matrixSize + matrixSize*3);
+    // the dynamical matrix and its three derivatives, with their phases, the
+    // scratch of the projection and the velocities
+    memoryPerPoint += 16. * (transformSize + 3 * (matrixSize + numBravaisVectors)
+                             + 2*matrixSize + matrixSize*3);
   } else {
     memoryPerPoint += 16. * transformSize;
   }
@@ -264,25 +281,21 @@ FullBandStructure PhononH0::kokkosPopulate(Points &fullPoints,
 
   FullBandStructure fullBandStructure(numBands, particle, withVelocities,
                                       withEigenvectors, fullPoints,
-                                      isDistributed);
-
-  // divide the k-points into batches
-  std::vector<std::vector<int>> ikBatches;
-  {
-    std::vector<int> ikIterator = fullBandStructure.getWavevectorIndices();
-    int batchSize = estimateBatchSize(withVelocities);
-    ikBatches = kokkosDeviceMemory->splitToBatches(ikIterator, batchSize);
-  }
+                                      isDistributed, onlyGroupVelocities);
 
-  // loop over the batches
-  for (auto ikBatch : ikBatches) {
+  // the k-points are split in batches between the device and the host
+  std::vector<int> ikIterator = fullBandStructure.getWavevectorIndices();
 
-    int numK = ikBatch.size();
+  auto deviceWork = [&](const int &start, const int &end) {
+    std::vector<int> ikBatch(ikIterator.begin() + start,
+                             ikIterator.begin() + end);
+    int numK = end - start;
 
     // get all the k-points in a batch
     DoubleView2D cartesianWavevectors_d("el_cartWav_d", numK, 3);
     {
-      auto cartesianWavevectors_h = Kokkos::create_mirror_view(cartesianWavevectors_d);
+      auto cartesianWavevectors_h =
+          stagingArena.mirror(0, cartesianWavevectors_d);
 #pragma omp parallel for
       for (int iik = 0; iik < numK; ++iik) {
         int ik = ikBatch[iik];
@@ -292,7 +305,9 @@ FullBandStructure PhononH0::kokkosPopulate(Points &fullPoints,
           cartesianWavevectors_h(iik, i) = k(i);
         }
       }
-      Kokkos::deep_copy(cartesianWavevectors_d, cartesianWavevectors_h);
+      // asynchronous, the kernels of the batch are queued after the copy
+      Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(),
+                        cartesianWavevectors_d, cartesianWavevectors_h);
     }
 
     // do all diagonalizations at once with Kokkos
@@ -305,19 +320,33 @@ FullBandStructure PhononH0::kokkosPopulate(Points &fullPoints,
         allEnergies_d = std::get<0>(t);
         allEigenvectors_d = std::get<1>(t);
         allVelocities_d = std::get<2>(t);
-      } else {
+      } else if (withEigenvectors) {
         auto t = kokkosBatchedDiagonalizeFromCoordinates(cartesianWavevectors_d);
         allEnergies_d = std::get<0>(t);
         allEigenvectors_d = std::get<1>(t);
+      } else {
+        allEnergies_d = kokkosBatchedEnergies(cartesianWavevectors_d);
       }
       Kokkos::realloc(cartesianWavevectors_d, 0, 0);
 
 
       // copy results to CPU
-      auto allEnergies_h = Kokkos::create_mirror_view(allEnergies_d);
-      auto allEigenvectors_h = Kokkos::create_mirror_view(allEigenvectors_d);
-      Kokkos::deep_copy(allEnergies_h, allEnergies_d);
-      Kokkos::deep_copy(allEigenvectors_h, allEigenvectors_d);
+      auto allEnergies_h = stagingArena.mirror(1, allEnergies_d);
+      Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), allEnergies_h,
+                        allEnergies_d);
+      StagingView<StridedComplexView3D> allEigenvectors_h;
+      if (withEigenvectors) {
+        allEigenvectors_h = stagingArena.mirror(2, allEigenvectors_d);
+        Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), allEigenvectors_h,
+                          allEigenvectors_d);
+      }
+      StagingView<ComplexView4D> allVelocities_h;
+      if (withVelocities) {
+        allVelocities_h = stagingArena.mirror(3, allVelocities_d);
+        Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), allVelocities_h,
+                          allVelocities_d);
+      }
+      Kokkos::fence();
 
       // store the results in the old datastructures
 #pragma omp parallel for
@@ -341,8 +370,6 @@ FullBandStructure PhononH0::kokkosPopulate(Points &fullPoints,
       }
 
       if (withVelocities) {
-        auto allVelocities_h = Kokkos::create_mirror_view(allVelocities_d);
-        Kokkos::deep_copy(allVelocities_h, allVelocities_d);
         for (int iik = 0; iik < numK; iik++) {
           int ik = ikBatch[iik];
           Point point = fullBandStructure.getPoint(ik);
@@ -361,153 +388,270 @@ FullBandStructure PhononH0::kokkosPopulate(Points &fullPoints,
       allEigenvectors_d = decltype(allEigenvectors_d)();
       Kokkos::realloc(allVelocities_d, 0, 0, 0, 0);
     }
-  }
+  };
+
+  auto hostWork = [&](const int &start, const int &end) {
+#pragma omp parallel for
+    for (int iik = start; iik < end; iik++) {
+      Point point = fullBandStructure.getPoint(ikIterator[iik]);
+      if (!withEigenvectors && !withVelocities) {
+        Eigen::Vector3d q = point.getCoordinates(Points::cartesianCoordinates);
+        auto tup = diagonalizeFromCoordinates(q, false, false);
+        fullBandStructure.setEnergies(point, std::get<0>(tup));
+        continue;
+      }
+      auto tup = diagonalize(point);
+      fullBandStructure.setEnergies(point, std::get<0>(tup));
+      if (withEigenvectors) {
+        fullBandStructure.setEigenvectors(point, std::get<1>(tup));
+      }
+      if (withVelocities) {
+        auto velocities = diagonalizeVelocity(point);
+        fullBandStructure.setVelocities(point, velocities);
+      }
+    }
+  };
+
+  int batchSize = estimateBatchSize(withVelocities);
+  heterogeneousBatches(int(ikIterator.size()), batchSize, deviceWork,
+                       hostWork);
 
   return fullBandStructure;
 }
 
 
 /**
- * Create and diagonalize Hamiltonians for a batch of k-points, with velocities
- * Returns the energies (nk, nb), eigenvectors (nk, nb, nb)
- * and velocities (nk, nb, nb, 3) at each k-point.
- * Note that for each k-point, the (nb, nb) eigenvector
- * matrix is column-major, as required by the cuSOLVER routine,
- * hence the StridedLayout.
+ * Build the derivatives dD/dq of the dynamical matrices for a batch of
+ * q-points, analytically: the short-range Fourier sum is multiplied by -iR,
+ * and the Ewald sum is derived term by term. As for the dynamical matrices,
+ * the derivatives are made hermitian and divided by the atomic masses.
+ * Returns a view (numK*3, numBands, numBands), with first index iK*3+i for
+ * the derivative along the cartesian direction i.
  */
-std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D>
-PhononH0::kokkosBatchedDiagonalizeWithVelocities(
+ComplexView3D PhononH0::kokkosBatchedBuildHamiltonianDerivatives(
     const DoubleView2D &cartesianCoordinates) {
 
-  // Note: this is slightly different than electronH0Wannier
-  // here, we need to compute the derivative of sqrt(DynamicalMatrix)
-  // while for electrons we derive the BlochHamiltonian directly
-
   int numK = cartesianCoordinates.extent(0);
+  int numBands = this->numBands;
+  int numBravaisVectors = this->numBravaisVectors;
+  Kokkos::complex<double> complexI(0.0, 1.0);
+
+  auto bravaisVectors_d = this->bravaisVectors_d;
+  auto mat2R_d = this->mat2R_d;
+  auto numAtoms = this->numAtoms;
 
-  double delta = 1.0e-8;
+  ComplexView3D derivatives("dynMatDer", numK * 3, numBands, numBands);
 
-  // prepare all the wavevectors at which we need the hamiltonian,
-  // (kx, ky, kz), (kx+dk, ky, kz), (kx - dk, ky, kz), (kx, ky + dk, kz), etc.
-  DoubleView2D allVectors("wavevectors_k", numK * 7, 3);
+  // phases -iR_i exp(-iqR), with the three directions as extra wavevectors
+  ComplexView2D phases_d("phDerPhases_d", numK * 3, numBravaisVectors);
   Kokkos::parallel_for(
-      "elHamiltonianShifted_d", numK, KOKKOS_LAMBDA(int iK) {
-        for (int i = 0; i < 3; ++i) {
-          allVectors(iK * 7, i) = cartesianCoordinates(iK, i);
+      "ph_der_phases", Range2D({0, 0}, {numK, numBravaisVectors}),
+      KOKKOS_LAMBDA(int iK, int iR) {
+        double arg = 0.0;
+        for (int i = 0; i < 3; i++) {
+          arg += cartesianCoordinates(iK, i) * bravaisVectors_d(iR, i);
         }
-        for (int iDir = 0; iDir < 3; ++iDir) {
-          for (int i = 0; i < 3; ++i) {
-            allVectors(iK * 7 + iDir * 2 + 1, i) = cartesianCoordinates(iK, i);
-            allVectors(iK * 7 + iDir * 2 + 2, i) = cartesianCoordinates(iK, i);
-            if (iDir == i) {
-              allVectors(iK * 7 + iDir * 2 + 1, i) += delta;
-              allVectors(iK * 7 + iDir * 2 + 2, i) -= delta;
-            }
-          }
+        Kokkos::complex<double> phase = exp(-complexI * arg);
+        for (int i = 0; i < 3; i++) {
+          phases_d(iK * 3 + i, iR) = -complexI * bravaisVectors_d(iR, i) * phase;
         }
       });
+  Kokkos::fence();
+  kokkosBatchedFourierTransform(phases_d, mat2R_d, derivatives);
+  Kokkos::realloc(phases_d, 0, 0);
 
-  //print2D("new = ", allVectors);
+  // the constant long range term doesn't depend on q
+  if (hasDielectric) {
+    double norm = e2 * fourPi / volumeUnitCell;
+    int numG = gVectors_d.extent(0);
 
-  // compute the electronic properties at all wavevectors
-  auto t = kokkosBatchedDiagonalizeFromCoordinates(allVectors, false);
-  DoubleView2D allEnergies = std::get<0>(t);
-  StridedComplexView3D allEigenvectors = std::get<1>(t);
+    auto gVectors_d = this->gVectors_d;
+    auto dielectricMatrix_d = this->dielectricMatrix_d;
+    auto bornCharges_d = this->bornCharges_d;
+    auto atomicPositions_d = this->atomicPositions_d;
+    auto gMax = this->gMax;
 
-    //print2D("new = ", allEnergies);
+    // same structure of the Ewald sum in kokkosBatchedBuildBlochHamiltonian,
+    // for each term normG * (GQ.Za)_i (GQ.Zb)_j exp(i xi.GQ) we sum the
+    // derivatives of the three factors
+    Kokkos::parallel_for(
+        "long-range-ph-H0-der", Range3D({0, 0, 0}, {numK, numAtoms, numAtoms}),
+        KOKKOS_LAMBDA(int iK, int na, int nb) {
+          double xi[3];
+          for (int i = 0; i < 3; i++) {
+            xi[i] = atomicPositions_d(na, i) - atomicPositions_d(nb, i);
+          }
+          Kokkos::complex<double> block[3][3][3];
+          for (int k = 0; k < 3; k++) {
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
+                block[k][i][j] = Kokkos::complex<double>(0., 0.);
+              }
+            }
+          }
 
-  int numBands = allEnergies.extent(1);
+          for (int iG = 0; iG < numG; iG++) {
+            double GQ[3];
+            for (int i = 0; i < 3; i++) {
+              GQ[i] = gVectors_d(iG, i) + cartesianCoordinates(iK, i);
+            }
 
-  //print2D("new = ", allEnergies);
-  //print3DComplex("new = ", allEigenvectors);
+            double geg = 0.;
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
+                geg += GQ[i] * dielectricMatrix_d(i, j) * GQ[j];
+              }
+            }
+            if (geg <= 0. || geg >= 4. * gMax) {
+              continue;
+            }
+            double normG = norm * exp(-geg * 0.25) / geg;
+            // d normG / dq_k
+            double dNormG[3];
+            for (int k = 0; k < 3; k++) {
+              double dGeg = 0.;
+              for (int j = 0; j < 3; j++) {
+                dGeg += (dielectricMatrix_d(k, j) + dielectricMatrix_d(j, k)) *
+                        GQ[j];
+              }
+              dNormG[k] = -normG * (0.25 + 1. / geg) * dGeg;
+            }
 
-  Kokkos::LayoutStride eigenvectorLayout(
-      numK, numBands*numBands,
-      numBands, 1,
-      numBands, numBands);
+            double GQZa[3], GQZb[3];
+            for (int i = 0; i < 3; i++) {
+              GQZa[i] = 0.;
+              GQZb[i] = 0.;
+              for (int j = 0; j < 3; j++) {
+                GQZa[i] += GQ[j] * bornCharges_d(i, j, na);
+                GQZb[i] += GQ[j] * bornCharges_d(i, j, nb);
+              }
+            }
 
-  // save energies and eigenvectors to results
-  DoubleView2D resultEnergies("energies", numK, numBands);
-  StridedComplexView3D resultEigenvectors("eigenvectors", eigenvectorLayout);
-  ComplexView4D resultVelocities("velocities", numK, numBands, numBands, 3);
+            double arg = 0.;
+            for (int i = 0; i < 3; i++) {
+              arg += xi[i] * GQ[i];
+            }
+            Kokkos::complex<double> phase = exp(complexI * arg);
+            for (int k = 0; k < 3; k++) {
+              for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                  double zz = GQZa[i] * GQZb[j];
+                  double dzz = bornCharges_d(i, k, na) * GQZb[j] +
+                               GQZa[i] * bornCharges_d(j, k, nb);
+                  block[k][i][j] +=
+                      phase * (dNormG[k] * zz + normG * dzz +
+                               complexI * xi[k] * normG * zz);
+                }
+              }
+            }
+          }
+
+          for (int k = 0; k < 3; k++) {
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
+                derivatives(iK * 3 + k, na * 3 + i, nb * 3 + j) +=
+                    block[k][i][j];
+              }
+            }
+          }
+        });
+  }
 
+  // ensure hermiticity and divide by atomic masses. Each thread owns the
+  // pair of elements (m,n), (n,m)
+  auto atomicMasses_d = this->atomicMasses_d;
   Kokkos::parallel_for(
-      "der", Range2D({0, 0}, {numK, numBands}), KOKKOS_LAMBDA(int iK, int m) {
-        auto E = Kokkos::subview(allEnergies, iK * 7, Kokkos::ALL);
-        auto X = Kokkos::subview(allEigenvectors, iK * 7, Kokkos::ALL, Kokkos::ALL);
-        resultEnergies(iK, m) = E(m);
-        for (int n=0; n<numBands; ++n) {
-          resultEigenvectors(iK, m, n) = X(m, n);
-        }
+      "ph_der_hermitian", Range3D({0, 0, 0}, {numK * 3, numBands, numBands}),
+      KOKKOS_LAMBDA(int iKDir, int m, int n) {
+        if (m > n) return;
+        auto D = Kokkos::subview(derivatives, iKDir, Kokkos::ALL, Kokkos::ALL);
+        Kokkos::complex<double> x =
+            0.5 * (D(m, n) + Kokkos::conj(D(n, m))) /
+            sqrt(atomicMasses_d(m) * atomicMasses_d(n));
+        D(m, n) = x;
+        D(n, m) = Kokkos::conj(x);
       });
+  Kokkos::fence();
+  return derivatives;
+}
 
-  //print3DComplex("new = ", resultEigenvectors);
+/**
+ * Create and diagonalize Hamiltonians for a batch of k-points, with velocities
+ * Returns the energies (nk, nb), eigenvectors (nk, nb, nb)
+ * and velocities (nk, nb, nb, 3) at each k-point.
+ * Note that for each k-point, the (nb, nb) eigenvector
+ * matrix is column-major, as required by the cuSOLVER routine,
+ * hence the StridedLayout.
+ */
+std::tuple<DoubleView2D, StridedComplexView3D, ComplexView4D>
+PhononH0::kokkosBatchedDiagonalizeWithVelocities(
+    const DoubleView2D &cartesianCoordinates) {
+  DeviceMemoryScope memoryScope("PhononH0");
+
+  // Note: this is slightly different than electronH0Wannier
+  // here, we need to compute the derivative of the frequencies, i.e. of
+  // sqrt(DynamicalMatrix), while for electrons we derive the
+  // BlochHamiltonian directly
+
+  int numK = cartesianCoordinates.extent(0);
+
+  // the analytic derivatives of the dynamical matrix, and the frequencies
+  // and eigenvectors at the wavevectors of the batch
+  ComplexView3D der = kokkosBatchedBuildHamiltonianDerivatives(
+      cartesianCoordinates);
+  auto t = kokkosBatchedDiagonalizeFromCoordinates(cartesianCoordinates,
+                                                   false);
+  DoubleView2D resultEnergies = std::get<0>(t);
+  StridedComplexView3D resultEigenvectors = std::get<1>(t);
+
+  int numBands = resultEnergies.extent(1);
+  ComplexView4D resultVelocities("velocities", numK, numBands, numBands, 3);
 
   // Views for intermediate results
-  ComplexView3D der("der", numK, numBands, numBands);
   ComplexView3D tmpV("tmpV", numK, numBands, numBands);
-  //ComplexView3D plus("plus", numK, numBands, numBands);
-  //ComplexView3D minus("plus", numK, numBands, numBands);
 
   for (int i = 0; i < 3; ++i) {
 
-    // To build the velocity operator, we first compute the matrix
-    // der = dH/dk = ( H(k+dk)-H(k-dk) ) / 2dk
-    // we also reinforce the Hermiticity (better numerical properties)
-    Kokkos::parallel_for(
-        "der", Range3D({0, 0, 0}, {numK, numBands, numBands}),
-        KOKKOS_LAMBDA(int iK, int m, int n) {
-          auto XPlus = Kokkos::subview(allEigenvectors, iK * 7 + i * 2 + 1, Kokkos::ALL, Kokkos::ALL);
-          auto XMins = Kokkos::subview(allEigenvectors, iK * 7 + i * 2 + 2, Kokkos::ALL, Kokkos::ALL);
-          DoubleView1D EPlus = Kokkos::subview(allEnergies, iK * 7 + i * 2 + 1, Kokkos::ALL);
-          DoubleView1D EMins = Kokkos::subview(allEnergies, iK * 7 + i * 2 + 2, Kokkos::ALL);
-          Kokkos::complex<double> x(0.,0.);
-          //Kokkos::complex<double> p(0.,0.);
-          //Kokkos::complex<double> pm(0.,0.);
-          for (int l=0; l<numBands; ++l) {
-            x += XPlus(m,l) * EPlus(l) * Kokkos::conj(XPlus(n,l))
-                - XMins(m,l) * EMins(l) * Kokkos::conj(XMins(n,l));
-            //p += XPlus(m,l) * EPlus(l) * Kokkos::conj(XPlus(n,l));
-            //pm += XMins(m,l) * EMins(l) * Kokkos::conj(XMins(n,l));
-          }
-          der(iK, m, n) = x/(2*delta);
-          //plus(iK,m,n) = p;
-          //minus(iK,m,n) = pm;
-        });
-    Kokkos::fence();
-    //print2D("new = ", resultEnergies);
-    //print3DComplex("new = ", der);
-    //print3DComplex("new = ", plus);
-    //print3DComplex("new = ", minus);
-
-    // Now we complete the Hellman-Feynman theorem
-    // and compute the velocity as v = U(k)^* der * U(k)
+    // Hellman-Feynman theorem on the dynamical matrix: U(k)^* dD/dk U(k)
     Kokkos::parallel_for(
         "tmpV", Range3D({0, 0, 0}, {numK, numBands, numBands}),
         KOKKOS_LAMBDA(int iK, int m, int n) {
           auto L = Kokkos::subview(resultEigenvectors, iK, Kokkos::ALL, Kokkos::ALL);
-          auto R = Kokkos::subview(der, iK, Kokkos::ALL, Kokkos::ALL);
-          auto A = Kokkos::subview(tmpV, iK, Kokkos::ALL, Kokkos::ALL);
+          auto R = Kokkos::subview(der, iK * 3 + i, Kokkos::ALL, Kokkos::ALL);
           Kokkos::complex<double> tmp(0.,0.);
           for (int l = 0; l < numBands; ++l) {
-            tmp += Kokkos::conj(L(l,m)) * 0.5 * (R(l, n) + Kokkos::conj(R(n, l)));
+            tmp += Kokkos::conj(L(l,m)) * R(l, n);
           }
-          A(m, n) = tmp;
+          tmpV(iK, m, n) = tmp;
         });
     Kokkos::fence();
 
+    // since D = W^2, with W the matrix of the frequencies, in the basis of
+    // the eigenvectors dD_mn = (w_m + w_n) dW_mn. More generally, for
+    // frequencies w = sign(l)sqrt(|l|) of the eigenvalues l, dW_mn is
+    // dD_mn times the divided difference (w_m - w_n) / (l_m - l_n)
     Kokkos::parallel_for(
         "vel", Range3D({0, 0, 0}, {numK, numBands, numBands}),
         KOKKOS_LAMBDA(int iK, int m, int n) {
           double norm = 0.;
-          for (int i=0; i<3; ++i) {
-            norm += cartesianCoordinates(iK,i) * cartesianCoordinates(iK,i);
+          for (int j=0; j<3; ++j) {
+            norm += cartesianCoordinates(iK,j) * cartesianCoordinates(iK,j);
           }
           Kokkos::complex<double> tmp(0.,0.);
           if ( norm > 1.0e-6 ) {// skip the gamma point
+            double wm = resultEnergies(iK, m);
+            double wn = resultEnergies(iK, n);
+            double factor = 0.;
+            if (wm * wn >= 0.) {
+              double sum = abs(wm) + abs(wn);
+              factor = sum > 0. ? 1. / sum : 0.;
+            } else {
+              factor = (wm - wn) / (wm * abs(wm) - wn * abs(wn));
+            }
             for (int l = 0; l < numBands; ++l) {
               tmp += tmpV(iK, m, l) * resultEigenvectors(iK, l, n);
             }
+            tmp *= factor;
           }
           resultVelocities(iK, m, n, i) = tmp;
         });
@@ -517,8 +661,6 @@ PhononH0::kokkosBatchedDiagonalizeWithVelocities(
   Kokkos::resize(der, 0, 0, 0);
   Kokkos::resize(tmpV, 0, 0, 0);
 
-  //print4DComplex("new = ", resultVelocities);
-
   // deal with velocity issues and degenerate bands
   kokkosBatchedTreatDegenerateVelocities(cartesianCoordinates, resultEnergies,
                                          resultVelocities, 0.0001 / ryToCmm1);
@@ -1,13 +1,21 @@
 #include "phonon_h0.h"
 
 #include <cmath>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 
 #include "eigen.h"
 #include "exceptions.h"
 
+#ifdef HDF5_AVAIL
+#include <highfive/H5Easy.hpp>
+#endif
+
 void PhononH0::setAcousticSumRule(const std::string &sumRule,
-                                  Eigen::Tensor<double, 7>& forceConstants) {
+                                  Eigen::Tensor<double, 7>& forceConstants,
+                                  const std::string &sumRuleFilePrefix) {
   //  VectorXi u_less(6*3*numAtoms)
   //  indices of the vectors u that are not independent to the preceding ones
   //  n_less = number of such vectors
@@ -78,6 +86,16 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
       }
     }
   } else {
+    // the "crystal" sum rule is expensive for large cells, and may have been
+    // computed by a previous run with the same input
+    std::string sumRuleFileName;
+    if (!sumRuleFilePrefix.empty()) {
+      sumRuleFileName = getSumRuleFileName(sumRuleFilePrefix, forceConstants);
+      if (loadAcousticSumRule(sumRuleFileName, forceConstants)) {
+        return;
+      }
+    }
+
     // Acoustic Sum Rule on effective charges
 
     // generating the vectors of the orthogonal of the subspace to project
@@ -242,7 +260,9 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
     int nr2 = qCoarseGrid(1);
     int nr3 = qCoarseGrid(2);
 
-    Eigen::Tensor<double, 8> uvec(18 * numAtoms, nr1, nr2, nr3, 3, 3, numAtoms,
+    // only the first 9*numAtoms vectors (the translational sum rules) are
+    // ever used, and this is the largest array of the sum rule
+    Eigen::Tensor<double, 8> uvec(9 * numAtoms, nr1, nr2, nr3, 3, 3, numAtoms,
                                   numAtoms);
     uvec.setZero();
 
@@ -293,7 +313,20 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
     v.setZero();
 
     int m = 0;
-    int q, l;
+    int q;
+
+    // index of an element (1-based, as in ind_v) of the force constants
+    auto elementIndex = [&](const int &n1, const int &n2, const int &n3,
+                            const int &i, const int &j, const int &na,
+                            const int &nb) {
+      return (((((size_t(n1 - 1) * nr2 + n2 - 1) * nr3 + n3 - 1) * 3 + i - 1)
+                   * 3 + j - 1) * numAtoms + na - 1) * numAtoms + nb - 1;
+    };
+    // true if the element is already the second element of a vector in
+    // ind_v. The first elements can't be repeated, as each element is only
+    // visited once by the loops below.
+    std::vector<bool> isPaired(9 * numAtoms * numAtoms * nr1 * nr2 * nr3,
+                               false);
 
     for (int i : {1, 2, 3}) {
       for (int j : {1, 2, 3}) {
@@ -305,27 +338,8 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
                   // These are the vectors associated with the symmetry
                   // constraints
                   q = 1;
-                  l = 1;
-                  while ((l <= m) && (q != 0)) {
-                    if ((ind_v(l - 1, 0, 0) == n1) &&
-                        (ind_v(l - 1, 0, 1) == n2) &&
-                        (ind_v(l - 1, 0, 2) == n3) &&
-                        (ind_v(l - 1, 0, 3) == i) &&
-                        (ind_v(l - 1, 0, 4) == j) &&
-                        (ind_v(l - 1, 0, 5) == na) &&
-                        (ind_v(l - 1, 0, 6) == nb)) {
-                      q = 0;
-                    }
-                    if ((ind_v(l - 1, 1, 0) == n1) &&
-                        (ind_v(l - 1, 1, 1) == n2) &&
-                        (ind_v(l - 1, 1, 2) == n3) &&
-                        (ind_v(l - 1, 1, 3) == i) &&
-                        (ind_v(l - 1, 1, 4) == j) &&
-                        (ind_v(l - 1, 1, 5) == na) &&
-                        (ind_v(l - 1, 1, 6) == nb)) {
-                      q = 0;
-                    }
-                    l += 1;
+                  if (isPaired[elementIndex(n1, n2, n3, i, j, na, nb)]) {
+                    q = 0;
                   }
                   if ((n1 == mod((nr1 + 1 - n1) , nr1) + 1) &&
                       (n2 == mod((nr2 + 1 - n2) , nr2) + 1) &&
@@ -351,6 +365,8 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
                     ind_v(m - 1, 1, 5) = nb;
                     ind_v(m - 1, 1, 6) = na;
                     v(m - 1, 1) = -1. / sqrt(2.);
+                    isPaired[elementIndex(ind_v(m - 1, 1, 0), ind_v(m - 1, 1, 1),
+                                          ind_v(m - 1, 1, 2), j, i, nb, na)] = true;
                   }
                 }
               }
@@ -394,28 +410,31 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
         }
       }
 
-      for (l = 0; l < m; l++) {
-        scalar = 0.;
+      // the symmetry constraints act on disjoint pairs of elements,
+      // so they can be projected out in parallel
+#pragma omp parallel for
+      for (int lc = 0; lc < m; lc++) {
+        double scalarL = 0.;
         for (int rr : {0, 1}) {
-          int n1 = ind_v(l, rr, 0) - 1;
-          int n2 = ind_v(l, rr, 1) - 1;
-          int n3 = ind_v(l, rr, 2) - 1;
-          int i = ind_v(l, rr, 3) - 1;
-          int j = ind_v(l, rr, 4) - 1;
-          int na = ind_v(l, rr, 5) - 1;
-          int nb = ind_v(l, rr, 6) - 1;
-          scalar += w(n1, n2, n3, i, j, na, nb) * v(l, rr);
+          int n1 = ind_v(lc, rr, 0) - 1;
+          int n2 = ind_v(lc, rr, 1) - 1;
+          int n3 = ind_v(lc, rr, 2) - 1;
+          int i = ind_v(lc, rr, 3) - 1;
+          int j = ind_v(lc, rr, 4) - 1;
+          int na = ind_v(lc, rr, 5) - 1;
+          int nb = ind_v(lc, rr, 6) - 1;
+          scalarL += w(n1, n2, n3, i, j, na, nb) * v(lc, rr);
         }
 
         for (int rr : {0, 1}) {
-          int n1 = ind_v(l, rr, 0) - 1;
-          int n2 = ind_v(l, rr, 1) - 1;
-          int n3 = ind_v(l, rr, 2) - 1;
-          int i = ind_v(l, rr, 3) - 1;
-          int j = ind_v(l, rr, 4) - 1;
-          int na = ind_v(l, rr, 5) - 1;
-          int nb = ind_v(l, rr, 6) - 1;
-          w(n1, n2, n3, i, j, na, nb) -= scalar * v(l, rr);
+          int n1 = ind_v(lc, rr, 0) - 1;
+          int n2 = ind_v(lc, rr, 1) - 1;
+          int n3 = ind_v(lc, rr, 2) - 1;
+          int i = ind_v(lc, rr, 3) - 1;
+          int j = ind_v(lc, rr, 4) - 1;
+          int na = ind_v(lc, rr, 5) - 1;
+          int nb = ind_v(lc, rr, 6) - 1;
+          w(n1, n2, n3, i, j, na, nb) -= scalarL * v(lc, rr);
         }
       }
 
@@ -458,6 +477,7 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
             }
           }
 
+#pragma omp parallel for collapse(7)
           for (int nb = 0; nb < numAtoms; nb++) {
             for (int na = 0; na < numAtoms; na++) {
               for (int j = 0; j < 3; j++) {
@@ -524,30 +544,31 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
     // subspace of the vectors verifying the sum rules and symmetry constraints
 
     w.setZero();
-    for (l = 1; l <= m; l++) {
+#pragma omp parallel for
+    for (int lc = 1; lc <= m; lc++) {
 
       //      call sp2(frcNew,v(l,:),ind_v(l,:,:),nr1,nr2,nr3,nat,scalar)
-      scalar = 0.;
+      double scalarL = 0.;
       for (int ii : {0, 1}) {
-        int n1 = ind_v(l - 1, ii, 0) - 1;
-        int n2 = ind_v(l - 1, ii, 1) - 1;
-        int n3 = ind_v(l - 1, ii, 2) - 1;
-        int i = ind_v(l - 1, ii, 3) - 1;
-        int j = ind_v(l - 1, ii, 4) - 1;
-        int na = ind_v(l - 1, ii, 5) - 1;
-        int nb = ind_v(l - 1, ii, 6) - 1;
-        scalar += frcNew(n1, n2, n3, i, j, na, nb) * v(l - 1, ii);
+        int n1 = ind_v(lc - 1, ii, 0) - 1;
+        int n2 = ind_v(lc - 1, ii, 1) - 1;
+        int n3 = ind_v(lc - 1, ii, 2) - 1;
+        int i = ind_v(lc - 1, ii, 3) - 1;
+        int j = ind_v(lc - 1, ii, 4) - 1;
+        int na = ind_v(lc - 1, ii, 5) - 1;
+        int nb = ind_v(lc - 1, ii, 6) - 1;
+        scalarL += frcNew(n1, n2, n3, i, j, na, nb) * v(lc - 1, ii);
       }
 
       for (int rr : {0, 1}) {
-        int n1 = ind_v(l - 1, rr, 0) - 1;
-        int n2 = ind_v(l - 1, rr, 1) - 1;
-        int n3 = ind_v(l - 1, rr, 2) - 1;
-        int i = ind_v(l - 1, rr, 3) - 1;
-        int j = ind_v(l - 1, rr, 4) - 1;
-        int na = ind_v(l - 1, rr, 5) - 1;
-        int nb = ind_v(l - 1, rr, 6) - 1;
-        w(n1, n2, n3, i, j, na, nb) += scalar * v(l - 1, rr);
+        int n1 = ind_v(lc - 1, rr, 0) - 1;
+        int n2 = ind_v(lc - 1, rr, 1) - 1;
+        int n3 = ind_v(lc - 1, rr, 2) - 1;
+        int i = ind_v(lc - 1, rr, 3) - 1;
+        int j = ind_v(lc - 1, rr, 4) - 1;
+        int na = ind_v(lc - 1, rr, 5) - 1;
+        int nb = ind_v(lc - 1, rr, 6) - 1;
+        w(n1, n2, n3, i, j, na, nb) += scalarL * v(lc - 1, rr);
       }
     }
     for (int k = 1; k <= p; k++) {
@@ -577,6 +598,7 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
           }
         }
 
+#pragma omp parallel for collapse(7)
         for (int nb = 0; nb < numAtoms; nb++) {
           for (int na = 0; na < numAtoms; na++) {
             for (int j = 0; j < 3; j++) {
@@ -642,6 +664,10 @@ void PhononH0::setAcousticSumRule(const std::string &sumRule,
         }
       }
     }
+
+    if (!sumRuleFileName.empty()) {
+      saveAcousticSumRule(sumRuleFileName, forceConstants);
+    }
   }
   if (mpi->mpiHead()) {
     std::cout << "Finished imposing " << sumRule << " acoustic sum rule."
@@ -664,3 +690,112 @@ void PhononH0::sp_zeu(Eigen::Tensor<double, 3> &zeu_u,
     }
   }
 }
+
+std::string PhononH0::getSumRuleFileName(
+    const std::string &sumRuleFilePrefix,
+    Eigen::Tensor<double, 7> &forceConstants) {
+  // we use the FNV-1a hash, which, unlike std::hash, is stable across
+  // compilers and runs
+  uint64_t hash = 14695981039346656037ULL;
+  auto addToHash = [&hash](const void *x, const size_t &numBytes) {
+    auto bytes = static_cast<const unsigned char *>(x);
+    for (size_t i = 0; i < numBytes; i++) {
+      hash ^= uint64_t(bytes[i]);
+      hash *= 1099511628211ULL;
+    }
+  };
+  addToHash(&numAtoms, sizeof(int));
+  addToHash(qCoarseGrid.data(), 3 * sizeof(int));
+  addToHash(forceConstants.data(), forceConstants.size() * sizeof(double));
+  addToHash(bornCharges.data(), bornCharges.size() * sizeof(double));
+
+  std::stringstream hashString;
+  hashString << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return sumRuleFilePrefix + ".sumRule." + hashString.str() + ".hdf5";
+}
+
+bool PhononH0::loadAcousticSumRule(const std::string &fileName,
+                                   Eigen::Tensor<double, 7> &forceConstants) {
+#ifndef HDF5_AVAIL
+  (void) fileName;
+  (void) forceConstants;
+  Error("Saving the acoustic sum rule to disk requires Phoebe built with HDF5.");
+  return false;
+#else
+  int fileExists = 0;
+  if (mpi->mpiHead()) {
+    std::ifstream tmpFile(fileName);
+    fileExists = int(tmpFile.good());
+  }
+  mpi->bcast(&fileExists);
+  if (fileExists == 0) {
+    return false;
+  }
+
+  if (mpi->mpiHead()) {
+    std::cout << "Loading the acoustic sum rule from " << fileName
+              << std::endl;
+  }
+
+  // the head process reads the file, and sends it to the others
+  std::vector<double> forceConstantsFlat;
+  std::vector<double> bornChargesFlat;
+  int status = 1;
+  if (mpi->mpiHead()) {
+    try {
+      HighFive::File file(fileName, HighFive::File::ReadOnly);
+      file.getDataSet("/forceConstants").read(forceConstantsFlat);
+      file.getDataSet("/bornCharges").read(bornChargesFlat);
+    } catch (std::exception &error) {
+      status = 0;
+    }
+    if (forceConstantsFlat.size() != size_t(forceConstants.size()) ||
+        bornChargesFlat.size() != size_t(bornCharges.size())) {
+      status = 0;
+    }
+  }
+  mpi->bcast(&status);
+  if (status == 0) {
+    Error("Issue reading the acoustic sum rule from " + fileName);
+  }
+  forceConstantsFlat.resize(forceConstants.size());
+  bornChargesFlat.resize(bornCharges.size());
+  mpi->bcast(&forceConstantsFlat);
+  mpi->bcast(&bornChargesFlat);
+
+  std::copy(forceConstantsFlat.begin(), forceConstantsFlat.end(),
+            forceConstants.data());
+  std::copy(bornChargesFlat.begin(), bornChargesFlat.end(),
+            bornCharges.data());
+  return true;
+#endif
+}
+
+void PhononH0::saveAcousticSumRule(const std::string &fileName,
+                                   Eigen::Tensor<double, 7> &forceConstants) {
+#ifdef HDF5_AVAIL
+  if (!mpi->mpiHead()) {
+    return;
+  }
+  std::cout << "Saving the acoustic sum rule to " << fileName << std::endl;
+
+  std::vector<double> forceConstantsFlat(
+      forceConstants.data(), forceConstants.data() + forceConstants.size());
+  std::vector<double> bornChargesFlat(
+      bornCharges.data(), bornCharges.data() + bornCharges.size());
+  try {
+    HighFive::File file(fileName, HighFive::File::Overwrite);
+    HighFive::DataSet dFC = file.createDataSet<double>(
+        "/forceConstants", HighFive::DataSpace::From(forceConstantsFlat));
+    dFC.write(forceConstantsFlat);
+    HighFive::DataSet dZ = file.createDataSet<double>(
+        "/bornCharges", HighFive::DataSpace::From(bornChargesFlat));
+    dZ.write(bornChargesFlat);
+  } catch (std::exception &error) {
+    Error("Issue writing the acoustic sum rule to " + fileName);
+  }
+#else
+  (void) fileName;
+  (void) forceConstants;
+#endif
+}
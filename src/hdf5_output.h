@@ -0,0 +1,65 @@
+#ifndef HDF5_OUTPUT_H
+#define HDF5_OUTPUT_H
+
+#include <string>
+#include <vector>
+
+#ifdef HDF5_AVAIL
+#include <highfive/H5Easy.hpp>
+
+/** Creates a dataset of dimensions dims in a HDF5 file, and writes the
+ * block of elements (offset, count) from a row-major buffer. The creation is
+ * collective on the processes that opened the file, while processes with an
+ * empty buffer don't write anything.
+ */
+template <typename T>
+inline void writeHDF5Slice(HighFive::File &file, const std::string &name,
+                           const std::vector<size_t> &dims,
+                           const std::vector<size_t> &offset,
+                           const std::vector<size_t> &count,
+                           const std::vector<T> &buffer) {
+  HighFive::DataSet dataset =
+      file.createDataSet<T>(name, HighFive::DataSpace(dims));
+  if (!buffer.empty()) {
+    dataset.select(offset, count).write_raw(buffer.data());
+  }
+}
+
+/** Creates a string dataset in a HDF5 file, written by one process.
+ */
+inline void writeHDF5String(HighFive::File &file, const std::string &name,
+                            const std::string &value, const bool &writer) {
+  HighFive::DataSet dataset = file.createDataSet<std::string>(
+      name, HighFive::DataSpace::From(value));
+  if (writer) {
+    dataset.write(value);
+  }
+}
+
+/** Same as writeHDF5String(), for a list of strings.
+ */
+inline void writeHDF5String(HighFive::File &file, const std::string &name,
+                            const std::vector<std::string> &values,
+                            const bool &writer) {
+  HighFive::DataSet dataset = file.createDataSet<std::string>(
+      name, HighFive::DataSpace::From(values));
+  if (writer) {
+    dataset.write(values);
+  }
+}
+#endif
+
+/** Returns the name of the HDF5 output file corresponding to a json file.
+ */
+inline std::string getHDF5OutputFileName(const std::string &jsonFileName) {
+  std::string extension = ".json";
+  if (jsonFileName.size() >= extension.size() &&
+      jsonFileName.compare(jsonFileName.size() - extension.size(),
+                           extension.size(), extension) == 0) {
+    return jsonFileName.substr(0, jsonFileName.size() - extension.size())
+        + ".hdf5";
+  }
+  return jsonFileName + ".hdf5";
+}
+
+#endif
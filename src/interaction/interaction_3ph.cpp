@@ -1,34 +1,138 @@
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+
 #include "interaction_3ph.h"
+#include "active_bandstructure.h"
+#include "io.h"
 #include "mpiHelper.h"
 #include "common_kokkos.h"
+#include <KokkosBlas3_gemm.hpp>
 
 Interaction3Ph::Interaction3Ph(Crystal &crystal, Eigen::Tensor<double, 5> &D3,
                                Eigen::MatrixXd &cellPositions2,
                                Eigen::MatrixXd &cellPositions3,
                                Eigen::Tensor<double, 3> &weights2,
-                               Eigen::Tensor<double, 3> &weights3)
+                               Eigen::Tensor<double, 3> &weights3,
+                               const double &pruningThreshold,
+                               const double &distanceCutoff)
     : crystal_(crystal) {
+  DeviceMemoryScope memoryScope("Interaction3Ph");
 
   numAtoms = crystal_.getNumAtoms();
   numBands = numAtoms * 3;
   nr2 = cellPositions2.cols();
-  nr3 = cellPositions3.cols();
+  int nr3Full = cellPositions3.cols();
+
+  // elements of D3 of atom triplets with an interatomic distance larger
+  // than distanceCutoff are discarded
+  Eigen::MatrixXd atomicPositions = crystal_.getAtomicPositions();
+  auto isWithinCutoff = [&](const int &at1, const int &at2, const int &at3,
+                            const int &ir3, const int &ir2) {
+    if (distanceCutoff <= 0.) {
+      return true;
+    }
+    Eigen::Vector3d pos1 = atomicPositions.row(at1).transpose();
+    Eigen::Vector3d pos2 =
+        atomicPositions.row(at2).transpose() + cellPositions2.col(ir2);
+    Eigen::Vector3d pos3 =
+        atomicPositions.row(at3).transpose() + cellPositions3.col(ir3);
+    double distance = std::max({(pos1 - pos2).norm(), (pos1 - pos3).norm(),
+                                (pos2 - pos3).norm()});
+    return distance <= distanceCutoff;
+  };
+  auto getD3 = [&](const int &i1, const int &i2, const int &i3,
+                   const int &ir3, const int &ir2) {
+    if (!isWithinCutoff(i1 / 3, i2 / 3, i3 / 3, ir3, ir2)) {
+      return 0.;
+    }
+    return D3(i1, i2, i3, ir3, ir2);
+  };
+
+  // largest element of each (R2,R3) block, including the weights
+  Eigen::MatrixXd blockMax = Eigen::MatrixXd::Zero(nr3Full, nr2);
+  for (int ir3 = 0; ir3 < nr3Full; ir3++) {
+    for (int ir2 = 0; ir2 < nr2; ir2++) {
+      for (int i1 = 0; i1 < numBands; i1++) {
+        for (int i2 = 0; i2 < numBands; i2++) {
+          for (int i3 = 0; i3 < numBands; i3++) {
+            double x = std::abs(getD3(i1, i2, i3, ir3, ir2) *
+                                weights2(ir2, i1 / 3, i2 / 3) *
+                                weights3(ir3, i1 / 3, i3 / 3));
+            blockMax(ir3, ir2) = std::max(blockMax(ir3, ir2), x);
+          }
+        }
+      }
+    }
+  }
+  double threshold = pruningThreshold * blockMax.maxCoeff();
+
+  // the blocks are stored in sparse format, i.e. we keep the list of
+  // (R2,R3) pairs with some non-negligible element, sorted by R3.
+  // The R3 vectors without any pair are removed.
+  std::vector<int> activeR3, pairR2, pairStart;
+  for (int ir3 = 0; ir3 < nr3Full; ir3++) {
+    std::vector<int> r2s;
+    for (int ir2 = 0; ir2 < nr2; ir2++) {
+      if (blockMax(ir3, ir2) > threshold) {
+        r2s.push_back(ir2);
+      }
+    }
+    if (r2s.empty()) continue;
+    activeR3.push_back(ir3);
+    pairStart.push_back(int(pairR2.size()));
+    pairR2.insert(pairR2.end(), r2s.begin(), r2s.end());
+  }
+  pairStart.push_back(int(pairR2.size()));
+  nr3 = int(activeR3.size());
+  int numTotalPairs = int(pairR2.size());
+
+  if (mpi->mpiHead() && numTotalPairs < nr2 * nr3Full) {
+    std::cout << "Storing " << numTotalPairs << " of the " << nr2 * nr3Full
+              << " (R2,R3) blocks of the anharmonic force constants.\n"
+              << std::endl;
+  }
+
+  // with pools of MPI processes, each process of the pool only stores a
+  // contiguous range of the blocks, and cacheD3 sums the contributions of
+  // all processes in the pool
+  {
+    int poolSize = mpi->getSize(mpi->intraPoolComm);
+    int poolRank = mpi->getRank(mpi->intraPoolComm);
+    int firstPair = int(long(numTotalPairs) * poolRank / poolSize);
+    int lastPair = int(long(numTotalPairs) * (poolRank + 1) / poolSize);
+    for (int &x : pairStart) {
+      x = std::max(firstPair, std::min(lastPair, x)) - firstPair;
+    }
+    pairR2 = std::vector<int>(pairR2.begin() + firstPair,
+                              pairR2.begin() + lastPair);
+    if (mpi->mpiHead() && poolSize > 1) {
+      std::cout << "The blocks are distributed over the " << poolSize
+                << " MPI processes of each pool.\n" << std::endl;
+    }
+  }
+  numPairs = int(pairR2.size());
+
   // Copy everything to kokkos views
   Kokkos::realloc(cellPositions2_k, nr2, 3);
   Kokkos::realloc(cellPositions3_k, nr3, 3);
   Kokkos::realloc(weights2_k, nr2, numAtoms, numAtoms);
-  Kokkos::realloc(weights3_k, nr2, numAtoms, numAtoms);
+  Kokkos::realloc(weights3_k, nr3, numAtoms, numAtoms);
+  Kokkos::realloc(pairStart_k, nr3 + 1);
+  Kokkos::realloc(pairR2_k, numPairs);
 
   auto cellPositions2_h = Kokkos::create_mirror_view(cellPositions2_k);
   auto cellPositions3_h = Kokkos::create_mirror_view(cellPositions3_k);
   auto weights2_h = Kokkos::create_mirror_view(weights2_k);
   auto weights3_h = Kokkos::create_mirror_view(weights3_k);
+  auto pairStart_h = Kokkos::create_mirror_view(pairStart_k);
+  auto pairR2_h = Kokkos::create_mirror_view(pairR2_k);
   for (int j = 0; j < 3; j++) {
     for (int i = 0; i < nr2; i++) {
       cellPositions2_h(i, j) = cellPositions2(j, i);
     }
     for (int i = 0; i < nr3; i++) {
-      cellPositions3_h(i, j) = cellPositions3(j, i);
+      cellPositions3_h(i, j) = cellPositions3(j, activeR3[i]);
     }
   }
   for (int j = 0; j < numAtoms; j++) {
@@ -37,31 +141,61 @@ Interaction3Ph::Interaction3Ph(Crystal &crystal, Eigen::Tensor<double, 5> &D3,
         weights2_h(i, j, k) = weights2(i, j, k);
       }
       for (int i = 0; i < nr3; i++) {
-        weights3_h(i, j, k) = weights3(i, j, k);
+        weights3_h(i, j, k) = weights3(activeR3[i], j, k);
       }
     }
   }
+  for (int i = 0; i <= nr3; i++) {
+    pairStart_h(i) = pairStart[i];
+  }
+  for (int i = 0; i < numPairs; i++) {
+    pairR2_h(i) = pairR2[i];
+  }
   Kokkos::deep_copy(cellPositions2_k, cellPositions2_h);
   Kokkos::deep_copy(cellPositions3_k, cellPositions3_h);
   Kokkos::deep_copy(weights2_k, weights2_h);
   Kokkos::deep_copy(weights3_k, weights3_h);
-
-  Kokkos::realloc(D3_k, numBands, numBands, numBands, nr3, nr2);
-  Kokkos::realloc(D3PlusCached_k, numBands, numBands, numBands, nr3);
-  Kokkos::realloc(D3MinsCached_k, numBands, numBands, numBands, nr3);
+  Kokkos::deep_copy(pairStart_k, pairStart_h);
+  Kokkos::deep_copy(pairR2_k, pairR2_h);
+
+  // on CPU builds, the processes of a node may share a single copy of D3
+  bool isSharedD3 = mpi->useSharedMemory() &&
+                    std::is_same<Kokkos::DefaultExecutionSpace::memory_space,
+                                 Kokkos::HostSpace>::value;
+  if (isSharedD3) {
+    size_t numElements = size_t(numBands) * numBands * numBands * numPairs;
+    sharedD3 = mpi->allocateSharedMemory(numElements * sizeof(double));
+    D3_k = DoubleView4D((double *)sharedD3, numBands, numBands, numBands,
+                        numPairs);
+  } else {
+    Kokkos::realloc(D3_k, numBands, numBands, numBands, numPairs);
+  }
+  Kokkos::realloc(D3PlusCached_k, numBands * numBands * numBands, nr3);
+  Kokkos::realloc(D3MinsCached_k, numBands * numBands * numBands, nr3);
+  // on the host, the mirror is D3_k itself: with shared memory, only the
+  // first process of the node writes it
   auto D3_h = Kokkos::create_mirror_view(D3_k);
-  for (int i1 = 0; i1 < numBands; i1++) {
-    for (int i2 = 0; i2 < numBands; i2++) {
-      for (int i3 = 0; i3 < numBands; i3++) {
-        for (int i5 = 0; i5 < nr3; i5++) {
-          for (int i4 = 0; i4 < nr2; i4++) {
-            D3_h(i1, i2, i3, i5, i4) = D3(i1, i2, i3, i5, i4);
+  if (!isSharedD3 || mpi->isSharedMemoryHead()) {
+    for (int i1 = 0; i1 < numBands; i1++) {
+      for (int i2 = 0; i2 < numBands; i2++) {
+        for (int i3 = 0; i3 < numBands; i3++) {
+          for (int ir3 = 0; ir3 < nr3; ir3++) {
+            for (int iPair = pairStart[ir3]; iPair < pairStart[ir3 + 1];
+                 iPair++) {
+              D3_h(i1, i2, i3, iPair) =
+                  getD3(i1, i2, i3, activeR3[ir3], pairR2[iPair]);
+            }
           }
         }
       }
     }
+    Kokkos::deep_copy(D3_k, D3_h);
+  }
+  if (isSharedD3) {
+    mpi->sharedMemoryBarrier();
   }
-  Kokkos::deep_copy(D3_k, D3_h);
+  Profiler::recordObjectMemory("3-ph force constants (D3)",
+                               double(D3_h.size()) * sizeof(double));
 
   double memoryUsed = getDeviceMemoryUsage();
   kokkosDeviceMemory->addDeviceMemoryUsage(memoryUsed);
@@ -70,7 +204,8 @@ Interaction3Ph::Interaction3Ph(Crystal &crystal, Eigen::Tensor<double, 5> &D3,
 // copy constructor
 Interaction3Ph::Interaction3Ph(const Interaction3Ph &that)
     : crystal_(that.crystal_), nr2(that.nr2), nr3(that.nr3),
-      numAtoms(that.numAtoms), numBands(that.numBands) {
+      numPairs(that.numPairs), numAtoms(that.numAtoms),
+      numBands(that.numBands) {
 }
 
 // assignment operator
@@ -79,6 +214,7 @@ Interaction3Ph &Interaction3Ph::operator=(const Interaction3Ph &that) {
     crystal_ = that.crystal_;
     nr2 = that.nr2;
     nr3 = that.nr3;
+    numPairs = that.numPairs;
     numAtoms = that.numAtoms;
     numBands = that.numBands;
   }
@@ -88,9 +224,18 @@ Interaction3Ph &Interaction3Ph::operator=(const Interaction3Ph &that) {
 Interaction3Ph::~Interaction3Ph() {
   double memoryUsed = getDeviceMemoryUsage(); // call this before deallocation
   kokkosDeviceMemory->removeDeviceMemoryUsage(memoryUsed);
-  Kokkos::realloc(D3_k, 0, 0, 0, 0, 0);
-  Kokkos::realloc(D3PlusCached_k, 0, 0, 0, 0);
-  Kokkos::realloc(D3MinsCached_k, 0, 0, 0, 0);
+  // if D3 is in shared memory, the view doesn't own it: release the window
+  // (collectively over the processes of the node sharing it)
+  D3_k = DoubleView4D();
+  if (sharedD3 != nullptr) {
+    mpi->freeSharedMemory(sharedD3);
+    sharedD3 = nullptr;
+  }
+  D3Left_k = Kokkos::View<double ****, Kokkos::LayoutLeft>();
+  Kokkos::realloc(pairStart_k, 0);
+  Kokkos::realloc(pairR2_k, 0);
+  Kokkos::realloc(D3PlusCached_k, 0, 0);
+  Kokkos::realloc(D3MinsCached_k, 0, 0);
   Kokkos::realloc(weights2_k, 0, 0, 0);
   Kokkos::realloc(weights3_k, 0, 0, 0);
   Kokkos::realloc(cellPositions2_k, 0, 0);
@@ -98,6 +243,209 @@ Interaction3Ph::~Interaction3Ph() {
 }
 
 void Interaction3Ph::cacheD3(const Eigen::Vector3d &q2_e) {
+  DeviceMemoryScope memoryScope("Interaction3Ph");
+  if (!isD3LayoutTuned) {
+    tuneD3Layout(q2_e);
+  }
+  int poolSize = mpi->getSize(mpi->intraPoolComm);
+  if (poolSize == 1) {
+    cacheD3Local(q2_e, D3PlusCached_k, D3MinsCached_k);
+    return;
+  }
+
+  Kokkos::Profiling::pushRegion("cacheD3 pool");
+  int poolRank = mpi->getRank(mpi->intraPoolComm);
+  int numBands3 = numBands * numBands * numBands;
+
+  // the contributions to the cache of each process of the pool are reduced
+  // with non-blocking calls, using two pairs of host buffers (for D3+ and
+  // D3-), so that the reduction for the iPool-th process overlaps with the
+  // Fourier transform for the next one. waitReduction() completes the
+  // reductions that used a pair of buffers and, on their root process, moves
+  // the result to the cache on the device.
+  ComplexView2D::HostMirror poolBuffers[2][2];
+  int poolBufferRoots[2] = {-1, -1};
+#ifdef MPI_AVAIL
+  MPI_Request poolRequests[2][2] = {{MPI_REQUEST_NULL, MPI_REQUEST_NULL},
+                                    {MPI_REQUEST_NULL, MPI_REQUEST_NULL}};
+#endif
+  auto waitReduction = [&](const int &iBuffer) {
+    if (poolBufferRoots[iBuffer] < 0) return;
+    Kokkos::Profiling::pushRegion("wait MPI_Ireduce");
+#ifdef MPI_AVAIL
+    MPI_Waitall(2, poolRequests[iBuffer], MPI_STATUSES_IGNORE);
+#endif
+    Kokkos::Profiling::popRegion();
+    if (poolBufferRoots[iBuffer] == poolRank) {
+      Kokkos::deep_copy(D3PlusCached_k, poolBuffers[iBuffer][0]);
+      Kokkos::deep_copy(D3MinsCached_k, poolBuffers[iBuffer][1]);
+    }
+    // the buffers can be released only after the reduction is complete
+    poolBuffers[iBuffer][0] = ComplexView2D::HostMirror();
+    poolBuffers[iBuffer][1] = ComplexView2D::HostMirror();
+    poolBufferRoots[iBuffer] = -1;
+  };
+
+  ComplexView2D poolPlus("poolD3pc", numBands3, nr3);
+  ComplexView2D poolMins("poolD3mc", numBands3, nr3);
+
+  // note: this loop is a parallelization over the group (Pool) of MPI
+  // processes, which together contain all the D3 tensor.
+  // Each process computes its contribution to the D3 cache of the q2 of the
+  // iPool-th process, and the contributions are summed on the latter.
+  for (int iPool = 0; iPool < poolSize; iPool++) {
+    Eigen::Vector3d poolQ2 = Eigen::Vector3d::Zero();
+    if (iPool == poolRank) {
+      poolQ2 = q2_e;
+    }
+    mpi->bcast(&poolQ2, mpi->intraPoolComm, iPool);
+
+    cacheD3Local(poolQ2, poolPlus, poolMins);
+
+    // the buffers used two iterations ago are free after their reduction
+    int iBuffer = iPool % 2;
+    waitReduction(iBuffer);
+
+    // create_mirror always allocates: on a host build, a mirror view would
+    // alias poolPlus and poolMins, which the next iteration overwrites
+    // while the reduction is still reading them
+    Kokkos::Profiling::pushRegion("copy D3 cache to CPU");
+    poolBuffers[iBuffer][0] = Kokkos::create_mirror(poolPlus);
+    poolBuffers[iBuffer][1] = Kokkos::create_mirror(poolMins);
+    Kokkos::deep_copy(poolBuffers[iBuffer][0], poolPlus);
+    Kokkos::deep_copy(poolBuffers[iBuffer][1], poolMins);
+    Kokkos::Profiling::popRegion();
+    poolBufferRoots[iBuffer] = iPool;
+
+#ifdef MPI_AVAIL
+    // start the reductions for the current iteration. Note: the send
+    // buffers must not be modified or freed before waitReduction()
+    Kokkos::Profiling::pushRegion("call MPI_Ireduce");
+    for (int i : {0, 1}) {
+      auto &buffer = poolBuffers[iBuffer][i];
+      if (poolRank == iPool) {
+        MPI_Ireduce(MPI_IN_PLACE, buffer.data(), int(buffer.size()),
+                    MPI_COMPLEX16, MPI_SUM, iPool,
+                    mpi->getComm(mpi->intraPoolComm), &poolRequests[iBuffer][i]);
+      } else {
+        MPI_Ireduce(buffer.data(), nullptr, int(buffer.size()), MPI_COMPLEX16,
+                    MPI_SUM, iPool, mpi->getComm(mpi->intraPoolComm),
+                    &poolRequests[iBuffer][i]);
+      }
+    }
+    Kokkos::Profiling::popRegion();
+#endif
+  }
+  // complete the last reductions
+  waitReduction(poolSize % 2);
+  waitReduction((poolSize + 1) % 2);
+  Kokkos::Profiling::popRegion();
+}
+
+void Interaction3Ph::tuneD3Layout(const Eigen::Vector3d &q2_e) {
+  isD3LayoutTuned = true;
+  int layout = kokkosDeviceMemory->getD3Layout();
+  // D3 in shared memory is only used on CPUs, where the threads of
+  // cacheD3Local() already read contiguous elements of D3_k
+  bool isHost = std::is_same<Kokkos::DefaultExecutionSpace::memory_space,
+                             Kokkos::HostSpace>::value;
+  bool isSharedD3 = mpi->useSharedMemory() && isHost;
+  if (layout == d3LayoutRight || isSharedD3 ||
+      (layout == d3LayoutAuto && isHost)) {
+    return;
+  }
+  // the copy of D3 must fit next to the original
+  double d3Memory = double(D3_k.size()) * sizeof(double);
+  if (kokkosDeviceMemory->getAvailableMemory() < d3Memory) {
+    if (layout == d3LayoutLeft) {
+      Warning("Not enough device memory to change the layout of D3");
+    }
+    return;
+  }
+
+  auto timeCache = [&]() {
+    ComplexView2D plus("tuneD3pc", D3PlusCached_k.extent(0), nr3);
+    ComplexView2D mins("tuneD3mc", D3MinsCached_k.extent(0), nr3);
+    auto startTime = std::chrono::steady_clock::now();
+    cacheD3Local(q2_e, plus, mins);
+    std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - startTime;
+    return time.count();
+  };
+
+  double timeRight = 0.;
+  if (layout == d3LayoutAuto) {
+    timeCache(); // warm up
+    timeRight = timeCache();
+  }
+  D3Left_k = Kokkos::View<double ****, Kokkos::LayoutLeft>(
+      Kokkos::view_alloc(Kokkos::WithoutInitializing, "D3Left"),
+      numBands, numBands, numBands, numPairs);
+  Kokkos::deep_copy(D3Left_k, D3_k);
+  double timeLeft = 0.;
+  if (layout == d3LayoutAuto) {
+    timeLeft = timeCache();
+  }
+
+  if (layout == d3LayoutLeft || timeLeft < timeRight) {
+    D3_k = DoubleView4D();
+  } else {
+    D3Left_k = Kokkos::View<double ****, Kokkos::LayoutLeft>();
+  }
+  if (mpi->mpiHead() && layout == d3LayoutAuto) {
+    std::cout << "Layout of the 3-phonon force constants on the device: "
+              << (D3Left_k.size() > 0 ? "left" : "right") << " (" << timeLeft
+              << " s vs " << timeRight << " s).\n";
+  }
+}
+
+/** Launches the kernel of cacheD3Local() that sums the blocks of D3 over
+ * the R2 vectors paired with each R3. Templated on the layout of D3, and on
+ * the iteration order of the threads, which must follow it for coalesced
+ * reads on GPUs.
+ */
+template <typename D3ViewType, typename PolicyType>
+void launchD3CacheKernel(const D3ViewType &D3, const PolicyType &policy,
+                         const int &numBands, const IntView1D &pairStart,
+                         const IntView1D &pairR2,
+                         const ComplexView1D &phasePlus2,
+                         const ComplexView1D &phasePlus3,
+                         const ComplexView1D &phaseMins2,
+                         const ComplexView1D &phaseMins3,
+                         const DoubleView3D &weights2,
+                         const DoubleView3D &weights3,
+                         const ComplexView2D &D3PlusCached,
+                         const ComplexView2D &D3MinsCached) {
+  int nb = numBands;
+  Kokkos::parallel_for(
+      "D3cacheloop", policy,
+      KOKKOS_LAMBDA(int ind1, int ind2, int ind3, int ir3) {
+        // note: decompress2Indices doesn't compile like this on the GPU
+        int at1 = ind1 / 3;
+        int at2 = ind2 / 3;
+        int at3 = ind3 / 3;
+
+        Kokkos::complex<double> tmpp = 0, tmpm = 0;
+        // sum over the R2 vectors paired with R3
+        for (int iPair = pairStart(ir3); iPair < pairStart(ir3 + 1); iPair++) {
+          int ir2 = pairR2(iPair);
+          tmpp += D3(ind1, ind2, ind3, iPair) * phasePlus2(ir2)
+              * phasePlus3(ir3) * weights2(ir2, at1, at2) * weights3(ir3, at1, at3);
+          tmpm += D3(ind1, ind2, ind3, iPair) * phaseMins2(ir2)
+              * phaseMins3(ir3) * weights2(ir2, at1, at2) * weights3(ir3, at1, at3);
+        }
+        // the weight of R3 of the q1 Fourier transform is applied here, so
+        // that the sum over R3 in getCouplingsSquared is a matrix product
+        double w3 = weights3(ir3, at1, at3);
+        int ind = (ind1 * nb + ind2) * nb + ind3;
+        D3PlusCached(ind, ir3) = tmpp * w3;
+        D3MinsCached(ind, ir3) = tmpm * w3;
+      });
+}
+
+void Interaction3Ph::cacheD3Local(const Eigen::Vector3d &q2_e,
+                                  ComplexView2D &D3PlusCached,
+                                  ComplexView2D &D3MinsCached) {
   // copy q2 to kokkos
   DoubleView1D q2("q2", 3);
   auto q2_h = Kokkos::create_mirror_view(q2);
@@ -113,13 +461,13 @@ void Interaction3Ph::cacheD3(const Eigen::Vector3d &q2_e) {
   int nr3 = this->nr3;
   int numBands = this->numBands;
 
-  auto D3PlusCached = this->D3PlusCached_k;
-  auto D3MinsCached = this->D3MinsCached_k;
   auto cellPositions2 = this->cellPositions2_k;
   auto cellPositions3 = this->cellPositions3_k;
   auto weights2 = this->weights2_k;
   auto weights3 = this->weights3_k;
   auto D3 = this->D3_k;
+  auto pairStart = this->pairStart_k;
+  auto pairR2 = this->pairR2_k;
 
   // precompute phases
   ComplexView1D phasePlus2("pp", nr2), phasePlus3("pp", nr3),
@@ -149,42 +497,59 @@ void Interaction3Ph::cacheD3(const Eigen::Vector3d &q2_e) {
   Kokkos::fence();
 
   // create cached D3
-  Kokkos::parallel_for(
-      "D3cacheloop",
-      Range4D({0, 0, 0, 0}, {numBands, numBands, numBands, nr3}),
-      KOKKOS_LAMBDA(int ind1, int ind2, int ind3, int ir3) {
-        // note: decompress2Indices doesn't compile like this on the GPU
-        int at1 = ind1 / 3;
-        int at2 = ind2 / 3;
-        int at3 = ind3 / 3;
-        // int at1 = std::get<0>(decompress2Indices(ind1,numAtoms,3));
-        // int at2 = std::get<0>(decompress2Indices(ind2,numAtoms,3));
-        // int at3 = std::get<0>(decompress2Indices(ind3,numAtoms,3));
-
-        Kokkos::complex<double> tmpp = 0, tmpm = 0;
-        for (int ir2 = 0; ir2 < nr2; ir2++) {// sum over all triplets
-          tmpp += D3(ind1, ind2, ind3, ir3, ir2) * phasePlus2(ir2)
-              * phasePlus3(ir3) * weights2(ir2, at1, at2) * weights3(ir3, at1, at3);
-          tmpm += D3(ind1, ind2, ind3, ir3, ir2) * phaseMins2(ir2)
-              * phaseMins3(ir3) * weights2(ir2, at1, at2) * weights3(ir3, at1, at3);
-        }
-        D3PlusCached(ind1, ind2, ind3, ir3) = tmpp;
-        D3MinsCached(ind1, ind2, ind3, ir3) = tmpm;
-      });
+  if (D3Left_k.size() > 0) {
+    // the first band index runs fastest, as in D3Left
+    using Range4DLeft = Kokkos::MDRangePolicy<
+        Kokkos::Rank<4, Kokkos::Iterate::Left, Kokkos::Iterate::Left>>;
+    launchD3CacheKernel(
+        D3Left_k, Range4DLeft({0, 0, 0, 0}, {numBands, numBands, numBands, nr3}),
+        numBands, pairStart, pairR2, phasePlus2, phasePlus3, phaseMins2,
+        phaseMins3, weights2, weights3, D3PlusCached, D3MinsCached);
+  } else {
+    launchD3CacheKernel(
+        D3, Range4D({0, 0, 0, 0}, {numBands, numBands, numBands, nr3}),
+        numBands, pairStart, pairR2, phasePlus2, phasePlus3, phaseMins2,
+        phaseMins3, weights2, weights3, D3PlusCached, D3MinsCached);
+  }
   Kokkos::fence();
 }
 
-std::tuple<std::vector<Eigen::Tensor<double, 3>>,
-           std::vector<Eigen::Tensor<double, 3>>>
-Interaction3Ph::getCouplingsSquared(
+std::tuple<DoubleView4D, DoubleView4D> Interaction3Ph::getCouplingsSquaredViews(
     const std::vector<Eigen::Vector3d> &q1s_e, const Eigen::Vector3d &q2_e,
     const std::vector<Eigen::MatrixXcd> &ev1s_e, const Eigen::MatrixXcd &ev2_e,
     const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
     const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
     const std::vector<int> &nb1s_e, const int nb2,
     const std::vector<int> &nb3Pluss_e, std::vector<int> &nb3Minss_e) {
-
   (void) q2_e;
+  return computeCouplingsSquared(q1s_e, ev1s_e, nullptr, ev2_e, ev3Pluss_e,
+                                 ev3Minss_e, nb1s_e, nb2, nb3Pluss_e,
+                                 nb3Minss_e);
+}
+
+std::tuple<DoubleView4D, DoubleView4D> Interaction3Ph::getCouplingsSquaredViews(
+    const DeviceQ1s &q1s, const Eigen::MatrixXcd &ev2_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Minss_e, const int nb2,
+    const std::vector<int> &nb3Pluss_e, std::vector<int> &nb3Minss_e) {
+  std::vector<int> nb1s_e(q1s.bands1s.size());
+  for (size_t i = 0; i < nb1s_e.size(); i++) {
+    nb1s_e[i] = int(q1s.bands1s[i].size());
+  }
+  return computeCouplingsSquared({}, {}, &q1s, ev2_e, ev3Pluss_e, ev3Minss_e,
+                                 nb1s_e, nb2, nb3Pluss_e, nb3Minss_e);
+}
+
+std::tuple<DoubleView4D, DoubleView4D> Interaction3Ph::computeCouplingsSquared(
+    const std::vector<Eigen::Vector3d> &q1s_e,
+    const std::vector<Eigen::MatrixXcd> &ev1s_e, const DeviceQ1s *deviceQ1s,
+    const Eigen::MatrixXcd &ev2_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+    const std::vector<int> &nb1s_e, const int nb2,
+    const std::vector<int> &nb3Pluss_e, std::vector<int> &nb3Minss_e) {
+  DeviceMemoryScope memoryScope("Interaction3Ph");
+
   Kokkos::complex<double> complexI(0.0, 1.0);
 
   // Need all variables to be local to be captured by lambda
@@ -192,39 +557,58 @@ Interaction3Ph::getCouplingsSquared(
   int numBands = this->numBands;
   auto cellPositions2 = this->cellPositions2_k;
   auto cellPositions3 = this->cellPositions3_k;
-  auto weights3 = this->weights3_k;
-  auto D3 = this->D3_k;
   auto D3PlusCached = this->D3PlusCached_k;
   auto D3MinsCached = this->D3MinsCached_k;
 
-  int nq1 = q1s_e.size();
+  int nq1 = nb1s_e.size();
 
   // MDRangePolicy loops are rectangular, need maximal dimensions
   int maxnb1 = *std::max_element(nb1s_e.begin(), nb1s_e.end());
   int maxnb3Plus = *std::max_element(nb3Pluss_e.begin(), nb3Pluss_e.end());
   int maxnb3Mins = *std::max_element(nb3Minss_e.begin(), nb3Minss_e.end());
-
-  DoubleView2D q1s("q1s", nq1, 3);
-  ComplexView2D ev2("ev2", nb2, numBands);
-  ComplexView3D ev1s("ev1s", nq1, maxnb1, numBands),
-      ev3Pluss("ev3p", nq1, maxnb3Plus, numBands),
-      ev3Minss("ev3m", nq1, maxnb3Mins, numBands);
-  IntView1D nb1s("nb1s", nq1), nb3Pluss("nb3ps", nq1), nb3Minss("nb3ms", nq1);
-
-  // copy everything to kokkos views
+  batchMemoryTuner.recordMemoryPerPoint(
+      getMemoryPerQ1(maxnb1, nb2, maxnb3Plus, maxnb3Mins),
+      getMemoryPerQ1(numBands, nb2, numBands, numBands));
+
+  // temporary views are borrowed from the scratch arena, to avoid device
+  // allocations at every batch. Views alive at the same time use distinct slots
+  auto q1s = scratchArena.borrow<DoubleView2D>(0, nq1, 3);
+  auto ev2 = scratchArena.borrow<ComplexView2D>(1, nb2, numBands);
+  auto ev1s = scratchArena.borrow<ComplexView3D>(2, nq1, maxnb1, numBands);
+  auto ev3Pluss =
+      scratchArena.borrow<ComplexView3D>(3, nq1, maxnb3Plus, numBands);
+  auto ev3Minss =
+      scratchArena.borrow<ComplexView3D>(4, nq1, maxnb3Mins, numBands);
+  auto nb1s = scratchArena.borrow<IntView1D>(5, nq1);
+  auto nb3Pluss = scratchArena.borrow<IntView1D>(6, nq1);
+  auto nb3Minss = scratchArena.borrow<IntView1D>(7, nq1);
+
+  // copy everything to kokkos views, through pinned host buffers. The
+  // copies of the previous batch must be over before the buffers are refilled
+  Kokkos::fence();
   {
-    auto q1s_h = Kokkos::create_mirror_view(q1s);
-    auto ev1s_h = Kokkos::create_mirror_view(ev1s);
-    auto ev2_h = Kokkos::create_mirror_view(ev2);
-    auto ev3Pluss_h = Kokkos::create_mirror_view(ev3Pluss);
-    auto ev3Minss_h = Kokkos::create_mirror_view(ev3Minss);
-    auto nb1s_h = Kokkos::create_mirror_view(nb1s);
-    auto nb3Pluss_h = Kokkos::create_mirror_view(nb3Pluss);
-    auto nb3Minss_h = Kokkos::create_mirror_view(nb3Minss);
+    auto q1s_h = stagingArena.mirror(0, q1s);
+    auto ev1s_h = stagingArena.mirror(1, ev1s);
+    auto ev2_h = stagingArena.mirror(2, ev2);
+    auto ev3Pluss_h = stagingArena.mirror(3, ev3Pluss);
+    auto ev3Minss_h = stagingArena.mirror(4, ev3Minss);
+    auto nb1s_h = stagingArena.mirror(5, nb1s);
+    auto nb3Pluss_h = stagingArena.mirror(6, nb3Pluss);
+    auto nb3Minss_h = stagingArena.mirror(7, nb3Minss);
+    // these are only partially filled below, and the arena memory is not
+    // initialized (on host builds, the mirror views alias the device views)
+    if (deviceQ1s == nullptr) {
+      Kokkos::deep_copy(ev1s_h, Kokkos::complex<double>(0.));
+    }
+    Kokkos::deep_copy(ev3Pluss_h, Kokkos::complex<double>(0.));
+    Kokkos::deep_copy(ev3Minss_h, Kokkos::complex<double>(0.));
     for (int i = 0; i < nq1; i++) {
       nb1s_h(i) = nb1s_e[i];
       nb3Pluss_h(i) = nb3Pluss_e[i];
       nb3Minss_h(i) = nb3Minss_e[i];
+      if (deviceQ1s != nullptr) {
+        continue; // the q1 data is gathered on the device below
+      }
       for (int j = 0; j < 3; j++) {
         q1s_h(i, j) = q1s_e[i][j];
       }
@@ -249,17 +633,59 @@ Interaction3Ph::getCouplingsSquared(
         ev2_h(j, i) = ev2_e(i, j);
       }
     }
-    Kokkos::deep_copy(q1s, q1s_h);
-    Kokkos::deep_copy(ev1s, ev1s_h);
-    Kokkos::deep_copy(ev2, ev2_h);
-    Kokkos::deep_copy(ev3Pluss, ev3Pluss_h);
-    Kokkos::deep_copy(ev3Minss, ev3Minss_h);
-    Kokkos::deep_copy(nb1s, nb1s_h);
-    Kokkos::deep_copy(nb3Pluss, nb3Pluss_h);
-    Kokkos::deep_copy(nb3Minss, nb3Minss_h);
+    // the copies are asynchronous, and are queued before the kernels below
+    auto space = Kokkos::DefaultExecutionSpace();
+    if (deviceQ1s == nullptr) {
+      Kokkos::deep_copy(space, q1s, q1s_h);
+      Kokkos::deep_copy(space, ev1s, ev1s_h);
+    }
+    Kokkos::deep_copy(space, ev2, ev2_h);
+    Kokkos::deep_copy(space, ev3Pluss, ev3Pluss_h);
+    Kokkos::deep_copy(space, ev3Minss, ev3Minss_h);
+    Kokkos::deep_copy(space, nb1s, nb1s_h);
+    Kokkos::deep_copy(space, nb3Pluss, nb3Pluss_h);
+    Kokkos::deep_copy(space, nb3Minss, nb3Minss_h);
+  }
+
+  // with the band structure on the device, only the indices of the q1
+  // states are transferred, and their data is gathered in the batch views
+  if (deviceQ1s != nullptr) {
+    auto iq1s = scratchArena.borrow<IntView1D>(14, nq1);
+    auto bands1s = scratchArena.borrow<IntView2D>(15, nq1, maxnb1);
+    auto iq1s_h = stagingArena.mirror(10, iq1s);
+    auto bands1s_h = stagingArena.mirror(11, bands1s);
+    for (int i = 0; i < nq1; i++) {
+      iq1s_h(i) = deviceQ1s->iq1s[i];
+      for (int k = 0; k < maxnb1; k++) {
+        bands1s_h(i, k) = k < nb1s_e[i] ? deviceQ1s->bands1s[i][k] : 0;
+      }
+    }
+    auto space = Kokkos::DefaultExecutionSpace();
+    Kokkos::deep_copy(space, iq1s, iq1s_h);
+    Kokkos::deep_copy(space, bands1s, bands1s_h);
+
+    auto wavevectors = deviceQ1s->bandStructure->wavevectors;
+    auto eigenvectors = deviceQ1s->bandStructure->eigenvectors;
+    Kokkos::parallel_for(
+        "gatherQ1s", Range2D({0, 0}, {nq1, maxnb1}),
+        KOKKOS_LAMBDA(int iq1, int ib1) {
+          int ik = iq1s(iq1);
+          if (ib1 == 0) {
+            for (int ic = 0; ic < 3; ic++) {
+              q1s(iq1, ic) = wavevectors(ik, ic);
+            }
+          }
+          int ib = bands1s(iq1, ib1);
+          bool isPadding = ib1 >= nb1s(iq1);
+          for (int iac = 0; iac < numBands; iac++) {
+            ev1s(iq1, ib1, iac) =
+                isPadding ? Kokkos::complex<double>(0.)
+                          : eigenvectors(ik, ib, iac);
+          }
+        });
   }
 
-  ComplexView2D phases("pp", nq1, nr3);
+  auto phases = scratchArena.borrow<ComplexView2D>(8, nq1, nr3);
   Kokkos::parallel_for(
       "tmpphaseloop", Range2D({0, 0}, {nq1, nr3}),
       KOKKOS_LAMBDA(int iq1, int ir3) {
@@ -271,158 +697,280 @@ Interaction3Ph::getCouplingsSquared(
       });
   Kokkos::fence();
 
-  ComplexView4D tmpPlus("tmpp", nq1, numBands, numBands, numBands);
-  ComplexView4D tmpMins("tmpm", nq1, numBands, numBands, numBands);
-  Kokkos::parallel_for(
-      "tmploop", Range4D({0, 0, 0, 0}, {nq1, numBands, numBands, numBands}),
-      KOKKOS_LAMBDA(int iq1, int iac1, int iac2, int iac3) {
-        // note: decompress2Indices doesn't compile like this on the GPU
-        int at1 = iac1 / 3;// std::get<0>(decompress2Indices(iac1,numAtoms,3));
-        int at3 = iac3 / 3;// std::get<0>(decompress2Indices(iac3,numAtoms,3));
-        Kokkos::complex<double> tmpp = 0, tmpm = 0;
-        for (int ir3 = 0; ir3 < nr3; ir3++) {// sum over all triplets
-          tmpp += D3PlusCached(iac1, iac2, iac3, ir3) * phases(iq1, ir3) * weights3(ir3, at1, at3);
-          tmpm += D3MinsCached(iac1, iac2, iac3, ir3) * phases(iq1, ir3) * weights3(ir3, at1, at3);
-        }
-        tmpPlus(iq1, iac1, iac2, iac3) = tmpp;
-        tmpMins(iq1, iac1, iac2, iac3) = tmpm;
-      });
-  Kokkos::realloc(phases, 0, 0);
-
-  ComplexView4D tmp1Plus("t1p", nq1, maxnb1, numBands, numBands);
-  ComplexView4D tmp1Mins("t1m", nq1, maxnb1, numBands, numBands);
-  Kokkos::parallel_for(
-      "tmp1loop",
-      Range4D({0, 0, 0, 0}, {nq1, maxnb1, numBands, numBands}),
-      KOKKOS_LAMBDA(int iq1, int ib1, int iac2, int iac3) {
-        int mask = ib1 < nb1s(iq1);
-        Kokkos::complex<double> tmpp = 0, tmpm = 0;
-
-        for (int iac1 = 0; iac1 < numBands; iac1++) {
-          tmpp += tmpPlus(iq1, iac1, iac2, iac3) * ev1s(iq1, ib1, iac1);
-          tmpm += tmpMins(iq1, iac1, iac2, iac3) * ev1s(iq1, ib1, iac1);
-        }
-        tmp1Plus(iq1, ib1, iac3, iac2) = tmpp * mask;
-        tmp1Mins(iq1, ib1, iac3, iac2) = tmpm * mask;
-      });
-  Kokkos::realloc(tmpPlus, 0, 0, 0, 0);
-  Kokkos::realloc(tmpMins, 0, 0, 0, 0);
-
-  ComplexView4D tmp2Plus("t2p", nq1, maxnb1, nb2, numBands);
-  ComplexView4D tmp2Mins("t2m", nq1, maxnb1, nb2, numBands);
-  Kokkos::parallel_for(
-      "tmp2loop",
-      Range4D({0, 0, 0, 0}, {nq1, maxnb1, nb2, numBands}),
-      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int iac3) {
-        int mask = ib1 < nb1s(iq1);
-
-        Kokkos::complex<double> tmpp = 0, tmpm = 0;
-        for (int iac2 = 0; iac2 < numBands; iac2++) {
-          tmpp += tmp1Plus(iq1, ib1, iac3, iac2) * ev2(ib2, iac2);
-          tmpm += tmp1Mins(iq1, ib1, iac3, iac2) * Kokkos::conj(ev2(ib2, iac2));
-        }
-        tmp2Plus(iq1, ib1, ib2, iac3) = tmpp * mask;
-        tmp2Mins(iq1, ib1, ib2, iac3) = tmpm * mask;
-      });
-  Kokkos::realloc(tmp1Plus, 0, 0, 0, 0);
-  Kokkos::realloc(tmp1Mins, 0, 0, 0, 0);
-
-  ComplexView4D vPlus("vp", nq1, maxnb1, nb2, maxnb3Plus);
-  ComplexView4D vMins("vm", nq1, maxnb1, nb2, maxnb3Mins);
-  Kokkos::parallel_for(
-      "vploop",
-      Range4D({0, 0, 0, 0}, {nq1, maxnb1, nb2, maxnb3Plus}),
-      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3) {
-        int mask = ib1 < nb1s(iq1) && ib3 < nb3Pluss(iq1);
-        Kokkos::complex<double> tmpp = 0;
-        for (int iac3 = 0; iac3 < numBands; iac3++) {
-          tmpp += tmp2Plus(iq1, ib1, ib2, iac3) * Kokkos::conj(ev3Pluss(iq1, ib3, iac3));
-        }
-        vPlus(iq1, ib1, ib2, ib3) = tmpp * mask;
-      });
+  // Fourier transform over R3, as the matrix product
+  // tmp(iq1, (iac1,iac2,iac3)) = sum_ir3 phases(iq1,ir3) D3Cached((iac1,iac2,iac3),ir3)
+  // which is done by the (device) BLAS library
+  int numBands3 = numBands * numBands * numBands;
+  auto tmpPlus = scratchArena.borrow<ComplexView2D>(9, nq1, numBands3);
+  auto tmpMins = scratchArena.borrow<ComplexView2D>(10, nq1, numBands3);
+  Kokkos::Profiling::pushRegion("tmploop");
+  KokkosBlas::gemm("N", "T", Kokkos::complex<double>(1.0), phases,
+                   D3PlusCached, Kokkos::complex<double>(0.0), tmpPlus);
+  KokkosBlas::gemm("N", "T", Kokkos::complex<double>(1.0), phases,
+                   D3MinsCached, Kokkos::complex<double>(0.0), tmpMins);
+  Kokkos::fence();
+  Kokkos::Profiling::popRegion();
+
+  // the couplings are returned to the caller, and are only borrowed when
+  // the kernels are replayed as a graph, which needs the same memory at
+  // every batch
+  int maxnb3 = std::max(maxnb3Plus, maxnb3Mins);
+  bool useGraphs = kokkosDeviceMemory->useKernelGraphs();
+  DoubleView4D couplingPlus, couplingMins;
+  if (useGraphs) {
+    couplingPlus = scratchArena.borrow<DoubleView4D>(12, nq1, maxnb1, nb2,
+                                                     maxnb3Plus);
+    couplingMins = scratchArena.borrow<DoubleView4D>(13, nq1, maxnb1, nb2,
+                                                     maxnb3Mins);
+  } else {
+    couplingPlus = DoubleView4D("cp", nq1, maxnb1, nb2, maxnb3Plus);
+    couplingMins = DoubleView4D("cp", nq1, maxnb1, nb2, maxnb3Mins);
+  }
 
-  Kokkos::parallel_for(
-      "vmloop", Range4D({0, 0, 0, 0}, {nq1, maxnb1, nb2, maxnb3Mins}),
-      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3) {
-        int mask = ib1 < nb1s(iq1) && ib3 < nb3Minss(iq1);
+  auto tmp1Plus = scratchArena.borrow<ComplexView4D>(8, nq1, maxnb1,
+                                                      numBands, numBands);
+  auto tmp1Mins = scratchArena.borrow<ComplexView4D>(11, nq1, maxnb1,
+                                                      numBands, numBands);
+  Range4D tmp1Range({0, 0, 0, 0}, {nq1, maxnb1, numBands, numBands});
+  auto tmp1Kernel = KOKKOS_LAMBDA(int iq1, int ib1, int iac2, int iac3) {
+    int mask = ib1 < nb1s(iq1);
+    Kokkos::complex<double> tmpp = 0, tmpm = 0;
+
+    for (int iac1 = 0; iac1 < numBands; iac1++) {
+      int iac = (iac1 * numBands + iac2) * numBands + iac3;
+      tmpp += tmpPlus(iq1, iac) * ev1s(iq1, ib1, iac1);
+      tmpm += tmpMins(iq1, iac) * ev1s(iq1, ib1, iac1);
+    }
+    tmp1Plus(iq1, ib1, iac3, iac2) = tmpp * mask;
+    tmp1Mins(iq1, ib1, iac3, iac2) = tmpm * mask;
+  };
+
+  auto tmp2Plus =
+      scratchArena.borrow<ComplexView4D>(9, nq1, maxnb1, nb2, numBands);
+  auto tmp2Mins =
+      scratchArena.borrow<ComplexView4D>(10, nq1, maxnb1, nb2, numBands);
+  Range4D tmp2Range({0, 0, 0, 0}, {nq1, maxnb1, nb2, numBands});
+  auto tmp2Kernel = KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int iac3) {
+    int mask = ib1 < nb1s(iq1);
+
+    Kokkos::complex<double> tmpp = 0, tmpm = 0;
+    for (int iac2 = 0; iac2 < numBands; iac2++) {
+      tmpp += tmp1Plus(iq1, ib1, iac3, iac2) * ev2(ib2, iac2);
+      tmpm += tmp1Mins(iq1, ib1, iac3, iac2) * Kokkos::conj(ev2(ib2, iac2));
+    }
+    tmp2Plus(iq1, ib1, ib2, iac3) = tmpp * mask;
+    tmp2Mins(iq1, ib1, ib2, iac3) = tmpm * mask;
+  };
+
+  // contraction with the eigenvectors at q3 and square modulus, with the (+)
+  // and (-) processes in the same kernel, that reads tmp2Plus and tmp2Mins
+  // once and never stores the complex couplings.
+  Range4D cpmRange({0, 0, 0, 0}, {nq1, maxnb1, nb2, maxnb3});
+  auto cpmKernel = KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3) {
+    bool isActive1 = ib1 < nb1s(iq1);
+    Kokkos::complex<double> tmpp = 0, tmpm = 0;
+    if (isActive1 && ib3 < nb3Pluss(iq1)) {
+      for (int iac3 = 0; iac3 < numBands; iac3++) {
+        tmpp += tmp2Plus(iq1, ib1, ib2, iac3) *
+                Kokkos::conj(ev3Pluss(iq1, ib3, iac3));
+      }
+    }
+    if (isActive1 && ib3 < nb3Minss(iq1)) {
+      for (int iac3 = 0; iac3 < numBands; iac3++) {
+        tmpm += tmp2Mins(iq1, ib1, ib2, iac3) *
+                Kokkos::conj(ev3Minss(iq1, ib3, iac3));
+      }
+    }
+    if (ib3 < maxnb3Plus) {
+      couplingPlus(iq1, ib1, ib2, ib3) =
+          tmpp.real() * tmpp.real() + tmpp.imag() * tmpp.imag();
+    }
+    if (ib3 < maxnb3Mins) {
+      couplingMins(iq1, ib1, ib2, ib3) =
+          tmpm.real() * tmpm.real() + tmpm.imag() * tmpm.imag();
+    }
+  };
+
+  if (useGraphs) {
+    // all the views of the kernels identify the graph (the scalars, i.e.
+    // the numbers of bands, are among their extents)
+    std::vector<std::uintptr_t> key;
+    auto addToKey = [&key](const std::vector<std::uintptr_t> &x) {
+      key.insert(key.end(), x.begin(), x.end());
+    };
+    addToKey(KernelGraphCache::viewKey(tmpPlus));
+    addToKey(KernelGraphCache::viewKey(tmpMins));
+    addToKey(KernelGraphCache::viewKey(ev1s));
+    addToKey(KernelGraphCache::viewKey(ev2));
+    addToKey(KernelGraphCache::viewKey(ev3Pluss));
+    addToKey(KernelGraphCache::viewKey(ev3Minss));
+    addToKey(KernelGraphCache::viewKey(nb1s));
+    addToKey(KernelGraphCache::viewKey(nb3Pluss));
+    addToKey(KernelGraphCache::viewKey(nb3Minss));
+    addToKey(KernelGraphCache::viewKey(tmp1Plus));
+    addToKey(KernelGraphCache::viewKey(tmp1Mins));
+    addToKey(KernelGraphCache::viewKey(couplingPlus));
+    addToKey(KernelGraphCache::viewKey(couplingMins));
+    contractionGraph.run(key, [&](const auto &root) {
+      auto tmp1Node = root.then_parallel_for("tmp1loop", tmp1Range, tmp1Kernel);
+      auto tmp2Node =
+          tmp1Node.then_parallel_for("tmp2loop", tmp2Range, tmp2Kernel);
+      tmp2Node.then_parallel_for("cpmloop", cpmRange, cpmKernel);
+    });
+  } else {
+    Kokkos::parallel_for("tmp1loop", tmp1Range, tmp1Kernel);
+    Kokkos::parallel_for("tmp2loop", tmp2Range, tmp2Kernel);
+    Kokkos::parallel_for("cpmloop", cpmRange, cpmKernel);
+  }
+  Kokkos::fence();
+  return std::make_tuple(couplingPlus, couplingMins);
+}
 
-        Kokkos::complex<double> tmpp = 0;
-        for (int iac3 = 0; iac3 < numBands; iac3++) {
-          tmpp += tmp2Mins(iq1, ib1, ib2, iac3) * Kokkos::conj(ev3Minss(iq1, ib3, iac3));
-        }
-        vMins(iq1, ib1, ib2, ib3) = tmpp * mask;
-      });
-  Kokkos::realloc(tmp2Plus, 0, 0, 0, 0);
-  Kokkos::realloc(tmp2Mins, 0, 0, 0, 0);
+void Interaction3Ph::CouplingBuffer::resize(const std::vector<int> &nb1s,
+                                            const int &nb2,
+                                            const std::vector<int> &nb3s) {
+  auto nq1 = int(nb1s.size());
+  offsets.resize(nq1);
+  dimensions.resize(nq1);
+  size_t size = 0;
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    offsets[iq1] = size;
+    dimensions[iq1] = {nb1s[iq1], nb2, nb3s[iq1]};
+    size += size_t(nb1s[iq1]) * nb2 * nb3s[iq1];
+  }
+  // note: resize() keeps the capacity, so the storage is allocated again
+  // only if this batch is larger than all the previous ones
+  data.resize(size);
+}
 
-  DoubleView4D couplingPlus("cp", nq1, maxnb1, nb2, maxnb3Plus);
-  DoubleView4D couplingMins("cp", nq1, maxnb1, nb2, maxnb3Mins);
-  Kokkos::parallel_for(
-      "cploop", Range4D({0, 0, 0, 0}, {nq1, maxnb1, nb2, maxnb3Plus}),
-      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3) {
-        auto tmp = vPlus(iq1, ib1, ib2, ib3);
-        couplingPlus(iq1, ib1, ib2, ib3) =
-            tmp.real() * tmp.real() + tmp.imag() * tmp.imag();
-      });
+void Interaction3Ph::getCouplingsSquared(
+    const std::vector<Eigen::Vector3d> &q1s_e, const Eigen::Vector3d &q2_e,
+    const std::vector<Eigen::MatrixXcd> &ev1s_e, const Eigen::MatrixXcd &ev2_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+    const std::vector<int> &nb1s_e, const int nb2,
+    const std::vector<int> &nb3Pluss_e, std::vector<int> &nb3Minss_e,
+    CouplingBuffer &couplingPlus_b, CouplingBuffer &couplingMins_b) {
+
+  auto tup = getCouplingsSquaredViews(q1s_e, q2_e, ev1s_e, ev2_e, ev3Pluss_e,
+                                      ev3Minss_e, nb1s_e, nb2, nb3Pluss_e,
+                                      nb3Minss_e);
+  copyCouplingsToBuffers(std::get<0>(tup), std::get<1>(tup), nb1s_e, nb2,
+                         nb3Pluss_e, nb3Minss_e, couplingPlus_b,
+                         couplingMins_b);
+}
 
-  Kokkos::parallel_for(
-      "cmloop", Range4D({0, 0, 0, 0}, {nq1, maxnb1, nb2, maxnb3Mins}),
-      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3) {
-        auto tmp = vMins(iq1, ib1, ib2, ib3);
-        couplingMins(iq1, ib1, ib2, ib3) =
-            tmp.real() * tmp.real() + tmp.imag() * tmp.imag();
-      });
-  Kokkos::realloc(vPlus, 0, 0, 0, 0);
-  Kokkos::realloc(vMins, 0, 0, 0, 0);
+void Interaction3Ph::getCouplingsSquared(
+    const DeviceQ1s &q1s, const Eigen::MatrixXcd &ev2_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Minss_e, const int nb2,
+    const std::vector<int> &nb3Pluss_e, std::vector<int> &nb3Minss_e,
+    CouplingBuffer &couplingPlus_b, CouplingBuffer &couplingMins_b) {
+  std::vector<int> nb1s_e(q1s.bands1s.size());
+  for (size_t i = 0; i < nb1s_e.size(); i++) {
+    nb1s_e[i] = int(q1s.bands1s[i].size());
+  }
+  auto tup = getCouplingsSquaredViews(q1s, ev2_e, ev3Pluss_e, ev3Minss_e, nb2,
+                                      nb3Pluss_e, nb3Minss_e);
+  copyCouplingsToBuffers(std::get<0>(tup), std::get<1>(tup), nb1s_e, nb2,
+                         nb3Pluss_e, nb3Minss_e, couplingPlus_b,
+                         couplingMins_b);
+}
 
-  // Copy result to vector of Eigen tensors
-  std::vector<Eigen::Tensor<double, 3>> couplingPlus_e(nq1),
-      couplingMins_e(nq1);
-  auto couplingPlus_h = Kokkos::create_mirror_view(couplingPlus);
-  auto couplingMins_h = Kokkos::create_mirror_view(couplingMins);
-  Kokkos::deep_copy(couplingPlus_h, couplingPlus);
-  Kokkos::deep_copy(couplingMins_h, couplingMins);
+void Interaction3Ph::copyCouplingsToBuffers(
+    DoubleView4D &couplingPlus, DoubleView4D &couplingMins,
+    const std::vector<int> &nb1s_e, const int nb2,
+    const std::vector<int> &nb3Pluss_e, const std::vector<int> &nb3Minss_e,
+    CouplingBuffer &couplingPlus_b, CouplingBuffer &couplingMins_b) {
+  int nq1 = nb1s_e.size();
+
+  couplingPlus_b.resize(nb1s_e, nb2, nb3Pluss_e);
+  couplingMins_b.resize(nb1s_e, nb2, nb3Minss_e);
+  auto couplingPlus_h = stagingArena.mirror(8, couplingPlus);
+  auto couplingMins_h = stagingArena.mirror(9, couplingMins);
+  Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), couplingPlus_h,
+                    couplingPlus);
+  Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), couplingMins_h,
+                    couplingMins);
+  Kokkos::fence();
+#pragma omp parallel for
   for (int iq1 = 0; iq1 < nq1; iq1++) {
     int nb1 = nb1s_e[iq1];
     int nb3Plus = nb3Pluss_e[iq1];
     int nb3Mins = nb3Minss_e[iq1];
-    couplingPlus_e[iq1] = Eigen::Tensor<double, 3>(nb1, nb2, nb3Plus);
-    couplingMins_e[iq1] = Eigen::Tensor<double, 3>(nb1, nb2, nb3Mins);
-    for (int ib1 = 0; ib1 < nb1; ib1++) {
+    double *plus = couplingPlus_b.data.data() + couplingPlus_b.offsets[iq1];
+    double *mins = couplingMins_b.data.data() + couplingMins_b.offsets[iq1];
+    for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
       for (int ib2 = 0; ib2 < nb2; ib2++) {
-        for (int ib3 = 0; ib3 < nb3Plus; ib3++) {
-          couplingPlus_e[iq1](ib1, ib2, ib3) =
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          plus[ib1 + nb1 * (ib2 + nb2 * ib3)] =
               couplingPlus_h(iq1, ib1, ib2, ib3);
         }
-        for (int ib3 = 0; ib3 < nb3Mins; ib3++) {
-          couplingMins_e[iq1](ib1, ib2, ib3) =
+      }
+    }
+    for (int ib3 = 0; ib3 < nb3Mins; ib3++) {
+      for (int ib2 = 0; ib2 < nb2; ib2++) {
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          mins[ib1 + nb1 * (ib2 + nb2 * ib3)] =
               couplingMins_h(iq1, ib1, ib2, ib3);
         }
       }
     }
   }
-  return std::make_tuple(couplingPlus_e, couplingMins_e);
 }
 
-int Interaction3Ph::estimateNumBatches(const int &nq1, const int &nb2) {
-  int maxnb1 = numBands;
-  int maxnb3Plus = numBands;
-  int maxnb3Mins = numBands;
+std::tuple<std::vector<Eigen::Tensor<double, 3>>,
+           std::vector<Eigen::Tensor<double, 3>>>
+Interaction3Ph::getCouplingsSquared(
+    const std::vector<Eigen::Vector3d> &q1s_e, const Eigen::Vector3d &q2_e,
+    const std::vector<Eigen::MatrixXcd> &ev1s_e, const Eigen::MatrixXcd &ev2_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+    const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+    const std::vector<int> &nb1s_e, const int nb2,
+    const std::vector<int> &nb3Pluss_e, std::vector<int> &nb3Minss_e) {
 
-  // available memory is MAXMEM minus size of D3, D3cache and ev2
-  double availmem = kokkosDeviceMemory->getAvailableMemory();
+  CouplingBuffer couplingPlus_b, couplingMins_b;
+  getCouplingsSquared(q1s_e, q2_e, ev1s_e, ev2_e, ev3Pluss_e, ev3Minss_e,
+                      nb1s_e, nb2, nb3Pluss_e, nb3Minss_e, couplingPlus_b,
+                      couplingMins_b);
+  int nq1 = q1s_e.size();
 
+  // copy the result to a vector of Eigen tensors
+  std::vector<Eigen::Tensor<double, 3>> couplingPlus_e(nq1),
+      couplingMins_e(nq1);
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    couplingPlus_e[iq1] = couplingPlus_b.get(iq1);
+    couplingMins_e[iq1] = couplingMins_b.get(iq1);
+  }
+  return std::make_tuple(couplingPlus_e, couplingMins_e);
+}
+
+double Interaction3Ph::getMemoryPerQ1(const int &nb1, const int &nb2,
+                                      const int &nb3Plus,
+                                      const int &nb3Mins) const {
   // memory used by different tensors
   // Note: 16 (2*8) is the size of double (complex<double>) in bytes
-  double evs = 16 * numBands * (maxnb1 + maxnb3Plus + maxnb3Mins);
+  double evs = 16 * numBands * (nb1 + nb3Plus + nb3Mins);
   double phase = 16 * nr3;
   double tmp = 2 * 16 * numBands * numBands * numBands;
-  double tmp1 = 2 * 16 * maxnb1 * numBands * numBands;
-  double tmp2 = 2 * 16 * maxnb1 * nb2 * numBands;
-  double v = 16 * maxnb1 * nb2 * (maxnb3Plus + maxnb3Mins);
-  double c = 16 * maxnb1 * nb2 * (maxnb3Plus + maxnb3Mins);
-  double maxusage =
-      nq1 * (evs + std::max({phase + tmp, tmp + tmp1, tmp1 + tmp2, tmp2 + v, v + c}));
+  double tmp1 = 2 * 16 * nb1 * numBands * numBands;
+  double tmp2 = 2 * 16 * nb1 * nb2 * numBands;
+  double c = 16 * nb1 * nb2 * (nb3Plus + nb3Mins);
+  // the temporaries take turns in the slots of the scratch arena,
+  // which are kept allocated between batches
+  return evs + std::max(phase, tmp1 / 2) + tmp1 / 2 + std::max(tmp, tmp2) + c;
+}
+
+int Interaction3Ph::estimateNumBatches(const int &nq1, const int &nb2) {
+  // available memory is MAXMEM minus size of D3, D3cache and ev2
+  // (and, on GPUs, no more than the memory currently free on the device)
+  // (memory already held by the scratch arena is reused by the batches)
+  double availmem = kokkosDeviceMemory->getAvailableMemory() +
+                    scratchArena.getMemory();
+
+  // the upper bound uses all bands at q1 and q3
+  double maxMemoryPerQ1 = getMemoryPerQ1(numBands, nb2, numBands, numBands);
+  double maxusage = nq1 * batchMemoryTuner.getMemoryPerPoint(maxMemoryPerQ1);
 
   // the number of batches needed
   int numBatches = std::ceil(maxusage / availmem);
@@ -440,9 +988,10 @@ int Interaction3Ph::estimateNumBatches(const int &nq1, const int &nb2) {
 }
 
 double Interaction3Ph::getDeviceMemoryUsage() {
-  double occupiedMemory = 16 * (D3_k.size() + D3PlusCached_k.size()
+  double occupiedMemory = 16 * (D3PlusCached_k.size()
                                 + D3MinsCached_k.size())
-      + 8 * (cellPositions2_k.size() + cellPositions2_k.size()
-             + weights2_k.size() + weights3_k.size());
+      + 8 * (D3_k.size() + D3Left_k.size() + cellPositions2_k.size() + cellPositions3_k.size()
+             + weights2_k.size() + weights3_k.size())
+      + 4 * (pairStart_k.size() + pairR2_k.size());
   return occupiedMemory;
 }
@@ -1,6 +1,7 @@
 #ifndef PH_INTERACTION_H
 #define PH_INTERACTION_H
 
+#include <array>
 #include <chrono>
 #include <cmath>
 #include <complex>
@@ -13,6 +14,8 @@
 #include "points.h"
 #include "utilities.h"
 
+struct BandStructureDeviceMirror;
+
 /** Class to calculate the probability rate for one 3-phonon scattering event.
  * In physical notation, this corresponds to the calculation of the term |V3|^2.
  * This class must be schematically used as follow:
@@ -43,20 +46,65 @@
  *
  * Use the environmental variable MAXMEM to set the amount of VRAM in gigabytes
  * available on the GPU/node (depending on the Kokkos installation).
+ * With pools of MPI processes (-ps on the command line), the D3 tensor is
+ * distributed over the processes of each pool, e.g. over the GPUs of a node.
  */
 class Interaction3Ph {
 private:
   Crystal &crystal_;
 
   // variables to be saved on the GPU
-  DoubleView5D D3_k;
-  ComplexView4D D3PlusCached_k, D3MinsCached_k;
+  // D3 is stored in a block-sparse format: D3_k(i1,i2,i3,iPair) is the block
+  // of the pair (R2,R3) = (pairR2_k(iPair),ir3), with the pairs of ir3 found
+  // at pairStart_k(ir3) <= iPair < pairStart_k(ir3+1).
+  DoubleView4D D3_k;
+  // the same tensor with the first band index contiguous in memory, so that
+  // neighbouring GPU threads of cacheD3Local() read neighbouring elements.
+  // Only one of D3_k and D3Left_k is allocated, see tuneD3Layout().
+  Kokkos::View<double ****, Kokkos::LayoutLeft> D3Left_k;
+  bool isD3LayoutTuned = false;
+  // with the -sm flag, the node-shared memory of D3_k, released by the
+  // destructor (copies of this object don't own it)
+  void *sharedD3 = nullptr;
+  IntView1D pairStart_k, pairR2_k;
+  // D3 Fourier transformed over R2, of size (numBands^3, nr3)
+  ComplexView2D D3PlusCached_k, D3MinsCached_k;
   DoubleView2D cellPositions2_k, cellPositions3_k;
   DoubleView3D weights2_k, weights3_k;
 
   // dimensions
-  int nr2, nr3, numAtoms, numBands;
+  // note: nr3 only counts the R3 vectors with some non-zero block
+  int nr2, nr3, numPairs, numAtoms, numBands;
+
+  // tunes the memory estimate of estimateNumBatches
+  BatchMemoryTuner batchMemoryTuner;
+
+  // reusable device memory for the temporary views of the batched kernels
+  ScratchArena scratchArena;
+  // reusable pinned host memory for the transfers of the batches
+  HostStagingArena stagingArena;
+  // the contraction kernels of getCouplingsSquaredViews, replayed as a graph
+  KernelGraphCache contractionGraph;
+
+  /** Estimate the peak memory in bytes used by getCouplingsSquared for each
+   * q1 wavevector, given the number of bands at q1, q2 and q3.
+   */
+  double getMemoryPerQ1(const int &nb1, const int &nb2, const int &nb3Plus,
+                        const int &nb3Mins) const;
+
+  /** Computes the Fourier transform over R2 of the blocks of D3 stored by
+   * this MPI process, see cacheD3().
+   */
+  void cacheD3Local(const Eigen::Vector3d &q2_e, ComplexView2D &D3PlusCached,
+                    ComplexView2D &D3MinsCached);
+
+  /** Chooses the memory layout of D3 on the device, as requested with the
+   * D3LAYOUT environment variable or, by default, by timing cacheD3Local()
+   * with both layouts at the wavevector q2_e. Called by the first cacheD3().
+   */
+  void tuneD3Layout(const Eigen::Vector3d &q2_e);
 
+public:
   /** Estimate the memory in bytes, occupied by the kokkos Views containing
    * the coupling tensor to be interpolated.
    *
@@ -64,8 +112,6 @@ private:
    */
   double getDeviceMemoryUsage();
 
-public:
-
   /** Default constructor.
    * This method mostly moves data to the GPU if necessary.
    *
@@ -88,12 +134,20 @@ public:
    * @param weights3: weight of the Bravais lattice vector, i.e. a counter of
    * the degeneracy of symmetry-equivalent Bravais lattice vectors in
    * cellPositions3. Set to unity (e.g. in ShengBTE) if this is not used.
+   * @param pruningThreshold: the (R2,R3) blocks of D3 whose largest element
+   * is not larger than pruningThreshold times the largest element of D3 are
+   * discarded. With the default (0), only blocks of zeros are discarded.
+   * @param distanceCutoff: if larger than zero, the elements of D3 of atom
+   * triplets with an interatomic distance larger than distanceCutoff (in
+   * Bohr) are discarded.
    */
   Interaction3Ph(Crystal &crystal, Eigen::Tensor<double, 5> &D3,
                  Eigen::MatrixXd &cellPositions2,
                  Eigen::MatrixXd &cellPositions3,
                  Eigen::Tensor<double,3> &weights2,
-                 Eigen::Tensor<double,3> &weights3);
+                 Eigen::Tensor<double,3> &weights3,
+                 const double &pruningThreshold = 0.,
+                 const double &distanceCutoff = 0.);
 
   /** Copy constructor
    */
@@ -137,7 +191,106 @@ public:
                       const std::vector<int> &nb3Pluss_e,
                       std::vector<int> &nb3Minss_e);
 
+  /** Host buffer for the |V3|^2 of a batch of q1 wavevectors, owned by the
+   * caller and reused between batches: the storage only grows, so that a
+   * single buffer serves the whole calculation without new allocations.
+   * The tensor of the iq1-th wavevector of the batch has dimensions
+   * (nb1,nb2,nb3) and is stored column-major (as an Eigen::Tensor) in
+   * data[offsets[iq1]], i.e. the element (ib1,ib2,ib3) is at
+   * data[offsets[iq1] + ib1 + nb1 * (ib2 + nb2 * ib3)].
+   */
+  struct CouplingBuffer {
+    std::vector<double> data;
+    std::vector<size_t> offsets;
+    std::vector<std::array<Eigen::Index, 3>> dimensions;
+
+    /** Sets the dimensions of the tensors of a batch, growing the storage
+     * if needed.
+     */
+    void resize(const std::vector<int> &nb1s, const int &nb2,
+                const std::vector<int> &nb3s);
+
+    /** Returns the tensor of the iq1-th wavevector of the batch, as a map
+     * on the buffer.
+     */
+    Eigen::TensorMap<Eigen::Tensor<double, 3>> get(const int &iq1) {
+      return Eigen::TensorMap<Eigen::Tensor<double, 3>>(
+          data.data() + offsets[iq1], dimensions[iq1]);
+    }
+  };
+
+  /** Same as getCouplingsSquared(), but the |V3|^2 are written in buffers
+   * owned by the caller (see CouplingBuffer), rather than in new tensors
+   * for each q1 wavevector of each batch.
+   */
+  void getCouplingsSquared(const std::vector<Eigen::Vector3d> &q1s_e,
+                           const Eigen::Vector3d &q2_e,
+                           const std::vector<Eigen::MatrixXcd> &ev1s_e,
+                           const Eigen::MatrixXcd &ev2_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+                           const std::vector<int> &nb1s_e, const int nb2,
+                           const std::vector<int> &nb3Pluss_e,
+                           std::vector<int> &nb3Minss_e,
+                           CouplingBuffer &couplingPlus,
+                           CouplingBuffer &couplingMins);
+
+  /** Same as getCouplingsSquared(), but the |V3|^2 are left on the device,
+   * for Kokkos kernels that use them directly. The views have dimensions
+   * (nq1, maxnb1, nb2, maxnb3), where the band indices are padded to the
+   * largest number of bands in the batch.
+   */
+  std::tuple<DoubleView4D, DoubleView4D>
+  getCouplingsSquaredViews(const std::vector<Eigen::Vector3d> &q1s_e,
+                           const Eigen::Vector3d &q2_e,
+                           const std::vector<Eigen::MatrixXcd> &ev1s_e,
+                           const Eigen::MatrixXcd &ev2_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+                           const std::vector<int> &nb1s_e, const int nb2,
+                           const std::vector<int> &nb3Pluss_e,
+                           std::vector<int> &nb3Minss_e);
+
+  /** The q1 wavevectors of a batch, given as indices on a band structure
+   * already copied on the device (see ActiveBandStructure::getDeviceMirror())
+   * rather than as coordinates and eigenvectors, so that only the indices
+   * are transferred at every batch.
+   */
+  struct DeviceQ1s {
+    const BandStructureDeviceMirror *bandStructure = nullptr;
+    // wavevector index of each q1 of the batch
+    std::vector<int> iq1s;
+    // the bands of each q1 passed to the couplings (a subset of the active
+    // bands, in the order of the band indices of the couplings)
+    std::vector<std::vector<int>> bands1s;
+  };
+
+  /** Same as getCouplingsSquaredViews(), but the q1 wavevectors and their
+   * eigenvectors are read from the band structure on the device.
+   */
+  std::tuple<DoubleView4D, DoubleView4D>
+  getCouplingsSquaredViews(const DeviceQ1s &q1s, const Eigen::MatrixXcd &ev2_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+                           const int nb2, const std::vector<int> &nb3Pluss_e,
+                           std::vector<int> &nb3Minss_e);
+
+  /** Same as the CouplingBuffer version of getCouplingsSquared(), but the
+   * q1 wavevectors and their eigenvectors are read from the band structure
+   * on the device.
+   */
+  void getCouplingsSquared(const DeviceQ1s &q1s, const Eigen::MatrixXcd &ev2_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+                           const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+                           const int nb2, const std::vector<int> &nb3Pluss_e,
+                           std::vector<int> &nb3Minss_e,
+                           CouplingBuffer &couplingPlus,
+                           CouplingBuffer &couplingMins);
+
   /** Computes a partial Fourier transform over the q2/R2 variables.
+   * When running with pools of MPI processes, D3 is distributed over the
+   * processes of the pool, and this is a collective call on the pool: all
+   * processes of a pool must call it the same number of times.
    * @param q2_e: values of the q2 cartesian coordinates over which the Fourier
    * transform is computed.
    */
@@ -145,11 +298,39 @@ public:
 
   /** Estimate the number of batches that the list of q1 wavevectors must be
    * split into, in order to fit in memory.
+   * The estimate uses the free device memory at the time of the call, and is
+   * tuned with the memory used by the first calls to getCouplingsSquared.
    *
    * @param nq1: total number of q1 wavevectors to be split in batches
    * @param nb2: number of bands at the q2 wavevector.
    */
   int estimateNumBatches(const int &nq1, const int &nb2);
+
+private:
+  /** Implementation of getCouplingsSquaredViews(): the q1 wavevectors are
+   * either q1s_e and ev1s_e, or deviceQ1s if not null.
+   */
+  std::tuple<DoubleView4D, DoubleView4D>
+  computeCouplingsSquared(const std::vector<Eigen::Vector3d> &q1s_e,
+                          const std::vector<Eigen::MatrixXcd> &ev1s_e,
+                          const DeviceQ1s *deviceQ1s,
+                          const Eigen::MatrixXcd &ev2_e,
+                          const std::vector<Eigen::MatrixXcd> &ev3Pluss_e,
+                          const std::vector<Eigen::MatrixXcd> &ev3Minss_e,
+                          const std::vector<int> &nb1s_e, const int nb2,
+                          const std::vector<int> &nb3Pluss_e,
+                          std::vector<int> &nb3Minss_e);
+
+  /** Copies the couplings computed by computeCouplingsSquared() to the
+   * host buffers of the caller.
+   */
+  void copyCouplingsToBuffers(DoubleView4D &couplingPlus,
+                              DoubleView4D &couplingMins,
+                              const std::vector<int> &nb1s_e, const int nb2,
+                              const std::vector<int> &nb3Pluss_e,
+                              const std::vector<int> &nb3Minss_e,
+                              CouplingBuffer &couplingPlus_b,
+                              CouplingBuffer &couplingMins_b);
 };
 
 #endif
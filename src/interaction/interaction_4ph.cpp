@@ -0,0 +1,541 @@
+#include <algorithm>
+
+#include "interaction_4ph.h"
+#include "mpiHelper.h"
+#include <KokkosBlas3_gemm.hpp>
+
+std::tuple<int, int> Interaction4Ph::getProcessSigns(const int &processType) {
+  if (processType == plusPlus) {
+    return std::make_tuple(1, 1);
+  } else if (processType == plusMinus) {
+    return std::make_tuple(1, -1);
+  } else if (processType == minusMinus) {
+    return std::make_tuple(-1, -1);
+  } else {
+    Error("Unknown kind of 4-phonon process");
+    return std::make_tuple(0, 0);
+  }
+}
+
+Interaction4Ph::Interaction4Ph(Crystal &crystal, Eigen::Tensor<double, 5> &D4,
+                               Eigen::MatrixXd &cellPositions2,
+                               Eigen::MatrixXd &cellPositions3,
+                               Eigen::MatrixXd &cellPositions4)
+    : crystal_(crystal) {
+  DeviceMemoryScope memoryScope("Interaction4Ph");
+
+  numAtoms = crystal_.getNumAtoms();
+  numBands = numAtoms * 3;
+  int numInputBlocks = int(cellPositions2.cols());
+  if (D4.dimension(0) != numBands || D4.dimension(4) != numInputBlocks ||
+      cellPositions3.cols() != numInputBlocks ||
+      cellPositions4.cols() != numInputBlocks) {
+    Error("Interaction4Ph: inconsistent dimensions of D4");
+  }
+
+  // group the blocks by R4 and then by R3, discarding the blocks of zeros
+  std::vector<Eigen::Vector3d> r4List;
+  std::vector<std::vector<Eigen::Vector3d>> r3Lists;
+  std::vector<std::vector<std::vector<int>>> blockLists;
+  for (int ib = 0; ib < numInputBlocks; ib++) {
+    double blockMax = 0.;
+    for (int i1 = 0; i1 < numBands; i1++) {
+      for (int i2 = 0; i2 < numBands; i2++) {
+        for (int i3 = 0; i3 < numBands; i3++) {
+          for (int i4 = 0; i4 < numBands; i4++) {
+            blockMax = std::max(blockMax, std::abs(D4(i1, i2, i3, i4, ib)));
+          }
+        }
+      }
+    }
+    if (blockMax == 0.) continue;
+
+    Eigen::Vector3d r3 = cellPositions3.col(ib);
+    Eigen::Vector3d r4 = cellPositions4.col(ib);
+    auto it4 = std::find(r4List.begin(), r4List.end(), r4);
+    auto ir4 = int(it4 - r4List.begin());
+    if (it4 == r4List.end()) {
+      r4List.push_back(r4);
+      r3Lists.emplace_back();
+      blockLists.emplace_back();
+    }
+    auto it3 = std::find(r3Lists[ir4].begin(), r3Lists[ir4].end(), r3);
+    auto ir3 = int(it3 - r3Lists[ir4].begin());
+    if (it3 == r3Lists[ir4].end()) {
+      r3Lists[ir4].push_back(r3);
+      blockLists[ir4].emplace_back();
+    }
+    blockLists[ir4][ir3].push_back(ib);
+  }
+
+  nr4 = int(r4List.size());
+  std::vector<int> blockOrder, pairStart, r4Start;
+  std::vector<Eigen::Vector3d> pairPositions;
+  for (int ir4 = 0; ir4 < nr4; ir4++) {
+    r4Start.push_back(int(pairStart.size()));
+    for (int ir3 = 0; ir3 < int(r3Lists[ir4].size()); ir3++) {
+      pairStart.push_back(int(blockOrder.size()));
+      pairPositions.emplace_back(r3Lists[ir4][ir3] - r4List[ir4]);
+      blockOrder.insert(blockOrder.end(), blockLists[ir4][ir3].begin(),
+                        blockLists[ir4][ir3].end());
+    }
+  }
+  numPairs = int(pairStart.size());
+  numBlocks = int(blockOrder.size());
+  r4Start.push_back(numPairs);
+  pairStart.push_back(numBlocks);
+
+  if (mpi->mpiHead()) {
+    std::cout << "Storing " << numBlocks << " (R2,R3,R4) blocks of the "
+              << "4th order force constants.\n" << std::endl;
+  }
+
+  int numBands4 = numBands * numBands * numBands * numBands;
+  Kokkos::realloc(D4_k, numBlocks, numBands4);
+  Kokkos::realloc(blockPositions_k, numBlocks, 3);
+  Kokkos::realloc(pairPositions_k, numPairs, 3);
+  Kokkos::realloc(r4Positions_k, nr4, 3);
+  Kokkos::realloc(pairStart_k, numPairs + 1);
+  Kokkos::realloc(r4Start_k, nr4 + 1);
+  Kokkos::realloc(D4Q2Plus_k, numPairs, numBands4);
+  Kokkos::realloc(D4Q2Mins_k, numPairs, numBands4);
+  Kokkos::realloc(D4Q3PlusPlus_k, nr4, numBands4);
+  Kokkos::realloc(D4Q3PlusMins_k, nr4, numBands4);
+  Kokkos::realloc(D4Q3MinsMins_k, nr4, numBands4);
+
+  auto D4_h = Kokkos::create_mirror_view(D4_k);
+  auto blockPositions_h = Kokkos::create_mirror_view(blockPositions_k);
+  auto pairPositions_h = Kokkos::create_mirror_view(pairPositions_k);
+  auto r4Positions_h = Kokkos::create_mirror_view(r4Positions_k);
+  auto pairStart_h = Kokkos::create_mirror_view(pairStart_k);
+  auto r4Start_h = Kokkos::create_mirror_view(r4Start_k);
+  for (int ir4 = 0; ir4 < nr4; ir4++) {
+    for (int iPair = r4Start[ir4]; iPair < r4Start[ir4 + 1]; iPair++) {
+      for (int iBlock = pairStart[iPair]; iBlock < pairStart[iPair + 1];
+           iBlock++) {
+        int ib = blockOrder[iBlock];
+        for (int i : {0, 1, 2}) {
+          blockPositions_h(iBlock, i) =
+              cellPositions2(i, ib) - cellPositions4(i, ib);
+        }
+        int ind = 0;
+        for (int i1 = 0; i1 < numBands; i1++) {
+          for (int i2 = 0; i2 < numBands; i2++) {
+            for (int i3 = 0; i3 < numBands; i3++) {
+              for (int i4 = 0; i4 < numBands; i4++) {
+                D4_h(iBlock, ind) = D4(i1, i2, i3, i4, ib);
+                ind++;
+              }
+            }
+          }
+        }
+      }
+    }
+    for (int i : {0, 1, 2}) {
+      r4Positions_h(ir4, i) = r4List[ir4](i);
+    }
+  }
+  for (int iPair = 0; iPair < numPairs; iPair++) {
+    for (int i : {0, 1, 2}) {
+      pairPositions_h(iPair, i) = pairPositions[iPair](i);
+    }
+  }
+  for (int i = 0; i <= numPairs; i++) {
+    pairStart_h(i) = pairStart[i];
+  }
+  for (int i = 0; i <= nr4; i++) {
+    r4Start_h(i) = r4Start[i];
+  }
+  Kokkos::deep_copy(D4_k, D4_h);
+  Kokkos::deep_copy(blockPositions_k, blockPositions_h);
+  Kokkos::deep_copy(pairPositions_k, pairPositions_h);
+  Kokkos::deep_copy(r4Positions_k, r4Positions_h);
+  Kokkos::deep_copy(pairStart_k, pairStart_h);
+  Kokkos::deep_copy(r4Start_k, r4Start_h);
+
+  double memoryUsed = getDeviceMemoryUsage();
+  kokkosDeviceMemory->addDeviceMemoryUsage(memoryUsed);
+}
+
+// copy constructor
+Interaction4Ph::Interaction4Ph(const Interaction4Ph &that)
+    : crystal_(that.crystal_), numBlocks(that.numBlocks),
+      numPairs(that.numPairs), nr4(that.nr4), numAtoms(that.numAtoms),
+      numBands(that.numBands) {
+}
+
+// assignment operator
+Interaction4Ph &Interaction4Ph::operator=(const Interaction4Ph &that) {
+  if (this != &that) {
+    crystal_ = that.crystal_;
+    numBlocks = that.numBlocks;
+    numPairs = that.numPairs;
+    nr4 = that.nr4;
+    numAtoms = that.numAtoms;
+    numBands = that.numBands;
+  }
+  return *this;
+}
+
+Interaction4Ph::~Interaction4Ph() {
+  double memoryUsed = getDeviceMemoryUsage(); // call this before deallocation
+  kokkosDeviceMemory->removeDeviceMemoryUsage(memoryUsed);
+  Kokkos::realloc(D4_k, 0, 0);
+  Kokkos::realloc(blockPositions_k, 0, 0);
+  Kokkos::realloc(pairPositions_k, 0, 0);
+  Kokkos::realloc(r4Positions_k, 0, 0);
+  Kokkos::realloc(pairStart_k, 0);
+  Kokkos::realloc(r4Start_k, 0);
+  Kokkos::realloc(D4Q2Plus_k, 0, 0);
+  Kokkos::realloc(D4Q2Mins_k, 0, 0);
+  Kokkos::realloc(D4Q3PlusPlus_k, 0, 0);
+  Kokkos::realloc(D4Q3PlusMins_k, 0, 0);
+  Kokkos::realloc(D4Q3MinsMins_k, 0, 0);
+}
+
+void Interaction4Ph::cacheD4(const Eigen::Vector3d &q2_e) {
+  DeviceMemoryScope memoryScope("Interaction4Ph");
+  Kokkos::Profiling::pushRegion("cacheD4");
+
+  DoubleView1D q2("q2", 3);
+  auto q2_h = Kokkos::create_mirror_view(q2);
+  for (int i = 0; i < 3; i++) {
+    q2_h(i) = q2_e(i);
+  }
+  Kokkos::deep_copy(q2, q2_h);
+
+  Kokkos::complex<double> complexI(0.0, 1.0);
+
+  // Need all variables to be local to be captured by lambda
+  int numBlocks = this->numBlocks;
+  int numBands4 = numBands * numBands * numBands * numBands;
+  auto D4 = this->D4_k;
+  auto blockPositions = this->blockPositions_k;
+  auto pairStart = this->pairStart_k;
+  auto D4Q2Plus = this->D4Q2Plus_k;
+  auto D4Q2Mins = this->D4Q2Mins_k;
+
+  // phases exp(+-i q2.(R2-R4)) of each block
+  ComplexView1D phasePlus("pp", numBlocks), phaseMins("pm", numBlocks);
+  Kokkos::parallel_for(
+      "phase2loop", numBlocks, KOKKOS_LAMBDA(int iBlock) {
+        double arg = 0;
+        for (int ic = 0; ic < 3; ic++) {
+          arg += q2(ic) * blockPositions(iBlock, ic);
+        }
+        phasePlus(iBlock) = Kokkos::exp(complexI * arg);
+        phaseMins(iBlock) = Kokkos::exp(-complexI * arg);
+      });
+  Kokkos::fence();
+
+  Kokkos::parallel_for(
+      "D4cacheloop", Range2D({0, 0}, {numPairs, numBands4}),
+      KOKKOS_LAMBDA(int iPair, int ind) {
+        Kokkos::complex<double> tmpp = 0, tmpm = 0;
+        for (int iBlock = pairStart(iPair); iBlock < pairStart(iPair + 1);
+             iBlock++) {
+          tmpp += D4(iBlock, ind) * phasePlus(iBlock);
+          tmpm += D4(iBlock, ind) * phaseMins(iBlock);
+        }
+        D4Q2Plus(iPair, ind) = tmpp;
+        D4Q2Mins(iPair, ind) = tmpm;
+      });
+  Kokkos::fence();
+  Kokkos::Profiling::popRegion();
+}
+
+void Interaction4Ph::cacheD4Q3(const Eigen::Vector3d &q3_e) {
+  DeviceMemoryScope memoryScope("Interaction4Ph");
+  Kokkos::Profiling::pushRegion("cacheD4Q3");
+
+  DoubleView1D q3("q3", 3);
+  auto q3_h = Kokkos::create_mirror_view(q3);
+  for (int i = 0; i < 3; i++) {
+    q3_h(i) = q3_e(i);
+  }
+  Kokkos::deep_copy(q3, q3_h);
+
+  Kokkos::complex<double> complexI(0.0, 1.0);
+
+  // Need all variables to be local to be captured by lambda
+  int nr4 = this->nr4;
+  int numBands4 = numBands * numBands * numBands * numBands;
+  auto pairPositions = this->pairPositions_k;
+  auto r4Start = this->r4Start_k;
+  auto D4Q2Plus = this->D4Q2Plus_k;
+  auto D4Q2Mins = this->D4Q2Mins_k;
+  auto D4Q3PlusPlus = this->D4Q3PlusPlus_k;
+  auto D4Q3PlusMins = this->D4Q3PlusMins_k;
+  auto D4Q3MinsMins = this->D4Q3MinsMins_k;
+
+  // phases exp(+-i q3.(R3-R4)) of each pair
+  ComplexView1D phasePlus("pp", numPairs), phaseMins("pm", numPairs);
+  Kokkos::parallel_for(
+      "phase3loop", numPairs, KOKKOS_LAMBDA(int iPair) {
+        double arg = 0;
+        for (int ic = 0; ic < 3; ic++) {
+          arg += q3(ic) * pairPositions(iPair, ic);
+        }
+        phasePlus(iPair) = Kokkos::exp(complexI * arg);
+        phaseMins(iPair) = Kokkos::exp(-complexI * arg);
+      });
+  Kokkos::fence();
+
+  Kokkos::parallel_for(
+      "D4Q3cacheloop", Range2D({0, 0}, {nr4, numBands4}),
+      KOKKOS_LAMBDA(int ir4, int ind) {
+        Kokkos::complex<double> tmppp = 0, tmppm = 0, tmpmm = 0;
+        for (int iPair = r4Start(ir4); iPair < r4Start(ir4 + 1); iPair++) {
+          tmppp += D4Q2Plus(iPair, ind) * phasePlus(iPair);
+          tmppm += D4Q2Plus(iPair, ind) * phaseMins(iPair);
+          tmpmm += D4Q2Mins(iPair, ind) * phaseMins(iPair);
+        }
+        D4Q3PlusPlus(ir4, ind) = tmppp;
+        D4Q3PlusMins(ir4, ind) = tmppm;
+        D4Q3MinsMins(ir4, ind) = tmpmm;
+      });
+  Kokkos::fence();
+  Kokkos::Profiling::popRegion();
+}
+
+std::vector<Eigen::Tensor<double, 4>> Interaction4Ph::getCouplingsSquared(
+    const int &processType, const std::vector<Eigen::Vector3d> &q1s_e,
+    const std::vector<Eigen::MatrixXcd> &ev1s_e, const Eigen::MatrixXcd &ev2_e,
+    const Eigen::MatrixXcd &ev3_e, const std::vector<Eigen::MatrixXcd> &ev4s_e) {
+  DeviceMemoryScope memoryScope("Interaction4Ph");
+
+  Kokkos::Profiling::pushRegion("getCouplingsSquared4Ph");
+  auto signs = getProcessSigns(processType);
+  int s2 = std::get<0>(signs);
+  int s3 = std::get<1>(signs);
+
+  Kokkos::complex<double> complexI(0.0, 1.0);
+
+  // Need all variables to be local to be captured by lambda
+  int nr4 = this->nr4;
+  int numBands = this->numBands;
+  auto r4Positions = this->r4Positions_k;
+  ComplexView2D D4Q3;
+  if (processType == plusPlus) {
+    D4Q3 = D4Q3PlusPlus_k;
+  } else if (processType == plusMinus) {
+    D4Q3 = D4Q3PlusMins_k;
+  } else {
+    D4Q3 = D4Q3MinsMins_k;
+  }
+
+  int nq1 = int(q1s_e.size());
+  int nb2 = int(ev2_e.cols());
+  int nb3 = int(ev3_e.cols());
+  std::vector<int> nb1s_e(nq1), nb4s_e(nq1);
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    nb1s_e[iq1] = int(ev1s_e[iq1].cols());
+    nb4s_e[iq1] = int(ev4s_e[iq1].cols());
+  }
+
+  // MDRangePolicy loops are rectangular, need maximal dimensions
+  int maxnb1 = *std::max_element(nb1s_e.begin(), nb1s_e.end());
+  int maxnb4 = *std::max_element(nb4s_e.begin(), nb4s_e.end());
+  batchMemoryTuner.recordMemoryPerPoint(
+      getMemoryPerQ1(maxnb1, nb2, nb3, maxnb4),
+      getMemoryPerQ1(numBands, nb2, nb3, numBands));
+
+  DoubleView2D q1s("q1s", nq1, 3);
+  ComplexView2D ev2("ev2", nb2, numBands), ev3("ev3", nb3, numBands);
+  ComplexView3D ev1s("ev1s", nq1, maxnb1, numBands),
+      ev4s("ev4s", nq1, maxnb4, numBands);
+  IntView1D nb1s("nb1s", nq1), nb4s("nb4s", nq1);
+
+  // copy everything to kokkos views. The eigenvectors at q2 and q3 are
+  // complex conjugated if the wavevector enters with a minus sign
+  {
+    auto q1s_h = Kokkos::create_mirror_view(q1s);
+    auto ev1s_h = Kokkos::create_mirror_view(ev1s);
+    auto ev2_h = Kokkos::create_mirror_view(ev2);
+    auto ev3_h = Kokkos::create_mirror_view(ev3);
+    auto ev4s_h = Kokkos::create_mirror_view(ev4s);
+    auto nb1s_h = Kokkos::create_mirror_view(nb1s);
+    auto nb4s_h = Kokkos::create_mirror_view(nb4s);
+    for (int i = 0; i < nq1; i++) {
+      nb1s_h(i) = nb1s_e[i];
+      nb4s_h(i) = nb4s_e[i];
+      for (int j = 0; j < 3; j++) {
+        q1s_h(i, j) = q1s_e[i][j];
+      }
+      for (int j = 0; j < numBands; j++) {
+        for (int k = 0; k < nb1s_e[i]; k++) {
+          ev1s_h(i, k, j) = ev1s_e[i](j, k);
+        }
+        for (int k = 0; k < nb4s_e[i]; k++) {
+          ev4s_h(i, k, j) = std::conj(ev4s_e[i](j, k));
+        }
+      }
+    }
+    for (int i = 0; i < numBands; i++) {
+      for (int j = 0; j < nb2; j++) {
+        ev2_h(j, i) = s2 > 0 ? ev2_e(i, j) : std::conj(ev2_e(i, j));
+      }
+      for (int j = 0; j < nb3; j++) {
+        ev3_h(j, i) = s3 > 0 ? ev3_e(i, j) : std::conj(ev3_e(i, j));
+      }
+    }
+    Kokkos::deep_copy(q1s, q1s_h);
+    Kokkos::deep_copy(ev1s, ev1s_h);
+    Kokkos::deep_copy(ev2, ev2_h);
+    Kokkos::deep_copy(ev3, ev3_h);
+    Kokkos::deep_copy(ev4s, ev4s_h);
+    Kokkos::deep_copy(nb1s, nb1s_h);
+    Kokkos::deep_copy(nb4s, nb4s_h);
+  }
+
+  ComplexView2D phases("pp", nq1, nr4);
+  Kokkos::parallel_for(
+      "phase4loop", Range2D({0, 0}, {nq1, nr4}),
+      KOKKOS_LAMBDA(int iq1, int ir4) {
+        double arg = 0;
+        for (int ic : {0, 1, 2}) {
+          arg += -q1s(iq1, ic) * r4Positions(ir4, ic);
+        }
+        phases(iq1, ir4) = exp(complexI * arg);
+      });
+  Kokkos::fence();
+
+  // Fourier transform over R4, as the matrix product
+  // tmp(iq1, ind) = sum_ir4 phases(iq1,ir4) D4Q3(ir4,ind)
+  int numBands4 = numBands * numBands * numBands * numBands;
+  ComplexView2D tmp("tmp", nq1, numBands4);
+  Kokkos::Profiling::pushRegion("tmploop4Ph");
+  KokkosBlas::gemm("N", "N", Kokkos::complex<double>(1.0), phases, D4Q3,
+                   Kokkos::complex<double>(0.0), tmp);
+  Kokkos::fence();
+  Kokkos::Profiling::popRegion();
+  Kokkos::realloc(phases, 0, 0);
+
+  // contractions with the eigenvectors, one index at the time
+  ComplexView5D tmp1("t1", nq1, maxnb1, numBands, numBands, numBands);
+  Kokkos::parallel_for(
+      "tmp1loop4Ph",
+      Range5D({0, 0, 0, 0, 0}, {nq1, maxnb1, numBands, numBands, numBands}),
+      KOKKOS_LAMBDA(int iq1, int ib1, int iac2, int iac3, int iac4) {
+        int mask = ib1 < nb1s(iq1);
+        Kokkos::complex<double> x = 0;
+        for (int iac1 = 0; iac1 < numBands; iac1++) {
+          int ind = ((iac1 * numBands + iac2) * numBands + iac3) * numBands
+              + iac4;
+          x += tmp(iq1, ind) * ev1s(iq1, ib1, iac1);
+        }
+        tmp1(iq1, ib1, iac2, iac3, iac4) = x * mask;
+      });
+  Kokkos::realloc(tmp, 0, 0);
+
+  ComplexView5D tmp2("t2", nq1, maxnb1, nb2, numBands, numBands);
+  Kokkos::parallel_for(
+      "tmp2loop4Ph",
+      Range5D({0, 0, 0, 0, 0}, {nq1, maxnb1, nb2, numBands, numBands}),
+      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int iac3, int iac4) {
+        Kokkos::complex<double> x = 0;
+        for (int iac2 = 0; iac2 < numBands; iac2++) {
+          x += tmp1(iq1, ib1, iac2, iac3, iac4) * ev2(ib2, iac2);
+        }
+        tmp2(iq1, ib1, ib2, iac3, iac4) = x;
+      });
+  Kokkos::realloc(tmp1, 0, 0, 0, 0, 0);
+
+  ComplexView5D tmp3("t3", nq1, maxnb1, nb2, nb3, numBands);
+  Kokkos::parallel_for(
+      "tmp3loop4Ph",
+      Range5D({0, 0, 0, 0, 0}, {nq1, maxnb1, nb2, nb3, numBands}),
+      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3, int iac4) {
+        Kokkos::complex<double> x = 0;
+        for (int iac3 = 0; iac3 < numBands; iac3++) {
+          x += tmp2(iq1, ib1, ib2, iac3, iac4) * ev3(ib3, iac3);
+        }
+        tmp3(iq1, ib1, ib2, ib3, iac4) = x;
+      });
+  Kokkos::realloc(tmp2, 0, 0, 0, 0, 0);
+
+  DoubleView5D coupling("c4", nq1, maxnb1, nb2, nb3, maxnb4);
+  Kokkos::parallel_for(
+      "c4loop", Range5D({0, 0, 0, 0, 0}, {nq1, maxnb1, nb2, nb3, maxnb4}),
+      KOKKOS_LAMBDA(int iq1, int ib1, int ib2, int ib3, int ib4) {
+        int mask = ib4 < nb4s(iq1);
+        Kokkos::complex<double> x = 0;
+        for (int iac4 = 0; iac4 < numBands; iac4++) {
+          x += tmp3(iq1, ib1, ib2, ib3, iac4) * ev4s(iq1, ib4, iac4);
+        }
+        coupling(iq1, ib1, ib2, ib3, ib4) =
+            (x.real() * x.real() + x.imag() * x.imag()) * mask;
+      });
+  Kokkos::realloc(tmp3, 0, 0, 0, 0, 0);
+
+  // Copy result to vector of Eigen tensors
+  std::vector<Eigen::Tensor<double, 4>> coupling_e(nq1);
+  auto coupling_h = Kokkos::create_mirror_view(coupling);
+  Kokkos::deep_copy(coupling_h, coupling);
+  for (int iq1 = 0; iq1 < nq1; iq1++) {
+    int nb1 = nb1s_e[iq1];
+    int nb4 = nb4s_e[iq1];
+    coupling_e[iq1] = Eigen::Tensor<double, 4>(nb1, nb2, nb3, nb4);
+    for (int ib1 = 0; ib1 < nb1; ib1++) {
+      for (int ib2 = 0; ib2 < nb2; ib2++) {
+        for (int ib3 = 0; ib3 < nb3; ib3++) {
+          for (int ib4 = 0; ib4 < nb4; ib4++) {
+            coupling_e[iq1](ib1, ib2, ib3, ib4) =
+                coupling_h(iq1, ib1, ib2, ib3, ib4);
+          }
+        }
+      }
+    }
+  }
+  Kokkos::Profiling::popRegion();
+  return coupling_e;
+}
+
+double Interaction4Ph::getMemoryPerQ1(const int &nb1, const int &nb2,
+                                      const int &nb3, const int &nb4) const {
+  // memory used by different tensors
+  // Note: 16 (2*8) is the size of double (complex<double>) in bytes
+  double nb = numBands;
+  double evs = 16 * nb * (nb1 + nb4);
+  double phase = 16 * nr4;
+  double tmp = 16 * nb * nb * nb * nb;
+  double tmp1 = 16 * nb1 * nb * nb * nb;
+  double tmp2 = 16 * nb1 * nb2 * nb * nb;
+  double tmp3 = 16 * nb1 * nb2 * nb3 * nb;
+  double c = 2 * 8 * nb1 * nb2 * nb3 * nb4; // device and host copies
+  return evs + std::max({phase + tmp, tmp + tmp1, tmp1 + tmp2, tmp2 + tmp3,
+                         tmp3 + c});
+}
+
+int Interaction4Ph::estimateNumBatches(const int &nq1, const int &nb2,
+                                       const int &nb3) {
+  double availmem = kokkosDeviceMemory->getAvailableMemory();
+
+  // the upper bound uses all bands at q1 and q4
+  double maxMemoryPerQ1 = getMemoryPerQ1(numBands, nb2, nb3, numBands);
+  double maxusage = nq1 * batchMemoryTuner.getMemoryPerPoint(maxMemoryPerQ1);
+
+  // the number of batches needed
+  int numBatches = std::ceil(maxusage / availmem);
+  double totalMemory = kokkosDeviceMemory->getTotalMemory();
+
+  if (availmem < maxusage / nq1) {
+    // not enough memory to do even a single q1
+    std::cerr << "total Memory = " << totalMemory / 1e9
+              << "(Gb), availmem = " << availmem / 1e9
+              << "(Gb), maxusage = " << maxusage / 1e9
+              << "(Gb), numBatches = " << numBatches << "\n";
+    Error("Insufficient memory!");
+  }
+  return numBatches;
+}
+
+double Interaction4Ph::getDeviceMemoryUsage() {
+  double occupiedMemory =
+      16 * (D4Q2Plus_k.size() + D4Q2Mins_k.size() + D4Q3PlusPlus_k.size() +
+            D4Q3PlusMins_k.size() + D4Q3MinsMins_k.size()) +
+      8 * (D4_k.size() + blockPositions_k.size() + pairPositions_k.size() +
+           r4Positions_k.size()) +
+      4 * (pairStart_k.size() + r4Start_k.size());
+  return occupiedMemory;
+}
@@ -0,0 +1,165 @@
+#ifndef PH4_INTERACTION_H
+#define PH4_INTERACTION_H
+
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#include "common_kokkos.h"
+#include "constants.h"
+#include "crystal.h"
+#include "eigen.h"
+#include "utilities.h"
+
+/** Class to calculate the probability rate for one 4-phonon scattering event.
+ * In physical notation, this corresponds to the calculation of the term |V4|^2.
+ * The class works as Interaction3Ph, but with one more nested loop:
+ * for (iq2) {
+ *   cacheD4(q2)
+ *   for (iq3) {
+ *     cacheD4Q3(q3)
+ *     for (processType) {
+ *       int numBatches = coupling4Ph->estimateNumBatches(nq1, nb2, nb3);
+ *       for (batch : batches) {
+ *         getCouplingsSquared()
+ *         ...
+ *
+ * We consider three kinds of processes, labelled by the signs (s2, s3) with
+ * which the wavevectors q2 and q3 enter the momentum conservation
+ * q4 = q1 + s2 q2 + s3 q3:
+ * plusPlus, (1+2+3)->4, with (s2,s3) = (+,+);
+ * plusMinus, (1+2)->(3+4), with (s2,s3) = (+,-);
+ * minusMinus, 1->(2+3+4), with (s2,s3) = (-,-).
+ *
+ * The real-space force constants are D4(0,R2,R3,R4), i.e. we set R1 to zero
+ * taking advantage of the crystal periodicity. They are stored as dense
+ * blocks of numBands^4 elements, one for each distinct triplet (R2,R3,R4) of
+ * Bravais lattice vectors found in the input. The Fourier transform is split
+ * as in the 3-phonon case: cacheD4() transforms over R2-R4, cacheD4Q3() over
+ * R3-R4, and getCouplingsSquared() transforms over R4 for a batch of q1
+ * wavevectors with a matrix product.
+ * Since the linewidths at each q1 sum over all pairs (q2,q3), the cost
+ * scales with the cube of the number of q-points (nq1*nq2*nq3).
+ *
+ * Note: unlike Interaction3Ph, D4 isn't distributed over pools of MPI
+ * processes.
+ */
+class Interaction4Ph {
+private:
+  Crystal &crystal_;
+
+  // D4_k(iBlock, ind) is the block of the triplet (R2,R3,R4) of Bravais
+  // lattice vectors, with ind = ((i1*nb+i2)*nb+i3)*nb+i4.
+  // The blocks are sorted by R4 and then by R3: the blocks of the iPair-th
+  // (R3,R4) pair are found at pairStart_k(iPair) <= iBlock <
+  // pairStart_k(iPair+1), and the pairs of the ir4-th R4 vector at
+  // r4Start_k(ir4) <= iPair < r4Start_k(ir4+1).
+  DoubleView2D D4_k;
+  // positions R2-R4 of each block, R3-R4 of each pair, and R4
+  DoubleView2D blockPositions_k, pairPositions_k, r4Positions_k;
+  IntView1D pairStart_k, r4Start_k;
+  // D4 Fourier transformed over R2, of size (numPairs, numBands^4)
+  ComplexView2D D4Q2Plus_k, D4Q2Mins_k;
+  // D4 Fourier transformed over R2 and R3, of size (nr4, numBands^4), for
+  // the three kinds of processes
+  ComplexView2D D4Q3PlusPlus_k, D4Q3PlusMins_k, D4Q3MinsMins_k;
+
+  // dimensions
+  int numBlocks, numPairs, nr4, numAtoms, numBands;
+
+  // tunes the memory estimate of estimateNumBatches
+  BatchMemoryTuner batchMemoryTuner;
+
+  /** Estimate the memory in bytes, occupied by the kokkos Views containing
+   * the coupling tensor to be interpolated.
+   */
+  double getDeviceMemoryUsage();
+
+  /** Estimate the peak memory in bytes used by getCouplingsSquared for each
+   * q1 wavevector, given the number of bands at the four wavevectors.
+   */
+  double getMemoryPerQ1(const int &nb1, const int &nb2, const int &nb3,
+                        const int &nb4) const;
+
+public:
+  // the kinds of 4-phonon processes
+  static const int plusPlus = 0;
+  static const int plusMinus = 1;
+  static const int minusMinus = 2;
+
+  /** Returns the signs (s2,s3) of a kind of process, such that the
+   * momentum conservation reads q4 = q1 + s2 q2 + s3 q3.
+   */
+  static std::tuple<int, int> getProcessSigns(const int &processType);
+
+  /** Default constructor.
+   * This method mostly moves data to the GPU if necessary.
+   *
+   * @param crystal: crystal object
+   * @param D4: the tensor of fourth-derivative force constants, with
+   * dimensions (3*numAtoms,3*numAtoms,3*numAtoms,3*numAtoms,numBlocks), where
+   * the last index labels the triplet (R2,R3,R4) of Bravais lattice vectors.
+   * @param cellPositions2: R2 vector of each triplet, of size (3,numBlocks).
+   * @param cellPositions3: R3 vector of each triplet, of size (3,numBlocks).
+   * @param cellPositions4: R4 vector of each triplet, of size (3,numBlocks).
+   */
+  Interaction4Ph(Crystal &crystal, Eigen::Tensor<double, 5> &D4,
+                 Eigen::MatrixXd &cellPositions2,
+                 Eigen::MatrixXd &cellPositions3,
+                 Eigen::MatrixXd &cellPositions4);
+
+  /** Copy constructor
+   */
+  Interaction4Ph(const Interaction4Ph &that);
+
+  /** Assignment operator
+   */
+  Interaction4Ph &operator=(const Interaction4Ph &that);
+
+  /** Destructor
+   */
+  ~Interaction4Ph();
+
+  /** Computes a partial Fourier transform over the q2/R2 variables.
+   * @param q2_e: cartesian coordinates of the q2 wavevector.
+   */
+  void cacheD4(const Eigen::Vector3d &q2_e);
+
+  /** Computes a partial Fourier transform over the q3/R3 variables, using
+   * the q2 transform of the last call to cacheD4().
+   * @param q3_e: cartesian coordinates of the q3 wavevector.
+   */
+  void cacheD4Q3(const Eigen::Vector3d &q3_e);
+
+  /** Computes the |V4|^2 matrix elements for a batch of q1 wavevectors, at
+   * the q2 and q3 wavevectors of the last calls to cacheD4 and cacheD4Q3.
+   *
+   * @param processType: one of plusPlus, plusMinus or minusMinus.
+   * @param q1s_e: list of q1 wavevectors in cartesian coordinates.
+   * @param ev1s_e: eigenvectors at each q1, of size (numBands,nb1).
+   * @param ev2_e: eigenvectors at q2, of size (numBands,nb2).
+   * @param ev3_e: eigenvectors at q3, of size (numBands,nb3).
+   * @param ev4s_e: eigenvectors at each q4 = q1 + s2 q2 + s3 q3, of size
+   * (numBands,nb4).
+   * @return couplings: for each q1, the tensor |V4|^2 of size
+   * (nb1,nb2,nb3,nb4).
+   */
+  std::vector<Eigen::Tensor<double, 4>>
+  getCouplingsSquared(const int &processType,
+                      const std::vector<Eigen::Vector3d> &q1s_e,
+                      const std::vector<Eigen::MatrixXcd> &ev1s_e,
+                      const Eigen::MatrixXcd &ev2_e,
+                      const Eigen::MatrixXcd &ev3_e,
+                      const std::vector<Eigen::MatrixXcd> &ev4s_e);
+
+  /** Estimate the number of batches that the list of q1 wavevectors must be
+   * split into, in order to fit in memory.
+   *
+   * @param nq1: total number of q1 wavevectors to be split in batches
+   * @param nb2: number of bands at the q2 wavevector.
+   * @param nb3: number of bands at the q3 wavevector.
+   */
+  int estimateNumBatches(const int &nq1, const int &nb2, const int &nb3);
+};
+
+#endif
@@ -1,25 +1,92 @@
 #include "interaction_elph.h"
+#include "io.h"
 #include <Kokkos_Core.hpp>
 #include <KokkosBlas2_gemv.hpp>
+#include <algorithm>
+#include <type_traits>
 
 #ifdef HDF5_AVAIL
 #include <Kokkos_ScatterView.hpp>
 #endif
 
+/** Fourier transform of the block-sparse coupling over the electronic
+ * lattice vectors, accumulated in the precision of the blocks, T.
+ * g1(irP,nu,iw1,iw2) = sum_{iBlock of irP} blocks(iBlock,nu,iw1,iw2)
+ *                      * phases(irE(iBlock))
+ */
+template <typename T>
+void blockFourierTransform(
+    const Kokkos::View<Kokkos::complex<T> ****, Kokkos::LayoutRight> &blocks,
+    const IntView1D &blockElVectors, const IntView1D &blockPhStart,
+    const ComplexView1D &phases, ComplexView4D &g1) {
+  auto numPhBravaisVectors = int(g1.extent(0));
+  auto numPhBands = int(g1.extent(1));
+  auto numElBands = int(g1.extent(2));
+  Kokkos::parallel_for(
+      "g1 blocks",
+      Range4D({0, 0, 0, 0},
+              {numPhBravaisVectors, numPhBands, numElBands, numElBands}),
+      KOKKOS_LAMBDA(int irP, int nu, int iw1, int iw2) {
+        Kokkos::complex<T> tmp(0.0);
+        for (int iBlock = blockPhStart(irP); iBlock < blockPhStart(irP + 1);
+             iBlock++) {
+          Kokkos::complex<double> phase = phases(blockElVectors(iBlock));
+          tmp += blocks(iBlock, nu, iw1, iw2) *
+                 Kokkos::complex<T>(T(phase.real()), T(phase.imag()));
+        }
+        g1(irP, nu, iw1, iw2) = Kokkos::complex<double>(tmp.real(), tmp.imag());
+      });
+  Kokkos::fence();
+}
+
+/** Fourier transform of elPhCached over the phonon lattice vectors,
+ * accumulated in precision T.
+ * g3(ik,nu,ib1,iw2) = sum_irP phases(ik,irP) * elPhCached(irP,nu,ib1,iw2)
+ * It's a functor rather than a function, so that it can also be a node of
+ * the kernel graph of calcCouplingSquaredView.
+ */
+template <typename T>
+struct PhononFourierTransform {
+  ComplexView2D phases;
+  ComplexView4D elPhCached;
+  ComplexView4D g3;
+
+  Range4D range() const {
+    return Range4D({0, 0, 0, 0}, {int(g3.extent(0)), int(g3.extent(1)),
+                                  int(g3.extent(2)), int(g3.extent(3))});
+  }
+
+  KOKKOS_INLINE_FUNCTION
+  void operator()(int ik, int nu, int ib1, int iw2) const {
+    Kokkos::complex<T> tmp(0., 0.);
+    for (int irP = 0; irP < int(phases.extent(1)); irP++) {
+      Kokkos::complex<double> phase = phases(ik, irP);
+      Kokkos::complex<double> g = elPhCached(irP, nu, ib1, iw2);
+      tmp += Kokkos::complex<T>(T(phase.real()), T(phase.imag())) *
+             Kokkos::complex<T>(T(g.real()), T(g.imag()));
+    }
+    g3(ik, nu, ib1, iw2) = Kokkos::complex<double>(tmp.real(), tmp.imag());
+  }
+};
+
 // default constructor
 InteractionElPhWan::InteractionElPhWan(
     Crystal &crystal_,
-    const Eigen::Tensor<std::complex<double>, 5> &couplingWannier_,
+    Eigen::Tensor<std::complex<double>, 5> &couplingWannier_,
     const Eigen::MatrixXd &elBravaisVectors_,
     const Eigen::VectorXd &elBravaisVectorsDegeneracies_,
     const Eigen::MatrixXd &phBravaisVectors_,
     const Eigen::VectorXd &phBravaisVectorsDegeneracies_, PhononH0 *phononH0_)
     : crystal(crystal_), phononH0(phononH0_) {
+  DeviceMemoryScope memoryScope("InteractionElPhWan");
 
   numElBands = int(couplingWannier_.dimension(0));
   numPhBands = int(couplingWannier_.dimension(2));
   numPhBravaisVectors = int(couplingWannier_.dimension(3));
   numElBravaisVectors = int(couplingWannier_.dimension(4));
+  Profiler::recordObjectMemory(
+      "el-ph coupling (couplingWannier)",
+      double(couplingWannier_.size()) * sizeof(std::complex<double>));
 
   usePolarCorrection = false;
   if (phononH0 != nullptr) {
@@ -30,28 +97,66 @@ InteractionElPhWan::InteractionElPhWan(
       }
     }
   }
+  if (usePolarCorrection) {
+    setupPolarCorrection();
+  }
 
   // in the first call to this function, we must copy the el-ph tensor
   // from the CPU to the accelerator
   {
-    Kokkos::realloc(couplingWannier_k, numElBravaisVectors, numPhBravaisVectors,
-                    numPhBands, numElBands, numElBands);
+    // on CPU builds, the processes of a node may share a single copy
+    bool isHostMemory =
+        std::is_same<Kokkos::DefaultExecutionSpace::memory_space,
+                     Kokkos::HostSpace>::value;
+    bool isSharedCoupling = mpi->useSharedMemory() && isHostMemory;
+    // otherwise, the view can use the memory of the parsed tensor, since
+    // the Eigen layout (column major) matches the Kokkos one (right layout,
+    // with reversed indices)
+    bool isAliasedCoupling = isHostMemory && !isSharedCoupling;
+    if (isSharedCoupling) {
+      size_t numBytes = sizeof(Kokkos::complex<double>) * couplingWannier_.size();
+      sharedCouplingWannier = std::shared_ptr<void>(
+          mpi->allocateSharedMemory(numBytes),
+          [](void *data) { mpi->freeSharedMemory(data); });
+      couplingWannier_k = ComplexView5D(
+          (Kokkos::complex<double> *)sharedCouplingWannier.get(),
+          numElBravaisVectors, numPhBravaisVectors, numPhBands, numElBands,
+          numElBands);
+    } else if (isAliasedCoupling) {
+      hostCouplingWannier =
+          std::make_shared<Eigen::Tensor<std::complex<double>, 5>>(
+              std::move(couplingWannier_));
+      couplingWannier_k = ComplexView5D(
+          (Kokkos::complex<double> *)hostCouplingWannier->data(),
+          numElBravaisVectors, numPhBravaisVectors, numPhBands, numElBands,
+          numElBands);
+    } else {
+      Kokkos::realloc(couplingWannier_k, numElBravaisVectors,
+                      numPhBravaisVectors, numPhBands, numElBands, numElBands);
+    }
     Kokkos::realloc(elBravaisVectorsDegeneracies_k, numElBravaisVectors);
     Kokkos::realloc(phBravaisVectorsDegeneracies_k, numPhBravaisVectors);
     Kokkos::realloc(elBravaisVectors_k, numElBravaisVectors, 3);
     Kokkos::realloc(phBravaisVectors_k, numPhBravaisVectors, 3);
 
-    // note that Eigen has left layout while kokkos has right layout
-    HostComplexView5D couplingWannier_h((Kokkos::complex<double> *) couplingWannier_.data(),
-                                        numElBravaisVectors, numPhBravaisVectors,
-                                        numPhBands, numElBands, numElBands);
     HostDoubleView1D elBravaisVectorsDegeneracies_h((double *) elBravaisVectorsDegeneracies_.data(), numElBravaisVectors);
     HostDoubleView1D phBravaisVectorsDegeneracies_h((double *) phBravaisVectorsDegeneracies_.data(), numPhBravaisVectors);
 
     HostDoubleView2D elBravaisVectors_h((double *) elBravaisVectors_.data(), numElBravaisVectors, 3);
     HostDoubleView2D phBravaisVectors_h((double *) phBravaisVectors_.data(), numPhBravaisVectors, 3);
 
-    Kokkos::deep_copy(couplingWannier_k, couplingWannier_h);
+    if (!isAliasedCoupling &&
+        (!isSharedCoupling || mpi->isSharedMemoryHead())) {
+      // note that Eigen has left layout while kokkos has right layout
+      HostComplexView5D couplingWannier_h(
+          (Kokkos::complex<double> *)couplingWannier_.data(),
+          numElBravaisVectors, numPhBravaisVectors, numPhBands, numElBands,
+          numElBands);
+      Kokkos::deep_copy(couplingWannier_k, couplingWannier_h);
+    }
+    if (isSharedCoupling) {
+      mpi->sharedMemoryBarrier();
+    }
     Kokkos::deep_copy(phBravaisVectors_k, phBravaisVectors_h);
     Kokkos::deep_copy(phBravaisVectorsDegeneracies_k, phBravaisVectorsDegeneracies_h);
     Kokkos::deep_copy(elBravaisVectors_k, elBravaisVectors_h);
@@ -72,10 +177,32 @@ InteractionElPhWan::InteractionElPhWan(const InteractionElPhWan &that)
       cacheCoupling(that.cacheCoupling),
       usePolarCorrection(that.usePolarCorrection),
       elPhCached(that.elPhCached), couplingWannier_k(that.couplingWannier_k),
+      hostCouplingWannier(that.hostCouplingWannier),
+      sharedCouplingWannier(that.sharedCouplingWannier),
+      isCouplingTruncated(that.isCouplingTruncated),
+      couplingBlocks_k(that.couplingBlocks_k),
+      useSinglePrecision(that.useSinglePrecision),
+      couplingBlocksFloat_k(that.couplingBlocksFloat_k),
+      blockElVectors_k(that.blockElVectors_k),
+      blockPhStart_k(that.blockPhStart_k),
       phBravaisVectors_k(that.phBravaisVectors_k),
       phBravaisVectorsDegeneracies_k(that.phBravaisVectorsDegeneracies_k),
       elBravaisVectors_k(that.elBravaisVectors_k),
-      elBravaisVectorsDegeneracies_k(that.elBravaisVectorsDegeneracies_k) {}
+      elBravaisVectorsDegeneracies_k(that.elBravaisVectorsDegeneracies_k),
+      polarGVectors_k(that.polarGVectors_k),
+      polarGPhases_k(that.polarGPhases_k), polarGZ_k(that.polarGZ_k),
+      polarBornCharges_k(that.polarBornCharges_k),
+      polarAtoms_k(that.polarAtoms_k),
+      polarPositions_k(that.polarPositions_k),
+      polarEpsilon_k(that.polarEpsilon_k), polarGNorms(that.polarGNorms),
+      polarGCutoff(that.polarGCutoff),
+      k1List(that.k1List), k1CacheMemory(that.k1CacheMemory),
+      k1CacheUsage(that.k1CacheUsage) {
+  // the map must point to the elements of the new list
+  for (auto it = k1List.begin(); it != k1List.end(); ++it) {
+    k1Map[it->first] = it;
+  }
+}
 
 // assignment operator
 InteractionElPhWan &
@@ -91,17 +218,44 @@ InteractionElPhWan::operator=(const InteractionElPhWan &that) {
     usePolarCorrection = that.usePolarCorrection;
     elPhCached = that.elPhCached;
     couplingWannier_k = that.couplingWannier_k;
+    hostCouplingWannier = that.hostCouplingWannier;
+    sharedCouplingWannier = that.sharedCouplingWannier;
+    isCouplingTruncated = that.isCouplingTruncated;
+    couplingBlocks_k = that.couplingBlocks_k;
+    useSinglePrecision = that.useSinglePrecision;
+    couplingBlocksFloat_k = that.couplingBlocksFloat_k;
+    blockElVectors_k = that.blockElVectors_k;
+    blockPhStart_k = that.blockPhStart_k;
     phBravaisVectors_k = that.phBravaisVectors_k;
     phBravaisVectorsDegeneracies_k = that.phBravaisVectorsDegeneracies_k;
     elBravaisVectors_k = that.elBravaisVectors_k;
     elBravaisVectorsDegeneracies_k = that.elBravaisVectorsDegeneracies_k;
+    polarGVectors_k = that.polarGVectors_k;
+    polarGPhases_k = that.polarGPhases_k;
+    polarGZ_k = that.polarGZ_k;
+    polarBornCharges_k = that.polarBornCharges_k;
+    polarAtoms_k = that.polarAtoms_k;
+    polarPositions_k = that.polarPositions_k;
+    polarEpsilon_k = that.polarEpsilon_k;
+    polarGNorms = that.polarGNorms;
+    polarGCutoff = that.polarGCutoff;
+    k1List = that.k1List;
+    k1Map.clear();
+    for (auto it = k1List.begin(); it != k1List.end(); ++it) {
+      k1Map[it->first] = it;
+    }
+    k1CacheMemory = that.k1CacheMemory;
+    k1CacheUsage = that.k1CacheUsage;
   }
   return *this;
 }
 
 InteractionElPhWan::~InteractionElPhWan() {
   //printf("rank %d calling interaction destructor\n", mpi->getRank());
-  if(couplingWannier_k.use_count()==1){
+  if(couplingWannier_k.use_count()==1 || couplingBlocks_k.use_count()==1
+     || couplingBlocksFloat_k.use_count()==1
+     || hostCouplingWannier.use_count()==1
+     || sharedCouplingWannier.use_count()==1){
     double memory = getDeviceMemoryUsage();
     kokkosDeviceMemory->removeDeviceMemoryUsage(memory);
   }
@@ -205,6 +359,198 @@ Eigen::VectorXcd InteractionElPhWan::polarCorrectionPart1Static(
   return x;
 }
 
+void InteractionElPhWan::setupPolarCorrection() {
+  // same parameters of polarCorrectionPart1Static()
+  double gMax = 14.;
+  Eigen::Matrix3d reciprocalUnitCell = crystal.getReciprocalUnitCell();
+  Eigen::Matrix3d epsilon = phononH0->getDielectricMatrix();
+  Eigen::Tensor<double, 3> bornCharges = phononH0->getBornCharges();
+  Eigen::MatrixXd atomicPositions = crystal.getAtomicPositions();
+  Eigen::Vector3i qCoarseMesh = phononH0->getCoarseGrid();
+  auto numAtoms = int(atomicPositions.rows());
+
+  // the terms with (q+G).epsilon.(q+G) > 4 gMax are discarded, hence all
+  // the terms with |q+G| > polarGCutoff
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(epsilon);
+  double minEpsilon = solver.eigenvalues().minCoeff();
+  polarGCutoff = sqrt(4. * gMax / minEpsilon);
+
+  // the G vectors of polarCorrectionPart1Static(), sorted by norm, so that
+  // the sphere |G| < polarGCutoff + |q| is a slice of the list
+  std::vector<Eigen::Vector3d> gVectors;
+  for (int m1 = -qCoarseMesh(0); m1 <= qCoarseMesh(0); m1++) {
+    for (int m2 = -qCoarseMesh(1); m2 <= qCoarseMesh(1); m2++) {
+      for (int m3 = -qCoarseMesh(2); m3 <= qCoarseMesh(2); m3++) {
+        Eigen::Vector3d gVector;
+        gVector << m1, m2, m3;
+        gVectors.push_back(reciprocalUnitCell * gVector);
+      }
+    }
+  }
+  std::sort(gVectors.begin(), gVectors.end(),
+            [](const Eigen::Vector3d &a, const Eigen::Vector3d &b) {
+              return a.norm() < b.norm();
+            });
+  auto numG = int(gVectors.size());
+  polarGNorms.resize(numG);
+
+  Kokkos::realloc(polarGVectors_k, numG, 3);
+  Kokkos::realloc(polarGPhases_k, numG, numAtoms);
+  Kokkos::realloc(polarGZ_k, numG, numPhBands);
+  Kokkos::realloc(polarBornCharges_k, numPhBands, 3);
+  Kokkos::realloc(polarAtoms_k, numPhBands);
+  Kokkos::realloc(polarPositions_k, numAtoms, 3);
+  Kokkos::realloc(polarEpsilon_k, 3, 3);
+  auto polarGVectors_h = Kokkos::create_mirror_view(polarGVectors_k);
+  auto polarGPhases_h = Kokkos::create_mirror_view(polarGPhases_k);
+  auto polarGZ_h = Kokkos::create_mirror_view(polarGZ_k);
+  auto polarBornCharges_h = Kokkos::create_mirror_view(polarBornCharges_k);
+  auto polarAtoms_h = Kokkos::create_mirror_view(polarAtoms_k);
+  auto polarPositions_h = Kokkos::create_mirror_view(polarPositions_k);
+  auto polarEpsilon_h = Kokkos::create_mirror_view(polarEpsilon_k);
+
+  for (int iAt = 0; iAt < numAtoms; iAt++) {
+    for (int iPol : {0, 1, 2}) {
+      int k = PhononH0::getIndexEigenvector(iAt, iPol, numAtoms);
+      polarAtoms_h(k) = iAt;
+      for (int j : {0, 1, 2}) {
+        polarBornCharges_h(k, j) = bornCharges(iAt, j, iPol);
+      }
+    }
+    for (int j : {0, 1, 2}) {
+      polarPositions_h(iAt, j) = atomicPositions(iAt, j);
+    }
+  }
+  for (int i : {0, 1, 2}) {
+    for (int j : {0, 1, 2}) {
+      polarEpsilon_h(i, j) = epsilon(i, j);
+    }
+  }
+  for (int iG = 0; iG < numG; iG++) {
+    const Eigen::Vector3d &gVector = gVectors[iG];
+    polarGNorms[iG] = gVector.norm();
+    for (int j : {0, 1, 2}) {
+      polarGVectors_h(iG, j) = gVector(j);
+    }
+    for (int iAt = 0; iAt < numAtoms; iAt++) {
+      double arg = -gVector.dot(atomicPositions.row(iAt));
+      polarGPhases_h(iG, iAt) = Kokkos::complex<double>(cos(arg), sin(arg));
+    }
+    for (int k = 0; k < numPhBands; k++) {
+      double x = 0.;
+      for (int j : {0, 1, 2}) {
+        x += gVector(j) * polarBornCharges_h(k, j);
+      }
+      polarGZ_h(iG, k) = x;
+    }
+  }
+  Kokkos::deep_copy(polarGVectors_k, polarGVectors_h);
+  Kokkos::deep_copy(polarGPhases_k, polarGPhases_h);
+  Kokkos::deep_copy(polarGZ_k, polarGZ_h);
+  Kokkos::deep_copy(polarBornCharges_k, polarBornCharges_h);
+  Kokkos::deep_copy(polarAtoms_k, polarAtoms_h);
+  Kokkos::deep_copy(polarPositions_k, polarPositions_h);
+  Kokkos::deep_copy(polarEpsilon_k, polarEpsilon_h);
+}
+
+ComplexView2D InteractionElPhWan::calcPolarCorrectionView(
+    const DoubleView2D &q3Cs_k, const double &qMax,
+    const ComplexView3D &eigvecs3_k) {
+  // doi:10.1103/physRevLett.115.176401, Eq. 4, as in
+  // polarCorrectionPart1Static(), but with the q-independent parts of each
+  // term precomputed, i.e. (q+G).Z = q.Z + G.Z and
+  // exp(-i(q+G).tau) = exp(-iq.tau) exp(-iG.tau)
+  Kokkos::Profiling::pushRegion("calcPolarCorrectionView");
+
+  double gMax = 14.;
+  double chargeSquare = 2.;// = e^2/4/Pi/eps_0 in atomic units
+  double factor = chargeSquare * fourPi / crystal.getVolumeUnitCell();
+  auto numLoops = int(q3Cs_k.extent(0));
+  int numPhBands = this->numPhBands;
+
+  // only the G-vectors in the sphere |G| < polarGCutoff + |q| contribute
+  auto numG = int(std::upper_bound(polarGNorms.begin(), polarGNorms.end(),
+                                   polarGCutoff + qMax) -
+                  polarGNorms.begin());
+
+  DoubleView2D polarGVectors_k = this->polarGVectors_k;
+  ComplexView2D polarGPhases_k = this->polarGPhases_k;
+  DoubleView2D polarGZ_k = this->polarGZ_k;
+  DoubleView2D polarBornCharges_k = this->polarBornCharges_k;
+  IntView1D polarAtoms_k = this->polarAtoms_k;
+  DoubleView2D polarPositions_k = this->polarPositions_k;
+  DoubleView2D polarEpsilon_k = this->polarEpsilon_k;
+
+  // the Gaussian weight of each (q+G) term
+  DoubleView2D weights(Kokkos::ViewAllocateWithoutInitializing("polarWeights"),
+                       numLoops, numG);
+  Kokkos::parallel_for(
+      "polarWeights", Range2D({0, 0}, {numLoops, numG}),
+      KOKKOS_LAMBDA(int ik, int iG) {
+        double qG[3];
+        for (int i = 0; i < 3; i++) {
+          qG[i] = q3Cs_k(ik, i) + polarGVectors_k(iG, i);
+        }
+        double qEq = 0.;
+        for (int i = 0; i < 3; i++) {
+          for (int j = 0; j < 3; j++) {
+            qEq += qG[i] * polarEpsilon_k(i, j) * qG[j];
+          }
+        }
+        double w = 0.;
+        if (qEq > 0. && qEq / 4. < gMax) {
+          w = exp(-qEq / 4.) / qEq;
+        }
+        weights(ik, iG) = w;
+      });
+
+  // the sum over G, for each atom-polarization index k
+  ComplexView2D xAtoms(Kokkos::ViewAllocateWithoutInitializing("polarXAtoms"),
+                       numLoops, numPhBands);
+  Kokkos::complex<double> complexI(0.0, 1.0);
+  Kokkos::parallel_for(
+      "polarXAtoms", Range2D({0, 0}, {numLoops, numPhBands}),
+      KOKKOS_LAMBDA(int ik, int k) {
+        int iAt = polarAtoms_k(k);
+        double arg = 0.;
+        double qNorm = 0.;
+        double qDotZ = 0.;
+        for (int j = 0; j < 3; j++) {
+          arg -= q3Cs_k(ik, j) * polarPositions_k(iAt, j);
+          qNorm += q3Cs_k(ik, j) * q3Cs_k(ik, j);
+          qDotZ += q3Cs_k(ik, j) * polarBornCharges_k(k, j);
+        }
+        Kokkos::complex<double> tmp(0., 0.);
+        if (qNorm > 1.0e-16) {
+          for (int iG = 0; iG < numG; iG++) {
+            double w = weights(ik, iG);
+            if (w > 0.) {
+              tmp += w * (qDotZ + polarGZ_k(iG, k)) * polarGPhases_k(iG, iAt);
+            }
+          }
+          tmp *= factor * complexI * exp(complexI * arg);
+        }
+        xAtoms(ik, k) = tmp;
+      });
+  Kokkos::realloc(weights, 0, 0);
+
+  // rotate on the phonon modes
+  ComplexView2D x(Kokkos::ViewAllocateWithoutInitializing("polarX"), numLoops,
+                  numPhBands);
+  Kokkos::parallel_for(
+      "polarX", Range2D({0, 0}, {numLoops, numPhBands}),
+      KOKKOS_LAMBDA(int ik, int nu) {
+        Kokkos::complex<double> tmp(0., 0.);
+        for (int k = 0; k < numPhBands; k++) {
+          tmp += xAtoms(ik, k) * eigvecs3_k(ik, nu, k);
+        }
+        x(ik, nu) = tmp;
+      });
+  Kokkos::fence();
+  Kokkos::Profiling::popRegion();
+  return x;
+}
+
 Eigen::Tensor<std::complex<double>, 3>
 InteractionElPhWan::polarCorrectionPart2(const Eigen::MatrixXcd &ev1, const Eigen::MatrixXcd &ev2, const Eigen::VectorXcd &x) {
   // overlap = <U^+_{b2 k+q}|U_{b1 k}>
@@ -232,27 +578,51 @@ void InteractionElPhWan::calcCouplingSquared(
     const std::vector<Eigen::MatrixXcd> &eigvecs3,
     const std::vector<Eigen::Vector3d> &q3Cs,
     const std::vector<Eigen::VectorXcd> &polarData) {
+  DoubleView4D coupling_k =
+      calcCouplingSquaredView(eigvec1, eigvecs2, eigvecs3, q3Cs, polarData);
+
   Kokkos::Profiling::pushRegion("calcCouplingSquared");
-  int numWannier = numElBands;
   auto nb1 = int(eigvec1.cols());
   auto numLoops = int(eigvecs2.size());
+  int numPhBands = this->numPhBands;
+  std::vector<int> nb2s_h(numLoops);
+  for (int ik = 0; ik < numLoops; ik++) {
+    nb2s_h[ik] = int(eigvecs2[ik].cols());
+  }
 
-#ifdef MPI_AVAIL
-  int pool_rank = mpi->getRank(mpi->intraPoolComm);
-  int pool_size = mpi->getSize(mpi->intraPoolComm);
-  if(pool_size > 1 && mpi_requests[0] != MPI_REQUEST_NULL){
-      Kokkos::Profiling::pushRegion("wait for reductions");
-      // wait for MPI_Ireduces from cacheCoupling
-      //MPI_Waitall(pool_size, mpi_requests.data(), MPI_STATUSES_IGNORE);
-      Kokkos::Profiling::popRegion();
-
-      Kokkos::Profiling::pushRegion("copy to GPU");
-      this->elPhCached = Kokkos::create_mirror_view_and_copy(
-          Kokkos::DefaultExecutionSpace(), elPhCached_hs[pool_rank]
-      );
-      Kokkos::Profiling::popRegion();
+  // now, copy results back to the CPU
+  cacheCoupling.resize(0);
+  cacheCoupling.resize(numLoops);
+  auto coupling_h = stagingArena.mirror(7, coupling_k);
+  Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), coupling_h, coupling_k);
+  Kokkos::fence();
+#pragma omp parallel for default(none) shared(numLoops, cacheCoupling, coupling_h, nb1, nb2s_h, numPhBands)
+  for (int ik = 0; ik < numLoops; ik++) {
+    Eigen::Tensor<double, 3> coupling(nb1, nb2s_h[ik], numPhBands);
+    for (int nu = 0; nu < numPhBands; nu++) {
+      for (int ib2 = 0; ib2 < nb2s_h[ik]; ib2++) {
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          coupling(ib1, ib2, nu) = coupling_h(ik, nu, ib2, ib1);
+        }
+      }
+    }
+    // and we save the coupling |g|^2 it for later
+    cacheCoupling[ik] = coupling;
   }
-#endif
+  Kokkos::Profiling::popRegion();
+}
+
+DoubleView4D InteractionElPhWan::calcCouplingSquaredView(
+    const Eigen::MatrixXcd &eigvec1,
+    const std::vector<Eigen::MatrixXcd> &eigvecs2,
+    const std::vector<Eigen::MatrixXcd> &eigvecs3,
+    const std::vector<Eigen::Vector3d> &q3Cs,
+    const std::vector<Eigen::VectorXcd> &polarData) {
+  DeviceMemoryScope memoryScope("InteractionElPhWan");
+  Kokkos::Profiling::pushRegion("calcCouplingSquaredView");
+  int numWannier = numElBands;
+  auto nb1 = int(eigvec1.cols());
+  auto numLoops = int(eigvecs2.size());
 
   auto elPhCached = this->elPhCached;
   int numPhBands = this->numPhBands;
@@ -260,30 +630,44 @@ void InteractionElPhWan::calcCouplingSquared(
   DoubleView2D phBravaisVectors_k = this->phBravaisVectors_k;
   DoubleView1D phBravaisVectorsDegeneracies_k = this->phBravaisVectorsDegeneracies_k;
 
+  // temporary views are borrowed from the scratch arena, to avoid device
+  // allocations at every batch. Views alive at the same time use distinct slots.
+  // Likewise, the host side of the transfers uses the pinned buffers of the
+  // staging arena, whose copies to the device are asynchronous: the copies
+  // of the previous batch must be over before the buffers are refilled
+  Kokkos::fence();
+
   // get nb2 for each ik and find the max
   // since loops and views must be rectangular, not ragged
-  IntView1D nb2s_k("nb2s", numLoops);
+  auto nb2s_k = scratchArena.borrow<IntView1D>(0, numLoops);
   int nb2max = 0;
-  auto nb2s_h = Kokkos::create_mirror_view(nb2s_k);
+  auto nb2s_h = stagingArena.mirror(0, nb2s_k);
   for (int ik = 0; ik < numLoops; ik++) {
     nb2s_h(ik) = int(eigvecs2[ik].cols());
     if (nb2s_h(ik) > nb2max) {
       nb2max = nb2s_h(ik);
     }
   }
-  Kokkos::deep_copy(nb2s_k, nb2s_h);
-
-  // Polar corrections are computed on the CPU and then transferred to GPU
-
-  IntView1D usePolarCorrections("usePolarCorrections", numLoops);
-  ComplexView4D polarCorrections(Kokkos::ViewAllocateWithoutInitializing("polarCorrections"),
-                                 numLoops, numPhBands, nb1, nb2max);
-  auto usePolarCorrections_h = Kokkos::create_mirror_view(usePolarCorrections);
-  auto polarCorrections_h = Kokkos::create_mirror_view(polarCorrections);
+  Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), nb2s_k, nb2s_h);
+  batchMemoryTuner.recordMemoryPerPoint(getMemoryPerK2(nb1, nb2max),
+                                        getMemoryPerK2(nb1, numElBands));
+
+  // Polar corrections are computed on the CPU and then transferred to GPU,
+  // unless the first part of the polar correction isn't passed in input,
+  // in which case the whole correction is computed on the device below
+  bool polarOnDevice = usePolarCorrection && polarData.empty();
+  int numHostPolar = usePolarCorrection && !polarOnDevice ? numLoops : 0;
+
+  auto usePolarCorrections =
+      scratchArena.borrow<IntView1D>(1, numHostPolar);
+  auto polarCorrections = scratchArena.borrow<ComplexView4D>(
+      2, numHostPolar, numPhBands, nb1, nb2max);
+  auto usePolarCorrections_h = stagingArena.mirror(1, usePolarCorrections);
+  auto polarCorrections_h = stagingArena.mirror(2, polarCorrections);
 
   // precompute all needed polar corrections
 #pragma omp parallel for
-  for (int ik = 0; ik < numLoops; ik++) {
+  for (int ik = 0; ik < numHostPolar; ik++) {
     Eigen::Vector3d q3C = q3Cs[ik];
     Eigen::MatrixXcd eigvec2 = eigvecs2[ik];
     Eigen::MatrixXcd eigvec3 = eigvecs3[ik];
@@ -311,17 +695,24 @@ void InteractionElPhWan::calcCouplingSquared(
     }
   }
 
-  Kokkos::deep_copy(polarCorrections, polarCorrections_h);
-  Kokkos::deep_copy(usePolarCorrections, usePolarCorrections_h);
+  Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), polarCorrections,
+                    polarCorrections_h);
+  Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), usePolarCorrections,
+                    usePolarCorrections_h);
 
   // copy eigenvectors etc. to device
-  DoubleView2D q3Cs_k("q3", numLoops, 3);
-  ComplexView3D eigvecs2Dagger_k("ev2Dagger", numLoops, numWannier, nb2max),
-      eigvecs3_k("ev3", numLoops, numPhBands, numPhBands);
+  auto q3Cs_k = scratchArena.borrow<DoubleView2D>(3, numLoops, 3);
+  auto eigvecs2Dagger_k =
+      scratchArena.borrow<ComplexView3D>(4, numLoops, numWannier, nb2max);
+  auto eigvecs3_k =
+      scratchArena.borrow<ComplexView3D>(5, numLoops, numPhBands, numPhBands);
   {
-    auto eigvecs2Dagger_h = Kokkos::create_mirror_view(eigvecs2Dagger_k);
-    auto eigvecs3_h = Kokkos::create_mirror_view(eigvecs3_k);
-    auto q3Cs_h = Kokkos::create_mirror_view(q3Cs_k);
+    auto eigvecs2Dagger_h = stagingArena.mirror(4, eigvecs2Dagger_k);
+    auto eigvecs3_h = stagingArena.mirror(5, eigvecs3_k);
+    auto q3Cs_h = stagingArena.mirror(3, q3Cs_k);
+    // only partially filled below, and the arena memory is not initialized
+    // (on host builds, the mirror view aliases the device view)
+    Kokkos::deep_copy(eigvecs2Dagger_h, Kokkos::complex<double>(0.));
 
 #pragma omp parallel for default(none) shared(eigvecs3_h, eigvecs2Dagger_h, nb2s_h, q3Cs_h, q3Cs_k, q3Cs, numLoops, numWannier, numPhBands, eigvecs2Dagger_k, eigvecs3_k, eigvecs2, eigvecs3)
     for (int ik = 0; ik < numLoops; ik++) {
@@ -345,133 +736,367 @@ void InteractionElPhWan::calcCouplingSquared(
         q3Cs_h(ik, i) = q3Cs[ik](i);
       }
     }
-    Kokkos::deep_copy(eigvecs2Dagger_k, eigvecs2Dagger_h);
-    Kokkos::deep_copy(eigvecs3_k, eigvecs3_h);
-    Kokkos::deep_copy(q3Cs_k, q3Cs_h);
+    auto space = Kokkos::DefaultExecutionSpace();
+    Kokkos::deep_copy(space, eigvecs2Dagger_k, eigvecs2Dagger_h);
+    Kokkos::deep_copy(space, eigvecs3_k, eigvecs3_h);
+    Kokkos::deep_copy(space, q3Cs_k, q3Cs_h);
   }
 
   // now we finish the Wannier transform. We have to do the Fourier transform
   // on the lattice degrees of freedom, and then do two rotations (at k2 and q)
-  ComplexView2D phases("phases", numLoops, numPhBravaisVectors);
+  auto phases =
+      scratchArena.borrow<ComplexView2D>(6, numLoops, numPhBravaisVectors);
   Kokkos::complex<double> complexI(0.0, 1.0);
-  Kokkos::parallel_for(
-      "phases", Range2D({0, 0}, {numLoops, numPhBravaisVectors}),
-      KOKKOS_LAMBDA(int ik, int irP) {
-        double arg = 0.0;
-        for (int j = 0; j < 3; j++) {
-          arg += q3Cs_k(ik, j) * phBravaisVectors_k(irP, j);
-        }
-        phases(ik, irP) =
-            exp(complexI * arg) / phBravaisVectorsDegeneracies_k(irP);
-     });
-   Kokkos::fence();
-
-  ComplexView4D g3(Kokkos::ViewAllocateWithoutInitializing("g3"), numLoops, numPhBands, nb1, numWannier);
-  Kokkos::parallel_for(
-      "g3", Range4D({0, 0, 0, 0}, {numLoops, numPhBands, nb1, numWannier}),
-      KOKKOS_LAMBDA(int ik, int nu, int ib1, int iw2) {
-        Kokkos::complex<double> tmp(0., 0.);
-        for (int irP = 0; irP < numPhBravaisVectors; irP++) {
-          tmp += phases(ik, irP) * elPhCached(irP, nu, ib1, iw2);
-        }
-        g3(ik, nu, ib1, iw2) = tmp;
+  Range2D phasesRange({0, 0}, {numLoops, numPhBravaisVectors});
+  auto phasesKernel = KOKKOS_LAMBDA(int ik, int irP) {
+    double arg = 0.0;
+    for (int j = 0; j < 3; j++) {
+      arg += q3Cs_k(ik, j) * phBravaisVectors_k(irP, j);
+    }
+    phases(ik, irP) =
+        exp(complexI * arg) / phBravaisVectorsDegeneracies_k(irP);
+  };
+
+  auto g3 = scratchArena.borrow<ComplexView4D>(7, numLoops, numPhBands, nb1,
+                                               numWannier);
+  PhononFourierTransform<float> g3KernelSingle{phases, elPhCached, g3};
+  PhononFourierTransform<double> g3KernelDouble{phases, elPhCached, g3};
+
+  auto g4 = scratchArena.borrow<ComplexView4D>(6, numLoops, numPhBands, nb1,
+                                               numWannier);
+  Range4D g4Range({0, 0, 0, 0}, {numLoops, numPhBands, nb1, numWannier});
+  auto g4Kernel = KOKKOS_LAMBDA(int ik, int nu2, int ib1, int iw2) {
+    Kokkos::complex<double> tmp(0., 0.);
+    for (int nu = 0; nu < numPhBands; nu++) {
+      tmp += g3(ik, nu, ib1, iw2) * eigvecs3_k(ik, nu2, nu);
+    }
+    g4(ik, nu2, ib1, iw2) = tmp;
+  };
+
+  auto gFinal = scratchArena.borrow<ComplexView4D>(7, numLoops, numPhBands,
+                                                   nb1, nb2max);
+  Range4D gFinalRange({0, 0, 0, 0}, {numLoops, numPhBands, nb1, nb2max});
+  auto gFinalKernel = KOKKOS_LAMBDA(int ik, int nu, int ib1, int ib2) {
+    Kokkos::complex<double> tmp(0., 0.);
+    for (int iw2 = 0; iw2 < numWannier; iw2++) {
+      tmp += eigvecs2Dagger_k(ik, iw2, ib2) * g4(ik, nu, ib1, iw2);
+    }
+    gFinal(ik, nu, ib1, ib2) = tmp;
+  };
+
+  // finally, compute |g|^2 from g, adding the polar corrections computed on
+  // the host. The couplings are returned to the caller, and are only
+  // borrowed when the kernels are replayed as a graph, which needs the same
+  // memory at every batch
+  bool useGraphs = kokkosDeviceMemory->useKernelGraphs() && !polarOnDevice;
+  DoubleView4D coupling_k;
+  if (useGraphs) {
+    coupling_k = scratchArena.borrow<DoubleView4D>(10, numLoops, numPhBands,
+                                                   nb2max, nb1);
+  } else {
+    coupling_k = DoubleView4D(Kokkos::ViewAllocateWithoutInitializing("coupling"),
+                              numLoops, numPhBands, nb2max, nb1);
+  }
+  bool addHostPolar = numHostPolar > 0;
+  Range4D couplingRange({0, 0, 0, 0}, {numLoops, numPhBands, nb2max, nb1});
+  auto couplingKernel = KOKKOS_LAMBDA(int ik, int nu, int ib2, int ib1) {
+    // notice the flip of 1 and 2 indices is intentional
+    // coupling is |<k+q,ib2 | dV_nu | k,ib1>|^2
+    auto tmp = gFinal(ik, nu, ib1, ib2);
+    if (addHostPolar) {
+      tmp += polarCorrections(ik, nu, ib1, ib2);
+    }
+    coupling_k(ik, nu, ib2, ib1) =
+        tmp.real() * tmp.real() + tmp.imag() * tmp.imag();
+  };
+
+  if (useGraphs) {
+    // all the views of the kernels identify the graph, together with the
+    // precision of the Fourier transform and the polar correction
+    std::vector<std::uintptr_t> key = {std::uintptr_t(useSinglePrecision),
+                                       std::uintptr_t(addHostPolar)};
+    auto addToKey = [&key](const std::vector<std::uintptr_t> &x) {
+      key.insert(key.end(), x.begin(), x.end());
+    };
+    addToKey(KernelGraphCache::viewKey(q3Cs_k));
+    addToKey(KernelGraphCache::viewKey(phBravaisVectors_k));
+    addToKey(KernelGraphCache::viewKey(phBravaisVectorsDegeneracies_k));
+    addToKey(KernelGraphCache::viewKey(phases));
+    addToKey(KernelGraphCache::viewKey(elPhCached));
+    addToKey(KernelGraphCache::viewKey(g3));
+    addToKey(KernelGraphCache::viewKey(eigvecs3_k));
+    addToKey(KernelGraphCache::viewKey(g4));
+    addToKey(KernelGraphCache::viewKey(eigvecs2Dagger_k));
+    addToKey(KernelGraphCache::viewKey(gFinal));
+    addToKey(KernelGraphCache::viewKey(polarCorrections));
+    addToKey(KernelGraphCache::viewKey(coupling_k));
+    auto record = [&](const auto &g3Kernel) {
+      couplingGraph.run(key, [&](const auto &root) {
+        auto phasesNode =
+            root.then_parallel_for("phases", phasesRange, phasesKernel);
+        auto g3Node =
+            phasesNode.then_parallel_for("g3", g3Kernel.range(), g3Kernel);
+        auto g4Node = g3Node.then_parallel_for("g4", g4Range, g4Kernel);
+        auto gFinalNode =
+            g4Node.then_parallel_for("gFinal", gFinalRange, gFinalKernel);
+        gFinalNode.then_parallel_for("coupling", couplingRange,
+                                     couplingKernel);
       });
-  Kokkos::realloc(phases, 0, 0);
+    };
+    if (useSinglePrecision) {
+      record(g3KernelSingle);
+    } else {
+      record(g3KernelDouble);
+    }
+    Kokkos::fence();
+    Kokkos::Profiling::popRegion();
+    return coupling_k;
+  }
 
-  ComplexView4D g4(Kokkos::ViewAllocateWithoutInitializing("g4"), numLoops, numPhBands, nb1, numWannier);
-  Kokkos::parallel_for(
-      "g4", Range4D({0, 0, 0, 0}, {numLoops, numPhBands, nb1, numWannier}),
-      KOKKOS_LAMBDA(int ik, int nu2, int ib1, int iw2) {
-        Kokkos::complex<double> tmp(0., 0.);
-        for (int nu = 0; nu < numPhBands; nu++) {
-          tmp += g3(ik, nu, ib1, iw2) * eigvecs3_k(ik, nu2, nu);
-        }
-        g4(ik, nu2, ib1, iw2) = tmp;
-      });
-  Kokkos::realloc(g3, 0, 0, 0, 0);
+  Kokkos::parallel_for("phases", phasesRange, phasesKernel);
+  Kokkos::fence();
+  if (useSinglePrecision) {
+    Kokkos::parallel_for("g3", g3KernelSingle.range(), g3KernelSingle);
+  } else {
+    Kokkos::parallel_for("g3", g3KernelDouble.range(), g3KernelDouble);
+  }
+  Kokkos::parallel_for("g4", g4Range, g4Kernel);
+  Kokkos::parallel_for("gFinal", gFinalRange, gFinalKernel);
+
+  // we now add the polar corrections computed on the device, before taking
+  // the norm of g
+  if (polarOnDevice) {
+    double qMax = 0.;
+    for (const Eigen::Vector3d &q3C : q3Cs) {
+      qMax = std::max(qMax, q3C.norm());
+    }
+    ComplexView2D polarX = calcPolarCorrectionView(q3Cs_k, qMax, eigvecs3_k);
 
-  ComplexView4D gFinal(Kokkos::ViewAllocateWithoutInitializing("gFinal"), numLoops, numPhBands, nb1, nb2max);
-  Kokkos::parallel_for(
-      "gFinal", Range4D({0, 0, 0, 0}, {numLoops, numPhBands, nb1, nb2max}),
-      KOKKOS_LAMBDA(int ik, int nu, int ib1, int ib2) {
-        Kokkos::complex<double> tmp(0., 0.);
-        for (int iw2 = 0; iw2 < numWannier; iw2++) {
-          tmp += eigvecs2Dagger_k(ik, iw2, ib2) * g4(ik, nu, ib1, iw2);
+    // overlap = <U^+_{b2 k+q}|U_{b1 k}>, as in polarCorrectionPart2()
+    auto eigvec1_k = scratchArena.borrow<ComplexView2D>(8, numWannier, nb1);
+    {
+      auto eigvec1_h = stagingArena.mirror(6, eigvec1_k);
+      for (int iw = 0; iw < numWannier; iw++) {
+        for (int ib1 = 0; ib1 < nb1; ib1++) {
+          eigvec1_h(iw, ib1) = eigvec1(iw, ib1);
         }
-        gFinal(ik, nu, ib1, ib2) = tmp;
-      });
-  Kokkos::realloc(g4, 0, 0, 0, 0);
-
-  // we now add the precomputed polar corrections, before taking the norm of g
-  if (usePolarCorrection) {
+      }
+      Kokkos::deep_copy(Kokkos::DefaultExecutionSpace(), eigvec1_k,
+                        eigvec1_h);
+    }
+    auto overlap =
+        scratchArena.borrow<ComplexView3D>(9, numLoops, nb1, nb2max);
+    Kokkos::parallel_for(
+        "overlap", Range3D({0, 0, 0}, {numLoops, nb1, nb2max}),
+        KOKKOS_LAMBDA(int ik, int ib1, int ib2) {
+          Kokkos::complex<double> tmp(0., 0.);
+          for (int iw = 0; iw < numWannier; iw++) {
+            tmp += eigvecs2Dagger_k(ik, iw, ib2) * eigvec1_k(iw, ib1);
+          }
+          overlap(ik, ib1, ib2) = tmp;
+        });
     Kokkos::parallel_for(
         "correction",
         Range4D({0, 0, 0, 0}, {numLoops, numPhBands, nb1, nb2max}),
         KOKKOS_LAMBDA(int ik, int nu, int ib1, int ib2) {
-          gFinal(ik, nu, ib1, ib2) += polarCorrections(ik, nu, ib1, ib2);
+          gFinal(ik, nu, ib1, ib2) += polarX(ik, nu) * overlap(ik, ib1, ib2);
         });
+    Kokkos::fence();
   }
-  Kokkos::realloc(polarCorrections, 0, 0, 0, 0);
 
-  // finally, compute |g|^2 from g
-  DoubleView4D coupling_k(Kokkos::ViewAllocateWithoutInitializing("coupling"), numLoops, numPhBands, nb2max, nb1);
-  Kokkos::parallel_for(
-      "coupling", Range4D({0, 0, 0, 0}, {numLoops, numPhBands, nb2max, nb1}),
-      KOKKOS_LAMBDA(int ik, int nu, int ib2, int ib1) {
-        // notice the flip of 1 and 2 indices is intentional
-        // coupling is |<k+q,ib2 | dV_nu | k,ib1>|^2
-        auto tmp = gFinal(ik, nu, ib1, ib2);
-        coupling_k(ik, nu, ib2, ib1) =
-            tmp.real() * tmp.real() + tmp.imag() * tmp.imag();
-      });
-  Kokkos::realloc(gFinal, 0, 0, 0, 0);
+  Kokkos::parallel_for("coupling", couplingRange, couplingKernel);
+  Kokkos::fence();
 
-  // now, copy results back to the CPU
-  cacheCoupling.resize(0);
-  cacheCoupling.resize(numLoops);
-  auto coupling_h = Kokkos::create_mirror_view(coupling_k);
-  Kokkos::deep_copy(coupling_h, coupling_k);
-#pragma omp parallel for default(none) shared(numLoops, cacheCoupling, coupling_h, nb1, nb2s_h, numPhBands)
-  for (int ik = 0; ik < numLoops; ik++) {
-    Eigen::Tensor<double, 3> coupling(nb1, nb2s_h(ik), numPhBands);
-    for (int nu = 0; nu < numPhBands; nu++) {
-      for (int ib2 = 0; ib2 < nb2s_h(ik); ib2++) {
-        for (int ib1 = 0; ib1 < nb1; ib1++) {
-          coupling(ib1, ib2, nu) = coupling_h(ik, nu, ib2, ib1);
-        }
-      }
-    }
-    // and we save the coupling |g|^2 it for later
-    cacheCoupling[ik] = coupling;
-  }
   Kokkos::Profiling::popRegion();
+  return coupling_k;
 }
 
 Eigen::VectorXi InteractionElPhWan::getCouplingDimensions() {
+  // note: couplingWannier_k may have been released by the truncation
   Eigen::VectorXi xx(5);
-  for (int i : {0, 1, 2, 3, 4}) {
-    xx(i) = couplingWannier_k.extent(i);
-  }
+  xx << numElBravaisVectors, numPhBravaisVectors, numPhBands, numElBands,
+      numElBands;
   return xx;
 }
 
-int InteractionElPhWan::estimateNumBatches(const int &nk2, const int &nb1) {
-  int maxNb2 = numElBands;
-  int maxNb3 = numPhBands;
+void InteractionElPhWan::truncateCouplingWannier(const double &tolerance,
+                                                 const bool &singlePrecision) {
+  DeviceMemoryScope memoryScope("InteractionElPhWan");
+  if (isCouplingTruncated) {
+    Error("Developer error: the el-ph coupling is already truncated");
+  }
+  Kokkos::Profiling::pushRegion("truncateCouplingWannier");
+  int numPhBands = this->numPhBands;
+  int numElBands = this->numElBands;
+  ComplexView5D couplingWannier_k = this->couplingWannier_k;
+
+  // squared norm of each (R_el,R_ph) block
+  DoubleView2D blockNorms_k("blockNorms", numElBravaisVectors,
+                            numPhBravaisVectors);
+  Kokkos::parallel_for(
+      "blockNorms", Range2D({0, 0}, {numElBravaisVectors, numPhBravaisVectors}),
+      KOKKOS_LAMBDA(int irE, int irP) {
+        double x = 0.;
+        for (int nu = 0; nu < numPhBands; nu++) {
+          for (int iw1 = 0; iw1 < numElBands; iw1++) {
+            for (int iw2 = 0; iw2 < numElBands; iw2++) {
+              auto g = couplingWannier_k(irE, irP, nu, iw1, iw2);
+              x += g.real() * g.real() + g.imag() * g.imag();
+            }
+          }
+        }
+        blockNorms_k(irE, irP) = x;
+      });
+  auto blockNorms_h =
+      Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), blockNorms_k);
+
+  // the threshold is relative to the largest block of all pools
+  double maxNorm = 0.;
+  for (int irE = 0; irE < numElBravaisVectors; irE++) {
+    for (int irP = 0; irP < numPhBravaisVectors; irP++) {
+      maxNorm = std::max(maxNorm, blockNorms_h(irE, irP));
+    }
+  }
+  mpi->allReduceMax(&maxNorm);
+  double threshold = tolerance * tolerance * maxNorm;
+
+  // list the blocks to be kept, sorted by R_ph
+  std::vector<int> blockEl, blockPh;
+  std::vector<int> blockPhStart(numPhBravaisVectors + 1, 0);
+  double totalNorm = 0.;
+  double droppedNorm = 0.;
+  for (int irP = 0; irP < numPhBravaisVectors; irP++) {
+    blockPhStart[irP] = int(blockEl.size());
+    for (int irE = 0; irE < numElBravaisVectors; irE++) {
+      double x = blockNorms_h(irE, irP);
+      totalNorm += x;
+      if (x < threshold) {
+        droppedNorm += x;
+      } else {
+        blockEl.push_back(irE);
+        blockPh.push_back(irP);
+      }
+    }
+  }
+  auto numBlocks = int(blockEl.size());
+  blockPhStart[numPhBravaisVectors] = numBlocks;
+
+  double oldMemory = getDeviceMemoryUsage();
 
-  double availableMemory = kokkosDeviceMemory->getAvailableMemory();
+  Kokkos::realloc(blockElVectors_k, numBlocks);
+  Kokkos::realloc(blockPhStart_k, numPhBravaisVectors + 1);
+  IntView1D blockPh_k("blockPh", numBlocks);
+  {
+    auto blockEl_h = Kokkos::create_mirror_view(blockElVectors_k);
+    auto blockPh_h = Kokkos::create_mirror_view(blockPh_k);
+    auto blockPhStart_h = Kokkos::create_mirror_view(blockPhStart_k);
+    for (int iBlock = 0; iBlock < numBlocks; iBlock++) {
+      blockEl_h(iBlock) = blockEl[iBlock];
+      blockPh_h(iBlock) = blockPh[iBlock];
+    }
+    for (int irP = 0; irP <= numPhBravaisVectors; irP++) {
+      blockPhStart_h(irP) = blockPhStart[irP];
+    }
+    Kokkos::deep_copy(blockElVectors_k, blockEl_h);
+    Kokkos::deep_copy(blockPh_k, blockPh_h);
+    Kokkos::deep_copy(blockPhStart_k, blockPhStart_h);
+  }
+  IntView1D blockElVectors_k = this->blockElVectors_k;
+  if (singlePrecision) {
+    ComplexFloatView4D couplingBlocksFloat_k(
+        Kokkos::ViewAllocateWithoutInitializing("couplingBlocksFloat"),
+        numBlocks, numPhBands, numElBands, numElBands);
+    Kokkos::parallel_for(
+        "couplingBlocksFloat",
+        Range4D({0, 0, 0, 0}, {numBlocks, numPhBands, numElBands, numElBands}),
+        KOKKOS_LAMBDA(int iBlock, int nu, int iw1, int iw2) {
+          Kokkos::complex<double> g = couplingWannier_k(
+              blockElVectors_k(iBlock), blockPh_k(iBlock), nu, iw1, iw2);
+          couplingBlocksFloat_k(iBlock, nu, iw1, iw2) =
+              Kokkos::complex<float>(float(g.real()), float(g.imag()));
+        });
+    Kokkos::fence();
+    this->couplingBlocksFloat_k = couplingBlocksFloat_k;
+  } else {
+    ComplexView4D couplingBlocks_k(
+        Kokkos::ViewAllocateWithoutInitializing("couplingBlocks"), numBlocks,
+        numPhBands, numElBands, numElBands);
+    Kokkos::parallel_for(
+        "couplingBlocks",
+        Range4D({0, 0, 0, 0}, {numBlocks, numPhBands, numElBands, numElBands}),
+        KOKKOS_LAMBDA(int iBlock, int nu, int iw1, int iw2) {
+          couplingBlocks_k(iBlock, nu, iw1, iw2) = couplingWannier_k(
+              blockElVectors_k(iBlock), blockPh_k(iBlock), nu, iw1, iw2);
+        });
+    Kokkos::fence();
+    this->couplingBlocks_k = couplingBlocks_k;
+  }
+  isCouplingTruncated = true;
+  useSinglePrecision = singlePrecision;
+
+  // release the dense tensor
+  couplingWannier_k = ComplexView5D();
+  this->couplingWannier_k = ComplexView5D();
+  hostCouplingWannier.reset();
+  sharedCouplingWannier.reset();
+  kokkosDeviceMemory->removeDeviceMemoryUsage(oldMemory);
+  kokkosDeviceMemory->addDeviceMemoryUsage(getDeviceMemoryUsage());
+
+  // report on the truncation, summing over the processes of a pool
+  int totalBlocks = numElBravaisVectors * numPhBravaisVectors;
+  int keptBlocks = numBlocks;
+  mpi->allReduceSum(&totalBlocks, mpi->intraPoolComm);
+  mpi->allReduceSum(&keptBlocks, mpi->intraPoolComm);
+  mpi->allReduceSum(&totalNorm, mpi->intraPoolComm);
+  mpi->allReduceSum(&droppedNorm, mpi->intraPoolComm);
+  if (mpi->mpiHead()) {
+    double blockSize = 16. * numPhBands * numElBands * numElBands;
+    double newBlockSize = singlePrecision ? blockSize / 2. : blockSize;
+    if (tolerance > 0.) {
+      std::cout << "Truncated the el-ph coupling: kept " << keptBlocks
+                << " of " << totalBlocks << " (R_el,R_ph) blocks.\n"
+                << "Relative norm of the dropped matrix elements: "
+                << sqrt(droppedNorm / std::max(totalNorm, 1.0e-300)) << ".\n";
+    }
+    if (singlePrecision) {
+      std::cout << "The el-ph coupling is stored in single precision.\n";
+    }
+    std::cout << "Coupling memory reduced from "
+              << totalBlocks * blockSize / pow(1024., 3) << " to "
+              << keptBlocks * newBlockSize / pow(1024., 3)
+              << " GB (per pool)." << std::endl;
+  }
+  Kokkos::Profiling::popRegion();
+}
 
+double InteractionElPhWan::getMemoryPerK2(const int &nb1,
+                                          const int &nb2) const {
   // memory used by different tensors, that is linear in nk2
   // Note: 16 (2*8) is the size of double (complex<double>) in bytes
-  double evs = 16 * (maxNb2 * numElBands + maxNb3 * numPhBands);
+  double evs = 16 * (nb2 * numElBands + numPhBands * numPhBands);
   double phase = 16 * numPhBravaisVectors;
   double g3 = 2 * 16 * numPhBands * nb1 * numElBands;
   double g4 = 2 * 16 * numPhBands * nb1 * numElBands;
-  double gFinal = 2 * 16 * numPhBands * nb1 * maxNb2;
-  double coupling = 16 * nb1 * maxNb2 * numPhBands;
-  double polar = 16 * numPhBands * nb1 * maxNb2;
-  double maxUsage =
-      nk2 * (evs + polar + std::max({phase + g3, g3 + g4, g4 + gFinal, gFinal + coupling}));
+  double gFinal = 2 * 16 * numPhBands * nb1 * nb2;
+  double coupling = 16 * nb1 * nb2 * numPhBands;
+  double polar = 16 * numPhBands * nb1 * nb2;
+  if (usePolarCorrection) {// the device path also uses the G-sphere weights
+    polar += 8 * double(polarGNorms.size()) + 16 * nb1 * nb2;
+  }
+  // the temporaries take turns in the slots of the scratch arena,
+  // which are kept allocated between batches
+  return evs + polar + std::max(phase, g4) + std::max(g3, gFinal) + coupling;
+}
+
+int InteractionElPhWan::estimateNumBatches(const int &nk2, const int &nb1) {
+  // on GPUs, this is no more than the memory currently free on the device
+  // (memory already held by the scratch arena is reused by the batches)
+  double availableMemory = kokkosDeviceMemory->getAvailableMemory() +
+                           scratchArena.getMemory();
+
+  // the upper bound uses all the bands at k2
+  double maxMemoryPerK2 = getMemoryPerK2(nb1, numElBands);
+  double maxUsage = nk2 * batchMemoryTuner.getMemoryPerPoint(maxMemoryPerK2);
 
   // the number of batches needed
   int numBatches = std::ceil(maxUsage / availableMemory);
@@ -490,6 +1115,7 @@ int InteractionElPhWan::estimateNumBatches(const int &nk2, const int &nb1) {
 }
 
 void InteractionElPhWan::cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen::Vector3d &k1C) {
+  DeviceMemoryScope memoryScope("InteractionElPhWan");
 
   Kokkos::Profiling::pushRegion("cacheElPh");
   //  int numWannier = numElBands;
@@ -512,10 +1138,68 @@ void InteractionElPhWan::cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen:
   int pool_rank = mpi->getRank(mpi->intraPoolComm);
   int pool_size = mpi->getSize(mpi->intraPoolComm);
 
+  // look for k1 in the cache of previous transforms. With pools, the
+  // transform is skipped only if all processes of the pool find their k1,
+  // since otherwise they must all take part in the reductions below.
+  // Note: the dummy calls for pools (with a null eigenvector) aren't stored,
+  // and don't need the transform.
+  bool useK1Cache = k1CacheMemory > 0.;
+  bool storeK1 = useK1Cache && !eigvec1.isZero();
+  K1Key k1Key;
+  if (useK1Cache) {
+    std::complex<double> checksum = eigvec1.sum();
+    for (int i : {0, 1, 2}) {
+      k1Key[i] = std::llround(k1C(i) * 1.0e8);
+    }
+    k1Key[3] = nb1;
+    k1Key[4] = std::llround(std::abs(checksum) * 1.0e8);
+
+    auto search = k1Map.find(k1Key);
+    bool isDummy = !storeK1 && pool_size > 1;
+    int isCached = (search != k1Map.end() || isDummy) ? 1 : 0;
+    if (pool_size > 1) {
+      mpi->allReduceMin(&isCached, mpi->intraPoolComm);
+    }
+    if (isCached == 1) {
+      if (search != k1Map.end()) {
+        // move the point to the front of the list, as the most recently used
+        k1List.splice(k1List.begin(), k1List, search->second);
+        this->elPhCached = search->second->second;
+      }
+      kokkosDeviceMemory->addDeviceMemoryUsage(getDeviceMemoryUsage());
+      Kokkos::Profiling::popRegion();
+      return;
+    }
+    // make sure that the transform below doesn't overwrite a cached tensor
+    elPhCached = ComplexView4D();
+  }
+
+  // with pools, the contributions to the cache of each process of the pool
+  // are reduced with non-blocking calls, using two host buffers, so that the
+  // reduction for the iPool-th process overlaps with the Fourier transform
+  // for the next one. waitReduction() completes the reduction that used a
+  // buffer and, on its root process, moves the result to elPhCached.
+  ComplexView4D::HostMirror poolBuffers[2];
+  int poolBufferRoots[2] = {-1, -1};
+#ifdef MPI_AVAIL
+  MPI_Request poolRequests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+#endif
+  auto waitReduction = [&](const int &iBuffer) {
+    if (poolBufferRoots[iBuffer] < 0) return;
+    Kokkos::Profiling::pushRegion("wait MPI_Ireduce");
 #ifdef MPI_AVAIL
-  mpi_requests.resize(pool_size);
-  elPhCached_hs.resize(pool_size);
+    MPI_Wait(&poolRequests[iBuffer], MPI_STATUS_IGNORE);
 #endif
+    Kokkos::Profiling::popRegion();
+    if (poolBufferRoots[iBuffer] == pool_rank) {
+      elPhCached = Kokkos::create_mirror_view_and_copy(
+          Kokkos::DefaultExecutionSpace(), poolBuffers[iBuffer]);
+    }
+    // the buffer can be released only after the reduction is complete
+    poolBuffers[iBuffer] = ComplexView4D::HostMirror();
+    poolBufferRoots[iBuffer] = -1;
+  };
+
   ComplexView4D g1(Kokkos::ViewAllocateWithoutInitializing("g1"),
       numPhBravaisVectors, numPhBands, numElBands, numElBands);
 
@@ -557,6 +1241,9 @@ void InteractionElPhWan::cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen:
 
     // now compute the Fourier transform on electronic coordinates.
     ComplexView5D couplingWannier_k = this->couplingWannier_k;
+    ComplexView4D couplingBlocks_k = this->couplingBlocks_k;
+    IntView1D blockElVectors_k = this->blockElVectors_k;
+    IntView1D blockPhStart_k = this->blockPhStart_k;
     DoubleView2D elBravaisVectors_k = this->elBravaisVectors_k;
     DoubleView1D elBravaisVectorsDegeneracies_k = this->elBravaisVectorsDegeneracies_k;
     Kokkos::Profiling::popRegion();
@@ -575,9 +1262,18 @@ void InteractionElPhWan::cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen:
     Kokkos::Profiling::popRegion();
 
     // now we complete the Fourier transform
-    // We have to write two codes: one for when the GPU runs on CUDA,
-    // the other for when we compile the code without GPU support
-#ifdef KOKKOS_ENABLE_CUDA
+    // With the truncated coupling, we only loop over the stored blocks.
+    // Otherwise, we have to write two codes: one for when the GPU runs on
+    // CUDA or HIP, the other for when we compile the code without GPU support
+    if (isCouplingTruncated && useSinglePrecision) {
+      blockFourierTransform<float>(this->couplingBlocksFloat_k,
+                                   blockElVectors_k, blockPhStart_k, phases_k,
+                                   g1);
+    } else if (isCouplingTruncated) {
+      blockFourierTransform<double>(couplingBlocks_k, blockElVectors_k,
+                                    blockPhStart_k, phases_k, g1);
+    } else {
+#if defined(KOKKOS_ENABLE_CUDA) || defined(KOKKOS_ENABLE_HIP)
     Kokkos::parallel_for(
         "g1",
         Range4D({0, 0, 0, 0},
@@ -622,6 +1318,7 @@ void InteractionElPhWan::cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen:
     Kokkos::Experimental::contribute(g1, g1scatter);
 */
 #endif
+    }
 
     // now we need to add the rotation on the electronic coordinates
     // and finish the transformation on electronic coordinates
@@ -665,43 +1362,87 @@ void InteractionElPhWan::cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen:
       // note: we do the reduction after the rotation, so that the tensor
       // may be a little smaller when windows are applied (nb1<numWannier)
 
-      // do a mpi->allReduce across the pool
-      //mpi->allReduceSum(&poolElPhCached_h, mpi->intraPoolComm);
+      // the buffer used two iterations ago is free after its reduction
+      int iBuffer = iPool % 2;
+      waitReduction(iBuffer);
 
       Kokkos::Profiling::pushRegion("copy elPhCached to CPU");
       // copy from accelerator to CPU
-      auto poolElPhCached_h = Kokkos::create_mirror_view(poolElPhCached_k);
-      Kokkos::deep_copy(poolElPhCached_h, poolElPhCached_k);
+      poolBuffers[iBuffer] = Kokkos::create_mirror_view(poolElPhCached_k);
+      Kokkos::deep_copy(poolBuffers[iBuffer], poolElPhCached_k);
       Kokkos::Profiling::popRegion();
-
-      elPhCached_hs[iPool] = poolElPhCached_h;
+      poolBufferRoots[iBuffer] = iPool;
 
 #ifdef MPI_AVAIL
-      // start reduction for current iteration
-      Kokkos::Profiling::pushRegion("call MPI_reduce");
-      // previously, we had tried non-blocking collectives here.
-      // However, this resulted in some segfaults, so we fell back to standard reduce.
+      // start the reduction for the current iteration. Note: the send
+      // buffer must not be modified or freed before waitReduction()
+      Kokkos::Profiling::pushRegion("call MPI_Ireduce");
+      auto &buffer = poolBuffers[iBuffer];
       if (pool_rank == iPool) {
-        //MPI_Ireduce(MPI_IN_PLACE, poolElPhCached_h.data(), poolElPhCached_h.size(), MPI_COMPLEX16, MPI_SUM, iPool, mpi->getComm(mpi->intraPoolComm), &mpi_requests[iPool]);
-        MPI_Reduce(MPI_IN_PLACE, poolElPhCached_h.data(), poolElPhCached_h.size(), MPI_COMPLEX16, MPI_SUM, iPool, mpi->getComm(mpi->intraPoolComm)); //, &mpi_requests[iPool]);
-      }
-      else{
-        MPI_Reduce(poolElPhCached_h.data(), poolElPhCached_h.data(), poolElPhCached_h.size(), MPI_COMPLEX16, MPI_SUM, iPool, mpi->getComm(mpi->intraPoolComm)); //, &mpi_requests[iPool]);
-        //MPI_Ireduce(poolElPhCached_h.data(), poolElPhCached_h.data(), poolElPhCached_h.size(), MPI_COMPLEX16, MPI_SUM, iPool, mpi->getComm(mpi->intraPoolComm), &mpi_requests[iPool]);
+        MPI_Ireduce(MPI_IN_PLACE, buffer.data(), int(buffer.size()),
+                    MPI_COMPLEX16, MPI_SUM, iPool,
+                    mpi->getComm(mpi->intraPoolComm), &poolRequests[iBuffer]);
+      } else {
+        MPI_Ireduce(buffer.data(), nullptr, int(buffer.size()), MPI_COMPLEX16,
+                    MPI_SUM, iPool, mpi->getComm(mpi->intraPoolComm),
+                    &poolRequests[iBuffer]);
       }
       Kokkos::Profiling::popRegion();
 #endif
-
     }
   }
+  // complete the last reductions
+  waitReduction(pool_size % 2);
+  waitReduction((pool_size + 1) % 2);
   this->elPhCached = elPhCached;
+
+  if (storeK1) {
+    Kokkos::Profiling::pushRegion("cacheElPh store k1");
+    auto search = k1Map.find(k1Key);
+    if (search != k1Map.end()) {// only found by some processes of the pool
+      k1List.splice(k1List.begin(), k1List, search->second);
+      k1CacheUsage -= 16. * double(search->second->second.size());
+      search->second->second = elPhCached;
+      k1CacheUsage += 16. * double(elPhCached.size());
+    } else {
+      k1List.emplace_front(k1Key, elPhCached);
+      k1Map[k1Key] = k1List.begin();
+      k1CacheUsage += 16. * double(elPhCached.size());
+    }
+    // evict the least recently used points, exceeding the memory budget
+    while (k1CacheUsage > k1CacheMemory && !k1List.empty()) {
+      k1CacheUsage -= 16. * double(k1List.back().second.size());
+      k1Map.erase(k1List.back().first);
+      k1List.pop_back();
+    }
+    Kokkos::Profiling::popRegion();
+  }
   double newMemory = getDeviceMemoryUsage();
   kokkosDeviceMemory->addDeviceMemoryUsage(newMemory);
   Kokkos::Profiling::popRegion();
 }
 
 double InteractionElPhWan::getDeviceMemoryUsage() {
-  double x = 16 * (this->elPhCached.size() + couplingWannier_k.size())
+  double x = 16 * (this->elPhCached.size() + couplingWannier_k.size() + couplingBlocks_k.size())
+      + 8 * couplingBlocksFloat_k.size()
+      + 4 * (blockElVectors_k.size() + blockPhStart_k.size())
       + 8 * (phBravaisVectorsDegeneracies_k.size() + phBravaisVectors_k.size() + elBravaisVectors_k.size() + elBravaisVectorsDegeneracies_k.size());
-  return x;
+  x += 16 * polarGPhases_k.size()
+      + 8 * (polarGVectors_k.size() + polarGZ_k.size() + polarBornCharges_k.size() + polarPositions_k.size() + polarEpsilon_k.size())
+      + 4 * polarAtoms_k.size();
+  return x + k1CacheUsage;
+}
+
+void InteractionElPhWan::setK1CacheMemory(const double &memory) {
+  double oldMemory = getDeviceMemoryUsage();
+  k1CacheMemory = memory;
+  // if the budget shrinks, evict the least recently used points
+  while (k1CacheUsage > k1CacheMemory && !k1List.empty()) {
+    k1CacheUsage -= 16. * double(k1List.back().second.size());
+    k1Map.erase(k1List.back().first);
+    k1List.pop_back();
+  }
+  if (k1List.empty()) k1CacheUsage = 0.;
+  kokkosDeviceMemory->removeDeviceMemoryUsage(oldMemory);
+  kokkosDeviceMemory->addDeviceMemoryUsage(getDeviceMemoryUsage());
 }
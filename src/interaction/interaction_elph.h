@@ -1,7 +1,11 @@
 #ifndef EL_PH_INTERACTION_H
 #define EL_PH_INTERACTION_H
 
+#include <array>
 #include <complex>
+#include <list>
+#include <map>
+#include <memory>
 
 #include "constants.h"
 #include "crystal.h"
@@ -51,11 +55,93 @@ class InteractionElPhWan {
 
   ComplexView4D elPhCached;
   ComplexView5D couplingWannier_k;
+  // on CPU builds, the parsed coupling tensor, taken over by the class:
+  // couplingWannier_k is then a view of its memory, rather than a copy
+  std::shared_ptr<Eigen::Tensor<std::complex<double>, 5>> hostCouplingWannier;
+  // with the -sm flag, the node-shared memory of couplingWannier_k, released
+  // when the last copy of this object drops it
+  std::shared_ptr<void> sharedCouplingWannier;
+  // block-sparse storage of the coupling, used instead of couplingWannier_k
+  // after truncateCouplingWannier(). couplingBlocks_k(iBlock,nu,iw1,iw2) is
+  // the block of the pair (R_el,R_ph) of lattice vectors, with R_el of index
+  // blockElVectors_k(iBlock). Blocks are sorted by R_ph: those of the irP-th
+  // phonon vector are blockPhStart_k(irP) <= iBlock < blockPhStart_k(irP+1).
+  bool isCouplingTruncated = false;
+  ComplexView4D couplingBlocks_k;
+  // with single precision, the blocks are stored in couplingBlocksFloat_k,
+  // and the Fourier transforms accumulate in complex<float>
+  bool useSinglePrecision = false;
+  ComplexFloatView4D couplingBlocksFloat_k;
+  IntView1D blockElVectors_k;
+  IntView1D blockPhStart_k;
   DoubleView2D phBravaisVectors_k;
   DoubleView1D phBravaisVectorsDegeneracies_k;
   DoubleView2D elBravaisVectors_k;
   DoubleView1D elBravaisVectorsDegeneracies_k;
 
+  // quantities of the polar correction that don't depend on q, precomputed
+  // on the device by setupPolarCorrection(): the reciprocal lattice vectors
+  // G (numG,3) sorted by norm, exp(-iG.tau) for each atom (numG,numAtoms),
+  // the contractions G.Z (numG,numPhBands) with the Born charges, the Born
+  // charges Z(k,j) with k the atom-polarization index (numPhBands,3), the
+  // atom of each index k, the atomic positions and the dielectric matrix.
+  DoubleView2D polarGVectors_k;
+  ComplexView2D polarGPhases_k;
+  DoubleView2D polarGZ_k;
+  DoubleView2D polarBornCharges_k;
+  IntView1D polarAtoms_k;
+  DoubleView2D polarPositions_k;
+  DoubleView2D polarEpsilon_k;
+  // norms of the G vectors, and the radius of the sphere |q+G| beyond which
+  // the Gaussian cutoff of the polar correction discards the G vectors
+  std::vector<double> polarGNorms;
+  double polarGCutoff = 0.;
+
+  /** Precomputes on the device the G-sphere and the Born charge
+   * contractions used by calcPolarCorrectionView().
+   */
+  void setupPolarCorrection();
+
+  /** Computes on the device the first part of the polar correction, i.e.
+   * the quantity returned by polarCorrectionPart1(), for a batch of q3
+   * wavevectors. The result is zero for q3 = 0.
+   * @param q3Cs_k: cartesian coordinates of the q3 wavevectors (numLoops,3).
+   * @param qMax: the largest norm of the q3 wavevectors.
+   * @param eigvecs3_k: phonon eigenvectors, such that eigvecs3_k(ik,nu,k)
+   * is the component k of the eigenvector of mode nu.
+   * @return x: a view (numLoops,numPhBands).
+   */
+  ComplexView2D calcPolarCorrectionView(const DoubleView2D &q3Cs_k,
+                                        const double &qMax,
+                                        const ComplexView3D &eigvecs3_k);
+
+  // least-recently-used cache of the elPhCached tensors computed by
+  // cacheElPh(), indexed by the rounded cartesian coordinates of k1, the
+  // number of bands at k1 and a checksum of its eigenvector.
+  // Most recent points in front.
+  using K1Key = std::array<long long, 5>;
+  std::list<std::pair<K1Key, ComplexView4D>> k1List;
+  std::map<K1Key, std::list<std::pair<K1Key, ComplexView4D>>::iterator> k1Map;
+  // memory budget and memory used by the cache, in bytes
+  double k1CacheMemory = 0.;
+  double k1CacheUsage = 0.;
+
+  // tunes the memory estimate of estimateNumBatches
+  BatchMemoryTuner batchMemoryTuner;
+
+  // reusable device memory for the temporary views of the batched kernels
+  ScratchArena scratchArena;
+  // reusable pinned host memory for the transfers of the batches
+  HostStagingArena stagingArena;
+  // the kernels of calcCouplingSquaredView, replayed as a graph
+  KernelGraphCache couplingGraph;
+
+  /** Estimate the peak memory in bytes used by calcCouplingSquared for each
+   * k2 wavevector, given the number of bands at k1 and k2.
+   */
+  double getMemoryPerK2(const int &nb1, const int &nb2) const;
+
+public:
   /** Estimate the memory in bytes, occupied by the kokkos Views containing
    * the coupling tensor to be interpolated.
    *
@@ -63,13 +149,6 @@ class InteractionElPhWan {
    */
   double getDeviceMemoryUsage();
 
-  std::vector<ComplexView4D::HostMirror> elPhCached_hs;
-#ifdef MPI_AVAIL
-  std::vector<MPI_Request> mpi_requests;
-#endif
-
-public:
-
   /** Default constructor
    * @param crystal_: object describing the crystal unit cell.
    * @param couplingWannier_: matrix elements of the electron phonon
@@ -89,10 +168,14 @@ public:
    * lattice vectors used in the phonon Fourier transform of the coupling.
    * @param phononH0_: pointer to the phonon dynamical matrix object. Used for
    * adding the polar interaction.
+   *
+   * Note: on CPU builds, the memory of couplingWannier_ is taken over by
+   * this object, so that the coupling isn't stored twice, and the tensor is
+   * left empty.
    */
   InteractionElPhWan(
       Crystal &crystal_,
-      const Eigen::Tensor<std::complex<double>, 5> &couplingWannier_,
+      Eigen::Tensor<std::complex<double>, 5> &couplingWannier_,
       const Eigen::MatrixXd &elBravaisVectors_,
       const Eigen::VectorXd &elBravaisVectorsDegeneracies_,
       const Eigen::MatrixXd &phBravaisVectors_,
@@ -145,6 +228,8 @@ public:
    * @param k1: value of first wavevector.
    * @param k2s: list of k2 wavevectors.
    * @param q3s: list of phonon wavevectors.
+   * @param polarData: for each q3, the output of polarCorrectionPart1(). If
+   * empty, the polar correction is computed on the device.
    */
   void calcCouplingSquared(
       const Eigen::MatrixXcd &eigvec1,
@@ -153,6 +238,21 @@ public:
       const std::vector<Eigen::Vector3d> &q3Cs,
       const std::vector<Eigen::VectorXcd> &polarData);
 
+  /** Same as calcCouplingSquared(), but the values of |g|^2 are returned
+   * on the device, for Kokkos kernels that use them directly, instead of
+   * being copied to the host for getCouplingSquared().
+   * @return coupling: a view of dimensions (numLoops, numPhBands, nb2max,
+   * nb1), i.e. with the indices of the q3 (and k2) wavevectors, the phonon
+   * band, the band at k2 (padded to the largest number of bands in the
+   * batch) and the band at k1.
+   */
+  DoubleView4D calcCouplingSquaredView(
+      const Eigen::MatrixXcd &eigvec1,
+      const std::vector<Eigen::MatrixXcd> &eigvecs2,
+      const std::vector<Eigen::MatrixXcd> &eigvecs3,
+      const std::vector<Eigen::Vector3d> &q3Cs,
+      const std::vector<Eigen::VectorXcd> &polarData);
+
   /** Computes a partial Fourier transform over the k1/R_el variables.
    * @param k1C: values of the k1 cartesian coordinates over which the Fourier
    * transform is computed.
@@ -160,6 +260,15 @@ public:
    */
   void cacheElPh(const Eigen::MatrixXcd &eigvec1, const Eigen::Vector3d &k1C);
 
+  /** Sets the memory budget of the cache of the partial Fourier transforms
+   * of cacheElPh(). If positive, the transforms at the most recently used k1
+   * points are kept on the device, and a later call to cacheElPh() at one of
+   * these points skips the transform. This helps e.g. the iterative solvers,
+   * which rebuild the el-ph scattering rates over the same k1 points.
+   * @param memory: the budget in bytes. Zero disables the cache.
+   */
+  void setK1CacheMemory(const double &memory);
+
   /** Get the coupling for the values of the wavevectors triplet (k1,k2,q3),
    * where k1 is the wavevector used at calcCoupling Squared(),
    * k2 (at index ik2) is the wavevector of the scattered electron in the
@@ -191,6 +300,21 @@ public:
       const Eigen::MatrixXd &atomicPositions,
       const Eigen::Vector3i &qCoarseMesh);
 
+  /** Drops the blocks of the Wannier coupling, i.e. all the matrix elements
+   * at a pair (R_el,R_ph) of lattice vectors, whose norm is smaller than
+   * tolerance times the largest block norm. The remaining blocks are stored
+   * in a block-sparse layout that the Fourier transform of cacheElPh()
+   * loops over. Prints the number of dropped blocks, the relative norm of
+   * the dropped elements and the memory savings.
+   * @param tolerance: the relative threshold on the norm of the blocks.
+   * @param singlePrecision: if true, the blocks are stored in single
+   * precision, and the Fourier transforms over the lattice vectors (in
+   * cacheElPh and calcCouplingSquared) are accumulated in single precision,
+   * while rotations and |g|^2 stay in double precision.
+   */
+  void truncateCouplingWannier(const double &tolerance,
+                               const bool &singlePrecision = false);
+
   /** Auxiliary function to return the shape of the electron-phonon tensor
    * @return (numWannier,numWannier,numPhModes,numElVectors,numPhVectors)
    */
@@ -198,6 +322,8 @@ public:
 
   /** Estimate the number of batches that the list of k2 wavevectors must be
    * split into, in order to fit in memory.
+   * The estimate uses the free device memory at the time of the call, and is
+   * tuned with the memory used by the first calls to calcCouplingSquared.
    *
    * @param nk2: total number of k2 wavevectors to be split in batches.
    * @param nb1: number of bands at the k1 wavevector.
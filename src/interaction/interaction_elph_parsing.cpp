@@ -2,7 +2,13 @@
 #include <fstream>
 
 #ifdef HDF5_AVAIL
+#include <cstring>
+#include <fcntl.h>
 #include <highfive/H5Easy.hpp>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 // specific parse function for the case where there is no
@@ -158,10 +164,111 @@ InteractionElPhWan parseNoHDF5(Context &context, Crystal &crystal,
 
 #ifdef HDF5_AVAIL
 
-std::tuple<int, int, int, Eigen::MatrixXd, Eigen::MatrixXd, std::vector<size_t>,
-    Eigen::VectorXd, Eigen::VectorXd> parseHeaderHDF5(Context &context) {
-  std::string fileName = context.getElphFileName();
+/** Helper class to read the el-ph coupling from the HDF5 file.
+ * The file is opened only once for the whole parsing (header and coupling),
+ * with the MPI-IO driver if parallel HDF5 is available. Optionally, the file
+ * is also memory-mapped, and the coupling is copied directly from the map
+ * for datasets with a contiguous (non-chunked, uncompressed) storage, such as
+ * those written by elPhQeToPhoebe. This bypasses the HDF5 library for the
+ * bulk of the data, and lets all the processes of a node share the same
+ * pages of the file cache.
+ */
+class ElPhHDF5Reader {
+public:
+  /** Opens the file.
+   * @param fileName: path to the HDF5 file.
+   * @param comm: communicator of the processes opening the file for a
+   * parallel (MPI-IO) read. Not used with useMemoryMap.
+   * @param useMemoryMap: if true, the file is opened serially, and the
+   * datasets are read from a memory map of the file.
+   */
+  ElPhHDF5Reader(const std::string &fileName, const int &comm,
+                 const bool &useMemoryMap)
+      : file(openFile(fileName, comm, useMemoryMap)) {
+    if (useMemoryMap) {
+      int fd = open(fileName.c_str(), O_RDONLY);
+      struct stat fileStat {};
+      if (fd >= 0 && fstat(fd, &fileStat) == 0) {
+        mapSize = size_t(fileStat.st_size);
+        void *map = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+          mapBuffer = (const char *)map;
+        }
+      }
+      if (fd >= 0) {
+        close(fd); // the mapping stays valid after closing the file
+      }
+      if (mapBuffer == nullptr) {
+        Warning("Couldn't memory-map " + fileName + ", reading it with HDF5.");
+      }
+    }
+  }
+
+  ~ElPhHDF5Reader() {
+    if (mapBuffer != nullptr) {
+      munmap((void *)mapBuffer, mapSize);
+    }
+  }
+
+  ElPhHDF5Reader(const ElPhHDF5Reader &that) = delete;
+  ElPhHDF5Reader &operator=(const ElPhHDF5Reader &that) = delete;
+
+  HighFive::File &getFile() { return file; }
+
+  /** Reads numElements complex numbers of a dataset, starting from the
+   * element offset of the flattened dataset.
+   */
+  void read(const std::string &datasetName, const size_t &offset,
+            const size_t &numElements, std::complex<double> *buffer) {
+    HighFive::DataSet dataset = file.getDataSet(datasetName);
+
+    if (mapBuffer != nullptr) {
+      // the byte offset of the data of a contiguous dataset in the file
+      haddr_t address = H5Dget_offset(dataset.getId());
+      size_t numBytes = numElements * sizeof(std::complex<double>);
+      size_t start = size_t(address) + offset * sizeof(std::complex<double>);
+      if (address != HADDR_UNDEF && start + numBytes <= mapSize) {
+        std::memcpy(buffer, mapBuffer + start, numBytes);
+        return;
+      }
+    }
+
+    std::vector<size_t> dims = dataset.getDimensions();
+    if (dims.size() == 2 && dims[0] == 1) { // the single dataset of format 1
+      dataset.select({0, offset}, {1, numElements}).read_raw(buffer);
+    } else { // a slice of format 2, which is always read whole
+      Eigen::VectorXcd slice(numElements);
+      dataset.read(slice);
+      std::memcpy(buffer, slice.data(),
+                  numElements * sizeof(std::complex<double>));
+    }
+  }
+
+private:
+  HighFive::File file;
+  const char *mapBuffer = nullptr;
+  size_t mapSize = 0;
+
+  static HighFive::File openFile(const std::string &fileName, const int &comm,
+                                 const bool &useMemoryMap) {
+#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
+    if (!useMemoryMap) {
+      HighFive::FileAccessProps fapl = HighFive::FileAccessProps{};
+      fapl.add(HighFive::MPIOFileAccess<MPI_Comm, MPI_Info>(mpi->getComm(comm),
+                                                            MPI_INFO_NULL));
+      return {fileName, HighFive::File::ReadOnly, fapl};
+    }
+#else
+    (void)comm;
+    (void)useMemoryMap;
+#endif
+    return {fileName, HighFive::File::ReadOnly};
+  }
+};
 
+std::tuple<int, int, int, Eigen::MatrixXd, Eigen::MatrixXd, std::vector<size_t>,
+    Eigen::VectorXd, Eigen::VectorXd> parseHeaderHDF5(Context &context,
+                                                      ElPhHDF5Reader *reader) {
   int numElectrons, numSpin;
   int numElBands, numElBravaisVectors, totalNumElBravaisVectors, numPhBands, numPhBravaisVectors;
   // suppress initialization warning
@@ -175,13 +282,9 @@ std::tuple<int, int, int, Eigen::MatrixXd, Eigen::MatrixXd, std::vector<size_t>,
     // Use MPI head only to read in the small data structures
     // then distribute them below this
     if (mpi->mpiHeadPool()) {
-      // need to open the files differently if MPI is available or not
-      // NOTE: do not remove the braces inside this if -- the file must
-      // go out of scope, so that it can be reopened for parallel
-      // read in the next block.
       {
-        // Open the HDF5 ElPh file
-        HighFive::File file(fileName, HighFive::File::ReadOnly);
+        // the file was already opened by the reader
+        HighFive::File &file = reader->getFile();
 
         // read in the number of electrons and the spin
         HighFive::DataSet dnelec = file.getDataSet("/numElectrons");
@@ -265,17 +368,15 @@ std::tuple<int, int, int, Eigen::MatrixXd, Eigen::MatrixXd, std::vector<size_t>,
           phBravaisVectorsDegeneracies_);
 }
 
-// specific parse function for the case where parallel HDF5 is available
+// parse function for the file format 1, where the coupling is stored in a
+// single flattened dataset
 InteractionElPhWan parseHDF5V1(Context &context, Crystal &crystal,
-                               PhononH0 *phononH0_) {
+                               PhononH0 *phononH0_, ElPhHDF5Reader *reader) {
   Kokkos::Profiling::pushRegion("parseHDF5V1");
 
-  std::string fileName = context.getElphFileName();
-
-  auto t = parseHeaderHDF5(context);
+  auto t = parseHeaderHDF5(context, reader);
   int numElBands = std::get<0>(t);
   int numPhBands = std::get<1>(t);
-  int totalNumElBravaisVectors = std::get<2>(t);
   Eigen::MatrixXd elBravaisVectors_ = std::get<3>(t);
   Eigen::MatrixXd phBravaisVectors_ = std::get<4>(t);
   std::vector<size_t> localElVectors = std::get<5>(t);
@@ -309,145 +410,51 @@ InteractionElPhWan parseHDF5V1(Context &context, Crystal &crystal,
                             numPhBravaisVectors, numElBravaisVectors);
     couplingWannier_.setZero();
 
-// Regular parallel read
-#if defined(MPI_AVAIL) && !defined(HDF5_SERIAL)
-
-    // Set up buffer to receive full matrix data
-    Eigen::VectorXcd gWanFlat(couplingWannier_.size());
-
-    // we will either divide the work over ranks, or we will divide the work
-    // over the processes in the head pool
-    int comm;
-    size_t start, stop, offset, numElements;
-
-    // if there's only one pool (aka, no pools) each process reads
-    // in a piece of the matrix from file.
-    // Then, at the end, we gather the pieces into one big gWan matrix.
-    if(mpi->getSize(mpi->intraPoolComm) == 1) {
-      comm = mpi->worldComm;
-      // start and stop points use divideWorkIter in the case without pools
-      start = mpi->divideWorkIter(numElBravaisVectors, comm)[0] * numElBands *
-              numElBands * numPhBands * numPhBravaisVectors;
-      stop = (mpi->divideWorkIter(numElBravaisVectors, comm).back() + 1) *
-              numElBands* numElBands * numPhBands * numPhBravaisVectors - 1;
-      offset = start;
-      numElements = stop - start + 1;
-    // else we have the pools case, in which each process on the head
-    // pool reads in a piece of the matrix (associated with whatever chunk
-    // of the bravais vectors it has), then we broadcast this information to
-    // all pools.
-    } else {
-      comm = mpi->intraPoolComm;
-      // each process has its own chunk of bravais vectors,
-      // and we need to read in all the elements associated with
-      // those vectors
-      start = 0;
-      stop = numElBravaisVectors * numElBands *
-              numElBands * numPhBands * numPhBravaisVectors;
-      // offset indexes the chunk we want to read in within the elph hdf5
-      // file, and indicates where this block starts in the full matrix
-      offset = localElVectors[0] * numElBands *
-              numElBands * numPhBands * numPhBravaisVectors;;
-      numElements = stop - start + 1;
-    }
-
-    // Reopen the HDF5 ElPh file for parallel read of eph matrix elements
-    HighFive::FileAccessProps fapl = HighFive::FileAccessProps{};
-    fapl.add(HighFive::MPIOFileAccess<MPI_Comm, MPI_Info>(mpi->getComm(comm), MPI_INFO_NULL));
-    HighFive::File file(fileName, HighFive::File::ReadOnly, fapl);
-
-    // Set up dataset for gWannier
-    HighFive::DataSet dgWannier = file.getDataSet("/gWannier");
-
-    // if this chunk of elements to be written by this process
-    // is greater than 2 GB, we must split it further due to a
-    // limitation of HDF5 which prevents read/write of
-    // more than 2 GB at a time.
-
-    // below, note the +1/-1 indexing on the start/stop numbers.
-    // This has to do with the way divideWorkIter sets the range
-    // of work to be done -- it uses indexing from 0 and doesn't
-    // include the last element as a result.
-    //
-    // start/stop points and the number of the total number of elements
-    // to be written by this process
-
-    // maxSize represents ~1 GB worth of std::complex<doubles>
-    // this is the maximum amount we feel is safe to read at once.
-    auto maxSize = int(pow(1000, 3)) / sizeof(std::complex<double>);
     // the size of all elements associated with one electronic BV
     size_t sizePerBV =
-        numElBands * numElBands * numPhBands * numPhBravaisVectors;
-    std::vector<int> irEBunchSizes;
-
-    // determine the # of eBVs to be written by this process.
-    // the bunchSizes vector tells us how many BVs each process will read
-    int numEBVs = int(mpi->divideWorkIter(totalNumElBravaisVectors, comm).back() + 1 -
-           mpi->divideWorkIter(totalNumElBravaisVectors, comm)[0]);
-
-    // loop over eBVs and add them to the current write bunch until
-    // we reach the maximum writable size
-    int irEBunchSize = 0;
-    for (int irE = 0; irE < numEBVs; irE++) {
-      irEBunchSize++;
-      // this bunch is as big as possible, stop adding to it
-      if ((irEBunchSize + 1) * sizePerBV > maxSize) {
-         irEBunchSizes.push_back(irEBunchSize);
-         irEBunchSize = 0;
+        size_t(numElBands) * numElBands * numPhBands * numPhBravaisVectors;
+
+    // Reads the elements of numBVs electronic Bravais vectors, starting from
+    // the firstBV-th vector of the file.
+    // HDF5 < v1.10.2 cannot read more than 2 GB at a time, so the read is
+    // split in bunches of ~1 GB, aligned with the blocks of each electronic
+    // Bravais vector, which are contiguous in the file
+    auto readBVs = [&](const size_t &firstBV, const size_t &numBVs,
+                       std::complex<double> *buffer) {
+      size_t maxSize = size_t(pow(1000, 3)) / sizeof(std::complex<double>);
+      size_t bunchBVs = std::max(size_t(1), maxSize / sizePerBV);
+      for (size_t iBV = 0; iBV < numBVs; iBV += bunchBVs) {
+        size_t numBunchBVs = std::min(bunchBVs, numBVs - iBV);
+        reader->read("/gWannier", (firstBV + iBV) * sizePerBV,
+                     numBunchBVs * sizePerBV, buffer + iBV * sizePerBV);
       }
-    }
-    // push the last one, no matter the size, to the list of bunch sizes
-    irEBunchSizes.push_back(irEBunchSize);
-
-    // Set up buffer to be filled from hdf5, enough for total # of elements
-    // to be read in by this process
-    Eigen::VectorXcd gWanSlice(numElements);
-
-    // determine the number of bunches -- not necessarily evenly sized
-    auto numBunches = int(irEBunchSizes.size());
-
-    // counter for offset from first element on this rank to current element
-    size_t bunchOffset = 0;
-    // we now loop over these bunch of eBVs, and read each bunch of
-    // bravais vectors in parallel
-    for (int iBunch = 0; iBunch < numBunches; iBunch++) {
-
-      // we need to determine the start, stop and offset of this
-      // sub-slice of the dataset available to this process
-      size_t bunchElements = irEBunchSizes[iBunch] * sizePerBV;
-      size_t totalOffset = offset + bunchOffset;
-
-      Eigen::VectorXcd gWanBunch(bunchElements);
-
-      // Read in the elements for this process
-      // into this bunch's location in the slice which will
-      // hold all the elements to be read by this process
-      dgWannier.select({0, totalOffset}, {1, bunchElements}).read(gWanBunch);
-
-      // Perhaps this could be more effective.
-      // however, HiFive doesn't seem to allow me to pass
-      // a slice of gWanSlice, so we have instead read to gWanBunch
-      // then copy it over
-      //
-      // copy bunch data into gWanSlice
-      for (size_t i = 0; i<bunchElements; i++) {
-        // if we're using pool, each pool proc has its own gwanFlat
-        if(comm == mpi->intraPoolComm) {
-          gWanFlat[i+bunchOffset] = gWanBunch[i];
-        }
-        // if no pools, each proc writes to a slice of the matrix
-        // which is later gathered to build the full one
-        else { gWanSlice[i+bunchOffset] = gWanBunch[i]; }
+    };
+
+    bool hasPools = mpi->getSize(mpi->intraPoolComm) > 1;
+    size_t firstBV = hasPools ? localElVectors[0] : 0;
+
+    if (context.getElPhMemoryMap()) {
+      // every process reads all its vectors from the memory map
+      readBVs(firstBV, numElBravaisVectors, couplingWannier_.data());
+
+    } else if (hasPools) {
+      // each process of the head pool reads the chunk of Bravais vectors
+      // of its pool rank, which is then broadcast to all pools
+      if (mpi->mpiHeadPool()) {
+        readBVs(firstBV, numElBravaisVectors, couplingWannier_.data());
       }
-      // calculate the offset for the next bunch
-      bunchOffset += bunchElements;
-    }
+      mpi->bcast(&couplingWannier_, mpi->interPoolComm);
 
-    // collect and broadcast the matrix elements now that they have been read in
+    } else {
+      // each process reads in a piece of the matrix from file, and then we
+      // gather the pieces into the full matrix
+      auto localBVs = mpi->divideWorkIter(numElBravaisVectors);
+      size_t offset = localBVs.empty() ? 0 : localBVs[0] * sizePerBV;
+      Eigen::VectorXcd gWanSlice(localBVs.size() * sizePerBV);
+      if (!localBVs.empty()) {
+        readBVs(localBVs[0], localBVs.size(), gWanSlice.data());
+      }
 
-    // We have the standard case of 1 pool (aka no pools),
-    // and we need to gather the components of the matrix into one big matrix
-    if(comm != mpi->intraPoolComm)  {
       // collect the information about how many elements each mpi rank has
       std::vector<size_t> workDivisionHeads(mpi->getSize());
       mpi->allGather(&offset, &workDivisionHeads);
@@ -456,62 +463,10 @@ InteractionElPhWan parseHDF5V1(Context &context, Crystal &crystal,
       mpi->allGather(&numIn, &workDivs);
 
       // Gather the elements read in by each process
-      mpi->bigAllGatherV(gWanSlice.data(), gWanFlat.data(),
-        workDivs, workDivisionHeads, comm);
-    }
-    // In the case of pools, where we read in only on the head pool,
-    // we now send it to all the other pools
-    //if(mpi->getSize(mpi->intraPoolComm) != 1) {
-    else {
-      mpi->bcast(&gWanFlat, mpi->interPoolComm);
-    }
-
-    // Map the flattened matrix back to tensor structure
-    Eigen::TensorMap<Eigen::Tensor<std::complex<double>, 5>> gWanTemp(
-        gWanFlat.data(), numElBands, numElBands, numPhBands,
-        numPhBravaisVectors, numElBravaisVectors);
-    couplingWannier_ = gWanTemp;
-
-#else
-    // Reopen serial version, either because MPI does not exist
-    // or because we forced HDF5 to run in serial.
-
-    // Set up buffer to receive full matrix data
-    std::vector<std::complex<double>> gWanFlat(totElems);
-
-    if (mpi->getSize(mpi->intraPoolComm) == 1) {
-      if (mpi->mpiHead()) {
-        HighFive::File file(fileName, HighFive::File::ReadOnly);
-
-        // Set up dataset for gWannier
-        HighFive::DataSet dgWannier = file.getDataSet("/gWannier");
-        // Read in the elements for this process
-        dgWannier.read(gWanFlat);
-      }
-      mpi->bcast(&gWanFlat);
-
-    } else {
-      if (mpi->mpiHeadPool()) {
-        HighFive::File file(fileName, HighFive::File::ReadOnly);
-
-        // Set up dataset for gWannier
-        HighFive::DataSet dgWannier = file.getDataSet("/gWannier");
-        // Read in the elements for this process
-        size_t offset = localElVectors[0] * pow(numElBands, 2) * numPhBravaisVectors * numPhBands;
-        size_t extent = numElBravaisVectors * pow(numElBands, 2) * numPhBravaisVectors * numPhBands;
-        dgWannier.select({0, offset}, {1, extent}).read(gWanFlat);
-      }
-      mpi->bcast(&gWanFlat, mpi->interPoolComm);
+      mpi->bigAllGatherV(gWanSlice.data(), couplingWannier_.data(), workDivs,
+                         workDivisionHeads, mpi->worldComm);
     }
 
-    // Map the flattened matrix back to tensor structure
-    Eigen::TensorMap<Eigen::Tensor<std::complex<double>, 5>> gWanTemp(
-        gWanFlat.data(), numElBands, numElBands, numPhBands,
-        numPhBravaisVectors, numElBravaisVectors);
-    couplingWannier_ = gWanTemp;
-
-#endif
-
   } catch (std::exception &error) {
     Error("Issue reading elph Wannier representation from hdf5.");
   }
@@ -526,12 +481,13 @@ InteractionElPhWan parseHDF5V1(Context &context, Crystal &crystal,
 }
 
 
-// specific parse function for the case where parallel HDF5 is available
+// parse function for the file format 2, where the coupling is stored in one
+// dataset for each electronic Bravais lattice vector
 InteractionElPhWan parseHDF5V2(Context &context, Crystal &crystal,
-                               PhononH0 *phononH0_) {
-  std::string fileName = context.getElphFileName();
+                               PhononH0 *phononH0_, ElPhHDF5Reader *reader) {
+  Kokkos::Profiling::pushRegion("parseHDF5V2");
 
-  auto t = parseHeaderHDF5(context);
+  auto t = parseHeaderHDF5(context, reader);
   int numElBands = std::get<0>(t);
   int numPhBands = std::get<1>(t);
   Eigen::MatrixXd elBravaisVectors_ = std::get<3>(t);
@@ -567,60 +523,40 @@ InteractionElPhWan parseHDF5V2(Context &context, Crystal &crystal,
                             numPhBravaisVectors, numElBravaisVectors);
     couplingWannier_.setZero();
 
-    // Set up buffer to receive full matrix data
-    size_t sliceElements = pow(numElBands,2) * numPhBands * numPhBravaisVectors;
-    Eigen::VectorXcd slice(sliceElements);
+    size_t sliceElements =
+        size_t(numElBands) * numElBands * numPhBands * numPhBravaisVectors;
+
+    // reads the slice of the irE-th Bravais vector of the file, which has
+    // the same layout of the slice irELocal of couplingWannier_
+    auto readSlice = [&](const int &irE, const int &irELocal) {
+      std::string datasetName = "/gWannier_" + std::to_string(irE);
+      reader->read(datasetName, 0, sliceElements,
+                   &couplingWannier_(0, 0, 0, 0, irELocal));
+    };
+
+    bool hasPools = mpi->getSize(mpi->intraPoolComm) > 1;
+
+    if (context.getElPhMemoryMap()) {
+      // every process reads all its vectors from the memory map
+      for (int irELocal = 0; irELocal < numElBravaisVectors; irELocal++) {
+        int irE = hasPools ? int(localElVectors[irELocal]) : irELocal;
+        readSlice(irE, irELocal);
+      }
 
-    if (mpi->getSize(mpi->intraPoolComm) > 1) { // case with pools
+    } else if (hasPools) { // case with pools
       if (mpi->mpiHeadPool()) {
-        HighFive::File file(fileName, HighFive::File::ReadOnly);
         for (int irE : localElVectors) {
-          int irELocal = irE - localElVectors[0];
-          std::string datasetName = "/gWannier_" + std::to_string(irE);
-          // Set up dataset for gWannier
-          HighFive::DataSet dslice = file.getDataSet(datasetName);
-          dslice.read(slice);
-
-          // Map the flattened matrix back to tensor structure
-          Eigen::TensorMap<Eigen::Tensor<std::complex<double>, 4>> sliceTemp(
-              slice.data(), numElBands, numElBands, numPhBands, numPhBravaisVectors);
-
-          for (int irP = 0; irP < numPhBravaisVectors; irP++) {
-            for (int nu = 0; nu < numPhBands; nu++) {
-              for (int i = 0; i < numElBands; i++) {
-                for (int j = 0; j < numElBands; j++) {
-                  couplingWannier_(i, j, nu, irP, irELocal) = sliceTemp(i, j, nu, irP);
-                }
-              }
-            }
-          }
+          readSlice(irE, irE - int(localElVectors[0]));
         }
       }
       mpi->bcast(&couplingWannier_, mpi->interPoolComm);
 
     } else { // case without pools
-      HighFive::File file(fileName, HighFive::File::ReadOnly);
       for (int irE : mpi->divideWorkIter(numElBravaisVectors)) {
-        std::string datasetName = "/gWannier_" + std::to_string(irE);
-        // Set up dataset for gWannier
-        HighFive::DataSet dslice = file.getDataSet(datasetName);
-        dslice.read(slice);
-
-        // Map the flattened matrix back to tensor structure
-        Eigen::TensorMap<Eigen::Tensor<std::complex<double>, 4>> sliceTemp(
-            slice.data(), numElBands, numElBands, numPhBands, numPhBravaisVectors);
-
-        for (int irP = 0; irP < numPhBravaisVectors; irP++) {
-          for (int nu = 0; nu < numPhBands; nu++) {
-            for (int i = 0; i < numElBands; i++) {
-              for (int j = 0; j < numElBands; j++) {
-                couplingWannier_(i, j, nu, irP, irE) = sliceTemp(i, j, nu, irP);
-              }
-            }
-          }
-        }
+        readSlice(irE, irE);
       }
-      mpi->bcast(&couplingWannier_);
+      // each process read different slices, the others are zero
+      mpi->allReduceSum(&couplingWannier_);
     }
   } catch (std::exception &error) {
     Error("Issue reading elph Wannier representation from hdf5.");
@@ -629,11 +565,13 @@ InteractionElPhWan parseHDF5V2(Context &context, Crystal &crystal,
   InteractionElPhWan output(crystal, couplingWannier_, elBravaisVectors_,
                             elBravaisVectorsDegeneracies_, phBravaisVectors_,
                             phBravaisVectorsDegeneracies_, phononH0_);
+  Kokkos::Profiling::popRegion();
   return output;
 }
 
 
-// specific parse function for the case where parallel HDF5 is available
+// parse function for the HDF5 file, which dispatches to the functions for
+// each file format
 InteractionElPhWan parseHDF5(Context &context, Crystal &crystal,
                              PhononH0 *phononH0_) {
   // check for existence of file
@@ -646,22 +584,29 @@ InteractionElPhWan parseHDF5(Context &context, Crystal &crystal,
     }
   }
 
+  // Without pools, every process reads a part of the coupling.
+  // With pools, only the processes of the head pool read the file, unless
+  // every process reads its part from the memory map.
+  bool useMemoryMap = context.getElPhMemoryMap();
+  bool hasPools = mpi->getSize(mpi->intraPoolComm) > 1;
+  bool isReader = useMemoryMap || !hasPools || mpi->mpiHeadPool();
+  int comm = hasPools ? mpi->intraPoolComm : mpi->worldComm;
+
+  // the file is opened once here, and stays open for the whole parsing
+  std::unique_ptr<ElPhHDF5Reader> reader;
+
   int fileFormat = 1;
   try {
+    if (isReader) {
+      reader = std::make_unique<ElPhHDF5Reader>(fileName, comm, useMemoryMap);
+    }
     // Use MPI head only to read in the small data structures
     if (mpi->mpiHead()) {
-      // need to open the files differently if MPI is available or not
-      // NOTE: do not remove the braces inside this if -- the file must
-      // go out of scope, so that it can be reopened for parallel
-      // read in the next block.
-      {
-        // Open the HDF5 ElPh file
-        HighFive::File file(fileName, HighFive::File::ReadOnly);
-        if ( file.exist("/fileFormat") ) {
-          // note: the earlier versions of the HDF5 file didn't have a format id
-          HighFive::DataSet dsFileFormat = file.getDataSet("/fileFormat");
-          dsFileFormat.read(fileFormat);
-        }
+      HighFive::File &file = reader->getFile();
+      if ( file.exist("/fileFormat") ) {
+        // note: the earlier versions of the HDF5 file didn't have a format id
+        HighFive::DataSet dsFileFormat = file.getDataSet("/fileFormat");
+        dsFileFormat.read(fileFormat);
       }
     }
     mpi->bcast(&fileFormat);
@@ -671,9 +616,9 @@ InteractionElPhWan parseHDF5(Context &context, Crystal &crystal,
   }
 
   if (fileFormat==1) {
-    return parseHDF5V1(context, crystal, phononH0_);
+    return parseHDF5V1(context, crystal, phononH0_, reader.get());
   } else {
-    return parseHDF5V2(context, crystal, phononH0_);
+    return parseHDF5V2(context, crystal, phononH0_, reader.get());
   }
 }
 
@@ -691,6 +636,13 @@ InteractionElPhWan InteractionElPhWan::parse(Context &context, Crystal &crystal,
 #else
   auto output = parseNoHDF5(context, crystal, phononH0_);
 #endif
+  // single precision uses the block-sparse layout, even with no truncation
+  if (context.getElPhTruncationThreshold() > 0. ||
+      context.getElPhSinglePrecision()) {
+    output.truncateCouplingWannier(context.getElPhTruncationThreshold(),
+                                   context.getElPhSinglePrecision());
+  }
+  output.setK1CacheMemory(context.getElPhK1CacheMemory() * 1.0e9);
 
   if (mpi->mpiHead()) {
     std::cout << "Finished parsing of el-ph interaction." << std::endl;
@@ -1,12 +1,21 @@
 #include "io.h"
+#include "common_kokkos.h"
 #include "mpiHelper.h"
 #include "main.h"
+#include "utilities.h"
 #include <algorithm>
 #include <exceptions.h>
 #include <iomanip>
 #include <cmath>
+#include <limits>
 #include <ctime>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <Kokkos_Core.hpp>
+#include <nlohmann/json.hpp>
 
 // Utility to get the command line option from it's name
 char *getCmdOption(char **begin, char **end, const std::string &option) {
@@ -81,6 +90,10 @@ void IO::welcome() {
 }
 
 void IO::goodbye(Context &context) {
+  // the reports on memory and timings are collective, and must come first
+  Profiler::recordHostMemory("end of the run");
+  Profiler::writeReport("performance_report.json");
+
   if (!mpi->mpiHead()) return;
   std::cout << "Exiting program.\n" << std::endl;
 
@@ -190,15 +203,37 @@ void IO::goodbye(Context &context) {
 
 }
 
-LoopPrint::LoopPrint(const std::string &task_, const std::string &step_,
-                     const int &numSteps_) {
-  if (!mpi->mpiHead())
-    return;
+namespace {
+// the region timing the MPI calls, see MPIcontroller::forEachChunk()
+const std::string communicationRegion = "MPI communication";
 
+double secondsBetween(const std::chrono::steady_clock::time_point &start,
+                      const std::chrono::steady_clock::time_point &end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+             .count() / 1e9;
+}
+} // namespace
+
+LoopPrint::LoopPrint(const std::string &task_, const std::string &step_,
+                     const int &numSteps_, const double &heartbeatInterval_) {
   task = task_;
   step = step_;
   numSteps = numSteps_;
 
+  // note: time returns the time (in secs) elapsed from 1st Jan 1970
+  initialTime = std::chrono::steady_clock::now();
+
+  // the heartbeat is only useful if there are other processes to monitor
+  if (heartbeatInterval_ > 0. && mpi->getSize() > 1) {
+    heartbeatInterval = heartbeatInterval_;
+    heartbeat = std::make_unique<MPIHeadWindow>(heartbeatSize);
+    initialCommunicationTime = Profiler::getRegionTime(communicationRegion);
+    sendHeartbeat(false);
+  }
+
+  if (!mpi->mpiHead())
+    return;
+
   int numRep = 10; // number of intermediate reports
   if (numSteps < numRep) {
     reportEvery = 1;
@@ -206,9 +241,6 @@ LoopPrint::LoopPrint(const std::string &task_, const std::string &step_,
     reportEvery = numSteps / numRep;
   }
 
-  // note: time returns the time (in secs) elapsed from 1st Jan 1970
-  initialTime = std::chrono::steady_clock::now();
-
   std::cout << "\n";
   std::cout << "Started " << task << " with " << numSteps << " " << step
             << "." << std::endl;
@@ -217,12 +249,20 @@ LoopPrint::LoopPrint(const std::string &task_, const std::string &step_,
 }
 
 void LoopPrint::update(const bool &withTimeEstimate) {
+  currentStep += 1;
+
+  if (heartbeat != nullptr && secondsBetween(lastHeartbeat,
+          std::chrono::steady_clock::now()) >= heartbeatInterval) {
+    sendHeartbeat(false);
+    if (mpi->mpiHead()) {
+      printHeartbeats();
+    }
+  }
+
   // Update prediction info for current task.
   if (!mpi->mpiHead())
     return;
 
-  currentStep += 1;
-
   if (currentStep <= 2 || (currentStep + 1) % reportEvery == 0 ||
       currentStep == numSteps - 1) {
 
@@ -268,15 +308,429 @@ void LoopPrint::update(const bool &withTimeEstimate) {
   }
 }
 
-void LoopPrint::close() {
+void LoopPrint::sendHeartbeat(const bool &loopDone) {
+  lastHeartbeat = std::chrono::steady_clock::now();
+  // update() is called at the beginning of each step
+  double stepsDone = loopDone ? numSteps : std::max(currentStep, 0);
+  heartbeat->put({1., stepsDone, double(numSteps),
+                  secondsBetween(initialTime, lastHeartbeat)});
+}
+
+void LoopPrint::printHeartbeats() {
+  std::vector<double> slots = heartbeat->read();
+  auto numProcesses = int(slots.size()) / heartbeatSize;
+  // the processes without steps are done, those which didn't report yet
+  // are at the beginning
+  std::vector<std::pair<double, int>> progress(numProcesses);
+  for (int i = 0; i < numProcesses; i++) {
+    const double *slot = slots.data() + i * heartbeatSize;
+    double fraction = 0.;
+    if (slot[0] > 0.) {
+      fraction = slot[2] > 0. ? slot[1] / slot[2] : 1.;
+    }
+    progress[i] = {fraction, i};
+  }
+  std::sort(progress.begin(), progress.end());
+
+  std::cout << "  progress of the " << numProcesses << " MPI processes: min "
+            << int(progress.front().first * 100.) << "%, median "
+            << int(progress[numProcesses / 2].first * 100.) << "%, max "
+            << int(progress.back().first * 100.) << "% | slowest:";
+  int numSlowest = std::min(3, numProcesses);
+  for (int i = 0; i < numSlowest; i++) {
+    std::cout << " rank " << progress[i].second << " ("
+              << int(progress[i].first * 100.) << "%)"
+              << (i < numSlowest - 1 ? "," : "");
+  }
+  std::cout << std::endl;
+}
+
+void LoopPrint::endLocalWork() {
+  localEndTime = std::chrono::steady_clock::now();
+  localWorkEnded = true;
+  if (heartbeat != nullptr) {
+    localCommunicationTime = Profiler::getRegionTime(communicationRegion) -
+                             initialCommunicationTime;
+    sendHeartbeat(true);
+  }
+}
+
+void LoopPrint::printLoadBalance(const time_point &closeTime) {
+  if (!localWorkEnded) {
+    endLocalWork();
+  }
+  // the communications done while waiting for the others count as waiting
+  double workTime = secondsBetween(initialTime, localEndTime);
+  double communicationTime = std::min(localCommunicationTime, workTime);
+  std::vector<double> times(3 * mpi->getSize(), 0.);
+  times[3 * mpi->getRank()] = workTime - communicationTime;
+  times[3 * mpi->getRank() + 1] = communicationTime;
+  times[3 * mpi->getRank() + 2] = secondsBetween(localEndTime, closeTime);
+  mpi->allReduceSum(&times);
   if (!mpi->mpiHead())
     return;
-  // print timing results
+
+  int numProcesses = mpi->getSize();
+  std::cout << "Time of the MPI processes in " << task
+            << " (min / average / max):\n";
+  const std::vector<std::string> names = {"computing", "communicating",
+                                          "waiting"};
+  double maxComputing = 0.;
+  double averageComputing = 0.;
+  for (int j = 0; j < 3; j++) {
+    double minTime = std::numeric_limits<double>::max();
+    double maxTime = 0.;
+    double sumTime = 0.;
+    int maxRank = 0;
+    for (int i = 0; i < numProcesses; i++) {
+      double t = times[3 * i + j];
+      minTime = std::min(minTime, t);
+      sumTime += t;
+      if (t > maxTime) {
+        maxTime = t;
+        maxRank = i;
+      }
+    }
+    std::cout << "  " << std::left << std::setw(14) << names[j] + ":"
+              << std::right << std::scientific << std::setprecision(2)
+              << minTime << " / " << sumTime / numProcesses << " / " << maxTime
+              << " s (max on rank " << maxRank << ")\n";
+    if (j == 0) {
+      maxComputing = maxTime;
+      averageComputing = sumTime / numProcesses;
+    }
+  }
+  std::cout << std::resetiosflags(std::cout.flags());
+  // a perfectly balanced loop has an imbalance of 1
+  if (averageComputing > 0.) {
+    Profiler::recordValue(task + " load imbalance",
+                          maxComputing / averageComputing);
+  }
+}
+
+void LoopPrint::close() {
   time_point currentTime;
   currentTime = std::chrono::steady_clock::now();
-  std::cout << "Elapsed time: " << std::setprecision(3)
-            << std::chrono::duration_cast<std::chrono::nanoseconds>(
-                currentTime - initialTime)
-                .count() / 1e9
+  if (heartbeat != nullptr) {
+    printLoadBalance(currentTime);
+    heartbeat.reset();
+  }
+  if (!mpi->mpiHead())
+    return;
+  // print timing results
+  double elapsedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           currentTime - initialTime).count() / 1e9;
+  std::cout << "Elapsed time: " << std::setprecision(3) << elapsedTime
             << " s." << std::endl;
+  Profiler::recordRegion(task, elapsedTime);
+}
+
+// state of the profiler
+namespace {
+struct RegionStats {
+  double numCalls = 0.;
+  double time = 0.;
+  double flops = 0.;
+  double bytes = 0.;
+};
+
+struct OpenRegion {
+  std::string name;
+  std::chrono::steady_clock::time_point startTime;
+};
+
+std::mutex profilerMutex;
+std::map<std::string, RegionStats> profilerRegions;
+std::map<std::string, double> profilerValues;
+// host memory at the end of each phase: largest RSS and peak RSS over the
+// processes, and total RSS
+struct HostMemoryPhase {
+  std::string phase;
+  double maxRss;
+  double maxPeakRss;
+  double totalRss;
+};
+std::vector<HostMemoryPhase> hostMemoryPhases;
+std::map<std::string, double> objectMemory;
+// regions are opened and closed on the same thread, so each thread keeps
+// its own stack of open regions
+thread_local std::vector<OpenRegion> openRegions;
+std::chrono::steady_clock::time_point profilerStartTime =
+    std::chrono::steady_clock::now();
+bool profilerHooksSet = false;
+// regions are keyed by name, work done outside any region ends up here
+const std::string outsideRegions = "(outside regions)";
+} // namespace
+
+static void pushRegionHook(const char *name) {
+  openRegions.push_back({name, std::chrono::steady_clock::now()});
+}
+
+static void popRegionHook() {
+  if (openRegions.empty()) return; // pushed before the hooks were set
+  OpenRegion region = openRegions.back();
+  openRegions.pop_back();
+  double elapsedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - region.startTime)
+                           .count() / 1e9;
+  Profiler::recordRegion(region.name, elapsedTime);
+}
+
+void Profiler::start() {
+  profilerStartTime = std::chrono::steady_clock::now();
+  // as for the memory hooks, we don't replace the ones of an external tool
+  if (!Kokkos::Tools::profileLibraryLoaded()) {
+    Kokkos::Tools::Experimental::set_push_region_callback(pushRegionHook);
+    Kokkos::Tools::Experimental::set_pop_region_callback(popRegionHook);
+    profilerHooksSet = true;
+  }
+}
+
+void Profiler::stop() {
+  if (profilerHooksSet) {
+    Kokkos::Tools::Experimental::set_push_region_callback(nullptr);
+    Kokkos::Tools::Experimental::set_pop_region_callback(nullptr);
+    profilerHooksSet = false;
+  }
+}
+
+void Profiler::addWork(const double &flops, const double &bytes) {
+  const std::string &name =
+      openRegions.empty() ? outsideRegions : openRegions.back().name;
+  std::lock_guard<std::mutex> lock(profilerMutex);
+  RegionStats &stats = profilerRegions[name];
+  stats.flops += flops;
+  stats.bytes += bytes;
+}
+
+void Profiler::recordRegion(const std::string &name, const double &seconds) {
+  std::lock_guard<std::mutex> lock(profilerMutex);
+  RegionStats &stats = profilerRegions[name];
+  stats.numCalls += 1.;
+  stats.time += seconds;
+}
+
+void Profiler::recordValue(const std::string &name, const double &value) {
+  std::lock_guard<std::mutex> lock(profilerMutex);
+  profilerValues[name] = value;
+}
+
+void Profiler::recordHostMemory(const std::string &phase) {
+  auto t = processMemory();
+  double maxRss = std::get<0>(t);
+  double maxPeakRss = std::get<1>(t);
+  double totalRss = maxRss;
+  mpi->allReduceMax(&maxRss);
+  mpi->allReduceMax(&maxPeakRss);
+  mpi->allReduceSum(&totalRss);
+  {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    hostMemoryPhases.push_back({phase, maxRss, maxPeakRss, totalRss});
+  }
+  if (mpi->mpiHead()) {
+    std::cout << "Host memory [" << phase << "]: " << std::setprecision(3)
+              << maxRss / 1.0e9 << " GB (peak " << maxPeakRss / 1.0e9
+              << " GB) on the largest MPI process, " << totalRss / 1.0e9
+              << " GB in total.\n" << std::endl;
+    std::cout << std::resetiosflags(std::cout.flags());
+  }
+}
+
+void Profiler::recordObjectMemory(const std::string &name,
+                                  const double &bytes) {
+  std::lock_guard<std::mutex> lock(profilerMutex);
+  double &memory = objectMemory[name];
+  memory = std::max(memory, bytes);
+}
+
+double Profiler::getRegionTime(const std::string &name) {
+  std::lock_guard<std::mutex> lock(profilerMutex);
+  auto it = profilerRegions.find(name);
+  return it == profilerRegions.end() ? 0. : it->second.time;
+}
+
+void Profiler::writeReport(const std::string &fileName) {
+  double wallTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - profilerStartTime)
+                        .count() / 1e9;
+
+  // the list of regions is the one of the head process
+  std::string namesList;
+  if (mpi->mpiHead()) {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    for (const auto &it : profilerRegions) {
+      namesList += it.first + "\n";
+    }
+  }
+  mpi->bcast(&namesList);
+  std::vector<std::string> names;
+  {
+    std::istringstream iss(namesList);
+    std::string name;
+    while (std::getline(iss, name)) {
+      names.push_back(name);
+    }
+  }
+
+  int numRegions = int(names.size());
+  std::vector<double> numCalls(numRegions, 0.);
+  std::vector<double> time(numRegions, 0.);
+  std::vector<double> flops(numRegions, 0.);
+  std::vector<double> bytes(numRegions, 0.);
+  {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    for (int i = 0; i < numRegions; i++) {
+      auto it = profilerRegions.find(names[i]);
+      if (it != profilerRegions.end()) {
+        numCalls[i] = it->second.numCalls;
+        time[i] = it->second.time;
+        flops[i] = it->second.flops;
+        bytes[i] = it->second.bytes;
+      }
+    }
+  }
+  // the processes that never entered a region don't enter the statistics
+  std::vector<double> numProcesses(numRegions, 0.);
+  std::vector<double> minTime(numRegions, 0.);
+  std::vector<double> maxTime = time;
+  std::vector<double> sumTime = time;
+  std::vector<double> sumFlops = flops;
+  std::vector<double> sumBytes = bytes;
+  for (int i = 0; i < numRegions; i++) {
+    if (numCalls[i] > 0.) {
+      numProcesses[i] = 1.;
+      minTime[i] = time[i];
+    } else {
+      minTime[i] = std::numeric_limits<double>::max();
+    }
+  }
+  mpi->allReduceSum(&numProcesses);
+  mpi->allReduceMin(&minTime);
+  mpi->allReduceMax(&maxTime);
+  mpi->allReduceSum(&sumTime);
+  mpi->allReduceSum(&sumFlops);
+  mpi->allReduceSum(&sumBytes);
+  mpi->allReduceMax(&wallTime);
+  double peakDeviceMemory = 0.;
+  bool deviceMemoryMeasured =
+      kokkosDeviceMemory != nullptr && kokkosDeviceMemory->isMemoryMeasured();
+  if (deviceMemoryMeasured) {
+    peakDeviceMemory = kokkosDeviceMemory->getPeakMemoryUsage();
+    mpi->allReduceMax(&peakDeviceMemory);
+  }
+
+  // the objects are those recorded by the head process, with the largest
+  // estimate over the processes
+  std::string objectsList;
+  if (mpi->mpiHead()) {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    for (const auto &it : objectMemory) {
+      objectsList += it.first + "\n";
+    }
+  }
+  mpi->bcast(&objectsList);
+  std::vector<std::string> objects;
+  {
+    std::istringstream iss(objectsList);
+    std::string name;
+    while (std::getline(iss, name)) {
+      objects.push_back(name);
+    }
+  }
+  std::vector<double> objectBytes(objects.size(), 0.);
+  {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    for (size_t i = 0; i < objects.size(); i++) {
+      auto it = objectMemory.find(objects[i]);
+      if (it != objectMemory.end()) {
+        objectBytes[i] = it->second;
+      }
+    }
+  }
+  mpi->allReduceMax(&objectBytes);
+
+  if (!mpi->mpiHead()) return;
+
+  if (!objects.empty()) {
+    std::cout << "Estimated host memory of the largest objects (largest over "
+                 "MPI processes):\n" << std::setprecision(3);
+    for (size_t i = 0; i < objects.size(); i++) {
+      std::cout << "  " << std::left << std::setw(32) << objects[i]
+                << std::right << objectBytes[i] / 1.0e9 << " GB\n";
+    }
+    std::cout << std::endl;
+    std::cout << std::resetiosflags(std::cout.flags());
+  }
+
+  nlohmann::json regions = nlohmann::json::array();
+  for (int i = 0; i < numRegions; i++) {
+    nlohmann::json region;
+    region["name"] = names[i];
+    region["numCalls"] = int(numCalls[i]);
+    region["time"] = time[i];
+    region["numProcesses"] = int(numProcesses[i]);
+    if (numProcesses[i] > 0.) {
+      region["minTime"] = minTime[i];
+      region["maxTime"] = maxTime[i];
+      region["averageTime"] = sumTime[i] / numProcesses[i];
+    }
+    // the rate is measured against the slowest process
+    if (sumFlops[i] > 0.) {
+      region["gflops"] = sumFlops[i] / 1.0e9;
+      if (maxTime[i] > 0.) {
+        region["gflopsPerSecond"] = sumFlops[i] / 1.0e9 / maxTime[i];
+      }
+    }
+    if (sumBytes[i] > 0.) {
+      region["gbytes"] = sumBytes[i] / 1.0e9;
+      if (maxTime[i] > 0.) {
+        region["gbytesPerSecond"] = sumBytes[i] / 1.0e9 / maxTime[i];
+      }
+      if (sumFlops[i] > 0.) {
+        region["arithmeticIntensity"] = sumFlops[i] / sumBytes[i];
+      }
+    }
+    regions.push_back(region);
+  }
+
+  nlohmann::json output;
+  output["phoebeVersion"] =
+      std::string(Phoebe_VERSION_MAJOR) + "." + Phoebe_VERSION_MINOR;
+  output["numMPIProcesses"] = mpi->getSize();
+  output["wallTime"] = wallTime;
+  output["timeUnit"] = "s";
+  output["regions"] = regions;
+  // the peak is the largest over the MPI processes
+  if (deviceMemoryMeasured) {
+    output["deviceMemory"] = kokkosDeviceMemory->getTotalMemory() / 1.0e9;
+    output["peakDeviceMemory"] = peakDeviceMemory / 1.0e9;
+    output["memoryUnit"] = "GB";
+  }
+  {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    if (!hostMemoryPhases.empty()) {
+      nlohmann::json phases = nlohmann::json::array();
+      for (const auto &it : hostMemoryPhases) {
+        nlohmann::json phase;
+        phase["phase"] = it.phase;
+        phase["maxRss"] = it.maxRss / 1.0e9;
+        phase["maxPeakRss"] = it.maxPeakRss / 1.0e9;
+        phase["totalRss"] = it.totalRss / 1.0e9;
+        phases.push_back(phase);
+      }
+      output["hostMemory"] = phases;
+      output["memoryUnit"] = "GB";
+    }
+    for (size_t i = 0; i < objects.size(); i++) {
+      output["objectMemory"][objects[i]] = objectBytes[i] / 1.0e9;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(profilerMutex);
+    for (const auto &it : profilerValues) {
+      output["values"][it.first] = it.second;
+    }
+  }
+  std::ofstream o(fileName);
+  o << std::setw(3) << output << std::endl;
 }
@@ -8,8 +8,10 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
 #include "context.h"
+#include "mpiController.h"
 
 /** class used to parse Phoebe command line arguments, and to redirect output
  * from std::cout to output-File
@@ -57,9 +59,14 @@ public:
    * These parameters will be inserted in the string:
    * "Started {task} with {numSteps} {step}." e.g.
    * "Started {q-point loop} with {100} {q-points}.".
+   * @param heartbeatInterval: if larger than zero, every MPI process records
+   * its progress every heartbeatInterval seconds, and the head process
+   * reports the progress of all processes. numSteps is then the number of
+   * steps done by this process, and the constructor, endLocalWork() and
+   * close() must be called by all MPI processes.
    */
   LoopPrint(const std::string &task, const std::string &step,
-            const int &numSteps);
+            const int &numSteps, const double &heartbeatInterval = 0.);
 
   /** Method to update on the progress of the loop
    * It must be called in the loop numSteps times.
@@ -68,7 +75,15 @@ public:
    */
   void update(const bool &withTimeEstimate=true);
 
+  /** Marks the end of the work of this MPI process in the loop. With the
+   * heartbeat, the time until close() is reported as time spent waiting for
+   * the other processes.
+   */
+  void endLocalWork();
+
   /** Close loopInfo and print summary of loop execution time.
+   * With the heartbeat, it also prints the time spent by the MPI processes
+   * working, communicating and waiting.
    */
   void close();
 
@@ -83,6 +98,99 @@ private:
   time_point initialTime;
   time_delta deltaTime;
   int stepDigits;
+
+  // progress of all MPI processes, written in the memory of the head
+  // process as (reported, steps done, numSteps, elapsed time)
+  static const int heartbeatSize = 4;
+  double heartbeatInterval = 0.;
+  std::unique_ptr<MPIHeadWindow> heartbeat;
+  time_point lastHeartbeat;
+  // the end of the work of this process, and the communication time then
+  time_point localEndTime;
+  bool localWorkEnded = false;
+  double initialCommunicationTime = 0.;
+  double localCommunicationTime = 0.;
+
+  void sendHeartbeat(const bool &loopDone);
+  void printHeartbeats();
+  void printLoadBalance(const time_point &closeTime);
+};
+
+/** Lightweight profiler, which collects the wall time spent in each of the
+ * regions marked with Kokkos::Profiling::pushRegion()/popRegion(), and in
+ * the loops timed by LoopPrint.
+ * The regions are recorded with the Kokkos profiling hooks, so no external
+ * Kokkos tool is needed. If a tool is loaded (KOKKOS_TOOLS_LIBS), the hooks
+ * are left to the tool, and only the LoopPrint timings are recorded.
+ * At the end of the run, writeReport() collects the timings of all MPI
+ * processes and writes them to a JSON file, together with the estimates of
+ * floating point operations and memory traffic of the main kernels, which
+ * are registered with addWork().
+ */
+class Profiler {
+public:
+  /** Sets the Kokkos hooks and starts the timer of the whole run.
+   * Called after Kokkos has been initialized.
+   */
+  static void start();
+
+  /** Removes the Kokkos hooks. Called before Kokkos is finalized.
+   */
+  static void stop();
+
+  /** Adds an estimate of the work done in the innermost region currently
+   * open on this thread.
+   * @param flops: number of floating point operations done on this process.
+   * @param bytes: number of bytes moved to or from memory on this process.
+   */
+  static void addWork(const double &flops, const double &bytes);
+
+  /** Records a call to a region timed elsewhere, e.g. by LoopPrint.
+   * @param name: name of the region.
+   * @param seconds: wall time spent in the region.
+   */
+  static void recordRegion(const std::string &name, const double &seconds);
+
+  /** Records a value to be written in the report, e.g. an estimate computed
+   * by the code. Only the values of the head process are reported.
+   * @param name: name of the value.
+   * @param value: the value, overwritten if recorded again.
+   */
+  static void recordValue(const std::string &name, const double &value);
+
+  /** Measures the host memory (resident set size, and its peak since the
+   * start of the run) of all MPI processes at the end of a phase of the
+   * calculation, and prints the largest values over the processes.
+   * The measurements also go in the report. Must be called by all MPI
+   * processes.
+   * @param phase: name of the phase just completed, e.g. "band structure".
+   */
+  static void recordHostMemory(const std::string &phase);
+
+  /** Records an estimate of the host memory used on this process by one of
+   * the large objects of the calculation, e.g. the force constants or the
+   * scattering matrix. If recorded several times, the largest estimate is
+   * kept. The estimates are printed and reported by writeReport().
+   * @param name: name of the object.
+   * @param bytes: memory of the object on this process, in bytes.
+   */
+  static void recordObjectMemory(const std::string &name, const double &bytes);
+
+  /** Returns the time spent so far by this process in a region, summed over
+   * its calls (0 if the region was never entered).
+   * @param name: name of the region.
+   */
+  static double getRegionTime(const std::string &name);
+
+  /** Writes the report with the timings to a JSON file.
+   * Must be called by all MPI processes. The regions reported are those
+   * recorded by the head process, with the number of calls and time of the
+   * head process, and the minimum, average and maximum time over the
+   * processes which entered the region.
+   * It also prints the estimates of the memory of the large objects.
+   * @param fileName: name of the JSON file.
+   */
+  static void writeReport(const std::string &fileName);
 };
 
 #endif
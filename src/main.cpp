@@ -1,8 +1,10 @@
 #include "app.h"
 #include "context.h"
+#include "farm.h"
 #include "io.h"
 #include "main.h"
 #include "mpi/mpiHelper.h"
+#include "parser.h"
 #include "common_kokkos.h"
 #include <Kokkos_Core.hpp>
 
@@ -14,6 +16,14 @@ int main(int argc, char **argv) {
   initMPI(argc, argv);
   initKokkos(argc, argv);
 
+  // in a job farm, the groups of processes run the inputs of a task list
+  if (mpi->isFarming()) {
+    runFarm(argc, argv);
+    deleteKokkos();
+    deleteMPI();
+    return (0);
+  }
+
   // setup input/output
   IO io(argc, argv);
   IO::welcome();
@@ -25,22 +35,32 @@ int main(int argc, char **argv) {
   // Read user input file
   Context context; // instantiate class container of the user input
   context.setupFromInput(io.getInputFileName()); // read the user input
-  context.printInputSummary(io.getInputFileName());
 
-  // decide which app to use
-  std::unique_ptr<App> app = App::loadApp(context.getAppName());
-  if (mpi->mpiHead()) {
-    std::cout << "Launching App \"" + context.getAppName() + "\".\n" << std::endl;
+  // the input may list several apps, which are run one after the other
+  std::vector<std::string> appNames = context.getAppNames();
+  if (appNames.empty()) { // let loadApp complain about the missing app
+    appNames.push_back(context.getAppName());
   }
+  for (const std::string &appName : appNames) {
+    context.setAppName(appName);
+    context.printInputSummary(io.getInputFileName());
+
+    // decide which app to use
+    std::unique_ptr<App> app = App::loadApp(appName);
+    if (mpi->mpiHead()) {
+      std::cout << "Launching App \"" + appName + "\".\n" << std::endl;
+    }
 
-  // check that the user passed all the necessary input
-  app->checkRequirements(context);
+    // check that the user passed all the necessary input
+    app->checkRequirements(context);
 
-  // launch it
-  app->run(context);
-  if (mpi->mpiHead()) {
-    std::cout << "Closing App \"" + context.getAppName() + "\".\n" << std::endl;
+    // launch it
+    app->run(context);
+    if (mpi->mpiHead()) {
+      std::cout << "Closing App \"" + appName + "\".\n" << std::endl;
+    }
   }
+  Parser::clearHarmonicCache();
 
   // exiting program
   IO::goodbye(context);
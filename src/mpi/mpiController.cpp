@@ -1,13 +1,43 @@
 #include "mpiController.h"
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <numeric>
+#include <queue>
+#include <string>
 #include <vector>
+#include "mpiHelper.h"
 #include "utilities.h"
 
 #ifdef MPI_AVAIL
 #include <mpi.h>
 #endif
 
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+// counts the NUMA domains of this node listed by the linux kernel
+static int countNumaDomains() {
+  int count = 0;
+#ifdef __linux__
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (dir != nullptr) {
+    while (dirent* entry = readdir(dir)) {
+      std::string name(entry->d_name);
+      if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+          name.find_first_not_of("0123456789", 4) == std::string::npos) {
+        count++;
+      }
+    }
+    closedir(dir);
+  }
+#endif
+  return std::max(1, count);
+}
+
 // default constructor
 MPIcontroller::MPIcontroller(int argc, char *argv[]) {
 
@@ -28,6 +58,34 @@ MPIcontroller::MPIcontroller(int argc, char *argv[]) {
   // get rank of current process
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+  // in a job farm, the processes are split in groups of consecutive ranks,
+  // which then behave as independent runs of Phoebe
+  for (int i=0; i<argc-1; i++) {
+    if (std::string(argv[i]) == "-ng" || std::string(argv[i]) == "-farmGroups") {
+      numFarmGroups = std::atoi(argv[i + 1]);
+    }
+  }
+  if (numFarmGroups < 1 || numFarmGroups > size) {
+    std::cout << "The number of farm groups must be between 1 and the # of "
+                 "MPI processes\n";
+    exit(1);
+  }
+  if (numFarmGroups > 1) {
+    // the counter of the tasks is shared by all groups
+    MPI_Aint counterBytes = rank == 0 ? sizeof(int) : 0;
+    MPI_Win_allocate(counterBytes, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD,
+                     &farmTaskCounter, &farmTaskWindow);
+    if (rank == 0) {
+      *farmTaskCounter = 0;
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    farmGroupId = int(size_t(rank) * numFarmGroups / size);
+    MPI_Comm_split(MPI_COMM_WORLD, farmGroupId, rank, &worldCommunicator);
+    MPI_Comm_size(worldCommunicator, &size);
+    MPI_Comm_rank(worldCommunicator, &rank);
+  }
+
   // create groups of MPI processes
 
   int tmpPoolSize = 1;
@@ -45,6 +103,9 @@ MPIcontroller::MPIcontroller(int argc, char *argv[]) {
       }
       tmpPoolSize = std::stoi(std::string(argv[i + 1]));
     }
+    if (std::string(argv[i]) == "-sm" || std::string(argv[i]) == "-sharedMemory") {
+      hasSharedMemory = true;
+    }
   }
   if (tmpPoolSize == 0) {
     std::cout << "poolSize must be at least 1\n";
@@ -60,7 +121,7 @@ MPIcontroller::MPIcontroller(int argc, char *argv[]) {
   poolId = rank / tmpPoolSize; // Determine color based on row
   // Split the communicator based on the color and use the
   // original rank for ordering
-  MPI_Comm_split(MPI_COMM_WORLD, poolId, rank, &intraPoolCommunicator);
+  MPI_Comm_split(worldCommunicator, poolId, rank, &intraPoolCommunicator);
   // initiate rank and size
   MPI_Comm_rank(intraPoolCommunicator, &poolRank);
   MPI_Comm_size(intraPoolCommunicator, &poolSize);
@@ -77,7 +138,21 @@ MPIcontroller::MPIcontroller(int argc, char *argv[]) {
   int color = mod(rank, poolSize); // Determine color based on columns
   // Split the communicator based on the color and use the
   // original rank for ordering
-  MPI_Comm_split(MPI_COMM_WORLD, color, rank, &interPoolCommunicator);
+  MPI_Comm_split(worldCommunicator, color, rank, &interPoolCommunicator);
+
+  // processes on the same node, used for the node-aware reductions
+  setupNodeCommunicators();
+
+  // processes that can share memory: those on the same node, which also
+  // have the same rank in the pool (and hence store the same data)
+  if (hasSharedMemory) {
+    MPI_Comm_split(nodeCommunicator, poolRank, rank, &sharedCommunicator);
+    MPI_Comm_rank(sharedCommunicator, &sharedRank);
+    MPI_Comm_split(worldCommunicator, sharedRank == 0 ? 0 : MPI_UNDEFINED, rank,
+                   &sharedHeadsCommunicator);
+  }
+
+  numNumaDomains = countNumaDomains();
 
   // start a timer
   startTime = MPI_Wtime();
@@ -91,6 +166,7 @@ MPIcontroller::MPIcontroller(int argc, char *argv[]) {
   startTime = std::chrono::steady_clock::now();
   poolSize = 1;
   poolRank = 0;
+  numNumaDomains = countNumaDomains();
 #endif
 
   // Print the starting time
@@ -106,7 +182,7 @@ const int MPIcontroller::worldComm = worldComm_;
 const int MPIcontroller::intraPoolComm = intraPoolComm_;
 const int MPIcontroller::interPoolComm = interPoolComm_;
 
-void MPIcontroller::finalize() const {
+void MPIcontroller::finalize() {
   if(mpiHead()) {
     // print date and time of run
     auto timenow = std::chrono::system_clock::to_time_t(
@@ -118,6 +194,35 @@ void MPIcontroller::finalize() const {
   if (mpiHead()) {
     fprintf(stdout, "Run time: %3f s\n", MPI_Wtime() - startTime);
   }
+  for (auto& window : sharedWindows) {
+    MPI_Win_free(&window.second);
+  }
+  sharedWindows.clear();
+  if (farmTaskWindow != MPI_WIN_NULL) {
+    // all the groups must be done with their tasks
+    MPI_Win win = farmTaskWindow;
+    MPI_Win_free(&win);
+  }
+  if (worldCommunicator != MPI_COMM_WORLD) {
+    MPI_Comm comm = worldCommunicator;
+    MPI_Comm_free(&comm);
+  }
+  if (sharedCommunicator != MPI_COMM_NULL) {
+    MPI_Comm comm = sharedCommunicator;
+    MPI_Comm_free(&comm);
+  }
+  if (sharedHeadsCommunicator != MPI_COMM_NULL) {
+    MPI_Comm comm = sharedHeadsCommunicator;
+    MPI_Comm_free(&comm);
+  }
+  if (nodeLeadersCommunicator != MPI_COMM_NULL) {
+    MPI_Comm comm = nodeLeadersCommunicator;
+    MPI_Comm_free(&comm);
+  }
+  if (nodeCommunicator != MPI_COMM_NULL) {
+    MPI_Comm comm = nodeCommunicator;
+    MPI_Comm_free(&comm);
+  }
   MPI_Finalize();
 #else
   std::cout << "Run time: "
@@ -154,17 +259,307 @@ void MPIcontroller::time() const {
             << " secs" << std::endl;
 #endif
 }
+void MPIcontroller::bcast(std::string* dataIn, const int& communicator,
+                          const int root) const {
+#ifdef MPI_AVAIL
+  if (size == 1) return;
+  // the other ranks don't know the length of the string in advance
+  size_t length = dataIn->size();
+  bcast(&length, communicator, root);
+  std::vector<char> buffer(dataIn->begin(), dataIn->end());
+  buffer.resize(length);
+  bcast(&buffer, communicator, root);
+  dataIn->assign(buffer.begin(), buffer.end());
+#else
+  (void)dataIn;
+  (void)communicator;
+  (void)root;
+#endif
+}
+
 // Asynchronous support functions -----------------------------------------
 void MPIcontroller::barrier() const {
 #ifdef MPI_AVAIL
   int errCode;
-  errCode = MPI_Barrier(MPI_COMM_WORLD);
+  errCode = MPI_Barrier(worldCommunicator);
+  if (errCode != MPI_SUCCESS) {
+    errorReport(errCode);
+  }
+#endif
+}
+
+// Job farm functions -----------------------------------------
+int MPIcontroller::nextFarmTask() const {
+  int task = 0;
+#ifdef MPI_AVAIL
+  if (farmTaskWindow == MPI_WIN_NULL) {
+    Error("Developer error: farm task requested without the -ng flag");
+  }
+  // the head of the group takes the next task, without the other groups
+  // having to take part
+  if (mpiHead()) {
+    const int one = 1;
+    MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, farmTaskWindow);
+    MPI_Fetch_and_op(&one, &task, MPI_INT, 0, 0, MPI_SUM, farmTaskWindow);
+    MPI_Win_unlock(0, farmTaskWindow);
+  }
+  bcast(&task);
+#endif
+  return task;
+}
+
+// Split world functions -----------------------------------------
+#ifdef MPI_AVAIL
+void MPIcontroller::setupNodeCommunicators() {
+  MPI_Comm_split_type(worldCommunicator, MPI_COMM_TYPE_SHARED, rank,
+                      MPI_INFO_NULL, &nodeCommunicator);
+  int nodeRank;
+  MPI_Comm_rank(nodeCommunicator, &nodeRank);
+  MPI_Comm_size(nodeCommunicator, &nodeSize);
+  MPI_Comm_split(worldCommunicator, nodeRank == 0 ? 0 : MPI_UNDEFINED, rank,
+                 &nodeLeadersCommunicator);
+  numNodes = nodeRank == 0 ? 1 : 0;
+  MPI_Allreduce(MPI_IN_PLACE, &numNodes, 1, MPI_INT, MPI_SUM, worldCommunicator);
+}
+#endif
+
+int MPIcontroller::splitWorld(const int& numGroups) {
+  if (numGroups < 1 || numGroups > size) {
+    Error("The number of groups must be between 1 and the # of MPI processes");
+  }
+  if (numSplitGroups > 1) {
+    Error("Developer error: the world communicator is already split");
+  }
+  if (numGroups == 1) {
+    return 0;
+  }
+#ifdef MPI_AVAIL
+  if (poolSize > 1 || hasSharedMemory) {
+    Error("Splitting the MPI processes in groups is not supported with the "
+          "-ps and -sm flags");
+  }
+  parentWorldCommunicator = worldCommunicator;
+  parentInterPoolCommunicator = interPoolCommunicator;
+  parentNodeCommunicator = nodeCommunicator;
+  parentNodeLeadersCommunicator = nodeLeadersCommunicator;
+  parentSize = size;
+  parentRank = rank;
+  parentNodeSize = nodeSize;
+  parentNumNodes = numNodes;
+
+  // same partition of consecutive ranks as the job farm
+  numSplitGroups = numGroups;
+  splitGroupId = int(size_t(rank) * numGroups / size);
+  MPI_Comm_split(parentWorldCommunicator, splitGroupId, rank,
+                 &worldCommunicator);
+  MPI_Comm_size(worldCommunicator, &size);
+  MPI_Comm_rank(worldCommunicator, &rank);
+  // without pools, the inter-pool communicator spans the world
+  MPI_Comm_split(worldCommunicator, 0, rank, &interPoolCommunicator);
+  setupNodeCommunicators();
+#endif
+  return splitGroupId;
+}
+
+void MPIcontroller::mergeWorld() {
+  if (numSplitGroups == 1) {
+    return;
+  }
+#ifdef MPI_AVAIL
+  MPI_Comm_free(&interPoolCommunicator);
+  MPI_Comm_free(&nodeCommunicator);
+  if (nodeLeadersCommunicator != MPI_COMM_NULL) {
+    MPI_Comm_free(&nodeLeadersCommunicator);
+  }
+  MPI_Comm_free(&worldCommunicator);
+
+  worldCommunicator = parentWorldCommunicator;
+  interPoolCommunicator = parentInterPoolCommunicator;
+  nodeCommunicator = parentNodeCommunicator;
+  nodeLeadersCommunicator = parentNodeLeadersCommunicator;
+  size = parentSize;
+  rank = parentRank;
+  nodeSize = parentNodeSize;
+  numNodes = parentNumNodes;
+  parentWorldCommunicator = MPI_COMM_NULL;
+  parentInterPoolCommunicator = MPI_COMM_NULL;
+  parentNodeCommunicator = MPI_COMM_NULL;
+  parentNodeLeadersCommunicator = MPI_COMM_NULL;
+#endif
+  numSplitGroups = 1;
+  splitGroupId = 0;
+  barrier();
+}
+
+// Shared memory functions -----------------------------------------
+void* MPIcontroller::allocateSharedMemory(const size_t& numBytes) {
+#ifdef MPI_AVAIL
+  if (!hasSharedMemory) {
+    Error("Developer error: shared memory requested without the -sm flag");
+  }
+  // only the first process allocates the memory
+  MPI_Aint localBytes = sharedRank == 0 ? MPI_Aint(numBytes) : 0;
+  void* data = nullptr;
+  MPI_Win win;
+  int errCode = MPI_Win_allocate_shared(localBytes, 1, MPI_INFO_NULL,
+                                        sharedCommunicator, &data, &win);
+  if (errCode != MPI_SUCCESS) {
+    errorReport(errCode);
+  }
+  // and the other processes get the address of its memory
+  MPI_Aint sharedBytes;
+  int dispUnit;
+  MPI_Win_shared_query(win, 0, &sharedBytes, &dispUnit, &data);
+  sharedWindows[data] = win;
+  return data;
+#else
+  (void)numBytes;
+  Error("Shared memory requires Phoebe built with MPI");
+  return nullptr;
+#endif
+}
+
+void MPIcontroller::freeSharedMemory(void* data) {
+#ifdef MPI_AVAIL
+  auto it = sharedWindows.find(data);
+  if (it == sharedWindows.end()) return;
+  int errCode = MPI_Win_free(&it->second);
+  if (errCode != MPI_SUCCESS) {
+    errorReport(errCode);
+  }
+  sharedWindows.erase(it);
+#else
+  (void)data;
+#endif
+}
+
+void MPIcontroller::sharedMemoryBarrier() const {
+#ifdef MPI_AVAIL
+  if (sharedCommunicator == MPI_COMM_NULL) return;
+  int errCode = MPI_Barrier(sharedCommunicator);
   if (errCode != MPI_SUCCESS) {
     errorReport(errCode);
   }
 #endif
 }
 
+// Node-aware and non-blocking reductions ---------------------------
+#ifdef MPI_AVAIL
+bool MPIcontroller::hierarchicalAllReduceSum(void* data, const int& count,
+                                             MPI_Datatype dataType) const {
+  // with a single node, or a single process per node, there's nothing
+  // to gain from the two levels
+  if (numNodes == 1 || nodeSize == 1) return false;
+  int typeSize;
+  MPI_Type_size(dataType, &typeSize);
+  if (double(count) * typeSize < hierarchicalThreshold) return false;
+
+  // first sum on the leader of each node, through shared memory
+  bool isLeader = nodeLeadersCommunicator != MPI_COMM_NULL;
+  int errCode = MPI_Reduce(isLeader ? MPI_IN_PLACE : data, data, count,
+                           dataType, MPI_SUM, 0, nodeCommunicator);
+  if (errCode != MPI_SUCCESS) {
+    errorReport(errCode);
+  }
+  // then only the leaders communicate across nodes
+  if (isLeader) {
+    errCode = MPI_Allreduce(MPI_IN_PLACE, data, count, dataType, MPI_SUM,
+                            nodeLeadersCommunicator);
+    if (errCode != MPI_SUCCESS) {
+      errorReport(errCode);
+    }
+  }
+  // and finally send the result to the other processes of the node
+  errCode = MPI_Bcast(data, count, dataType, 0, nodeCommunicator);
+  if (errCode != MPI_SUCCESS) {
+    errorReport(errCode);
+  }
+  return true;
+}
+#endif
+
+MPIRequest::MPIRequest(MPIRequest&& that) noexcept {
+#ifdef MPI_AVAIL
+  requests = std::move(that.requests);
+  that.requests.clear();
+#else
+  (void)that;
+#endif
+}
+
+MPIRequest& MPIRequest::operator=(MPIRequest&& that) noexcept {
+  if (this != &that) {
+    wait();
+#ifdef MPI_AVAIL
+    requests = std::move(that.requests);
+    that.requests.clear();
+#endif
+  }
+  return *this;
+}
+
+MPIRequest::~MPIRequest() { wait(); }
+
+void MPIRequest::wait() {
+#ifdef MPI_AVAIL
+  if (requests.empty()) return;
+  MPI_Waitall(int(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+  requests.clear();
+#endif
+}
+
+MPIHeadWindow::MPIHeadWindow(const int& numValues_) : numValues(numValues_) {
+#ifdef MPI_AVAIL
+  MPI_Comm comm = mpi->getComm();
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &numProcesses);
+  // only the head exposes memory, the other processes just access it
+  size_t numElements = rank == 0 ? size_t(numProcesses) * numValues : 0;
+  int errCode = MPI_Win_allocate(MPI_Aint(numElements * sizeof(double)),
+                                 sizeof(double), MPI_INFO_NULL,
+                                 comm, &data, &window);
+  if (errCode != MPI_SUCCESS) {
+    MPI_Abort(MPI_COMM_WORLD, errCode);
+  }
+  std::fill(data, data + numElements, 0.);
+  // no process writes before the head has initialized the slots
+  MPI_Barrier(comm);
+#else
+  data.resize(numValues, 0.);
+#endif
+}
+
+MPIHeadWindow::~MPIHeadWindow() {
+#ifdef MPI_AVAIL
+  MPI_Win_free(&window);
+#endif
+}
+
+void MPIHeadWindow::put(const std::vector<double>& values) {
+#ifdef MPI_AVAIL
+  // the slots don't overlap, so the processes can write at the same time
+  MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, window);
+  MPI_Put(values.data(), numValues, MPI_DOUBLE, 0,
+          MPI_Aint(rank) * numValues, numValues, MPI_DOUBLE, window);
+  MPI_Win_unlock(0, window);
+#else
+  std::copy(values.begin(), values.begin() + numValues, data.begin());
+#endif
+}
+
+std::vector<double> MPIHeadWindow::read() const {
+#ifdef MPI_AVAIL
+  std::vector<double> values(size_t(numProcesses) * numValues);
+  // the exclusive lock makes sure that no write is in progress
+  MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, window);
+  std::copy(data, data + values.size(), values.begin());
+  MPI_Win_unlock(0, window);
+  return values;
+#else
+  return data;
+#endif
+}
+
 // Labor division functions -----------------------------------------
 std::vector<size_t> MPIcontroller::divideWork(size_t numTasks) {
   // return a vector of the start and stop points for task division
@@ -198,6 +593,92 @@ std::vector<size_t> MPIcontroller::divideWorkIter(size_t numTasks, const int& co
   return divs;
 }
 
+std::vector<size_t> MPIcontroller::divideWorkIterWeighted(
+    const std::vector<double>& costs, const int& communicator) {
+  int rank_ = 0;
+  int size_ = 1;
+  if (communicator == worldComm) {
+    rank_ = rank;
+    size_ = size;
+  } else if (communicator == intraPoolComm) {
+    rank_ = poolRank;
+    size_ = poolSize;
+  } else {
+    Error("divideWorkIterWeighted called with invalid communicator");
+  }
+
+  // sort tasks by decreasing cost, ties are broken by the task index
+  std::vector<size_t> order(costs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](const size_t& a, const size_t& b) {
+                     return costs[a] > costs[b];
+                   });
+
+  // min-heap of (cost so far, rank)
+  std::priority_queue<std::pair<double, int>,
+                      std::vector<std::pair<double, int>>,
+                      std::greater<std::pair<double, int>>> loads;
+  for (int i = 0; i < size_; i++) {
+    loads.push(std::make_pair(0., i));
+  }
+  std::vector<size_t> divs;
+  for (size_t iTask : order) {
+    auto load = loads.top();
+    loads.pop();
+    if (load.second == rank_) {
+      divs.push_back(iTask);
+    }
+    load.first += costs[iTask];
+    loads.push(load);
+  }
+  std::sort(divs.begin(), divs.end());
+  return divs;
+}
+
+std::vector<size_t> MPIcontroller::divideWorkWeighted(
+    const std::vector<double>& costs, const int& communicator) {
+  int rank_ = 0;
+  int size_ = 1;
+  if (communicator == worldComm) {
+    rank_ = rank;
+    size_ = size;
+  } else if (communicator == intraPoolComm) {
+    rank_ = poolRank;
+    size_ = poolSize;
+  } else {
+    Error("divideWorkWeighted called with invalid communicator");
+  }
+
+  // a task belongs to the process whose share of the total cost contains
+  // the midpoint of the task in the cumulative cost
+  double totalCost = std::accumulate(costs.begin(), costs.end(), 0.);
+  if (totalCost <= 0.) {
+    // no cost estimate, fall back to the even division
+    size_t start = (costs.size() * rank_) / size_;
+    size_t stop = (costs.size() * (rank_ + 1)) / size_;
+    return {start, stop};
+  }
+  double shareBegin = totalCost * rank_ / size_;
+  double shareEnd = totalCost * (rank_ + 1) / size_;
+  size_t start = costs.size();
+  size_t stop = costs.size();
+  double cumulativeCost = 0.;
+  for (size_t i = 0; i < costs.size(); i++) {
+    double midpoint = cumulativeCost + 0.5 * costs[i];
+    if (start == costs.size() && midpoint >= shareBegin) {
+      start = i;
+    }
+    if (midpoint >= shareEnd && rank_ < size_ - 1) {
+      stop = i;
+      break;
+    }
+    cumulativeCost += costs[i];
+  }
+  stop = std::max(start, stop);
+  return {start, stop};
+}
+
 // Helper function to re-establish work divisions for MPI calls requiring
 // the number of tasks given to each point
 std::tuple<std::vector<int>, std::vector<int>>
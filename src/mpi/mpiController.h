@@ -1,8 +1,11 @@
 #ifndef MPI_CONTROLLER_H
 #define MPI_CONTROLLER_H
 
+#include <algorithm>
 #include <chrono>
 #include <complex>
+#include <map>
+#include <string>
 #include <vector>
 #include "eigen.h"
 #include <tuple>
@@ -23,6 +26,76 @@ functions here (see gather) operate under the
 assumption that they will gather using the same distribution of
  labor as divideWork provides.*/
 
+/** Handle to a non-blocking MPI communication, returned e.g. by
+ * MPIcontroller::iAllReduceSum(). The communication is completed by wait(),
+ * or at the latest when the handle is destroyed.
+ */
+class MPIRequest {
+ public:
+  MPIRequest() = default;
+#ifdef MPI_AVAIL
+  explicit MPIRequest(std::vector<MPI_Request> requests_)
+      : requests(std::move(requests_)) {}
+#endif
+  MPIRequest(const MPIRequest&) = delete;
+  MPIRequest& operator=(const MPIRequest&) = delete;
+  MPIRequest(MPIRequest&& that) noexcept;
+  MPIRequest& operator=(MPIRequest&& that) noexcept;
+  ~MPIRequest();
+
+  /** Blocks until the communication is completed.
+   * Does nothing if the communication was already completed.
+   */
+  void wait();
+
+ private:
+#ifdef MPI_AVAIL
+  // large arrays are communicated in several chunks
+  std::vector<MPI_Request> requests;
+#endif
+};
+
+/** Array of doubles in the memory of the head process, where each MPI process
+ * owns a slot of numValues doubles. The processes write their slot with
+ * one-sided communications, which don't need the head process to take part,
+ * and the head process can read the slots of all processes at any time.
+ * Used e.g. to monitor the progress of the processes during a loop, without
+ * synchronizing them.
+ * The constructor and destructor are collective over the world communicator.
+ */
+class MPIHeadWindow {
+ public:
+  /** Constructor.
+   * @param numValues: number of doubles in the slot of each process.
+   * The slots are initialized to zero.
+   */
+  explicit MPIHeadWindow(const int& numValues);
+  MPIHeadWindow(const MPIHeadWindow&) = delete;
+  MPIHeadWindow& operator=(const MPIHeadWindow&) = delete;
+  ~MPIHeadWindow();
+
+  /** Writes the slot of this process. The write is completed on return.
+   * @param values: vector of numValues doubles.
+   */
+  void put(const std::vector<double>& values);
+
+  /** Returns the slots of all processes, with the slot of process i in
+   * the elements [i*numValues, (i+1)*numValues). To be called by the head.
+   */
+  std::vector<double> read() const;
+
+ private:
+  int numValues;
+  int numProcesses = 1;
+  int rank = 0;
+#ifdef MPI_AVAIL
+  MPI_Win window = MPI_WIN_NULL;
+  double* data = nullptr;
+#else
+  std::vector<double> data;
+#endif
+};
+
 /** Class for handling the MPI library usage inside of phoebe.
  * We define 3 communicators.
  * 1) MPI_COMM_WORLD: this is the communicator involving all MPI processes
@@ -37,6 +110,10 @@ assumption that they will gather using the same distribution of
  * Note that in order for the `ps` flag to work, we require that all MPI
  * processes in the world communicator can be divided in the rectangle with no
  * MPI process left idle.
+ *
+ * In a job farm (-ng flag), the processes are first split in groups, each
+ * running its own calculations: the "world" communicator of Phoebe is then
+ * the one of the group, and all the communicators above are built within it.
  */
 class MPIcontroller {
  private:
@@ -52,10 +129,45 @@ class MPIcontroller {
   bool hasMPIPools = false;
   int poolRank = 0; // rank of the MPI process within the pool from 0 to poolSize
   int poolId = 0; // id of the pool
+  bool hasSharedMemory = false; // set with the -sm flag
+  int sharedRank = 0; // rank in the group of processes sharing memory
+  int nodeSize = 1; // number of processes on this node
+  int numNodes = 1; // number of nodes
+  int numNumaDomains = 1; // number of NUMA domains of this node
+  int numFarmGroups = 1; // number of groups of a job farm (-ng flag)
+  int farmGroupId = 0; // group of this process in the job farm
+  int numSplitGroups = 1; // number of groups of splitWorld()
+  int splitGroupId = 0; // group of this process in splitWorld()
 #ifdef MPI_AVAIL
   MPI_Comm intraPoolCommunicator;
   MPI_Comm interPoolCommunicator;
+  // all processes, or the processes of the group in a job farm
   MPI_Comm worldCommunicator = MPI_COMM_WORLD;
+  // in a job farm, counter of the next task, in the memory of the first
+  // process of MPI_COMM_WORLD
+  MPI_Win farmTaskWindow = MPI_WIN_NULL;
+  int* farmTaskCounter = nullptr;
+  // processes of the same node and with the same rank in the pool
+  MPI_Comm sharedCommunicator = MPI_COMM_NULL;
+  // the first process of each group sharing memory
+  MPI_Comm sharedHeadsCommunicator = MPI_COMM_NULL;
+  // the shared memory windows, by the address of their memory
+  std::map<void*, MPI_Win> sharedWindows;
+  // all processes of the same node, and the first process of each node
+  MPI_Comm nodeCommunicator = MPI_COMM_NULL;
+  MPI_Comm nodeLeadersCommunicator = MPI_COMM_NULL;
+  // the world before splitWorld(), restored by mergeWorld()
+  MPI_Comm parentWorldCommunicator = MPI_COMM_NULL;
+  MPI_Comm parentInterPoolCommunicator = MPI_COMM_NULL;
+  MPI_Comm parentNodeCommunicator = MPI_COMM_NULL;
+  MPI_Comm parentNodeLeadersCommunicator = MPI_COMM_NULL;
+  int parentSize = 1;
+  int parentRank = 0;
+  int parentNodeSize = 1;
+  int parentNumNodes = 1;
+  // messages smaller than this (in bytes) are latency bound, and the flat
+  // MPI_Allreduce is faster than the two-level one
+  static constexpr int hierarchicalThreshold = 65536;
 #endif
 
   // helper function used internally
@@ -69,6 +181,35 @@ class MPIcontroller {
    * @return
    */
   std::tuple<MPI_Comm, int> decideCommunicator(const int& communicator) const;
+
+  /** Node-aware in-place sum over the world communicator: the data is first
+   * reduced on the first process of each node, then summed across nodes
+   * by these leaders only, and finally broadcast within each node.
+   * Compared to a flat MPI_Allreduce, only one process per node sends data
+   * through the network.
+   * @return true if the reduction was done, false if the flat reduction
+   * should be used instead (a single node, one process per node, or a
+   * small message).
+   */
+  bool hierarchicalAllReduceSum(void* data, const int& count,
+                                MPI_Datatype dataType) const;
+
+  /** Builds the communicators of the processes on the same node of the
+   * world communicator, used by the node-aware reductions.
+   */
+  void setupNodeCommunicators();
+
+  // the largest number of elements passed to a single MPI call
+  static constexpr size_t maxChunkSize = size_t(1) << 30;
+
+  /** MPI calls take int counts, which overflow for arrays with more than
+   * 2^31 elements. This calls mpiCall(offset, chunkSize) on consecutive
+   * chunks of an array of count elements, each small enough for a single
+   * MPI call, and reports the errors.
+   * @param mpiCall: makes the MPI call on a chunk and returns its error code.
+   */
+  template <typename F>
+  void forEachChunk(const size_t& count, F mpiCall) const;
 #else
   std::chrono::steady_clock::time_point startTime;
 #endif
@@ -80,7 +221,7 @@ class MPIcontroller {
   MPIcontroller(int argc, char *argv[]);
 
   /** Calls finalize and potentially reports statistics */
-  void finalize() const;
+  void finalize();
 
   // Collective communications functions -----------------------------------
   /** Wrapper for the MPI_Broadcast function.
@@ -91,6 +232,14 @@ class MPIcontroller {
   template <typename T>
   void bcast(T* dataIn, const int& communicator=worldComm, const int root=-1) const;
 
+  /** Broadcast of a string, whose length may differ on the receiving ranks.
+   *  @param dataIn: pointer to the string to broadcast
+   *  @param communicator: Communicator over which to broacast
+   *  @param root: The root process. Automatically determined if <0.
+   */
+  void bcast(std::string* dataIn, const int& communicator=worldComm,
+             const int root=-1) const;
+
   /** Wrapper for MPI_Reduce in the case of a summation.
    * @param dataIn: pointer to sent data from each rank.
    * @param dataOut: pointer to buffer to receive summed data.
@@ -105,12 +254,23 @@ class MPIcontroller {
   template <typename T>
   void allReduceSum(T* dataIn, const int& communicator=worldComm) const;
 
+  /** Non-blocking version of the in-place allReduceSum.
+   * The reduction runs in the background: the caller can do other work
+   * that doesn't touch dataIn, and must call wait() on the returned
+   * request before reading or writing dataIn again.
+   * @param dataIn: pointer to the data, overwritten with the sum.
+   * @return request: handle to the pending reduction.
+   */
+  template <typename T>
+  MPIRequest iAllReduceSum(T* dataIn, const int& communicator=worldComm) const;
+
   /** Wrapper for MPI_Reduce in the case of a summation.
    * @param dataIn: pointer to sent data from each rank,
    *       also acts as a receive buffer, as reduce is implemented IP.
+   * @param root: the rank receiving the result. Defaults to the head if <0.
    */
   template <typename T>
-  void reduceSum(T* dataIn) const;
+  void reduceSum(T* dataIn, const int root=-1) const;
 
   /** Wrapper for MPI_Reduce which identifies the maximum of distributed data
    * @param dataIn: pointer to sent data from each rank.
@@ -138,7 +298,7 @@ class MPIcontroller {
    *       also acts as a receive buffer, as reduce is implemented IP.
    */
   template <typename T>
-  void allReduceMin(T* dataIn) const;
+  void allReduceMin(T* dataIn, const int& communicator=worldComm) const;
 
   /** Wrapper for MPI_Gatherv which collects data from different ranks
    * (with the possibility of a different number of elements from each
@@ -223,6 +383,55 @@ class MPIcontroller {
    */
   void barrier() const;
 
+  // Shared memory functions
+  /** Returns true if the user asked (with the -sm or -sharedMemory command
+   * line flag) to store the large tensors in memory shared by the MPI
+   * processes of a node.
+   */
+  bool useSharedMemory() const { return hasSharedMemory; }
+
+  /** Allocates an array in memory shared by the MPI processes of a node that
+   * have the same rank in the pool (and hence store the same part of the
+   * coupling tensors), using an MPI-3 shared memory window.
+   * The memory is allocated by the first of these processes (see
+   * isSharedMemoryHead()), and mapped by the others. This is a collective
+   * call over the processes sharing memory. The memory is released by
+   * freeSharedMemory(), or else by finalize().
+   * @param numBytes: the size of the array in bytes.
+   * @return a pointer to the shared array.
+   */
+  void* allocateSharedMemory(const size_t& numBytes);
+
+  /** Releases an array allocated with allocateSharedMemory(). This is a
+   * collective call over the processes sharing memory. Arrays already
+   * released by finalize() are ignored, so that it can be called by the
+   * destructors of objects outliving the MPI environment.
+   * @param data: the pointer returned by allocateSharedMemory().
+   */
+  void freeSharedMemory(void* data);
+
+  /** Returns true for the process that should write the shared arrays, i.e.
+   * the first of the processes sharing memory.
+   */
+  bool isSharedMemoryHead() const { return sharedRank == 0; }
+
+  /** MPI_Barrier over the processes sharing memory, to be called after the
+   * shared arrays have been written.
+   */
+  void sharedMemoryBarrier() const;
+
+  /** Sums an array allocated with allocateSharedMemory() over all the groups
+   * of processes sharing memory. Each process must have written its
+   * contribution in the shared array (different processes of a node writing
+   * different elements), and called sharedMemoryBarrier(). On exit, the
+   * array of every node contains the sum. Collective over the world
+   * communicator.
+   * @param data: pointer to the shared array.
+   * @param count: number of elements of the array.
+   */
+  template <typename T>
+  void allReduceSumSharedMemory(T* data, const size_t& count) const;
+
   // Utility functions -----------------------------------
   /** Simple function to tell us if this process is the head
    * @return isRank: returns true if this rank is the head.
@@ -238,6 +447,75 @@ class MPIcontroller {
   * command line varible */
   bool hasPools() const { return hasMPIPools; }
 
+  /** Returns true if the processes are split in the groups of a job farm,
+   * set with the -ng command line flag.
+   */
+  bool isFarming() const { return numFarmGroups > 1; }
+
+  /** Returns the number of groups of the job farm (1 without farming).
+   */
+  int getNumFarmGroups() const { return numFarmGroups; }
+
+  /** Returns the group of this process in the job farm.
+   */
+  int getFarmGroupId() const { return farmGroupId; }
+
+  /** Assigns the next task of the job farm to the group of this process,
+   * i.e. returns 0, 1, 2... across all the calls by all the groups, in the
+   * order in which the groups ask for a task. Collective over the group.
+   */
+  int nextFarmTask() const;
+
+  /** Splits the world communicator in numGroups groups of consecutive
+   * ranks, which behave as independent runs until mergeWorld() is called:
+   * the collective communications, and the BLACS grids of the matrices
+   * created in the meantime, only involve the processes of the group.
+   * Used to run different BTE solvers concurrently.
+   * Requires no pools and no shared memory. Collective over the world.
+   * @return the group of this process, from 0 to numGroups-1.
+   */
+  int splitWorld(const int& numGroups);
+
+  /** Restores the world communicator split by splitWorld().
+   * Collective over the processes of all groups.
+   */
+  void mergeWorld();
+
+  /** Returns the number of groups of splitWorld() (1 if not split).
+   */
+  int getNumSplitGroups() const { return numSplitGroups; }
+
+  /** Returns the group of this process in splitWorld().
+   */
+  int getSplitGroupId() const { return splitGroupId; }
+
+  /** Returns the rank in the world communicator, as it is before
+   * splitWorld(numGroups) or after mergeWorld(), of the first process of a
+   * group, e.g. to broadcast the results of that group to all processes.
+   */
+  int getSplitGroupHead(const int& groupId, const int& numGroups) const {
+    return (groupId * size + numGroups - 1) / numGroups;
+  }
+
+  /** Returns true if the world communicator of Phoebe is a subset of
+   * MPI_COMM_WORLD, i.e. in a job farm or after splitWorld().
+   */
+  bool isSubWorld() const { return numFarmGroups > 1 || numSplitGroups > 1; }
+
+  /** Returns the number of nodes, i.e. of groups of processes that can
+   * share memory.
+   */
+  int getNumNodes() const { return numNodes; }
+
+  /** Returns the number of MPI processes on the node of this process.
+   */
+  int getNodeSize() const { return nodeSize; }
+
+  /** Returns the number of NUMA domains of the node of this process, as
+   * reported by the operating system, or 1 if it can't be detected.
+   */
+  int getNumNumaDomains() const { return numNumaDomains; }
+
   /** Function to return the rank of a process.
    * @return rank: the rank of this process.
    */
@@ -276,7 +554,7 @@ class MPIcontroller {
       return interPoolCommunicator;
     } else {
       Error("Invalid communicator in getComm.");
-      return MPI_COMM_WORLD;
+      return worldCommunicator;
     }
   };
 #endif
@@ -300,6 +578,30 @@ class MPIcontroller {
    */
   std::vector<size_t> divideWorkIter(size_t numTasks, const int& communicator=worldComm);
 
+  /** Divides a set of tasks with different costs across the processes, so
+   * that each process receives approximately the same total cost.
+   * Starting from the most expensive task, tasks are assigned to the process
+   * with the smallest cost so far. The division is the same on all
+   * processes, and doesn't require communications.
+   * @param costs: the estimated cost of each task.
+   * @return divs: the (sorted) indices of the tasks of this process.
+   */
+  std::vector<size_t> divideWorkIterWeighted(const std::vector<double>& costs,
+                                     const int& communicator=worldComm);
+
+  /** Divides a set of tasks with different costs across the processes in
+   * contiguous ranges, so that each process receives approximately the same
+   * total cost. Use this instead of divideWorkIterWeighted() when the tasks
+   * of a process must be consecutive, e.g. to write a slice of a buffer.
+   * The division is the same on all processes, and doesn't require
+   * communications.
+   * @param costs: the estimated cost of each task.
+   * @return divs: returns a vector of length 2, containing start and stop
+   *       points for the tasks of this process, as in divideWork().
+   */
+  std::vector<size_t> divideWorkWeighted(const std::vector<double>& costs,
+                                         const int& communicator=worldComm);
+
   /** integer used to specify the call to MPI uses the world communicator.
    */
   static const int worldComm;
@@ -345,6 +647,7 @@ struct containerType;
   };
 
   // Use definition to generate containers for scalar types
+  MPIDataType(char, MPI_CHAR)
   MPIDataType(int, MPI_INT)
   MPIDataType(long, MPI_LONG)
   MPIDataType(unsigned int, MPI_UNSIGNED)
@@ -463,6 +766,22 @@ struct containerType;
 #endif
 }  // namespace mpiContainer
 
+#ifdef MPI_AVAIL
+template <typename F>
+void MPIcontroller::forEachChunk(const size_t& count, F mpiCall) const {
+  // timed as a region, for the communication time in performance reports
+  Kokkos::Profiling::pushRegion("MPI communication");
+  for (size_t offset = 0; offset < count; offset += maxChunkSize) {
+    int chunkSize = int(std::min(maxChunkSize, count - offset));
+    int errCode = mpiCall(offset, chunkSize);
+    if (errCode != MPI_SUCCESS) {
+      errorReport(errCode);
+    }
+  }
+  Kokkos::Profiling::popRegion();
+}
+#endif
+
 // Collective communications functions -----------------------------------
 template <typename T>
 void MPIcontroller::bcast(T* dataIn, const int& communicator, const int root) const {
@@ -477,12 +796,13 @@ void MPIcontroller::bcast(T* dataIn, const int& communicator, const int root) co
 
   broadcasterId = root < 0 ? broadcasterId : root;
 
-  int errCode = MPI_Bcast(containerType<T>::getAddress(dataIn),
-                      containerType<T>::getSize(dataIn),
-                      containerType<T>::getMPItype(), broadcasterId, comm);
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Bcast(address + offset, count,
+                                  containerType<T>::getMPItype(),
+                                  broadcasterId, comm);
+               });
  #else
  (void)dataIn;
  (void)communicator;
@@ -490,28 +810,41 @@ void MPIcontroller::bcast(T* dataIn, const int& communicator, const int root) co
 }
 
 template <typename T>
-void MPIcontroller::reduceSum(T* dataIn) const {
+void MPIcontroller::allReduceSumSharedMemory(T* data,
+                                             const size_t& count) const {
+  using namespace mpiContainer;
+#ifdef MPI_AVAIL
+  // only the owners of the shared arrays communicate
+  if (sharedHeadsCommunicator == MPI_COMM_NULL) return;
+  forEachChunk(count, [&](const size_t& offset, const int& chunk) {
+    return MPI_Allreduce(MPI_IN_PLACE, data + offset, chunk,
+                         containerType<T>::getMPItype(), MPI_SUM,
+                         sharedHeadsCommunicator);
+  });
+#else
+  (void)data;
+  (void)count;
+#endif
+}
+
+template <typename T>
+void MPIcontroller::reduceSum(T* dataIn, const int root) const {
   using namespace mpiContainer;
   #ifdef MPI_AVAIL
   if (size == 1) return;
-  int errCode;
-
-  if (rank == 0) {
-    errCode =
-        MPI_Reduce(MPI_IN_PLACE, containerType<T>::getAddress(dataIn),
-                   containerType<T>::getSize(dataIn),
-                   containerType<T>::getMPItype(), MPI_SUM, mpiHeadId, MPI_COMM_WORLD);
-  } else {
-    errCode = MPI_Reduce(
-        containerType<T>::getAddress(dataIn),
-        containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
-        containerType<T>::getMPItype(), MPI_SUM, mpiHeadId, MPI_COMM_WORLD);
-  }
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  int rootId = root < 0 ? mpiHeadId : root;
+
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Reduce(
+                     rank == rootId ? MPI_IN_PLACE : address + offset,
+                     address + offset, count, containerType<T>::getMPItype(),
+                     MPI_SUM, rootId, worldCommunicator);
+               });
   #else
   (void)dataIn;
+  (void)root;
   #endif
 }
 
@@ -520,15 +853,15 @@ void MPIcontroller::allReduceSum(T* dataIn, T* dataOut) const {
   using namespace mpiContainer;
 #ifdef MPI_AVAIL
   if (size == 1) return;
-  int errCode;
 
-  errCode = MPI_Allreduce(
-      containerType<T>::getAddress(dataIn),
-      containerType<T>::getAddress(dataOut), containerType<T>::getSize(dataIn),
-      containerType<T>::getMPItype(), MPI_SUM, MPI_COMM_WORLD);
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  auto addressIn = containerType<T>::getAddress(dataIn);
+  auto addressOut = containerType<T>::getAddress(dataOut);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Allreduce(addressIn + offset, addressOut + offset,
+                                      count, containerType<T>::getMPItype(),
+                                      MPI_SUM, worldCommunicator);
+               });
 #else
   pointerSwap(dataIn, dataOut);  // just switch the pointers in serial case
 #endif
@@ -539,22 +872,15 @@ void MPIcontroller::reduceMax(T* dataIn) const {
   using namespace mpiContainer;
   #ifdef MPI_AVAIL
   if (size == 1) return;
-  int errCode;
 
-  if (rank == 0) {
-    errCode =
-        MPI_Reduce(MPI_IN_PLACE, containerType<T>::getAddress(dataIn),
-                   containerType<T>::getSize(dataIn),
-                   containerType<T>::getMPItype(), MPI_MAX, mpiHeadId, MPI_COMM_WORLD);
-  } else {
-    errCode = MPI_Reduce(
-        containerType<T>::getAddress(dataIn),
-        containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
-        containerType<T>::getMPItype(), MPI_MAX, mpiHeadId, MPI_COMM_WORLD);
-  }
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Reduce(
+                     rank == mpiHeadId ? MPI_IN_PLACE : address + offset,
+                     address + offset, count, containerType<T>::getMPItype(),
+                     MPI_MAX, mpiHeadId, worldCommunicator);
+               });
   #else
   (void)dataIn;
   #endif
@@ -569,19 +895,51 @@ void MPIcontroller::allReduceSum(T* dataIn, const int& communicator) const {
 
   MPI_Comm comm = std::get<0>(decideCommunicator(communicator));
 
-  int errCode =
-      MPI_Allreduce(MPI_IN_PLACE, containerType<T>::getAddress(dataIn),
-                    containerType<T>::getSize(dataIn),
-                    containerType<T>::getMPItype(), MPI_SUM, comm);
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 if (communicator == worldComm &&
+                     hierarchicalAllReduceSum(address + offset, count,
+                                              containerType<T>::getMPItype())) {
+                   return int(MPI_SUCCESS);
+                 }
+                 return MPI_Allreduce(MPI_IN_PLACE, address + offset, count,
+                                      containerType<T>::getMPItype(), MPI_SUM,
+                                      comm);
+               });
   #else
   (void)dataIn;
   (void)communicator;
   #endif
 }
 
+template <typename T>
+MPIRequest MPIcontroller::iAllReduceSum(T* dataIn,
+                                       const int& communicator) const {
+  using namespace mpiContainer;
+  #ifdef MPI_AVAIL
+  if (size == 1) return {};
+  if (communicator == intraPoolComm && poolSize == 1) return {};
+
+  MPI_Comm comm = std::get<0>(decideCommunicator(communicator));
+
+  std::vector<MPI_Request> requests;
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 requests.emplace_back();
+                 return MPI_Iallreduce(MPI_IN_PLACE, address + offset, count,
+                                       containerType<T>::getMPItype(), MPI_SUM,
+                                       comm, &requests.back());
+               });
+  return MPIRequest(std::move(requests));
+  #else
+  (void)dataIn;
+  (void)communicator;
+  return {};
+  #endif
+}
+
 template <typename T>
 void MPIcontroller::allReduceMax(T* dataIn, const int& communicator) const {
   using namespace mpiContainer;
@@ -591,13 +949,13 @@ void MPIcontroller::allReduceMax(T* dataIn, const int& communicator) const {
 
   MPI_Comm comm = std::get<0>(decideCommunicator(communicator));
 
-  int errCode =
-      MPI_Allreduce(MPI_IN_PLACE, containerType<T>::getAddress(dataIn),
-                    containerType<T>::getSize(dataIn),
-                    containerType<T>::getMPItype(), MPI_MAX, comm);
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Allreduce(MPI_IN_PLACE, address + offset, count,
+                                      containerType<T>::getMPItype(), MPI_MAX,
+                                      comm);
+               });
   #else
   (void)dataIn;
   (void)communicator;
@@ -608,44 +966,40 @@ template <typename T>
 void MPIcontroller::reduceMin(T* dataIn) const {
   using namespace mpiContainer;
   #ifdef MPI_AVAIL
-
   if (size == 1) return;
-  int errCode;
 
-  if (rank == 0) {
-    errCode =
-        MPI_Reduce(MPI_IN_PLACE, containerType<T>::getAddress(dataIn),
-                   containerType<T>::getSize(dataIn),
-                   containerType<T>::getMPItype(), MPI_MIN, mpiHeadId, MPI_COMM_WORLD);
-  } else {
-    errCode = MPI_Reduce(
-        containerType<T>::getAddress(dataIn),
-        containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
-        containerType<T>::getMPItype(), MPI_MIN, mpiHeadId, MPI_COMM_WORLD);
-  }
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Reduce(
+                     rank == mpiHeadId ? MPI_IN_PLACE : address + offset,
+                     address + offset, count, containerType<T>::getMPItype(),
+                     MPI_MIN, mpiHeadId, worldCommunicator);
+               });
   #else
   (void)dataIn;
   #endif
 }
 
 template <typename T>
-void MPIcontroller::allReduceMin(T* dataIn) const {
+void MPIcontroller::allReduceMin(T* dataIn, const int& communicator) const {
   using namespace mpiContainer;
   #ifdef MPI_AVAIL
   if (size == 1) return;
-  int errCode;
-  errCode =
-      MPI_Allreduce(MPI_IN_PLACE, containerType<T>::getAddress(dataIn),
-                    containerType<T>::getSize(dataIn),
-                    containerType<T>::getMPItype(), MPI_MIN, MPI_COMM_WORLD);
-  if (errCode != MPI_SUCCESS) {
-    errorReport(errCode);
-  }
+  if (communicator == intraPoolComm && poolSize == 1) return;
+
+  MPI_Comm comm = std::get<0>(decideCommunicator(communicator));
+
+  auto address = containerType<T>::getAddress(dataIn);
+  forEachChunk(containerType<T>::getSize(dataIn),
+               [&](const size_t& offset, const int& count) {
+                 return MPI_Allreduce(MPI_IN_PLACE, address + offset, count,
+                                      containerType<T>::getMPItype(), MPI_MIN,
+                                      comm);
+               });
   #else
   (void)dataIn;
+  (void)communicator;
   #endif
 }
 
@@ -678,7 +1032,11 @@ void MPIcontroller::gatherv(T* dataIn, V* dataOut) const {
   // calculate the number of elements coming from each process
   // this will correspond to the save division of elements
   // as divideWorkIter provides.
-  int numTasks = containerType<V>::getSize(dataOut);
+  size_t numTasks = containerType<V>::getSize(dataOut);
+  if (numTasks > maxChunkSize) {
+    Error("Developer error: gatherv on more than 2^30 elements, "
+          "use bigAllGatherV instead.");
+  }
   auto tup = workDivHelper(numTasks);
   std::vector<int> workDivs = std::get<0>(tup);
   std::vector<int> workDivisionHeads = std::get<1>(tup);
@@ -687,7 +1045,7 @@ void MPIcontroller::gatherv(T* dataIn, V* dataOut) const {
       containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
       containerType<T>::getMPItype(), containerType<V>::getAddress(dataOut),
       workDivs.data(), workDivisionHeads.data(), containerType<V>::getMPItype(),
-      mpiHeadId, MPI_COMM_WORLD);
+      mpiHeadId, worldCommunicator);
   if (errCode != MPI_SUCCESS) {
     errorReport(errCode);
   }
@@ -706,7 +1064,7 @@ void MPIcontroller::gather(T* dataIn, V* dataOut) const {
       containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
       containerType<T>::getMPItype(), containerType<V>::getAddress(dataOut),
       containerType<T>::getSize(dataIn), containerType<V>::getMPItype(),
-      mpiHeadId, MPI_COMM_WORLD);
+      mpiHeadId, worldCommunicator);
   if (errCode != MPI_SUCCESS) {
     errorReport(errCode);
   }
@@ -732,6 +1090,18 @@ void MPIcontroller::allGatherv(T* dataIn, V* dataOut) const {
   // this will correspond to the save division of elements
   // as divideWorkIter provides.
   size_t numTasks = containerType<V>::getSize(dataOut);
+  if (numTasks > maxChunkSize) {
+    // the int displacements would overflow, use point-to-point messages
+    std::vector<size_t> bigWorkDivs(size), bigWorkDivisionHeads(size);
+    for (int i = 0; i < size; i++) {
+      bigWorkDivisionHeads[i] = (numTasks * i) / size;
+      bigWorkDivs[i] = (numTasks * (i + 1)) / size - bigWorkDivisionHeads[i];
+    }
+    bigAllGatherV(containerType<T>::getAddress(dataIn),
+                  containerType<V>::getAddress(dataOut), bigWorkDivs,
+                  bigWorkDivisionHeads);
+    return;
+  }
   auto tup = workDivHelper(numTasks);
   std::vector<int> workDivs = std::get<0>(tup);
   std::vector<int> workDivisionHeads = std::get<1>(tup);
@@ -740,7 +1110,7 @@ void MPIcontroller::allGatherv(T* dataIn, V* dataOut) const {
       containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
       containerType<T>::getMPItype(), containerType<V>::getAddress(dataOut),
       workDivs.data(), workDivisionHeads.data(), containerType<V>::getMPItype(),
-      MPI_COMM_WORLD);
+      worldCommunicator);
   if (errCode != MPI_SUCCESS) {
     errorReport(errCode);
   }
@@ -758,11 +1128,21 @@ void MPIcontroller::allGather(T* dataIn, V* dataOut, const int& communicator) co
   auto t = decideCommunicator(communicator);
   MPI_Comm comm = std::get<0>(t);
 
-  errCode = MPI_Allgather(
-      containerType<T>::getAddress(dataIn), containerType<T>::getSize(dataIn),
-      containerType<T>::getMPItype(), containerType<V>::getAddress(dataOut),
-      containerType<T>::getSize(dataIn), containerType<V>::getMPItype(),
-      comm);
+  size_t count = containerType<T>::getSize(dataIn);
+  if (count > maxChunkSize) {
+    // each process sends one element of a datatype spanning its block
+    MPI_Datatype container;
+    datatypeHelper(&container, count, containerType<T>::getAddress(dataIn));
+    errCode = MPI_Allgather(containerType<T>::getAddress(dataIn), 1,
+                            container, containerType<V>::getAddress(dataOut),
+                            1, container, comm);
+    MPI_Type_free(&container);
+  } else {
+    errCode = MPI_Allgather(
+        containerType<T>::getAddress(dataIn), int(count),
+        containerType<T>::getMPItype(), containerType<V>::getAddress(dataOut),
+        int(count), containerType<V>::getMPItype(), comm);
+  }
   if (errCode != MPI_SUCCESS) {
     errorReport(errCode);
   }
@@ -1,10 +1,16 @@
 #include "mpiHelper.h"
 #include <iostream>
+#include <string>
+#include <thread>
 
 #ifdef OMP_AVAIL
 #include "omp.h"
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 MPIcontroller *mpi = nullptr;
 
 // A function to set up the mpi env by creating the controller object.
@@ -18,6 +24,21 @@ void deleteMPI() {
 }
 
 void parallelInfo() {
+  int numThreads = 1;
+#ifdef OMP_AVAIL
+  numThreads = omp_get_max_threads();
+#endif
+  // the smallest number of cores a process is bound to by the launcher
+  int numBoundCores = int(std::thread::hardware_concurrency());
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+    numBoundCores = CPU_COUNT(&cpuSet);
+  }
+#endif
+  mpi->allReduceMin(&numBoundCores);
+
   if (mpi->mpiHead()) {
     std::cout << "Initialized with:\n";
 #ifdef MPI_AVAIL
@@ -26,9 +47,38 @@ void parallelInfo() {
     } else {
       std::cout << "MPI Processes " << mpi->getSize() << std::endl;
     }
+    std::cout << "Nodes " << mpi->getNumNodes() << " ("
+              << mpi->getNodeSize() << " processes on the first node)"
+              << std::endl;
 #endif
 #ifdef OMP_AVAIL
     std::cout << "OMP Threads " << omp_get_max_threads() << std::endl;
 #endif
+    std::cout << "NUMA domains per node " << mpi->getNumNumaDomains()
+              << std::endl;
+  }
+
+  // the binding chosen by the launcher can make a large difference
+  int numHardwareThreads = int(std::thread::hardware_concurrency());
+  if (numBoundCores > 0 && numThreads > numBoundCores) {
+    Warning("Each MPI process runs " + std::to_string(numThreads) +
+            " OpenMP threads, but some are bound to only " +
+            std::to_string(numBoundCores) + " cores.\n"
+            "Bind each process to at least OMP_NUM_THREADS cores, "
+            "e.g. with srun --cpus-per-task or mpirun --map-by ...:PE=N.");
+  } else if (numHardwareThreads > 0 &&
+             mpi->getNodeSize() * numThreads > numHardwareThreads) {
+    Warning("The first node is oversubscribed: " +
+            std::to_string(mpi->getNodeSize()) + " MPI processes x " +
+            std::to_string(numThreads) + " OpenMP threads on " +
+            std::to_string(numHardwareThreads) + " hardware threads.");
+  }
+  if (numThreads > 1 && mpi->getNumNumaDomains() > 1 &&
+      mpi->getNodeSize() % mpi->getNumNumaDomains() != 0) {
+    Warning("The " + std::to_string(mpi->getNodeSize()) +
+            " MPI processes per node can't be evenly placed on the " +
+            std::to_string(mpi->getNumNumaDomains()) + " NUMA domains.\n"
+            "Running one or more processes per NUMA domain, with the threads "
+            "of a process in the same domain, is usually faster.");
   }
 }
@@ -31,6 +31,8 @@ void ElectronViscosity::calcRTA(VectorBTE &tau) {
 
   std::vector<int> iss = bandStructure.parallelIrrStateIterator();
   int niss = iss.size();
+  // getPoints() returns a copy, which we don't make for every state
+  Points points = bandStructure.getPoints();
 
   Kokkos::View<double*****, Kokkos::LayoutLeft, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>> tensordxdxdxd_k(tensordxdxdxd.data(), numCalculations, dimensionality, dimensionality, dimensionality, dimensionality);
   Kokkos::Experimental::ScatterView<double*****, Kokkos::LayoutLeft, Kokkos::HostSpace> scatter_tensordxdxdxd(tensordxdxdxd_k);
@@ -46,11 +48,11 @@ void ElectronViscosity::calcRTA(VectorBTE &tau) {
     auto velIrr = bandStructure.getGroupVelocity(isIdx);
     auto kIrr = bandStructure.getWavevector(isIdx);
 
-    auto rotations = bandStructure.getRotationsStar(isIdx);
-    for (const Eigen::Matrix3d& rotation : rotations) {
+    for (int iRot : bandStructure.getRotationIndicesStar(isIdx)) {
+      const Eigen::Matrix3d &rotation = bandStructure.getRotationMatrix(iRot);
 
       Eigen::Vector3d kPt = rotation * kIrr;
-      kPt = bandStructure.getPoints().bzToWs(kPt,Points::cartesianCoordinates);
+      kPt = points.bzToWs(kPt,Points::cartesianCoordinates);
       Eigen::Vector3d vel = rotation * velIrr;
 
       for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
@@ -107,55 +109,46 @@ void ElectronViscosity::calcFromRelaxons(Eigen::VectorXd &eigenvalues, ParallelM
   double kBT = calcStat.temperature;
   double chemPot = calcStat.chemicalPotential;
 
-  // print info about the special eigenvectors
-  // and save the indices that need to be skipped
-  relaxonEigenvectorsCheck(eigenvectors, numRelaxons);
-
-  // transform from the relaxon population basis to the electron population ------------
-  Eigen::Tensor<double, 3> fRelaxons(3, 3, numStates);
-  fRelaxons.setZero();
-  for (auto tup0 : eigenvectors.getAllLocalStates()) {
-
-    int is = std::get<0>(tup0);
-    int alpha = std::get<1>(tup0);
-    if (eigenvalues(alpha) <= 0. || alpha >= numRelaxons) { continue; }
-    if (alpha == alpha0 || alpha == alpha_e) continue; // skip the energy eigenvector
-
+  // all the projections on the relaxon eigenvectors are done with a single
+  // distributed product, stacking as columns of x the special eigenvectors
+  // theta0 and theta_e and the driving terms of the viscosity
+  int numSpecial = 2;
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates, numSpecial + 9);
+  x.col(0) = theta0;
+  x.col(1) = theta_e;
+#pragma omp parallel for default(none) shared(x, numStates, numSpecial, particle, kBT, chemPot)
+  for (int is = 0; is < numStates; is++) {
     StateIndex isIdx(is);
     Eigen::Vector3d kPt = bandStructure.getWavevector(isIdx);
     kPt = bandStructure.getPoints().bzToWs(kPt,Points::cartesianCoordinates);
     Eigen::Vector3d vel = bandStructure.getGroupVelocity(isIdx);
     double en = bandStructure.getEnergy(isIdx);
     double pop = particle.getPopPopPm1(en, kBT, chemPot);
-    // true sets a sqrt term
     for (int k = 0; k < dimensionality; k++) {
       for (int l = 0; l < dimensionality; l++) {
-        fRelaxons(k, l, alpha) += kPt(k) * vel(l) * sqrt(pop) / kBT /
-                                  eigenvalues(alpha) * eigenvectors(is, alpha);
+        x(is, numSpecial + k + 3 * l) = kPt(k) * vel(l) * sqrt(pop) / kBT;
       }
     }
   }
-  mpi->allReduceSum(&fRelaxons);
-
-  //if(mpi->mpiHead()) std::cout << "about to switch to relaxon populations " << std::endl;
+  Eigen::MatrixXd projections = eigenvectors.projectColumns(x, numRelaxons);
 
-  // transform from relaxon to electron populations
-  Eigen::Tensor<double, 3> f(3, 3, bandStructure.getNumStates());
-  f.setZero();
-  for (auto tup0 : eigenvectors.getAllLocalStates()) {
-
-    int is = std::get<0>(tup0);
-    int alpha = std::get<1>(tup0);
-    if (eigenvalues(alpha) <= 0. || alpha >= numRelaxons) { continue; }
-    if (alpha == alpha0 || alpha == alpha_e) continue; // skip the energy eigenvector
-
-    for (int i : {0, 1, 2}) {
-      for (int j : {0, 1, 2}) {
-        f(i, j, is) += eigenvectors(is, alpha) * fRelaxons(i, j, alpha);
-      }
+  // print info about the special eigenvectors
+  // and save the indices that need to be skipped
+  Eigen::MatrixXd prodThetas = projections.leftCols(numSpecial);
+  genericRelaxonEigenvectorsCheck(prodThetas, particle, alpha0, alpha_e);
+
+  // relaxon populations, f_alpha = theta_alpha^T x / lambda_alpha
+  Eigen::MatrixXd fRelaxons = projections.rightCols(9);
+  for (int alpha = 0; alpha < numRelaxons; alpha++) {
+    if (eigenvalues(alpha) <= 0. || alpha == alpha0 || alpha == alpha_e) {
+      fRelaxons.row(alpha).setZero(); // skip the energy eigenvector
+    } else {
+      fRelaxons.row(alpha) /= eigenvalues(alpha);
     }
   }
-  mpi->allReduceSum(&f);
+
+  // transform from relaxon to electron populations, f(is, k + 3 * l)
+  Eigen::MatrixXd f = eigenvectors.combineColumns(fRelaxons);
 
   // calculate the final viscosity --------------------------
   double norm = 1. / volume / Nk;
@@ -176,7 +169,7 @@ void ElectronViscosity::calcFromRelaxons(Eigen::VectorXd &eigenvalues, ParallelM
             // note: the sqrt(pop) is to rescale the population from the symmetrized exact BTE
             tensordxdxdxd(iCalc, i, j, k, l) +=
                 0.5 * ffm1 * norm * sqrt(ffm1) *
-                (kPt(i) * vel(j) * f(k, l, is) + kPt(i) * vel(l) * f(k, j, is));
+                (kPt(i) * vel(j) * f(is, k + 3 * l) + kPt(i) * vel(l) * f(is, k + 3 * j));
           }
         }
       }
@@ -303,11 +296,13 @@ void ElectronViscosity::outputToJSON(const std::string &outFileName) {
 }
 
 
-void ElectronViscosity::outputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix) {
+void ElectronViscosity::outputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
+                                        const std::string& outFileName) {
 
   // call the function in viscosity io
   genericOutputRealSpaceToJSON(scatteringMatrix, bandStructure, statisticsSweep,
-                                theta0, theta_e, phi, C, A, context);
+                                theta0, theta_e, phi, C, A, context,
+                                outFileName);
 
 }
 
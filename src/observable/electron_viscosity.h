@@ -36,8 +36,11 @@ public:
 
   /** Outputs the quantities needed for a real space solution
    *  in hydrodynamic materials.
+   * @param outFileName: name of the json file, which must differ between
+   * the calculations of a loop over temperatures.
    */
-  void outputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix);
+  void outputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
+      const std::string& outFileName = "el_relaxons_real_space_coeffs.json");
 
   /** Computes the viscosity from the scattering matrix eigenvectors.
    * Stores it internally.
@@ -1,4 +1,5 @@
 #include "observable.h"
+#include "constants.h"
 #include <cmath>
 
 Observable::Observable(Context &context_, StatisticsSweep &statisticsSweep_,
@@ -138,3 +139,21 @@ Eigen::VectorXd Observable::getNorm() {
   }
   return norm;
 }
+
+Eigen::MatrixXcd
+Observable::relaxonsACResponse(const Eigen::VectorXd &eigenvalues,
+                               const std::vector<double> &frequencies) {
+  auto numRelaxons = int(eigenvalues.size());
+  auto numFrequencies = int(frequencies.size());
+  Eigen::MatrixXcd response = Eigen::MatrixXcd::Zero(numRelaxons,
+                                                     numFrequencies);
+  for (int iFreq = 0; iFreq < numFrequencies; iFreq++) {
+    std::complex<double> shift(0., twoPi * twoPi * frequencies[iFreq]);
+    for (int alpha = 0; alpha < numRelaxons; alpha++) {
+      if (eigenvalues(alpha) > 0.) {
+        response(alpha, iFreq) = 1. / (eigenvalues(alpha) + shift);
+      }
+    }
+  }
+  return response;
+}
@@ -45,7 +45,26 @@ public:
    */
   Eigen::VectorXd getNorm();
 
+  /** Response of each relaxon to a driving term oscillating in time as
+   * exp(i 2pi f t), for each of the frequencies f. In the relaxon basis the
+   * BTE is diagonal, and the relaxon alpha decays with the rate
+   * lambda_alpha / 2pi (in atomic units), so that the relaxation time
+   * 1/lambda_alpha of the static solution becomes
+   * 1/(lambda_alpha + i 4pi^2 f).
+   * Relaxons with non-positive eigenvalues are discarded, as in the static
+   * solvers.
+   * @param eigenvalues: the relaxon eigenvalues.
+   * @param frequencies: frequencies in inverse atomic units of time.
+   * @return response: complex matrix (numRelaxons, numFrequencies).
+   */
+  static Eigen::MatrixXcd relaxonsACResponse(
+      const Eigen::VectorXd &eigenvalues,
+      const std::vector<double> &frequencies);
+
 protected:
+  // the fused pass fills the tensors of several observables at once
+  friend class ObservablesPass;
+
   // save input parameters
   Context &context;
   StatisticsSweep &statisticsSweep;
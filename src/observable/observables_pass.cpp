@@ -0,0 +1,414 @@
+#include "observables_pass.h"
+
+#include "constants.h"
+#include "mpiHelper.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <Kokkos_Core.hpp>
+
+ObservablesPass::ObservablesPass(StatisticsSweep &statisticsSweep_,
+                                 BaseBandStructure &bandStructure_)
+    : statisticsSweep(statisticsSweep_), bandStructure(bandStructure_) {
+  numCalculations = statisticsSweep.getNumCalculations();
+}
+
+void ObservablesPass::add(PhononThermalConductivity &thCond, VectorBTE &n,
+                          VectorBTE *relTimes) {
+  if (phPopulation != nullptr && phPopulation != &n) {
+    Error("Developer error: thermal conductivities in the same pass "
+          "must share the phonon population");
+  }
+  phPopulation = &n;
+  if (relTimes != nullptr) {
+    phThCondRelTimes = relTimes;
+  }
+  thConds.push_back(&thCond);
+}
+
+void ObservablesPass::add(PhononViscosity &viscosity, VectorBTE &tau) {
+  phViscosity = &viscosity;
+  phRelTimes = &tau;
+}
+
+void ObservablesPass::add(SpecificHeat &specificHeat_) {
+  specificHeat = &specificHeat_;
+}
+
+void ObservablesPass::add(OnsagerCoefficients &onsager, VectorBTE &nE,
+                          VectorBTE &nT) {
+  if (elPopulationE != nullptr
+      && (elPopulationE != &nE || elPopulationT != &nT)) {
+    Error("Developer error: Onsager coefficients in the same pass "
+          "must share the electron populations");
+  }
+  elPopulationE = &nE;
+  elPopulationT = &nT;
+  onsagers.push_back(&onsager);
+}
+
+void ObservablesPass::calc() {
+
+  Kokkos::Profiling::pushRegion("ObservablesPass::calc");
+
+  auto particle = bandStructure.getParticle();
+  Points points = bandStructure.getPoints();
+
+  bool doThCond = !thConds.empty();
+  bool doViscosity = phViscosity != nullptr;
+  bool doSpecificHeat = specificHeat != nullptr;
+  bool doOnsager = !onsagers.empty();
+
+  // all the observables are accumulated in a single buffer, so that we can
+  // reduce everything with one MPI call. Each tensor is stored with the
+  // same (column-major) layout of the Eigen::Tensor it will be copied into.
+  int dimThCond = doThCond ? thConds[0]->dimensionality : 0;
+  int dimViscosity = doViscosity ? phViscosity->dimensionality : 0;
+  int dimOnsager = doOnsager ? onsagers[0]->dimensionality : 0;
+
+  int sizeThCond = doThCond ? numCalculations * dimThCond * dimThCond : 0;
+  int sizeViscosity = doViscosity ? numCalculations * dimViscosity
+          * dimViscosity * dimViscosity * dimViscosity : 0;
+  int sizeSpecificHeat = doSpecificHeat ? numCalculations : 0;
+  int sizeOnsager = doOnsager ? numCalculations * dimOnsager * dimOnsager : 0;
+
+  // the spectral decompositions are stored as extra copies of the tensors,
+  // one for each bin, appended after the integrated quantities
+  int numBinsThCond =
+      doThCond ? thConds[0]->context.getSpectralTransportBins() : 0;
+  int numBinsOnsager =
+      doOnsager ? onsagers[0]->context.getSpectralTransportBins() : 0;
+  bool doThCondMfp = numBinsThCond > 0 && phThCondRelTimes != nullptr;
+  int sizeThCondFrequency = numBinsThCond * sizeThCond;
+  int sizeThCondMfp = doThCondMfp ? numBinsThCond * sizeThCond : 0;
+  int sizeOnsagerEnergy = numBinsOnsager * sizeOnsager;
+
+  int offsetThCond = 0;
+  int offsetViscosity = offsetThCond + sizeThCond;
+  int offsetSpecificHeat = offsetViscosity + sizeViscosity;
+  int offsetLEE = offsetSpecificHeat + sizeSpecificHeat;
+  int offsetLET = offsetLEE + sizeOnsager;
+  int offsetLTE = offsetLET + sizeOnsager;
+  int offsetLTT = offsetLTE + sizeOnsager;
+  int offsetThCondFrequency = offsetLTT + sizeOnsager;
+  int offsetThCondMfp = offsetThCondFrequency + sizeThCondFrequency;
+  int offsetOnsagerEnergy = offsetThCondMfp + sizeThCondMfp;
+  int bufferSize = offsetOnsagerEnergy + sizeOnsagerEnergy;
+
+  // normalizations, identical to those of the individual observables
+  double normThCond = 0.;
+  std::vector<int> excludeThCond;
+  if (doThCond) {
+    normThCond = 1. / thConds[0]->crystal.getVolumeUnitCell(dimThCond);
+    excludeThCond = phPopulation->excludeIndices;
+  }
+  double normViscosity = 0.;
+  std::vector<int> excludeViscosity;
+  if (doViscosity) {
+    normViscosity = 1. / phViscosity->context.getQMesh().prod()
+        / phViscosity->crystal.getVolumeUnitCell(dimViscosity);
+    excludeViscosity = phRelTimes->excludeIndices;
+  }
+  double normSpecificHeat = 0.;
+  if (doSpecificHeat) {
+    normSpecificHeat = 1. / specificHeat->crystal.getVolumeUnitCell(
+                                specificHeat->dimensionality);
+    if (particle.isPhonon()) {
+      normSpecificHeat /= specificHeat->context.getQMesh().prod();
+    }
+    if (particle.isElectron()) {
+      normSpecificHeat /= specificHeat->context.getKMesh().prod();
+    }
+  }
+  double normOnsager = 0.;
+  if (doOnsager) {
+    normOnsager = onsagers[0]->spinFactor
+        / onsagers[0]->context.getKMesh().prod()
+        / onsagers[0]->crystal.getVolumeUnitCell(dimOnsager);
+  }
+
+  Eigen::VectorXd buffer = Eigen::VectorXd::Zero(bufferSize);
+
+  std::vector<int> iss = bandStructure.parallelIrrStateIterator();
+  int niss = iss.size();
+
+  // bins of the spectral decompositions: linear in the phonon frequency
+  // (or electron energy), logarithmic in the mean free path
+  Eigen::VectorXd frequencyEdges, mfpEdges, energyEdges;
+  double minEnergy = 0., maxEnergy = 0., minLogMfp = 0., maxLogMfp = 0.;
+  if (numBinsThCond > 0 || numBinsOnsager > 0) {
+    double minMfp = std::numeric_limits<double>::max();
+    double maxMfp = 0.;
+    minEnergy = std::numeric_limits<double>::max();
+    maxEnergy = -std::numeric_limits<double>::max();
+    for (int is : iss) {
+      StateIndex isIdx(is);
+      double energy = bandStructure.getEnergy(isIdx);
+      minEnergy = std::min(minEnergy, energy);
+      maxEnergy = std::max(maxEnergy, energy);
+      if (doThCondMfp) {
+        int iBte = bandStructure.stateToBte(isIdx).get();
+        double vNorm = bandStructure.getGroupVelocity(isIdx).norm();
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double mfp = vNorm * (*phThCondRelTimes)(iCalc, 0, iBte);
+          if (mfp > 0.) {
+            minMfp = std::min(minMfp, mfp);
+            maxMfp = std::max(maxMfp, mfp);
+          }
+        }
+      }
+    }
+    mpi->allReduceMin(&minEnergy);
+    mpi->allReduceMax(&maxEnergy);
+    if (numBinsThCond > 0) {
+      minEnergy = 0.;
+      frequencyEdges = Eigen::VectorXd::LinSpaced(numBinsThCond + 1, minEnergy,
+                                                  maxEnergy);
+    }
+    if (numBinsOnsager > 0) {
+      energyEdges = Eigen::VectorXd::LinSpaced(numBinsOnsager + 1, minEnergy,
+                                               maxEnergy);
+    }
+    if (doThCondMfp) {
+      mpi->allReduceMin(&minMfp);
+      mpi->allReduceMax(&maxMfp);
+      if (maxMfp <= 0.) { // no state with a finite mean free path
+        minMfp = 1.;
+        maxMfp = 1.;
+      }
+      minLogMfp = std::log10(minMfp);
+      maxLogMfp = std::log10(maxMfp);
+      mfpEdges = Eigen::VectorXd::LinSpaced(numBinsThCond + 1, minLogMfp,
+                                            maxLogMfp);
+      for (int i = 0; i < mfpEdges.size(); i++) {
+        mfpEdges(i) = std::pow(10., mfpEdges(i));
+      }
+    }
+  }
+  // returns the bin of x in [x0, x1], clamping the values out of range
+  auto findBin = [](const double &x, const double &x0, const double &x1,
+                    const int &numBins) {
+    if (x1 <= x0) return 0;
+    int iBin = int((x - x0) / (x1 - x0) * numBins);
+    return std::max(0, std::min(iBin, numBins - 1));
+  };
+
+#pragma omp parallel default(none) shared(iss, niss, buffer, bufferSize, particle, points, doThCond, doViscosity, doSpecificHeat, doOnsager, dimThCond, dimViscosity, dimOnsager, offsetThCond, offsetViscosity, offsetSpecificHeat, offsetLEE, offsetLET, offsetLTE, offsetLTT, sizeOnsager, normThCond, normViscosity, normSpecificHeat, normOnsager, excludeThCond, excludeViscosity, ryToCmm1, sizeThCond, numBinsThCond, numBinsOnsager, doThCondMfp, offsetThCondFrequency, offsetThCondMfp, offsetOnsagerEnergy, minEnergy, maxEnergy, minLogMfp, maxLogMfp, findBin)
+  {
+    // we do manually the reduction, to avoid custom type declaration
+    // which is not always allowed by the compiler e.g. by clang
+    Eigen::VectorXd bufferPrivate = Eigen::VectorXd::Zero(bufferSize);
+
+    // per-temperature factors, computed once per state
+    Eigen::VectorXd viscosityFactor(numCalculations);
+    Eigen::VectorXi mfpBin = Eigen::VectorXi::Zero(numCalculations);
+
+#pragma omp for nowait
+    for (int iis = 0; iis < niss; iis++) {
+      // read the data of this state only once
+      StateIndex isIdx(iss[iis]);
+      double energy = bandStructure.getEnergy(isIdx);
+      Eigen::Vector3d velIrr = bandStructure.getGroupVelocity(isIdx);
+      int iBte = bandStructure.stateToBte(isIdx).get();
+      const std::vector<int> &rotations =
+          bandStructure.getRotationIndicesStar(isIdx);
+
+      // decide which observables this state contributes to
+      bool thisThCond = doThCond
+          && std::find(excludeThCond.begin(), excludeThCond.end(), iBte)
+              == excludeThCond.end();
+      bool thisViscosity = doViscosity
+          && std::find(excludeViscosity.begin(), excludeViscosity.end(), iBte)
+              == excludeViscosity.end()
+          && energy >= 0.001 / ryToCmm1;
+      // exclude acoustic phonons, cutoff at 0.1 cm^-1
+      bool thisSpecificHeat = doSpecificHeat
+          && !(particle.isPhonon() && energy < 0.1 / ryToCmm1);
+
+      double weightThCond = 0.;
+      if (thisThCond) {
+        auto ikIdx = std::get<0>(bandStructure.getIndex(isIdx));
+        weightThCond = normThCond * points.getWeight(ikIdx.get());
+      }
+      int frequencyBin = 0;
+      if (thisThCond && numBinsThCond > 0) {
+        frequencyBin = findBin(energy, minEnergy, maxEnergy, numBinsThCond);
+      }
+      if (thisThCond && doThCondMfp) {
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double mfp = velIrr.norm() * (*phThCondRelTimes)(iCalc, 0, iBte);
+          mfpBin(iCalc) = mfp > 0.
+              ? findBin(std::log10(mfp), minLogMfp, maxLogMfp, numBinsThCond)
+              : 0;
+        }
+      }
+      int energyBin = 0;
+      if (doOnsager && numBinsOnsager > 0) {
+        energyBin = findBin(energy, minEnergy, maxEnergy, numBinsOnsager);
+      }
+
+      Eigen::Vector3d qIrr = Eigen::Vector3d::Zero();
+      if (thisViscosity) {
+        qIrr = bandStructure.getWavevector(isIdx);
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double kBT = statisticsSweep.getCalcStatistics(iCalc).temperature;
+          double boseP1 = particle.getPopPopPm1(energy, kBT, 0.);
+          viscosityFactor(iCalc) = boseP1 * (*phRelTimes)(iCalc, 0, iBte)
+              / kBT * normViscosity;
+        }
+      }
+
+      if (thisSpecificHeat) {
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+          double chemPot = calcStat.chemicalPotential;
+          double dndt = particle.getDndt(energy, calcStat.temperature, chemPot);
+          bufferPrivate(offsetSpecificHeat + iCalc) += std::abs(dndt)
+              * std::abs(energy - chemPot) * normSpecificHeat
+              * double(rotations.size());
+        }
+      }
+
+      for (int iRot : rotations) {
+        const Eigen::Matrix3d &rot = bandStructure.getRotationMatrix(iRot);
+        Eigen::Vector3d vel = rot * velIrr;
+
+        if (thisThCond) {
+          for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+            Eigen::Vector3d nRot = Eigen::Vector3d::Zero();
+            for (int i = 0; i < dimThCond; i++) {
+              nRot(i) = (*phPopulation)(iCalc, i, iBte);
+            }
+            nRot = rot * nRot;
+            for (int j = 0; j < dimThCond; j++) {
+              for (int i = 0; i < dimThCond; i++) {
+                int index = iCalc + numCalculations * (i + dimThCond * j);
+                double x = nRot(i) * vel(j) * energy * weightThCond;
+                bufferPrivate(offsetThCond + index) += x;
+                if (numBinsThCond > 0) {
+                  bufferPrivate(offsetThCondFrequency + index
+                                + sizeThCond * frequencyBin) += x;
+                }
+                if (doThCondMfp) {
+                  bufferPrivate(offsetThCondMfp + index
+                                + sizeThCond * mfpBin(iCalc)) += x;
+                }
+              }
+            }
+          }
+        }
+
+        if (thisViscosity) {
+          Eigen::Vector3d q = rot * qIrr;
+          q = points.bzToWs(q, Points::cartesianCoordinates);
+          for (int l = 0; l < dimViscosity; l++) {
+            for (int k = 0; k < dimViscosity; k++) {
+              for (int j = 0; j < dimViscosity; j++) {
+                for (int i = 0; i < dimViscosity; i++) {
+                  double qvqv = q(i) * vel(j) * q(k) * vel(l);
+                  int index = offsetViscosity + numCalculations
+                      * (i + dimViscosity * (j + dimViscosity
+                                             * (k + dimViscosity * l)));
+                  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+                    bufferPrivate(index + iCalc) += qvqv * viscosityFactor(iCalc);
+                  }
+                }
+              }
+            }
+          }
+        }
+
+        if (doOnsager) {
+          for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+            double en = energy
+                - statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
+            Eigen::Vector3d thisNE = Eigen::Vector3d::Zero();
+            Eigen::Vector3d thisNT = Eigen::Vector3d::Zero();
+            for (int i = 0; i < dimOnsager; i++) {
+              thisNE(i) = (*elPopulationE)(iCalc, i, iBte);
+              thisNT(i) = (*elPopulationT)(iCalc, i, iBte);
+            }
+            thisNE = rot * thisNE;
+            thisNT = rot * thisNT;
+            for (int j = 0; j < dimOnsager; j++) {
+              for (int i = 0; i < dimOnsager; i++) {
+                int index = iCalc + numCalculations * (i + dimOnsager * j);
+                double nEv = thisNE(i) * vel(j) * normOnsager;
+                double nTv = thisNT(i) * vel(j) * normOnsager;
+                bufferPrivate(offsetLEE + index) += nEv;
+                bufferPrivate(offsetLET + index) += nTv;
+                bufferPrivate(offsetLTE + index) += nEv * en;
+                bufferPrivate(offsetLTT + index) += nTv * en;
+                if (numBinsOnsager > 0) {
+                  bufferPrivate(offsetOnsagerEnergy + index
+                                + sizeOnsager * energyBin) += nEv;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // now we do the reduction thread by thread
+#pragma omp critical
+    { buffer += bufferPrivate; }
+  }
+
+  // the states were distributed with MPI, a single reduction for everything
+  mpi->allReduceSum(&buffer);
+
+  // copy the results back into the observables
+  for (auto thCond : thConds) {
+    std::copy(buffer.data() + offsetThCond,
+              buffer.data() + offsetThCond + sizeThCond,
+              thCond->tensordxd.data());
+    thCond->addCoherenceCorrection();
+    if (numBinsThCond > 0) {
+      thCond->frequencyBinEdges = frequencyEdges;
+      thCond->frequencyResolved.resize(numCalculations, dimThCond, dimThCond,
+                                       numBinsThCond);
+      std::copy(buffer.data() + offsetThCondFrequency,
+                buffer.data() + offsetThCondFrequency + sizeThCondFrequency,
+                thCond->frequencyResolved.data());
+    }
+    if (doThCondMfp) {
+      thCond->mfpBinEdges = mfpEdges;
+      thCond->mfpResolved.resize(numCalculations, dimThCond, dimThCond,
+                                 numBinsThCond);
+      std::copy(buffer.data() + offsetThCondMfp,
+                buffer.data() + offsetThCondMfp + sizeThCondMfp,
+                thCond->mfpResolved.data());
+    }
+  }
+  if (doViscosity) {
+    std::copy(buffer.data() + offsetViscosity,
+              buffer.data() + offsetViscosity + sizeViscosity,
+              phViscosity->tensordxdxdxd.data());
+  }
+  if (doSpecificHeat) {
+    specificHeat->scalar = buffer.segment(offsetSpecificHeat, sizeSpecificHeat);
+  }
+  for (auto onsager : onsagers) {
+    std::copy(buffer.data() + offsetLEE, buffer.data() + offsetLEE + sizeOnsager,
+              onsager->LEE.data());
+    std::copy(buffer.data() + offsetLET, buffer.data() + offsetLET + sizeOnsager,
+              onsager->LET.data());
+    std::copy(buffer.data() + offsetLTE, buffer.data() + offsetLTE + sizeOnsager,
+              onsager->LTE.data());
+    std::copy(buffer.data() + offsetLTT, buffer.data() + offsetLTT + sizeOnsager,
+              onsager->LTT.data());
+    onsager->addCoherenceCorrection();
+    onsager->calcTransportCoefficients();
+    if (numBinsOnsager > 0) {
+      onsager->energyBinEdges = energyEdges;
+      onsager->energyResolvedLEE.resize(numCalculations, dimOnsager, dimOnsager,
+                                        numBinsOnsager);
+      std::copy(buffer.data() + offsetOnsagerEnergy,
+                buffer.data() + offsetOnsagerEnergy + sizeOnsagerEnergy,
+                onsager->energyResolvedLEE.data());
+    }
+  }
+
+  Kokkos::Profiling::popRegion();
+}
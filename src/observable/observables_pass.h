@@ -0,0 +1,81 @@
+#ifndef OBSERVABLES_PASS_H
+#define OBSERVABLES_PASS_H
+
+#include "onsager.h"
+#include "phonon_thermal_cond.h"
+#include "phonon_viscosity.h"
+#include "specific_heat.h"
+
+/** Class to compute several observables with a single loop over the
+ * irreducible states of a band structure.
+ * The observables computed separately each read the energy, group velocity
+ * and rotations of every state, and each does its own MPI reduction.
+ * Here, the observables are first registered with the add() methods, and
+ * calc() reads the data of each state once, accumulates all the requested
+ * quantities in a single buffer with OpenMP, and reduces that buffer with
+ * one MPI call. The results are then stored back in the observables, which
+ * can be printed and written to file as usual.
+ */
+class ObservablesPass {
+public:
+  /** Constructor method
+   * @param statisticsSweep: object with the temperatures and chemical
+   * potentials
+   * @param bandStructure: band structure shared by all the observables
+   */
+  ObservablesPass(StatisticsSweep &statisticsSweep_,
+                  BaseBandStructure &bandStructure_);
+
+  /** Request the thermal conductivity from the phonon populations.
+   * Several conductivities (e.g. the standard and the Wigner one) can be
+   * registered with the same population, and are filled from the same
+   * accumulation, each adding its own coherence correction.
+   * @param thCond: the thermal conductivity to be computed.
+   * @param n: the phonon population out-of-equilibrium.
+   * @param relTimes: optional phonon relaxation times. If given, and if
+   * spectralTransportBins is set, the conductivity is also resolved by the
+   * phonon mean free path.
+   */
+  void add(PhononThermalConductivity &thCond, VectorBTE &n,
+           VectorBTE *relTimes = nullptr);
+
+  /** Request the phonon viscosity within the relaxation time approximation.
+   * @param viscosity: the viscosity to be computed.
+   * @param tau: the phonon relaxation times.
+   */
+  void add(PhononViscosity &viscosity, VectorBTE &tau);
+
+  /** Request the specific heat.
+   * @param specificHeat: the specific heat to be computed.
+   */
+  void add(SpecificHeat &specificHeat);
+
+  /** Request the Onsager coefficients from the electron populations.
+   * As for the thermal conductivity, several objects can share nE and nT.
+   * @param onsager: the transport coefficients to be computed.
+   * @param nE: the electron population (E perturbation).
+   * @param nT: the electron population ($\nabla T$ perturbation).
+   */
+  void add(OnsagerCoefficients &onsager, VectorBTE &nE, VectorBTE &nT);
+
+  /** Compute all the registered observables.
+   */
+  void calc();
+
+protected:
+  StatisticsSweep &statisticsSweep;
+  BaseBandStructure &bandStructure;
+  int numCalculations;
+
+  std::vector<PhononThermalConductivity *> thConds;
+  VectorBTE *phPopulation = nullptr;
+  VectorBTE *phThCondRelTimes = nullptr;
+  PhononViscosity *phViscosity = nullptr;
+  VectorBTE *phRelTimes = nullptr;
+  SpecificHeat *specificHeat = nullptr;
+  std::vector<OnsagerCoefficients *> onsagers;
+  VectorBTE *elPopulationE = nullptr;
+  VectorBTE *elPopulationT = nullptr;
+};
+
+#endif
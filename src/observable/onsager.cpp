@@ -2,6 +2,7 @@
 #include "constants.h"
 #include "io.h"
 #include "mpiHelper.h"
+#include "observable.h"
 #include "particle.h"
 #include <fstream>
 #include <iomanip>
@@ -89,24 +90,24 @@ void OnsagerCoefficients::calcFromEPA(
   LET.setZero();
   LTE.setZero();
   LTT.setZero();
+  auto numEnergies = int(energies.size());
+  // each thread fills different values of iCalc
+#pragma omp parallel for
   for (int iCalc = 0; iCalc < numCalculations; ++iCalc) {
     double chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
     double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
-    for (int iBeta = 0; iBeta < dimensionality; ++iBeta) {
-      for (int iAlpha = 0; iAlpha < dimensionality; ++iAlpha) {
-        for (int iEnergy = 0; iEnergy < energies.size(); ++iEnergy) {
-
-          double pop = particle.getPopPopPm1(energies(iEnergy), temp, chemPot);
-          double en = energies(iEnergy) - chemPot;
-          if (scatteringRates.data(iCalc, iEnergy) <= 1.0e-10 ||
-              pop <= 1.0e-20) {
-            continue;
-          }
-
-          double term = energyProjVelocity(iAlpha, iBeta, iEnergy) /
-                        scatteringRates.data(iCalc, iEnergy) * factor * pop *
-                        energyStep;
-
+    for (int iEnergy = 0; iEnergy < numEnergies; ++iEnergy) {
+      // the population factor is computed once for all the components
+      double pop = particle.getPopPopPm1(energies(iEnergy), temp, chemPot);
+      double en = energies(iEnergy) - chemPot;
+      if (scatteringRates.data(iCalc, iEnergy) <= 1.0e-10 || pop <= 1.0e-20) {
+        continue;
+      }
+      double weight =
+          factor * pop * energyStep / scatteringRates.data(iCalc, iEnergy);
+      for (int iBeta = 0; iBeta < dimensionality; ++iBeta) {
+        for (int iAlpha = 0; iAlpha < dimensionality; ++iAlpha) {
+          double term = energyProjVelocity(iAlpha, iBeta, iEnergy) * weight;
           LEE(iCalc, iAlpha, iBeta) += term / temp;
           LET(iCalc, iAlpha, iBeta) -= term * en / pow(temp, 2);
           LTE(iCalc, iAlpha, iBeta) -= term * en / temp;
@@ -120,39 +121,25 @@ void OnsagerCoefficients::calcFromEPA(
 
 void OnsagerCoefficients::calcFromCanonicalPopulation(VectorBTE &fE,
                                                       VectorBTE &fT) {
-  VectorBTE nE = fE;
-  VectorBTE nT = fT;
-  nE.canonical2Population(); // n = bose (bose+1) f
-  nT.canonical2Population(); // n = bose (bose+1) f
-  calcFromPopulation(nE, nT);
+  // n = f (1-f) fCanonical, applied state by state without copying fE, fT
+  accumulatePopulation(fE, fT, 1.);
+  addCoherenceCorrection();
+  calcTransportCoefficients();
 }
 
 void OnsagerCoefficients::calcFromSymmetricPopulation(VectorBTE &nE, VectorBTE &nT) {
-  VectorBTE nE2 = nE;
-  VectorBTE nT2 = nT;
-
-  Particle electron = bandStructure.getParticle();
-
-  for (int is : bandStructure.parallelIrrStateIterator()) {
-    StateIndex isIdx(is);
-    double energy = bandStructure.getEnergy(isIdx);
-    int iBte = bandStructure.stateToBte(isIdx).get();
-
-    for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
-      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-      double temp = calcStat.temperature;
-      double chemPot = calcStat.chemicalPotential;
-      double x = sqrt(electron.getPopPopPm1(energy, temp, chemPot));
-      for (int i : {0, 1, 2}) {
-        nE2(iCalc, i, iBte) *= x;
-        nT2(iCalc, i, iBte) *= x;
-      }
-    }
-  }
-  calcFromPopulation(nE2, nT2);
+  accumulatePopulation(nE, nT, 0.5);
+  addCoherenceCorrection();
+  calcTransportCoefficients();
 }
 
 void OnsagerCoefficients::calcFromPopulation(VectorBTE &nE, VectorBTE &nT) {
+  accumulatePopulation(nE, nT, 0.);
+  calcTransportCoefficients();
+}
+
+void OnsagerCoefficients::accumulatePopulation(VectorBTE &nE, VectorBTE &nT,
+                                               const double &popPopPm1Exponent) {
 
   Kokkos::Profiling::pushRegion("calcOnsagerFromPopulation");
 
@@ -164,6 +151,7 @@ void OnsagerCoefficients::calcFromPopulation(VectorBTE &nE, VectorBTE &nT) {
   LTT.setZero();
 
   auto points = bandStructure.getPoints();
+  Particle electron = bandStructure.getParticle();
 
   std::vector<int> states = bandStructure.parallelIrrStateIterator();
   int numStates = states.size();
@@ -199,18 +187,26 @@ void OnsagerCoefficients::calcFromPopulation(VectorBTE &nE, VectorBTE &nT) {
     double energy = bandStructure.getEnergy(isIdx);
     Eigen::Vector3d velIrr = bandStructure.getGroupVelocity(isIdx);
     int iBte = bandStructure.stateToBte(isIdx).get();
-    auto rotations = bandStructure.getRotationsStar(isIdx);
+    const std::vector<int> &rotations =
+        bandStructure.getRotationIndicesStar(isIdx);
 
     for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
       auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
       double en = energy - calcStat.chemicalPotential;
+      double scale = 1.;
+      if (popPopPm1Exponent != 0.) {
+        scale = std::pow(electron.getPopPopPm1(energy, calcStat.temperature,
+                                               calcStat.chemicalPotential),
+                         popPopPm1Exponent);
+      }
 
-      for (const Eigen::Matrix3d& r : rotations) {
+      for (int iRot : rotations) {
+        const Eigen::Matrix3d &r = bandStructure.getRotationMatrix(iRot);
         Eigen::Vector3d thisNE = Eigen::Vector3d::Zero();
         Eigen::Vector3d thisNT = Eigen::Vector3d::Zero();
         for (int i : {0, 1, 2}) {
-          thisNE(i) += nE(iCalc, i, iBte);
-          thisNT(i) += nT(iCalc, i, iBte);
+          thisNE(i) += nE(iCalc, i, iBte) * scale;
+          thisNT(i) += nT(iCalc, i, iBte) * scale;
         }
         thisNE = r * thisNE;
         thisNT = r * thisNT;
@@ -274,7 +270,7 @@ void OnsagerCoefficients::calcFromPopulation(VectorBTE &nE, VectorBTE &nT) {
   mpi->allReduceSum(&LTE);
   mpi->allReduceSum(&LET);
   mpi->allReduceSum(&LTT);
-  calcTransportCoefficients();
+  Kokkos::Profiling::popRegion();
 }
 
 void OnsagerCoefficients::calcTransportCoefficients() {
@@ -318,7 +314,6 @@ void OnsagerCoefficients::calcTransportCoefficients() {
       }
     }
   }
-  Kokkos::Profiling::popRegion();
 }
 
 void OnsagerCoefficients::calcFromRelaxons(
@@ -336,63 +331,48 @@ void OnsagerCoefficients::calcFromRelaxons(
   VectorBTE nE(statisticsSweep, bandStructure, 3);
   VectorBTE nT(statisticsSweep, bandStructure, 3);
 
+  // if we only calculated some eigenvalues,
+  // we should not include any alpha
+  // values past that -- the memory in eigenvectors is
+  // still allocated, however, it contains zeros or nonsense.
+  // we also need to discard any negative states (warned about already)
+  Eigen::VectorXd relaxonTimes(numEigenvalues);
+  for (int alpha = 0; alpha < numEigenvalues; alpha++) {
+    relaxonTimes(alpha) = eigenvalues(alpha) > 0. ? 1. / eigenvalues(alpha) : 0.;
+  }
+
+  // the relaxon populations f_alpha = theta^T * x / lambda_alpha are
+  // back-rotated to n = theta * f with distributed products, where the
+  // columns of x hold the electric (0-2) and thermal (3-5) driving terms
   if (!context.getUseSymmetries()) {
 
-    VectorBTE fE(statisticsSweep, bandStructure, 3);
-    VectorBTE fT(statisticsSweep, bandStructure, 3);
-
-    for (auto tup0 : eigenvectors.getAllLocalStates()) {
-      int is = std::get<0>(tup0);
-      int alpha = std::get<1>(tup0);
-      // if we only calculated some eigenvalues,
-      // we should not include any alpha
-      // values past that -- the memory in eigenvectors is
-      // still allocated, however, it contains zeros or nonsense.
-      // we also need to discard any negative states (warned about already)
-      if (eigenvalues(alpha) <= 0. || alpha >= numEigenvalues) {
-        continue;
-      }
+    int numStates = bandStructure.getNumStates();
+    Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates, 6);
+    for (int is = 0; is < numStates; is++) {
       auto isIndex = StateIndex(is);
       double en = bandStructure.getEnergy(isIndex);
       auto vel = bandStructure.getGroupVelocity(isIndex);
+      double dnde = particle.getDnde(en, temp, chemPot, true);
+      double dndt = particle.getDndt(en, temp, chemPot, true);
       for (int i : {0, 1, 2}) {
-        fE(iCalc, i, alpha) += -particle.getDnde(en, temp, chemPot, true)
-            * vel(i) * eigenvectors(is, alpha) / eigenvalues(alpha);
-        fT(iCalc, i, alpha) += -particle.getDndt(en, temp, chemPot, true)
-            * vel(i) * eigenvectors(is, alpha) / eigenvalues(alpha);
+        x(is, i) = -dnde * vel(i);
+        x(is, i + 3) = -dndt * vel(i);
       }
     }
-    mpi->allReduceSum(&fE.data);
-    mpi->allReduceSum(&fT.data);
-
-    for (auto tup0 : eigenvectors.getAllLocalStates()) {
-      int is = std::get<0>(tup0);
-      int alpha = std::get<1>(tup0);
-      // discard negative and non-computed alpha values
-      if (eigenvalues(alpha) <= 0. || alpha >= numEigenvalues) {
-        continue;
-      }
+
+    Eigen::MatrixXd y = eigenvectors.projectOnColumns(x, relaxonTimes);
+    for (int is = 0; is < numStates; is++) {
       for (int i : {0, 1, 2}) {
-        nE(iCalc, i, is) += fE(iCalc, i, alpha) * eigenvectors(is, alpha);
-        nT(iCalc, i, is) += fT(iCalc, i, alpha) * eigenvectors(is, alpha);
+        nE(iCalc, i, is) = y(is, i);
+        nT(iCalc, i, is) = y(is, i + 3);
       }
     }
-    mpi->allReduceSum(&nE.data);
-    mpi->allReduceSum(&nT.data);
 
   } else { // with symmetries
     Error("Developer error: Theoretically, relaxons with symmetries may not work.");
-    Eigen::MatrixXd fE(3, eigenvectors.cols());
-    Eigen::MatrixXd fT(3, eigenvectors.cols());
-    fE.setZero();
-    fT.setZero();
-    for (auto tup0 : eigenvectors.getAllLocalStates()) {
-      int iMat1 = std::get<0>(tup0);
-      int alpha = std::get<1>(tup0);
-      // discard negative and non-computed alpha values
-      if (eigenvalues(alpha) <= 0. || alpha >= numEigenvalues) {
-        continue;
-      }
+    int numRows = eigenvectors.rows();
+    Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numRows, 2);
+    for (int iMat1 = 0; iMat1 < numRows; iMat1++) {
       auto tup1 = scatteringMatrix.getSMatrixIndex(iMat1);
       BteIndex iBteIndex = std::get<0>(tup1);
       CartIndex dimIndex = std::get<1>(tup1);
@@ -403,47 +383,149 @@ void OnsagerCoefficients::calcFromRelaxons(
       double en = bandStructure.getEnergy(isIndex);
       double dndt = particle.getDndt(en, temp, chemPot);
       double dnde = particle.getDnde(en, temp, chemPot);
-
-      if (eigenvalues(alpha) <= 0.) {
-        continue;
-      }
-      fE(iDim, alpha) +=
-          -sqrt(dnde) * vel(iDim) * eigenvectors(iMat1, alpha) / eigenvalues(alpha);
-      fT(iDim, alpha) +=
-          -sqrt(dndt) * vel(iDim) * eigenvectors(iMat1, alpha) / eigenvalues(alpha);
+      x(iMat1, 0) = -sqrt(dnde) * vel(iDim);
+      x(iMat1, 1) = -sqrt(dndt) * vel(iDim);
     }
-    mpi->allReduceSum(&fT);
-    mpi->allReduceSum(&fE);
 
     // back rotate to Bloch electron coordinates
-    for (auto tup0 : eigenvectors.getAllLocalStates()) {
-      int iMat1 = std::get<0>(tup0);
-      int alpha = std::get<1>(tup0);
-      // discard negative and non-computed alpha values
-      if (eigenvalues(alpha) <= 0. || alpha >= numEigenvalues) {
-        continue;
-      }
+    Eigen::MatrixXd y = eigenvectors.projectOnColumns(x, relaxonTimes);
+    for (int iMat1 = 0; iMat1 < numRows; iMat1++) {
       auto tup1 = scatteringMatrix.getSMatrixIndex(iMat1);
-      BteIndex iBteIndex = std::get<0>(tup1);
-      CartIndex dimIndex = std::get<1>(tup1);
-      int iBte = iBteIndex.get();
-      int iDim = dimIndex.get();
-      nE(iCalc, iDim, iBte) += fE(iDim, alpha) * eigenvectors(iMat1, alpha);
-      nT(iCalc, iDim, iBte) += fT(iDim, alpha) * eigenvectors(iMat1, alpha);
+      int iBte = std::get<0>(tup1).get();
+      int iDim = std::get<1>(tup1).get();
+      nE(iCalc, iDim, iBte) += y(iMat1, 0);
+      nT(iCalc, iDim, iBte) += y(iMat1, 1);
     }
-    mpi->allReduceSum(&nE.data);
-    mpi->allReduceSum(&nT.data);
   }
   Kokkos::Profiling::popRegion();
   calcFromSymmetricPopulation(nE, nT);
 }
 
-void OnsagerCoefficients::print() {
+void OnsagerCoefficients::calcACFromRelaxons(
+    Eigen::VectorXd &eigenvalues, ParallelMatrix<double> &eigenvectors) {
+
+  if (context.getUseSymmetries()) {
+    Error("Developer error: the AC transport coefficients from relaxons are "
+          "only implemented without symmetries");
+  }
+  acFrequencies = context.getACFrequencies();
+  auto numFrequencies = int(acFrequencies.size());
+  auto numRelaxons = int(eigenvalues.size());
+  int numStates = bandStructure.getNumStates();
+  auto particle = bandStructure.getParticle();
+  double norm = spinFactor / context.getKMesh().prod() /
+                crystal.getVolumeUnitCell(dimensionality);
+
+  int iCalc = 0;
+  double chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
+  double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
+
+  // columns 0-5 are the electric and thermal driving terms of
+  // calcFromRelaxons, columns 6-11 the charge and heat currents of each
+  // state, in the same symmetrized basis
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates, 12);
+  for (int is = 0; is < numStates; is++) {
+    auto isIndex = StateIndex(is);
+    double en = bandStructure.getEnergy(isIndex);
+    auto vel = bandStructure.getGroupVelocity(isIndex);
+    double dnde = particle.getDnde(en, temp, chemPot, true);
+    double dndt = particle.getDndt(en, temp, chemPot, true);
+    double term = sqrt(particle.getPopPopPm1(en, temp, chemPot)) * norm;
+    for (int i : {0, 1, 2}) {
+      x(is, i) = -dnde * vel(i);
+      x(is, i + 3) = -dndt * vel(i);
+      x(is, i + 6) = term * vel(i);
+      x(is, i + 9) = term * vel(i) * (en - chemPot);
+    }
+  }
+  Eigen::MatrixXd projections = eigenvectors.projectColumns(x, numRelaxons);
+
+  Eigen::MatrixXcd response =
+      Observable::relaxonsACResponse(eigenvalues, acFrequencies);
+  acSigma.resize(numFrequencies, dimensionality, dimensionality);
+  acKappa.resize(numFrequencies, dimensionality, dimensionality);
+  for (int iFreq = 0; iFreq < numFrequencies; iFreq++) {
+    // L(i,j) = sum_alpha x_alpha,i j_alpha,j response_alpha
+    Eigen::MatrixXcd thisL =
+        projections.leftCols(6).transpose().cast<std::complex<double>>() *
+        response.col(iFreq).asDiagonal() *
+        projections.rightCols(6).cast<std::complex<double>>();
+    Eigen::MatrixXcd thisLEE = thisL.block(0, 0, dimensionality, dimensionality);
+    Eigen::MatrixXcd thisLET = thisL.block(3, 0, dimensionality, dimensionality);
+    Eigen::MatrixXcd thisLTE = thisL.block(0, 3, dimensionality, dimensionality);
+    Eigen::MatrixXcd thisLTT = thisL.block(3, 3, dimensionality, dimensionality);
+    // k = L_tt - L_TE L_EE^-1 L_ET, as in calcTransportCoefficients
+    Eigen::MatrixXcd thisKappa =
+        -(thisLTT - thisLTE * thisLEE.inverse() * thisLET);
+    for (int i = 0; i < dimensionality; i++) {
+      for (int j = 0; j < dimensionality; j++) {
+        acSigma(iFreq, i, j) = thisLEE(i, j);
+        acKappa(iFreq, i, j) = thisKappa(i, j);
+      }
+    }
+  }
+}
+
+void OnsagerCoefficients::outputACToJSON(const std::string &outFileName) {
   if (!mpi->mpiHead())
     return;
 
   std::string unitsSigma, unitsKappa;
   double convSigma, convKappa;
+  getOutputUnits(unitsSigma, unitsKappa, convSigma, convKappa);
+
+  // converts (iFreq,i,j) to nested vectors, for the real or imaginary part
+  auto toVector = [&](const Eigen::Tensor<std::complex<double>, 3> &x,
+                      const double &conversion, const bool &imaginary) {
+    std::vector<std::vector<std::vector<double>>> out;
+    for (int iFreq = 0; iFreq < x.dimension(0); iFreq++) {
+      std::vector<std::vector<double>> rows;
+      for (int i = 0; i < dimensionality; i++) {
+        std::vector<double> cols;
+        for (int j = 0; j < dimensionality; j++) {
+          std::complex<double> c = x(iFreq, i, j) * conversion;
+          cols.push_back(imaginary ? c.imag() : c.real());
+        }
+        rows.push_back(cols);
+      }
+      out.push_back(rows);
+    }
+    return out;
+  };
+
+  std::vector<double> frequencies;
+  for (double f : acFrequencies) {
+    // from inverse atomic units of time to THz
+    frequencies.push_back(f / (timeAuToFs * 1.0e-3));
+  }
+  auto calcStat = statisticsSweep.getCalcStatistics(0);
+  nlohmann::json output;
+  output["temperature"] = calcStat.temperature * temperatureAuToSi;
+  output["temperatureUnit"] = "K";
+  output["chemicalPotential"] = calcStat.chemicalPotential * energyRyToEv;
+  output["chemicalPotentialUnit"] = "eV";
+  output["doping"] = calcStat.doping;
+  output["dopingUnit"] = "cm$^{-3}$";
+  output["frequencies"] = frequencies;
+  output["frequencyUnit"] = "THz";
+  output["electricalConductivityReal"] = toVector(acSigma, convSigma, false);
+  output["electricalConductivityImag"] = toVector(acSigma, convSigma, true);
+  output["electricalConductivityUnit"] = unitsSigma;
+  output["electronicThermalConductivityReal"] =
+      toVector(acKappa, convKappa, false);
+  output["electronicThermalConductivityImag"] =
+      toVector(acKappa, convKappa, true);
+  output["electronicThermalConductivityUnit"] = unitsKappa;
+  output["particleType"] = "electron";
+  std::ofstream o(outFileName);
+  o << std::setw(3) << output << std::endl;
+  o.close();
+}
+
+void OnsagerCoefficients::getOutputUnits(std::string &unitsSigma,
+                                         std::string &unitsKappa,
+                                         double &convSigma,
+                                         double &convKappa) {
   if (dimensionality == 1) {
     unitsSigma = "S m";
     unitsKappa = "W m / K";
@@ -460,6 +542,15 @@ void OnsagerCoefficients::print() {
     convSigma = elConductivityAuToSi;
     convKappa = thConductivityAuToSi;
   }
+}
+
+void OnsagerCoefficients::print() {
+  if (!mpi->mpiHead())
+    return;
+
+  std::string unitsSigma, unitsKappa;
+  double convSigma, convKappa;
+  getOutputUnits(unitsSigma, unitsKappa, convSigma, convKappa);
 
   double convMobility = mobilityAuToSi * 100 * 100; // from m^2/Vs to cm^2/Vs
   std::string unitsMobility = "cm^2 / V / s";
@@ -578,29 +669,85 @@ void OnsagerCoefficients::print(const int &iter) {
   std::cout << std::endl;
 }
 
-void OnsagerCoefficients::outputToJSON(const std::string &outFileName) {
-  if (!mpi->mpiHead())
+void OnsagerCoefficients::outputSpectralToJSON(const std::string &outFileName) {
+  if (!mpi->mpiHead() || energyBinEdges.size() == 0)
     return;
 
-  std::string unitsSigma, unitsKappa;
-  double convSigma, convKappa;
+  std::string unitsSigma;
+  double convSigma;
   if (dimensionality == 1) {
     unitsSigma = "S m";
-    unitsKappa = "W m / K";
     convSigma = elConductivityAuToSi * rydbergSi * rydbergSi;
-    convKappa = thConductivityAuToSi * rydbergSi * rydbergSi;
   } else if (dimensionality == 2) {
     unitsSigma = "S";
-    unitsKappa = "W / K";
     convSigma = elConductivityAuToSi * rydbergSi;
-    convKappa = thConductivityAuToSi * rydbergSi;
   } else {
     unitsSigma = "S / m";
-    unitsKappa = "W / m / K";
     convSigma = elConductivityAuToSi;
-    convKappa = thConductivityAuToSi;
   }
 
+  std::vector<double> temps, dopings, chemPots;
+  // [iCalc][iBin][i][j], bin by bin and accumulated over the bins
+  std::vector<std::vector<std::vector<std::vector<double>>>> sigmaOut;
+  std::vector<std::vector<std::vector<std::vector<double>>>> sigmaCumOut;
+  int numBins = int(energyResolvedLEE.dimension(3));
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temps.push_back(calcStat.temperature * temperatureAuToSi);
+    dopings.push_back(calcStat.doping);
+    chemPots.push_back(calcStat.chemicalPotential * energyRyToEv);
+
+    std::vector<std::vector<std::vector<double>>> bins, binsCum;
+    Eigen::MatrixXd sum = Eigen::MatrixXd::Zero(dimensionality, dimensionality);
+    for (int iBin = 0; iBin < numBins; iBin++) {
+      std::vector<std::vector<double>> rows, rowsCum;
+      for (int i = 0; i < dimensionality; i++) {
+        std::vector<double> cols, colsCum;
+        for (int j = 0; j < dimensionality; j++) {
+          sum(i, j) += energyResolvedLEE(iCalc, i, j, iBin);
+          cols.push_back(energyResolvedLEE(iCalc, i, j, iBin) * convSigma);
+          colsCum.push_back(sum(i, j) * convSigma);
+        }
+        rows.push_back(cols);
+        rowsCum.push_back(colsCum);
+      }
+      bins.push_back(rows);
+      binsCum.push_back(rowsCum);
+    }
+    sigmaOut.push_back(bins);
+    sigmaCumOut.push_back(binsCum);
+  }
+  std::vector<double> energies;
+  for (int i = 0; i < energyBinEdges.size(); i++) {
+    energies.push_back(energyBinEdges(i) * energyRyToEv);
+  }
+
+  nlohmann::json output;
+  output["temperatures"] = temps;
+  output["temperatureUnit"] = "K";
+  output["dopingConcentrations"] = dopings;
+  output["dopingConcentrationUnit"] = "cm$^{-" + std::to_string(dimensionality) + "}$";
+  output["chemicalPotentials"] = chemPots;
+  output["chemicalPotentialUnit"] = "eV";
+  output["energyBinEdges"] = energies;
+  output["energyUnit"] = "eV";
+  output["electricalConductivityByEnergy"] = sigmaOut;
+  output["cumulativeElectricalConductivityByEnergy"] = sigmaCumOut;
+  output["electricalConductivityUnit"] = unitsSigma;
+  output["particleType"] = "electron";
+  std::ofstream o(outFileName);
+  o << std::setw(3) << output << std::endl;
+  o.close();
+}
+
+void OnsagerCoefficients::outputToJSON(const std::string &outFileName) {
+  if (!mpi->mpiHead())
+    return;
+
+  std::string unitsSigma, unitsKappa;
+  double convSigma, convKappa;
+  getOutputUnits(unitsSigma, unitsKappa, convSigma, convKappa);
+
   double convMobility = mobilityAuToSi * pow(100., 2); // from m^2/Vs to cm^2/Vs
   std::string unitsMobility = "cm^2 / V / s";
 
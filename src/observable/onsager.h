@@ -61,6 +61,12 @@ public:
    */
   void outputToJSON(const std::string &outFileName);
 
+  /** Outputs to a json file the electrical conductivity resolved by
+   * electron energy, if it has been computed by ObservablesPass.
+   * @param outFileName: string representing the name of the json file
+   */
+  void outputSpectralToJSON(const std::string &outFileName);
+
   /** After the Onsager coefficients L_EE, L_TT, L_ET, L_TE have been computed
    * this function evaluates the transport coefficients such as electrical
    * conductivity, Seebeck and thermal conductivity.
@@ -89,6 +95,27 @@ public:
                         ParallelMatrix<double> &eigenvectors,
                         ElScatteringMatrix &scatteringMatrix);
 
+  /** Computes the frequency-dependent (AC) electrical and electronic
+   * thermal conductivities, at the frequencies of
+   * context.getACFrequencies(), from the relaxons.
+   * Each frequency is a diagonal shift of the relaxon eigenvalues (see
+   * Observable::relaxonsACResponse), so that the driving terms and the
+   * currents are projected on the relaxons only once, with a single
+   * distributed product, and all the frequencies are then computed from
+   * these projections. Only for the first calculation, and without
+   * symmetries, as calcFromRelaxons.
+   * @param eigenvalues: eigenvalues of $\tilde{\Omega}$
+   * @param eigenvectors : eigenvectors of $\tilde{\Omega}$
+   */
+  void calcACFromRelaxons(Eigen::VectorXd &eigenvalues,
+                          ParallelMatrix<double> &eigenvectors);
+
+  /** Outputs the AC coefficients computed by calcACFromRelaxons to a json
+   * file, with their real and imaginary parts.
+   * @param outFileName: string representing the name of the json file
+   */
+  void outputACToJSON(const std::string &outFileName);
+
   /** This function computes the electrical and thermal conductivity using the
    * variational functional (f \Omega f - b f).
    *
@@ -109,6 +136,22 @@ public:
   Eigen::Tensor<double, 3> getThermalConductivity();
 
 protected:
+  // the fused pass fills LEE, LET, LTE, LTT directly
+  friend class ObservablesPass;
+
+  /** Adds further contributions to the Onsager coefficients after they
+   * have been computed from the populations (e.g. the Wigner coherences).
+   */
+  virtual void addCoherenceCorrection() {}
+
+  /** Accumulates LEE, LET, LTE and LTT from the populations, rescaled state
+   * by state by (f(1-f))^popPopPm1Exponent, so that symmetrized (exponent
+   * 1/2) and canonical (exponent 1) populations don't need to be copied and
+   * converted first.
+   */
+  void accumulatePopulation(VectorBTE &nE, VectorBTE &nT,
+                            const double &popPopPm1Exponent);
+
   StatisticsSweep &statisticsSweep;
   Crystal &crystal;
   BaseBandStructure &bandStructure;
@@ -120,6 +163,20 @@ protected:
 
   Eigen::Tensor<double, 3> sigma, seebeck, kappa, mobility;
   Eigen::Tensor<double, 3> LEE, LET, LTE, LTT;
+
+  // L_EE resolved by energy, with indices (iCalc, i, j, iBin),
+  // and the edges of the energy bins
+  Eigen::VectorXd energyBinEdges;
+  Eigen::Tensor<double, 4> energyResolvedLEE;
+
+  // AC conductivities (iFreq, i, j), at the frequencies (in inverse Ry
+  // atomic units of time) of calcACFromRelaxons
+  std::vector<double> acFrequencies;
+  Eigen::Tensor<std::complex<double>, 3> acSigma, acKappa;
+
+  // units and conversion factors of the conductivities in output
+  void getOutputUnits(std::string &unitsSigma, std::string &unitsKappa,
+                      double &convSigma, double &convKappa);
 };
 
 #endif
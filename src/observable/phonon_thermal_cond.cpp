@@ -56,14 +56,29 @@ PhononThermalConductivity::operator-(const PhononThermalConductivity &that) {
 }
 
 void PhononThermalConductivity::calcFromCanonicalPopulation(VectorBTE &f) {
-  VectorBTE n = f;
-  n.canonical2Population(); // n = bose (bose+1) f
-  calcFromPopulation(n);
+  // n = bose (bose+1) f, applied state by state without copying f
+  accumulatePopulation(f, 1.);
+  addCoherenceCorrection();
 }
 
 void PhononThermalConductivity::calcFromPopulation(VectorBTE &n) {
+  accumulatePopulation(n, 0.);
+}
+
+void PhononThermalConductivity::accumulatePopulation(
+    VectorBTE &n, const double &popPopPm1Exponent) {
+
+  Particle particle = bandStructure.getParticle();
+  Eigen::VectorXd temps(numCalculations), chemPots(numCalculations);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temps(iCalc) = calcStat.temperature;
+    chemPots(iCalc) = calcStat.chemicalPotential;
+  }
 
-  double norm = 1. / context.getQMesh().prod() / crystal.getVolumeUnitCell(dimensionality);
+  double norm = 1. / crystal.getVolumeUnitCell(dimensionality);
+  // integration weights of the wavevectors, 1/numQMeshPoints on uniform meshes
+  Points points = bandStructure.getPoints();
 
   auto excludeIndices = n.excludeIndices;
 
@@ -82,6 +97,8 @@ void PhononThermalConductivity::calcFromPopulation(VectorBTE &n) {
       StateIndex isIdx(is);
       double en = bandStructure.getEnergy(isIdx);
       Eigen::Vector3d velIrr = bandStructure.getGroupVelocity(isIdx);
+      auto ikIdx = std::get<0>(bandStructure.getIndex(isIdx));
+      double weight = norm * points.getWeight(ikIdx.get());
 
       int iBte = bandStructure.stateToBte(isIdx).get();
 
@@ -97,15 +114,21 @@ void PhononThermalConductivity::calcFromPopulation(VectorBTE &n) {
 
         for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
 
+          double scale = 1.;
+          if (popPopPm1Exponent != 0.) {
+            scale = std::pow(particle.getPopPopPm1(en, temps(iCalc),
+                                                   chemPots(iCalc)),
+                             popPopPm1Exponent);
+          }
           Eigen::Vector3d nRot;
           for (int i = 0; i < dimensionality; i++) {
-            nRot(i) = n(iCalc, i, iBte);
+            nRot(i) = n(iCalc, i, iBte) * scale;
           }
           nRot = rot * nRot;
 
           for (int j = 0; j < dimensionality; j++) {
             for (int i = 0; i < dimensionality; i++) {
-              tensorPrivate(iCalc, i, j) += nRot(i) * vel(j) * en * norm;
+              tensorPrivate(iCalc, i, j) += nRot(i) * vel(j) * en * weight;
             }
           }
         }
@@ -267,161 +290,79 @@ void PhononThermalConductivity::calcFromRelaxons(
   // values past that -- scalapack required the memory in eigenvectors to be allocated,
   // however, for alpha>numEigenvalues, it contains zeros or nonsense.
   // we also need to discard any negative states
-  std::vector<std::tuple<int, int>> allLocalStates = eigenvectors.getAllLocalStates();
-  std::vector<std::tuple<int, int>> localStates;
-  for(auto state : allLocalStates) {
-    int alpha = std::get<1>(state);
-    if (eigenvalues(alpha) <= 0. || alpha >= numEigenvalues) {
-      continue;
-    }
-    localStates.push_back(state);
+  Eigen::VectorXd relaxonTimes(numEigenvalues);
+  for (int alpha = 0; alpha < numEigenvalues; alpha++) {
+    relaxonTimes(alpha) = eigenvalues(alpha) > 0. ? 1. / eigenvalues(alpha) : 0.;
   }
-  int nlocalStates = localStates.size();
 
-  // now, use these states to calcuate the populations
-  // first, we calculate the relaxon populations f_alpha
+  // We first calculate the relaxon populations f_alpha, then back-rotate them
+  // to phonon coordinates. With x the driving term below, this is
+  // population = theta * diag(tau_alpha) * theta^T * x,
+  // which is done with distributed products on the eigenvector matrix.
   if (context.getUseSymmetries()) {
 
-    // relaxons population f_alpha
-    Eigen::VectorXd relaxonsPopulation(numEigenvalues);
-    relaxonsPopulation.setZero();
-
-#pragma omp parallel default(none)                                             \
-    shared(relaxonsPopulation, temp, chemPot, scatteringMatrix, eigenvectors,       \
-           eigenvalues, particle, localStates, nlocalStates)
-    {
-      // each omp process needs its own copy
-      Eigen::VectorXd relaxonsPopPrivate(eigenvalues.size());
-      relaxonsPopPrivate.setZero();
-
-#pragma omp for nowait
-      for(int ilocalState = 0; ilocalState < nlocalStates; ilocalState++){
-
-        // calculate related state indices (need to use SMatrix for this when sym present)
-        // scalapack required eigenvectors to be the same size as
-        // the SMatrix, so this indexing works for eigenvectors, too.
-        std::tuple<int,int> tup0 = localStates[ilocalState];
-        int iMat1 = std::get<0>(tup0);
-        int alpha = std::get<1>(tup0);
-        auto tup1 = scatteringMatrix.getSMatrixIndex(iMat1);
-        BteIndex iBteIdx = std::get<0>(tup1);
-        CartIndex dimIdx = std::get<1>(tup1);
-        StateIndex isIdx = bandStructure.bteToState(iBteIdx);
-        int iDim = dimIdx.get();
+    // calculate related state indices (need to use SMatrix for this when sym present)
+    // scalapack required eigenvectors to be the same size as
+    // the SMatrix, so this indexing works for eigenvectors, too.
+    int numRows = eigenvectors.rows();
+    Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numRows, 1);
+#pragma omp parallel for default(none)                                         \
+    shared(x, numRows, temp, chemPot, scatteringMatrix, particle)
+    for (int iMat1 = 0; iMat1 < numRows; iMat1++) {
+      auto tup1 = scatteringMatrix.getSMatrixIndex(iMat1);
+      BteIndex iBteIdx = std::get<0>(tup1);
+      CartIndex dimIdx = std::get<1>(tup1);
+      StateIndex isIdx = bandStructure.bteToState(iBteIdx);
+      int iDim = dimIdx.get();
 
+      double en = bandStructure.getEnergy(isIdx);
+      // Not sure which equation this comes from in 2016 PRX,
+      // maybe should check 2020
+      if (en > 0.) {
+        //  sum(alpha, i) dn/dT * (1/sqrt(n(n+1)))
+        //                        * v_i * theta_mu,alpha * tau_alpha
         auto vel = bandStructure.getGroupVelocity(isIdx);
-        double en = bandStructure.getEnergy(isIdx);
         double term = sqrt(particle.getPopPopPm1(en, temp, chemPot));
         double dndt = particle.getDndt(en, temp, chemPot);
-        // Not sure which equation this comes from in 2016 PRX,
-        // maybe should check 2020
-        if (eigenvalues(alpha) > 0. && en > 0.) {
-          //  sum(alpha, i) dn/dT * (1/sqrt(n(n+1)))
-          //                        * v_i * theta_mu,alpha * tau_alpha
-          relaxonsPopPrivate(alpha) += dndt / term * vel(iDim) *
-                                  eigenvectors(iMat1, alpha) /
-                                  eigenvalues(alpha);
-        }
-      }
-#pragma omp critical
-      for (int alpha = 0; alpha < eigenvalues.size(); alpha++) {
-        relaxonsPopulation(alpha) += relaxonsPopPrivate(alpha);
+        x(iMat1, 0) = dndt / term * vel(iDim);
       }
     }
-    mpi->allReduceSum(&relaxonsPopulation);
-
-    // back rotate to phonon coordinates
-
-#pragma omp parallel default(none)                                             \
-    shared(bandStructure, eigenvectors, relaxonsPopulation, population,             \
-           scatteringMatrix, iCalc, localStates, nlocalStates)
-    {
-      Eigen::MatrixXd popPrivate(dimensionality, bandStructure.irrStateIterator().size());
-      popPrivate.setZero();
 
-#pragma omp for nowait
-      for(int ilocalState = 0; ilocalState < nlocalStates; ilocalState++){
-        std::tuple<int,int> tup0 = localStates[ilocalState];
-        int iMat1 = std::get<0>(tup0);
-        int alpha = std::get<1>(tup0);
-        auto tup1 = scatteringMatrix.getSMatrixIndex(iMat1);
-        BteIndex iBteIndex = std::get<0>(tup1);
-        CartIndex dimIndex = std::get<1>(tup1);
-        int iBte = iBteIndex.get();
-        int iDim = dimIndex.get();
-        popPrivate(iDim, iBte) +=
-            eigenvectors(iMat1, alpha) * relaxonsPopulation(alpha);
-      }
+    Eigen::MatrixXd y = eigenvectors.projectOnColumns(x, relaxonTimes);
 
-#pragma omp critical
-      for (int is = 0; is < popPrivate.cols(); is++) {
-        for (int i = 0; i < dimensionality; i++) {
-          population(iCalc, i, is) += popPrivate(i, is);
-        }
-      }
+    for (int iMat1 = 0; iMat1 < numRows; iMat1++) {
+      auto tup1 = scatteringMatrix.getSMatrixIndex(iMat1);
+      int iBte = std::get<0>(tup1).get();
+      int iDim = std::get<1>(tup1).get();
+      population(iCalc, iDim, iBte) += y(iMat1, 0);
     }
-    mpi->allReduceSum(&population.data);
 
   } else { // case without symmetries ------------------------------------------
 
-    Eigen::MatrixXd relaxonsPopulation(eigenvalues.size(), dimensionality);
-    relaxonsPopulation.setZero();
-#pragma omp parallel default(none)                                             \
-    shared(eigenvectors, eigenvalues, temp, chemPot, particle, relaxonsPopulation, localStates, nlocalStates)
-    {
-      Eigen::MatrixXd relaxonsPopPrivate(eigenvalues.size(), dimensionality); 
-      relaxonsPopPrivate.setZero();
-#pragma omp for nowait
-      for(int ilocalState = 0; ilocalState < nlocalStates; ilocalState++){
-        std::tuple<int,int> tup0 = localStates[ilocalState];
-        int is = std::get<0>(tup0);
-        StateIndex isIdx(is);
-        int alpha = std::get<1>(tup0);
-        double en = bandStructure.getEnergy(isIdx);
-        if (eigenvalues(alpha) > 0. && en > 0.) {
-          auto vel = bandStructure.getGroupVelocity(isIdx);
-          double term = sqrt(particle.getPopPopPm1(en, temp, chemPot));
-          double dndt = particle.getDndt(en, temp, chemPot);
-          for (int i = 0; i < dimensionality; i++) {
-            relaxonsPopPrivate(alpha, i) += dndt / term * vel(i) *
-                                       eigenvectors(is, alpha) /
-                                       eigenvalues(alpha);
-          }
-        }
-      }
-#pragma omp critical
-      for (int alpha = 0; alpha < eigenvalues.size(); alpha++) {
+    int numStates = bandStructure.getNumStates();
+    Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates, dimensionality);
+#pragma omp parallel for default(none)                                         \
+    shared(x, numStates, temp, chemPot, particle)
+    for (int is = 0; is < numStates; is++) {
+      StateIndex isIdx(is);
+      double en = bandStructure.getEnergy(isIdx);
+      if (en > 0.) {
+        auto vel = bandStructure.getGroupVelocity(isIdx);
+        double term = sqrt(particle.getPopPopPm1(en, temp, chemPot));
+        double dndt = particle.getDndt(en, temp, chemPot);
         for (int i = 0; i < dimensionality; i++) {
-          relaxonsPopulation(alpha, i) += relaxonsPopPrivate(alpha, i);
+          x(is, i) = dndt / term * vel(i);
         }
       }
     }
-    mpi->allReduceSum(&relaxonsPopulation);
 
-    // back rotate to phonon coordinates
-#pragma omp parallel default(none)                                             \
-    shared(eigenvectors, relaxonsPopulation, population, iCalc, localStates, nlocalStates)
-    {
-      Eigen::MatrixXd popPrivate(dimensionality, bandStructure.getNumStates());
-      popPrivate.setZero();
+    Eigen::MatrixXd y = eigenvectors.projectOnColumns(x, relaxonTimes);
 
-#pragma omp for nowait
-      for(int ilocalState = 0; ilocalState < nlocalStates; ilocalState++){
-        std::tuple<int,int> tup0 = localStates[ilocalState];
-        int is = std::get<0>(tup0);
-        int alpha = std::get<1>(tup0);
-        for (int i = 0; i < dimensionality; i++) {
-          popPrivate(i, is) += eigenvectors(is, alpha) * relaxonsPopulation(alpha, i);
-        }
-      }
-#pragma omp critical
-      for (int is = 0; is < bandStructure.getNumStates(); is++) {
-        for (int i = 0; i < dimensionality; i++) {
-          population(iCalc, i, is) += popPrivate(i, is);
-        }
+    for (int is = 0; is < numStates; is++) {
+      for (int i = 0; i < dimensionality; i++) {
+        population(iCalc, i, is) = y(is, i);
       }
     }
-    mpi->allReduceSum(&population.data);
   }
 
   // put back the rescaling factor
@@ -445,6 +386,67 @@ void PhononThermalConductivity::calcFromRelaxons(
   calcFromPopulation(population);
 }
 
+void PhononThermalConductivity::calcACFromRelaxons(
+    ParallelMatrix<double> &eigenvectors, const Eigen::VectorXd &eigenvalues) {
+
+  if (context.getUseSymmetries()) {
+    Error("Developer error: the AC conductivity from relaxons is only "
+          "implemented without symmetries");
+  }
+  acFrequencies = context.getACFrequencies();
+  auto numFrequencies = int(acFrequencies.size());
+  auto numRelaxons = int(eigenvalues.size());
+  int numStates = bandStructure.getNumStates();
+  auto particle = bandStructure.getParticle();
+  Points points = bandStructure.getPoints();
+  double norm = 1. / crystal.getVolumeUnitCell(dimensionality);
+
+  int iCalc = 0; // relaxons only allows one calc in memory
+  double temp = statisticsSweep.getCalcStatistics(iCalc).temperature;
+  double chemPot = statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
+
+  // the first columns are the driving term of calcFromRelaxons, the others
+  // are the heat current of each state, both in the symmetrized basis,
+  // so that the conductivity is sum_alpha x_alpha,i j_alpha,j tau_alpha
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates, 2 * dimensionality);
+#pragma omp parallel for default(none)                                         \
+    shared(x, numStates, temp, chemPot, particle, points, norm)
+  for (int is = 0; is < numStates; is++) {
+    StateIndex isIdx(is);
+    double en = bandStructure.getEnergy(isIdx);
+    // skip the acoustic phonons, as VectorBTE does
+    if (en < 0.1 / ryToCmm1) {
+      continue;
+    }
+    auto vel = bandStructure.getGroupVelocity(isIdx);
+    double term = sqrt(particle.getPopPopPm1(en, temp, chemPot));
+    double dndt = particle.getDndt(en, temp, chemPot);
+    auto ikIdx = std::get<0>(bandStructure.getIndex(isIdx));
+    double weight = norm * points.getWeight(ikIdx.get());
+    for (int i = 0; i < dimensionality; i++) {
+      x(is, i) = dndt / term * vel(i);
+      x(is, i + dimensionality) = term * en * vel(i) * weight;
+    }
+  }
+  Eigen::MatrixXd projections = eigenvectors.projectColumns(x, numRelaxons);
+
+  Eigen::MatrixXcd response = relaxonsACResponse(eigenvalues, acFrequencies);
+  acTensor.resize(numFrequencies, dimensionality, dimensionality);
+  for (int iFreq = 0; iFreq < numFrequencies; iFreq++) {
+    for (int i = 0; i < dimensionality; i++) {
+      for (int j = 0; j < dimensionality; j++) {
+        std::complex<double> sum = 0.;
+        for (int alpha = 0; alpha < numRelaxons; alpha++) {
+          sum += projections(alpha, i) *
+                 projections(alpha, j + dimensionality) *
+                 response(alpha, iFreq);
+        }
+        acTensor(iFreq, i, j) = sum;
+      }
+    }
+  }
+}
+
 void PhononThermalConductivity::print() {
 
   if (!mpi->mpiHead()) return;
@@ -509,6 +511,114 @@ void PhononThermalConductivity::outputToJSON(const std::string &outFileName) {
   o.close();
 }
 
+void PhononThermalConductivity::outputACToJSON(
+    const std::string &outFileName) {
+
+  if (!mpi->mpiHead()) return;
+
+  std::vector<double> frequencies;
+  std::vector<std::vector<std::vector<double>>> realParts, imagParts;
+  for (int iFreq = 0; iFreq < int(acFrequencies.size()); iFreq++) {
+    // from inverse atomic units of time to THz
+    frequencies.push_back(acFrequencies[iFreq] / (timeAuToFs * 1.0e-3));
+    std::vector<std::vector<double>> realRows, imagRows;
+    for (int i = 0; i < dimensionality; i++) {
+      std::vector<double> realCols, imagCols;
+      for (int j = 0; j < dimensionality; j++) {
+        realCols.push_back(acTensor(iFreq, i, j).real() * thCondConversion);
+        imagCols.push_back(acTensor(iFreq, i, j).imag() * thCondConversion);
+      }
+      realRows.push_back(realCols);
+      imagRows.push_back(imagCols);
+    }
+    realParts.push_back(realRows);
+    imagParts.push_back(imagRows);
+  }
+
+  auto calcStat = statisticsSweep.getCalcStatistics(0);
+  nlohmann::json output;
+  output["temperature"] = calcStat.temperature * temperatureAuToSi;
+  output["temperatureUnit"] = "K";
+  output["frequencies"] = frequencies;
+  output["frequencyUnit"] = "THz";
+  output["thermalConductivityReal"] = realParts;
+  output["thermalConductivityImag"] = imagParts;
+  output["thermalConductivityUnit"] = thCondUnits;
+  output["particleType"] = "phonon";
+  std::ofstream o(outFileName);
+  o << std::setw(3) << output << std::endl;
+  o.close();
+}
+
+// converts a tensor (iCalc,i,j,iBin) to nested vectors [iCalc][iBin][i][j],
+// either bin by bin or accumulated over the bins
+static std::vector<std::vector<std::vector<std::vector<double>>>>
+spectralToVector(const Eigen::Tensor<double, 4> &x, const int &dimensionality,
+                 const double &conversion, const bool &cumulative) {
+  std::vector<std::vector<std::vector<std::vector<double>>>> out;
+  for (int iCalc = 0; iCalc < x.dimension(0); iCalc++) {
+    std::vector<std::vector<std::vector<double>>> bins;
+    Eigen::MatrixXd sum = Eigen::MatrixXd::Zero(dimensionality, dimensionality);
+    for (int iBin = 0; iBin < x.dimension(3); iBin++) {
+      std::vector<std::vector<double>> rows;
+      for (int i = 0; i < dimensionality; i++) {
+        std::vector<double> cols;
+        for (int j = 0; j < dimensionality; j++) {
+          sum(i, j) = (cumulative ? sum(i, j) : 0.) + x(iCalc, i, j, iBin);
+          cols.push_back(sum(i, j) * conversion);
+        }
+        rows.push_back(cols);
+      }
+      bins.push_back(rows);
+    }
+    out.push_back(bins);
+  }
+  return out;
+}
+
+void PhononThermalConductivity::outputSpectralToJSON(
+    const std::string &outFileName) {
+
+  if (!mpi->mpiHead() || frequencyBinEdges.size() == 0) return;
+
+  std::vector<double> temps;
+  for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temps.push_back(calcStat.temperature * temperatureAuToSi);
+  }
+  std::vector<double> frequencies;
+  for (int i = 0; i < frequencyBinEdges.size(); i++) {
+    frequencies.push_back(frequencyBinEdges(i) * ryToCmm1);
+  }
+
+  nlohmann::json output;
+  output["temperatures"] = temps;
+  output["temperatureUnit"] = "K";
+  output["frequencyBinEdges"] = frequencies;
+  output["frequencyUnit"] = "cm^-1";
+  output["thermalConductivityByFrequency"] = spectralToVector(
+      frequencyResolved, dimensionality, thCondConversion, false);
+  output["cumulativeThermalConductivityByFrequency"] = spectralToVector(
+      frequencyResolved, dimensionality, thCondConversion, true);
+  if (mfpBinEdges.size() > 0) {
+    std::vector<double> mfps;
+    for (int i = 0; i < mfpBinEdges.size(); i++) {
+      mfps.push_back(mfpBinEdges(i) * distanceBohrToMum);
+    }
+    output["meanFreePathBinEdges"] = mfps;
+    output["meanFreePathUnit"] = "mum";
+    output["thermalConductivityByMeanFreePath"] = spectralToVector(
+        mfpResolved, dimensionality, thCondConversion, false);
+    output["cumulativeThermalConductivityByMeanFreePath"] = spectralToVector(
+        mfpResolved, dimensionality, thCondConversion, true);
+  }
+  output["thermalConductivityUnit"] = thCondUnits;
+  output["particleType"] = "phonon";
+  std::ofstream o(outFileName);
+  o << std::setw(3) << output << std::endl;
+  o.close();
+}
+
 void PhononThermalConductivity::print(const int &iter) {
 
   if (!mpi->mpiHead()) return;
@@ -543,3 +653,8 @@ int PhononThermalConductivity::whichType() { return is2Tensor; }
 Eigen::Tensor<double,3> PhononThermalConductivity::getThermalConductivity() {
   return tensordxd;
 }
+
+std::tuple<double, std::string>
+PhononThermalConductivity::getOutputUnits() const {
+  return std::make_tuple(thCondConversion, thCondUnits);
+}
@@ -75,6 +75,26 @@ public:
                         PhScatteringMatrix &scatteringMatrix,
                         const Eigen::VectorXd &eigenvalues);
 
+  /** Computes the frequency-dependent (AC) thermal conductivity, at the
+   * frequencies of context.getACFrequencies(), from the relaxons.
+   * Each frequency is a diagonal shift of the relaxon eigenvalues (see
+   * Observable::relaxonsACResponse), so that the driving term and the heat
+   * current are projected on the relaxons only once, with a single
+   * distributed product, and all the frequencies are then computed from
+   * these projections. Only for the first temperature, and without
+   * symmetries, as calcFromRelaxons.
+   * @param eigenvectors: relaxon eigenvectors, in the symmetrized basis.
+   * @param eigenvalues: relaxon eigenvalues.
+   */
+  void calcACFromRelaxons(ParallelMatrix<double> &eigenvectors,
+                          const Eigen::VectorXd &eigenvalues);
+
+  /** Outputs the AC thermal conductivity computed by calcACFromRelaxons
+   * to a json file, with its real and imaginary parts.
+   * @param outFileName: string representing the name of the json file
+   */
+  void outputACToJSON(const std::string& outFileName);
+
   /** Prints to screen the thermal conductivity at various temperatures
    * in a a nicely formatted way.
    */
@@ -94,13 +114,49 @@ public:
 
   Eigen::Tensor<double,3> getThermalConductivity();
 
+  /** Returns the factor converting the thermal conductivity from atomic
+   * units to the units of the output files, and the name of these units.
+   */
+  std::tuple<double, std::string> getOutputUnits() const;
+
+  /** Outputs to a json file the thermal conductivity resolved by frequency
+   * and by mean free path, if it has been computed by ObservablesPass.
+   * @param outFileName: string representing the name of the json file
+   */
+  void outputSpectralToJSON(const std::string& outFileName);
+
 protected:
+  // the fused pass adds the coherences after filling the tensor, and fills
+  // the frequency and mean free path resolved conductivities
+  friend class ObservablesPass;
+
   int whichType() override;
+
+  /** Adds further contributions to the conductivity after it has been
+   * computed from the populations (e.g. the Wigner coherences).
+   */
+  virtual void addCoherenceCorrection() {}
+
+  /** Accumulates the conductivity from a population, rescaled state by state
+   * by (bose(bose+1))^popPopPm1Exponent, so that canonical populations
+   * (exponent 1) don't need to be copied and converted first.
+   */
+  void accumulatePopulation(VectorBTE &n, const double &popPopPm1Exponent);
+
   BaseBandStructure &bandStructure;
   // unit information for writing to files
   std::string thCondUnits; 
   double thCondConversion; 
 
+  // conductivity resolved by frequency and mean free path, with indices
+  // (iCalc, i, j, iBin), and the edges of the bins (in Ry and Bohr)
+  Eigen::VectorXd frequencyBinEdges, mfpBinEdges;
+  Eigen::Tensor<double, 4> frequencyResolved, mfpResolved;
+
+  // AC conductivity (iFreq, i, j), at the frequencies (in inverse Ry
+  // atomic units of time) of calcACFromRelaxons
+  std::vector<double> acFrequencies;
+  Eigen::Tensor<std::complex<double>, 3> acTensor;
 };
 
 #endif
@@ -28,6 +28,8 @@ void PhononViscosity::calcRTA(VectorBTE &tau) {
 
   std::vector<int> iss = bandStructure.parallelIrrStateIterator();
   int niss = iss.size();
+  // getPoints() returns a copy, which we don't make for every state
+  Points points = bandStructure.getPoints();
 
   Kokkos::View<double*****, Kokkos::LayoutLeft, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>> tensordxdxdxd_k(tensordxdxdxd.data(), numCalculations, dimensionality, dimensionality, dimensionality, dimensionality);
   Kokkos::Experimental::ScatterView<double*****, Kokkos::LayoutLeft, Kokkos::HostSpace> scatter_tensordxdxdxd(tensordxdxdxd_k);
@@ -48,11 +50,11 @@ void PhononViscosity::calcRTA(VectorBTE &tau) {
     auto velIrr = bandStructure.getGroupVelocity(isIdx);
     auto qIrr = bandStructure.getWavevector(isIdx);
 
-    auto rotations = bandStructure.getRotationsStar(isIdx);
-    for (const Eigen::Matrix3d& rotation : rotations) {
+    for (int iRot : bandStructure.getRotationIndicesStar(isIdx)) {
+      const Eigen::Matrix3d &rotation = bandStructure.getRotationMatrix(iRot);
 
       Eigen::Vector3d q = rotation * qIrr;
-      q = bandStructure.getPoints().bzToWs(q,Points::cartesianCoordinates);
+      q = points.bzToWs(q,Points::cartesianCoordinates);
       Eigen::Vector3d vel = rotation * velIrr;
 
       for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
@@ -92,9 +94,6 @@ void PhononViscosity::calcFromRelaxons(Eigen::VectorXd &eigenvalues,
   int numRelaxons = eigenvalues.size();
   int iCalc = 0; // zero index, because we only run one for relaxons
 
-  // search for the indices of the special eigenvectors and print info about them
-  relaxonEigenvectorsCheck(eigenvectors, numRelaxons);
-
   // Code by Andrea, annotation by Jenny
   // Here we are calculating Eq. 9 from the PRX Simoncelli 2020
   //    mu_ijkl = (eta_ijkl + eta_ilkj)/2
@@ -125,50 +124,42 @@ void PhononViscosity::calcFromRelaxons(Eigen::VectorXd &eigenvalues,
   // NOTE: phi, theta0, A, and specific heat are calculated earlier
   // and stored ready to use here
 
-  // calculate the first part of w^j_i,alpha
-  Eigen::Tensor<double, 3> tmpDriftEigvecs(dimensionality, dimensionality, numStates);
-  tmpDriftEigvecs.setZero();
-  for (int is : bandStructure.parallelStateIterator()) {
+  // all the projections on the relaxon eigenvectors are done with a single
+  // distributed product, stacking as columns of x the special eigenvectors
+  // theta0 and theta_e (to identify them among the relaxons) and the first
+  // part of w^j_i,alpha, the drift eigenvectors times the velocities
+  int numSpecial = 2;
+  Eigen::MatrixXd x(numStates, numSpecial + dimensionality * dimensionality);
+  x.col(0) = theta0;
+  x.col(1) = theta_e;
+#pragma omp parallel for default(none) shared(x, numStates, numSpecial)
+  for (int is = 0; is < numStates; is++) {
     auto isIdx = StateIndex(is);
     auto v = bandStructure.getGroupVelocity(isIdx);
     for (int i = 0; i < dimensionality; i++) {
       for (int j = 0; j < dimensionality; j++) {
-        tmpDriftEigvecs(i, j, is) = phi(j, is) * v(i);
+        x(is, numSpecial + i + dimensionality * j) = phi(j, is) * v(i);
       }
     }
   }
-  mpi->allReduceSum(&tmpDriftEigvecs);
+  Eigen::MatrixXd projections = eigenvectors.projectColumns(x, numRelaxons);
+
+  // search for the indices of the special eigenvectors and print info about them
+  Particle particle = bandStructure.getParticle();
+  Eigen::MatrixXd prodThetas = projections.leftCols(numSpecial);
+  genericRelaxonEigenvectorsCheck(prodThetas, particle, alpha0, alpha_e);
 
-  // now we're calculating w
+  // w^j_i,alpha = sum_is1 phi*v*theta
+  // Andrea's note: in Eq. 9 of PRX, w is normalized by V*N_q
+  // here however I normalize the eigenvectors differently:
+  // \sum_state theta_s^2 = 1, instead of 1/VN_q \sum_state theta_s^2 = 1
   Eigen::Tensor<double, 3> w(dimensionality, dimensionality, numStates);
   w.setZero();
-  for (int i = 0; i < dimensionality; i++) {
-    for (int j = 0; j < dimensionality; j++) {
-      // drift eigenvectors * v -- only have phonon state indices
-      // and cartesian directions
-      Eigen::VectorXd x(numStates);
-      for (int is = 0; is < numStates; is++) {
-        x(is) = tmpDriftEigvecs(i, j, is);
-      }
-
-      // w^j_i,alpha = sum_is1 phi*v*theta
-      std::vector<double> x2(numRelaxons, 0.);
-      for (auto tup : eigenvectors.getAllLocalStates()) {
-        auto is1 = std::get<0>(tup);
-        auto alpha = std::get<1>(tup);
-        if(alpha >= numRelaxons) continue; // wasn't calculated
-        x2[alpha] += x(is1) * eigenvectors(is1, alpha);
-      }
-      mpi->allReduceSum(&x2);
-
-      // this normalization is needed to make the overall normalization work
-      // given that scalapack normalizes the eigenvectors to theta*theta = 1
-      for (int ialpha = 0; ialpha < numRelaxons; ialpha++) {
-        w(i, j, ialpha) = x2[ialpha];// / ( sqrt(volume) * sqrt(context.getQMesh().prod()) );
+  for (int ialpha = 0; ialpha < numRelaxons; ialpha++) {
+    for (int i = 0; i < dimensionality; i++) {
+      for (int j = 0; j < dimensionality; j++) {
+        w(i, j, ialpha) = projections(ialpha, numSpecial + i + dimensionality * j);
       }
-      // Andrea's note: in Eq. 9 of PRX, w is normalized by V*N_q
-      // here however I normalize the eigenvectors differently:
-      // \sum_state theta_s^2 = 1, instead of 1/VN_q \sum_state theta_s^2 = 1
     }
   }
 
@@ -357,14 +348,16 @@ void PhononViscosity::outputToJSON(const std::string& outFileName) {
 
 int PhononViscosity::whichType() { return is4Tensor; }
 
-void PhononViscosity::outputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix) {
+void PhononViscosity::outputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
+                                        const std::string& outFileName) {
 
   // we need a dummy variable for theta_e, as it doesn't matter for phonons
   Eigen::VectorXd theta_e(bandStructure.getNumStates());
 
   // call the function in viscosity io
   genericOutputRealSpaceToJSON(scatteringMatrix, bandStructure, statisticsSweep,
-                                theta0, theta_e, phi, C, A, context);
+                                theta0, theta_e, phi, C, A, context,
+                                outFileName);
 
 }
 
@@ -13,22 +13,20 @@ void genericRelaxonEigenvectorsCheck(ParallelMatrix<double>& eigenvectors,
                                     int& alpha0, int& alpha_e) {
 
   // calculate the overlaps with special eigenvectors
-  Eigen::VectorXd prodTheta0(numRelaxons); prodTheta0.setZero();
-  Eigen::VectorXd prodThetae(numRelaxons); prodThetae.setZero();
-  for (auto tup : eigenvectors.getAllLocalStates()) {
-
-    auto is = std::get<0>(tup);
-    auto gamma = std::get<1>(tup);
-    //if(std::isnan(eigenvectors(is,gamma)) || std::isnan(theta0(is))) std::cout << is << " " << gamma << " " << eigenvectors(is,gamma) << " " << theta0(is) << std::endl; 
-    prodTheta0(gamma) += eigenvectors(is,gamma) * theta0(is);
-    prodThetae(gamma) += eigenvectors(is,gamma) * theta_e(is);
+  Eigen::MatrixXd x(theta0.size(), 2);
+  x.col(0) = theta0;
+  x.col(1) = theta_e;
+  Eigen::MatrixXd prodThetas = eigenvectors.projectColumns(x, numRelaxons);
+  genericRelaxonEigenvectorsCheck(prodThetas, particle, alpha0, alpha_e);
+}
 
-  }
-  mpi->allReduceSum(&prodThetae); mpi->allReduceSum(&prodTheta0);
+void genericRelaxonEigenvectorsCheck(const Eigen::MatrixXd& prodThetas,
+                                     Particle& particle,
+                                     int& alpha0, int& alpha_e) {
 
   // find the element with the maximum product
-  prodTheta0 = prodTheta0.cwiseAbs();
-  prodThetae = prodThetae.cwiseAbs();
+  Eigen::VectorXd prodTheta0 = prodThetas.col(0).cwiseAbs();
+  Eigen::VectorXd prodThetae = prodThetas.col(1).cwiseAbs();
   Eigen::Index maxCol0, idxAlpha0;
   Eigen::Index maxCol_e, idxAlpha_e;
   float maxTheta0 = prodTheta0.maxCoeff(&idxAlpha0, &maxCol0);
@@ -91,47 +89,59 @@ void genericCalcSpecialEigenvectors(BaseBandStructure& bandStructure,
   // theta^0 - energy conservation eigenvector
   //   electronic states = ds * g-1 * (hE - mu) * 1/(kbT^2 * V * Nkq * Ctot)
   //   phonon states = ds * g-1 * h*omega * 1/(kbT^2 * V * Nkq * Ctot)
-  theta0 = Eigen::VectorXd::Zero(numStates);
 
   // theta^e -- the charge conservation eigenvector
   //   electronic states = ds * g-1 * 1/(kbT * U)
   // for the phonons, this is unused
-  theta_e = Eigen::VectorXd::Zero(numStates);
 
   // phi -- the three momentum conservation eigenvectors
   //     phi = sqrt(1/(kbT*volume*Nkq*M)) * g-1 * ds * hbar * wavevector;
-  phi = Eigen::MatrixXd::Zero(3, numStates);
-
-  // spin degen vector
-  Eigen::VectorXd ds = Eigen::VectorXd::Zero(numStates);
 
   // normalization for theta_e
   double U = 0;
 
   // specific heat
-  C = 0.; 
+  C = 0.;
+
+  // normalization coeff A ("phonon specific momentum")
+  // A = 1/(V*N) * (1/kT) sum_qs (hbar*q)^2 * N(1+N)
+  A = Eigen::Vector3d::Zero();
 
-  // calculate the special eigenvectors ----------------
+  // calculate the special eigenvectors and their normalizations ----------
+  // everything is computed in a single pass over the local states, and
+  // reduced with a single MPI call. Columns of x: theta0, theta_e, phi_i;
+  // the last row holds C, U and A_i, which are sums over the states
+  double ds = sqrt(spinFactor);
+  Eigen::MatrixXd x = Eigen::MatrixXd::Zero(numStates + 1, 5);
   for (int is : bandStructure.parallelStateIterator()) {
 
-    ds(is) = sqrt(spinFactor);
     auto isIdx = StateIndex(is);
     double en = bandStructure.getEnergy(isIdx);
     if(particle.isPhonon() && en < 0.001 / ryToCmm1) { continue; }
-    double pop = particle.getPopPopPm1(en, kBT, chemPot);
+    double pop = particle.getPopPopPm1(en, kBT, chemPot); // = n(n+1)
 
-    theta0(is) = sqrt(pop) * (en - chemPot) * ds(is);
+    x(is, 0) = sqrt(pop) * (en - chemPot) * ds;
+    x(numStates, 0) += pop * (en - chemPot) * (en - chemPot);
     if(particle.isElectron()) {
-      theta_e(is) = sqrt(pop) * ds(is);
-      U += pop;
+      x(is, 1) = sqrt(pop) * ds;
+      x(numStates, 1) += pop;
+    }
+    // drift eigenvectors, phi (eq A12 of PRX Simoncelli)
+    auto q = bandStructure.getWavevector(isIdx);
+    q = bandStructure.getPoints().bzToWs(q,Points::cartesianCoordinates);
+    for (int i = 0; i < dimensionality; i++) {
+      x(is, 2 + i) = q(i) * sqrt(pop) * ds;
+      x(numStates, 2 + i) += pop * q(i) * q(i);
     }
-    auto popCont = pop * (en - chemPot) * (en - chemPot);
-    C += pop * (en - chemPot) * (en - chemPot);
   }
-  mpi->allReduceSum(&theta0);
-  mpi->allReduceSum(&theta_e);
-  mpi->allReduceSum(&C);
-  mpi->allReduceSum(&U);
+  mpi->allReduceSum(&x);
+
+  C = x(numStates, 0);
+  U = x(numStates, 1);
+  for (int i = 0; i < dimensionality; i++) A(i) = x(numStates, 2 + i);
+  theta0 = x.col(0).head(numStates);
+  theta_e = x.col(1).head(numStates);
+  phi = x.block(0, 2, numStates, 3).transpose();
 
   // apply normalizations
   C *= spinFactor / (volume * size_t(Npts) * kBT * T);
@@ -139,47 +149,9 @@ void genericCalcSpecialEigenvectors(BaseBandStructure& bandStructure,
   U *= spinFactor / (volume * Npts * kBT);
   if(particle.isPhonon()) U = 1.; // avoid making theta_e nan instead of zero
   theta_e *= 1./sqrt(kBT * U * Npts * volume);
-  
-  // calculate A_i ----------------------------------------
-
-  // normalization coeff A ("phonon specific momentum")
-  // A = 1/(V*N) * (1/kT) sum_qs (hbar*q)^2 * N(1+N)
-  A = Eigen::Vector3d::Zero();
-
-  for (int is : bandStructure.parallelStateIterator()) {
-    auto isIdx = StateIndex(is);
-    auto en = bandStructure.getEnergy(isIdx);
-
-    if(particle.isPhonon() && en < 0.001 / ryToCmm1) { continue; }
-    double pop = particle.getPopPopPm1(en, kBT, chemPot); // = n(n+1)
-    auto q = bandStructure.getWavevector(isIdx);
-    q = bandStructure.getPoints().bzToWs(q,Points::cartesianCoordinates);
-    for (int iDim = 0; iDim < dimensionality; iDim++) {
-      A(iDim) += pop * q(iDim) * q(iDim);
-    }
-  }
-  mpi->allReduceSum(&A);
   A *= spinFactor / (kBT * Npts * volume);
-
-  // then calculate the drift eigenvectors, phi (eq A12 of PRX Simoncelli)
-  // -----------------------------------------------------------------
-  for (int is : bandStructure.parallelStateIterator()) {
-
-    auto isIdx = StateIndex(is);
-    auto en = bandStructure.getEnergy(isIdx);
-    if(particle.isPhonon() && en < 0.001 / ryToCmm1) { continue; }
-
-    double pop = particle.getPopPopPm1(en, kBT, chemPot); // = n(n+1)
-    auto q = bandStructure.getWavevector(isIdx);
-    q = bandStructure.getPoints().bzToWs(q,Points::cartesianCoordinates);
-    for (int i = 0; i < dimensionality; i++) {
-      phi(i, is) = q(i) * sqrt(pop) * ds(is);
-    }
-  }
-  mpi->allReduceSum(&phi);
-  // apply normalization to phi
-  for(int is = 0; is < numStates; is++) {
-    for (int i = 0; i < dimensionality; i++) phi(i,is) *= 1./sqrt(kBT * volume * Npts * A(i));
+  for (int i = 0; i < dimensionality; i++) {
+    phi.row(i) *= 1./sqrt(kBT * volume * Npts * A(i));
   }
 /*
   // print phi overlap
@@ -318,7 +290,8 @@ void genericOutputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
                                 Eigen::VectorXd& theta_e,
                                 Eigen::MatrixXd& phi,
                                 double& C, Eigen::Vector3d& A,
-                                Context& context) {
+                                Context& context,
+                                const std::string& outFileName) {
 
   // write D to file before diagonalizing, as the scattering matrix
   // will be destroyed by scalapack
@@ -336,26 +309,12 @@ void genericOutputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
   // below used only for electrons
   Eigen::MatrixXd Wjie(dimensionality,dimensionality); Wjie.setZero();
 
-  // sum over the alpha and v states that this process owns
-  for (auto tup : scatteringMatrix.getAllLocalStates()) {
-
-    auto is1 = std::get<0>(tup);
-    auto is2 = std::get<1>(tup);
-    for (int i = 0; i < dimensionality; i++) {
-      for (int j = 0; j < dimensionality; j++) {
-      /*  if(context.getUseUpperTriangle()) {
-          if( i == j ) {
-            Du(i,j) += phi(i,is1) * scatteringMatrix(is1,is2) * phi(j,is2);
-          } else {
-            Du(i,j) += 2. * phi(i,is1) * scatteringMatrix(is1,is2) * phi(j,is2);
-          }
-        } else { */
-          Du(i,j) += phi(i,is1) * scatteringMatrix(is1,is2) * phi(j,is2);
-       // }
-      }
-    }
-  }
-  mpi->allReduceSum(&Du);
+  // Du_ij = phi_i * Omega * phi_j, computed with a single product of the
+  // matrix with the drift eigenvectors, instead of a loop over the
+  // individual matrix elements. This works also with the sparse storage.
+  Eigen::MatrixXd phiT = phi.topRows(dimensionality).transpose();
+  Eigen::MatrixXd omegaPhi = scatteringMatrix.blockDot(phiT);
+  Du = phiT.transpose() * omegaPhi;
 
   for (int is : bandStructure.parallelStateIterator()) {
     auto isIdx = StateIndex(is);
@@ -425,8 +384,6 @@ void genericOutputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
 
   if(mpi->mpiHead()) {
     // output to json
-    std::string outFileName = "el_relaxons_real_space_coeffs.json";
-    if(isPhonon) outFileName = "ph_relaxons_real_space_coeffs.json";
     nlohmann::json output;
     output["temperature"] = kBT * temperatureAuToSi;
     output["Wji0"] = vecWji0;
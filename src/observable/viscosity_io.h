@@ -29,6 +29,7 @@
    * @param phi: momentum conservation eigenvectors
    * @param C: specific heat
    * @param A: specific momentum
+   * @param outFileName: name of the json file
    */
    void genericOutputRealSpaceToJSON(ScatteringMatrix& scatteringMatrix,
                                 BaseBandStructure& bandStructure,
@@ -37,7 +38,8 @@
                                 Eigen::VectorXd& theta_e,
                                 Eigen::MatrixXd& phi,
                                 double& C, Eigen::Vector3d& A,
-                                Context& context);
+                                Context& context,
+                                const std::string& outFileName);
 
   /** Helper function to print information about the scalar products with the
    * special eigenvectors.
@@ -55,6 +57,15 @@
                                 Eigen::VectorXd& theta_e,
                                 int& alpha0, int& alpha_e);
 
+  /** Same as above, but with the scalar products already computed, so that
+   * they can be stacked with other projections on the eigenvectors.
+   * @param prodThetas: matrix (numRelaxons x 2) with the scalar products of
+   * the eigenvectors with theta0 (first column) and theta_e (second column)
+   */
+  void genericRelaxonEigenvectorsCheck(const Eigen::MatrixXd& prodThetas,
+                                Particle& particle,
+                                int& alpha0, int& alpha_e);
+
   /** Helper function to pre-calculate the special eigenvectors theta0,
    * theta_e, phi as well as A, C
    * @param bandStructure: bandstructure for either phonons or electrons
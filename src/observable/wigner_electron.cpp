@@ -1,5 +1,6 @@
 #include "wigner_electron.h"
 #include "constants.h"
+#include <algorithm>
 #include <iomanip>
 
 WignerElCoefficients::WignerElCoefficients(StatisticsSweep &statisticsSweep_,
@@ -24,92 +25,138 @@ WignerElCoefficients::WignerElCoefficients(StatisticsSweep &statisticsSweep_,
   double norm = spinFactor / context.getKMesh().prod() /
                 crystal.getVolumeUnitCell(dimensionality) / 2.;
 
-  Eigen::Tensor<std::complex<double>, 4> fE, fT;
-
-  for (int ik : mpi->divideWorkIter(bandStructure.getNumPoints())) {
-    WavevectorIndex ikIdx(ik);
-    auto velocities = bandStructure.getVelocities(ikIdx);
-    auto energies = bandStructure.getEnergies(ikIdx);
-    int numBands = energies.size();
-
-    Eigen::Vector3d k = bandStructure.getWavevector(ikIdx);
-    auto t = bandStructure.getRotationToIrreducible(k, Points::cartesianCoordinates);
-    int ikIrr = std::get<0>(t);
-
-    // we do the calculation in two steps
-
-    //-----------------------------------------------------------------------
-    // Step 1: compute the off-diagonal population term (at given wavevector)
-
-    fE.resize(numBands, numBands, dimensionality, numCalculations);
-    fT.resize(numBands, numBands, dimensionality, numCalculations);
-    fE.setZero();
-    fT.setZero();
+  std::vector<double> temperatures(numCalculations);
+  std::vector<double> chemicalPotentials(numCalculations);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
+    temperatures[iCalc] = calcStat.temperature;
+    chemicalPotentials[iCalc] = calcStat.chemicalPotential;
+  }
 
-    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-      auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-      double chemPot = calcStat.chemicalPotential;
-      double temp = calcStat.temperature;
-      Eigen::VectorXd fermi(numBands);
-      Eigen::VectorXd dfdt(numBands);
-      for (int ib1 = 0; ib1 < numBands; ib1++) {
-        fermi(ib1) = particle.getPopulation(energies(ib1), temp, chemPot);
-        dfdt(ib1) = particle.getDndt(energies(ib1), temp, chemPot);
+  std::vector<size_t> points =
+      mpi->divideWorkIter(bandStructure.getNumPoints());
+  auto numLocalPoints = int(points.size());
+
+#pragma omp parallel default(none)                                             \
+    shared(points, numLocalPoints, temperatures, chemicalPotentials, norm,     \
+           particle)
+  {
+    // we do manually the reduction, to avoid custom type declaration
+    // which is not always allowed by the compiler e.g. by clang
+    Eigen::Tensor<double, 3> localLEE(numCalculations, 3, 3);
+    Eigen::Tensor<double, 3> localLTE(numCalculations, 3, 3);
+    Eigen::Tensor<double, 3> localLET(numCalculations, 3, 3);
+    Eigen::Tensor<double, 3> localLTT(numCalculations, 3, 3);
+    localLEE.setZero();
+    localLTE.setZero();
+    localLET.setZero();
+    localLTT.setZero();
+
+#pragma omp for nowait schedule(dynamic)
+    for (int iPoint = 0; iPoint < numLocalPoints; iPoint++) {
+      WavevectorIndex ikIdx(int(points[iPoint]));
+      auto velocities = bandStructure.getVelocities(ikIdx);
+      auto energies = bandStructure.getEnergies(ikIdx);
+      int numBands = energies.size();
+
+      Eigen::Vector3d k = bandStructure.getWavevector(ikIdx);
+      auto t = bandStructure.getRotationToIrreducible(k, Points::cartesianCoordinates);
+      int ikIrr = std::get<0>(t);
+
+      // populations and inverse relaxation times of each band
+      Eigen::MatrixXd fermi(numCalculations, numBands);
+      Eigen::MatrixXd dfdt(numCalculations, numBands);
+      Eigen::MatrixXd gamma(numCalculations, numBands);
+      Eigen::VectorXd gammaMax = Eigen::VectorXd::Zero(numCalculations);
+      for (int ib = 0; ib < numBands; ib++) {
+        int is = bandStructure.getIndex(WavevectorIndex(ikIrr), BandIndex(ib));
+        StateIndex isIdx(is);
+        int iBte = bandStructure.stateToBte(isIdx).get();
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double temp = temperatures[iCalc];
+          double chemPot = chemicalPotentials[iCalc];
+          fermi(iCalc, ib) = particle.getPopulation(energies(ib), temp, chemPot);
+          dfdt(iCalc, ib) = particle.getDndt(energies(ib), temp, chemPot);
+          gamma(iCalc, ib) = 1. / smaRelTimes(iCalc, 0, iBte);
+          gammaMax(iCalc) = std::max(gammaMax(iCalc), gamma(iCalc, ib));
+        }
       }
-
+      // with sorted energies, the pairs with a negligible Lorentzian can be
+      // skipped in blocks
+      bool isSorted = std::is_sorted(energies.data(), energies.data() + numBands);
+
+      // The off-diagonal populations are
+      // fE(ib1,ib2) = -2 v(ib1,ib2) / x(ib1,ib2) (f1-f2)/(e1-e2)
+      // fT(ib1,ib2) = 2 v(ib1,ib2) / x(ib1,ib2) (df1/dT + df2/dT)
+      // with x(ib1,ib2) = 1/tau1 + 1/tau2 + 2i(e1-e2) = conj(x(ib2,ib1)).
+      // The anti-commutator of the pair (ib1,ib2) is then equal to the one of
+      // (ib2,ib1), so we only loop on ib2 > ib1
       for (int ib1 = 0; ib1 < numBands; ib1++) {
-        for (int ib2 = 0; ib2 < numBands; ib2++) {
-          if (ib1 == ib2) {
-            continue;
+        for (int ib2 = ib1 + 1; ib2 < numBands; ib2++) {
+          double deltaE = energies(ib1) - energies(ib2);
+
+          // with the largest linewidth at this point, the Lorentzian is an
+          // upper bound for the following bands
+          if (isSorted) {
+            bool isNegligible = true;
+            for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              double g = gamma(iCalc, ib1) + gammaMax(iCalc);
+              if (g * g >= lorentzianCutoff * (4. * deltaE * deltaE + g * g)) {
+                isNegligible = false;
+                break;
+              }
+            }
+            if (isNegligible) {
+              break;
+            }
+          }
+
+          // v(ib1,ib2,i) * v(ib2,ib1,j)
+          Eigen::Matrix3cd vel;
+          for (int i : {0, 1, 2}) {
+            for (int j : {0, 1, 2}) {
+              vel(i, j) = velocities(ib1, ib2, i) * velocities(ib2, ib1, j);
+            }
           }
-          int is1 = bandStructure.getIndex(WavevectorIndex(ikIrr), BandIndex(ib1));
-          int is2 = bandStructure.getIndex(WavevectorIndex(ikIrr), BandIndex(ib2));
-          StateIndex is1Idx(is1);
-          StateIndex is2Idx(is2);
-          int iBte1 = bandStructure.stateToBte(is1Idx).get();
-          int iBte2 = bandStructure.stateToBte(is2Idx).get();
-
-          std::complex<double> xC = {1. / smaRelTimes(iCalc, 0, iBte1) +
-                                         1. / smaRelTimes(iCalc, 0, iBte2),
-                                     2. * (energies(ib1) - energies(ib2))};
-
-          for (int ic1 = 0; ic1 < dimensionality; ic1++) {
-            fE(ib1, ib2, ic1, iCalc) = -2. * velocities(ib1, ib2, ic1) / xC *
-                                       (fermi(ib1) - fermi(ib2)) /
-                                       (energies(ib1) - energies(ib2));
-            fT(ib1, ib2, ic1, iCalc) =
-                2. * velocities(ib1, ib2, ic1) / xC * (dfdt(ib1) + dfdt(ib2));
+
+          for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+            double g = gamma(iCalc, ib1) + gamma(iCalc, ib2);
+            if (g * g < lorentzianCutoff * (4. * deltaE * deltaE + g * g)) {
+              continue;
+            }
+            std::complex<double> xInv =
+                1. / std::complex<double>(g, 2. * deltaE);
+            double factorE =
+                -2. * (fermi(iCalc, ib1) - fermi(iCalc, ib2)) / deltaE;
+            double factorT = 2. * (dfdt(iCalc, ib1) + dfdt(iCalc, ib2));
+            // sum of the energies of the pairs (ib1,ib2) and (ib2,ib1)
+            double energyTerm = energies(ib1) + energies(ib2) -
+                                2. * chemicalPotentials[iCalc];
+            for (int ic1 = 0; ic1 < dimensionality; ic1++) {
+              for (int ic2 = 0; ic2 < dimensionality; ic2++) {
+                double x = std::real(vel(ic1, ic2) * std::conj(xInv) +
+                                     vel(ic2, ic1) * xInv);
+                double xE = factorE * x;
+                double xT = factorT * x;
+                localLEE(iCalc, ic1, ic2) += 2. * norm * xE;
+                localLET(iCalc, ic1, ic2) -= 2. * norm * xT;
+                localLTE(iCalc, ic1, ic2) -= norm * energyTerm * xE;
+                localLTT(iCalc, ic1, ic2) -= norm * energyTerm * xT;
+              }
+            }
           }
         }
       }
     }
 
-    //---------------------------------------------------------------------
-    // Step 2: now compute the anti-commutator for the transport coefficient
-
-    for (int ib1 = 0; ib1 < numBands; ib1++) {
-      for (int ib2 = 0; ib2 < numBands; ib2++) {
-        if (ib1 == ib2)
-          continue;
-        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-          double chemicalPotential =
-              statisticsSweep.getCalcStatistics(iCalc).chemicalPotential;
-          for (int ic1 = 0; ic1 < dimensionality; ic1++) {
-            for (int ic2 = 0; ic2 < dimensionality; ic2++) {
-              double xE = std::real(
-                  velocities(ib1, ib2, ic1) * fE(ib2, ib1, ic2, iCalc) +
-                  velocities(ib2, ib1, ic1) * fE(ib1, ib2, ic2, iCalc));
-              double xT = std::real(
-                  velocities(ib1, ib2, ic1) * fT(ib2, ib1, ic2, iCalc) +
-                  velocities(ib2, ib1, ic1) * fT(ib1, ib2, ic2, iCalc));
-              correctionLEE(iCalc, ic1, ic2) += norm * xE;
-              correctionLET(iCalc, ic1, ic2) -= norm * xT;
-              correctionLTE(iCalc, ic1, ic2) -=
-                  norm * (energies(ib1) - chemicalPotential) * xE;
-              correctionLTT(iCalc, ic1, ic2) -=
-                  norm * (energies(ib1) - chemicalPotential) * xT;
-            }
-          }
+#pragma omp critical
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      for (int ic1 = 0; ic1 < dimensionality; ic1++) {
+        for (int ic2 = 0; ic2 < dimensionality; ic2++) {
+          correctionLEE(iCalc, ic1, ic2) += localLEE(iCalc, ic1, ic2);
+          correctionLTE(iCalc, ic1, ic2) += localLTE(iCalc, ic1, ic2);
+          correctionLET(iCalc, ic1, ic2) += localLET(iCalc, ic1, ic2);
+          correctionLTT(iCalc, ic1, ic2) += localLTT(iCalc, ic1, ic2);
         }
       }
     }
@@ -142,13 +189,17 @@ WignerElCoefficients::operator=(const WignerElCoefficients &that) {
 
 void WignerElCoefficients::calcFromPopulation(VectorBTE &nE, VectorBTE &nT) {
   OnsagerCoefficients::calcFromPopulation(nE, nT);
+  addCoherenceCorrection();
+  // calcTransportCoefficients is called twice, also in base calcFromPopulation.
+  // Could this be improved?
+  calcTransportCoefficients();
+}
+
+void WignerElCoefficients::addCoherenceCorrection() {
   LEE += correctionLEE;
   LTE += correctionLTE;
   LET += correctionLET;
   LTT += correctionLTT;
-  // calcTransportCoefficients is called twice, also in base calcFromPopulation.
-  // Could this be improved?
-  calcTransportCoefficients();
 }
 
 void WignerElCoefficients::print() {
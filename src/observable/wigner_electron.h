@@ -47,9 +47,14 @@ class WignerElCoefficients : public OnsagerCoefficients {
   void print() override;
 
  protected:
+  void addCoherenceCorrection() override;
+
   VectorBTE &smaRelTimes;
   Eigen::Tensor<double, 3> correctionLEE, correctionLTE, correctionLET,
       correctionLTT;
+  // band pairs whose Lorentzian is smaller than this fraction of its peak
+  // value give a negligible contribution to the coherence term
+  static constexpr double lorentzianCutoff = 1.0e-8;
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include "wigner_phonon_thermal_cond.h"
+#include <algorithm>
 #include <iomanip>
 #include "constants.h"
 
@@ -38,87 +39,134 @@ WignerPhononThermalConductivity::WignerPhononThermalConductivity(
                   temperature / 2.;
   }
 
-  for (int iq : bandStructure.parallelIrrPointsIterator()) {
-    WavevectorIndex iqIdx(iq);
-
-    auto velocities = bandStructure.getVelocities(iqIdx);
-    auto energies = bandStructure.getEnergies(iqIdx);
-    auto numBands = int(energies.size());
+  std::vector<double> temperatures(numCalculations);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    temperatures[iCalc] = statisticsSweep.getCalcStatistics(iCalc).temperature;
+  }
 
-    // calculate bose factors
-    Eigen::MatrixXd bose(numCalculations, numBands);
-    for (int ib1 = 0; ib1 < numBands; ib1++) {
-      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-        auto calcStat = statisticsSweep.getCalcStatistics(iCalc);
-        double temperature = calcStat.temperature;
-        bose(iCalc, ib1) = particle.getPopulation(energies(ib1), temperature);
-        // exclude acoustic phonons, cutoff at 0.1 cm^-1
-        // setting this to zero here causes acoustic ph
-        // contribution below to evaluate to zero
-        if (energies(ib1) < 0.1 / ryToCmm1) {
-          bose(iCalc, ib1) = 0.0;
+  std::vector<int> irrPoints = bandStructure.parallelIrrPointsIterator();
+  auto numIrrPoints = int(irrPoints.size());
+
+#pragma omp parallel default(none)                                             \
+    shared(irrPoints, numIrrPoints, temperatures, norm, particle, dimensionality)
+  {
+    // we do manually the reduction, to avoid custom type declaration
+    // which is not always allowed by the compiler e.g. by clang
+    Eigen::Tensor<double, 3> localCorrection(numCalculations, 3, 3);
+    localCorrection.setZero();
+
+#pragma omp for nowait schedule(dynamic)
+    for (int iIrr = 0; iIrr < numIrrPoints; iIrr++) {
+      WavevectorIndex iqIdx(irrPoints[iIrr]);
+
+      auto velocities = bandStructure.getVelocities(iqIdx);
+      auto energies = bandStructure.getEnergies(iqIdx);
+      auto numBands = int(energies.size());
+
+      // energy times bose factors, and inverse relaxation times, of each band
+      Eigen::MatrixXd boseTerm(numCalculations, numBands);
+      Eigen::MatrixXd gamma(numCalculations, numBands);
+      Eigen::VectorXd gammaMax = Eigen::VectorXd::Zero(numCalculations);
+      for (int ib = 0; ib < numBands; ib++) {
+        StateIndex isIdx(bandStructure.getIndex(iqIdx, BandIndex(ib)));
+        int iBte = bandStructure.stateToBte(isIdx).get();
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double bose = particle.getPopulation(energies(ib), temperatures[iCalc]);
+          // exclude acoustic phonons, cutoff at 0.1 cm^-1
+          // setting this to zero here causes acoustic ph
+          // contribution below to evaluate to zero
+          if (energies(ib) < 0.1 / ryToCmm1) {
+            bose = 0.0;
+          }
+          boseTerm(iCalc, ib) = energies(ib) * bose * (bose + 1.);
+          gamma(iCalc, ib) = 1. / smaRelTimes(iCalc, 0, iBte);
+          gammaMax(iCalc) = std::max(gammaMax(iCalc), gamma(iCalc, ib));
         }
       }
-    }
-
-    BandIndex ibIdx(0);
-    int is = bandStructure.getIndex(iqIdx, ibIdx);
-    StateIndex isIdx(is);
-    auto rots = bandStructure.getRotationsStar(isIdx);
-
-    // apply rotation to velocity
-    for (const Eigen::Matrix3d &rot : rots) {
-
-      Eigen::Tensor<std::complex<double>, 3> velRot = velocities.constant(0.);
+      // with sorted energies, the pairs with a negligible Lorentzian can be
+      // skipped in blocks
+      bool isSorted = std::is_sorted(energies.data(), energies.data() + numBands);
+
+      // sum over band pairs, before the rotations of the star of q.
+      // The terms (ib1,ib2) and (ib2,ib1) have the same weight, and their
+      // velocity products are the transpose of each other
+      Eigen::Tensor<double, 3> pointSum(numCalculations, 3, 3);
+      pointSum.setZero();
       for (int ib1 = 0; ib1 < numBands; ib1++) {
-        for (int ib2 = 0; ib2 < numBands; ib2++) {
+        for (int ib2 = ib1 + 1; ib2 < numBands; ib2++) {
+          double deltaE2 = 4. * pow(energies(ib1) - energies(ib2), 2);
+
+          // with the largest linewidth at this point, the Lorentzian is an
+          // upper bound for the following bands
+          if (isSorted) {
+            bool isNegligible = true;
+            for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+              double g = gamma(iCalc, ib1) + gammaMax(iCalc);
+              if (g * g >= lorentzianCutoff * (deltaE2 + g * g)) {
+                isNegligible = false;
+                break;
+              }
+            }
+            if (isNegligible) {
+              break;
+            }
+          }
+
+          Eigen::Matrix3d vel;
           for (int i : {0, 1, 2}) {
             for (int j : {0, 1, 2}) {
-              velRot(ib1, ib2, i) += rot(i, j) * velocities(ib1, ib2, j);
+              vel(i, j) = (velocities(ib1, ib2, i) * velocities(ib2, ib1, j)).real();
+            }
+          }
+          vel += vel.transpose().eval();
+
+          for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+            double g = gamma(iCalc, ib1) + gamma(iCalc, ib2);
+            double den = deltaE2 + g * g;
+            if (g * g < lorentzianCutoff * den) {
+              continue;
+            }
+            double weight = (energies(ib1) + energies(ib2)) *
+                            (boseTerm(iCalc, ib1) + boseTerm(iCalc, ib2)) /
+                            den * g * norm(iCalc);
+            for (int i : {0, 1, 2}) {
+              for (int j : {0, 1, 2}) {
+                pointSum(iCalc, i, j) += weight * vel(i, j);
+              }
             }
           }
         }
       }
 
-      // calculate wigner correction
-      for (int ib1 = 0; ib1 < numBands; ib1++) {
-        for (int ib2 = 0; ib2 < numBands; ib2++) {
-          if (ib1 == ib2) {
-            continue;
+      // apply the rotations of the star to the velocities
+      StateIndex isIdx(bandStructure.getIndex(iqIdx, BandIndex(0)));
+      auto rots = bandStructure.getRotationsStar(isIdx);
+      for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+        Eigen::Matrix3d x;
+        for (int i : {0, 1, 2}) {
+          for (int j : {0, 1, 2}) {
+            x(i, j) = pointSum(iCalc, i, j);
           }
-
-          int is1 = bandStructure.getIndex(iqIdx, BandIndex(ib1));
-          int is2 = bandStructure.getIndex(iqIdx, BandIndex(ib2));
-          auto is1Idx = StateIndex(is1);
-          auto is2Idx = StateIndex(is2);
-          int iBte1 = bandStructure.stateToBte(is1Idx).get();
-          int iBte2 = bandStructure.stateToBte(is2Idx).get();
-
-          for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
-            for (int ic1 = 0; ic1 < dimensionality; ic1++) {
-              for (int ic2 = 0; ic2 < dimensionality; ic2++) {
-
-                double num =
-                    energies(ib1) * bose(iCalc, ib1) * (bose(iCalc, ib1) + 1.) +
-                    energies(ib2) * bose(iCalc, ib2) * (bose(iCalc, ib2) + 1.);
-                double vel =
-                    (velRot(ib1, ib2, ic1) * velRot(ib2, ib1, ic2)).real();
-                double den = 4. * pow(energies(ib1) - energies(ib2), 2) +
-                             pow(1. / smaRelTimes(iCalc, 0, iBte1) +
-                                     1. / smaRelTimes(iCalc, 0, iBte2),
-                                 2);
-
-                wignerCorrection(iCalc, ic1, ic2) +=
-                    (energies(ib1) + energies(ib2)) * vel * num / den *
-                    (1. / smaRelTimes(iCalc, 0, iBte1) +
-                     1. / smaRelTimes(iCalc, 0, iBte2)) *
-                    norm(iCalc);
-              }
+        }
+        for (const Eigen::Matrix3d &rot : rots) {
+          Eigen::Matrix3d xRot = rot * x * rot.transpose();
+          for (int ic1 = 0; ic1 < dimensionality; ic1++) {
+            for (int ic2 = 0; ic2 < dimensionality; ic2++) {
+              localCorrection(iCalc, ic1, ic2) += xRot(ic1, ic2);
             }
           }
         }
       }
     }
+
+#pragma omp critical
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      for (int ic1 = 0; ic1 < dimensionality; ic1++) {
+        for (int ic2 = 0; ic2 < dimensionality; ic2++) {
+          wignerCorrection(iCalc, ic1, ic2) += localCorrection(iCalc, ic1, ic2);
+        }
+      }
+    }
   }
   mpi->allReduceSum(&wignerCorrection);
 }
@@ -142,14 +190,14 @@ WignerPhononThermalConductivity &WignerPhononThermalConductivity::operator=(
 
 void WignerPhononThermalConductivity::calcFromPopulation(VectorBTE &n) {
   PhononThermalConductivity::calcFromPopulation(n);
-  tensordxd += wignerCorrection;
+  addCoherenceCorrection();
 }
 
 void WignerPhononThermalConductivity::calcVariational(VectorBTE &af,
                                                       VectorBTE &f,
                                                       VectorBTE &scalingCG) {
   PhononThermalConductivity::calcVariational(af, f, scalingCG);
-  tensordxd += wignerCorrection;
+  addCoherenceCorrection();
 }
 
 void WignerPhononThermalConductivity::calcFromRelaxons(
@@ -159,6 +207,10 @@ void WignerPhononThermalConductivity::calcFromRelaxons(
   PhononThermalConductivity::calcFromRelaxons(context, statisticsSweep,
                                               eigenvectors,
                                               scatteringMatrix, eigenvalues);
+  addCoherenceCorrection();
+}
+
+void WignerPhononThermalConductivity::addCoherenceCorrection() {
   tensordxd += wignerCorrection;
 }
 
@@ -70,8 +70,13 @@ public:
   void print() override;
 
 protected:
+  void addCoherenceCorrection() override;
+
   VectorBTE &smaRelTimes;
   Eigen::Tensor<double, 3> wignerCorrection;
+  // band pairs whose Lorentzian is smaller than this fraction of its peak
+  // value give a negligible contribution to the coherence term
+  static constexpr double lorentzianCutoff = 1.0e-8;
   // unit information for writing to files
   std::string thCondUnits; 
   double thCondConversion; 
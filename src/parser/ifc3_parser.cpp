@@ -113,10 +113,8 @@ std::tuple<Eigen::MatrixXd, Eigen::Tensor<double, 3>, Eigen::MatrixXd, Eigen::Te
 reorderDynamicalMatrix(
     Crystal &crystal, const Eigen::Vector3i &qCoarseGrid, const Eigen::MatrixXd &rws,
     Eigen::Tensor<double, 5> &mat3R, Eigen::MatrixXd &cellPositions,
-    const std::vector<
-        std::vector<std::vector<std::vector<std::vector<std::vector<double>>>>>>
-        &ifc3Tensor,
-    const std::vector<int> &cellMap) {
+    const std::vector<double> &ifc3Slabs, const std::vector<int> &localAtoms,
+    const int &numSupAtoms, const std::vector<int> &cellMap) {
 
   Kokkos::Profiling::pushRegion("reorderDynamicalMatrix");
 
@@ -310,7 +308,9 @@ reorderDynamicalMatrix(
               auto ir3 = findIndexRow(cellPositions, rp3);
 
               // loop over the atoms involved in the first vector
-              for (int na = 0; na < numAtoms; na++) {
+              // (only those read by this MPI process)
+              for (int iLocal = 0; iLocal < int(localAtoms.size()); iLocal++) {
+                int na = localAtoms[iLocal];
                 for (int nb = 0; nb < numAtoms; nb++) {
 
                   // calculate the R2 vector for atom nb
@@ -355,9 +355,11 @@ reorderDynamicalMatrix(
                             std::cout << ind1 << " " << ind2 << " " << ind3 << " "
                                       << iR3 << " " << iR2 << "\n";
                           }
+                          size_t index =
+                              ((((size_t(iLocal) * numSupAtoms + sat2) *
+                                     numSupAtoms + sat3) * 3 + i) * 3 + j) * 3 + k;
                           mat3R(ind1, ind2, ind3, iR3, iR2) +=
-                              ifc3Tensor[cellMap[na]][sat2][sat3][i][j][k] * conversion;
-//                          ifc3Tensor[cellMap[na]][sat2][sat3][i][j][k] * conversion;
+                              ifc3Slabs[index] * conversion;
 
                         }// close cartesian loops
                       }
@@ -372,6 +374,9 @@ reorderDynamicalMatrix(
     }// close nb loop
   }  // close na loop
 
+  // each MPI process has filled the elements of its atoms
+  mpi->allReduceSum(&mat3R);
+
   Kokkos::Profiling::popRegion();
   return std::make_tuple(bravaisVectors, weights, bravaisVectors, weights);
 }
@@ -387,8 +392,9 @@ Interaction3Ph IFC3Parser::parseFromPhono3py(Context &context,
 #else
 
   // Notes about p3py's fc3.hdf5 file:
-  // 3rd order fcs are listed as (num_atom, num_atom, num_atom, 3, 3, 3)
-  // stored in eV/Angstrom3
+  // 3rd order fcs are listed as (num_atom, num_atom, num_atom, 3, 3, 3),
+  // or as (num_prim_atom, num_atom, num_atom, 3, 3, 3) if phono3py was run
+  // with --compact-fc, and are stored in eV/Angstrom3
   // Look here for additional details
   // https://phonopy.github.io/phono3py/output-files.html#fc3-hdf5
 
@@ -563,26 +569,32 @@ Interaction3Ph IFC3Parser::parseFromPhono3py(Context &context,
   if (mpi->mpiHead())
     std::cout << "Reading in " + fileName + "." << std::endl;
 
+  // Only the force constants fc3(a,b,c) with the atom a in the unit cell at
+  // the origin are used. Hence, we only read the hyperslabs fc3[a,:,:,:,:,:]
+  // of the unit cell atoms, and these are distributed over the MPI processes.
+  // The dataset is either the full (numSupAtoms,numSupAtoms,numSupAtoms,3,3,3)
+  // array, or the compact (numAtoms,numSupAtoms,numSupAtoms,3,3,3) one.
+  std::vector<int> localAtoms;
+  for (size_t na : mpi->divideWorkIter(numAtoms)) {
+    localAtoms.push_back(int(na));
+  }
+  size_t slabSize = size_t(numSupAtoms) * numSupAtoms * 27;
+
   // user info about memory
   // note, this is for a temporary array --
   // later we reduce to (numAtoms*3)^3 * numRVecs
   {
-    double rx;
-    double x = pow(numSupAtoms * 3, 3) / pow(1024., 3) * sizeof(rx);
+    double x = double(slabSize) * localAtoms.size() * sizeof(double)
+        / pow(1024., 3);
+    mpi->allReduceMax(&x);
     if (mpi->mpiHead()) {
       std::cout << "Allocating " << x
-                << " (GB) (per MPI process) for the 3-ph coupling matrix."
+                << " (GB) (per MPI process) for reading the 3-ph force constants."
                 << std::endl;
     }
   }
 
-  // set up buffer to read entire matrix
-  // have to use this monstrosity because the
-  // phono3py data is shaped as a 6 dimensional array,
-  // and eigen tensor is not supported by highFive
-  std::vector<
-      std::vector<std::vector<std::vector<std::vector<std::vector<double>>>>>>
-      ifc3Tensor;
+  std::vector<double> ifc3Slabs(slabSize * localAtoms.size());
   std::vector<int> cellMap;
 
   try {
@@ -591,11 +603,26 @@ Interaction3Ph IFC3Parser::parseFromPhono3py(Context &context,
     // Set up hdf5 datasets
     HighFive::DataSet difc3 = file.getDataSet("/fc3");
     HighFive::DataSet dcellMap = file.getDataSet("/p2s_map");
-
-    // read in the ifc3 data
-    difc3.read(ifc3Tensor);
     dcellMap.read(cellMap);
 
+    std::vector<size_t> dims = difc3.getDimensions();
+    bool isCompact = dims.size() == 6 && int(dims[0]) == numAtoms &&
+                     numAtoms != numSupAtoms;
+    if (dims.size() != 6 || int(dims[1]) != numSupAtoms ||
+        int(dims[2]) != numSupAtoms ||
+        (!isCompact && int(dims[0]) != numSupAtoms)) {
+      Error("The fc3 dataset in " + fileName + " has unexpected dimensions.");
+    }
+
+    // read in the ifc3 data, one unit cell atom at a time
+    for (int iLocal = 0; iLocal < int(localAtoms.size()); iLocal++) {
+      int na = localAtoms[iLocal];
+      size_t firstIndex = isCompact ? na : cellMap[na];
+      difc3.select({firstIndex, 0, 0, 0, 0, 0},
+                   {1, size_t(numSupAtoms), size_t(numSupAtoms), 3, 3, 3})
+          .read_raw(&ifc3Slabs[slabSize * iLocal]);
+    }
+
   } catch (std::exception &error) {
     if(mpi->mpiHead()) std::cout << error.what() << std::endl;
     Error("Issue reading fc3.hdf5 file. Make sure it exists at " + fileName +
@@ -623,7 +650,9 @@ Interaction3Ph IFC3Parser::parseFromPhono3py(Context &context,
   Eigen::Tensor<double, 5> FC3;
 
   auto tup = reorderDynamicalMatrix(crystal, qCoarseGrid, rws, FC3,
-                                    cellPositions, ifc3Tensor, cellMap);
+                                    cellPositions, ifc3Slabs, localAtoms,
+                                    numSupAtoms, cellMap);
+  std::vector<double>().swap(ifc3Slabs);
   auto bravaisVectors2 = std::get<0>(tup);
   auto weights2 = std::get<1>(tup);
   auto bravaisVectors3 = std::get<2>(tup);
@@ -637,7 +666,9 @@ Interaction3Ph IFC3Parser::parseFromPhono3py(Context &context,
 
   // Create interaction3Ph object
   Interaction3Ph interaction3Ph(crystal, FC3, bravaisVectors2, bravaisVectors3,
-                                weights2, weights3);
+                                weights2, weights3,
+                                context.getFc3PruningThreshold(),
+                                context.getFc3DistanceCutoff());
 
   Kokkos::Profiling::popRegion();
   return interaction3Ph;
@@ -828,7 +859,9 @@ Interaction3Ph IFC3Parser::parseFromShengBTE(Context &context,
   weights.setConstant(1.);
 
   Interaction3Ph interaction3Ph(crystal, FC3, cellPositions2,
-                                cellPositions3, weights, weights);
+                                cellPositions3, weights, weights,
+                                context.getFc3PruningThreshold(),
+                                context.getFc3DistanceCutoff());
 
   if (mpi->mpiHead()) {
     std::cout << "Successfully parsed anharmonic "
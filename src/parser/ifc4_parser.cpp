@@ -0,0 +1,146 @@
+#include "ifc4_parser.h"
+#include "constants.h"
+#include "eigen.h"
+#include "mpiHelper.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+std::unique_ptr<Interaction4Ph> IFC4Parser::parse(Context &context, Crystal &crystal) {
+
+  Kokkos::Profiling::pushRegion("IFC4Parser::parse");
+
+  auto fileName = context.getPhFC4FileName();
+
+  // Open IFC4 file
+  std::ifstream infile(fileName);
+  std::string line;
+
+  if (not infile.is_open()) {
+    Error("FC4 file not found");
+  }
+  if (mpi->mpiHead()) {
+    std::cout << "Reading in " + fileName + "." << std::endl;
+  }
+
+  // Number of quartets
+  std::getline(infile, line);
+  int numQuartets = std::stoi(line);
+
+  int numAtoms = crystal.getNumAtoms();
+  int numBands = numAtoms * 3;
+
+  // the quartets with the same (R2,R3,R4) vectors are grouped in one block
+  std::vector<Eigen::Vector3d> positions2, positions3, positions4;
+  std::vector<int> quartetBlock(numQuartets);
+  std::vector<Eigen::Vector4i> quartetAtoms(numQuartets);
+  Eigen::Tensor<double, 5> ifc4Tensor(3, 3, 3, 3, numQuartets);
+  ifc4Tensor.setZero();
+
+  double conversion = pow(distanceBohrToAng, 4) / energyRyToEv;
+  for (int iq = 0; iq < numQuartets; iq++) {
+    // empty line
+    std::getline(infile, line);
+    // line with a counter
+    std::getline(infile, line);
+
+    // Read the positions of the 2nd, 3rd and 4th cells
+    Eigen::Vector3d r[3];
+    for (auto &ri : r) {
+      std::getline(infile, line);
+      std::istringstream iss(line);
+      for (int j : {0, 1, 2}) {
+        iss >> ri(j);
+      }
+      ri /= distanceBohrToAng;
+    }
+
+    // find the block of this quartet
+    int iBlock = -1;
+    for (int ib = 0; ib < int(positions2.size()); ib++) {
+      if (positions2[ib] == r[0] && positions3[ib] == r[1] &&
+          positions4[ib] == r[2]) {
+        iBlock = ib;
+        break;
+      }
+    }
+    if (iBlock == -1) {
+      iBlock = int(positions2.size());
+      positions2.push_back(r[0]);
+      positions3.push_back(r[1]);
+      positions4.push_back(r[2]);
+    }
+    quartetBlock[iq] = iBlock;
+
+    // Read quartet atom indices
+    std::getline(infile, line);
+    std::istringstream iss2(line);
+    for (int j = 0; j < 4; j++) {
+      iss2 >> quartetAtoms[iq](j);
+      quartetAtoms[iq](j) -= 1;
+      if (quartetAtoms[iq](j) < 0 || quartetAtoms[iq](j) >= numAtoms) {
+        Error("Atom index in the FC4 file is inconsistent with the crystal");
+      }
+    }
+
+    // Read the 3x3x3x3 force constants tensor
+    int i1, i2, i3, i4;
+    double x;
+    for (int a = 0; a < 81; a++) {
+      std::getline(infile, line);
+      std::istringstream iss3(line);
+      if (iss3 >> i1 >> i2 >> i3 >> i4 >> x) {
+        ifc4Tensor(i1 - 1, i2 - 1, i3 - 1, i4 - 1, iq) = x * conversion;
+      }
+    }
+  }
+  infile.close();
+
+  int numBlocks = int(positions2.size());
+  Eigen::MatrixXd cellPositions2(3, numBlocks), cellPositions3(3, numBlocks),
+      cellPositions4(3, numBlocks);
+  for (int ib = 0; ib < numBlocks; ib++) {
+    cellPositions2.col(ib) = positions2[ib];
+    cellPositions3.col(ib) = positions3[ib];
+    cellPositions4.col(ib) = positions4[ib];
+  }
+
+  // user info about memory
+  if (mpi->mpiHead()) {
+    double x = pow(numBands, 4) * numBlocks / pow(1024., 3) * sizeof(double);
+    std::cout << "Allocating " << x
+              << " (GB) (per MPI process) for the 4-ph coupling matrix.\n"
+              << std::endl;
+  }
+
+  Eigen::Tensor<double, 5> FC4(numBands, numBands, numBands, numBands,
+                               numBlocks);
+  FC4.setZero();
+  for (int iq = 0; iq < numQuartets; iq++) {
+    int ib = quartetBlock[iq];
+    for (int ic1 : {0, 1, 2}) {
+      int ind1 = compress2Indices(quartetAtoms[iq](0), ic1, numAtoms, 3);
+      for (int ic2 : {0, 1, 2}) {
+        int ind2 = compress2Indices(quartetAtoms[iq](1), ic2, numAtoms, 3);
+        for (int ic3 : {0, 1, 2}) {
+          int ind3 = compress2Indices(quartetAtoms[iq](2), ic3, numAtoms, 3);
+          for (int ic4 : {0, 1, 2}) {
+            int ind4 = compress2Indices(quartetAtoms[iq](3), ic4, numAtoms, 3);
+            FC4(ind1, ind2, ind3, ind4, ib) =
+                ifc4Tensor(ic1, ic2, ic3, ic4, iq);
+          }
+        }
+      }
+    }
+  }
+
+  auto interaction4Ph = std::make_unique<Interaction4Ph>(
+      crystal, FC4, cellPositions2, cellPositions3, cellPositions4);
+
+  if (mpi->mpiHead()) {
+    std::cout << "Successfully parsed the 4th order force constants.\n"
+              << std::endl;
+  }
+  Kokkos::Profiling::popRegion();
+  return interaction4Ph;
+}
@@ -0,0 +1,26 @@
+#ifndef IFC4_PARSER_H
+#define IFC4_PARSER_H
+
+#include "context.h"
+#include "crystal.h"
+#include "interaction_4ph.h"
+#include <memory>
+
+/** Class for the parsing of the 4th derivative of the total energy with
+ * respect to ionic displacements, and the creation of a dedicated object.
+ */
+class IFC4Parser {
+public:
+  /** Parse the 4th derivative of the total energy wrt ionic displacements,
+   * from the FORCE_CONSTANTS_4TH file of ShengBTE (FourPhonon).
+   * @param context: the Context object with the user input (to get filename)
+   * @param crystal: Crystal object. To be obtained parsing the dynamical
+   * matrix first.
+   * @return Interaction4Ph: the object that contains the 4th derivative.
+   * Since the 4-phonon scattering is optional, the object is returned as a
+   * pointer.
+   */
+  static std::unique_ptr<Interaction4Ph> parse(Context &context, Crystal &crystal);
+};
+
+#endif
@@ -1,7 +1,66 @@
 #include "parser.h"
 
+#include <iomanip>
+#include <sstream>
+
+// When the user runs several apps in the same job (or in the same Session of
+// libphoebe), the harmonic Hamiltonians are parsed (and the acoustic sum rule
+// imposed) only once, and copies are handed to each app. The caches are keyed
+// by the input variables read by the parsers.
+namespace {
+std::map<std::string, std::tuple<Crystal, PhononH0>> phHarmonicCache;
+std::map<std::string, std::tuple<Crystal, ElectronH0Wannier>> elHarmonicCache;
+// set by a library Session, which may run any number of apps
+bool harmonicCacheEnabled = false;
+
+bool useHarmonicCache(Context &context) {
+  return harmonicCacheEnabled || context.getAppNames().size() > 1;
+}
+
+// sets the options of the band structures computed by the app that is
+// currently running. The off-diagonal elements of the velocity operator are
+// only used for the Wigner transport coefficients.
+void setBandStructureOptions(Context &context, HarmonicHamiltonian &h0) {
+  h0.setBandStructureCachePrefix(context.getBandStructureCachePrefix());
+  std::string appName = context.getAppName();
+  bool isWignerApp =
+      (appName == "phononTransport" && h0.getParticle().isPhonon()) ||
+      (appName == "electronWannierTransport" && h0.getParticle().isElectron());
+  h0.setOnlyGroupVelocities(!(isWignerApp && context.getWignerCorrection()));
+  h0.setSinglePrecisionEigenvectors(context.getEigenvectorsSinglePrecision());
+}
+}
+
 std::tuple<Crystal, PhononH0> Parser::parsePhHarmonic(Context &context) {
 
+  std::string key;
+  if (useHarmonicCache(context)) {
+    key = context.getPhFC2FileName() + "|" + context.getPhonopyDispFileName()
+        + "|" + context.getPhonopyBORNFileName() + "|"
+        + context.getSumRuleFC2();
+    auto cached = phHarmonicCache.find(key);
+    if (cached != phHarmonicCache.end()) {
+      if (mpi->mpiHead()) {
+        std::cout << "Reusing the phonon harmonic Hamiltonian parsed by a "
+                     "previous app.\n" << std::endl;
+      }
+      auto t = cached->second;
+      setBandStructureOptions(context, std::get<1>(t));
+      return t;
+    }
+  }
+
+  auto t = parsePhHarmonicFromFile(context);
+  setBandStructureOptions(context, std::get<1>(t));
+  if (useHarmonicCache(context)) {
+    phHarmonicCache.emplace(key, t);
+  }
+  return t;
+}
+
+std::tuple<Crystal, PhononH0> Parser::parsePhHarmonicFromFile(
+    Context &context) {
+
   std::string fileName = context.getPhonopyDispFileName();
 
   // check if this file is set -- if it is, we read from phonopy
@@ -23,10 +82,49 @@ std::tuple<Crystal, PhononH0> Parser::parsePhHarmonic(Context &context) {
 
 std::tuple<Crystal, ElectronH0Fourier> Parser::parseElHarmonicFourier(
         Context &context) {
-  return QEParser::parseElHarmonicFourier(context);
+  auto t = QEParser::parseElHarmonicFourier(context);
+  setBandStructureOptions(context, std::get<1>(t));
+  return t;
 }
 
 std::tuple<Crystal, ElectronH0Wannier> Parser::parseElHarmonicWannier(
             Context &context, Crystal *inCrystal) {
-  return QEParser::parseElHarmonicWannier(context, inCrystal);
+  if (!useHarmonicCache(context)) {
+    auto t = QEParser::parseElHarmonicWannier(context, inCrystal);
+    setBandStructureOptions(context, std::get<1>(t));
+    return t;
+  }
+
+  // the parser uses the unit cell of inCrystal, if passed
+  std::stringstream key;
+  key << context.getElectronH0Name() << "|" << context.getWsVecFileName();
+  if (inCrystal != nullptr) {
+    key << std::setprecision(17) << "|" << inCrystal->getDirectUnitCell();
+  }
+  auto cached = elHarmonicCache.find(key.str());
+  if (cached != elHarmonicCache.end()) {
+    if (mpi->mpiHead()) {
+      std::cout << "Reusing the electronic Wannier Hamiltonian parsed by a "
+                   "previous app.\n" << std::endl;
+    }
+    auto t = cached->second;
+    setBandStructureOptions(context, std::get<1>(t));
+    if (inCrystal != nullptr) {
+      return std::make_tuple(*inCrystal, std::get<1>(t));
+    }
+    return t;
+  }
+  auto t = QEParser::parseElHarmonicWannier(context, inCrystal);
+  setBandStructureOptions(context, std::get<1>(t));
+  elHarmonicCache.emplace(key.str(), t);
+  return t;
+}
+
+void Parser::clearHarmonicCache() {
+  phHarmonicCache.clear();
+  elHarmonicCache.clear();
+}
+
+void Parser::setHarmonicCacheEnabled(const bool &x) {
+  harmonicCacheEnabled = x;
 }
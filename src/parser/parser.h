@@ -7,6 +7,7 @@
 #include "phonon_h0.h"
 #include "phonopy_input_parser.h"
 #include "qe_input_parser.h"
+#include <map>
 #include <string>
 
 /** Class used to make decisions about which parser to call
@@ -45,6 +46,23 @@ public:
    */
   static std::tuple<Crystal, ElectronH0Wannier>
   parseElHarmonicWannier(Context &context, Crystal *inCrystal = nullptr);
+
+  /** Releases the harmonic Hamiltonians cached when several apps are run in
+   * the same job. Must be called before Kokkos is finalized, since the
+   * cached objects own device memory.
+   */
+  static void clearHarmonicCache();
+
+  /** Caches the harmonic Hamiltonians even when a single app is listed in
+   * the input, for a Session that runs several apps in the same process.
+   */
+  static void setHarmonicCacheEnabled(const bool &x);
+
+private:
+  /** Reads the force constants from the QE or phonopy files.
+   */
+  static std::tuple<Crystal, PhononH0> parsePhHarmonicFromFile(
+      Context &context);
 };
 
 #endif
@@ -2,6 +2,8 @@
 #include <cmath>     // round()
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -51,18 +53,21 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
 
   // open input file
   std::string fileName = context.getPhonopyDispFileName();
-  std::ifstream infile(fileName);
   std::string line;
 
   if (fileName.empty()) {
     Error("Phonopy required file phonopyDispFileName (phono3py_disp.yaml) "
           "file not specified in input file.");
   }
-  if (not infile.is_open()) {
+  // the files are read by the head rank only, and parsed from memory
+  std::string fileContent;
+  if (!readFileOnHead(fileName, fileContent)) {
     Error("Phonopy required file phonopyDispFileName (phono3py_disp.yaml) "
           "not found at " +
           fileName);
   }
+  std::istringstream infile(fileContent);
+  std::string().swap(fileContent); // the stream holds its own copy
   if (mpi->mpiHead())
     std::cout << "Reading in " + fileName + "." << std::endl;
 
@@ -261,7 +266,6 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
       ilatt = 0;
     }
   }
-  infile.close();
 
   // number of atoms in the supercell for later use
   int numSupAtoms = supPositionsVec.size();
@@ -342,12 +346,12 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
   // skip reading in born charges if file name is not set
   if (!fileName.empty()) {
 
-    infile.clear();
-    infile.open(fileName);
-
-    if (!infile.is_open()) {
+    if (!readFileOnHead(fileName, fileContent)) {
       Error("BORN file " + fileName + " cannot be read.");
     }
+    infile.clear();
+    infile.str(fileContent);
+    std::string().swap(fileContent);
     if(mpi->mpiHead()) {
       std::cout << "\nReading in the phonopy BORN file." << std::endl;
     }
@@ -414,10 +418,13 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
       "Phono3py HDF5 output cannot be read if Phoebe is not built with HDF5.");
 #else
 
-  // set up buffer to read entire matrix
-  // have to use this because the phono3py data is shaped as a
-  // 4 dimensional array, and eigen tensor is not supported by highFive
-  std::vector<std::vector<std::vector<std::vector<double>>>> ifc2;
+  // buffer for the force constants in phonopy's compact format, i.e. a
+  // (numAtoms, numSupAtoms, 3, 3) array with the rows of the unit cell atoms.
+  // The full format, shaped as (numSupAtoms, numSupAtoms, 3, 3), has the
+  // same information repeated for each cell of the superCell: we only read
+  // the rows listed in p2s_map, which are the compact force constants.
+  std::vector<double> ifc2;
+  std::vector<size_t> ifc2Dims(4, 0);
   std::vector<int> cellMap;
   HighFive::FixedLenStringArray<14> unitVec;
   std::string unit;
@@ -430,53 +437,85 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
   if (mpi->mpiHead())
     std::cout << "Reading in " + fileName + "." << std::endl;
 
-  try {
-    // Open the hdf5 file
-    HighFive::File file(fileName, HighFive::File::ReadOnly);
-
-    // Set up hdf5 datasets
-    HighFive::DataSet difc2 = file.getDataSet("/force_constants");
-    HighFive::DataSet dCellMap = file.getDataSet("/p2s_map");
-    // read in the ifc2 data
-    difc2.read(ifc2);
-    dCellMap.read(cellMap);
-
-    // check that cell map matches number of atoms
-    if(int(cellMap.size()) != numAtoms) {
-      Error("Developer error: p2s_map from phono3py does not match numAtoms."
-                "\nyaml file and HDF5 file are somehow mismatched.");
-    }
-
-    // unfortunately it appears this is not in some fc files...
-    // default to ev/Ang^2
+  // only the head rank opens the file, the data is then broadcast
+  int readError = 0;
+  if (mpi->mpiHead()) {
     try {
-      HighFive::DataSet dConversion = file.getDataSet("/physical_unit");
-      dConversion.read(unitVec);
-      unit = unitVec[0];
-    } catch (std::exception &error) {
-      if(mpi->mpiHead()) {
+      // Open the hdf5 file
+      HighFive::File file(fileName, HighFive::File::ReadOnly);
+
+      // Set up hdf5 datasets
+      HighFive::DataSet difc2 = file.getDataSet("/force_constants");
+      HighFive::DataSet dCellMap = file.getDataSet("/p2s_map");
+      dCellMap.read(cellMap);
+      // read in the ifc2 data
+      ifc2Dims = difc2.getDimensions();
+      if (ifc2Dims.size() != 4 || ifc2Dims[2] != 3 || ifc2Dims[3] != 3) {
+        throw std::runtime_error("Unexpected shape of /force_constants");
+      }
+      size_t rowSize = ifc2Dims[1] * 9;
+      if (ifc2Dims[0] == cellMap.size()) {
+        // compact format, read as it is
+        ifc2.resize(ifc2Dims[0] * rowSize);
+        difc2.read_raw(ifc2.data());
+      } else if (ifc2Dims[0] == ifc2Dims[1]) {
+        // full format, read one row per unit cell atom
+        ifc2.resize(cellMap.size() * rowSize);
+        for (size_t iat = 0; iat < cellMap.size(); iat++) {
+          if (cellMap[iat] < 0 || size_t(cellMap[iat]) >= ifc2Dims[0]) {
+            throw std::runtime_error("p2s_map out of the superCell");
+          }
+          difc2.select({size_t(cellMap[iat]), 0, 0, 0},
+                       {1, ifc2Dims[1], 3, 3})
+              .read_raw(&ifc2[iat * rowSize]);
+        }
+        ifc2Dims[0] = cellMap.size();
+      } else {
+        throw std::runtime_error("Unexpected shape of /force_constants");
+      }
+
+      // unfortunately it appears this is not in some fc files...
+      // default to ev/Ang^2
+      try {
+        HighFive::DataSet dConversion = file.getDataSet("/physical_unit");
+        dConversion.read(unitVec);
+        unit = unitVec[0];
+      } catch (std::exception &error) {
         std::cout << "\nPhonopy fc file did not include units. "
          << "\nThis is likely ok, defaulting to eV/angstrom^2."
          << "\nHowever, you should check to be sure the magnitude of your"
          << " phonon frequencies is sensible.\n" << std::endl;
+        unit = "eV/angstrom^2";
       }
-      unit = "eV/angstrom^2";
-    }
 
-  } catch (std::exception &error) {
-    if(mpi->mpiHead()) std::cout << error.what() << std::endl;
+    } catch (std::exception &error) {
+      std::cout << error.what() << std::endl;
+      readError = 1;
+    }
+  }
+  mpi->bcast(&readError);
+  if (readError != 0) {
     Error("Issue reading fc2.hdf5 file. Make sure it exists at " + fileName +
           "\n and is not open by some other persisting processes.");
   }
+  int cellMapSize = int(cellMap.size());
+  mpi->bcast(&cellMapSize);
+  mpi->bcast(&ifc2Dims);
+  cellMap.resize(cellMapSize);
+  ifc2.resize(ifc2Dims[0] * ifc2Dims[1] * ifc2Dims[2] * ifc2Dims[3]);
+  mpi->bcast(&cellMap);
+  mpi->bcast(&ifc2);
+  mpi->bcast(&unit);
+
+  // check that cell map matches number of atoms
+  if(int(cellMap.size()) != numAtoms) {
+    Error("Developer error: p2s_map from phono3py does not match numAtoms."
+              "\nyaml file and HDF5 file are somehow mismatched.");
+  }
 
   Eigen::Tensor<double, 7> forceConstants(3, 3, qCoarseGrid[0], qCoarseGrid[1],
                                           qCoarseGrid[2], numAtoms, numAtoms);
 
-  // if the force constants are compact format, the first two
-  // dimensions will not be the same (one will be nprimAtoms, other nsupAtoms)
-  bool compact = false;
-  if(ifc2.size() != ifc2[0].size()) compact = true;
-
   // phonopy force constants are in ev/ang^2, convert to atomic
   double conversion = 1;
   if(unit.find("eV/ang") != std::string::npos) {
@@ -522,26 +561,15 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
             // first atom of this type is, then adding ir, which tells us
             // which cell it's in.
             //
-            int isAt, jsAt;
-            if(!compact) {
-              // We must put an offset of iR onto the first index, because
-              // the format in phono3py is D(R',R=0)
-              isAt = cellMap[iat] + ir;
-              jsAt = cellMap[jat];
-            }
-            else {
-              // if compact, now it appears notation is D(R=0,R')
-              jsAt = cellMap[iat] + ir;
-              isAt = jat;
-            }
+            // We need D(R',R=0), while the compact format stores D(R=0,R'),
+            // i.e. the transpose in both atoms and cartesian directions
+            size_t jsAt = cellMap[iat] + ir;
             // loop over cartesian directions
             for (int ic : {0, 1, 2}) {
               for (int jc : {0, 1, 2}) {
-
-                // here, cellMap tells us the position of this
-                // unit cell atom in the superCell of phonopy
                 forceConstants(ic, jc, r1, r2, r3, iat, jat) =
-                    ifc2[isAt][jsAt][ic][jc] * conversion;
+                    ifc2[((jat * ifc2Dims[1] + jsAt) * 3 + jc) * 3 + ic]
+                    * conversion;
               }
             }
           }
@@ -563,7 +591,8 @@ std::tuple<Crystal, PhononH0> PhonopyParser::parsePhHarmonic(Context &context) {
                   speciesNames, speciesMasses);
   crystal.print();
   PhononH0 dynamicalMatrix(crystal, dielectricMatrix, bornCharges,
-                           forceConstants, context.getSumRuleFC2());
+                           forceConstants, context.getSumRuleFC2(),
+                           context.getSumRuleFC2FilePrefix());
 
   Kokkos::Profiling::popRegion();
   return std::make_tuple(crystal, dynamicalMatrix);
@@ -1,7 +1,10 @@
 #include <algorithm>// to use .remove_if
+#include <cctype>   // isspace()
 #include <cmath>    // round()
-#include <cstdlib>  // abs()
+#include <cstdlib>  // abs(), strtod()
+#include <cstring>  // memchr()
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -382,6 +385,40 @@ std::vector<std::string> split(const std::string &s, char delimiter) {
   return tokens;
 }
 
+// helpers to parse numbers from a text buffer, much faster than extracting
+// them line by line with std::getline and a stringstream.
+// White space, newlines included, is skipped before each number.
+static double nextDouble(const char *&p) {
+  char *end;
+  double x = std::strtod(p, &end);
+  if (end == p) {
+    Error("Unexpected format while parsing a number from file");
+  }
+  p = end;
+  return x;
+}
+
+static long nextInt(const char *&p) {
+  char *end;
+  long x = std::strtol(p, &end, 10);
+  if (end == p) {
+    Error("Unexpected format while parsing an integer from file");
+  }
+  p = end;
+  return x;
+}
+
+// returns a pointer to the beginning of the line that comes numLines lines
+// after the one containing p, or end if the buffer finishes first
+static const char *skipLines(const char *p, const char *end,
+                             const size_t &numLines) {
+  for (size_t i = 0; i < numLines && p < end; i++) {
+    auto newLine = static_cast<const char *>(memchr(p, '\n', end - p));
+    p = newLine == nullptr ? end : newLine + 1;
+  }
+  return p;
+}
+
 std::tuple<Crystal, PhononH0> QEParser::parsePhHarmonic(Context &context) {
   //  Here we read the dynamical matrix of inter-atomic force constants
   //	in real space.
@@ -396,12 +433,13 @@ std::tuple<Crystal, PhononH0> QEParser::parsePhHarmonic(Context &context) {
   std::string line;
   std::vector<std::string> lineSplit;
 
-  // open input file
-  std::ifstream infile(fileName);
-
-  if (not infile.is_open()) {
+  // the file is read by the head rank only, and parsed from memory
+  std::string fileContent;
+  if (!readFileOnHead(fileName, fileContent)) {
     Error("Dynamical matrix file not found");
   }
+  // the header is read line by line, the force constants from the buffer
+  std::istringstream infile(fileContent);
   if (mpi->mpiHead())
     std::cout << "Reading in " + fileName + "." << std::endl;
 
@@ -518,22 +556,25 @@ std::tuple<Crystal, PhononH0> QEParser::parsePhHarmonic(Context &context) {
 
   Eigen::Tensor<double, 7> forceConstants(3, 3, qCoarseGrid[0], qCoarseGrid[1],
                                           qCoarseGrid[2], numAtoms, numAtoms);
+  // the rest of the file is parsed directly from the buffer
+  const char *p = fileContent.data() + static_cast<size_t>(infile.tellg());
+  std::istringstream().swap(infile);
   for (int ic : {0, 1, 2}) {
-    int m1Test, m2Test, m3Test;
-    double x;
     for (int jc : {0, 1, 2}) {
       for (int iat = 0; iat < numAtoms; iat++) {
         for (int jat = 0; jat < numAtoms; jat++) {
           // a line containing ic, jc, iat, jat
-          std::getline(infile, line);
-
+          for (int k = 0; k < 4; k++) {
+            nextInt(p);
+          }
+          // followed by lines with m1, m2, m3, and the force constant
           for (int r3 = 0; r3 < qCoarseGrid[2]; r3++) {
             for (int r2 = 0; r2 < qCoarseGrid[1]; r2++) {
               for (int r1 = 0; r1 < qCoarseGrid[0]; r1++) {
-                std::getline(infile, line);
-                std::istringstream iss(line);
-                iss >> m1Test >> m2Test >> m3Test >> x;
-                forceConstants(ic, jc, r1, r2, r3, iat, jat) = x;
+                for (int k = 0; k < 3; k++) {
+                  nextInt(p);
+                }
+                forceConstants(ic, jc, r1, r2, r3, iat, jat) = nextDouble(p);
               }
             }
           }
@@ -541,7 +582,7 @@ std::tuple<Crystal, PhononH0> QEParser::parsePhHarmonic(Context &context) {
       }
     }
   }
-  infile.close();
+  std::string().swap(fileContent);
 
   // Now we do postprocessing
 
@@ -558,7 +599,8 @@ std::tuple<Crystal, PhononH0> QEParser::parsePhHarmonic(Context &context) {
   }
 
   PhononH0 dynamicalMatrix(crystal, dielectricMatrix, bornCharges,
-                           forceConstants, context.getSumRuleFC2());
+                           forceConstants, context.getSumRuleFC2(),
+                           context.getSumRuleFC2FilePrefix());
 
   Kokkos::Profiling::popRegion();
   return std::make_tuple(crystal, dynamicalMatrix);
@@ -817,22 +859,20 @@ std::pair<Eigen::Tensor<double, 3>,
     Error("Must provide the Wannier90 WsVec file name");
   }
 
-  std::string line;
-  std::vector<std::string> lineSplit;
-
-  // open input file
-  std::ifstream infile(fileName);
-
-  if (not infile.is_open()) {
+  // the file is read by the head rank only, and parsed from memory
+  std::string fileContent;
+  if (!readFileOnHead(fileName, fileContent)) {
     Error("Wannier WsVec file not found");
   }
 
   //  First line contains the title and date, and the information whether
   // or not the Bravais vectors shifts are present
-  std::getline(infile, line);
+  const char *fileEnd = fileContent.data() + fileContent.size();
+  const char *p = skipLines(fileContent.data(), fileEnd, 1);
   {
+    std::string firstLine(fileContent.data(), p - fileContent.data());
     std::string s2 = ".true.";
-    if (line.find(s2) == std::string::npos) { // string not found
+    if (firstLine.find(s2) == std::string::npos) { // string not found
      Error("Wannier90 didn't run with phase shifts. Remove wsVecFileName from input");
     }
   }
@@ -844,28 +884,28 @@ std::pair<Eigen::Tensor<double, 3>,
   degeneracyShifts.setZero();
   phaseShifts.setZero();
 
+  // the file is a list of blocks made of a line "R1 R2 R3 iw1 iw2", a line
+  // with the degeneracy, and one line with a shift for each degeneracy
   std::vector<int> oldBV(3, 0);
   std::vector<int> thisBV(3, 0);
-  std::vector<int> shift(3, 0);
   int iR = -1;
-  while (std::getline(infile, line)) {
-    auto lineSplit = split(line, ' ');
-    thisBV[0] = std::stoi(lineSplit[0]);
-    thisBV[1] = std::stoi(lineSplit[1]);
-    thisBV[2] = std::stoi(lineSplit[2]);
+  while (true) {
+    // stop at the end of the file, ignoring trailing white space
+    while (p < fileEnd && std::isspace(static_cast<unsigned char>(*p))) p++;
+    if (p >= fileEnd) break;
+    thisBV[0] = int(nextInt(p));
+    thisBV[1] = int(nextInt(p));
+    thisBV[2] = int(nextInt(p));
     if (thisBV != oldBV) { iR++; oldBV = thisBV; }
-    int iw1 = std::stoi(lineSplit[3]) - 1;
-    int iw2 = std::stoi(lineSplit[4]) - 1;
-    std::getline(infile, line);
-    int thisDegeneracy = std::stoi(line);
+    int iw1 = int(nextInt(p)) - 1;
+    int iw2 = int(nextInt(p)) - 1;
+    int thisDegeneracy = int(nextInt(p));
     degeneracyShifts(iw1, iw2, iR) = thisDegeneracy;
     for (int iDeg = 0; iDeg < thisDegeneracy; ++iDeg) {
-      std::getline(infile, line);
-      auto lineSplit2 = split(line, ' ');
       Eigen::Vector3d tmpVector;
-      tmpVector(0) = std::stoi(lineSplit2[0]);
-      tmpVector(1) = std::stoi(lineSplit2[1]);
-      tmpVector(2) = std::stoi(lineSplit2[2]);
+      tmpVector(0) = double(nextInt(p));
+      tmpVector(1) = double(nextInt(p));
+      tmpVector(2) = double(nextInt(p));
       // the phase shifts are written in crystal coordinates
       // let's change them to cartesian coordinates
       tmpVector = directUnitCell * tmpVector;
@@ -892,44 +932,34 @@ QEParser::parseElHarmonicWannier(Context &context, Crystal *inCrystal) {
     Error("Must provide the Wannier90 TB file name");
   }
 
-  std::string line;
-  std::vector<std::string> lineSplit;
-
-  // open input file
-  std::ifstream infile(fileName);
-
-  if (not infile.is_open()) {
+  // the file is read by the head rank only, and parsed from memory
+  std::string fileContent;
+  if (!readFileOnHead(fileName, fileContent)) {
     Error("Wannier H0 file not found");
   }
+  const char *fileEnd = fileContent.data() + fileContent.size();
 
   //  First line contains the title and date
-  std::getline(infile, line);
+  const char *p = skipLines(fileContent.data(), fileEnd, 1);
 
   // Then, we have the directUnitCell of the crystal in angstroms
   Eigen::Matrix3d directUnitCell_(3, 3);
   directUnitCell_.setZero();
   for (int i = 0; i < 3; i++) {
-    std::getline(infile, line);
-    lineSplit = split(line, ' ');
     for (int j = 0; j < 3; j++) {
       // unit cell is written in angstrom
-      directUnitCell_(j, i) = std::stod(lineSplit[j]) / distanceBohrToAng;
+      directUnitCell_(j, i) = nextDouble(p) / distanceBohrToAng;
     }
   }
 
   // Next, we the number of Wannier functions / bands, after disentanglement
-  std::getline(infile, line);
-  int numWannier = std::stoi(line);
+  int numWannier = int(nextInt(p));
 
   // The number of irreducible vectors in real space
-  std::getline(infile, line);
-  int numVectors = std::stoi(line);
+  int numVectors = int(nextInt(p));
 
   // now, we must read numVectors integers with the vector degeneracies
-  // there can be only up to 15 numbers per line
-  int numLines = numVectors / int(15);
-  if (numVectors % 15 != 0) { numLines += 1; }
-
+  // (up to 15 numbers per line)
   // note: the file contains only phases to compute the FT of the hamiltonian
   // with the phase factor e^{ikR}
   // this does not have enough accuracy, and instead we will use the phase
@@ -937,17 +967,8 @@ QEParser::parseElHarmonicWannier(Context &context, Crystal *inCrystal) {
   // we parse the old phase factors anyway
   Eigen::VectorXd simpleVectorsDegeneracies(numVectors);
   simpleVectorsDegeneracies.setZero();
-  {
-    int j = 0;
-    for (int i = 0; i < numLines; i++) {
-      std::getline(infile, line);
-      lineSplit = split(line, ' ');
-      for (const auto &x : lineSplit) {
-        int deg = std::stoi(x);
-        simpleVectorsDegeneracies(j) = double(deg);
-        j += 1;
-      }
-    }
+  for (int j = 0; j < numVectors; j++) {
+    simpleVectorsDegeneracies(j) = double(nextInt(p));
   }
 
   // now we read the Hamiltonian in real space
@@ -960,58 +981,59 @@ QEParser::parseElHarmonicWannier(Context &context, Crystal *inCrystal) {
   h0R.setZero();
   rMatrix.setZero();
 
-  // parse the Hamiltonian
+  // Both the Hamiltonian and the R matrix are written in blocks, one per
+  // lattice vector, each made of an empty line, a line with the lattice
+  // vector, and numWannier^2 lines with the matrix elements. We first find
+  // where each block starts, so that the blocks can be parsed in parallel.
+  std::vector<const char *> blockStarts(2 * numVectors + 1);
+  blockStarts[0] = skipLines(p, fileEnd, 1); // end of the degeneracies line
+  for (int iBlock = 0; iBlock < 2 * numVectors; iBlock++) {
+    blockStarts[iBlock + 1] = skipLines(blockStarts[iBlock], fileEnd,
+                                        2 + numWannier * numWannier);
+  }
+  if (blockStarts[2 * numVectors - 1] >= fileEnd) {
+    Error("Wannier H0 file " + fileName + " is incomplete");
+  }
 
+  // parse the Hamiltonian, with lines "i j Re(H) Im(H)" (in eV),
+  // and then the R matrix, with lines "i j Re(x) Im(x) Re(y) ... Im(z)"
+#pragma omp parallel for
   for (int iR = 0; iR < numVectors; iR++) {
-    // first we have an empty line
-    std::getline(infile, line);
-
-    // then we read the lattice vector coordinates
-    std::getline(infile, line);
-    lineSplit = split(line, ' ');
-    bravaisVectors(0, iR) = std::stod(lineSplit[0]);
-    bravaisVectors(1, iR) = std::stod(lineSplit[1]);
-    bravaisVectors(2, iR) = std::stod(lineSplit[2]);
+    const char *q = blockStarts[iR];
+    // the lattice vector coordinates
+    bravaisVectors(0, iR) = nextDouble(q);
+    bravaisVectors(1, iR) = nextDouble(q);
+    bravaisVectors(2, iR) = nextDouble(q);
 
     for (int i = 0; i < numWannier; i++) {
       for (int j = 0; j < numWannier; j++) {
-        std::getline(infile, line);
-        lineSplit = split(line, ' ');
-        double re = std::stod(lineSplit[2]) / energyRyToEv;
-        double im = std::stod(lineSplit[3]) / energyRyToEv;
+        nextInt(q);
+        nextInt(q);
+        double re = nextDouble(q) / energyRyToEv;
+        double im = nextDouble(q) / energyRyToEv;
         h0R(iR, i, j) = {re, im};// the matrix was in eV
       }
     }
-  }
-
-  // now parse the R matrix
-  // the format is similar, but we have a complex vector
-
-  for (int iR = 0; iR < numVectors; iR++) {
-    // first we have an empty line
-    std::getline(infile, line);
-
-    // then we read the lattice vector coordinates
-    std::getline(infile, line);
-    lineSplit = split(line, ' ');
-    // they have been initialized above, and they are the same
 
+    // the R matrix has the same format, but we have a complex vector.
+    // The lattice vectors are the same as above
+    q = blockStarts[numVectors + iR];
+    for (int k = 0; k < 3; k++) {
+      nextDouble(q);
+    }
     for (int i = 0; i < numWannier; i++) {
       for (int j = 0; j < numWannier; j++) {
-        std::getline(infile, line);
-        lineSplit = split(line, ' ');
-        double re = std::stod(lineSplit[2]) / distanceBohrToAng;
-        double im = std::stod(lineSplit[3]) / distanceBohrToAng;
-        rMatrix(0, iR, i, j) = {re, im};// the matrix was in eV
-        re = std::stod(lineSplit[4]) / distanceBohrToAng;
-        im = std::stod(lineSplit[5]) / distanceBohrToAng;
-        rMatrix(1, iR, i, j) = {re, im};// the matrix was in eV
-        re = std::stod(lineSplit[6]) / distanceBohrToAng;
-        im = std::stod(lineSplit[7]) / distanceBohrToAng;
-        rMatrix(2, iR, i, j) = {re, im};// the matrix was in eV
+        nextInt(q);
+        nextInt(q);
+        for (int k = 0; k < 3; k++) {
+          double re = nextDouble(q) / distanceBohrToAng;
+          double im = nextDouble(q) / distanceBohrToAng;
+          rMatrix(k, iR, i, j) = {re, im};// the matrix was in angstrom
+        }
       }
     }
   }
+  std::string().swap(fileContent);
 
   Eigen::Matrix3d directUnitCell(3, 3);
   if (inCrystal != nullptr) {
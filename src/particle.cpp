@@ -95,6 +95,24 @@ double Particle::getPopulation(const double &energy, const double &temperature,
   return population;
 }
 
+Eigen::VectorXd Particle::getPopulations(const Eigen::VectorXd &energies,
+                                         const double &temperature,
+                                         const double &chemicalPotential) const {
+  if (temperature <= 0.) {
+    return (energies.array() <= chemicalPotential).cast<double>().matrix();
+  }
+  Eigen::ArrayXd expY =
+      ((energies.array() - chemicalPotential) / temperature).exp();
+  // same bounds as getPopulation()
+  Eigen::ArrayXd populations;
+  if (statistics == bose) {
+    populations = (1. / (expY - 1.)).max(0.);
+  } else {
+    populations = (1. / (expY + 1.)).max(0.).min(1.);
+  }
+  return populations.matrix();
+}
+
 double Particle::getDndt(const double &energy, const double &temperature,
                          const double &chemicalPotential,
                          const bool &symmetrize) const {
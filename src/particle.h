@@ -45,6 +45,17 @@ public:
   double getPopulation(const double &energy, const double &temperature,
                        const double &chemicalPotential = 0.) const;
 
+  /** Vectorized version of getPopulation(), for a list of energies at the
+   * same temperature and chemical potential.
+   * @param energies: values of quasiparticle energies.
+   * @param temperature: value of temperature.
+   * @param chemicalPotential: 0 by default, set a value for electrons.
+   * @return n: the Bose or Fermi populations of each energy.
+   */
+  Eigen::VectorXd getPopulations(const Eigen::VectorXd &energies,
+                                 const double &temperature,
+                                 const double &chemicalPotential = 0.) const;
+
   /** Returns dn/dT, with T temperature, and n being either a Bose--Einstein
    * or a Fermi--Dirac distribution, depending on the value of "statistics"
    * @param energy: value of quasiparticle energy.
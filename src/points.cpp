@@ -2,6 +2,7 @@
 #include "eigen.h"
 #include "mpiHelper.h"
 #include "utilities.h"
+#include <algorithm>
 #include <cmath>
 #include <set>
 
@@ -123,6 +124,94 @@ Points::Points(Crystal &crystal_, const Eigen::Tensor<double, 3> &pathExtrema,
 
 }
 
+Points::Points(Crystal &crystal_, const Eigen::MatrixXd &pointsList_)
+    : crystalObj(crystal_) {
+  if (pointsList_.rows() != 3) {
+    Error("Points list must have 3 rows");
+  }
+  explicitlyStored = true;
+  setupGVectors();
+
+  numPoints = int(pointsList_.cols());
+  pointsList = pointsList_;
+  isPointsListSorted = true; // presume points are sorted
+  for (int i = 1; i < numPoints; i++) { // check list is sorted
+    Eigen::Vector3d p = pointsList.col(i);
+    Eigen::Vector3d pOld = pointsList.col(i - 1);
+    if (p(0) <= pOld(0) && p(1) <= pOld(1) && p(2) <= pOld(2)) {
+      isPointsListSorted = false;
+    }
+  }
+}
+
+Points::Points(Crystal &crystal_, const Eigen::Vector3i &coarseMesh_,
+               const std::vector<int> &refinedPoints, const int &refinement)
+    : crystalObj(crystal_) {
+  if (refinement < 1 || refinement % 2 == 0) {
+    Error("The mesh refinement must be a positive odd integer");
+  }
+  // we don't refine directions that are not sampled, e.g. in 2D materials
+  Eigen::Vector3i factor;
+  for (int i : {0, 1, 2}) {
+    factor(i) = coarseMesh_(i) > 1 ? refinement : 1;
+  }
+  Eigen::Vector3i fineMesh = coarseMesh_.cwiseProduct(factor);
+  setMesh(fineMesh, Eigen::Vector3d::Zero());
+  setupGVectors();
+
+  int numCoarsePoints = coarseMesh_.prod();
+  std::vector<bool> isRefined(numCoarsePoints, false);
+  for (int ik : refinedPoints) {
+    if (ik < 0 || ik >= numCoarsePoints) {
+      Error("Refined point index is out of the coarse mesh");
+    }
+    isRefined[ik] = true;
+  }
+
+  double coarseWeight = 1. / numCoarsePoints;
+  double fineWeight = coarseWeight / factor.prod();
+
+  // pairs of (index in the fine mesh, integration weight)
+  // an odd refinement makes the coarse points fall on the fine mesh
+  std::vector<std::pair<int, double>> finePoints;
+  for (int ikc = 0; ikc < numCoarsePoints; ikc++) {
+    int ikz = ikc / (coarseMesh_(0) * coarseMesh_(1));
+    int idx_ = ikc - (ikz * coarseMesh_(0) * coarseMesh_(1));
+    int iky = idx_ / coarseMesh_(0);
+    int ikx = mod(idx_, int(coarseMesh_(0)));
+    Eigen::Vector3i center;
+    center << ikx * factor(0), iky * factor(1), ikz * factor(2);
+
+    if (!isRefined[ikc]) {
+      int ik = center(0) + center(1) * mesh(0) + center(2) * mesh(0) * mesh(1);
+      finePoints.emplace_back(ik, coarseWeight);
+      continue;
+    }
+    Eigen::Vector3i half = factor / 2;
+    for (int dz = -half(2); dz <= half(2); dz++) {
+      for (int dy = -half(1); dy <= half(1); dy++) {
+        for (int dx = -half(0); dx <= half(0); dx++) {
+          int fx = mod(center(0) + dx, mesh(0));
+          int fy = mod(center(1) + dy, mesh(1));
+          int fz = mod(center(2) + dz, mesh(2));
+          int ik = fx + fy * mesh(0) + fz * mesh(0) * mesh(1);
+          finePoints.emplace_back(ik, fineWeight);
+        }
+      }
+    }
+  }
+  std::sort(finePoints.begin(), finePoints.end());
+
+  Eigen::VectorXi filter(finePoints.size());
+  Eigen::VectorXd weights_(finePoints.size());
+  for (int i = 0; i < int(finePoints.size()); i++) {
+    filter(i) = finePoints[i].first;
+    weights_(i) = finePoints[i].second;
+  }
+  setActiveLayer(filter);
+  weights = weights_;
+}
+
 void Points::setActiveLayer(const Eigen::VectorXi &filter) {
   // if the filter has the same size of points, we are not filtering anything
   // and we just use the class as a full list of points
@@ -130,12 +219,27 @@ void Points::setActiveLayer(const Eigen::VectorXi &filter) {
     return;
   }
 
+  // the full index of the points can only be computed from the mesh,
+  // either directly or through a previous filter on the mesh
+  bool isFilteringActiveLayer =
+      explicitlyStored && !fullToFilteredIndices.empty();
+  bool isFilteringMesh = !explicitlyStored || isFilteringActiveLayer;
+
   // this contain the list of indices of the points in the FullPoints class
   // which we want to include in the ActivePoints class
+  Eigen::VectorXi oldFilteredToFullIndices = filteredToFullIndices;
   filteredToFullIndices = filter;
+  if (isFilteringActiveLayer) {
+    for (int ik = 0; ik < filter.size(); ik++) {
+      filteredToFullIndices(ik) = oldFilteredToFullIndices(filter(ik));
+    }
+  }
 
   numPoints = int(filteredToFullIndices.size());
 
+  // the list of points is overwritten below, so we read from a copy
+  Eigen::MatrixXd oldPointsList = pointsList;
+
   int maxIndex = 0;
 
   isPointsListSorted = true; // presume points are sorted
@@ -143,8 +247,13 @@ void Points::setActiveLayer(const Eigen::VectorXi &filter) {
   pointsList.resize(3, numPoints);
   pointsList.setZero();
   for (int ikNew = 0; ikNew < numPoints; ikNew++) {
-    int ik = filteredToFullIndices(ikNew);
-    Eigen::Vector3d x = getPointCoordinates(ik, Points::crystalCoordinates);
+    int ik = filter(ikNew);
+    Eigen::Vector3d x;
+    if (explicitlyStored) {
+      x = oldPointsList.col(ik);
+    } else {
+      x = getPointCoordinates(ik, Points::crystalCoordinates);
+    }
     pointsList.col(ikNew) = x;
 
     if (ik > maxIndex)
@@ -168,6 +277,22 @@ void Points::setActiveLayer(const Eigen::VectorXi &filter) {
   // because this changes the behavior of getCoordinates
   explicitlyStored = true;
 
+  if (weights.size() > 0) {
+    Eigen::VectorXd oldWeights = weights;
+    weights.resize(numPoints);
+    for (int ikNew = 0; ikNew < numPoints; ikNew++) {
+      weights(ikNew) = oldWeights(filter(ikNew));
+    }
+  }
+
+  fullToFilteredIndices.clear();
+  if (isFilteringMesh) {
+    fullToFilteredIndices.reserve(numPoints);
+    for (int ikNew = 0; ikNew < numPoints; ikNew++) {
+      fullToFilteredIndices[filteredToFullIndices(ikNew)] = ikNew;
+    }
+  }
+
   if (numIrrPoints > 0) {
     Error("Setting symmetries before applying active layer is unsupported");
     // Note: it's not impossible, we simply didn't implement it because not
@@ -183,13 +308,15 @@ Points::Points(const Points &that)
       isPointsListSorted(that.isPointsListSorted),
       pointsList(that.pointsList),
       filteredToFullIndices(that.filteredToFullIndices),
+      fullToFilteredIndices(that.fullToFilteredIndices),
+      weights(that.weights),
       rotationMatricesCrystal(that.rotationMatricesCrystal),
       rotationMatricesCartesian(that.rotationMatricesCartesian),
       mapEquivalenceRotationIndex(that.mapEquivalenceRotationIndex),
       mapIrreducibleToReducibleList(that.mapIrreducibleToReducibleList),
       mapReducibleToIrreducibleList(that.mapReducibleToIrreducibleList),
       numIrrPoints(that.numIrrPoints), irreducibleStars(that.irreducibleStars),
-      equiv(that.equiv) {}
+      equiv(that.equiv), symmetryTables(that.symmetryTables) {}
 
 // copy assignment operator
 Points &Points::operator=(const Points &that) { // assignment operator
@@ -203,6 +330,8 @@ Points &Points::operator=(const Points &that) { // assignment operator
     isPointsListSorted = that.isPointsListSorted;
     pointsList = that.pointsList;
     filteredToFullIndices = that.filteredToFullIndices;
+    fullToFilteredIndices = that.fullToFilteredIndices;
+    weights = that.weights;
     rotationMatricesCrystal = that.rotationMatricesCrystal;
     rotationMatricesCartesian = that.rotationMatricesCartesian;
     mapEquivalenceRotationIndex = that.mapEquivalenceRotationIndex;
@@ -211,6 +340,7 @@ Points &Points::operator=(const Points &that) { // assignment operator
     numIrrPoints = that.numIrrPoints;
     irreducibleStars = that.irreducibleStars;
     equiv = that.equiv;
+    symmetryTables = that.symmetryTables;
   }
   return *this;
 }
@@ -401,26 +531,40 @@ int pointsBinarySearch(const Eigen::MatrixXd& pointsList,
   return idxMin; // point found
 }
 
+int Points::getMeshIndex(const Eigen::Vector3d &crystCoordinates_) {
+  Eigen::Vector3i p;
+  // multiply by grid, so that p now contains integers
+  double diff = 0.;
+  for (int i : {0, 1, 2}) {
+    // bring the point to integer coordinates
+    double x = (crystCoordinates_(i) - offset(i)) * mesh(i);
+    // check that p is indeed a point commensurate to the mesh.
+    diff += round(x) - x;
+    // fold in Brillouin zone in range [0,mesh-1]
+    p(i) = mod(int(round(x)), mesh(i));
+  }
+  if (diff >= 1.0e-6) {
+    return -1;
+  }
+  return p(2) * mesh(0) * mesh(1) + p(1) * mesh(0) + p(0);
+}
+
 int Points::isPointStored(const Eigen::Vector3d &crystCoordinates_) {
 
   if (!explicitlyStored) { // full list is faster
-    Eigen::Vector3i p;
-    // multiply by grid, so that p now contains integers
-    double diff = 0.;
-    for (int i : {0, 1, 2}) {
-      // bring the point to integer coordinates
-      double x = (crystCoordinates_(i) - offset(i)) * mesh(i);
-      // check that p is indeed a point commensurate to the mesh.
-      diff += round(x) - x;
-      // fold in Brillouin zone in range [0,mesh-1]
-      p(i) = mod(int(round(x)), mesh(i));
-    }
-    if (diff >= 1.0e-6) {
-      int ik = -1;
-      return ik;
+    return getMeshIndex(crystCoordinates_);
+  } else if (!fullToFilteredIndices.empty()) {
+    // active points filtered from a mesh: find the point on the mesh,
+    // then check if it survived the filter
+    int ikFull = getMeshIndex(crystCoordinates_);
+    if (ikFull == -1) {
+      return -1;
     }
-    int ik = p(2) * mesh(0) * mesh(1) + p(1) * mesh(0) + p(0);
-    return ik;
+    auto it = fullToFilteredIndices.find(ikFull);
+    if (it == fullToFilteredIndices.end()) {
+      return -1;
+    }
+    return it->second;
   } else {
 
     if ( isPointsListSorted ) {
@@ -525,6 +669,18 @@ Crystal &Points::getCrystal() { return crystalObj; }
 
 int Points::getNumPoints() const { return numPoints; }
 
+double Points::getWeight(const int &index) const {
+  if (weights.size() > 0) {
+    return weights(index);
+  }
+  if (mesh.prod() > 0) {
+    return 1. / mesh.prod();
+  }
+  return 1. / numPoints;
+}
+
+bool Points::hasUniformWeights() const { return weights.size() == 0; }
+
 void Points::setMesh(const Eigen::Vector3i &mesh_,
                      const Eigen::Vector3d &offset_) {
 
@@ -695,10 +851,7 @@ void Points::setIrreduciblePoints(
 
   const double epsilon = 1.0e-5;
 
-  equiv.resize(numPoints);
-  for (int i = 0; i < numPoints; i++) {
-    equiv(i) = i;
-  }
+  equiv = Eigen::VectorXi::Zero(numPoints);
   // equiv(i) = i : k-point i is not equivalent to any other (irreducible)
   // equiv(i)!=i : k-point i is equivalent to k-point equiv(nk)
 
@@ -725,125 +878,48 @@ void Points::setIrreduciblePoints(
     }
   }
 
-  // search for irreducible kpoints, checking every point
-  for (int ik = 0; ik < numPoints; ik++) {
-    // check if this k-point has already been found equivalent to another
-    // if true, this point has not yet been identified as reducible
-    if (equiv(ik) == ik) {
-
-      // check if there are equivalent k-point to this in the list
-      // (excepted those previously found to be equivalent to another)
-
-      std::set<int> thisStar;
-
-      // apply symmetries to identify all other points
-      // which will reduce to this point, and save them to its star
-      for (const auto &symmetry : symmetries) {
-        Eigen::Matrix3d rot = symmetry.rotation;
-        Eigen::Vector3d rotatedPoint =
-            rot * getPointCoordinates(ik, Points::crystalCoordinates);
-
-        // check if rotated point is somewhere on the mesh
-        int ikRot = isPointStored(rotatedPoint);
-
-        // if the point is on the mesh and is not previously identified
-        // as an irreducible point
-        if (ikRot >= 0 && equiv(ikRot) == ikRot) {
-          if (ikRot >= ik) {
-            // if the rotated point is further in the list than ik, denote ik as
-            // its ikRot's irr point
-            equiv(ikRot) = ik;
-            thisStar.insert(ikRot);
-          } else {
-            // if ikRot was before ik in the list, yet we
-            // somehow did not flag ikRot as ik's irr kpoint,
-            // there has been an error
-            if (equiv(ikRot) != ik || ikRot < ik) {
-              Error("Error in finding irreducible points");
-            }
-          }
-        }
+  // The symmetries form a group, so the points equivalent to a point k are
+  // all found by rotating k. The irreducible point of a star is the point
+  // with the lowest index, i.e. equiv(ik) = min_R index(R*k). This can be
+  // computed independently for each point, and is split over MPI processes
+  // and OpenMP threads.
+  // The images R*k of all points are tabulated here, and this is the only
+  // place where rotated coordinates are searched in the list of points.
+  auto tables = std::make_shared<SymmetryTables>();
+  auto numRotations = int(rotationMatricesCrystal.size());
+  // (stored as index+1, so that the entries of other processes are zero)
+  tables->rotatedPoints = Eigen::MatrixXi::Zero(numRotations, numPoints);
+  std::vector<size_t> pointsIter = mpi->divideWorkIter(numPoints);
+  int numLocalPoints = int(pointsIter.size());
+#pragma omp parallel for
+  for (int iik = 0; iik < numLocalPoints; iik++) {
+    int ik = int(pointsIter[iik]);
+    Eigen::Vector3d k = getPointCoordinates(ik, Points::crystalCoordinates);
+    int ikIrr = ik;
+    for (int iRot = 0; iRot < numRotations; iRot++) {
+      Eigen::Vector3d rotatedPoint = rotationMatricesCrystal[iRot] * k;
+      // check if rotated point is somewhere on the mesh
+      int ikRot = isPointStored(rotatedPoint);
+      tables->rotatedPoints(iRot, ik) = ikRot + 1;
+      if (ikRot >= 0 && ikRot < ikIrr) {
+        ikIrr = ikRot;
       }
-
-      std::vector<int> tmp;
-      std::copy(thisStar.begin(), thisStar.end(), std::back_inserter(tmp));
-      irreducibleStars.push_back(tmp); // here we save the equivalent star
     }
+    equiv(ik) = ikIrr;
   }
+  mpi->allReduceSum(&equiv);
+  mpi->allReduceSum(&tables->rotatedPoints);
+  tables->rotatedPoints.array() -= 1;
+  const Eigen::MatrixXi &rotatedPoints = tables->rotatedPoints;
 
-  // here we find the rotations mapping the reducible point ot the irreducible
-  // Note: I want to see how velocities rotate.
-  mapEquivalenceRotationIndex = Eigen::VectorXi::Zero(numPoints);
-  mapEquivalenceRotationIndex.setConstant(-1);
-  if (groupVelocities == nullptr) {
-    for (int ikRed = 0; ikRed < numPoints; ikRed++) {
-      if (equiv(ikRed) == ikRed) {              // identity
-        mapEquivalenceRotationIndex(ikRed) = 0; // checked above it's identity
-      } else {
-        int ikIrr = equiv(ikRed);
-
-        Eigen::Vector3d kIrr =
-            getPointCoordinates(ikIrr, Points::crystalCoordinates);
-
-        for (unsigned int is = 0; is < symmetries.size(); is++) {
-          Eigen::Matrix3d rot = rotationMatricesCrystal[is];
-          Eigen::Vector3d rotatedPoint = rot * kIrr;
-          int ikRot = isPointStored(rotatedPoint);
-          if (ikRot == ikRed) {
-            mapEquivalenceRotationIndex(ikRed) = int(is);
-            break;
-          }
-        }
-      }
+  // if the symmetries are a group, the irreducible point is its own
+  // irreducible point
+  for (int ik = 0; ik < numPoints; ik++) {
+    if (equiv(equiv(ik)) != equiv(ik)) {
+      Error("Error in finding irreducible points");
     }
-  } else {
-    if (int((*groupVelocities).size()) != numPoints) {
-      Error("setIrreducible: velocities not aligned with the full grid");
-    }
-
-    for (int ikRed = 0; ikRed < numPoints; ikRed++) {
-      if (equiv(ikRed) == ikRed) {              // identity
-        mapEquivalenceRotationIndex(ikRed) = 0; // checked above it's identity
-      } else {
-        int ikIrr = equiv(ikRed);
-
-        Eigen::Vector3d kIrr =
-            getPointCoordinates(ikIrr, Points::crystalCoordinates);
-
-        Eigen::MatrixXd irrVelocities = (*groupVelocities)[ikIrr];
-        Eigen::MatrixXd redVelocities = (*groupVelocities)[ikRed];
-
-        if (irrVelocities.rows() != redVelocities.rows()) {
-          Error("Different number of bands at two equivalent points");
-        }
-
-        std::vector<int> isSelects;
-        std::vector<double> diffs;
-
-        for (unsigned int is = 0; is < symmetries.size(); is++) {
-          Eigen::Vector3d rotatedPoint = rotationMatricesCrystal[is] * kIrr;
-          int ikRot = isPointStored(rotatedPoint);
-          if (ikRot != ikRed) {
-            continue;
-          }
-
-          auto numBands = int(irrVelocities.rows());
-          double diff = 0.;
-          for (int ib = 0; ib < numBands; ib++) {
-            Eigen::Vector3d thisIrrVel = irrVelocities.row(ib);
-            Eigen::Vector3d thisRedVel = redVelocities.row(ib);
-            Eigen::Vector3d rotVel = rotationMatricesCartesian[is] * thisIrrVel;
-            diff += (rotVel - thisRedVel).squaredNorm();
-          }
-          isSelects.push_back(int(is));
-          diffs.push_back(diff);
-        }
-
-        auto minElementIndex =
-            std::min_element(diffs.begin(), diffs.end()) - diffs.begin();
-
-        mapEquivalenceRotationIndex(ikRed) = isSelects[minElementIndex];
-      }
+    if (weights.size() > 0 && abs(weights(ik) - weights(equiv(ik))) > 1e-12) {
+      Error("Mesh refinement doesn't respect the crystal symmetries");
     }
   }
 
@@ -856,36 +932,104 @@ void Points::setIrreduciblePoints(
   }
 
   // this allows us to map (ikIrr in the irrPoints) -> (ikRed in fullPoints)
+  // and (ikRed in fullPoints) -> (ikIrr in the irrPoints)
   mapIrreducibleToReducibleList = Eigen::VectorXi::Zero(numIrrPoints);
+  mapReducibleToIrreducibleList = Eigen::VectorXi::Zero(numPoints);
   {
     int i = 0;
     for (int j = 0; j < numPoints; j++) {
       if (equiv(j) == j) { // if is irreducible
         mapIrreducibleToReducibleList(i) = j;
+        mapReducibleToIrreducibleList(j) = i;
         ++i;
+      } else {
+        // equiv(j) < j, so its irreducible index has already been set
+        mapReducibleToIrreducibleList(j) =
+            mapReducibleToIrreducibleList(equiv(j));
       }
     }
   }
 
-  // this allows us to map (ikRed in fullPoints) -> (ikIrr in the irrPoints)
-  // basically the inverse of mapIrrToRedList
-  mapReducibleToIrreducibleList = Eigen::VectorXi::Zero(numPoints);
+  // here we save the stars of equivalent points, sorted by index
+  irreducibleStars.clear();
+  irreducibleStars.resize(numIrrPoints);
+  for (int ik = 0; ik < numPoints; ik++) {
+    irreducibleStars[mapReducibleToIrreducibleList(ik)].push_back(ik);
+  }
 
-  // make a vector copy of mI2R for binary search
-  std::vector<int> mI2R(mapIrreducibleToReducibleList.data(),
-                   mapIrreducibleToReducibleList.data()
-                        + mapIrreducibleToReducibleList.size());
+  // here we find the rotations mapping the reducible point ot the irreducible
+  // Note: I want to see how velocities rotate.
+  if (groupVelocities != nullptr
+      && int((*groupVelocities).size()) != numPoints) {
+    Error("setIrreducible: velocities not aligned with the full grid");
+  }
+  mapEquivalenceRotationIndex = Eigen::VectorXi::Zero(numPoints);
+#pragma omp parallel for
+  for (int iik = 0; iik < numLocalPoints; iik++) {
+    int ikRed = int(pointsIter[iik]);
+    if (equiv(ikRed) == ikRed) { // identity
+      mapEquivalenceRotationIndex(ikRed) = 0; // checked above it's identity
+      continue;
+    }
+    int ikIrr = equiv(ikRed);
 
-  for (int ik : mpi->divideWorkIter(numPoints)) {
-    int ikIrr = equiv(ik); // map to the irreducible in fullPoints
-    auto itr = std::lower_bound(mI2R.begin(), mI2R.end(), ikIrr);
-    int ikIrr2 = std::distance(mI2R.begin(), itr);
-    if (ikIrr2 == -1) {
-      Error("Failed building irreducible points mapRedToIrrList");
+    if (groupVelocities == nullptr) {
+      mapEquivalenceRotationIndex(ikRed) = -1;
+      for (unsigned int is = 0; is < symmetries.size(); is++) {
+        if (rotatedPoints(is, ikIrr) == ikRed) {
+          mapEquivalenceRotationIndex(ikRed) = int(is);
+          break;
+        }
+      }
+      continue;
     }
-    mapReducibleToIrreducibleList(ik) = ikIrr2;
+
+    // if there are several rotations mapping kIrr to kRed, pick the one
+    // that also maps the group velocities best
+    const Eigen::MatrixXd &irrVelocities = (*groupVelocities)[ikIrr];
+    const Eigen::MatrixXd &redVelocities = (*groupVelocities)[ikRed];
+
+    if (irrVelocities.rows() != redVelocities.rows()) {
+      Error("Different number of bands at two equivalent points");
+    }
+
+    int isSelect = -1;
+    double minDiff = 0.;
+    for (unsigned int is = 0; is < symmetries.size(); is++) {
+      if (rotatedPoints(is, ikIrr) != ikRed) {
+        continue;
+      }
+
+      auto numBands = int(irrVelocities.rows());
+      double diff = 0.;
+      for (int ib = 0; ib < numBands; ib++) {
+        Eigen::Vector3d thisIrrVel = irrVelocities.row(ib);
+        Eigen::Vector3d thisRedVel = redVelocities.row(ib);
+        Eigen::Vector3d rotVel = rotationMatricesCartesian[is] * thisIrrVel;
+        diff += (rotVel - thisRedVel).squaredNorm();
+      }
+      if (isSelect == -1 || diff < minDiff) {
+        isSelect = int(is);
+        minDiff = diff;
+      }
+    }
+    mapEquivalenceRotationIndex(ikRed) = isSelect;
   }
-  mpi->allReduceSum(&mapReducibleToIrreducibleList);
+  mpi->allReduceSum(&mapEquivalenceRotationIndex);
+
+  tables->starRotations.resize(numIrrPoints);
+  for (int ikIrr = 0; ikIrr < numIrrPoints; ikIrr++) {
+    for (int ik : irreducibleStars[ikIrr]) {
+      tables->starRotations[ikIrr].push_back(mapEquivalenceRotationIndex(ik));
+    }
+  }
+  for (int iRot = 0; iRot < numRotations; iRot++) {
+    tables->inverseRotationsCrystal.push_back(
+        rotationMatricesCrystal[iRot].inverse());
+    tables->inverseRotationsCartesian.push_back(
+        rotationMatricesCartesian[iRot].inverse());
+  }
+  symmetryTables = tables;
 }
 
 std::vector<int> Points::irrPointsIterator() {
@@ -948,10 +1092,11 @@ Points::getRotationToIrreducible(const Eigen::Vector3d &x, const int &basis) {
     // find rotation such that rotation * qFull = qRed
     Eigen::Matrix3d rot;
     if (basis == crystalCoordinates) {
-      rot = rotationMatricesCrystal[mapEquivalenceRotationIndex(ik)].inverse();
+      rot = symmetryTables
+                ->inverseRotationsCrystal[mapEquivalenceRotationIndex(ik)];
     } else {
-      rot =
-          rotationMatricesCartesian[mapEquivalenceRotationIndex(ik)].inverse();
+      rot = symmetryTables
+                ->inverseRotationsCartesian[mapEquivalenceRotationIndex(ik)];
     }
     // also, we add the index of the irreducible point to which x is mapped
     return std::make_tuple(equiv(ik), rot);
@@ -964,14 +1109,9 @@ Points::getRotationToIrreducible(const Eigen::Vector3d &x, const int &basis) {
 
 std::vector<Eigen::Matrix3d> Points::getRotationsStar(const int &ik) {
   if (numIrrPoints > 0) {
-    // first, map ik to [0,N_irr]
-    int ikIrr = mapReducibleToIrreducibleList(ik);
-    std::vector<int> starIndices = irreducibleStars[ikIrr];
     std::vector<Eigen::Matrix3d> rotations;
-    for (int ikFull : starIndices) {
-      Eigen::Matrix3d rot;
-      rot = rotationMatricesCartesian[mapEquivalenceRotationIndex(ikFull)];
-      rotations.push_back(rot);
+    for (int iRot : getRotationIndicesStar(ik)) {
+      rotations.push_back(rotationMatricesCartesian[iRot]);
     }
     // list of rotations such that qStar = rotation * qIrr
     return rotations;
@@ -988,3 +1128,103 @@ std::vector<int> Points::getReducibleStarFromIrreducible(const int &ik) {
   int ikIrr = mapReducibleToIrreducibleList(ik);
   return irreducibleStars[ikIrr];
 }
+
+int Points::getNumRotations() {
+  if (numIrrPoints > 0) {
+    return int(rotationMatricesCartesian.size());
+  } else {
+    return 1;
+  }
+}
+
+const Eigen::Matrix3d &Points::getRotationMatrix(const int &iRotation,
+                                                 const int &basis) {
+  static const Eigen::Matrix3d identity = Eigen::Matrix3d::Identity();
+  if (numIrrPoints == 0) { // only the identity symmetry exists
+    return identity;
+  }
+  if (basis == crystalCoordinates) {
+    return rotationMatricesCrystal[iRotation];
+  } else {
+    return rotationMatricesCartesian[iRotation];
+  }
+}
+
+std::tuple<int, int> Points::getRotationIndexToIrreducible(const int &ik) {
+  if (numIrrPoints > 0) {
+    return std::make_tuple(equiv(ik), mapEquivalenceRotationIndex(ik));
+  } else {
+    return std::make_tuple(ik, 0);
+  }
+}
+
+const std::vector<int> &Points::getRotationIndicesStar(const int &ik) {
+  static const std::vector<int> identityStar = {0};
+  if (numIrrPoints == 0) {
+    return identityStar;
+  }
+  return symmetryTables->starRotations[mapReducibleToIrreducibleList(ik)];
+}
+
+int Points::getRotatedPointIndex(const int &iRotation, const int &ik) {
+  if (numIrrPoints == 0) {
+    return ik;
+  }
+  return symmetryTables->rotatedPoints(iRotation, ik);
+}
+
+uint64_t Points::getCurveIndex(const int &ik, const std::string &curve) {
+  if (mesh.minCoeff() <= 0) {
+    return uint64_t(ik);
+  }
+  // integer coordinates of the point on the mesh, in [0,mesh-1]
+  Eigen::Vector3d p = getPointCoordinates(ik, crystalCoordinates);
+  uint32_t x[3];
+  for (int i : {0, 1, 2}) {
+    x[i] = uint32_t(mod(int(round((p(i) - offset(i)) * mesh(i))), mesh(i)));
+  }
+  // number of bits needed for the largest coordinate
+  int numBits = 1;
+  while ((1 << numBits) < mesh.maxCoeff()) {
+    numBits++;
+  }
+
+  if (curve == "hilbert") {
+    // transform the coordinates into the "transposed" Hilbert index
+    // (J. Skilling, AIP Conf. Proc. 707, 381 (2004))
+    uint32_t m = 1u << (numBits - 1);
+    for (uint32_t q = m; q > 1; q >>= 1) {
+      uint32_t r = q - 1;
+      for (uint32_t &xi : x) {
+        if (xi & q) {
+          x[0] ^= r;
+        } else {
+          uint32_t t = (x[0] ^ xi) & r;
+          x[0] ^= t;
+          xi ^= t;
+        }
+      }
+    }
+    // Gray encoding
+    x[1] ^= x[0];
+    x[2] ^= x[1];
+    uint32_t t = 0;
+    for (uint32_t q = m; q > 1; q >>= 1) {
+      if (x[2] & q) {
+        t ^= q - 1;
+      }
+    }
+    for (uint32_t &xi : x) {
+      xi ^= t;
+    }
+  }
+
+  // interleave the bits of the three coordinates, from the most significant
+  uint64_t index = 0;
+  for (int b = numBits - 1; b >= 0; b--) {
+    for (uint32_t xi : x) {
+      index = (index << 1) | ((xi >> b) & 1u);
+    }
+  }
+  return index;
+}
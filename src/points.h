@@ -4,6 +4,10 @@
 #include "crystal.h"
 #include "eigen.h"
 #include "exceptions.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
 
 const int crystalCoordinates_ = 0;
 const int cartesianCoordinates_ = 1;
@@ -102,9 +106,36 @@ public:
   Points(Crystal &crystal_, const Eigen::Tensor<double, 3> &pathExtrema,
          const double &delta);
 
+  /** Constructor for an explicit list of points, e.g. a portion of a path.
+   * @param crystal: the crystal object that defines the Brillouin zone.
+   * @param pointsList: matrix of size (3, numPoints) with the coordinates of
+   * the points, in crystal coordinates.
+   */
+  Points(Crystal &crystal_, const Eigen::MatrixXd &pointsList_);
+
+  /** Constructor for a locally refined Monkhorst-Pack grid.
+   * Starting from a coarse grid, each selected coarse point is replaced by a
+   * patch of refinement^3 points of a finer grid, centered on it. The
+   * resulting points are an active layer of the grid refinement*coarseMesh,
+   * and each point carries the integration weight of the volume it samples,
+   * so that weights sum to one. Directions where the coarse mesh has a
+   * single point are not refined.
+   * Note: for symmetries to be used, the list of refined points should be
+   * closed under the crystal symmetry operations.
+   * @param crystal: the crystal object that defines the Brillouin zone.
+   * @param coarseMesh: grid size of the coarse Monkhorst-Pack (unshifted).
+   * @param refinedPoints: indices of the coarse points to be refined.
+   * @param refinement: odd integer, number of fine points per direction in a
+   * refined patch.
+   */
+  Points(Crystal &crystal_, const Eigen::Vector3i &coarseMesh_,
+         const std::vector<int> &refinedPoints, const int &refinement);
+
   /** Constructor for Active Points
    * @param filter: a vector of integers of "filtered" points, i.e. the
    * indices of the wavevectors in parentPoints that we want to keep.
+   * If the points are already an active layer of a mesh, the filter is
+   * composed with the previous one, and integration weights are kept.
    */
   void setActiveLayer(const Eigen::VectorXi &filter_);
 
@@ -127,6 +158,18 @@ public:
    */
   int getNumPoints() const;
 
+  /** Returns the integration weight of a wavevector, i.e. the fraction of
+   * the Brillouin zone volume that it samples. On a uniform mesh, this is
+   * 1/(number of mesh points), also for active points.
+   * @param index: the index of the wavevector in [0,numPoints[
+   */
+  double getWeight(const int &index) const;
+
+  /** Returns true if all points have the same weight, false if the points
+   * have been built with a local mesh refinement.
+   */
+  bool hasUniformWeights() const;
+
   /** Converts a wavevector from crystal to cartesian coordinates.
    * @param point: the input wavevector in crystal coordinates.
    * @return wavevector: the output wavevector in cartesian coordinates.
@@ -215,6 +258,8 @@ public:
    * also transforms the group velocities (i.e. there may sometimes be more than
    * one symmetry mapping v and k to irreducible values). Useful since we want
    * symmetries in the BTE to be the same as group velocities.
+   * Note: the work is distributed over MPI processes and OpenMP threads, so
+   * this must be called by all MPI processes.
    */
   void
   setIrreduciblePoints(std::vector<Eigen::MatrixXd> *groupVelocities = nullptr);
@@ -291,11 +336,59 @@ public:
    */
   std::vector<int> getReducibleStarFromIrreducible(const int &ik);
 
+  /** Returns the number of symmetry operations acting on the points, i.e.
+   * the size of the range of the rotation indices below (1 if
+   * setIrreduciblePoints has not been called).
+   */
+  int getNumRotations();
+
+  /** Returns the rotation matrix of a symmetry operation, without copies.
+   * @param iRotation: index of the rotation, e.g. from getRotationIndicesStar.
+   * @param basis: crystal or cartesian coordinates.
+   */
+  const Eigen::Matrix3d &
+  getRotationMatrix(const int &iRotation,
+                    const int &basis = cartesianCoordinates);
+
+  /** Integer version of getRotationToIrreducible, for a point of the list:
+   * no coordinates are compared and no matrices are inverted.
+   * @param ik: index of the (reducible) point.
+   * @return tuple: the index of the irreducible point (in the reducible list)
+   * and the index of the rotation R such that k^red = R k^irr (note: this is
+   * the inverse of the rotation returned by getRotationToIrreducible).
+   */
+  std::tuple<int, int> getRotationIndexToIrreducible(const int &ik);
+
+  /** Integer version of getRotationsStar: returns the indices of the
+   * rotations such that k^red = R k^irr, for the points of the star of ik
+   * in the order of getReducibleStarFromIrreducible. The list is tabulated
+   * by setIrreduciblePoints, and returned without copies.
+   * @param ik: index of irreducible point in the reducible list.
+   */
+  const std::vector<int> &getRotationIndicesStar(const int &ik);
+
+  /** Returns the index of the point R k obtained by applying the symmetry
+   * operation iRotation to the point ik, or -1 if R k is not in the list.
+   * This is a lookup in a table built by setIrreduciblePoints.
+   */
+  int getRotatedPointIndex(const int &iRotation, const int &ik);
+
+  /** Returns the position of a point along a space-filling curve through the
+   * mesh, such that points that are close along the curve are also close in
+   * the Brillouin zone. Sorting wavevectors by this key improves the reuse
+   * of the data of neighboring points in caches.
+   * @param ik: index of the point.
+   * @param curve: "morton" (Z-order curve) or "hilbert".
+   * @return the position of the point along the curve, or the index ik
+   * itself if the points are not on a mesh (e.g. on a path).
+   */
+  uint64_t getCurveIndex(const int &ik, const std::string &curve);
+
 protected:
   void setMesh(const Eigen::Vector3i &mesh_, const Eigen::Vector3d &offset_);
   Crystal &crystalObj;
-  Eigen::Vector3i mesh;
-  Eigen::Vector3d offset;
+  Eigen::Vector3i mesh = Eigen::Vector3i::Zero();
+  Eigen::Vector3d offset = Eigen::Vector3d::Zero();
   int numPoints = 0;
   // for Wigner Seitz folding
   Eigen::MatrixXd gVectors;
@@ -307,6 +400,15 @@ protected:
 
   // for active Points:
   Eigen::VectorXi filteredToFullIndices;
+  // inverse of filteredToFullIndices, when the active points were filtered
+  // from a mesh. Makes isPointStored() constant time.
+  std::unordered_map<int, int> fullToFilteredIndices;
+
+  // integration weights of each point, only set for refined meshes
+  Eigen::VectorXd weights;
+
+  // index of a point in the full mesh, or -1 if it's not on the mesh
+  int getMeshIndex(const Eigen::Vector3d &crystalCoordinates_);
 
   void setupGVectors();
 
@@ -339,6 +441,22 @@ protected:
   // if equiv(i) == i, point is irreducible, otherwise, equiv(i) gives the
   // index of the irreducible equivalent index.
   Eigen::VectorXi equiv;
+
+  // integer tables of the action of the symmetries on the points, built once
+  // by setIrreduciblePoints. They aren't modified afterwards, and are shared
+  // by the copies of Points (the band structures return Points by value).
+  struct SymmetryTables {
+    // rotatedPoints(iRotation, ik) is the index of R*k(ik), or -1
+    // (numRotations x numPoints integers)
+    Eigen::MatrixXi rotatedPoints;
+    // for each irreducible point, the rotation index of each point of its
+    // star, aligned with irreducibleStars
+    std::vector<std::vector<int>> starRotations;
+    // the inverse of each rotation, in crystal and cartesian coordinates
+    std::vector<Eigen::Matrix3d> inverseRotationsCrystal;
+    std::vector<Eigen::Matrix3d> inverseRotationsCartesian;
+  };
+  std::shared_ptr<const SymmetryTables> symmetryTables;
   //------------------------------------------
 };
 
@@ -0,0 +1,50 @@
+#include "session.h"
+#include "app.h"
+#include "common_kokkos.h"
+#include "io.h"
+#include "mpiHelper.h"
+#include "parser.h"
+#include <memory>
+#include <vector>
+
+Session::Session(int argc, char *argv[]) {
+  initMPI(argc, argv);
+  initKokkos(argc, argv);
+  // the Hamiltonians are kept for the following calls to run()
+  Parser::setHarmonicCacheEnabled(true);
+}
+
+Session::~Session() {
+  // the cached objects own device memory
+  clearCache();
+  Parser::setHarmonicCacheEnabled(false);
+  Profiler::writeReport("performance_report.json");
+  deleteKokkos();
+  deleteMPI();
+}
+
+Context Session::readInput(const std::string &fileName) {
+  Context context;
+  context.setupFromInput(fileName);
+  return context;
+}
+
+void Session::run(Context &context, const std::string &appName) {
+  std::vector<std::string> appNames;
+  if (!appName.empty()) {
+    appNames.push_back(appName);
+  } else {
+    appNames = context.getAppNames();
+    if (appNames.empty()) { // let loadApp complain about the missing app
+      appNames.push_back(context.getAppName());
+    }
+  }
+  for (const std::string &name : appNames) {
+    context.setAppName(name);
+    std::unique_ptr<App> app = App::loadApp(name);
+    app->checkRequirements(context);
+    app->run(context);
+  }
+}
+
+void Session::clearCache() { Parser::clearHarmonicCache(); }
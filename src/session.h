@@ -0,0 +1,62 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "context.h"
+#include <string>
+
+/** Entry point of Phoebe used as a library (libphoebe), for drivers that run
+ * many calculations in the same process, e.g. high-throughput screenings.
+ * A session initializes MPI and Kokkos once, and then runs any number of
+ * apps, each with its own Context. The harmonic Hamiltonians are parsed by
+ * the first app that needs them, and reused by the following apps that read
+ * the same files, as when several apps are listed in a single input file.
+ *
+ * Since MPI and Kokkos can only be initialized once per process, only one
+ * session can be created, and it must outlive all the Phoebe objects.
+ * Errors in the input or in the calculation still abort the whole process,
+ * as in the phoebe executable.
+ *
+ * Example:
+ *   Session session(argc, argv);
+ *   Context context = session.readInput("phononTransport.in");
+ *   for (double temperature : {100., 200., 300.}) {
+ *     context.setTemperatures(Eigen::VectorXd::Constant(1, temperature));
+ *     session.run(context);
+ *   }
+ */
+class Session {
+ public:
+  /** Initializes MPI, Kokkos, and the profiler.
+   * @param argc, argv: the command line arguments, which may contain the
+   * MPI options of Phoebe (e.g. -ps for the pool size) and the Kokkos ones.
+   */
+  Session(int argc, char *argv[]);
+
+  /** Releases the cached Hamiltonians, writes the performance report and
+   * finalizes Kokkos and MPI.
+   */
+  ~Session();
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  /** Reads an input file, as done by `phoebe -in`. The context can then be
+   * changed with its setters before running the apps.
+   * @param fileName: path to the input file.
+   */
+  static Context readInput(const std::string &fileName);
+
+  /** Runs an app. Must be called by all MPI processes.
+   * @param context: the input of the app.
+   * @param appName: name of the app, e.g. "phononTransport". If empty, the
+   * apps listed in the context are run one after the other.
+   */
+  void run(Context &context, const std::string &appName = "");
+
+  /** Drops the cached Hamiltonians, e.g. if the files they were read from
+   * have been replaced.
+   */
+  static void clearCache();
+};
+
+#endif
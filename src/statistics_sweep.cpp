@@ -172,18 +172,23 @@ StatisticsSweep::StatisticsSweep(Context &context,
     // in this case, I have dopings, and want to find chemical potentials
     if (nChemPot == 0) {
       nChemPot = nDop;
+      // all the (doping, temperature) pairs are solved together
+      Eigen::VectorXd pairDopings(nTemp * nDop);
+      Eigen::VectorXd pairTemperatures(nTemp * nDop);
       for (int it = 0; it < nTemp; it++) {
         for (int id = 0; id < nDop; id++) {
-          double temp = temperatures(it);
-          double doping = dopings(id);
-          double chemPot = findChemicalPotentialFromDoping(doping, temp);
-
           int iCalc = compress2Indices(it, id, nTemp, nDop);
-          calcTable(iCalc, 0) = temp;
-          calcTable(iCalc, 1) = chemPot;
-          calcTable(iCalc, 2) = doping;
+          pairTemperatures(iCalc) = temperatures(it);
+          pairDopings(iCalc) = dopings(id);
         }
       }
+      Eigen::VectorXd pairChemPots =
+          findChemicalPotentialsFromDopings(pairDopings, pairTemperatures);
+      for (int iCalc = 0; iCalc < nTemp * nDop; iCalc++) {
+        calcTable(iCalc, 0) = pairTemperatures(iCalc);
+        calcTable(iCalc, 1) = pairChemPots(iCalc);
+        calcTable(iCalc, 2) = pairDopings(iCalc);
+      }
 
       // in this case, I have chemical potentials
     } else if (nDop == 0) {
@@ -223,6 +228,25 @@ StatisticsSweep::StatisticsSweep(const StatisticsSweep &that)
   nDop = that.nDop;
 }
 
+// restriction to a single calculation
+StatisticsSweep::StatisticsSweep(const StatisticsSweep &that, const int &iCalc)
+    : StatisticsSweep(that, iCalc, 1) {}
+
+StatisticsSweep::StatisticsSweep(const StatisticsSweep &that,
+                                 const int &firstCalc, const int &numCalcs)
+    : particle(that.particle) {
+  if (firstCalc < 0 || numCalcs < 1 ||
+      firstCalc + numCalcs > that.numCalculations) {
+    Error("StatisticsSweep: calculation index out of range");
+  }
+  numCalculations = numCalcs;
+  infoCalculations = that.infoCalculations.middleRows(firstCalc, numCalcs);
+  // the calculations are indexed as a list of temperatures
+  nTemp = numCalcs;
+  nChemPot = 1;
+  nDop = std::min(that.nDop, 1);
+}
+
 // copy assignment
 StatisticsSweep &StatisticsSweep::operator=(const StatisticsSweep &that) {
   if (this != &that) {
@@ -236,89 +260,115 @@ StatisticsSweep &StatisticsSweep::operator=(const StatisticsSweep &that) {
   return *this;
 }
 
-double StatisticsSweep::fPop(const double &chemPot, const double &temp) {
-  // fPop = 1/NK \sum_\mu FermiDirac(\mu) - N
+void StatisticsSweep::sumOccupations(const Eigen::VectorXd &chemPots,
+                                     const Eigen::VectorXd &temperatures,
+                                     const std::vector<bool> &isActive,
+                                     Eigen::VectorXd &numbers,
+                                     Eigen::VectorXd &derivatives) {
+  // numbers = 1/NK \sum_s f(s), derivatives = d numbers / d mu,
+  // for all the (mu,T) pairs, with a single pass over the states.
   // Note that I don`t normalize the integral, which is the same thing I did
   // for computing the particle number
-
-  double fPop_ = 0.;
+  auto numPairs = int(chemPots.size());
   int numStates = int(energies.size());
+  Eigen::VectorXd sums = Eigen::VectorXd::Zero(2 * numPairs);
   #pragma omp parallel
   {
-    double fPopPrivate = 0.;
+    Eigen::VectorXd sumsPrivate = Eigen::VectorXd::Zero(2 * numPairs);
     #pragma omp for
     for (int is = 0; is < numStates; is++) {
       double x = energies[is];
-      fPopPrivate += particle.getPopulation(x, temp, chemPot);
+      for (int i = 0; i < numPairs; i++) {
+        if (!isActive[i]) continue;
+        sumsPrivate(i) += particle.getPopulation(x, temperatures(i), chemPots(i));
+        if (temperatures(i) > 0.) {
+          sumsPrivate(numPairs + i) -=
+              particle.getDnde(x, temperatures(i), chemPots(i));
+        }
       }
+    }
     #pragma omp critical
-    fPop_ += fPopPrivate;
+    sums += sumsPrivate;
   }
 
   // in the distributed case, this needs to be summed over all processes,
   // and also needs to be available to all processes for calculation of next
-  // iteration's chem potential
-  if (isDistributed) mpi->allReduceSum(&fPop_);
-  fPop_ /= double(numPoints);
-  fPop_ = numElectronsDoped - fPop_;
-  return fPop_;
+  // iteration's chem potential. One reduction for all pairs.
+  if (isDistributed) mpi->allReduceSum(&sums);
+  sums /= double(numPoints);
+  numbers = sums.head(numPairs);
+  derivatives = sums.tail(numPairs);
 }
 
 double
 StatisticsSweep::findChemicalPotentialFromDoping(const double &doping,
                                                  const double &temperature) {
+  Eigen::VectorXd dopings = Eigen::VectorXd::Constant(1, doping);
+  Eigen::VectorXd temperatures = Eigen::VectorXd::Constant(1, temperature);
+  return findChemicalPotentialsFromDopings(dopings, temperatures)(0);
+}
+
+Eigen::VectorXd StatisticsSweep::findChemicalPotentialsFromDopings(
+    const Eigen::VectorXd &dopings, const Eigen::VectorXd &temperatures) {
   // given the carrier concentration, finds the fermi energy
-  // temperature is set inside glob
-  // To find fermi energy, I must find the root of \sum_s f(s) - N = 0
-  // the root is found with a bisection algorithm
+  // To find fermi energy, I must find the root of N - \sum_s f(s) = 0
+  // the root is found with a Newton method, using the analytic derivative
+  // of the occupation, safeguarded by bisection.
   // Might be numerically unstable for VERY small doping concentration
 
   // numElectronsDoped is the total number of electrons in the unit cell
   // numElectrons is the number of electrons in the unit cell before doping
   // doping > 0 means p-doping (fermi level in the valence band)
 
-  numElectronsDoped = occupiedStates - doping * volume * pow(distanceBohrToCm, 3) / spinFactor;
-
-  // bisection method: I need to find the root of N - \int fermi dirac = 0
-  // initial guess
-  double chemicalPotential = fermiLevel;
-
-  // Corner cases
-  // if numElectronsDoped > numBands, it's a non-valid doping
-  if (numElectronsDoped > float(numBands)) {
-    Error("The requested number of occupied states is larger than the "
-          "bands present in the Hamiltonian.\n"
-          "numBands: " + std::to_string(numBands) + " numElectrons: " + std::to_string(numElectronsDoped)
-          + "\nThis likely means you've selected a non-physical doping value, such as\n"
-          "a very small doping for a metal, or you didn't Wannierize enough bands."
-          "\nThis can also happen if you had bands under your disentanglement window which\n"
-          "were not excluded using exclude_bands in Wannier90.\nSee a note about this in the elphWannier tutorial.");
-  }
-  if (numElectronsDoped < 0.) {
-    Error("The number of occupied states is negative!");
-  }
+  auto numPairs = int(dopings.size());
+  Eigen::VectorXd chemicalPotentials(numPairs);
+  std::vector<bool> isActive(numPairs, true);
+  Eigen::VectorXd targets(numPairs);
+  for (int i = 0; i < numPairs; i++) {
+    double numElectronsDoped = occupiedStates
+        - dopings(i) * volume * pow(distanceBohrToCm, 3) / spinFactor;
+    targets(i) = numElectronsDoped;
+
+    // initial guess
+    chemicalPotentials(i) = fermiLevel;
+
+    // Corner cases
+    // if numElectronsDoped > numBands, it's a non-valid doping
+    if (numElectronsDoped > float(numBands)) {
+      Error("The requested number of occupied states is larger than the "
+            "bands present in the Hamiltonian.\n"
+            "numBands: " + std::to_string(numBands) + " numElectrons: " + std::to_string(numElectronsDoped)
+            + "\nThis likely means you've selected a non-physical doping value, such as\n"
+            "a very small doping for a metal, or you didn't Wannierize enough bands."
+            "\nThis can also happen if you had bands under your disentanglement window which\n"
+            "were not excluded using exclude_bands in Wannier90.\nSee a note about this in the elphWannier tutorial.");
+    }
+    if (numElectronsDoped < 0.) {
+      Error("The number of occupied states is negative!");
+    }
 
-  // if we are looking for the fermi level at T=0 and n=0, we have a corner case
-  // when we have completely empty bands or completely full bands.
-  if (doping == 0. && temperature == 0.) {// case of computing fermi level
-    if (numElectronsDoped == 0.) {
-      if(energies.size() > 0) fermiLevel = *min_element(energies.begin(), energies.end());
-      chemicalPotential = fermiLevel;
-      return chemicalPotential;
-    } else if (numElectronsDoped == float(numBands)) {
-      if(energies.size() > 0) fermiLevel = *max_element(energies.begin(), energies.end());
-      chemicalPotential = fermiLevel;
-      return chemicalPotential;
+    // if we are looking for the fermi level at T=0 and n=0, we have a corner
+    // case when we have completely empty bands or completely full bands.
+    if (dopings(i) == 0. && temperatures(i) == 0.) {// computing fermi level
+      if (numElectronsDoped == 0.) {
+        if(energies.size() > 0) fermiLevel = *min_element(energies.begin(), energies.end());
+        chemicalPotentials(i) = fermiLevel;
+        isActive[i] = false;
+      } else if (numElectronsDoped == float(numBands)) {
+        if(energies.size() > 0) fermiLevel = *max_element(energies.begin(), energies.end());
+        chemicalPotentials(i) = fermiLevel;
+        isActive[i] = false;
+      }
     }
   }
 
-  double aX = 0; double bX = 0;
+  double minX = 0; double maxX = 0;
   // if this is a weird case where this processor has zero
   // states, the below lines will cause a seg fault
   if(energies.size() > 0) {
     // I choose the following (generous) boundaries
-    aX = *min_element(energies.begin(), energies.end()) - 1.;
-    bX = *max_element(energies.begin(), energies.end()) + 1.;
+    minX = *min_element(energies.begin(), energies.end()) - 1.;
+    maxX = *max_element(energies.begin(), energies.end()) + 1.;
     // note: +-1 Ry = 13 eV should work for most dopings and temperatures,
     // even in corner cases
   }
@@ -326,39 +376,75 @@ StatisticsSweep::findChemicalPotentialFromDoping(const double &doping,
   // if energies are distributed, each process needs to have the global
   // minimum and maximum of the energies
   if (isDistributed) {
-    mpi->allReduceMin(&aX);
-    mpi->allReduceMax(&bX);
+    mpi->allReduceMin(&minX);
+    mpi->allReduceMax(&maxX);
   }
-  double aY = fPop(aX, temperature);
-  double bY = fPop(bX, temperature);
+  Eigen::VectorXd aX = Eigen::VectorXd::Constant(numPairs, minX);
+  Eigen::VectorXd bX = Eigen::VectorXd::Constant(numPairs, maxX);
 
   // check if starting values are bad
-  if (sgn(aY) == sgn(bY)) {
-    Error("Something is wrong with the boundary limits for mu determination bisection method.");
+  Eigen::VectorXd aN, bN, dN;
+  sumOccupations(aX, temperatures, isActive, aN, dN);
+  sumOccupations(bX, temperatures, isActive, bN, dN);
+  for (int i = 0; i < numPairs; i++) {
+    if (!isActive[i]) continue;
+    if (sgn(targets(i) - aN(i)) == sgn(targets(i) - bN(i))) {
+      Error("Something is wrong with the boundary limits for mu determination.");
+    }
+    if (chemicalPotentials(i) <= aX(i) || chemicalPotentials(i) >= bX(i)) {
+      chemicalPotentials(i) = (aX(i) + bX(i)) / 2.;
+    }
   }
 
   for (int iter = 0; iter < maxIter; iter++) {
+    if (std::none_of(isActive.begin(), isActive.end(),
+                     [](bool x) { return x; })) {
+      break;
+    }
     if (mpi->mpiHead() && iter == maxIter - 1) {
       Error("Max iteration reached without finding mu.");
     }
-    // x value is midpoint of prior values
-    double cX = (aX + bX) / 2.;
-    double cY = fPop(cX, temperature);
-
-    // exit condition: the guess is exact or didn't change much
-    if ((cY == 0.) || (abs(bX - aX) < 1.0e-8)) {
-      chemicalPotential = cX;
-      break;// go out of the loop
-    }
+    Eigen::VectorXd numbers, derivatives;
+    sumOccupations(chemicalPotentials, temperatures, isActive, numbers,
+                   derivatives);
+
+    for (int i = 0; i < numPairs; i++) {
+      if (!isActive[i]) continue;
+      double x = chemicalPotentials(i);
+      // the number of particles increases with the chemical potential
+      double y = targets(i) - numbers(i);
+
+      // exit condition: the guess is exact
+      if (y == 0.) {
+        isActive[i] = false;
+        continue;
+      }
 
-    // check the sign
-    if (sgn(cY) == sgn(aY)) {
-      aX = cX;
-    } else {
-      bX = cX;
+      // shrink the bracket around the root
+      if (y > 0.) {
+        aX(i) = x;
+      } else {
+        bX(i) = x;
+      }
+
+      // Newton step, or bisection if it falls out of the bracket
+      // (e.g. at T=0, where the derivative vanishes)
+      double newX = (aX(i) + bX(i)) / 2.;
+      if (derivatives(i) > 0.) {
+        double newtonX = x + y / derivatives(i);
+        if (newtonX > aX(i) && newtonX < bX(i)) {
+          newX = newtonX;
+        }
+      }
+      chemicalPotentials(i) = newX;
+
+      // exit condition: the guess didn't change much
+      if (abs(newX - x) < 1.0e-8 || abs(bX(i) - aX(i)) < 1.0e-8) {
+        isActive[i] = false;
+      }
     }
   }
-  return chemicalPotential;
+  return chemicalPotentials;
 }
 
 double StatisticsSweep::findDopingFromChemicalPotential(
@@ -405,6 +491,25 @@ StatisticsSweep::getCalcStatistics(const TempIndex &iTemp,
 
 int StatisticsSweep::getNumCalculations() const { return numCalculations; }
 
+Eigen::MatrixXd
+StatisticsSweep::getIrrPopulations(BaseBandStructure &bandStructure) {
+  auto numIrrStates = int(bandStructure.irrStateIterator().size());
+  Eigen::VectorXd irrEnergies(numIrrStates);
+  for (int iBte = 0; iBte < numIrrStates; iBte++) {
+    BteIndex iBteIdx(iBte);
+    StateIndex isIdx = bandStructure.bteToState(iBteIdx);
+    irrEnergies(iBte) = bandStructure.getEnergy(isIdx);
+  }
+  Eigen::MatrixXd populations(numCalculations, numIrrStates);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    auto calcStat = getCalcStatistics(iCalc);
+    populations.row(iCalc) =
+        particle.getPopulations(irrEnergies, calcStat.temperature,
+                                calcStat.chemicalPotential).transpose();
+  }
+  return populations;
+}
+
 int StatisticsSweep::getNumChemicalPotentials() const { return nChemPot; }
 
 int StatisticsSweep::getNumTemperatures() const { return nTemp; }
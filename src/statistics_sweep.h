@@ -38,6 +38,23 @@ class StatisticsSweep {
    */
   StatisticsSweep(const StatisticsSweep &that);
 
+  /** Constructor of a sweep restricted to a single calculation of another
+   * sweep, i.e. to one pair of temperature and chemical potential.
+   * @param that: the StatisticsSweep containing all the calculations.
+   * @param iCalc: index of the calculation to keep, in [0,numCalculations[
+   */
+  StatisticsSweep(const StatisticsSweep &that, const int &iCalc);
+
+  /** Constructor of a sweep restricted to a range of consecutive
+   * calculations of another sweep, e.g. to process a long list of
+   * temperatures and chemical potentials in chunks.
+   * @param that: the StatisticsSweep containing all the calculations.
+   * @param firstCalc: index of the first calculation to keep.
+   * @param numCalcs: number of calculations to keep.
+   */
+  StatisticsSweep(const StatisticsSweep &that, const int &firstCalc,
+                  const int &numCalcs);
+
   /** Copy assignment
    */
   StatisticsSweep &operator=(const StatisticsSweep &that);
@@ -68,6 +85,16 @@ class StatisticsSweep {
    */
   int getNumCalculations() const;
 
+  /** Computes the equilibrium populations of the irreducible (BTE) states
+   * of a band structure, for all calculations.
+   * Every MPI process computes the full table, which is cheaper than
+   * distributing the work and reducing the result.
+   * @param bandStructure: a non-distributed band structure.
+   * @return populations: a matrix (numCalculations, numIrrStates), indexed
+   * with the BteIndex of the states.
+   */
+  Eigen::MatrixXd getIrrPopulations(BaseBandStructure &bandStructure);
+
   /** Returns for how many chemical potentials we are computing properties.
    */
   int getNumChemicalPotentials() const;
@@ -105,15 +132,24 @@ class StatisticsSweep {
   double findDopingFromChemicalPotential(const double &chemicalPotential,
                                          const double &temperature);
 
-  // Auxiliary function for finding the chemical potential.
-  double fPop(const double &chemPot, const double &temp);
+  /** Computes the chemical potentials of several (doping, temperature)
+   * pairs at once, with a single pass over the states per iteration.
+   */
+  Eigen::VectorXd findChemicalPotentialsFromDopings(
+      const Eigen::VectorXd &dopings, const Eigen::VectorXd &temperatures);
+
+  // Auxiliary function for finding the chemical potential: computes the
+  // number of particles and its derivative wrt mu for each (mu,T) pair.
+  void sumOccupations(const Eigen::VectorXd &chemPots,
+                      const Eigen::VectorXd &temperatures,
+                      const std::vector<bool> &isActive,
+                      Eigen::VectorXd &numbers, Eigen::VectorXd &derivatives);
 
   // this block is temporary variables for electronic calculations
   const int maxIter = 100;
   int numPoints = 0;
   int numBands = 0;
   std::vector<double> energies;
-  double numElectronsDoped = 0.;
   double volume = 0.;
   double spinFactor = 0.;
   double occupiedStates = 0.;
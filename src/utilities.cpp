@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <iomanip>
 #include <regex>
+#include <sstream>
 
 int mod(const int &a, const int &b) { return (a % b + b) % b; }
 
@@ -77,6 +78,26 @@ std::tuple<double, double> memoryUsage() {
   return std::make_tuple(vm_usage, resident_set);
 }
 
+std::tuple<double, double> processMemory() {
+  double rss = 0.;
+  double peakRss = 0.;
+  // the lines of interest are e.g. "VmRSS:     123456 kB"
+  std::ifstream statusFile("/proc/self/status");
+  std::string line;
+  while (std::getline(statusFile, line)) {
+    std::istringstream iss(line);
+    std::string key;
+    double kiloBytes = 0.;
+    iss >> key >> kiloBytes;
+    if (key == "VmRSS:") {
+      rss = kiloBytes * 1024.;
+    } else if (key == "VmHWM:") {
+      peakRss = kiloBytes * 1024.;
+    }
+  }
+  return std::make_tuple(rss, peakRss);
+}
+
 double findMaxRelativeDifference(const Eigen::Tensor<double,3> &x,
                                  const Eigen::Tensor<double,3> &xRef) {
 
@@ -101,6 +122,43 @@ double findMaxRelativeDifference(const Eigen::Tensor<double,3> &x,
   return maxDiff;
 }
 
+Eigen::VectorXd findMaxRelativeDifferencePerCalc(
+    const Eigen::Tensor<double,3> &x, const Eigen::Tensor<double,3> &xRef) {
+
+  if (!(x.dimensions() == xRef.dimensions())) {
+    Error("Developer error: Can't compare inconsistent tensors");
+  }
+
+  int numCalculations = int(x.dimension(0));
+  Eigen::VectorXd diffs(numCalculations);
+  Eigen::array<Eigen::Index, 3> extents = {1, x.dimension(1), x.dimension(2)};
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    Eigen::array<Eigen::Index, 3> offsets = {iCalc, 0, 0};
+    Eigen::Tensor<double, 3> xSlice = x.slice(offsets, extents);
+    Eigen::Tensor<double, 3> xRefSlice = xRef.slice(offsets, extents);
+    diffs(iCalc) = findMaxRelativeDifference(xSlice, xRefSlice);
+  }
+  return diffs;
+}
+
+bool readFileOnHead(const std::string &fileName, std::string &content) {
+  int isOpen = 0;
+  content.clear();
+  if (mpi->mpiHead()) {
+    std::ifstream infile(fileName);
+    if (infile.is_open()) {
+      isOpen = 1;
+      std::stringstream buffer;
+      buffer << infile.rdbuf();
+      content = buffer.str();
+    }
+  }
+  mpi->bcast(&isOpen);
+  if (isOpen == 0) return false;
+  mpi->bcast(&content);
+  return true;
+}
+
 // helper to break up strings by comma and spaces and quote marks
 std::vector<std::string> tokenize(const std::string str) {
 
@@ -1,6 +1,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <cstdint>
 #include <tuple>
 #include <string>
 #include <vector>
@@ -14,7 +15,7 @@
 int mod(const int &a, const int &b);
 
 // returns -1 if val<0, 0 if val=0, and 1 if val>0
-template<typename T> int sgn(T &val) {
+template<typename T> int sgn(const T &val) {
     return (T(0) < val) - (val < T(0));
 }
 
@@ -33,6 +34,15 @@ std::tuple<int, int> decompress2Indices(const int &iTot, const int &size1,
 // helper to break up strings by commas and spaces
 std::vector<std::string> tokenize(const std::string str);
 
+/** Reads a text file on the head MPI rank, and broadcasts its content to
+ * all the other ranks, so that only one process opens the file. The content
+ * can then be parsed with an std::istringstream in place of an ifstream.
+ * @param fileName: path of the file to read.
+ * @param content: on exit, the content of the file, on all ranks.
+ * @return bool: false if the file couldn't be opened (on all ranks).
+ */
+bool readFileOnHead(const std::string &fileName, std::string &content);
+
 // A function to allocate a dynamically sized array. It tricks the
 // compiler into thinking the size is a constant via the const identifier
 // on the argument. This resolves issues with VLAs -- see crystal.cpp
@@ -98,6 +108,33 @@ using StateIndex = NamedType<int, struct StateTag>;
  */
 std::tuple<double, double> memoryUsage();
 
+/** Host memory of this MPI process, read from /proc/self/status.
+ * Unlike memoryUsage(), it is not collective and doesn't print anything.
+ *
+ * @return [rss,peakRss]: tuple with the resident set size and its peak
+ * since the start of the process (VmRSS and VmHWM), in bytes. Both are zero
+ * if /proc is not available, e.g. on macOS.
+ */
+std::tuple<double, double> processMemory();
+
+/** Sets an array to zero (or copies a source array into it) in parallel,
+ * with a static OpenMP schedule. Since the operating system places a page
+ * of memory on the NUMA domain of the thread that first writes it, large
+ * buffers initialized this way are spread over the NUMA domains of the
+ * node, instead of all landing on the domain of the master thread.
+ * @param data: the array, freshly allocated and not yet written.
+ * @param size: number of elements of the array.
+ * @param source: optional array of the same size to copy from.
+ */
+template <typename T>
+void firstTouch(T* data, const size_t& size, const T* source = nullptr) {
+  auto n = int64_t(size);
+#pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < n; i++) {
+    data[i] = source == nullptr ? T(0) : source[i];
+  }
+}
+
 /** splitVector is a utility that splits a std::vector<> into chunks with
  * specified size.
  *
@@ -129,4 +166,11 @@ std::vector<Vector> splitVector(const Vector& v, unsigned chunkSize) {
 double findMaxRelativeDifference(const Eigen::Tensor<double,3> &x,
                                  const Eigen::Tensor<double,3> &xRef);
 
+/** Same as findMaxRelativeDifference, but evaluated separately on each
+ * slice x(i,:,:) of the tensors, i.e. on each calculation (temperature and
+ * chemical potential) of a transport tensor.
+ */
+Eigen::VectorXd findMaxRelativeDifferencePerCalc(
+    const Eigen::Tensor<double,3> &x, const Eigen::Tensor<double,3> &xRef);
+
 #endif
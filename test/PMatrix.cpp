@@ -50,3 +50,187 @@ TEST (PMatrixTest, diagonalize) {
   if(pMat.indicesAreLocal(1,1)) { EXPECT_EQ(pMat(1,1), 0.0); }
 
 }
+
+TEST (PMatrixTest, autoBlocks) {
+
+  // a tuned block-cyclic distribution on the default process grid
+  int numRows = 37;
+  ParallelMatrix<double> pMat(numRows, numRows, 0, 0,
+                              ParallelMatrix<double>::autoBlocks,
+                              ParallelMatrix<double>::autoBlocks);
+
+  // every element is stored by exactly one process
+  int numLocal = int(pMat.getAllLocalStates().size());
+  mpi->allReduceSum(&numLocal);
+  EXPECT_EQ(numLocal, numRows * numRows);
+
+  // a diagonal matrix with known eigenvalues
+  for (int i = 0; i < numRows; i++) {
+    if (pMat.indicesAreLocal(i, i)) pMat(i, i) = double(i);
+  }
+  auto eigenvalues = std::get<0>(pMat.diagonalize());
+  for (int i = 0; i < numRows; i++) {
+    EXPECT_NEAR(eigenvalues[i], double(i), 1e-10);
+  }
+}
+
+TEST (PMatrixTest, localTiles) {
+
+  // a block-cyclic distribution with several tiles per process
+  int numRows = 37;
+  ParallelMatrix<double> pMat(numRows, numRows, 0, 0,
+                              ParallelMatrix<double>::autoBlocks,
+                              ParallelMatrix<double>::autoBlocks);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      if (pMat.indicesAreLocal(i, j)) pMat(i, j) = double(i + 100 * j);
+    }
+  }
+
+  // the tiles cover each local element once, with the right global indices
+  int numVisited = 0;
+  int numWrong = 0;
+  pMat.forEachLocalTile([&](const int &row0, const int &col0,
+                            const int &numTileRows, const int &numTileCols,
+                            double *data, const int &ld) {
+    for (int j = 0; j < numTileCols; j++) {
+      for (int i = 0; i < numTileRows; i++) {
+        numVisited++;
+        if (data[i + j * ld] != double(row0 + i + 100 * (col0 + j))) {
+          numWrong++;
+        }
+      }
+    }
+  });
+  EXPECT_EQ(numVisited, int(pMat.getAllLocalStates().size()));
+  EXPECT_EQ(numWrong, 0);
+  mpi->allReduceSum(&numVisited);
+  EXPECT_EQ(numVisited, numRows * numRows);
+}
+
+TEST (PMatrixTest, symmetrize) {
+
+  // large enough to be symmetrized in several strips
+  int numRows = 53;
+  Eigen::MatrixXd a(numRows, numRows);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      a(i, j) = double(i - 3 * j) + 0.01 * double(i * j);
+    }
+  }
+  ParallelMatrix<double> pMat(numRows, numRows, 0, 0,
+                              ParallelMatrix<double>::autoBlocks,
+                              ParallelMatrix<double>::autoBlocks);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      if (pMat.indicesAreLocal(i, j)) pMat(i, j) = a(i, j);
+    }
+  }
+  pMat.symmetrize();
+
+  Eigen::MatrixXd aSym = 0.5 * (a + a.transpose());
+  double maxError = 0.;
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      if (pMat.indicesAreLocal(i, j)) {
+        maxError = std::max(maxError, std::abs(pMat(i, j) - aSym(i, j)));
+      }
+    }
+  }
+  mpi->allReduceMax(&maxError);
+  EXPECT_NEAR(maxError, 0., 1e-12);
+}
+
+TEST (PMatrixTest, projectOnColumns) {
+
+  // a symmetric positive definite matrix
+  int numRows = 6;
+  Eigen::MatrixXd a(numRows, numRows);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      a(i, j) = 1. / (1. + i + j);
+    }
+    a(i, i) += 2.;
+  }
+  ParallelMatrix<double> pMat(numRows, numRows);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      if (pMat.indicesAreLocal(i, j)) pMat(i, j) = a(i, j);
+    }
+  }
+  auto tup = pMat.diagonalize();
+  auto eigenvalues = std::get<0>(tup);
+  auto eigenvectors = std::get<1>(tup);
+
+  // projecting with weights 1/lambda gives the solution of a * y = x
+  Eigen::VectorXd weights(numRows);
+  for (int i = 0; i < numRows; i++) weights(i) = 1. / eigenvalues[i];
+  Eigen::MatrixXd x = Eigen::MatrixXd::Ones(numRows, 2);
+  x.col(1).setLinSpaced(numRows, 0., 1.);
+
+  Eigen::MatrixXd y = eigenvectors.projectOnColumns(x, weights);
+  EXPECT_NEAR((a * y - x).norm(), 0., 1e-10);
+
+  // the distributed copy of x is collected back unchanged
+  EXPECT_NEAR((eigenvectors.distributeRows(x).replicate() - x).norm(), 0., 1e-14);
+}
+
+TEST (PMatrixTest, gatherLocalRows) {
+
+  int numRows = 7;
+  Eigen::MatrixXd a(numRows, numRows);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      a(i, j) = double(i - 2 * j);
+    }
+  }
+  ParallelMatrix<double> pMat(numRows, numRows);
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      if (pMat.indicesAreLocal(i, j)) pMat(i, j) = a(i, j);
+    }
+  }
+  Eigen::MatrixXd x(numRows, 2);
+  x.col(0).setOnes();
+  x.col(1).setLinSpaced(numRows, 0., 1.);
+
+  // each process multiplies its local block
+  std::vector<int> localRows = pMat.getAllLocalRows();
+  std::vector<int> localCols = pMat.getAllLocalCols();
+  Eigen::MatrixXd y = Eigen::MatrixXd::Zero(localRows.size(), 2);
+  for (size_t i = 0; i < localRows.size(); i++) {
+    for (int j : localCols) {
+      y.row(i) += a(localRows[i], j) * x.row(j);
+    }
+  }
+  EXPECT_NEAR((pMat.gatherLocalRows(y) - a * x).norm(), 0., 1e-12);
+}
+
+TEST (PMatrixTest, outOfCore) {
+
+  int numRows = 4;
+  ParallelMatrix<double> pMat(numRows, numRows, 0, 0, 0, 0, -1, ".");
+  EXPECT_TRUE(pMat.isOutOfCore());
+
+  // the scratch file starts filled with zeros
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      EXPECT_EQ(pMat(i, j), 0.);
+      if (pMat.indicesAreLocal(i, j)) pMat(i, j) = double(i + j);
+    }
+  }
+
+  // a moved matrix keeps its scratch file, a copy is in memory
+  ParallelMatrix<double> moved = std::move(pMat);
+  EXPECT_TRUE(moved.isOutOfCore());
+  ParallelMatrix<double> copied = moved;
+  EXPECT_FALSE(copied.isOutOfCore());
+  for (int i = 0; i < numRows; i++) {
+    for (int j = 0; j < numRows; j++) {
+      if (moved.indicesAreLocal(i, j)) {
+        EXPECT_EQ(moved(i, j), double(i + j));
+        EXPECT_EQ(copied(i, j), double(i + j));
+      }
+    }
+  }
+}
@@ -0,0 +1,46 @@
+#include "gtest/gtest.h"
+#include "SparseMatrix.h"
+
+TEST (SparseMatrixTest, accumulate) {
+
+  SparseMatrix<double> sMat(3, 3);
+
+  // add elements in random order, with duplicates
+  sMat.add(2, 0, 1.0);
+  sMat.add(0, 1, 2.0);
+  sMat.add(2, 0, 3.0);
+  sMat.add(1, 1, 1e-14);
+  sMat.compress();
+  sMat.add(0, 1, -1.0);
+  sMat.add(0, 0, 5.0);
+  sMat.compress();
+
+  EXPECT_EQ(int(sMat.nonZeros()), 4);
+
+  // row 0 contains (0,0) and (0,1), sorted by column
+  EXPECT_EQ(int(sMat.rowBegin(0)), 0);
+  EXPECT_EQ(int(sMat.rowBegin(1)), 2);
+  EXPECT_EQ(sMat.colIndex(0), 0);
+  EXPECT_EQ(sMat.value(0), 5.0);
+  EXPECT_EQ(sMat.colIndex(1), 1);
+  EXPECT_EQ(sMat.value(1), 1.0);
+  EXPECT_EQ(sMat.colIndex(3), 0);
+  EXPECT_EQ(sMat.value(3), 4.0);
+
+  // the small element of row 1 is removed
+  sMat.drop(1e-12);
+  EXPECT_EQ(int(sMat.nonZeros()), 3);
+  EXPECT_EQ(int(sMat.rowBegin(2)), 2);
+  EXPECT_EQ(int(sMat.rowBegin(3)), 3);
+
+  // (A + A^T)/2
+  sMat.symmetrize();
+  EXPECT_EQ(int(sMat.nonZeros()), 5);
+  double sum = 0.;
+  for (size_t k = 0; k < sMat.nonZeros(); k++) {
+    sum += sMat.value(k);
+  }
+  EXPECT_EQ(sum, 10.0);
+  EXPECT_EQ(sMat.value(0), 5.0);
+  EXPECT_EQ(sMat.value(1), 0.5);
+}
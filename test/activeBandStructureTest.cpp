@@ -276,4 +276,12 @@ TEST(ActiveBandStructureTest, WindowFilter) {
   Eigen::MatrixXcd resultAPP = mat_vec_mat_adj(ev3Dto2D(eigenVectorsAPP), ensAPP, nb);
   //resultOTF = ev3Dto2D(eigenVectorsOTF)*ensOTF.asDiagonal()*ev3Dto2D(eigenVectorsOTF).adjoint();
   EXPECT_NEAR((resultAPP-resultOTF).norm()/resultAPP.norm(), 0.0, 1e-14);
+
+  // the views on the storage must match the copies
+  Eigen::VectorXd ensView = absOTF.getEnergiesView(ikIndex);
+  Eigen::MatrixXd vView = absOTF.getGroupVelocitiesView(ikIndex);
+  Eigen::MatrixXcd evView = absOTF.getEigenvectorsView(ikIndex);
+  EXPECT_EQ((ensView - ensOTF).norm(), 0.);
+  EXPECT_EQ((vView - absOTF.getGroupVelocities(ikIndex)).norm(), 0.);
+  EXPECT_EQ((evView - absOTF.getEigenvectors(ikIndex)).norm(), 0.);
 }
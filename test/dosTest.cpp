@@ -60,3 +60,72 @@ TEST(TetrahedronTest, Normalization) {
   ASSERT_NEAR(x,h0.getNumBands(),0.025);
 
 }
+
+/** The DOS computed with a single sweep over the precomputed tetrahedra
+ * must agree with the energy-by-energy evaluation.
+ */
+TEST(TetrahedronTest, BinnedDOS) {
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setSumRuleFC2("simple");
+
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto h0 = std::get<1>(tup);
+
+  Eigen::Vector3i qMesh;
+  qMesh << 8, 8, 8;
+  Points points(crystal, qMesh);
+  auto fullBandStructure = h0.populate(points, false, false, false);
+
+  TetrahedronDeltaFunction tetrahedra(fullBandStructure);
+
+  double minEnergy = 0.;
+  double deltaEnergy = 0.001 / energyRyToEv;
+  int numEnergies = 80;
+
+  std::vector<double> dosPointwise(numEnergies);
+  for (int i = 0; i < numEnergies; i++) {
+    dosPointwise[i] = tetrahedra.getDOS(i * deltaEnergy + minEnergy);
+  }
+
+  tetrahedra.precomputeTetrahedra();
+  std::vector<double> dosBinned =
+      tetrahedra.getDOS(minEnergy, deltaEnergy, numEnergies);
+  ASSERT_EQ(int(dosBinned.size()), numEnergies);
+  for (int i = 0; i < numEnergies; i++) {
+    ASSERT_NEAR(dosBinned[i], dosPointwise[i], 1.0e-6 * (1. + dosPointwise[i]));
+  }
+}
+
+/** The copy of the smearing used in Kokkos kernels must give the same
+ * values as the host implementation.
+ */
+TEST(DeltaFunctionTest, DeviceSmearing) {
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setSumRuleFC2("simple");
+  context.setSmearingWidth(0.01 / energyRyToEv);
+
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto h0 = std::get<1>(tup);
+  Eigen::Vector3i qMesh;
+  qMesh << 4, 4, 4;
+  Points points(crystal, qMesh);
+  auto fullBandStructure = h0.populate(points, false, false, false);
+
+  GaussianDeltaFunction gaussian(context);
+  AdaptiveGaussianDeltaFunction adaptive(fullBandStructure);
+  DeviceDeltaFunction deviceGaussian = gaussian.getDeviceDeltaFunction();
+  DeviceDeltaFunction deviceAdaptive = adaptive.getDeviceDeltaFunction();
+
+  Eigen::Vector3d v;
+  v << 1.0e-4, -2.0e-4, 5.0e-5;
+  for (double energy : {0., 0.002 / energyRyToEv, 0.02 / energyRyToEv}) {
+    EXPECT_NEAR(deviceGaussian(energy, 0., 0., 0.),
+                gaussian.getSmearing(energy), 1.0e-10);
+    EXPECT_NEAR(deviceAdaptive(energy, v(0), v(1), v(2)),
+                adaptive.getSmearing(energy, v), 1.0e-10);
+  }
+}
@@ -1,5 +1,6 @@
 #include "bandstructure.h"
 #include "ifc3_parser.h"
+#include "mpiHelper.h"
 #include "ph_scattering.h"
 #include "points.h"
 #include "parser.h"
@@ -468,3 +469,81 @@ TEST(Interaction3Ph, Coupling3Ph000_p3py) {
 
   ASSERT_NEAR(relativeError, 0., 1.0e-4);
 }
+
+/** With pools, cacheD3() sums the contributions of the processes of the pool
+ * with non-blocking reductions, while the processes go on with the q2 of the
+ * next process. The cache for different q2 on each process must be the same
+ * as the one obtained when all the processes cache the same q2, one q2 at a
+ * time. Run with at least 3 processes per pool (e.g. mpirun -np 3 runTests
+ * -ps 3), so that the two buffers of the reductions are both reused.
+ */
+TEST(Interaction3Ph, PooledCacheD3) {
+  int poolSize = mpi->getSize(mpi->intraPoolComm);
+  if (poolSize < 3) {
+    GTEST_SKIP() << "needs pools of at least 3 MPI processes";
+  }
+  int poolRank = mpi->getRank(mpi->intraPoolComm);
+
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setPhFC3FileName("../test/data/FORCE_CONSTANTS_3RD");
+  context.setSumRuleFC2("simple");
+
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto phononH0 = std::get<1>(tup);
+  auto coupling3Ph = IFC3Parser::parse(context, crystal);
+
+  // a different q2 for each process of the pool
+  auto getQ2 = [](const int &iPool) {
+    Eigen::Vector3d q2;
+    q2 << 0.1 * (iPool + 1), -0.05 * iPool, 0.02 * (iPool + 2);
+    return q2;
+  };
+  Eigen::Vector3d q1;
+  q1 << 0.13, 0.07, -0.11;
+
+  auto computeCouplings = [&](const Eigen::Vector3d &q2) {
+    Eigen::Vector3d q3Plus = q1 + q2;
+    Eigen::Vector3d q3Mins = q1 - q2;
+    auto ev1 = std::get<1>(phononH0.diagonalizeFromCoordinates(q1));
+    auto ev2 = std::get<1>(phononH0.diagonalizeFromCoordinates(q2));
+    auto ev3Plus = std::get<1>(phononH0.diagonalizeFromCoordinates(q3Plus));
+    auto ev3Mins = std::get<1>(phononH0.diagonalizeFromCoordinates(q3Mins));
+    int nb = phononH0.getNumBands();
+    std::vector<Eigen::Vector3d> q1s = {q1};
+    std::vector<Eigen::MatrixXcd> ev1s = {ev1}, ev3Pluss = {ev3Plus},
+                                  ev3Minss = {ev3Mins};
+    std::vector<int> nb1s = {nb}, nb3Pluss = {nb}, nb3Minss = {nb};
+    return coupling3Ph.getCouplingsSquared(q1s, q2, ev1s, ev2, ev3Pluss,
+                                           ev3Minss, nb1s, nb, nb3Pluss,
+                                           nb3Minss);
+  };
+
+  // reference: all the processes cache the same q2, so the reductions
+  // always sum the same contributions
+  Eigen::Tensor<double, 3> referencePlus, referenceMins;
+  for (int iPool = 0; iPool < poolSize; iPool++) {
+    coupling3Ph.cacheD3(getQ2(iPool));
+    if (iPool == poolRank) {
+      auto t = computeCouplings(getQ2(iPool));
+      referencePlus = std::get<0>(t)[0];
+      referenceMins = std::get<1>(t)[0];
+    }
+  }
+
+  // pooled: each process caches its own q2
+  coupling3Ph.cacheD3(getQ2(poolRank));
+  auto t = computeCouplings(getQ2(poolRank));
+  Eigen::Tensor<double, 3> couplingPlus = std::get<0>(t)[0];
+  Eigen::Tensor<double, 3> couplingMins = std::get<1>(t)[0];
+
+  Eigen::Tensor<double, 0> norm = referencePlus.abs().maximum();
+  ASSERT_GT(norm(), 0.);
+  for (long i = 0; i < referencePlus.size(); i++) {
+    ASSERT_NEAR(couplingPlus.data()[i], referencePlus.data()[i],
+                1.0e-10 * norm());
+    ASSERT_NEAR(couplingMins.data()[i], referenceMins.data()[i],
+                1.0e-10 * norm());
+  }
+}
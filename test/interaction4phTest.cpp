@@ -0,0 +1,94 @@
+#include "interaction_4ph.h"
+#include "parser.h"
+#include "gtest/gtest.h"
+
+TEST(Interaction4Ph, Coupling4PhFourier) {
+  // here we test the |V4|^2 matrix elements computed by the partial Fourier
+  // transforms of Interaction4Ph, against a direct sum over the lattice
+  // vectors, using some random force constants and eigenvectors.
+
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setSumRuleFC2("simple");
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+
+  int numBands = 3 * crystal.getNumAtoms();
+
+  // three blocks, two of which share the same (R3,R4) pair
+  int numBlocks = 3;
+  Eigen::MatrixXd cellPositions2(3, numBlocks), cellPositions3(3, numBlocks),
+      cellPositions4(3, numBlocks);
+  cellPositions2 << 0., 1., 0.,
+                    0., 0., 2.,
+                    0., 0., 0.;
+  cellPositions3 << 0., 0., -1.,
+                    0., 0., 0.,
+                    0., 0., 3.;
+  cellPositions4 << 0., 0., 1.,
+                    0., 0., 1.,
+                    0., 0., 0.;
+  Eigen::Tensor<double, 5> D4(numBands, numBands, numBands, numBands,
+                              numBlocks);
+  D4.setRandom();
+  Interaction4Ph coupling4Ph(crystal, D4, cellPositions2, cellPositions3,
+                             cellPositions4);
+
+  Eigen::Vector3d q1(0.1, 0.2, -0.3), q2(-0.4, 0.15, 0.25),
+      q3(0.3, -0.2, 0.05);
+  Eigen::MatrixXcd ev1 = Eigen::MatrixXcd::Random(numBands, numBands);
+  Eigen::MatrixXcd ev2 = Eigen::MatrixXcd::Random(numBands, numBands);
+  Eigen::MatrixXcd ev3 = Eigen::MatrixXcd::Random(numBands, numBands);
+  Eigen::MatrixXcd ev4 = Eigen::MatrixXcd::Random(numBands, numBands);
+
+  coupling4Ph.cacheD4(q2);
+  coupling4Ph.cacheD4Q3(q3);
+
+  std::complex<double> complexI(0., 1.);
+  for (int processType : {Interaction4Ph::plusPlus, Interaction4Ph::plusMinus,
+                          Interaction4Ph::minusMinus}) {
+    auto signs = Interaction4Ph::getProcessSigns(processType);
+    int s2 = std::get<0>(signs);
+    int s3 = std::get<1>(signs);
+    Eigen::Vector3d q4 = q1 + s2 * q2 + s3 * q3;
+
+    std::vector<Eigen::Vector3d> q1s = {q1};
+    std::vector<Eigen::MatrixXcd> ev1s = {ev1};
+    std::vector<Eigen::MatrixXcd> ev4s = {ev4};
+    auto couplings = coupling4Ph.getCouplingsSquared(processType, q1s, ev1s,
+                                                     ev2, ev3, ev4s);
+    ASSERT_EQ(int(couplings.size()), 1);
+
+    Eigen::MatrixXcd ev2s = s2 > 0 ? ev2 : ev2.conjugate();
+    Eigen::MatrixXcd ev3s = s3 > 0 ? ev3 : ev3.conjugate();
+    for (int ib1 = 0; ib1 < numBands; ib1 += 2) {
+      for (int ib2 = 0; ib2 < numBands; ib2 += 3) {
+        for (int ib3 = 1; ib3 < numBands; ib3 += 2) {
+          for (int ib4 = 0; ib4 < numBands; ib4 += 5) {
+            std::complex<double> v = 0.;
+            for (int ib = 0; ib < numBlocks; ib++) {
+              double arg = s2 * q2.dot(cellPositions2.col(ib)) +
+                           s3 * q3.dot(cellPositions3.col(ib)) -
+                           q4.dot(cellPositions4.col(ib));
+              std::complex<double> phase = std::exp(complexI * arg);
+              for (int i1 = 0; i1 < numBands; i1++) {
+                for (int i2 = 0; i2 < numBands; i2++) {
+                  for (int i3 = 0; i3 < numBands; i3++) {
+                    for (int i4 = 0; i4 < numBands; i4++) {
+                      v += D4(i1, i2, i3, i4, ib) * phase * ev1(i1, ib1) *
+                           ev2s(i2, ib2) * ev3s(i3, ib3) *
+                           std::conj(ev4(i4, ib4));
+                    }
+                  }
+                }
+              }
+            }
+            double expected = std::norm(v);
+            EXPECT_NEAR(couplings[0](ib1, ib2, ib3, ib4), expected,
+                        1.0e-8 * (1. + expected));
+          }
+        }
+      }
+    }
+  }
+}
@@ -81,6 +81,29 @@ TEST(IrrPointsTest, Symmetries) {
   int uniqueCount =
       std::unique(allIndices.begin(), allIndices.end()) - allIndices.begin();
   ASSERT_EQ(mesh.prod(), uniqueCount);
+
+  // the integer tables must agree with the rotation of the coordinates
+  ASSERT_EQ(points.getNumRotations(), 48);
+  for (int ik = 0; ik < points.getNumPoints(); ik++) {
+    auto k = points.getPointCoordinates(ik, Points::crystalCoordinates);
+    for (int iRot = 0; iRot < points.getNumRotations(); iRot++) {
+      Eigen::Vector3d kRot =
+          points.getRotationMatrix(iRot, Points::crystalCoordinates) * k;
+      ASSERT_EQ(points.getRotatedPointIndex(iRot, ik),
+                points.isPointStored(kRot));
+    }
+    auto t = points.getRotationIndexToIrreducible(ik);
+    int ikIrr = std::get<0>(t);
+    ASSERT_EQ(points.getRotatedPointIndex(std::get<1>(t), ikIrr), ik);
+  }
+  for (int ikIrr : points.irrPointsIterator()) {
+    auto star = points.getReducibleStarFromIrreducible(ikIrr);
+    const std::vector<int> &rotations = points.getRotationIndicesStar(ikIrr);
+    ASSERT_EQ(star.size(), rotations.size());
+    for (size_t i = 0; i < star.size(); i++) {
+      ASSERT_EQ(points.getRotatedPointIndex(rotations[i], ikIrr), star[i]);
+    }
+  }
 }
 
 
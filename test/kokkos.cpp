@@ -8,18 +8,34 @@ TEST(Kokkos, KokkosDeviceManager) {
   double x = kokkosDeviceMemory->getTotalMemory();
   ASSERT_EQ(x, 16.0e9);
 
-  // at the start, available memory is approx all the total memory
   double y = kokkosDeviceMemory->getAvailableMemory();
-  ASSERT_NEAR(x, y, 1.0e-2); // at the start, they should be about the same
+  if (kokkosDeviceMemory->isMemoryMeasured()) {
+    // available memory is the total minus what Kokkos has allocated
+    double used = kokkosDeviceMemory->getMeasuredMemoryUsage();
+    ASSERT_NEAR(x - used, y, 1.0e-2);
 
-  // check we remember we added memory
-  double z = 2.0e9;
-  kokkosDeviceMemory->addDeviceMemoryUsage(z);
-  ASSERT_NEAR(kokkosDeviceMemory->getAvailableMemory(), y-z, 1.0e-2);
+    // check that the allocation of a View is measured
+    double z = 8.0e6;
+    {
+      DoubleView1D v("v", 1000000);
+      // the allocation also contains a small header
+      ASSERT_NEAR(kokkosDeviceMemory->getAvailableMemory(), y - z, 1.0e3);
+    }
+    // and that the memory is given back when the View is destroyed
+    ASSERT_NEAR(kokkosDeviceMemory->getAvailableMemory(), y, 1.0e-2);
+  } else {
+    // at the start, available memory is approx all the total memory
+    ASSERT_NEAR(x, y, 1.0e-2); // at the start, they should be about the same
+
+    // check we remember we added memory
+    double z = 2.0e9;
+    kokkosDeviceMemory->addDeviceMemoryUsage(z);
+    ASSERT_NEAR(kokkosDeviceMemory->getAvailableMemory(), y-z, 1.0e-2);
 
-  // check that if we remove memory, we go back to where we started
-  kokkosDeviceMemory->removeDeviceMemoryUsage(z);
-  ASSERT_NEAR(kokkosDeviceMemory->getAvailableMemory(), y, 1.0e-2);
+    // check that if we remove memory, we go back to where we started
+    kokkosDeviceMemory->removeDeviceMemoryUsage(z);
+    ASSERT_NEAR(kokkosDeviceMemory->getAvailableMemory(), y, 1.0e-2);
+  }
 
   std::vector<int> test = {0,1,2,3,4,5,6,7,8,9,10};
   int batchSize = 3;
@@ -36,3 +52,75 @@ TEST(Kokkos, KokkosDeviceManager) {
     ASSERT_EQ(verify[i], test[i]);
   }
 }
+
+TEST(Kokkos, BatchMemoryTuner) {
+  BatchMemoryTuner tuner(2);
+  double maxMemory = 100.;
+
+  // during the warmup, the upper bound is used
+  ASSERT_EQ(tuner.getMemoryPerPoint(maxMemory), maxMemory);
+  tuner.recordMemoryPerPoint(20., maxMemory);
+  ASSERT_EQ(tuner.getMemoryPerPoint(maxMemory), maxMemory);
+  tuner.recordMemoryPerPoint(40., maxMemory);
+
+  // afterwards, the largest observed memory with a safety margin
+  double tuned = tuner.getMemoryPerPoint(maxMemory);
+  ASSERT_GE(tuned, 40.);
+  ASSERT_LT(tuned, maxMemory);
+
+  // a call with more bands at the fixed wavevector has a larger upper bound,
+  // and the estimate scales with it
+  double largerMemory = 3. * maxMemory;
+  tuned = tuner.getMemoryPerPoint(largerMemory);
+  ASSERT_GE(tuned, 120.);
+  ASSERT_LT(tuned, largerMemory);
+
+  // a larger usage restarts the tuning
+  tuner.recordMemoryPerPoint(60., maxMemory);
+  ASSERT_EQ(tuner.getMemoryPerPoint(maxMemory), maxMemory);
+}
+
+TEST(Kokkos, BatchedFourierTransform) {
+  int numK = 4;
+  int numR = 5;
+  // 6 and 8 use the fixed-size kernels, 5 the generic one
+  for (int numBands : {5, 6, 8}) {
+    ComplexView2D phases("phases", numK, numR);
+    ComplexView3D matR("matR", numBands, numBands, numR);
+    ComplexView3D out("out", numK, numBands, numBands);
+
+    auto phases_h = Kokkos::create_mirror_view(phases);
+    auto matR_h = Kokkos::create_mirror_view(matR);
+    for (int iK = 0; iK < numK; iK++) {
+      for (int iR = 0; iR < numR; iR++) {
+        phases_h(iK, iR) = Kokkos::complex<double>(cos(iK * iR), sin(iK + iR));
+      }
+    }
+    for (int m = 0; m < numBands; m++) {
+      for (int n = 0; n < numBands; n++) {
+        for (int iR = 0; iR < numR; iR++) {
+          matR_h(m, n, iR) = Kokkos::complex<double>(m + 2. * n, iR - n);
+        }
+      }
+    }
+    Kokkos::deep_copy(phases, phases_h);
+    Kokkos::deep_copy(matR, matR_h);
+
+    kokkosBatchedFourierTransform(phases, matR, out);
+
+    auto out_h = Kokkos::create_mirror_view(out);
+    Kokkos::deep_copy(out_h, out);
+    for (int iK = 0; iK < numK; iK++) {
+      for (int m = 0; m < numBands; m++) {
+        for (int n = 0; n < numBands; n++) {
+          Kokkos::complex<double> x(0., 0.);
+          for (int iR = 0; iR < numR; iR++) {
+            x += phases_h(iK, iR) * matR_h(m, n, iR);
+          }
+          ASSERT_NEAR(out_h(iK, m, n).real(), x.real(), 1.0e-10);
+          ASSERT_NEAR(out_h(iK, m, n).imag(), x.imag(), 1.0e-10);
+        }
+      }
+    }
+  }
+}
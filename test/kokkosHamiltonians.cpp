@@ -449,3 +449,70 @@ TEST(Kokkos, PhononH0) {
   }
   EXPECT_NEAR(norm, 0.0, 1e-7);
 }
+
+/** The batched Berry connection must match getBerryConnection. The matrix
+ * elements depend on the gauge of the eigenvectors, so we compare the trace
+ * over the bands, which doesn't.
+ */
+TEST(Kokkos, WannierBerryConnection) {
+  Context context;
+  context.setElectronH0Name("../test/data/666_si_tb.dat");
+
+  Eigen::MatrixXd atomicPositions(2, 3);
+  atomicPositions.row(0) << 0., 0., 0.;
+  atomicPositions.row(1) << 1.34940, 1.34940, 1.34940;
+  Eigen::VectorXi atomicSpecies(2);
+  atomicSpecies(0) = 0;
+  atomicSpecies(1) = 0;
+  std::vector<std::string> speciesNames;
+  speciesNames.emplace_back("Si");
+  context.setInputAtomicPositions(atomicPositions);
+  context.setInputAtomicSpecies(atomicSpecies);
+  context.setInputSpeciesNames(speciesNames);
+
+  auto tup = QEParser::parseElHarmonicWannier(context);
+  auto crystal = std::get<0>(tup);
+  auto electronH0 = std::get<1>(tup);
+  int numBands = electronH0.getNumBands();
+
+  Eigen::Vector3i mesh;
+  mesh << 3, 3, 3;
+  Points points(crystal, mesh);
+  int numK = points.getNumPoints();
+
+  DoubleView2D kCs_d("k", numK, 3);
+  auto kCs_h = Kokkos::create_mirror_view(kCs_d);
+  for (int ik = 0; ik < numK; ik++) {
+    Eigen::Vector3d k =
+        points.getPointCoordinates(ik, Points::cartesianCoordinates);
+    for (int i = 0; i < 3; i++) {
+      kCs_h(ik, i) = k(i);
+    }
+  }
+  Kokkos::deep_copy(kCs_d, kCs_h);
+
+  auto t = electronH0.kokkosBatchedDiagonalizeWithBerryConnection(kCs_d);
+  DoubleView2D energies_d = std::get<0>(t);
+  ComplexView4D berryConnection_d = std::get<3>(t);
+  auto energies_h = Kokkos::create_mirror_view(energies_d);
+  Kokkos::deep_copy(energies_h, energies_d);
+  auto berryConnection_h = Kokkos::create_mirror_view(berryConnection_d);
+  Kokkos::deep_copy(berryConnection_h, berryConnection_d);
+
+  for (int ik = 0; ik < numK; ik++) {
+    Point point = points.getPoint(ik);
+    auto ens = std::get<0>(electronH0.diagonalize(point));
+    std::vector<Eigen::MatrixXcd> berryConnection =
+        electronH0.getBerryConnection(point);
+    for (int ib = 0; ib < numBands; ib++) {
+      EXPECT_NEAR(ens(ib), energies_h(ik, ib), 1e-8);
+    }
+    for (int i = 0; i < 3; i++) {
+      std::complex<double> trace = 0.;
+      for (int ib = 0; ib < numBands; ib++) {
+        trace += berryConnection_h(ik, ib, ib, i);
+      }
+      EXPECT_NEAR(std::abs(trace - berryConnection[i].trace()), 0., 1e-8);
+    }
+  }
+}
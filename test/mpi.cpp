@@ -2,6 +2,7 @@
 #include "eigen.h"
 #include "mpiHelper.h"
 #include "gtest/gtest.h"
+#include <numeric>
 
 TEST(MPITest, AllReduceSum) {
 
@@ -87,3 +88,62 @@ TEST(MPITest, AllReduceSum) {
     }
   }
 }
+
+TEST(MPITest, IAllReduceSum) {
+
+  int size = mpi->getSize();
+  int rank = mpi->getRank();
+
+  // large enough to go through the node-aware reduction on many nodes
+  Eigen::MatrixXd x(size, 10000);
+  x.setZero();
+  x.row(rank).setConstant(1.);
+  Eigen::MatrixXd y = x;
+
+  // the non-blocking and the blocking reductions must agree
+  MPIRequest request = mpi->iAllReduceSum(&x);
+  mpi->allReduceSum(&y);
+  request.wait();
+  // waiting again does nothing
+  request.wait();
+  EXPECT_EQ(x.sum(), size * 10000.);
+  EXPECT_EQ((x - y).norm(), 0.);
+}
+
+TEST(MPITest, DivideWorkWeighted) {
+
+  int size = mpi->getSize();
+
+  // tasks with very different costs
+  int numTasks = 50;
+  std::vector<double> costs(numTasks);
+  for (int i = 0; i < numTasks; i++) {
+    costs[i] = double((i * 7) % 11);
+  }
+
+  // the contiguous ranges of all processes cover all tasks once
+  std::vector<size_t> divs = mpi->divideWorkWeighted(costs);
+  ASSERT_EQ(divs.size(), 2);
+  EXPECT_LE(divs[0], divs[1]);
+  std::vector<int> counts(numTasks, 0);
+  for (size_t i = divs[0]; i < divs[1]; i++) {
+    counts[i] += 1;
+  }
+  // and so do the greedy divisions
+  for (size_t i : mpi->divideWorkIterWeighted(costs)) {
+    counts[i] += 1;
+  }
+  mpi->allReduceSum(&counts);
+  for (int i = 0; i < numTasks; i++) {
+    EXPECT_EQ(counts[i], 2);
+  }
+
+  // the cost of a range doesn't exceed the fair share by more than a task
+  double localCost = 0.;
+  for (size_t i = divs[0]; i < divs[1]; i++) {
+    localCost += costs[i];
+  }
+  double totalCost = std::accumulate(costs.begin(), costs.end(), 0.);
+  double maxCost = *std::max_element(costs.begin(), costs.end());
+  EXPECT_LE(localCost, totalCost / size + maxCost);
+}
@@ -0,0 +1,75 @@
+#include "active_bandstructure.h"
+#include "constants.h"
+#include "drift.h"
+#include "observables_pass.h"
+#include "points.h"
+#include "qe_input_parser.h"
+#include <gtest/gtest.h>
+
+/** The observables computed in a single fused pass over the band structure
+ * must agree with those computed by each observable separately.
+ */
+TEST(ObservablesPassTest, PhononObservables) {
+  Context context;
+  context.setPhFC2FileName("../test/data/444_silicon.fc");
+  context.setSumRuleFC2("simple");
+  context.setUseSymmetries(true);
+
+  Eigen::Vector3i qMesh;
+  qMesh << 6, 6, 6;
+  context.setQMesh(qMesh);
+  Eigen::VectorXd temperatures(2);
+  temperatures << 300. / temperatureAuToSi, 600. / temperatureAuToSi;
+  context.setTemperatures(temperatures);
+
+  auto tup = QEParser::parsePhHarmonic(context);
+  auto crystal = std::get<0>(tup);
+  auto h0 = std::get<1>(tup);
+
+  Points points(crystal, qMesh);
+  auto tup1 = ActiveBandStructure::builder(context, h0, points);
+  auto bandStructure = std::get<0>(tup1);
+  auto statisticsSweep = std::get<1>(tup1);
+
+  // a constant relaxation time is enough to compare the two evaluations
+  VectorBTE relTimes(statisticsSweep, bandStructure, 1);
+  relTimes.setConst(1.0e4);
+  BulkTDrift drift(statisticsSweep, bandStructure, 3);
+  VectorBTE population = drift * relTimes;
+
+  PhononThermalConductivity thCond1(context, statisticsSweep, crystal,
+                                    bandStructure);
+  PhononViscosity viscosity1(context, statisticsSweep, crystal, bandStructure);
+  SpecificHeat specificHeat1(context, statisticsSweep, crystal, bandStructure);
+  thCond1.calcFromPopulation(population);
+  viscosity1.calcRTA(relTimes);
+  specificHeat1.calc();
+
+  PhononThermalConductivity thCond2(context, statisticsSweep, crystal,
+                                    bandStructure);
+  PhononViscosity viscosity2(context, statisticsSweep, crystal, bandStructure);
+  SpecificHeat specificHeat2(context, statisticsSweep, crystal, bandStructure);
+  ObservablesPass observablesPass(statisticsSweep, bandStructure);
+  observablesPass.add(thCond2, population);
+  observablesPass.add(viscosity2, relTimes);
+  observablesPass.add(specificHeat2);
+  observablesPass.calc();
+
+  for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
+    double norm = thCond1.getNorm()(iCalc);
+    ASSERT_GT(norm, 0.);
+    ASSERT_NEAR(thCond2.getNorm()(iCalc) / norm, 1., 1.0e-10);
+    norm = viscosity1.getNorm()(iCalc);
+    ASSERT_GT(norm, 0.);
+    ASSERT_NEAR(viscosity2.getNorm()(iCalc) / norm, 1., 1.0e-10);
+    norm = specificHeat1.getNorm()(iCalc);
+    ASSERT_GT(norm, 0.);
+    ASSERT_NEAR(specificHeat2.getNorm()(iCalc) / norm, 1., 1.0e-10);
+  }
+
+  // the difference between the tensors must vanish, not just their norms
+  PhononThermalConductivity diff = thCond2 - thCond1;
+  for (int iCalc = 0; iCalc < statisticsSweep.getNumCalculations(); iCalc++) {
+    ASSERT_NEAR(diff.getNorm()(iCalc) / thCond1.getNorm()(iCalc), 0., 1.0e-10);
+  }
+}
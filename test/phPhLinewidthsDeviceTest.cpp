@@ -0,0 +1,125 @@
+#include "constants.h"
+#include "ph_scattering.h"
+#include <gtest/gtest.h>
+
+/** The linewidths computed on the device must agree with those obtained
+ * from the couplings symmetrized on the host, also when the states at q1, q2
+ * and q3 are degenerate and the smearing depends on the velocities.
+ */
+TEST(PhPhLinewidthsDevice, DegenerateStates) {
+  int nb = 4;
+  int numCalculations = 2;
+
+  // pairs of degenerate modes at each wavevector
+  Eigen::VectorXd energies1(nb), energies2(nb), energies3Plus(nb),
+      energies3Mins(nb);
+  energies1 << 0.0010, 0.0010, 0.0020, 0.0025;
+  energies2 << 0.0012, 0.0015, 0.0015, 0.0030;
+  energies3Plus << 0.0020, 0.0020, 0.0026, 0.0026;
+  energies3Mins << 0.0008, 0.0011, 0.0011, 0.0024;
+
+  // the velocities of degenerate modes differ, so do their smearings
+  Eigen::MatrixXd v2s(nb, 3), v3sPlus(nb, 3), v3sMins(nb, 3);
+  Eigen::MatrixXd bose1(numCalculations, nb), bose2(numCalculations, nb),
+      bose3Plus(numCalculations, nb), bose3Mins(numCalculations, nb);
+  for (int ib = 0; ib < nb; ib++) {
+    for (int i : {0, 1, 2}) {
+      v2s(ib, i) = 0.001 * (ib + 1) * (i + 1);
+      v3sPlus(ib, i) = -0.0007 * (ib + 2) * (i - 1);
+      v3sMins(ib, i) = 0.0005 * (ib - 1) * (i + 2);
+    }
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      bose1(iCalc, ib) = 0.1 * (iCalc + 1) + 0.01 * ib;
+      bose2(iCalc, ib) = 0.2 * (iCalc + 1) + 0.02 * ib;
+      bose3Plus(iCalc, ib) = 0.3 * (iCalc + 1) + 0.03 * ib;
+      bose3Mins(iCalc, ib) = 0.4 * (iCalc + 1) + 0.01 * ib;
+    }
+  }
+
+  DeviceDeltaFunction deltaFunction;
+  deltaFunction.type = DeltaFunction::adaptiveGaussian;
+  deltaFunction.broadeningCutoff = 1.0e-5;
+  for (int i : {0, 1, 2}) {
+    deltaFunction.qTensor[i][i] = 1.;
+  }
+
+  // couplings which are not symmetric within the degenerate subspaces
+  Eigen::Tensor<double, 3> couplingPlus(nb, nb, nb), couplingMins(nb, nb, nb);
+  DoubleView4D couplingPlus_k("couplingPlus", 1, nb, nb, nb);
+  DoubleView4D couplingMins_k("couplingMins", 1, nb, nb, nb);
+  auto couplingPlus_h = Kokkos::create_mirror_view(couplingPlus_k);
+  auto couplingMins_h = Kokkos::create_mirror_view(couplingMins_k);
+  for (int ib1 = 0; ib1 < nb; ib1++) {
+    for (int ib2 = 0; ib2 < nb; ib2++) {
+      for (int ib3 = 0; ib3 < nb; ib3++) {
+        couplingPlus(ib1, ib2, ib3) = 1. + (ib1 * 7 + ib2 * 3 + ib3 * 5) % 11;
+        couplingMins(ib1, ib2, ib3) = 1. + (ib1 * 5 + ib2 * 7 + ib3 * 3) % 13;
+        couplingPlus_h(0, ib1, ib2, ib3) = couplingPlus(ib1, ib2, ib3);
+        couplingMins_h(0, ib1, ib2, ib3) = couplingMins(ib1, ib2, ib3);
+      }
+    }
+  }
+  Kokkos::deep_copy(couplingPlus_k, couplingPlus_h);
+  Kokkos::deep_copy(couplingMins_k, couplingMins_h);
+
+  double norm = 1.;
+  double energyCutoff = 0.;
+  std::vector<bool> isActive2(nb, true);
+  auto linewidths = phPhLinewidthsOnDevice(
+      couplingPlus_k, couplingMins_k, deltaFunction, {energies1}, {bose1},
+      energies2, v2s, bose2, isActive2, {energies3Plus}, {v3sPlus},
+      {bose3Plus}, {energies3Mins}, {v3sMins}, {bose3Mins}, norm,
+      energyCutoff, true);
+
+  // reference: the host symmetrization, followed by the linewidth sums
+  ScatteringMatrix::symmetrizeCoupling(couplingPlus, energies1, energies2,
+                                       energies3Plus);
+  ScatteringMatrix::symmetrizeCoupling(couplingMins, energies1, energies2,
+                                       energies3Mins);
+  Eigen::MatrixXd expected = Eigen::MatrixXd::Zero(numCalculations, nb);
+  double prefactor = pi * 0.25 * 0.5 * norm;
+  for (int ib1 = 0; ib1 < nb; ib1++) {
+    double en1 = energies1(ib1);
+    for (int ib2 = 0; ib2 < nb; ib2++) {
+      double en2 = energies2(ib2);
+      for (int ib3 = 0; ib3 < nb; ib3++) {
+        double en3 = energies3Plus(ib3);
+        Eigen::Vector3d v = v2s.row(ib2) - v3sPlus.row(ib3);
+        double delta = deltaFunction(en1 + en2 - en3, v(0), v(1), v(2));
+        if (delta <= 0.) continue;
+        double weight = prefactor * couplingPlus(ib1, ib2, ib3) * delta /
+                        (en1 * en2 * en3);
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          expected(iCalc, ib1) += bose1(iCalc, ib1) * bose2(iCalc, ib2) *
+                                  (bose3Plus(iCalc, ib3) + 1.) * weight;
+        }
+      }
+      for (int ib3 = 0; ib3 < nb; ib3++) {
+        double en3 = energies3Mins(ib3);
+        Eigen::Vector3d v = v2s.row(ib2) - v3sMins.row(ib3);
+        double delta1 = deltaFunction(en1 + en3 - en2, v(0), v(1), v(2));
+        double delta2 = deltaFunction(en2 + en3 - en1, v(0), v(1), v(2));
+        delta1 = std::max(delta1, 0.);
+        delta2 = std::max(delta2, 0.);
+        double weight =
+            prefactor * couplingMins(ib1, ib2, ib3) / (en1 * en2 * en3);
+        for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+          double b1 = bose1(iCalc, ib1);
+          double b2 = bose2(iCalc, ib2);
+          double b3 = bose3Mins(iCalc, ib3);
+          expected(iCalc, ib1) += (b3 * b1 * (b2 + 1.) * delta1 +
+                                   b2 * b3 * (b1 + 1.) * delta2) * weight;
+        }
+      }
+    }
+  }
+
+  ASSERT_EQ(int(linewidths.size()), 1);
+  ASSERT_GT(expected.norm(), 0.);
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    for (int ib1 = 0; ib1 < nb; ib1++) {
+      ASSERT_NEAR(linewidths[0](iCalc, ib1), expected(iCalc, ib1),
+                  1.0e-10 * expected.norm());
+    }
+  }
+}
@@ -57,3 +57,111 @@ TEST(PointsTest, PointsHandling) {
 
   EXPECT_EQ(p3.getCoordinates().norm(), 0.);
 }
+
+TEST(PointsTest, RefinedMesh) {
+  Eigen::Matrix3d directUnitCell;
+  directUnitCell.row(0) << -5.1, 0., 5.1;
+  directUnitCell.row(1) << 0., 5.1, 5.1;
+  directUnitCell.row(2) << -5.1, 5.1, 0.;
+  Eigen::MatrixXd atomicPositions(2, 3);
+  atomicPositions.row(0) << 0., 0., 0.;
+  atomicPositions.row(1) << 2.55, 2.55, 2.55;
+  Eigen::VectorXi atomicSpecies(2);
+  atomicSpecies << 0, 0;
+  std::vector<std::string> speciesNames;
+  speciesNames.emplace_back("Si");
+  Eigen::VectorXd speciesMasses(1);
+  speciesMasses(0) = 28.086;
+
+  Context context;
+
+  Crystal crystal(context, directUnitCell, atomicPositions, atomicSpecies,
+                  speciesNames, speciesMasses);
+
+  // refine the Gamma point of a 4x4x4 mesh with a 3x3x3 patch
+  Eigen::Vector3i mesh;
+  mesh << 4, 4, 4;
+  std::vector<int> refinedPoints = {0};
+  Points points(crystal, mesh, refinedPoints, 3);
+
+  EXPECT_EQ(points.getNumPoints(), 63 + 27);
+  EXPECT_FALSE(points.hasUniformWeights());
+  EXPECT_EQ((std::get<0>(points.getMesh()) - 3 * mesh).norm(), 0.);
+
+  double sumWeights = 0.;
+  for (int ik = 0; ik < points.getNumPoints(); ik++) {
+    sumWeights += points.getWeight(ik);
+  }
+  EXPECT_NEAR(sumWeights, 1., 1e-12);
+
+  // points of the patch and of the coarse mesh are found
+  Eigen::Vector3d x = Eigen::Vector3d::Zero();
+  int ik = points.isPointStored(x);
+  EXPECT_NEAR(points.getWeight(ik), 1. / 64. / 27., 1e-12);
+  x << -1. / 12., 0., 1. / 12.;
+  EXPECT_GE(points.isPointStored(x), 0);
+  x << 0.25, 0., 0.;
+  ik = points.isPointStored(x);
+  EXPECT_NEAR(points.getWeight(ik), 1. / 64., 1e-12);
+  // fine points outside the patch are not
+  x << 2. / 12., 0., 0.;
+  EXPECT_EQ(points.isPointStored(x), -1);
+
+  // a further filter keeps the weights and the point lookup
+  Eigen::VectorXi filter(2);
+  filter << 0, ik;
+  points.setActiveLayer(filter);
+  EXPECT_EQ(points.getNumPoints(), 2);
+  EXPECT_NEAR(points.getWeight(1), 1. / 64., 1e-12);
+  x << 0.25, 0., 0.;
+  EXPECT_EQ(points.isPointStored(x), 1);
+}
+
+TEST(PointsTest, SpaceFillingCurves) {
+  Eigen::Matrix3d directUnitCell;
+  directUnitCell.row(0) << -5.1, 0., 5.1;
+  directUnitCell.row(1) << 0., 5.1, 5.1;
+  directUnitCell.row(2) << -5.1, 5.1, 0.;
+  Eigen::MatrixXd atomicPositions(2, 3);
+  atomicPositions.row(0) << 0., 0., 0.;
+  atomicPositions.row(1) << 2.55, 2.55, 2.55;
+  Eigen::VectorXi atomicSpecies(2);
+  atomicSpecies << 0, 0;
+  std::vector<std::string> speciesNames;
+  speciesNames.emplace_back("Si");
+  Eigen::VectorXd speciesMasses(1);
+  speciesMasses(0) = 28.086;
+
+  Context context;
+  Crystal crystal(context, directUnitCell, atomicPositions, atomicSpecies,
+                  speciesNames, speciesMasses);
+
+  Eigen::Vector3i mesh;
+  mesh << 4, 4, 4;
+  Points points(crystal, mesh);
+  int numPoints = points.getNumPoints();
+
+  for (const std::string curve : {"morton", "hilbert"}) {
+    // on a cubic mesh of size 2^n, the curve visits each point once
+    std::vector<int> order(numPoints, -1);
+    for (int ik = 0; ik < numPoints; ik++) {
+      uint64_t index = points.getCurveIndex(ik, curve);
+      ASSERT_LT(index, uint64_t(numPoints));
+      EXPECT_EQ(order[index], -1);
+      order[index] = ik;
+    }
+    if (curve != "hilbert") {
+      continue;
+    }
+    // consecutive points of the Hilbert curve are nearest neighbors
+    for (int i = 1; i < numPoints; i++) {
+      Eigen::Vector3d x0 = points.getPointCoordinates(order[i - 1]);
+      Eigen::Vector3d x1 = points.getPointCoordinates(order[i]);
+      Eigen::Vector3d d = (x1 - x0) * 4.;
+      for (int j : {0, 1, 2}) {
+        d(j) -= 4. * std::round(d(j) / 4.);
+      }
+      EXPECT_NEAR(d.cwiseAbs().sum(), 1., 1e-8);
+    }
+  }
+}
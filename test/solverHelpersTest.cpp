@@ -0,0 +1,92 @@
+#include "solver_helpers.h"
+#include <Eigen/Dense>
+#include <cmath>
+#include <gtest/gtest.h>
+
+/** Anderson mixing must converge to the fixed point of a linear map which
+ * couples the cartesian components of each calculation, as the rotations do
+ * when the BTE is solved in the irreducible wedge.
+ */
+TEST(SolverHelpers, AndersonMixingCoupledComponents) {
+  int numCalculations = 2;
+  int dimensionality = 3;
+  int numStates = 5;
+  int size = dimensionality * numStates;
+
+  // a contraction with real eigenvalues between 0.5 and 0.95, which mixes
+  // the rows of the three cartesian components
+  std::vector<Eigen::MatrixXd> maps;
+  std::vector<Eigen::VectorXd> offsets;
+  for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+    Eigen::MatrixXd v(size, size);
+    for (int i = 0; i < size; i++) {
+      for (int j = 0; j < size; j++) {
+        v(i, j) = (i == j ? 1. : 0.) + 0.1 * std::sin(1. + i * size + j + iCalc);
+      }
+    }
+    Eigen::VectorXd d(size), b(size);
+    for (int i = 0; i < size; i++) {
+      d(i) = 0.5 + 0.45 * i / (size - 1.);
+      b(i) = std::cos(0.3 * i + iCalc);
+    }
+    maps.emplace_back(v * d.asDiagonal() * v.inverse());
+    offsets.push_back(b);
+  }
+
+  auto apply = [&](const Eigen::MatrixXd &n) {
+    Eigen::MatrixXd g(n.rows(), n.cols());
+    for (int iCalc = 0; iCalc < numCalculations; iCalc++) {
+      Eigen::VectorXd x(size);
+      for (int i = 0; i < dimensionality; i++) {
+        x.segment(i * numStates, numStates) =
+            n.row(iCalc * dimensionality + i).transpose();
+      }
+      Eigen::VectorXd y = maps[iCalc] * x + offsets[iCalc];
+      for (int i = 0; i < dimensionality; i++) {
+        g.row(iCalc * dimensionality + i) =
+            y.segment(i * numStates, numStates).transpose();
+      }
+    }
+    return g;
+  };
+
+  auto residual = [&](const bool &useAnderson) {
+    Eigen::MatrixXd n =
+        Eigen::MatrixXd::Zero(numCalculations * dimensionality, numStates);
+    std::deque<Eigen::MatrixXd> nHistory, rHistory;
+    for (int iter = 0; iter < 40; iter++) {
+      Eigen::MatrixXd nNext = apply(n);
+      if (useAnderson) {
+        andersonMixing(nNext, n, dimensionality, nHistory, rHistory, 5);
+      }
+      n = nNext;
+    }
+    return (apply(n) - n).norm();
+  };
+
+  // the plain iteration is still far from converged after 40 steps
+  EXPECT_GT(residual(false), 1.0e-3);
+  EXPECT_LT(residual(true), 1.0e-7);
+}
+
+/** The CG coefficients are per component without symmetries, shared by the
+ * components of a calculation with symmetries, and zero for vanishing
+ * denominators.
+ */
+TEST(SolverHelpers, CgRatio) {
+  Eigen::MatrixXd num(2, 3), den(2, 3);
+  num << 1., 2., 3., 4., 5., 6.;
+  den << 2., 0., 4., 0., 0., 0.;
+
+  Eigen::MatrixXd ratio = cgRatio(num, den, false);
+  EXPECT_DOUBLE_EQ(ratio(0, 0), 0.5);
+  EXPECT_DOUBLE_EQ(ratio(0, 1), 0.);
+  EXPECT_DOUBLE_EQ(ratio(0, 2), 0.75);
+  EXPECT_EQ(ratio.row(1).norm(), 0.);
+
+  ratio = cgRatio(num, den, true);
+  for (int i : {0, 1, 2}) {
+    EXPECT_DOUBLE_EQ(ratio(0, i), 1.);
+    EXPECT_EQ(ratio(1, i), 0.);
+  }
+}